@@ -22,6 +22,7 @@ import com.pinterest.rocksdb_admin.thrift.AddS3SstFilesToDBRequest;
 import com.pinterest.rocksdb_admin.thrift.Admin;
 import com.pinterest.rocksdb_admin.thrift.StartMessageIngestionRequest;
 import com.pinterest.rocksdb_admin.thrift.StopMessageIngestionRequest;
+import com.pinterest.rocksplicator.utils.StateTransitionExecutor;
 
 import com.google.gson.JsonElement;
 import com.google.gson.JsonObject;
@@ -36,6 +37,8 @@ import org.apache.helix.participant.statemachine.StateModelFactory;
 import org.slf4j.Logger;
 import org.slf4j.LoggerFactory;
 
+import java.util.concurrent.ExecutorService;
+
 /**
  * The Bootstrap state machine has 5 possible states. There are 7 possible state transitions that
  * we need to handle.
@@ -74,6 +77,7 @@ public class BootstrapStateModelFactory extends StateModelFactory<StateModel> {
   private final int adminPort;
   private final String cluster;
   private CuratorFramework zkClient;
+  private StateTransitionExecutor transitionExecutor = null;
 
   private static final Logger LOG = LoggerFactory.getLogger(BootstrapStateModelFactory.class);
 
@@ -85,6 +89,23 @@ public class BootstrapStateModelFactory extends StateModelFactory<StateModel> {
     zkClient.start();
   }
 
+  /**
+   * Run the state transitions on transitionExecutor, rather than on the default pools of Helix.
+   * Must be called before the factory is registered.
+   */
+  public void setTransitionExecutor(StateTransitionExecutor transitionExecutor) {
+    this.transitionExecutor = transitionExecutor;
+  }
+
+  @Override
+  public ExecutorService getExecutorService(String resourceName, String fromState,
+                                            String toState) {
+    if (transitionExecutor == null) {
+      return null;
+    }
+    return transitionExecutor.forTransition(fromState, toState);
+  }
+
   @Override
   public StateModel createNewStateModel(String resourceName, String partitionName) {
     LOG.error("Create a new state for " + partitionName);
@@ -148,7 +169,12 @@ public class BootstrapStateModelFactory extends StateModelFactory<StateModel> {
                 s3Bucket, s3Path + Utils.getS3PartPrefix(partitionName));
         req.setS3_download_limit_mb(s3_download_limit_mb);
         Admin.Client client = Utils.getLocalAdminClient(adminPort);
-        client.addS3SstFilesToDB(req);
+        Utils.acquireS3RestorePermit();
+        try {
+          client.addS3SstFilesToDB(req);
+        } finally {
+          Utils.releaseS3RestorePermit();
+        }
       } catch (Exception e) {
         LOG.error("Failed to add S3 files for " + partitionName, e);
         throw new RuntimeException(e);
@@ -51,6 +51,8 @@ import java.util.Iterator;
 import java.util.List;
 import java.util.Map;
 import java.util.Set;
+import java.util.concurrent.Executors;
+import java.util.concurrent.ScheduledExecutorService;
 import java.util.concurrent.TimeUnit;
 import java.util.concurrent.locks.ReentrantLock;
 import java.util.stream.Collectors;
@@ -181,6 +183,34 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
   private Set<String> disabledHosts;
   private ExternalViewLeaderEventLogger externalViewLeaderEventLogger;
 
+  /**
+   * With a positive debounceMillis, the changes notified within debounceMillis of the first one
+   * are coalesced into a single generation, run by the scheduler.
+   */
+  private final long debounceMillis;
+  private final ScheduledExecutorService scheduler;
+  private boolean generationScheduled;
+
+  /**
+   * The config of each resource, and the version of the ExternalView it was generated from, so
+   * that only the resources whose ExternalView changed are generated again.
+   */
+  private final Map<String, CachedResourceConfig> resourceConfigCache;
+
+  private static class CachedResourceConfig {
+    final int version;
+    final long modifiedTime;
+    final JSONObject config;
+    final Set<String> hosts;
+
+    CachedResourceConfig(int version, long modifiedTime, JSONObject config, Set<String> hosts) {
+      this.version = version;
+      this.modifiedTime = modifiedTime;
+      this.config = config;
+      this.hosts = hosts;
+    }
+  }
+
   @VisibleForTesting
   ConfigGenerator(
       final String clusterName,
@@ -196,6 +226,16 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
       final ShardMapPublisher<JSONObject> shardMapPublisher,
       final RocksplicatorMonitor monitor,
       final ExternalViewLeaderEventLogger externalViewLeaderEventLogger) {
+    this(clusterName, helixManager, shardMapPublisher, monitor, externalViewLeaderEventLogger, 0);
+  }
+
+  public ConfigGenerator(
+      final String clusterName,
+      final HelixManager helixManager,
+      final ShardMapPublisher<JSONObject> shardMapPublisher,
+      final RocksplicatorMonitor monitor,
+      final ExternalViewLeaderEventLogger externalViewLeaderEventLogger,
+      final long debounceMillis) {
     this.clusterName = clusterName;
     this.helixManager = helixManager;
     this.helixAdmin = this.helixManager.getClusterManagmentTool();
@@ -205,6 +245,10 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
     this.monitor = monitor;
     this.synchronizedCallbackLock = new ReentrantLock();
     this.externalViewLeaderEventLogger = externalViewLeaderEventLogger;
+    this.debounceMillis = debounceMillis;
+    this.scheduler = debounceMillis > 0 ? Executors.newSingleThreadScheduledExecutor() : null;
+    this.generationScheduled = false;
+    this.resourceConfigCache = new HashMap<>();
   }
 
   private void logUncheckedException(Runnable r) {
@@ -235,10 +279,10 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
         public void run() {
           LOG.error("Received notification: " + notificationContext.getChangeType());
           if (notificationContext.getChangeType() == HelixConstants.ChangeType.EXTERNAL_VIEW) {
-            generateShardConfig();
+            requestShardConfig();
           } else if (notificationContext.getChangeType() == HelixConstants.ChangeType.INSTANCE_CONFIG) {
             if (updateDisabledHosts()) {
-              generateShardConfig();
+              requestShardConfig();
             }
           }
         }
@@ -254,7 +298,7 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
         @Override
         public void run() {
           if (updateDisabledHosts()) {
-            generateShardConfig();
+            requestShardConfig();
           }
         }
       });
@@ -269,12 +313,44 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
       logUncheckedException(new Runnable() {
         @Override
         public void run() {
-          generateShardConfig();
+          requestShardConfig();
         }
       });
     }
   }
 
+  /**
+   * Generate the shard config now, or once the debounce window of the first change not
+   * generated yet has passed. Must hold synchronizedCallbackLock.
+   */
+  private void requestShardConfig() {
+    if (scheduler == null) {
+      generateShardConfig();
+      return;
+    }
+
+    if (generationScheduled) {
+      return;
+    }
+    generationScheduled = true;
+    scheduler.schedule(new Runnable() {
+      @Override
+      public void run() {
+        try (AutoCloseableLock autoLock = AutoCloseableLock.lock(synchronizedCallbackLock)) {
+          generationScheduled = false;
+          logUncheckedException(new Runnable() {
+            @Override
+            public void run() {
+              generateShardConfig();
+            }
+          });
+        } catch (Throwable throwable) {
+          // Already logged and counted, keep the scheduler running
+        }
+      }
+    }, debounceMillis, TimeUnit.MILLISECONDS);
+  }
+
   private void generateShardConfig() {
     final long generationStartTimeMillis = System.currentTimeMillis();
 
@@ -288,6 +364,7 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
     resources = resources.stream().filter(r -> ! r.startsWith("PARTICIPANT_LEADER")).collect(Collectors.toList());
 
     Set<String> existingHosts = new HashSet<String>();
+    int numResourcesGenerated = 0;
 
     List<ExternalView> externalViewsToProcess = null;
     if (externalViewLeaderEventLogger != null) {
@@ -323,6 +400,19 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
         externalViewsToProcess.add(externalView);
       }
 
+      // The ExternalView is unchanged since its config was generated
+      final int version = externalView.getRecord().getVersion();
+      final long modifiedTime = externalView.getRecord().getModifiedTime();
+      CachedResourceConfig cached = resourceConfigCache.get(resource);
+      if (cached != null && modifiedTime > 0 && cached.version == version
+          && cached.modifiedTime == modifiedTime) {
+        existingHosts.addAll(cached.hosts);
+        jsonClusterShardMap.put(resource, cached.config);
+        continue;
+      }
+      ++numResourcesGenerated;
+      Set<String> resourceHosts = new HashSet<String>();
+
       Set<String> partitions = externalView.getPartitionSet();
 
       // compose resource config
@@ -338,7 +428,7 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
             String.format("%05d", Integer.parseInt(parts[parts.length - 1]));
         Map<String, String> hostToState = externalView.getStateMap(partition);
         for (Map.Entry<String, String> entry : hostToState.entrySet()) {
-          existingHosts.add(entry.getKey());
+          resourceHosts.add(entry.getKey());
 
           /**TODO: gopalrajpurohit
            * Add a LiveInstanceListener and remove any temporary / permanently dead hosts
@@ -377,10 +467,20 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
 
       // add the resource config to the cluster config
       jsonClusterShardMap.put(resource, resourceConfig);
+      existingHosts.addAll(resourceHosts);
+      if (modifiedTime > 0) {
+        resourceConfigCache.put(resource,
+            new CachedResourceConfig(version, modifiedTime, resourceConfig, resourceHosts));
+      } else {
+        resourceConfigCache.remove(resource);
+      }
     }
 
     // remove host that doesn't exist in the ExternalView from hostToHostWithDomain
     hostToHostWithDomain.keySet().retainAll(existingHosts);
+    resourceConfigCache.keySet().retainAll(jsonClusterShardMap.keySet());
+    LOG.error("Generated the config of " + numResourcesGenerated + " of " + resources.size()
+        + " resources");
 
     /**
      * Finally publish the shard_map in json_format to multiple configured publishers.
@@ -430,6 +530,8 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
       return false;
     }
     disabledHosts = latestDisabledInstances;
+    // the configs of all resources may exclude different hosts now
+    resourceConfigCache.clear();
     return true;
   }
 
@@ -461,6 +563,9 @@ public class ConfigGenerator extends RoutingTableProvider implements CustomCodeC
     // at the moment.
     try (AutoCloseableLock lock = new AutoCloseableLock(this.synchronizedCallbackLock)) {
       // Cleanup any remaining items.
+      if (scheduler != null) {
+        scheduler.shutdownNow();
+      }
       if (externalViewLeaderEventLogger != null) {
         externalViewLeaderEventLogger.close();
       }
@@ -22,6 +22,7 @@ import com.pinterest.rocksdb_admin.thrift.CheckDBResponse;
 import com.pinterest.rocksplicator.eventstore.LeaderEventsCollector;
 import com.pinterest.rocksplicator.eventstore.LeaderEventsLogger;
 import com.pinterest.rocksplicator.thrift.eventhistory.LeaderEventType;
+import com.pinterest.rocksplicator.utils.StateTransitionExecutor;
 
 import com.google.common.base.Preconditions;
 import org.apache.curator.framework.CuratorFramework;
@@ -40,6 +41,7 @@ import org.slf4j.LoggerFactory;
 
 import java.util.HashMap;
 import java.util.Map;
+import java.util.concurrent.ExecutorService;
 import java.util.concurrent.TimeUnit;
 
 /**
@@ -96,6 +98,7 @@ public class LeaderFollowerStateModelFactory extends StateModelFactory<StateMode
   private final boolean useS3Backup;
   private final String s3Bucket;
   private final LeaderEventsLogger leaderEventsLogger;
+  private StateTransitionExecutor transitionExecutor = null;
 
   public LeaderFollowerStateModelFactory(
       final String host,
@@ -116,6 +119,23 @@ public class LeaderFollowerStateModelFactory extends StateModelFactory<StateMode
     this.leaderEventsLogger = leaderEventsLogger;
   }
 
+  /**
+   * Run the state transitions on transitionExecutor, rather than on the default pools of Helix.
+   * Must be called before the factory is registered.
+   */
+  public void setTransitionExecutor(StateTransitionExecutor transitionExecutor) {
+    this.transitionExecutor = transitionExecutor;
+  }
+
+  @Override
+  public ExecutorService getExecutorService(String resourceName, String fromState,
+                                            String toState) {
+    if (transitionExecutor == null) {
+      return null;
+    }
+    return transitionExecutor.forTransition(fromState, toState);
+  }
+
   @Override
   public StateModel createNewStateModel(String resourceName, String partitionName) {
     LOG.error("Create a new state for " + partitionName);
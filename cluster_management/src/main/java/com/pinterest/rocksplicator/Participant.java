@@ -27,6 +27,7 @@ import com.pinterest.rocksplicator.publisher.ShardMapPublisherBuilder;
 import com.pinterest.rocksplicator.task.BackupTaskFactory;
 import com.pinterest.rocksplicator.task.DedupTaskFactory;
 import com.pinterest.rocksplicator.task.RestoreTaskFactory;
+import com.pinterest.rocksplicator.utils.StateTransitionExecutor;
 
 import java.util.HashMap;
 import java.util.Map;
@@ -79,6 +80,8 @@ public class Participant {
   private static final String handoffEventHistoryConfigPath = "handoffEventHistoryConfigPath";
   private static final String handoffEventHistoryConfigType = "handoffEventHistoryConfigType";
   private static final String  handoffClientEventHistoryJsonShardMapPath = "handoffClientEventHistoryJsonShardMapPath";
+  private static final String stateTransitionThreads = "stateTransitionThreads";
+  private static final String maxConcurrentS3Restores = "maxConcurrentS3Restores";
 
   private static HelixManager helixManager = null;
   private static LeaderEventsLogger staticParticipantLeaderEventsLogger = null;
@@ -86,6 +89,7 @@ public class Participant {
   private static LeaderEventsLogger staticClientLeaderEventsLogger = null;
   private static ClientShardMapLeaderEventLoggerDriver staticClientShardMapLeaderEventLoggerDriver = null;
   private static StateModelFactory<StateModel> stateModelFactory;
+  private static StateTransitionExecutor staticTransitionExecutor = null;
   private final RocksplicatorMonitor monitor;
 
   private static Options constructCommandLineOptions() {
@@ -182,6 +186,28 @@ public class Participant {
     handoffClientEventHistoryJsonShardMapPathOption.setArgName(
         "path to shard_map in json format, generated by Spectator");
 
+    Option stateTransitionThreadsOption =
+        OptionBuilder.withLongOpt(stateTransitionThreads)
+            .withDescription(
+                "Run the state transitions of all the resources on a pool of this many threads, "
+                    + "bringing replicas online first, plus a quarter as many threads (at least "
+                    + "one) reserved for the promotions and demotions. By default, Helix runs "
+                    + "those of each resource on a pool of its own")
+            .create();
+    stateTransitionThreadsOption.setArgs(1);
+    stateTransitionThreadsOption.setRequired(false);
+    stateTransitionThreadsOption.setArgName("Number of state transition threads (Optional)");
+
+    Option maxConcurrentS3RestoresOption =
+        OptionBuilder.withLongOpt(maxConcurrentS3Restores)
+            .withDescription(
+                "Max number of dbs restored from S3 at a time by the state transitions, which "
+                    + "should not be over --max_s3_sst_loading_concurrency of the admin server")
+            .create();
+    maxConcurrentS3RestoresOption.setArgs(1);
+    maxConcurrentS3RestoresOption.setRequired(false);
+    maxConcurrentS3RestoresOption.setArgName("Max concurrent S3 restores (Optional)");
+
     Options options = new Options();
     options.addOption(zkServerOption)
         .addOption(clusterOption)
@@ -195,7 +221,9 @@ public class Participant {
         .addOption(handoffEventHistoryzkSvrOption)
         .addOption(handoffEventHistoryConfigPathOption)
         .addOption(handoffEventHistoryConfigTypeOption)
-        .addOption(handoffClientEventHistoryJsonShardMapPathOption);
+        .addOption(handoffClientEventHistoryJsonShardMapPathOption)
+        .addOption(stateTransitionThreadsOption)
+        .addOption(maxConcurrentS3RestoresOption);
     return options;
   }
 
@@ -234,6 +262,14 @@ public class Participant {
     final String resourceConfigPath = cmd.getOptionValue(handoffEventHistoryConfigPath, "");
     final String resourceConfigType = cmd.getOptionValue(handoffEventHistoryConfigType, "");
     final String shardMapPath = cmd.getOptionValue(handoffClientEventHistoryJsonShardMapPath, "");
+    final int numTransitionThreads =
+        Integer.parseInt(cmd.getOptionValue(stateTransitionThreads, "0"));
+    final int maxS3Restores = Integer.parseInt(cmd.getOptionValue(maxConcurrentS3Restores, "0"));
+
+    if (numTransitionThreads > 0) {
+      staticTransitionExecutor = new StateTransitionExecutor(numTransitionThreads);
+    }
+    Utils.setMaxConcurrentS3Restores(maxS3Restores);
 
     /**
      * Note that the last parameter is empty, since we don't dictate
@@ -378,6 +414,19 @@ public class Participant {
       LOG.error("Unknown state model: " + stateModelType);
     }
 
+    if (staticTransitionExecutor != null) {
+      if (stateModelFactory instanceof MasterSlaveStateModelFactory) {
+        ((MasterSlaveStateModelFactory) stateModelFactory)
+            .setTransitionExecutor(staticTransitionExecutor);
+      } else if (stateModelFactory instanceof LeaderFollowerStateModelFactory) {
+        ((LeaderFollowerStateModelFactory) stateModelFactory)
+            .setTransitionExecutor(staticTransitionExecutor);
+      } else if (stateModelFactory instanceof BootstrapStateModelFactory) {
+        ((BootstrapStateModelFactory) stateModelFactory)
+            .setTransitionExecutor(staticTransitionExecutor);
+      }
+    }
+
     StateMachineEngine stateMach = helixManager.getStateMachineEngine();
 
     if (stateModelFactory != null) {
@@ -66,6 +66,10 @@ public class Spectator {
   private static final String hostAddress = "host";
   private static final String hostPort = "port";
   private static final String configPostUrl = "configPostUrl";
+  private static final String configDebounceMs = "configDebounceMs";
+  private static final String shardMapDeltaMaxPercent = "shardMapDeltaMaxPercent";
+  // a full shard_map is dumped at least this often with shard_map deltas
+  private static final long SHARD_MAP_DELTA_MAX_AGE_MS = TimeUnit.MINUTES.toMillis(10);
 
   private static final String handoffEventHistoryzkSvr = "handoffEventHistoryzkSvr";
   private static final String handoffEventHistoryConfigPath = "handoffEventHistoryConfigPath";
@@ -114,6 +118,25 @@ public class Spectator {
     configPostUrlOption.setRequired(true);
     configPostUrlOption.setArgName("URL to post config (Required)");
 
+    Option configDebounceMsOption =
+        OptionBuilder.withLongOpt(configDebounceMs)
+            .withDescription("Coalesce the changes within this many ms into one shard_map")
+            .create();
+    configDebounceMsOption.setArgs(1);
+    configDebounceMsOption.setRequired(false);
+    configDebounceMsOption.setArgName("Shard map generation debounce ms, 0 by default (Optional)");
+
+    Option shardMapDeltaMaxPercentOption =
+        OptionBuilder.withLongOpt(shardMapDeltaMaxPercent)
+            .withDescription(
+                "If positive, dump shard_map deltas next to the local shard_map, until more than "
+                    + "this percent of the resources changed")
+            .create();
+    shardMapDeltaMaxPercentOption.setArgs(1);
+    shardMapDeltaMaxPercentOption.setRequired(false);
+    shardMapDeltaMaxPercentOption.setArgName(
+        "Max percent of resources in a shard_map delta, 0 by default (Optional)");
+
     Option handoffEventHistoryzkSvrOption =
         OptionBuilder.withLongOpt(handoffEventHistoryzkSvr)
             .withDescription(
@@ -159,6 +182,8 @@ public class Spectator {
         .addOption(hostOption)
         .addOption(portOption)
         .addOption(configPostUrlOption)
+        .addOption(configDebounceMsOption)
+        .addOption(shardMapDeltaMaxPercentOption)
         .addOption(handoffEventHistoryzkSvrOption)
         .addOption(handoffEventHistoryConfigPathOption)
         .addOption(handoffEventHistoryConfigTypeOption)
@@ -187,6 +212,8 @@ public class Spectator {
     final String host = cmd.getOptionValue(hostAddress);
     final String port = cmd.getOptionValue(hostPort);
     final String postUrl = cmd.getOptionValue(configPostUrl);
+    final long debounceMs = Long.parseLong(cmd.getOptionValue(configDebounceMs, "0"));
+    final int deltaMaxPercent = Integer.parseInt(cmd.getOptionValue(shardMapDeltaMaxPercent, "0"));
     final String instanceName = host + "_" + port;
 
     final String zkEventHistoryStr = cmd.getOptionValue(handoffEventHistoryzkSvr, "");
@@ -249,7 +276,7 @@ public class Spectator {
 
     try (Locker locker = new Locker(mutex)) {
       LOG.error("Obtained lock");
-      spectator.startListener(postUrl);
+      spectator.startListener(postUrl, debounceMs, deltaMaxPercent);
       Thread.currentThread().join();
     } catch (RuntimeException e) {
       LOG.error("RuntimeException thrown by cluster " + clusterName, e);
@@ -279,16 +306,22 @@ public class Spectator {
     });
   }
 
-  private void startListener(String postUrl) throws Exception {
+  private void startListener(String postUrl, long debounceMs, int deltaMaxPercent)
+      throws Exception {
     if (this.configGenerator == null) {
+      ShardMapPublisherBuilder publisherBuilder =
+          ShardMapPublisherBuilder.create(helixManager.getClusterName())
+              .withPostUrl(postUrl)
+              .withLocalDump();
+      if (deltaMaxPercent > 0) {
+        publisherBuilder.withLocalDumpDeltas(deltaMaxPercent, SHARD_MAP_DELTA_MAX_AGE_MS);
+      }
       this.configGenerator = new ConfigGenerator(
           helixManager.getClusterName(),
           helixManager,
-          ShardMapPublisherBuilder.create(helixManager.getClusterName())
-              .withPostUrl(postUrl)
-              .withLocalDump()
-              .build(),
-          monitor, new ExternalViewLeaderEventsLoggerImpl(spectatorLeaderEventsLogger));
+          publisherBuilder.build(),
+          monitor, new ExternalViewLeaderEventsLoggerImpl(spectatorLeaderEventsLogger),
+          debounceMs);
 
       /**
        * Add to the helixManager, message handlers.
@@ -32,6 +32,7 @@ import com.pinterest.rocksdb_admin.thrift.CloseDBRequest;
 import com.pinterest.rocksdb_admin.thrift.CompactDBRequest;
 import com.pinterest.rocksdb_admin.thrift.GetSequenceNumberRequest;
 import com.pinterest.rocksdb_admin.thrift.GetSequenceNumberResponse;
+import com.pinterest.rocksdb_admin.thrift.GetSequenceNumbersRequest;
 import com.pinterest.rocksdb_admin.thrift.RestoreDBFromS3Request;
 import com.pinterest.rocksdb_admin.thrift.RestoreDBRequest;
 
@@ -46,13 +47,42 @@ import org.apache.zookeeper.KeeperException;
 import org.slf4j.Logger;
 import org.slf4j.LoggerFactory;
 
+import java.util.List;
+import java.util.Map;
 import java.util.concurrent.Callable;
+import java.util.concurrent.Semaphore;
 import java.util.concurrent.atomic.AtomicInteger;
 
 public class Utils {
 
   private static final Logger LOG = LoggerFactory.getLogger(Utils.class);
 
+  // Bounds the S3 transfers into the local dbs, null for no limit
+  private static Semaphore s3RestorePermits = null;
+
+  /**
+   * Let at most maxRestores restores of the local dbs from S3 run at a time, 0 for no limit.
+   * The admin server queues the S3 transfers over its --max_s3_sst_loading_concurrency, and fails
+   * those which wait for longer than --s3_transfer_admission_timeout_ms. Keeping the restores
+   * waiting here instead leaves room to the other transitions, and never fails them.
+   * Must be called before the participant connects.
+   */
+  public static void setMaxConcurrentS3Restores(int maxRestores) {
+    s3RestorePermits = maxRestores > 0 ? new Semaphore(maxRestores, true) : null;
+  }
+
+  public static void acquireS3RestorePermit() throws InterruptedException {
+    if (s3RestorePermits != null) {
+      s3RestorePermits.acquire();
+    }
+  }
+
+  public static void releaseS3RestorePermit() {
+    if (s3RestorePermits != null) {
+      s3RestorePermits.release();
+    }
+  }
+
   /**
    * Build a thrift client to local adminPort
    * @param adminPort
@@ -246,6 +276,27 @@ public class Utils {
     }
   }
 
+  /**
+   * Get the latest sequence numbers of the DBs on the host in one call
+   * @param dbNames the DBs to get sequence numbers for, all DBs on the host if empty
+   * @return DB name -> the latest sequence number, DBs not on the host are left out. null if
+   *         fails to get them
+   */
+  public static Map<String, Long> getLatestSequenceNumbers(
+      List<String> dbNames, String host, int adminPort) {
+    LOG.error("Get seq numbers from " + host + " for " + dbNames.size() + " DBs");
+    try {
+      Admin.Client client = getAdminClient(host, adminPort);
+
+      GetSequenceNumbersRequest request = new GetSequenceNumbersRequest();
+      request.setDb_names(dbNames);
+      return client.getSequenceNumbers(request).getSeq_nums();
+    } catch (TException e) {
+      LOG.error("Failed to get sequence numbers", e);
+      return null;
+    }
+  }
+
   /**
    * Change DB role and upstream on host:adminPort
    * @param host
@@ -413,8 +464,18 @@ public class Utils {
   public static void restoreLocalDBFromS3(int adminPort, String dbName, String s3Bucket,
                                           String s3Path, String upsreamHost, int upstreamPort)
       throws RuntimeException {
-    restoreRemoteOrLocalDBFromS3("localhost", adminPort, dbName, s3Bucket, s3Path, upsreamHost,
-        upstreamPort);
+    try {
+      acquireS3RestorePermit();
+    } catch (InterruptedException e) {
+      Thread.currentThread().interrupt();
+      throw new RuntimeException(e);
+    }
+    try {
+      restoreRemoteOrLocalDBFromS3("localhost", adminPort, dbName, s3Bucket, s3Path, upsreamHost,
+          upstreamPort);
+    } finally {
+      releaseS3RestorePermit();
+    }
   }
 
   public static void restoreRemoteOrLocalDBFromS3(String host, int adminPort, String dbName,
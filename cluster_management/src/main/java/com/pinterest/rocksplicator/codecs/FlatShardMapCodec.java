@@ -0,0 +1,262 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+package com.pinterest.rocksplicator.codecs;
+
+import org.json.simple.JSONArray;
+import org.json.simple.JSONObject;
+
+import java.nio.BufferUnderflowException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+/**
+ * Codec between the JSON shard map and a compact binary layout, which
+ * common::parseConfig() in the C++ router also reads. Each host string is
+ * written once, and the shards refer to hosts by index.
+ *
+ * The layout, all integers little endian:
+ *
+ * "RSM1"
+ * u32 number of hosts, then for each host its "ip:port[:group]" string
+ * u32 number of segments, then for each segment
+ *   string name
+ *   u32 number of shards
+ *   u32 replication fanout
+ *   string key mapping, empty for the default
+ *   u32 number of shards before split, 0 if not split
+ *   u32 number of entries, then for each entry
+ *     u32 host index
+ *     u32 shard id in the low 30 bits, and role in the high 2 bits (0 for
+ *     none, 1 for master, 2 for slave)
+ *
+ * Strings are a u16 length followed by the UTF-8 bytes.
+ */
+public class FlatShardMapCodec implements Codec<JSONObject, byte[]> {
+
+  public static final byte[] MAGIC = {'R', 'S', 'M', '1'};
+
+  private static final String NUM_SHARDS = "num_shards";
+  private static final String NUM_LEAF_SEGMENTS = "num_leaf_segments";
+  private static final String REPLICATION_FANOUT = "replication_fanout";
+  private static final String KEY_MAPPING = "key_mapping";
+  private static final String NUM_SHARDS_BEFORE_SPLIT = "num_shards_before_split";
+
+  private static final int ROLE_NONE = 0;
+  private static final int ROLE_MASTER = 1;
+  private static final int ROLE_SLAVE = 2;
+  private static final int ROLE_SHIFT = 30;
+  private static final int SHARD_MASK = (1 << ROLE_SHIFT) - 1;
+
+  @Override
+  public byte[] encode(JSONObject shardMap) throws CodecException {
+    try {
+      List<String> hosts = new ArrayList<>();
+      Map<String, Integer> hostIndexes = new HashMap<>();
+      ByteStream segments = new ByteStream();
+      segments.putInt(shardMap.size());
+      for (Object segmentObj : shardMap.entrySet()) {
+        Map.Entry<?, ?> segment = (Map.Entry<?, ?>) segmentObj;
+        JSONObject config = (JSONObject) segment.getValue();
+        segments.putString((String) segment.getKey());
+        Object numShards = config.containsKey(NUM_SHARDS)
+                           ? config.get(NUM_SHARDS) : config.get(NUM_LEAF_SEGMENTS);
+        segments.putInt(toInt(numShards));
+        segments.putInt(config.containsKey(REPLICATION_FANOUT)
+                        ? toInt(config.get(REPLICATION_FANOUT)) : 0);
+        segments.putString(config.containsKey(KEY_MAPPING)
+                           ? (String) config.get(KEY_MAPPING) : "");
+        segments.putInt(config.containsKey(NUM_SHARDS_BEFORE_SPLIT)
+                        ? toInt(config.get(NUM_SHARDS_BEFORE_SPLIT)) : 0);
+
+        ByteStream entries = new ByteStream();
+        int numEntries = 0;
+        for (Object hostObj : config.entrySet()) {
+          Map.Entry<?, ?> host = (Map.Entry<?, ?>) hostObj;
+          String hostStr = (String) host.getKey();
+          if (isSegmentProperty(hostStr)) {
+            continue;
+          }
+          Integer hostIndex = hostIndexes.get(hostStr);
+          if (hostIndex == null) {
+            hostIndex = hosts.size();
+            hosts.add(hostStr);
+            hostIndexes.put(hostStr, hostIndex);
+          }
+          for (Object shardObj : (JSONArray) host.getValue()) {
+            entries.putInt(hostIndex);
+            entries.putInt(encodeShard((String) shardObj));
+            ++numEntries;
+          }
+        }
+        segments.putInt(numEntries);
+        segments.putBytes(entries.toByteArray());
+      }
+
+      ByteStream out = new ByteStream();
+      out.putBytes(MAGIC);
+      out.putInt(hosts.size());
+      for (String host : hosts) {
+        out.putString(host);
+      }
+      out.putBytes(segments.toByteArray());
+      return out.toByteArray();
+    } catch (ClassCastException | IllegalArgumentException e) {
+      throw new CodecException("Invalid shard map", e);
+    }
+  }
+
+  @Override
+  public JSONObject decode(byte[] data) throws CodecException {
+    try {
+      ByteBuffer buffer = ByteBuffer.wrap(data).order(ByteOrder.LITTLE_ENDIAN);
+      for (byte b : MAGIC) {
+        if (buffer.get() != b) {
+          throw new CodecException("Not a flat shard map");
+        }
+      }
+
+      int numHosts = buffer.getInt();
+      List<String> hosts = new ArrayList<>(numHosts);
+      for (int i = 0; i < numHosts; ++i) {
+        hosts.add(getString(buffer));
+      }
+
+      JSONObject shardMap = new JSONObject();
+      int numSegments = buffer.getInt();
+      for (int i = 0; i < numSegments; ++i) {
+        String name = getString(buffer);
+        JSONObject config = new JSONObject();
+        config.put(NUM_SHARDS, buffer.getInt());
+        int replicationFanout = buffer.getInt();
+        if (replicationFanout != 0) {
+          config.put(REPLICATION_FANOUT, replicationFanout);
+        }
+        String keyMapping = getString(buffer);
+        if (!keyMapping.isEmpty()) {
+          config.put(KEY_MAPPING, keyMapping);
+        }
+        int numShardsBeforeSplit = buffer.getInt();
+        if (numShardsBeforeSplit != 0) {
+          config.put(NUM_SHARDS_BEFORE_SPLIT, numShardsBeforeSplit);
+        }
+
+        int numEntries = buffer.getInt();
+        for (int j = 0; j < numEntries; ++j) {
+          String host = hosts.get(buffer.getInt());
+          JSONArray shards = (JSONArray) config.get(host);
+          if (shards == null) {
+            shards = new JSONArray();
+            config.put(host, shards);
+          }
+          shards.add(decodeShard(buffer.getInt()));
+        }
+        shardMap.put(name, config);
+      }
+      return shardMap;
+    } catch (BufferUnderflowException | IndexOutOfBoundsException e) {
+      throw new CodecException("Truncated or invalid flat shard map", e);
+    }
+  }
+
+  private static boolean isSegmentProperty(String key) {
+    return NUM_SHARDS.equals(key) || NUM_LEAF_SEGMENTS.equals(key)
+        || REPLICATION_FANOUT.equals(key) || KEY_MAPPING.equals(key)
+        || NUM_SHARDS_BEFORE_SPLIT.equals(key);
+  }
+
+  private static int toInt(Object value) {
+    if (value instanceof Number) {
+      return ((Number) value).intValue();
+    }
+    return Integer.parseInt((String) value);
+  }
+
+  private static int encodeShard(String shard) {
+    String[] parts = shard.split(":");
+    int role = ROLE_NONE;
+    if (parts.length == 2) {
+      role = "S".equals(parts[1]) ? ROLE_SLAVE : ROLE_MASTER;
+    }
+    return (role << ROLE_SHIFT) | Integer.parseInt(parts[0]);
+  }
+
+  private static String decodeShard(int shardAndRole) {
+    String shard = String.format("%05d", shardAndRole & SHARD_MASK);
+    switch (shardAndRole >>> ROLE_SHIFT) {
+      case ROLE_MASTER:
+        return shard + ":M";
+      case ROLE_SLAVE:
+        return shard + ":S";
+      default:
+        return shard;
+    }
+  }
+
+  private static String getString(ByteBuffer buffer) {
+    int length = buffer.getShort() & 0xFFFF;
+    byte[] bytes = new byte[length];
+    buffer.get(bytes);
+    return new String(bytes, StandardCharsets.UTF_8);
+  }
+
+  /**
+   * A growable little endian byte buffer.
+   */
+  private static class ByteStream {
+
+    private ByteBuffer buffer = ByteBuffer.allocate(1024).order(ByteOrder.LITTLE_ENDIAN);
+
+    void putInt(int value) {
+      ensure(4);
+      buffer.putInt(value);
+    }
+
+    void putBytes(byte[] bytes) {
+      ensure(bytes.length);
+      buffer.put(bytes);
+    }
+
+    void putString(String str) {
+      byte[] bytes = str.getBytes(StandardCharsets.UTF_8);
+      if (bytes.length > 0xFFFF) {
+        throw new IllegalArgumentException("String too long: " + str);
+      }
+      ensure(2 + bytes.length);
+      buffer.putShort((short) bytes.length);
+      buffer.put(bytes);
+    }
+
+    byte[] toByteArray() {
+      byte[] bytes = new byte[buffer.position()];
+      System.arraycopy(buffer.array(), 0, bytes, 0, bytes.length);
+      return bytes;
+    }
+
+    private void ensure(int n) {
+      if (buffer.remaining() < n) {
+        ByteBuffer bigger = ByteBuffer.allocate(Math.max(buffer.capacity() * 2,
+            buffer.position() + n)).order(ByteOrder.LITTLE_ENDIAN);
+        buffer.flip();
+        bigger.put(buffer);
+        buffer = bigger;
+      }
+    }
+  }
+}
@@ -0,0 +1,40 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+package com.pinterest.rocksplicator.codecs;
+
+import com.pinterest.rocksplicator.thrift.commons.io.CompressionAlgorithm;
+
+import org.json.simple.JSONObject;
+
+/**
+ * Same as ZkGZIPCompressedShardMapCodec, with the FlatShardMapCodec layout
+ * instead of JSON text.
+ */
+public class ZkGZIPCompressedFlatShardMapCodec implements Codec<JSONObject, byte[]> {
+
+  private static final Codec<JSONObject, byte[]> baseCodec = new FlatShardMapCodec();
+  private static final Codec<JSONObject, byte[]> gzipCompressedCoded =
+      Codecs.getCompressedCodec(baseCodec, CompressionAlgorithm.GZIP);
+
+  @Override
+  public JSONObject decode(byte[] data) throws CodecException {
+    return gzipCompressedCoded.decode(data);
+  }
+
+  @Override
+  public byte[] encode(JSONObject obj) throws CodecException {
+    return gzipCompressedCoded.encode(obj);
+  }
+}
@@ -19,6 +19,7 @@
 package com.pinterest.rocksplicator.helix_client;
 
 import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
 
 import org.apache.commons.cli.CommandLine;
 import org.apache.commons.cli.CommandLineParser;
@@ -27,8 +28,15 @@ import org.apache.commons.cli.Option;
 import org.apache.commons.cli.OptionBuilder;
 import org.apache.commons.cli.Options;
 import org.apache.commons.cli.ParseException;
+import org.apache.curator.framework.CuratorFramework;
+import org.apache.curator.framework.CuratorFrameworkFactory;
+import org.apache.curator.framework.recipes.cache.ChildData;
+import org.apache.curator.framework.recipes.cache.NodeCache;
+import org.apache.curator.retry.ExponentialBackoffRetry;
 import org.apache.helix.HelixAdmin;
+import org.apache.helix.ZNRecord;
 import org.apache.helix.manager.zk.ZKHelixAdmin;
+import org.apache.helix.manager.zk.ZNRecordSerializer;
 import org.apache.helix.model.ExternalView;
 import org.apache.log4j.BasicConfigurator;
 import org.apache.log4j.ConsoleAppender;
@@ -46,6 +54,15 @@ public class HelixClient {
   private static final String resource = "resource";
   private static final String partition = "partition";
 
+  private static final ZNRecordSerializer serializer = new ZNRecordSerializer();
+  // The zk clients of the watches below, keyed by zk connect string
+  private static final ConcurrentHashMap<String, CuratorFramework> zkClients =
+      new ConcurrentHashMap<>();
+  // The external views looked up so far, kept up to date by zk watches. They are keyed by zk
+  // connect string, cluster and resource.
+  private static final ConcurrentHashMap<String, NodeCache> externalViews =
+      new ConcurrentHashMap<>();
+
   private static Options constructCommandLineOptions() {
     Option zkServerOption =
         OptionBuilder.withLongOpt(zkServer).withDescription("Provide zookeeper addresses").create();
@@ -90,51 +107,116 @@ public class HelixClient {
    * instance which hosts the leader replica of the partition. Returns an empty string in case
    * an error or if there is no leader. In our case helix instace ID is the IP of the instance
    * and the port in which the service is running.
+   *
+   * The external view of the resource is read from zk once, and then kept up to date by a watch,
+   * which also invalidates the leaders cached by the admin process, see
+   * onExternalViewChange().
    */
   public static String getleaderInstanceId(String zkConnectString,
                                        String clusterName,
                                        String resourceName,
                                        String partitionName) {
-    HelixAdmin helixAdmin = null;
+    ExternalView view;
     try {
-      LOG.error("Starting helix with ZK:" + zkConnectString);
-      helixAdmin = new ZKHelixAdmin(zkConnectString);
-      String leaderInstanceId = "";
-      if (helixAdmin == null) {
-        LOG.error("Could not get helix admin for: " + zkConnectString);
-        return leaderInstanceId;
-      }
-      ExternalView view = helixAdmin.getResourceExternalView(clusterName, resourceName);
-      if (view == null) {
+      ChildData data = watchExternalView(zkConnectString, clusterName, resourceName)
+          .getCurrentData();
+      if (data == null || data.getData() == null) {
         LOG.error("Could not get external view for: " + resourceName);
-        return leaderInstanceId;
+        return "";
       }
+      view = new ExternalView((ZNRecord) serializer.deserialize(data.getData()));
+    } catch (Exception e) {
+      LOG.error("Failed to watch the external view of " + resourceName + ", reading it once", e);
+      return getLeaderInstanceIdFromHelixAdmin(
+          zkConnectString, clusterName, resourceName, partitionName);
+    }
 
-      Map<String, String> stateMap = view.getStateMap(partitionName);
+    return findLeader(view, resourceName, partitionName);
+  }
+
+  private static NodeCache watchExternalView(String zkConnectString,
+                                             String clusterName,
+                                             String resourceName) throws Exception {
+    final String key = zkConnectString + "/" + clusterName + "/" + resourceName;
+    NodeCache cache = externalViews.get(key);
+    if (cache != null) {
+      return cache;
+    }
 
-      if (stateMap == null) {
-        LOG.error("Could not get statemap for: " + resourceName);
-        return leaderInstanceId;
+    synchronized (externalViews) {
+      cache = externalViews.get(key);
+      if (cache != null) {
+        return cache;
       }
 
-      LOG.error("State map :" + stateMap);
+      CuratorFramework zkClient = zkClients.computeIfAbsent(zkConnectString, zk -> {
+        CuratorFramework client =
+            CuratorFrameworkFactory.newClient(zk, new ExponentialBackoffRetry(1000, 3));
+        client.start();
+        return client;
+      });
+      cache = new NodeCache(zkClient, "/" + clusterName + "/EXTERNALVIEW/" + resourceName);
+      cache.getListenable().addListener(
+          () -> notifyExternalViewChange(zkConnectString, clusterName, resourceName));
+      // Load the current view before returning it
+      cache.start(true);
+      externalViews.put(key, cache);
+      return cache;
+    }
+  }
 
-      if (!stateMap.containsValue("MASTER") && !stateMap.containsValue("LEADER")) {
-        LOG.error("No leader found");
-        return leaderInstanceId;
+  private static void notifyExternalViewChange(String zkConnectString,
+                                               String clusterName,
+                                               String resourceName) {
+    try {
+      onExternalViewChange(zkConnectString, clusterName, resourceName);
+    } catch (UnsatisfiedLinkError e) {
+      // Not running in the admin process, nothing is cached natively
+    }
+  }
+
+  /**
+   * Implemented by rocksdb_admin/helix_client.cpp, which drops the leaders it has cached for the
+   * resource.
+   */
+  private static native void onExternalViewChange(String zkConnectString,
+                                                  String clusterName,
+                                                  String resourceName);
+
+  private static String findLeader(ExternalView view, String resourceName,
+                                   String partitionName) {
+    Map<String, String> stateMap = view.getStateMap(partitionName);
+    if (stateMap == null) {
+      LOG.error("Could not get statemap for: " + resourceName);
+      return "";
+    }
+
+    for (Map.Entry<String, String> instanceNameAndRole : stateMap.entrySet()) {
+      String role = instanceNameAndRole.getValue();
+      if (role.equals("MASTER") || role.equals("LEADER")) {
+        return instanceNameAndRole.getKey();
       }
+    }
+
+    LOG.error("No leader found for " + partitionName + " in " + stateMap);
+    return "";
+  }
 
-      for (Map.Entry<String, String> instanceNameAndRole : stateMap.entrySet()) {
-        String role = instanceNameAndRole.getValue();
-        if (role.equals("MASTER") || role.equals("LEADER")) {
-          leaderInstanceId = instanceNameAndRole.getKey();
-          LOG.error("Found leader: " + leaderInstanceId);
-          break;
-        }
+  private static String getLeaderInstanceIdFromHelixAdmin(String zkConnectString,
+                                                          String clusterName,
+                                                          String resourceName,
+                                                          String partitionName) {
+    HelixAdmin helixAdmin = null;
+    try {
+      LOG.error("Starting helix with ZK:" + zkConnectString);
+      helixAdmin = new ZKHelixAdmin(zkConnectString);
+      ExternalView view = helixAdmin.getResourceExternalView(clusterName, resourceName);
+      if (view == null) {
+        LOG.error("Could not get external view for: " + resourceName);
+        return "";
       }
 
-      LOG.error("Done finding leader: " + leaderInstanceId);
-      return leaderInstanceId;
+      return findLeader(view, resourceName, partitionName);
     } catch (Exception e) {
       LOG.error("Caught exception while trying to get current leader: %s", e);
       return "";
@@ -161,7 +243,9 @@ public class HelixClient {
     final String partitionName = cmd.getOptionValue(partition);
 
     // For now, we need only one function to get the current leader.
-    getleaderInstanceId(zkConnectString, clusterName, resourceName, partitionName);
+    // A single lookup doesn't need the watch
+    System.out.println(getLeaderInstanceIdFromHelixAdmin(
+        zkConnectString, clusterName, resourceName, partitionName));
   }
 
 }
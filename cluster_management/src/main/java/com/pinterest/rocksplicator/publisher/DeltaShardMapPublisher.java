@@ -0,0 +1,160 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+package com.pinterest.rocksplicator.publisher;
+
+import org.apache.helix.model.ExternalView;
+import org.json.simple.JSONObject;
+import org.slf4j.Logger;
+import org.slf4j.LoggerFactory;
+
+import java.io.IOException;
+import java.nio.charset.StandardCharsets;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.Set;
+
+/**
+ * Implementation of ShardMapPublisher that publishes the full shard_map only once in a while,
+ * and a delta of the resources changed since the last full one otherwise, so that clients
+ * don't parse the whole shard_map for every change.
+ *
+ * The full shard_maps go to fullShardMapPublisher, and the deltas go to deltaShardMapPublisher,
+ * in the following format, which the C++ ThriftRouter applies with common::applyConfigDelta():
+ *
+ * <code>
+ * {
+ *   "base_hash": "8c9a2f10d3b4e5a6",   <-- hash of the full shard_map the delta is based on
+ *   "segments": {
+ *     "resource1": {...},              <-- the new config of a changed resource
+ *     "resource2": null                <-- a removed resource
+ *   }
+ * }
+ * </code>
+ *
+ * Deltas are cumulative, so a client only needs the latest full shard_map and delta. A full
+ * shard_map is published instead of a delta once more than maxDeltaPercent of the resources have
+ * changed since the last full one, or it is older than maxDeltaAgeMillis.
+ */
+public class DeltaShardMapPublisher implements ShardMapPublisher<JSONObject> {
+
+  private static final Logger LOG = LoggerFactory.getLogger(DeltaShardMapPublisher.class);
+
+  private final ShardMapPublisher<JSONObject> fullShardMapPublisher;
+  private final ShardMapPublisher<String> deltaShardMapPublisher;
+  private final int maxDeltaPercent;
+  private final long maxDeltaAgeMillis;
+
+  private Map<String, Object> baseShardMap;
+  private String baseHash;
+  private long baseTimeMillis;
+  private String lastPublishedDelta;
+
+  public DeltaShardMapPublisher(
+      ShardMapPublisher<JSONObject> fullShardMapPublisher,
+      ShardMapPublisher<String> deltaShardMapPublisher,
+      int maxDeltaPercent,
+      long maxDeltaAgeMillis) {
+    this.fullShardMapPublisher = fullShardMapPublisher;
+    this.deltaShardMapPublisher = deltaShardMapPublisher;
+    this.maxDeltaPercent = maxDeltaPercent;
+    this.maxDeltaAgeMillis = maxDeltaAgeMillis;
+    this.baseShardMap = null;
+    this.baseHash = null;
+    this.baseTimeMillis = 0;
+    this.lastPublishedDelta = null;
+  }
+
+  @Override
+  public synchronized void publish(
+      final Set<String> validResources,
+      final List<ExternalView> externalViews,
+      final JSONObject jsonShardMap) {
+    final long nowMillis = System.currentTimeMillis();
+    JSONObject changedResources = null;
+    if (baseShardMap != null && nowMillis - baseTimeMillis < maxDeltaAgeMillis) {
+      changedResources = getChangedResources(jsonShardMap);
+      int numResources = Math.max(jsonShardMap.size(), 1);
+      if (changedResources.size() * 100 > numResources * maxDeltaPercent) {
+        changedResources = null;
+      }
+    }
+
+    if (changedResources == null) {
+      fullShardMapPublisher.publish(validResources, externalViews, jsonShardMap);
+      baseShardMap = new HashMap<String, Object>(jsonShardMap);
+      baseHash = hash(jsonShardMap.toString());
+      baseTimeMillis = nowMillis;
+      LOG.error("Published a full shard_map with hash " + baseHash);
+      return;
+    }
+
+    JSONObject delta = new JSONObject();
+    delta.put("base_hash", baseHash);
+    delta.put("segments", changedResources);
+    String deltaContent = delta.toString();
+    if (deltaContent.equals(lastPublishedDelta)) {
+      LOG.error("Identical shard_map delta observed, skip publishing it.");
+      return;
+    }
+    lastPublishedDelta = deltaContent;
+    deltaShardMapPublisher.publish(validResources, externalViews, deltaContent);
+    LOG.error("Published a shard_map delta of " + changedResources.size() + " resources");
+  }
+
+  /**
+   * The resources of jsonShardMap which differ from baseShardMap, and null for the ones it
+   * doesn't have anymore.
+   */
+  private JSONObject getChangedResources(JSONObject jsonShardMap) {
+    JSONObject changed = new JSONObject();
+    for (Object entryObject : jsonShardMap.entrySet()) {
+      Map.Entry<?, ?> entry = (Map.Entry<?, ?>) entryObject;
+      Object baseConfig = baseShardMap.get(entry.getKey());
+      if (baseConfig == null || !baseConfig.equals(entry.getValue())) {
+        changed.put(entry.getKey(), entry.getValue());
+      }
+    }
+    for (String resource : baseShardMap.keySet()) {
+      if (!jsonShardMap.containsKey(resource)) {
+        changed.put(resource, null);
+      }
+    }
+    return changed;
+  }
+
+  /**
+   * 64 bit FNV-1a of the UTF-8 bytes of content in hex, as computed by
+   * common::detail::hashConfig() of the C++ ThriftRouter.
+   */
+  static String hash(String content) {
+    long hash = 0xcbf29ce484222325L;
+    for (byte b : content.getBytes(StandardCharsets.UTF_8)) {
+      hash ^= (b & 0xff);
+      hash *= 0x100000001b3L;
+    }
+    return String.format("%016x", hash);
+  }
+
+  @Override
+  public void close() throws IOException {
+    fullShardMapPublisher.close();
+    deltaShardMapPublisher.close();
+  }
+}
@@ -38,6 +38,15 @@ public class LocalFileShardMapPublisher implements ShardMapPublisher<String> {
   private final String localDumpFilePath;
 
   public LocalFileShardMapPublisher(boolean enableDumpToLocal, String clusterName) {
+    this(enableDumpToLocal, clusterName, "");
+  }
+
+  /**
+   * Dump to the local shard config file path with suffix appended, e.g. ".delta" for the
+   * deltas of DeltaShardMapPublisher.
+   */
+  public LocalFileShardMapPublisher(boolean enableDumpToLocal, String clusterName,
+                                    String suffix) {
     boolean localDumpEnabled = false;
     if (enableDumpToLocal) {
       if (new File(PARENT_OF_DUMP_DIR).canWrite()) {
@@ -48,7 +57,8 @@ public class LocalFileShardMapPublisher implements ShardMapPublisher<String> {
       }
     }
     this.enableDumpToLocal = localDumpEnabled;
-    this.localDumpFilePath = String.format("%s/%s-shard-config.json", DUMP_DIR, clusterName);
+    this.localDumpFilePath =
+        String.format("%s/%s-shard-config.json%s", DUMP_DIR, clusterName, suffix);
   }
 
   @Override
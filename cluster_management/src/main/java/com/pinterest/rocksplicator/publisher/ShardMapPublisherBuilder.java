@@ -29,6 +29,9 @@ public class ShardMapPublisherBuilder {
 
   private String postUrl = null;
   private boolean enableLocalDump = false;
+  private boolean enableDeltas = false;
+  private int maxDeltaPercent = 0;
+  private long maxDeltaAgeMillis = 0;
 
   private final String clusterName;
 
@@ -55,16 +58,40 @@ public class ShardMapPublisherBuilder {
     return this;
   }
 
+  /**
+   * Dump deltas of the shard_map next to the local dump, and the full shard_map only once in a
+   * while, see DeltaShardMapPublisher. Only used with the local dump.
+   */
+  public ShardMapPublisherBuilder withLocalDumpDeltas(int maxDeltaPercent,
+                                                     long maxDeltaAgeMillis) {
+    this.enableDeltas = true;
+    this.maxDeltaPercent = maxDeltaPercent;
+    this.maxDeltaAgeMillis = maxDeltaAgeMillis;
+    return this;
+  }
+
   public ShardMapPublisher<JSONObject> build() {
     List<ShardMapPublisher<String>> publishers = new ArrayList<>();
 
     if (postUrl != null && !postUrl.isEmpty()) {
       publishers.add(new HttpPostShardMapPublisher(this.postUrl));
     }
-    if (enableLocalDump) {
+    if (enableLocalDump && !enableDeltas) {
       publishers.add(new LocalFileShardMapPublisher(enableLocalDump, clusterName));
     }
-    return new DedupingShardMapPublisher(
+    ShardMapPublisher<JSONObject> publisher = new DedupingShardMapPublisher(
         new ParallelShardMapPublisher<String>(ImmutableList.copyOf(publishers)));
+    if (!enableLocalDump || !enableDeltas) {
+      return publisher;
+    }
+
+    // The posted shard_maps stay full, and the local dump only gets a full one once in a while
+    ShardMapPublisher<JSONObject> localDumpPublisher = new DeltaShardMapPublisher(
+        new DedupingShardMapPublisher(
+            new LocalFileShardMapPublisher(enableLocalDump, clusterName)),
+        new LocalFileShardMapPublisher(enableLocalDump, clusterName, ".delta"),
+        maxDeltaPercent, maxDeltaAgeMillis);
+    return new ParallelShardMapPublisher<JSONObject>(
+        ImmutableList.of(publisher, localDumpPublisher));
   }
 }
@@ -0,0 +1,199 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+package com.pinterest.rocksplicator.utils;
+
+import java.util.Collections;
+import java.util.List;
+import java.util.concurrent.AbstractExecutorService;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.FutureTask;
+import java.util.concurrent.PriorityBlockingQueue;
+import java.util.concurrent.ThreadPoolExecutor;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.concurrent.atomic.AtomicLong;
+
+/**
+ * A thread pool shared by the state transitions of all the resources of a participant, which runs
+ * the promotions and demotions first, then the transitions bringing replicas online, and then
+ * those taking them offline or dropping them.
+ *
+ * Helix runs the transitions of each resource on a pool of its own by default, so that the number
+ * of transitions running at a time, e.g. restoring dbs from S3, grows with the number of resources.
+ * The state model factories hand the executors returned by forTransition() to Helix instead.
+ * Transitions of the same priority run in the order they are submitted.
+ *
+ * The transitions bringing replicas online may hold their thread for long, e.g. waiting for an S3
+ * restore permit and then restoring. Promotions and demotions run on threads of their own, so that
+ * they are never stuck behind them.
+ */
+public class StateTransitionExecutor {
+
+  private final ThreadPoolExecutor pool;
+  // the threads reserved for the promotions and demotions
+  private final ThreadPoolExecutor roleChangePool;
+  private final AtomicLong nextSequence = new AtomicLong(0);
+  // the executors handed to Helix, one per transition type
+  private final ConcurrentHashMap<String, ExecutorService> executors = new ConcurrentHashMap<>();
+
+  public StateTransitionExecutor(int numThreads) {
+    this(numThreads, Math.max(1, numThreads / 4));
+  }
+
+  public StateTransitionExecutor(int numThreads, int numRoleChangeThreads) {
+    this.pool = newPool(numThreads, "state-transition-");
+    this.roleChangePool = newPool(numRoleChangeThreads, "role-change-");
+  }
+
+  private static ThreadPoolExecutor newPool(int numThreads, String threadNamePrefix) {
+    final AtomicInteger threadId = new AtomicInteger(0);
+    // With an unbounded queue, the pool never grows over its core size
+    return new ThreadPoolExecutor(numThreads, numThreads, 60, TimeUnit.SECONDS,
+        new PriorityBlockingQueue<>(), runnable -> {
+          Thread thread = new Thread(runnable, threadNamePrefix + threadId.getAndIncrement());
+          thread.setDaemon(true);
+          return thread;
+        });
+  }
+
+  /**
+   * The priority of a transition, lower first. Promotions and demotions go first, so that the
+   * partitions get a serving Master or Leader quickly, and run on their own threads. Replicas
+   * coming online, including the Slaves and Followers which may be promoted next, go next, and
+   * cleanups go last.
+   */
+  public static int getPriority(String fromState, String toState) {
+    if (isRoleChange(fromState, toState)) {
+      return 0;
+    }
+    if (toState.equals("DROPPED")) {
+      return 3;
+    }
+    if (toState.equals("OFFLINE")) {
+      return 2;
+    }
+    return 1;
+  }
+
+  private static boolean isRoleChange(String fromState, String toState) {
+    return (fromState.equals("SLAVE") && toState.equals("MASTER"))
+        || (fromState.equals("MASTER") && toState.equals("SLAVE"))
+        || (fromState.equals("FOLLOWER") && toState.equals("LEADER"))
+        || (fromState.equals("LEADER") && toState.equals("FOLLOWER"));
+  }
+
+  /**
+   * The executor of the transitions from fromState to toState, for
+   * StateModelFactory.getExecutorService(). Shutting it down doesn't affect the others.
+   */
+  public ExecutorService forTransition(String fromState, String toState) {
+    final int priority = getPriority(fromState, toState);
+    final ThreadPoolExecutor target = isRoleChange(fromState, toState) ? roleChangePool : pool;
+    // Helix shuts its executors down when it disconnects, and asks again once reconnected
+    return executors.compute(fromState + "." + toState, (key, executor) ->
+        executor == null || executor.isShutdown()
+            ? new PrioritizedExecutor(target, priority) : executor);
+  }
+
+  public void shutdown() {
+    pool.shutdown();
+    roleChangePool.shutdown();
+  }
+
+  private class PrioritizedTask<T> extends FutureTask<T>
+      implements Comparable<PrioritizedTask<?>> {
+    private final int priority;
+    private final long sequence;
+
+    PrioritizedTask(Callable<T> callable, int priority) {
+      super(callable);
+      this.priority = priority;
+      this.sequence = nextSequence.getAndIncrement();
+    }
+
+    @Override
+    public int compareTo(PrioritizedTask<?> other) {
+      if (priority != other.priority) {
+        return Integer.compare(priority, other.priority);
+      }
+      return Long.compare(sequence, other.sequence);
+    }
+  }
+
+  // A view of a pool submitting everything with the same priority
+  private class PrioritizedExecutor extends AbstractExecutorService {
+    private final ThreadPoolExecutor target;
+    private final int priority;
+    private volatile boolean shutdown = false;
+
+    PrioritizedExecutor(ThreadPoolExecutor target, int priority) {
+      this.target = target;
+      this.priority = priority;
+    }
+
+    @Override
+    protected <T> FutureTask<T> newTaskFor(Callable<T> callable) {
+      return new PrioritizedTask<>(callable, priority);
+    }
+
+    @Override
+    protected <T> FutureTask<T> newTaskFor(Runnable runnable, T value) {
+      return new PrioritizedTask<>(Executors.callable(runnable, value),
+          priority);
+    }
+
+    @Override
+    public void execute(Runnable command) {
+      if (!(command instanceof PrioritizedTask)) {
+        // Only tasks created by newTaskFor() can be compared in the queue
+        command = newTaskFor(command, null);
+      }
+      target.execute(command);
+    }
+
+    @Override
+    public void shutdown() {
+      shutdown = true;
+    }
+
+    @Override
+    public List<Runnable> shutdownNow() {
+      shutdown = true;
+      return Collections.emptyList();
+    }
+
+    @Override
+    public boolean isShutdown() {
+      return shutdown;
+    }
+
+    @Override
+    public boolean isTerminated() {
+      return shutdown;
+    }
+
+    @Override
+    public boolean awaitTermination(long timeout, TimeUnit unit) {
+      return shutdown;
+    }
+  }
+}
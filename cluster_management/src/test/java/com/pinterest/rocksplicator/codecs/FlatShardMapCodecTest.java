@@ -0,0 +1,103 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+package com.pinterest.rocksplicator.codecs;
+
+import static org.junit.Assert.assertArrayEquals;
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertTrue;
+
+import org.json.simple.JSONArray;
+import org.json.simple.JSONObject;
+import org.junit.Test;
+
+import java.nio.charset.StandardCharsets;
+import java.util.Arrays;
+
+public class FlatShardMapCodecTest {
+
+  private static JSONArray shards(String... shards) {
+    JSONArray array = new JSONArray();
+    array.addAll(Arrays.asList(shards));
+    return array;
+  }
+
+  private static JSONObject createShardMap() {
+    JSONObject userPins = new JSONObject();
+    userPins.put("num_shards", 3);
+    userPins.put("replication_fanout", 1);
+    userPins.put("127.0.0.1:8090:us-east-1a", shards("00000:S", "00001:S", "00002:M"));
+    userPins.put("127.0.0.1:8091:us-east-1c", shards("00000:S", "00001:M", "00002:S"));
+    userPins.put("127.0.0.1:8092:us-east-1e", shards("00000:M", "00001:S", "00002:S"));
+
+    JSONObject interestPins = new JSONObject();
+    interestPins.put("num_shards", 2);
+    interestPins.put("key_mapping", "jump");
+    interestPins.put("127.0.0.1:8090:us-east-1a", shards("00000", "00001"));
+
+    JSONObject shardMap = new JSONObject();
+    shardMap.put("user_pins", userPins);
+    shardMap.put("interest_pins", interestPins);
+    return shardMap;
+  }
+
+  @Test
+  public void testRoundTrip() throws Exception {
+    FlatShardMapCodec codec = new FlatShardMapCodec();
+    JSONObject shardMap = createShardMap();
+    byte[] data = codec.encode(shardMap);
+
+    assertArrayEquals(FlatShardMapCodec.MAGIC, Arrays.copyOf(data, 4));
+    assertEquals(shardMap, codec.decode(data));
+
+    // Hosts are only written once
+    byte[] json = new SimpleJsonObjectByteArrayCodec().encode(shardMap);
+    assertTrue(data.length < json.length);
+    String dataStr = new String(data, StandardCharsets.ISO_8859_1);
+    assertEquals(dataStr.indexOf("127.0.0.1:8090"), dataStr.lastIndexOf("127.0.0.1:8090"));
+  }
+
+  @Test
+  public void testLeafSegments() throws Exception {
+    JSONObject segment = new JSONObject();
+    segment.put("num_leaf_segments", 1);
+    segment.put("127.0.0.1:8090", shards("00000:M"));
+    JSONObject shardMap = new JSONObject();
+    shardMap.put("segment", segment);
+
+    FlatShardMapCodec codec = new FlatShardMapCodec();
+    JSONObject decoded = codec.decode(codec.encode(shardMap));
+    JSONObject decodedSegment = (JSONObject) decoded.get("segment");
+    assertEquals(1, decodedSegment.get("num_shards"));
+    assertEquals(shards("00000:M"), decodedSegment.get("127.0.0.1:8090"));
+  }
+
+  @Test(expected = CodecException.class)
+  public void testInvalidData() throws Exception {
+    new FlatShardMapCodec().decode("{}".getBytes(StandardCharsets.UTF_8));
+  }
+
+  @Test(expected = CodecException.class)
+  public void testTruncatedData() throws Exception {
+    byte[] data = new FlatShardMapCodec().encode(createShardMap());
+    new FlatShardMapCodec().decode(Arrays.copyOf(data, data.length - 3));
+  }
+
+  @Test
+  public void testGZIPCompressed() throws Exception {
+    ZkGZIPCompressedFlatShardMapCodec codec = new ZkGZIPCompressedFlatShardMapCodec();
+    JSONObject shardMap = createShardMap();
+    assertEquals(shardMap, codec.decode(codec.encode(shardMap)));
+  }
+}
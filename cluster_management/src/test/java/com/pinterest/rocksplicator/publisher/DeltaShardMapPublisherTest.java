@@ -0,0 +1,92 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+package com.pinterest.rocksplicator.publisher;
+
+import static org.junit.Assert.assertEquals;
+import static org.mockito.Mockito.mock;
+import static org.mockito.Mockito.verify;
+import static org.mockito.Mockito.verifyNoMoreInteractions;
+
+import com.google.common.collect.ImmutableList;
+import com.google.common.collect.ImmutableSet;
+import org.apache.helix.model.ExternalView;
+import org.json.simple.JSONObject;
+import org.junit.Test;
+import org.mockito.Mockito;
+
+import java.util.List;
+import java.util.Set;
+
+public class DeltaShardMapPublisherTest {
+
+  private static JSONObject resourceConfig(int numShards) {
+    JSONObject config = new JSONObject();
+    config.put("num_shards", numShards);
+    return config;
+  }
+
+  @Test
+  public void testHash() {
+    // Same as common::detail::hashConfig() of the C++ ThriftRouter
+    assertEquals("af63dc4c8601ec8c", DeltaShardMapPublisher.hash("a"));
+    assertEquals("cbf29ce484222325", DeltaShardMapPublisher.hash(""));
+  }
+
+  @Test
+  public void testDeltas() {
+    Set<String> resources = ImmutableSet.of();
+    List<ExternalView> externalViews = ImmutableList.of();
+    ShardMapPublisher<JSONObject> fullPublisher = mock(ShardMapPublisher.class);
+    ShardMapPublisher<String> deltaPublisher = mock(ShardMapPublisher.class);
+    DeltaShardMapPublisher publisher =
+        new DeltaShardMapPublisher(fullPublisher, deltaPublisher, 70, 3600 * 1000);
+
+    JSONObject shardMap = new JSONObject();
+    shardMap.put("resource1", resourceConfig(1));
+    shardMap.put("resource2", resourceConfig(2));
+    shardMap.put("resource3", resourceConfig(3));
+    publisher.publish(resources, externalViews, shardMap);
+    verify(fullPublisher, Mockito.times(1)).publish(resources, externalViews, shardMap);
+    final String baseHash = DeltaShardMapPublisher.hash(shardMap.toString());
+
+    // One of three resources changed, and one removed
+    JSONObject newShardMap = new JSONObject();
+    newShardMap.put("resource1", resourceConfig(10));
+    newShardMap.put("resource2", resourceConfig(2));
+    publisher.publish(resources, externalViews, newShardMap);
+    JSONObject changed = new JSONObject();
+    changed.put("resource1", resourceConfig(10));
+    changed.put("resource3", null);
+    JSONObject delta = new JSONObject();
+    delta.put("base_hash", baseHash);
+    delta.put("segments", changed);
+    verify(deltaPublisher, Mockito.times(1)).publish(resources, externalViews, delta.toString());
+
+    // Identical deltas are skipped
+    publisher.publish(resources, externalViews, newShardMap);
+    verifyNoMoreInteractions(deltaPublisher);
+
+    // Too many changes for a delta
+    JSONObject otherShardMap = new JSONObject();
+    otherShardMap.put("resource4", resourceConfig(4));
+    publisher.publish(resources, externalViews, otherShardMap);
+    verify(fullPublisher, Mockito.times(1)).publish(resources, externalViews, otherShardMap);
+    verifyNoMoreInteractions(deltaPublisher);
+  }
+}
@@ -0,0 +1,123 @@
+/// Copyright 2021 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+package com.pinterest.rocksplicator.utils;
+
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
+import static org.junit.Assert.assertNotSame;
+import static org.junit.Assert.assertSame;
+import static org.junit.Assert.assertTrue;
+
+import org.junit.Test;
+
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.List;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Future;
+import java.util.concurrent.TimeUnit;
+
+public class StateTransitionExecutorTest {
+
+  @Test
+  public void testPriorities() {
+    assertEquals(0, StateTransitionExecutor.getPriority("SLAVE", "MASTER"));
+    assertEquals(0, StateTransitionExecutor.getPriority("MASTER", "SLAVE"));
+    assertEquals(0, StateTransitionExecutor.getPriority("FOLLOWER", "LEADER"));
+    assertEquals(0, StateTransitionExecutor.getPriority("LEADER", "FOLLOWER"));
+    assertEquals(1, StateTransitionExecutor.getPriority("OFFLINE", "SLAVE"));
+    assertEquals(1, StateTransitionExecutor.getPriority("OFFLINE", "FOLLOWER"));
+    assertEquals(1, StateTransitionExecutor.getPriority("OFFLINE", "BOOTSTRAP"));
+    assertEquals(2, StateTransitionExecutor.getPriority("SLAVE", "OFFLINE"));
+    assertEquals(3, StateTransitionExecutor.getPriority("OFFLINE", "DROPPED"));
+    assertEquals(3, StateTransitionExecutor.getPriority("ERROR", "DROPPED"));
+  }
+
+  @Test
+  public void testExecutorsPerTransition() {
+    StateTransitionExecutor executor = new StateTransitionExecutor(1);
+    ExecutorService offlineToSlave = executor.forTransition("OFFLINE", "SLAVE");
+    assertSame(offlineToSlave, executor.forTransition("OFFLINE", "SLAVE"));
+    assertNotSame(offlineToSlave, executor.forTransition("SLAVE", "OFFLINE"));
+
+    // Shutting down a view doesn't affect the others, and a new one replaces it
+    offlineToSlave.shutdown();
+    assertTrue(offlineToSlave.isShutdown());
+    assertFalse(executor.forTransition("SLAVE", "OFFLINE").isShutdown());
+    assertNotSame(offlineToSlave, executor.forTransition("OFFLINE", "SLAVE"));
+    executor.shutdown();
+  }
+
+  @Test
+  public void testOnlineTransitionsRunFirst() throws Exception {
+    StateTransitionExecutor executor = new StateTransitionExecutor(1);
+    // Keep the only thread busy while the transitions are queued
+    CountDownLatch blocked = new CountDownLatch(1);
+    CountDownLatch release = new CountDownLatch(1);
+    executor.forTransition("OFFLINE", "SLAVE").submit(() -> {
+      blocked.countDown();
+      release.await();
+      return null;
+    });
+    blocked.await();
+
+    List<String> order = Collections.synchronizedList(new ArrayList<>());
+    List<Future<?>> futures = new ArrayList<>();
+    for (String[] transition : new String[][]{
+        {"OFFLINE", "DROPPED"}, {"SLAVE", "OFFLINE"}, {"OFFLINE", "SLAVE"},
+        {"OFFLINE", "FOLLOWER"}}) {
+      String name = transition[0] + "->" + transition[1];
+      futures.add(executor.forTransition(transition[0], transition[1])
+          .submit(() -> order.add(name)));
+    }
+    release.countDown();
+    for (Future<?> future : futures) {
+      future.get();
+    }
+
+    assertEquals(Arrays.asList("OFFLINE->SLAVE", "OFFLINE->FOLLOWER", "SLAVE->OFFLINE",
+        "OFFLINE->DROPPED"), order);
+    executor.shutdown();
+  }
+
+  @Test
+  public void testRoleChangesDontWait() throws Exception {
+    StateTransitionExecutor executor = new StateTransitionExecutor(1, 1);
+    // Keep the only transition thread busy, e.g. waiting for an S3 restore permit
+    CountDownLatch blocked = new CountDownLatch(1);
+    CountDownLatch release = new CountDownLatch(1);
+    Future<?> restore = executor.forTransition("OFFLINE", "SLAVE").submit(() -> {
+      blocked.countDown();
+      release.await();
+      return null;
+    });
+    blocked.await();
+
+    // Promotions and demotions still run on the reserved thread
+    executor.forTransition("SLAVE", "MASTER").submit(() -> null).get(10, TimeUnit.SECONDS);
+    executor.forTransition("LEADER", "FOLLOWER").submit(() -> null).get(10, TimeUnit.SECONDS);
+    assertFalse(restore.isDone());
+
+    release.countDown();
+    restore.get();
+    executor.shutdown();
+  }
+}
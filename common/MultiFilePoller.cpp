@@ -56,6 +56,8 @@
 #include "common/MultiFilePoller.h"
 
 #include <algorithm>
+#include <memory>
+#include <utility>
 #include <folly/FileUtil.h>
 #include <folly/String.h>
 
@@ -63,8 +65,21 @@ using namespace folly;
 
 namespace common {
 
-MultiFilePoller::MultiFilePoller(std::chrono::milliseconds pollInterval)
-    : poller_(pollInterval) {}
+// A FileWatcher of a MultiFilePoller's own, rather than the singleton, so
+// that the files it watches may be watched by others too
+class MultiFilePoller::Watcher : public FileWatcher {
+ public:
+  Watcher() {}
+  ~Watcher() override {}
+};
+
+MultiFilePoller::MultiFilePoller(std::chrono::milliseconds debounce,
+                                 folly::Executor* executor)
+    : debounce_(debounce),
+      executor_(executor),
+      watcher_(std::make_unique<Watcher>()) {}
+
+MultiFilePoller::~MultiFilePoller() = default;
 
 size_t MultiFilePoller::getNextCallbackId() {
   size_t ret = lastCallbackId_;
@@ -93,56 +108,91 @@ MultiFilePoller::CallbackId MultiFilePoller::registerFiles(
     throw std::invalid_argument("Argument paths must be non-empty.");
   }
   StringReferences cbPaths;
-  SharedMutex::WriteHolder wh(rwlock_);
-  auto cbId = getNextCallbackId();
-  // Create the bi-directional relation between path and callback.
-  for (const auto& path : paths) {
-    pathsToCallbackIds_[path].push_back(cbId);
-    // Use reference to key of pathsToCallbackIds_ map to avoid duplicates.
-    const auto& key = pathsToCallbackIds_.find(path)->first;
-    cbPaths.push_back(key);
-    poller_.addFileToTrack(key, [=] { onFileUpdated(key); });
+  std::vector<std::string> pathsToWatch;
+  std::lock_guard<std::mutex> g(watchLock_);
+  size_t cbId;
+  {
+    SharedMutex::WriteHolder wh(rwlock_);
+    cbId = getNextCallbackId();
+    // Create the bi-directional relation between path and callback.
+    for (const auto& path : paths) {
+      auto& callbackIds = pathsToCallbackIds_[path];
+      if (callbackIds.empty()) {
+        pathsToWatch.push_back(path);
+      }
+      callbackIds.push_back(cbId);
+      // Use reference to key of pathsToCallbackIds_ map to avoid duplicates.
+      const auto& key = pathsToCallbackIds_.find(path)->first;
+      cbPaths.push_back(key);
+    }
+    idsToCallbacks_.emplace(cbId,
+                            CallbackDetail(std::move(cbPaths), std::move(cb)));
+  }
+
+  // Out of rwlock_, which the watcher thread takes for the callbacks.
+  FileWatcher::Options options;
+  options.debounce = debounce_;
+  options.executor = executor_;
+  options.must_exist = false;
+  options.callback_on_add = false;
+  for (const auto& path : pathsToWatch) {
+    if (!watcher_->AddFile(
+          path,
+          [this, path](std::string content) {
+            onFileUpdated(path, std::move(content));
+          },
+          options)) {
+      LOG(ERROR) << "Failed to watch " << path;
+    }
   }
-  idsToCallbacks_.emplace(cbId,
-                          CallbackDetail(std::move(cbPaths), std::move(cb)));
   return MultiFilePoller::CallbackId(cbId);
 }
 
 void MultiFilePoller::cancelCallback(const CallbackId& cbId) {
   std::vector<std::string> pathsToErase;
-  SharedMutex::WriteHolder wh(rwlock_);
-
-  auto pos = idsToCallbacks_.find(cbId.id_);
-  if (pos == idsToCallbacks_.end()) {
-    throw std::out_of_range(
-        to<std::string>("Callback ", cbId.id_, " not found"));
-  }
+  std::lock_guard<std::mutex> g(watchLock_);
+  {
+    SharedMutex::WriteHolder wh(rwlock_);
+
+    auto pos = idsToCallbacks_.find(cbId.id_);
+    if (pos == idsToCallbacks_.end()) {
+      throw std::out_of_range(
+          to<std::string>("Callback ", cbId.id_, " not found"));
+    }
 
-  // Remove the callback ID from its registered paths.
-  for (const auto& path : pos->second.files_) {
-    auto& callbackIds = pathsToCallbackIds_[path];
-    callbackIds.erase(
-        std::remove(callbackIds.begin(), callbackIds.end(), cbId.id_));
-    // If the path has no more callbacks, erase it from map.
-    if (callbackIds.empty()) {
-      poller_.removeFileToTrack(path);
-      pathsToErase.emplace_back(path);
+    // Remove the callback ID from its registered paths.
+    for (const auto& path : pos->second.files_) {
+      auto& callbackIds = pathsToCallbackIds_[path];
+      callbackIds.erase(
+          std::remove(callbackIds.begin(), callbackIds.end(), cbId.id_));
+      // If the path has no more callbacks, erase it from map.
+      if (callbackIds.empty()) {
+        pathsToErase.emplace_back(path);
+      }
+    }
+    // Remove the callback.
+    idsToCallbacks_.erase(cbId.id_);
+    // Remove callback-less paths from pathsToCallbackIds_, if any, at last.
+    for (const auto& path : pathsToErase) {
+      pathsToCallbackIds_.erase(path);
     }
   }
-  // Remove the callback.
-  idsToCallbacks_.erase(cbId.id_);
-  // Remove callback-less paths from pathsToCallbackIds_, if any, at last.
+
+  // Out of rwlock_, which the watcher thread takes for the callbacks.
   for (const auto& path : pathsToErase) {
-    pathsToCallbackIds_.erase(path);
+    watcher_->RemoveFile(path);
   }
 }
 
-void MultiFilePoller::onFileUpdated(const std::string& triggeredPath) {
+void MultiFilePoller::onFileUpdated(const std::string& triggeredPath,
+                                    std::string content) {
   VLOG(4) << "onFileUpdated(" << triggeredPath << ").";
 
   // A temporary read cache. Not worth it making it permanent because
   // files do not change frequently.
   std::unordered_map<std::string, std::string> filePathsToFileContents;
+  // The watcher has just read the triggered file
+  filePathsToFileContents.emplace(triggeredPath, std::move(content));
   SharedMutex::ReadHolder rh(rwlock_);
 
   const auto& callbacks = pathsToCallbackIds_.find(triggeredPath);
@@ -55,20 +55,26 @@
 
 #pragma once
 
-#include "common/FilePoller.h"
+#include "common/file_watcher.h"
 
 #include <chrono>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
+#include <folly/Executor.h>
 #include <folly/Function.h>
 #include <folly/SharedMutex.h>
 
 namespace common {
 
 /**
- * An extension to common::FilePoller with the ability to register one or more
- * callback on a file, and to track one or more file in a callback, and to
- * deliver cached file data to callbacks.
+ * A watcher with the ability to register one or more callback on a file, and
+ * to track one or more file in a callback, and to deliver cached file data to
+ * callbacks.
+ * Files are watched with inotify by a common::FileWatcher of its own, rather
+ * than polled, and a write which leaves the content of a file unchanged
+ * triggers no callback.
  */
 class MultiFilePoller {
  public:
@@ -76,8 +82,9 @@ class MultiFilePoller {
    * A callback:
    *   (1) takes as argument a map from a file path to its latest content.
            Unreadable paths will not show up in the map.
-   *   (2) is triggered when any file it registers is changed,
-   *       in the context of FilePoller thread.
+   *   (2) is triggered when the content of any file it registers is
+   *       changed, in the context of the watcher thread, or of the executor
+   *       if one is given.
    *   (3) once registered, cannot have its file list or callback pointer
    *       changed. To make changes, cancel the existing one and register
    *       a new one.
@@ -111,13 +118,16 @@ class MultiFilePoller {
   };
 
   /**
-   * @param pollInterval Interval between polls. Setting a value less than 1_s
-   *   may cause undesirable behavior because the minimum granularity for
-   *   common::FilePoller to detect mtime difference is 1_s.
+   * @param debounce A file is read once it has not been written for this
+   *   long, so that the callbacks don't see a file which is still changing.
+   * @param executor If set, the callbacks run on it, one call at a time per
+   *   file, instead of on the watcher thread. It must have run them all by
+   *   the time the poller is destroyed.
    */
-  explicit MultiFilePoller(std::chrono::milliseconds pollInterval);
+  explicit MultiFilePoller(std::chrono::milliseconds debounce,
+                           folly::Executor* executor = nullptr);
 
-  ~MultiFilePoller() = default;
+  ~MultiFilePoller();
 
   /**
    * Add a callback to trigger when the specified file changes.
@@ -142,10 +152,12 @@ class MultiFilePoller {
   void cancelCallback(const CallbackId& cbId);
 
  private:
+  class Watcher;
+
   /**
-   * The callback dispatcher to be registered to common::FilePoller.
+   * The callback dispatcher to be registered to common::FileWatcher.
    */
-  void onFileUpdated(const std::string& triggeredPath);
+  void onFileUpdated(const std::string& triggeredPath, std::string content);
 
   /**
    * Find an unused size_t value as callback Id. Caller must acquire wlock.
@@ -169,8 +181,15 @@ class MultiFilePoller {
   std::unordered_map<std::string, std::vector<size_t>> pathsToCallbackIds_;
   std::unordered_map<size_t, CallbackDetail> idsToCallbacks_;
 
+  // Serializes the changes of the files watched by watcher_. Never held by
+  // the callbacks, so it may be held while waiting for the watcher thread.
+  std::mutex watchLock_;
+
   // The following data structures are set by ctor only.
-  common::FilePoller poller_;
+  const std::chrono::milliseconds debounce_;
+  folly::Executor* const executor_;
+  // destroyed first, so that no callback runs with the maps gone
+  std::unique_ptr<Watcher> watcher_;
 };
 
 } // namespace wangle
@@ -0,0 +1,91 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/adaptive_rate_limiter.h"
+
+#include <algorithm>
+#include <ctime>
+
+#include "glog/logging.h"
+
+using Aws::Utils::RateLimits::RateLimiterInterface;
+
+namespace common {
+
+AdaptiveRateLimiter::AdaptiveRateLimiter(
+    const int64_t min_rate,
+    const int64_t max_rate,
+    const int64_t step,
+    std::function<uint32_t(void)> clock)
+    : min_rate_(min_rate)
+    , max_rate_(max_rate)
+    , step_(step)
+    , clock_(std::move(clock))
+    , rate_(max_rate)
+    , last_increase_seconds_(0)
+    , last_decrease_seconds_(0)
+    , limiter_(max_rate, clock_) {
+  CHECK_GT(min_rate_, 0);
+  CHECK_GE(max_rate_, min_rate_);
+}
+
+RateLimiterInterface::DelayType AdaptiveRateLimiter::ApplyCost(int64_t cost) {
+  return limiter_.ApplyCost(cost);
+}
+
+void AdaptiveRateLimiter::ApplyAndPayForCost(int64_t cost) {
+  limiter_.ApplyAndPayForCost(cost);
+}
+
+void AdaptiveRateLimiter::SetRate(int64_t rate, bool) {
+  rate = std::min(std::max(rate, min_rate_), max_rate_);
+  rate_.store(rate);
+  limiter_.SetRate(rate);
+}
+
+void AdaptiveRateLimiter::OnSuccess() {
+  auto now = clock_();
+  auto last = last_increase_seconds_.load();
+  // At most once a second, and not in the second we backed off
+  if (now <= last || now <= last_decrease_seconds_.load() ||
+      !last_increase_seconds_.compare_exchange_strong(last, now)) {
+    return;
+  }
+
+  SetRate(rate_.load() + step_);
+}
+
+void AdaptiveRateLimiter::OnThrottled() {
+  auto now = clock_();
+  auto last = last_decrease_seconds_.load();
+  // The requests throttled in the same second count once
+  if (now <= last ||
+      !last_decrease_seconds_.compare_exchange_strong(last, now)) {
+    return;
+  }
+
+  SetRate(rate_.load() / 2);
+  LOG(WARNING) << "Throttled by S3, backing off to " << rate_.load()
+               << " bytes/s";
+}
+
+uint32_t AdaptiveRateLimiter::GetCurrentTimeSeconds() {
+  return static_cast<uint32_t>(time(nullptr));
+}
+
+}  // namespace common
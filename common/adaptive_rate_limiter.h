@@ -0,0 +1,77 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+#include "aws/core/utils/ratelimiter/RateLimiterInterface.h"
+#include "common/aws_s3_rate_limiter.h"
+
+namespace common {
+
+/**
+ * AdaptiveRateLimiter is an AwsS3RateLimiter whose rate goes up and down
+ * with the responses (AIMD). The rate grows by "step" for every second with
+ * successful requests, and is halved for every second with requests
+ * throttled by S3, in [min_rate, max_rate].
+ */
+class AdaptiveRateLimiter
+    : public Aws::Utils::RateLimits::RateLimiterInterface {
+ public:
+  // The rates are in bytes per second, and it starts at max_rate.
+  AdaptiveRateLimiter(
+      const int64_t min_rate,
+      const int64_t max_rate,
+      const int64_t step,
+      std::function<uint32_t(void)> clock = GetCurrentTimeSeconds);
+
+  DelayType ApplyCost(int64_t cost) override;
+
+  void ApplyAndPayForCost(int64_t cost) override;
+
+  // Set the current rate, which is clamped to [min_rate, max_rate].
+  void SetRate(int64_t rate, bool resetAccumulator = false) override;
+
+  // A request went through.
+  void OnSuccess();
+
+  // A request was throttled (e.g. 503 SlowDown).
+  void OnThrottled();
+
+  int64_t GetRate() const {
+    return rate_.load();
+  }
+
+ private:
+  static uint32_t GetCurrentTimeSeconds();
+
+  const int64_t min_rate_;
+  const int64_t max_rate_;
+  const int64_t step_;
+  const std::function<uint32_t(void)> clock_;
+  std::atomic<int64_t> rate_;
+  // When the rate was last increased / decreased
+  std::atomic<uint32_t> last_increase_seconds_;
+  std::atomic<uint32_t> last_decrease_seconds_;
+  AwsS3RateLimiter limiter_;
+};
+
+}  // namespace common
@@ -0,0 +1,159 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/admission_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "common/stats/stats.h"
+
+DEFINE_bool(admission_control, false,
+            "Shed the requests beyond a latency adapted concurrency limit");
+
+DEFINE_int32(admission_control_initial_limit, 100,
+             "The concurrency limit to start with");
+
+DEFINE_int32(admission_control_min_limit, 8,
+             "The concurrency limit never goes below this");
+
+DEFINE_int32(admission_control_max_limit, 1000,
+             "The concurrency limit never goes above this");
+
+DEFINE_int32(admission_control_window_requests, 100,
+             "The concurrency limit is adjusted after every this many "
+             "finished requests");
+
+DEFINE_double(admission_control_latency_tolerance, 1.5,
+              "How many times of the long term latency is tolerated before "
+              "the concurrency limit shrinks");
+
+DEFINE_int32(admission_control_low_priority_percent, 80,
+             "The percentage of the concurrency limit low priority requests "
+             "may take");
+
+namespace {
+
+// the weight of the latest window in the long term latency
+const double kLongLatencyWeight = 0.05;
+// the weight of the new limit in the limit
+const double kLimitSmoothing = 0.2;
+
+}  // namespace
+
+namespace common {
+
+AdmissionController::Permit::~Permit() {
+  if (controller_) {
+    controller_->Release(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start_).count());
+  }
+}
+
+AdmissionController::AdmissionController(const std::string& name)
+    : accepted_stat_(name + "_admission_accepted")
+    , rejected_stat_(name + "_admission_rejected")
+    , limit_stat_(name + "_concurrency_limit")
+    , limit_(0)
+    , in_flight_(0)
+    , mutex_()
+    , exact_limit_(std::min(std::max(FLAGS_admission_control_initial_limit,
+                                     FLAGS_admission_control_min_limit),
+                            FLAGS_admission_control_max_limit))
+    , long_latency_us_(0)
+    , window_latency_us_(0)
+    , window_requests_(0)
+    , window_max_in_flight_(0) {
+  exact_limit_ = std::max(exact_limit_, 1.0);
+  limit_ = static_cast<uint32_t>(exact_limit_);
+}
+
+std::unique_ptr<AdmissionController::Permit> AdmissionController::TryAcquire(
+    Priority priority) {
+  if (!FLAGS_admission_control) {
+    return std::make_unique<Permit>(nullptr);
+  }
+
+  const auto limit = Limit();
+  uint32_t cap = limit;
+  if (priority == Priority::LOW) {
+    cap = std::max<uint32_t>(
+      1, limit * FLAGS_admission_control_low_priority_percent / 100);
+  }
+
+  const auto in_flight = in_flight_.fetch_add(1);
+  if (priority != Priority::CRITICAL && in_flight >= cap) {
+    --in_flight_;
+    Stats::get()->Incr(rejected_stat_);
+    return nullptr;
+  }
+
+  Stats::get()->Incr(accepted_stat_);
+  return std::make_unique<Permit>(this);
+}
+
+void AdmissionController::Release(uint64_t latency_us) {
+  const auto in_flight = in_flight_.fetch_sub(1);
+
+  std::lock_guard<std::mutex> g(mutex_);
+  window_latency_us_ += std::max<uint64_t>(latency_us, 1);
+  window_max_in_flight_ = std::max(window_max_in_flight_, in_flight);
+  if (++window_requests_ <
+      static_cast<uint32_t>(
+        std::max(FLAGS_admission_control_window_requests, 1))) {
+    return;
+  }
+
+  const double latency_us = static_cast<double>(window_latency_us_) /
+    window_requests_;
+  if (long_latency_us_ == 0) {
+    long_latency_us_ = latency_us;
+  } else {
+    long_latency_us_ = long_latency_us_ * (1 - kLongLatencyWeight) +
+      latency_us * kLongLatencyWeight;
+  }
+  // Come back down quickly once the latency has recovered, so that the long
+  // term latency of a slow period isn't taken as normal
+  if (long_latency_us_ > 2 * latency_us) {
+    long_latency_us_ *= 0.95;
+  }
+
+  const double gradient = std::max(0.5, std::min(1.0,
+    FLAGS_admission_control_latency_tolerance * long_latency_us_ /
+    latency_us));
+  double new_limit = exact_limit_ * gradient + std::sqrt(exact_limit_);
+  // Don't grow beyond what the load has needed, or any burst would be
+  // admitted after an idle period
+  if (new_limit > exact_limit_ && window_max_in_flight_ < exact_limit_ / 2) {
+    new_limit = exact_limit_;
+  }
+  exact_limit_ = exact_limit_ * (1 - kLimitSmoothing) +
+    new_limit * kLimitSmoothing;
+  exact_limit_ = std::max(exact_limit_,
+    static_cast<double>(std::max(FLAGS_admission_control_min_limit, 1)));
+  exact_limit_ = std::min(exact_limit_,
+    static_cast<double>(std::max(FLAGS_admission_control_max_limit, 1)));
+  limit_ = static_cast<uint32_t>(exact_limit_);
+  Stats::get()->AddMetric(limit_stat_, limit_.load());
+
+  window_latency_us_ = 0;
+  window_requests_ = 0;
+  window_max_in_flight_ = 0;
+}
+
+}  // namespace common
@@ -0,0 +1,113 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "gflags/gflags.h"
+
+DECLARE_bool(admission_control);
+
+namespace common {
+
+/**
+ * AdmissionController sheds load at the entry of the request handlers, before
+ * the requests pile up behind a stalled RocksDB or a saturated CPU until the
+ * callers time out.
+ *
+ * It admits up to a concurrency limit which adapts to the latency, with a
+ * gradient algorithm. Over each window of
+ * --admission_control_window_requests finished requests, it compares their
+ * average latency with the long term average. The limit shrinks in proportion
+ * while the latency grows beyond --admission_control_latency_tolerance times
+ * the long term one, and grows by about its square root otherwise, within
+ * [--admission_control_min_limit, --admission_control_max_limit].
+ *
+ * LOW priority requests are only admitted below
+ * --admission_control_low_priority_percent of the limit, so they are shed
+ * first. CRITICAL ones are always admitted.
+ *
+ * The admitted and rejected requests are counted as
+ * <name>_admission_accepted and <name>_admission_rejected.
+ *
+ * All interfaces are thread safe. With --admission_control off, everything
+ * is admitted.
+ */
+class AdmissionController {
+ public:
+  enum class Priority { LOW, NORMAL, CRITICAL };
+
+  // Permit is held by an admitted request until it is done, which is when it
+  // is destroyed. Its lifetime is the latency the limit adapts to.
+  class Permit {
+   public:
+    explicit Permit(AdmissionController* controller)
+      : controller_(controller)
+      , start_(std::chrono::steady_clock::now()) {}
+
+    ~Permit();
+
+    Permit(const Permit&) = delete;
+    Permit& operator=(const Permit&) = delete;
+
+   private:
+    AdmissionController* controller_;
+    const std::chrono::steady_clock::time_point start_;
+  };
+
+  // name is the prefix of the stats. The permits must not outlive us.
+  explicit AdmissionController(const std::string& name);
+
+  // @return nullptr if the request of priority is shed
+  std::unique_ptr<Permit> TryAcquire(Priority priority);
+
+  uint32_t Limit() const {
+    return limit_.load(std::memory_order_relaxed);
+  }
+
+  uint32_t InFlight() const {
+    return in_flight_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void Release(uint64_t latency_us);
+
+  const std::string accepted_stat_;
+  const std::string rejected_stat_;
+  const std::string limit_stat_;
+  std::atomic<uint32_t> limit_;
+  std::atomic<uint32_t> in_flight_;
+
+  // protects the rest
+  std::mutex mutex_;
+  // the exact limit, limit_ is its floor
+  double exact_limit_;
+  // exponential moving average of the window latencies
+  double long_latency_us_;
+  uint64_t window_latency_us_;
+  uint32_t window_requests_;
+  uint32_t window_max_in_flight_;
+};
+
+}  // namespace common
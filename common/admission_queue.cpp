@@ -0,0 +1,81 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/admission_queue.h"
+
+#include "glog/logging.h"
+
+namespace common {
+
+AdmissionQueue::AdmissionQueue(const uint32_t max_concurrency)
+    : max_concurrency_(max_concurrency)
+    , mutex_()
+    , cv_()
+    , waiters_()
+    , next_arrival_(0)
+    , in_use_(0) {
+  CHECK_GT(max_concurrency_, 0);
+}
+
+std::unique_ptr<AdmissionQueue::Admission> AdmissionQueue::Admit(
+    const uint32_t priority,
+    const uint64_t cost,
+    const std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const Waiter me(priority, cost, next_arrival_++);
+  waiters_.insert(me);
+
+  const bool admitted = cv_.wait_for(lock, timeout, [this, &me] {
+    return in_use_ < max_concurrency_ && *waiters_.begin() == me;
+  });
+
+  waiters_.erase(me);
+  if (!admitted) {
+    // We may have been the head of the queue, so let the next waiter check
+    lock.unlock();
+    cv_.notify_all();
+    return nullptr;
+  }
+
+  ++in_use_;
+  lock.unlock();
+  // There may be more free slots for the waiters behind us
+  cv_.notify_all();
+  return std::make_unique<Admission>(this);
+}
+
+uint32_t AdmissionQueue::QueueDepth() const {
+  std::lock_guard<std::mutex> g(mutex_);
+  return waiters_.size();
+}
+
+uint32_t AdmissionQueue::InUse() const {
+  std::lock_guard<std::mutex> g(mutex_);
+  return in_use_;
+}
+
+void AdmissionQueue::Release() {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    CHECK_GT(in_use_, 0);
+    --in_use_;
+  }
+  cv_.notify_all();
+}
+
+}  // namespace common
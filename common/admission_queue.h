@@ -0,0 +1,82 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <tuple>
+
+namespace common {
+
+/*
+ * AdmissionQueue is a thread safe data structure to limit the number of
+ * concurrent holders of a resource. Callers which can't be admitted right
+ * away wait in the queue. Waiters with lower priority values are admitted
+ * first, then the ones with lower costs, and FIFO otherwise.
+ */
+class AdmissionQueue {
+ public:
+  // Admission is returned by Admit() when the call holds one of the slots,
+  // which is released when it is destroyed.
+  class Admission {
+   public:
+    explicit Admission(AdmissionQueue* queue) : queue_(queue) {}
+    ~Admission() { queue_->Release(); }
+
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+
+   private:
+    AdmissionQueue* queue_;
+  };
+
+  explicit AdmissionQueue(const uint32_t max_concurrency);
+
+  // Wait for at most timeout until one of the slots is free and no waiter
+  // goes before us.
+  // @return nullptr if the call timed out.
+  std::unique_ptr<Admission> Admit(const uint32_t priority,
+                                   const uint64_t cost,
+                                   const std::chrono::milliseconds timeout);
+
+  // The number of the calls waiting to be admitted
+  uint32_t QueueDepth() const;
+
+  // The number of the calls holding a slot
+  uint32_t InUse() const;
+
+ private:
+  // (priority, cost, arrival order)
+  using Waiter = std::tuple<uint32_t, uint64_t, uint64_t>;
+
+  void Release();
+
+  const uint32_t max_concurrency_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::set<Waiter> waiters_;
+  uint64_t next_arrival_;
+  uint32_t in_use_;
+};
+
+}  // namespace common
@@ -0,0 +1,212 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <thrift/lib/cpp2/async/HeaderClientChannel.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/stats/stats.h"
+#include "folly/futures/Future.h"
+#include "folly/futures/Promise.h"
+#include "folly/io/async/EventBase.h"
+
+namespace common {
+
+/*
+ * BatchingFutureClient coalesces small RPCs to one host into batch RPCs.
+ *
+ * Calls to future_call() are collected for up to max_delay or
+ * max_batch_size requests, and then sent as one batch through the user
+ * supplied batch_func, which must return one response per request in the
+ * same order. The responses are fanned out to the futures of the individual
+ * calls, and a failed batch fails all of them.
+ *
+ * Like SafeFutureClient, batch_func is run in the IO thread of the client, so
+ * there is one IO thread hop per batch rather than per call. folly timers
+ * have a millisecond granularity, so a max_delay of 0 sends the batch in the
+ * next loop of the IO thread, which collects the calls made in the meantime,
+ * and other delays are rounded up to milliseconds.
+ *
+ * Create one BatchingFutureClient for each (host, batched method). It is
+ * thread safe.
+ *
+ * Example:
+ *   BatchingFutureClient<CounterServiceAsyncClient, std::string, int64_t>
+ *     batcher(client,
+ *             [] (CounterServiceAsyncClient* client,
+ *                 std::vector<std::string> keys) {
+ *               return client->future_getCounters(keys);
+ *             },
+ *             64, std::chrono::microseconds(0), "get_counter");
+ *   auto f = batcher.future_call("key");
+ */
+template <typename ClientType, typename Request, typename Response>
+class BatchingFutureClient {
+ public:
+  using BatchFunc = std::function<folly::Future<std::vector<Response>>(
+    ClientType*, std::vector<Request>)>;
+
+  BatchingFutureClient(std::shared_ptr<ClientType> client,
+                       BatchFunc batch_func,
+                       const uint32_t max_batch_size,
+                       const std::chrono::microseconds max_delay,
+                       const std::string& name)
+    : state_(std::make_shared<State>()) {
+    state_->evb = dynamic_cast<apache::thrift::HeaderClientChannel*>(
+      client->getChannel())->getEventBase();
+    state_->client = std::move(client);
+    state_->batch_func = std::move(batch_func);
+    state_->max_batch_size = std::max(max_batch_size, 1U);
+    state_->max_delay_ms = static_cast<uint32_t>(
+      (max_delay.count() + 999) / 1000);
+    state_->flush_scheduled = false;
+    state_->batch_size_metric = "batching_client_batch_size name=" + name;
+    state_->batches_stat = "batching_client_batches name=" + name;
+  }
+
+  folly::Future<Response> future_call(Request request) {
+    folly::Promise<Response> p;
+    auto f = p.getFuture();
+
+    Batch full;
+    bool schedule_flush = false;
+    {
+      std::lock_guard<std::mutex> g(state_->mutex);
+      auto& pending = state_->pending;
+      pending.requests.push_back(std::move(request));
+      pending.promises.push_back(std::move(p));
+      if (pending.requests.size() >= state_->max_batch_size) {
+        full = std::move(pending);
+        pending = Batch();
+      } else if (!state_->flush_scheduled) {
+        // A flush scheduled for a batch sent because it was full takes the
+        // next batch, which at worst sends it earlier than max_delay
+        state_->flush_scheduled = true;
+        schedule_flush = true;
+      }
+    }
+
+    auto state = state_;
+    if (!full.requests.empty()) {
+      state->evb->runInEventBaseThread(
+        [state, full = std::move(full)] () mutable {
+          send(state, std::move(full));
+        });
+    } else if (schedule_flush) {
+      state->evb->runInEventBaseThread([state] {
+          if (state->max_delay_ms == 0) {
+            flush(state);
+          } else {
+            state->evb->runAfterDelay([state] { flush(state); },
+                                      state->max_delay_ms);
+          }
+        });
+    }
+
+    return f;
+  }
+
+ private:
+  struct Batch {
+    std::vector<Request> requests;
+    std::vector<folly::Promise<Response>> promises;
+  };
+
+  struct State {
+    std::shared_ptr<ClientType> client;
+    folly::EventBase* evb;
+    BatchFunc batch_func;
+    uint32_t max_batch_size;
+    uint32_t max_delay_ms;
+    std::string batch_size_metric;
+    std::string batches_stat;
+
+    std::mutex mutex;
+    Batch pending;
+    bool flush_scheduled;
+  };
+
+  // Send the pending batch, in the IO thread
+  static void flush(const std::shared_ptr<State>& state) {
+    Batch batch;
+    {
+      std::lock_guard<std::mutex> g(state->mutex);
+      batch = std::move(state->pending);
+      state->pending = Batch();
+      state->flush_scheduled = false;
+    }
+
+    if (!batch.requests.empty()) {
+      send(state, std::move(batch));
+    }
+  }
+
+  // Send batch, in the IO thread
+  static void send(const std::shared_ptr<State>& state, Batch batch) {
+    common::Stats::get()->AddMetric(state->batch_size_metric,
+                                    batch.requests.size());
+    common::Stats::get()->Incr(state->batches_stat);
+
+    folly::Future<std::vector<Response>> f =
+      folly::makeFuture<std::vector<Response>>(
+        std::runtime_error("Batch not sent"));
+    try {
+      f = state->batch_func(state->client.get(), std::move(batch.requests));
+    } catch (const std::exception& ex) {
+      f = folly::makeFuture<std::vector<Response>>(
+        std::runtime_error(ex.what()));
+    }
+
+    f.then([promises = std::move(batch.promises)] (
+        folly::Try<std::vector<Response>>&& t) mutable {
+      if (t.hasException()) {
+        for (auto& p : promises) {
+          p.setException(t.exception());
+        }
+        return;
+      }
+
+      auto& responses = t.value();
+      if (responses.size() != promises.size()) {
+        for (auto& p : promises) {
+          p.setException(std::runtime_error(
+            "Batch response size doesn't match the batch size"));
+        }
+        return;
+      }
+
+      for (size_t i = 0; i < promises.size(); ++i) {
+        promises[i].setValue(std::move(responses[i]));
+      }
+    });
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace common
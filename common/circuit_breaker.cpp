@@ -0,0 +1,197 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/circuit_breaker.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "common/stats/stats.h"
+#include "glog/logging.h"
+
+DEFINE_bool(thrift_router_circuit_breaker, false,
+            "Eject hosts from ThriftRouter by the outcomes of the requests "
+            "reported to them");
+DEFINE_int32(thrift_router_circuit_breaker_window_ms, 10000,
+             "The sliding window over which request outcomes are counted");
+DEFINE_int32(thrift_router_circuit_breaker_min_requests, 20,
+             "Minimum number of requests in the window before a host may be "
+             "ejected");
+DEFINE_int32(thrift_router_circuit_breaker_error_percent, 50,
+             "Eject a host once this percentage of its requests failed or "
+             "were slow");
+DEFINE_int32(thrift_router_circuit_breaker_slow_request_ms, 1000,
+             "Requests slower than this count as failed. 0 disables it");
+DEFINE_int32(thrift_router_circuit_breaker_ejection_ms, 5000,
+             "How long a host is ejected for the first time. It is multiplied "
+             "by the number of consecutive ejections");
+DEFINE_int32(thrift_router_circuit_breaker_max_ejection_ms, 60000,
+             "The maximum ejection time");
+
+namespace {
+
+const std::string kEjections = "thrift_router_host_ejections";
+const std::string kRecoveries = "thrift_router_host_recoveries";
+
+}  // anonymous namespace
+
+namespace common {
+
+CircuitBreaker::CircuitBreaker(const std::string& name)
+    : name_(name)
+    , state_(State::CLOSED)
+    , mutex_()
+    , open_until_ms_(0)
+    , probe_deadline_ms_(0)
+    , probe_in_flight_(false)
+    , consecutive_ejections_(0) {
+  for (auto& bucket : buckets_) {
+    bucket = Bucket{0, 0, 0};
+  }
+}
+
+uint64_t CircuitBreaker::nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool CircuitBreaker::allowRequest() {
+  if (state_.load(std::memory_order_relaxed) == State::CLOSED) {
+    return true;
+  }
+
+  const auto now = nowMs();
+  std::lock_guard<std::mutex> g(mutex_);
+  auto state = state_.load(std::memory_order_relaxed);
+  if (state == State::CLOSED) {
+    return true;
+  }
+
+  if (state == State::OPEN) {
+    if (now < open_until_ms_) {
+      return false;
+    }
+    state_.store(State::HALF_OPEN, std::memory_order_relaxed);
+  } else if (probe_in_flight_ && now < probe_deadline_ms_) {
+    return false;
+  }
+
+  // A probe whose outcome is never reported doesn't block the next one for
+  // long
+  probe_in_flight_ = true;
+  probe_deadline_ms_ =
+    now + std::max(FLAGS_thrift_router_circuit_breaker_ejection_ms, 1);
+  return true;
+}
+
+bool CircuitBreaker::isEjected() const {
+  if (state_.load(std::memory_order_relaxed) == State::CLOSED) {
+    return false;
+  }
+
+  const auto now = nowMs();
+  std::lock_guard<std::mutex> g(mutex_);
+  switch (state_.load(std::memory_order_relaxed)) {
+  case State::OPEN:
+    return now < open_until_ms_;
+  case State::HALF_OPEN:
+    return probe_in_flight_ && now < probe_deadline_ms_;
+  default:
+    return false;
+  }
+}
+
+void CircuitBreaker::onRequestDone(const bool success,
+                                   const uint64_t latency_us) {
+  const bool bad = !success ||
+    (FLAGS_thrift_router_circuit_breaker_slow_request_ms > 0 &&
+     latency_us >
+       static_cast<uint64_t>(FLAGS_thrift_router_circuit_breaker_slow_request_ms)
+         * 1000);
+  const auto now = nowMs();
+
+  std::lock_guard<std::mutex> g(mutex_);
+  const auto state = state_.load(std::memory_order_relaxed);
+  if (state == State::OPEN) {
+    // sent before the circuit opened
+    return;
+  }
+
+  if (state == State::HALF_OPEN) {
+    probe_in_flight_ = false;
+    if (bad) {
+      open(now);
+    } else {
+      close();
+    }
+    return;
+  }
+
+  const uint64_t bucket_ms = std::max(
+    FLAGS_thrift_router_circuit_breaker_window_ms / kNumBuckets, 1U);
+  const uint64_t id = now / bucket_ms + 1;
+  auto& bucket = buckets_[id % kNumBuckets];
+  if (bucket.id != id) {
+    bucket = Bucket{id, 0, 0};
+  }
+  ++bucket.requests;
+  if (!bad) {
+    return;
+  }
+  ++bucket.bad_requests;
+
+  uint64_t requests = 0;
+  uint64_t bad_requests = 0;
+  for (const auto& b : buckets_) {
+    if (b.id + kNumBuckets > id) {
+      requests += b.requests;
+      bad_requests += b.bad_requests;
+    }
+  }
+
+  if (requests >= static_cast<uint64_t>(
+        std::max(FLAGS_thrift_router_circuit_breaker_min_requests, 1)) &&
+      bad_requests * 100 >= requests *
+        FLAGS_thrift_router_circuit_breaker_error_percent) {
+    open(now);
+  }
+}
+
+void CircuitBreaker::open(const uint64_t now_ms) {
+  ++consecutive_ejections_;
+  const uint64_t ejection_ms = std::min<uint64_t>(
+    static_cast<uint64_t>(FLAGS_thrift_router_circuit_breaker_ejection_ms) *
+      consecutive_ejections_,
+    FLAGS_thrift_router_circuit_breaker_max_ejection_ms);
+  open_until_ms_ = now_ms + ejection_ms;
+  state_.store(State::OPEN, std::memory_order_relaxed);
+  Stats::get()->Incr(kEjections);
+  LOG(WARNING) << "Ejecting " << name_ << " for " << ejection_ms << " ms";
+}
+
+void CircuitBreaker::close() {
+  consecutive_ejections_ = 0;
+  for (auto& bucket : buckets_) {
+    bucket = Bucket{0, 0, 0};
+  }
+  state_.store(State::CLOSED, std::memory_order_relaxed);
+  Stats::get()->Incr(kRecoveries);
+  LOG(INFO) << name_ << " recovered";
+}
+
+}  // namespace common
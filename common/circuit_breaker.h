@@ -0,0 +1,94 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "gflags/gflags.h"
+
+DECLARE_bool(thrift_router_circuit_breaker);
+
+namespace common {
+
+/**
+ * CircuitBreaker ejects a host which keeps failing or being slow, based on
+ * the outcomes of the requests sent to it.
+ *
+ * The outcomes are counted over a sliding window of
+ * --thrift_router_circuit_breaker_window_ms. Once it has seen enough requests,
+ * the circuit opens if too many of them failed or were slower than
+ * --thrift_router_circuit_breaker_slow_request_ms. After the ejection time,
+ * which grows with consecutive ejections, it is half open and lets one probe
+ * request through at a time. A good probe closes the circuit, a bad one opens
+ * it again.
+ *
+ * All interfaces are thread safe.
+ */
+class CircuitBreaker {
+ public:
+  enum class State { CLOSED, OPEN, HALF_OPEN };
+
+  // name identifies the host in logs
+  explicit CircuitBreaker(const std::string& name);
+
+  // Return true if a request may be sent now. While half open, it admits the
+  // caller as the probe, so only call it for requests which are sent.
+  bool allowRequest();
+
+  // Return true if allowRequest() would return false now. It admits no probe,
+  // so it is the one to filter the candidate hosts with.
+  bool isEjected() const;
+
+  // Report the outcome of a request
+  void onRequestDone(bool success, uint64_t latency_us);
+
+  State state() const {
+    return state_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static const uint32_t kNumBuckets = 10;
+
+  struct Bucket {
+    uint64_t id;
+    uint32_t requests;
+    uint32_t bad_requests;
+  };
+
+  static uint64_t nowMs();
+
+  // Called with mutex_ held
+  void open(uint64_t now_ms);
+  void close();
+
+  const std::string name_;
+  std::atomic<State> state_;
+
+  mutable std::mutex mutex_;
+  Bucket buckets_[kNumBuckets];
+  uint64_t open_until_ms_;
+  uint64_t probe_deadline_ms_;
+  bool probe_in_flight_;
+  uint32_t consecutive_ejections_;
+};
+
+}  // namespace common
@@ -54,6 +54,17 @@ bool ConcurrentRateLimiter::GetTokens(const uint32_t tokens) {
   }
 }
 
+void ConcurrentRateLimiter::ReturnTokens(const uint32_t tokens) {
+  auto pre_state = atomic_state_.load();
+  while (true) {
+    State new_state(pre_state);
+    new_state.n_tokens_ = std::min<float>(new_state.n_tokens_ + tokens, rate_);
+    if (atomic_state_.compare_exchange_weak(pre_state, new_state)) {
+      return;
+    }
+  }
+}
+
 uint32_t ConcurrentRateLimiter::GetCurrentTimeSeconds() {
   return static_cast<uint32_t>(time(nullptr));
 }
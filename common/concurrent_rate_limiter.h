@@ -58,6 +58,9 @@ class ConcurrentRateLimiter {
   // @return true if it is allowed.
   bool GetTokens(const uint32_t tokens = 1);
 
+  // Give back tokens got from GetTokens() but not used.
+  void ReturnTokens(const uint32_t tokens);
+
  private:
   static uint32_t GetCurrentTimeSeconds();
 
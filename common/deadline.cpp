@@ -0,0 +1,102 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/deadline.h"
+
+#include <algorithm>
+
+#include "folly/Conv.h"
+#include "thrift/lib/cpp/transport/THeader.h"
+#include "thrift/lib/cpp2/async/RequestChannel.h"
+#include "thrift/lib/cpp2/server/Cpp2ConnContext.h"
+
+namespace {
+
+// Set by HeaderClientChannel from RpcOptions' timeout
+const char* const kClientTimeoutHeader = "client_timeout";
+
+bool ParseTimeoutMs(const apache::thrift::transport::THeader::StringToStringMap&
+                      headers,
+                    const char* name,
+                    int64_t* timeout_ms) {
+  auto itor = headers.find(name);
+  if (itor == headers.end()) {
+    return false;
+  }
+
+  auto ret = folly::tryTo<int64_t>(itor->second);
+  if (!ret.hasValue() || ret.value() < 0) {
+    return false;
+  }
+  *timeout_ms = ret.value();
+  return true;
+}
+
+}  // namespace
+
+namespace common {
+
+const char* const Deadline::kDeadlineHeader = "rsp_deadline_budget_ms";
+
+Deadline Deadline::fromRequest(
+    const apache::thrift::Cpp2RequestContext* ctx) {
+  if (ctx == nullptr || ctx->getHeader() == nullptr) {
+    return Deadline();
+  }
+
+  const auto& headers = ctx->getHeader()->getHeaders();
+  int64_t timeout_ms;
+  if (ParseTimeoutMs(headers, kDeadlineHeader, &timeout_ms) ||
+      (ParseTimeoutMs(headers, kClientTimeoutHeader, &timeout_ms) &&
+       timeout_ms > 0)) {
+    return after(std::chrono::milliseconds(timeout_ms));
+  }
+
+  return Deadline();
+}
+
+std::chrono::milliseconds Deadline::remaining() const {
+  if (!isSet()) {
+    return std::chrono::milliseconds::max();
+  }
+
+  const auto now = Clock::now();
+  if (now >= deadline_) {
+    return std::chrono::milliseconds(0);
+  }
+
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    deadline_ - now);
+}
+
+void Deadline::applyTo(apache::thrift::RpcOptions* options) const {
+  if (!isSet()) {
+    return;
+  }
+
+  // At least 1ms, as a 0 timeout means none
+  auto timeout = std::max(remaining(), std::chrono::milliseconds(1));
+  if (options->getTimeout().count() > 0) {
+    timeout = std::min(timeout, options->getTimeout());
+  }
+  options->setTimeout(timeout);
+  options->setWriteHeader(kDeadlineHeader,
+                          folly::to<std::string>(timeout.count()));
+}
+
+}  // namespace common
@@ -0,0 +1,92 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+namespace apache { namespace thrift {
+
+class Cpp2RequestContext;
+class RpcOptions;
+
+}}  // namespace apache::thrift
+
+namespace common {
+
+/*
+ * A request deadline carried across hops.
+ *
+ * It travels as the remaining time budget in milliseconds in the
+ * kDeadlineHeader Thrift header, rather than as a point in time, so that
+ * clock skew between hosts doesn't matter. Each hop turns it back into a
+ * local deadline when it starts handling the request.
+ *
+ * Servers should drop requests whose deadline expired before doing any work
+ * for them, and forward the deadline with applyTo() when calling other
+ * services.
+ */
+class Deadline {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // The header carrying the remaining time budget
+  static const char* const kDeadlineHeader;
+
+  // No deadline
+  Deadline() : deadline_(Clock::time_point::max()) {}
+
+  static Deadline after(const std::chrono::milliseconds timeout) {
+    Deadline d;
+    d.deadline_ = Clock::now() + timeout;
+    return d;
+  }
+
+  // The deadline of the request being handled, from its kDeadlineHeader, or
+  // the Thrift client timeout if the header is missing. No deadline if
+  // neither is there.
+  static Deadline fromRequest(const apache::thrift::Cpp2RequestContext* ctx);
+
+  bool isSet() const {
+    return deadline_ != Clock::time_point::max();
+  }
+
+  bool expired() const {
+    return isSet() && Clock::now() >= deadline_;
+  }
+
+  // The remaining time, 0 if expired and max() if not set
+  std::chrono::milliseconds remaining() const;
+
+  // Forward the deadline to the next hop: write kDeadlineHeader and cap the
+  // timeout of options to the remaining time. Does nothing if not set.
+  void applyTo(apache::thrift::RpcOptions* options) const;
+
+ private:
+  Clock::time_point deadline_;
+};
+
+class DeadlineExceededException : public std::runtime_error {
+ public:
+  explicit DeadlineExceededException(const std::string& what)
+    : std::runtime_error(what) {}
+};
+
+}  // namespace common
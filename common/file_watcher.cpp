@@ -32,6 +32,7 @@
 #include <sys/inotify.h>
 
 #include <string>
+#include <utility>
 
 #include "boost/filesystem.hpp"
 #include "gflags/gflags.h"
@@ -60,7 +61,8 @@ FileWatcher::FileWatcher()
     , handler_(&evb_, fd_, this)
     , thread_()
     , file_names_()
-    , states_() {
+    , states_()
+    , next_generation_(1) {
   CHECK(fd_ != -1) << "Failed to inotify_init()";
 
   CHECK(handler_.registerHandler(folly::EventHandler::EventFlags::READ |
@@ -83,19 +85,47 @@ FileWatcher::~FileWatcher() {
 
 bool FileWatcher::AddFile(const std::string& file_name,
                           std::function<void(std::string)> cb) {
+  return AddFile(file_name, std::move(cb), Options());
+}
+
+bool FileWatcher::AddFile(const std::string& file_name,
+                          std::function<void(std::string)> cb,
+                          const Options& options) {
   bool ret = true;
-  evb_.runInEventBaseThreadAndWait([&ret, &file_name, &cb, this] {
-      auto watch_fd = RegisterFile(file_name);
-      if (watch_fd == -1) {
+  evb_.runInEventBaseThreadAndWait([&ret, &file_name, &cb, &options, this] {
+      if (states_.count(file_name) == 1) {
+        LOG(ERROR) << file_name << " is already being watched, RemoveFile() "
+                   << "first if you want to change its callback.";
+        ret = false;
+        return;
+      }
+
+      auto watch_fd = RegisterFile(file_name, false);
+      if (watch_fd == -1 && options.must_exist) {
         ret = false;
         return;
       }
 
       uint64_t hash;
-      cb(ReadFileAndHash(file_name, &hash));
+      std::string content;
+      if (watch_fd == -1) {
+        hash = folly::hash::SpookyHashV2::Hash64(content.data(), 0, 0);
+      } else {
+        content = ReadFileAndHash(file_name, &hash);
+      }
+
+      auto& state = states_.emplace(
+        file_name, State(std::move(cb), hash, watch_fd, options)).first->second;
+      if (watch_fd == -1) {
+        // watch it once it is created
+        ScheduleRegisterMonitoredFile(file_name);
+      } else {
+        file_names_.emplace(watch_fd, file_name);
+      }
 
-      file_names_.emplace(watch_fd, file_name);
-      states_.emplace(file_name, State(std::move(cb), hash, watch_fd));
+      if (options.callback_on_add) {
+        Callback::Run(state.cb, std::move(content));
+      }
     });
 
   return ret;
@@ -173,7 +203,11 @@ void FileWatcher::ProcessEvents(const char* buf, int sz) {
     }
 
     auto& state = state_itor->second;
-    CheckFileAndCallback(state_itor->first, &state);
+    if (state.options.debounce.count() > 0) {
+      ScheduleDebouncedCheck(state_itor->first, &state);
+    } else {
+      CheckFileAndCallback(state_itor->first, &state);
+    }
   }
 }
 
@@ -250,7 +284,67 @@ void FileWatcher::CheckFileAndCallback(const std::string& file_name,
     common::Stats::get()->Incr("file_change_detected file_name=" +
       boost::filesystem::path(file_name).filename().string());
     state->current_hash = new_hash;
-    state->cb(std::move(content));
+    Callback::Run(state->cb, std::move(content));
   }
 }
+
+void FileWatcher::ScheduleDebouncedCheck(const std::string& file_name,
+                                         State* state) {
+  CHECK(state);
+  const auto generation = next_generation_++;
+  state->generation = generation;
+  try {
+    evb_.runAfterDelay([this, file_name, generation] {
+      auto itor = states_.find(file_name);
+      // removed, or written again since
+      if (itor == states_.end() || itor->second.generation != generation) {
+        return;
+      }
+
+      CheckFileAndCallback(file_name, &itor->second);
+    },
+    state->options.debounce.count());
+  } catch (const std::system_error& err) {
+    LOG(ERROR) << "Failed to schedule checking file: " << file_name
+               << std::endl << err.what();
+    CheckFileAndCallback(file_name, state);
+  }
+}
+
+void FileWatcher::Callback::Run(const std::shared_ptr<Callback>& callback,
+                                std::string content) {
+  if (callback->executor == nullptr) {
+    callback->func(std::move(content));
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> g(callback->lock);
+    callback->pending = std::move(content);
+    callback->has_pending = true;
+    if (callback->running) {
+      // picked up by the running call once it is done
+      return;
+    }
+    callback->running = true;
+  }
+
+  callback->executor->add([callback] {
+      while (true) {
+        std::string latest;
+        {
+          std::lock_guard<std::mutex> g(callback->lock);
+          if (!callback->has_pending) {
+            callback->running = false;
+            return;
+          }
+          latest = std::move(callback->pending);
+          callback->pending.clear();
+          callback->has_pending = false;
+        }
+
+        callback->func(std::move(latest));
+      }
+    });
+}
 }  // namespace common
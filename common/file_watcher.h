@@ -18,9 +18,13 @@
 
 #pragma once
 
+#include <folly/Executor.h>
 #include <folly/io/async/EventBase.h>
 #include <folly/io/async/EventHandler.h>
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -56,6 +60,39 @@ class FileWatcher {
   virtual bool AddFile(const std::string& file_name,
                std::function<void(std::string)> cb);
 
+  struct Options {
+    Options()
+        : debounce(0)
+        , executor(nullptr)
+        , must_exist(true)
+        , callback_on_add(true) {
+    }
+
+    // If positive, a file is read only once it has not been written for
+    // this long, so that a file written several times in a row is read once.
+    std::chrono::milliseconds debounce;
+
+    // If set, cb runs on executor rather than on the watcher thread, one call
+    // at a time. When the calls fall behind, only the latest content is
+    // passed on. Calls may still run after RemoveFile() returns.
+    folly::Executor* executor;
+
+    // If false, a missing file is watched from its creation on, as if it had
+    // been empty
+    bool must_exist;
+
+    // Whether cb is called with the current content when the file is added
+    bool callback_on_add;
+  };
+
+  /*
+   * Add a file to be watched, like AddFile() above, with options.
+   * @return true on success
+   */
+  virtual bool AddFile(const std::string& file_name,
+                       std::function<void(std::string)> cb,
+                       const Options& options);
+
   /*
    * Remove a file from the file list being watched.
    * @return true on success
@@ -83,17 +120,49 @@ class FileWatcher {
   virtual ~FileWatcher();
 
  private:
+  // The callback of a file, run in place or on the executor of its options
+  struct Callback {
+    Callback(std::function<void(std::string)>&& func_arg,
+             folly::Executor* executor_arg)
+        : func(std::move(func_arg))
+        , executor(executor_arg)
+        , lock()
+        , running(false)
+        , has_pending(false)
+        , pending() {
+    }
+
+    static void Run(const std::shared_ptr<Callback>& callback,
+                    std::string content);
+
+    std::function<void(std::string)> func;
+    folly::Executor* const executor;
+    // the following are for calls on executor only
+    std::mutex lock;
+    bool running;
+    bool has_pending;
+    std::string pending;
+  };
+
   struct State {
     State(std::function<void(std::string)>&& cb_arg,
           uint64_t hash_arg,
-          int watch_fd_arg)
-        : cb(std::move(cb_arg))
+          int watch_fd_arg,
+          const Options& options_arg)
+        : cb(std::make_shared<Callback>(std::move(cb_arg),
+                                        options_arg.executor))
         , current_hash(hash_arg)
-        , watch_fd(watch_fd_arg) {
+        , watch_fd(watch_fd_arg)
+        , options(options_arg)
+        , generation(0) {
     }
-    std::function<void(std::string)> cb;
+    std::shared_ptr<Callback> cb;
     uint64_t current_hash;
     int watch_fd;
+    Options options;
+    // of the last write, for the debounced checks to tell whether the file
+    // has been written again since they were scheduled
+    uint64_t generation;
   };
 
   void ReadAndProcessEvents();
@@ -102,6 +171,7 @@ class FileWatcher {
   int RegisterFile(const std::string& file_name, const bool check_dup = true);
   void ScheduleRegisterMonitoredFile(const std::string& file_name);
   void CheckFileAndCallback(const std::string& file_name, State* state);
+  void ScheduleDebouncedCheck(const std::string& file_name, State* state);
 
   struct INotifyHandler : public folly::EventHandler {
     INotifyHandler(folly::EventBase* evb, int fd, FileWatcher* watcher)
@@ -144,5 +214,8 @@ class FileWatcher {
 
   // mapping from file name to states
   std::unordered_map<std::string, State> states_;
+
+  // the generation of the next write of any file
+  uint64_t next_generation_;
 };
 }  // namespace common
@@ -21,12 +21,7 @@
 #include <gflags/gflags.h>
 
 #include "common/global_cpu_executor.h"
-
-#if __GNUC__ >= 8
-#include "folly/executors/CPUThreadPoolExecutor.h"
-#else
-#include "wangle/concurrent/CPUThreadPoolExecutor.h"
-#endif
+#include "folly/Executor.h"
 
 
 DEFINE_bool(delayed_future_with_cpu_executor, false,
@@ -42,7 +37,7 @@ folly::Future<folly::Unit> GenerateDelayedFuture(folly::Duration delay) {
 #endif
 
   if (FLAGS_delayed_future_with_cpu_executor) {
-    future = future.via(common::getGlobalCPUExecutor());
+    future = future.via(common::getGlobalExecutor());
   }
 
   return future;
@@ -22,6 +22,8 @@
 #include <glog/logging.h>
 
 #include "common/identical_name_thread_factory.h"
+#include "common/thread_placement.h"
+#include "common/work_stealing_executor.h"
 #if __GNUC__ >= 8
 #include "folly/executors/CPUThreadPoolExecutor.h"
 #else
@@ -40,6 +42,14 @@ DEFINE_bool(block_on_global_cpu_pool_full, true,
 DEFINE_string(global_cpu_thread_pool_name, "g-cpu-pool",
               "The name for threads in the global cpu pool");
 
+DEFINE_string(global_cpu_pool_cpus, "",
+              "The CPUs to pin the threads of the global cpu pool to, see "
+              "common::ThreadPlacement for the format");
+
+DEFINE_bool(global_cpu_executor_work_stealing, false,
+            "Use a WorkStealingExecutor, with per thread queues and two "
+            "priorities, for getGlobalExecutor()");
+
 #if __GNUC__ >= 8
 using folly::CPUThreadPoolExecutor;
 using folly::LifoSemMPMCQueue;
@@ -83,7 +93,8 @@ CPUThreadPoolExecutor* getGlobalCPUExecutor() {
         LifoSemMPMCQueue<CPUThreadPoolExecutor::CPUTask,
         QueueBehaviorIfFull::BLOCK>>(GetQueueSize()),
       std::make_shared<IdenticalNameThreadFactory>(
-        FLAGS_global_cpu_thread_pool_name));
+        FLAGS_global_cpu_thread_pool_name,
+        ThreadPlacement::Create(FLAGS_global_cpu_pool_cpus)));
 
     return &g_executor;
   } else {
@@ -93,10 +104,35 @@ CPUThreadPoolExecutor* getGlobalCPUExecutor() {
         LifoSemMPMCQueue<CPUThreadPoolExecutor::CPUTask,
         QueueBehaviorIfFull::THROW>>(GetQueueSize()),
       std::make_shared<IdenticalNameThreadFactory>(
-        FLAGS_global_cpu_thread_pool_name));
+        FLAGS_global_cpu_thread_pool_name,
+        ThreadPlacement::Create(FLAGS_global_cpu_pool_cpus)));
 
     return &g_executor;
   }
 }
 
+folly::Executor* getGlobalExecutor() {
+  if (!FLAGS_global_cpu_executor_work_stealing) {
+    return getGlobalCPUExecutor();
+  }
+
+  static WorkStealingExecutor g_executor(
+    GetThreadsCount(),
+    GetQueueSize(),
+    FLAGS_block_on_global_cpu_pool_full,
+    FLAGS_global_cpu_thread_pool_name,
+    ThreadPlacement::Create(FLAGS_global_cpu_pool_cpus));
+
+  return &g_executor;
+}
+
+uint64_t getGlobalExecutorPendingTaskCount() {
+  if (!FLAGS_global_cpu_executor_work_stealing) {
+    return getGlobalCPUExecutor()->getPoolStats().pendingTaskCount;
+  }
+
+  return static_cast<WorkStealingExecutor*>(
+    getGlobalExecutor())->getPendingTaskCount();
+}
+
 }  // namespace common
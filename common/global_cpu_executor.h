@@ -18,6 +18,14 @@
 
 #pragma once
 
+#include <cstdint>
+
+namespace folly {
+
+class Executor;
+
+}
+
 #if __GNUC__ >= 8
 namespace folly {
 #else
@@ -43,4 +51,17 @@ folly::CPUThreadPoolExecutor* getGlobalCPUExecutor();
 wangle::CPUThreadPoolExecutor* getGlobalCPUExecutor();
 #endif
 
+/*
+ * Return the global CPU executor. It is the WorkStealingExecutor if
+ * --global_cpu_executor_work_stealing is set, which runs
+ * addWithPriority(func, folly::Executor::LO_PRI) after the other tasks, and
+ * getGlobalCPUExecutor() otherwise. The same NOTE applies.
+ */
+folly::Executor* getGlobalExecutor();
+
+/*
+ * The number of tasks waiting in the queue(s) of getGlobalExecutor()
+ */
+uint64_t getGlobalExecutorPendingTaskCount();
+
 }  // namespace common
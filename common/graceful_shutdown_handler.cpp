@@ -18,6 +18,7 @@
 
 #include "common/graceful_shutdown_handler.h"
 
+#include <algorithm>
 #include <csignal>
 #include "glog/logging.h"
 
@@ -29,7 +30,12 @@ GracefulShutdownHandler::GracefulShutdownHandler(
   : AsyncSignalHandler(server->getEventBaseManager()->getEventBase())
   , server_(std::move(server))
   , pre_shutdown_handlers_()
-  , post_shutdown_handlers_() {
+  , post_shutdown_handlers_()
+  , drain_handlers_()
+  , drain_enabled_(false)
+  , drain_min_wait_(0)
+  , drain_timeout_(0)
+  , draining_(false) {
 }
 
 void GracefulShutdownHandler::signalReceived(int signum) noexcept {
@@ -52,7 +58,56 @@ void GracefulShutdownHandler::RegisterShutdownSignal(int signum) {
   registerSignalHandler(signum);
 }
 
+void GracefulShutdownHandler::EnableDrain(
+    std::chrono::milliseconds min_wait,
+    std::chrono::milliseconds drain_timeout) {
+  drain_enabled_ = true;
+  drain_min_wait_ = min_wait;
+  drain_timeout_ = std::max(min_wait, drain_timeout);
+}
+
+void GracefulShutdownHandler::RegisterDrainHandler(
+    std::function<void()> handler) {
+  drain_handlers_.push_back(std::move(handler));
+}
+
+void GracefulShutdownHandler::CheckDrained() {
+  const auto now = std::chrono::steady_clock::now();
+  const auto in_flight = server_->getActiveRequests();
+  if (now < drain_start_ + drain_timeout_ &&
+      (now < drain_start_ + drain_min_wait_ || in_flight > 0)) {
+    // keep the event base running, it accepts the connections until the
+    // routers have moved away
+    getEventBase()->runAfterDelay([this] { CheckDrained(); }, 10);
+    return;
+  }
+
+  LOG(INFO) << "Drained with " << in_flight << " requests in flight after "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 now - drain_start_).count() << " ms";
+  Shutdown();
+}
+
 void GracefulShutdownHandler::InitiateGracefulShutdown() {
+  if (draining_.exchange(true)) {
+    LOG(INFO) << "Already shutting down";
+    return;
+  }
+
+  if (!drain_enabled_) {
+    Shutdown();
+    return;
+  }
+
+  for (auto& handler : drain_handlers_) {
+    handler();
+  }
+  LOG(INFO) << "Draining...";
+  drain_start_ = std::chrono::steady_clock::now();
+  CheckDrained();
+}
+
+void GracefulShutdownHandler::Shutdown() {
   // first, invoke pre-shutdown handlers if there is any
   auto ritr = pre_shutdown_handlers_.rbegin();
   for ( ; ritr != pre_shutdown_handlers_.rend(); ++ritr) {
@@ -18,7 +18,10 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <vector>
 
 #include "folly/io/async/AsyncSignalHandler.h"
@@ -33,6 +36,12 @@ namespace common {
  * This handler should be registered in the same thread as what will call
  * server->serve() later.
  *
+ * With drain enabled, the shutdown starts with a drain phase: the drain
+ * handlers run first to take the host out of routing, then the server keeps
+ * serving for at least min_wait, so that the routers see it, and until no
+ * request is in flight or drain_timeout has passed. Only then does it stop
+ * listening and run the post-shutdown handlers, e.g. to flush the dbs.
+ *
  * NB: the program who uses GracefulShutdownHandler should NOT register other
  * AsyncSignalHandler anywhere else through out the program!
  */
@@ -45,16 +54,37 @@ class GracefulShutdownHandler : public folly::AsyncSignalHandler {
   void RegisterPostShutdownHandler(std::function<void()> handler);
   void RegisterShutdownSignal(int signum);
 
+  // Drain for at least min_wait and at most drain_timeout before shutting down
+  void EnableDrain(std::chrono::milliseconds min_wait,
+                   std::chrono::milliseconds drain_timeout);
+  // Handlers to mark the host unhealthy for routing, run as the drain starts
+  void RegisterDrainHandler(std::function<void()> handler);
+
+  // Return true once the shutdown has started
+  bool IsDraining() const {
+    return draining_.load();
+  }
+
   void signalReceived(int signum) noexcept override;
 
  private:
   void InitiateGracefulShutdown();
+  // Shut down once drained, checked on the event base every 10ms
+  void CheckDrained();
+  void Shutdown();
   // the thrift server to perfrom graceful shutdown
   std::shared_ptr<apache::thrift::ThriftServer> server_;
   // a list of pre-shutdown handlers
   std::vector<std::function<void()>> pre_shutdown_handlers_;
   // a list of post-shutdown handlers
   std::vector<std::function<void()>> post_shutdown_handlers_;
+  // a list of drain handlers
+  std::vector<std::function<void()>> drain_handlers_;
+  bool drain_enabled_;
+  std::chrono::milliseconds drain_min_wait_;
+  std::chrono::milliseconds drain_timeout_;
+  std::chrono::steady_clock::time_point drain_start_;
+  std::atomic<bool> draining_;
 };
 
 }  // namespace common
@@ -0,0 +1,264 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+DECLARE_int32(hot_key_detector_decay_time_seconds);
+
+namespace common {
+
+/**
+ * A detector of the heaviest keys among many, for which HotKeyDetector can't
+ * tell keys taking a few percents of the load from the others, e.g. a key
+ * taking 1% of the load among millions of keys. Like HotKeyDetector, all
+ * public interface is protected by a mutex, and the load decays by half every
+ * --hot_key_detector_decay_time_seconds.
+ *
+ * @algorithm
+ * The load of the keys is counted in a Count-Min sketch of kDepth rows of
+ * width counters, each one indexed by a different hash of the key. The load
+ * of a key is estimated as the smallest of its counters, which is never below
+ * its actual load, and above it by at most e/width of the total load with
+ * probability 1 - e^-kDepth. Counters are only raised as much as needed for
+ * the new estimate (conservative update), which reduces the error further.
+ *
+ * The top_k_capacity keys of the largest estimates are kept as candidates.
+ * A key recorded with an estimate larger than the smallest candidate replaces
+ * it, so getTopK() costs O(top_k_capacity) whatever the number of keys.
+ *
+ * The counters of each row are contiguous, and decaying them is a loop the
+ * compiler vectorizes.
+ */
+template<typename K, typename Hash = std::hash<K>>
+class HeavyHitterDetector {
+ public:
+  /**
+   * @param width The number of counters per row, rounded up to a power of 2.
+   * e/width should be well below the ratio of the load of the keys to detect.
+   * @param top_k_capacity The max number of keys getTopK() returns
+   */
+  explicit HeavyHitterDetector(uint32_t width = 8192,
+                               uint32_t top_k_capacity = 32)
+    : mask_(roundUpToPowerOf2(width) - 1)
+    , counters_(kDepth * (mask_ + 1), 0)
+    , top_k_capacity_(std::max<uint32_t>(top_k_capacity, 1))
+    , candidates_()
+    , min_candidate_load_(0)
+    , total_recorded_load_(0)
+    , last_decay_time_(std::chrono::steady_clock::now())
+    , hash_()
+    , mtx_() {
+  }
+
+  /**
+   * Record load for the key
+   */
+  void record(const K& key, uint64_t load = 1) {
+    uint32_t idx[kDepth];
+    getIndices(key, idx);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    decayByTime();
+
+    total_recorded_load_ += load;
+
+    auto estimate = std::min<uint64_t>(estimateLocked(idx) + load,
+                                  std::numeric_limits<uint32_t>::max());
+    for (int i = 0; i < kDepth; ++i) {
+      if (counters_[idx[i]] < estimate) {
+        counters_[idx[i]] = estimate;
+      }
+    }
+
+    updateCandidates(key, estimate);
+  }
+
+  /**
+   * Estimate the load of the key, which is never below its recorded load
+   */
+  uint64_t estimate(const K& key) const {
+    uint32_t idx[kDepth];
+    getIndices(key, idx);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    return estimateLocked(idx);
+  }
+
+  /**
+   * Approximately check if the key's load is above percents percentages,
+   * which may be a fraction of 1
+   */
+  bool isAbove(const K& key, double percents) const {
+    uint32_t idx[kDepth];
+    getIndices(key, idx);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    return 100 * estimateLocked(idx) > percents * total_recorded_load_;
+  }
+
+  /**
+   * Get the (at most) k keys of the largest load, with their estimated load,
+   * in descending order of the load. k is capped at top_k_capacity.
+   */
+  std::vector<std::pair<K, uint64_t>> getTopK(uint32_t k) const {
+    std::vector<std::pair<K, uint64_t>> top_k;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      top_k.assign(candidates_.begin(), candidates_.end());
+    }
+
+    k = std::min<uint32_t>(k, top_k.size());
+    std::partial_sort(top_k.begin(), top_k.begin() + k, top_k.end(),
+                      [] (const std::pair<K, uint64_t>& a,
+                          const std::pair<K, uint64_t>& b) {
+                        return a.second > b.second;
+                      });
+    top_k.resize(k);
+
+    return top_k;
+  }
+
+  /**
+   * The sum of the recorded load, after decay
+   */
+  uint64_t totalLoad() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    return total_recorded_load_;
+  }
+
+ private:
+  static uint32_t roundUpToPowerOf2(uint32_t n) {
+    uint32_t power = 1;
+    while (power < n && power < (1u << 31)) {
+      power <<= 1;
+    }
+
+    return power;
+  }
+
+  // The counter index of the key in each row. Rows use different hashes of
+  // the key derived from a single one by double hashing.
+  void getIndices(const K& key, uint32_t* idx) const {
+    const uint64_t h = hash_(key);
+    const uint32_t h1 = static_cast<uint32_t>(h);
+    // odd, so that the hashes of the rows differ
+    const uint32_t h2 = static_cast<uint32_t>(h >> 32) | 1;
+    for (int i = 0; i < kDepth; ++i) {
+      idx[i] = i * (mask_ + 1) + ((h1 + i * h2) & mask_);
+    }
+  }
+
+  // Must hold mtx_
+  uint64_t estimateLocked(const uint32_t* idx) const {
+    uint64_t estimate = std::numeric_limits<uint64_t>::max();
+    for (int i = 0; i < kDepth; ++i) {
+      estimate = std::min<uint64_t>(estimate, counters_[idx[i]]);
+    }
+
+    return estimate;
+  }
+
+  // Must hold mtx_
+  void updateCandidates(const K& key, uint64_t estimate) {
+    auto itor = candidates_.find(key);
+    if (itor != candidates_.end()) {
+      itor->second = estimate;
+      return;
+    }
+
+    if (candidates_.size() < top_k_capacity_) {
+      candidates_.emplace(key, estimate);
+      min_candidate_load_ = candidates_.size() == 1 ?
+        estimate : std::min(min_candidate_load_, estimate);
+      return;
+    }
+
+    if (estimate <= min_candidate_load_) {
+      return;
+    }
+
+    // Replace the smallest candidate. The cached min may be stale, as the
+    // load of candidates only grows between decays, so find it again.
+    auto min_itor = std::min_element(candidates_.begin(), candidates_.end(),
+      [] (const std::pair<const K, uint64_t>& a,
+          const std::pair<const K, uint64_t>& b) {
+        return a.second < b.second;
+      });
+    if (estimate <= min_itor->second) {
+      min_candidate_load_ = min_itor->second;
+      return;
+    }
+
+    candidates_.erase(min_itor);
+    candidates_.emplace(key, estimate);
+    min_candidate_load_ = std::min_element(candidates_.begin(),
+                                           candidates_.end(),
+      [] (const std::pair<const K, uint64_t>& a,
+          const std::pair<const K, uint64_t>& b) {
+        return a.second < b.second;
+      })->second;
+  }
+
+  // Must hold mtx_
+  void decayByTime() {
+    auto now = std::chrono::steady_clock::now();
+    auto diff = now - last_decay_time_;
+    if (std::chrono::duration_cast<std::chrono::seconds>(diff).count() <
+        FLAGS_hot_key_detector_decay_time_seconds) {
+      return;
+    }
+
+    total_recorded_load_ >>= 1;
+    for (auto& counter : counters_) {
+      counter >>= 1;
+    }
+    for (auto& candidate : candidates_) {
+      candidate.second >>= 1;
+    }
+    min_candidate_load_ >>= 1;
+    last_decay_time_ = now;
+  }
+
+  static constexpr int kDepth = 4;
+
+  const uint32_t mask_;
+  // kDepth rows of mask_ + 1 counters
+  std::vector<uint32_t> counters_;
+  const uint32_t top_k_capacity_;
+  std::unordered_map<K, uint64_t, Hash> candidates_;
+  uint64_t min_candidate_load_;
+  uint64_t total_recorded_load_;
+  std::chrono::time_point<std::chrono::steady_clock> last_decay_time_;
+  const Hash hash_;
+  mutable std::mutex mtx_;
+};
+
+}  // namespace common
@@ -0,0 +1,154 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/hedging_policy.h"
+
+#include <algorithm>
+
+#include "common/stats/stats.h"
+#include "gflags/gflags.h"
+
+DEFINE_double(thrift_router_hedge_percentile, 95,
+              "The latency percentile after which a request is hedged");
+DEFINE_double(thrift_router_hedge_max_percent, 5,
+              "Maximum percentage of the requests which are hedged");
+DEFINE_int32(thrift_router_hedge_default_delay_ms, 20,
+             "The hedge delay before enough latencies are recorded");
+DEFINE_int32(thrift_router_hedge_min_delay_ms, 1,
+             "The minimum hedge delay");
+
+namespace {
+
+// Samples needed before the percentile is trusted
+const uint64_t kMinSamples = 100;
+// Recompute the hedge delay every so many samples
+const uint64_t kRefreshInterval = 256;
+// Halve the histogram beyond this many samples, to follow recent latencies
+const uint64_t kMaxSamples = 16384;
+// Hedges which may be sent at once, in thousandths of a hedge
+const int64_t kMaxHedgeBudget = 10 * 1000;
+
+}  // anonymous namespace
+
+namespace common {
+
+HedgingPolicy::HedgingPolicy(const std::string& segment)
+    : n_samples_(0)
+    , refreshing_(false)
+    , hedge_delay_us_(FLAGS_thrift_router_hedge_default_delay_ms * 1000)
+    , hedge_budget_(kMaxHedgeBudget)
+    , requests_stat_("thrift_router_hedgeable_requests segment=" + segment)
+    , hedges_stat_("thrift_router_hedges segment=" + segment)
+    , hedge_wins_stat_("thrift_router_hedge_wins segment=" + segment) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0);
+  }
+}
+
+uint32_t HedgingPolicy::bucketIndex(const uint64_t latency_us) {
+  if (latency_us < 2) {
+    return 0;
+  }
+
+  // Two buckets for each power of 2
+  const uint32_t log2 = 63 - __builtin_clzll(latency_us);
+  const uint32_t half = (latency_us >> (log2 - 1)) & 1;
+  return std::min(2 * log2 + half - 1, kNumBuckets - 1);
+}
+
+uint64_t HedgingPolicy::bucketUpperBound(const uint32_t idx) {
+  const uint32_t log2 = (idx + 1) / 2;
+  const uint64_t base = 1ULL << log2;
+  return (idx + 1) % 2 == 0 ? base + base / 2 : 2 * base;
+}
+
+void HedgingPolicy::recordLatency(const uint64_t latency_us) {
+  buckets_[bucketIndex(latency_us)].fetch_add(1, std::memory_order_relaxed);
+  const auto n = n_samples_.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (n >= kMinSamples && n % kRefreshInterval == 0) {
+    refreshHedgeDelay();
+  }
+}
+
+void HedgingPolicy::refreshHedgeDelay() {
+  if (refreshing_.exchange(true)) {
+    return;
+  }
+
+  uint64_t counts[kNumBuckets];
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < kNumBuckets; ++i) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+
+  const auto target = static_cast<uint64_t>(
+    total * FLAGS_thrift_router_hedge_percentile / 100);
+  uint64_t sum = 0;
+  uint32_t idx = 0;
+  for (; idx < kNumBuckets - 1; ++idx) {
+    sum += counts[idx];
+    if (sum >= target) {
+      break;
+    }
+  }
+
+  const uint64_t min_delay_us = FLAGS_thrift_router_hedge_min_delay_ms * 1000;
+  hedge_delay_us_.store(std::max(bucketUpperBound(idx), min_delay_us),
+                        std::memory_order_relaxed);
+
+  if (total > kMaxSamples) {
+    for (uint32_t i = 0; i < kNumBuckets; ++i) {
+      buckets_[i].fetch_sub(counts[i] / 2, std::memory_order_relaxed);
+    }
+    n_samples_.fetch_sub(total / 2, std::memory_order_relaxed);
+  }
+
+  refreshing_.store(false);
+}
+
+void HedgingPolicy::onRequest() {
+  Stats::get()->Incr(requests_stat_);
+  const auto earned =
+    static_cast<int64_t>(FLAGS_thrift_router_hedge_max_percent * 10);
+  const auto budget =
+    hedge_budget_.fetch_add(earned, std::memory_order_relaxed) + earned;
+  if (budget > kMaxHedgeBudget) {
+    hedge_budget_.fetch_sub(budget - kMaxHedgeBudget,
+                            std::memory_order_relaxed);
+  }
+}
+
+bool HedgingPolicy::tryAcquireHedge() {
+  auto budget = hedge_budget_.load(std::memory_order_relaxed);
+  do {
+    if (budget < 1000) {
+      return false;
+    }
+  } while (!hedge_budget_.compare_exchange_weak(
+             budget, budget - 1000, std::memory_order_relaxed));
+
+  Stats::get()->Incr(hedges_stat_);
+  return true;
+}
+
+void HedgingPolicy::onHedgeWon() {
+  Stats::get()->Incr(hedge_wins_stat_);
+}
+
+}  // namespace common
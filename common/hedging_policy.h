@@ -0,0 +1,80 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace common {
+
+/**
+ * HedgingPolicy decides when and how often requests to a segment are hedged.
+ *
+ * It tracks a log scale histogram of the request latencies, and the hedge
+ * delay is a percentile of it (--thrift_router_hedge_percentile). Hedges are
+ * capped to --thrift_router_hedge_max_percent of the requests by a token
+ * bucket, so that a slow segment doesn't get twice the traffic.
+ *
+ * All interfaces are thread safe.
+ */
+class HedgingPolicy {
+ public:
+  explicit HedgingPolicy(const std::string& segment);
+
+  // Record the latency of a successful request
+  void recordLatency(uint64_t latency_us);
+
+  // The delay after which the backup request is sent
+  std::chrono::microseconds getHedgeDelay() const {
+    return std::chrono::microseconds(
+      hedge_delay_us_.load(std::memory_order_relaxed));
+  }
+
+  // A request which may be hedged is sent
+  void onRequest();
+
+  // Return true if a backup request may be sent, which consumes the budget
+  bool tryAcquireHedge();
+
+  // The backup request succeeded first
+  void onHedgeWon();
+
+ private:
+  static const uint32_t kNumBuckets = 64;
+
+  static uint32_t bucketIndex(uint64_t latency_us);
+  static uint64_t bucketUpperBound(uint32_t idx);
+
+  void refreshHedgeDelay();
+
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+  std::atomic<uint64_t> n_samples_;
+  std::atomic<bool> refreshing_;
+  std::atomic<uint64_t> hedge_delay_us_;
+  // In thousandths of a hedge
+  std::atomic<int64_t> hedge_budget_;
+
+  const std::string requests_stat_;
+  const std::string hedges_stat_;
+  const std::string hedge_wins_stat_;
+};
+
+}  // namespace common
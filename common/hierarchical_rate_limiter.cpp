@@ -0,0 +1,154 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/hierarchical_rate_limiter.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "common/future_util.h"
+#include "folly/Likely.h"
+#include "glog/logging.h"
+
+namespace common {
+
+std::shared_ptr<HierarchicalRateLimiter> HierarchicalRateLimiter::Create(
+    double rate,
+    std::shared_ptr<HierarchicalRateLimiter> parent,
+    std::function<uint64_t(void)> clock) {
+  return std::shared_ptr<HierarchicalRateLimiter>(
+    new HierarchicalRateLimiter(rate, std::move(parent), std::move(clock)));
+}
+
+HierarchicalRateLimiter::HierarchicalRateLimiter(
+    double rate,
+    std::shared_ptr<HierarchicalRateLimiter> parent,
+    std::function<uint64_t(void)> clock)
+    : rate_(rate)
+    , parent_(std::move(parent))
+    , clock_(std::move(clock))
+    , atomic_state_() {
+  CHECK_GT(rate_, 0);
+  State s;
+  s.last_update_ms_ = static_cast<uint32_t>(clock_());
+  s.n_tokens_ = rate_;
+  atomic_state_.store(s);
+}
+
+HierarchicalRateLimiter::State HierarchicalRateLimiter::Refill(
+    State state, const uint32_t now_ms) const {
+  // the clock wraps every 49 days, and racing threads may read it out of
+  // order
+  const auto elapsed_ms =
+    static_cast<int32_t>(now_ms - state.last_update_ms_);
+  if (elapsed_ms > 0) {
+    state.n_tokens_ = std::min<double>(
+      state.n_tokens_ + elapsed_ms * rate_ / 1000, rate_);
+    state.last_update_ms_ = now_ms;
+  }
+  return state;
+}
+
+bool HierarchicalRateLimiter::TakeOwnTokens(const uint32_t tokens) {
+  auto pre_state = atomic_state_.load();
+  while (true) {
+    auto new_state = Refill(pre_state, static_cast<uint32_t>(clock_()));
+    if (new_state.n_tokens_ < tokens &&
+        new_state.n_tokens_ < static_cast<float>(rate_)) {
+      return false;
+    }
+
+    new_state.n_tokens_ -= tokens;
+
+    if (atomic_state_.compare_exchange_weak(pre_state, new_state)) {
+      return true;
+    }
+  }
+}
+
+void HierarchicalRateLimiter::ChargeTokens(const uint32_t tokens) {
+  auto pre_state = atomic_state_.load();
+  while (true) {
+    auto new_state = Refill(pre_state, static_cast<uint32_t>(clock_()));
+    new_state.n_tokens_ = std::max<double>(new_state.n_tokens_ - tokens,
+                                           -rate_);
+
+    if (atomic_state_.compare_exchange_weak(pre_state, new_state)) {
+      return;
+    }
+  }
+}
+
+bool HierarchicalRateLimiter::TakeTokens(const uint32_t tokens) {
+  if (TakeOwnTokens(tokens)) {
+    for (auto node = parent_.get(); node; node = node->parent_.get()) {
+      node->ChargeTokens(tokens);
+    }
+    return true;
+  }
+
+  // borrow the capacity left unused by the siblings
+  return parent_ && parent_->TakeTokens(tokens);
+}
+
+bool HierarchicalRateLimiter::TryGetTokens(const uint32_t tokens) {
+  if (UNLIKELY(tokens <= 0)) {
+    return true;
+  }
+
+  return TakeTokens(tokens);
+}
+
+folly::Future<folly::Unit> HierarchicalRateLimiter::GetTokens(
+    const uint32_t tokens) {
+  if (TryGetTokens(tokens)) {
+    return folly::makeFuture();
+  }
+
+  // Retry once the first node on the way up could have the tokens
+  return GenerateDelayedFuture(std::chrono::milliseconds(GetWaitMs(tokens)))
+    .then([self = shared_from_this(), tokens] {
+        return self->GetTokens(tokens);
+      });
+}
+
+uint64_t HierarchicalRateLimiter::GetWaitMs(const uint32_t tokens) {
+  double wait_ms = -1;
+  for (auto node = this; node; node = node->parent_.get()) {
+    const auto missing =
+      std::min<double>(tokens, node->rate_) - node->GetAvailableTokens();
+    const auto node_wait_ms = std::max(missing, 0.0) * 1000 / node->rate_;
+    if (wait_ms < 0 || node_wait_ms < wait_ms) {
+      wait_ms = node_wait_ms;
+    }
+  }
+
+  return std::max<uint64_t>(static_cast<uint64_t>(wait_ms), 1);
+}
+
+double HierarchicalRateLimiter::GetAvailableTokens() {
+  return Refill(atomic_state_.load(),
+                static_cast<uint32_t>(clock_())).n_tokens_;
+}
+
+uint64_t HierarchicalRateLimiter::GetCurrentTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace common
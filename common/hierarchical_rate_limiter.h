@@ -0,0 +1,121 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#if __GNUC__ >= 8
+#include "folly/synchronization/AtomicStruct.h"
+#else
+#include "folly/AtomicStruct.h"
+#endif
+#include "folly/futures/Future.h"
+
+namespace common {
+
+/*
+ * HierarchicalRateLimiter is a thread safe tree of token buckets, e.g. a
+ * per host limiter with a child per segment, which has a child per DB.
+ *
+ * Each node refills "rate" tokens per second, up to "rate" tokens. Tokens
+ * taken from a node are charged to all its ancestors too, which may go into
+ * debt for it. So the tokens a node has left are the capacity its children
+ * didn't use. A node out of tokens borrows them from its parent, which
+ * borrows from its own parent in turn. With the rates of the children adding
+ * up to the rate of their parent, every node gets its own rate, and unused
+ * capacity goes to the siblings which want more.
+ *
+ * Like ConcurrentRateLimiter, the state of each node is a folly::AtomicStruct
+ * updated lock free.
+ *
+ * // Example usage
+ * auto host = HierarchicalRateLimiter::Create(100 << 20);
+ * auto segment = HierarchicalRateLimiter::Create(50 << 20, host);
+ * auto db = HierarchicalRateLimiter::Create(10 << 20, segment);
+ * db->GetTokens(n_bytes).then([] { ... });
+ */
+class HierarchicalRateLimiter
+    : public std::enable_shared_from_this<HierarchicalRateLimiter> {
+  struct State {
+    // the lower 32 bits of the clock
+    uint32_t last_update_ms_;
+    float n_tokens_;
+  };
+
+ public:
+  // Create a node allowing "rate" tokens per second, which is a child of
+  // parent if it is not nullptr. The parent is kept alive by its children.
+  // clock returns the current time in milliseconds.
+  static std::shared_ptr<HierarchicalRateLimiter> Create(
+      double rate,
+      std::shared_ptr<HierarchicalRateLimiter> parent = nullptr,
+      std::function<uint64_t(void)> clock = GetCurrentTimeMs);
+
+  // Try to get some tokens now, from this node or by borrowing from its
+  // ancestors.
+  // @return true if it is allowed.
+  bool TryGetTokens(uint32_t tokens = 1);
+
+  // Get some tokens, waiting asynchronously until they are available.
+  // Requests of more tokens than a node holds are allowed once it is full.
+  // @return a future fulfilled once the tokens are taken.
+  folly::Future<folly::Unit> GetTokens(uint32_t tokens = 1);
+
+  // The tokens this node has now, negative in debt.
+  double GetAvailableTokens();
+
+  double rate() const {
+    return rate_;
+  }
+
+  // no copy or move
+  HierarchicalRateLimiter(const HierarchicalRateLimiter&) = delete;
+  HierarchicalRateLimiter& operator=(const HierarchicalRateLimiter&) = delete;
+
+ private:
+  HierarchicalRateLimiter(double rate,
+                          std::shared_ptr<HierarchicalRateLimiter> parent,
+                          std::function<uint64_t(void)> clock);
+
+  static uint64_t GetCurrentTimeMs();
+
+  // The state refilled up to now
+  State Refill(State state, uint32_t now_ms) const;
+
+  // Take tokens from this node only if it has them, or it is full.
+  bool TakeOwnTokens(uint32_t tokens);
+
+  // Take tokens from this node regardless, in debt of at most "rate".
+  void ChargeTokens(uint32_t tokens);
+
+  // Take tokens from this node or by borrowing, and charge the ancestors.
+  bool TakeTokens(uint32_t tokens);
+
+  // The time until tokens may be taken
+  uint64_t GetWaitMs(uint32_t tokens);
+
+  const double rate_;
+  const std::shared_ptr<HierarchicalRateLimiter> parent_;
+  const std::function<uint64_t(void)> clock_;
+  folly::AtomicStruct<State> atomic_state_;
+};
+
+}  // namespace common
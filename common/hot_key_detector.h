@@ -16,16 +16,161 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <memory>
 #include <mutex>
 #include <vector>
 
+#include "folly/ThreadLocal.h"
+#if __GNUC__ >= 8
+#include "folly/synchronization/Rcu.h"
+#else
+#include "folly/RWSpinLock.h"
+#endif
 #include "gflags/gflags.h"
 
 DECLARE_int32(hot_key_detector_decay_time_seconds);
 
 namespace common {
 
+namespace detail {
+
+/**
+ * The buckets of hot key detectors, see the algorithm of HotKeyDetector below.
+ * Not thread-safe.
+ */
+template<typename K>
+struct HotKeyBuckets {
+  HotKeyBuckets()
+    : keys()
+    , load()
+    , next_idx(0)
+    , total_records(0)
+    , total_recorded_load(0) {
+  }
+
+  void record(const K& key, uint64_t key_load) {
+    ++total_records;
+    total_recorded_load += key_load;
+    int first_empty_bucket = -1;
+    for (int i = 0; i < kBucketNumber; ++i) {
+      if (key == keys[i]) {
+        load[i] += key_load;
+        return;
+      }
+
+      if (first_empty_bucket == -1 && load[i] == 0) {
+        first_empty_bucket = i;
+      }
+    }
+
+    // couldn't find the key and there is an empty bucket
+    if (first_empty_bucket != -1) {
+      keys[first_empty_bucket] = key;
+      load[first_empty_bucket] = key_load;
+      return;
+    }
+
+    // couldn't find the key and there is no empty bucket
+    if (load[next_idx] == key_load) {
+      keys[next_idx] = key;
+    } else if (load[next_idx] > key_load) {
+      load[next_idx] -= key_load;
+    } else {
+      keys[next_idx] = key;
+      load[next_idx] = key_load - load[next_idx];
+    }
+
+    ++next_idx;
+    if (next_idx >= kBucketNumber) {
+      next_idx = 0;
+    }
+  }
+
+  /**
+   * Record the buckets of other as if the records of other were recorded
+   * here. The load other has taken off its buckets still counts to the total.
+   */
+  void merge(const HotKeyBuckets& other) {
+    uint64_t merged_records = 0;
+    uint64_t merged_load = 0;
+    for (int i = 0; i < kBucketNumber; ++i) {
+      if (other.load[i] > 0) {
+        record(other.keys[i], other.load[i]);
+        ++merged_records;
+        merged_load += other.load[i];
+      }
+    }
+
+    total_records += other.total_records - merged_records;
+    total_recorded_load += other.total_recorded_load - merged_load;
+  }
+
+  void decay() {
+    total_records >>= 1;
+    total_recorded_load >>= 1;
+
+    for (auto& l : load) {
+      l >>= 1;
+    }
+  }
+
+  void clear() {
+    *this = HotKeyBuckets();
+  }
+
+  bool isAbove(const K& key, int percents) const {
+    // if total_records is too small, statistic estimation won't make sense
+    // we add a check here to help with cold start. 50 may need to be tuned.
+    if (total_records < 50) {
+      return false;
+    }
+
+    const auto itor = std::find(keys.begin(), keys.end(), key);
+    if (itor == keys.end()) {
+      return false;
+    }
+
+    int idx = std::distance(keys.begin(), itor);
+    return isIdxKeyAbove(idx, percents);
+  }
+
+  std::vector<K> getKeysAbove(int percents) const {
+    std::vector<K> hot_keys;
+
+    for (int idx = 0; idx < kBucketNumber; ++idx) {
+      if (isIdxKeyAbove(idx, percents)) {
+        hot_keys.push_back(keys[idx]);
+      }
+    }
+
+    return hot_keys;
+  }
+
+  bool isIdxKeyAbove(int idx, int percents) const {
+    // TODO(bol) we may want to reduce load[idx] in the following formula to
+    // provide a more accurate estimation when there are multiple hot keys
+    //
+    // Please see the comment of HotKeyDetector to understand the algorithm.
+    // After some calculation and eliminating "/" operation for faster
+    // execution, the following code should start to make sense
+    return 100 * kBucketNumber * load[idx] >
+      ((kBucketNumber + 1) * percents - 100) * total_recorded_load;
+  }
+
+  // TODO(bol) add a template parameter for percents lower limit passed to
+  // isAbove() and compute kBucketNumber based on the parameter.
+  static constexpr int kBucketNumber = 12;
+  std::array<K, kBucketNumber> keys;
+  std::array<uint64_t, kBucketNumber> load;
+  int next_idx;
+  uint64_t total_records;
+  uint64_t total_recorded_load;
+};
+
+}  // namespace detail
+
 /**
  * All public interface of HotKeyDetector are protected by a global mutex and
  * thus thread-safe. When int is used as the key type, the critical sections
@@ -65,11 +210,7 @@ template<typename K>
 class HotKeyDetector {
  public:
   HotKeyDetector()
-    : keys_()
-    , load_()
-    , next_idx_(0)
-    , total_records_(0)
-    , total_recorded_load_(0)
+    : buckets_()
     , last_decay_time_(std::chrono::steady_clock::now())
     , mtx_() {
   }
@@ -82,41 +223,7 @@ class HotKeyDetector {
 
     decayByTime();
 
-    ++total_records_;
-    total_recorded_load_ += load;
-    int first_empty_bucket = -1;
-    for (int i = 0; i < kBucketNumber; ++i) {
-      if (key == keys_[i]) {
-        load_[i] += load;
-        return;
-      }
-
-      if (first_empty_bucket == -1 && load_[i] == 0) {
-        first_empty_bucket = i;
-      }
-    }
-
-    // couldn't find the key and there is an empty bucket
-    if (first_empty_bucket != -1) {
-      keys_[first_empty_bucket] = key;
-      load_[first_empty_bucket] = load;
-      return;
-    }
-
-    // couldn't find the key and there is no empty bucket
-    if (load_[next_idx_] == load) {
-      keys_[next_idx_] = key;
-    } else if (load_[next_idx_] > load) {
-      load_[next_idx_] -= load;
-    } else {
-      keys_[next_idx_] = key;
-      load_[next_idx_] = load - load_[next_idx_];
-    }
-
-    ++next_idx_;
-    if (next_idx_ >= kBucketNumber) {
-      next_idx_ = 0;
-    }
+    buckets_.record(key, load);
   }
 
   /**
@@ -128,19 +235,7 @@ class HotKeyDetector {
   bool isAbove(const K& key, int percents) const {
     std::lock_guard<std::mutex> lock(mtx_);
 
-    // if total_records_ is too small, statistic estimation won't make sense
-    // we add a check here to help with cold start. 50 may need to be tuned.
-    if (total_records_ < 50) {
-      return false;
-    }
-
-    const auto itor = std::find(keys_.begin(), keys_.end(), key);
-    if (itor == keys_.end()) {
-      return false;
-    }
-
-    int idx = std::distance(keys_.begin(), itor);
-    return isIdxKeyAbove(idx, percents);
+    return buckets_.isAbove(key, percents);
   }
 
   /**
@@ -149,15 +244,7 @@ class HotKeyDetector {
   std::vector<K> getKeysAbove(int percents) {
     std::lock_guard<std::mutex> lock(mtx_);
 
-    std::vector<K> keys;
-
-    for (int idx = 0; idx < kBucketNumber; ++idx) {
-      if (isIdxKeyAbove(idx, percents)) {
-        keys.push_back(keys_[idx]);
-      }
-    }
-
-    return keys;
+    return buckets_.getKeysAbove(percents);
   }
 
  private:
@@ -169,36 +256,181 @@ class HotKeyDetector {
       return;
     }
 
-    total_records_ >>= 1;
-    total_recorded_load_ >>= 1;
+    buckets_.decay();
+    last_decay_time_ = now;
+  }
+
+  detail::HotKeyBuckets<K> buckets_;
+  std::chrono::time_point<std::chrono::steady_clock> last_decay_time_;
+  mutable std::mutex mtx_;
+};
+
+/**
+ * A HotKeyDetector for recording from many threads. Each thread records into
+ * its own buckets without any synchronization. Every kRecordsPerMerge records,
+ * or after kMergeInterval, the thread merges them into the global buckets,
+ * which takes a mutex, and publishes a copy of the global buckets as a
+ * snapshot. isAbove() and getKeysAbove() only read the latest snapshot,
+ * without locking with folly RCU (or with a RWSpinLock before gcc 8).
+ *
+ * The snapshot misses the records not merged yet, and those of a thread are
+ * dropped when it exits. Recording to many detectors from a thread is fine,
+ * as each detector has its own thread local buckets.
+ *
+ * See common/tests/detector_benchmark.cpp for the cost of them compared with
+ * HotKeyDetector.
+ */
+template<typename K>
+class ConcurrentHotKeyDetector {
+  using Buckets = detail::HotKeyBuckets<K>;
 
-    for (auto& load : load_) {
-      load >>= 1;
+ public:
+  ConcurrentHotKeyDetector()
+    : local_buckets_()
+    , merge_mtx_()
+    , buckets_()
+    , last_decay_time_(std::chrono::steady_clock::now())
+#if __GNUC__ >= 8
+    , snapshot_(new Buckets()) {
+#else
+    , snapshot_(std::make_shared<Buckets>())
+    , snapshot_rwlock_() {
+#endif
+  }
+
+  ~ConcurrentHotKeyDetector() {
+#if __GNUC__ >= 8
+    delete snapshot_.load();
+#endif
+  }
+
+  // no copy or move
+  ConcurrentHotKeyDetector(const ConcurrentHotKeyDetector&) = delete;
+  ConcurrentHotKeyDetector& operator=(const ConcurrentHotKeyDetector&) =
+    delete;
+
+  /**
+   * Record load for the key
+   */
+  void record(const K& key, uint64_t load = 1) {
+    auto& local = *local_buckets_;
+    local.buckets.record(key, load);
+    ++local.n_records;
+    if (local.n_records >= kRecordsPerMerge ||
+        (local.n_records % kRecordsPerTimeCheck == 0 &&
+         std::chrono::steady_clock::now() - local.last_merge_time >=
+           kMergeInterval)) {
+      merge(&local);
     }
-    last_decay_time_ = now;
   }
 
-  bool isIdxKeyAbove(int idx, int percents) const {
-    // TODO(bol) we may want to reduce load_[idx] in the following formula to
-    // provide a more accurate estimation when there are multiple hot keys
-    //
-    // Please see the comment above to understand the algorithm. After some
-    // calculation and eliminating "/" operation for faster execution, the
-    // following code should start to make sense
-    return 100 * kBucketNumber * load_[idx] >
-      ((kBucketNumber + 1) * percents - 100) * total_recorded_load_;
+  /**
+   * Merge the records of the calling thread, so that they are reflected by
+   * isAbove() and getKeysAbove()
+   */
+  void flush() {
+    merge(&*local_buckets_);
   }
 
-  // TODO(bol) add a template parameter for percents lower limit passed to
-  // isAbove() and compute kBucketNumber based on the parameter.
-  static constexpr int kBucketNumber = 12;
-  std::array<K, kBucketNumber> keys_;
-  std::array<uint64_t, kBucketNumber> load_;
-  int next_idx_;
-  uint64_t total_records_;
-  uint64_t total_recorded_load_;
+  /**
+   * Same as HotKeyDetector::isAbove(), for the merged records
+   */
+  bool isAbove(const K& key, int percents) const {
+#if __GNUC__ >= 8
+    folly::rcu_reader guard;
+    const auto snapshot = snapshot_.load(std::memory_order_acquire);
+#else
+    std::shared_ptr<const Buckets> snapshot;
+    {
+      folly::RWSpinLock::ReadHolder read_guard(snapshot_rwlock_);
+      snapshot = snapshot_;
+    }
+#endif
+
+    return snapshot->isAbove(key, percents);
+  }
+
+  /**
+   * Get keys that are above percents percentages of the merged records
+   */
+  std::vector<K> getKeysAbove(int percents) const {
+#if __GNUC__ >= 8
+    folly::rcu_reader guard;
+    const auto snapshot = snapshot_.load(std::memory_order_acquire);
+#else
+    std::shared_ptr<const Buckets> snapshot;
+    {
+      folly::RWSpinLock::ReadHolder read_guard(snapshot_rwlock_);
+      snapshot = snapshot_;
+    }
+#endif
+
+    return snapshot->getKeysAbove(percents);
+  }
+
+ private:
+  struct LocalBuckets {
+    LocalBuckets()
+      : buckets()
+      , n_records(0)
+      , last_merge_time(std::chrono::steady_clock::now()) {
+    }
+
+    Buckets buckets;
+    uint32_t n_records;
+    std::chrono::time_point<std::chrono::steady_clock> last_merge_time;
+  };
+
+  void merge(LocalBuckets* local) {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(merge_mtx_);
+
+    if (std::chrono::duration_cast<std::chrono::seconds>(
+          now - last_decay_time_).count() >=
+        FLAGS_hot_key_detector_decay_time_seconds) {
+      buckets_.decay();
+      last_decay_time_ = now;
+    }
+
+    buckets_.merge(local->buckets);
+    local->buckets.clear();
+    local->n_records = 0;
+    local->last_merge_time = now;
+
+    // Readers may still be reading the old snapshot
+#if __GNUC__ >= 8
+    folly::rcu_retire(snapshot_.exchange(new Buckets(buckets_),
+                                         std::memory_order_acq_rel));
+#else
+    std::shared_ptr<const Buckets> old_snapshot =
+      std::make_shared<Buckets>(buckets_);
+    {
+      folly::RWSpinLock::WriteHolder write_guard(snapshot_rwlock_);
+      snapshot_.swap(old_snapshot);
+    }
+#endif
+  }
+
+  static constexpr uint32_t kRecordsPerMerge = 4096;
+  static constexpr uint32_t kRecordsPerTimeCheck = 64;
+  static constexpr std::chrono::milliseconds kMergeInterval{100};
+
+  folly::ThreadLocal<LocalBuckets> local_buckets_;
+
+  // protects buckets_ and last_decay_time_
+  std::mutex merge_mtx_;
+  Buckets buckets_;
   std::chrono::time_point<std::chrono::steady_clock> last_decay_time_;
-  mutable std::mutex mtx_;
+
+#if __GNUC__ >= 8
+  std::atomic<const Buckets*> snapshot_;
+#else
+  std::shared_ptr<const Buckets> snapshot_;
+  mutable folly::RWSpinLock snapshot_rwlock_;
+#endif
 };
 
+template<typename K>
+constexpr std::chrono::milliseconds ConcurrentHotKeyDetector<K>::kMergeInterval;
+
 }  // namespace common
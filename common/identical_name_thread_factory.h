@@ -18,8 +18,12 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <thread>
+#include <utility>
+
+#include "common/thread_placement.h"
 
 #if __GNUC__ >= 8
 #include "folly/executors/thread_factory/ThreadFactory.h"
@@ -37,11 +41,25 @@ class IdenticalNameThreadFactory : public folly::ThreadFactory {
 class IdenticalNameThreadFactory : public wangle::ThreadFactory {
 #endif
  public:
-  explicit IdenticalNameThreadFactory(const std::string& name)
-    : name_(name) {}
+  // If placement is not nullptr, it is applied to each thread before func
+  // runs
+  explicit IdenticalNameThreadFactory(
+      const std::string& name,
+      std::shared_ptr<ThreadPlacement> placement = nullptr)
+    : name_(name)
+    , placement_(std::move(placement)) {}
 
   std::thread newThread(folly::Func&& func) override {
-    auto thread = std::thread(std::move(func));
+    std::thread thread;
+    if (placement_) {
+      thread = std::thread(
+        [placement = placement_, func = std::move(func)] () mutable {
+          placement->Apply();
+          func();
+        });
+    } else {
+      thread = std::thread(std::move(func));
+    }
     folly::setThreadName(thread.native_handle(), name_);
 
     return thread;
@@ -49,6 +67,7 @@ class IdenticalNameThreadFactory : public wangle::ThreadFactory {
 
  private:
   const std::string name_;
+  const std::shared_ptr<ThreadPlacement> placement_;
 };
 
 }  // namespace common
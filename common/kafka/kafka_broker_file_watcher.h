@@ -21,6 +21,10 @@
 
 namespace kafka{
 
+// Return CSV list of broker("host:port") from the broker serverset local file
+// content. An empty string is returned if it failed to parse the content.
+std::string ParseKafkaBrokerList(const std::string& content);
+
 class KafkaBrokerFileWatcher {
  public:
   explicit KafkaBrokerFileWatcher(std::string local_serverset_path);
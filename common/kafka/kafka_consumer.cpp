@@ -13,6 +13,7 @@
 /// limitations under the License.
 #include "common/kafka/kafka_consumer.h"
 
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <memory>
@@ -22,17 +23,49 @@
 #include <vector>
 #include <iostream>
 
+#include "common/kafka/kafka_broker_file_watcher.h"
 #include "common/kafka/kafka_consumer_holder.h"
 #include "common/kafka/kafka_flags.h"
 #include "common/kafka/kafka_utils.h"
 #include "common/kafka/stats_enum.h"
 #include "common/stats/stats.h"
+#include "common/timeutil.h"
+#include "folly/FileUtil.h"
 #include "folly/String.h"
 #include "librdkafka/rdkafka.h"
 #include "librdkafka/rdkafkacpp.h"
 
 namespace kafka {
 
+const int64_t kLagUpdateIntervalMs = 1000;
+
+common::MultiFilePoller::CallbackArg ReadWatchedFiles(
+    const std::vector<std::string>& paths) {
+  common::MultiFilePoller::CallbackArg contents;
+  for (const auto& path : paths) {
+    std::string content;
+    if (folly::readFile(path.c_str(), content)) {
+      contents.emplace(path, std::move(content));
+    }
+  }
+  return contents;
+}
+
+std::vector<std::string> UpdateWatchedFileContents(
+    const common::MultiFilePoller::CallbackArg& new_data,
+    common::MultiFilePoller::CallbackArg* contents) {
+  std::vector<std::string> changed_files;
+  for (const auto& file : new_data) {
+    auto it = contents->find(file.first);
+    if (it != contents->end() && it->second == file.second) {
+      continue;
+    }
+    (*contents)[file.first] = file.second;
+    changed_files.push_back(file.first);
+  }
+  return changed_files;
+}
+
 class SSLFilePollerHolder {
 public:
   static common::MultiFilePoller* getFilePollerInstance() {
@@ -77,7 +110,12 @@ KafkaConsumer::KafkaConsumer(
   kafka_consumer_type_metric_tag_("kafka_consumer_type=" + kafka_consumer_type),
   reset_callback_id_ptr_(nullptr),
   is_healthy_(false),
-  should_reset_rd_kafka_consumer_(false) {
+  should_reset_rd_kafka_consumer_(false),
+  broker_files_(),
+  watched_file_contents_(),
+  pending_broker_list_mutex_(),
+  pending_broker_list_(),
+  has_pending_broker_list_(false) {
   if (!isConsumerAvailable()) {
     return;
   }
@@ -95,19 +133,35 @@ KafkaConsumer::KafkaConsumer(
     }
   }
 
+  std::vector<std::string> filePathsToWatch;
   if (!FLAGS_kafka_consumer_reset_on_file_change.empty()) {
-    std::vector<std::string> filePathsToWatch;
     folly::split(",", FLAGS_kafka_consumer_reset_on_file_change, filePathsToWatch);
+  }
+  if (!FLAGS_kafka_consumer_update_brokers_on_file_change.empty()) {
+    std::vector<std::string> brokerFiles;
+    folly::split(",", FLAGS_kafka_consumer_update_brokers_on_file_change, brokerFiles);
+    for (const auto& brokerFile : brokerFiles) {
+      if (broker_files_.insert(brokerFile).second &&
+          std::find(filePathsToWatch.begin(), filePathsToWatch.end(), brokerFile) ==
+            filePathsToWatch.end()) {
+        filePathsToWatch.push_back(brokerFile);
+      }
+    }
+  }
 
+  if (!filePathsToWatch.empty()) {
     for (const auto& it : filePathsToWatch) {
       LOG(INFO) << "Will be watching path for change: " << it << std::endl << std::flush;
     }
 
+    // Or the first callback would see the files which didn't change as new,
+    // and reset the consumer for them
+    watched_file_contents_ = ReadWatchedFiles(filePathsToWatch);
     reset_callback_id_ptr_ = std::make_shared<common::MultiFilePoller::CallbackId>(
       SSLFilePollerHolder::getFilePollerInstance()->registerFiles(
         filePathsToWatch,
         [&](const common::MultiFilePoller::CallbackArg& newData) {
-          std::atomic_exchange(&should_reset_rd_kafka_consumer_, true);
+          onWatchedFilesChange(newData);
         }));
   }
 
@@ -168,11 +222,9 @@ KafkaConsumer::KafkaConsumer(
 }
 
 KafkaConsumer::~KafkaConsumer() {
-  if (!FLAGS_kafka_consumer_reset_on_file_change.empty()) {
-    if (reset_callback_id_ptr_ != nullptr) {
-      const auto cbId = *reset_callback_id_ptr_.get();
-      SSLFilePollerHolder::getFilePollerInstance()->cancelCallback(cbId);
-    }
+  if (reset_callback_id_ptr_ != nullptr) {
+    const auto cbId = *reset_callback_id_ptr_.get();
+    SSLFilePollerHolder::getFilePollerInstance()->cancelCallback(cbId);
   }
 
   if (rd_kafka_consumer_provider_) {
@@ -180,6 +232,55 @@ KafkaConsumer::~KafkaConsumer() {
   }
 }
 
+void KafkaConsumer::onWatchedFilesChange(
+  const common::MultiFilePoller::CallbackArg& newData) {
+  bool reset = false;
+  std::vector<std::string> broker_lists;
+  for (const auto& file :
+         UpdateWatchedFileContents(newData, &watched_file_contents_)) {
+    if (broker_files_.count(file) == 0) {
+      reset = true;
+      continue;
+    }
+
+    auto broker_list = ParseKafkaBrokerList(watched_file_contents_[file]);
+    if (broker_list.empty()) {
+      LOG(ERROR) << "Failed to find Kafka brokers in " << file;
+      continue;
+    }
+    broker_lists.push_back(std::move(broker_list));
+  }
+
+  if (!broker_lists.empty()) {
+    std::lock_guard<std::mutex> g(pending_broker_list_mutex_);
+    pending_broker_list_ = folly::join(",", broker_lists);
+    has_pending_broker_list_.store(true);
+  }
+
+  if (reset) {
+    std::atomic_exchange(&should_reset_rd_kafka_consumer_, true);
+  }
+}
+
+void KafkaConsumer::applyPendingBrokerList() {
+  if (!has_pending_broker_list_.load()) {
+    return;
+  }
+
+  std::string broker_list;
+  {
+    std::lock_guard<std::mutex> g(pending_broker_list_mutex_);
+    broker_list.swap(pending_broker_list_);
+    has_pending_broker_list_.store(false);
+  }
+
+  if (!rd_kafka_consumer_provider_->addBrokers(broker_list)) {
+    LOG(ERROR) << "Resetting kafka consumer for partitions: " << partition_ids_str_
+               << ", failed to add brokers: " << broker_list;
+    std::atomic_exchange(&should_reset_rd_kafka_consumer_, true);
+  }
+}
+
 bool KafkaConsumer::IsHealthy() const { return is_healthy_.load(); }
 
 bool KafkaConsumer::Seek(const int64_t timestamp_ms) {
@@ -366,7 +467,14 @@ RdKafka::Message* KafkaConsumer::Consume(int32_t timeout_ms) {
       resetSeekedConsumer();
     }
 
+    const auto consume_start_ms = common::timeutil::GetCurrentTimestamp(
+      common::timeutil::TimeUnit::kMillisecond);
     auto* message = rd_kafka_consumer_provider_->getInstance()->consume(timeout_ms);
+    common::Stats::get()->AddMetric(
+      getFullStatsName(kKafkaConsumerConsumeMs,
+                       {kafka_consumer_type_metric_tag_}),
+      common::timeutil::GetCurrentTimestamp(
+        common::timeutil::TimeUnit::kMillisecond) - consume_start_ms);
 
     if (message == nullptr) {
       if (shouldResetLoad()) {
@@ -406,12 +514,107 @@ RdKafka::Message* KafkaConsumer::Consume(int32_t timeout_ms) {
       consumedOffset.timestamp = message->timestamp().timestamp;
       consumedOffset.offset = message->offset();
       last_known_consumed_offsets_[topic_partition_pair] = consumedOffset;
+      MaybeUpdateLag(*message);
     }
 
     return message;
   } while (shouldResetLoad());
 }
 
+std::vector<std::unique_ptr<RdKafka::Message>> KafkaConsumer::ConsumeBatch(
+    uint32_t max_msgs, int32_t timeout_ms) {
+  std::vector<std::unique_ptr<RdKafka::Message>> messages;
+  messages.reserve(max_msgs);
+  while (messages.size() < max_msgs) {
+    // Only wait for the first message
+    std::unique_ptr<RdKafka::Message> message(
+      Consume(messages.empty() ? timeout_ms : 0));
+    if (message == nullptr) {
+      break;
+    }
+
+    const auto error_code = message->err();
+    if (error_code == RdKafka::ERR__TIMED_OUT && !messages.empty()) {
+      // Nothing more fetched yet
+      break;
+    }
+
+    messages.push_back(std::move(message));
+    if (error_code != RdKafka::ERR_NO_ERROR) {
+      break;
+    }
+  }
+
+  return messages;
+}
+
+void KafkaConsumer::MaybeUpdateLag(const RdKafka::Message& message) {
+  const auto now_ms = common::timeutil::GetCurrentTimestamp(
+    common::timeutil::TimeUnit::kMillisecond);
+  auto& updated_ms = lag_updated_ms_[std::make_pair(message.topic_name(),
+                                                    message.partition())];
+  if (now_ms - updated_ms < kLagUpdateIntervalMs) {
+    return;
+  }
+  updated_ms = now_ms;
+
+  // The watermarks cached by librdkafka, which doesn't call the broker
+  int64_t low;
+  int64_t high;
+  const auto error_code =
+    rd_kafka_consumer_provider_->getInstance()->get_watermark_offsets(
+      message.topic_name(), message.partition(), &low, &high);
+  if (error_code != RdKafka::ERR_NO_ERROR || high < 0) {
+    return;
+  }
+
+  const auto lag = std::max<int64_t>(high - message.offset() - 1, 0);
+  SetKafkaGauge(
+    getFullStatsName(kKafkaConsumerLag,
+                     {kafka_consumer_type_metric_tag_,
+                      "topic=" + message.topic_name(),
+                      "partition=" + std::to_string(message.partition())}),
+    lag);
+}
+
+bool KafkaConsumer::Pause() {
+  return PauseOrResume(true);
+}
+
+bool KafkaConsumer::Resume() {
+  return PauseOrResume(false);
+}
+
+bool KafkaConsumer::PauseOrResume(const bool pause) {
+  if (!isConsumerAvailable()) {
+    return false;
+  }
+
+  std::vector<std::unique_ptr<RdKafka::TopicPartition>> topic_partitions;
+  // The pointers inside this vector is owned by `topic_partitions`.
+  std::vector<RdKafka::TopicPartition*> tmp_topic_partitions;
+  topic_partitions.reserve(partition_ids_.size() * topic_names_.size());
+  tmp_topic_partitions.reserve(partition_ids_.size() * topic_names_.size());
+  for (const auto partition_id : partition_ids_) {
+    for (const auto& topic_name : topic_names_) {
+      topic_partitions.emplace_back(
+        RdKafka::TopicPartition::create(topic_name, partition_id));
+      tmp_topic_partitions.push_back(topic_partitions.back().get());
+    }
+  }
+
+  auto consumer = rd_kafka_consumer_provider_->getInstance();
+  const auto error_code = pause ? consumer->pause(tmp_topic_partitions)
+                                : consumer->resume(tmp_topic_partitions);
+  if (error_code != RdKafka::ERR_NO_ERROR) {
+    LOG(ERROR) << "Failed to " << (pause ? "pause" : "resume")
+               << " partitions: " << partition_ids_str_
+               << ", error_code: " << RdKafka::err2str(error_code);
+    return false;
+  }
+  return true;
+}
+
 RdKafka::ErrorCode KafkaConsumer::Commit(RdKafka::Message* message, bool is_async) {
   if (is_async) {
     return rd_kafka_consumer_provider_->getInstance()->commitAsync(message);
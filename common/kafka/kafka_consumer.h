@@ -15,8 +15,11 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "common/MultiFilePoller.h"
 #include "common/kafka/kafka_consumer_holder.h"
@@ -24,6 +27,18 @@
 
 namespace kafka {
 
+// Read the content of the files of paths, skipping the ones which can't be
+// read
+common::MultiFilePoller::CallbackArg ReadWatchedFiles(
+    const std::vector<std::string>& paths);
+
+// Update contents with new_data from the file poller, and return the files
+// whose content is new or differs from contents. The poller passes all the
+// files of a callback when any of them changes.
+std::vector<std::string> UpdateWatchedFileContents(
+    const common::MultiFilePoller::CallbackArg& new_data,
+    common::MultiFilePoller::CallbackArg* contents);
+
 class KafkaConsumer {
 public:
   KafkaConsumer(const std::unordered_set<uint32_t>& partition_ids,
@@ -61,6 +76,19 @@ public:
   // It returns nullptr if IsHealthy() returns false.
   virtual RdKafka::Message* Consume(int32_t timeout_ms);
 
+  // Consume up to max_msgs messages. It waits for at most timeout_ms for the
+  // first one, and then only takes the ones librdkafka has fetched already.
+  // All messages but the last one have no error. It returns an empty vector
+  // if IsHealthy() returns false.
+  std::vector<std::unique_ptr<RdKafka::Message>> ConsumeBatch(
+      uint32_t max_msgs, int32_t timeout_ms);
+
+  // Stop fetching messages of the partitions of this consumer until
+  // Resume() is called. Consume() then keeps serving events only.
+  bool Pause();
+
+  bool Resume();
+
   // Commit offset for a single topic+partition based on message.
   virtual RdKafka::ErrorCode Commit(RdKafka::Message* message, bool is_async);
 
@@ -95,11 +123,25 @@ private:
   virtual bool SeekInternal(const std::map<std::string, std::map<int32_t,
     int64_t>>& last_offsets);
 
+  bool PauseOrResume(const bool pause);
+
+  // Update the lag gauge of the partition of message, at most once a second
+  void MaybeUpdateLag(const RdKafka::Message& message);
+
+  // Called by the file poller with the content of the watched files
+  void onWatchedFilesChange(const common::MultiFilePoller::CallbackArg& newData);
+
+  // Add the brokers of the last broker serverset change to the consumer, or
+  // schedule a reset if that fails
+  void applyPendingBrokerList();
+
   inline bool isResettable() {
     return reset_callback_id_ptr_ != nullptr;
   }
 
   inline bool shouldResetAndExchange() {
+    // broker serverset changes are applied without a reset
+    applyPendingBrokerList();
     return isResettable() && std::atomic_exchange(&should_reset_rd_kafka_consumer_, false);
   }
 
@@ -130,7 +172,17 @@ private:
   std::shared_ptr<common::MultiFilePoller::CallbackId> reset_callback_id_ptr_;
   std::atomic<bool> is_healthy_;
   std::atomic<bool> should_reset_rd_kafka_consumer_;
+  // The watched files whose changes are applied by adding brokers
+  std::unordered_set<std::string> broker_files_;
+  // The last content seen of the watched files, read when they are
+  // registered. Only used by the file poller afterwards.
+  common::MultiFilePoller::CallbackArg watched_file_contents_;
+  std::mutex pending_broker_list_mutex_;
+  std::string pending_broker_list_;
+  std::atomic<bool> has_pending_broker_list_;
   TopicPartitionToValueMap<ConsumedOffset> last_known_consumed_offsets_;
+  // When the lag gauge of each partition was last updated
+  TopicPartitionToValueMap<int64_t> lag_updated_ms_;
 };
 
 }  // namespace kafka
@@ -139,10 +139,33 @@ std::shared_ptr<RdKafka::KafkaConsumer> CreateRdKafkaConsumer(
   return CreateRdKafkaConsumer(kafkaConfigMap, partition_ids, kafka_consumer_type);
 }
 
+namespace {
+
+bool addBrokersToInstance(RdKafka::KafkaConsumer* consumer,
+                          const std::string& broker_list) {
+  if (consumer == nullptr) {
+    return false;
+  }
+
+  // The number of brokers parsed from broker_list, new or already known
+  const int num_brokers = rd_kafka_brokers_add(consumer->c_ptr(),
+                                               broker_list.c_str());
+  if (num_brokers <= 0) {
+    LOG(ERROR) << "Failed to add kafka brokers: " << broker_list;
+    return false;
+  }
+
+  LOG(INFO) << "Added " << num_brokers << " kafka brokers: " << broker_list;
+  common::Stats::get()->Incr(kKafkaBrokerUpdates);
+  return true;
+}
+
+}  // namespace
+
 class RdKafkaConsumerHolderRenewable : virtual public RdKafkaConsumerHolder {
 private:
   const std::unordered_set<uint32_t> partition_ids_;
-  const std::string broker_list_;
+  std::string broker_list_;
   const std::unordered_set<std::string> topic_names_;
   const std::string group_id_;
   const std::string kafka_consumer_type_;
@@ -412,6 +435,15 @@ public:
     } while (!done);
   }
 
+  virtual bool addBrokers(const std::string& broker_list) override {
+    if (!addBrokersToInstance(kafkaConsumer_.get(), broker_list)) {
+      return false;
+    }
+
+    broker_list_ = broker_list;
+    return true;
+  }
+
   virtual void close() override {
     if (kafkaConsumer_) {
       kafkaConsumer_->close();
@@ -434,6 +466,10 @@ public:
     // doNothing();
   }
 
+  virtual bool addBrokers(const std::string& broker_list) override {
+    return addBrokersToInstance(kafkaConsumer_.get(), broker_list);
+  }
+
   virtual void close() override {
     if (kafkaConsumer_) {
       kafkaConsumer_->close();
@@ -53,9 +53,24 @@ public:
 
   virtual void resetInstance(const TopicPartitionToValueMap<ConsumedOffset>* consumedOffsets) = 0;
 
+  // Add the brokers of the CSV list broker_list to the current instance in
+  // place, and use them for the instances created by resetInstance(). The
+  // brokers already known are kept, librdkafka learns about the others from
+  // the cluster metadata. Returns false if no broker could be added.
+  virtual bool addBrokers(const std::string& broker_list) = 0;
+
   virtual void close() = 0;
 };
 
+// Create a librdkafka consumer with the configs of the kafka flags, which
+// has no partitions assigned. Returns nullptr on failure. partition_ids and
+// kafka_consumer_type are only used for logging and stats.
+std::shared_ptr<RdKafka::KafkaConsumer> CreateRdKafkaConsumer(
+  const std::unordered_set<uint32_t>& partition_ids,
+  const std::string& broker_list,
+  const std::string& group_id,
+  const std::string kafka_consumer_type);
+
 class RdKafkaConsumerHolderFactory {
 public:
   static RdKafkaConsumerHolder* createInstance(const std::unordered_set<uint32_t>& partition_ids,
@@ -25,6 +25,10 @@ DEFINE_int32(kafka_consumer_time_between_retries_ms, 100,
              "Time in ms to sleep between each retry");
 DEFINE_string(kafka_consumer_reset_on_file_change, "",
               "Comma separated files to watch and reset kafka consumer, when the file change is noticed");
+DEFINE_string(kafka_consumer_update_brokers_on_file_change, "",
+              "Comma separated Kafka broker serverset files to watch. When one changes, its brokers "
+              "are added to the kafka consumers in place instead of resetting them, even if it is "
+              "also in kafka_consumer_reset_on_file_change");
 DEFINE_string(enable_kafka_auto_offset_store, "false",
               "Whether to automatically commit the kafka offsets");
 DEFINE_string(kafka_client_global_config_file, "",
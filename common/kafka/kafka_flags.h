@@ -21,5 +21,6 @@ DECLARE_int32(kafka_consumer_timeout_ms);
 DECLARE_int32(kafka_consumer_num_retries);
 DECLARE_int32(kafka_consumer_time_between_retries_ms);
 DECLARE_string(kafka_consumer_reset_on_file_change);
+DECLARE_string(kafka_consumer_update_brokers_on_file_change);
 DECLARE_string(enable_kafka_auto_offset_store);
 DECLARE_string(kafka_client_global_config_file);
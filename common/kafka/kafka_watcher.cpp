@@ -31,6 +31,8 @@
 #include "common/kafka/kafka_consumer.h"
 #include "common/kafka/kafka_utils.h"
 #include "common/kafka/kafka_consumer_pool.h"
+#include "common/kafka/offset_commit_tracker.h"
+#include "common/kafka/partition_dispatcher.h"
 
 using namespace kafka;
 
@@ -159,27 +161,20 @@ uint32_t KafkaWatcher::ConsumeUpToNow(kafka::KafkaConsumer& consumer) {
   // all the topics, or it takes longer than the allowed time limit.
   while (!is_stopped_.load() && finished_topic_partitions.size() !=
          num_topic_partitions) {
-    const auto message =
-        std::shared_ptr<RdKafka::Message>(
-            consumer.Consume(kafka_consumer_timeout_ms_));
-    if (message == nullptr) {
+    auto messages = ConsumeMessages(consumer);
+    if (messages.empty()) {
       // This should only happen if kafka consumer is unhealthy.
       break;
     }
-    if (message->err() == RdKafka::ERR_NO_ERROR) {
-      const auto msg_timestamp_ms = GetMessageTimestamp(*message);
-      const auto time_now_ms = common::timeutil::GetCurrentTimestamp(
-          common::timeutil::TimeUnit::kMillisecond);
-      common::Stats::get()->AddMetric(
-          getFullStatsName(kKafkaMsgTimeDiffFromCurrMs,
-              {kafka_watcher_metric_tag_}),
-          time_now_ms - msg_timestamp_ms);
-      common::Stats::get()->AddMetric(
-          getFullStatsName(kKafkaMsgNumBytes, {kafka_watcher_metric_tag_}),
-          message->len());
+    std::unique_ptr<RdKafka::Message> event;
+    if (messages.back()->err() != RdKafka::ERR_NO_ERROR) {
+      event = std::move(messages.back());
+      messages.pop_back();
+    }
+
+    for (const auto& message : messages) {
       const auto topic_partition_pair = std::make_pair(message->topic_name(),
           message->partition());
-      HandleKafkaNoErrorMessage(message, true /* replay */);
       auto it = topic_partition_to_message_num.find(topic_partition_pair);
       if (it == topic_partition_to_message_num.end()) {
         CHECK(topic_partition_to_message_num.emplace(topic_partition_pair,
@@ -194,11 +189,18 @@ uint32_t KafkaWatcher::ConsumeUpToNow(kafka::KafkaConsumer& consumer) {
                                           message->partition(),
                                           message->offset(),
                                           name_);
-    } else if (message->err() == RdKafka::ERR__PARTITION_EOF) {
+    }
+    const auto prev_num_msg_consumed = num_msg_consumed;
+    num_msg_consumed += messages.size() + (event ? 1 : 0);
+    HandleKafkaNoErrorMessages(std::move(messages), true /* replay */);
+
+    if (event == nullptr) {
+      // Only messages without errors
+    } else if (event->err() == RdKafka::ERR__PARTITION_EOF) {
       // Reached the end of the topic+partition queue on the broker.
-      finished_topic_partitions.emplace(message->topic_name(),
-          message->partition());
-    } else if (message->err() == RdKafka::ERR__TIMED_OUT) {
+      finished_topic_partitions.emplace(event->topic_name(),
+          event->partition());
+    } else if (event->err() == RdKafka::ERR__TIMED_OUT) {
       // This could happen even before getting ERR__PARTITION_EOF message. It
       // happens when consumer hasn't got any message from the broker within the
       // timeout. We should retry in this case.
@@ -211,8 +213,7 @@ uint32_t KafkaWatcher::ConsumeUpToNow(kafka::KafkaConsumer& consumer) {
       // TODO: We probably need to re-establish Kafka connection here..
       break;
     }
-    ++num_msg_consumed;
-    if (num_msg_consumed % 100 == 0) {
+    if (num_msg_consumed / 100 != prev_num_msg_consumed / 100) {
       if (kafka_init_blocking_consume_timeout_ms_ != -1 &&
           common::timeutil::GetCurrentTimestamp(
               common::timeutil::TimeUnit::kMillisecond) >
@@ -241,21 +242,278 @@ uint32_t KafkaWatcher::ConsumeUpToNow(kafka::KafkaConsumer& consumer) {
          "):" + std::to_string(pair.second) + " ";
   }
   LOG(INFO) << name_ << ": Messages consumed per topic partition: " << s;
+  HandleKafkaIdle();
   return num_msg_consumed;
 }
 
+std::vector<std::unique_ptr<RdKafka::Message>> KafkaWatcher::ConsumeMessages(
+    kafka::KafkaConsumer& consumer) {
+  if (batch_handler_) {
+    return consumer.ConsumeBatch(max_batch_size_, kafka_consumer_timeout_ms_);
+  }
+
+  std::vector<std::unique_ptr<RdKafka::Message>> messages;
+  auto message = consumer.Consume(kafka_consumer_timeout_ms_);
+  if (message != nullptr) {
+    messages.emplace_back(message);
+  }
+  return messages;
+}
+
+uint64_t KafkaWatcher::HandleKafkaNoErrorMessages(
+    std::vector<std::unique_ptr<RdKafka::Message>> messages,
+    const bool is_replay) {
+  if (messages.empty()) {
+    return 0;
+  }
+
+  const auto time_now_ms = common::timeutil::GetCurrentTimestamp(
+      common::timeutil::TimeUnit::kMillisecond);
+  uint64_t n_bytes = 0;
+  for (const auto& message : messages) {
+    common::Stats::get()->AddMetric(
+        getFullStatsName(kKafkaMsgTimeDiffFromCurrMs,
+            {kafka_watcher_metric_tag_}),
+        time_now_ms - GetMessageTimestamp(*message));
+    common::Stats::get()->AddMetric(
+        getFullStatsName(kKafkaMsgNumBytes, {kafka_watcher_metric_tag_}),
+        message->len());
+    n_bytes += message->len();
+  }
+  common::Stats::get()->AddMetric(
+      getFullStatsName(kKafkaWatcherBatchSize, {kafka_watcher_metric_tag_}),
+      messages.size());
+  common::Stats::get()->Incr(
+      getFullStatsName(kKafkaWatcherMessages, {kafka_watcher_metric_tag_}),
+      messages.size());
+  common::Stats::get()->Incr(
+      getFullStatsName(kKafkaWatcherBytes, {kafka_watcher_metric_tag_}),
+      n_bytes);
+
+  RunHandlers(std::move(messages), is_replay);
+
+  const auto latency_ms = common::timeutil::GetCurrentTimestamp(
+      common::timeutil::TimeUnit::kMillisecond) - time_now_ms;
+  common::Stats::get()->AddMetric(
+      getFullStatsName(kKafkaWatcherHandlerMs, {kafka_watcher_metric_tag_}),
+      latency_ms);
+  return latency_ms;
+}
+
+void KafkaWatcher::RunHandlers(
+    std::vector<std::unique_ptr<RdKafka::Message>> messages,
+    const bool is_replay) {
+  if (dispatcher_ != nullptr && batch_handler_) {
+    // Split the batch by partition, in the order of the messages
+    std::vector<std::shared_ptr<
+      std::vector<std::unique_ptr<RdKafka::Message>>>> batches;
+    TopicPartitionToValueMap<size_t> batch_indexes;
+    for (auto& message : messages) {
+      auto key = std::make_pair(message->topic_name(), message->partition());
+      auto itor = batch_indexes.find(key);
+      if (itor == batch_indexes.end()) {
+        itor = batch_indexes.emplace(std::move(key), batches.size()).first;
+        batches.push_back(std::make_shared<
+          std::vector<std::unique_ptr<RdKafka::Message>>>());
+      }
+      batches[itor->second]->push_back(std::move(message));
+    }
+
+    for (auto& batch : batches) {
+      const auto& first = *batch->front();
+      dispatcher_->Add(first.topic_name(), first.partition(),
+                       [this, batch, is_replay] {
+                         batch_handler_(*batch, is_replay);
+                         MarkHandled(*batch);
+                       });
+    }
+    return;
+  }
+
+  if (batch_handler_) {
+    batch_handler_(messages, is_replay);
+    MarkHandled(messages);
+    return;
+  }
+
+  for (auto& message : messages) {
+    std::shared_ptr<const RdKafka::Message> shared_message(std::move(message));
+    if (dispatcher_ == nullptr) {
+      HandleKafkaNoErrorMessage(shared_message, is_replay);
+      if (commit_tracker_ != nullptr) {
+        commit_tracker_->MarkProcessed(shared_message->topic_name(),
+                                       shared_message->partition(),
+                                       shared_message->offset());
+      }
+      continue;
+    }
+
+    dispatcher_->Add(shared_message->topic_name(), shared_message->partition(),
+                     [this, shared_message, is_replay] {
+                       HandleKafkaNoErrorMessage(shared_message, is_replay);
+                       if (commit_tracker_ != nullptr) {
+                         commit_tracker_->MarkProcessed(
+                             shared_message->topic_name(),
+                             shared_message->partition(),
+                             shared_message->offset());
+                       }
+                     });
+  }
+}
+
+void KafkaWatcher::MarkHandled(
+    const std::vector<std::unique_ptr<RdKafka::Message>>& messages) {
+  if (commit_tracker_ == nullptr) {
+    return;
+  }
+
+  for (const auto& message : messages) {
+    commit_tracker_->MarkProcessed(message->topic_name(), message->partition(),
+                                   message->offset());
+  }
+}
+
+void KafkaWatcher::MaybeCommitOffsets(const bool is_final) {
+  if (commit_tracker_ == nullptr ||
+      (!is_final && !commit_tracker_->IsCommitDue())) {
+    return;
+  }
+
+  auto offsets = commit_tracker_->TakeOffsets();
+  if (offsets.empty()) {
+    return;
+  }
+
+  if (pre_commit_handler_) {
+    std::map<std::string, std::map<int32_t, int64_t>> last_offsets;
+    for (const auto& topic_partition_offset : offsets) {
+      last_offsets[topic_partition_offset.first.first]
+        [topic_partition_offset.first.second] = topic_partition_offset.second;
+    }
+    if (!pre_commit_handler_(last_offsets)) {
+      commit_tracker_->Restore(offsets);
+      return;
+    }
+  }
+
+  for (const auto& kafka_consumer : kafka_consumers_) {
+    if (kafka_consumer == nullptr || !kafka_consumer->IsHealthy()) {
+      continue;
+    }
+
+    const auto& topic_names = kafka_consumer->GetTopicNames();
+    const auto& partition_ids = kafka_consumer->GetPartitionIds();
+    TopicPartitionToValueMap<int64_t> committing;
+    std::vector<std::unique_ptr<RdKafka::TopicPartition>> partitions;
+    std::vector<RdKafka::TopicPartition*> partition_ptrs;
+    for (auto itor = offsets.begin(); itor != offsets.end();) {
+      const auto& topic_name = itor->first.first;
+      const auto partition_id = itor->first.second;
+      if (topic_names.find(topic_name) == topic_names.end() ||
+          partition_ids.find(partition_id) == partition_ids.end()) {
+        ++itor;
+        continue;
+      }
+
+      // kafka expects the offset of the next message to consume
+      partitions.emplace_back(RdKafka::TopicPartition::create(
+          topic_name, partition_id, itor->second + 1));
+      partition_ptrs.push_back(partitions.back().get());
+      committing.insert(*itor);
+      itor = offsets.erase(itor);
+    }
+    if (partition_ptrs.empty()) {
+      continue;
+    }
+
+    // The result of an async commit is only logged by librdkafka, and the
+    // next commit covers its offsets anyway.
+    const auto err = kafka_consumer->Commit(partition_ptrs, !is_final);
+    if (err == RdKafka::ERR_NO_ERROR) {
+      common::Stats::get()->Incr(
+          getFullStatsName(kKafkaWatcherCommits, {kafka_watcher_metric_tag_}));
+    } else {
+      LOG(ERROR) << name_ << ": Failed to commit offsets for topics: "
+                 << kafka_consumer->GetTopicsString() << " error: "
+                 << RdKafka::err2str(err);
+      common::Stats::get()->Incr(getFullStatsName(
+          kKafkaWatcherCommitErrors, {kafka_watcher_metric_tag_}));
+      commit_tracker_->Restore(committing);
+    }
+  }
+
+  // Retry the offsets of unhealthy consumers with the next commit
+  commit_tracker_->Restore(offsets);
+}
+
+void KafkaWatcher::HandleKafkaIdle() {
+  if (dispatcher_ != nullptr) {
+    dispatcher_->Drain();
+  }
+  if (idle_handler_) {
+    idle_handler_();
+  }
+}
+
+void KafkaWatcher::EnableParallelHandling(uint32_t n_workers,
+                                          uint32_t max_pending_per_partition) {
+  CHECK(!thread_.joinable()) << "Enable parallel handling before starting";
+  dispatcher_ = std::make_unique<PartitionDispatcher>(
+      name_.substr(0, 15), n_workers, max_pending_per_partition);
+}
+
+void KafkaWatcher::EnableOffsetCommits(
+    uint32_t commit_interval_ms,
+    uint32_t max_uncommitted_messages,
+    KafkaPreCommitHandler pre_commit_handler) {
+  CHECK(!thread_.joinable()) << "Enable offset commits before starting";
+  CHECK(commit_interval_ms > 0 || max_uncommitted_messages > 0);
+  commit_tracker_ = std::make_unique<OffsetCommitTracker>(
+      commit_interval_ms, max_uncommitted_messages);
+  pre_commit_handler_ = std::move(pre_commit_handler);
+}
+
+bool KafkaWatcher::StartWithBatch(int64_t initial_kafka_seek_timestamp_ms,
+    KafkaBatchMessageHandler handler,
+    uint32_t max_batch_size,
+    KafkaIdleHandler idle_handler) {
+  CHECK(handler != nullptr);
+  CHECK_GT(max_batch_size, 0u);
+  batch_handler_ = handler;
+  max_batch_size_ = max_batch_size;
+  idle_handler_ = idle_handler;
+  return Start(initial_kafka_seek_timestamp_ms);
+}
+
+bool KafkaWatcher::StartWithBatch(const std::map<std::string, std::map<int32_t,
+                                  int64_t>>& last_offsets,
+                                  KafkaBatchMessageHandler handler,
+                                  uint32_t max_batch_size,
+                                  KafkaIdleHandler idle_handler) {
+  CHECK(handler != nullptr);
+  CHECK_GT(max_batch_size, 0u);
+  batch_handler_ = handler;
+  max_batch_size_ = max_batch_size;
+  idle_handler_ = idle_handler;
+  return Start(last_offsets);
+}
+
 bool KafkaWatcher::StartWith(int64_t initial_kafka_seek_timestamp_ms,
-    KafkaMessageHandler handler) {
+    KafkaMessageHandler handler,
+    KafkaIdleHandler idle_handler) {
   CHECK(handler != nullptr);
   handler_ = handler;
+  idle_handler_ = idle_handler;
   return Start(initial_kafka_seek_timestamp_ms);
 }
 
 bool KafkaWatcher::StartWith(const std::map<std::string, std::map<int32_t,
                              int64_t>>& last_offsets,
-                             KafkaMessageHandler handler) {
+                             KafkaMessageHandler handler,
+                             KafkaIdleHandler idle_handler) {
   CHECK(handler != nullptr);
   handler_ = handler;
+  idle_handler_ = idle_handler;
   return Start(last_offsets);
 }
 
@@ -351,6 +609,51 @@ bool KafkaWatcher::Start(int64_t initial_kafka_seek_timestamp_ms) {
   return true;
 }
 
+void KafkaWatcher::SetBackpressureHandler(
+    KafkaBackpressureHandler backpressure_handler,
+    uint32_t max_handler_latency_ms) {
+  CHECK(!thread_.joinable()) << "Set the backpressure handler before starting";
+  backpressure_handler_ = std::move(backpressure_handler);
+  max_handler_latency_ms_ = max_handler_latency_ms;
+}
+
+void KafkaWatcher::MaybePauseOrResume(
+    kafka::KafkaConsumer* const kafka_consumer) {
+  if (!backpressure_handler_ && max_handler_latency_ms_ == 0) {
+    return;
+  }
+
+  auto& handler_latency_ms = handler_latency_ms_[kafka_consumer];
+  const bool too_slow = max_handler_latency_ms_ > 0 &&
+      handler_latency_ms > max_handler_latency_ms_;
+  // Nothing is handled while paused, so only wait one consume for it
+  handler_latency_ms = 0;
+  const bool should_pause =
+      too_slow || (backpressure_handler_ && backpressure_handler_());
+
+  const bool is_paused =
+      paused_consumers_.find(kafka_consumer) != paused_consumers_.end();
+  if (should_pause == is_paused) {
+    return;
+  }
+
+  if (should_pause) {
+    if (kafka_consumer->Pause()) {
+      LOG(INFO) << name_ << ": Paused consuming topics: "
+                << kafka_consumer->GetTopicsString() << " partitions: "
+                << kafka_consumer->partition_ids_str_;
+      common::Stats::get()->Incr(
+          getFullStatsName(kKafkaWatcherPause, {kafka_watcher_metric_tag_}));
+      paused_consumers_.insert(kafka_consumer);
+    }
+  } else if (kafka_consumer->Resume()) {
+    LOG(INFO) << name_ << ": Resumed consuming topics: "
+              << kafka_consumer->GetTopicsString() << " partitions: "
+              << kafka_consumer->partition_ids_str_;
+    paused_consumers_.erase(kafka_consumer);
+  }
+}
+
 void KafkaWatcher::StartWatchLoop() {
   uint64_t cycle_end_timestamp_ms;
 
@@ -375,39 +678,45 @@ void KafkaWatcher::StartWatchLoop() {
         // 3) Consume and apply the kafka updates
         // kafka consumption uses whatever time budget is left for this cycle.
         if (kafka_consumer != nullptr && kafka_consumer->IsHealthy()) {
+          MaybePauseOrResume(kafka_consumer.get());
           const auto& topic_names = kafka_consumer->GetTopicNames();
           TopicPartitionToValueMap<int64_t> topic_partition_to_prev_offset;
           topic_partition_to_prev_offset.reserve(topic_names.size());
-          const auto message = std::shared_ptr<const RdKafka::Message>(
-              kafka_consumer->Consume(kafka_consumer_timeout_ms_));
-          if (message == nullptr) {
+          auto messages = ConsumeMessages(*kafka_consumer);
+          if (messages.empty()) {
+            HandleKafkaIdle();
+            MaybeCommitOffsets(false /* not final */);
             continue;
           }
-          if (message->err() == RdKafka::ERR_NO_ERROR) {
-            const auto msg_timestamp_ms = GetMessageTimestamp(*message);
-            const auto time_now_ms = common::timeutil::GetCurrentTimestamp(
-                common::timeutil::TimeUnit::kMillisecond);
-            common::Stats::get()->AddMetric(
-                getFullStatsName(kKafkaMsgTimeDiffFromCurrMs,
-                    {kafka_watcher_metric_tag_}),
-                time_now_ms - msg_timestamp_ms);
-            common::Stats::get()->AddMetric(
-                getFullStatsName(kKafkaMsgNumBytes,
-                    {kafka_watcher_metric_tag_}), message->len());
-            HandleKafkaNoErrorMessage(message, false /* not replay */);
+          std::unique_ptr<RdKafka::Message> event;
+          if (messages.back()->err() != RdKafka::ERR_NO_ERROR) {
+            event = std::move(messages.back());
+            messages.pop_back();
+          }
+
+          for (const auto& message : messages) {
             // Check if messages are missing between current and previous offset
             VerifyAndUpdateTopicPartitionOffset(&topic_partition_to_prev_offset,
                                                 message->topic_name(),
                                                 message->partition(),
                                                 message->offset(),
                                                 name_);
-          } else if (message->err() == RdKafka::ERR__TIMED_OUT ||
-                     message->err() == RdKafka::ERR__PARTITION_EOF) {
+          }
+          handler_latency_ms_[kafka_consumer.get()] =
+              HandleKafkaNoErrorMessages(std::move(messages),
+                                         false /* not replay */);
+          MaybeCommitOffsets(false /* not final */);
+
+          if (event == nullptr) {
+            // Only messages without errors
+          } else if (event->err() == RdKafka::ERR__TIMED_OUT ||
+                     event->err() == RdKafka::ERR__PARTITION_EOF) {
             // ERR__PARTITION_EOF: Reached the end of the topic+partition queue
             // on the broker. Not really an error. ERR__TIMED_OUT: timeout due
             // to no message or event. This happens after
             // receiving ERR__PARTITION_EOF and there was still no messages to
             // be consumed after timeout.
+            HandleKafkaIdle();
           } else {
             err_count_.fetch_add(1, std::memory_order_seq_cst);
             common::Stats::get()->Incr(
@@ -435,5 +744,7 @@ void KafkaWatcher::StartWatchLoop() {
           cycle_end_timestamp_ms - now_ms));
     }
   }
+  HandleKafkaIdle();
+  MaybeCommitOffsets(true /* final */);
   LOG(INFO) << name_ << ": StartWatchLoop has ended";
 }
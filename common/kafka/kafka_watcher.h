@@ -15,6 +15,7 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -34,11 +35,30 @@ namespace kafka {
 class KafkaConsumer;
 
 class KafkaConsumerPool;
+
+class OffsetCommitTracker;
+
+class PartitionDispatcher;
 }  // namespace kafka
 
 typedef std::function<void(std::shared_ptr<const RdKafka::Message> message,
     const bool is_replay)> KafkaMessageHandler;
 
+// Called with the messages of each batch consumed, which have no errors
+typedef std::function<void(
+    const std::vector<std::unique_ptr<RdKafka::Message>>& messages,
+    const bool is_replay)> KafkaBatchMessageHandler;
+
+typedef std::function<void()> KafkaIdleHandler;
+
+// Returns true while the messages consumed can't be handled fast enough
+typedef std::function<bool()> KafkaBackpressureHandler;
+
+// Called with the last offset processed per topic and partition before they
+// are committed to kafka. Returns false to skip this commit.
+typedef std::function<bool(const std::map<std::string, std::map<int32_t,
+    int64_t>>& last_offsets)> KafkaPreCommitHandler;
+
 /**
  * Base class for watchers that want to consume from kafka. Manages the kafka
  * consumer and the consuming thread. Derived class just has to implement the
@@ -83,12 +103,65 @@ public:
   bool Start(const std::map<std::string, std::map<int32_t,
       int64_t>>& last_offsets);
 
+  // idle_handler, if set, is called from the same thread as handler whenever
+  // a consume returns no message, after consuming up to now at start, and
+  // when the watch loop ends. e.g., handlers buffering messages can flush
+  // them then.
   bool StartWith(int64_t initial_kafka_seek_timestamp_ms,
-      KafkaMessageHandler handler);
+      KafkaMessageHandler handler,
+      KafkaIdleHandler idle_handler = nullptr);
 
   bool StartWith(const std::map<std::string, std::map<int32_t,
       int64_t>>& last_offsets,
-      KafkaMessageHandler handler);
+      KafkaMessageHandler handler,
+      KafkaIdleHandler idle_handler = nullptr);
+
+  // Call before starting the watcher to run the handler on n_workers threads
+  // rather than on the watcher thread. The messages (or batches) of a topic
+  // partition are handled one at a time in order, and the watcher waits while
+  // max_pending_per_partition of them are pending. The handler must then be
+  // safe to call concurrently for different partitions. The idle handler
+  // only runs once all messages consumed so far are handled.
+  void EnableParallelHandling(uint32_t n_workers,
+                              uint32_t max_pending_per_partition);
+
+  // Call before starting the watcher to stop fetching from kafka while the
+  // messages can't be handled fast enough, rather than letting librdkafka
+  // queue up more of them. The partitions of a consumer are paused while
+  // backpressure_handler returns true, e.g. while the db written to stalls
+  // writes, or for one consume timeout after handling the messages of a
+  // consume took more than max_handler_latency_ms (if not 0).
+  void SetBackpressureHandler(KafkaBackpressureHandler backpressure_handler,
+                              uint32_t max_handler_latency_ms = 0);
+
+  // Call before starting the watcher to commit the offsets of the messages
+  // handled to kafka, asynchronously every commit_interval_ms or once
+  // max_uncommitted_messages are handled, and synchronously when the watch
+  // loop ends. Only the highest offset handled per partition is committed, so
+  // a message is committed once the handler returned for it and all messages
+  // before it in its partition. Delivery is at least once: the messages
+  // handled after the last commit are handled again after a restart or a
+  // rebalance. pre_commit_handler, if set, runs on the watcher thread before
+  // each commit, e.g. to persist the offsets next to the data they produced,
+  // so that restarting from them with Start(last_offsets) skips what was
+  // persisted. Messages handled since it last ran are still handled again.
+  void EnableOffsetCommits(uint32_t commit_interval_ms,
+                           uint32_t max_uncommitted_messages,
+                           KafkaPreCommitHandler pre_commit_handler = nullptr);
+
+  // Like StartWith(), but consume up to max_batch_size messages at a time
+  // with KafkaConsumer::ConsumeBatch(), and hand each batch over to handler
+  // in one call.
+  bool StartWithBatch(int64_t initial_kafka_seek_timestamp_ms,
+      KafkaBatchMessageHandler handler,
+      uint32_t max_batch_size,
+      KafkaIdleHandler idle_handler = nullptr);
+
+  bool StartWithBatch(const std::map<std::string, std::map<int32_t,
+      int64_t>>& last_offsets,
+      KafkaBatchMessageHandler handler,
+      uint32_t max_batch_size,
+      KafkaIdleHandler idle_handler = nullptr);
 
   // Non blocking call to signal the watch loop to terminate at the
   // next iteration. Can be called to signal multiple KafkaWatchers to
@@ -136,6 +209,8 @@ private:
     }
   }
 
+  virtual void HandleKafkaIdle();
+
   // Derived class should implement if there is code to be run before getting
   // the kafka consumer from the pool. Return false to abort starting the
   // watcher
@@ -165,6 +240,34 @@ private:
   // Returns how many messages are consumed.
   uint32_t ConsumeUpToNow(kafka::KafkaConsumer& consumer);
 
+  // Consume a batch of messages if there is a batch handler, or one message
+  // otherwise. All messages but the last one have no error.
+  std::vector<std::unique_ptr<RdKafka::Message>> ConsumeMessages(
+      kafka::KafkaConsumer& consumer);
+
+  // Record the stats of the messages, and pass them to the handlers with
+  // RunHandlers(). Returns how long the handlers took in ms.
+  uint64_t HandleKafkaNoErrorMessages(
+      std::vector<std::unique_ptr<RdKafka::Message>> messages,
+      const bool is_replay);
+
+  // Pass the messages to the batch handler, or to HandleKafkaNoErrorMessage()
+  // one by one, on the dispatcher if any.
+  void RunHandlers(std::vector<std::unique_ptr<RdKafka::Message>> messages,
+                   const bool is_replay);
+
+  // Pause or resume the partitions of kafka_consumer as backpressure_handler_
+  // and the latency of the handlers tell
+  void MaybePauseOrResume(kafka::KafkaConsumer* const kafka_consumer);
+
+  // Record the messages as handled for EnableOffsetCommits()
+  void MarkHandled(
+      const std::vector<std::unique_ptr<RdKafka::Message>>& messages);
+
+  // Commit the offsets handled if they are due, or synchronously regardless
+  // if is_final
+  void MaybeCommitOffsets(bool is_final);
+
   void StartWatchLoop();
 
   std::thread thread_;
@@ -185,4 +288,25 @@ private:
   const int loop_cycle_limit_ms_;
   // Kafka message handler provided by caller
   KafkaMessageHandler handler_;
+  // Kafka batch message handler provided by caller, which is used instead of
+  // handler_ if set
+  KafkaBatchMessageHandler batch_handler_;
+  uint32_t max_batch_size_{1};
+  // Kafka idle handler provided by caller
+  KafkaIdleHandler idle_handler_;
+  // Kafka backpressure handler provided by caller
+  KafkaBackpressureHandler backpressure_handler_;
+  uint32_t max_handler_latency_ms_{0};
+  // How long the handlers took for the last messages consumed by each
+  // consumer, and the consumers paused, only used by the watcher thread
+  std::unordered_map<const kafka::KafkaConsumer*, uint64_t>
+    handler_latency_ms_;
+  std::unordered_set<const kafka::KafkaConsumer*> paused_consumers_;
+  // The offsets handled with EnableOffsetCommits(), which may be marked by the
+  // workers of dispatcher_
+  std::unique_ptr<kafka::OffsetCommitTracker> commit_tracker_;
+  KafkaPreCommitHandler pre_commit_handler_;
+  // Runs the handlers with EnableParallelHandling(). Declared last to be
+  // destroyed first, which waits for the pending messages.
+  std::unique_ptr<kafka::PartitionDispatcher> dispatcher_;
 };
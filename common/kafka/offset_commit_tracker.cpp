@@ -0,0 +1,86 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/kafka/offset_commit_tracker.h"
+
+#include <chrono>
+#include <utility>
+
+namespace kafka {
+
+OffsetCommitTracker::OffsetCommitTracker(
+    const uint32_t commit_interval_ms,
+    const uint32_t max_uncommitted_messages,
+    std::function<uint64_t(void)> clock)
+    : commit_interval_ms_(commit_interval_ms),
+      max_uncommitted_messages_(max_uncommitted_messages),
+      clock_(std::move(clock)),
+      mutex_(),
+      offsets_(),
+      n_uncommitted_messages_(0),
+      last_commit_ms_(clock_()) {}
+
+void OffsetCommitTracker::MarkProcessed(const std::string& topic_name,
+                                        const int32_t partition_id,
+                                        const int64_t offset,
+                                        const uint32_t n_messages) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itor = offsets_.emplace(std::make_pair(topic_name, partition_id),
+                               offset).first;
+  if (itor->second < offset) {
+    itor->second = offset;
+  }
+  n_uncommitted_messages_ += n_messages;
+}
+
+bool OffsetCommitTracker::IsCommitDue() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (offsets_.empty()) {
+    return false;
+  }
+
+  if (max_uncommitted_messages_ > 0 &&
+      n_uncommitted_messages_ >= max_uncommitted_messages_) {
+    return true;
+  }
+
+  return commit_interval_ms_ > 0 &&
+    clock_() >= last_commit_ms_ + commit_interval_ms_;
+}
+
+TopicPartitionToValueMap<int64_t> OffsetCommitTracker::TakeOffsets() {
+  TopicPartitionToValueMap<int64_t> offsets;
+  std::lock_guard<std::mutex> lock(mutex_);
+  offsets.swap(offsets_);
+  n_uncommitted_messages_ = 0;
+  last_commit_ms_ = clock_();
+  return offsets;
+}
+
+void OffsetCommitTracker::Restore(
+    const TopicPartitionToValueMap<int64_t>& offsets) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& topic_partition_offset : offsets) {
+    // a higher offset processed since then supersedes the restored one
+    offsets_.emplace(topic_partition_offset);
+  }
+}
+
+uint64_t OffsetCommitTracker::GetCurrentTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace kafka
@@ -0,0 +1,72 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "common/kafka/kafka_utils.h"
+
+namespace kafka {
+
+/**
+ * Tracks the highest offset processed per topic partition, to commit them in
+ * batches rather than per message, which overloads the group coordinator.
+ * Offsets are due for a commit every commit_interval_ms, or once
+ * max_uncommitted_messages are processed since the last commit, whichever
+ * comes first. 0 disables either trigger. Thread safe.
+ */
+class OffsetCommitTracker {
+ public:
+  // clock returns the current time in milliseconds.
+  OffsetCommitTracker(uint32_t commit_interval_ms,
+                      uint32_t max_uncommitted_messages,
+                      std::function<uint64_t(void)> clock = GetCurrentTimeMs);
+
+  // no copy nor move
+  OffsetCommitTracker(const OffsetCommitTracker&) = delete;
+  OffsetCommitTracker& operator=(const OffsetCommitTracker&) = delete;
+
+  // Record that the messages of a topic partition up to offset are processed
+  void MarkProcessed(const std::string& topic_name, int32_t partition_id,
+                     int64_t offset, uint32_t n_messages = 1);
+
+  // Whether the offsets processed should be committed now
+  bool IsCommitDue();
+
+  // Take the highest offsets processed since the last call, and restart the
+  // commit interval.
+  TopicPartitionToValueMap<int64_t> TakeOffsets();
+
+  // Give back offsets which failed to commit, to retry them with the next
+  // ones unless higher offsets were processed in the meantime.
+  void Restore(const TopicPartitionToValueMap<int64_t>& offsets);
+
+ private:
+  static uint64_t GetCurrentTimeMs();
+
+  const uint32_t commit_interval_ms_;
+  const uint32_t max_uncommitted_messages_;
+  const std::function<uint64_t(void)> clock_;
+
+  std::mutex mutex_;
+  TopicPartitionToValueMap<int64_t> offsets_;
+  uint64_t n_uncommitted_messages_;
+  uint64_t last_commit_ms_;
+};
+
+}  // namespace kafka
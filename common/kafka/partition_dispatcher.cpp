@@ -0,0 +1,122 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/kafka/partition_dispatcher.h"
+
+#include "glog/logging.h"
+#if __GNUC__ >= 8
+#include "folly/system/ThreadName.h"
+#else
+#include "folly/ThreadName.h"
+#endif
+
+namespace kafka {
+
+PartitionDispatcher::PartitionDispatcher(
+    const std::string& name,
+    const uint32_t n_workers,
+    const uint32_t max_pending_tasks_per_partition)
+    : max_pending_tasks_per_partition_(max_pending_tasks_per_partition),
+      workers_() {
+  CHECK_GT(n_workers, 0u);
+  CHECK_GT(max_pending_tasks_per_partition_, 0u);
+  for (uint32_t i = 0; i < n_workers; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (auto& worker : workers_) {
+    worker->thread = std::thread([this, name, worker = worker.get()] {
+      folly::setThreadName(name);
+      RunWorker(worker);
+    });
+  }
+}
+
+PartitionDispatcher::~PartitionDispatcher() {
+  for (auto& worker : workers_) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->stopping = true;
+    }
+    worker->cv.notify_all();
+  }
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+void PartitionDispatcher::Add(const std::string& topic_name,
+                              const int32_t partition_id,
+                              std::function<void()> task) {
+  auto key = std::make_pair(topic_name, partition_id);
+  auto& worker =
+    *workers_[boost::hash<std::pair<std::string, int32_t>>()(key) %
+              workers_.size()];
+
+  std::unique_lock<std::mutex> lock(worker.mutex);
+  worker.cv.wait(lock, [this, &worker, &key] {
+    auto itor = worker.pending.find(key);
+    return itor == worker.pending.end() ||
+      itor->second < max_pending_tasks_per_partition_;
+  });
+  ++worker.pending[key];
+  ++worker.n_pending;
+  worker.tasks.emplace_back(std::move(key), std::move(task));
+  lock.unlock();
+  worker.cv.notify_all();
+}
+
+void PartitionDispatcher::Drain() {
+  for (auto& worker : workers_) {
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    worker->cv.wait(lock, [&worker] { return worker->n_pending == 0; });
+  }
+}
+
+uint64_t PartitionDispatcher::PendingTasks() {
+  uint64_t n = 0;
+  for (auto& worker : workers_) {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    n += worker->n_pending;
+  }
+  return n;
+}
+
+void PartitionDispatcher::RunWorker(Worker* worker) {
+  std::unique_lock<std::mutex> lock(worker->mutex);
+  while (true) {
+    worker->cv.wait(lock, [worker] {
+      return !worker->tasks.empty() || worker->stopping;
+    });
+    if (worker->tasks.empty()) {
+      // stopping, with all tasks done
+      return;
+    }
+
+    auto task = std::move(worker->tasks.front());
+    worker->tasks.pop_front();
+    lock.unlock();
+    task.second();
+    lock.lock();
+
+    auto itor = worker->pending.find(task.first);
+    if (--itor->second == 0) {
+      worker->pending.erase(itor);
+    }
+    --worker->n_pending;
+    worker->cv.notify_all();
+  }
+}
+
+}  // namespace kafka
@@ -0,0 +1,83 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "boost/functional/hash.hpp"
+#include "common/kafka/kafka_utils.h"
+
+namespace kafka {
+
+/**
+ * Runs the tasks added for kafka topic partitions on a pool of workers. The
+ * tasks of a topic partition run one at a time in the order they are added,
+ * always on the same worker, while different partitions run in parallel.
+ * Add() blocks while a partition has too many pending tasks, which pushes
+ * back on the consumer of a slow partition only.
+ */
+class PartitionDispatcher {
+ public:
+  PartitionDispatcher(const std::string& name,
+                      const uint32_t n_workers,
+                      const uint32_t max_pending_tasks_per_partition);
+
+  // Waits for the pending tasks and stops the workers
+  ~PartitionDispatcher();
+
+  // no copy nor move
+  PartitionDispatcher(const PartitionDispatcher&) = delete;
+  PartitionDispatcher& operator=(const PartitionDispatcher&) = delete;
+
+  // Run task after the ones added for the same partition before.
+  void Add(const std::string& topic_name, const int32_t partition_id,
+           std::function<void()> task);
+
+  // Block until all tasks added so far are done
+  void Drain();
+
+  // The number of tasks added but not done yet
+  uint64_t PendingTasks();
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<std::pair<std::string, int32_t>,
+                         std::function<void()>>> tasks;
+    // the tasks queued or running per partition
+    TopicPartitionToValueMap<uint32_t> pending;
+    uint64_t n_pending = 0;
+    bool stopping = false;
+    std::thread thread;
+  };
+
+  void RunWorker(Worker* worker);
+
+  const uint32_t max_pending_tasks_per_partition_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+}  // namespace kafka
@@ -0,0 +1,393 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/kafka/shared_kafka_consumer.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/kafka/kafka_flags.h"
+#include "common/kafka/stats_enum.h"
+#include "common/stats/stats.h"
+#include "common/timeutil.h"
+#include "glog/logging.h"
+#include "librdkafka/rdkafkacpp.h"
+
+namespace kafka {
+
+SharedKafkaConsumer::SharedKafkaConsumer(
+    const std::string& name,
+    std::shared_ptr<RdKafka::KafkaConsumer> consumer,
+    const uint32_t max_batch_size,
+    const int32_t consume_timeout_ms)
+    : name_(name),
+      consumer_(std::move(consumer)),
+      max_batch_size_(max_batch_size),
+      consume_timeout_ms_(consume_timeout_ms),
+      partitions_(),
+      n_partitions_(0),
+      requests_lock_(),
+      requests_cv_(),
+      requests_(),
+      stopping_(false),
+      thread_() {
+  CHECK(consumer_ != nullptr);
+  CHECK_GT(max_batch_size_, 0u);
+  thread_ = std::thread(&SharedKafkaConsumer::Run, this);
+}
+
+SharedKafkaConsumer::~SharedKafkaConsumer() {
+  {
+    std::lock_guard<std::mutex> lock(requests_lock_);
+    stopping_.store(true);
+  }
+  requests_cv_.notify_all();
+  thread_.join();
+  consumer_->close();
+}
+
+bool SharedKafkaConsumer::AddPartition(const std::string& topic_name,
+                                       const int32_t partition_id,
+                                       const int64_t start_timestamp_ms,
+                                       KafkaBatchMessageHandler handler,
+                                       KafkaIdleHandler idle_handler,
+                                       const int64_t start_offset) {
+  auto request = std::make_shared<Request>();
+  request->is_add = true;
+  request->topic_partition = std::make_pair(topic_name, partition_id);
+  request->start_timestamp_ms = start_timestamp_ms;
+  request->start_offset = start_offset;
+  request->handler = std::move(handler);
+  request->idle_handler = std::move(idle_handler);
+  request->added_timestamp_ms = common::timeutil::GetCurrentTimestamp(
+      common::timeutil::TimeUnit::kMillisecond);
+
+  std::unique_lock<std::mutex> lock(requests_lock_);
+  if (stopping_.load()) {
+    return false;
+  }
+  requests_.push_back(request);
+  requests_cv_.notify_all();
+  requests_cv_.wait(lock, [&request] { return request->done; });
+  return request->ok;
+}
+
+bool SharedKafkaConsumer::RemovePartition(const std::string& topic_name,
+                                          const int32_t partition_id) {
+  auto request = std::make_shared<Request>();
+  request->is_add = false;
+  request->topic_partition = std::make_pair(topic_name, partition_id);
+
+  std::unique_lock<std::mutex> lock(requests_lock_);
+  if (stopping_.load()) {
+    return false;
+  }
+  requests_.push_back(request);
+  requests_cv_.notify_all();
+  requests_cv_.wait(lock, [&request] { return request->done; });
+  return request->ok;
+}
+
+void SharedKafkaConsumer::Run() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(requests_lock_);
+      // Nothing to consume until a partition is added
+      requests_cv_.wait(lock, [this] {
+        return stopping_.load() || !requests_.empty() || !partitions_.empty();
+      });
+      if (stopping_.load()) {
+        break;
+      }
+    }
+
+    ProcessRequests();
+    if (!partitions_.empty()) {
+      ConsumeAndRoute();
+    }
+  }
+
+  for (auto& p : partitions_) {
+    HandleIdle(&p.second);
+    if (p.second.add_request != nullptr) {
+      Finish(p.second.add_request.get(), false);
+    }
+  }
+  partitions_.clear();
+  n_partitions_.store(0);
+
+  std::deque<std::shared_ptr<Request>> requests;
+  {
+    std::lock_guard<std::mutex> lock(requests_lock_);
+    requests.swap(requests_);
+  }
+  for (auto& request : requests) {
+    Finish(request.get(), false);
+  }
+  LOG(INFO) << name_ << ": Stopped consuming";
+}
+
+void SharedKafkaConsumer::ProcessRequests() {
+  std::deque<std::shared_ptr<Request>> requests;
+  {
+    std::lock_guard<std::mutex> lock(requests_lock_);
+    requests.swap(requests_);
+  }
+  if (requests.empty()) {
+    return;
+  }
+
+  for (auto& request : requests) {
+    const auto& topic_partition = request->topic_partition;
+    auto itor = partitions_.find(topic_partition);
+    if (request->is_add) {
+      if (itor != partitions_.end()) {
+        LOG(ERROR) << name_ << ": Already consuming topic: "
+                   << topic_partition.first << ", partition: "
+                   << topic_partition.second;
+        Finish(request.get(), false);
+        continue;
+      }
+
+      Partition partition;
+      partition.handler = std::move(request->handler);
+      partition.idle_handler = std::move(request->idle_handler);
+      partition.start_timestamp_ms = request->start_timestamp_ms;
+      partition.next_offset = request->start_offset;
+      partition.add_request = request;
+      partitions_.emplace(topic_partition, std::move(partition));
+      LOG(INFO) << name_ << ": Adding topic: " << topic_partition.first
+                << ", partition: " << topic_partition.second
+                << ", from timestamp: " << request->start_timestamp_ms;
+      continue;
+    }
+
+    if (itor == partitions_.end()) {
+      LOG(ERROR) << name_ << ": Not consuming topic: " << topic_partition.first
+                 << ", partition: " << topic_partition.second;
+      Finish(request.get(), false);
+      continue;
+    }
+
+    HandleIdle(&itor->second);
+    if (itor->second.add_request != nullptr) {
+      Finish(itor->second.add_request.get(), false);
+    }
+    partitions_.erase(itor);
+    LOG(INFO) << name_ << ": Removed topic: " << topic_partition.first
+              << ", partition: " << topic_partition.second;
+    Finish(request.get(), true);
+  }
+
+  // The messages fetched for the removed partitions are dropped while
+  // routing
+  AssignPartitions();
+  n_partitions_.store(partitions_.size());
+}
+
+void SharedKafkaConsumer::AssignPartitions() {
+  while (!stopping_.load()) {
+    // KafkaConsumer::assign() replaces the whole assignment and forgets the
+    // positions, so all partitions are seeked again
+    std::vector<std::unique_ptr<RdKafka::TopicPartition>> topic_partitions;
+    std::vector<RdKafka::TopicPartition*> tmp_topic_partitions;
+    topic_partitions.reserve(partitions_.size());
+    tmp_topic_partitions.reserve(partitions_.size());
+    for (const auto& p : partitions_) {
+      topic_partitions.emplace_back(RdKafka::TopicPartition::create(
+          p.first.first, p.first.second, RdKafka::Topic::OFFSET_END));
+      tmp_topic_partitions.push_back(topic_partitions.back().get());
+    }
+
+    std::vector<std::pair<std::string, int32_t>> failed;
+    const auto error_code = ExecuteKafkaOperationWithRetry(
+        [this, &tmp_topic_partitions]() {
+          return consumer_->assign(tmp_topic_partitions);
+        });
+    if (error_code != RdKafka::ERR_NO_ERROR) {
+      LOG(ERROR) << name_ << ": Failed to assign partitions, error_code: "
+                 << RdKafka::err2str(error_code);
+      common::Stats::get()->Incr(getFullStatsName(
+          kKafkaConsumerErrorAssign,
+          {"kafka_consumer_type=" + name_,
+           "error_code=" + std::to_string(error_code)}));
+      for (const auto& p : partitions_) {
+        failed.push_back(p.first);
+      }
+    } else {
+      for (auto* topic_partition : tmp_topic_partitions) {
+        const auto& partition = partitions_[std::make_pair(
+            topic_partition->topic(), topic_partition->partition())];
+        if (partition.next_offset >= 0) {
+          topic_partition->set_offset(partition.next_offset);
+        } else {
+          // Find the offset of the first message since start_timestamp_ms
+          topic_partition->set_offset(partition.start_timestamp_ms);
+          std::vector<RdKafka::TopicPartition*> offsets({topic_partition});
+          const auto error_code = ExecuteKafkaOperationWithRetry(
+              [this, &offsets]() {
+                return consumer_->offsetsForTimes(
+                    offsets, FLAGS_kafka_consumer_timeout_ms);
+              });
+          if (error_code != RdKafka::ERR_NO_ERROR) {
+            LOG(ERROR) << name_ << ": Failed to get offset for topic: "
+                       << topic_partition->topic() << ", partition: "
+                       << topic_partition->partition() << ", timestamp_ms: "
+                       << partition.start_timestamp_ms << ", error_code: "
+                       << RdKafka::err2str(error_code);
+            failed.emplace_back(topic_partition->topic(),
+                                topic_partition->partition());
+            continue;
+          }
+        }
+
+        if (!KafkaSeekWithRetry(consumer_.get(), *topic_partition)) {
+          failed.emplace_back(topic_partition->topic(),
+                              topic_partition->partition());
+        }
+      }
+    }
+
+    if (failed.empty()) {
+      return;
+    }
+
+    // Give up on the partitions being added, but keep trying for the ones
+    // already consumed
+    bool removed = false;
+    for (const auto& topic_partition : failed) {
+      auto itor = partitions_.find(topic_partition);
+      if (itor->second.add_request == nullptr) {
+        continue;
+      }
+      LOG(ERROR) << name_ << ": Can't consume topic: " << topic_partition.first
+                 << ", partition: " << topic_partition.second;
+      Finish(itor->second.add_request.get(), false);
+      partitions_.erase(itor);
+      removed = true;
+    }
+    if (!removed) {
+      common::Stats::get()->Incr(getFullStatsName(
+          kKafkaConsumerErrorSeek, {"kafka_consumer_type=" + name_}));
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(consume_timeout_ms_));
+    }
+  }
+}
+
+void SharedKafkaConsumer::ConsumeAndRoute() {
+  // Consecutive messages of the same partition are handled together
+  Partition* partition = nullptr;
+  std::vector<std::unique_ptr<RdKafka::Message>> messages;
+  auto flush = [&partition, &messages] {
+    if (!messages.empty()) {
+      partition->handler(messages, partition->add_request != nullptr);
+      messages.clear();
+    }
+  };
+
+  for (uint32_t i = 0; i < max_batch_size_; ++i) {
+    // Only wait for the first message
+    std::unique_ptr<RdKafka::Message> message(
+        consumer_->consume(i == 0 ? consume_timeout_ms_ : 0));
+    if (message == nullptr) {
+      break;
+    }
+
+    const auto error_code = message->err();
+    if (error_code != RdKafka::ERR_NO_ERROR &&
+        error_code != RdKafka::ERR__PARTITION_EOF) {
+      flush();
+      if (error_code == RdKafka::ERR__TIMED_OUT) {
+        // Nothing more fetched yet
+        if (i == 0) {
+          for (auto& p : partitions_) {
+            HandleIdle(&p.second);
+          }
+        }
+      } else {
+        LOG_EVERY_N(ERROR, 100)
+            << name_ << ": Failed to consume from kafka, error_code: "
+            << RdKafka::err2str(error_code);
+        common::Stats::get()->Incr(getFullStatsName(
+            kKafkaConsumerErrorConsume,
+            {"kafka_consumer_type=" + name_,
+             "error_code=" + std::to_string(error_code)}));
+        // Sleep here to prevent potential busy loop which exhausts the CPU.
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(consume_timeout_ms_));
+      }
+      return;
+    }
+
+    auto itor = partitions_.find(
+        std::make_pair(message->topic_name(), message->partition()));
+    if (itor == partitions_.end()) {
+      // Fetched before the partition was removed
+      continue;
+    }
+    if (&itor->second != partition) {
+      flush();
+      partition = &itor->second;
+    }
+
+    if (error_code == RdKafka::ERR__PARTITION_EOF) {
+      flush();
+      HandleIdle(partition);
+      CatchUp(partition);
+      continue;
+    }
+
+    partition->next_offset = message->offset() + 1;
+    const bool caught_up = partition->add_request != nullptr &&
+        GetMessageTimestamp(*message) >=
+            partition->add_request->added_timestamp_ms;
+    messages.push_back(std::move(message));
+    if (caught_up) {
+      flush();
+      HandleIdle(partition);
+      CatchUp(partition);
+    }
+  }
+
+  flush();
+}
+
+void SharedKafkaConsumer::CatchUp(Partition* partition) {
+  if (partition->add_request != nullptr) {
+    Finish(partition->add_request.get(), true);
+    partition->add_request.reset();
+  }
+}
+
+void SharedKafkaConsumer::HandleIdle(Partition* partition) {
+  if (partition->idle_handler) {
+    partition->idle_handler();
+  }
+}
+
+void SharedKafkaConsumer::Finish(Request* request, const bool ok) {
+  {
+    std::lock_guard<std::mutex> lock(requests_lock_);
+    request->done = true;
+    request->ok = ok;
+  }
+  requests_cv_.notify_all();
+}
+
+}  // namespace kafka
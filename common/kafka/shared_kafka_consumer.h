@@ -0,0 +1,152 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "common/kafka/kafka_utils.h"
+#include "common/kafka/kafka_watcher.h"
+
+namespace RdKafka {
+class KafkaConsumer;
+}  // namespace RdKafka
+
+namespace kafka {
+
+/**
+ * One kafka consumer, consumed by one thread, which is assigned many topic
+ * partitions and routes their messages to a handler per partition. Partitions
+ * can be added and removed while it runs. Unlike KafkaWatcher, it doesn't
+ * cost a kafka connection and a thread per partition.
+ *
+ * The handlers of all partitions run on the consumer thread, one at a time.
+ * A partition's messages are replay messages until its end was reached once.
+ */
+class SharedKafkaConsumer {
+ public:
+  // consumer must not have any partition assigned, and is closed on
+  // destruction. Up to max_batch_size messages are passed to a handler at
+  // once.
+  SharedKafkaConsumer(const std::string& name,
+                      std::shared_ptr<RdKafka::KafkaConsumer> consumer,
+                      const uint32_t max_batch_size,
+                      const int32_t consume_timeout_ms);
+
+  // Stops consuming, calling the idle handler of every partition last
+  ~SharedKafkaConsumer();
+
+  // no copy nor move
+  SharedKafkaConsumer(const SharedKafkaConsumer&) = delete;
+  SharedKafkaConsumer& operator=(const SharedKafkaConsumer&) = delete;
+
+  // Consume topic_name/partition_id from start_timestamp_ms on, or from
+  // start_offset if not -1, and pass its messages to handler. idle_handler
+  // is called whenever there are no more messages for now. It blocks until
+  // the partition has caught up, and returns false if it is already added or
+  // can't be consumed.
+  bool AddPartition(const std::string& topic_name,
+                    const int32_t partition_id,
+                    const int64_t start_timestamp_ms,
+                    KafkaBatchMessageHandler handler,
+                    KafkaIdleHandler idle_handler = nullptr,
+                    const int64_t start_offset = -1);
+
+  // Stop consuming topic_name/partition_id. Once it returns, the handlers of
+  // the partition are not running and won't be called anymore. The idle
+  // handler is called one last time. It returns false if the partition was
+  // not added.
+  bool RemovePartition(const std::string& topic_name,
+                       const int32_t partition_id);
+
+  // The number of partitions added and not removed yet
+  uint32_t NumPartitions() const {
+    return n_partitions_.load();
+  }
+
+ private:
+  // A pending AddPartition() or RemovePartition() call
+  struct Request {
+    bool is_add;
+    std::pair<std::string, int32_t> topic_partition;
+    int64_t start_timestamp_ms;
+    int64_t start_offset;
+    KafkaBatchMessageHandler handler;
+    KafkaIdleHandler idle_handler;
+    // the partition has caught up once it reaches its end, or a message
+    // produced after this
+    int64_t added_timestamp_ms;
+    bool done = false;
+    bool ok = false;
+  };
+
+  struct Partition {
+    KafkaBatchMessageHandler handler;
+    KafkaIdleHandler idle_handler;
+    int64_t start_timestamp_ms;
+    // the offset of the next message to consume, or -1 to seek to
+    // start_timestamp_ms
+    int64_t next_offset = -1;
+    // the AddPartition() call waiting for the partition to catch up
+    std::shared_ptr<Request> add_request;
+  };
+
+  void Run();
+
+  // Apply the pending requests, and assign the partitions to the consumer
+  // if they changed
+  void ProcessRequests();
+
+  // Assign all partitions_ to the consumer, and seek each to where it
+  // should continue from. Partitions which fail to seek are removed.
+  void AssignPartitions();
+
+  void ConsumeAndRoute();
+
+  // Let the AddPartition() call of partition return
+  void CatchUp(Partition* partition);
+
+  void HandleIdle(Partition* partition);
+
+  // Mark request done, and wake up its caller
+  void Finish(Request* request, const bool ok);
+
+  const std::string name_;
+  const std::shared_ptr<RdKafka::KafkaConsumer> consumer_;
+  const uint32_t max_batch_size_;
+  const int32_t consume_timeout_ms_;
+
+  // Only used by the consumer thread
+  TopicPartitionToValueMap<Partition> partitions_;
+  std::atomic<uint32_t> n_partitions_;
+
+  std::mutex requests_lock_;
+  std::condition_variable requests_cv_;
+  std::deque<std::shared_ptr<Request>> requests_;
+  std::atomic<bool> stopping_;
+
+  std::thread thread_;
+};
+
+}  // namespace kafka
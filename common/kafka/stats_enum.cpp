@@ -14,7 +14,11 @@
 
 #include "common/kafka/stats_enum.h"
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -38,3 +42,28 @@ std::string getFullStatsName(const std::string& metric_name,
   }
   return full_metric_name;
 }
+
+void SetKafkaGauge(const std::string& gauge_name, const uint64_t value) {
+  static std::mutex gauges_mutex;
+  static auto gauges =
+    new std::unordered_map<std::string, std::shared_ptr<std::atomic<uint64_t>>>();
+
+  std::shared_ptr<std::atomic<uint64_t>> gauge;
+  bool is_new;
+  {
+    std::lock_guard<std::mutex> g(gauges_mutex);
+    auto& stored_gauge = (*gauges)[gauge_name];
+    is_new = stored_gauge == nullptr;
+    if (is_new) {
+      stored_gauge = std::make_shared<std::atomic<uint64_t>>(0);
+    }
+    gauge = stored_gauge;
+  }
+
+  gauge->store(value);
+  if (is_new) {
+    common::Stats::get()->RegisterGauge(gauge_name, [gauge] {
+        return gauge->load();
+      });
+  }
+}
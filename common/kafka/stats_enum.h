@@ -27,6 +27,15 @@ const std::string kKafkaConsumerMessageNull = "kKafkaConsumerMessageNull";
 const std::string kKafkaWatcherMessageMissing = "kafka_watcher_message_missing";
 const std::string kKafkaWatcherMessageDuplicates = "kafka_watcher_message_duplicates";
 const std::string kKafkaWatcherNeedReEstablish = "kafka_watcher_need_reestablish";
+const std::string kKafkaWatcherPause = "kafka_watcher_pause";
+const std::string kKafkaWatcherHandlerMs = "kafka_watcher_handler_ms";
+const std::string kKafkaWatcherBatchSize = "kafka_watcher_batch_size";
+const std::string kKafkaWatcherMessages = "kafka_watcher_messages";
+const std::string kKafkaWatcherBytes = "kafka_watcher_bytes";
+const std::string kKafkaWatcherCommits = "kafka_watcher_commits";
+const std::string kKafkaWatcherCommitErrors = "kafka_watcher_commit_errors";
+const std::string kKafkaConsumerConsumeMs = "kafka_consumer_consume_ms";
+const std::string kKafkaConsumerLag = "kafka_consumer_lag";
 const std::string kKafkaWatcherBlockingConsumeTimeout =
     "kafka_watcher_blocking_consume_timeout";
 const std::string kKafkaWatcherInitMs = "kafka_watcher_init_ms";
@@ -36,6 +45,12 @@ const std::string kKafkaMsgNumBytes = "kafka_msg_num_bytes";
 const std::string kKafkaResets = "kafka_consumer_resets";
 const std::string kKafkaResetsInLoop = "kafka_consumer_resets_in_loop";
 const std::string kKafkaResetSleepMillis = "kafka_consumer_reset_sleep_ms";
+const std::string kKafkaBrokerUpdates = "kafka_consumer_broker_updates";
 
 std::string getFullStatsName(const std::string& metric_name,
     const std::initializer_list<std::string>& tags);
+
+// Set the value of a gauge, registering it with common::Stats on first use.
+// Stats can't unregister gauges, so the last value set is reported after the
+// consumer setting it is gone.
+void SetKafkaGauge(const std::string& gauge_name, const uint64_t value);
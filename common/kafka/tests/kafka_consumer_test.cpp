@@ -13,13 +13,19 @@
 /// limitations under the License.
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <unordered_set>
 #include <vector>
 
+#include "folly/FileUtil.h"
 #include "gtest/gtest.h"
 #include "librdkafka/rdkafkacpp.h"
+#include "common/kafka/stats_enum.h"
 #include "common/kafka/tests/mock_kafka_cluster.h"
 #include "common/kafka/tests/mock_kafka_consumer.h"
 
@@ -85,6 +91,86 @@ TEST_F(KafkaConsumerTest, TestSingleTopic) {
   EXPECT_EQ(records_.size(), offset);
 }
 
+TEST_F(KafkaConsumerTest, TestConsumeBatch) {
+  const int32_t partition_id = 4;
+  const std::string topic_name = "topic0";
+
+  KafkaConsumer kafka_consumer(std::make_shared<RdKafka::MockKafkaConsumer>(mock_kafka_cluster_),
+                               std::unordered_set<uint32_t>({partition_id}),
+                               std::unordered_set<std::string>({topic_name}),
+                               "UnitTestKafkaConsumer");
+
+  ASSERT_TRUE(kafka_consumer.Seek(topic_name, 16 /* timestamp_ms */));
+
+  // A full batch
+  auto messages = kafka_consumer.ConsumeBatch(3, -1 /* timeout_ms */);
+  ASSERT_EQ(3, messages.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(RdKafka::ERR_NO_ERROR, messages[i]->err());
+    EXPECT_EQ(records_[3 + i].payload,
+              std::string(static_cast<char*>(messages[i]->payload())));
+    EXPECT_EQ(3 + i, messages[i]->offset());
+  }
+
+  // The batch ends with the end of the partition
+  messages = kafka_consumer.ConsumeBatch(3, -1 /* timeout_ms */);
+  ASSERT_EQ(2, messages.size());
+  EXPECT_EQ(RdKafka::ERR_NO_ERROR, messages[0]->err());
+  EXPECT_EQ(records_[6].payload,
+            std::string(static_cast<char*>(messages[0]->payload())));
+  EXPECT_EQ(RdKafka::ERR__PARTITION_EOF, messages[1]->err());
+}
+
+TEST_F(KafkaConsumerTest, TestPauseAndResume) {
+  const int32_t partition_id = 4;
+  const std::string topic_name = "topic0";
+
+  KafkaConsumer kafka_consumer(std::make_shared<RdKafka::MockKafkaConsumer>(mock_kafka_cluster_),
+                               std::unordered_set<uint32_t>({partition_id}),
+                               std::unordered_set<std::string>({topic_name}),
+                               "UnitTestKafkaConsumer");
+
+  ASSERT_TRUE(kafka_consumer.Seek(topic_name, 16 /* timestamp_ms */));
+
+  std::unique_ptr<RdKafka::Message> message(kafka_consumer.Consume(-1 /* timeout_ms */));
+  EXPECT_EQ(RdKafka::ERR_NO_ERROR, message->err());
+  EXPECT_EQ(3, message->offset());
+
+  // Nothing is consumed while paused
+  ASSERT_TRUE(kafka_consumer.Pause());
+  message.reset(kafka_consumer.Consume(0 /* timeout_ms */));
+  EXPECT_EQ(RdKafka::ERR__TIMED_OUT, message->err());
+
+  // and it goes on from where it was once resumed
+  ASSERT_TRUE(kafka_consumer.Resume());
+  message.reset(kafka_consumer.Consume(-1 /* timeout_ms */));
+  EXPECT_EQ(RdKafka::ERR_NO_ERROR, message->err());
+  EXPECT_EQ(4, message->offset());
+}
+
+TEST_F(KafkaConsumerTest, TestLagGauge) {
+  const int32_t partition_id = 4;
+  const std::string topic_name = "topic0";
+
+  KafkaConsumer kafka_consumer(std::make_shared<RdKafka::MockKafkaConsumer>(mock_kafka_cluster_),
+                               std::unordered_set<uint32_t>({partition_id}),
+                               std::unordered_set<std::string>({topic_name}),
+                               "UnitTestKafkaConsumer");
+
+  ASSERT_TRUE(kafka_consumer.Seek(topic_name, 16 /* timestamp_ms */));
+  std::unique_ptr<RdKafka::Message> message(kafka_consumer.Consume(-1 /* timeout_ms */));
+  EXPECT_EQ(3, message->offset());
+
+  // The gauges are exported periodically
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  auto gauge = common::Stats::get()->GetGauge(getFullStatsName(
+      kKafkaConsumerLag,
+      {"kafka_consumer_type=UnitTestKafkaConsumer", "topic=topic0", "partition=4"}));
+  ASSERT_NE(nullptr, gauge);
+  // Offsets 4, 5 and 6 are not consumed yet
+  EXPECT_EQ(3, gauge->GetValue());
+}
+
 TEST_F(KafkaConsumerTest, TestMultipleTopicPartitions) {
   const std::unordered_set<uint32_t> partition_ids{1, 2, 10};
   const std::unordered_set<std::string> topic_names({"topic0", "topic2"});
@@ -286,6 +372,41 @@ TEST_F(KafkaConsumerTest, TestSeekInvalidTopic) {
   EXPECT_FALSE(kafka_consumer.Seek("topic1", 2));
 }
 
+TEST(WatchedFilesTest, OnlyChangedFiles) {
+  const std::string brokers_path = "/tmp/kafka_consumer_test_brokers";
+  const std::string certs_path = "/tmp/kafka_consumer_test_certs";
+  const std::string missing_path = "/tmp/kafka_consumer_test_missing";
+  ASSERT_TRUE(folly::writeFile(std::string("host1:9092\n"),
+                               brokers_path.c_str()));
+  ASSERT_TRUE(folly::writeFile(std::string("cert"), certs_path.c_str()));
+  std::remove(missing_path.c_str());
+
+  // Seeded with the files which exist at registration
+  auto contents = ReadWatchedFiles({brokers_path, certs_path, missing_path});
+  EXPECT_EQ(contents.size(), 2);
+  EXPECT_EQ(contents[certs_path], "cert");
+
+  // A change of the brokers comes with the certs unchanged, which are not
+  // a change
+  auto changed = UpdateWatchedFileContents(
+    {{brokers_path, "host2:9092\n"}, {certs_path, "cert"}}, &contents);
+  EXPECT_EQ(changed, std::vector<std::string>({brokers_path}));
+  EXPECT_EQ(contents[brokers_path], "host2:9092\n");
+
+  // Neither is a callback with the same contents again
+  changed = UpdateWatchedFileContents(
+    {{brokers_path, "host2:9092\n"}, {certs_path, "cert"}}, &contents);
+  EXPECT_TRUE(changed.empty());
+
+  // A file created after the registration is
+  changed = UpdateWatchedFileContents(
+    {{certs_path, "cert"}, {missing_path, "new"}}, &contents);
+  EXPECT_EQ(changed, std::vector<std::string>({missing_path}));
+
+  std::remove(brokers_path.c_str());
+  std::remove(certs_path.c_str());
+}
+
 }  // namespace kafka
 
 int main(int argc, char** argv) {
@@ -147,6 +147,21 @@ public:
     return std::make_unique<Iterator>(topic_name, partition_id, &partition, last_offset);
   }
 
+  // The offset after the last record in the partition. Returns -1 if the
+  // partition does not exist
+  int64_t HighWatermark(const std::string& topic_name, int32_t partition_id) {
+    const auto name_topic_pair = topics_.find(topic_name);
+    if (name_topic_pair == topics_.end()) {
+      return -1;
+    }
+
+    auto id_partition_pair = name_topic_pair->second.find(partition_id);
+    if (id_partition_pair == name_topic_pair->second.end()) {
+      return -1;
+    }
+    return id_partition_pair->second.size();
+  }
+
   void AddRecord(const std::string& topic_name,
                  int32_t partition_id,
                  std::string payload,
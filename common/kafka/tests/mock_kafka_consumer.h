@@ -153,6 +153,11 @@ public:
   Message* consume(int timeout_ms) override {
     for (auto it = topic_partition_to_iter_map_.begin();
          it != topic_partition_to_iter_map_.end();) {
+      if (paused_topic_partitions_.find(it->first) != paused_topic_partitions_.end()) {
+        ++it;
+        continue;
+      }
+
       const auto& kafka_iter = it->second;
       const auto& topic_name = kafka_iter->topic_name_;
       const auto partition_id = kafka_iter->partition_id_;
@@ -203,6 +208,32 @@ public:
 
   ErrorCode close() override { return ERR_NO_ERROR; }
 
+  ErrorCode get_watermark_offsets(const std::string& topic,
+                                  int32_t partition,
+                                  int64_t* low,
+                                  int64_t* high) override {
+    *low = 0;
+    *high = mock_kafka_cluster_->HighWatermark(topic, partition);
+    return *high < 0 ? ERR__UNKNOWN_PARTITION : ERR_NO_ERROR;
+  }
+
+  // Paused topic partitions are skipped by consume() until resumed
+  ErrorCode pause(std::vector<TopicPartition*>& partitions) override {
+    for (const auto* topic_partition : partitions) {
+      paused_topic_partitions_.insert(
+          GetTopicPartitionKey(topic_partition->topic(), topic_partition->partition()));
+    }
+    return ERR_NO_ERROR;
+  }
+
+  ErrorCode resume(std::vector<TopicPartition*>& partitions) override {
+    for (const auto* topic_partition : partitions) {
+      paused_topic_partitions_.erase(
+          GetTopicPartitionKey(topic_partition->topic(), topic_partition->partition()));
+    }
+    return ERR_NO_ERROR;
+  }
+
   ////////////////////////////////////////////////////////////////
   // RdKafka::Handle Implemented Methods
   ErrorCode offsetsForTimes(std::vector<TopicPartition*>& offsets, int timeout_ms) override {
@@ -316,10 +347,6 @@ private:
     return NotImplErrorCode();
   }
 
-  ErrorCode pause(std::vector<TopicPartition*>& partitions) override { return NotImplErrorCode(); }
-
-  ErrorCode resume(std::vector<TopicPartition*>& partitions) override { return NotImplErrorCode(); }
-
   ErrorCode query_watermark_offsets(const std::string& topic,
                                     int32_t partition,
                                     int64_t* low,
@@ -328,12 +355,6 @@ private:
     return NotImplErrorCode();
   }
 
-  ErrorCode get_watermark_offsets(const std::string& topic,
-                                  int32_t partition,
-                                  int64_t* low,
-                                  int64_t* high) override {
-    return NotImplErrorCode();
-  }
 
   Queue* get_partition_queue(const TopicPartition* partition) override {
     return NotImplNullptr<Queue>();
@@ -392,6 +413,7 @@ private:
   std::shared_ptr<::kafka::MockKafkaCluster> mock_kafka_cluster_;
 
   std::unordered_set<std::string> assigned_topic_partitions_;
+  std::unordered_set<std::string> paused_topic_partitions_;
   std::unordered_map<std::string, std::unique_ptr<::kafka::MockKafkaCluster::Iterator>>
       topic_partition_to_iter_map_;
 };
@@ -0,0 +1,83 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "gtest/gtest.h"
+#include "common/kafka/offset_commit_tracker.h"
+
+namespace kafka {
+
+TEST(OffsetCommitTrackerTest, KeepsHighestOffsets) {
+  OffsetCommitTracker tracker(0, 100);
+  EXPECT_FALSE(tracker.IsCommitDue());
+  EXPECT_TRUE(tracker.TakeOffsets().empty());
+
+  tracker.MarkProcessed("topic", 0, 10);
+  tracker.MarkProcessed("topic", 0, 12);
+  // Out of order across batches handled in parallel
+  tracker.MarkProcessed("topic", 0, 11);
+  tracker.MarkProcessed("topic", 1, 5);
+  tracker.MarkProcessed("other", 0, 7);
+
+  auto offsets = tracker.TakeOffsets();
+  EXPECT_EQ(offsets.size(), 3u);
+  EXPECT_EQ(offsets[std::make_pair(std::string("topic"), 0)], 12);
+  EXPECT_EQ(offsets[std::make_pair(std::string("topic"), 1)], 5);
+  EXPECT_EQ(offsets[std::make_pair(std::string("other"), 0)], 7);
+  EXPECT_TRUE(tracker.TakeOffsets().empty());
+
+  // A failed commit is retried, unless superseded
+  tracker.MarkProcessed("topic", 0, 20);
+  tracker.Restore(offsets);
+  offsets = tracker.TakeOffsets();
+  EXPECT_EQ(offsets.size(), 3u);
+  EXPECT_EQ(offsets[std::make_pair(std::string("topic"), 0)], 20);
+  EXPECT_EQ(offsets[std::make_pair(std::string("topic"), 1)], 5);
+}
+
+TEST(OffsetCommitTrackerTest, CommitTriggers) {
+  uint64_t now_ms = 1000;
+  OffsetCommitTracker tracker(500, 10, [&now_ms] { return now_ms; });
+
+  tracker.MarkProcessed("topic", 0, 1, 9);
+  EXPECT_FALSE(tracker.IsCommitDue());
+  tracker.MarkProcessed("topic", 0, 2);
+  EXPECT_TRUE(tracker.IsCommitDue());
+  tracker.TakeOffsets();
+  EXPECT_FALSE(tracker.IsCommitDue());
+
+  // Nothing to commit when the interval elapsed
+  now_ms += 500;
+  EXPECT_FALSE(tracker.IsCommitDue());
+  tracker.MarkProcessed("topic", 0, 3);
+  EXPECT_TRUE(tracker.IsCommitDue());
+  tracker.TakeOffsets();
+
+  tracker.MarkProcessed("topic", 0, 4);
+  now_ms += 499;
+  EXPECT_FALSE(tracker.IsCommitDue());
+  now_ms += 1;
+  EXPECT_TRUE(tracker.IsCommitDue());
+}
+
+}  // namespace kafka
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,106 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "common/kafka/partition_dispatcher.h"
+
+namespace kafka {
+
+TEST(PartitionDispatcherTest, KeepsPartitionOrder) {
+  std::mutex mutex;
+  TopicPartitionToValueMap<std::vector<int>> seen;
+  {
+    PartitionDispatcher dispatcher("test", 4, 16);
+    for (int i = 0; i < 1000; ++i) {
+      const int32_t partition_id = i % 7;
+      dispatcher.Add("topic", partition_id, [&mutex, &seen, partition_id, i] {
+        std::lock_guard<std::mutex> lock(mutex);
+        seen[std::make_pair(std::string("topic"), partition_id)].push_back(i);
+      });
+    }
+  }
+
+  EXPECT_EQ(seen.size(), 7);
+  for (const auto& p : seen) {
+    EXPECT_TRUE(std::is_sorted(p.second.begin(), p.second.end()));
+    EXPECT_EQ(p.second.size(), 1000 / 7 + (p.first.second < 1000 % 7 ? 1 : 0));
+  }
+}
+
+TEST(PartitionDispatcherTest, RunsPartitionsInParallel) {
+  PartitionDispatcher dispatcher("test", 8, 16);
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  for (int32_t partition_id = 0; partition_id < 64; ++partition_id) {
+    dispatcher.Add("topic", partition_id, [&running, &max_running] {
+      auto n = ++running;
+      auto max = max_running.load();
+      while (n > max && !max_running.compare_exchange_weak(max, n)) {}
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      --running;
+    });
+  }
+  dispatcher.Drain();
+
+  EXPECT_EQ(dispatcher.PendingTasks(), 0);
+  EXPECT_GT(max_running.load(), 1);
+}
+
+TEST(PartitionDispatcherTest, BlocksOnSlowPartition) {
+  PartitionDispatcher dispatcher("test", 2, 2);
+  std::atomic<bool> release{false};
+  std::atomic<int> done{0};
+  auto slow = [&release, &done] {
+    while (!release.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ++done;
+  };
+
+  dispatcher.Add("topic", 0, slow);
+  dispatcher.Add("topic", 0, slow);
+  EXPECT_EQ(dispatcher.PendingTasks(), 2);
+
+  std::atomic<bool> added{false};
+  std::thread t([&dispatcher, &added, &slow] {
+    dispatcher.Add("topic", 0, slow);
+    added.store(true);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(added.load());
+
+  release.store(true);
+  t.join();
+  EXPECT_TRUE(added.load());
+
+  dispatcher.Drain();
+  EXPECT_EQ(done.load(), 3);
+  EXPECT_EQ(dispatcher.PendingTasks(), 0);
+}
+
+}  // namespace kafka
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
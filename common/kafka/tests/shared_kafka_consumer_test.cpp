@@ -0,0 +1,149 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "librdkafka/rdkafkacpp.h"
+#include "common/kafka/shared_kafka_consumer.h"
+#include "common/kafka/tests/mock_kafka_cluster.h"
+#include "common/kafka/tests/mock_kafka_consumer.h"
+
+namespace kafka {
+
+class SharedKafkaConsumerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    mock_kafka_cluster_ = std::make_shared<MockKafkaCluster>();
+
+    topic_names_ = {"topic0", "topic1"};
+    partition_ids_ = {1, 2, 3, 4};
+    records_ = {{"a", 2}, {"b", 4}, {"c", 8}, {"d", 16}, {"e", 32}, {"f", 64}, {"g", 128}};
+
+    for (auto& topic_name : topic_names_) {
+      for (auto partition_id : partition_ids_) {
+        for (auto& record : records_) {
+          mock_kafka_cluster_->AddRecord(
+              topic_name, partition_id, record.payload, record.timestamp_ms);
+        }
+      }
+    }
+  }
+
+  // Collects the payloads handled for a partition
+  struct Handled {
+    std::mutex mutex;
+    std::vector<std::string> payloads;
+    uint32_t n_replay = 0;
+    uint32_t n_idle = 0;
+  };
+
+  bool AddPartition(SharedKafkaConsumer* consumer,
+                    const std::string& topic_name,
+                    const int32_t partition_id,
+                    const int64_t start_timestamp_ms,
+                    Handled* handled) {
+    return consumer->AddPartition(
+        topic_name, partition_id, start_timestamp_ms,
+        [handled, topic_name, partition_id](
+            const std::vector<std::unique_ptr<RdKafka::Message>>& messages,
+            const bool is_replay) {
+          std::lock_guard<std::mutex> lock(handled->mutex);
+          for (const auto& message : messages) {
+            EXPECT_EQ(topic_name, message->topic_name());
+            EXPECT_EQ(partition_id, message->partition());
+            handled->payloads.emplace_back(
+                static_cast<const char*>(message->payload()), message->len());
+            if (is_replay) {
+              ++handled->n_replay;
+            }
+          }
+        },
+        [handled] {
+          std::lock_guard<std::mutex> lock(handled->mutex);
+          ++handled->n_idle;
+        });
+  }
+
+  std::shared_ptr<MockKafkaCluster> mock_kafka_cluster_;
+  std::vector<std::string> topic_names_;
+  std::vector<int32_t> partition_ids_;
+  std::vector<MockKafkaCluster::Record> records_;
+};
+
+TEST_F(SharedKafkaConsumerTest, AddAndRemovePartitions) {
+  SharedKafkaConsumer consumer(
+      "UnitTestSharedKafkaConsumer",
+      std::make_shared<RdKafka::MockKafkaConsumer>(mock_kafka_cluster_),
+      2 /* max_batch_size */,
+      10 /* consume_timeout_ms */);
+
+  // Returns once the partition is replayed
+  Handled handled0;
+  ASSERT_TRUE(AddPartition(&consumer, "topic0", 4, 16, &handled0));
+  {
+    std::lock_guard<std::mutex> lock(handled0.mutex);
+    EXPECT_EQ(std::vector<std::string>({"d", "e", "f", "g"}),
+              handled0.payloads);
+    EXPECT_EQ(4, handled0.n_replay);
+    EXPECT_GT(handled0.n_idle, 0);
+  }
+  EXPECT_EQ(1, consumer.NumPartitions());
+
+  Handled duplicate;
+  EXPECT_FALSE(AddPartition(&consumer, "topic0", 4, 0, &duplicate));
+
+  // The partitions consumed already go on from where they were
+  Handled handled1;
+  ASSERT_TRUE(AddPartition(&consumer, "topic1", 2, 0, &handled1));
+  {
+    std::lock_guard<std::mutex> lock(handled1.mutex);
+    EXPECT_EQ(records_.size(), handled1.payloads.size());
+    EXPECT_EQ(records_.size(), handled1.n_replay);
+  }
+  {
+    std::lock_guard<std::mutex> lock(handled0.mutex);
+    EXPECT_EQ(4, handled0.payloads.size());
+  }
+  EXPECT_EQ(2, consumer.NumPartitions());
+
+  ASSERT_TRUE(consumer.RemovePartition("topic0", 4));
+  EXPECT_FALSE(consumer.RemovePartition("topic0", 4));
+  EXPECT_EQ(1, consumer.NumPartitions());
+
+  // It can be consumed again
+  Handled handled2;
+  ASSERT_TRUE(AddPartition(&consumer, "topic0", 4, 64, &handled2));
+  {
+    std::lock_guard<std::mutex> lock(handled2.mutex);
+    EXPECT_EQ(std::vector<std::string>({"f", "g"}), handled2.payloads);
+  }
+  {
+    std::lock_guard<std::mutex> lock(handled0.mutex);
+    EXPECT_EQ(4, handled0.payloads.size());
+  }
+  EXPECT_EQ(2, consumer.NumPartitions());
+}
+
+}  // namespace kafka
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
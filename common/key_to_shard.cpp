@@ -0,0 +1,162 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/key_to_shard.h"
+
+#include <memory>
+#include <utility>
+
+#include "folly/Hash.h"
+
+namespace {
+
+class ModuloKeyToShardMapper : public common::KeyToShardMapper {
+ public:
+  using KeyToShardMapper::KeyToShardMapper;
+
+  uint32_t getShard(const uint64_t hash) const override {
+    return hash % num_shards_;
+  }
+
+  void getShards(const uint64_t* hashes, const size_t n,
+                 uint32_t* shards) const override {
+    const uint64_t num_shards = num_shards_;
+    for (size_t i = 0; i < n; ++i) {
+      shards[i] = hashes[i] % num_shards;
+    }
+  }
+};
+
+class JumpKeyToShardMapper : public common::KeyToShardMapper {
+ public:
+  using KeyToShardMapper::KeyToShardMapper;
+
+  uint32_t getShard(const uint64_t hash) const override {
+    return common::JumpConsistentHash(hash, num_shards_);
+  }
+};
+
+class RendezvousKeyToShardMapper : public common::KeyToShardMapper {
+ public:
+  using KeyToShardMapper::KeyToShardMapper;
+
+  uint32_t getShard(const uint64_t hash) const override {
+    return common::RendezvousHash(hash, num_shards_);
+  }
+};
+
+class SplitKeyToShardMapper : public common::KeyToShardMapper {
+ public:
+  SplitKeyToShardMapper(
+      std::unique_ptr<const common::KeyToShardMapper> parent_mapper,
+      const uint32_t num_shards)
+      : KeyToShardMapper(num_shards)
+      , parent_mapper_(std::move(parent_mapper))
+      , num_parents_(parent_mapper_->numShards())
+      , split_factor_(num_shards / num_parents_) {}
+
+  uint32_t getShard(const uint64_t hash) const override {
+    return parent_mapper_->getShard(hash) + num_parents_ * child(hash);
+  }
+
+  void getShards(const uint64_t* hashes, const size_t n,
+                 uint32_t* shards) const override {
+    parent_mapper_->getShards(hashes, n, shards);
+    for (size_t i = 0; i < n; ++i) {
+      shards[i] += num_parents_ * child(hashes[i]);
+    }
+  }
+
+ private:
+  uint32_t child(const uint64_t hash) const {
+    // Independent of the bits picking the parent
+    return folly::hash::twang_mix64(hash) % split_factor_;
+  }
+
+  const std::unique_ptr<const common::KeyToShardMapper> parent_mapper_;
+  const uint32_t num_parents_;
+  const uint32_t split_factor_;
+};
+
+}  // namespace
+
+namespace common {
+
+uint32_t JumpConsistentHash(uint64_t key, const uint32_t num_buckets) {
+  int64_t b = -1;
+  int64_t j = 0;
+  while (j < num_buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (b + 1) * (static_cast<double>(1LL << 31) /
+                   static_cast<double>((key >> 33) + 1));
+  }
+  return b;
+}
+
+uint32_t RendezvousHash(const uint64_t key, const uint32_t num_buckets) {
+  uint32_t best = 0;
+  uint64_t best_weight = 0;
+  for (uint32_t i = 0; i < num_buckets; ++i) {
+    const auto weight = folly::hash::hash_128_to_64(key, i);
+    if (i == 0 || weight > best_weight) {
+      best = i;
+      best_weight = weight;
+    }
+  }
+  return best;
+}
+
+uint64_t HashKeyForShard(const folly::StringPiece key) {
+  return folly::hash::fnv64_buf(key.data(), key.size());
+}
+
+std::unique_ptr<const KeyToShardMapper> CreateKeyToShardMapper(
+    const std::string& type,
+    const uint32_t num_shards,
+    const uint32_t num_shards_before_split) {
+  if (num_shards == 0) {
+    return nullptr;
+  }
+
+  if (num_shards_before_split != 0) {
+    if (num_shards % num_shards_before_split != 0) {
+      return nullptr;
+    }
+
+    auto parent_mapper = CreateKeyToShardMapper(type, num_shards_before_split);
+    if (parent_mapper == nullptr) {
+      return nullptr;
+    }
+
+    return std::make_unique<SplitKeyToShardMapper>(std::move(parent_mapper),
+                                                   num_shards);
+  }
+
+  if (type == "modulo") {
+    return std::make_unique<ModuloKeyToShardMapper>(num_shards);
+  } else if (type == "jump") {
+    return std::make_unique<JumpKeyToShardMapper>(num_shards);
+  } else if (type == "rendezvous") {
+    return std::make_unique<RendezvousKeyToShardMapper>(num_shards);
+  }
+
+  return nullptr;
+}
+
+}  // namespace common
@@ -0,0 +1,95 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "folly/Range.h"
+
+namespace common {
+
+/*
+ * Jump consistent hash from "A Fast, Minimal Memory, Consistent Hash
+ * Algorithm" (Lamping & Veach). Growing num_buckets from n to n + 1 moves
+ * 1 / (n + 1) of the keys, all to the new bucket.
+ */
+uint32_t JumpConsistentHash(uint64_t key, uint32_t num_buckets);
+
+/*
+ * Rendezvous (highest random weight) hashing: the bucket with the highest
+ * hash of (key, bucket). It takes O(num_buckets), but any bucket can be
+ * added or removed while only moving its own keys.
+ */
+uint32_t RendezvousHash(uint64_t key, uint32_t num_buckets);
+
+// The hash of key given to KeyToShardMapper
+uint64_t HashKeyForShard(folly::StringPiece key);
+
+/*
+ * Map keys, as returned by HashKeyForShard(), to the shards of a segment.
+ * Implementations are immutable and thread safe.
+ */
+class KeyToShardMapper {
+ public:
+  explicit KeyToShardMapper(const uint32_t num_shards)
+      : num_shards_(num_shards) {}
+
+  virtual ~KeyToShardMapper() {}
+
+  virtual uint32_t getShard(uint64_t hash) const = 0;
+
+  // Same as getShard() for n hashes. Implementations override it with a
+  // loop the compiler can vectorize where possible.
+  virtual void getShards(const uint64_t* hashes, size_t n,
+                         uint32_t* shards) const {
+    for (size_t i = 0; i < n; ++i) {
+      shards[i] = getShard(hashes[i]);
+    }
+  }
+
+  uint32_t numShards() const {
+    return num_shards_;
+  }
+
+ protected:
+  const uint32_t num_shards_;
+};
+
+/*
+ * Create the mapper of type "modulo", "jump" or "rendezvous" for num_shards.
+ *
+ * If num_shards_before_split is not 0, the segment grew from
+ * num_shards_before_split shards by splitting each shard s into s,
+ * s + num_shards_before_split, s + 2 * num_shards_before_split... So keys
+ * only move from a shard to its children, and splitting again by a
+ * multiple of the factor keeps it that way. num_shards must then be a
+ * multiple of num_shards_before_split, and type maps the keys to the shards
+ * before the split.
+ *
+ * Return nullptr for an unknown type or invalid shard numbers.
+ */
+std::unique_ptr<const KeyToShardMapper> CreateKeyToShardMapper(
+    const std::string& type,
+    uint32_t num_shards,
+    uint32_t num_shards_before_split = 0);
+
+}  // namespace common
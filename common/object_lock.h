@@ -24,7 +24,7 @@
 #else
 #include <folly/detail/CacheLocality.h>
 #endif
-#include <folly/MPMCQueue.h>
+#include <cassert>
 #include <cstddef>
 #include <functional>
 #include <memory>
@@ -36,14 +36,28 @@ namespace common {
  * ObjectLock is a thread safe data structure to Lock() and Unlock() objects.
  * The potential use case is that the object space is huge, but only a few
  * of them need to be locked simultaneously.
+ *
+ * Each bucket holds a few nodes inline, which are probed before the overflow
+ * list. Overflow nodes are pooled per bucket, so locking a new object takes
+ * no allocation and no memory shared with other buckets in the common case.
+ *
+ * With a shared MutexType, e.g. folly::SharedMutex, objects can also be
+ * locked shared with LockShared() and UnlockShared().
  */
 template <typename ObjectType, typename HasherType = std::hash<ObjectType>,
           typename MutexType = std::mutex>
 class ObjectLock {
  private:
+  // The number of nodes held inline by each bucket, i.e. how many objects
+  // of a bucket can be locked before the overflow list is used
+  static constexpr std::size_t kInlineNodes = 2;
+  // The max number of free overflow nodes kept by each bucket
+  static constexpr std::size_t kMaxPooledNodes = 4;
+
   struct Node : public boost::intrusive::list_base_hook<> {
     ObjectType object;
     MutexType nodeMutex;
+    // 0 for free nodes
     std::size_t refCount;
 
     Node() : object(), nodeMutex(), refCount(0) {}
@@ -52,50 +66,58 @@ class ObjectLock {
   struct Bucket {
 #if __GNUC__ >= 8
     alignas(folly::hardware_destructive_interference_size) MutexType bucketMutex;
-    alignas(folly::hardware_destructive_interference_size) boost::intrusive::list<Node> nodes;
+    alignas(folly::hardware_destructive_interference_size) Node inlineNodes[kInlineNodes];
 #else
     MutexType bucketMutex FOLLY_ALIGN_TO_AVOID_FALSE_SHARING;
-    boost::intrusive::list<Node> nodes FOLLY_ALIGN_TO_AVOID_FALSE_SHARING;
+    Node inlineNodes[kInlineNodes] FOLLY_ALIGN_TO_AVOID_FALSE_SHARING;
 #endif
+    boost::intrusive::list<Node> nodes;
+    boost::intrusive::list<Node> pooledNodes;
+
+    ~Bucket() {
+      pooledNodes.clear_and_dispose([](Node* p) { delete p; });
+    }
+
+    bool Empty() const {
+      for (const auto& node : inlineNodes) {
+        if (node.refCount > 0) {
+          return false;
+        }
+      }
+      return nodes.empty();
+    }
 
-    template <typename ALLOC>
-    void Lock(const ObjectType& object, ALLOC&& alloc) {
-      typename boost::intrusive::list<Node>::iterator itor;
+    template <typename LOCK>
+    void Lock(const ObjectType& object, LOCK&& lock) {
+      Node* p;
       {
         std::lock_guard<MutexType> g(bucketMutex);
-        itor = FindNodeLocked(object);
+        p = FindNodeLocked(object);
 
-        if (itor == nodes.end()) {
-          auto p = alloc();
-          p->object = object;
-          nodes.push_front(*p);
-          itor = nodes.begin();
+        if (p == nullptr) {
+          p = AddNodeLocked(object);
         }
 
-        assert(itor != nodes.end());
-        ++itor->refCount;
+        ++p->refCount;
       }
-      itor->nodeMutex.lock();
+      lock(p->nodeMutex);
     }
 
     // Return true if successfully acquired the lock. Otherwise, return false.
-    template <typename ALLOC>
-    bool TryLock(const ObjectType& object, ALLOC&& alloc) {
+    template <typename LOCK>
+    bool TryLock(const ObjectType& object, LOCK&& lock) {
       if (!bucketMutex.try_lock()) {
         return false;
       }
 
       std::lock_guard<MutexType> g(bucketMutex, std::adopt_lock);
-      auto itor = FindNodeLocked(object);
+      auto p = FindNodeLocked(object);
 
-      if (itor == nodes.end()) {
+      if (p == nullptr) {
         // Currently the object is not locked by anyone, lock() won't block us
-        auto p = alloc();
-        p->object = object;
+        p = AddNodeLocked(object);
         ++p->refCount;
-        p->nodeMutex.lock();
-
-        nodes.push_front(*p);
+        lock(p->nodeMutex);
         return true;
       }
 
@@ -104,33 +126,68 @@ class ObjectLock {
       return false;
     }
 
-    template <typename DEALLOC>
-    void Unlock(const ObjectType& object, DEALLOC&& dealloc) {
+    template <typename UNLOCK>
+    void Unlock(const ObjectType& object, UNLOCK&& unlock) {
       std::lock_guard<MutexType> g(bucketMutex);
-      auto itor = FindNodeLocked(object);
-      assert(itor != nodes.end() && itor->refCount > 0);
-      itor->nodeMutex.unlock();
-      --itor->refCount;
-      if (itor->refCount == 0) {
-        Node* p = &(*itor);
-        nodes.erase(itor);
-        dealloc(p);
+      auto p = FindNodeLocked(object);
+      assert(p != nullptr && p->refCount > 0);
+      unlock(p->nodeMutex);
+      --p->refCount;
+      if (p->refCount == 0) {
+        RemoveNodeLocked(p);
       }
     }
 
    private:
-    typename boost::intrusive::list<Node>::iterator FindNodeLocked(  // NOLINT
-        const ObjectType& object) {
-      auto itor = nodes.begin();
-      while (itor != nodes.end()) {
-        if (object == itor->object) {
-          return itor;
+    Node* FindNodeLocked(const ObjectType& object) {  // NOLINT
+      for (auto& node : inlineNodes) {
+        if (node.refCount > 0 && object == node.object) {
+          return &node;
         }
+      }
 
-        ++itor;
+      for (auto& node : nodes) {
+        if (object == node.object) {
+          return &node;
+        }
       }
 
-      return itor;
+      return nullptr;
+    }
+
+    Node* AddNodeLocked(const ObjectType& object) {
+      for (auto& node : inlineNodes) {
+        if (node.refCount == 0) {
+          node.object = object;
+          return &node;
+        }
+      }
+
+      Node* p;
+      if (!pooledNodes.empty()) {
+        p = &pooledNodes.front();
+        pooledNodes.pop_front();
+      } else {
+        p = new Node;
+      }
+      p->object = object;
+      nodes.push_front(*p);
+      return p;
+    }
+
+    // p has no ref left
+    void RemoveNodeLocked(Node* p) {
+      if (p >= inlineNodes && p < inlineNodes + kInlineNodes) {
+        // a free inline node is one with no ref
+        return;
+      }
+
+      nodes.erase(nodes.iterator_to(*p));
+      if (pooledNodes.size() < kMaxPooledNodes) {
+        pooledNodes.push_front(*p);
+      } else {
+        delete p;
+      }
     }
   };
 
@@ -143,63 +200,46 @@ class ObjectLock {
 
   explicit ObjectLock(const std::size_t maxOutstandingLocksHint = 128)
       : nBucket_(maxOutstandingLocksHint << 2),
-        buckets_(new Bucket[nBucket_]),
-        nodePool_(maxOutstandingLocksHint) {
+        buckets_(new Bucket[nBucket_]) {
     assert(nBucket_ > 0);
   }
 
   ~ObjectLock() {
     for (std::size_t i = 0; i < nBucket_; ++i) {
       std::lock_guard<MutexType> g(buckets_[i].bucketMutex);
-      assert(buckets_[i].nodes.empty());
-    }
-
-    Node* node;
-    while (nodePool_.read(node)) {
-      delete node;
+      assert(buckets_[i].Empty());
     }
   }
 
   void Lock(const ObjectType& object) {
-    auto idx = hasher_(object) % nBucket_;
-    buckets_[idx].Lock(object, [this]() {
-      return AllocNode();
-    });
+    GetBucket(object).Lock(object, [](MutexType& m) { m.lock(); });
   }
 
   bool TryLock(const ObjectType& object) {
-    auto idx = hasher_(object) % nBucket_;
-    return buckets_[idx].TryLock(object, [this]() {
-      return AllocNode();
-    });
+    return GetBucket(object).TryLock(object, [](MutexType& m) { m.lock(); });
   }
 
   void Unlock(const ObjectType& object) {
-    auto idx = hasher_(object) % nBucket_;
-    buckets_[idx].Unlock(object, [this](Node * node) {
-      DeallocNode(node);
-    });
+    GetBucket(object).Unlock(object, [](MutexType& m) { m.unlock(); });
   }
 
- private:
-  Node* AllocNode() {
-    Node* node;
-    if (nodePool_.read(node)) {
-      return node;
-    }
+  // Only for a shared MutexType. Shared holders of an object don't block
+  // each other, but block Lock() of it and vice versa.
+  void LockShared(const ObjectType& object) {
+    GetBucket(object).Lock(object, [](MutexType& m) { m.lock_shared(); });
+  }
 
-    return new Node;
+  void UnlockShared(const ObjectType& object) {
+    GetBucket(object).Unlock(object, [](MutexType& m) { m.unlock_shared(); });
   }
 
-  void DeallocNode(Node* node) {
-    if (!nodePool_.write(node)) {
-      delete node;
-    }
+ private:
+  Bucket& GetBucket(const ObjectType& object) {
+    return buckets_[hasher_(object) % nBucket_];
   }
 
   const std::size_t nBucket_;
   std::unique_ptr<Bucket[]> buckets_;
-  folly::MPMCQueue<Node*> nodePool_;
   static HasherType hasher_;
 };
 
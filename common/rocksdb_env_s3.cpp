@@ -18,7 +18,18 @@
 
 #include "common/rocksdb_env_s3.h"
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "boost/filesystem.hpp"
 #include "common/rocksdb_glogger/rocksdb_glogger.h"
@@ -27,9 +38,222 @@
 #include "rocksdb/status.h"
 
 DECLARE_bool(s3_direct_io);
+DECLARE_int32(s3_multipart_upload_part_retries);
+
+DEFINE_bool(s3_env_lazy_read, false,
+            "If true, S3Env serves the reads of the files which are not in "
+            "the local directory with ranged GETs, rather than downloading "
+            "the whole files on the first open");
+DEFINE_int32(s3_env_block_size_kb, 256,
+             "The block size of the ranged GETs of the lazily read files");
+DEFINE_int32(s3_env_cached_blocks, 64,
+             "The max number of blocks cached in memory per lazily read file");
+DEFINE_int32(s3_env_readahead_blocks, 4,
+             "The number of blocks fetched at least by a ranged GET of a "
+             "lazily read file");
+DEFINE_bool(s3_env_streaming_upload, false,
+            "If true, S3Env uploads the files while they are written, with "
+            "multipart uploads, rather than writing them to the local "
+            "directory and uploading them afterwards");
+DEFINE_int32(s3_env_upload_part_size_mb, 8,
+             "The part size of the streamed uploads, at least 5");
+DEFINE_int32(s3_env_upload_buffers, 4,
+             "The parts of each streamed file kept in memory at most, "
+             "including the one being written. All the others are uploaded "
+             "in parallel");
 
 namespace rocksdb {
 
+// S3ObjectReader serves the reads of an (immutable) S3 object with ranged
+// GETs. The blocks read are kept in an LRU cache, and each GET fetches a few
+// blocks more than asked for, so that sequential reads need few GETs.
+class S3ObjectReader {
+ public:
+  S3ObjectReader(const std::string& key,
+                 const uint64_t size,
+                 std::shared_ptr<common::S3Util> s3_util) :
+      key_(key),
+      size_(size),
+      block_size_(std::max(FLAGS_s3_env_block_size_kb, 1) * 1024),
+      s3_util_(std::move(s3_util)) {}
+
+  uint64_t size() const {
+    return size_;
+  }
+
+  Status Read(uint64_t offset, size_t n, Slice* result, char* scratch) {
+    if (offset >= size_ || n == 0) {
+      *result = Slice(scratch, 0);
+      return Status::OK();
+    }
+
+    n = std::min<uint64_t>(n, size_ - offset);
+    const auto first = offset / block_size_;
+    const auto last = (offset + n - 1) / block_size_;
+    size_t copied = 0;
+    for (auto i = first; i <= last; ++i) {
+      auto block = GetBlock(i, last);
+      if (block == nullptr) {
+        return Status::IOError("Failed to read " + key_);
+      }
+
+      const auto block_offset = i * block_size_;
+      const auto begin = std::max(offset, block_offset) - block_offset;
+      if (begin >= block->size()) {
+        // the object is shorter than its size told us
+        break;
+      }
+      const auto end = std::min<uint64_t>(offset + n - block_offset,
+                                          block->size());
+      memcpy(scratch + copied, block->data() + begin, end - begin);
+      copied += end - begin;
+    }
+
+    *result = Slice(scratch, copied);
+    return Status::OK();
+  }
+
+  // Fetch the blocks of [offset, offset + n) into the cache
+  Status Prefetch(uint64_t offset, size_t n) {
+    if (offset >= size_ || n == 0) {
+      return Status::OK();
+    }
+
+    n = std::min<uint64_t>(n, size_ - offset);
+    const auto last = (offset + n - 1) / block_size_;
+    for (auto i = offset / block_size_; i <= last; ++i) {
+      if (GetBlock(i, last) == nullptr) {
+        return Status::IOError("Failed to prefetch " + key_);
+      }
+    }
+
+    return Status::OK();
+  }
+
+ private:
+  using Block = std::shared_ptr<const std::string>;
+
+  // Return block i, fetching the blocks up to last (and the readahead ones)
+  // with it if it is not cached.
+  Block GetBlock(const uint64_t i, const uint64_t last) {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      auto itor = blocks_.find(i);
+      if (itor != blocks_.end()) {
+        lru_.splice(lru_.begin(), lru_, itor->second.second);
+        return itor->second.first;
+      }
+    }
+
+    const auto n_blocks = (size_ + block_size_ - 1) / block_size_;
+    const auto fetch_last = std::min<uint64_t>(
+      std::max<uint64_t>(last, i + FLAGS_s3_env_readahead_blocks - 1),
+      n_blocks - 1);
+    auto resp = s3_util_->getObjectRange(key_, i * block_size_,
+                                         (fetch_last - i + 1) * block_size_);
+    if (!resp.Error().empty()) {
+      LOG(ERROR) << resp.Error();
+      return nullptr;
+    }
+
+    const auto& data = resp.Body();
+    Block block;
+    std::lock_guard<std::mutex> g(mutex_);
+    for (auto j = i; j <= fetch_last; ++j) {
+      const auto begin = (j - i) * block_size_;
+      if (begin >= data.size()) {
+        break;
+      }
+
+      auto fetched = std::make_shared<const std::string>(
+        data.substr(begin, block_size_));
+      if (j == i) {
+        block = fetched;
+      }
+      if (blocks_.find(j) == blocks_.end()) {
+        lru_.push_front(j);
+        blocks_.emplace(j, std::make_pair(std::move(fetched), lru_.begin()));
+      }
+    }
+
+    while (lru_.size() > static_cast<size_t>(
+             std::max(FLAGS_s3_env_cached_blocks, 1))) {
+      blocks_.erase(lru_.back());
+      lru_.pop_back();
+    }
+
+    return block;
+  }
+
+  const std::string key_;
+  const uint64_t size_;
+  const uint64_t block_size_;
+  std::shared_ptr<common::S3Util> s3_util_;
+  std::mutex mutex_;
+  // block indexes, most recently used first
+  std::list<uint64_t> lru_;
+  std::unordered_map<uint64_t,
+                     std::pair<Block, std::list<uint64_t>::iterator>> blocks_;
+};
+
+class S3RandomAccessFile : public RandomAccessFile {
+ public:
+  explicit S3RandomAccessFile(std::unique_ptr<S3ObjectReader> reader) :
+      reader_(std::move(reader)) {}
+
+  Status Read(uint64_t offset, size_t n, Slice* result,
+              char* scratch) const override {
+    return reader_->Read(offset, n, result, scratch);
+  }
+
+  Status Prefetch(uint64_t offset, size_t n) override {
+    return reader_->Prefetch(offset, n);
+  }
+
+ private:
+  std::unique_ptr<S3ObjectReader> reader_;
+};
+
+class S3SequentialFile : public SequentialFile {
+ public:
+  explicit S3SequentialFile(std::unique_ptr<S3ObjectReader> reader) :
+      reader_(std::move(reader)),
+      offset_(0) {}
+
+  Status Read(size_t n, Slice* result, char* scratch) override {
+    auto s = reader_->Read(offset_, n, result, scratch);
+    if (s.ok()) {
+      offset_ += result->size();
+    }
+    return s;
+  }
+
+  Status Skip(uint64_t n) override {
+    offset_ = std::min(offset_ + n, reader_->size());
+    return Status::OK();
+  }
+
+ private:
+  std::unique_ptr<S3ObjectReader> reader_;
+  uint64_t offset_;
+};
+
+// Create a reader for the S3 object fname if it exists
+Status NewS3ObjectReader(const std::string& fname,
+                         std::shared_ptr<common::S3Util> s3_util,
+                         std::unique_ptr<S3ObjectReader>* reader) {
+  auto resp = s3_util->getObjectSizeAndModTime(fname);
+  if (!resp.Error().empty()) {
+    LOG(ERROR) << "Error happened when getting the size of " << fname
+               << " in S3: " << resp.Error();
+    return Status::IOError();
+  }
+
+  reader->reset(
+    new S3ObjectReader(fname, resp.Body().at("size"), std::move(s3_util)));
+  return Status::OK();
+}
+
 // open a file for sequential reading
 Status S3Env::NewSequentialFile(const std::string& fname,
                                 std::unique_ptr<SequentialFile>* result,
@@ -41,6 +265,15 @@ Status S3Env::NewSequentialFile(const std::string& fname,
   auto local_full_path = local_directory_ + GetRelativePath(fname);
   auto st = posix_env_->NewSequentialFile(local_full_path, result, options);
 
+  if (!st.ok() && FLAGS_s3_env_lazy_read) {
+    std::unique_ptr<S3ObjectReader> reader;
+    st = NewS3ObjectReader(fname, s3_util_, &reader);
+    if (st.ok()) {
+      result->reset(new S3SequentialFile(std::move(reader)));
+    }
+    return st;
+  }
+
   if (!st.ok()) {
     // If file doesnt exist in local, we copy the file to the local storage from S3
     size_t slash = local_full_path.find_last_of('/');
@@ -75,6 +308,15 @@ Status S3Env::NewRandomAccessFile(const std::string& fname,
   auto local_full_path = local_directory_ + GetRelativePath(fname);
   auto st = posix_env_->NewRandomAccessFile(local_full_path, result, options);
 
+  if (!st.ok() && FLAGS_s3_env_lazy_read) {
+    std::unique_ptr<S3ObjectReader> reader;
+    st = NewS3ObjectReader(fname, s3_util_, &reader);
+    if (st.ok()) {
+      result->reset(new S3RandomAccessFile(std::move(reader)));
+    }
+    return st;
+  }
+
   if (!st.ok()) {
     // If file doesnt exist in local, we copy the file to the local storage from S3
     size_t slash = local_full_path.find_last_of('/');
@@ -215,12 +457,250 @@ class S3WritableFile : public WritableFile {
   std::unique_ptr<WritableFile> local_file_;
 };
 
+// S3StreamingWritableFile uploads a file to S3 while it is written, with a
+// multipart upload, so that no local copy is needed. Append() fills a part in
+// memory, which is uploaded by a background thread once it is full. Append()
+// blocks while --s3_env_upload_buffers parts are in memory, i.e. when the
+// uploads fall behind. Close() uploads the last part and completes the
+// upload, after which the object is visible in S3.
+class S3StreamingWritableFile : public WritableFile {
+ public:
+  S3StreamingWritableFile(const std::string& s3_fname,
+                          std::shared_ptr<common::S3Util> s3_util) :
+      key_(s3_fname),
+      s3_util_(std::move(s3_util)),
+      part_size_(
+        static_cast<uint64_t>(std::max(FLAGS_s3_env_upload_part_size_mb, 5))
+          << 20),
+      max_pending_parts_(std::max(FLAGS_s3_env_upload_buffers, 2) - 1),
+      file_size_(0),
+      closed_(false),
+      n_pending_parts_(0),
+      stop_(false) {
+    auto resp = s3_util_->createMultipartUpload(key_);
+    if (!resp.Error().empty()) {
+      status_ = Status::IOError("Failed to start the upload of " + key_,
+                                resp.Error());
+      closed_ = true;
+      return;
+    }
+
+    upload_id_ = resp.Body();
+    buffer_.reserve(part_size_);
+    for (int i = 0; i < max_pending_parts_; ++i) {
+      uploaders_.emplace_back([this] { UploadLoop(); });
+    }
+  }
+
+  virtual ~S3StreamingWritableFile() {
+    Close();
+  }
+
+  Status Append(const Slice& data) override {
+    if (closed_) {
+      return Status::IOError(key_ + " is closed");
+    }
+
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+      const size_t n = std::min<uint64_t>(left, part_size_ - buffer_.size());
+      buffer_.append(p, n);
+      p += n;
+      left -= n;
+      file_size_ += n;
+      if (buffer_.size() == part_size_) {
+        auto s = SubmitPart();
+        if (!s.ok()) {
+          return s;
+        }
+      }
+    }
+
+    return Status::OK();
+  }
+
+  Status Truncate(uint64_t size) override {
+    // The parts uploaded are final
+    return size == file_size_ ? Status::OK() : Status::NotSupported();
+  }
+
+  Status Flush() override {
+    return Status::OK();
+  }
+
+  // Wait for the full parts to be uploaded. The last part is only uploaded by
+  // Close(), as S3 requires all but the last part to be full.
+  Status Sync() override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return n_pending_parts_ == 0; });
+    return status_;
+  }
+
+  Status Fsync() override {
+    return Sync();
+  }
+
+  uint64_t GetFileSize() override {
+    return file_size_;
+  }
+
+  Status status() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return status_;
+  }
+
+  Status Close() override {
+    if (closed_) {
+      return status();
+    }
+    closed_ = true;
+
+    // S3 requires at least one part, even for an empty file
+    if (!buffer_.empty() || next_part_number_ == 1) {
+      SubmitPart();
+    }
+    auto s = Sync();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& uploader : uploaders_) {
+      uploader.join();
+    }
+
+    if (s.ok()) {
+      auto resp = s3_util_->completeMultipartUpload(key_, upload_id_, etags_);
+      if (resp.Error().empty()) {
+        return s;
+      }
+      s = Status::IOError("Failed to complete the upload of " + key_,
+                          resp.Error());
+      std::lock_guard<std::mutex> lock(mutex_);
+      status_ = s;
+    }
+
+    LOG(ERROR) << s.ToString();
+    s3_util_->abortMultipartUpload(key_, upload_id_);
+    return s;
+  }
+
+ private:
+  // Hand buffer_ over to the uploaders, as the next part
+  Status SubmitPart() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] {
+        return n_pending_parts_ < max_pending_parts_ || !status_.ok();
+      });
+    if (!status_.ok()) {
+      return status_;
+    }
+
+    parts_.emplace_back(next_part_number_++, std::move(buffer_));
+    etags_.emplace_back();
+    ++n_pending_parts_;
+    // Reuse the buffer of an uploaded part
+    buffer_.clear();
+    if (!free_buffers_.empty()) {
+      buffer_ = std::move(free_buffers_.back());
+      free_buffers_.pop_back();
+    } else {
+      buffer_.reserve(part_size_);
+    }
+    lock.unlock();
+    cv_.notify_all();
+    return Status::OK();
+  }
+
+  void UploadLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || !parts_.empty(); });
+      if (parts_.empty()) {
+        return;
+      }
+
+      auto part = std::move(parts_.front());
+      parts_.pop_front();
+      // Once a part failed, the upload is aborted
+      const bool failed = !status_.ok();
+      lock.unlock();
+
+      std::string etag;
+      std::string error;
+      if (!failed) {
+        auto resp = s3_util_->uploadPart(
+          key_, upload_id_, part.first, part.second.data(), part.second.size(),
+          std::max(FLAGS_s3_multipart_upload_part_retries, 0));
+        etag = resp.Body();
+        error = resp.Error();
+      }
+
+      lock.lock();
+      if (!failed) {
+        if (error.empty()) {
+          etags_[part.first - 1] = std::move(etag);
+        } else {
+          status_ = Status::IOError("Failed to upload part " +
+                                    std::to_string(part.first) + " of " + key_,
+                                    error);
+        }
+      }
+      part.second.clear();
+      free_buffers_.push_back(std::move(part.second));
+      --n_pending_parts_;
+      cv_.notify_all();
+    }
+  }
+
+  const std::string key_;
+  std::shared_ptr<common::S3Util> s3_util_;
+  const uint64_t part_size_;
+  // The parts submitted but not uploaded yet, at most
+  const int max_pending_parts_;
+  std::string upload_id_;
+  // The part being filled
+  std::string buffer_;
+  uint64_t file_size_;
+  uint32_t next_part_number_ = 1;
+  bool closed_;
+
+  // The state shared with uploaders_
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  Status status_;
+  // (part number, data) to be uploaded
+  std::deque<std::pair<uint32_t, std::string>> parts_;
+  std::vector<std::string> free_buffers_;
+  // The ETag of part i + 1 at i
+  std::vector<std::string> etags_;
+  int n_pending_parts_;
+  bool stop_;
+  std::vector<std::thread> uploaders_;
+};
+
 Status S3Env::NewWritableFile(const std::string& fname,
                               std::unique_ptr<WritableFile>* result,
                               const EnvOptions& options) {
   assert(s3_util_ != nullptr);
   result->reset();
 
+  if (FLAGS_s3_env_streaming_upload) {
+    std::unique_ptr<S3StreamingWritableFile> f(
+        new S3StreamingWritableFile(fname, s3_util_));
+    auto s = f->status();
+    if (!s.ok()) {
+      LOG(ERROR) << "Error happened when creating S3StreamingWritableFile: "
+                 << s.ToString();
+      return s;
+    }
+
+    result->reset(f.release());
+    return Status::OK();
+  }
+
   std::unique_ptr<S3WritableFile> f(
       new S3WritableFile(local_directory_ + GetRelativePath(fname), fname, options, this, s3_util_));
   auto s = f->status();
@@ -397,11 +877,67 @@ Status S3Env::GetFileModificationTime(const std::string& fname,
   return st;
 }
 
+// Move the object src, or the objects under src/ for a directory, to target
+// with server side copies, which are limited to objects of up to 5GB
+static Status MoveS3Objects(common::S3Util* s3_util,
+                            std::string src,
+                            std::string target) {
+  while (!src.empty() && src.back() == '/') {
+    src.pop_back();
+  }
+  while (!target.empty() && target.back() == '/') {
+    target.pop_back();
+  }
+
+  auto resp = s3_util->listAllObjects(src);
+  if (!resp.Error().empty()) {
+    LOG(ERROR) << "Error happened when listing " << src << " for renaming: "
+               << resp.Error();
+    return Status::IOError();
+  }
+
+  for (const auto& key : resp.Body().objects) {
+    if (key.size() > src.size() && key[src.size()] != '/') {
+      // e.g. src.tmp for src
+      continue;
+    }
+
+    const auto new_key = target + key.substr(src.size());
+    auto copy_resp = s3_util->copyObject(key, new_key);
+    if (!copy_resp.Error().empty()) {
+      LOG(ERROR) << "Error happened when copying " << key << " to " << new_key
+                 << ": " << copy_resp.Error();
+      return Status::IOError();
+    }
+    auto delete_resp = s3_util->deleteObject(key);
+    if (!delete_resp.Error().empty()) {
+      LOG(ERROR) << "Error happened when deleting " << key << " after "
+                 << "renaming: " << delete_resp.Error();
+    }
+  }
+
+  return Status::OK();
+}
+
 // The rename is not atomic. S3 does not support renaming natively, so
 // we perform the renaming in local and then upload the updated file to S3.
+// With --s3_env_streaming_upload, the files are only in S3, where they are
+// copied to their new names.
 Status S3Env::RenameFile(const std::string& src, const std::string& target) {
   auto local_src_path = local_directory_ + GetRelativePath(src);
   auto local_target_path = local_directory_ + GetRelativePath(target);
+  if (FLAGS_s3_env_streaming_upload) {
+    // The local directories still hold the structure of the files
+    if (posix_env_->FileExists(local_src_path).ok()) {
+      Status st = posix_env_->RenameFile(local_src_path, local_target_path);
+      if (!st.ok()) {
+        LOG(ERROR) << "Error happened when renaming local file: " << src;
+        return st;
+      }
+    }
+    return MoveS3Objects(s3_util_.get(), src, target);
+  }
+
   Status st = posix_env_->RenameFile(local_src_path, local_target_path);
   if (!st.ok()) {
     LOG(ERROR) << "Error happened when renaming local file: " << src;
@@ -456,4 +992,180 @@ Status S3Env::NewLogger(const std::string& fname, std::shared_ptr<Logger>* resul
   return Status::OK();
 }
 
+TieredS3Env::TieredS3Env(const std::string& local_root,
+                         const std::string& s3_key_prefix,
+                         std::shared_ptr<common::S3Util> s3_util) :
+    EnvWrapper(Env::Default()),
+    local_root_(local_root),
+    s3_key_prefix_(s3_key_prefix),
+    s3_util_(std::move(s3_util)) {}
+
+Status TieredS3Env::ReadStub(const std::string& fname,
+                             std::string* key,
+                             uint64_t* size) {
+  std::string data;
+  auto s = ReadFileToString(target(), StubPath(fname), &data);
+  if (!s.ok()) {
+    return s;
+  }
+
+  std::istringstream stub(data);
+  if (!std::getline(stub, *key) || !(stub >> *size) || key->empty()) {
+    return Status::Corruption("Invalid stub " + StubPath(fname));
+  }
+  return Status::OK();
+}
+
+bool TieredS3Env::IsOffloaded(const std::string& fname) {
+  return target()->FileExists(StubPath(fname)).ok();
+}
+
+Status TieredS3Env::Offload(const std::string& fname) {
+  if (fname.compare(0, local_root_.size(), local_root_) != 0) {
+    return Status::InvalidArgument(fname + " is not under " + local_root_);
+  }
+
+  uint64_t size;
+  auto s = target()->GetFileSize(fname, &size);
+  if (!s.ok()) {
+    return IsOffloaded(fname) ? Status::OK() : s;
+  }
+
+  // Unique, as the file numbers of a db are reused once it is destroyed
+  const auto key = s3_key_prefix_ + fname.substr(local_root_.size()) + "." +
+    std::to_string(NowMicros());
+  auto resp = s3_util_->putObject(key, fname);
+  if (!resp.Error().empty()) {
+    return Status::IOError("Failed to upload " + fname + ": " + resp.Error());
+  }
+
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!target()->FileExists(fname).ok()) {
+    // deleted by a compaction meanwhile
+    s3_util_->deleteObject(key);
+    return Status::OK();
+  }
+
+  // The stub replaces the file atomically, for the readers opening it
+  const auto tmp_stub = StubPath(fname) + ".tmp";
+  s = WriteStringToFile(target(), key + "\n" + std::to_string(size) + "\n",
+                        tmp_stub, true);
+  if (s.ok()) {
+    s = target()->RenameFile(tmp_stub, StubPath(fname));
+  }
+  if (!s.ok()) {
+    target()->DeleteFile(tmp_stub);
+    s3_util_->deleteObject(key);
+    return s;
+  }
+
+  // The open readers of the local file keep reading it until they close it
+  return target()->DeleteFile(fname);
+}
+
+Status TieredS3Env::NewSequentialFile(const std::string& fname,
+                                      std::unique_ptr<SequentialFile>* result,
+                                      const EnvOptions& options) {
+  auto s = target()->NewSequentialFile(fname, result, options);
+  std::string key;
+  uint64_t size;
+  if (s.ok() || !ReadStub(fname, &key, &size).ok()) {
+    return s;
+  }
+
+  result->reset(new S3SequentialFile(
+    std::make_unique<S3ObjectReader>(key, size, s3_util_)));
+  return Status::OK();
+}
+
+Status TieredS3Env::NewRandomAccessFile(
+    const std::string& fname,
+    std::unique_ptr<RandomAccessFile>* result,
+    const EnvOptions& options) {
+  auto s = target()->NewRandomAccessFile(fname, result, options);
+  std::string key;
+  uint64_t size;
+  if (s.ok() || !ReadStub(fname, &key, &size).ok()) {
+    return s;
+  }
+
+  result->reset(new S3RandomAccessFile(
+    std::make_unique<S3ObjectReader>(key, size, s3_util_)));
+  return Status::OK();
+}
+
+Status TieredS3Env::FileExists(const std::string& fname) {
+  auto s = target()->FileExists(fname);
+  if (s.IsNotFound() && IsOffloaded(fname)) {
+    return Status::OK();
+  }
+  return s;
+}
+
+Status TieredS3Env::GetChildren(const std::string& path,
+                                std::vector<std::string>* result) {
+  auto s = target()->GetChildren(path, result);
+  if (!s.ok()) {
+    return s;
+  }
+
+  // Show the stubs as the files they replace, which are both there for a
+  // moment while being offloaded
+  std::unordered_set<std::string> children;
+  for (const auto& child : *result) {
+    const auto suffix_pos = child.size() - std::min<size_t>(child.size(), 3);
+    if (child.compare(suffix_pos, std::string::npos, ".s3") == 0) {
+      children.insert(child.substr(0, suffix_pos));
+    } else {
+      children.insert(child);
+    }
+  }
+  result->assign(children.begin(), children.end());
+  return Status::OK();
+}
+
+Status TieredS3Env::DeleteFile(const std::string& fname) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto s = target()->DeleteFile(fname);
+  std::string key;
+  uint64_t size;
+  if (!ReadStub(fname, &key, &size).ok()) {
+    return s;
+  }
+
+  auto resp = s3_util_->deleteObject(key);
+  if (!resp.Error().empty()) {
+    // Leaked, the stub is gone either way
+    LOG(ERROR) << "Failed to delete " << key << " of " << fname << ": "
+               << resp.Error();
+  }
+  return target()->DeleteFile(StubPath(fname));
+}
+
+Status TieredS3Env::GetFileSize(const std::string& fname, uint64_t* size) {
+  auto s = target()->GetFileSize(fname, size);
+  std::string key;
+  if (s.ok() || !ReadStub(fname, &key, size).ok()) {
+    return s;
+  }
+  return Status::OK();
+}
+
+Status TieredS3Env::GetFileModificationTime(const std::string& fname,
+                                            uint64_t* file_mtime) {
+  auto s = target()->GetFileModificationTime(fname, file_mtime);
+  if (!s.ok() && IsOffloaded(fname)) {
+    return target()->GetFileModificationTime(StubPath(fname), file_mtime);
+  }
+  return s;
+}
+
+Status TieredS3Env::LinkFile(const std::string& src,
+                             const std::string& target_fname) {
+  if (IsOffloaded(src)) {
+    return Status::NotSupported(src + " is in S3");
+  }
+  return target()->LinkFile(src, target_fname);
+}
+
 }  // namespace rocksdb
@@ -24,6 +24,8 @@
 #include <iostream>
 #include <mutex>
 #include <pthread.h>
+#include <string>
+#include <vector>
 
 #include "common/s3util.h"
 #include "rocksdb/env.h"
@@ -55,6 +57,10 @@ class S3FatalException : public std::exception {
  * copy and delete but no modification. The implementation is very straight-forward, for the
  * backup, it will first backup files to a local dir and then upload to s3. And for restore,
  * it will first download latest backup to a local dir from s3, then perform the restore.
+ * With --s3_env_lazy_read, the files not in the local dir are read from s3 with ranged
+ * GETs instead, so that only the parts of them being read are downloaded.
+ * With --s3_env_streaming_upload, the files are uploaded with multipart uploads while
+ * they are written instead, so that backups need no local space.
  */
 class S3Env : public Env {
 
@@ -206,4 +212,69 @@ class S3Env : public Env {
 
 };
 
+/**
+ * The env of live rocksdb instances whose cold sst files can be moved to S3
+ * with Offload(). An offloaded file N.sst leaves a stub N.sst.s3 in its local
+ * dir, which holds its S3 key and size, and is read with ranged GETs through
+ * an LRU of blocks like the lazily read files of S3Env. The stubs are shown to
+ * rocksdb as the files themselves, so the dbs only see slower reads of the
+ * blocks missing their block cache. Deleting an offloaded file deletes its S3
+ * object too.
+ * The offloaded files can't be hard linked, so the dbs using this env can't
+ * be checkpointed.
+ */
+class TieredS3Env : public EnvWrapper {
+ public:
+  // The S3 key of a file under local_root is s3_key_prefix + its path
+  // relative to local_root, and a unique suffix.
+  TieredS3Env(const std::string& local_root,
+              const std::string& s3_key_prefix,
+              std::shared_ptr<common::S3Util> s3_util);
+
+  // Move the local sst file fname to S3. It is a non-op if fname is
+  // offloaded already or deleted meanwhile.
+  Status Offload(const std::string& fname);
+
+  // Whether fname has been moved to S3
+  bool IsOffloaded(const std::string& fname);
+
+  Status NewSequentialFile(const std::string& fname,
+                           std::unique_ptr<SequentialFile>* result,
+                           const EnvOptions& options) override;
+
+  Status NewRandomAccessFile(const std::string& fname,
+                             std::unique_ptr<RandomAccessFile>* result,
+                             const EnvOptions& options) override;
+
+  Status FileExists(const std::string& fname) override;
+
+  Status GetChildren(const std::string& path,
+                     std::vector<std::string>* result) override;
+
+  Status DeleteFile(const std::string& fname) override;
+
+  Status GetFileSize(const std::string& fname, uint64_t* size) override;
+
+  Status GetFileModificationTime(const std::string& fname,
+                                 uint64_t* file_mtime) override;
+
+  Status LinkFile(const std::string& src,
+                  const std::string& target_fname) override;
+
+ private:
+  static std::string StubPath(const std::string& fname) {
+    return fname + ".s3";
+  }
+
+  // Read the S3 key and size of the offloaded fname from its stub
+  Status ReadStub(const std::string& fname, std::string* key, uint64_t* size);
+
+  const std::string local_root_;
+  const std::string s3_key_prefix_;
+  std::shared_ptr<common::S3Util> s3_util_;
+  // Serializes Offload() with DeleteFile(), so that a file deleted while it
+  // is being uploaded doesn't leave a stub behind
+  std::mutex mutex_;
+};
+
 }  // namespace rocksdb
@@ -17,37 +17,195 @@
 //
 
 #include "common/rocksdb_glogger/rocksdb_glogger.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "common/stats/stats.h"
+#include "folly/MPMCQueue.h"
+#if __GNUC__ >= 8
+#include "folly/system/ThreadName.h"
+#else
+#include "folly/ThreadName.h"
+#endif
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_bool(rocksdb_glogger_async, true,
+            "If true, RocksDB info log lines are written to GLog by a "
+            "background thread instead of the RocksDB threads");
+DEFINE_int32(rocksdb_glogger_queue_size, 16 * 1024,
+             "The max number of RocksDB info log lines waiting to be written");
+DEFINE_int32(rocksdb_glogger_info_lines_per_sec, 1000,
+             "The max number of DEBUG, INFO and HEADER RocksDB info log "
+             "lines written per second, 0 for no limit");
+DEFINE_int32(rocksdb_glogger_warn_lines_per_sec, 1000,
+             "The max number of WARN RocksDB info log lines written per "
+             "second, 0 for no limit");
+
+namespace {
+
+const std::string kDroppedLines = "rocksdb_glogger_dropped_lines";
+const int kBufSize = 2048;
+
+std::atomic<uint64_t> num_dropped_lines(0);
+
+void WriteToGLog(const rocksdb::InfoLogLevel log_level, const char* line) {
+  if (log_level == rocksdb::InfoLogLevel::FATAL_LEVEL) {
+    LOG(FATAL) << line;
+  } else if (log_level == rocksdb::InfoLogLevel::ERROR_LEVEL) {
+    LOG(ERROR) << line;
+  } else if (log_level == rocksdb::InfoLogLevel::WARN_LEVEL) {
+    LOG(WARNING) << line;
+  } else {
+    // everything else
+    LOG(INFO) << line;
+  }
+}
+
+void DropLine() {
+  num_dropped_lines.fetch_add(1, std::memory_order_relaxed);
+  common::Stats::get()->Incr(kDroppedLines);
+}
+
+// Caps the number of lines of a level written in each second
+class LineRateLimiter {
+ public:
+  LineRateLimiter() : second_(0), count_(0) {}
+
+  // Whether one more line fits in limit for the current second, 0 for no
+  // limit. Lines may slightly go over the limit when the second turns.
+  bool Allow(const int32_t limit) {
+    if (limit <= 0) {
+      return true;
+    }
+
+    const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto second = second_.load(std::memory_order_relaxed);
+    if (second != now &&
+        second_.compare_exchange_strong(second, now,
+                                        std::memory_order_relaxed)) {
+      count_.store(0, std::memory_order_relaxed);
+    }
+
+    return count_.fetch_add(1, std::memory_order_relaxed) <
+      static_cast<uint32_t>(limit);
+  }
+
+ private:
+  std::atomic<int64_t> second_;
+  std::atomic<uint32_t> count_;
+};
+
+bool AllowLine(const rocksdb::InfoLogLevel log_level) {
+  static std::array<LineRateLimiter,
+                    rocksdb::InfoLogLevel::NUM_INFO_LOG_LEVELS> limiters;
+  if (log_level == rocksdb::InfoLogLevel::ERROR_LEVEL ||
+      log_level == rocksdb::InfoLogLevel::FATAL_LEVEL) {
+    return true;
+  }
+
+  return limiters[log_level].Allow(
+    log_level == rocksdb::InfoLogLevel::WARN_LEVEL ?
+      FLAGS_rocksdb_glogger_warn_lines_per_sec :
+      FLAGS_rocksdb_glogger_info_lines_per_sec);
+}
+
+// The thread writing the queued lines of all loggers to GLog
+class AsyncLineWriter {
+ public:
+  static AsyncLineWriter* get() {
+    static AsyncLineWriter writer;
+    return &writer;
+  }
+
+  // Queue line to be written, return false if the queue is full
+  bool TryWrite(const rocksdb::InfoLogLevel log_level, std::string line) {
+    return queue_.write(Line{log_level, std::move(line), false});
+  }
+
+  ~AsyncLineWriter() {
+    queue_.blockingWrite(Line{rocksdb::InfoLogLevel::INFO_LEVEL, "", true});
+    thread_.join();
+  }
+
+ private:
+  struct Line {
+    rocksdb::InfoLogLevel log_level;
+    std::string text;
+    // tells the thread to exit once the lines before it are written
+    bool stop;
+  };
+
+  AsyncLineWriter()
+      : queue_(std::max(FLAGS_rocksdb_glogger_queue_size, 1))
+      , thread_([this] {
+          if (!folly::setThreadName("RocksdbGLogger")) {
+            LOG(ERROR) << "Failed to setThreadName for RocksdbGLogger thread";
+          }
+
+          Line line;
+          while (true) {
+            queue_.blockingRead(line);
+            if (line.stop) {
+              break;
+            }
+            WriteToGLog(line.log_level, line.text.c_str());
+          }
+        }) {
+  }
+
+  folly::MPMCQueue<Line> queue_;
+  std::thread thread_;
+};
+
+}  // anonymous namespace
+
 namespace common {
 
 void RocksdbGLogger::Logv(const char* format, va_list ap) {
-  static const int kBufSize = 2048;
-  static char buf[kBufSize];
+  Logv(rocksdb::InfoLogLevel::INFO_LEVEL, format, ap);
+}
+
+void RocksdbGLogger::Logv(const rocksdb::InfoLogLevel log_level,
+                          const char* format, va_list ap) {
+  if (log_level < GetInfoLogLevel()) {
+    return;
+  }
 
+  if (!AllowLine(log_level)) {
+    DropLine();
+    return;
+  }
+
+  char buf[kBufSize];
   auto ret = vsnprintf(buf, kBufSize, format, ap);
   if (ret < 0) {
     LOG(ERROR) << "Failed to vsnprintf(): " << ret;
     return;
   }
 
-  if (ret >= kBufSize) {
-    LOG(ERROR) << "RocksDB log info is of " << ret
-               << " bytes, but the buf size is " << kBufSize
-               << " bytes only, ignored";
+  // longer lines are truncated to the buf size
+  if (!FLAGS_rocksdb_glogger_async ||
+      log_level == rocksdb::InfoLogLevel::FATAL_LEVEL) {
+    WriteToGLog(log_level, buf);
     return;
   }
 
-  if (GetInfoLogLevel() == rocksdb::InfoLogLevel::FATAL_LEVEL) {
-    LOG(FATAL) << buf;
-  } else if (GetInfoLogLevel() == rocksdb::InfoLogLevel::ERROR_LEVEL) {
-    LOG(ERROR) << buf;
-  } else if (GetInfoLogLevel() == rocksdb::InfoLogLevel::WARN_LEVEL) {
-    LOG(WARNING) << buf;
-  } else {
-    // everything else
-    LOG(INFO) << buf;
+  if (!AsyncLineWriter::get()->TryWrite(log_level, buf)) {
+    DropLine();
   }
 }
 
+uint64_t RocksdbGLogger::NumDroppedLines() {
+  return num_dropped_lines.load(std::memory_order_relaxed);
+}
+
 }  // namespace common
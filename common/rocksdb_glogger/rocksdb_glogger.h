@@ -18,18 +18,32 @@
 
 #pragma once
 
+#include <cstdint>
+
 #include "rocksdb/env.h"
 
 namespace common {
 
 /*
- * This class simply forwards logs to GLog.
+ * This class forwards logs to GLog.
+ * Unless --rocksdb_glogger_async is off, the lines are queued and written by
+ * a background thread shared by all loggers, so that RocksDB flush and
+ * compaction threads never block on the GLog file lock. The lines of each
+ * level under ERROR are rate limited per second, and the lines which are
+ * over the limit, or which find the queue full, are dropped and counted in
+ * rocksdb_glogger_dropped_lines. FATAL lines are always written in place.
  */
 class RocksdbGLogger : public rocksdb::Logger {
  public:
   RocksdbGLogger() {}
 
   void Logv(const char* format, va_list ap) override;
+
+  void Logv(const rocksdb::InfoLogLevel log_level,
+            const char* format, va_list ap) override;
+
+  // The number of lines dropped by all loggers so far
+  static uint64_t NumDroppedLines();
 };
 
 }  // namespace common
@@ -0,0 +1,159 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/s3_crt_client.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#ifdef ROCKSPLICATOR_WITH_S3_CRT
+#include <aws/core/http/Scheme.h>
+#include <aws/s3-crt/ClientConfiguration.h>
+#include <aws/s3-crt/S3CrtClient.h>
+#include <aws/s3-crt/S3CrtErrors.h>
+#include <aws/s3-crt/model/GetObjectRequest.h>
+#include <aws/s3-crt/model/PutObjectRequest.h>
+
+#include "boost/filesystem.hpp"
+#endif
+
+// Defined in all builds, so that the command lines work with either
+DEFINE_double(s3_crt_throughput_target_gbps, 10.0,
+              "The throughput the CRT S3 client sizes its connection pool "
+              "for, shared by all the transfers of the process");
+DEFINE_int32(s3_crt_part_size_mb, 8,
+             "The size of the parts the CRT S3 client splits the transfers "
+             "into");
+DEFINE_bool(s3_crt_checksums, true,
+            "If true, the CRT S3 client sends CRC32 checksums with the "
+            "uploads and validates those of the downloads");
+
+namespace common {
+
+#ifdef ROCKSPLICATOR_WITH_S3_CRT
+
+namespace {
+
+template <typename Outcome>
+bool IsThrottled(const Outcome& outcome) {
+  const auto& error = outcome.GetError();
+  return error.GetErrorType() == Aws::S3Crt::S3CrtErrors::SLOW_DOWN ||
+    error.GetErrorType() == Aws::S3Crt::S3CrtErrors::THROTTLING ||
+    error.GetExceptionName() == "SlowDown";
+}
+
+class S3CrtClientImpl : public S3CrtClient {
+ public:
+  explicit S3CrtClientImpl(const Aws::S3Crt::ClientConfiguration& config)
+      : client_(config) {}
+
+  Result getObject(
+      const std::string& bucket, const std::string& key,
+      const std::function<std::iostream*()>& stream_factory) override {
+    Aws::S3Crt::Model::GetObjectRequest request;
+    request.SetBucket(bucket);
+    request.SetKey(key);
+    request.SetResponseStreamFactory(stream_factory);
+    if (FLAGS_s3_crt_checksums) {
+      request.SetChecksumMode(Aws::S3Crt::Model::ChecksumMode::ENABLED);
+    }
+
+    auto outcome = client_.GetObject(request);
+    if (!outcome.IsSuccess()) {
+      return Result{outcome.GetError().GetMessage(), 0, IsThrottled(outcome)};
+    }
+
+    return Result{"",
+                  static_cast<uint64_t>(outcome.GetResult().GetContentLength()),
+                  false};
+  }
+
+  Result putObject(const std::string& bucket, const std::string& key,
+                   const std::string& local_path,
+                   const std::string& tags) override {
+    boost::system::error_code ec;
+    const auto file_size = boost::filesystem::file_size(local_path, ec);
+    if (ec) {
+      return Result{"Failed to stat " + local_path + ": " + ec.message(), 0,
+                    false};
+    }
+
+    Aws::S3Crt::Model::PutObjectRequest request;
+    request.SetBucket(bucket);
+    request.SetKey(key);
+    if (!tags.empty()) {
+      request.SetTagging(tags);
+    }
+    if (FLAGS_s3_crt_checksums) {
+      request.SetChecksumAlgorithm(
+        Aws::S3Crt::Model::ChecksumAlgorithm::CRC32);
+    }
+    request.SetBody(Aws::MakeShared<Aws::FStream>(
+      "S3CrtPutObjectInputStream", local_path.c_str(),
+      std::ios_base::in | std::ios_base::binary));
+
+    auto outcome = client_.PutObject(request);
+    if (!outcome.IsSuccess()) {
+      return Result{outcome.GetError().GetMessage(), 0, IsThrottled(outcome)};
+    }
+
+    return Result{"", static_cast<uint64_t>(file_size), false};
+  }
+
+ private:
+  Aws::S3Crt::S3CrtClient client_;
+};
+
+}  // namespace
+
+std::shared_ptr<S3CrtClient> S3CrtClient::Get(
+    const std::string& endpoint_override, const std::string& scheme) {
+  static std::mutex clients_mutex;
+  static std::map<std::string, std::weak_ptr<S3CrtClient>> clients;
+
+  const auto key = scheme + "://" + endpoint_override;
+  std::lock_guard<std::mutex> guard(clients_mutex);
+  auto client = clients[key].lock();
+  if (client == nullptr) {
+    Aws::S3Crt::ClientConfiguration config;
+    config.throughputTargetGbps = FLAGS_s3_crt_throughput_target_gbps;
+    config.partSize =
+      static_cast<uint64_t>(std::max(FLAGS_s3_crt_part_size_mb, 5)) << 20;
+    config.scheme = scheme == "http" ? Aws::Http::Scheme::HTTP :
+                                       Aws::Http::Scheme::HTTPS;
+    if (!endpoint_override.empty()) {
+      config.endpointOverride = endpoint_override;
+    }
+    client = std::make_shared<S3CrtClientImpl>(config);
+    clients[key] = client;
+  }
+
+  return client;
+}
+
+#else
+
+std::shared_ptr<S3CrtClient> S3CrtClient::Get(const std::string&,
+                                              const std::string&) {
+  return nullptr;
+}
+
+#endif  // ROCKSPLICATOR_WITH_S3_CRT
+
+}  // namespace common
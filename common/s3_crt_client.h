@@ -0,0 +1,76 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "gflags/gflags.h"
+
+DECLARE_double(s3_crt_throughput_target_gbps);
+DECLARE_int32(s3_crt_part_size_mb);
+DECLARE_bool(s3_crt_checksums);
+
+namespace common {
+
+/*
+ * S3CrtClient transfers whole objects between S3 and local files with the
+ * S3 client of the AWS Common Runtime, which splits them into parts sent over
+ * parallel connections, and checksums them. It is only available if we are
+ * built with aws-cpp-sdk-s3-crt, see ROCKSPLICATOR_WITH_S3_CRT.
+ *
+ * It is thread safe. All the S3Utils of the process share the one for their
+ * endpoint, as the CRT client sizes its connection pool for the throughput
+ * target of the whole host.
+ */
+class S3CrtClient {
+ public:
+  struct Result {
+    // empty on success
+    std::string error;
+    // the bytes of the object transferred
+    uint64_t bytes;
+    // S3 asked us to slow down
+    bool throttled;
+  };
+
+  // Return the client shared by the process for endpoint_override (empty for
+  // AWS) and scheme ("http" or "https"), nullptr if the CRT client isn't
+  // available. Aws::InitAPI() must have been called.
+  static std::shared_ptr<S3CrtClient> Get(const std::string& endpoint_override,
+                                          const std::string& scheme);
+
+  virtual ~S3CrtClient() {}
+
+  // Download bucket/key into the stream returned by stream_factory, which
+  // is called once and owned by the client from then on
+  virtual Result getObject(
+    const std::string& bucket, const std::string& key,
+    const std::function<std::iostream*()>& stream_factory) = 0;
+
+  // Upload local_path to bucket/key. tags are URL encoded, e.g. "Key1=Value1"
+  virtual Result putObject(const std::string& bucket, const std::string& key,
+                           const std::string& local_path,
+                           const std::string& tags) = 0;
+};
+
+}  // namespace common
@@ -22,8 +22,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <aws/core/http/Scheme.h>
 #include <aws/s3/S3Client.h>
+#include <aws/s3/S3Errors.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CompletedPart.h>
 #include <aws/s3/model/CopyObjectRequest.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
 #include <aws/s3/model/DeleteObjectRequest.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/HeadObjectRequest.h>
@@ -31,58 +38,314 @@
 #include <aws/s3/model/ListObjectsResult.h>
 #include <aws/s3/model/Object.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <sstream>
 #include <string>
 #include <tuple>
 #include <fstream>
 #include "boost/algorithm/string.hpp"
+#include "boost/filesystem.hpp"
 #include "boost/iostreams/stream.hpp"
+#include "common/adaptive_rate_limiter.h"
 #include "common/aws_s3_rate_limiter.h"
+#include "common/stats/stats.h"
+#include "folly/Conv.h"
+#include "folly/ScopeGuard.h"
 #include "glog/logging.h"
 
 using std::string;
 using std::vector;
 using std::tuple;
+using Aws::S3::Model::AbortMultipartUploadRequest;
+using Aws::S3::Model::CompleteMultipartUploadRequest;
+using Aws::S3::Model::CompletedMultipartUpload;
+using Aws::S3::Model::CompletedPart;
 using Aws::S3::Model::CopyObjectRequest;
+using Aws::S3::Model::CreateMultipartUploadRequest;
 using Aws::S3::Model::DeleteObjectRequest;
 using Aws::S3::Model::GetObjectRequest;
 using Aws::S3::Model::ListObjectsRequest;
 using Aws::S3::Model::HeadObjectRequest;
 using Aws::S3::Model::PutObjectRequest;
+using Aws::S3::Model::UploadPartRequest;
 
+DEFINE_string(s3_endpoint_override, "",
+              "If set, S3 requests go to this host[:port] rather than to AWS, "
+              "e.g. to a MinIO server. Prefix it with http:// for plain HTTP");
+DEFINE_string(s3_client_backend, "classic",
+              "The client downloading and uploading whole files: \"classic\" "
+              "for the S3Client, or \"crt\" for the S3 client of the AWS "
+              "Common Runtime, which falls back to the classic one if we are "
+              "not built with it");
 DEFINE_int32(direct_io_buffer_n_pages, 1,
              "Number of pages we need to set to direct io buffer");
 DEFINE_bool(disable_s3_download_stream_buffer, false,
             "disable the stream buffer used by s3 downloading");
+DEFINE_int32(direct_io_writer_n_buffers, 1,
+             "The number of direct_io_buffer_n_pages buffers of a direct I/O "
+             "writer. With more than one, the full ones are written in the "
+             "background while the next one is being filled");
+DEFINE_int32(s3_multipart_upload_threshold_mb, 0,
+             "putObject() uploads the files of at least this size with a "
+             "multipart upload, 0 to disable");
+DEFINE_int32(s3_multipart_upload_part_size_mb, 64,
+             "The part size of multipart uploads, which S3 requires to be at "
+             "least 5MB");
+DEFINE_int32(s3_multipart_upload_concurrency, 4,
+             "The number of parts of a multipart upload uploaded at a time");
+DEFINE_int32(s3_multipart_upload_part_retries, 3,
+             "How many times a failed part of a multipart upload is retried");
+DEFINE_int32(s3_ranged_get_threshold_mb, 0,
+             "getObject() downloads the objects of at least this size to "
+             "local files with parallel ranged GETs, 0 to disable. It costs "
+             "a HEAD request per object to find out the size");
+DEFINE_int32(s3_ranged_get_part_size_mb, 64,
+             "The part size of ranged GETs");
+DEFINE_int32(s3_ranged_get_concurrency, 4,
+             "The number of parts of an object downloaded at a time");
+DEFINE_int32(s3_ranged_get_part_retries, 3,
+             "How many times a failed ranged GET is retried");
+DEFINE_int32(s3_adaptive_rate_limit_max_mb, 0,
+             "If positive, all the S3 transfers of the process share an "
+             "adaptive rate limit of at most this many MB/s, which is halved "
+             "when S3 throttles the requests and grows when they go through");
+DEFINE_int32(s3_adaptive_rate_limit_min_mb, 10,
+             "The min MB/s of the adaptive S3 rate limit");
+DEFINE_int32(s3_adaptive_rate_limit_step_mb, 10,
+             "How many MB/s the adaptive S3 rate limit grows by per second of "
+             "successful requests");
+DEFINE_int32(s3_list_concurrency, 1,
+             "The number of threads listAllObjects() lists the sub-dirs of a "
+             "prefix with");
+DEFINE_int32(s3_get_objects_concurrency, 1,
+             "The number of objects getObjects() downloads at a time");
 
 namespace common {
 
 std::mutex S3Util::counter_mutex_;
 std::uint32_t S3Util::instance_counter_(0);
+std::mutex S3Util::client_pool_mutex_;
+map<string, std::weak_ptr<S3Util::CutomizedS3Client>> S3Util::client_pool_;
+std::mutex S3Util::rate_limiter_pool_mutex_;
+map<std::pair<bool, uint32_t>,
+    std::weak_ptr<Aws::Utils::RateLimits::RateLimiterInterface>>
+  S3Util::rate_limiter_pool_;
 const uint32_t kPageSize = getpagesize();
+const std::string kS3AdaptiveRateGauge = "s3_adaptive_rate_limit_bytes_per_sec";
+
+namespace {
+
+using Aws::Utils::RateLimits::RateLimiterInterface;
+
+// The adaptive rate limiter shared by all the S3 transfers of the process,
+// null if disabled. The current rate is exported as a gauge.
+AdaptiveRateLimiter* GlobalRateLimiter() {
+  static AdaptiveRateLimiter* limiter = [] () -> AdaptiveRateLimiter* {
+    if (FLAGS_s3_adaptive_rate_limit_max_mb <= 0) {
+      return nullptr;
+    }
+    auto max_rate =
+      static_cast<int64_t>(FLAGS_s3_adaptive_rate_limit_max_mb) << 20;
+    auto min_rate = std::min<int64_t>(
+      static_cast<int64_t>(std::max(FLAGS_s3_adaptive_rate_limit_min_mb, 1))
+        << 20, max_rate);
+    auto step = static_cast<int64_t>(FLAGS_s3_adaptive_rate_limit_step_mb) << 20;
+    auto l = new AdaptiveRateLimiter(min_rate, max_rate, step);
+    Stats::get()->RegisterGauge(kS3AdaptiveRateGauge, [l] {
+      return static_cast<uint64_t>(l->GetRate());
+    });
+    return l;
+  }();
+
+  return limiter;
+}
+
+// Let the adaptive rate limiter know how a request went
+void ReportResult(const bool success, const bool throttled) {
+  auto limiter = GlobalRateLimiter();
+  if (limiter == nullptr) {
+    return;
+  }
+
+  if (success) {
+    limiter->OnSuccess();
+  } else if (throttled) {
+    limiter->OnThrottled();
+  }
+}
+
+template <typename Outcome>
+void ReportOutcome(const Outcome& outcome) {
+  if (outcome.IsSuccess()) {
+    ReportResult(true, false);
+    return;
+  }
+
+  const auto& error = outcome.GetError();
+  ReportResult(false,
+               error.GetErrorType() == Aws::S3::S3Errors::SLOW_DOWN ||
+               error.GetErrorType() == Aws::S3::S3Errors::THROTTLING ||
+               error.GetExceptionName() == "SlowDown");
+}
+
+// The rate limiters of the S3Util request being sent by this thread
+thread_local RateLimiterInterface* tl_read_rate_limiter = nullptr;
+thread_local RateLimiterInterface* tl_write_rate_limiter = nullptr;
+
+// The rate limiter of the pooled clients, which are shared by S3Utils with
+// different rate limits. It passes the costs on to the rate limiter of the
+// S3Util whose request is being sent by the calling thread.
+class ThreadLocalRateLimiter : public RateLimiterInterface {
+ public:
+  explicit ThreadLocalRateLimiter(RateLimiterInterface* const* limiter)
+      : limiter_(limiter) {}
+
+  DelayType ApplyCost(int64_t cost) override {
+    DelayType delay(0);
+    if (*limiter_) {
+      delay = (*limiter_)->ApplyCost(cost);
+    }
+    if (auto global_limiter = GlobalRateLimiter()) {
+      delay = std::max(delay, global_limiter->ApplyCost(cost));
+    }
+    return delay;
+  }
+
+  void ApplyAndPayForCost(int64_t cost) override {
+    auto delay = ApplyCost(cost);
+    if (delay.count() > 0) {
+      std::this_thread::sleep_for(delay);
+    }
+  }
+
+  void SetRate(int64_t, bool) override {
+  }
+
+ private:
+  // address of the thread local limiter to use
+  RateLimiterInterface* const* limiter_;
+};
+
+// Apply the rate limiters to the requests sent by this thread in the scope
+class RateLimitScope {
+ public:
+  RateLimitScope(RateLimiterInterface* read_rate_limiter,
+                 RateLimiterInterface* write_rate_limiter)
+      : prev_read_rate_limiter_(tl_read_rate_limiter)
+      , prev_write_rate_limiter_(tl_write_rate_limiter) {
+    tl_read_rate_limiter = read_rate_limiter;
+    tl_write_rate_limiter = write_rate_limiter;
+  }
+
+  ~RateLimitScope() {
+    tl_read_rate_limiter = prev_read_rate_limiter_;
+    tl_write_rate_limiter = prev_write_rate_limiter_;
+  }
+
+ private:
+  RateLimiterInterface* const prev_read_rate_limiter_;
+  RateLimiterInterface* const prev_write_rate_limiter_;
+};
+
+// The CRT client doesn't go through the rate limiters of the S3Client. The
+// bytes of its transfers are charged once they are done instead, which holds
+// the average rate, if not the peaks.
+void PayForCrtTransfer(RateLimiterInterface* rate_limiter,
+                       const S3CrtClient::Result& result) {
+  ReportResult(result.error.empty(), result.throttled);
+  if (result.bytes == 0) {
+    return;
+  }
+
+  auto delay = RateLimiterInterface::DelayType(0);
+  if (rate_limiter) {
+    delay = rate_limiter->ApplyCost(result.bytes);
+  }
+  if (auto global_limiter = GlobalRateLimiter()) {
+    delay = std::max(delay, global_limiter->ApplyCost(result.bytes));
+  }
+  if (delay.count() > 0) {
+    std::this_thread::sleep_for(delay);
+  }
+}
+
+// The streams objects are downloaded into
+std::function<Aws::IOStream*()> FileStreamFactory(const string& local_path,
+                                                  const bool direct_io) {
+  if (direct_io) {
+    return [=]() -> Aws::IOStream* {
+      if (FLAGS_disable_s3_download_stream_buffer) {
+        return new boost::iostreams::stream<DirectIOFileSink>(
+          DirectIOFileSink(local_path), 0, 0);
+      } else {
+        return new boost::iostreams::stream<DirectIOFileSink>(local_path);
+      }
+    };
+  }
+
+  return [=]() -> Aws::IOStream* {
+    // "T" is just a place holder for ALLOCATION_TAG.
+    return Aws::New<Aws::FStream>(
+            "T", local_path.c_str(),
+            std::ios_base::out | std::ios_base::in | std::ios_base::trunc);
+  };
+}
+
+}  // namespace
 
 DirectIOWritableFile::DirectIOWritableFile(const string& file_path)
     : fd_(-1)
     , file_size_(0)
     , buffer_()
     , offset_(0)
-    , buffer_size_(FLAGS_direct_io_buffer_n_pages * kPageSize){
-  if (posix_memalign(&buffer_, kPageSize, buffer_size_) != 0) {
-    LOG(ERROR) << "Failed to allocate memaligned buffer, errno = " << errno;
-    return;
+    , buffer_size_(FLAGS_direct_io_buffer_n_pages * kPageSize)
+    , write_offset_(0)
+    , buffers_()
+    , mutex_()
+    , cv_()
+    , free_buffers_()
+    , full_buffers_()
+    , stop_(false)
+    , failed_(false)
+    , writer_() {
+  const int n_buffers = std::max(FLAGS_direct_io_writer_n_buffers, 1);
+  for (int i = 0; i < n_buffers; ++i) {
+    void* buffer;
+    if (posix_memalign(&buffer, kPageSize, buffer_size_) != 0) {
+      LOG(ERROR) << "Failed to allocate memaligned buffer, errno = " << errno;
+      break;
+    }
+    buffers_.push_back(buffer);
   }
 
   int flag = O_WRONLY | O_TRUNC | O_CREAT | O_DIRECT;
-  fd_ = open(file_path.c_str(), flag , S_IRUSR | S_IWUSR | S_IRGRP);
+  if (buffers_.size() == static_cast<size_t>(n_buffers)) {
+    fd_ = open(file_path.c_str(), flag , S_IRUSR | S_IWUSR | S_IRGRP);
+  }
   if (fd_ < 0) {
     LOG(ERROR) << "Failed to open " << file_path << " with flag " << flag
                << ", errno = " << errno;
-    free(buffer_);
-    buffer_ = nullptr;
+    for (auto buffer : buffers_) {
+      free(buffer);
+    }
+    buffers_.clear();
+    return;
+  }
+
+  buffer_ = buffers_[0];
+  free_buffers_.assign(buffers_.begin() + 1, buffers_.end());
+  if (n_buffers > 1) {
+    writer_ = std::make_unique<std::thread>([this] { writeLoop(); });
   }
 }
 
@@ -91,17 +354,79 @@ DirectIOWritableFile::~DirectIOWritableFile() {
     return;
   }
 
+  bool ok = true;
   if (offset_ > 0) {
-    if (::write(fd_, buffer_, buffer_size_) != buffer_size_) {
+    // The last chunk is padded to a whole buffer, and truncated below
+    if (!(ok = flushBuffer())) {
       LOG(ERROR) << "Failed to write last chunk, errno = " << errno;
-    } else {
-      ftruncate(fd_, file_size_);
     }
   }
-  free(buffer_);
+
+  if (writer_ != nullptr) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    writer_->join();
+    ok = ok && !failed_;
+  }
+
+  if (ok && offset_ > 0) {
+    ftruncate(fd_, file_size_);
+  }
+  for (auto buffer : buffers_) {
+    free(buffer);
+  }
   close(fd_);
 }
 
+bool DirectIOWritableFile::flushBuffer() {
+  const auto offset = write_offset_;
+  write_offset_ += buffer_size_;
+  if (writer_ == nullptr) {
+    return pwrite(fd_, buffer_, buffer_size_, offset) ==
+      static_cast<ssize_t>(buffer_size_);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  full_buffers_.emplace_back(buffer_, offset);
+  cv_.notify_all();
+  cv_.wait(lock, [this] { return !free_buffers_.empty() || failed_; });
+  if (failed_) {
+    // writer_ still owns the buffers it hasn't gotten to
+    return false;
+  }
+  buffer_ = free_buffers_.back();
+  free_buffers_.pop_back();
+  return true;
+}
+
+void DirectIOWritableFile::writeLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return !full_buffers_.empty() || stop_; });
+    if (full_buffers_.empty()) {
+      return;
+    }
+
+    auto full_buffer = full_buffers_.front();
+    full_buffers_.pop_front();
+    lock.unlock();
+    const bool ok = pwrite(fd_, full_buffer.first, buffer_size_,
+                           full_buffer.second) ==
+      static_cast<ssize_t>(buffer_size_);
+    if (!ok) {
+      LOG(ERROR) << "Failed to write to DirectIOWritableFile, errno = "
+                 << errno;
+    }
+    lock.lock();
+    failed_ = failed_ || !ok;
+    free_buffers_.push_back(full_buffer.first);
+    cv_.notify_all();
+  }
+}
+
 std::streamsize DirectIOWritableFile::write(const char* s, std::streamsize n) {
   if (buffer_ == nullptr || fd_ < 0) {
     return -1;
@@ -115,7 +440,7 @@ std::streamsize DirectIOWritableFile::write(const char* s, std::streamsize n) {
     s += bytes;
     // flush when buffer is full
     if (offset_ == buffer_size_) {
-      if (::write(fd_, buffer_, buffer_size_) != buffer_size_) {
+      if (!flushBuffer()) {
         LOG(ERROR) << "Failed to write to DirectIOWritableFile, errno = "
                    << errno;
         return -1;
@@ -131,6 +456,30 @@ std::streamsize DirectIOWritableFile::write(const char* s, std::streamsize n) {
 
 GetObjectResponse S3Util::getObject(
     const string& key, const string& local_path, const bool direct_io) {
+  if (crt_client_) {
+    // The CRT client splits large objects into ranged GETs itself
+    auto result = crt_client_->getObject(
+      bucket_, key, FileStreamFactory(local_path, direct_io));
+    PayForCrtTransfer(read_rate_limiter_.get(), result);
+    if (result.error.empty()) {
+      return GetObjectResponse(true, "");
+    }
+    return GetObjectResponse(false, "Failed to download from " + key +
+                             " to " + local_path + " error: " + result.error);
+  }
+
+  if (FLAGS_s3_ranged_get_threshold_mb > 0) {
+    auto size_resp = getObjectSizeAndModTime(key);
+    if (size_resp.Error().empty() && size_resp.Body().at("size") >=
+        static_cast<uint64_t>(FLAGS_s3_ranged_get_threshold_mb) << 20) {
+      return getObjectRanged(
+        key, local_path,
+        static_cast<uint64_t>(FLAGS_s3_ranged_get_part_size_mb) << 20,
+        FLAGS_s3_ranged_get_concurrency, FLAGS_s3_ranged_get_part_retries,
+        direct_io);
+    }
+  }
+
   auto getObjectResult = sdkGetObject(key, local_path, direct_io);
   string err_msg_prefix =
     "Failed to download from " + key + " to " + local_path + " error: ";
@@ -142,11 +491,137 @@ GetObjectResponse S3Util::getObject(
   }
 }
 
+GetObjectResponse S3Util::getObjectRanged(const string& key,
+                                          const string& local_path,
+                                          const uint64_t part_size,
+                                          const uint32_t concurrency,
+                                          const uint32_t retries,
+                                          const bool direct_io) {
+  const string err_msg_prefix =
+    "Failed to download from " + key + " to " + local_path + " error: ";
+  auto size_resp = getObjectSizeAndModTime(key);
+  if (!size_resp.Error().empty()) {
+    return GetObjectResponse(false, err_msg_prefix + size_resp.Error());
+  }
+  const uint64_t file_size = size_resp.Body().at("size");
+  // Direct I/O writes whole pages at page aligned offsets
+  const uint64_t aligned_part_size = direct_io ?
+    std::max<uint64_t>((part_size + kPageSize - 1) / kPageSize * kPageSize,
+                       kPageSize) :
+    std::max<uint64_t>(part_size, 1);
+
+  int flag = O_WRONLY | O_TRUNC | O_CREAT;
+  if (direct_io) {
+    flag |= O_DIRECT;
+  }
+  const int fd = open(local_path.c_str(), flag, S_IRUSR | S_IWUSR | S_IRGRP);
+  if (fd < 0) {
+    return GetObjectResponse(false, err_msg_prefix + "Failed to open, errno = " +
+                             std::to_string(errno));
+  }
+  SCOPE_EXIT { close(fd); };
+  if (file_size > 0 && posix_fallocate(fd, 0, file_size) != 0) {
+    LOG(WARNING) << "Failed to preallocate " << local_path;
+  }
+
+  const uint64_t n_parts =
+    (file_size + aligned_part_size - 1) / aligned_part_size;
+  std::atomic<uint64_t> next_part(0);
+  std::atomic<bool> failed(false);
+  std::mutex err_mutex;
+  string err_msg;
+
+  auto download_parts = [&] {
+    void* buf = nullptr;
+    if (posix_memalign(&buf, kPageSize, aligned_part_size) != 0) {
+      std::lock_guard<std::mutex> guard(err_mutex);
+      err_msg = "Failed to allocate memaligned buffer";
+      failed.store(true);
+      return;
+    }
+    SCOPE_EXIT { free(buf); };
+
+    uint64_t i;
+    while (!failed.load() && (i = next_part.fetch_add(1)) < n_parts) {
+      const uint64_t offset = i * aligned_part_size;
+      const uint64_t length = std::min(aligned_part_size, file_size - offset);
+      for (uint32_t attempt = 0; ; ++attempt) {
+        GetObjectRequest request;
+        request.SetBucket(bucket_);
+        request.SetKey(key);
+        request.SetRange("bytes=" + std::to_string(offset) + "-" +
+                         std::to_string(offset + length - 1));
+        RateLimitScope rate_limit_scope(read_rate_limiter_.get(),
+                                        write_rate_limiter_.get());
+        auto result = s3Client->GetObject(request);
+        ReportOutcome(result);
+        string part_err;
+        if (result.IsSuccess()) {
+          auto& body = result.GetResult().GetBody();
+          body.read(static_cast<char*>(buf), length);
+          if (static_cast<uint64_t>(body.gcount()) != length) {
+            part_err = "Short read";
+          } else {
+            // The tail of the last part is padded to a whole page for direct
+            // I/O, and the file is truncated to its size in the end.
+            const uint64_t write_length = direct_io ?
+              (length + kPageSize - 1) / kPageSize * kPageSize : length;
+            if (pwrite(fd, buf, write_length, offset) !=
+                static_cast<ssize_t>(write_length)) {
+              std::lock_guard<std::mutex> guard(err_mutex);
+              err_msg = "Failed to write part " + std::to_string(i + 1) +
+                ", errno = " + std::to_string(errno);
+              failed.store(true);
+              return;
+            }
+            break;
+          }
+        } else {
+          part_err = result.GetError().GetMessage();
+        }
+
+        LOG(ERROR) << err_msg_prefix << "part " << i + 1 << " attempt "
+                   << attempt + 1 << ": " << part_err;
+        if (attempt >= retries) {
+          std::lock_guard<std::mutex> guard(err_mutex);
+          err_msg = part_err;
+          failed.store(true);
+          return;
+        }
+      }
+    }
+  };
+
+  vector<std::thread> workers;
+  const auto n_workers = std::min<uint64_t>(std::max(concurrency, 1u), n_parts);
+  for (uint64_t i = 0; i < n_workers; ++i) {
+    workers.emplace_back(download_parts);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  if (failed.load()) {
+    return GetObjectResponse(false, err_msg_prefix + err_msg);
+  }
+
+  if (ftruncate(fd, file_size) != 0) {
+    return GetObjectResponse(false, err_msg_prefix +
+                             "Failed to truncate, errno = " +
+                             std::to_string(errno));
+  }
+
+  return GetObjectResponse(true, "");
+}
+
 GetObjectResponse S3Util::getObject(const string& key, iostream* out) {
   GetObjectRequest getObjectRequest;
   getObjectRequest.SetBucket(bucket_);
   getObjectRequest.SetKey(key);
+  RateLimitScope rate_limit_scope(read_rate_limiter_.get(),
+                                  write_rate_limiter_.get());
   auto getObjectResult = s3Client->GetObject(getObjectRequest);
+  ReportOutcome(getObjectResult);
   if (getObjectResult.IsSuccess()) {
     *out << getObjectResult.GetResult().GetBody().rdbuf();
     return GetObjectResponse(true, "");
@@ -157,6 +632,33 @@ GetObjectResponse S3Util::getObject(const string& key, iostream* out) {
   }
 }
 
+GetObjectRangeResponse S3Util::getObjectRange(const string& key,
+                                              const uint64_t offset,
+                                              const uint64_t length) {
+  if (length == 0) {
+    return GetObjectRangeResponse("", "");
+  }
+
+  GetObjectRequest getObjectRequest;
+  getObjectRequest.SetBucket(bucket_);
+  getObjectRequest.SetKey(key);
+  getObjectRequest.SetRange("bytes=" + std::to_string(offset) + "-" +
+                            std::to_string(offset + length - 1));
+  RateLimitScope rate_limit_scope(read_rate_limiter_.get(),
+                                  write_rate_limiter_.get());
+  auto getObjectResult = s3Client->GetObject(getObjectRequest);
+  ReportOutcome(getObjectResult);
+  if (!getObjectResult.IsSuccess()) {
+    string err_msg_prefix = "Failed to get range of " + key + ", error: ";
+    return GetObjectRangeResponse("",
+        err_msg_prefix + getObjectResult.GetError().GetMessage());
+  }
+
+  std::stringstream data;
+  data << getObjectResult.GetResult().GetBody().rdbuf();
+  return GetObjectRangeResponse(data.str(), "");
+}
+
 SdkGetObjectResponse S3Util::sdkGetObject(const string& key,
                                           const string& local_path,
                                           const bool direct_io) {
@@ -164,29 +666,13 @@ SdkGetObjectResponse S3Util::sdkGetObject(const string& key,
   getObjectRequest.SetBucket(bucket_);
   getObjectRequest.SetKey(key);
   if (local_path != "") {
-    if (direct_io) {
-      getObjectRequest.SetResponseStreamFactory(
-        [=]() {
-          if (FLAGS_disable_s3_download_stream_buffer) {
-            return new boost::iostreams::stream<DirectIOFileSink>(
-              DirectIOFileSink(local_path), 0, 0);
-          } else {
-            return new boost::iostreams::stream<DirectIOFileSink>(local_path);
-          }
-        }
-      );
-    } else {
-      getObjectRequest.SetResponseStreamFactory(
-        [=]() {
-          // "T" is just a place holder for ALLOCATION_TAG.
-          return Aws::New<Aws::FStream>(
-                  "T", local_path.c_str(),
-                  std::ios_base::out | std::ios_base::in | std::ios_base::trunc);
-        }
-      );
-    }
+    getObjectRequest.SetResponseStreamFactory(
+      FileStreamFactory(local_path, direct_io));
   }
+  RateLimitScope rate_limit_scope(read_rate_limiter_.get(),
+                                  write_rate_limiter_.get());
   auto getObjectResult = s3Client->GetObject(getObjectRequest);
+  ReportOutcome(getObjectResult);
   return getObjectResult;
 }
 
@@ -236,6 +722,121 @@ void S3Util::listObjectsHelper(const string& prefix, const string& delimiter,
 }
 
 
+void S3Util::listPageHelper(const string& prefix, const string& delimiter,
+                            const string& marker, vector<string>* objects,
+                            vector<string>* common_prefixes,
+                            string* next_marker, string* error_message) {
+  ListObjectsRequest listObjectRequest;
+  listObjectRequest.SetBucket(bucket_);
+  listObjectRequest.SetPrefix(prefix);
+  listObjectRequest.SetDelimiter(delimiter);
+  if (!marker.empty()) {
+    listObjectRequest.SetMarker(marker);
+  }
+  auto listObjectResult = s3Client->ListObjects(listObjectRequest);
+  if (!listObjectResult.IsSuccess()) {
+    *error_message = listObjectResult.GetError().GetMessage();
+    return;
+  }
+
+  const auto& result = listObjectResult.GetResult();
+  for (const auto& object : result.GetContents()) {
+    objects->push_back(object.GetKey());
+  }
+  for (const auto& common_prefix : result.GetCommonPrefixes()) {
+    common_prefixes->push_back(common_prefix.GetPrefix());
+  }
+
+  if (result.GetIsTruncated()) {
+    if (result.GetNextMarker().empty()) {
+      // The last key or common prefix of the page, whichever comes later
+      string last = objects->empty() ? "" : objects->back();
+      if (!common_prefixes->empty() && common_prefixes->back() > last) {
+        last = common_prefixes->back();
+      }
+      *next_marker = last;
+    } else {
+      *next_marker = result.GetNextMarker();
+    }
+  }
+}
+
+string S3Util::listAllObjectsParallel(
+    const string& prefix,
+    const uint32_t concurrency,
+    const std::function<void(const vector<string>&)>& on_objects,
+    const string& delimiter) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  // the prefixes to be listed
+  std::deque<string> prefixes{prefix};
+  // the number of prefixes being listed
+  uint32_t n_listing = 0;
+  string error_message;
+  std::mutex callback_mutex;
+
+  auto list_prefixes = [&] {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] {
+        return !prefixes.empty() || n_listing == 0 || !error_message.empty();
+      });
+      if (prefixes.empty() || !error_message.empty()) {
+        // all done, or failed
+        return;
+      }
+
+      const auto current = std::move(prefixes.front());
+      prefixes.pop_front();
+      ++n_listing;
+      lock.unlock();
+
+      string marker;
+      string page_error;
+      do {
+        vector<string> objects;
+        vector<string> common_prefixes;
+        string next_marker;
+        listPageHelper(current, delimiter, marker, &objects, &common_prefixes,
+                       &next_marker, &page_error);
+        if (!page_error.empty()) {
+          break;
+        }
+
+        if (!common_prefixes.empty()) {
+          std::lock_guard<std::mutex> guard(mutex);
+          prefixes.insert(prefixes.end(), common_prefixes.begin(),
+                          common_prefixes.end());
+          cv.notify_all();
+        }
+        if (!objects.empty()) {
+          std::lock_guard<std::mutex> guard(callback_mutex);
+          on_objects(objects);
+        }
+        marker = std::move(next_marker);
+      } while (!marker.empty());
+
+      lock.lock();
+      --n_listing;
+      if (!page_error.empty() && error_message.empty()) {
+        error_message = page_error;
+      }
+      cv.notify_all();
+    }
+  };
+
+  vector<std::thread> workers;
+  for (uint32_t i = 1; i < std::max(concurrency, 1u); ++i) {
+    workers.emplace_back(list_prefixes);
+  }
+  list_prefixes();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  return error_message;
+}
+
 ListObjectsResponse S3Util::listObjects(const string& prefix,
                                         const string& delimiter) {
   vector<string> objects;
@@ -257,6 +858,19 @@ ListObjectsResponseV2 S3Util::listObjectsV2(const string& prefix,
 }
 
 ListObjectsResponseV2 S3Util::listAllObjects(const string& prefix, const string& delimiter) {
+  if (FLAGS_s3_list_concurrency > 1 && delimiter.empty()) {
+    vector<string> output;
+    auto error_message = listAllObjectsParallel(
+      prefix, FLAGS_s3_list_concurrency,
+      [&output] (const vector<string>& objects) {
+        output.insert(output.end(), objects.begin(), objects.end());
+      });
+    // in the order S3 lists them
+    std::sort(output.begin(), output.end());
+    return ListObjectsResponseV2(ListObjectsResponseV2Body(output, ""),
+                                 error_message);
+  }
+
   vector<string> output;
   vector<string> objects;
   string error_message;
@@ -275,6 +889,44 @@ ListObjectsResponseV2 S3Util::listAllObjects(const string& prefix, const string&
   return ListObjectsResponseV2(ListObjectsResponseV2Body(output, next_marker), error_message);
 }
 
+ListObjectSizesResponse S3Util::listAllObjectSizes(const string& prefix) {
+  map<string, uint64_t> sizes;
+  string marker;
+  do {
+    ListObjectsRequest listObjectRequest;
+    listObjectRequest.SetBucket(bucket_);
+    listObjectRequest.SetPrefix(prefix);
+    if (!marker.empty()) {
+      listObjectRequest.SetMarker(marker);
+    }
+    auto listObjectResult = s3Client->ListObjects(listObjectRequest);
+    if (!listObjectResult.IsSuccess()) {
+      return ListObjectSizesResponse(
+          sizes, listObjectResult.GetError().GetMessage());
+    }
+
+    const auto& result = listObjectResult.GetResult();
+    for (const auto& object : result.GetContents()) {
+      sizes[object.GetKey()] = object.GetSize();
+    }
+
+    marker.clear();
+    if (result.GetIsTruncated()) {
+      if (result.GetNextMarker().empty()) {
+        // if the response is truncated but NextMarker is not set,
+        // last object of response can be used as marker.
+        if (!result.GetContents().empty()) {
+          marker = result.GetContents().back().GetKey();
+        }
+      } else {
+        marker = result.GetNextMarker();
+      }
+    }
+  } while (!marker.empty());
+
+  return ListObjectSizesResponse(sizes, "");
+}
+
 GetObjectsResponse S3Util::getObjects(
     const string& prefix, const string& local_directory,
     const string& delimiter, const bool direct_io) {
@@ -287,22 +939,51 @@ GetObjectsResponse S3Util::getObjects(
     if (local_directory.back() != '/') {
       formatted_dir_path += "/";
     }
-    for (string object_key : list_result.Body()) {
-      // sanitization check
-      vector<string> parts;
-      boost::split(parts, object_key, boost::is_any_of(delimiter));
-      string object_name = parts[parts.size() - 1];
-      if (object_name.empty()) {
-        continue;
+    // The downloads are indexed, so that the results are in the order of the
+    // listing as before
+    const auto& object_keys = list_result.Body();
+    results.resize(object_keys.size(), GetObjectResponse(false, ""));
+    std::atomic<size_t> next_object(0);
+    auto download_objects = [&] {
+      size_t i;
+      while ((i = next_object.fetch_add(1)) < object_keys.size()) {
+        const auto& object_key = object_keys[i];
+        // sanitization check
+        vector<string> parts;
+        boost::split(parts, object_key, boost::is_any_of(delimiter));
+        string object_name = parts[parts.size() - 1];
+        if (object_name.empty()) {
+          continue;
+        }
+        GetObjectResponse download_response =
+          getObject(object_key, formatted_dir_path + object_name, direct_io);
+        if (download_response.Body()) {
+          results[i] = GetObjectResponse(true, object_key);
+        } else {
+          results[i] = download_response;
+        }
       }
-      GetObjectResponse download_response =
-        getObject(object_key, formatted_dir_path + object_name, direct_io);
-      if (download_response.Body()) {
-        results.push_back(GetObjectResponse(true, object_key));
-      } else {
-        results.push_back(download_response);
+    };
+
+    vector<std::thread> workers;
+    const auto n_workers = std::min<size_t>(
+      std::max(FLAGS_s3_get_objects_concurrency, 1), object_keys.size());
+    for (size_t i = 1; i < n_workers; ++i) {
+      workers.emplace_back(download_objects);
+    }
+    download_objects();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    // Drop the entries of the skipped keys
+    vector<S3UtilResponse<bool>> downloaded;
+    for (size_t i = 0; i < object_keys.size(); ++i) {
+      if (results[i].Body() || !results[i].Error().empty()) {
+        downloaded.push_back(std::move(results[i]));
       }
     }
+    results = std::move(downloaded);
     return GetObjectsResponse(results, "");
   }
 }
@@ -352,6 +1033,30 @@ GetObjectSizeAndModTimeResponse S3Util::getObjectSizeAndModTime(const string& ke
 }
 
 PutObjectResponse S3Util::putObject(const string& key, const string& local_path, const string& tags) {
+  if (crt_client_) {
+    // The CRT client uploads large files in parts itself
+    auto result = crt_client_->putObject(bucket_, key, local_path, tags);
+    PayForCrtTransfer(write_rate_limiter_.get(), result);
+    if (result.error.empty()) {
+      return PutObjectResponse(true, "");
+    }
+    return PutObjectResponse(false, "Failed to upload file " + local_path +
+                             " to " + key + ", error: " + result.error);
+  }
+
+  if (FLAGS_s3_multipart_upload_threshold_mb > 0) {
+    boost::system::error_code ec;
+    const auto file_size = boost::filesystem::file_size(local_path, ec);
+    if (!ec && file_size >=
+        static_cast<uint64_t>(FLAGS_s3_multipart_upload_threshold_mb) << 20) {
+      return putObjectMultipart(
+        key, local_path,
+        static_cast<uint64_t>(FLAGS_s3_multipart_upload_part_size_mb) << 20,
+        FLAGS_s3_multipart_upload_concurrency,
+        FLAGS_s3_multipart_upload_part_retries, tags);
+    }
+  }
+
   PutObjectRequest object_request;
   object_request.WithBucket(bucket_).WithKey(key);
   if (!tags.empty()) {
@@ -361,7 +1066,10 @@ PutObjectResponse S3Util::putObject(const string& key, const string& local_path,
                                                   local_path.c_str(),
                                                   std::ios_base::in | std::ios_base::binary);
   object_request.SetBody(input_data);
+  RateLimitScope rate_limit_scope(read_rate_limiter_.get(),
+                                  write_rate_limiter_.get());
   auto put_result = s3Client->PutObject(object_request);
+  ReportOutcome(put_result);
 
   if (put_result.IsSuccess()) {
     return PutObjectResponse(true, "");
@@ -372,6 +1080,165 @@ PutObjectResponse S3Util::putObject(const string& key, const string& local_path,
   }
 }
 
+PutObjectResponse S3Util::putObjectMultipart(const string& key,
+                                             const string& local_path,
+                                             const uint64_t part_size,
+                                             const uint32_t concurrency,
+                                             const uint32_t retries,
+                                             const string& tags) {
+  const string err_msg_prefix =
+    "Failed to upload file " + local_path + " to " + key + ", error: ";
+  boost::system::error_code ec;
+  const uint64_t file_size = boost::filesystem::file_size(local_path, ec);
+  if (ec || part_size == 0) {
+    return PutObjectResponse(false, err_msg_prefix + "Invalid file or part size");
+  }
+
+  auto create_resp = createMultipartUpload(key, tags);
+  if (!create_resp.Error().empty()) {
+    return PutObjectResponse(false, err_msg_prefix + create_resp.Error());
+  }
+  const auto& upload_id = create_resp.Body();
+
+  // S3 requires at least one part, even for an empty file
+  const uint64_t n_parts =
+    std::max<uint64_t>((file_size + part_size - 1) / part_size, 1);
+  vector<string> etags(n_parts);
+  std::atomic<uint64_t> next_part(0);
+  std::atomic<bool> failed(false);
+  std::mutex err_mutex;
+  string err_msg;
+
+  // Each worker uploads the next part until all of them are done. The parts
+  // share the rate limiters of the client, so the bandwidth limit applies to
+  // the whole upload.
+  auto upload_parts = [&] {
+    std::ifstream file(local_path, std::ios::binary);
+    vector<char> buf(part_size);
+    uint64_t i;
+    while (!failed.load() && (i = next_part.fetch_add(1)) < n_parts) {
+      const uint64_t offset = i * part_size;
+      const uint64_t length = std::min(part_size, file_size - offset);
+      file.seekg(offset);
+      file.read(buf.data(), length);
+      if (static_cast<uint64_t>(file.gcount()) != length) {
+        std::lock_guard<std::mutex> guard(err_mutex);
+        err_msg = "Failed to read part " + std::to_string(i + 1);
+        failed.store(true);
+        return;
+      }
+
+      auto part_resp =
+        uploadPart(key, upload_id, i + 1, buf.data(), length, retries);
+      if (!part_resp.Error().empty()) {
+        std::lock_guard<std::mutex> guard(err_mutex);
+        err_msg = part_resp.Error();
+        failed.store(true);
+        return;
+      }
+      etags[i] = part_resp.Body();
+    }
+  };
+
+  vector<std::thread> workers;
+  const auto n_workers = std::min<uint64_t>(std::max(concurrency, 1u), n_parts);
+  for (uint64_t i = 0; i < n_workers; ++i) {
+    workers.emplace_back(upload_parts);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  if (!failed.load()) {
+    auto complete_resp = completeMultipartUpload(key, upload_id, etags);
+    if (complete_resp.Error().empty()) {
+      return PutObjectResponse(true, "");
+    }
+    err_msg = complete_resp.Error();
+  }
+
+  // Don't leave the uploaded parts, which are charged for, behind
+  abortMultipartUpload(key, upload_id);
+  return PutObjectResponse(false, err_msg_prefix + err_msg);
+}
+
+CreateMultipartUploadResponse S3Util::createMultipartUpload(
+    const string& key, const string& tags) {
+  CreateMultipartUploadRequest create_request;
+  create_request.WithBucket(bucket_).WithKey(key);
+  if (!tags.empty()) {
+    create_request.WithTagging(tags);
+  }
+  auto create_result = s3Client->CreateMultipartUpload(create_request);
+  if (!create_result.IsSuccess()) {
+    return CreateMultipartUploadResponse(
+      "", create_result.GetError().GetMessage());
+  }
+  return CreateMultipartUploadResponse(
+    create_result.GetResult().GetUploadId(), "");
+}
+
+UploadPartResponse S3Util::uploadPart(const string& key,
+                                      const string& upload_id,
+                                      const uint32_t part_number,
+                                      const char* data,
+                                      const uint64_t length,
+                                      const uint32_t retries) {
+  for (uint32_t attempt = 0; ; ++attempt) {
+    auto part_data = Aws::MakeShared<Aws::StringStream>("UploadPartStream");
+    part_data->write(data, length);
+    UploadPartRequest part_request;
+    part_request.WithBucket(bucket_).WithKey(key).WithUploadId(upload_id)
+      .WithPartNumber(part_number).WithContentLength(length);
+    part_request.SetBody(part_data);
+    RateLimitScope rate_limit_scope(read_rate_limiter_.get(),
+                                    write_rate_limiter_.get());
+    auto part_result = s3Client->UploadPart(part_request);
+    ReportOutcome(part_result);
+    if (part_result.IsSuccess()) {
+      return UploadPartResponse(part_result.GetResult().GetETag(), "");
+    }
+
+    LOG(ERROR) << "Failed to upload part " << part_number << " of " << key
+               << " attempt " << attempt + 1 << ": "
+               << part_result.GetError().GetMessage();
+    if (attempt >= retries) {
+      return UploadPartResponse("", part_result.GetError().GetMessage());
+    }
+  }
+}
+
+CompleteMultipartUploadResponse S3Util::completeMultipartUpload(
+    const string& key,
+    const string& upload_id,
+    const vector<string>& etags) {
+  Aws::Vector<CompletedPart> completed_parts(etags.size());
+  for (size_t i = 0; i < etags.size(); ++i) {
+    completed_parts[i].WithPartNumber(i + 1).WithETag(etags[i]);
+  }
+  CompletedMultipartUpload completed_upload;
+  completed_upload.SetParts(std::move(completed_parts));
+  CompleteMultipartUploadRequest complete_request;
+  complete_request.WithBucket(bucket_).WithKey(key).WithUploadId(upload_id)
+    .WithMultipartUpload(std::move(completed_upload));
+  auto complete_result = s3Client->CompleteMultipartUpload(complete_request);
+  if (!complete_result.IsSuccess()) {
+    return CompleteMultipartUploadResponse(
+      false, complete_result.GetError().GetMessage());
+  }
+  return CompleteMultipartUploadResponse(true, "");
+}
+
+void S3Util::abortMultipartUpload(const string& key, const string& upload_id) {
+  AbortMultipartUploadRequest abort_request;
+  abort_request.WithBucket(bucket_).WithKey(key).WithUploadId(upload_id);
+  auto abort_result = s3Client->AbortMultipartUpload(abort_request);
+  if (!abort_result.IsSuccess()) {
+    LOG(ERROR) << "Failed to abort the multipart upload " << upload_id
+               << " of " << key << ": " << abort_result.GetError().GetMessage();
+  }
+}
+
 Aws::S3::Model::PutObjectOutcomeCallable
 S3Util::putObjectCallable(const string& key, const string& local_path) {
   PutObjectRequest object_request;
@@ -432,6 +1299,64 @@ tuple<string, string> S3Util::parseFullS3Path(const string& s3_path) {
   return std::make_tuple(std::move(bucket), std::move(object_path));
 }
 
+shared_ptr<S3Util::CutomizedS3Client> S3Util::GetPooledClient(
+    const ClientConfiguration& client_config) {
+  const auto key = folly::to<string>(
+    client_config.connectTimeoutMs, "/", client_config.requestTimeoutMs, "/",
+    client_config.maxConnections, "/", client_config.region, "/",
+    client_config.endpointOverride);
+  std::lock_guard<std::mutex> guard(client_pool_mutex_);
+  auto client = client_pool_[key].lock();
+  if (client == nullptr) {
+    client = std::make_shared<CutomizedS3Client>(client_config);
+    client_pool_[key] = client;
+  }
+
+  return client;
+}
+
+S3Util::RateLimiterPtr S3Util::GetSharedRateLimiter(
+    const uint32_t ratelimit_mb,
+    const bool read) {
+  if (ratelimit_mb == 0) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> guard(rate_limiter_pool_mutex_);
+  auto& pooled = rate_limiter_pool_[std::make_pair(read, ratelimit_mb)];
+  auto rate_limiter = pooled.lock();
+  if (rate_limiter == nullptr) {
+    rate_limiter = std::make_shared<AwsS3RateLimiter>(
+      static_cast<int64_t>(ratelimit_mb) * 1024 * 1024);
+    pooled = rate_limiter;
+  }
+
+  return rate_limiter;
+}
+
+shared_ptr<S3CrtClient> S3Util::GetCrtClient(
+    const ClientConfiguration& client_config) {
+  if (FLAGS_s3_client_backend != "crt") {
+    if (FLAGS_s3_client_backend != "classic") {
+      LOG(ERROR) << "Unknown --s3_client_backend " << FLAGS_s3_client_backend
+                 << ", using the classic client";
+    }
+    return nullptr;
+  }
+
+  auto client = S3CrtClient::Get(
+    client_config.endpointOverride,
+    client_config.scheme == Aws::Http::Scheme::HTTP ? "http" : "https");
+  if (client == nullptr) {
+    static std::once_flag warned;
+    std::call_once(warned, [] {
+      LOG(ERROR) << "Not built with the CRT S3 client, using the classic one";
+    });
+  }
+
+  return client;
+}
+
 shared_ptr<S3Util> S3Util::BuildS3Util(
     const uint32_t read_ratelimit_mb,
     const string& bucket,
@@ -439,23 +1364,34 @@ shared_ptr<S3Util> S3Util::BuildS3Util(
     const uint32_t request_timeout_ms,
     const uint32_t max_connections,
     const uint32_t write_ratelimit_mb) {
+  static const auto read_dispatcher =
+    std::make_shared<ThreadLocalRateLimiter>(&tl_read_rate_limiter);
+  static const auto write_dispatcher =
+    std::make_shared<ThreadLocalRateLimiter>(&tl_write_rate_limiter);
+
   Aws::Client::ClientConfiguration aws_config;
   aws_config.connectTimeoutMs = connect_timeout_ms;
   aws_config.requestTimeoutMs = request_timeout_ms;
   aws_config.maxConnections = max_connections;
-  if (read_ratelimit_mb > 0) {
-    aws_config.readRateLimiter =
-        std::make_shared<AwsS3RateLimiter>(
-            read_ratelimit_mb * 1024 * 1024);
-  }
-  if (write_ratelimit_mb > 0) {
-    aws_config.writeRateLimiter =
-        std::make_shared<AwsS3RateLimiter>(
-            write_ratelimit_mb * 1024 * 1024);
+  aws_config.readRateLimiter = read_dispatcher;
+  aws_config.writeRateLimiter = write_dispatcher;
+  if (!FLAGS_s3_endpoint_override.empty()) {
+    static const string kHttpPrefix = "http://";
+    if (FLAGS_s3_endpoint_override.compare(0, kHttpPrefix.size(),
+                                           kHttpPrefix) == 0) {
+      aws_config.scheme = Aws::Http::Scheme::HTTP;
+      aws_config.endpointOverride =
+        FLAGS_s3_endpoint_override.substr(kHttpPrefix.size());
+    } else {
+      aws_config.endpointOverride = FLAGS_s3_endpoint_override;
+    }
   }
   SDKOptions options;
   return std::shared_ptr<S3Util>(
-      new S3Util(bucket, aws_config, options, read_ratelimit_mb, write_ratelimit_mb));
+      new S3Util(bucket, aws_config, options, read_ratelimit_mb,
+                 write_ratelimit_mb,
+                 GetSharedRateLimiter(read_ratelimit_mb, true /* read */),
+                 GetSharedRateLimiter(write_ratelimit_mb, false /* read */)));
 }
 
 }  // namespace common
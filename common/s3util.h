@@ -25,17 +25,25 @@
 #include <aws/core/http/HttpClient.h>
 #include <aws/core/http/HttpResponse.h>
 #include <aws/core/utils/memory/stl/AWSStringStream.h>
+#include <aws/core/utils/ratelimiter/RateLimiterInterface.h>
 #include <aws/core/utils/Outcome.h>
 #include <boost/iostreams/categories.hpp>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iosfwd>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <utility>
 #include <vector>
 
+#include "common/s3_crt_client.h"
 #include "gflags/gflags.h"
 
 using std::iostream;
@@ -76,6 +84,9 @@ class S3UtilResponse {
 
 /**
  * A writable file which uses direct I/O under the hood.
+ * With --direct_io_writer_n_buffers > 1, the full buffers are written by a
+ * background thread, while write() keeps filling the free ones, so that
+ * filling the buffers (e.g. from the network) and the disk writes overlap.
  */
 class DirectIOWritableFile {
  public:
@@ -89,15 +100,34 @@ class DirectIOWritableFile {
   std::streamsize write(const char* s, std::streamsize n);
 
  private:
+  // Write the current buffer at write_offset_ and switch to a free one
+  bool flushBuffer();
+  // Run by writer_ to write the full buffers
+  void writeLoop();
+
   // file descriptor
   int fd_;
-  uint32_t file_size_;
-  // page size aligned buffer
+  uint64_t file_size_;
+  // page size aligned buffer being filled
   void* buffer_;
   // buffer offset
   uint32_t offset_;
   // buffer size
   uint32_t buffer_size_;
+  // the file offset of the next full buffer
+  uint64_t write_offset_;
+  // all the page size aligned buffers
+  vector<void*> buffers_;
+
+  // The state shared with writer_
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  vector<void*> free_buffers_;
+  // (buffer, file offset) to be written
+  std::deque<std::pair<void*, uint64_t>> full_buffers_;
+  bool stop_;
+  bool failed_;
+  std::unique_ptr<std::thread> writer_;
 };
 
 /**
@@ -146,6 +176,7 @@ class ListObjectsResponseV2Body {
 };
 
 using GetObjectResponse = S3UtilResponse<bool>;
+using GetObjectRangeResponse = S3UtilResponse<string>;
 using PutObjectResponse = S3UtilResponse<bool>;
 using SdkGetObjectResponse = Aws::S3::Model::GetObjectOutcome;
 using ListObjectsResponse = S3UtilResponse<vector<string>>;
@@ -153,7 +184,13 @@ using ListObjectsResponseV2 = S3UtilResponse<ListObjectsResponseV2Body>;
 using GetObjectsResponse = S3UtilResponse<vector<GetObjectResponse>>;
 using GetObjectMetadataResponse = S3UtilResponse<map<string, string>>;
 using GetObjectSizeAndModTimeResponse = S3UtilResponse<map<string, uint64_t>>;
+using ListObjectSizesResponse = S3UtilResponse<map<string, uint64_t>>;
 using CopyObjectResponse = S3UtilResponse<bool>;
+// The upload id
+using CreateMultipartUploadResponse = S3UtilResponse<string>;
+// The ETag of the part
+using UploadPartResponse = S3UtilResponse<string>;
+using CompleteMultipartUploadResponse = S3UtilResponse<bool>;
 using DeleteObjectResponse = S3UtilResponse<bool>;
 
 class S3Util {
@@ -173,14 +210,34 @@ class S3Util {
     }
   };
 
-  ~S3Util() {
+  virtual ~S3Util() {
+    // The clients have to go before Aws::ShutdownAPI()
+    s3Client = nullptr;
+    crt_client_ = nullptr;
     TryAwsShutdownAPI(options_);
   }
-  // Download an S3 Object to a local file
+  // Download an S3 Object to a local file. With --s3_client_backend=crt, the
+  // CRT client downloads it.
   GetObjectResponse getObject(const string& key, const string& local_path,
                               const bool direct_io = false);
+  // Download an S3 Object to a local file with "concurrency" ranged GETs of
+  // part_size bytes at a time, each of which is retried for at most "retries"
+  // times. The parts are written to the preallocated file with pwrite().
+  // getObject() calls it for the objects of at least
+  // --s3_ranged_get_threshold_mb.
+  GetObjectResponse getObjectRanged(const string& key,
+                                    const string& local_path,
+                                    const uint64_t part_size,
+                                    const uint32_t concurrency,
+                                    const uint32_t retries,
+                                    const bool direct_io = false);
   // Get S3 object to given iostream
-  GetObjectResponse getObject(const string& key, iostream* out);
+  virtual GetObjectResponse getObject(const string& key, iostream* out);
+  // Get length bytes of an S3 object from offset. The body is shorter if the
+  // object ends before offset + length.
+  GetObjectRangeResponse getObjectRange(const string& key,
+                                        const uint64_t offset,
+                                        const uint64_t length);
   // Get object using s3client
   SdkGetObjectResponse sdkGetObject(const string& key,
                                     const string& local_path = "",
@@ -197,14 +254,33 @@ class S3Util {
   // and the next occurrence of the string specified by delimiter.
   // next_marker can be used for continuation (if the objects are more than
   // s3 default max 1000). If set to empty, we will not use continuation.
-  ListObjectsResponseV2 listObjectsV2(const string& prefix,
-                                      const string& delimiter = "",
-                                      const string& marker = "");
+  virtual ListObjectsResponseV2 listObjectsV2(const string& prefix,
+                                              const string& delimiter = "",
+                                              const string& marker = "");
 
   // Return a list of all objects under the prefix. It will have no up-limit for objects count
-  ListObjectsResponseV2 listAllObjects(const string& prefix, const string& delimiter = "");
-
-  // Download all objects under a prefix. We only assume
+  // With --s3_list_concurrency > 1 and an empty delimiter, the objects are
+  // listed by listAllObjectsParallel().
+  virtual ListObjectsResponseV2 listAllObjects(const string& prefix,
+                                               const string& delimiter = "");
+
+  // Return the sizes in bytes of all objects under the prefix, keyed by the
+  // object keys. The sizes come with the listing, no HEAD request is sent.
+  ListObjectSizesResponse listAllObjectSizes(const string& prefix);
+
+  // List all objects under the prefix with "concurrency" threads, which list
+  // the sub-dirs (the common prefixes up to the next delimiter) found along
+  // the way in parallel. on_objects is called with each page of objects as
+  // soon as it arrives, one call at a time, and in no particular order.
+  // @return the error message, empty if all objects were listed.
+  string listAllObjectsParallel(
+      const string& prefix,
+      const uint32_t concurrency,
+      const std::function<void(const vector<string>&)>& on_objects,
+      const string& delimiter = "/");
+
+  // Download all objects under a prefix, --s3_get_objects_concurrency of them
+  // at a time. We only assume
   // For each object downloading,
   // if the download is successful, the error message will be
   // the object key.
@@ -220,12 +296,49 @@ class S3Util {
   // Get the size and last modified time(ms) of an object.
   GetObjectSizeAndModTimeResponse getObjectSizeAndModTime(const string& key);
 
-  // Upload a local file to S3.
+  // Upload a local file to S3. With --s3_client_backend=crt, the CRT client
+  // uploads it.
   // Tags: The tag-set for the object. The tag-set must be encoded as URL Query
   // parameters. (For example, "Key1=Value1")
-  PutObjectResponse putObject(const string& key, const string& local_path, const string& tags="");
+  virtual PutObjectResponse putObject(const string& key,
+                                      const string& local_path,
+                                      const string& tags = "");
+
+  // Upload a local file to S3 with a multipart upload, which uploads
+  // "concurrency" parts of part_size bytes at a time and retries each of them
+  // for at most "retries" times. putObject() calls it for the files of at
+  // least --s3_multipart_upload_threshold_mb.
+  PutObjectResponse putObjectMultipart(const string& key,
+                                       const string& local_path,
+                                       const uint64_t part_size,
+                                       const uint32_t concurrency,
+                                       const uint32_t retries,
+                                       const string& tags = "");
+
+  // The steps of a multipart upload, for the callers producing the parts as
+  // they go, e.g. S3Env. The parts are numbered from 1, and all but the last
+  // one must be at least 5MB.
+  CreateMultipartUploadResponse createMultipartUpload(const string& key,
+                                                      const string& tags = "");
+  // Upload length bytes from data as part part_number of the upload, retrying
+  // it for at most "retries" times
+  UploadPartResponse uploadPart(const string& key,
+                                const string& upload_id,
+                                const uint32_t part_number,
+                                const char* data,
+                                const uint64_t length,
+                                const uint32_t retries);
+  // etags: (IN) The ETag of part i + 1 at i
+  CompleteMultipartUploadResponse completeMultipartUpload(
+      const string& key,
+      const string& upload_id,
+      const vector<string>& etags);
+  // Drop the parts uploaded so far, which are charged for until then
+  void abortMultipartUpload(const string& key, const string& upload_id);
 
   // Upload a local file to S3 in async mode and return a future to the operation.
+  // The rate limit of this S3Util doesn't apply to it, as the request is sent
+  // by a thread of the sdk.
   Aws::S3::Model::PutObjectOutcomeCallable
   putObjectCallable(const string& key, const string& local_path);
 
@@ -241,6 +354,11 @@ class S3Util {
   // return a tuple of bucketname and file path.
   static tuple<string, string> parseFullS3Path(const string& s3_path);
 
+  // The S3Utils built with the same client configuration (timeouts, max
+  // connections, and the region and endpoint of the process) share one client
+  // and its connection pool. The S3Utils with the same read, or write, rate
+  // limit share one rate limiter, so that the limit holds for all of them
+  // together, e.g. for concurrent requests with the same limit.
   static shared_ptr<S3Util> BuildS3Util(
       const uint32_t read_ratelimit_mb = 50,
       const string& bucket = "",
@@ -257,19 +375,46 @@ class S3Util {
     return read_ratelimit_mb_;
   }
 
+ protected:
+  using RateLimiterPtr =
+    std::shared_ptr<Aws::Utils::RateLimits::RateLimiterInterface>;
+
+  // For the fakes of tests, which override the calls they need. It has no
+  // classic client, so only these calls may be used, and getObject() to a
+  // local file and putObject() if crt_client is given.
+  explicit S3Util(const string& bucket,
+                  shared_ptr<S3CrtClient> crt_client = nullptr,
+                  RateLimiterPtr read_rate_limiter = nullptr,
+                  RateLimiterPtr write_rate_limiter = nullptr) :
+      bucket_(bucket), crt_client_(std::move(crt_client)), options_(),
+      read_ratelimit_mb_(0), write_ratelimit_mb_(0),
+      read_rate_limiter_(std::move(read_rate_limiter)),
+      write_rate_limiter_(std::move(write_rate_limiter)) {
+    TryAwsInitAPI(options_);
+  }
+
+  // The CRT client for client_config, if --s3_client_backend=crt and we are
+  // built with it
+  static shared_ptr<S3CrtClient> GetCrtClient(
+      const ClientConfiguration& client_config);
+
  private:
   explicit S3Util(const string& bucket,
                   const ClientConfiguration& client_config,
                   const SDKOptions& options,
                   const uint32_t read_ratelimit_mb,
-                  const uint32_t write_ratelimit_mb) :
+                  const uint32_t write_ratelimit_mb,
+                  RateLimiterPtr read_rate_limiter,
+                  RateLimiterPtr write_rate_limiter) :
       bucket_(std::move(bucket)), options_(options),
       read_ratelimit_mb_(read_ratelimit_mb),
-      write_ratelimit_mb_(write_ratelimit_mb) {
+      write_ratelimit_mb_(write_ratelimit_mb),
+      read_rate_limiter_(std::move(read_rate_limiter)),
+      write_rate_limiter_(std::move(write_rate_limiter)) {
     TryAwsInitAPI(options);
     // s3Client initialization must happen AFTER TryAwsInitAPI(), otherwise
     // core dump may happen. 
-    s3Client = std::make_unique<CutomizedS3Client>(client_config);
+    s3Client = GetPooledClient(client_config);
     Aws::StringStream ss;
     ss << Aws::Http::SchemeMapper::ToString(client_config.scheme) << "://";
 
@@ -279,8 +424,25 @@ class S3Util {
       ss << client_config.endpointOverride;
     }
     uri_ = ss.str();
+    crt_client_ = GetCrtClient(client_config);
   }
 
+  // Return the rate limiter of the process for ratelimit_mb MB/s of reads,
+  // or of writes, creating it if there is none. Null for no limit.
+  static RateLimiterPtr GetSharedRateLimiter(const uint32_t ratelimit_mb,
+                                             const bool read);
+
+  // Return the client of the process for client_config, creating it if there
+  // is none
+  static shared_ptr<CutomizedS3Client> GetPooledClient(
+      const ClientConfiguration& client_config);
+
+  // List a page of the objects and the common prefixes directly under prefix
+  void listPageHelper(const string& prefix, const string& delimiter,
+                      const string& marker, vector<string>* objects,
+                      vector<string>* common_prefixes, string* next_marker,
+                      string* error_message);
+
   void listObjectsHelper(const string& prefix, const string& delimiter,
                          const string& marker, vector<string>* objects,
                          string* next_marker, string* error_message);
@@ -307,15 +469,29 @@ class S3Util {
   const string bucket_;
   // S3Client is thread safe:
   // https://github.com/aws/aws-sdk-cpp/issues/166
-  std::unique_ptr<CutomizedS3Client> s3Client;
+  shared_ptr<CutomizedS3Client> s3Client;
+  // null unless --s3_client_backend=crt
+  shared_ptr<S3CrtClient> crt_client_;
   SDKOptions options_;
   std::string uri_;
   const uint32_t read_ratelimit_mb_;
   const uint32_t write_ratelimit_mb_;
+  // Applied to the requests of this S3Util on the shared client, null for no
+  // limit
+  RateLimiterPtr read_rate_limiter_;
+  RateLimiterPtr write_rate_limiter_;
   // To track the number of S3Util instances. Only call Aws::ShutdownAPI() when
   // there is no other instance exists.
   static std::mutex counter_mutex_;
   static uint32_t instance_counter_;
+  // The clients in use, keyed by their configurations
+  static std::mutex client_pool_mutex_;
+  static map<string, std::weak_ptr<CutomizedS3Client>> client_pool_;
+  // The rate limiters in use, keyed by (read, MB/s)
+  static std::mutex rate_limiter_pool_mutex_;
+  static map<std::pair<bool, uint32_t>,
+             std::weak_ptr<Aws::Utils::RateLimits::RateLimiterInterface>>
+    rate_limiter_pool_;
 };
 
 }  // namespace common
@@ -23,6 +23,7 @@
 
 #include <string>
 
+#include "common/deadline.h"
 #include "common/global_cpu_executor.h"
 #include "common/timer.h"
 #include "folly/futures/Future.h"
@@ -116,7 +117,7 @@ class SafeFutureClient {
           };
 
           try {
-            common::getGlobalCPUExecutor()->add(std::move(process_response_op));
+            common::getGlobalExecutor()->add(std::move(process_response_op));
 #if __GNUC__ >= 8
           } catch (const folly::QueueFullException& e) {
 #else
@@ -132,9 +133,9 @@ class SafeFutureClient {
             common::Stats::get()->Incr(executor_enqueue_fail_times);
           }
 
-          auto stats = common::getGlobalCPUExecutor()->getPoolStats();
           common::Stats::get()->AddMetric(
-            executor_pending_task_count_metrics_name, stats.pendingTaskCount);
+            executor_pending_task_count_metrics_name,
+            common::getGlobalExecutorPendingTaskCount());
         }
       };
 
@@ -145,6 +146,25 @@ class SafeFutureClient {
     return f;
   }
 
+  /*
+   * Same as above, but forward deadline to the server, or fail with
+   * DeadlineExceededException without sending the request if it expired.
+   */
+  template <typename T>
+  folly::Future<typename RequestTraits<T>::response_type> future_call(
+      const apache::thrift::RpcOptions& rpc_options,
+      std::shared_ptr<T> request,
+      const Deadline& deadline) {
+    if (deadline.expired()) {
+      return folly::makeFuture<typename RequestTraits<T>::response_type>(
+        DeadlineExceededException("Deadline expired before sending"));
+    }
+
+    auto options = rpc_options;
+    deadline.applyTo(&options);
+    return future_call(options, std::move(request));
+  }
+
  private:
   template <typename F>
   struct Callback : public apache::thrift::RequestCallback {
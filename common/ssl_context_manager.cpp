@@ -19,11 +19,21 @@
 #include "common/ssl_context_manager.h"
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "common/future_util.h"
 #include "common/stats/stats.h"
+#include "folly/Random.h"
+#include "folly/SocketAddress.h"
+#include "folly/String.h"
+#include "folly/io/async/AsyncSSLSocket.h"
 #include "folly/io/async/SSLContext.h"
+#include "thrift/lib/cpp2/server/ThriftServer.h"
+#include "wangle/ssl/SSLContextConfig.h"
+#include "wangle/ssl/TLSTicketKeySeeds.h"
 
 DEFINE_string(tls_certfile, "", "Certificate file path location for TLS");
 
@@ -32,8 +42,78 @@ DEFINE_string(tls_trusted_certfile, "",
 
 DEFINE_string(tls_keyfile, "", "Key file path location for TLS");
 
+DEFINE_bool(tls_session_resumption, true,
+            "Resume the TLS session of the last connection to a peer when "
+            "connecting to it again");
+
+DEFINE_int32(tls_session_cache_size, 10000,
+             "The max number of peers to remember a TLS session for");
+
+DEFINE_int32(tls_ticket_key_rotation_seconds, 60 * 60,
+             "How often the servers rotate their TLS session ticket key");
+
 namespace {
 
+const std::string kTLSFullHandshakes = "tls_full_handshakes";
+const std::string kTLSResumedHandshakes = "tls_resumed_handshakes";
+
+struct SSLSessionDeleter {
+  void operator()(SSL_SESSION* session) const {
+    SSL_SESSION_free(session);
+  }
+};
+
+// The session of the last connection to each peer
+class SSLSessionCache {
+ public:
+  static SSLSessionCache* get() {
+    static SSLSessionCache cache;
+    return &cache;
+  }
+
+  // @return the session for peer with a reference taken for the caller, or
+  // nullptr if there is none.
+  SSL_SESSION* find(const folly::SocketAddress& peer) {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto itor = sessions_.find(peer);
+    if (itor == sessions_.end()) {
+      return nullptr;
+    }
+
+    SSL_SESSION_up_ref(itor->second.get());
+    return itor->second.get();
+  }
+
+  // Take over session, the reference of which is owned by the caller
+  void insert(const folly::SocketAddress& peer, SSL_SESSION* session) {
+    std::unique_ptr<SSL_SESSION, SSLSessionDeleter> holder(session);
+    std::lock_guard<std::mutex> g(mutex_);
+    auto itor = sessions_.find(peer);
+    if (itor != sessions_.end()) {
+      itor->second = std::move(holder);
+      return;
+    }
+
+    if (sessions_.size() >=
+        static_cast<size_t>(std::max(FLAGS_tls_session_cache_size, 1))) {
+      // the peers we talk to are mostly stable, so evicting any one is fine
+      sessions_.erase(sessions_.begin());
+    }
+    sessions_.emplace(peer, std::move(holder));
+  }
+
+  // The sessions of an old SSLContext may not be for our current certificate
+  void clear() {
+    std::lock_guard<std::mutex> g(mutex_);
+    sessions_.clear();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<folly::SocketAddress,
+                     std::unique_ptr<SSL_SESSION, SSLSessionDeleter>> sessions_;
+};
+
 // create a new SSLContext from files, return nullptr on error
 std::shared_ptr<folly::SSLContext> loadSSLContext() {
   auto ctx = std::make_shared<folly::SSLContext>();
@@ -71,6 +151,7 @@ void scheduleRefresh(std::shared_ptr<folly::SSLContext>* cur_ctx) {
         common::Stats::get()->Incr(kSSLContextRefreshTimes);
         std::atomic_exchange_explicit(cur_ctx, new_ctx,
                                       std::memory_order_release);
+        SSLSessionCache::get()->clear();
       }
 
       scheduleRefresh(cur_ctx);
@@ -79,6 +160,38 @@ void scheduleRefresh(std::shared_ptr<folly::SSLContext>* cur_ctx) {
 
 std::once_flag schedule_flag;
 
+std::string newTicketSeed() {
+  std::string seed(32, '\0');
+  folly::Random::secureRandom(&seed[0], seed.size());
+  return folly::hexlify(seed);
+}
+
+// Move the ticket keys of server down by one every
+// --tls_ticket_key_rotation_seconds: the new key becomes the current one,
+// which the server issues the tickets with, and the current one becomes the
+// old one, which it still accepts.
+void scheduleTicketSeedRotation(apache::thrift::ThriftServer* server,
+                                wangle::TLSTicketKeySeeds seeds) {
+  auto delayed_future = common::GenerateDelayedFuture(
+    std::chrono::seconds(FLAGS_tls_ticket_key_rotation_seconds));
+#if __GNUC__ >= 8
+  std::move(delayed_future).then(
+    [server, seeds = std::move(seeds)] (auto&&) mutable {
+#else
+  delayed_future.then([server, seeds = std::move(seeds)] () mutable {
+#endif
+      seeds.oldSeeds = std::move(seeds.currentSeeds);
+      seeds.currentSeeds = std::move(seeds.newSeeds);
+      seeds.newSeeds = { newTicketSeed() };
+      server->updateTicketSeeds(seeds);
+      static const std::string kTLSTicketKeyRotations =
+        "tls_ticket_key_rotations";
+      common::Stats::get()->Incr(kTLSTicketKeyRotations);
+
+      scheduleTicketSeedRotation(server, std::move(seeds));
+    });
+}
+
 }  // namespace
 
 
@@ -110,4 +223,56 @@ const std::shared_ptr<folly::SSLContext>* getSSLContext() {
   return &ctx;
 }
 
+void resumeSSLSession(folly::AsyncSSLSocket* socket,
+                      const folly::SocketAddress& peer) {
+  if (!FLAGS_tls_session_resumption) {
+    return;
+  }
+
+  auto session = SSLSessionCache::get()->find(peer);
+  if (session) {
+    socket->setSSLSession(session, true /* takeOwnership */);
+  }
+}
+
+void onSSLConnected(folly::AsyncSSLSocket* socket,
+                    const folly::SocketAddress& peer) {
+  if (socket->getSSLSessionReused()) {
+    common::Stats::get()->Incr(kTLSResumedHandshakes);
+  } else {
+    common::Stats::get()->Incr(kTLSFullHandshakes);
+  }
+
+  if (!FLAGS_tls_session_resumption) {
+    return;
+  }
+
+  // a resumed session may come with a new ticket, so always take the latest
+  auto session = socket->getSSLSession();
+  if (session) {
+    SSLSessionCache::get()->insert(peer, session);
+  }
+}
+
+void configureServerTLS(apache::thrift::ThriftServer* server) {
+  if (FLAGS_tls_certfile.empty() || FLAGS_tls_trusted_certfile.empty() ||
+      FLAGS_tls_keyfile.empty()) {
+    return;
+  }
+
+  auto ssl_config = std::make_shared<wangle::SSLContextConfig>();
+  ssl_config->setCertificate(FLAGS_tls_certfile, FLAGS_tls_keyfile, "");
+  ssl_config->clientCAFile = FLAGS_tls_trusted_certfile;
+  ssl_config->isDefault = true;
+  ssl_config->sessionCacheEnabled = true;
+  server->setSSLConfig(std::move(ssl_config));
+
+  wangle::TLSTicketKeySeeds seeds;
+  seeds.oldSeeds = { newTicketSeed() };
+  seeds.currentSeeds = { newTicketSeed() };
+  seeds.newSeeds = { newTicketSeed() };
+  server->setTicketSeeds(seeds);
+  scheduleTicketSeedRotation(server, std::move(seeds));
+}
+
 }  // namespace common
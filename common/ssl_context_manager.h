@@ -20,8 +20,16 @@
 
 #include <memory>
 
+namespace apache { namespace thrift {
+
+class ThriftServer;
+
+}}
+
 namespace folly {
 
+class AsyncSSLSocket;
+class SocketAddress;
 class SSLContext;
 
 }
@@ -35,4 +43,22 @@ namespace common {
 // be returned.
 const std::shared_ptr<folly::SSLContext>* getSSLContext();
 
+// Client side TLS session resumption. Hand socket the session of the last
+// connection to peer before connecting it, so that the server can take the
+// abbreviated handshake. A no-op with --tls_session_resumption off.
+void resumeSSLSession(folly::AsyncSSLSocket* socket,
+                      const folly::SocketAddress& peer);
+
+// Count the handshake of socket, which has just connected to peer, as full or
+// resumed, and remember its session for the next connection to peer.
+void onSSLConnected(folly::AsyncSSLSocket* socket,
+                    const folly::SocketAddress& peer);
+
+// Serve TLS with the certificates from the tls gflags, with session tickets
+// whose keys are rotated every --tls_ticket_key_rotation_seconds. The tickets
+// of the last two keys are still accepted, so a ticket is good for up to
+// twice that long. It does nothing if any of the tls gflags is not set.
+// server must stay alive as long as the process does.
+void configureServerTLS(apache::thrift::ThriftServer* server);
+
 }  // namespace common
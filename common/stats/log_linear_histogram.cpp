@@ -0,0 +1,177 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/stats/log_linear_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace common {
+
+const uint32_t LogLinearHistogram::kSubBucketBits;
+const uint32_t LogLinearHistogram::kSubBuckets;
+const uint32_t LogLinearHistogram::kMaxBits;
+const uint32_t LogLinearHistogram::kNumBuckets;
+
+void LogLinearHistogram::merge(const LogLinearHistogram& other) {
+  for (uint32_t i = 0; i < kNumBuckets; ++i) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+}
+
+void LogLinearHistogram::clear() {
+  std::fill(buckets_.begin(), buckets_.end(), 0);
+  count_ = 0;
+  sum_ = 0;
+}
+
+int64_t LogLinearHistogram::getPercentileEstimate(double pct) const {
+  if (count_ == 0) {
+    return 0;
+  }
+
+  pct = std::max(0.0, std::min(100.0, pct));
+  // the rank of the value of the percentile, starting from 1
+  const auto rank = std::max<uint64_t>(
+    1, static_cast<uint64_t>(std::ceil(pct / 100 * count_)));
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return BucketMin(i) + BucketWidth(i) / 2;
+    }
+  }
+
+  return BucketMin(kNumBuckets - 1);
+}
+
+uint64_t LogLinearHistogram::countUpTo(int64_t value) const {
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < kNumBuckets - 1; ++i) {
+    if (BucketMin(i) + BucketWidth(i) - 1 > value) {
+      return count;
+    }
+    count += buckets_[i];
+  }
+
+  // the last bucket has no upper bound
+  return count;
+}
+
+AtomicLogLinearHistogram::AtomicLogLinearHistogram()
+    : buckets_(new std::atomic<uint64_t>[LogLinearHistogram::kNumBuckets])
+    , sum_(0) {
+  for (uint32_t i = 0; i < LogLinearHistogram::kNumBuckets; ++i) {
+    buckets_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void AtomicLogLinearHistogram::drainTo(LogLinearHistogram* histogram) {
+  for (uint32_t i = 0; i < LogLinearHistogram::kNumBuckets; ++i) {
+    // one relaxed load first, most buckets are empty
+    if (buckets_[i].load(std::memory_order_relaxed) != 0) {
+      histogram->addBucket(
+        i, buckets_[i].exchange(0, std::memory_order_relaxed));
+    }
+  }
+  histogram->addSum(sum_.exchange(0, std::memory_order_relaxed));
+}
+
+bool AtomicLogLinearHistogram::empty() const {
+  for (uint32_t i = 0; i < LogLinearHistogram::kNumBuckets; ++i) {
+    if (buckets_[i].load(std::memory_order_relaxed) != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+size_t AtomicLogLinearHistogram::memoryUsage() const {
+  return sizeof(*this) +
+    LogLinearHistogram::kNumBuckets * sizeof(std::atomic<uint64_t>);
+}
+
+LogLinearTimeseries::LogLinearTimeseries(uint32_t seconds_per_min)
+    : slots_(std::max<uint32_t>(seconds_per_min, 1))
+    , total_() {
+  for (auto& slot : slots_) {
+    slot.second = -1;
+  }
+}
+
+void LogLinearTimeseries::addValues(std::chrono::seconds now,
+                                    const LogLinearHistogram& histogram) {
+  auto& slot = slots_[now.count() % slots_.size()];
+  if (slot.second != now.count()) {
+    slot.second = now.count();
+    slot.histogram.clear();
+  }
+  slot.histogram.merge(histogram);
+  total_.merge(histogram);
+}
+
+void LogLinearTimeseries::update(std::chrono::seconds now) {
+  for (auto& slot : slots_) {
+    if (slot.second >= 0 &&
+        slot.second + static_cast<int64_t>(slots_.size()) <= now.count()) {
+      slot.second = -1;
+      slot.histogram.clear();
+    }
+  }
+}
+
+LogLinearHistogram LogLinearTimeseries::lastMinute() const {
+  LogLinearHistogram histogram;
+  for (const auto& slot : slots_) {
+    if (slot.second >= 0) {
+      histogram.merge(slot.histogram);
+    }
+  }
+
+  return histogram;
+}
+
+int64_t LogLinearTimeseries::getPercentileEstimate(double pct,
+                                                   int level) const {
+  return level == 0 ? lastMinute().getPercentileEstimate(pct)
+                    : total_.getPercentileEstimate(pct);
+}
+
+int64_t LogLinearTimeseries::sum(int level) const {
+  return level == 0 ? lastMinute().sum() : total_.sum();
+}
+
+int64_t LogLinearTimeseries::avg(int level) const {
+  return level == 0 ? lastMinute().avg() : total_.avg();
+}
+
+int64_t LogLinearTimeseries::count(int level) const {
+  return level == 0 ? lastMinute().count() : total_.count();
+}
+
+uint64_t LogLinearTimeseries::countUpTo(int64_t value, int level) const {
+  return level == 0 ? lastMinute().countUpTo(value) : total_.countUpTo(value);
+}
+
+size_t LogLinearTimeseries::memoryUsage() const {
+  // the total and one histogram per slot
+  return sizeof(*this) + slots_.size() * sizeof(Slot) +
+    (slots_.size() + 1) * LogLinearHistogram::kNumBuckets * sizeof(uint64_t);
+}
+
+}  // namespace common
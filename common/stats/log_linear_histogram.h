@@ -0,0 +1,192 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+/**
+ * Log linear histograms for the metrics whose values span several orders of
+ * magnitude, e.g. latencies from us to seconds.
+ *
+ * Each power of 2 range of values is split into kSubBuckets linear buckets,
+ * so a percentile is estimated within 1/kSubBuckets of the true value over
+ * the whole range, with no bucket configuration. Values below kSubBuckets are
+ * exact, and values from 2^kMaxBits up go to the last bucket. Finding the
+ * bucket of a value is a count leading zeros and a shift.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace common {
+
+class LogLinearHistogram {
+ public:
+  static const uint32_t kSubBucketBits = 4;
+  static const uint32_t kSubBuckets = 1 << kSubBucketBits;
+  static const uint32_t kMaxBits = 40;
+  static const uint32_t kNumBuckets =
+    (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+  static uint32_t BucketIndex(int64_t value) {
+    const uint64_t v = value < 0 ? 0 : value;
+    if (v < kSubBuckets) {
+      return v;
+    }
+
+    const uint32_t shift = 63 - __builtin_clzll(v) - kSubBucketBits;
+    const uint32_t idx = (shift + 1) * kSubBuckets +
+      static_cast<uint32_t>((v >> shift) - kSubBuckets);
+    return idx < kNumBuckets ? idx : kNumBuckets - 1;
+  }
+
+  // The smallest value in bucket idx
+  static int64_t BucketMin(uint32_t idx) {
+    if (idx < kSubBuckets) {
+      return idx;
+    }
+
+    const uint32_t shift = idx / kSubBuckets - 1;
+    return static_cast<int64_t>(kSubBuckets + idx % kSubBuckets) << shift;
+  }
+
+  // The number of values in bucket idx
+  static int64_t BucketWidth(uint32_t idx) {
+    return idx < kSubBuckets ? 1 : int64_t(1) << (idx / kSubBuckets - 1);
+  }
+
+  LogLinearHistogram() : buckets_(kNumBuckets, 0), count_(0), sum_(0) {}
+
+  void addValue(int64_t value) {
+    ++buckets_[BucketIndex(value)];
+    ++count_;
+    sum_ += value;
+  }
+
+  void addBucket(uint32_t idx, uint64_t count) {
+    buckets_[idx] += count;
+    count_ += count;
+  }
+
+  void addSum(int64_t sum) {
+    sum_ += sum;
+  }
+
+  void merge(const LogLinearHistogram& other);
+
+  void clear();
+
+  // pct in [0, 100]. The estimate is the middle of the bucket of the
+  // percentile, 0 if there is no value.
+  int64_t getPercentileEstimate(double pct) const;
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  int64_t sum() const {
+    return sum_;
+  }
+
+  int64_t avg() const {
+    return count_ == 0 ? 0 : sum_ / static_cast<int64_t>(count_);
+  }
+
+  // The number of values <= value, exact at the bucket boundaries
+  uint64_t countUpTo(int64_t value) const;
+
+ private:
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  int64_t sum_;
+};
+
+/*
+ * A LogLinearHistogram updated by one thread and read by another one without
+ * locking. The updates are relaxed atomic adds.
+ */
+class AtomicLogLinearHistogram {
+ public:
+  AtomicLogLinearHistogram();
+
+  void addValue(int64_t value) {
+    buckets_[LogLinearHistogram::BucketIndex(value)].fetch_add(
+      1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // Move the values recorded so far into histogram
+  void drainTo(LogLinearHistogram* histogram);
+
+  // Whether no value was recorded since the last drainTo()
+  bool empty() const;
+
+  // The bytes used, approximately
+  size_t memoryUsage() const;
+
+ private:
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<int64_t> sum_;
+};
+
+/*
+ * The values of the last minute, in 1 second slots, of a log linear metric,
+ * and the total of all of them. Level 0 is the last minute, and level 1 the
+ * total, like in folly::TimeseriesHistogram. Not thread safe.
+ */
+class LogLinearTimeseries {
+ public:
+  // seconds_per_min is the length of a "minute", shortened in tests
+  explicit LogLinearTimeseries(uint32_t seconds_per_min);
+
+  void addValues(std::chrono::seconds now,
+                 const LogLinearHistogram& histogram);
+
+  // Drop the slots older than a minute before now
+  void update(std::chrono::seconds now);
+
+  int64_t getPercentileEstimate(double pct, int level) const;
+  int64_t sum(int level) const;
+  int64_t avg(int level) const;
+  int64_t count(int level) const;
+  uint64_t countUpTo(int64_t value, int level) const;
+
+  // The values of the last minute merged into one histogram, for reading
+  // several of their stats at once
+  LogLinearHistogram lastMinute() const;
+
+  const LogLinearHistogram& total() const {
+    return total_;
+  }
+
+  // The bytes used, approximately
+  size_t memoryUsage() const;
+
+ private:
+
+  struct Slot {
+    int64_t second;
+    LogLinearHistogram histogram;
+  };
+
+  // by second % slots_.size()
+  std::vector<Slot> slots_;
+  LogLinearHistogram total_;
+};
+
+}  // namespace common
@@ -16,23 +16,45 @@
 #include "common/stats/stats.h"
 
 #include <boost/format.hpp>
+#include <folly/Conv.h>
 #include <folly/Memory.h>
 #include <folly/stats/BucketedTimeSeries-defs.h>
 #include <folly/stats/MultiLevelTimeSeries-defs.h>
 #include <folly/stats/Histogram-defs.h>
 #include <folly/stats/TimeseriesHistogram-defs.h>
 #include <folly/String.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
+#include <map>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
+DEFINE_string(openmetrics_histogram_buckets,
+              "1,2,5,10,20,50,100,200,500,1000,2000,5000,10000,20000,50000,"
+              "100000,200000,500000,1000000",
+              "The comma separated upper bounds of the histogram buckets of the"
+              " metrics in the OpenMetrics dump");
+
+DEFINE_int32(stats_max_dynamic_stats_per_name, 0,
+             "The max number of dynamic stats with the same name and "
+             "different tags, the extra ones are recorded to the stat "
+             "\"<name> overflow=true\". 0 is unlimited");
+
+DEFINE_int32(stats_idle_eviction_minutes, 0,
+             "Remove the dynamic stats not updated for so many minutes. 0 "
+             "never removes them");
+
 using folly::Histogram;
 using folly::MultiLevelTimeSeries;
 using std::chrono::duration_cast;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::lock_guard;
 using std::mutex;
@@ -50,20 +72,34 @@ namespace {
 const int64_t kMinMetricValue = 0;
 const int64_t kMaxMetricValue = 200;
 const int64_t kFlushIntervalMS = 250;
+// How often a thread evicts its idle stats, at most
+const seconds kLocalEvictionInterval(10);
+
+const char kOverflowTag[] = " overflow=true";
+const char kMemoryGauge[] = "stats_memory_bytes";
+
+// A sum and a count per bucket of folly histograms and time series
+const size_t kBucketBytes = sizeof(int64_t) + sizeof(uint64_t);
 
 inline seconds GetTimeSinceEpochSeconds() {
   return duration_cast<seconds>(system_clock::now().time_since_epoch());
 }
 
 unique_ptr<Stats::TimeseriesHistogramWrapper> GetTimeseriesHistogramWrapper(
-    uint32_t nSecondsPerMin) {
+    uint32_t nSecondsPerMin, bool use_log_linear) {
   std::vector<seconds> intervals { seconds(nSecondsPerMin), seconds(0) };
 
   folly::TimeseriesHistogram<int64_t> ts_histogram(
       1, kMinMetricValue, kMaxMetricValue,
       MultiLevelTimeSeries<int64_t>(60, intervals.size(), intervals.data()));
 
-  return folly::make_unique<Stats::TimeseriesHistogramWrapper>(ts_histogram);
+  auto thw = folly::make_unique<Stats::TimeseriesHistogramWrapper>(
+      ts_histogram);
+  if (use_log_linear) {
+    thw->log_linear = folly::make_unique<LogLinearTimeseries>(nSecondsPerMin);
+  }
+
+  return thw;
 }
 
 unique_ptr<Stats::MultiLevelTimeSeriesWrapper> GetMultiLevelTimeSeriesWrapper(
@@ -76,6 +112,86 @@ unique_ptr<Stats::MultiLevelTimeSeriesWrapper> GetMultiLevelTimeSeriesWrapper(
   return folly::make_unique<Stats::MultiLevelTimeSeriesWrapper>(timeseries);
 }
 
+string GetTaggedName(const string& name, const Stats::Tags& tags) {
+  auto tagged_name = name;
+  for (const auto& tag : tags) {
+    tagged_name += " " + tag.first + "=" + tag.second;
+  }
+
+  return tagged_name;
+}
+
+// The name of a stat without the tags
+string GetBaseName(const string& stat) {
+  return stat.substr(0, stat.find(' '));
+}
+
+bool IsOverflowName(const string& stat) {
+  const auto tag_size = sizeof(kOverflowTag) - 1;
+  return stat.size() >= tag_size &&
+    stat.compare(stat.size() - tag_size, tag_size, kOverflowTag) == 0;
+}
+
+// The name to record a new dynamic stat under, which is counted in
+// name_counts: itself, or the overflow stat of its name if the name has
+// --stats_max_dynamic_stats_per_name stats already.
+string AdmitDynamicStat(const string& stat,
+                        std::unordered_map<string, uint32_t>* name_counts) {
+  if (IsOverflowName(stat)) {
+    return stat;
+  }
+
+  auto base_name = GetBaseName(stat);
+  auto& count = (*name_counts)[base_name];
+  if (FLAGS_stats_max_dynamic_stats_per_name > 0 &&
+      count >= static_cast<uint32_t>(FLAGS_stats_max_dynamic_stats_per_name)) {
+    return base_name + kOverflowTag;
+  }
+
+  ++count;
+  return stat;
+}
+
+// Undo AdmitDynamicStat() for a removed stat
+void ReleaseDynamicStat(const string& stat,
+                        std::unordered_map<string, uint32_t>* name_counts) {
+  if (IsOverflowName(stat)) {
+    return;
+  }
+
+  auto it = name_counts->find(GetBaseName(stat));
+  if (it != name_counts->end() && --it->second == 0) {
+    name_counts->erase(it);
+  }
+}
+
+template <typename T>
+size_t GetStatMemoryUsage(const MultiLevelTimeSeries<T>& timeseries) {
+  size_t bytes = sizeof(timeseries);
+  for (size_t i = 0; i < timeseries.numLevels(); ++i) {
+    bytes += sizeof(timeseries.getLevel(i)) +
+      timeseries.getLevel(i).numBuckets() * kBucketBytes;
+  }
+
+  return bytes;
+}
+
+size_t GetStatMemoryUsage(const Stats::TimeseriesHistogramWrapper& thw) {
+  size_t bytes = sizeof(thw);
+  for (size_t i = 0; i < thw.ts_histogram.getNumBuckets(); ++i) {
+    bytes += GetStatMemoryUsage(thw.ts_histogram.getBucket(i));
+  }
+  if (thw.log_linear) {
+    bytes += thw.log_linear->memoryUsage();
+  }
+
+  return bytes;
+}
+
+size_t GetStatMemoryUsage(const Stats::MultiLevelTimeSeriesWrapper& mltsw) {
+  return sizeof(mltsw) + GetStatMemoryUsage(mltsw.timeseries);
+}
+
 uint32_t GetArraySize(const std::vector<string>* array) {
   if (array) {
     return array->size();
@@ -88,6 +204,11 @@ uint32_t GetArraySize(const std::vector<string>* array) {
 
 std::atomic<uint32_t> Stats::nSecondsPerMin_ { 60 };
 
+std::atomic<bool> Stats::useLogLinearHistograms_ { false };
+
+const size_t Stats::kCounterSnapshotSize;
+const size_t Stats::kMetricSnapshotSize;
+
 std::atomic<const std::vector<string>*> Stats::counter_names_ { nullptr };
 
 std::atomic<const std::vector<string>*> Stats::metric_names_ { nullptr };
@@ -97,36 +218,82 @@ std::atomic<const std::vector<string>*> Stats::metric_names_ { nullptr };
 class LocalStats {
  public:
   LocalStats(uint32_t num_counters, uint32_t num_metrics,
-             int64_t min_metric_value, int64_t max_metric_value);
+             int64_t min_metric_value, int64_t max_metric_value,
+             bool use_log_linear);
 
   // Counter update methods.
   void Incr(const uint32_t counter, uint64_t value = 1);
   void Incr(const string& counter, uint64_t value = 1);
+  void Incr(const Stats::CounterHandle counter, uint64_t value = 1);
 
   // Metric update methods.
   void AddMetric(const uint32_t metric, int64_t value);
   void AddMetric(const string& metric, int64_t value);
+  void AddMetric(const Stats::MetricHandle metric, int64_t value);
 
   // Gauge update methods.
   void SetGauge(const string& gauge, uint64_t value);
 
   void FlushAll();
 
+  // The bytes used by this object, approximately. Called by the flush thread.
+  size_t GetMemoryUsage();
+
  private:
   // Helper structs for storing last flushing time along with the histogram/
   // counter.
   struct HistogramWrapper {
     unique_ptr<Histogram<int64_t>> histogram;
+    // set instead of histogram with log linear histograms, which need no lock
+    unique_ptr<AtomicLogLinearHistogram> log_linear;
     mutex m;
+    // the flushes in a row with no value, guarded by the lock of the map
+    uint32_t idle_flushes;
+
+    HistogramWrapper(int64_t min_value, int64_t max_value, bool use_log_linear)
+        : histogram(use_log_linear ? nullptr :
+                    new Histogram<int64_t>(1, min_value, max_value))
+        , log_linear(use_log_linear ? new AtomicLogLinearHistogram() :
+                     nullptr)
+        , idle_flushes(0) {}
+
+    void addValue(int64_t value) {
+      if (log_linear) {
+        log_linear->addValue(value);
+        return;
+      }
+
+      lock_guard<mutex> g(m);
+      histogram->addValue(value);
+    }
 
-    HistogramWrapper(int64_t min_value, int64_t max_value)
-        : histogram(new Histogram<int64_t>(1, min_value, max_value)) {}
+    bool empty() {
+      if (log_linear) {
+        return log_linear->empty();
+      }
+
+      lock_guard<mutex> g(m);
+      return histogram->computeTotalCount() == 0;
+    }
+
+    size_t GetMemoryUsage() {
+      size_t bytes = sizeof(*this);
+      if (log_linear) {
+        bytes += log_linear->memoryUsage();
+      }
+      if (histogram) {
+        bytes += sizeof(*histogram) + histogram->getNumBuckets() * kBucketBytes;
+      }
+      return bytes;
+    }
   };
 
   struct Counter {
     std::atomic<uint64_t> sum;
+    // the flushes in a row with no value, guarded by the lock of the map
+    uint32_t idle_flushes;
 
-    explicit Counter(uint64_t n) : sum(n) {}
+    explicit Counter(uint64_t n) : sum(n), idle_flushes(0) {}
   };
 
   struct Gauge {
@@ -139,14 +306,28 @@ class LocalStats {
   void FlushCounter(const uint32_t counter, seconds time_epoch_seconds);
   void FlushCounter(std::pair<const string, unique_ptr<Counter>>* counter,
                     seconds time_epoch_seconds);
+  void FlushHandleCounter(const uint32_t counter, seconds time_epoch_seconds);
   void FlushMetric(const uint32_t metric, seconds time_epoch_seconds);
+  void FlushHandleMetric(const uint32_t metric, seconds time_epoch_seconds);
   void FlushMetric(
       std::pair<const string, unique_ptr<HistogramWrapper>>* metric,
       seconds time_epoch_seconds);
   void FlushGauge(std::pair<const string, unique_ptr<Gauge>>* gauge);
+  // Drain the log linear histogram of hw into the metric named or indexed by
+  // metric.
+  // @return false if there was no value.
+  template <typename MetricType>
+  bool FlushLogLinearMetric(const MetricType& metric, HistogramWrapper* hw,
+                            seconds time_epoch_seconds);
+
+  // Remove the dynamic stats with no value for --stats_idle_eviction_minutes,
+  // at most every kLocalEvictionInterval. Only called by the thread who is
+  // recording stats.
+  void MaybeEvictIdleStats();
 
   const int64_t min_metric_value_;
   const int64_t max_metric_value_;
+  const bool use_log_linear_;
 
   std::vector<unique_ptr<HistogramWrapper>> histograms_;
   std::vector<unique_ptr<Counter>> counters_;
@@ -157,15 +338,28 @@ class LocalStats {
   mutex lock_counter_map_;
   std::unordered_map<string, unique_ptr<Gauge>> gauge_map_;
   mutex lock_gauge_map_;
+  // indexed by the handle idx, grown as new handles are used
+  std::vector<unique_ptr<HistogramWrapper>> handle_histograms_;
+  mutex lock_handle_histograms_;
+  std::vector<unique_ptr<Counter>> handle_counters_;
+  mutex lock_handle_counters_;
+
+  // The number of dynamic stats per name in counter_map_ and histogram_map_,
+  // only used by the thread who is recording stats
+  std::unordered_map<string, uint32_t> counter_name_counts_;
+  std::unordered_map<string, uint32_t> metric_name_counts_;
+  steady_clock::time_point next_eviction_;
 
   // Global stats object.
   Stats* stats_;
 };
 
 LocalStats::LocalStats(uint32_t num_counters, uint32_t num_metrics,
-                       int64_t min_metric_value, int64_t max_metric_value)
+                       int64_t min_metric_value, int64_t max_metric_value,
+                       bool use_log_linear)
     : min_metric_value_(min_metric_value),
       max_metric_value_(max_metric_value),
+      use_log_linear_(use_log_linear),
       histograms_(),
       counters_(),
       histogram_map_(),
@@ -174,10 +368,17 @@ LocalStats::LocalStats(uint32_t num_counters, uint32_t num_metrics,
       lock_counter_map_(),
       gauge_map_(),
       lock_gauge_map_(),
+      handle_histograms_(),
+      lock_handle_histograms_(),
+      handle_counters_(),
+      lock_handle_counters_(),
+      counter_name_counts_(),
+      metric_name_counts_(),
+      next_eviction_(steady_clock::now() + kLocalEvictionInterval),
       stats_(Stats::get()) {
   for (uint32_t i = 0; i < num_metrics; ++i) {
     histograms_.emplace_back(folly::make_unique<HistogramWrapper>(
-        min_metric_value_, max_metric_value_));
+        min_metric_value_, max_metric_value_, use_log_linear_));
   }
 
   for (uint32_t i = 0; i < num_counters; ++i) {
@@ -201,14 +402,35 @@ void LocalStats::Incr(const string& counter, uint64_t value) {
     return;
   }
 
+  MaybeEvictIdleStats();
+  // a new stat, or one more of its name than allowed
+  const auto name = AdmitDynamicStat(counter, &counter_name_counts_);
+  it = counter_map_.find(name);
+  if (it != counter_map_.end()) {
+    it->second->sum.fetch_add(value);
+    return;
+  }
+
   lock_guard<mutex> g(lock_counter_map_);
-  counter_map_.emplace(counter, folly::make_unique<Counter>(value));
+  counter_map_.emplace(name, folly::make_unique<Counter>(value));
+}
+
+void LocalStats::Incr(const Stats::CounterHandle counter, uint64_t value) {
+  // only the thread who is recording stats can grow handle_counters_.
+  // Thus we don't need to do any synchronizations when reading it.
+  if (UNLIKELY(counter.idx >= handle_counters_.size())) {
+    lock_guard<mutex> g(lock_handle_counters_);
+    while (handle_counters_.size() <= counter.idx) {
+      handle_counters_.emplace_back(folly::make_unique<Counter>(0));
+    }
+  }
+
+  handle_counters_[counter.idx]->sum.fetch_add(value);
 }
 
 void LocalStats::AddMetric(const uint32_t metric, int64_t value) {
   if (LIKELY(metric < histograms_.size())) {
-    lock_guard<mutex> g(histograms_[metric]->m);
-    histograms_[metric]->histogram->addValue(value);
+    histograms_[metric]->addValue(value);
   }
 }
 
@@ -218,17 +440,84 @@ void LocalStats::AddMetric(const string& metric, int64_t value) {
   // Thus we don't need to do any synchronizations when reading it.
   auto it = histogram_map_.find(metric);
   if (LIKELY(it != histogram_map_.end())) {
-    lock_guard<mutex> g(it->second->m);
-    it->second->histogram->addValue(value);
+    it->second->addValue(value);
+    return;
+  }
+
+  MaybeEvictIdleStats();
+  // a new stat, or one more of its name than allowed
+  const auto name = AdmitDynamicStat(metric, &metric_name_counts_);
+  it = histogram_map_.find(name);
+  if (it != histogram_map_.end()) {
+    it->second->addValue(value);
     return;
   }
 
   auto hw = folly::make_unique<HistogramWrapper>(min_metric_value_,
-                                                 max_metric_value_);
-  hw->histogram->addValue(value);
+                                                 max_metric_value_,
+                                                 use_log_linear_);
+  hw->addValue(value);
 
   lock_guard<mutex> g(lock_histogram_map_);
-  histogram_map_.emplace(metric, std::move(hw));
+  histogram_map_.emplace(name, std::move(hw));
+}
+
+void LocalStats::MaybeEvictIdleStats() {
+  if (FLAGS_stats_idle_eviction_minutes <= 0) {
+    return;
+  }
+
+  const auto now = steady_clock::now();
+  if (now < next_eviction_) {
+    return;
+  }
+  next_eviction_ = now + kLocalEvictionInterval;
+
+  const uint32_t max_idle_flushes = static_cast<uint64_t>(
+    FLAGS_stats_idle_eviction_minutes) * Stats::nSecondsPerMin_.load() *
+    1000 / kFlushIntervalMS;
+  // A stat may have values recorded since its last flush
+  {
+    lock_guard<mutex> g(lock_counter_map_);
+    for (auto it = counter_map_.begin(); it != counter_map_.end();) {
+      if (it->second->idle_flushes < max_idle_flushes ||
+          it->second->sum.load() != 0) {
+        ++it;
+        continue;
+      }
+
+      ReleaseDynamicStat(it->first, &counter_name_counts_);
+      it = counter_map_.erase(it);
+    }
+  }
+
+  {
+    lock_guard<mutex> g(lock_histogram_map_);
+    for (auto it = histogram_map_.begin(); it != histogram_map_.end();) {
+      if (it->second->idle_flushes < max_idle_flushes ||
+          !it->second->empty()) {
+        ++it;
+        continue;
+      }
+
+      ReleaseDynamicStat(it->first, &metric_name_counts_);
+      it = histogram_map_.erase(it);
+    }
+  }
+}
+
+void LocalStats::AddMetric(const Stats::MetricHandle metric, int64_t value) {
+  // only the thread who is recording stats can grow handle_histograms_.
+  // Thus we don't need to do any synchronizations when reading it.
+  if (UNLIKELY(metric.idx >= handle_histograms_.size())) {
+    lock_guard<mutex> g(lock_handle_histograms_);
+    while (handle_histograms_.size() <= metric.idx) {
+      handle_histograms_.emplace_back(folly::make_unique<HistogramWrapper>(
+          min_metric_value_, max_metric_value_, use_log_linear_));
+    }
+  }
+
+  handle_histograms_[metric.idx]->addValue(value);
 }
 
 void LocalStats::SetGauge(const string& gauge, uint64_t value) {
@@ -259,6 +548,13 @@ void LocalStats::FlushAll() {
     }
   }
 
+  {
+    lock_guard<mutex> g(lock_handle_counters_);
+    for (uint32_t counter = 0; counter < handle_counters_.size(); ++counter) {
+      FlushHandleCounter(counter, now);
+    }
+  }
+
   for (uint32_t metric = 0; metric < histograms_.size(); ++metric) {
     FlushMetric(metric, now);
   }
@@ -270,6 +566,13 @@ void LocalStats::FlushAll() {
     }
   }
 
+  {
+    lock_guard<mutex> g(lock_handle_histograms_);
+    for (uint32_t metric = 0; metric < handle_histograms_.size(); ++metric) {
+      FlushHandleMetric(metric, now);
+    }
+  }
+
   {
     lock_guard<mutex> g(lock_gauge_map_);
     for (auto& gauge : gauge_map_) {
@@ -278,6 +581,42 @@ void LocalStats::FlushAll() {
   }
 }
 
+size_t LocalStats::GetMemoryUsage() {
+  size_t bytes = sizeof(*this) + counters_.size() * sizeof(Counter);
+  for (auto& hw : histograms_) {
+    bytes += hw->GetMemoryUsage();
+  }
+
+  {
+    lock_guard<mutex> g(lock_counter_map_);
+    for (auto& counter : counter_map_) {
+      bytes += counter.first.size() + sizeof(counter) + sizeof(Counter);
+    }
+  }
+
+  {
+    lock_guard<mutex> g(lock_histogram_map_);
+    for (auto& histogram : histogram_map_) {
+      bytes += histogram.first.size() + sizeof(histogram) +
+        histogram.second->GetMemoryUsage();
+    }
+  }
+
+  {
+    lock_guard<mutex> g(lock_handle_counters_);
+    bytes += handle_counters_.size() * sizeof(Counter);
+  }
+
+  {
+    lock_guard<mutex> g(lock_handle_histograms_);
+    for (auto& hw : handle_histograms_) {
+      bytes += hw->GetMemoryUsage();
+    }
+  }
+
+  return bytes;
+}
+
 void LocalStats::FlushCounter(const uint32_t counter,
                               seconds time_epoch_seconds) {
   auto sum = counters_[counter]->sum.exchange(0);
@@ -294,12 +633,31 @@ void LocalStats::FlushCounter(
   auto sum = counter->second->sum.exchange(0);
 
   if (sum > 0) {
+    counter->second->idle_flushes = 0;
     stats_->FlushCounter(counter->first, sum, time_epoch_seconds);
+  } else {
+    ++counter->second->idle_flushes;
+  }
+}
+
+void LocalStats::FlushHandleCounter(const uint32_t counter,
+                                    seconds time_epoch_seconds) {
+  auto sum = handle_counters_[counter]->sum.exchange(0);
+
+  if (sum > 0) {
+    stats_->FlushCounter(stats_->GetHandleCounterName(counter), sum,
+                         time_epoch_seconds);
   }
 }
 
 void LocalStats::FlushMetric(const uint32_t metric,
                              seconds time_epoch_seconds) {
+  if (use_log_linear_) {
+    FlushLogLinearMetric(metric, histograms_[metric].get(),
+                         time_epoch_seconds);
+    return;
+  }
+
   auto histogram_ptr = folly::make_unique<Histogram<int64_t>>(
       1, min_metric_value_, max_metric_value_);
 
@@ -315,18 +673,74 @@ void LocalStats::FlushMetric(const uint32_t metric,
 void LocalStats::FlushMetric(
     std::pair<const string, unique_ptr<HistogramWrapper>>* metric,
     seconds time_epoch_seconds) {
+  if (use_log_linear_) {
+    if (FlushLogLinearMetric(metric->first, metric->second.get(),
+                             time_epoch_seconds)) {
+      metric->second->idle_flushes = 0;
+    } else {
+      ++metric->second->idle_flushes;
+    }
+    return;
+  }
+
   auto histogram_ptr = folly::make_unique<Histogram<int64_t>>(
       1, min_metric_value_, max_metric_value_);
 
   {
     lock_guard<mutex> g(metric->second->m);
+    if (metric->second->histogram->computeTotalCount() == 0) {
+      ++metric->second->idle_flushes;
+      return;
+    }
     metric->second->histogram.swap(histogram_ptr);
   }
 
   // Flush to global stats.
+  metric->second->idle_flushes = 0;
   stats_->FlushMetric(metric->first, *histogram_ptr, time_epoch_seconds);
 }
 
+void LocalStats::FlushHandleMetric(const uint32_t metric,
+                                   seconds time_epoch_seconds) {
+  if (use_log_linear_) {
+    LogLinearHistogram histogram;
+    handle_histograms_[metric]->log_linear->drainTo(&histogram);
+    if (histogram.count() > 0) {
+      stats_->FlushMetric(stats_->GetHandleMetricName(metric), histogram,
+                          time_epoch_seconds);
+    }
+    return;
+  }
+
+  auto histogram_ptr = folly::make_unique<Histogram<int64_t>>(
+      1, min_metric_value_, max_metric_value_);
+
+  {
+    lock_guard<mutex> g(handle_histograms_[metric]->m);
+    if (handle_histograms_[metric]->histogram->computeTotalCount() == 0) {
+      return;
+    }
+    handle_histograms_[metric]->histogram.swap(histogram_ptr);
+  }
+
+  stats_->FlushMetric(stats_->GetHandleMetricName(metric), *histogram_ptr,
+                      time_epoch_seconds);
+}
+
+template <typename MetricType>
+bool LocalStats::FlushLogLinearMetric(const MetricType& metric,
+                                      HistogramWrapper* hw,
+                                      seconds time_epoch_seconds) {
+  LogLinearHistogram histogram;
+  hw->log_linear->drainTo(&histogram);
+  if (histogram.count() == 0) {
+    return false;
+  }
+
+  stats_->FlushMetric(metric, histogram, time_epoch_seconds);
+  return true;
+}
+
 void LocalStats::FlushGauge(std::pair<const string, unique_ptr<Gauge>>* gauge) {
   stats_->FlushGauge(gauge->first, gauge->second->value);
 }
@@ -343,12 +757,15 @@ void Stats::init(const std::vector<string>* counter_names,
 }
 
 Stats::Stats() : flush_interval_(kFlushIntervalMS)
+               , dumped_stats_(std::make_shared<const DumpedStats>())
+               , dumped_stats_stale_(true)
                , should_stop_(false) {
   auto num_metrics = GetArraySize(metric_names_.load());
   if (num_metrics > 0) {
     for (uint32_t i = 0; i < num_metrics; ++i) {
       histograms_.emplace_back(
-          GetTimeseriesHistogramWrapper(nSecondsPerMin_.load()));
+          GetTimeseriesHistogramWrapper(nSecondsPerMin_.load(),
+                                        useLogLinearHistograms_.load()));
     }
   }
 
@@ -362,6 +779,7 @@ Stats::Stats() : flush_interval_(kFlushIntervalMS)
 
   // Start flush thread.
   flush_thread_ = thread([this] {
+    seconds last_maintenance(0);
     while (!should_stop_) {
       sleep_for(this->flush_interval_);
       {
@@ -383,11 +801,28 @@ Stats::Stats() : flush_interval_(kFlushIntervalMS)
         }
       }
 
+      // The eviction and the memory usage once per second
+      const auto now = GetTimeSinceEpochSeconds();
+      const bool maintain = now != last_maintenance;
+      size_t memory_usage = 0;
+
       // Note that this object blocks creation of new thread local objects until
       // it is destroyed.
-      auto accessor = this->local_stats_.accessAllThreads();
-      for (auto it = accessor.begin(); it != accessor.end(); ++it) {
-        it->FlushAll();
+      {
+        auto accessor = this->local_stats_.accessAllThreads();
+        for (auto it = accessor.begin(); it != accessor.end(); ++it) {
+          it->FlushAll();
+          if (maintain) {
+            memory_usage += it->GetMemoryUsage();
+          }
+        }
+      }
+
+      if (maintain) {
+        last_maintenance = now;
+        EvictIdleStats(now);
+        FlushGauge(kMemoryGauge, memory_usage + GetMemoryUsage());
+        PublishSnapshots();
       }
     }
   });
@@ -414,6 +849,54 @@ void Stats::AddMetric(const string& metric, int64_t value) {
   GetLocalStats()->AddMetric(metric, value);
 }
 
+void Stats::Incr(const CounterHandle counter, uint64_t value) {
+  GetLocalStats()->Incr(counter, value);
+}
+
+void Stats::AddMetric(const MetricHandle metric, int64_t value) {
+  GetLocalStats()->AddMetric(metric, value);
+}
+
+Stats::CounterHandle Stats::GetCounterHandle(const string& counter,
+                                             const Tags& tags) {
+  auto name = GetTaggedName(counter, tags);
+  lock_guard<mutex> g(lock_handles_);
+  auto it = handle_counters_.find(name);
+  if (it != handle_counters_.end()) {
+    return CounterHandle{it->second};
+  }
+
+  const uint32_t idx = handle_counter_names_.size();
+  handle_counter_names_.push_back(name);
+  handle_counters_.emplace(std::move(name), idx);
+  return CounterHandle{idx};
+}
+
+Stats::MetricHandle Stats::GetMetricHandle(const string& metric,
+                                           const Tags& tags) {
+  auto name = GetTaggedName(metric, tags);
+  lock_guard<mutex> g(lock_handles_);
+  auto it = handle_metrics_.find(name);
+  if (it != handle_metrics_.end()) {
+    return MetricHandle{it->second};
+  }
+
+  const uint32_t idx = handle_metric_names_.size();
+  handle_metric_names_.push_back(name);
+  handle_metrics_.emplace(std::move(name), idx);
+  return MetricHandle{idx};
+}
+
+string Stats::GetHandleCounterName(const uint32_t counter) {
+  lock_guard<mutex> g(lock_handles_);
+  return handle_counter_names_[counter];
+}
+
+string Stats::GetHandleMetricName(const uint32_t metric) {
+  lock_guard<mutex> g(lock_handles_);
+  return handle_metric_names_[metric];
+}
+
 void Stats::RegisterIncr(const std::string &counter,
                          std::function<uint64_t()> callback) {
   lock_guard<mutex> g(lock_counter_callbacks_);
@@ -438,7 +921,8 @@ LocalStats* Stats::GetLocalStats() {
   if (UNLIKELY(ptr == nullptr)) {
     local_stats_.reset(new LocalStats(GetArraySize(counter_names_.load()),
                                       GetArraySize(metric_names_.load()),
-                                      kMinMetricValue, kMaxMetricValue));
+                                      kMinMetricValue, kMaxMetricValue,
+                                      useLogLinearHistograms_.load()));
     ptr = local_stats_.get();
   }
 
@@ -451,26 +935,61 @@ void Stats::FlushMetric(const uint32_t metric,
   if (LIKELY(metric < histograms_.size())) {
     lock_guard<mutex> g(histograms_[metric]->m);
     histograms_[metric]->ts_histogram.addValues(time_epoch_seconds, histogram);
+    histograms_[metric]->dirty = true;
   }
 }
 
 void Stats::FlushMetric(const string& metric,
                         const Histogram<int64_t>& histogram,
                         seconds time_epoch_seconds) {
+  auto thw = GetDynamicMetric(metric, useLogLinearHistograms_.load());
+  lock_guard<mutex> g(thw->m);
+  thw->ts_histogram.addValues(time_epoch_seconds, histogram);
+  thw->dirty = true;
+  thw->last_flush = time_epoch_seconds;
+}
+
+void Stats::FlushMetric(const uint32_t metric,
+                        const LogLinearHistogram& histogram,
+                        seconds time_epoch_seconds) {
+  if (LIKELY(metric < histograms_.size())) {
+    lock_guard<mutex> g(histograms_[metric]->m);
+    histograms_[metric]->log_linear->addValues(time_epoch_seconds, histogram);
+    histograms_[metric]->dirty = true;
+  }
+}
+
+void Stats::FlushMetric(const string& metric,
+                        const LogLinearHistogram& histogram,
+                        seconds time_epoch_seconds) {
+  auto thw = GetDynamicMetric(metric, true);
+  lock_guard<mutex> g(thw->m);
+  thw->log_linear->addValues(time_epoch_seconds, histogram);
+  thw->dirty = true;
+  thw->last_flush = time_epoch_seconds;
+}
+
+Stats::TimeseriesHistogramWrapper* Stats::GetDynamicMetric(
+    const string& metric, bool use_log_linear) {
   // only the flush thread can modify the structure of histogram_map_.
   // Thus we don't need to do any synchronizations when reading it.
   auto it = histogram_map_.find(metric);
   if (LIKELY(it != histogram_map_.end())) {
-    lock_guard<mutex> g(it->second->m);
-    it->second->ts_histogram.addValues(time_epoch_seconds, histogram);
-    return;
+    return it->second.get();
   }
 
-  auto thw = GetTimeseriesHistogramWrapper(nSecondsPerMin_.load());
-  thw->ts_histogram.addValues(time_epoch_seconds, histogram);
+  // a new stat, or one more of its name than allowed
+  const auto name = AdmitDynamicStat(metric, &metric_name_counts_);
+  it = histogram_map_.find(name);
+  if (it != histogram_map_.end()) {
+    return it->second.get();
+  }
 
   lock_guard<mutex> g(lock_histogram_map_);
-  histogram_map_.emplace(metric, std::move(thw));
+  dumped_stats_stale_ = true;
+  return histogram_map_.emplace(
+    name, GetTimeseriesHistogramWrapper(nSecondsPerMin_.load(),
+                                        use_log_linear)).first->second.get();
 }
 
 void Stats::FlushCounter(const uint32_t counter, uint64_t sum,
@@ -478,6 +997,7 @@ void Stats::FlushCounter(const uint32_t counter, uint64_t sum,
   if (LIKELY(counter < timeseries_.size())) {
     lock_guard<mutex> g(timeseries_[counter]->m);
     timeseries_[counter]->timeseries.addValue(time_epoch_seconds, sum);
+    timeseries_[counter]->dirty = true;
   }
 }
 
@@ -486,17 +1006,22 @@ void Stats::FlushCounter(const string& counter, uint64_t sum,
   // only the flush thread can modify the structure of counter_map_.
   // Thus we don't need to do any synchronizations when reading it.
   auto it = timeseries_map_.find(counter);
-  if (LIKELY(it != timeseries_map_.end())) {
-    lock_guard<mutex> g(it->second->m);
-    it->second->timeseries.addValue(time_epoch_seconds, sum);
-    return;
+  if (UNLIKELY(it == timeseries_map_.end())) {
+    // a new stat, or one more of its name than allowed
+    const auto name = AdmitDynamicStat(counter, &counter_name_counts_);
+    it = timeseries_map_.find(name);
+    if (it == timeseries_map_.end()) {
+      lock_guard<mutex> g(lock_timeseries_map_);
+      it = timeseries_map_.emplace(
+        name, GetMultiLevelTimeSeriesWrapper(nSecondsPerMin_.load())).first;
+      dumped_stats_stale_ = true;
+    }
   }
 
-  auto mtsw = GetMultiLevelTimeSeriesWrapper(nSecondsPerMin_.load());
-  mtsw->timeseries.addValue(time_epoch_seconds, sum);
-
-  lock_guard<mutex> g(lock_timeseries_map_);
-  timeseries_map_.emplace(counter, std::move(mtsw));
+  lock_guard<mutex> g(it->second->m);
+  it->second->timeseries.addValue(time_epoch_seconds, sum);
+  it->second->dirty = true;
+  it->second->last_flush = time_epoch_seconds;
 }
 
 void Stats::FlushGauge(const string& gauge, uint64_t value) {
@@ -508,11 +1033,76 @@ void Stats::FlushGauge(const string& gauge, uint64_t value) {
     return;
   }
 
+  lock_guard<mutex> g(lock_gauges_map_);
   gauges_map_.emplace(gauge, folly::make_unique<std::atomic<uint64_t>>(value));
+  dumped_stats_stale_ = true;
+}
+
+void Stats::EvictIdleStats(seconds now) {
+  if (FLAGS_stats_idle_eviction_minutes <= 0) {
+    return;
+  }
+
+  // The evicted stats stay valid for the DumpedStats listing them
+  const seconds max_idle(static_cast<int64_t>(
+    FLAGS_stats_idle_eviction_minutes) * nSecondsPerMin_.load());
+  {
+    lock_guard<mutex> g(lock_histogram_map_);
+    for (auto it = histogram_map_.begin(); it != histogram_map_.end();) {
+      if (now - it->second->last_flush < max_idle) {
+        ++it;
+        continue;
+      }
+
+      ReleaseDynamicStat(it->first, &metric_name_counts_);
+      it = histogram_map_.erase(it);
+      dumped_stats_stale_ = true;
+    }
+  }
+
+  {
+    lock_guard<mutex> g(lock_timeseries_map_);
+    for (auto it = timeseries_map_.begin(); it != timeseries_map_.end();) {
+      if (now - it->second->last_flush < max_idle) {
+        ++it;
+        continue;
+      }
+
+      ReleaseDynamicStat(it->first, &counter_name_counts_);
+      it = timeseries_map_.erase(it);
+      dumped_stats_stale_ = true;
+    }
+  }
+}
+
+size_t Stats::GetMemoryUsage() {
+  // only the flush thread modifies the structure of the stat maps, which we
+  // are on.
+  size_t bytes = 0;
+  for (const auto& thw : histograms_) {
+    bytes += GetStatMemoryUsage(*thw);
+  }
+  for (const auto& histogram : histogram_map_) {
+    bytes += histogram.first.size() + sizeof(histogram) +
+      GetStatMemoryUsage(*histogram.second);
+  }
+  for (const auto& mltsw : timeseries_) {
+    bytes += GetStatMemoryUsage(*mltsw);
+  }
+  for (const auto& timeseries : timeseries_map_) {
+    bytes += timeseries.first.size() + sizeof(timeseries) +
+      GetStatMemoryUsage(*timeseries.second);
+  }
+  for (const auto& gauge : gauges_map_) {
+    bytes += gauge.first.size() + sizeof(gauge) + sizeof(*gauge.second);
+  }
+
+  return bytes;
 }
 
-Stats::Counter::Counter(Stats::MultiLevelTimeSeriesWrapper* ts_wrapper_arg)
-    : ts_wrapper_(ts_wrapper_arg) {}
+Stats::Counter::Counter(
+    std::shared_ptr<Stats::MultiLevelTimeSeriesWrapper> ts_wrapper_arg)
+    : ts_wrapper_(std::move(ts_wrapper_arg)) {}
 
 uint64_t Stats::Counter::GetTotal() {
   lock_guard<mutex> l(ts_wrapper_->m);
@@ -526,54 +1116,103 @@ uint64_t Stats::Counter::GetLastMinute() {
   return ts_wrapper_->timeseries.sum(0);
 }
 
-Stats::Metric::Metric(TimeseriesHistogramWrapper* hist_wrapper_arg)
-    : hist_wrapper_(hist_wrapper_arg) {}
+Stats::Metric::Metric(
+    std::shared_ptr<TimeseriesHistogramWrapper> hist_wrapper_arg)
+    : hist_wrapper_(std::move(hist_wrapper_arg)) {}
 
 int64_t Stats::Metric::GetPercentileTotal(double pct) {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->getPercentileEstimate(pct, 1);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.getPercentileEstimate(pct, 1);
 }
 
 int64_t Stats::Metric::GetPercentileLastMinute(double pct) {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->getPercentileEstimate(pct, 0);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.getPercentileEstimate(pct, 0);
 }
 
 int64_t Stats::Metric::GetSumTotal() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->sum(1);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.sum(1);
 }
 
 int64_t Stats::Metric::GetSumLastMinute() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->sum(0);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.sum(0);
 }
 
 int64_t Stats::Metric::GetAverageTotal() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->avg(1);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.avg(1);
 }
 
 int64_t Stats::Metric::GetAverageLastMinute() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->avg(0);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.avg(0);
 }
 
 int64_t Stats::Metric::GetCountTotal() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->count(1);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.count(1);
 }
 
 int64_t Stats::Metric::GetCountLastMinute() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
+  const auto now = GetTimeSinceEpochSeconds();
+  if (hist_wrapper_->log_linear) {
+    hist_wrapper_->log_linear->update(now);
+    return hist_wrapper_->log_linear->count(0);
+  }
+
+  hist_wrapper_->ts_histogram.update(now);
   return hist_wrapper_->ts_histogram.count(0);
 }
 
@@ -589,7 +1228,7 @@ unique_ptr<Stats::Metric> Stats::GetMetric(const uint32_t metric) {
     return nullptr;
   }
 
-  return folly::make_unique<Stats::Metric>(histograms_[metric].get());
+  return folly::make_unique<Stats::Metric>(histograms_[metric]);
 }
 
 unique_ptr<Stats::Metric> Stats::GetMetric(const string& metric) {
@@ -599,7 +1238,7 @@ unique_ptr<Stats::Metric> Stats::GetMetric(const string& metric) {
     return nullptr;
   }
 
-  return folly::make_unique<Stats::Metric>(it->second.get());
+  return folly::make_unique<Stats::Metric>(it->second);
 }
 
 unique_ptr<Stats::Counter> Stats::GetCounter(const uint32_t counter) {
@@ -607,7 +1246,7 @@ unique_ptr<Stats::Counter> Stats::GetCounter(const uint32_t counter) {
     return nullptr;
   }
 
-  return folly::make_unique<Stats::Counter>(timeseries_[counter].get());
+  return folly::make_unique<Stats::Counter>(timeseries_[counter]);
 }
 
 unique_ptr<Stats::Counter> Stats::GetCounter(const string& counter) {
@@ -617,7 +1256,7 @@ unique_ptr<Stats::Counter> Stats::GetCounter(const string& counter) {
     return nullptr;
   }
 
-  return folly::make_unique<Stats::Counter>(it->second.get());
+  return folly::make_unique<Stats::Counter>(it->second);
 }
 
 unique_ptr<Stats::Gauge> Stats::GetGauge(const string& gauge) {
@@ -650,77 +1289,384 @@ string GetTotalName(const string& raw_name) {
   raw_name_parts.at(0) += "__TOTAL";
   return folly::join(" ", raw_name_parts);
 }
+
+const double kSnapshotPercentiles[] = {100, 0, 50, 90, 99, 99.9, 99.99};
+
+// Set the average, count, percentiles and sum of histogram in values from i
+template <typename HistogramType>
+void SetMetricSnapshot(const HistogramType& histogram, size_t i,
+                       std::array<int64_t, Stats::kMetricSnapshotSize>* values) {
+  (*values)[i++] = histogram.avg();
+  (*values)[i++] = histogram.count();
+  for (const auto pct : kSnapshotPercentiles) {
+    (*values)[i++] = histogram.getPercentileEstimate(pct);
+  }
+  (*values)[i] = histogram.sum();
+}
+
+// The snapshot of thw, read under one lock of it. The last minute values of
+// a log linear histogram are merged once for all of them.
+std::array<int64_t, Stats::kMetricSnapshotSize> GetMetricSnapshot(
+    Stats::TimeseriesHistogramWrapper* thw) {
+  std::array<int64_t, Stats::kMetricSnapshotSize> values;
+  lock_guard<mutex> g(thw->m);
+  const auto now = GetTimeSinceEpochSeconds();
+  if (thw->log_linear) {
+    thw->log_linear->update(now);
+    SetMetricSnapshot(thw->log_linear->lastMinute(), 0, &values);
+    SetMetricSnapshot(thw->log_linear->total(), values.size() / 2, &values);
+    return values;
+  }
+
+  auto& ts_histogram = thw->ts_histogram;
+  ts_histogram.update(now);
+  size_t i = 0;
+  for (int level = 0; level < 2; ++level) {
+    values[i++] = ts_histogram.avg(level);
+    values[i++] = ts_histogram.count(level);
+    for (const auto pct : kSnapshotPercentiles) {
+      values[i++] = ts_histogram.getPercentileEstimate(pct, level);
+    }
+    values[i++] = ts_histogram.sum(level);
+  }
+  return values;
+}
 }  // namespace
 
+void Stats::PublishSnapshots() {
+  // Only the flush thread modifies the structure of the stat maps, which we
+  // are on. Thus we don't need to do any synchronizations when reading them.
+  auto dumped = GetDumpedStats();
+  if (dumped_stats_stale_) {
+    dumped_stats_stale_ = false;
+    auto new_dumped = std::make_shared<DumpedStats>();
+    for (uint32_t i = 0; i < histograms_.size(); ++i) {
+      new_dumped->metrics.emplace_back((*metric_names_.load())[i],
+                                       histograms_[i]);
+    }
+    for (auto& histogram : histogram_map_) {
+      new_dumped->metrics.emplace_back(histogram.first, histogram.second);
+    }
+    for (uint32_t i = 0; i < timeseries_.size(); ++i) {
+      new_dumped->counters.emplace_back((*counter_names_.load())[i],
+                                        timeseries_[i]);
+    }
+    for (auto& timeseries : timeseries_map_) {
+      new_dumped->counters.emplace_back(timeseries.first, timeseries.second);
+    }
+    for (auto& gauge : gauges_map_) {
+      new_dumped->gauges.emplace_back(gauge.first, gauge.second.get());
+    }
+
+    dumped = new_dumped;
+    std::atomic_store(&dumped_stats_, dumped);
+  }
+
+  // A stat with no flush has to be republished only if its last minute values
+  // may still expire.
+  for (const auto& metric : dumped->metrics) {
+    auto thw = metric.second.get();
+    if (!thw->dirty.exchange(false) && thw->snapshot.Read()[1] == 0) {
+      continue;
+    }
+
+    thw->snapshot.Publish(GetMetricSnapshot(thw));
+  }
+
+  for (const auto& counter : dumped->counters) {
+    auto mltsw = counter.second.get();
+    if (!mltsw->dirty.exchange(false) && mltsw->snapshot.Read()[0] == 0) {
+      continue;
+    }
+
+    Counter c(mltsw);
+    mltsw->snapshot.Publish({{static_cast<int64_t>(c.GetLastMinute()),
+                              static_cast<int64_t>(c.GetTotal())}});
+  }
+}
+
+std::shared_ptr<const Stats::DumpedStats> Stats::GetDumpedStats() {
+  return std::atomic_load(&dumped_stats_);
+}
+
 string Stats::DumpStatsAsText() {
+  auto dumped = GetDumpedStats();
   stringstream output;
   output << "gauges:\n";
-  for (auto& gauge : gauges_map_) {
+  for (const auto& gauge : dumped->gauges) {
     output << boost::format("  %1%: %2%\n") % gauge.first %
                   gauge.second->load();
   };
 
   output << "labels:\n";
   output << "metrics:\n";
-  auto metric_logger =
-      [&output](TimeseriesHistogramWrapper * thw, const string & metric_name) {
-    Metric metric(thw);
+  for (const auto& metric : dumped->metrics) {
+    const auto v = metric.second->snapshot.Read();
     output << boost::format("  %1%: (average=%2%, count=%3%, maximum=%4%, "
                             "minimum=%5%, p50=%6%, p90=%7%, p99=%8%, "
-                            "p999=%9%, p9999=%10%, sum=%11%)\n") % metric_name %
-                  metric.GetAverageLastMinute() % metric.GetCountLastMinute() %
-                  metric.GetPercentileLastMinute(100) %
-                  metric.GetPercentileLastMinute(0) %
-                  metric.GetPercentileLastMinute(50) %
-                  metric.GetPercentileLastMinute(90) %
-                  metric.GetPercentileLastMinute(99) %
-                  metric.GetPercentileLastMinute(99.9) %
-                  metric.GetPercentileLastMinute(99.99) %
-                  metric.GetSumLastMinute();
-    output
-        << boost::format("  %1%: (average=%2%, count=%3%, maximum=%4%, "
-                         "minimum=%5%, p50=%6%, p90=%7%, p99=%8%, "
-                         "p999=%9%, p9999=%10%, sum=%11%)\n") %
-               GetTotalName(metric_name) %
-               metric.GetAverageTotal() % metric.GetCountTotal() %
-               metric.GetPercentileTotal(100) % metric.GetPercentileTotal(0) %
-               metric.GetPercentileTotal(50) % metric.GetPercentileTotal(90) %
-               metric.GetPercentileTotal(99) % metric.GetPercentileTotal(99.9) %
-               metric.GetPercentileTotal(99.99) % metric.GetSumTotal();
-  };
+                            "p999=%9%, p9999=%10%, sum=%11%)\n") %
+                  metric.first % v[0] % v[1] % v[2] % v[3] % v[4] % v[5] %
+                  v[6] % v[7] % v[8] % v[9];
+    output << boost::format("  %1%: (average=%2%, count=%3%, maximum=%4%, "
+                            "minimum=%5%, p50=%6%, p90=%7%, p99=%8%, "
+                            "p999=%9%, p9999=%10%, sum=%11%)\n") %
+                  GetTotalName(metric.first) % v[10] % v[11] % v[12] %
+                  v[13] % v[14] % v[15] % v[16] % v[17] % v[18] % v[19];
+  }
 
-  for (uint32_t i = 0; i < histograms_.size(); ++i) {
-    metric_logger(histograms_[i].get(), (*metric_names_.load())[i]);
+  output << "counters:\n";
+  for (const auto& counter : dumped->counters) {
+    const auto v = counter.second->snapshot.Read();
+    output << boost::format("  %1%: %2%\n") % counter.first % v[0];
+    output << boost::format("  %1%: %2%\n") % GetTotalName(counter.first) %
+                  v[1];
   }
 
-  {
-    lock_guard<mutex> g(lock_histogram_map_);
-    for (auto& histogram : histogram_map_) {
-      metric_logger(histogram.second.get(), histogram.first);
+  return output.str();
+}
+
+namespace {
+
+/**
+ * Split a raw stat name "stats key1=value1 key2=value2" into the OpenMetrics
+ * metric name and the labels: "stats" and "key1=\"value1\",key2=\"value2\"".
+ * The parts with no '=' are dropped.
+ */
+void ParseOpenMetricsName(const string& raw_name, string* name,
+                          string* labels) {
+  vector<folly::StringPiece> parts;
+  folly::split(" ", raw_name, parts, true /* ignoreEmpty */);
+  name->clear();
+  labels->clear();
+  if (parts.empty()) {
+    return;
+  }
+
+  *name = parts[0].str();
+  for (auto& c : *name) {
+    // OpenMetrics names only have [a-zA-Z0-9_:]
+    if (!isalnum(static_cast<unsigned char>(c)) && c != ':') {
+      c = '_';
     }
   }
 
-  output << "counters:\n";
-  auto counter_logger = [&output](MultiLevelTimeSeriesWrapper * mltsw,
-                                  const string & counter_name) {
-    Counter counter(mltsw);
-    output << boost::format("  %1%: %2%\n") % counter_name %
-                  counter.GetLastMinute();
-    output << boost::format("  %1%: %2%\n") % GetTotalName(counter_name) %
-                  counter.GetTotal();
+  for (size_t i = 1; i < parts.size(); ++i) {
+    const auto pos = parts[i].find('=');
+    if (pos == folly::StringPiece::npos) {
+      continue;
+    }
+
+    if (!labels->empty()) {
+      labels->push_back(',');
+    }
+    labels->append(parts[i].data(), pos);
+    labels->append("=\"");
+    for (auto c : parts[i].subpiece(pos + 1)) {
+      if (c == '\\' || c == '"') {
+        labels->push_back('\\');
+      }
+      labels->push_back(c);
+    }
+    labels->push_back('"');
+  }
+}
+
+string WithLabels(const string& labels, const string& extra_label = "") {
+  if (labels.empty() && extra_label.empty()) {
+    return "";
+  }
+
+  if (labels.empty() || extra_label.empty()) {
+    return "{" + labels + extra_label + "}";
+  }
+
+  return "{" + labels + "," + extra_label + "}";
+}
+
+vector<int64_t> GetOpenMetricsBuckets() {
+  vector<int64_t> buckets;
+  vector<folly::StringPiece> bounds;
+  folly::split(",", FLAGS_openmetrics_histogram_buckets, bounds, true);
+  for (const auto& bound : bounds) {
+    try {
+      buckets.push_back(folly::to<int64_t>(folly::trimWhitespace(bound)));
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Invalid histogram bucket " << bound << ": " << e.what();
+    }
+  }
+  std::sort(buckets.begin(), buckets.end());
+  buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+
+  return buckets;
+}
+
+// The number of values <= value at the total level of
+// folly::TimeseriesHistogram, whose values are integers
+uint64_t CountUpTo(const folly::TimeseriesHistogram<int64_t>& ts_histogram,
+                   int64_t value) {
+  uint64_t count = 0;
+  // the last bucket has the values above the max
+  for (size_t i = 0; i + 1 < ts_histogram.getNumBuckets(); ++i) {
+    if (i > 0 && ts_histogram.getBucketMin(i) + ts_histogram.getBucketSize() -
+                 1 > value) {
+      break;
+    }
+    count += ts_histogram.getBucket(i).count(1);
+  }
+
+  return count;
+}
+
+}  // namespace
+
+struct Stats::OpenMetricsDumper::Family {
+  enum class Type {
+    COUNTER,
+    GAUGE,
+    HISTOGRAM,
+  };
+
+  Type type;
+  string name;
+  // labels -> stat
+  vector<std::pair<string, std::shared_ptr<MultiLevelTimeSeriesWrapper>>>
+      counters;
+  vector<std::pair<string, std::atomic<uint64_t>*>> gauges;
+  vector<std::pair<string, std::shared_ptr<TimeseriesHistogramWrapper>>>
+      histograms;
+  vector<int64_t> buckets;
+};
+
+Stats::OpenMetricsDumper::OpenMetricsDumper(Stats* stats)
+    : families_(), next_family_(0), eof_dumped_(false) {
+  // The families share the ownership of the metrics and the counters, which
+  // stay valid if they are evicted meanwhile. The gauges are never removed.
+  std::map<std::pair<Family::Type, string>, unique_ptr<Family>> families;
+  string name;
+  string labels;
+  auto get_family = [&families, &name] (Family::Type type) {
+    auto& family = families[std::make_pair(type, name)];
+    if (family == nullptr) {
+      family = folly::make_unique<Family>();
+      family->type = type;
+      family->name = name;
+    }
+    return family.get();
   };
 
-  for (uint32_t i = 0; i < timeseries_.size(); ++i) {
-    counter_logger(timeseries_[i].get(), (*counter_names_.load())[i]);
+  const auto buckets = GetOpenMetricsBuckets();
+  auto dumped = stats->GetDumpedStats();
+  for (const auto& metric : dumped->metrics) {
+    ParseOpenMetricsName(metric.first, &name, &labels);
+    auto family = get_family(Family::Type::HISTOGRAM);
+    family->histograms.emplace_back(labels, metric.second);
+    family->buckets = buckets;
   }
 
-  {
-    lock_guard<mutex> g(lock_timeseries_map_);
-    for (auto& timeseries : timeseries_map_) {
-      counter_logger(timeseries.second.get(), timeseries.first);
+  for (const auto& counter : dumped->counters) {
+    ParseOpenMetricsName(counter.first, &name, &labels);
+    get_family(Family::Type::COUNTER)->counters.emplace_back(
+        labels, counter.second);
+  }
+
+  for (const auto& gauge : dumped->gauges) {
+    ParseOpenMetricsName(gauge.first, &name, &labels);
+    get_family(Family::Type::GAUGE)->gauges.emplace_back(labels, gauge.second);
+  }
+
+  for (auto& family : families) {
+    families_.push_back(std::move(family.second));
+  }
+}
+
+Stats::OpenMetricsDumper::~OpenMetricsDumper() {}
+
+bool Stats::OpenMetricsDumper::Next(string* out) {
+  if (next_family_ == families_.size()) {
+    if (eof_dumped_) {
+      return false;
     }
+
+    out->append("# EOF\n");
+    eof_dumped_ = true;
+    return true;
   }
 
-  return output.str();
+  const auto& family = *families_[next_family_++];
+  stringstream output;
+  switch (family.type) {
+  case Family::Type::COUNTER:
+    output << "# TYPE " << family.name << " counter\n";
+    for (const auto& counter : family.counters) {
+      output << family.name << "_total" << WithLabels(counter.first) << " "
+             << counter.second->snapshot.Read()[1] << "\n";
+    }
+    break;
+
+  case Family::Type::GAUGE:
+    output << "# TYPE " << family.name << " gauge\n";
+    for (const auto& gauge : family.gauges) {
+      output << family.name << WithLabels(gauge.first) << " "
+             << gauge.second->load() << "\n";
+    }
+    break;
+
+  case Family::Type::HISTOGRAM:
+    output << "# TYPE " << family.name << " histogram\n";
+    for (const auto& histogram : family.histograms) {
+      auto thw = histogram.second.get();
+      vector<uint64_t> bucket_counts;
+      uint64_t count;
+      int64_t sum;
+      {
+        lock_guard<mutex> g(thw->m);
+        const auto now = GetTimeSinceEpochSeconds();
+        if (thw->log_linear) {
+          thw->log_linear->update(now);
+          for (auto bucket : family.buckets) {
+            bucket_counts.push_back(thw->log_linear->countUpTo(bucket, 1));
+          }
+          count = thw->log_linear->count(1);
+          sum = thw->log_linear->sum(1);
+        } else {
+          thw->ts_histogram.update(now);
+          for (auto bucket : family.buckets) {
+            bucket_counts.push_back(CountUpTo(thw->ts_histogram, bucket));
+          }
+          count = thw->ts_histogram.count(1);
+          sum = thw->ts_histogram.sum(1);
+        }
+      }
+
+      for (size_t i = 0; i < family.buckets.size(); ++i) {
+        output << family.name << "_bucket"
+               << WithLabels(histogram.first,
+                             "le=\"" + std::to_string(family.buckets[i]) +
+                             "\"")
+               << " " << bucket_counts[i] << "\n";
+      }
+      output << family.name << "_bucket"
+             << WithLabels(histogram.first, "le=\"+Inf\"") << " " << count
+             << "\n";
+      output << family.name << "_count" << WithLabels(histogram.first) << " "
+             << count << "\n";
+      output << family.name << "_sum" << WithLabels(histogram.first) << " "
+             << sum << "\n";
+    }
+    break;
+  }
+
+  out->append(output.str());
+  return true;
 }
+
+string Stats::DumpStatsAsOpenMetrics() {
+  OpenMetricsDumper dumper(this);
+  string output;
+  while (dumper.Next(&output)) {
+  }
+
+  return output;
+}
+
 }  // namespace common
@@ -60,6 +60,25 @@
  * Dynamic stats and pre-defined stats can be used together. i.e., some stats
  * are pre-defined,
  * while others are dynamic.
+ *
+ * A dynamic stat can be resolved to a handle once, e.g., when a db is added,
+ * for the hot paths to update it as cheaply as a pre-defined stat, with no
+ * string building or hashing per update.
+ *
+ * auto handle = Stats::get()->GetCounterHandle(counter, {{"db", db_name}});
+ * Stats::get()->Incr(handle, 100);
+ *
+ * With Stats::SetUseLogLinearHistograms(true) called before any other Stats
+ * function, the metrics use log linear histograms instead, with no range
+ * limit, a precision of 1/16 of the value over the whole range, and lock free
+ * recording. See log_linear_histogram.h.
+ *
+ * To bound the memory of the dynamic stats, --stats_max_dynamic_stats_per_name
+ * caps the number of stats with the same name and different tags, the extra
+ * ones going to the stat "<name> overflow=true". With
+ * --stats_idle_eviction_minutes, the dynamic stats not updated for so long
+ * are removed, and start over if they are updated again. The gauge
+ * stats_memory_bytes is the memory used by all the stats, approximately.
  */
 
 #pragma once
@@ -71,30 +90,58 @@
 #endif
 
 #include <folly/ThreadLocal.h>
+#include <gflags/gflags.h>
 #include <folly/stats/Histogram.h>
 #include <folly/stats/MultiLevelTimeSeries.h>
 #include <folly/stats/TimeseriesHistogram.h>
+#include "common/stats/log_linear_histogram.h"
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+DECLARE_int32(stats_max_dynamic_stats_per_name);
+DECLARE_int32(stats_idle_eviction_minutes);
+
 namespace common {
 
 class LocalStats;
 
 class Stats {
  public:
+  // The resolved dynamic stats
+  struct CounterHandle {
+    uint32_t idx;
+  };
+  struct MetricHandle {
+    uint32_t idx;
+  };
+
+  // (key, value) pairs appended to a stat name as " key=value"
+  using Tags = std::vector<std::pair<std::string, std::string>>;
+
   // Counter update functions.
   void Incr(const uint32_t counter, uint64_t value = 1);
   void Incr(const std::string& counter, uint64_t value = 1);
+  void Incr(const CounterHandle counter, uint64_t value = 1);
 
   // Metric update functions.
   void AddMetric(const uint32_t metric, int64_t value);
   void AddMetric(const std::string& metric, int64_t value);
+  void AddMetric(const MetricHandle metric, int64_t value);
+
+  // Resolve the dynamic stat named counter / metric with tags to a handle.
+  // The same name always resolves to the same handle, and the updates through
+  // it go to the same stat as the ones by name.
+  CounterHandle GetCounterHandle(const std::string& counter,
+                                 const Tags& tags = Tags());
+  MetricHandle GetMetricHandle(const std::string& metric,
+                               const Tags& tags = Tags());
 
   // Register callback for Counter / Metric / Gauge so they will be reported
   // periodically by the Stats class.
@@ -110,37 +157,110 @@ class Stats {
   static void init(const std::vector<std::string>* counter_names,
                    const std::vector<std::string>* metric_names);
 
+  /*
+   * The values of a stat as dumped by DumpStatsAsText, published by the flush
+   * thread so that the dumps read them without any lock. It is double
+   * buffered: Publish() writes the buffer not being read, and Read() retries
+   * in the unlikely case a second Publish() started while it was reading.
+   * Publish() must be called by one thread only.
+   */
+  template <size_t N>
+  class StatSnapshot {
+   public:
+    StatSnapshot() : started_(0), published_(0) {
+      for (auto& buffer : buffers_) {
+        for (auto& value : buffer) {
+          value.store(0, std::memory_order_relaxed);
+        }
+      }
+    }
+
+    void Publish(const std::array<int64_t, N>& values) {
+      const auto n = published_.load(std::memory_order_relaxed) + 1;
+      started_.store(n, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      for (size_t i = 0; i < N; ++i) {
+        buffers_[n & 1][i].store(values[i], std::memory_order_relaxed);
+      }
+      published_.store(n, std::memory_order_release);
+    }
+
+    std::array<int64_t, N> Read() const {
+      std::array<int64_t, N> values;
+      while (true) {
+        const auto n = published_.load(std::memory_order_acquire);
+        for (size_t i = 0; i < N; ++i) {
+          values[i] = buffers_[n & 1][i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // Publish(n + 1) writes the other buffer
+        if (started_.load(std::memory_order_relaxed) <= n + 1) {
+          return values;
+        }
+      }
+    }
+
+   private:
+    std::atomic<uint64_t> started_;
+    std::atomic<uint64_t> published_;
+    std::array<std::atomic<int64_t>, N> buffers_[2];
+  };
+
+  // last minute and total
+  static const size_t kCounterSnapshotSize = 2;
+  // average, count, maximum, minimum, p50, p90, p99, p999, p9999 and sum, for
+  // the last minute and then the total
+  static const size_t kMetricSnapshotSize = 20;
+
   struct MultiLevelTimeSeriesWrapper {
     folly::MultiLevelTimeSeries<uint64_t> timeseries;
     std::mutex m;
+    // set by the flushes, cleared when the snapshot is published
+    std::atomic<bool> dirty;
+    StatSnapshot<kCounterSnapshotSize> snapshot;
+    // the time of the last flush, only used by the flush thread
+    std::chrono::seconds last_flush;
 
     MultiLevelTimeSeriesWrapper(
         const folly::MultiLevelTimeSeries<uint64_t>& timeseries_arg)
-        : timeseries(timeseries_arg), m() {}
+        : timeseries(timeseries_arg), m(), dirty(true), snapshot(),
+          last_flush(0) {}
   };
 
   struct TimeseriesHistogramWrapper {
     folly::TimeseriesHistogram<int64_t> ts_histogram;
+    // used instead of ts_histogram if set
+    std::unique_ptr<LogLinearTimeseries> log_linear;
     std::mutex m;
+    // set by the flushes, cleared when the snapshot is published
+    std::atomic<bool> dirty;
+    StatSnapshot<kMetricSnapshotSize> snapshot;
+    // the time of the last flush, only used by the flush thread
+    std::chrono::seconds last_flush;
 
     TimeseriesHistogramWrapper(
         const folly::TimeseriesHistogram<int64_t>& ts_histogram_arg)
-        : ts_histogram(ts_histogram_arg), m() {}
+        : ts_histogram(ts_histogram_arg), log_linear(), m(), dirty(true),
+          snapshot(), last_flush(0) {}
   };
 
+  // Counter and Metric share the ownership of their stat, so that they stay
+  // valid after the stat is evicted for being idle.
   class Counter {
    public:
-    explicit Counter(MultiLevelTimeSeriesWrapper* ts_wrapper_arg);
+    explicit Counter(
+      std::shared_ptr<MultiLevelTimeSeriesWrapper> ts_wrapper_arg);
     uint64_t GetTotal();
     uint64_t GetLastMinute();
 
    private:
-    MultiLevelTimeSeriesWrapper* ts_wrapper_;
+    std::shared_ptr<MultiLevelTimeSeriesWrapper> ts_wrapper_;
   };
 
   class Metric {
    public:
-    explicit Metric(TimeseriesHistogramWrapper* hist_wrapper_arg);
+    explicit Metric(
+      std::shared_ptr<TimeseriesHistogramWrapper> hist_wrapper_arg);
 
     int64_t GetPercentileLastMinute(double pct);
     int64_t GetPercentileTotal(double pct);
@@ -152,7 +272,7 @@ class Stats {
     int64_t GetCountTotal();
 
    private:
-    TimeseriesHistogramWrapper* hist_wrapper_;
+    std::shared_ptr<TimeseriesHistogramWrapper> hist_wrapper_;
   };
 
   class Gauge {
@@ -178,12 +298,49 @@ class Stats {
   std::unique_ptr<Gauge> GetGauge(const std::string& gauge);
 
   // Dumps all the stats in the form of text (formatted similar to how java's
-  // ostrich library dumps stats).
+  // ostrich library dumps stats). It reads the snapshots published by the
+  // flush thread, without taking any of the locks used for flushing, so the
+  // output lags the stats by up to a second and a flush interval.
   std::string DumpStatsAsText();
 
+  /*
+   * Dumps all the stats in the OpenMetrics text format, one metric family per
+   * Next() call, so that a scrape streams its output instead of building it
+   * as one string. The " key=value" tags of a stat name become labels, the
+   * metrics are histograms with the --openmetrics_histogram_buckets buckets
+   * and the counters and the metrics report their totals. It dumps the stats
+   * listed by the flush thread when it is created, without the stat map
+   * locks.
+   */
+  class OpenMetricsDumper {
+   public:
+    explicit OpenMetricsDumper(Stats* stats);
+    ~OpenMetricsDumper();
+
+    // Append the next metric family to out, and "# EOF" after the last one.
+    // Return false if everything has been dumped.
+    bool Next(std::string* out);
+
+   private:
+    struct Family;
+
+    std::vector<std::unique_ptr<Family>> families_;
+    size_t next_family_;
+    bool eof_dumped_;
+  };
+
+  // Dumps all the stats in the OpenMetrics text format as one string.
+  std::string DumpStatsAsOpenMetrics();
+
   // Set the number of seconds per min, used for test to reduce testing time
   static void SetSecondsPerMin(uint32_t n) { nSecondsPerMin_.store(n); }
 
+  // Use log linear histograms for the metrics. It must be called before get()
+  // is used.
+  static void SetUseLogLinearHistograms(bool use) {
+    useLogLinearHistograms_.store(use);
+  }
+
  private:
   friend class LocalStats;
 
@@ -195,12 +352,55 @@ class Stats {
   void FlushMetric(const std::string& metric,
                    const folly::Histogram<int64_t>& histogram,
                    std::chrono::seconds time_epoch_seconds);
+  void FlushMetric(const uint32_t metric,
+                   const LogLinearHistogram& histogram,
+                   std::chrono::seconds time_epoch_seconds);
+  void FlushMetric(const std::string& metric,
+                   const LogLinearHistogram& histogram,
+                   std::chrono::seconds time_epoch_seconds);
   void FlushCounter(const uint32_t counter, uint64_t sum,
                     std::chrono::seconds time_epoch_seconds);
   void FlushCounter(const std::string& counter, uint64_t sum,
                     std::chrono::seconds time_epoch_seconds);
   void FlushGauge(const std::string& counter, uint64_t value);
 
+  // The dynamic metric to flush metric to, created if needed
+  TimeseriesHistogramWrapper* GetDynamicMetric(const std::string& metric,
+                                               bool use_log_linear);
+
+  // The names of the stats with handles
+  std::string GetHandleCounterName(const uint32_t counter);
+  std::string GetHandleMetricName(const uint32_t metric);
+
+  // The list of all the stats, to dump them without the stat map locks. It
+  // shares the ownership of the stats, so that the evicted ones stay valid
+  // until the dumps using them are done.
+  struct DumpedStats {
+    std::vector<std::pair<std::string,
+                          std::shared_ptr<TimeseriesHistogramWrapper>>>
+        metrics;
+    std::vector<std::pair<std::string,
+                          std::shared_ptr<MultiLevelTimeSeriesWrapper>>>
+        counters;
+    std::vector<std::pair<std::string, std::atomic<uint64_t>*>> gauges;
+  };
+
+  // Called by the flush thread once per second, after a flush, to publish
+  // the snapshots of the stats that may have changed, and a new DumpedStats
+  // if stats were added. Publishing after every flush would cost more than
+  // the flushes for the many histograms.
+  void PublishSnapshots();
+
+  // Returns the last DumpedStats published, never nullptr.
+  std::shared_ptr<const DumpedStats> GetDumpedStats();
+
+  // Called by the flush thread to remove the dynamic stats with no flush for
+  // --stats_idle_eviction_minutes.
+  void EvictIdleStats(std::chrono::seconds now);
+
+  // The bytes used by the stats in the stat maps, approximately
+  size_t GetMemoryUsage();
+
   Stats();
   ~Stats();
 
@@ -212,19 +412,31 @@ class Stats {
   // Thread local stats.
   folly::ThreadLocalPtr<LocalStats, Stats> local_stats_;
 
-  std::vector<std::unique_ptr<TimeseriesHistogramWrapper>> histograms_;
-  std::vector<std::unique_ptr<MultiLevelTimeSeriesWrapper>> timeseries_;
+  std::vector<std::shared_ptr<TimeseriesHistogramWrapper>> histograms_;
+  std::vector<std::shared_ptr<MultiLevelTimeSeriesWrapper>> timeseries_;
 
-  std::unordered_map<std::string, std::unique_ptr<TimeseriesHistogramWrapper>>
+  std::unordered_map<std::string, std::shared_ptr<TimeseriesHistogramWrapper>>
       histogram_map_;
   std::mutex lock_histogram_map_;
-  std::unordered_map<std::string, std::unique_ptr<MultiLevelTimeSeriesWrapper>>
+  std::unordered_map<std::string, std::shared_ptr<MultiLevelTimeSeriesWrapper>>
       timeseries_map_;
   std::mutex lock_timeseries_map_;
   std::unordered_map<std::string, std::unique_ptr<std::atomic<uint64_t>>> gauges_map_;
   std::mutex lock_gauges_map_;
 
+  // Only accessed through std::atomic_load() and std::atomic_store()
+  std::shared_ptr<const DumpedStats> dumped_stats_;
+  // Set when stats are added to or removed from the stat maps, only used by
+  // the flush thread
+  bool dumped_stats_stale_;
+
+  // The number of dynamic stats per name in histogram_map_ and
+  // timeseries_map_, only used by the flush thread
+  std::unordered_map<std::string, uint32_t> metric_name_counts_;
+  std::unordered_map<std::string, uint32_t> counter_name_counts_;
+
   static std::atomic<uint32_t> nSecondsPerMin_;
+  static std::atomic<bool> useLogLinearHistograms_;
   static std::atomic<const std::vector<std::string>*> counter_names_;
   static std::atomic<const std::vector<std::string>*> metric_names_;
 
@@ -238,6 +450,13 @@ class Stats {
   std::unordered_map<std::string, std::function<uint64_t()>> counter_callbacks_;
   std::unordered_map<std::string, std::function<int64_t()>> metrics_callbacks_;
   std::unordered_map<std::string, std::function<uint64_t()>> gauge_callbacks_;
+
+  // The stats with handles, handle idx -> name and name -> handle idx
+  std::mutex lock_handles_;
+  std::vector<std::string> handle_counter_names_;
+  std::unordered_map<std::string, uint32_t> handle_counters_;
+  std::vector<std::string> handle_metric_names_;
+  std::unordered_map<std::string, uint32_t> handle_metrics_;
 };
 
 }  // namespace common
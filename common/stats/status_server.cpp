@@ -22,25 +22,135 @@
 #include <stdio.h>
 #include <stddef.h>
 
+#include <folly/Conv.h>
+#include <folly/String.h>
 #include <folly/Uri.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <microhttpd.h>
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <utility>
 #include "common/stats/stats.h"
 
 DEFINE_int32(
     http_status_port, 9999,
     "Port at which status information such as build info/stats is exported.");
+DEFINE_int32(
+    http_status_max_connections, 32,
+    "The max number of status requests served at a time, each by a thread.");
 
 namespace common {
 
 namespace {
 
+const char kOpenMetricsPath[] = "/metrics";
+const char kOpenMetricsContentType[] =
+  "application/openmetrics-text; version=1.0.0; charset=utf-8";
+const size_t kStreamBlockSize = 64 * 1024;
+
+// Read a jemalloc stat, 0 if it isn't there, e.g., in an older jemalloc
+template <typename T>
+uint64_t ReadMallctl(const std::string& name) {
+  T value = 0;
+  size_t size = sizeof(value);
+  if (mallctl(name.c_str(), &value, &size, nullptr, 0) != 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(value);
+}
+
+// The jemalloc stats of the process and of each arena in use, in the
+// stats.txt format. The arenas created for the RocksDB block caches tell how
+// much of the heap they hold, and how fragmented the rest of it is.
+std::string DumpJemallocStats() {
+  // The stats are a snapshot taken at the last epoch
+  uint64_t epoch = 1;
+  size_t size = sizeof(epoch);
+  if (mallctl("epoch", &epoch, &size, &epoch, size) != 0) {
+    return "";
+  }
+
+  std::string stats;
+  for (const char* name : {"allocated", "active", "resident", "mapped",
+                           "metadata", "retained"}) {
+    stats += folly::stringPrintf(
+      "  jemalloc_%s: %" PRIu64 "\n", name,
+      ReadMallctl<size_t>(std::string("stats.") + name));
+  }
+
+  const auto page_size = ReadMallctl<size_t>("arenas.page");
+  const auto n_arenas = ReadMallctl<unsigned>("arenas.narenas");
+  for (uint64_t i = 0; i < n_arenas; ++i) {
+    const auto prefix = folly::to<std::string>("stats.arenas.", i, ".");
+    const auto active = ReadMallctl<size_t>(prefix + "pactive") * page_size;
+    const auto dirty = ReadMallctl<size_t>(prefix + "pdirty") * page_size;
+    if (active == 0 && dirty == 0) {
+      // not used yet
+      continue;
+    }
+    stats += folly::stringPrintf(
+      "  jemalloc_arena_active arena=%" PRIu64 ": %" PRIu64 "\n"
+      "  jemalloc_arena_dirty arena=%" PRIu64 ": %" PRIu64 "\n"
+      "  jemalloc_arena_allocated arena=%" PRIu64 ": %" PRIu64 "\n"
+      "  jemalloc_arena_threads arena=%" PRIu64 ": %" PRIu64 "\n",
+      i, active, i, dirty,
+      i, ReadMallctl<size_t>(prefix + "small.allocated") +
+        ReadMallctl<size_t>(prefix + "large.allocated"),
+      i, ReadMallctl<unsigned>(prefix + "nthreads"));
+  }
+  return stats;
+}
+
+const std::string* FindArgument(const StatusServer::Arguments* args,
+                                const std::string& key) {
+  if (args == nullptr) {
+    return nullptr;
+  }
+  for (const auto& arg : *args) {
+    if (arg.first == key) {
+      return &arg.second;
+    }
+  }
+  return nullptr;
+}
+
+// The state of a streamed response
+struct ResponseStream {
+  explicit ResponseStream(StatusServer::ChunkReader r)
+      : reader(std::move(r)), chunk(), offset(0) {}
+
+  StatusServer::ChunkReader reader;
+  std::string chunk;
+  size_t offset;
+};
+
+ssize_t ReadResponse(void* cls, uint64_t pos, char* buf, size_t max) {
+  auto stream = reinterpret_cast<ResponseStream*>(cls);
+  while (stream->offset == stream->chunk.size()) {
+    stream->chunk.clear();
+    stream->offset = 0;
+    if (!stream->reader(&stream->chunk)) {
+      return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+  }
+
+  const auto n = std::min(max, stream->chunk.size() - stream->offset);
+  memcpy(buf, stream->chunk.data() + stream->offset, n);
+  stream->offset += n;
+  return n;
+}
+
+void FreeResponse(void* cls) {
+  delete reinterpret_cast<ResponseStream*>(cls);
+}
+
 int ServeCallback(void* param, struct MHD_Connection* connection,
                   const char* url, const char* method, const char* version,
                   const char* upload_data, size_t* upload_data_size,
@@ -73,6 +183,21 @@ int ServeCallback(void* param, struct MHD_Connection* connection,
         return MHD_YES;
       },
       &args);
+  auto reader = server->GetPageReader(url, &args);
+  if (reader) {
+    // stream the chunks one by one as they are produced
+    response = MHD_create_response_from_callback(
+        MHD_SIZE_UNKNOWN, kStreamBlockSize, &ReadResponse,
+        new ResponseStream(std::move(reader)), &FreeResponse);
+    if (0 == strcmp(url, kOpenMetricsPath)) {
+      MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                              kOpenMetricsContentType);
+    }
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+  }
+
   auto str = server->GetPageContent(url, &args);
   response = MHD_create_response_from_data(str.size(),
                                            const_cast<char*>(str.c_str()),
@@ -84,46 +209,77 @@ int ServeCallback(void* param, struct MHD_Connection* connection,
 }  // namespace
 
 StatusServer* StatusServer::StartStatusServer(
-    EndPointToOPMap op_map, std::set<std::string> extra_stats_endpoints) {
+    EndPointToOPMap op_map, std::set<std::string> extra_stats_endpoints,
+    StreamingEndPointToOPMap streaming_op_map) {
   static StatusServer server(FLAGS_http_status_port, std::move(op_map),
-                             std::move(extra_stats_endpoints));
+                             std::move(extra_stats_endpoints),
+                             std::move(streaming_op_map));
   return &server;
 }
 
 void StatusServer::StartStatusServerOrDie(
-    EndPointToOPMap op_map, std::set<std::string> extra_stats_endpoints) {
+    EndPointToOPMap op_map, std::set<std::string> extra_stats_endpoints,
+    StreamingEndPointToOPMap streaming_op_map) {
   static StatusServer server(FLAGS_http_status_port, std::move(op_map),
-                             std::move(extra_stats_endpoints));
+                             std::move(extra_stats_endpoints),
+                             std::move(streaming_op_map));
   CHECK(server.Serving());
 }
 
 StatusServer::StatusServer(uint16_t port, EndPointToOPMap op_map,
-                           std::set<std::string> extra_stats_endpoints)
+                           std::set<std::string> extra_stats_endpoints,
+                           StreamingEndPointToOPMap streaming_op_map)
     : port_(port), d_(nullptr), op_map_(std::move(op_map)),
-      extra_stats_endpoints_(std::move(extra_stats_endpoints)) {
+      extra_stats_endpoints_(std::move(extra_stats_endpoints)),
+      streaming_op_map_(std::move(streaming_op_map)) {
 
   extra_stats_endpoints_.emplace("/rocksdb_info.txt");
+  extra_stats_endpoints_.emplace("/jemalloc_stats.txt");
   // prevent infinite recursion...
   extra_stats_endpoints_.erase("/stats.txt");
   // Text
-  op_map_.emplace("/stats.txt", [this]
-      (const Arguments*) {
-    std::string ret = common::Stats::get()->DumpStatsAsText();
+  streaming_op_map_.emplace("/stats.txt", [this] (const Arguments*) {
+    return StatsTextReader();
+  });
 
-    for (const auto& endpoint_name : extra_stats_endpoints_) {
-      auto itor = op_map_.find(endpoint_name);
-      if (itor != op_map_.end()) {
-        ret += itor->second(nullptr);
-      }
-    }
-    return ret;
+  // stream the families one by one as they are dumped
+  streaming_op_map_.emplace(kOpenMetricsPath, [] (const Arguments*) {
+    auto dumper = std::make_shared<Stats::OpenMetricsDumper>(Stats::get());
+    return [dumper] (std::string* chunk) {
+      return dumper->Next(chunk);
+    };
   });
 
-  // dump_heap
+  op_map_.emplace("/jemalloc_stats.txt",
+                  [] (const Arguments*) {
+                    return DumpJemallocStats();
+                  });
+
+  // dump_heap to the jemalloc prof_prefix. The path isn't taken from the
+  // request, as anyone reaching the port could overwrite any file we can.
+  // Needs a jemalloc built with --enable-prof, and MALLOC_CONF=prof:true.
   op_map_.emplace("/dump_heap",
                   [] (const Arguments*) {
                     auto ret = mallctl("prof.dump", nullptr, nullptr, nullptr, 0);
-                    return strerror(ret);
+                    return std::string(strerror(ret));
+                  });
+
+  // ?active=true|false starts or stops sampling allocations for the heap
+  // profiles, so that it only costs while being looked into. It may start
+  // inactive with MALLOC_CONF=prof:true,prof_active:false.
+  op_map_.emplace("/heap_profile",
+                  [] (const Arguments* args) {
+                    auto active_arg = FindArgument(args, "active");
+                    bool active;
+                    if (active_arg == nullptr) {
+                      active = ReadMallctl<bool>("prof.active") != 0;
+                      return std::string("active: ") +
+                        (active ? "true" : "false") + "\n";
+                    }
+                    active = *active_arg == "true" || *active_arg == "1";
+                    auto ret = mallctl("prof.active", nullptr, nullptr,
+                                       &active, sizeof(active));
+                    return std::string(strerror(ret));
                   });
 
   op_map_.emplace("/gflags.txt",
@@ -145,32 +301,111 @@ StatusServer::StatusServer(uint16_t port, EndPointToOPMap op_map,
   }
 }
 
-std::string StatusServer::GetPageContent(const std::string& end_point, Arguments* args) {
+std::string StatusServer::ParseEndPoint(const std::string& end_point,
+                                        Arguments* args) {
   // Add dummy url to allow it to be parsed by folly:Uri.
   // Note: folly:Uri is not thread-safe!
   folly::Uri u("http://blah.blah" + end_point);
 
+  auto params = u.getQueryParams();
+  for (const auto& p : params) {
 #if __GNUC__ >= 8
-  auto iter = op_map_.find(u.path());
+    args->emplace_back(p.first, p.second);
 #else
-  auto iter = op_map_.find(u.path().toStdString());
+    args->emplace_back(p.first.toStdString(), p.second.toStdString());
 #endif
-  if (iter == op_map_.end()) {
-    return "Unsupported http path: " + end_point + "!\n";
   }
 
-  auto params = u.getQueryParams();
-  for (const auto& p : params) {
 #if __GNUC__ >= 8
-    args->emplace_back(p.first, p.second);
+  return u.path();
 #else
-    args->emplace_back(p.first.toStdString(), p.second.toStdString());
+  return u.path().toStdString();
 #endif
+}
+
+std::string StatusServer::GetPageContent(const std::string& end_point, Arguments* args) {
+  Arguments parsed_args;
+  const auto path = ParseEndPoint(end_point, &parsed_args);
+  auto iter = op_map_.find(path);
+  if (iter != op_map_.end()) {
+    args->insert(args->end(), parsed_args.begin(), parsed_args.end());
+    return iter->second(args);
+  }
+
+  auto reader = GetPageReader(end_point, args);
+  if (!reader) {
+    return "Unsupported http path: " + end_point + "!\n";
   }
 
+  std::string content;
+  while (reader(&content)) {
+  }
+  return content;
+}
+
+StatusServer::ChunkReader StatusServer::GetPageReader(
+    const std::string& end_point, Arguments* args) {
+  Arguments parsed_args;
+  const auto path = ParseEndPoint(end_point, &parsed_args);
+  // plain endpoints go first, as for /stats.txt before
+  if (op_map_.count(path) != 0) {
+    return nullptr;
+  }
+
+  auto iter = streaming_op_map_.find(path);
+  if (iter == streaming_op_map_.end()) {
+    return nullptr;
+  }
+
+  args->insert(args->end(), parsed_args.begin(), parsed_args.end());
   return iter->second(args);
 }
 
+StatusServer::ChunkReader StatusServer::StatsTextReader() {
+  struct State {
+    bool dumped_stats;
+    std::set<std::string>::const_iterator next_endpoint;
+    // of the streamed extra endpoint being read, if any
+    ChunkReader endpoint_reader;
+  };
+
+  auto state = std::make_shared<State>();
+  state->dumped_stats = false;
+  state->next_endpoint = extra_stats_endpoints_.begin();
+  return [this, state] (std::string* chunk) {
+    if (!state->dumped_stats) {
+      state->dumped_stats = true;
+      *chunk += common::Stats::get()->DumpStatsAsText();
+      return true;
+    }
+
+    while (true) {
+      if (state->endpoint_reader) {
+        if (state->endpoint_reader(chunk)) {
+          return true;
+        }
+        state->endpoint_reader = nullptr;
+      }
+
+      if (state->next_endpoint == extra_stats_endpoints_.end()) {
+        return false;
+      }
+
+      const auto& endpoint_name = *state->next_endpoint++;
+      auto itor = op_map_.find(endpoint_name);
+      if (itor != op_map_.end()) {
+        *chunk += itor->second(nullptr);
+        return true;
+      }
+
+      auto streaming_itor = streaming_op_map_.find(endpoint_name);
+      if (streaming_itor != streaming_op_map_.end()) {
+        state->endpoint_reader = streaming_itor->second(nullptr);
+      }
+    }
+  };
+}
+
 void StatusServer::Stop() {
   if (d_) {
     MHD_stop_daemon(d_);
@@ -179,8 +414,12 @@ void StatusServer::Stop() {
 
 bool StatusServer::Serve() {
   LOG(INFO) << "Starting status server at " << port_;
-  d_ = MHD_start_daemon(MHD_USE_POLL_INTERNALLY, port_, nullptr, nullptr,
-                        &ServeCallback, this, MHD_OPTION_END);
+  d_ = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL, port_,
+                        nullptr, nullptr, &ServeCallback, this,
+                        MHD_OPTION_CONNECTION_LIMIT,
+                        static_cast<unsigned int>(
+                          std::max(FLAGS_http_status_max_connections, 1)),
+                        MHD_OPTION_END);
   return (d_ != nullptr);
 }
 
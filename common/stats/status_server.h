@@ -17,7 +17,14 @@
  * An StatusServer based on libmicrohttpd.
  * http://www.gnu.org/software/libmicrohttpd/
  *
- * Used for exporting stats, deploy commit etc.
+ * Used for exporting stats, deploy commit etc. /stats.txt has the stats in
+ * the ostrich text format, and /metrics streams them in the OpenMetrics text
+ * format. /jemalloc_stats.txt has the heap usage of the process and of each
+ * jemalloc arena, /heap_profile turns the jemalloc heap profiling on and off,
+ * and /dump_heap dumps a heap profile to the jemalloc prof_prefix.
+ *
+ * Each connection is served by a thread of its own, so that a slow endpoint
+ * doesn't hold up the other requests.
  */
 
 #pragma once
@@ -51,6 +58,22 @@ class StatusServer {
   using Arguments = std::vector<std::pair<std::string, std::string>>;
   using EndPointToOPMap = std::map<std::string, std::function<std::string(const Arguments*)>>;
 
+  /*
+   * \brief Endpoint/function name to streamed response mapping.
+   *
+   * For the endpoints with large results. The std::function takes the
+   * arguments like the ones of EndPointToOPMap and returns a ChunkReader,
+   * which is called for the next chunk of the response each time the client
+   * is ready for more. The whole result is thus never held in memory.
+   *
+   * A ChunkReader appends the next chunk to its argument and returns true,
+   * or returns false once the response is complete. It is called from one
+   * thread at a time.
+   */
+  using ChunkReader = std::function<bool(std::string*)>;
+  using StreamingEndPointToOPMap =
+    std::map<std::string, std::function<ChunkReader(const Arguments*)>>;
+
   /*!
    * \brief Instantiate a StatusServer.
    *
@@ -67,13 +90,17 @@ class StatusServer {
    * Metrics format(there should be 2 empty space at the beginning of each line):
    *   metrics_name1: metrics_value1
    *   metrics_name2 tag_name2=tag_value12 metrics_value2
+   * Extra endpoints may be streaming ones.
+   * @param streaming_op_map The endpoints whose responses are streamed.
    */
   static StatusServer* StartStatusServer(EndPointToOPMap op_map = EndPointToOPMap(),
-                                         std::set<std::string> extra_stats_endpoints = {});
+                                         std::set<std::string> extra_stats_endpoints = {},
+                                         StreamingEndPointToOPMap streaming_op_map = {});
   // Instantiate a StatusServer or Die.
   static void StartStatusServerOrDie(
       EndPointToOPMap op_map = EndPointToOPMap(),
-      std::set<std::string> extra_stats_endpoints = {});
+      std::set<std::string> extra_stats_endpoints = {},
+      StreamingEndPointToOPMap streaming_op_map = {});
 
   /*!
    * \brief Executes the function corresponding to the given end_point.
@@ -82,6 +109,14 @@ class StatusServer {
    */
   std::string GetPageContent(const std::string& end_point, Arguments* args);
 
+  /*!
+   * \brief Starts the streamed response of the given end_point.
+   * @param end_point The requested end point, including the query.
+   * @return The reader of the response, or nullptr if end_point is not a
+   * streaming endpoint.
+   */
+  ChunkReader GetPageReader(const std::string& end_point, Arguments* args);
+
   // Stop the HTTP serving daemon. Not currently used.
   // Add to shutdown hook when available.
   void Stop();
@@ -91,7 +126,16 @@ class StatusServer {
 
  private:
   StatusServer(uint16_t port, EndPointToOPMap op_map,
-               std::set<std::string> extra_stats_endpoints);
+               std::set<std::string> extra_stats_endpoints,
+               StreamingEndPointToOPMap streaming_op_map);
+
+  // The path of end_point, with its query params appended to args
+  static std::string ParseEndPoint(const std::string& end_point,
+                                   Arguments* args);
+
+  // The reader of /stats.txt, which streams the stats and then the result
+  // of each extra stats endpoint
+  ChunkReader StatsTextReader();
 
   // Start the server and return true if the serve starts successfully.
   bool Serve();
@@ -102,5 +146,6 @@ class StatusServer {
 
   EndPointToOPMap op_map_;
   std::set<std::string> extra_stats_endpoints_;
+  StreamingEndPointToOPMap streaming_op_map_;
 };
 }  // namespace common
@@ -0,0 +1,168 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+/**
+ * Unit tests for log_linear_histogram.h
+ */
+
+#include "common/stats/log_linear_histogram.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using common::AtomicLogLinearHistogram;
+using common::LogLinearHistogram;
+using common::LogLinearTimeseries;
+using std::chrono::seconds;
+
+namespace {
+
+TEST(LogLinearHistogramTest, Buckets) {
+  for (int64_t v = 0; v < 100000; ++v) {
+    const auto idx = LogLinearHistogram::BucketIndex(v);
+    EXPECT_LE(LogLinearHistogram::BucketMin(idx), v);
+    EXPECT_GT(LogLinearHistogram::BucketMin(idx) +
+              LogLinearHistogram::BucketWidth(idx), v);
+  }
+
+  // the buckets are contiguous
+  for (uint32_t i = 1; i < LogLinearHistogram::kNumBuckets; ++i) {
+    EXPECT_EQ(LogLinearHistogram::BucketMin(i - 1) +
+              LogLinearHistogram::BucketWidth(i - 1),
+              LogLinearHistogram::BucketMin(i));
+  }
+
+  EXPECT_EQ(0, LogLinearHistogram::BucketIndex(-5));
+  EXPECT_EQ(LogLinearHistogram::kNumBuckets - 1,
+            LogLinearHistogram::BucketIndex(INT64_MAX));
+}
+
+TEST(LogLinearHistogramTest, Percentiles) {
+  LogLinearHistogram histogram;
+  EXPECT_EQ(0, histogram.getPercentileEstimate(50));
+
+  for (int64_t v = 1; v <= 1000; ++v) {
+    histogram.addValue(v);
+  }
+  EXPECT_EQ(1000, histogram.count());
+  EXPECT_EQ(500500, histogram.sum());
+  EXPECT_EQ(500, histogram.avg());
+  EXPECT_EQ(1, histogram.getPercentileEstimate(0));
+  EXPECT_NEAR(500, histogram.getPercentileEstimate(50), 500 / 16);
+  EXPECT_NEAR(990, histogram.getPercentileEstimate(99), 990 / 16);
+
+  // the precision is relative to the value over the whole range
+  for (int64_t v = 1; v <= 1000000000; v *= 10) {
+    LogLinearHistogram h;
+    h.addValue(v);
+    EXPECT_NEAR(v, h.getPercentileEstimate(50), v / 16 + 1);
+  }
+}
+
+TEST(LogLinearHistogramTest, CountUpTo) {
+  LogLinearHistogram histogram;
+  for (int64_t v = 0; v < 1000; ++v) {
+    histogram.addValue(v);
+  }
+
+  EXPECT_EQ(0, histogram.countUpTo(-1));
+  EXPECT_EQ(11, histogram.countUpTo(10));
+  // 1023 is the last value of a bucket
+  EXPECT_EQ(1000, histogram.countUpTo(1023));
+  EXPECT_EQ(1000, histogram.countUpTo(INT64_MAX));
+}
+
+TEST(LogLinearHistogramTest, Merge) {
+  LogLinearHistogram h1;
+  LogLinearHistogram h2;
+  for (int64_t v = 0; v < 100; ++v) {
+    h1.addValue(v);
+    h2.addValue(v + 100);
+  }
+
+  h1.merge(h2);
+  EXPECT_EQ(200, h1.count());
+  EXPECT_EQ(19900, h1.sum());
+  EXPECT_NEAR(100, h1.getPercentileEstimate(50), 100 / 16);
+
+  h1.clear();
+  EXPECT_EQ(0, h1.count());
+  EXPECT_EQ(0, h1.sum());
+}
+
+TEST(LogLinearHistogramTest, AtomicDrain) {
+  AtomicLogLinearHistogram atomic_histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&atomic_histogram] {
+      for (int64_t v = 0; v < 10000; ++v) {
+        atomic_histogram.addValue(v);
+      }
+    });
+  }
+
+  LogLinearHistogram histogram;
+  for (int i = 0; i < 100; ++i) {
+    atomic_histogram.drainTo(&histogram);
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  atomic_histogram.drainTo(&histogram);
+
+  EXPECT_EQ(40000, histogram.count());
+  EXPECT_EQ(4 * 49995000, histogram.sum());
+
+  LogLinearHistogram empty;
+  atomic_histogram.drainTo(&empty);
+  EXPECT_EQ(0, empty.count());
+}
+
+TEST(LogLinearHistogramTest, Timeseries) {
+  LogLinearTimeseries ts(60);
+  LogLinearHistogram histogram;
+  histogram.addValue(100);
+
+  ts.addValues(seconds(1000), histogram);
+  ts.addValues(seconds(1030), histogram);
+  ts.update(seconds(1030));
+  EXPECT_EQ(2, ts.count(0));
+  EXPECT_EQ(2, ts.count(1));
+
+  ts.update(seconds(1060));
+  EXPECT_EQ(1, ts.count(0));
+  EXPECT_EQ(100, ts.sum(0));
+  EXPECT_EQ(2, ts.count(1));
+  EXPECT_EQ(200, ts.sum(1));
+
+  ts.update(seconds(1200));
+  EXPECT_EQ(0, ts.count(0));
+  EXPECT_EQ(0, ts.getPercentileEstimate(50, 0));
+  EXPECT_EQ(100, ts.avg(1));
+  EXPECT_NEAR(100, ts.getPercentileEstimate(50, 1), 100 / 16);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
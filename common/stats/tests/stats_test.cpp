@@ -227,6 +227,138 @@ TEST_F(StatsTest, StatsHistogramTest) {
   EXPECT_NEAR(190, metric2->GetPercentileTotal(90), 5);
   EXPECT_NEAR(199, metric2->GetPercentileTotal(99), 5);
 }
+
+// Verifies that the updates through handles go to the stats of the same names
+TEST_F(StatsTest, StatHandleTest) {
+  auto counter_handle = Stats::get()->GetCounterHandle("counter4",
+                                                       {{"db", "db00001"}});
+  EXPECT_EQ(counter_handle.idx,
+            Stats::get()->GetCounterHandle("counter4",
+                                           {{"db", "db00001"}}).idx);
+  EXPECT_NE(counter_handle.idx,
+            Stats::get()->GetCounterHandle("counter4",
+                                           {{"db", "db00002"}}).idx);
+  auto metric_handle = Stats::get()->GetMetricHandle("metric4");
+
+  for (int i = 0; i < 100; ++i) {
+    Stats::get()->Incr(counter_handle, 2);
+    Stats::get()->Incr("counter4 db=db00001");
+    Stats::get()->AddMetric(metric_handle, 50);
+  }
+  sleep_for(seconds(1));
+
+  auto counter = Stats::get()->GetCounter("counter4 db=db00001");
+  EXPECT_NE(counter, nullptr);
+  EXPECT_EQ(300, counter->GetTotal());
+  EXPECT_EQ(nullptr, Stats::get()->GetCounter("counter4 db=db00002"));
+
+  auto metric = Stats::get()->GetMetric("metric4");
+  EXPECT_NE(metric, nullptr);
+  EXPECT_EQ(100, metric->GetCountTotal());
+  EXPECT_EQ(5000, metric->GetSumTotal());
+}
+
+TEST(DumpStatsAsTextTest, Snapshots) {
+  for (int i = 0; i < 10; ++i) {
+    Stats::get()->Incr("dump_counter db=db00001", 2);
+    Stats::get()->AddMetric("dump_metric", 7);
+  }
+  sleep_for(seconds(2));
+
+  auto output = Stats::get()->DumpStatsAsText();
+  EXPECT_NE(output.find("  dump_counter db=db00001: 20\n"), std::string::npos);
+  EXPECT_NE(output.find("  dump_counter__TOTAL db=db00001: 20\n"),
+            std::string::npos);
+  EXPECT_NE(output.find("  dump_metric: (average=7, count=10, "),
+            std::string::npos);
+  EXPECT_NE(output.find("  dump_metric__TOTAL: (average=7, count=10, "),
+            std::string::npos);
+
+  // the snapshots are republished after the new flushes
+  Stats::get()->Incr("dump_counter db=db00001", 2);
+  sleep_for(seconds(2));
+  output = Stats::get()->DumpStatsAsText();
+  EXPECT_NE(output.find("  dump_counter__TOTAL db=db00001: 22\n"),
+            std::string::npos);
+}
+
+TEST(OpenMetricsTest, Basics) {
+  for (int i = 0; i < 10; ++i) {
+    Stats::get()->Incr("om_counter db=db00001", 3);
+    Stats::get()->Incr("om.counter");
+    Stats::get()->AddMetric("om_metric db=db00001", i * 10);
+  }
+  sleep_for(seconds(2));
+
+  auto output = Stats::get()->DumpStatsAsOpenMetrics();
+  // om.counter is in the om_counter family
+  EXPECT_NE(output.find("# TYPE om_counter counter\n"), std::string::npos);
+  EXPECT_EQ(output.find("# TYPE om_counter counter\n"),
+            output.rfind("# TYPE om_counter counter\n"));
+  EXPECT_NE(output.find("\nom_counter_total{db=\"db00001\"} 30\n"),
+            std::string::npos);
+  EXPECT_NE(output.find("\nom_counter_total 10\n"), std::string::npos);
+  EXPECT_NE(output.find("# TYPE om_metric histogram\n"),
+            std::string::npos);
+  EXPECT_NE(output.find("om_metric_bucket{db=\"db00001\",le=\"20\"} 3\n"),
+            std::string::npos);
+  EXPECT_NE(output.find("om_metric_bucket{db=\"db00001\",le=\"+Inf\"} 10\n"),
+            std::string::npos);
+  EXPECT_NE(output.find("om_metric_count{db=\"db00001\"} 10\n"),
+            std::string::npos);
+  EXPECT_NE(output.find("om_metric_sum{db=\"db00001\"} 450\n"),
+            std::string::npos);
+  EXPECT_EQ(output.size() - 6, output.rfind("# EOF\n"));
+
+  // the dumper streams one family per call
+  Stats::OpenMetricsDumper dumper(Stats::get());
+  std::string family;
+  uint32_t n = 0;
+  while (dumper.Next(&family)) {
+    ++n;
+  }
+  EXPECT_EQ(output, family);
+  EXPECT_GT(n, 3);
+}
+
+TEST(DynamicStatsLimitsTest, OverflowAndEviction) {
+  FLAGS_stats_max_dynamic_stats_per_name = 2;
+  FLAGS_stats_idle_eviction_minutes = 1;
+  for (int i = 0; i < 4; ++i) {
+    Stats::get()->Incr("limited_counter db=db0000" + std::to_string(i));
+    Stats::get()->AddMetric("limited_metric db=db0000" + std::to_string(i),
+                            10);
+  }
+  sleep_for(seconds(1));
+
+  EXPECT_NE(nullptr, Stats::get()->GetCounter("limited_counter db=db00001"));
+  EXPECT_EQ(nullptr, Stats::get()->GetCounter("limited_counter db=db00002"));
+  EXPECT_EQ(2, Stats::get()->GetCounter(
+    "limited_counter overflow=true")->GetTotal());
+  EXPECT_EQ(nullptr, Stats::get()->GetMetric("limited_metric db=db00003"));
+  EXPECT_EQ(2, Stats::get()->GetMetric(
+    "limited_metric overflow=true")->GetCountTotal());
+
+  auto gauge = Stats::get()->GetGauge("stats_memory_bytes");
+  EXPECT_NE(nullptr, gauge);
+  EXPECT_GT(gauge->GetValue(), 0);
+
+  // a "minute" is kIntervalSeconds
+  sleep_for(seconds(kIntervalSeconds + 2));
+  EXPECT_EQ(nullptr, Stats::get()->GetCounter("limited_counter db=db00001"));
+  EXPECT_EQ(nullptr, Stats::get()->GetMetric("limited_metric db=db00000"));
+  EXPECT_EQ(std::string::npos,
+            Stats::get()->DumpStatsAsText().find("limited_counter"));
+
+  // an evicted stat starts over
+  Stats::get()->Incr("limited_counter db=db00001", 5);
+  sleep_for(seconds(1));
+  EXPECT_EQ(5, Stats::get()->GetCounter(
+    "limited_counter db=db00001")->GetTotal());
+
+  FLAGS_stats_max_dynamic_stats_per_name = 0;
+  FLAGS_stats_idle_eviction_minutes = 0;
+}
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -21,6 +21,7 @@
 
 #include "common/stats/status_server.h"
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -63,7 +64,42 @@ TEST(StatusServerTest, BasicTest) {
       },
   };
 
-  common::StatusServer::StartStatusServer(std::move(endpoint_to_op));
+  common::StatusServer::StreamingEndPointToOPMap streaming_endpoint_to_op = {
+      {
+          "/count",
+          [](const std::vector<std::pair<std::string, std::string>>* v) {
+            auto next = std::make_shared<int>(0);
+            const int n = std::stoi(v->at(0).second);
+            return [next, n] (std::string* chunk) {
+              if (*next == n) {
+                return false;
+              }
+              *chunk += std::to_string((*next)++) + "\n";
+              return true;
+            };
+          }
+      },
+  };
+
+  auto status_server = common::StatusServer::StartStatusServer(
+      std::move(endpoint_to_op), {}, std::move(streaming_endpoint_to_op));
+
+  // Streamed responses are read a chunk at a time
+  std::vector<std::pair<std::string, std::string>> args;
+  auto reader = status_server->GetPageReader("/count?n=3", &args);
+  ASSERT_TRUE(reader != nullptr);
+  std::string chunk;
+  EXPECT_TRUE(reader(&chunk));
+  EXPECT_EQ(chunk, "0\n");
+  EXPECT_TRUE(reader(&chunk));
+  EXPECT_EQ(chunk, "0\n1\n");
+  EXPECT_TRUE(reader(&chunk));
+  EXPECT_FALSE(reader(&chunk));
+  EXPECT_EQ(chunk, "0\n1\n2\n");
+  args.clear();
+  EXPECT_EQ(status_server->GetPageReader("/success.txt", &args), nullptr);
+  args.clear();
+  EXPECT_EQ(status_server->GetPageContent("/count?n=2", &args), "0\n1\n");
 
   CURL *c;
   CURLcode errornum;
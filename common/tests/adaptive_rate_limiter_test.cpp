@@ -0,0 +1,88 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+
+#include "common/adaptive_rate_limiter.h"
+#include "gtest/gtest.h"
+
+using common::AdaptiveRateLimiter;
+
+struct TestClock {
+  static uint32_t GetCurrentTimeSeconds() {
+    return current_time_.load();
+  }
+
+  static void SetCurrentTime(const uint32_t t) {
+    current_time_.store(t);
+  }
+
+  static std::atomic<uint32_t> current_time_;
+};
+
+std::atomic<uint32_t> TestClock::current_time_;
+
+TEST(AdaptiveRateLimiterTest, AIMD) {
+  TestClock::SetCurrentTime(1);
+  AdaptiveRateLimiter rl(10, 100, 5, TestClock::GetCurrentTimeSeconds);
+  EXPECT_EQ(rl.GetRate(), 100);
+
+  // halved once per second
+  rl.OnThrottled();
+  EXPECT_EQ(rl.GetRate(), 50);
+  rl.OnThrottled();
+  EXPECT_EQ(rl.GetRate(), 50);
+
+  // no increase in the second we backed off
+  rl.OnSuccess();
+  EXPECT_EQ(rl.GetRate(), 50);
+
+  TestClock::SetCurrentTime(2);
+  rl.OnSuccess();
+  EXPECT_EQ(rl.GetRate(), 55);
+  rl.OnSuccess();
+  EXPECT_EQ(rl.GetRate(), 55);
+
+  // down to min_rate at most
+  for (uint32_t t = 3; t < 10; ++t) {
+    TestClock::SetCurrentTime(t);
+    rl.OnThrottled();
+  }
+  EXPECT_EQ(rl.GetRate(), 10);
+
+  // up to max_rate at most
+  for (uint32_t t = 10; t < 100; ++t) {
+    TestClock::SetCurrentTime(t);
+    rl.OnSuccess();
+  }
+  EXPECT_EQ(rl.GetRate(), 100);
+}
+
+TEST(AdaptiveRateLimiterTest, Delay) {
+  TestClock::SetCurrentTime(1);
+  AdaptiveRateLimiter rl(10, 100, 5, TestClock::GetCurrentTimeSeconds);
+  EXPECT_EQ(rl.ApplyCost(100).count(), 0);
+  // budget left = 0, at 50 bytes/s after backing off
+  rl.OnThrottled();
+  EXPECT_EQ(rl.ApplyCost(50).count(), 1000);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
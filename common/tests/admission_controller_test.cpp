@@ -0,0 +1,108 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/admission_controller.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+
+DECLARE_int32(admission_control_initial_limit);
+DECLARE_int32(admission_control_min_limit);
+DECLARE_int32(admission_control_window_requests);
+DECLARE_int32(admission_control_low_priority_percent);
+
+using common::AdmissionController;
+using Priority = common::AdmissionController::Priority;
+using std::chrono::milliseconds;
+
+TEST(AdmissionControllerTest, Disabled) {
+  FLAGS_admission_control = false;
+  FLAGS_admission_control_initial_limit = 10;
+  AdmissionController controller("test");
+  std::vector<std::unique_ptr<AdmissionController::Permit>> permits;
+  for (int i = 0; i < 20; ++i) {
+    permits.push_back(controller.TryAcquire(Priority::LOW));
+    EXPECT_NE(permits.back(), nullptr);
+  }
+  EXPECT_EQ(controller.InFlight(), 0);
+}
+
+TEST(AdmissionControllerTest, Priorities) {
+  FLAGS_admission_control = true;
+  FLAGS_admission_control_initial_limit = 10;
+  FLAGS_admission_control_low_priority_percent = 50;
+  AdmissionController controller("test");
+  EXPECT_EQ(controller.Limit(), 10);
+
+  std::vector<std::unique_ptr<AdmissionController::Permit>> permits;
+  for (int i = 0; i < 5; ++i) {
+    permits.push_back(controller.TryAcquire(Priority::LOW));
+    EXPECT_NE(permits.back(), nullptr);
+  }
+  // Low priority requests are shed first
+  EXPECT_EQ(controller.TryAcquire(Priority::LOW), nullptr);
+
+  for (int i = 0; i < 5; ++i) {
+    permits.push_back(controller.TryAcquire(Priority::NORMAL));
+    EXPECT_NE(permits.back(), nullptr);
+  }
+  EXPECT_EQ(controller.InFlight(), 10);
+  EXPECT_EQ(controller.TryAcquire(Priority::NORMAL), nullptr);
+
+  // Critical ones always get in
+  EXPECT_NE(controller.TryAcquire(Priority::CRITICAL), nullptr);
+
+  permits.pop_back();
+  EXPECT_EQ(controller.InFlight(), 9);
+  EXPECT_NE(controller.TryAcquire(Priority::NORMAL), nullptr);
+
+  permits.clear();
+  EXPECT_EQ(controller.InFlight(), 0);
+  FLAGS_admission_control_low_priority_percent = 80;
+}
+
+TEST(AdmissionControllerTest, ShrinkWithLatency) {
+  FLAGS_admission_control = true;
+  FLAGS_admission_control_initial_limit = 100;
+  FLAGS_admission_control_min_limit = 8;
+  FLAGS_admission_control_window_requests = 10;
+  AdmissionController controller("test");
+
+  // Fast requests don't grow a limit the load doesn't need
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_NE(controller.TryAcquire(Priority::NORMAL), nullptr);
+  }
+  EXPECT_EQ(controller.Limit(), 100);
+
+  for (int i = 0; i < 50; ++i) {
+    auto permit = controller.TryAcquire(Priority::NORMAL);
+    EXPECT_NE(permit, nullptr);
+    std::this_thread::sleep_for(milliseconds(2));
+  }
+  EXPECT_LT(controller.Limit(), 100);
+  EXPECT_GE(controller.Limit(), 8);
+
+  FLAGS_admission_control_window_requests = 100;
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
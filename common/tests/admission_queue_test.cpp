@@ -0,0 +1,100 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common/admission_queue.h"
+#include "gtest/gtest.h"
+
+using common::AdmissionQueue;
+using std::chrono::milliseconds;
+
+TEST(AdmissionQueueTest, Basics) {
+  AdmissionQueue queue(2);
+  auto a1 = queue.Admit(0, 0, milliseconds(0));
+  auto a2 = queue.Admit(0, 0, milliseconds(0));
+  EXPECT_NE(a1, nullptr);
+  EXPECT_NE(a2, nullptr);
+  EXPECT_EQ(queue.InUse(), 2);
+
+  // No free slot
+  EXPECT_EQ(queue.Admit(0, 0, milliseconds(10)), nullptr);
+  EXPECT_EQ(queue.QueueDepth(), 0);
+
+  a1.reset();
+  EXPECT_EQ(queue.InUse(), 1);
+  auto a3 = queue.Admit(0, 0, milliseconds(0));
+  EXPECT_NE(a3, nullptr);
+}
+
+TEST(AdmissionQueueTest, WaitForFreeSlot) {
+  AdmissionQueue queue(1);
+  auto a = queue.Admit(0, 0, milliseconds(0));
+  ASSERT_NE(a, nullptr);
+
+  std::thread releaser([&a] {
+    std::this_thread::sleep_for(milliseconds(50));
+    a.reset();
+  });
+
+  EXPECT_NE(queue.Admit(0, 0, milliseconds(5000)), nullptr);
+  releaser.join();
+}
+
+TEST(AdmissionQueueTest, Order) {
+  AdmissionQueue queue(1);
+  auto a = queue.Admit(0, 0, milliseconds(0));
+  ASSERT_NE(a, nullptr);
+
+  std::mutex order_mutex;
+  std::vector<int> order;
+  std::vector<std::thread> threads;
+  // (priority, cost) of the waiters, in the order they arrive
+  const std::vector<std::pair<uint32_t, uint64_t>> waiters = {
+    {1, 10}, {1, 5}, {0, 100}, {1, 5}, {0, 1},
+  };
+  for (int i = 0; i < static_cast<int>(waiters.size()); ++i) {
+    threads.emplace_back([&, i] {
+      auto admission = queue.Admit(waiters[i].first, waiters[i].second,
+                                   milliseconds(5000));
+      EXPECT_NE(admission, nullptr);
+      std::lock_guard<std::mutex> g(order_mutex);
+      order.push_back(i);
+    });
+    while (queue.QueueDepth() != static_cast<uint32_t>(i + 1)) {
+      std::this_thread::sleep_for(milliseconds(1));
+    }
+  }
+
+  a.reset();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(order, std::vector<int>({4, 2, 1, 3, 0}));
+  EXPECT_EQ(queue.InUse(), 0);
+  EXPECT_EQ(queue.QueueDepth(), 0);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
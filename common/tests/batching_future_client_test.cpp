@@ -0,0 +1,178 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/batching_future_client.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "common/tests/thrift/gen-cpp2/DummyService.h"
+#include "common/thrift_client_pool.h"
+#include "gtest/gtest.h"
+#include "thrift/lib/cpp2/server/ThriftServer.h"
+
+using apache::thrift::HandlerCallback;
+using apache::thrift::ThriftServer;
+using common::BatchingFutureClient;
+using common::ThriftClientPool;
+using dummy_service::thrift::DummyServiceAsyncClient;
+using dummy_service::thrift::DummyServiceSvIf;
+
+using std::atomic;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::make_shared;
+using std::shared_ptr;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+using Batcher = BatchingFutureClient<DummyServiceAsyncClient, int64_t, int64_t>;
+
+class DummyServiceTestHandler : public DummyServiceSvIf {
+ public:
+  DummyServiceTestHandler() : nPings_(0) {}
+
+  void async_tm_ping(unique_ptr<HandlerCallback<void>> callback) override {
+    ++nPings_;
+    callback->done();
+  }
+
+  atomic<uint32_t> nPings_;
+};
+
+class BatchingFutureClientTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    handler_ = make_shared<DummyServiceTestHandler>();
+    server_ = make_shared<ThriftServer>();
+    server_->setPort(9290);
+    server_->setInterface(handler_);
+    server_thread_ = thread([this] { server_->serve(); });
+    std::this_thread::sleep_for(milliseconds(500));
+
+    folly::SocketAddress addr("127.0.0.1", 9290);
+    client_ = pool_.getClient(addr);
+    ASSERT_NE(client_, nullptr);
+  }
+
+  void TearDown() override {
+    client_.reset();
+    server_->stop();
+    server_thread_.join();
+  }
+
+  // One ping per batch, and each response is twice its request
+  Batcher::BatchFunc doubleFunc() {
+    return [this] (DummyServiceAsyncClient* client, vector<int64_t> requests) {
+      batch_sizes_.push_back(requests.size());
+      return client->future_ping().then([requests] {
+          vector<int64_t> responses;
+          for (auto r : requests) {
+            responses.push_back(2 * r);
+          }
+          return responses;
+        });
+    };
+  }
+
+  ThriftClientPool<DummyServiceAsyncClient> pool_;
+  shared_ptr<DummyServiceTestHandler> handler_;
+  shared_ptr<ThriftServer> server_;
+  thread server_thread_;
+  shared_ptr<DummyServiceAsyncClient> client_;
+  // only touched in the IO thread, and read after the futures are done
+  vector<size_t> batch_sizes_;
+};
+
+TEST_F(BatchingFutureClientTest, CoalesceByDelay) {
+  Batcher batcher(client_, doubleFunc(), 100, microseconds(100000), "test");
+  vector<folly::Future<int64_t>> futures;
+  for (int64_t i = 0; i < 10; ++i) {
+    futures.push_back(batcher.future_call(i));
+  }
+
+  for (int64_t i = 0; i < 10; ++i) {
+    EXPECT_EQ(futures[i].get(), 2 * i);
+  }
+  EXPECT_EQ(handler_->nPings_.load(), 1);
+  EXPECT_EQ(batch_sizes_, vector<size_t>({10}));
+}
+
+TEST_F(BatchingFutureClientTest, FlushWhenFull) {
+  Batcher batcher(client_, doubleFunc(), 4, microseconds(5000000), "test");
+  vector<folly::Future<int64_t>> futures;
+  const auto start = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i < 8; ++i) {
+    futures.push_back(batcher.future_call(i));
+  }
+
+  for (int64_t i = 0; i < 8; ++i) {
+    EXPECT_EQ(futures[i].get(), 2 * i);
+  }
+  EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(1000));
+  EXPECT_EQ(handler_->nPings_.load(), 2);
+  EXPECT_EQ(batch_sizes_, vector<size_t>({4, 4}));
+}
+
+TEST_F(BatchingFutureClientTest, NextLoop) {
+  Batcher batcher(client_, doubleFunc(), 100, microseconds(0), "test");
+  vector<folly::Future<int64_t>> futures;
+  for (int round = 0; round < 3; ++round) {
+    futures.push_back(batcher.future_call(round));
+    EXPECT_EQ(futures.back().get(), 2 * round);
+  }
+  EXPECT_EQ(handler_->nPings_.load(), 3);
+}
+
+TEST_F(BatchingFutureClientTest, Errors) {
+  // The batch fails
+  Batcher failing(client_,
+    [] (DummyServiceAsyncClient*, vector<int64_t>) {
+      return folly::makeFuture<vector<int64_t>>(
+        std::runtime_error("Intended exception"));
+    }, 100, microseconds(1000), "test");
+  auto f1 = failing.future_call(1);
+  auto f2 = failing.future_call(2);
+  EXPECT_THROW(f1.get(), std::runtime_error);
+  EXPECT_THROW(f2.get(), std::runtime_error);
+
+  // batch_func throws
+  Batcher throwing(client_,
+    [] (DummyServiceAsyncClient*, vector<int64_t>)
+        -> folly::Future<vector<int64_t>> {
+      throw std::runtime_error("Intended exception");
+    }, 100, microseconds(1000), "test");
+  EXPECT_THROW(throwing.future_call(1).get(), std::runtime_error);
+
+  // Too few responses
+  Batcher short_responses(client_,
+    [] (DummyServiceAsyncClient*, vector<int64_t>) {
+      return folly::makeFuture(vector<int64_t>({1}));
+    }, 100, microseconds(1000), "test");
+  auto f3 = short_responses.future_call(1);
+  auto f4 = short_responses.future_call(2);
+  EXPECT_THROW(f3.get(), std::runtime_error);
+  EXPECT_THROW(f4.get(), std::runtime_error);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
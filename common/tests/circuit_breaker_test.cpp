@@ -0,0 +1,138 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/circuit_breaker.h"
+
+#include <chrono>
+#include <thread>
+
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+
+DECLARE_int32(thrift_router_circuit_breaker_min_requests);
+DECLARE_int32(thrift_router_circuit_breaker_error_percent);
+DECLARE_int32(thrift_router_circuit_breaker_slow_request_ms);
+DECLARE_int32(thrift_router_circuit_breaker_ejection_ms);
+DECLARE_int32(thrift_router_circuit_breaker_max_ejection_ms);
+
+using common::CircuitBreaker;
+using State = common::CircuitBreaker::State;
+using std::chrono::milliseconds;
+using std::this_thread::sleep_for;
+
+TEST(CircuitBreakerTest, ErrorRate) {
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 200;
+  CircuitBreaker breaker("host");
+  EXPECT_EQ(breaker.state(), State::CLOSED);
+
+  // Not enough requests yet
+  for (int i = 0; i < FLAGS_thrift_router_circuit_breaker_min_requests - 1;
+       ++i) {
+    breaker.onRequestDone(false, 100);
+  }
+  EXPECT_EQ(breaker.state(), State::CLOSED);
+  EXPECT_TRUE(breaker.allowRequest());
+
+  breaker.onRequestDone(false, 100);
+  EXPECT_EQ(breaker.state(), State::OPEN);
+  EXPECT_FALSE(breaker.allowRequest());
+
+  // One probe at a time once half open
+  sleep_for(milliseconds(300));
+  EXPECT_TRUE(breaker.allowRequest());
+  EXPECT_EQ(breaker.state(), State::HALF_OPEN);
+  EXPECT_FALSE(breaker.allowRequest());
+
+  // A good probe closes it
+  breaker.onRequestDone(true, 100);
+  EXPECT_EQ(breaker.state(), State::CLOSED);
+  EXPECT_TRUE(breaker.allowRequest());
+
+  // Mostly good requests keep it closed
+  for (int i = 0; i < 100; ++i) {
+    breaker.onRequestDone(i % 3 != 0, 100);
+  }
+  EXPECT_EQ(breaker.state(), State::CLOSED);
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 5000;
+}
+
+TEST(CircuitBreakerTest, SlowRequests) {
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 200;
+  CircuitBreaker breaker("host");
+  const uint64_t slow_us =
+    FLAGS_thrift_router_circuit_breaker_slow_request_ms * 1000 + 1;
+  for (int i = 0; i < FLAGS_thrift_router_circuit_breaker_min_requests; ++i) {
+    breaker.onRequestDone(true, slow_us);
+  }
+  EXPECT_EQ(breaker.state(), State::OPEN);
+
+  // A bad probe opens it again, for longer
+  sleep_for(milliseconds(300));
+  EXPECT_TRUE(breaker.allowRequest());
+  breaker.onRequestDone(true, slow_us);
+  EXPECT_EQ(breaker.state(), State::OPEN);
+  sleep_for(milliseconds(300));
+  EXPECT_FALSE(breaker.allowRequest());
+  sleep_for(milliseconds(200));
+  EXPECT_TRUE(breaker.allowRequest());
+
+  // Late outcomes are ignored while it is open, a good probe closes it
+  breaker.onRequestDone(true, 100);
+  EXPECT_EQ(breaker.state(), State::CLOSED);
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 5000;
+}
+
+TEST(CircuitBreakerTest, LostProbe) {
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 200;
+  CircuitBreaker breaker("host");
+  for (int i = 0; i < FLAGS_thrift_router_circuit_breaker_min_requests; ++i) {
+    breaker.onRequestDone(false, 100);
+  }
+  sleep_for(milliseconds(300));
+  EXPECT_TRUE(breaker.allowRequest());
+  EXPECT_FALSE(breaker.allowRequest());
+
+  // The outcome of the probe never comes, another one is let through
+  sleep_for(milliseconds(300));
+  EXPECT_TRUE(breaker.allowRequest());
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 5000;
+}
+
+TEST(CircuitBreakerTest, IsEjected) {
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 200;
+  CircuitBreaker breaker("host");
+  EXPECT_FALSE(breaker.isEjected());
+  for (int i = 0; i < FLAGS_thrift_router_circuit_breaker_min_requests; ++i) {
+    breaker.onRequestDone(false, 100);
+  }
+  EXPECT_TRUE(breaker.isEjected());
+
+  // Checking doesn't take the probe
+  sleep_for(milliseconds(300));
+  EXPECT_FALSE(breaker.isEjected());
+  EXPECT_FALSE(breaker.isEjected());
+  EXPECT_EQ(breaker.state(), State::OPEN);
+  EXPECT_TRUE(breaker.allowRequest());
+  EXPECT_TRUE(breaker.isEjected());
+
+  breaker.onRequestDone(true, 100);
+  EXPECT_FALSE(breaker.isEjected());
+  FLAGS_thrift_router_circuit_breaker_ejection_ms = 5000;
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -81,6 +81,21 @@ TEST(ConcurrentRateLimiterTest, Basics) {
   EXPECT_FALSE(rl.GetTokens());
 }
 
+TEST(ConcurrentRateLimiterTest, ReturnTokens) {
+  TestClock::SetCurrentTime(0);
+  double rate = 10;
+  ConcurrentRateLimiter rl(rate, 1, TestClock::GetCurrentTimeSeconds);
+
+  EXPECT_TRUE(rl.GetTokens(8));
+  EXPECT_FALSE(rl.GetTokens(5));
+  rl.ReturnTokens(5);
+  EXPECT_TRUE(rl.GetTokens(5));
+
+  // Never more than rate
+  rl.ReturnTokens(100);
+  EXPECT_TRUE(rl.GetTokens(10));
+  EXPECT_FALSE(rl.GetTokens());
+}
 
 TEST(ConcurrentRateLimiterTest, MultiThreads) {
   TestClock::SetCurrentTime(0);
@@ -0,0 +1,75 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/deadline.h"
+
+#include <chrono>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "thrift/lib/cpp2/async/RequestChannel.h"
+
+using apache::thrift::RpcOptions;
+using common::Deadline;
+using std::chrono::milliseconds;
+
+TEST(DeadlineTest, Basics) {
+  Deadline none;
+  EXPECT_FALSE(none.isSet());
+  EXPECT_FALSE(none.expired());
+  EXPECT_EQ(none.remaining(), milliseconds::max());
+  EXPECT_FALSE(Deadline::fromRequest(nullptr).isSet());
+
+  auto deadline = Deadline::after(milliseconds(100));
+  EXPECT_TRUE(deadline.isSet());
+  EXPECT_FALSE(deadline.expired());
+  EXPECT_GT(deadline.remaining(), milliseconds(50));
+  EXPECT_LE(deadline.remaining(), milliseconds(100));
+
+  std::this_thread::sleep_for(milliseconds(150));
+  EXPECT_TRUE(deadline.expired());
+  EXPECT_EQ(deadline.remaining(), milliseconds(0));
+}
+
+TEST(DeadlineTest, ApplyTo) {
+  RpcOptions options;
+  Deadline().applyTo(&options);
+  EXPECT_EQ(options.getTimeout(), milliseconds(0));
+  EXPECT_EQ(options.getWriteHeaders().count(Deadline::kDeadlineHeader), 0);
+
+  Deadline::after(milliseconds(1000)).applyTo(&options);
+  EXPECT_GT(options.getTimeout(), milliseconds(900));
+  EXPECT_LE(options.getTimeout(), milliseconds(1000));
+  EXPECT_EQ(options.getWriteHeaders().at(Deadline::kDeadlineHeader),
+            std::to_string(options.getTimeout().count()));
+
+  // A shorter per call timeout wins
+  RpcOptions short_options;
+  short_options.setTimeout(milliseconds(10));
+  Deadline::after(milliseconds(1000)).applyTo(&short_options);
+  EXPECT_EQ(short_options.getTimeout(), milliseconds(10));
+  EXPECT_EQ(short_options.getWriteHeaders().at(Deadline::kDeadlineHeader),
+            "10");
+
+  // An expired deadline still sets a timeout
+  RpcOptions expired_options;
+  Deadline::after(milliseconds(0)).applyTo(&expired_options);
+  EXPECT_EQ(expired_options.getTimeout(), milliseconds(1));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
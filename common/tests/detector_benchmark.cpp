@@ -13,6 +13,7 @@
 /// limitations under the License.
 
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "common/hot_key_detector.h"
@@ -207,6 +208,107 @@ BENCHMARK(_20PercentDistributionRecordLongString, n) {
   }
 }
 
+template <typename Detector>
+void recordIntFromThreads(int n, int nThreads) {
+  Detector detector;
+  std::vector<int> keys;
+  const int nKeys = 100;
+
+  BENCHMARK_SUSPEND {
+    for (int i = 0; i < nKeys * 20 / 100; ++i) {
+      keys.push_back(-1);
+    }
+
+    for (int i = 0; i < nKeys * 80 / 100; ++i) {
+      keys.push_back(i);
+    }
+
+    std::random_shuffle(keys.begin(), keys.end());
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i) {
+    threads.emplace_back([&detector, &keys, n, nThreads, nKeys] {
+        int idx = 0;
+        for (int j = 0; j < n / nThreads; ++j) {
+          if (idx >= nKeys) {
+            idx = 0;
+          }
+
+          detector.record(keys[idx++]);
+        }
+      });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+template <typename Detector>
+void isAboveIntFromThreads(int n, int nThreads) {
+  Detector detector;
+  std::vector<int> keys;
+  const int nKeys = 100;
+
+  BENCHMARK_SUSPEND {
+    keys = generateEvenDistributionIntKeys(nKeys);
+    for (const auto key : keys) {
+      detector.record(key);
+    }
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i) {
+    threads.emplace_back([&detector, &keys, n, nThreads, nKeys] {
+        int idx = 0;
+        for (int j = 0; j < n / nThreads; ++j) {
+          if (idx >= nKeys) {
+            idx = 0;
+          }
+
+          detector.isAbove(keys[idx++], 20);
+        }
+      });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+BENCHMARK(_20PercentDistributionRecordInt1Thread, n) {
+  recordIntFromThreads<common::HotKeyDetector<int>>(n, 1);
+}
+
+BENCHMARK_RELATIVE(Concurrent20PercentDistributionRecordInt1Thread, n) {
+  recordIntFromThreads<common::ConcurrentHotKeyDetector<int>>(n, 1);
+}
+
+BENCHMARK(_20PercentDistributionRecordInt8Threads, n) {
+  recordIntFromThreads<common::HotKeyDetector<int>>(n, 8);
+}
+
+BENCHMARK_RELATIVE(Concurrent20PercentDistributionRecordInt8Threads, n) {
+  recordIntFromThreads<common::ConcurrentHotKeyDetector<int>>(n, 8);
+}
+
+BENCHMARK(_20PercentDistributionRecordInt32Threads, n) {
+  recordIntFromThreads<common::HotKeyDetector<int>>(n, 32);
+}
+
+BENCHMARK_RELATIVE(Concurrent20PercentDistributionRecordInt32Threads, n) {
+  recordIntFromThreads<common::ConcurrentHotKeyDetector<int>>(n, 32);
+}
+
+BENCHMARK(EvenDistributionIsAboveInt8Threads, n) {
+  isAboveIntFromThreads<common::HotKeyDetector<int>>(n, 8);
+}
+
+BENCHMARK_RELATIVE(ConcurrentEvenDistributionIsAboveInt8Threads, n) {
+  isAboveIntFromThreads<common::ConcurrentHotKeyDetector<int>>(n, 8);
+}
+
 int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   folly::runBenchmarks();
@@ -17,6 +17,7 @@
 //
 
 #include <folly/MPMCQueue.h>
+#include <chrono>
 #include <fstream>
 #include <string>
 
@@ -224,6 +225,40 @@ TEST(FileWatcherTest, FullChangeOnly) {
   RemoveFile(file_name);
 }
 
+TEST(FileWatcherTest, Options) {
+  const string file_name = "./file_watcher_test_file_options";
+  auto watcher = FileWatcher::Instance();
+  RemoveFile(file_name);
+  MPMCQueue<string> queue(1024);
+
+  // a missing file is watched from its creation on
+  FileWatcher::Options options;
+  options.debounce = std::chrono::milliseconds(1000);
+  options.must_exist = false;
+  options.callback_on_add = false;
+  EXPECT_TRUE(watcher->AddFile(file_name, [&queue] (string content) {
+        queue.blockingWrite(move(content));
+      }, options));
+  string content;
+  EXPECT_FALSE(queue.read(content));
+
+  OverwriteFile(file_name, "abc");
+  queue.blockingRead(content);
+  EXPECT_EQ(content, "abc");
+
+  // writes in a row are read once the last one is done
+  OverwriteFile(file_name, "1");
+  OverwriteFile(file_name, "12");
+  OverwriteFile(file_name, "123");
+  queue.blockingRead(content);
+  EXPECT_EQ(content, "123");
+  sleep(3);
+  EXPECT_FALSE(queue.read(content));
+
+  EXPECT_TRUE(watcher->RemoveFile(file_name));
+  RemoveFile(file_name);
+}
+
 int main(int argc, char** argv) {
   // FLAGS_recheck_removed_file_interval_ms = 500;
   ::testing::InitGoogleTest(&argc, argv);
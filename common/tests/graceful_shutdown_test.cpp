@@ -17,6 +17,7 @@
 //
 
 #include <sys/socket.h>
+#include <atomic>
 #include <csignal>
 #include <chrono>
 #include <string>
@@ -209,6 +210,48 @@ TEST_F(GracefulShutdownTest, NewConnectionAfterPostShutdownTest) {
   server_thread.join();
 }
 
+TEST_F(GracefulShutdownTest, DrainTest) {
+  std::atomic<bool> drain_handler_called{false};
+  std::atomic<bool> post_handler_called{false};
+  std::atomic<bool> draining{false};
+  std::thread server_thread([&] {
+      GracefulShutdownHandler gracefulShutdown(server_);
+      gracefulShutdown.EnableDrain(milliseconds(1000), seconds(10));
+      gracefulShutdown.RegisterDrainHandler([&] {
+          drain_handler_called = true;
+          draining = gracefulShutdown.IsDraining();
+        });
+      gracefulShutdown.RegisterPostShutdownHandler([&] {
+          post_handler_called = true;
+        });
+      gracefulShutdown.RegisterShutdownSignal(SIGUSR1);
+      server_->serve();
+  });
+  sleep(1);
+
+  ThriftClientPool<DummyServiceAsyncClient> client_pool;
+  auto client = client_pool.getClient(server_->getAddress());
+  RpcOptions options;
+  options.setTimeout(seconds(5));
+  auto result = client->future_getSomething(options, 123);
+  sleep(1);
+  std::raise(SIGUSR1);
+  usleep(200 * 1000);
+  EXPECT_TRUE(drain_handler_called);
+  EXPECT_TRUE(draining);
+
+  // still serving while draining
+  auto result2 = client->future_getSomething(options, 456);
+  usleep(200 * 1000);
+  EXPECT_FALSE(post_handler_called);
+
+  // drained once the requests in flight are done
+  handler_->baton_.post();
+  EXPECT_EQ(result.get(), 123);
+  EXPECT_EQ(result2.get(), 456);
+  server_thread.join();
+  EXPECT_TRUE(post_handler_called);
+}
 
 }  // namespace common
 
@@ -0,0 +1,114 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/heavy_hitter_detector.h"
+#include "gtest/gtest.h"
+
+using common::HeavyHitterDetector;
+
+// 1% of the keys are "hot1", 2% are "hot2", and the rest are all different
+std::vector<std::string> generateKeys() {
+  std::vector<std::string> keys;
+  for (int i = 0; i < 97000; ++i) {
+    keys.push_back(std::to_string(i));
+  }
+
+  for (int i = 0; i < 1000; ++i) {
+    keys.push_back("hot1");
+  }
+
+  for (int i = 0; i < 2000; ++i) {
+    keys.push_back("hot2");
+  }
+
+  std::random_shuffle(keys.begin(), keys.end());
+
+  return keys;
+}
+
+TEST(HeavyHitterDetectorTest, TopKTest) {
+  HeavyHitterDetector<std::string> detector;
+  EXPECT_TRUE(detector.getTopK(2).empty());
+
+  auto keys = generateKeys();
+  for (int i = 0; i < 3; ++i) {
+    for (const auto& key : keys) {
+      detector.record(key);
+    }
+    std::random_shuffle(keys.begin(), keys.end());
+  }
+
+  EXPECT_EQ(detector.totalLoad(), 3 * keys.size());
+  EXPECT_GE(detector.estimate("hot1"), 3000);
+  EXPECT_GE(detector.estimate("hot2"), 6000);
+
+  auto top_k = detector.getTopK(2);
+  ASSERT_EQ(top_k.size(), 2);
+  EXPECT_EQ(top_k[0].first, "hot2");
+  EXPECT_EQ(top_k[1].first, "hot1");
+  EXPECT_GE(top_k[0].second, top_k[1].second);
+
+  EXPECT_TRUE(detector.isAbove("hot1", 0.9));
+  EXPECT_FALSE(detector.isAbove("hot1", 1.5));
+  EXPECT_TRUE(detector.isAbove("hot2", 1.9));
+  EXPECT_FALSE(detector.isAbove("1", 0.1));
+
+  // k is capped at the capacity
+  EXPECT_EQ(detector.getTopK(1000).size(), 32);
+}
+
+TEST(HeavyHitterDetectorTest, WeightedLoadTest) {
+  HeavyHitterDetector<int> detector(1024, 4);
+  for (int i = 0; i < 10000; ++i) {
+    detector.record(i);
+    if (i % 10 == 0) {
+      detector.record(-1, 5);
+    }
+  }
+
+  auto top_k = detector.getTopK(1);
+  ASSERT_EQ(top_k.size(), 1);
+  EXPECT_EQ(top_k[0].first, -1);
+  EXPECT_GE(top_k[0].second, 5000);
+  EXPECT_EQ(detector.totalLoad(), 15000);
+}
+
+TEST(HeavyHitterDetectorTest, DecayTest) {
+  FLAGS_hot_key_detector_decay_time_seconds = 2;
+  HeavyHitterDetector<std::string> detector;
+  for (int i = 0; i < 1000; ++i) {
+    detector.record("hot", 10);
+    detector.record(std::to_string(i));
+  }
+
+  sleep(3);
+  // the first record after the interval halves the load
+  detector.record("new", 100);
+  EXPECT_EQ(detector.totalLoad(), 11000 / 2 + 100);
+  EXPECT_EQ(detector.getTopK(1)[0].first, "hot");
+  EXPECT_GE(detector.estimate("hot"), 5000);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,91 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "common/hedging_policy.h"
+
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+
+DECLARE_double(thrift_router_hedge_percentile);
+DECLARE_double(thrift_router_hedge_max_percent);
+DECLARE_int32(thrift_router_hedge_default_delay_ms);
+DECLARE_int32(thrift_router_hedge_min_delay_ms);
+
+using common::HedgingPolicy;
+using std::chrono::microseconds;
+
+TEST(HedgingPolicyTest, HedgeDelay) {
+  HedgingPolicy policy("segment");
+  EXPECT_EQ(policy.getHedgeDelay(),
+            microseconds(FLAGS_thrift_router_hedge_default_delay_ms * 1000));
+
+  // 96% of the requests take 10ms, the others 1s
+  for (int i = 0; i < 2560; ++i) {
+    policy.recordLatency(i % 25 == 0 ? 1000000 : 10000);
+  }
+  EXPECT_GE(policy.getHedgeDelay(), microseconds(10000));
+  EXPECT_LT(policy.getHedgeDelay(), microseconds(20000));
+
+  // Follows the latency going up
+  for (int i = 0; i < 256 * 20; ++i) {
+    policy.recordLatency(100000);
+  }
+  EXPECT_GE(policy.getHedgeDelay(), microseconds(100000));
+  EXPECT_LT(policy.getHedgeDelay(), microseconds(200000));
+
+  // Never below the min delay
+  for (int i = 0; i < 256 * 200; ++i) {
+    policy.recordLatency(10);
+  }
+  EXPECT_EQ(policy.getHedgeDelay(),
+            microseconds(FLAGS_thrift_router_hedge_min_delay_ms * 1000));
+}
+
+TEST(HedgingPolicyTest, HedgeBudget) {
+  FLAGS_thrift_router_hedge_max_percent = 10;
+  HedgingPolicy policy("segment");
+
+  // Some hedges are allowed at once
+  int n_hedges = 0;
+  while (policy.tryAcquireHedge()) {
+    ++n_hedges;
+  }
+  EXPECT_EQ(n_hedges, 10);
+
+  // Then one for every 10 requests
+  n_hedges = 0;
+  for (int i = 0; i < 1000; ++i) {
+    policy.onRequest();
+    if (policy.tryAcquireHedge()) {
+      ++n_hedges;
+    }
+  }
+  EXPECT_EQ(n_hedges, 100);
+
+  // The budget doesn't accumulate forever
+  for (int i = 0; i < 100000; ++i) {
+    policy.onRequest();
+  }
+  n_hedges = 0;
+  while (policy.tryAcquireHedge()) {
+    ++n_hedges;
+  }
+  EXPECT_EQ(n_hedges, 10);
+  FLAGS_thrift_router_hedge_max_percent = 5;
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,127 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "common/hierarchical_rate_limiter.h"
+#include "gtest/gtest.h"
+
+using common::HierarchicalRateLimiter;
+
+struct TestClock {
+  static uint64_t GetCurrentTimeMs() {
+    return current_time_ms_.load();
+  }
+
+  static std::atomic<uint64_t> current_time_ms_;
+};
+
+std::atomic<uint64_t> TestClock::current_time_ms_;
+
+TEST(HierarchicalRateLimiterTest, Borrowing) {
+  TestClock::current_time_ms_.store(0);
+  auto host = HierarchicalRateLimiter::Create(
+    100, nullptr, TestClock::GetCurrentTimeMs);
+  auto a = HierarchicalRateLimiter::Create(50, host,
+                                           TestClock::GetCurrentTimeMs);
+  auto b = HierarchicalRateLimiter::Create(50, host,
+                                           TestClock::GetCurrentTimeMs);
+
+  EXPECT_TRUE(a->TryGetTokens(50));
+  EXPECT_EQ(host->GetAvailableTokens(), 50);
+
+  // a borrows what b doesn't use
+  EXPECT_TRUE(a->TryGetTokens(30));
+  EXPECT_EQ(a->GetAvailableTokens(), 0);
+  EXPECT_EQ(host->GetAvailableTokens(), 20);
+
+  // b still gets its own rate, which puts host in debt
+  EXPECT_TRUE(b->TryGetTokens(50));
+  EXPECT_EQ(host->GetAvailableTokens(), -30);
+  EXPECT_FALSE(a->TryGetTokens(1));
+  EXPECT_FALSE(b->TryGetTokens(1));
+  EXPECT_FALSE(host->TryGetTokens(1));
+
+  TestClock::current_time_ms_.store(500);
+  EXPECT_EQ(a->GetAvailableTokens(), 25);
+  EXPECT_EQ(host->GetAvailableTokens(), 20);
+  EXPECT_TRUE(a->TryGetTokens(25));
+  EXPECT_FALSE(b->TryGetTokens(26));
+  EXPECT_TRUE(b->TryGetTokens(25));
+  EXPECT_EQ(host->GetAvailableTokens(), -30);
+
+  // Buckets are full after a second
+  TestClock::current_time_ms_.store(10000);
+  EXPECT_EQ(a->GetAvailableTokens(), 50);
+  EXPECT_EQ(host->GetAvailableTokens(), 100);
+
+  // More tokens than a node holds are allowed once it is full
+  EXPECT_TRUE(a->TryGetTokens(80));
+  EXPECT_EQ(a->GetAvailableTokens(), -30);
+  EXPECT_EQ(host->GetAvailableTokens(), 20);
+}
+
+TEST(HierarchicalRateLimiterTest, ThreeLevels) {
+  TestClock::current_time_ms_.store(0);
+  auto host = HierarchicalRateLimiter::Create(
+    100, nullptr, TestClock::GetCurrentTimeMs);
+  auto segment = HierarchicalRateLimiter::Create(
+    50, host, TestClock::GetCurrentTimeMs);
+  auto db = HierarchicalRateLimiter::Create(
+    10, segment, TestClock::GetCurrentTimeMs);
+
+  // db borrows from segment, then from host
+  EXPECT_TRUE(db->TryGetTokens(10));
+  EXPECT_TRUE(db->TryGetTokens(40));
+  EXPECT_EQ(segment->GetAvailableTokens(), 0);
+  EXPECT_EQ(host->GetAvailableTokens(), 50);
+  EXPECT_TRUE(db->TryGetTokens(50));
+  EXPECT_EQ(host->GetAvailableTokens(), 0);
+  EXPECT_FALSE(db->TryGetTokens(1));
+}
+
+TEST(HierarchicalRateLimiterTest, GetTokens) {
+  auto host = HierarchicalRateLimiter::Create(1000);
+  auto db = HierarchicalRateLimiter::Create(500, host);
+
+  EXPECT_TRUE(db->GetTokens(1000).isReady());
+  EXPECT_FALSE(db->TryGetTokens(100));
+
+  const auto start = std::chrono::steady_clock::now();
+  auto future = db->GetTokens(100);
+  EXPECT_FALSE(future.isReady());
+  future.get();
+  const auto elapsed_ms =
+    std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  EXPECT_GE(elapsed_ms, 90);
+  EXPECT_LT(elapsed_ms, 1000);
+
+  // Many waiters get their tokens at the rate of the nodes
+  std::vector<folly::Future<folly::Unit>> futures;
+  for (int i = 0; i < 10; ++i) {
+    futures.push_back(db->GetTokens(50));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
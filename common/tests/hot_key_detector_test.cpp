@@ -13,12 +13,14 @@
 /// limitations under the License.
 
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "common/hot_key_detector.h"
 #include "gtest/gtest.h"
 
+using common::ConcurrentHotKeyDetector;
 using common::HotKeyDetector;
 
 std::vector<std::string> generateKeys(const std::string& hot_key,
@@ -174,6 +176,45 @@ TEST(HotKeyDetectorTest, DecayTest) {
   testNoDecay();
 }
 
+TEST(ConcurrentHotKeyDetectorTest, ManyThreadsTest) {
+  static const int kThreads = 8;
+  static const int kRounds = 10;
+  ConcurrentHotKeyDetector<std::string> detector;
+
+  // Nothing is merged before a thread records enough keys or flushes
+  detector.record("hot", 100);
+  EXPECT_FALSE(detector.isAbove("hot", 10));
+  EXPECT_TRUE(detector.getKeysAbove(10).empty());
+  detector.flush();
+
+  int percents = 20;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&detector, percents] {
+        auto keys = generateKeys("hot", percents);
+        for (int j = 0; j < kRounds; ++j) {
+          for (const auto& key : keys) {
+            detector.record(key);
+            // reading concurrently with recording and merging
+            detector.isAbove(key, percents);
+          }
+          std::random_shuffle(keys.begin(), keys.end());
+        }
+        detector.flush();
+      });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // The buckets of each thread are merged, which is less accurate
+  EXPECT_TRUE(detector.isAbove("hot", percents - 5));
+  EXPECT_FALSE(detector.isAbove("hot", percents + 10));
+  EXPECT_EQ(detector.getKeysAbove(percents - 5),
+            std::vector<std::string>({"hot"}));
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
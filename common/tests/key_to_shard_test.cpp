@@ -0,0 +1,140 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "common/key_to_shard.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using common::CreateKeyToShardMapper;
+using common::HashKeyForShard;
+using common::JumpConsistentHash;
+using common::RendezvousHash;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace {
+
+vector<uint64_t> makeHashes(const int n) {
+  vector<uint64_t> hashes;
+  for (int i = 0; i < n; ++i) {
+    hashes.push_back(HashKeyForShard("key" + to_string(i)));
+  }
+  return hashes;
+}
+
+}  // namespace
+
+TEST(KeyToShardTest, JumpConsistentHash) {
+  const auto hashes = makeHashes(10000);
+  vector<int> counts(10);
+  int n_moved = 0;
+  for (const auto hash : hashes) {
+    const auto bucket = JumpConsistentHash(hash, 10);
+    ASSERT_LT(bucket, 10);
+    ++counts[bucket];
+    // Growing to 11 buckets only moves keys to the new bucket
+    const auto new_bucket = JumpConsistentHash(hash, 11);
+    if (new_bucket != bucket) {
+      EXPECT_EQ(new_bucket, 10);
+      ++n_moved;
+    }
+  }
+  for (const auto count : counts) {
+    EXPECT_GT(count, 800);
+    EXPECT_LT(count, 1200);
+  }
+  EXPECT_GT(n_moved, 700);
+  EXPECT_LT(n_moved, 1100);
+  EXPECT_EQ(JumpConsistentHash(hashes[0], 1), 0);
+}
+
+TEST(KeyToShardTest, RendezvousHash) {
+  const auto hashes = makeHashes(10000);
+  vector<int> counts(10);
+  for (const auto hash : hashes) {
+    const auto bucket = RendezvousHash(hash, 10);
+    ASSERT_LT(bucket, 10);
+    ++counts[bucket];
+    const auto new_bucket = RendezvousHash(hash, 11);
+    if (new_bucket != bucket) {
+      EXPECT_EQ(new_bucket, 10);
+    }
+  }
+  for (const auto count : counts) {
+    EXPECT_GT(count, 800);
+    EXPECT_LT(count, 1200);
+  }
+}
+
+TEST(KeyToShardTest, CreateKeyToShardMapper) {
+  EXPECT_EQ(CreateKeyToShardMapper("unknown", 10), nullptr);
+  EXPECT_EQ(CreateKeyToShardMapper("jump", 0), nullptr);
+  EXPECT_EQ(CreateKeyToShardMapper("jump", 10, 3), nullptr);
+  EXPECT_EQ(CreateKeyToShardMapper("unknown", 10, 5), nullptr);
+
+  const auto hashes = makeHashes(1000);
+  for (const string type : { "modulo", "jump", "rendezvous" }) {
+    auto mapper = CreateKeyToShardMapper(type, 10);
+    ASSERT_NE(mapper, nullptr);
+    EXPECT_EQ(mapper->numShards(), 10);
+
+    // The batch version maps the same way
+    vector<uint32_t> shards(hashes.size());
+    mapper->getShards(hashes.data(), hashes.size(), shards.data());
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      EXPECT_EQ(shards[i], mapper->getShard(hashes[i]));
+      EXPECT_LT(shards[i], 10);
+    }
+  }
+
+  EXPECT_EQ(CreateKeyToShardMapper("modulo", 10)->getShard(123), 3);
+}
+
+TEST(KeyToShardTest, Split) {
+  const auto hashes = makeHashes(10000);
+  for (const string type : { "modulo", "jump", "rendezvous" }) {
+    auto before = CreateKeyToShardMapper(type, 4);
+    auto split_2 = CreateKeyToShardMapper(type, 8, 4);
+    auto split_4 = CreateKeyToShardMapper(type, 16, 4);
+    ASSERT_NE(split_2, nullptr);
+    ASSERT_NE(split_4, nullptr);
+
+    vector<uint32_t> shards(hashes.size());
+    split_4->getShards(hashes.data(), hashes.size(), shards.data());
+    vector<int> counts(16);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      const auto parent = before->getShard(hashes[i]);
+      const auto child_2 = split_2->getShard(hashes[i]);
+      const auto child_4 = split_4->getShard(hashes[i]);
+      EXPECT_EQ(child_4, shards[i]);
+      // Keys only move to the children of their shard
+      EXPECT_EQ(child_2 % 4, parent);
+      EXPECT_EQ(child_4 % 8, child_2);
+      ++counts[child_4];
+    }
+    for (const auto count : counts) {
+      EXPECT_GT(count, 450);
+      EXPECT_LT(count, 800);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -16,14 +16,21 @@
 #include "common/object_lock.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <future>
+#include <iostream>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "folly/SharedMutex.h"
 #include "gtest/gtest.h"
 
 using common::ObjectLock;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 using std::promise;
 using std::thread;
 using std::vector;
@@ -129,6 +136,112 @@ TEST(ObjectLockTest, ObjectTryLockTest) {
   RunMultipleThreadTest(10, 10000, 100, true);
 }
 
+TEST(ObjectLockTest, ManyObjectsInOneBucket) {
+  // 100 objects in 4 buckets, so most of them overflow
+  ObjectLock<int> lock(1);
+  for (int round = 0; round < 3; ++round) {
+    for (int obj = 0; obj < 100; ++obj) {
+      EXPECT_TRUE(lock.TryLock(obj));
+    }
+    for (int obj = 0; obj < 100; ++obj) {
+      EXPECT_FALSE(lock.TryLock(obj));
+    }
+    for (int obj = 99; obj >= 0; --obj) {
+      lock.Unlock(obj);
+    }
+  }
+}
+
+TEST(ObjectLockTest, SharedLockTest) {
+  ObjectLock<std::string, std::hash<std::string>, folly::SharedMutex> lock;
+  const std::string token = "token";
+
+  lock.LockShared(token);
+  lock.LockShared(token);
+
+  std::atomic<bool> locked(false);
+  thread thr([&lock, &locked, &token] () {
+      lock.Lock(token);
+      locked = true;
+      lock.Unlock(token);
+    });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(locked);
+  lock.UnlockShared(token);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(locked);
+  lock.UnlockShared(token);
+  thr.join();
+  EXPECT_TRUE(locked);
+
+  lock.Lock(token);
+  thread shared_thr([&lock, &locked, &token] () {
+      lock.LockShared(token);
+      locked = false;
+      lock.UnlockShared(token);
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(locked);
+  lock.Unlock(token);
+  shared_thr.join();
+  EXPECT_FALSE(locked);
+}
+
+// Return # of Lock() and Unlock() pairs per second of n_threads threads,
+// each of them locking n_objects_per_thread distinct objects in turn
+template <typename Lock>
+double LockThroughput(Lock* lock, size_t n_threads,
+                      size_t n_objects_per_thread, size_t n_rounds,
+                      bool shared) {
+  vector<thread> threads(n_threads);
+  const auto start = steady_clock::now();
+  for (size_t i = 0; i < n_threads; ++i) {
+    threads[i] = thread([lock, i, n_objects_per_thread, n_rounds, shared] {
+        const size_t first = i * n_objects_per_thread;
+        for (size_t round = 0; round < n_rounds; ++round) {
+          for (size_t obj = first; obj < first + n_objects_per_thread;
+               ++obj) {
+            if (shared) {
+              lock->LockShared(obj);
+              lock->UnlockShared(obj);
+            } else {
+              lock->Lock(obj);
+              lock->Unlock(obj);
+            }
+          }
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  const auto us =
+    duration_cast<microseconds>(steady_clock::now() - start).count();
+  return n_threads * n_objects_per_thread * n_rounds * 1000000.0 /
+    std::max<int64_t>(us, 1);
+}
+
+TEST(ObjectLockTest, LockThroughput) {
+  const size_t n_objects_per_thread = 100000;
+  const size_t n_rounds = 10;
+  const size_t max_threads = std::max(1u, thread::hardware_concurrency());
+  for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 4) {
+    ObjectLock<size_t> lock(n_threads);
+    ObjectLock<size_t, std::hash<size_t>, folly::SharedMutex> shared_lock(
+        n_threads);
+    std::cout << n_threads << " threads: Lock() "
+              << LockThroughput(&lock, n_threads, n_objects_per_thread,
+                                n_rounds, false)
+              << " locks/s, LockShared() "
+              << LockThroughput(&shared_lock, n_threads, n_objects_per_thread,
+                                n_rounds, true)
+              << " locks/s" << std::endl;
+  }
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
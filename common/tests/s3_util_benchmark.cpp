@@ -0,0 +1,309 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// The throughput of the S3Util transfers against a real endpoint, MinIO with
+// --s3_endpoint_override=http://minio:9000 or S3 itself. Each scenario moves
+// --n_files files of --file_mb MB, and reports its MB/s, its requests/s and
+// the CPU seconds it spends per GB.
+//
+// ./s3_util_benchmark --bucket=bench --prefix=s3_util_benchmark \
+//   --scenarios=put,put_multipart,get,get_ranged
+//
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/s3util.h"
+#include "folly/String.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+DEFINE_string(bucket, "", "The bucket to transfer the objects from and to");
+DEFINE_string(prefix, "s3_util_benchmark",
+              "The prefix of the objects of the benchmark, which are deleted "
+              "once it is done");
+DEFINE_string(local_dir, "/tmp/s3_util_benchmark",
+              "The directory of the local files of the benchmark");
+DEFINE_int32(file_mb, 256, "The MB of each file transferred");
+DEFINE_int32(n_files, 4, "The files transferred by each scenario");
+DEFINE_int32(concurrency, 4,
+             "The files transferred at a time by the put and get scenarios");
+DEFINE_int32(max_connections, 16, "The connections of the S3 client");
+DEFINE_int32(request_timeout_ms, 30000, "The timeout of each request");
+DEFINE_int32(rate_limit_mb, 50,
+             "The read rate limit (MB/s) checked by the rate_limit scenario");
+DEFINE_string(scenarios,
+              "put,put_multipart,get,get_direct_io,get_ranged,get_objects,"
+              "rate_limit",
+              "The comma separated scenarios to run");
+
+DECLARE_int32(s3_multipart_upload_part_size_mb);
+DECLARE_int32(s3_multipart_upload_concurrency);
+DECLARE_int32(s3_multipart_upload_part_retries);
+DECLARE_int32(s3_ranged_get_part_size_mb);
+DECLARE_int32(s3_ranged_get_concurrency);
+DECLARE_int32(s3_ranged_get_part_retries);
+
+using common::S3Util;
+
+namespace {
+
+// The limits of the S3Util of the unthrottled scenarios, in MB/s
+const uint32_t kUnlimitedMB = 100000;
+
+struct Result {
+  double seconds;
+  double cpu_seconds;
+  uint64_t bytes;
+  uint64_t requests;
+};
+
+double CpuSeconds() {
+  struct rusage usage;
+  CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+uint64_t FileBytes() {
+  return static_cast<uint64_t>(FLAGS_file_mb) << 20;
+}
+
+// The requests of one transfer of part_size_mb parts, besides the one
+// starting (CreateMultipartUpload / HeadObject) and the one finishing it
+uint64_t NumParts(const int part_size_mb) {
+  const auto part_size = static_cast<uint64_t>(std::max(part_size_mb, 1)) << 20;
+  return (FileBytes() + part_size - 1) / part_size;
+}
+
+std::string LocalFile(const std::string& dir, const int i) {
+  return FLAGS_local_dir + "/" + dir + "/file" + std::to_string(i);
+}
+
+std::string Key(const std::string& dir, const int i) {
+  return FLAGS_prefix + "/" + dir + "/file" + std::to_string(i);
+}
+
+void MakeDir(const std::string& dir) {
+  CHECK_EQ(std::system(("mkdir -p " + FLAGS_local_dir + "/" + dir).c_str()),
+           0);
+}
+
+// The random, thus incompressible, local files uploaded by the put scenarios
+void WriteLocalFiles() {
+  MakeDir("src");
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> chunk((1 << 20) / sizeof(uint64_t));
+  for (int i = 0; i < FLAGS_n_files; ++i) {
+    std::ofstream out(LocalFile("src", i), std::ios::binary | std::ios::trunc);
+    for (int mb = 0; mb < FLAGS_file_mb; ++mb) {
+      for (auto& word : chunk) {
+        word = rng();
+      }
+      out.write(reinterpret_cast<const char*>(chunk.data()),
+                chunk.size() * sizeof(uint64_t));
+    }
+    CHECK(out.good()) << "Failed to write " << LocalFile("src", i);
+  }
+}
+
+// Run transfer(i) for each file, FLAGS_concurrency files at a time
+Result Run(const std::function<void(int)>& transfer,
+           const uint64_t requests_per_file) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto start_cpu = CpuSeconds();
+
+  std::vector<std::thread> threads;
+  const int n_threads = std::max(1, std::min(FLAGS_concurrency, FLAGS_n_files));
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&transfer, t, n_threads] {
+        for (int i = t; i < FLAGS_n_files; i += n_threads) {
+          transfer(i);
+        }
+      });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  return Result{elapsed.count(), CpuSeconds() - start_cpu,
+                FileBytes() * FLAGS_n_files,
+                requests_per_file * FLAGS_n_files};
+}
+
+void CheckGet(const common::GetObjectResponse& response,
+              const std::string& key) {
+  CHECK(response.Body()) << "Failed to get " << key << ": "
+                         << response.Error();
+}
+
+void CheckPut(const common::PutObjectResponse& response,
+              const std::string& key) {
+  CHECK(response.Body()) << "Failed to put " << key << ": "
+                         << response.Error();
+}
+
+Result Put(S3Util* s3util) {
+  return Run([s3util] (int i) {
+      CheckPut(s3util->putObject(Key("put", i), LocalFile("src", i)),
+               Key("put", i));
+    }, 1);
+}
+
+Result PutMultipart(S3Util* s3util) {
+  const auto part_size =
+    static_cast<uint64_t>(FLAGS_s3_multipart_upload_part_size_mb) << 20;
+  return Run([s3util, part_size] (int i) {
+      CheckPut(s3util->putObjectMultipart(
+                 Key("put_multipart", i), LocalFile("src", i), part_size,
+                 FLAGS_s3_multipart_upload_concurrency,
+                 FLAGS_s3_multipart_upload_part_retries),
+               Key("put_multipart", i));
+    }, NumParts(FLAGS_s3_multipart_upload_part_size_mb) + 2);
+}
+
+Result Get(S3Util* s3util, const std::string& dir, const bool direct_io) {
+  MakeDir(dir);
+  return Run([s3util, dir, direct_io] (int i) {
+      CheckGet(s3util->getObject(Key("src", i), LocalFile(dir, i), direct_io),
+               Key("src", i));
+    }, 1);
+}
+
+Result GetRanged(S3Util* s3util) {
+  MakeDir("get_ranged");
+  const auto part_size =
+    static_cast<uint64_t>(FLAGS_s3_ranged_get_part_size_mb) << 20;
+  return Run([s3util, part_size] (int i) {
+      CheckGet(s3util->getObjectRanged(
+                 Key("src", i), LocalFile("get_ranged", i), part_size,
+                 FLAGS_s3_ranged_get_concurrency,
+                 FLAGS_s3_ranged_get_part_retries),
+               Key("src", i));
+    }, NumParts(FLAGS_s3_ranged_get_part_size_mb) + 1);
+}
+
+// All files with one getObjects(), which downloads
+// --s3_get_objects_concurrency of them at a time
+Result GetObjects(S3Util* s3util) {
+  MakeDir("get_objects");
+  const auto start = std::chrono::steady_clock::now();
+  const auto start_cpu = CpuSeconds();
+  const auto response = s3util->getObjects(
+    FLAGS_prefix + "/src/", FLAGS_local_dir + "/get_objects");
+  CHECK(response.Error().empty()) << response.Error();
+  for (const auto& object : response.Body()) {
+    CHECK(object.Body()) << object.Error();
+  }
+  CHECK_EQ(response.Body().size(), static_cast<size_t>(FLAGS_n_files));
+
+  const std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  // one listing, and one GET per file
+  return Result{elapsed.count(), CpuSeconds() - start_cpu,
+                FileBytes() * FLAGS_n_files,
+                static_cast<uint64_t>(FLAGS_n_files) + 1};
+}
+
+void PrintResult(const std::string& scenario, const Result& result) {
+  const double mb = static_cast<double>(result.bytes) / (1 << 20);
+  printf("%-16s %12.1f %12.1f %14.2f %10.1f\n", scenario.c_str(),
+         mb / result.seconds, result.requests / result.seconds,
+         result.cpu_seconds / (mb / 1024), result.seconds);
+}
+
+void DeleteObjects(S3Util* s3util) {
+  auto response = s3util->listAllObjects(FLAGS_prefix + "/");
+  for (const auto& key : response.Body().objects) {
+    auto deleted = s3util->deleteObject(key);
+    LOG_IF(ERROR, !deleted.Body()) << "Failed to delete " << key << ": "
+                                   << deleted.Error();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_bucket.empty()) << "--bucket is required";
+  CHECK_GT(FLAGS_file_mb, 0);
+  CHECK_GT(FLAGS_n_files, 0);
+
+  std::vector<std::string> scenarios;
+  folly::split(',', FLAGS_scenarios, scenarios, true);
+
+  auto s3util = S3Util::BuildS3Util(
+    kUnlimitedMB, FLAGS_bucket, 3000, FLAGS_request_timeout_ms,
+    FLAGS_max_connections, kUnlimitedMB);
+
+  // the objects the get scenarios download, which are uploaded untimed
+  WriteLocalFiles();
+  for (int i = 0; i < FLAGS_n_files; ++i) {
+    CheckPut(s3util->putObject(Key("src", i), LocalFile("src", i)),
+             Key("src", i));
+  }
+
+  printf("%d files of %d MB, %d at a time\n\n", FLAGS_n_files, FLAGS_file_mb,
+         FLAGS_concurrency);
+  printf("%-16s %12s %12s %14s %10s\n", "scenario", "MB/s", "requests/s",
+         "CPU sec/GB", "seconds");
+  for (const auto& scenario : scenarios) {
+    if (scenario == "put") {
+      PrintResult(scenario, Put(s3util.get()));
+    } else if (scenario == "put_multipart") {
+      PrintResult(scenario, PutMultipart(s3util.get()));
+    } else if (scenario == "get") {
+      PrintResult(scenario, Get(s3util.get(), "get", false));
+    } else if (scenario == "get_direct_io") {
+      PrintResult(scenario, Get(s3util.get(), "get_direct_io", true));
+    } else if (scenario == "get_ranged") {
+      PrintResult(scenario, GetRanged(s3util.get()));
+    } else if (scenario == "get_objects") {
+      PrintResult(scenario, GetObjects(s3util.get()));
+    } else if (scenario == "rate_limit") {
+      // an S3Util of its own, with the read rate limit under test
+      auto limited = S3Util::BuildS3Util(
+        FLAGS_rate_limit_mb, FLAGS_bucket, 3000, FLAGS_request_timeout_ms,
+        FLAGS_max_connections, kUnlimitedMB);
+      const auto result = Get(limited.get(), "rate_limit", false);
+      PrintResult(scenario, result);
+      const double mb_per_sec =
+        static_cast<double>(result.bytes) / (1 << 20) / result.seconds;
+      printf("%-16s %12.1f MB/s for a limit of %d MB/s (%.1f%%)\n", "",
+             mb_per_sec, FLAGS_rate_limit_mb,
+             100 * mb_per_sec / FLAGS_rate_limit_mb);
+    } else {
+      LOG(ERROR) << "Unknown scenario " << scenario;
+    }
+  }
+
+  DeleteObjects(s3util.get());
+  CHECK_EQ(std::system(("rm -rf " + FLAGS_local_dir).c_str()), 0);
+}
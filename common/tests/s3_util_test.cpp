@@ -16,6 +16,8 @@
 // @author shu (shu@pinterest.com)
 //
 
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <tuple>
 
@@ -25,10 +27,76 @@
 #include "common/s3util.h"
 #include "gtest/gtest.h"
 
+DECLARE_int32(direct_io_writer_n_buffers);
+DECLARE_string(s3_client_backend);
+
 namespace fs = boost::filesystem;
 
 using std::string;
 
+namespace {
+
+// Downloads content, or fails with error
+class FakeCrtClient : public common::S3CrtClient {
+ public:
+  Result getObject(
+      const string& bucket, const string& key,
+      const std::function<std::iostream*()>& stream_factory) override {
+    last_key = bucket + "/" + key;
+    if (!result.error.empty()) {
+      return result;
+    }
+
+    auto stream = stream_factory();
+    *stream << content;
+    Aws::Delete(stream);
+    return result;
+  }
+
+  Result putObject(const string& bucket, const string& key,
+                   const string& local_path, const string& tags) override {
+    last_key = bucket + "/" + key;
+    last_tags = tags;
+    return result;
+  }
+
+  string content;
+  Result result{"", 0, false};
+  string last_key;
+  string last_tags;
+};
+
+// Records the costs applied, without delaying anything
+class FakeRateLimiter
+    : public Aws::Utils::RateLimits::RateLimiterInterface {
+ public:
+  DelayType ApplyCost(int64_t cost) override {
+    cost_ += cost;
+    return DelayType(0);
+  }
+
+  void ApplyAndPayForCost(int64_t cost) override {
+    cost_ += cost;
+  }
+
+  void SetRate(int64_t, bool) override {}
+
+  int64_t cost_ = 0;
+};
+
+class CrtS3Util : public common::S3Util {
+ public:
+  CrtS3Util(shared_ptr<common::S3CrtClient> crt_client,
+            RateLimiterPtr read_rate_limiter,
+            RateLimiterPtr write_rate_limiter)
+      : S3Util("bucket", std::move(crt_client), std::move(read_rate_limiter),
+               std::move(write_rate_limiter)) {}
+
+  using S3Util::GetCrtClient;
+};
+
+}  // namespace
+
 TEST(S3UtilTest, ParseS3StringTest) {
   string test_path = "invalid/string";
   tuple<string, string> result = common::S3Util::parseFullS3Path(test_path);
@@ -140,11 +208,116 @@ TEST(S3UtilTest, DirectIOTest) {
   fs::remove(file_path);
 }
 
+TEST(S3UtilTest, MultiBufferDirectIOTest) {
+  const string file_path = "/tmp/s3MultiBufferDirectIO";
+  FLAGS_direct_io_buffer_n_pages = 1;
+  FLAGS_direct_io_writer_n_buffers = 3;
+
+  // many full buffers in flight, plus a partial last one
+  string data;
+  for (int i = 0; i < 4096 * 10 + 7; ++i) {
+    data.push_back('a' + i % 26);
+  }
+  {
+    common::DirectIOWritableFile file(file_path);
+    for (size_t i = 0; i < data.size(); i += 1000) {
+      auto n = std::min<size_t>(1000, data.size() - i);
+      EXPECT_EQ(file.write(data.data() + i, n), static_cast<std::streamsize>(n));
+    }
+  }
+  fs::ifstream f_in;
+  f_in.open(file_path, std::ios::in);
+  std::stringstream ss;
+  ss << f_in.rdbuf();
+  EXPECT_EQ(data, ss.str());
+
+  FLAGS_direct_io_writer_n_buffers = 1;
+  fs::remove(file_path);
+}
+
 TEST(S3UtilTest, CreateS3UtilNoCrash) {
   auto s3util_ptr = common::S3Util::BuildS3Util(0, "", 0, 0);
   s3util_ptr = nullptr;
 }
 
+TEST(S3UtilTest, CrtGetObject) {
+  const string file_path = "/tmp/s3CrtGetObject";
+  auto crt_client = std::make_shared<FakeCrtClient>();
+  auto read_limiter = std::make_shared<FakeRateLimiter>();
+  auto write_limiter = std::make_shared<FakeRateLimiter>();
+  CrtS3Util s3util(crt_client, read_limiter, write_limiter);
+
+  crt_client->content = "hello world!";
+  crt_client->result = common::S3CrtClient::Result{"", 12, false};
+  auto resp = s3util.getObject("key", file_path);
+  EXPECT_TRUE(resp.Error().empty());
+  EXPECT_TRUE(resp.Body());
+  EXPECT_EQ(crt_client->last_key, "bucket/key");
+  fs::ifstream f_in;
+  f_in.open(file_path, std::ios::in);
+  std::stringstream ss;
+  ss << f_in.rdbuf();
+  EXPECT_EQ(ss.str(), "hello world!");
+  // The bytes are charged to the read limiter once the transfer is done
+  EXPECT_EQ(read_limiter->cost_, 12);
+  EXPECT_EQ(write_limiter->cost_, 0);
+
+  // Nothing transferred, nothing charged
+  crt_client->result = common::S3CrtClient::Result{"SlowDown", 0, true};
+  resp = s3util.getObject("key", file_path);
+  EXPECT_FALSE(resp.Body());
+  EXPECT_NE(resp.Error().find("SlowDown"), string::npos);
+  EXPECT_EQ(read_limiter->cost_, 12);
+  fs::remove(file_path);
+}
+
+TEST(S3UtilTest, CrtPutObject) {
+  auto crt_client = std::make_shared<FakeCrtClient>();
+  auto read_limiter = std::make_shared<FakeRateLimiter>();
+  auto write_limiter = std::make_shared<FakeRateLimiter>();
+  CrtS3Util s3util(crt_client, read_limiter, write_limiter);
+
+  crt_client->result = common::S3CrtClient::Result{"", 100, false};
+  auto resp = s3util.putObject("key", "/tmp/s3CrtPutObject", "Key1=Value1");
+  EXPECT_TRUE(resp.Error().empty());
+  EXPECT_TRUE(resp.Body());
+  EXPECT_EQ(crt_client->last_key, "bucket/key");
+  EXPECT_EQ(crt_client->last_tags, "Key1=Value1");
+  EXPECT_EQ(write_limiter->cost_, 100);
+  EXPECT_EQ(read_limiter->cost_, 0);
+
+  crt_client->result = common::S3CrtClient::Result{"Access Denied", 0, false};
+  resp = s3util.putObject("key", "/tmp/s3CrtPutObject");
+  EXPECT_FALSE(resp.Body());
+  EXPECT_NE(resp.Error().find("Access Denied"), string::npos);
+  EXPECT_EQ(write_limiter->cost_, 100);
+}
+
+TEST(S3UtilTest, CrtClientFallback) {
+  // Keeps the aws sdk initialized
+  CrtS3Util s3util(nullptr, nullptr, nullptr);
+  ClientConfiguration config;
+
+  FLAGS_s3_client_backend = "classic";
+  EXPECT_EQ(CrtS3Util::GetCrtClient(config), nullptr);
+  FLAGS_s3_client_backend = "unknown";
+  EXPECT_EQ(CrtS3Util::GetCrtClient(config), nullptr);
+
+  // Falls back to the classic client if we are not built with the CRT one
+  FLAGS_s3_client_backend = "crt";
+#ifdef ROCKSPLICATOR_WITH_S3_CRT
+  auto client = CrtS3Util::GetCrtClient(config);
+  EXPECT_NE(client, nullptr);
+  // Shared by the S3Utils of the endpoint
+  EXPECT_EQ(CrtS3Util::GetCrtClient(config), client);
+  client = nullptr;
+#else
+  EXPECT_EQ(CrtS3Util::GetCrtClient(config), nullptr);
+  EXPECT_EQ(common::S3CrtClient::Get("", "https"), nullptr);
+#endif
+  FLAGS_s3_client_backend = "classic";
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,120 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/thread_placement.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/identical_name_thread_factory.h"
+#include "gtest/gtest.h"
+
+using common::IdenticalNameThreadFactory;
+using common::ParseCpuList;
+using common::ThreadPlacement;
+
+namespace {
+
+std::vector<int> getAffinity() {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  EXPECT_EQ(sched_getaffinity(0, sizeof(cpu_set), &cpu_set), 0);
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpu_set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+}  // namespace
+
+TEST(ThreadPlacementTest, ParseCpuList) {
+  std::vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11", &cpus));
+  EXPECT_EQ(cpus, std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_TRUE(ParseCpuList("5,1-2,2\n", &cpus));
+  EXPECT_EQ(cpus, std::vector<int>({1, 2, 5}));
+
+  EXPECT_FALSE(ParseCpuList("", &cpus));
+  EXPECT_FALSE(ParseCpuList("a", &cpus));
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("1-2-3", &cpus));
+  EXPECT_FALSE(ParseCpuList("-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("100000", &cpus));
+}
+
+TEST(ThreadPlacementTest, Create) {
+  EXPECT_EQ(ThreadPlacement::Create(""), nullptr);
+  EXPECT_EQ(ThreadPlacement::Create("x"), nullptr);
+  EXPECT_EQ(ThreadPlacement::Create("core:"), nullptr);
+  EXPECT_EQ(ThreadPlacement::Create("node:100000"), nullptr);
+
+  auto placement = ThreadPlacement::Create("core:0,1");
+  ASSERT_NE(placement, nullptr);
+  EXPECT_EQ(placement->cpus(), std::vector<int>({0, 1}));
+}
+
+TEST(ThreadPlacementTest, Apply) {
+  auto placement = ThreadPlacement::Create("0");
+  ASSERT_NE(placement, nullptr);
+  std::thread t([placement] {
+      EXPECT_TRUE(placement->Apply());
+      EXPECT_EQ(getAffinity(), std::vector<int>({0}));
+    });
+  t.join();
+
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+    return;
+  }
+
+  // One CPU per thread, round robin
+  IdenticalNameThreadFactory factory("placed",
+                                     ThreadPlacement::Create("core:0-1"));
+  std::vector<std::vector<int>> affinities(4);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.push_back(factory.newThread([&affinities, i] {
+        affinities[i] = getAffinity();
+      }));
+    threads.back().join();
+  }
+  EXPECT_EQ(affinities[0], std::vector<int>({0}));
+  EXPECT_EQ(affinities[1], std::vector<int>({1}));
+  EXPECT_EQ(affinities[2], std::vector<int>({0}));
+  EXPECT_EQ(affinities[3], std::vector<int>({1}));
+}
+
+TEST(ThreadPlacementTest, NumaNode) {
+  auto placement = ThreadPlacement::Create("node:0");
+  if (access("/sys/devices/system/node/node0/cpulist", R_OK) != 0) {
+    EXPECT_EQ(placement, nullptr);
+    return;
+  }
+
+  ASSERT_NE(placement, nullptr);
+  EXPECT_FALSE(placement->cpus().empty());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
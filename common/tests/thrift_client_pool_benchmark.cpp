@@ -0,0 +1,140 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "common/tests/thrift/gen-cpp2/DummyService.h"
+#include "common/thrift_client_pool.h"
+#include "folly/Benchmark.h"
+#include "folly/SocketAddress.h"
+#include "thrift/lib/cpp2/server/ThriftServer.h"
+
+using apache::thrift::HandlerCallback;
+using apache::thrift::ThriftServer;
+using dummy_service::thrift::DummyServiceAsyncClient;
+using dummy_service::thrift::DummyServiceSvIf;
+
+using Pool = common::ThriftClientPool<DummyServiceAsyncClient>;
+
+namespace {
+
+const uint16_t kPort = 9190;
+const int kNumHosts = 16;
+
+struct DummyServiceHandler : public DummyServiceSvIf {
+  void async_tm_ping(std::unique_ptr<HandlerCallback<void>> callback)
+      override {
+    callback->done();
+  }
+};
+
+// The same server through different loopback addresses
+std::vector<folly::SocketAddress> getAddrs() {
+  std::vector<folly::SocketAddress> addrs(kNumHosts);
+  for (int i = 0; i < kNumHosts; ++i) {
+    addrs[i].setFromIpPort("127.0.0." + std::to_string(i + 1), kPort);
+  }
+  return addrs;
+}
+
+void getClientFromThreads(const int n, const int n_threads,
+                          const int channels_per_destination) {
+  std::unique_ptr<Pool> pool;
+  std::vector<folly::SocketAddress> addrs;
+  std::atomic<int> n_ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  BENCHMARK_SUSPEND {
+    FLAGS_channels_per_destination = channels_per_destination;
+    pool = std::make_unique<Pool>();
+    addrs = getAddrs();
+    for (const auto& addr : addrs) {
+      // connect before measuring
+      pool->getClient(addr)->future_ping().get();
+    }
+
+    for (int i = 0; i < n_threads; ++i) {
+      threads.emplace_back([&pool, &addrs, n, n_threads, &n_ready, &go] {
+          ++n_ready;
+          while (!go.load()) {
+            std::this_thread::yield();
+          }
+
+          for (int j = 0; j < n / n_threads; ++j) {
+            folly::doNotOptimizeAway(
+              pool->getClient(addrs[j % addrs.size()]));
+          }
+        });
+    }
+
+    while (n_ready.load() < n_threads) {
+      std::this_thread::yield();
+    }
+  }
+
+  go = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  BENCHMARK_SUSPEND {
+    pool.reset();
+    FLAGS_channels_per_destination = 1;
+  }
+}
+
+}  // anonymous namespace
+
+BENCHMARK(GetClient1Thread, n) {
+  getClientFromThreads(n, 1, 1);
+}
+
+BENCHMARK(GetClient8Threads, n) {
+  getClientFromThreads(n, 8, 1);
+}
+
+BENCHMARK(GetClient32Threads, n) {
+  getClientFromThreads(n, 32, 1);
+}
+
+BENCHMARK(GetClient64Threads, n) {
+  getClientFromThreads(n, 64, 1);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(GetClient32Threads4ChannelsPerHost, n) {
+  getClientFromThreads(n, 32, 4);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  auto server = std::make_shared<ThriftServer>();
+  server->setPort(kPort);
+  server->setInterface(std::make_shared<DummyServiceHandler>());
+  std::thread server_thread([server] { server->serve(); });
+  sleep(1);
+
+  folly::runBenchmarks();
+
+  server->stop();
+  server_thread.join();
+}
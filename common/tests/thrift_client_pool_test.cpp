@@ -290,6 +290,79 @@ TEST(ThriftClientTest, Stress) {
   thr->join();
 }
 
+TEST(ThriftClientTest, ChannelsPerDestination) {
+  shared_ptr<DummyServiceTestHandler> handler;
+  shared_ptr<ThriftServer> server;
+  unique_ptr<thread> thr;
+  tie(handler, server, thr) = makeServer(gPort, 0);
+  sleep(1);
+
+  FLAGS_channels_per_destination = 2;
+  ThriftClientPool<DummyServiceAsyncClient> pool(1);
+  auto client_1 = pool.getClient(gLocalIp, gPort);
+  auto client_2 = pool.getClient(gLocalIp, gPort);
+  ASSERT_TRUE(client_1 != nullptr);
+  ASSERT_TRUE(client_2 != nullptr);
+  // A new channel while the first one is in use
+  EXPECT_NE(client_1->getChannel(), client_2->getChannel());
+
+  // No more than 2 channels
+  auto client_3 = pool.getClient(gLocalIp, gPort);
+  ASSERT_TRUE(client_3 != nullptr);
+  EXPECT_TRUE(client_3->getChannel() == client_1->getChannel() ||
+              client_3->getChannel() == client_2->getChannel());
+
+  // The channel used by the fewest clients
+  const auto shared_channel = client_3->getChannel();
+  auto client_4 = pool.getClient(gLocalIp, gPort);
+  ASSERT_TRUE(client_4 != nullptr);
+  EXPECT_NE(client_4->getChannel(), shared_channel);
+
+  for (auto client : { client_1.get(), client_2.get(), client_3.get(),
+                       client_4.get() }) {
+    EXPECT_NO_THROW(client->future_ping().get());
+  }
+  EXPECT_EQ(handler->nPings_.load(), 4);
+  FLAGS_channels_per_destination = 1;
+
+  server->stop();
+  thr->join();
+}
+
+TEST(ThriftClientTest, ChannelCounts) {
+  ThriftClientPool<DummyServiceAsyncClient> pool(1);
+  auto client = pool.getClient(gLocalIp, gPort);
+  ASSERT_TRUE(client != nullptr);
+  auto counts = pool.getChannelCounts();
+  EXPECT_EQ(counts.live, 1);
+  EXPECT_EQ(counts.idle, 0);
+
+  // Every destination is idle from now on
+  FLAGS_channel_idle_seconds = -1;
+  counts = pool.getChannelCounts();
+  EXPECT_EQ(counts.live, 0);
+  EXPECT_EQ(counts.idle, 1);
+
+  // The cleanup keeps the channels still used by clients
+  auto other_client = pool.getClient(gLocalIp, gPort + 1);
+  ASSERT_TRUE(other_client != nullptr);
+  counts = pool.getChannelCounts();
+  EXPECT_EQ(counts.idle, 2);
+
+  // and drops the released ones
+  client.reset();
+  other_client = pool.getClient(gLocalIp, gPort + 1);
+  ASSERT_TRUE(other_client != nullptr);
+  counts = pool.getChannelCounts();
+  EXPECT_EQ(counts.idle, 1);
+  EXPECT_EQ(counts.live, 0);
+
+  FLAGS_channel_idle_seconds = 60;
+  counts = pool.getChannelCounts();
+  EXPECT_EQ(counts.live, 1);
+  EXPECT_EQ(counts.idle, 0);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   FLAGS_channel_cleanup_min_interval_seconds = -1;
@@ -0,0 +1,319 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/key_to_shard.h"
+#include "common/tests/thrift/gen-cpp2/DummyService.h"
+#include "common/thrift_router.h"
+#include "folly/Benchmark.h"
+#include "folly/Conv.h"
+#include "thrift/lib/cpp2/server/ThriftServer.h"
+
+using apache::thrift::HandlerCallback;
+using apache::thrift::ThriftServer;
+using dummy_service::thrift::DummyServiceAsyncClient;
+using dummy_service::thrift::DummyServiceSvIf;
+
+using Router = common::ThriftRouter<DummyServiceAsyncClient>;
+using Role = Router::Role;
+using Quantity = Router::Quantity;
+
+namespace {
+
+const int kNumShards = 1024;
+const int kNumReplicas = 3;
+// Each server is reached through many loopback addresses, as distinct hosts
+const int kNumServers = 3;
+const uint16_t kFirstPort = 9090;
+const char* kLocalGroup = "us-east-1c";
+
+struct DummyServiceHandler : public DummyServiceSvIf {
+  void async_tm_ping(std::unique_ptr<HandlerCallback<void>> callback)
+      override {
+    callback->done();
+  }
+};
+
+// A segment "seg" of kNumShards shards, each on kNumReplicas of n_hosts
+// hosts spread over 3 zones, with the first one as the Master
+std::string makeConfig(const int n_hosts) {
+  static const char* zones[] = { "us-east-1a", "us-east-1c", "us-east-1e" };
+  std::vector<std::vector<std::string>> host_shards(n_hosts);
+  for (int shard = 0; shard < kNumShards; ++shard) {
+    for (int r = 0; r < kNumReplicas && r < n_hosts; ++r) {
+      char name[16];
+      snprintf(name, sizeof(name), "%05d:%c", shard, r == 0 ? 'M' : 'S');
+      host_shards[(shard + r) % n_hosts].push_back(name);
+    }
+  }
+
+  std::string config = "{\"seg\": {\"num_leaf_segments\": " +
+    folly::to<std::string>(kNumShards);
+  for (int i = 0; i < n_hosts; ++i) {
+    config += ", \"127.0." + folly::to<std::string>(i / 250) + "." +
+      folly::to<std::string>(i % 250 + 1) + ":" +
+      folly::to<std::string>(kFirstPort + i % kNumServers) + ":" +
+      zones[i % 3] + "\": [";
+    for (size_t j = 0; j < host_shards[i].size(); ++j) {
+      config += (j == 0 ? "\"" : ", \"") + host_shards[i][j] + "\"";
+    }
+    config += "]";
+  }
+  return config + "}}";
+}
+
+std::unique_ptr<Router> makeRouter(const int n_hosts) {
+  const std::string path =
+    "./thrift_router_benchmark_" + folly::to<std::string>(n_hosts);
+  std::ofstream(path) << makeConfig(n_hosts);
+  return std::make_unique<Router>(kLocalGroup, path, common::parseConfig);
+}
+
+Router* getRouter(const int n_hosts) {
+  static std::unique_ptr<Router> routers[] = {
+    makeRouter(3), makeRouter(30), makeRouter(300),
+  };
+  return routers[n_hosts == 3 ? 0 : (n_hosts == 30 ? 1 : 2)].get();
+}
+
+// Warm up the clients of this thread, so that connecting isn't measured
+void warmUp(Router* router) {
+  Router::ClientVector clients;
+  const auto segment = router->getSegmentHandle("seg");
+  for (int shard = 0; shard < kNumShards; ++shard) {
+    router->getClientsFor(segment, Role::ANY, Quantity::ALL, shard, &clients);
+  }
+}
+
+void getClientsForByName(const int n, const int n_hosts, const Role role,
+                         const Quantity quantity) {
+  Router* router;
+  BENCHMARK_SUSPEND {
+    router = getRouter(n_hosts);
+    warmUp(router);
+  }
+
+  std::vector<std::shared_ptr<DummyServiceAsyncClient>> clients;
+  for (int i = 0; i < n; ++i) {
+    router->getClientsFor("seg", role, quantity, i % kNumShards, &clients);
+  }
+  folly::doNotOptimizeAway(clients);
+}
+
+void getClientsForByHandle(const int n, const int n_hosts, const Role role,
+                           const Quantity quantity) {
+  Router* router;
+  Router::SegmentHandle segment;
+  BENCHMARK_SUSPEND {
+    router = getRouter(n_hosts);
+    segment = router->getSegmentHandle("seg");
+    warmUp(router);
+  }
+
+  Router::ClientVector clients;
+  for (int i = 0; i < n; ++i) {
+    router->getClientsFor(segment, role, quantity, i % kNumShards, &clients);
+  }
+  folly::doNotOptimizeAway(clients);
+}
+
+void getClientsForFromThreads(const int n, const int n_threads) {
+  std::atomic<int> n_ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  BENCHMARK_SUSPEND {
+    auto router = getRouter(30);
+    const auto segment = router->getSegmentHandle("seg");
+    for (int i = 0; i < n_threads; ++i) {
+      threads.emplace_back([router, segment, n, n_threads, &n_ready, &go] {
+          warmUp(router);
+          ++n_ready;
+          while (!go.load()) {
+            std::this_thread::yield();
+          }
+
+          Router::ClientVector clients;
+          for (int j = 0; j < n / n_threads; ++j) {
+            router->getClientsFor(segment, Role::ANY, Quantity::ONE,
+                                  j % kNumShards, &clients);
+          }
+          folly::doNotOptimizeAway(clients);
+        });
+    }
+
+    while (n_ready.load() < n_threads) {
+      std::this_thread::yield();
+    }
+  }
+
+  go = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void getShardForKey(const int n, const char* type) {
+  std::unique_ptr<const common::KeyToShardMapper> mapper;
+  std::vector<uint64_t> hashes;
+  BENCHMARK_SUSPEND {
+    mapper = common::CreateKeyToShardMapper(type, kNumShards);
+    for (int i = 0; i < 1024; ++i) {
+      hashes.push_back(
+        common::HashKeyForShard("key_" + folly::to<std::string>(i)));
+    }
+  }
+
+  uint32_t sum = 0;
+  for (int i = 0; i < n; ++i) {
+    sum += mapper->getShard(hashes[i % hashes.size()]);
+  }
+  folly::doNotOptimizeAway(sum);
+}
+
+// What each config change costs the FileWatcher thread
+void updateLayout(const int n, const int n_hosts) {
+  std::string config;
+  std::shared_ptr<const common::detail::ClusterLayout> old_layout;
+  BENCHMARK_SUSPEND {
+    config = makeConfig(n_hosts);
+    old_layout = common::parseConfig(makeConfig(n_hosts - 1), kLocalGroup);
+  }
+
+  for (int i = 0; i < n; ++i) {
+    std::shared_ptr<const common::detail::ClusterLayout> layout =
+      common::parseConfig(config, kLocalGroup);
+    folly::doNotOptimizeAway(
+      common::detail::getRemovedHosts(*old_layout, *layout));
+  }
+}
+
+}  // anonymous namespace
+
+BENCHMARK(GetClientsForByName3Hosts, n) {
+  getClientsForByName(n, 3, Role::ANY, Quantity::ONE);
+}
+
+BENCHMARK_RELATIVE(GetClientsForByHandle3Hosts, n) {
+  getClientsForByHandle(n, 3, Role::ANY, Quantity::ONE);
+}
+
+BENCHMARK(GetClientsForByName30Hosts, n) {
+  getClientsForByName(n, 30, Role::ANY, Quantity::ONE);
+}
+
+BENCHMARK_RELATIVE(GetClientsForByHandle30Hosts, n) {
+  getClientsForByHandle(n, 30, Role::ANY, Quantity::ONE);
+}
+
+BENCHMARK(GetClientsForByName300Hosts, n) {
+  getClientsForByName(n, 300, Role::ANY, Quantity::ONE);
+}
+
+BENCHMARK_RELATIVE(GetClientsForByHandle300Hosts, n) {
+  getClientsForByHandle(n, 300, Role::ANY, Quantity::ONE);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(GetClientsForMasterOne, n) {
+  getClientsForByHandle(n, 30, Role::MASTER, Quantity::ONE);
+}
+
+BENCHMARK(GetClientsForSlaveOne, n) {
+  getClientsForByHandle(n, 30, Role::SLAVE, Quantity::ONE);
+}
+
+BENCHMARK(GetClientsForAnyTwo, n) {
+  getClientsForByHandle(n, 30, Role::ANY, Quantity::TWO);
+}
+
+BENCHMARK(GetClientsForAnyAll, n) {
+  getClientsForByHandle(n, 30, Role::ANY, Quantity::ALL);
+}
+
+BENCHMARK(GetClientsForByNameAnyAll, n) {
+  getClientsForByName(n, 30, Role::ANY, Quantity::ALL);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(GetClientsFor1Thread, n) {
+  getClientsForFromThreads(n, 1);
+}
+
+BENCHMARK(GetClientsFor8Threads, n) {
+  getClientsForFromThreads(n, 8);
+}
+
+BENCHMARK(GetClientsFor32Threads, n) {
+  getClientsForFromThreads(n, 32);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(GetShardForKeyModulo, n) {
+  getShardForKey(n, "modulo");
+}
+
+BENCHMARK_RELATIVE(GetShardForKeyJump, n) {
+  getShardForKey(n, "jump");
+}
+
+BENCHMARK_RELATIVE(GetShardForKeyRendezvous, n) {
+  getShardForKey(n, "rendezvous");
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(UpdateLayout30Hosts, n) {
+  updateLayout(n, 30);
+}
+
+BENCHMARK(UpdateLayout300Hosts, n) {
+  updateLayout(n, 300);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::vector<std::shared_ptr<ThriftServer>> servers;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumServers; ++i) {
+    auto server = std::make_shared<ThriftServer>();
+    server->setPort(kFirstPort + i);
+    server->setInterface(std::make_shared<DummyServiceHandler>());
+    threads.emplace_back([server] { server->serve(); });
+    servers.push_back(std::move(server));
+  }
+  // for the servers to start and the routers to load their configs
+  getRouter(3);
+  sleep(1);
+
+  folly::runBenchmarks();
+
+  for (int i = 0; i < kNumServers; ++i) {
+    servers[i]->stop();
+    threads[i].join();
+  }
+}
@@ -16,8 +16,11 @@
 // @author bol (bol@pinterest.com)
 //
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <fstream>
+#include <map>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -38,6 +41,7 @@ using folly::split;
 
 using std::atoi;
 using std::atomic;
+using std::chrono::milliseconds;
 using std::make_shared;
 using std::make_tuple;
 using std::make_unique;
@@ -128,6 +132,22 @@ static const char* g_config_v5 =
   "   }"
   "}";
 
+// This config replicates each shard through a chain
+static const char* g_config_v6 =
+  "{"
+  "  \"user_pins\": {"
+  "  \"num_leaf_segments\": 1,"
+  "  \"replication_fanout\": 1,"
+  "  \"127.0.0.1:8090\": [\"00000:M\"],"
+  "  \"127.0.0.1:8091\": [\"00000:S\"],"
+  "  \"127.0.0.1:8092\": [\"00000:S\"]"
+  "   },"
+  "  \"interest_pins\": {"
+  "  \"num_leaf_segments\": 1,"
+  "  \"127.0.0.1:8090\": [\"00000:M\"]"
+  "   }"
+  "}";
+
 using ClusterLayout = ThriftRouter<DummyServiceAsyncClient>::ClusterLayout;
 using Role = ThriftRouter<DummyServiceAsyncClient>::Role;
 using Quantity = ThriftRouter<DummyServiceAsyncClient>::Quantity;
@@ -917,6 +937,894 @@ TEST(ThriftRouterTest, UnreachableHost) {
     ReturnCode::BAD_HOST);
 }
 
+TEST(ThriftRouterTest, ReplicationFanout) {
+  auto layout = common::parseConfig(g_config_v6, "");
+  ASSERT_TRUE(layout != nullptr);
+  EXPECT_EQ(layout->segments.at("user_pins").replication_fanout, 1);
+  EXPECT_EQ(layout->segments.at("user_pins").shard_to_hosts[0].size(), 3);
+  EXPECT_EQ(layout->segments.at("interest_pins").replication_fanout, 0);
+
+  EXPECT_TRUE(common::parseConfig(
+    "{\"user_pins\": {\"num_leaf_segments\": 1, "
+    "\"replication_fanout\": \"chain\"}}", "") == nullptr);
+}
+
+TEST(ThriftRouterTest, RocksdbProfileIsNotAHost) {
+  auto layout = common::parseConfig(
+    "{\"user_pins\": {\"num_leaf_segments\": 1, "
+    "\"rocksdb_profile\": \"point_lookup\", "
+    "\"127.0.0.1:8090\": [\"00000\"]}}", "");
+  ASSERT_TRUE(layout != nullptr);
+  EXPECT_EQ(layout->all_hosts.size(), 1);
+  EXPECT_EQ(layout->segments.at("user_pins").shard_to_hosts[0].size(), 1);
+  EXPECT_EQ(layout->segments.at("user_pins").rocksdb_profile, "point_lookup");
+
+  // Not set
+  layout = common::parseConfig(g_config_v3, "");
+  ASSERT_TRUE(layout != nullptr);
+  EXPECT_TRUE(layout->segments.at("user_pins").rocksdb_profile.empty());
+}
+
+TEST(ThriftRouterTest, KeyMapping) {
+  auto layout = common::parseConfig(
+    "{\"user_pins\": {\"num_leaf_segments\": 8, "
+    "\"key_mapping\": \"jump\", \"num_shards_before_split\": 4}, "
+    "\"interest_pins\": {\"num_leaf_segments\": 3}}", "");
+  ASSERT_TRUE(layout != nullptr);
+  const auto& user_pins = layout->segments.at("user_pins");
+  ASSERT_TRUE(user_pins.key_to_shard != nullptr);
+  EXPECT_EQ(user_pins.key_to_shard->numShards(), 8);
+  const auto expected = common::CreateKeyToShardMapper("jump", 8, 4);
+  const auto hash = common::HashKeyForShard("key");
+  EXPECT_EQ(user_pins.key_to_shard->getShard(hash), expected->getShard(hash));
+
+  // modulo by default
+  const auto& interest_pins = layout->segments.at("interest_pins");
+  ASSERT_TRUE(interest_pins.key_to_shard != nullptr);
+  EXPECT_EQ(interest_pins.key_to_shard->getShard(hash), hash % 3);
+
+  EXPECT_TRUE(common::parseConfig(
+    "{\"user_pins\": {\"num_leaf_segments\": 8, "
+    "\"key_mapping\": \"unknown\"}}", "") == nullptr);
+  EXPECT_TRUE(common::parseConfig(
+    "{\"user_pins\": {\"num_leaf_segments\": 8, "
+    "\"num_shards_before_split\": 3}}", "") == nullptr);
+
+  // Through the router
+  updateConfigFile(
+    "{\"user_pins\": {\"num_leaf_segments\": 8, "
+    "\"key_mapping\": \"jump\", \"num_shards_before_split\": 4}}");
+  ThriftRouter<DummyServiceAsyncClient> router("", g_config_path,
+                                               common::parseConfig);
+  const auto handle = router.getSegmentHandle("user_pins");
+  EXPECT_EQ(router.getShardForKey(handle, "key"), expected->getShard(hash));
+  EXPECT_EQ(router.getShardForKey(router.getSegmentHandle("unknown"), "key"),
+            -1);
+
+  const vector<folly::StringPiece> keys = {"key", "key1", "key2"};
+  vector<uint32_t> shards;
+  EXPECT_TRUE(router.getShardsForKeys(handle, keys, &shards));
+  ASSERT_EQ(shards.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(shards[i], router.getShardForKey(handle, keys[i]));
+  }
+}
+
+TEST(ThriftRouterTest, GetRemovedHosts) {
+  auto v3 = common::parseConfig(g_config_v3, "us-east-1c");
+  auto v6 = common::parseConfig(g_config_v6, "us-east-1c");
+  auto v1 = common::parseConfig(
+    "{\"user_pins\": {\"num_leaf_segments\": 1, "
+    "\"127.0.0.1:8080\": [\"00000:M\"], "
+    "\"127.0.0.1:8091\": [\"00000:S\"]}}", "");
+  ASSERT_TRUE(v3 != nullptr);
+  ASSERT_TRUE(v6 != nullptr);
+  ASSERT_TRUE(v1 != nullptr);
+
+  EXPECT_TRUE(common::detail::getRemovedHosts(*v3, *v6).empty());
+  auto removed = common::detail::getRemovedHosts(*v3, *v1);
+  ASSERT_EQ(removed.size(), 2);
+  EXPECT_EQ(removed[0].getPort(), 8090);
+  EXPECT_EQ(removed[1].getPort(), 8092);
+  removed = common::detail::getRemovedHosts(*v1, *v3);
+  ASSERT_EQ(removed.size(), 1);
+  EXPECT_EQ(removed[0].getPort(), 8080);
+
+  // A host of several segments is shared by them
+  const auto& user_pins = v6->segments.at("user_pins");
+  const auto& interest_pins = v6->segments.at("interest_pins");
+  EXPECT_EQ(user_pins.shard_to_hosts[0][0].first,
+            interest_pins.shard_to_hosts[0][0].first);
+  EXPECT_EQ(user_pins.shard_to_hosts[0][0].first->groups_prefix_lengths.size(),
+            2);
+}
+
+namespace {
+
+// Writes the flat config layout of the Java FlatShardMapCodec
+struct FlatConfigWriter {
+  void u16(uint16_t v) {
+    for (int i = 0; i < 2; ++i) {
+      data.push_back(static_cast<char>(v >> (8 * i)));
+    }
+  }
+
+  void u32(uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      data.push_back(static_cast<char>(v >> (8 * i)));
+    }
+  }
+
+  void str(const string& s) {
+    u16(s.size());
+    data += s;
+  }
+
+  string data = "RSM1";
+};
+
+// The same as g_config_v3, unless shard_number says otherwise
+string makeFlatConfigV3(const uint32_t shard_number = 3) {
+  FlatConfigWriter w;
+  w.u32(3);
+  w.str("127.0.0.1:8090:us-east-1a");
+  w.str("127.0.0.1:8091:us-east-1c");
+  w.str("127.0.0.1:8092:us-east-1e");
+  w.u32(1);
+  w.str("user_pins");
+  w.u32(shard_number);  // shards
+  w.u32(0);  // replication fanout
+  w.str("");  // key mapping
+  w.u32(0);  // shards before split
+  w.u32(9);  // entries
+  const uint32_t kMaster = 1U << 30;
+  const uint32_t kSlave = 2U << 30;
+  const uint32_t roles[3][3] = {
+    { kSlave, kSlave, kMaster },
+    { kSlave, kMaster, kSlave },
+    { kMaster, kSlave, kSlave },
+  };
+  for (uint32_t host = 0; host < 3; ++host) {
+    for (uint32_t shard = 0; shard < 3; ++shard) {
+      w.u32(host);
+      w.u32(roles[host][shard] | shard);
+    }
+  }
+  return w.data;
+}
+
+}  // namespace
+
+TEST(ThriftRouterTest, FlatConfig) {
+  auto json_layout = common::parseConfig(g_config_v3, "us-east-1c");
+  const auto flat_config = makeFlatConfigV3();
+  auto flat_layout = common::parseConfig(flat_config, "us-east-1c");
+  ASSERT_TRUE(json_layout != nullptr);
+  ASSERT_TRUE(flat_layout != nullptr);
+
+  ASSERT_EQ(flat_layout->all_hosts.size(), 3);
+  auto json_host = json_layout->all_hosts.begin();
+  for (const auto& host : flat_layout->all_hosts) {
+    EXPECT_EQ(host.addr, json_host->addr);
+    EXPECT_EQ(host.groups_prefix_lengths, json_host->groups_prefix_lengths);
+    ++json_host;
+  }
+
+  const auto& json_shards =
+    json_layout->segments.at("user_pins").shard_to_hosts;
+  const auto& flat_shards =
+    flat_layout->segments.at("user_pins").shard_to_hosts;
+  ASSERT_EQ(flat_shards.size(), json_shards.size());
+  for (size_t shard = 0; shard < flat_shards.size(); ++shard) {
+    ASSERT_EQ(flat_shards[shard].size(), json_shards[shard].size());
+    EXPECT_EQ(flat_shards[shard].capacity(), flat_shards[shard].size());
+    for (size_t i = 0; i < flat_shards[shard].size(); ++i) {
+      EXPECT_EQ(flat_shards[shard][i].first->addr,
+                json_shards[shard][i].first->addr);
+      EXPECT_EQ(flat_shards[shard][i].second, json_shards[shard][i].second);
+    }
+  }
+  EXPECT_EQ(flat_layout->segments.at("user_pins").shard_host_orders.size(), 3);
+  EXPECT_TRUE(flat_layout->segments.at("user_pins").key_to_shard != nullptr);
+
+  // Truncated
+  for (size_t size = 4; size < flat_config.size(); size += 7) {
+    EXPECT_TRUE(common::parseConfig(flat_config.substr(0, size), "") ==
+                nullptr);
+  }
+
+  // Corrupted shard number, more shards than bytes left
+  EXPECT_TRUE(common::parseConfig(makeFlatConfigV3(1U << 29), "") ==
+              nullptr);
+}
+
+TEST(ThriftRouterTest, BuildHostOrders) {
+  auto layout = common::parseConfig(g_config_v3, "us-east-1c");
+  ASSERT_TRUE(layout != nullptr);
+  const auto& orders = layout->segments.at("user_pins").shard_host_orders;
+  ASSERT_EQ(orders.size(), 3);
+
+  // shard 2: 8090 (M, us-east-1a), 8091 (S, us-east-1c), 8092 (S, us-east-1e)
+  const auto& master = orders[2][common::detail::MASTER_ORDER];
+  ASSERT_EQ(master.hosts.size(), 1);
+  EXPECT_EQ(master.hosts[0]->addr.getPort(), 8090);
+  EXPECT_EQ(master.tier_ends, vector<uint32_t>({1}));
+
+  const auto& slave = orders[2][common::detail::SLAVE_ORDER];
+  ASSERT_EQ(slave.hosts.size(), 2);
+  EXPECT_EQ(slave.hosts[0]->addr.getPort(), 8091);
+  EXPECT_EQ(slave.tier_ends, vector<uint32_t>({1, 2}));
+
+  const auto& any_master_first =
+    orders[2][common::detail::ANY_MASTER_FIRST_ORDER];
+  ASSERT_EQ(any_master_first.hosts.size(), 3);
+  EXPECT_EQ(any_master_first.hosts[0]->addr.getPort(), 8090);
+  EXPECT_EQ(any_master_first.hosts[1]->addr.getPort(), 8091);
+  EXPECT_EQ(any_master_first.tier_ends, vector<uint32_t>({1, 2, 3}));
+
+  // 8090 and 8092 share the same prefix length with us-east-1c
+  const auto& any = orders[2][common::detail::ANY_ORDER];
+  ASSERT_EQ(any.hosts.size(), 3);
+  EXPECT_EQ(any.hosts[0]->addr.getPort(), 8091);
+  EXPECT_EQ(any.tier_ends, vector<uint32_t>({1, 3}));
+}
+
+TEST(ThriftRouterTest, ConfigDelta) {
+  const std::string base_config =
+    "{"
+    "  \"user_pins\": {"
+    "  \"num_leaf_segments\": 2,"
+    "  \"127.0.0.1:8090:us-east-1a\": [\"00000:M\", \"00001:S\"],"
+    "  \"127.0.0.1:8091:us-east-1c\": [\"00000:S\", \"00001:M\"]"
+    "   },"
+    "  \"interest_pins\": {"
+    "  \"num_leaf_segments\": 1,"
+    "  \"127.0.0.1:8091:us-east-1c\": [\"00000:M\"]"
+    "   },"
+    "  \"board_pins\": {"
+    "  \"num_leaf_segments\": 1,"
+    "  \"127.0.0.1:8092:us-east-1e\": [\"00000:M\"]"
+    "   }"
+    "}";
+  auto base = common::parseConfig(base_config, "us-east-1c");
+  ASSERT_TRUE(base != nullptr);
+  const auto base_hash = common::detail::hashConfig(base_config);
+  EXPECT_EQ(base_hash.size(), 16);
+  // 64 bit FNV-1a of "a"
+  EXPECT_EQ(common::detail::hashConfig("a"), "af63dc4c8601ec8c");
+
+  // interest_pins moves to 8092, board_pins is removed
+  const std::string delta =
+    "{\"base_hash\": \"" + base_hash + "\", \"segments\": {"
+    "  \"interest_pins\": {"
+    "  \"num_leaf_segments\": 1,"
+    "  \"127.0.0.1:8092:us-east-1e\": [\"00000:M\"]"
+    "   },"
+    "  \"board_pins\": null"
+    "}}";
+  auto layout = common::applyConfigDelta(*base, base_hash, delta,
+                                         "us-east-1c");
+  ASSERT_TRUE(layout != nullptr);
+  EXPECT_EQ(layout->segments.size(), 2);
+  EXPECT_EQ(layout->segments.count("board_pins"), 0);
+  EXPECT_EQ(layout->all_hosts.size(), 3);
+
+  // The copied segment points to the hosts of the new layout
+  const auto& user_pins = layout->segments.at("user_pins");
+  ASSERT_EQ(user_pins.shard_to_hosts.size(), 2);
+  for (const auto& shard : user_pins.shard_to_hosts) {
+    for (const auto& host : shard) {
+      EXPECT_EQ(layout->all_hosts.count(*host.first), 1);
+      EXPECT_EQ(&*layout->all_hosts.find(*host.first), host.first);
+    }
+  }
+  const auto& any = user_pins.shard_host_orders[0][common::detail::ANY_ORDER];
+  ASSERT_EQ(any.hosts.size(), 2);
+  EXPECT_EQ(any.hosts[0]->addr.getPort(), 8091);
+  EXPECT_EQ(&*layout->all_hosts.find(*any.hosts[0]), any.hosts[0]);
+
+  const auto& interest_pins = layout->segments.at("interest_pins");
+  ASSERT_EQ(interest_pins.shard_to_hosts[0].size(), 1);
+  EXPECT_EQ(interest_pins.shard_to_hosts[0][0].first->addr.getPort(), 8092);
+  EXPECT_EQ(
+    interest_pins.shard_host_orders[0][common::detail::MASTER_ORDER]
+      .hosts.size(), 1);
+
+  // Deltas of another config, and invalid ones, are not applied
+  EXPECT_TRUE(common::applyConfigDelta(*base, "0000000000000000", delta,
+                                       "us-east-1c") == nullptr);
+  EXPECT_TRUE(common::applyConfigDelta(*base, base_hash, "{}",
+                                       "us-east-1c") == nullptr);
+}
+
+TEST(ThriftRouterTest, SegmentHandleTest) {
+  updateConfigFile(g_config_v3);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "us-east-1c", g_config_path, common::parseConfig);
+  using ClientVector = ThriftRouter<DummyServiceAsyncClient>::ClientVector;
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  const auto user_pins = router.getSegmentHandle("user_pins");
+  EXPECT_EQ(router.getSegmentHandle("user_pins").id, user_pins.id);
+  const auto unknown = router.getSegmentHandle("unknown");
+  EXPECT_NE(unknown.id, user_pins.id);
+
+  ClientVector v;
+  EXPECT_EQ(router.getClientsFor(unknown, Role::ANY, Quantity::ONE, 0, &v),
+            ReturnCode::UNKNOWN_SEGMENT);
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::ANY, Quantity::ONE, 3, &v),
+            ReturnCode::UNKNOWN_SHARD);
+
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::MASTER, Quantity::ALL, 2,
+                                 &v),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 1);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[0]->nPings_.load(), 1);
+
+  // The local Slave first
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::TWO, 2,
+                                 &v),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 2);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[1]->nPings_.load(), 1);
+  EXPECT_NO_THROW(v[1]->future_ping().get());
+  EXPECT_EQ(handlers[2]->nPings_.load(), 1);
+
+  FLAGS_always_prefer_local_host = true;
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::ANY, Quantity::ONE, 2, &v),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 1);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[1]->nPings_.load(), 2);
+
+  FLAGS_always_prefer_local_host = false;
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::ANY, Quantity::ALL, 2, &v),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 3);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[0]->nPings_.load(), 2);
+
+  // stop the Master of shard 2
+  servers[0]->stop();
+  thrs[0]->join();
+  EXPECT_THROW(v[0]->future_ping().get(), TTransportException);
+
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::ANY, Quantity::ALL, 2, &v),
+            ReturnCode::BAD_HOST);
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::ANY, Quantity::ONE, 2, &v),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 1);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[1]->nPings_.load(), 3);
+
+  for (int i = 1; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, HostLoadTest) {
+  common::detail::HostLoad load;
+  EXPECT_EQ(load.cost(), 1);
+
+  load.onRequestStart();
+  EXPECT_EQ(load.outstanding(), 1);
+  EXPECT_EQ(load.cost(), 2);
+  load.onRequestDone(800);
+  EXPECT_EQ(load.outstanding(), 0);
+  EXPECT_EQ(load.ewmaLatencyUs(), 800);
+  EXPECT_EQ(load.cost(), 801);
+
+  load.onRequestStart();
+  load.onRequestDone(1600);
+  EXPECT_EQ(load.ewmaLatencyUs(), 900);
+
+  // idle hosts get cheaper
+  sleep(2);
+  EXPECT_LT(load.cost(), 300);
+}
+
+TEST(ThriftRouterTest, LatencyAwareSelectionTest) {
+  updateConfigFile(g_config_v3);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "us-east-1c", g_config_path, common::parseConfig);
+  using ClientVector = ThriftRouter<DummyServiceAsyncClient>::ClientVector;
+  using HostLoadVector =
+    ThriftRouter<DummyServiceAsyncClient>::HostLoadVector;
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  FLAGS_thrift_router_latency_aware_selection = true;
+  const auto user_pins = router.getSegmentHandle("user_pins");
+  ClientVector v;
+  HostLoadVector loads;
+
+  // Same loads, the local Slave first
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::TWO, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 2);
+  ASSERT_EQ(loads.size(), 2);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[1]->nPings_.load(), 1);
+  auto local_load = loads[0];
+  auto remote_load = loads[1];
+
+  // The local Slave is a bit slower, still preferred
+  local_load->onRequestStart();
+  local_load->onRequestDone(1500);
+  remote_load->onRequestStart();
+  remote_load->onRequestDone(1000);
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 1);
+  EXPECT_EQ(loads[0], local_load);
+
+  // The local Slave is much slower
+  local_load->onRequestStart();
+  local_load->onRequestDone(100000);
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(v.size(), 1);
+  EXPECT_EQ(loads[0], remote_load);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[2]->nPings_.load(), 1);
+
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::TWO, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 2);
+  EXPECT_EQ(loads[0], remote_load);
+  EXPECT_EQ(loads[1], local_load);
+  FLAGS_thrift_router_latency_aware_selection = false;
+
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, CircuitBreakerTest) {
+  FLAGS_thrift_router_circuit_breaker = true;
+  updateConfigFile(g_config_v3);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "us-east-1c", g_config_path, common::parseConfig);
+  using ClientVector = ThriftRouter<DummyServiceAsyncClient>::ClientVector;
+  using HostLoadVector =
+    ThriftRouter<DummyServiceAsyncClient>::HostLoadVector;
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  const auto user_pins = router.getSegmentHandle("user_pins");
+  ClientVector v;
+  HostLoadVector loads;
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::TWO, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 2);
+  auto local_load = loads[0];
+  auto remote_load = loads[1];
+
+  // The local Slave accepts connections but fails its requests
+  for (int i = 0; i < 100; ++i) {
+    local_load->onRequestStart();
+    local_load->onRequestDone(1000, false);
+  }
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 1);
+  EXPECT_EQ(loads[0], remote_load);
+
+  // ALL still gets it
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::ANY, Quantity::ALL, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  EXPECT_EQ(v.size(), 3);
+  vector<shared_ptr<DummyServiceAsyncClient>> clients;
+  EXPECT_EQ(router.getClientsFor("user_pins", Role::ANY, Quantity::ALL, 2,
+                                 &clients),
+            ReturnCode::OK);
+  EXPECT_EQ(clients.size(), 3);
+
+  // The only good host left is used even if it is ejected
+  for (int i = 0; i < 100; ++i) {
+    remote_load->onRequestStart();
+    remote_load->onRequestDone(1000, false);
+  }
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  EXPECT_EQ(v.size(), 1);
+  FLAGS_thrift_router_circuit_breaker = false;
+
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, HedgedCallTest) {
+  updateConfigFile(g_config_v3);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "us-east-1c", g_config_path, common::parseConfig);
+  using ClientPtr = shared_ptr<DummyServiceAsyncClient>;
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  const auto user_pins = router.getSegmentHandle("user_pins");
+  EXPECT_EQ(router.getSegmentHandle("user_pins").hedging, user_pins.hedging);
+
+  // A fast response, no backup
+  atomic<int> n_calls(0);
+  EXPECT_NO_THROW(router.hedgedCall(user_pins, Role::SLAVE, 2,
+    [&n_calls] (const ClientPtr& client) {
+      ++n_calls;
+      return client->future_ping();
+    }).get());
+  EXPECT_EQ(n_calls.load(), 1);
+  EXPECT_EQ(handlers[1]->nPings_.load(), 1);
+  EXPECT_EQ(handlers[2]->nPings_.load(), 0);
+
+  // The local Slave is slow, the backup wins
+  n_calls = 0;
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_NO_THROW(router.hedgedCall(user_pins, Role::SLAVE, 2,
+    [&n_calls] (const ClientPtr& client) {
+      if (++n_calls == 1) {
+        return client->future_ping().delayed(milliseconds(1000));
+      }
+      return client->future_ping();
+    }).get());
+  EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(500));
+  EXPECT_EQ(n_calls.load(), 2);
+  EXPECT_EQ(handlers[1]->nPings_.load(), 2);
+  EXPECT_EQ(handlers[2]->nPings_.load(), 1);
+
+  // Fail over right away if the local Slave fails
+  n_calls = 0;
+  EXPECT_NO_THROW(router.hedgedCall(user_pins, Role::SLAVE, 2,
+    [&n_calls] (const ClientPtr& client) {
+      if (++n_calls == 1) {
+        return folly::makeFuture<folly::Unit>(
+          std::runtime_error("Intended exception"));
+      }
+      return client->future_ping();
+    }).get());
+  EXPECT_EQ(n_calls.load(), 2);
+  EXPECT_EQ(handlers[2]->nPings_.load(), 2);
+
+  // Unknown shard
+  EXPECT_THROW(router.hedgedCall(user_pins, Role::SLAVE, 3,
+    [] (const ClientPtr& client) {
+      return client->future_ping();
+    }).get(), std::runtime_error);
+
+  // wait for the delayed future
+  sleep(1);
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, ScatterGatherTest) {
+  updateConfigFile(g_config_v3);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "us-east-1c", g_config_path, common::parseConfig);
+  using ClientPtr = shared_ptr<DummyServiceAsyncClient>;
+  using ShardToKeys = std::map<uint32_t, vector<int>>;
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  const auto user_pins = router.getSegmentHandle("user_pins");
+  const vector<int> keys = {0, 1, 2, 3, 4, 5, 6};
+  auto shard_fn = [] (int key) { return key % 3; };
+  // Respond with the number of keys
+  auto request = [] (const ClientPtr& client, const ShardToKeys& keys) {
+    size_t n = 0;
+    for (const auto& shard_keys : keys) {
+      n += shard_keys.second.size();
+    }
+    return client->future_ping().then([n] { return n; });
+  };
+
+  // The local Slave serves shards 0 and 2 in one request
+  auto result = router.scatterGather(user_pins, Role::SLAVE, keys, shard_fn,
+                                     request, milliseconds(1000)).get();
+  EXPECT_TRUE(result.errors.empty());
+  ASSERT_EQ(result.responses.size(), 2);
+  size_t n_keys = 0;
+  for (const auto& response : result.responses) {
+    n_keys += response.second;
+    if (response.first.size() == 2) {
+      EXPECT_EQ(response.first[0], 0);
+      EXPECT_EQ(response.first[1], 2);
+      EXPECT_EQ(response.second, 5);
+    }
+  }
+  EXPECT_EQ(n_keys, keys.size());
+  EXPECT_EQ(handlers[1]->nPings_.load(), 1);
+  EXPECT_EQ(handlers[0]->nPings_.load() + handlers[2]->nPings_.load(), 1);
+
+  // One request per Master
+  result = router.scatterGather(user_pins, Role::MASTER, keys, shard_fn,
+                                request, milliseconds(1000)).get();
+  EXPECT_TRUE(result.errors.empty());
+  EXPECT_EQ(result.responses.size(), 3);
+
+  // Partial results past the deadline
+  result = router.scatterGather(user_pins, Role::MASTER, keys, shard_fn,
+    [] (const ClientPtr& client, const ShardToKeys& keys) {
+      const size_t n = keys.size();
+      auto f = client->future_ping().then([n] { return n; });
+      if (keys.count(1)) {
+        return std::move(f).delayed(milliseconds(1000));
+      }
+      return f;
+    }, milliseconds(200)).get();
+  EXPECT_EQ(result.responses.size(), 2);
+  ASSERT_EQ(result.errors.size(), 1);
+  EXPECT_EQ(result.errors.count(1), 1);
+
+  // Unknown shards
+  result = router.scatterGather(user_pins, Role::MASTER, vector<int>{1, 5},
+    [] (int key) { return key; }, request, milliseconds(1000)).get();
+  EXPECT_EQ(result.responses.size(), 1);
+  EXPECT_EQ(result.errors.size(), 1);
+  EXPECT_EQ(result.errors.count(5), 1);
+
+  // wait for the delayed future
+  sleep(1);
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, PrewarmTest) {
+  FLAGS_thrift_router_prewarm_connections = true;
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  sleep(1);
+
+  {
+    updateConfigFile(g_config_v3);
+    ThriftRouter<DummyServiceAsyncClient> router(
+      "us-east-1c", g_config_path, common::parseConfig);
+    sleep(1);
+
+    // 8092 is down
+    EXPECT_EQ(router.numPrewarmHosts(), 3);
+    EXPECT_EQ(router.numPrewarmedHosts(), 2);
+
+    // A new layout retries it
+    tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+    sleep(1);
+    updateConfigFile(g_config_v1);
+    sleep(1);
+    EXPECT_EQ(router.numPrewarmHosts(), 3);
+    EXPECT_EQ(router.numPrewarmedHosts(), 3);
+
+    // The warm clients are good right away
+    vector<shared_ptr<DummyServiceAsyncClient>> v;
+    EXPECT_EQ(router.getClientsFor("user_pins", Role::ANY, Quantity::ALL, 2,
+                                   &v),
+              ReturnCode::OK);
+    EXPECT_EQ(v.size(), 3);
+
+    // Removed hosts are dropped
+    updateConfigFile(g_config_v5);
+    sleep(1);
+    EXPECT_EQ(router.numPrewarmHosts(), 1);
+    EXPECT_EQ(router.numPrewarmedHosts(), 0);
+  }
+
+  FLAGS_thrift_router_prewarm_connections = false;
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, GroupSpilloverTest) {
+  updateConfigFile(g_config_v3);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "us-east-1c", g_config_path, common::parseConfig);
+  using ClientVector = ThriftRouter<DummyServiceAsyncClient>::ClientVector;
+  using HostLoadVector =
+    ThriftRouter<DummyServiceAsyncClient>::HostLoadVector;
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+  for (int i = 0; i < 3; ++i) {
+    tie(handlers[i], servers[i], thrs[i]) = makeServer(8090 + i);
+  }
+  sleep(1);
+
+  FLAGS_thrift_router_group_spillover_max_outstanding = 2;
+  const auto user_pins = router.getSegmentHandle("user_pins");
+  ClientVector v;
+  HostLoadVector loads;
+
+  // The Slaves of shard 2 are on 8091 in the local AZ and on 8092
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::TWO, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 2);
+  EXPECT_NO_THROW(v[0]->future_ping().get());
+  EXPECT_EQ(handlers[1]->nPings_.load(), 1);
+  auto local_load = loads[0];
+  auto remote_load = loads[1];
+
+  // Local while it has headroom
+  local_load->onRequestStart();
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 1);
+  EXPECT_EQ(loads[0], local_load);
+
+  // Spills over once the local host is at the target
+  local_load->onRequestStart();
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 1);
+  EXPECT_EQ(loads[0], remote_load);
+
+  // Back to local once the other host has no headroom either
+  remote_load->onRequestStart();
+  remote_load->onRequestStart();
+  EXPECT_EQ(router.getClientsFor(user_pins, Role::SLAVE, Quantity::ONE, 2,
+                                 &v, &loads),
+            ReturnCode::OK);
+  ASSERT_EQ(loads.size(), 1);
+  EXPECT_EQ(loads[0], local_load);
+
+  for (int i = 0; i < 2; ++i) {
+    local_load->onRequestDone(1000);
+    remote_load->onRequestDone(1000);
+  }
+  FLAGS_thrift_router_group_spillover_max_outstanding = 0;
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, LocalClientTest) {
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+  for (int i = 0; i < 3; ++i) {
+    tie(handlers[i], servers[i], thrs[i]) = makeServer(8090 + i);
+  }
+
+  updateConfigFile(g_config_v1);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "test", g_config_path, common::parseConfig);
+  router.setLocalAddress(folly::SocketAddress("127.0.0.1", 8091));
+  sleep(1);
+
+  vector<shared_ptr<DummyServiceAsyncClient>> v;
+  EXPECT_EQ(router.getClientsFor("user_pins", Role::ANY, Quantity::ALL, 2,
+                                 &v),
+            ReturnCode::OK);
+  EXPECT_EQ(v.size(), 3);
+  int n_local = 0;
+  for (const auto& client : v) {
+    if (router.isLocalClient(client.get())) {
+      ++n_local;
+      // It is the client of the server at the local address
+      EXPECT_NO_THROW(client->future_ping().get());
+      EXPECT_EQ(handlers[1]->nPings_.load(), 1);
+    }
+  }
+  EXPECT_EQ(n_local, 1);
+
+  // No local host for shard 0
+  EXPECT_EQ(router.getClientsFor("user_pins", Role::ANY, Quantity::ONE, 0,
+                                 &v),
+            ReturnCode::OK);
+  EXPECT_EQ(v.size(), 1);
+  EXPECT_FALSE(router.isLocalClient(v[0].get()));
+  EXPECT_FALSE(router.isLocalClient(nullptr));
+
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
+TEST(ThriftRouterTest, SharedClientsTest) {
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+  for (int i = 0; i < 3; ++i) {
+    tie(handlers[i], servers[i], thrs[i]) = makeServer(8090 + i);
+  }
+
+  updateConfigFile(g_config_v1);
+  for (const bool shared : {true, false}) {
+    FLAGS_thrift_router_shared_clients = shared;
+    ThriftRouter<DummyServiceAsyncClient> router(
+      "test", g_config_path, common::parseConfig);
+    sleep(1);
+
+    vector<shared_ptr<DummyServiceAsyncClient>> v;
+    EXPECT_EQ(router.getClientsFor("user_pins", Role::ANY, Quantity::ALL, 2,
+                                   &v),
+              ReturnCode::OK);
+    EXPECT_EQ(v.size(), 3);
+
+    vector<shared_ptr<DummyServiceAsyncClient>> other_v;
+    thread([&router, &other_v] {
+        EXPECT_EQ(router.getClientsFor("user_pins", Role::ANY, Quantity::ALL,
+                                       2, &other_v),
+                  ReturnCode::OK);
+      }).join();
+    ASSERT_EQ(other_v.size(), 3);
+    for (const auto& client : other_v) {
+      const bool found = std::find(v.begin(), v.end(), client) != v.end();
+      // The threads share the clients of the hosts
+      EXPECT_EQ(found, shared);
+      EXPECT_NO_THROW(client->future_ping().get());
+    }
+  }
+  FLAGS_thrift_router_shared_clients = true;
+
+  for (int i = 0; i < 3; ++i) {
+    servers[i]->stop();
+    thrs[i]->join();
+  }
+}
+
 int main(int argc, char** argv) {
   FLAGS_always_prefer_local_host = false;
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,105 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/tracing.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "common/stats/stats.h"
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+#include "thrift/lib/cpp2/async/RequestChannel.h"
+
+DECLARE_int32(trace_sample_rate);
+
+using apache::thrift::RpcOptions;
+using common::ScopedTrace;
+using common::Stats;
+using common::Trace;
+using common::TraceSpan;
+using std::chrono::milliseconds;
+
+TEST(TracingTest, Sampling) {
+  FLAGS_trace_sample_rate = 0;
+  EXPECT_EQ(Trace::maybeStart(), 0);
+  EXPECT_EQ(Trace::fromRequest(nullptr), 0);
+
+  FLAGS_trace_sample_rate = 1;
+  EXPECT_NE(Trace::maybeStart(), 0);
+  EXPECT_NE(Trace::maybeStart(), Trace::maybeStart());
+
+  FLAGS_trace_sample_rate = 10;
+  int n = 0;
+  for (int i = 0; i < 100; ++i) {
+    n += Trace::maybeStart() != 0;
+  }
+  EXPECT_EQ(n, 10);
+  FLAGS_trace_sample_rate = 0;
+}
+
+TEST(TracingTest, ApplyTo) {
+  RpcOptions options;
+  Trace::applyTo(0, &options);
+  EXPECT_EQ(options.getWriteHeaders().count(Trace::kTraceHeader), 0);
+
+  Trace::applyTo(12345, &options);
+  EXPECT_EQ(options.getWriteHeaders().at(Trace::kTraceHeader), "12345");
+}
+
+TEST(TracingTest, Spans) {
+  EXPECT_EQ(Trace::current(), 0);
+  {
+    // not traced
+    TraceSpan span("untraced_span");
+  }
+
+  {
+    ScopedTrace trace(777);
+    EXPECT_EQ(Trace::current(), 777);
+    TraceSpan span("outer_span");
+    {
+      TraceSpan inner("inner_span");
+      std::this_thread::sleep_for(milliseconds(5));
+    }
+
+    // ends on another thread
+    TraceSpan moved("moved_span");
+    std::thread([span = std::move(moved)] {}).join();
+  }
+  EXPECT_EQ(Trace::current(), 0);
+
+  // wait for the exporter to calibrate the TSC
+  std::this_thread::sleep_for(milliseconds(100));
+  Trace::exportNow();
+
+  const auto text = Trace::DumpRecentTracesAsText();
+  EXPECT_NE(text.find("trace 777\n"), std::string::npos);
+  EXPECT_NE(text.find("  outer_span "), std::string::npos);
+  EXPECT_NE(text.find("  inner_span "), std::string::npos);
+  EXPECT_NE(text.find("  moved_span "), std::string::npos);
+  EXPECT_EQ(text.find("untraced_span"), std::string::npos);
+
+  std::this_thread::sleep_for(milliseconds(1000));
+  auto metric = Stats::get()->GetMetric("trace_span_us span=inner_span");
+  ASSERT_NE(metric, nullptr);
+  EXPECT_EQ(metric->GetCountTotal(), 1);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,39 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <chrono>
+#include <thread>
+
+#include "common/tsc_clock.h"
+#include "gtest/gtest.h"
+
+using common::TscClock;
+
+TEST(TscClockTest, ElapsedNs) {
+  const auto start = TscClock::Now();
+  EXPECT_LE(start, TscClock::Now());
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  const auto elapsed_ns = TscClock::ElapsedNs(start);
+  EXPECT_GE(elapsed_ns, 45 * 1000 * 1000);
+  EXPECT_LT(elapsed_ns, 1000 * 1000 * 1000);
+
+  // A later start
+  EXPECT_EQ(TscClock::ElapsedNs(TscClock::Now() + (1ull << 40)), 0);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
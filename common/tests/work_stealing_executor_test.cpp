@@ -0,0 +1,215 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/work_stealing_executor.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "folly/futures/Future.h"
+#include "folly/futures/Promise.h"
+#include "gtest/gtest.h"
+#if __GNUC__ >= 8
+#include "folly/executors/task_queue/BlockingQueue.h"
+#else
+#include "wangle/concurrent/BlockingQueue.h"
+#endif
+
+#if __GNUC__ >= 8
+using folly::QueueFullException;
+#else
+using wangle::QueueFullException;
+#endif
+
+using common::WorkStealingExecutor;
+using std::chrono::milliseconds;
+
+namespace {
+
+void waitFor(const std::atomic<int>& counter, const int target) {
+  const auto deadline = std::chrono::steady_clock::now() + milliseconds(5000);
+  while (counter.load() < target &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(milliseconds(1));
+  }
+}
+
+}  // namespace
+
+TEST(WorkStealingExecutorTest, RunTasks) {
+  std::atomic<int> n_run(0);
+  {
+    WorkStealingExecutor executor(4, 0, true, "test");
+    EXPECT_EQ(executor.getNumPriorities(), 2);
+    for (int i = 0; i < 1000; ++i) {
+      executor.add([&n_run] { ++n_run; });
+    }
+
+    auto f = folly::via(&executor, [] { return 1; });
+    EXPECT_EQ(f.get(), 1);
+    waitFor(n_run, 1000);
+    EXPECT_EQ(n_run.load(), 1000);
+
+    // A throwing task doesn't stop the worker
+    executor.add([] { throw std::runtime_error("Intended exception"); });
+    executor.add([&n_run] { ++n_run; });
+    waitFor(n_run, 1001);
+
+    // Pending tasks are run on destruction
+    for (int i = 0; i < 100; ++i) {
+      executor.add([&n_run] { ++n_run; });
+    }
+  }
+  EXPECT_EQ(n_run.load(), 1101);
+}
+
+TEST(WorkStealingExecutorTest, Priorities) {
+  WorkStealingExecutor executor(1, 0, true, "test");
+  std::mutex mutex;
+  std::vector<int> order;
+  folly::Promise<folly::Unit> blocker;
+  auto blocked = blocker.getFuture();
+  std::atomic<int> n_run(0);
+
+  executor.add([&blocked, &n_run] {
+      blocked.wait();
+      ++n_run;
+    });
+  for (int i = 0; i < 3; ++i) {
+    executor.addWithPriority([&, i] {
+        std::lock_guard<std::mutex> g(mutex);
+        order.push_back(-i);
+        ++n_run;
+      }, folly::Executor::LO_PRI);
+  }
+  for (int i = 1; i < 4; ++i) {
+    executor.addWithPriority([&, i] {
+        std::lock_guard<std::mutex> g(mutex);
+        order.push_back(i);
+        ++n_run;
+      }, folly::Executor::HI_PRI);
+  }
+
+  blocker.setValue();
+  waitFor(n_run, 7);
+  EXPECT_EQ(order, std::vector<int>({1, 2, 3, 0, -1, -2}));
+}
+
+TEST(WorkStealingExecutorTest, NoStarvation) {
+  WorkStealingExecutor executor(1, 0, true, "test");
+  std::atomic<bool> low_run(false);
+  std::atomic<int> n_high(0);
+
+  // High priority tasks which keep adding themselves
+  std::function<void()> high = [&] {
+    if (++n_high < 1000 && !low_run.load()) {
+      executor.add(high);
+    }
+  };
+  executor.addWithPriority([&low_run] { low_run = true; },
+                           folly::Executor::LO_PRI);
+  executor.add(high);
+
+  const auto deadline = std::chrono::steady_clock::now() + milliseconds(5000);
+  while (!low_run.load() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(milliseconds(1));
+  }
+  EXPECT_TRUE(low_run.load());
+  EXPECT_LT(n_high.load(), 1000);
+}
+
+TEST(WorkStealingExecutorTest, WorkStealing) {
+  WorkStealingExecutor executor(4, 0, true, "test");
+  std::mutex mutex;
+  std::set<std::thread::id> thread_ids;
+  std::atomic<int> n_run(0);
+
+  // All tasks are added by one worker to its own deque
+  executor.add([&] {
+      for (int i = 0; i < 400; ++i) {
+        executor.add([&] {
+            std::this_thread::sleep_for(milliseconds(1));
+            std::lock_guard<std::mutex> g(mutex);
+            thread_ids.insert(std::this_thread::get_id());
+            ++n_run;
+          });
+      }
+    });
+
+  waitFor(n_run, 400);
+  EXPECT_EQ(n_run.load(), 400);
+  EXPECT_GT(thread_ids.size(), 1);
+}
+
+TEST(WorkStealingExecutorTest, QueueFull) {
+  WorkStealingExecutor executor(1, 2, false, "test");
+  folly::Promise<folly::Unit> blocker;
+  auto blocked = blocker.getFuture();
+  std::atomic<int> n_run(0);
+
+  executor.add([&blocked, &n_run] {
+      blocked.wait();
+      ++n_run;
+    });
+  // wait for the worker to take the first task
+  std::this_thread::sleep_for(milliseconds(100));
+  executor.add([&n_run] { ++n_run; });
+  executor.add([&n_run] { ++n_run; });
+  EXPECT_THROW(executor.add([&n_run] { ++n_run; }), QueueFullException);
+
+  blocker.setValue();
+  waitFor(n_run, 3);
+  EXPECT_EQ(n_run.load(), 3);
+  EXPECT_NO_THROW(executor.add([&n_run] { ++n_run; }));
+  waitFor(n_run, 4);
+}
+
+TEST(WorkStealingExecutorTest, BlockWhenFull) {
+  WorkStealingExecutor executor(1, 1, true, "test");
+  folly::Promise<folly::Unit> blocker;
+  auto blocked = blocker.getFuture();
+  std::atomic<int> n_run(0);
+
+  executor.add([&blocked, &n_run] {
+      blocked.wait();
+      ++n_run;
+    });
+  std::this_thread::sleep_for(milliseconds(100));
+  executor.add([&n_run] { ++n_run; });
+
+  std::atomic<bool> added(false);
+  std::thread t([&] {
+      executor.add([&n_run] { ++n_run; });
+      added = true;
+    });
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_FALSE(added.load());
+
+  blocker.setValue();
+  t.join();
+  EXPECT_TRUE(added.load());
+  waitFor(n_run, 3);
+  EXPECT_EQ(n_run.load(), 3);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
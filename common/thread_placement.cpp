@@ -0,0 +1,171 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/thread_placement.h"
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <utility>
+
+#include "folly/Conv.h"
+#include "folly/String.h"
+
+namespace {
+
+// From <numaif.h>, to not depend on libnuma
+const int kMpolPreferred = 1;
+
+bool ReadNumaNodeCpus(const int node, std::vector<int>* cpus) {
+  std::ifstream is("/sys/devices/system/node/node" +
+                   folly::to<std::string>(node) + "/cpulist");
+  std::string list;
+  if (!is || !std::getline(is, list)) {
+    return false;
+  }
+
+  return common::ParseCpuList(list, cpus);
+}
+
+}  // namespace
+
+namespace common {
+
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus) {
+  std::vector<folly::StringPiece> ranges;
+  folly::split(",", folly::trimWhitespace(list), ranges, true);
+  if (ranges.empty()) {
+    return false;
+  }
+
+  std::set<int> result;
+  for (const auto& range : ranges) {
+    std::vector<folly::StringPiece> bounds;
+    folly::split("-", range, bounds);
+    if (bounds.size() > 2) {
+      return false;
+    }
+
+    int first;
+    int last;
+    try {
+      first = folly::to<int>(bounds[0]);
+      last = folly::to<int>(bounds.back());
+    } catch (...) {
+      return false;
+    }
+    if (first < 0 || first > last || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      result.insert(cpu);
+    }
+  }
+
+  cpus->assign(result.begin(), result.end());
+  return true;
+}
+
+std::shared_ptr<ThreadPlacement> ThreadPlacement::Create(
+    const std::string& spec) {
+  folly::StringPiece rest(spec);
+  if (rest.empty()) {
+    return nullptr;
+  }
+
+  const bool one_cpu_per_thread = rest.removePrefix("core:");
+  std::vector<int> cpus;
+  int numa_node = -1;
+  if (rest.removePrefix("node:")) {
+    std::vector<int> nodes;
+    if (!ParseCpuList(rest.str(), &nodes)) {
+      LOG(ERROR) << "Invalid NUMA nodes in thread placement " << spec;
+      return nullptr;
+    }
+    for (const auto node : nodes) {
+      std::vector<int> node_cpus;
+      if (!ReadNumaNodeCpus(node, &node_cpus)) {
+        LOG(ERROR) << "Failed to read the CPUs of NUMA node " << node;
+        return nullptr;
+      }
+      cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+    }
+    if (nodes.size() == 1 && nodes[0] < 64) {
+      numa_node = nodes[0];
+    }
+  } else if (!ParseCpuList(rest.str(), &cpus)) {
+    LOG(ERROR) << "Invalid CPUs in thread placement " << spec;
+    return nullptr;
+  }
+
+  if (cpus.empty()) {
+    LOG(ERROR) << "No CPUs in thread placement " << spec;
+    return nullptr;
+  }
+  std::sort(cpus.begin(), cpus.end());
+
+  return std::shared_ptr<ThreadPlacement>(
+    new ThreadPlacement(std::move(cpus), one_cpu_per_thread, numa_node));
+}
+
+ThreadPlacement::ThreadPlacement(std::vector<int> cpus,
+                                 const bool one_cpu_per_thread,
+                                 const int numa_node)
+    : cpus_(std::move(cpus))
+    , one_cpu_per_thread_(one_cpu_per_thread)
+    , numa_node_(numa_node)
+    , next_cpu_(0) {}
+
+bool ThreadPlacement::Apply() {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (one_cpu_per_thread_) {
+    const auto idx = next_cpu_.fetch_add(1) % cpus_.size();
+    CPU_SET(cpus_[idx], &cpu_set);
+  } else {
+    for (const auto cpu : cpus_) {
+      CPU_SET(cpu, &cpu_set);
+    }
+  }
+
+  const int ret =
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (ret != 0) {
+    LOG(ERROR) << "Failed to set thread affinity: " << ret;
+    return false;
+  }
+
+  if (numa_node_ >= 0) {
+    const unsigned long node_mask = 1UL << numa_node_;
+    if (syscall(SYS_set_mempolicy, kMpolPreferred, &node_mask,
+                sizeof(node_mask) * 8) != 0) {
+      PLOG(ERROR) << "Failed to prefer NUMA node " << numa_node_;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace common
@@ -0,0 +1,116 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __GNUC__ >= 8
+#include "folly/executors/thread_factory/ThreadFactory.h"
+#else
+#include "wangle/concurrent/ThreadFactory.h"
+#endif
+
+namespace common {
+
+/*
+ * ThreadPlacement pins the threads of a pool to a set of CPUs, so that IO
+ * threads and executor workers don't float across sockets.
+ *
+ * The spec is one of
+ *   ""               no placement
+ *   "0-7,16-23"      the listed CPUs
+ *   "node:0"         the CPUs of the listed NUMA nodes, e.g. "node:0-1"
+ * optionally prefixed by "core:", which pins each thread to a single CPU of
+ * the set, round robin, instead of letting it float within the set.
+ *
+ * Pages are placed on the node of the thread which first touches them, so
+ * pinning a thread before it runs anything keeps its per thread structures
+ * node local. With a single NUMA node in the spec, the thread's memory
+ * policy also prefers that node.
+ */
+class ThreadPlacement {
+ public:
+  // Return nullptr for an empty spec, or an invalid one which is logged
+  static std::shared_ptr<ThreadPlacement> Create(const std::string& spec);
+
+  // Apply the placement to the calling thread. Return false on failure.
+  bool Apply();
+
+  const std::vector<int>& cpus() const {
+    return cpus_;
+  }
+
+ private:
+  ThreadPlacement(std::vector<int> cpus, bool one_cpu_per_thread,
+                  int numa_node);
+
+  const std::vector<int> cpus_;
+  const bool one_cpu_per_thread_;
+  // the node to prefer for memory, or -1
+  const int numa_node_;
+  std::atomic<uint32_t> next_cpu_;
+};
+
+/*
+ * Parse a CPU list like "0-3,8,10-11", as in /sys/devices/system/cpu.
+ */
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus);
+
+/*
+ * A thread factory applying placement to the threads created by factory
+ */
+#if __GNUC__ >= 8
+class PlacedThreadFactory : public folly::ThreadFactory {
+ public:
+  PlacedThreadFactory(std::shared_ptr<folly::ThreadFactory> factory,
+#else
+class PlacedThreadFactory : public wangle::ThreadFactory {
+ public:
+  PlacedThreadFactory(std::shared_ptr<wangle::ThreadFactory> factory,
+#endif
+                      std::shared_ptr<ThreadPlacement> placement)
+    : factory_(std::move(factory))
+    , placement_(std::move(placement)) {}
+
+  std::thread newThread(folly::Func&& func) override {
+    if (placement_ == nullptr) {
+      return factory_->newThread(std::move(func));
+    }
+
+    return factory_->newThread(
+      [placement = placement_, func = std::move(func)] () mutable {
+        placement->Apply();
+        func();
+      });
+  }
+
+ private:
+#if __GNUC__ >= 8
+  std::shared_ptr<folly::ThreadFactory> factory_;
+#else
+  std::shared_ptr<wangle::ThreadFactory> factory_;
+#endif
+  std::shared_ptr<ThreadPlacement> placement_;
+};
+
+}  // namespace common
@@ -21,12 +21,20 @@
 DEFINE_int32(channel_cleanup_min_interval_seconds, 10,
              "The minimum time between two channel cleanups");
 
+DEFINE_int32(channel_idle_seconds, 60,
+             "Cleanups drop the released channels to destinations no client "
+             "has been got for in this many seconds");
+
 DEFINE_int32(channel_max_checking_size, 500,
              "The maximum # of channels checked by one cleanup");
 
 DEFINE_int32(channel_send_timeout_ms, 0,
              "The send timeout for channels");
 
+DEFINE_int32(channels_per_destination, 1,
+             "The maximum number of channels to a destination per IO thread. "
+             "New clients get the channel used by the fewest clients.");
+
 DEFINE_int32(default_thrift_client_pool_threads, sysconf(_SC_NPROCESSORS_ONLN),
              "The number of threads driving evbs in thrift client pool.");
 
@@ -44,3 +52,19 @@ DEFINE_bool(channel_enable_snappy, false, "Enable snappy compression or not");
 DEFINE_bool(use_framed_transport_for_binary_protocol, true,
             "Use framed transport for binary protocol");
 
+DEFINE_string(thrift_client_pool_io_cpus, "",
+              "The CPUs to pin the IO threads of thrift client pools to, see "
+              "common::ThreadPlacement for the format");
+
+namespace common {
+namespace detail {
+
+ThreadPlacement* getThriftClientPoolIOPlacement() {
+  static const auto placement =
+    ThreadPlacement::Create(FLAGS_thrift_client_pool_io_cpus);
+  return placement.get();
+}
+
+}  // namespace detail
+}  // namespace common
+
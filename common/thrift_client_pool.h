@@ -18,14 +18,18 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <list>
 #include <memory>
 #include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#include "common/ssl_context_manager.h"
+#include "common/thread_placement.h"
 #include "folly/futures/Promise.h"
 #if __GNUC__ >= 8
 #include "folly/system/ThreadName.h"
@@ -42,10 +46,14 @@
 
 DECLARE_int32(channel_cleanup_min_interval_seconds);
 
+DECLARE_int32(channel_idle_seconds);
+
 DECLARE_int32(channel_max_checking_size);
 
 DECLARE_int32(channel_send_timeout_ms);
 
+DECLARE_int32(channels_per_destination);
+
 DECLARE_int32(default_thrift_client_pool_threads);
 
 DECLARE_int32(min_channel_create_interval_seconds);
@@ -58,15 +66,35 @@ DECLARE_bool(channel_enable_snappy);
 
 DECLARE_bool(use_framed_transport_for_binary_protocol);
 
+DECLARE_string(thrift_client_pool_io_cpus);
+
 namespace common {
 
+namespace detail {
+
+// The ThreadPlacement of --thrift_client_pool_io_cpus shared by all pools, or
+// nullptr
+ThreadPlacement* getThriftClientPoolIOPlacement();
+
+}  // namespace detail
+
+// The channels of a ThriftClientPool. The idle ones are to destinations no
+// client has been got for in --channel_idle_seconds, which cleanups drop once
+// their clients are released.
+struct ThriftChannelCounts {
+  size_t live = 0;
+  size_t idle = 0;
+};
+
 /*
  * ThriftClientPool maintains a pool of channels to remote services.
  * Users may get thrift client object from the pool, and use it to communicate
  * with remote services.
  * Internally each pool has (owns or shares with others) N IO threads and N
- * event bases. Each IO Thread drives one event base. A pool can have at most N
- * connections to a destination.
+ * event bases. Each IO Thread drives one event base. A pool can have at most
+ * N * FLAGS_channels_per_destination connections to a destination. Within an
+ * IO thread, new clients get the channel used by the fewest clients, so that
+ * the load to a hot destination spreads over several TCP connections.
  * IO threads will be used in a round-robin way for creating new client.
  *
  * If a shared_ptr to a folly::SSLContext is provided, the clientpool will make
@@ -107,6 +135,7 @@ class ThriftClientPool {
       , public apache::thrift::async::TAsyncSocket::ConnectCallback {
     ClientStatusCallback(const folly::SocketAddress& addr)
       : is_good(true)
+      , is_connected(false)
       , create_time(time(nullptr))
       , peer_addr(addr) {}
 
@@ -120,6 +149,12 @@ class ThriftClientPool {
     void connectSuccess() noexcept override {
       LOG_EVERY_N(INFO, FLAGS_thrift_client_pool_log_frequency) << peer_addr
         << " connection established after " << elapsedTime() << " seconds";
+
+      if (ssl_socket) {
+        common::onSSLConnected(ssl_socket, peer_addr);
+        ssl_socket = nullptr;
+      }
+      is_connected.store(true);
     }
 
     void connectError(const apache::thrift::transport::TTransportException& ex)
@@ -127,6 +162,7 @@ class ThriftClientPool {
       LOG(ERROR) << peer_addr << " ConnectError: " << ex.what()
                  << " after " << elapsedTime() << " seconds";
 
+      ssl_socket = nullptr;
       is_good.store(false);
     }
 
@@ -135,8 +171,26 @@ class ThriftClientPool {
     }
 
     std::atomic<bool> is_good;
+    // set once the connection (and TLS handshake) is established
+    std::atomic<bool> is_connected;
     const time_t create_time;
     const folly::SocketAddress peer_addr;
+    // the TLS socket being connected, only used on its event base
+    folly::AsyncSSLSocket* ssl_socket = nullptr;
+  };
+
+  using ChannelEntry =
+    std::pair<std::weak_ptr<apache::thrift::HeaderClientChannel>,
+              std::unique_ptr<ClientStatusCallback>>;
+
+  // The channels to a destination
+  struct Destination {
+    // at most FLAGS_channels_per_destination
+    std::vector<ChannelEntry> entries;
+    // the position of the destination in EventLoop::lru_
+    std::list<folly::SocketAddress>::iterator lru_pos;
+    // last time a client was got for the destination
+    time_t last_use_time;
   };
 
   struct EventLoop {
@@ -150,10 +204,14 @@ class ThriftClientPool {
     time_t last_cleanup_time_;
 
     // a map from destinations to channels
-    std::unordered_map<
-      folly::SocketAddress,
-      std::pair<std::weak_ptr<apache::thrift::HeaderClientChannel>,
-                std::unique_ptr<ClientStatusCallback>>> channels_;
+    std::unordered_map<folly::SocketAddress, Destination> channels_;
+
+    // the destinations in channels_, the most recently used first. Cleanups
+    // only check the idle ones at the back.
+    std::list<folly::SocketAddress> lru_;
+
+    // the number of channels in channels_
+    size_t num_channels_ = 0;
 
     static std::string ioThreadName() {
       const auto class_name = folly::demangle(typeid(T)).toStdString();
@@ -172,6 +230,10 @@ class ThriftClientPool {
     EventLoop() {
       auto evb = std::make_unique<folly::EventBase>();
       thread_ = std::make_unique<std::thread>([evb = evb.get()] {
+          auto placement = detail::getThriftClientPoolIOPlacement();
+          if (placement) {
+            placement->Apply();
+          }
           static const auto name = ioThreadName();
           if (!folly::setThreadName(name)) {
             LOG(ERROR) << "Failed to set thread name for thrift IO thread";
@@ -209,115 +271,223 @@ class ThriftClientPool {
     //
     // a nullptr or bad channel can be returned if it's too soon to create a new
     // channel and aggressively is set to false
+    //
+    // With FLAGS_channels_per_destination > 1, the good channel used by the
+    // fewest clients is returned, and a new one is created while all of them
+    // are in use and there is room for more.
     std::shared_ptr<apache::thrift::HeaderClientChannel>
     getChannelFor(const folly::SocketAddress& addr,
                   const uint32_t connect_timeout_ms,
                   const std::atomic<bool>** is_good,
                   const bool aggressively,
-                  const std::shared_ptr<folly::SSLContext>& ssl_ctx) {
-      std::shared_ptr<apache::thrift::HeaderClientChannel> channel;
-      auto itor = channels_.find(addr);
-      bool should_new_channel = false;
+                  const std::shared_ptr<folly::SSLContext>& ssl_ctx,
+                  const std::atomic<bool>** is_connected) {
+      const auto now = time(nullptr);
+      auto& entries = touch(addr, now).entries;
+      const size_t max_channels =
+        std::max(FLAGS_channels_per_destination, 1);
+
+      // the good channel with the fewest clients
+      std::shared_ptr<apache::thrift::HeaderClientChannel> best;
+      size_t best_idx = 0;
+      bool has_too_soon_bad = false;
+      for (size_t i = 0; i < entries.size(); ++i) {
+        auto channel = entries[i].first.lock();
+        if (channel && channel->getTransport()->good()) {
+          if (best == nullptr || channel.use_count() < best.use_count()) {
+            best = std::move(channel);
+            best_idx = i;
+          }
+        } else if (entries[i].second->create_time +
+                   FLAGS_min_channel_create_interval_seconds > now) {
+          has_too_soon_bad = true;
+        }
+      }
 
-      if (itor == channels_.end()) {
-        // no such channel yet
-        should_new_channel = true;
-      } else {
-        channel = itor->second.first.lock();
+      // only we hold best if no client uses it
+      if (best && (best.use_count() <= 1 || entries.size() >= max_channels)) {
+        setStatus(*entries[best_idx].second, is_good, is_connected);
+        return best;
+      }
+
+      // we only want to create a new channel if no channel is good for use
+      // and it's not too soon to create a new one or we want to be aggressive,
+      // or if all the good channels are used and there is room for more
+      if (entries.size() < max_channels &&
+          (best || aggressively || !has_too_soon_bad)) {
+        entries.emplace_back();
+        ++num_channels_;
+        return newChannel(addr, connect_timeout_ms, is_good, is_connected,
+                          ssl_ctx, &entries.back());
+      }
+
+      for (auto& entry : entries) {
+        auto channel = entry.first.lock();
         const bool channel_good = (channel && channel->getTransport()->good());
         const bool too_soon =
-          (itor->second.second->create_time +
-           FLAGS_min_channel_create_interval_seconds > time(nullptr));
-        // we only want to create a new channel if the current channel is not
-        // good for use and it's not too soon to create a new one or we want to
-        // be aggressive
+          (entry.second->create_time +
+           FLAGS_min_channel_create_interval_seconds > now);
         if (!channel_good && (!too_soon || aggressively)) {
-          should_new_channel = true;
+          return newChannel(addr, connect_timeout_ms, is_good, is_connected,
+                            ssl_ctx, &entry);
         }
       }
 
-      if (should_new_channel) {
-        std::shared_ptr<apache::thrift::async::TAsyncSocket> socket;
-        if (ssl_ctx == nullptr) {
-          socket = apache::thrift::async::TAsyncSocket::newSocket(evb_);
-        } else {
-          socket = apache::thrift::async::TAsyncSSLSocket::newSocket(ssl_ctx, evb_);
-        }
-        auto cb = std::make_unique<ClientStatusCallback>(addr);
-        socket->connect(cb.get(), addr, connect_timeout_ms);
+      if (best) {
+        setStatus(*entries[best_idx].second, is_good, is_connected);
+        return best;
+      }
+
+      setStatus(*entries[0].second, is_good, is_connected);
+      return entries[0].first.lock();
+    }
+
+    std::shared_ptr<apache::thrift::HeaderClientChannel>
+    newChannel(const folly::SocketAddress& addr,
+               const uint32_t connect_timeout_ms,
+               const std::atomic<bool>** is_good,
+               const std::atomic<bool>** is_connected,
+               const std::shared_ptr<folly::SSLContext>& ssl_ctx,
+               ChannelEntry* entry) {
+      std::shared_ptr<apache::thrift::async::TAsyncSocket> socket;
+      auto cb = std::make_unique<ClientStatusCallback>(addr);
+      if (ssl_ctx == nullptr) {
+        socket = apache::thrift::async::TAsyncSocket::newSocket(evb_);
+      } else {
+        auto ssl_socket =
+          apache::thrift::async::TAsyncSSLSocket::newSocket(ssl_ctx, evb_);
+        common::resumeSSLSession(ssl_socket.get(), addr);
+        cb->ssl_socket = ssl_socket.get();
+        socket = std::move(ssl_socket);
+      }
+      socket->connect(cb.get(), addr, connect_timeout_ms);
 
 #ifdef TCP_USER_TIMEOUT
-        // TCP_USER_TIMEOUT is not supported by Ubuntu 12.04.
-        if (FLAGS_tcp_user_timeout_ms > 0) {
-          unsigned int timeout_ms = FLAGS_tcp_user_timeout_ms;
-          const auto ret =
-            socket->setSockOpt(IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms);
-
-          if (ret == 0) {
-            LOG_EVERY_N(INFO, FLAGS_thrift_client_pool_log_frequency) << "Set TCP_USER_TIMEOUT to "
-                                                                      << timeout_ms
-                                                                      << " ms for " << addr;
-          } else {
-            LOG(ERROR) << "Failed to set TCP_USER_TIMEOUT to " << timeout_ms
-                       << " ms with errno " << errno << " : "
-                       << strerror(errno);
-          }
+      // TCP_USER_TIMEOUT is not supported by Ubuntu 12.04.
+      if (FLAGS_tcp_user_timeout_ms > 0) {
+        unsigned int timeout_ms = FLAGS_tcp_user_timeout_ms;
+        const auto ret =
+          socket->setSockOpt(IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms);
+
+        if (ret == 0) {
+          LOG_EVERY_N(INFO, FLAGS_thrift_client_pool_log_frequency) << "Set TCP_USER_TIMEOUT to "
+                                                                    << timeout_ms
+                                                                    << " ms for " << addr;
+        } else {
+          LOG(ERROR) << "Failed to set TCP_USER_TIMEOUT to " << timeout_ms
+                     << " ms with errno " << errno << " : "
+                     << strerror(errno);
         }
+      }
 #endif
 
-        channel = apache::thrift::HeaderClientChannel::newChannel(socket);
-        if (FLAGS_channel_send_timeout_ms > 0) {
-          channel->setTimeout(FLAGS_channel_send_timeout_ms);
-        }
-        if (FLAGS_channel_enable_snappy) {
-          channel->setTransform(apache::thrift::transport::THeader::SNAPPY_TRANSFORM);
-        }
-        if (USE_BINARY_PROTOCOL) {
-          channel->setProtocolId(apache::thrift::protocol::T_BINARY_PROTOCOL);
-          if (FLAGS_use_framed_transport_for_binary_protocol) {
-            channel->setClientType(THRIFT_FRAMED_DEPRECATED);
-          }
-        }
-
-        if (is_good) {
-          *is_good = &cb->is_good;
-        }
-        channel->setCloseCallback(cb.get());
-        channels_[addr] =
-          std::pair<std::weak_ptr<apache::thrift::HeaderClientChannel>,
-                    std::unique_ptr<ClientStatusCallback>>(
-            channel, std::move(cb));
-      } else {
-        if (is_good) {
-          *is_good = &(itor->second.second->is_good);
+      auto channel = apache::thrift::HeaderClientChannel::newChannel(socket);
+      if (FLAGS_channel_send_timeout_ms > 0) {
+        channel->setTimeout(FLAGS_channel_send_timeout_ms);
+      }
+      if (FLAGS_channel_enable_snappy) {
+        channel->setTransform(apache::thrift::transport::THeader::SNAPPY_TRANSFORM);
+      }
+      if (USE_BINARY_PROTOCOL) {
+        channel->setProtocolId(apache::thrift::protocol::T_BINARY_PROTOCOL);
+        if (FLAGS_use_framed_transport_for_binary_protocol) {
+          channel->setClientType(THRIFT_FRAMED_DEPRECATED);
         }
       }
 
+      setStatus(*cb, is_good, is_connected);
+      channel->setCloseCallback(cb.get());
+      entry->first = channel;
+      entry->second = std::move(cb);
       return channel;
     }
 
-    void cleanupStaleChannels(const folly::SocketAddress& addr) {
+    static void setStatus(const ClientStatusCallback& cb,
+                          const std::atomic<bool>** is_good,
+                          const std::atomic<bool>** is_connected) {
+      if (is_good) {
+        *is_good = &cb.is_good;
+      }
+      if (is_connected) {
+        *is_connected = &cb.is_connected;
+      }
+    }
+
+    // Move the destination of addr to the front of lru_, and add it if it's
+    // new
+    Destination& touch(const folly::SocketAddress& addr, const time_t now) {
+      auto itor = channels_.find(addr);
+      if (itor == channels_.end()) {
+        lru_.push_front(addr);
+        itor = channels_.emplace(addr, Destination()).first;
+        itor->second.lru_pos = lru_.begin();
+      } else {
+        lru_.splice(lru_.begin(), lru_, itor->second.lru_pos);
+      }
+      itor->second.last_use_time = now;
+      return itor->second;
+    }
+
+    void cleanupStaleChannels() {
       // cleanup stale entries if it hasn't been done for a period of time.
       auto now = time(nullptr);
       if (last_cleanup_time_ + FLAGS_channel_cleanup_min_interval_seconds
           < now) {
         last_cleanup_time_ = now;
-        auto itor = channels_.find(addr);
-        int n = 0;
-        while (itor != channels_.end() &&
-               n++ < FLAGS_channel_max_checking_size) {
+        // lru_ is ordered by last use, so we stop at the first destination
+        // which isn't idle, and each check costs O(1) for the destination.
+        // Each destination is checked at most once.
+        auto n = std::min<size_t>(
+          lru_.size(), std::max(FLAGS_channel_max_checking_size, 0));
+        while (n-- > 0) {
+          auto itor = channels_.find(lru_.back());
+          auto& dest = itor->second;
+          if (dest.last_use_time + FLAGS_channel_idle_seconds > now) {
+            break;
+          }
+
           // We don't cleanup !good() live channels here. Otherwise we
           // will need to upgrade it to a shared_ptr. We expect clients
           // won't keep a !good() channels for a long period of time.
-          if (itor->second.first.use_count() == 0) {
-            itor = channels_.erase(itor);
+          auto& entries = dest.entries;
+          const auto n_entries = entries.size();
+          entries.erase(
+            std::remove_if(entries.begin(), entries.end(),
+                           [] (const ChannelEntry& e) {
+                             return e.first.expired();
+                           }),
+            entries.end());
+          num_channels_ -= n_entries - entries.size();
+          if (entries.empty()) {
+            lru_.pop_back();
+            channels_.erase(itor);
           } else {
-            ++itor;
+            // still used by some clients, check it again after another idle
+            // period
+            lru_.splice(lru_.begin(), lru_, dest.lru_pos);
+            dest.last_use_time = now;
           }
         }
       }
     }
 
+    // Add the channels of this loop to counts. It walks the idle
+    // destinations only.
+    void addChannelCounts(ThriftChannelCounts* counts) const {
+      const auto now = time(nullptr);
+      size_t idle = 0;
+      for (auto itor = lru_.rbegin(); itor != lru_.rend(); ++itor) {
+        const auto& dest = channels_.at(*itor);
+        if (dest.last_use_time + FLAGS_channel_idle_seconds > now) {
+          break;
+        }
+        idle += dest.entries.size();
+      }
+
+      counts->live += num_channels_ - idle;
+      counts->idle += idle;
+    }
+
     // no copy
     EventLoop(const EventLoop&) = delete;
     EventLoop& operator=(const EventLoop&) = delete;
@@ -327,6 +497,9 @@ class ThriftClientPool {
       thread_ = std::move(el.thread_);
       last_cleanup_time_ = el.last_cleanup_time_;
       channels_ = std::move(el.channels_);
+      // the iterators in channels_ stay valid
+      lru_ = std::move(el.lru_);
+      num_channels_ = el.num_channels_;
 
       return *this;
     }
@@ -384,12 +557,16 @@ class ThriftClientPool {
   // is released
   // If aggressively is set to true, a new channel will be created
   // immediately if there is no existing good channel for the addr
+  // @param is_connected is an optional out parameter set once the connection
+  // of the underlying channel is established, with the same lifetime as
+  // is_good
   //
   // @note a nullptr will be returned if a channel couldn't be obtained.
   auto getClient(const folly::SocketAddress& addr,
                  const uint32_t connect_timeout_ms = 0,
                  const std::atomic<bool>** is_good = nullptr,
-                 const bool aggressively = true) {
+                 const bool aggressively = true,
+                 const std::atomic<bool>** is_connected = nullptr) {
     auto idx = nextEvbIdx_.fetch_add(1) % event_loops_.size();
 
     // We can't use lambda for std::unique_ptr deleter. Otherwise, we won't be
@@ -415,11 +592,14 @@ class ThriftClientPool {
         ssl_ctx_ == nullptr ? nullptr : std::atomic_load_explicit(ssl_ctx_, std::memory_order_acquire);
     event_loops_[idx].evb_->runInEventBaseThreadAndWait(
         [&client, &event_loop = event_loops_[idx], &addr, &is_good,
-         connect_timeout_ms, aggressively, ssl_ctx = std::move(ssl_ctx)] () mutable {
+         &is_connected, connect_timeout_ms, aggressively,
+         ssl_ctx = std::move(ssl_ctx)] () mutable {
           auto channel = event_loop.getChannelFor(addr, connect_timeout_ms,
-                                                  is_good, aggressively, std::move(ssl_ctx));
+                                                  is_good, aggressively,
+                                                  std::move(ssl_ctx),
+                                                  is_connected);
 
-          event_loop.cleanupStaleChannels(addr);
+          event_loop.cleanupStaleChannels();
 
           // The underlying folly::AsyncSocket has to be created/released on the
           // same IO thread to avoid race condition on its internal states. So
@@ -446,6 +626,19 @@ class ThriftClientPool {
                      is_good, aggressively);
   }
 
+  // Get the numbers of live and idle channels of this pool, which waits for
+  // each of its IO threads.
+  ThriftChannelCounts getChannelCounts() {
+    ThriftChannelCounts counts;
+    for (auto& event_loop : event_loops_) {
+      event_loop.evb_->runInEventBaseThreadAndWait(
+        [&counts, &event_loop] {
+          event_loop.addChannelCounts(&counts);
+        });
+    }
+    return counts;
+  }
+
   // no copy or move
   ThriftClientPool(const ThriftClientPool&) = delete;
   ThriftClientPool(ThriftClientPool&&) = delete;
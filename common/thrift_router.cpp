@@ -19,10 +19,17 @@
 #include "common/thrift_router.h"
 
 #include <algorithm>
+#include <cinttypes>
+#include <cstdio>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include "common/jsoncpp/include/json/json.h"
+#include "common/stats/stats.h"
+#include "folly/Conv.h"
+#include "folly/String.h"
 
 DEFINE_bool(always_prefer_local_host, true,
             "Always prefer local host when ordering hosts");
@@ -30,60 +37,602 @@ DEFINE_int32(min_client_reconnect_interval_seconds, 5,
              "min reconnect interval in seconds");
 DEFINE_int64(client_connect_timeout_millis, 100,
              "Timeout for establishing client connection.");
+DEFINE_bool(thrift_router_shared_clients, true,
+            "Share the client of each host between all threads routing "
+            "requests, so that the clients and the reconnects are per host "
+            "rather than per host and thread. Each thread still caches the "
+            "clients it uses");
 DEFINE_int32(thrift_router_max_num_hosts_to_consider, -1, "Maximum number of "
              "hosts to consider for each routing request. -1 means unlimited.");
 
 DEFINE_int32(thrift_router_log_frequency, 100, "Log frequency");
 
+DEFINE_bool(thrift_router_latency_aware_selection, false,
+            "Pick between two hosts by their latency and outstanding requests "
+            "in the SegmentHandle getClientsFor() for ONE and TWO");
+DEFINE_double(thrift_router_latency_aware_max_slowdown, 2.0,
+              "With latency aware selection, prefer a less preferred host "
+              "only if the preferred one is this many times costlier");
+
+DEFINE_int32(thrift_router_group_spillover_max_outstanding, 0,
+             "If positive, ONE and TWO of the SegmentHandle getClientsFor() "
+             "keep to the hosts of the most preferred group, e.g. the local "
+             "AZ, while one of them has fewer outstanding requests than this. "
+             "Once they all have this many, the requests spill over to the "
+             "other hosts in proportion to their headroom below it");
+
+DEFINE_bool(thrift_router_prewarm_connections, false,
+            "Connect to all hosts of a new cluster layout in the background, "
+            "so that the first requests to them don't pay for the connect "
+            "and TLS handshake");
+DEFINE_int32(thrift_router_prewarm_max_concurrent_connects, 16,
+             "Maximum number of connections being established at a time by "
+             "the pre-warming of one ThriftRouter");
+DEFINE_int32(thrift_router_prewarm_clients_per_host, 1,
+             "Number of connections to pre-warm for each host. Channels are "
+             "per event loop of the client pool, so set it to the number of "
+             "pool threads to warm all of them");
+DEFINE_string(thrift_router_config_delta_suffix, "",
+              "If set, ThriftRouter also watches the config path with this "
+              "suffix for the shard map deltas written by the Java "
+              "DeltaShardMapPublisher, see common::applyConfigDelta()");
+
+DEFINE_int32(thrift_router_config_debounce_ms, 200,
+             "The shard config is parsed once it has not been written for "
+             "this long, so that a config written in several steps is parsed "
+             "once it is complete. 0 to parse it on every write");
+
 namespace {
 
-bool parseHost(const std::string& str, common::detail::Host* host,
-               const std::string& segment, const std::string& local_group) {
-  std::vector<std::string> tokens;
+// Parse "ip:port[:group]"
+bool parseHostAddr(const folly::StringPiece str, folly::SocketAddress* addr,
+                   folly::StringPiece* group) {
+  std::vector<folly::StringPiece> tokens;
   folly::split(":", str, tokens);
   if (tokens.size() < 2 || tokens.size() > 3) {
     return false;
   }
   try {
-    uint16_t port = atoi(tokens[1].c_str());
-    host->addr.setFromIpPort(tokens[0], port);
+    uint16_t port = folly::to<uint16_t>(tokens[1]);
+    addr->setFromIpPort(tokens[0].str(), port);
   } catch (...) {
     return false;
   }
-  auto group = (tokens.size() == 3 ? tokens[2] : "");
-  host->groups_prefix_lengths[segment] =
-    std::distance(group.begin(), std::mismatch(group.begin(), group.end(),
-                  local_group.begin(), local_group.end()).first);
+  *group = (tokens.size() == 3 ? tokens[2] : folly::StringPiece());
   return true;
 }
 
-bool parseShard(const std::string& str, common::detail::Role* role,
-                uint32_t* shard) {
-  std::vector<std::string> tokens;
-  folly::split(":", str, tokens);
-  if (tokens.size() < 1 || tokens.size() > 2) {
+uint16_t groupPrefixLength(const folly::StringPiece group,
+                           const std::string& local_group) {
+  return std::distance(group.begin(),
+                       std::mismatch(group.begin(), group.end(),
+                                     local_group.begin(),
+                                     local_group.end()).first);
+}
+
+bool parseHost(const std::string& str, common::detail::Host* host,
+               const std::string& segment, const std::string& local_group) {
+  folly::StringPiece group;
+  if (!parseHostAddr(str, &host->addr, &group)) {
+    return false;
+  }
+  host->groups_prefix_lengths[segment] = groupPrefixLength(group, local_group);
+  return true;
+}
+
+bool setKeyToShard(const std::string& segment,
+                   const std::string& key_mapping,
+                   const uint32_t num_shards_before_split,
+                   common::detail::SegmentInfo* info) {
+  const uint32_t shard_number = info->shard_to_hosts.size();
+  if (shard_number == 0) {
+    return true;
+  }
+
+  info->key_to_shard = common::CreateKeyToShardMapper(
+    key_mapping, shard_number, num_shards_before_split);
+  if (info->key_to_shard == nullptr) {
+    LOG(ERROR) << "invalid key mapping " << key_mapping << " with "
+               << num_shards_before_split << " shards before split for "
+               << segment;
     return false;
   }
+  return true;
+}
+
+// Reads the little endian integers and strings of the flat config
+class FlatConfigReader {
+ public:
+  explicit FlatConfigReader(const folly::StringPiece data) : data_(data) {}
+
+  bool read(uint16_t* value) {
+    return readInt(value);
+  }
+
+  bool read(uint32_t* value) {
+    return readInt(value);
+  }
+
+  bool read(folly::StringPiece* str) {
+    uint16_t size;
+    if (!read(&size) || data_.size() < size) {
+      return false;
+    }
+    *str = data_.subpiece(0, size);
+    data_.advance(size);
+    return true;
+  }
+
+  size_t remaining() const {
+    return data_.size();
+  }
+
+ private:
+  template <typename T>
+  bool readInt(T* value) {
+    if (data_.size() < sizeof(T)) {
+      return false;
+    }
+    *value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      *value |= static_cast<T>(static_cast<uint8_t>(data_[i])) << (8 * i);
+    }
+    data_.advance(sizeof(T));
+    return true;
+  }
+
+  folly::StringPiece data_;
+};
+
+const folly::StringPiece kFlatConfigMagic("RSM1");
+const uint32_t kFlatRoleShift = 30;
+const uint32_t kFlatShardMask = (1U << kFlatRoleShift) - 1;
+const uint32_t kFlatRoleSlave = 2;
+
+std::unique_ptr<const common::detail::ClusterLayout> parseFlatConfig(
+    const folly::StringPiece content, const std::string& local_group) {
+  using common::detail::Host;
+  auto cl = std::make_unique<common::detail::ClusterLayout>();
+  FlatConfigReader reader(content.subpiece(kFlatConfigMagic.size()));
+
+  // The host strings are interned, each is parsed once
+  uint32_t num_hosts;
+  if (!reader.read(&num_hosts)) {
+    return nullptr;
+  }
+  std::vector<std::pair<Host, folly::StringPiece>> hosts;
+  hosts.reserve(std::min<size_t>(num_hosts, reader.remaining()));
+  for (uint32_t i = 0; i < num_hosts; ++i) {
+    folly::StringPiece host_str;
+    hosts.emplace_back();
+    if (!reader.read(&host_str) ||
+        !parseHostAddr(host_str, &hosts.back().first.addr,
+                       &hosts.back().second)) {
+      LOG(ERROR) << "Invalid host in flat config";
+      return nullptr;
+    }
+  }
+  // The host of hosts[i] in cl->all_hosts
+  std::vector<const Host*> host_ptrs(num_hosts, nullptr);
+
+  uint32_t num_segments;
+  if (!reader.read(&num_segments)) {
+    return nullptr;
+  }
+  for (uint32_t i = 0; i < num_segments; ++i) {
+    folly::StringPiece name;
+    uint32_t shard_number;
+    uint32_t replication_fanout;
+    folly::StringPiece key_mapping;
+    uint32_t num_shards_before_split;
+    uint32_t num_entries;
+    if (!reader.read(&name) || !reader.read(&shard_number) ||
+        !reader.read(&replication_fanout) || !reader.read(&key_mapping) ||
+        !reader.read(&num_shards_before_split) ||
+        !reader.read(&num_entries)) {
+      LOG(ERROR) << "Truncated flat config";
+      return nullptr;
+    }
+
+    // Every shard takes at least a byte of the config, so that a corrupted
+    // shard number doesn't make us allocate GBs of shards
+    if (shard_number > reader.remaining()) {
+      LOG(ERROR) << "Invalid shard number " << shard_number << " for "
+                 << name << " in flat config";
+      return nullptr;
+    }
+
+    const std::string segment = name.str();
+    auto& segment_info = cl->segments[segment];
+    segment_info.shard_to_hosts.resize(shard_number);
+    segment_info.replication_fanout = replication_fanout;
+    if (!setKeyToShard(segment,
+                       key_mapping.empty() ? "modulo" : key_mapping.str(),
+                       num_shards_before_split, &segment_info)) {
+      return nullptr;
+    }
+
+    // Count the hosts of each shard first, so that each shard is allocated
+    // once
+    FlatConfigReader entries_reader = reader;
+    std::vector<uint32_t> shard_sizes(shard_number, 0);
+    for (uint32_t j = 0; j < num_entries; ++j) {
+      uint32_t host_idx;
+      uint32_t shard_and_role;
+      if (!reader.read(&host_idx) || !reader.read(&shard_and_role) ||
+          host_idx >= num_hosts ||
+          (shard_and_role & kFlatShardMask) >= shard_number) {
+        LOG(ERROR) << "Invalid shard entry for " << segment;
+        return nullptr;
+      }
+      ++shard_sizes[shard_and_role & kFlatShardMask];
+    }
+    for (uint32_t shard = 0; shard < shard_number; ++shard) {
+      segment_info.shard_to_hosts[shard].reserve(shard_sizes[shard]);
+    }
+
+    for (uint32_t j = 0; j < num_entries; ++j) {
+      uint32_t host_idx;
+      uint32_t shard_and_role;
+      entries_reader.read(&host_idx);
+      entries_reader.read(&shard_and_role);
+      auto& host_ptr = host_ptrs[host_idx];
+      if (host_ptr == nullptr) {
+        host_ptr = &*cl->all_hosts.insert(hosts[host_idx].first).first;
+      }
+      if (host_ptr->groups_prefix_lengths.count(segment) == 0) {
+        host_ptr->groups_prefix_lengths[segment] =
+          groupPrefixLength(hosts[host_idx].second, local_group);
+      }
+      const auto role = (shard_and_role >> kFlatRoleShift) == kFlatRoleSlave ?
+        common::detail::Role::SLAVE : common::detail::Role::MASTER;
+      segment_info.shard_to_hosts[shard_and_role & kFlatShardMask]
+        .emplace_back(host_ptr, role);
+    }
+  }
+
+  common::detail::buildHostOrders(cl.get());
+  return std::unique_ptr<const common::detail::ClusterLayout>(std::move(cl));
+}
+
+bool parseShard(const folly::StringPiece str, common::detail::Role* role,
+                uint32_t* shard) {
+  // Called for every shard of every host, so it doesn't allocate
+  folly::StringPiece shard_str(str);
+  folly::StringPiece role_str;
+  const auto colon = shard_str.find(':');
+  if (colon != folly::StringPiece::npos) {
+    role_str = shard_str.subpiece(colon + 1);
+    shard_str = shard_str.subpiece(0, colon);
+    if (role_str.find(':') != folly::StringPiece::npos) {
+      return false;
+    }
+  }
 
   try {
-    *shard = atoi(tokens[0].c_str());
+    *shard = folly::to<uint32_t>(shard_str);
   } catch (...) {
     return false;
   }
   *role = common::detail::Role::MASTER;
-  if (tokens.size() == 2 && tokens[1] == "S") {
+  if (role_str == "S") {
     *role = common::detail::Role::SLAVE;
   }
 
   return true;
 }
 
+// Parse segment_value, the config of segment, into cl
+bool parseSegment(const std::string& segment,
+                  const Json::Value& segment_value,
+                  const std::string& local_group,
+                  common::detail::ClusterLayout* cl) {
+  static const std::vector<std::string> SHARD_NUM_STRs =
+    { "num_leaf_segments", "num_shards" };
+  static const std::string REPLICATION_FANOUT_STR = "replication_fanout";
+  static const std::string KEY_MAPPING_STR = "key_mapping";
+  static const std::string NUM_SHARDS_BEFORE_SPLIT_STR =
+    "num_shards_before_split";
+  // Not used for routing, but by services to pick RocksDB options
+  static const std::string ROCKSDB_PROFILE_STR = "rocksdb_profile";
+
+  if (!segment_value.isObject()) {
+    return false;
+  }
+
+  uint32_t shard_number;
+  if (segment_value.isMember(SHARD_NUM_STRs[0]) &&
+      segment_value[SHARD_NUM_STRs[0]].isInt()) {
+    shard_number = segment_value[SHARD_NUM_STRs[0]].asInt();
+  } else if (segment_value.isMember(SHARD_NUM_STRs[1]) &&
+             segment_value[SHARD_NUM_STRs[1]].isInt()) {
+    shard_number = segment_value[SHARD_NUM_STRs[1]].asInt();
+  } else {
+    LOG(ERROR) << "missing or invalid shard number for " << segment;
+    return false;
+  }
+
+  auto& segment_info = cl->segments[segment];
+  segment_info.shard_to_hosts.resize(shard_number);
+  if (segment_value.isMember(REPLICATION_FANOUT_STR)) {
+    if (!segment_value[REPLICATION_FANOUT_STR].isUInt()) {
+      LOG(ERROR) << "invalid replication fanout for " << segment;
+      return false;
+    }
+
+    segment_info.replication_fanout =
+      segment_value[REPLICATION_FANOUT_STR].asUInt();
+  }
+
+  std::string key_mapping = "modulo";
+  if (segment_value.isMember(KEY_MAPPING_STR)) {
+    if (!segment_value[KEY_MAPPING_STR].isString()) {
+      LOG(ERROR) << "invalid key mapping for " << segment;
+      return false;
+    }
+    key_mapping = segment_value[KEY_MAPPING_STR].asString();
+  }
+  uint32_t num_shards_before_split = 0;
+  if (segment_value.isMember(NUM_SHARDS_BEFORE_SPLIT_STR)) {
+    if (!segment_value[NUM_SHARDS_BEFORE_SPLIT_STR].isUInt()) {
+      LOG(ERROR) << "invalid shard number before split for " << segment;
+      return false;
+    }
+    num_shards_before_split =
+      segment_value[NUM_SHARDS_BEFORE_SPLIT_STR].asUInt();
+  }
+  if (!setKeyToShard(segment, key_mapping, num_shards_before_split,
+                     &segment_info)) {
+    return false;
+  }
+  if (segment_value.isMember(ROCKSDB_PROFILE_STR)) {
+    // Not worth failing the routing for
+    if (segment_value[ROCKSDB_PROFILE_STR].isString()) {
+      segment_info.rocksdb_profile =
+        segment_value[ROCKSDB_PROFILE_STR].asString();
+    } else {
+      LOG(ERROR) << "invalid rocksdb profile for " << segment;
+    }
+  }
+
+  // for each host:port:group
+  for (const auto& host_port_group : segment_value.getMemberNames()) {
+    if (host_port_group == SHARD_NUM_STRs[0] ||
+        host_port_group == SHARD_NUM_STRs[1] ||
+        host_port_group == REPLICATION_FANOUT_STR ||
+        host_port_group == KEY_MAPPING_STR ||
+        host_port_group == NUM_SHARDS_BEFORE_SPLIT_STR ||
+        host_port_group == ROCKSDB_PROFILE_STR) {
+      continue;
+    }
+
+    common::detail::Host host;
+    if (!parseHost(host_port_group, &host, segment, local_group)) {
+      LOG(ERROR) << "Invalid host port group " << host_port_group;
+      return false;
+    }
+    // Merge into the host of the previous segments in place, so that the
+    // pointers they hold stay valid
+    auto host_iter = cl->all_hosts.insert(host).first;
+    host_iter->groups_prefix_lengths.insert(
+      host.groups_prefix_lengths.begin(), host.groups_prefix_lengths.end());
+    const common::detail::Host* pHost = &*host_iter;
+    const auto& shard_list = segment_value[host_port_group];
+    // for each shard
+    for (Json::ArrayIndex i = 0; i < shard_list.size(); ++i) {
+      const auto& shard = shard_list[i];
+      if (!shard.isString()) {
+        LOG(ERROR) << "Invalid shard list for " << host_port_group;
+        return false;
+      }
+
+      const folly::StringPiece shard_str(shard.asCString());
+      std::pair<const common::detail::Host*, common::detail::Role> p;
+      uint32_t shard_id = 0;
+      if (!parseShard(shard_str, &p.second, &shard_id) ||
+          shard_id >= shard_number) {
+        LOG(ERROR) << "Invalid shard " << shard_str;
+        return false;
+      }
+      p.first = pHost;
+      segment_info.shard_to_hosts[shard_id].push_back(p);
+    }
+  }
+
+  return true;
+}
+
 }  // namespace
 
 namespace common {
 
+namespace detail {
+
+std::vector<folly::SocketAddress> getRemovedHosts(
+    const ClusterLayout& old_layout, const ClusterLayout& new_layout) {
+  std::vector<folly::SocketAddress> removed;
+  auto new_itor = new_layout.all_hosts.begin();
+  for (const auto& host : old_layout.all_hosts) {
+    while (new_itor != new_layout.all_hosts.end() && *new_itor < host) {
+      ++new_itor;
+    }
+    if (new_itor == new_layout.all_hosts.end() || host < *new_itor) {
+      removed.push_back(host.addr);
+    }
+  }
+  return removed;
+}
+
+namespace {
+
+const std::string kPrewarmHosts = "thrift_router_prewarm_hosts";
+const std::string kPrewarmedHosts = "thrift_router_prewarmed_hosts";
+const std::string kPrewarmReadyPercent = "thrift_router_prewarm_ready_percent";
+const std::string kPrewarmFailures = "thrift_router_prewarm_failures";
+
+struct PrewarmProgress {
+  PrewarmProgress() : hosts(0), prewarmed_hosts(0) {
+    auto stats = common::Stats::get();
+    stats->RegisterGauge(kPrewarmHosts, [this] {
+      return static_cast<uint64_t>(std::max<int64_t>(hosts.load(), 0));
+    });
+    stats->RegisterGauge(kPrewarmedHosts, [this] {
+      return static_cast<uint64_t>(std::max<int64_t>(prewarmed_hosts.load(),
+                                                     0));
+    });
+    stats->RegisterGauge(kPrewarmReadyPercent, [this] {
+      const auto total = hosts.load();
+      if (total <= 0) {
+        return static_cast<uint64_t>(100);
+      }
+      return static_cast<uint64_t>(
+        std::max<int64_t>(prewarmed_hosts.load(), 0) * 100 / total);
+    });
+  }
+
+  std::atomic<int64_t> hosts;
+  std::atomic<int64_t> prewarmed_hosts;
+};
+
+PrewarmProgress* prewarmProgress() {
+  static auto progress = new PrewarmProgress();
+  return progress;
+}
+
+}  // namespace
+
+void reportPrewarmProgress(int64_t hosts_delta,
+                           int64_t prewarmed_hosts_delta) {
+  auto progress = prewarmProgress();
+  progress->hosts.fetch_add(hosts_delta);
+  progress->prewarmed_hosts.fetch_add(prewarmed_hosts_delta);
+}
+
+void reportPrewarmFailure() {
+  common::Stats::get()->Incr(kPrewarmFailures);
+}
+
+namespace {
+
+const std::string kInGroupRequests = "thrift_router_in_group_requests";
+const std::string kCrossGroupRequests = "thrift_router_cross_group_requests";
+const std::string kCrossGroupPercent = "thrift_router_cross_group_percent";
+
+struct GroupSpread {
+  GroupSpread()
+      : in_group_handle(common::Stats::get()->GetCounterHandle(
+          kInGroupRequests))
+      , cross_group_handle(common::Stats::get()->GetCounterHandle(
+          kCrossGroupRequests))
+      , in_group(0)
+      , cross_group(0) {
+    // The share of the requests since the last report
+    common::Stats::get()->RegisterGauge(kCrossGroupPercent, [this] {
+      const auto in = in_group.exchange(0);
+      const auto cross = cross_group.exchange(0);
+      return in + cross == 0 ? 0 : cross * 100 / (in + cross);
+    });
+  }
+
+  const common::Stats::CounterHandle in_group_handle;
+  const common::Stats::CounterHandle cross_group_handle;
+  std::atomic<uint64_t> in_group;
+  std::atomic<uint64_t> cross_group;
+};
+
+GroupSpread* groupSpread() {
+  static auto spread = new GroupSpread();
+  return spread;
+}
+
+}  // namespace
+
+void reportGroupSpread(const bool cross_group) {
+  auto spread = groupSpread();
+  if (cross_group) {
+    spread->cross_group.fetch_add(1, std::memory_order_relaxed);
+    common::Stats::get()->Incr(spread->cross_group_handle);
+  } else {
+    spread->in_group.fetch_add(1, std::memory_order_relaxed);
+    common::Stats::get()->Incr(spread->in_group_handle);
+  }
+}
+
+void buildHostOrders(const SegmentName& segment_name, SegmentInfo* info) {
+  info->shard_host_orders.clear();
+  info->shard_host_orders.resize(info->shard_to_hosts.size());
+  for (size_t shard = 0; shard < info->shard_to_hosts.size(); ++shard) {
+    const auto& host_info = info->shard_to_hosts[shard];
+    for (int type = 0; type < NUM_HOST_ORDERS; ++type) {
+      // (master first rank, prefix length, host)
+      std::vector<std::tuple<int, uint16_t, const Host*>> ranked;
+      for (const auto& hi : host_info) {
+        if ((type == MASTER_ORDER && hi.second != Role::MASTER) ||
+            (type == SLAVE_ORDER && hi.second != Role::SLAVE)) {
+          continue;
+        }
+
+        const int rank = type == ANY_MASTER_FIRST_ORDER &&
+          hi.second == Role::SLAVE ? 1 : 0;
+        auto itor = hi.first->groups_prefix_lengths.find(segment_name);
+        const uint16_t prefix_length =
+          itor == hi.first->groups_prefix_lengths.end() ? 0 : itor->second;
+        ranked.emplace_back(rank, prefix_length, hi.first);
+      }
+
+      // Lower rank first, then longer prefix first
+      std::sort(ranked.begin(), ranked.end(),
+                [] (const std::tuple<int, uint16_t, const Host*>& a,
+                    const std::tuple<int, uint16_t, const Host*>& b) {
+                  if (std::get<0>(a) != std::get<0>(b)) {
+                    return std::get<0>(a) < std::get<0>(b);
+                  }
+                  return std::get<1>(a) > std::get<1>(b);
+                });
+
+      auto& order = info->shard_host_orders[shard][type];
+      for (size_t i = 0; i < ranked.size(); ++i) {
+        if (i > 0 &&
+            (std::get<0>(ranked[i]) != std::get<0>(ranked[i - 1]) ||
+             std::get<1>(ranked[i]) != std::get<1>(ranked[i - 1]))) {
+          order.tier_ends.push_back(i);
+        }
+        order.hosts.push_back(std::get<2>(ranked[i]));
+      }
+      if (!ranked.empty()) {
+        order.tier_ends.push_back(ranked.size());
+      }
+    }
+  }
+}
+
+void buildHostOrders(ClusterLayout* layout) {
+  for (auto& segment : layout->segments) {
+    buildHostOrders(segment.first, &segment.second);
+  }
+}
+
+std::string hashConfig(const std::string& content) {
+  // 64 bit FNV-1a, as computed by the Java DeltaShardMapPublisher
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char c : content) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016" PRIx64, hash);
+  return hex;
+}
+
+}  // namespace detail
+
 std::unique_ptr<const detail::ClusterLayout> parseConfig(
     const std::string& content, const std::string& local_group) {
+  if (folly::StringPiece(content).startsWith(kFlatConfigMagic)) {
+    return parseFlatConfig(content, local_group);
+  }
+
   auto cl = std::make_unique<detail::ClusterLayout>();
   Json::Reader reader;
   Json::Value root;
@@ -91,71 +640,98 @@ std::unique_ptr<const detail::ClusterLayout> parseConfig(
     return nullptr;
   }
 
-  static const std::vector<std::string> SHARD_NUM_STRs =
-    { "num_leaf_segments", "num_shards" };
   for (const auto& segment : root.getMemberNames()) {
-    // for each segment
-    const auto& segment_value = root[segment];
-    if (!segment_value.isObject()) {
+    if (!parseSegment(segment, root[segment], local_group, cl.get())) {
       return nullptr;
     }
+  }
 
-    uint32_t shard_number;
-    if (segment_value.isMember(SHARD_NUM_STRs[0]) &&
-        segment_value[SHARD_NUM_STRs[0]].isInt()) {
-      shard_number = segment_value[SHARD_NUM_STRs[0]].asInt();
-    } else if (segment_value.isMember(SHARD_NUM_STRs[1]) &&
-               segment_value[SHARD_NUM_STRs[1]].isInt()) {
-      shard_number = segment_value[SHARD_NUM_STRs[1]].asInt();
-    } else {
-      LOG(ERROR) << "missing or invalid shard number for " << segment;
-      return nullptr;
-    }
+  detail::buildHostOrders(cl.get());
+  return std::unique_ptr<const detail::ClusterLayout>(std::move(cl));
+}
 
-    cl->segments[segment].shard_to_hosts.resize(shard_number);
-    // for each host:port:group
-    for (const auto& host_port_group : segment_value.getMemberNames()) {
-      if (host_port_group == SHARD_NUM_STRs[0] ||
-          host_port_group == SHARD_NUM_STRs[1]) {
-        continue;
-      }
+namespace {
 
-      detail::Host host;
-      if (!parseHost(host_port_group, &host, segment, local_group)) {
-        LOG(ERROR) << "Invalid host port group " << host_port_group;
-        return nullptr;
-      }
-      auto host_iter = cl->all_hosts.find(host);
-      if (host_iter != cl->all_hosts.end()) {
-        host.groups_prefix_lengths.insert(
-                host_iter->groups_prefix_lengths.begin(),
-                host_iter->groups_prefix_lengths.end());
-        cl->all_hosts.erase(host_iter);
+// Copy segment of base into cl, pointing to copies of its hosts merged into
+// cl->all_hosts. The host orders are copied too, rather than rebuilt.
+void copySegment(const std::string& segment,
+                 const detail::SegmentInfo& info,
+                 detail::ClusterLayout* cl) {
+  std::unordered_map<const detail::Host*, const detail::Host*> new_hosts;
+  auto copy_host = [&] (const detail::Host* host) {
+    auto& new_host = new_hosts[host];
+    if (new_host == nullptr) {
+      detail::Host copy;
+      copy.addr = host->addr;
+      auto host_iter = cl->all_hosts.insert(std::move(copy)).first;
+      auto itor = host->groups_prefix_lengths.find(segment);
+      if (itor != host->groups_prefix_lengths.end()) {
+        host_iter->groups_prefix_lengths[segment] = itor->second;
       }
-      cl->all_hosts.insert(std::move(host));
-      const detail::Host* pHost = &*(cl->all_hosts.find(host));
-      const auto& shard_list = segment_value[host_port_group];
-      // for each shard
-      for (Json::ArrayIndex i = 0; i < shard_list.size(); ++i) {
-        const auto& shard = shard_list[i];
-        if (!shard.isString()) {
-          LOG(ERROR) << "Invalid shard list for " << host_port_group;
-          return nullptr;
-        }
+      new_host = &*host_iter;
+    }
+    return new_host;
+  };
 
-        auto shard_str = shard.asString();
-        std::pair<const detail::Host*, detail::Role> p;
-        uint32_t shard_id = 0;
-        if (!parseShard(shard_str, &p.second, &shard_id) ||
-            shard_id >= shard_number) {
-          LOG(ERROR) << "Invalid shard " << shard_str;
-          return nullptr;
-        }
-        p.first = pHost;
-        cl->segments[segment].shard_to_hosts[shard_id].push_back(p);
+  auto& new_info = cl->segments[segment];
+  new_info = info;
+  for (auto& hosts : new_info.shard_to_hosts) {
+    for (auto& host : hosts) {
+      host.first = copy_host(host.first);
+    }
+  }
+  for (auto& orders : new_info.shard_host_orders) {
+    for (auto& order : orders) {
+      for (auto& host : order.hosts) {
+        host = copy_host(host);
       }
     }
   }
+}
+
+}  // namespace
+
+std::unique_ptr<const detail::ClusterLayout> applyConfigDelta(
+    const detail::ClusterLayout& base,
+    const std::string& base_hash,
+    const std::string& delta,
+    const std::string& local_group) {
+  static const std::string BASE_HASH_STR = "base_hash";
+  static const std::string SEGMENTS_STR = "segments";
+
+  Json::Reader reader;
+  Json::Value root;
+  if (!reader.parse(delta, root) || !root.isObject() ||
+      !root[BASE_HASH_STR].isString() || !root[SEGMENTS_STR].isObject()) {
+    LOG(ERROR) << "Invalid config delta";
+    return nullptr;
+  }
+  if (root[BASE_HASH_STR].asString() != base_hash) {
+    // A new full config is on its way
+    LOG(INFO) << "The config delta is based on another config";
+    return nullptr;
+  }
+
+  auto cl = std::make_unique<detail::ClusterLayout>();
+  const auto& segments = root[SEGMENTS_STR];
+  for (const auto& segment : segments.getMemberNames()) {
+    const auto& segment_value = segments[segment];
+    if (segment_value.isNull()) {
+      // removed
+      continue;
+    }
+
+    if (!parseSegment(segment, segment_value, local_group, cl.get())) {
+      return nullptr;
+    }
+    detail::buildHostOrders(segment, &cl->segments[segment]);
+  }
+
+  for (const auto& segment : base.segments) {
+    if (!segments.isMember(segment.first)) {
+      copySegment(segment.first, segment.second, cl.get());
+    }
+  }
 
   return std::unique_ptr<const detail::ClusterLayout>(std::move(cl));
 }
@@ -19,27 +19,52 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
+#include "common/circuit_breaker.h"
 #include "common/file_watcher.h"
+#include "common/future_util.h"
+#include "common/hedging_policy.h"
+#include "common/key_to_shard.h"
 #include "common/network_util.h"
 #include "common/thrift_client_pool.h"
+#include "common/tracing.h"
+#include "folly/futures/Future.h"
 #include "folly/Hash.h"
+#include "folly/SharedMutex.h"
 #include "folly/SocketAddress.h"
 #include "folly/ThreadLocal.h"
+#include "folly/small_vector.h"
 
 DECLARE_bool(always_prefer_local_host);
 DECLARE_int32(min_client_reconnect_interval_seconds);
+DECLARE_bool(thrift_router_shared_clients);
 DECLARE_int64(client_connect_timeout_millis);
 DECLARE_int32(thrift_router_max_num_hosts_to_consider);
 DECLARE_int32(thrift_router_log_frequency);
+DECLARE_bool(thrift_router_latency_aware_selection);
+DECLARE_double(thrift_router_latency_aware_max_slowdown);
+DECLARE_int32(thrift_router_group_spillover_max_outstanding);
+DECLARE_bool(thrift_router_prewarm_connections);
+DECLARE_int32(thrift_router_prewarm_max_concurrent_connects);
+DECLARE_int32(thrift_router_prewarm_clients_per_host);
+DECLARE_int32(thrift_router_config_debounce_ms);
+DECLARE_string(thrift_router_config_delta_suffix);
 
 namespace common {
 
@@ -57,8 +82,28 @@ struct Host {
   }
 
   folly::SocketAddress addr;
-  // The hosts' longest common prefix length with local group
-  std::unordered_map<std::string, uint16_t> groups_prefix_lengths;
+  // The hosts' longest common prefix length with local group. Not part of the
+  // ordering, so parsers may add to it in ClusterLayout.all_hosts.
+  mutable std::unordered_map<std::string, uint16_t> groups_prefix_lengths;
+};
+
+// The hosts of a shard matching a role, in the order of preference
+struct HostOrder {
+  std::vector<const Host*> hosts;
+  // hosts in [tier_ends[i - 1], tier_ends[i]) are equally preferred, and
+  // picked from in random order
+  std::vector<uint32_t> tier_ends;
+};
+
+// The host orders precomputed for each shard
+enum HostOrderType {
+  MASTER_ORDER,
+  SLAVE_ORDER,
+  // Masters before Slaves, then local before non-local
+  ANY_MASTER_FIRST_ORDER,
+  // local before non-local
+  ANY_ORDER,
+  NUM_HOST_ORDERS,
 };
 
 struct SegmentInfo {
@@ -66,6 +111,18 @@ struct SegmentInfo {
   // shard_to_hosts[i] contains all host info for shard i.
   // Host* refers to a host in ClusterLayout.all_hosts
   std::vector<std::vector<std::pair<const Host*, Role>>> shard_to_hosts;
+  // How many Slaves of a shard replicate from each of its hosts. 0 means all
+  // Slaves replicate from the Master, 1 means a chain.
+  uint32_t replication_fanout = 0;
+  // Maps keys to shards, see CreateKeyToShardMapper(). nullptr means
+  // modulo.
+  std::shared_ptr<const KeyToShardMapper> key_to_shard;
+  // The RocksDB option profile the services should open the dbs of the
+  // segment with. Empty if not set, as always with the flat config.
+  std::string rocksdb_profile;
+  // Filled by buildHostOrders(), empty otherwise.
+  // shard_host_orders[i][type] is the host order of type for shard i.
+  std::vector<std::array<HostOrder, NUM_HOST_ORDERS>> shard_host_orders;
 };
 
 struct ClusterLayout {
@@ -73,6 +130,137 @@ struct ClusterLayout {
   std::set<Host> all_hosts;
 };
 
+/*
+ * The load of a host as seen by the local clients, for latency aware host
+ * selection. Callers report their requests to it through onRequestStart() and
+ * onRequestDone(). It is shared by all threads and routers of the process.
+ *
+ * With --thrift_router_circuit_breaker, the reported outcomes also drive a
+ * CircuitBreaker, and ThriftRouter skips the host while it is ejected.
+ */
+class HostLoad {
+ public:
+  explicit HostLoad(const std::string& name = "")
+      : ewma_latency_us_(0)
+      , outstanding_(0)
+      , last_update_ms_(0)
+      , circuit_breaker_(FLAGS_thrift_router_circuit_breaker ?
+                         new CircuitBreaker(name) : nullptr) {}
+
+  // Call before sending a request to the host
+  void onRequestStart() {
+    outstanding_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Call once the request is done, with its latency and whether it succeeded
+  void onRequestDone(const uint64_t latency_us, const bool success = true) {
+    outstanding_.fetch_sub(1, std::memory_order_relaxed);
+    if (circuit_breaker_) {
+      circuit_breaker_->onRequestDone(success, latency_us);
+    }
+    auto old_ewma = ewma_latency_us_.load(std::memory_order_relaxed);
+    uint64_t new_ewma;
+    do {
+      new_ewma = old_ewma == 0 ? latency_us :
+        old_ewma - old_ewma / kEwmaWeight + latency_us / kEwmaWeight;
+    } while (!ewma_latency_us_.compare_exchange_weak(
+               old_ewma, new_ewma, std::memory_order_relaxed));
+    last_update_ms_.store(nowMs(), std::memory_order_relaxed);
+  }
+
+  // The expected cost of sending a request to the host now, the lower the
+  // better. The latency of a host we don't hear from decays, so that it gets
+  // requests again to refresh it.
+  uint64_t cost() const {
+    auto ewma = ewma_latency_us_.load(std::memory_order_relaxed);
+    const auto now = nowMs();
+    const auto last_update = last_update_ms_.load(std::memory_order_relaxed);
+    const auto halvings =
+      now > last_update ? (now - last_update) / kDecayIntervalMs : 0;
+    ewma = halvings >= 64 ? 0 : ewma >> halvings;
+    const auto outstanding =
+      std::max(outstanding_.load(std::memory_order_relaxed), 0);
+    return (ewma + 1) * (outstanding + 1);
+  }
+
+  uint64_t ewmaLatencyUs() const {
+    return ewma_latency_us_.load(std::memory_order_relaxed);
+  }
+
+  int32_t outstanding() const {
+    return outstanding_.load(std::memory_order_relaxed);
+  }
+
+  // Return false if the host is ejected by its circuit breaker. While the
+  // circuit is half open, it admits the caller as the probe, so only call it
+  // for the host picked.
+  bool allowRequest() {
+    return circuit_breaker_ == nullptr || circuit_breaker_->allowRequest();
+  }
+
+  // Whether allowRequest() would return false now, without admitting any
+  // probe. The candidate hosts are filtered with it.
+  bool isEjected() const {
+    return circuit_breaker_ != nullptr && circuit_breaker_->isEjected();
+  }
+
+ private:
+  static uint64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // each sample weighs 1/kEwmaWeight
+  static const uint64_t kEwmaWeight = 8;
+  static const uint64_t kDecayIntervalMs = 1000;
+
+  std::atomic<uint64_t> ewma_latency_us_;
+  std::atomic<int32_t> outstanding_;
+  std::atomic<uint64_t> last_update_ms_;
+  const std::unique_ptr<CircuitBreaker> circuit_breaker_;
+};
+
+/*
+ * Precompute the host orders of all shards of layout, for the fast path of
+ * ThriftRouter::getClientsFor(). parseConfig() does it, and custom parsers
+ * should call it before returning their layouts.
+ */
+void buildHostOrders(ClusterLayout* layout);
+
+/*
+ * Precompute the host orders of the shards of a single segment of a layout.
+ */
+void buildHostOrders(const SegmentName& segment_name, SegmentInfo* info);
+
+/*
+ * The hash of a full config a delta is based on, see applyConfigDelta().
+ */
+std::string hashConfig(const std::string& content);
+
+/*
+ * The hosts of old_layout which aren't in new_layout, by a linear merge of the
+ * sorted all_hosts.
+ */
+std::vector<folly::SocketAddress> getRemovedHosts(
+    const ClusterLayout& old_layout, const ClusterLayout& new_layout);
+
+/*
+ * Process wide connection pre-warming progress of all ThriftRouters, exported
+ * as the thrift_router_prewarm_hosts, thrift_router_prewarmed_hosts and
+ * thrift_router_prewarm_ready_percent gauges.
+ */
+void reportPrewarmProgress(int64_t hosts_delta, int64_t prewarmed_hosts_delta);
+void reportPrewarmFailure();
+
+/*
+ * Count a request sent to a host in the most preferred group of its shard, or
+ * to one out of it. Exported as the thrift_router_in_group_requests and
+ * thrift_router_cross_group_requests counters, and the
+ * thrift_router_cross_group_percent gauge of the requests since its last
+ * report.
+ */
+void reportGroupSpread(bool cross_group);
+
 }  // namespace detail
 
 /*
@@ -91,6 +279,25 @@ class ThriftRouter {
   using Host = detail::Host;
   using SegmentInfo = detail::SegmentInfo;
   using ClusterLayout = detail::ClusterLayout;
+  using HostLoad = detail::HostLoad;
+  // Enough for ONE and TWO without allocating
+  using ClientVector = folly::small_vector<std::shared_ptr<ClientType>, 2>;
+  using HostLoadVector = folly::small_vector<std::shared_ptr<HostLoad>, 2>;
+
+  // The result of scatterGather()
+  template <typename Response>
+  struct ScatterGatherResult {
+    // The response of each host, with the shards it served
+    std::vector<std::pair<std::vector<ShardID>, Response>> responses;
+    // The error of each shard without a response
+    std::map<ShardID, folly::exception_wrapper> errors;
+  };
+
+  // A segment resolved by getSegmentHandle(), valid across config changes
+  struct SegmentHandle {
+    uint32_t id;
+    HedgingPolicy* hedging;
+  };
 
   /*
    * @param local_group  The group of the local host
@@ -106,22 +313,75 @@ class ThriftRouter {
         const std::string&, const std::string&)> parser,
       std::shared_ptr<ThriftClientPool<ClientType, USE_BINARY_PROTOCOL>> client_pool = nullptr)
       : config_path_(config_path)
+      , config_delta_path_(FLAGS_thrift_router_config_delta_suffix.empty() ?
+          std::string() : config_path + FLAGS_thrift_router_config_delta_suffix)
       , parser_(std::move(parser))
       , cluster_layout_()
-      , local_client_map_(std::move(client_pool)) {
+      , layout_update_()
+      , config_mutex_()
+      , last_config_content_()
+      , last_config_delta_content_()
+      , full_layout_()
+      , full_config_hash_()
+      , local_client_map_(std::move(client_pool))
+      , prewarm_thread_()
+      , prewarm_mutex_()
+      , prewarm_cv_()
+      , prewarm_layout_()
+      , stop_prewarm_(false)
+      , prewarm_hosts_(0)
+      , prewarmed_hosts_(0)
+      , warm_clients_() {
+    if (FLAGS_thrift_router_prewarm_connections) {
+      prewarm_thread_ = std::thread([this] { prewarmLoop(); });
+    }
+
     CHECK(common::FileWatcher::Instance()->AddFile(
       config_path_,
       [this, local_group] (std::string content) {
+        std::lock_guard<std::mutex> g(config_mutex_);
+        // Deploys often republish the same config
+        if (content == last_config_content_) {
+          return;
+        }
+
         std::shared_ptr<const ClusterLayout> new_layout(
           parser_(content, local_group));
 
         if (new_layout) {
-          std::atomic_store_explicit(&cluster_layout_, new_layout, std::memory_order_release);
+          if (!config_delta_path_.empty()) {
+            full_config_hash_ = detail::hashConfig(content);
+            full_layout_ = new_layout;
+          }
+          last_config_content_ = std::move(content);
+          setClusterLayout(std::move(new_layout));
+          // The latest delta may have been waiting for this config
+          applyConfigDelta(local_group);
         } else {
           LOG(ERROR) << "Failed to parse the config: " << content;
         }
-      }))
+      },
+      configWatchOptions()))
     << "Failed to watch " << config_path_;
+
+    if (!config_delta_path_.empty()) {
+      auto options = configWatchOptions();
+      options.must_exist = false;
+      CHECK(common::FileWatcher::Instance()->AddFile(
+        config_delta_path_,
+        [this, local_group] (std::string content) {
+          std::lock_guard<std::mutex> g(config_mutex_);
+          if (content == last_config_delta_content_) {
+            return;
+          }
+
+          last_config_delta_content_ = std::move(content);
+          applyConfigDelta(local_group);
+        },
+        options))
+      << "Failed to watch " << config_delta_path_;
+    }
+
     LOG(INFO) << "Local Group used by ThriftRouter: " << local_group;
   }
 
@@ -129,6 +389,34 @@ class ThriftRouter {
     if (!common::FileWatcher::Instance()->RemoveFile(config_path_)) {
       LOG(ERROR) << "Failed to stop watching " << config_path_;
     }
+    if (!config_delta_path_.empty() &&
+        !common::FileWatcher::Instance()->RemoveFile(config_delta_path_)) {
+      LOG(ERROR) << "Failed to stop watching " << config_delta_path_;
+    }
+
+    if (prewarm_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> g(prewarm_mutex_);
+        stop_prewarm_ = true;
+        prewarm_cv_.notify_one();
+      }
+      prewarm_thread_.join();
+      detail::reportPrewarmProgress(-static_cast<int64_t>(prewarm_hosts_),
+                                    -static_cast<int64_t>(prewarmed_hosts_));
+    }
+  }
+
+  /*
+   * The number of hosts in the current layout, and how many of them have an
+   * established connection kept warm. Both are 0 unless
+   * FLAGS_thrift_router_prewarm_connections is set.
+   */
+  uint32_t numPrewarmHosts() const {
+    return prewarm_hosts_.load(std::memory_order_relaxed);
+  }
+
+  uint32_t numPrewarmedHosts() const {
+    return prewarmed_hosts_.load(std::memory_order_relaxed);
   }
 
 
@@ -191,11 +479,273 @@ class ThriftRouter {
       const Quantity quantity,
       std::map<ShardID, std::vector<std::shared_ptr<ClientType>>>*
         shard_to_clients) {
+    TraceSpan span("thrift_router_get_clients");
     updateClusterLayout();
     return local_client_map_.getClientsFor(segment, role, quantity,
                                            shard_to_clients);
   }
 
+  /*
+   * Resolve segment for the getClientsFor() below. It only needs to be called
+   * once per segment, and the segment doesn't have to be in the config yet.
+   */
+  SegmentHandle getSegmentHandle(const std::string& segment) {
+    const auto id = local_client_map_.registerSegment(segment);
+    std::lock_guard<std::mutex> g(hedging_policies_mutex_);
+    if (id >= hedging_policies_.size()) {
+      hedging_policies_.resize(id + 1);
+    }
+    if (hedging_policies_[id] == nullptr) {
+      hedging_policies_[id] = std::make_unique<HedgingPolicy>(segment);
+    }
+    return SegmentHandle{id, hedging_policies_[id].get()};
+  }
+
+  /*
+   * Same as the single shard getClientsFor() above, except that it doesn't
+   * allocate memory once the clients are connected. The hosts are visited in
+   * the order precomputed by detail::buildHostOrders(), and only until enough
+   * good clients are found.
+   *
+   * If loads is not nullptr, it is filled with the HostLoad of the host of
+   * each client, to report the requests sent to them. With
+   * --thrift_router_latency_aware_selection, ONE and TWO pick between the
+   * preferred host and a random other one by their HostLoad::cost(), so that
+   * a slow host gets fewer requests.
+   * With --thrift_router_group_spillover_max_outstanding instead, ONE and TWO
+   * keep to the most preferred group of hosts, e.g. the local AZ, up to that
+   * many outstanding requests per host, and then spill over to the other
+   * hosts in proportion to their headroom. The outstanding requests are the
+   * ones reported to the loads.
+   */
+  ReturnCode getClientsFor(const SegmentHandle& segment,
+                           const Role role,
+                           const Quantity quantity,
+                           const ShardID shard,
+                           ClientVector* clients,
+                           HostLoadVector* loads = nullptr) {
+    updateClusterLayout();
+    return local_client_map_.getClientsFor(segment.id, role, quantity, shard,
+                                           clients, loads);
+  }
+
+  /*
+   * The shard of key in the segment, by the key mapping of the config, or
+   * -1 if the segment isn't in the config.
+   */
+  int64_t getShardForKey(const SegmentHandle& segment,
+                         const folly::StringPiece key) {
+    const uint64_t hash = HashKeyForShard(key);
+    updateClusterLayout();
+    auto mapper = local_client_map_.getKeyToShardMapper(segment.id);
+    if (mapper.second == 0) {
+      return -1;
+    }
+    return mapper.first ? mapper.first->getShard(hash) : hash % mapper.second;
+  }
+
+  /*
+   * Same as getShardForKey() for many keys. shards is resized to keys.
+   * Return false if the segment isn't in the config.
+   */
+  bool getShardsForKeys(const SegmentHandle& segment,
+                        const std::vector<folly::StringPiece>& keys,
+                        std::vector<ShardID>* shards) {
+    std::vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      hashes[i] = HashKeyForShard(keys[i]);
+    }
+
+    shards->resize(keys.size());
+    updateClusterLayout();
+    auto mapper = local_client_map_.getKeyToShardMapper(segment.id);
+    if (mapper.second == 0) {
+      return false;
+    }
+    if (mapper.first) {
+      mapper.first->getShards(hashes.data(), hashes.size(), shards->data());
+    } else {
+      for (size_t i = 0; i < hashes.size(); ++i) {
+        (*shards)[i] = hashes[i] % mapper.second;
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Send a request to the best host of shard, and a backup request to the
+   * second best one if the first doesn't respond within the hedge delay of
+   * the segment (see HedgingPolicy). The first successful response is used,
+   * or the exception of the first request if both fail.
+   *
+   * request is called with the client to send to, once or twice, and returns
+   * a folly::Future. The backup isn't sent if the first request succeeds in
+   * time, otherwise the late response is dropped.
+   */
+  template <typename F>
+  auto hedgedCall(const SegmentHandle& segment,
+                  const Role role,
+                  const ShardID shard,
+                  F&& request)
+      -> decltype(request(
+           std::declval<const std::shared_ptr<ClientType>&>())) {
+    using FutureType = decltype(request(
+      std::declval<const std::shared_ptr<ClientType>&>()));
+    using T = typename FutureType::value_type;
+    // the value, and whether it is from the backup request
+    using Result = std::pair<T, bool>;
+
+    ClientVector clients;
+    HostLoadVector loads;
+    const auto ret =
+      getClientsFor(segment, role, Quantity::TWO, shard, &clients, &loads);
+    if (ret != ReturnCode::OK) {
+      return folly::makeFuture<T>(std::runtime_error(
+        "No client for shard " + std::to_string(shard) + ", return code " +
+        std::to_string(ret)));
+    }
+
+    auto policy = segment.hedging;
+    if (clients.size() < 2) {
+      return sendHedgedRequest<T>(request, clients[0], loads[0], policy, false)
+        .then([] (Result&& result) { return std::move(result.first); });
+    }
+
+    policy->onRequest();
+    auto request_ptr = std::make_shared<typename std::decay<F>::type>(
+      std::forward<F>(request));
+    auto primary_failed = std::make_shared<std::atomic<bool>>(false);
+    auto primary = sendHedgedRequest<T>(*request_ptr, clients[0], loads[0],
+                                        policy, false)
+      .onError([primary_failed] (folly::exception_wrapper ew) {
+        primary_failed->store(true);
+        return folly::makeFuture<Result>(std::move(ew));
+      });
+
+    auto backup = [request_ptr, client = clients[1], load = loads[1], policy,
+                   primary_failed] () {
+      // failing over doesn't count against the hedge budget
+      if (!primary_failed->load() && !policy->tryAcquireHedge()) {
+        return folly::makeFuture<Result>(
+          std::runtime_error("Hedge budget exhausted"));
+      }
+      return sendHedgedRequest<T>(*request_ptr, client, load, policy, true);
+    };
+
+    const auto delay = std::max(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+        policy->getHedgeDelay()),
+      std::chrono::milliseconds(1));
+    return GetSpeculativeFuture(std::move(primary), std::move(backup), delay)
+      .then([policy, primary_failed] (Result&& result) {
+        if (result.second && !primary_failed->load()) {
+          policy->onHedgeWon();
+        }
+        return std::move(result.first);
+      });
+  }
+
+  /*
+   * Send keys to the hosts serving them, with one request per host for all
+   * the shards it serves, and collect the responses.
+   *
+   * @param segment   The segment of the keys
+   * @param role      The role of the hosts to send to
+   * @param keys      The keys
+   * @param shard_fn  Returns the shard of a key
+   * @param request   Called once per host with its client and the keys by
+   *                  shard it serves, returns a folly::Future
+   * @param timeout   The deadline of all the requests
+   *
+   * @return a future fulfilled once all the hosts responded or the deadline
+   *         passed. The shards without a response, because of no good host, a
+   *         failed request or the deadline, are in errors.
+   */
+  template <typename Key, typename ShardFn, typename RequestFn>
+  auto scatterGather(const SegmentHandle& segment,
+                     const Role role,
+                     const std::vector<Key>& keys,
+                     ShardFn&& shard_fn,
+                     RequestFn&& request,
+                     const std::chrono::milliseconds timeout)
+      -> folly::Future<ScatterGatherResult<typename decltype(request(
+           std::declval<const std::shared_ptr<ClientType>&>(),
+           std::declval<const std::map<ShardID, std::vector<Key>>&>()))
+             ::value_type>> {
+    using Response = typename decltype(request(
+      std::declval<const std::shared_ptr<ClientType>&>(),
+      std::declval<const std::map<ShardID, std::vector<Key>>&>()))::value_type;
+    using Result = ScatterGatherResult<Response>;
+
+    std::map<ShardID, std::vector<Key>> shard_to_keys;
+    for (const auto& key : keys) {
+      shard_to_keys[shard_fn(key)].push_back(key);
+    }
+
+    struct HostBatch {
+      std::shared_ptr<ClientType> client;
+      std::map<ShardID, std::vector<Key>> shard_to_keys;
+    };
+    std::vector<HostBatch> batches;
+    Result result;
+    ClientVector clients;
+    for (auto& shard_keys : shard_to_keys) {
+      const auto shard = shard_keys.first;
+      const auto ret =
+        getClientsFor(segment, role, Quantity::TWO, shard, &clients);
+      if (ret != ReturnCode::OK) {
+        result.errors[shard] = folly::make_exception_wrapper<
+          std::runtime_error>("No client for shard " + std::to_string(shard) +
+                              ", return code " + std::to_string(ret));
+        continue;
+      }
+
+      // Prefer a host with a batch already if both are good
+      auto find_batch = [&batches] (const std::shared_ptr<ClientType>& c) {
+        return std::find_if(batches.begin(), batches.end(),
+                            [&c] (const HostBatch& b) {
+                              return b.client == c;
+                            });
+      };
+      auto itor = find_batch(clients[0]);
+      if (itor == batches.end() && clients.size() > 1) {
+        itor = find_batch(clients[1]);
+      }
+      if (itor == batches.end()) {
+        batches.push_back(HostBatch{clients[0], {}});
+        itor = batches.end() - 1;
+      }
+      itor->shard_to_keys[shard] = std::move(shard_keys.second);
+    }
+
+    std::vector<folly::Future<Response>> futures;
+    std::vector<std::vector<ShardID>> batch_shards(batches.size());
+    futures.reserve(batches.size());
+    for (size_t i = 0; i < batches.size(); ++i) {
+      for (const auto& shard_keys : batches[i].shard_to_keys) {
+        batch_shards[i].push_back(shard_keys.first);
+      }
+      futures.push_back(
+        request(batches[i].client, batches[i].shard_to_keys).within(timeout));
+    }
+
+    return folly::collectAll(futures).then(
+      [result = std::move(result), batch_shards = std::move(batch_shards)]
+      (std::vector<folly::Try<Response>>&& tries) mutable {
+        for (size_t i = 0; i < tries.size(); ++i) {
+          if (tries[i].hasException()) {
+            for (const auto shard : batch_shards[i]) {
+              result.errors[shard] = tries[i].exception();
+            }
+          } else {
+            result.responses.emplace_back(std::move(batch_shards[i]),
+                                          std::move(tries[i].value()));
+          }
+        }
+        return std::move(result);
+      });
+  }
+
   uint32_t getShardNumberFor(const std::string& segment) {
     const auto layout = getClusterLayout();
 
@@ -236,6 +786,25 @@ class ThriftRouter {
     return itor->second.shard_to_hosts[shard].size();
   }
 
+  /*
+   * Set the address this process serves at, if it is one of the hosts of the
+   * layout. The clients pointing to it are then told apart by
+   * isLocalClient(), so that the requests routed to the local host can be
+   * served in process rather than through the transport.
+   * @note Call it before any getClientsFor()
+   */
+  void setLocalAddress(const folly::SocketAddress& addr) {
+    local_client_map_.setLocalAddress(addr);
+  }
+
+  /*
+   * Whether client, returned to this thread by getClientsFor(), points to the
+   * address set by setLocalAddress().
+   */
+  bool isLocalClient(const ClientType* client) {
+    return local_client_map_.isLocalClient(client);
+  }
+
   // no copy or move
   ThriftRouter(const ThriftRouter&) = delete;
   ThriftRouter& operator=(const ThriftRouter&) = delete;
@@ -245,8 +814,214 @@ class ThriftRouter {
     return std::atomic_load_explicit(&cluster_layout_, std::memory_order_acquire);
   }
 
+  static FileWatcher::Options configWatchOptions() {
+    FileWatcher::Options options;
+    options.debounce = std::chrono::milliseconds(
+      std::max(FLAGS_thrift_router_config_debounce_ms, 0));
+    return options;
+  }
+
+  // A new layout, and the hosts removed since the one before it
+  struct LayoutUpdate {
+    std::shared_ptr<const ClusterLayout> layout;
+    // Only compared with, it may have been freed
+    const ClusterLayout* previous = nullptr;
+    std::vector<folly::SocketAddress> removed_hosts;
+  };
+
+  // Publish new_layout to the threads routing requests
+  void setClusterLayout(std::shared_ptr<const ClusterLayout> new_layout) {
+    auto update = std::make_shared<LayoutUpdate>();
+    update->previous = getClusterLayout().get();
+    if (update->previous) {
+      update->removed_hosts =
+        detail::getRemovedHosts(*update->previous, *new_layout);
+    }
+    update->layout = new_layout;
+    std::atomic_store_explicit(&layout_update_,
+                               std::shared_ptr<const LayoutUpdate>(
+                                 std::move(update)),
+                               std::memory_order_release);
+    std::atomic_store_explicit(&cluster_layout_, new_layout, std::memory_order_release);
+    if (prewarm_thread_.joinable()) {
+      std::lock_guard<std::mutex> g(prewarm_mutex_);
+      prewarm_layout_ = std::move(new_layout);
+      prewarm_cv_.notify_one();
+    }
+  }
+
+  // Apply the latest config delta to the latest full config, if it is based
+  // on it. Must hold config_mutex_.
+  void applyConfigDelta(const std::string& local_group) {
+    if (full_layout_ == nullptr || last_config_delta_content_.empty()) {
+      return;
+    }
+
+    std::shared_ptr<const ClusterLayout> new_layout(common::applyConfigDelta(
+      *full_layout_, full_config_hash_, last_config_delta_content_,
+      local_group));
+    if (new_layout) {
+      setClusterLayout(std::move(new_layout));
+    }
+  }
+
   void updateClusterLayout() {
-    local_client_map_.updateClusterLayout(getClusterLayout());
+    auto update = std::atomic_load_explicit(&layout_update_,
+                                            std::memory_order_acquire);
+    if (update) {
+      local_client_map_.updateClusterLayout(*update);
+    }
+  }
+
+  // Send request to client, reporting it to load and policy
+  template <typename T, typename F>
+  static folly::Future<std::pair<T, bool>> sendHedgedRequest(
+      F& request,
+      const std::shared_ptr<ClientType>& client,
+      std::shared_ptr<HostLoad> load,
+      HedgingPolicy* policy,
+      const bool is_backup) {
+    if (load) {
+      load->onRequestStart();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    return request(client).then(
+      [load = std::move(load), policy, start, is_backup] (folly::Try<T>&& t) {
+        const uint64_t latency_us =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        if (load) {
+          load->onRequestDone(latency_us, !t.hasException());
+        }
+        if (t.hasException()) {
+          return folly::makeFuture<std::pair<T, bool>>(
+            std::move(t.exception()));
+        }
+        policy->recordLatency(latency_us);
+        return folly::makeFuture(std::make_pair(std::move(t.value()),
+                                                is_backup));
+      });
+  }
+
+  void prewarmLoop() {
+    while (true) {
+      std::shared_ptr<const ClusterLayout> layout;
+      {
+        std::unique_lock<std::mutex> lock(prewarm_mutex_);
+        prewarm_cv_.wait(lock, [this] {
+          return stop_prewarm_ || prewarm_layout_ != nullptr;
+        });
+        if (stop_prewarm_) {
+          return;
+        }
+        layout = std::move(prewarm_layout_);
+        prewarm_layout_.reset();
+      }
+
+      prewarm(*layout);
+    }
+  }
+
+  // Connect to the hosts of layout which aren't warm yet, with at most
+  // FLAGS_thrift_router_prewarm_max_concurrent_connects connections being
+  // established at a time. The clients are kept in warm_clients_ so that the
+  // pool keeps their channels until the hosts leave the layout.
+  void prewarm(const ClusterLayout& layout) {
+    std::unordered_set<folly::SocketAddress> hosts;
+    for (const auto& host : layout.all_hosts) {
+      hosts.insert(host.addr);
+    }
+
+    uint32_t num_removed = 0;
+    for (auto itor = warm_clients_.begin(); itor != warm_clients_.end();) {
+      if (hosts.count(itor->first) == 0) {
+        itor = warm_clients_.erase(itor);
+        ++num_removed;
+      } else {
+        ++itor;
+      }
+    }
+
+    std::vector<folly::SocketAddress> pending;
+    for (const auto& addr : hosts) {
+      if (warm_clients_.count(addr) == 0) {
+        pending.push_back(addr);
+      }
+    }
+
+    const int64_t hosts_delta =
+      static_cast<int64_t>(hosts.size()) - prewarm_hosts_;
+    prewarm_hosts_ = hosts.size();
+    prewarmed_hosts_ -= num_removed;
+    detail::reportPrewarmProgress(hosts_delta,
+                                  -static_cast<int64_t>(num_removed));
+
+    struct Connect {
+      const folly::SocketAddress* addr;
+      std::shared_ptr<ClientType> client;
+      const std::atomic<bool>* is_good;
+      const std::atomic<bool>* is_connected;
+      std::chrono::steady_clock::time_point deadline;
+    };
+
+    const size_t max_in_flight =
+      std::max(FLAGS_thrift_router_prewarm_max_concurrent_connects, 1);
+    const int clients_per_host =
+      std::max(FLAGS_thrift_router_prewarm_clients_per_host, 1);
+    const auto timeout =
+      std::chrono::milliseconds(FLAGS_client_connect_timeout_millis);
+    auto& pool = local_client_map_.clientPool();
+    std::vector<Connect> in_flight;
+    size_t next = 0;
+    while (next < pending.size() || !in_flight.empty()) {
+      {
+        std::lock_guard<std::mutex> g(prewarm_mutex_);
+        if (stop_prewarm_ || prewarm_layout_) {
+          // a newer layout supersedes this one
+          return;
+        }
+      }
+
+      while (next < pending.size() && in_flight.size() < max_in_flight) {
+        const auto& addr = pending[next++];
+        for (int i = 0; i < clients_per_host; ++i) {
+          Connect c;
+          c.addr = &addr;
+          c.is_good = nullptr;
+          c.is_connected = nullptr;
+          c.client = pool.getClient(addr, FLAGS_client_connect_timeout_millis,
+                                    &c.is_good, false, &c.is_connected);
+          c.deadline = std::chrono::steady_clock::now() + timeout;
+          if (c.client) {
+            in_flight.push_back(std::move(c));
+          } else {
+            detail::reportPrewarmFailure();
+          }
+        }
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+      const auto now = std::chrono::steady_clock::now();
+      auto itor = std::remove_if(in_flight.begin(), in_flight.end(),
+                                 [this, now] (Connect& c) {
+        if (c.is_connected->load() && c.is_good->load()) {
+          auto& clients = warm_clients_[*c.addr];
+          clients.push_back(std::move(c.client));
+          if (clients.size() == 1) {
+            ++prewarmed_hosts_;
+            detail::reportPrewarmProgress(0, 1);
+          }
+          return true;
+        }
+        if (!c.is_good->load() || now >= c.deadline) {
+          detail::reportPrewarmFailure();
+          return true;
+        }
+        return false;
+      });
+      in_flight.erase(itor, in_flight.end());
+    }
   }
 
   class ThreadLocalClientMap {
@@ -262,6 +1037,19 @@ class ThriftRouter {
       *local_cluster_layout_ = std::make_shared<const ClusterLayout>();
     }
 
+    ThriftClientPool<ClientType, USE_BINARY_PROTOCOL>& clientPool() {
+      return *client_pool_;
+    }
+
+    void setLocalAddress(const folly::SocketAddress& addr) {
+      local_addr_ = addr;
+      has_local_addr_ = true;
+    }
+
+    bool isLocalClient(const ClientType* client) {
+      return client != nullptr && local_client_->get() == client;
+    }
+
     ReturnCode getClientsFor(
         const std::string& segment,
         const Role role,
@@ -307,7 +1095,8 @@ class ThriftRouter {
         }
         createOrFixClientsFor(hosts_for_shard);
         auto sz = hosts_for_shard.size();
-        filterBadHosts(&hosts_for_shard);
+        const bool only_ejected =
+          filterBadHosts(&hosts_for_shard, quantity != Quantity::ALL);
         if (sz != hosts_for_shard.size() && quantity == Quantity::ALL) {
           // exist some bad hosts, and we want all of them
           LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
@@ -324,7 +1113,15 @@ class ThriftRouter {
         }
 
         for (const auto host : hosts_for_shard) {
-          clients.push_back((*clients_)[host->addr].client);
+          // Admit the probe of a half open host picked. Another caller may
+          // have taken it since filterBadHosts().
+          const auto& cs = (*clients_)[host->addr];
+          if (quantity != Quantity::ALL && !only_ejected &&
+              cs.load != nullptr && !cs.load->allowRequest()) {
+            continue;
+          }
+
+          clients.push_back(cs.client);
           if (quantity == Quantity::ONE) {
             break;
           }
@@ -333,18 +1130,307 @@ class ThriftRouter {
             break;
           }
         }
+
+        if (clients.empty()) {
+          LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+            << "We could not find any good host for shard " << shard;
+          ret = ReturnCode::BAD_HOST;
+        }
       }
 
       return ret;
     }
 
-    void updateClusterLayout(std::shared_ptr<const ClusterLayout> layout) {
-      if (layout == *local_cluster_layout_ || layout == nullptr) {
+    uint32_t registerSegment(const std::string& segment) {
+      std::lock_guard<std::mutex> g(segment_ids_mutex_);
+      auto ret = segment_ids_.emplace(segment, segment_names_.size());
+      if (ret.second) {
+        segment_names_.push_back(segment);
+      }
+      return ret.first->second;
+    }
+
+    ReturnCode getClientsFor(const uint32_t segment_id,
+                             const Role role,
+                             const Quantity quantity,
+                             const ShardID shard,
+                             ClientVector* clients,
+                             HostLoadVector* loads) {
+      clients->clear();
+      if (loads) {
+        loads->clear();
+      }
+      const std::string* segment_name = nullptr;
+      auto segment_info = getSegment(segment_id, &segment_name);
+      if (segment_info == nullptr) {
+        LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+          << "Unknown segment id: " << segment_id;
+        return ReturnCode::UNKNOWN_SEGMENT;
+      }
+
+      if (shard >= segment_info->shard_to_hosts.size()) {
+        LOG(ERROR) << "Unknown shard: " << shard;
+        return ReturnCode::UNKNOWN_SHARD;
+      }
+
+      if (segment_info->shard_host_orders.empty()) {
+        // The layout is from a parser not calling buildHostOrders()
+        std::map<ShardID, std::vector<std::shared_ptr<ClientType>>>
+          shard_to_clients;
+        shard_to_clients[shard];
+        auto ret = getClientsFor(*segment_name, role, quantity,
+                                 &shard_to_clients);
+        const auto& v = shard_to_clients[shard];
+        clients->assign(v.begin(), v.end());
+        if (loads) {
+          for (const auto& client : v) {
+            loads->push_back(findHostLoad(client.get()));
+          }
+        }
+        return ret;
+      }
+
+      detail::HostOrderType type;
+      if (role == Role::MASTER) {
+        type = detail::MASTER_ORDER;
+      } else if (role == Role::SLAVE) {
+        type = detail::SLAVE_ORDER;
+      } else if (!FLAGS_always_prefer_local_host) {
+        type = detail::ANY_MASTER_FIRST_ORDER;
+      } else {
+        type = detail::ANY_ORDER;
+      }
+      const auto& order = segment_info->shard_host_orders[shard][type];
+      if (order.hosts.empty()) {
+        LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+          << "Could not find hosts for shard " << shard;
+        return ReturnCode::NOT_FOUND;
+      }
+
+      uint32_t n_hosts = order.hosts.size();
+      if (quantity != Quantity::ALL &&
+          FLAGS_thrift_router_max_num_hosts_to_consider > 0 &&
+          FLAGS_thrift_router_max_num_hosts_to_consider < n_hosts) {
+        n_hosts = FLAGS_thrift_router_max_num_hosts_to_consider;
+      }
+      const uint32_t n_wanted = quantity == Quantity::ONE ? 1 :
+        (quantity == Quantity::TWO ? 2 : n_hosts);
+
+      // Start from a random host of each tier, so that equally preferred
+      // hosts share the load
+      thread_local unsigned rotation_counter = 0;
+      const auto rotation = folly::hash::twang_mix64(++rotation_counter);
+      const int32_t spillover_max_outstanding =
+        quantity == Quantity::ALL ? 0 :
+        FLAGS_thrift_router_group_spillover_max_outstanding;
+      const bool latency_aware =
+        FLAGS_thrift_router_latency_aware_selection &&
+        quantity != Quantity::ALL && spillover_max_outstanding <= 0;
+      // The good hosts visited and their tiers, for latency aware selection
+      folly::small_vector<std::pair<ClientAndStatus*, uint32_t>, 8>
+        candidates;
+      folly::small_vector<ClientAndStatus*, 2> ejected;
+      uint32_t tier_begin = 0;
+      uint32_t n_visited = 0;
+      for (uint32_t tier = 0; tier < order.tier_ends.size(); ++tier) {
+        const uint32_t tier_end = order.tier_ends[tier];
+        const uint32_t tier_size = tier_end - tier_begin;
+        const uint32_t offset = rotation % tier_size;
+        for (uint32_t i = 0; i < tier_size && n_visited < n_hosts;
+             ++i, ++n_visited) {
+          const Host* host =
+            order.hosts[tier_begin + (offset + i) % tier_size];
+          auto cs = getGoodClient(host);
+          if (cs == nullptr) {
+            if (quantity == Quantity::ALL) {
+              LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+                << "There is at least one bad host for shard " << shard;
+              clients->clear();
+              if (loads) {
+                loads->clear();
+              }
+              return ReturnCode::BAD_HOST;
+            }
+            continue;
+          }
+
+          // Ejected hosts are only the last resort. ALL asks for every host,
+          // so it doesn't skip them.
+          if (quantity != Quantity::ALL && cs->load->isEjected()) {
+            ejected.push_back(cs);
+            continue;
+          }
+
+          if (latency_aware || spillover_max_outstanding > 0) {
+            candidates.emplace_back(cs, tier);
+            continue;
+          }
+
+          // Admit the probe of a half open host picked. Another caller may
+          // have taken it since isEjected().
+          if (quantity != Quantity::ALL && !cs->load->allowRequest()) {
+            ejected.push_back(cs);
+            continue;
+          }
+
+          clients->push_back(cs->client);
+          if (loads) {
+            loads->push_back(cs->load);
+          }
+          if (clients->size() >= n_wanted) {
+            return ReturnCode::OK;
+          }
+        }
+        tier_begin = tier_end;
+      }
+
+      if (spillover_max_outstanding > 0 && !candidates.empty()) {
+        pickWithSpillover(&candidates, n_wanted, spillover_max_outstanding,
+                          rotation, clients, loads);
+      }
+
+      if (latency_aware && !candidates.empty()) {
+        // Power of two choices between the preferred host and a random other
+        // one. A less preferred host only wins if the preferred one is much
+        // slower.
+        uint32_t first = 0;
+        uint32_t second = 0;
+        if (candidates.size() > 1) {
+          second = 1 + (rotation >> 32) % (candidates.size() - 1);
+          const double preferred_cost = candidates[0].first->load->cost();
+          const double other_cost = candidates[second].first->load->cost();
+          const bool same_tier =
+            candidates[0].second == candidates[second].second;
+          if (same_tier ? other_cost < preferred_cost :
+              preferred_cost >
+                FLAGS_thrift_router_latency_aware_max_slowdown * other_cost) {
+            std::swap(first, second);
+          }
+        }
+
+        // Admit the probes of the half open hosts picked. One lost to
+        // another caller since isEjected() only lets one more probe through.
+        candidates[first].first->load->allowRequest();
+        clients->push_back(candidates[first].first->client);
+        if (loads) {
+          loads->push_back(candidates[first].first->load);
+        }
+        if (n_wanted > 1 && first != second) {
+          candidates[second].first->load->allowRequest();
+          clients->push_back(candidates[second].first->client);
+          if (loads) {
+            loads->push_back(candidates[second].first->load);
+          }
+        }
+      }
+
+      if (clients->empty()) {
+        // All good hosts are ejected, don't fail the request for it
+        for (const auto cs : ejected) {
+          clients->push_back(cs->client);
+          if (loads) {
+            loads->push_back(cs->load);
+          }
+          if (clients->size() >= n_wanted) {
+            break;
+          }
+        }
+      }
+
+      if (clients->empty()) {
+        LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+          << "We could not find any good host for shard " << shard;
+        return ReturnCode::BAD_HOST;
+      }
+
+      return ReturnCode::OK;
+    }
+
+    // Pick n_wanted of the candidates, which are in the order of preference
+    // with their tiers. A host of tier 0 is picked while it has fewer than
+    // max_outstanding requests outstanding, the one with the fewest first.
+    // Otherwise, the other hosts are picked at random in proportion to their
+    // headroom below max_outstanding. If none has any, the preferred host is
+    // picked, as spilling over would only add the cost.
+    void pickWithSpillover(
+        folly::small_vector<std::pair<ClientAndStatus*, uint32_t>, 8>*
+          candidates,
+        const uint32_t n_wanted,
+        const int32_t max_outstanding,
+        const uint64_t rotation,
+        ClientVector* clients,
+        HostLoadVector* loads) {
+      auto random = rotation;
+      while (clients->size() < n_wanted && !candidates->empty()) {
+        size_t picked = 0;
+        int64_t best_headroom = 0;
+        int64_t total_other_headroom = 0;
+        for (size_t i = 0; i < candidates->size(); ++i) {
+          const auto& candidate = (*candidates)[i];
+          const int64_t headroom = std::max<int64_t>(
+            max_outstanding - candidate.first->load->outstanding(), 0);
+          if (candidate.second == 0) {
+            if (headroom > best_headroom) {
+              picked = i;
+              best_headroom = headroom;
+            }
+          } else {
+            total_other_headroom += headroom;
+          }
+        }
+
+        if (best_headroom == 0 && total_other_headroom > 0) {
+          random = folly::hash::twang_mix64(random);
+          auto point = static_cast<int64_t>(random % total_other_headroom);
+          for (size_t i = 0; i < candidates->size(); ++i) {
+            const auto& candidate = (*candidates)[i];
+            if (candidate.second == 0) {
+              continue;
+            }
+            point -= std::max<int64_t>(
+              max_outstanding - candidate.first->load->outstanding(), 0);
+            if (point < 0) {
+              picked = i;
+              break;
+            }
+          }
+        }
+
+        const auto& choice = (*candidates)[picked];
+        detail::reportGroupSpread(choice.second != 0);
+        // Admit the probe of a half open host picked, as getClientsFor() does
+        choice.first->load->allowRequest();
+        clients->push_back(choice.first->client);
+        if (loads) {
+          loads->push_back(choice.first->load);
+        }
+        candidates->erase(candidates->begin() + picked);
+      }
+    }
+
+    void updateClusterLayout(const LayoutUpdate& update) {
+      if (update.layout == *local_cluster_layout_ ||
+          update.layout == nullptr) {
         return;
       }
 
+      // Only remove the clients of the removed hosts if this thread has the
+      // layout before update.layout. The thread holds it, so the address
+      // can't be reused by another layout.
+      const bool incremental =
+        update.previous == local_cluster_layout_->get();
+
       // store the new cluster layout
-      *local_cluster_layout_ = std::move(layout);
+      *local_cluster_layout_ = update.layout;
+
+      pruneSharedClients(update);
+
+      if (incremental) {
+        for (const auto& addr : update.removed_hosts) {
+          clients_->erase(addr);
+        }
+        return;
+      }
 
       // remove clients for non-existing servers
       const auto& hosts = (*local_cluster_layout_)->all_hosts;
@@ -457,28 +1543,188 @@ class ThriftRouter {
 
     void createOrFixClientsFor(const std::vector<const Host*>& hosts) {
       for (auto host : hosts) {
-        auto itor = clients_->find(host->addr);
-        if (itor != clients_->end() &&
-            is_client_good(itor->second.client.get())) {
-            // has the client and it is good
-          continue;
-        }
+        createOrFixClientFor(host);
+      }
+    }
+
+    void createOrFixClientFor(const Host* host) {
+      auto itor = clients_->find(host->addr);
+      if (itor != clients_->end() &&
+          is_client_good(itor->second.client.get())) {
+          // has the client and it is good
+        return;
+      }
 
+      if (FLAGS_thrift_router_shared_clients) {
+        // Another thread may have fixed it already
+        (*clients_)[host->addr] = getSharedClient(host);
+      } else {
         if (itor != clients_->end() &&
             itor->second.create_time +
             FLAGS_min_client_reconnect_interval_seconds > now()) {
           // has a bad client and it is too soon to reconnect
-          continue;
+          return;
         }
 
         // either don't have the client or we need to fix the bad client
         auto& cs = (*clients_)[host->addr];
-        cs.client = client_pool_->getClient(host->addr,
-                                            FLAGS_client_connect_timeout_millis,
-                                            &cs.is_good,
-                                            false /* aggressively */);
+        cs.client = client_pool_->getClient(
+          host->addr, FLAGS_client_connect_timeout_millis, &cs.is_good,
+          false /* aggressively */);
         cs.create_time = now();
+        if (cs.load == nullptr) {
+          cs.load = getHostLoad(host->addr);
+        }
+      }
+
+      const auto& cs = (*clients_)[host->addr];
+      if (has_local_addr_ && host->addr == local_addr_) {
+        // Held, so that no client of another host reuses its address
+        *local_client_ = cs.client;
+      }
+    }
+
+    // Return the client of host shared by all threads. It is created, or
+    // replaced if it is bad and it isn't too soon to reconnect, by the first
+    // thread asking for it.
+    ClientAndStatus getSharedClient(const Host* host) {
+      auto& shard = shared_clients_[
+        std::hash<folly::SocketAddress>()(host->addr) % kNumSharedShards];
+      auto usable = [] (const ClientAndStatus& cs) {
+        return is_client_good(cs.client.get()) ||
+          (cs.client != nullptr &&
+           cs.create_time + FLAGS_min_client_reconnect_interval_seconds >
+             now());
+      };
+
+      {
+        folly::SharedMutex::ReadHolder g(shard.mutex);
+        auto itor = shard.clients.find(host->addr);
+        if (itor != shard.clients.end() && usable(itor->second)) {
+          return itor->second;
+        }
+      }
+
+      folly::SharedMutex::WriteHolder g(shard.mutex);
+      auto& cs = shard.clients[host->addr];
+      if (usable(cs)) {
+        return cs;
+      }
+      cs.client = client_pool_->getClient(host->addr,
+                                          FLAGS_client_connect_timeout_millis,
+                                          &cs.is_good,
+                                          false /* aggressively */);
+      cs.create_time = now();
+      if (cs.load == nullptr) {
+        cs.load = getHostLoad(host->addr);
+      }
+      return cs;
+    }
+
+    // Remove the shared clients of the hosts not in update.layout, once per
+    // layout. A thread still routing with an older layout may add some back,
+    // until the next layout.
+    void pruneSharedClients(const LayoutUpdate& update) {
+      auto pruned = shared_clients_layout_.load();
+      if (pruned == update.layout.get() ||
+          !shared_clients_layout_.compare_exchange_strong(
+            pruned, update.layout.get())) {
+        return;
+      }
+
+      const auto& hosts = update.layout->all_hosts;
+      Host host;
+      for (auto& shard : shared_clients_) {
+        folly::SharedMutex::WriteHolder g(shard.mutex);
+        for (auto itor = shard.clients.begin(); itor != shard.clients.end();) {
+          host.addr = itor->first;
+          if (hosts.find(host) != hosts.end()) {
+            ++itor;
+          } else {
+            itor = shard.clients.erase(itor);
+          }
+        }
+      }
+    }
+
+    // Return the client of host if it is good, or try to fix it otherwise.
+    // Return nullptr if the client is still bad.
+    ClientAndStatus* getGoodClient(const Host* host) {
+      auto itor = clients_->find(host->addr);
+      if (itor == clients_->end() ||
+          !is_client_good(itor->second.client.get())) {
+        createOrFixClientFor(host);
+        itor = clients_->find(host->addr);
+        if (itor == clients_->end() ||
+            !is_client_good(itor->second.client.get())) {
+          return nullptr;
+        }
+      }
+
+      return &itor->second;
+    }
+
+    // The HostLoad shared by all threads for addr
+    std::shared_ptr<HostLoad> getHostLoad(const folly::SocketAddress& addr) {
+      std::lock_guard<std::mutex> g(host_loads_mutex_);
+      auto& load = host_loads_[addr];
+      if (load == nullptr) {
+        load = std::make_shared<HostLoad>(addr.describe());
       }
+      return load;
+    }
+
+    // The HostLoad of the host of client, which this thread got from the
+    // slow path
+    std::shared_ptr<HostLoad> findHostLoad(const ClientType* client) {
+      for (const auto& addr_client : *clients_) {
+        if (addr_client.second.client.get() == client) {
+          return addr_client.second.load;
+        }
+      }
+      return nullptr;
+    }
+
+    // The key mapper and the shard number of segment_id, or {nullptr, 0} if
+    // the segment isn't in the local layout
+    std::pair<const KeyToShardMapper*, uint32_t> getKeyToShardMapper(
+        const uint32_t segment_id) {
+      const std::string* segment_name = nullptr;
+      auto segment_info = getSegment(segment_id, &segment_name);
+      if (segment_info == nullptr) {
+        return std::make_pair(nullptr, 0);
+      }
+      return std::make_pair(segment_info->key_to_shard.get(),
+                            segment_info->shard_to_hosts.size());
+    }
+
+    // Return the segment of segment_id in the local layout, and set name to
+    // its name, or return nullptr if it is not in the layout
+    const SegmentInfo* getSegment(const uint32_t segment_id,
+                                  const std::string** name) {
+      auto& cache = *local_segments_;
+      const auto& layout = *local_cluster_layout_;
+      if (cache.layout != layout || segment_id >= cache.segments.size()) {
+        // The layout has changed, or a new segment was registered
+        cache.layout = layout;
+        cache.segments.clear();
+        std::lock_guard<std::mutex> g(segment_ids_mutex_);
+        for (const auto& segment_name : segment_names_) {
+          auto itor = layout->segments.find(segment_name);
+          if (itor == layout->segments.end()) {
+            cache.segments.emplace_back(nullptr, nullptr);
+          } else {
+            cache.segments.emplace_back(&itor->second, &itor->first);
+          }
+        }
+      }
+
+      if (segment_id >= cache.segments.size()) {
+        return nullptr;
+      }
+
+      *name = cache.segments[segment_id].second;
+      return cache.segments[segment_id].first;
     }
 
     static uint64_t now() {
@@ -486,34 +1732,118 @@ class ThriftRouter {
         std::chrono::system_clock::now().time_since_epoch()).count();
     }
 
-    void filterBadHosts(std::vector<const Host*>* hosts) {
+    // Remove the hosts whose clients are bad. If skip_ejected, also remove
+    // the hosts ejected by their circuit breakers, unless all hosts left are.
+    // Return true in that case. No probe is admitted, see allowRequest().
+    bool filterBadHosts(std::vector<const Host*>* hosts,
+                        const bool skip_ejected) {
       auto itor = std::remove_if(
         hosts->begin(), hosts->end(),
         [this] (const Host* host) {
           return !is_client_good((*clients_)[host->addr].client.get());
         });
       hosts->erase(itor, hosts->end());
+
+      if (!skip_ejected) {
+        return false;
+      }
+      std::vector<const Host*> allowed;
+      for (const auto host : *hosts) {
+        const auto& load = (*clients_)[host->addr].load;
+        if (load == nullptr || !load->isEjected()) {
+          allowed.push_back(host);
+        }
+      }
+      if (allowed.empty()) {
+        return !hosts->empty();
+      }
+      hosts->swap(allowed);
+      return false;
     }
 
     struct ClientAndStatus {
       std::shared_ptr<ClientType> client;
       const std::atomic<bool>* is_good;
       uint64_t create_time;
+      std::shared_ptr<HostLoad> load;
     };
 
     std::shared_ptr<ThriftClientPool<ClientType, USE_BINARY_PROTOCOL>> client_pool_;
     folly::ThreadLocal<std::shared_ptr<const ClusterLayout>>
       local_cluster_layout_;
+    // The clients this thread has used, see FLAGS_thrift_router_shared_clients
     folly::ThreadLocal<std::unordered_map<folly::SocketAddress,
                                           ClientAndStatus>> clients_;
+
+    // The clients shared by all threads, sharded by address
+    static constexpr size_t kNumSharedShards = 64;
+    struct SharedClients {
+      folly::SharedMutex mutex;
+      std::unordered_map<folly::SocketAddress, ClientAndStatus> clients;
+    };
+    std::array<SharedClients, kNumSharedShards> shared_clients_;
+    // The last layout whose removed hosts were pruned from shared_clients_,
+    // only compared with
+    std::atomic<const ClusterLayout*> shared_clients_layout_{nullptr};
+
+    // The address of this process, and the last client of this thread to it
+    folly::SocketAddress local_addr_;
+    bool has_local_addr_ = false;
+    folly::ThreadLocal<std::shared_ptr<ClientType>> local_client_;
+
+    std::mutex host_loads_mutex_;
+    std::unordered_map<folly::SocketAddress, std::shared_ptr<HostLoad>>
+      host_loads_;
+
+    // Registered segment names, SegmentHandle::id is the index
+    std::mutex segment_ids_mutex_;
+    std::vector<std::string> segment_names_;
+    std::unordered_map<std::string, uint32_t> segment_ids_;
+
+    // The segments of local_cluster_layout_ by SegmentHandle::id
+    struct LocalSegments {
+      // Held, so that a new layout can't be allocated at its address and be
+      // taken for it
+      std::shared_ptr<const ClusterLayout> layout;
+      std::vector<std::pair<const SegmentInfo*, const std::string*>> segments;
+    };
+    folly::ThreadLocal<LocalSegments> local_segments_;
   };
 
   const std::string config_path_;
+  // Empty unless FLAGS_thrift_router_config_delta_suffix is set
+  const std::string config_delta_path_;
   std::function<std::unique_ptr<const ClusterLayout>(
     std::string, const std::string&)> parser_;
 
   std::shared_ptr<const ClusterLayout> cluster_layout_;
+  std::shared_ptr<const LayoutUpdate> layout_update_;
+  // Serializes the callbacks of the config and its deltas, and guards the
+  // members below
+  std::mutex config_mutex_;
+  std::string last_config_content_;
+  std::string last_config_delta_content_;
+  // The layout of the latest full config and its hash, which deltas are
+  // applied to. Only kept if config_delta_path_ is set.
+  std::shared_ptr<const ClusterLayout> full_layout_;
+  std::string full_config_hash_;
   ThreadLocalClientMap local_client_map_;
+
+  // Connection pre-warming, see prewarm()
+  std::thread prewarm_thread_;
+  std::mutex prewarm_mutex_;
+  std::condition_variable prewarm_cv_;
+  std::shared_ptr<const ClusterLayout> prewarm_layout_;
+  bool stop_prewarm_;
+  std::atomic<uint32_t> prewarm_hosts_;
+  std::atomic<uint32_t> prewarmed_hosts_;
+  // Only accessed by prewarm_thread_
+  std::unordered_map<folly::SocketAddress,
+                     std::vector<std::shared_ptr<ClientType>>> warm_clients_;
+
+  // By SegmentHandle::id
+  std::mutex hedging_policies_mutex_;
+  std::vector<std::unique_ptr<HedgingPolicy>> hedging_policies_;
 };
 
 /*
@@ -546,8 +1876,31 @@ class ThriftRouter {
   "  \"127.0.0.1:8091:\": [\"00001:S\"]"
   "   }"
   "}";
+ *
+ * It also reads the flat binary layout written by the Java
+ * FlatShardMapCodec, which starts with "RSM1" and interns the host strings.
  */
 std::unique_ptr<const detail::ClusterLayout> parseConfig(
   const std::string& content, const std::string& local_group);
 
+/*
+ * Apply a shard map delta written by the Java DeltaShardMapPublisher to base,
+ * the layout of the full JSON config whose detail::hashConfig() is base_hash.
+ * A delta holds the segments changed since that config, in the format of
+ * parseConfig(), and null for the removed ones:
+ *
+ *   {"base_hash": "8c9a2f10d3b4e5a6",
+ *    "segments": {"user_pins": {"num_leaf_segments": 3, ...},
+ *                 "interest_pins": null}}
+ *
+ * Only the changed segments are parsed, the others are copied from base.
+ * Deltas are cumulative, so only the latest one needs to be applied.
+ * @return nullptr if delta is invalid, or based on another config
+ */
+std::unique_ptr<const detail::ClusterLayout> applyConfigDelta(
+  const detail::ClusterLayout& base,
+  const std::string& base_hash,
+  const std::string& delta,
+  const std::string& local_group);
+
 }  // namespace common
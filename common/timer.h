@@ -15,30 +15,34 @@
 
 #pragma once
 
-#include <chrono>
+#include <cstdint>
 #include <string>
 
 #include "common/stats/stats.h"
+#include "common/tsc_clock.h"
 
 namespace common {
 
+// Timer reads the clock with TscClock, which is cheap enough for hot paths.
 class Timer {
  public:
   // start the clock
   explicit Timer(const uint32_t metric)
     : metric_int_(metric)
     , metric_str_("")
-    , start_(std::chrono::steady_clock::now()) {}
+    , start_(TscClock::Now()) {}
 
   explicit Timer(const std::string& metric)
     : metric_int_(0)
     , metric_str_(metric)
-    , start_(std::chrono::steady_clock::now()) {}
+    , start_(TscClock::Now()) {}
 
   int64_t getElapsedTimeMs() {
-    auto end = std::chrono::steady_clock::now();
-    auto diff = end - start_;
-    return std::chrono::duration_cast<std::chrono::milliseconds>(diff).count();
+    return TscClock::ElapsedNs(start_) / 1000000;
+  }
+
+  int64_t getElapsedTimeUs() {
+    return TscClock::ElapsedNs(start_) / 1000;
   }
 
   // stop the clock and report the delta through metric_[str|int]_
@@ -55,7 +59,8 @@ class Timer {
  private:
   const uint32_t metric_int_;
   const std::string metric_str_;
-  const std::chrono::time_point<std::chrono::steady_clock> start_;
+  // TscClock ticks
+  const uint64_t start_;
 };
 
 }  // namespace common
@@ -0,0 +1,385 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/tracing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common/stats/stats.h"
+#include "folly/Conv.h"
+#include "folly/Random.h"
+#include "folly/String.h"
+#include "folly/ThreadName.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "thrift/lib/cpp/transport/THeader.h"
+#include "thrift/lib/cpp2/async/RequestChannel.h"
+#include "thrift/lib/cpp2/server/Cpp2ConnContext.h"
+
+DEFINE_int32(trace_sample_rate, 0,
+             "Trace one in this many requests, 0 to trace none");
+
+DEFINE_int32(trace_export_interval_ms, 1000,
+             "The time between the exports of the spans recorded");
+
+DEFINE_int32(trace_max_recent_traces, 100,
+             "The number of traces kept for the traces dump");
+
+namespace {
+
+const char kTraceSpansDropped[] = "trace_spans_dropped";
+const char kTraceSpanUsPrefix[] = "trace_span_us span=";
+
+// The spans a thread records between two exports, at most
+const uint64_t kRingSize = 4096;
+
+struct Slot {
+  std::atomic<uint64_t> trace_id;
+  std::atomic<const char*> name;
+  std::atomic<uint64_t> start_tsc;
+  std::atomic<uint64_t> end_tsc;
+};
+
+// Written by its thread and read by the exporter. The exporter drops the
+// slots that may have been overwritten while it was reading them.
+struct SpanRing {
+  SpanRing() : head(0), tail(0), alive(true) {}
+
+  Slot slots[kRingSize];
+  // the number of spans recorded
+  std::atomic<uint64_t> head;
+  // the number of spans exported, only used by the exporter
+  uint64_t tail;
+  // false once its thread exited
+  std::atomic<bool> alive;
+};
+
+struct Span {
+  const char* name;
+  uint64_t start_tsc;
+  uint64_t duration_us;
+};
+
+class Exporter {
+ public:
+  static Exporter* get() {
+    static Exporter exporter;
+    return &exporter;
+  }
+
+  void Register(std::shared_ptr<SpanRing> ring) {
+    std::lock_guard<std::mutex> g(rings_lock_);
+    rings_.push_back(std::move(ring));
+  }
+
+  void ExportNow();
+
+  std::string Dump();
+
+ private:
+  Exporter();
+  ~Exporter();
+
+  // Measure the TSC frequency against the steady clock
+  void Calibrate();
+
+  void Drain(SpanRing* ring, std::vector<std::pair<uint64_t, Span>>* spans);
+
+  std::mutex rings_lock_;
+  std::vector<std::shared_ptr<SpanRing>> rings_;
+
+  // serializes the exports and guards the recent traces
+  std::mutex export_lock_;
+  double tsc_per_us_;
+  // trace ids in the order they were first exported
+  std::deque<uint64_t> recent_order_;
+  std::unordered_map<uint64_t, std::vector<Span>> recent_traces_;
+
+  std::mutex stop_lock_;
+  std::condition_variable stop_cv_;
+  bool stop_;
+  std::thread thread_;
+};
+
+Exporter::Exporter()
+    : rings_lock_()
+    , rings_()
+    , export_lock_()
+    , tsc_per_us_(0)
+    , recent_order_()
+    , recent_traces_()
+    , stop_lock_()
+    , stop_cv_()
+    , stop_(false) {
+  thread_ = std::thread([this] {
+    if (!folly::setThreadName("TraceExporter")) {
+      LOG(ERROR) << "Failed to set thread name for trace exporter thread";
+    }
+
+    Calibrate();
+    std::unique_lock<std::mutex> lock(stop_lock_);
+    while (!stop_) {
+      stop_cv_.wait_for(
+        lock,
+        std::chrono::milliseconds(std::max(FLAGS_trace_export_interval_ms, 1)),
+        [this] { return stop_; });
+      lock.unlock();
+      ExportNow();
+      lock.lock();
+    }
+  });
+}
+
+Exporter::~Exporter() {
+  {
+    std::lock_guard<std::mutex> g(stop_lock_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  thread_.join();
+}
+
+void Exporter::Calibrate() {
+  const auto start = std::chrono::steady_clock::now();
+  const auto start_tsc = common::Trace::readTsc();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  const auto end_tsc = common::Trace::readTsc();
+  const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count();
+
+  std::lock_guard<std::mutex> g(export_lock_);
+  tsc_per_us_ = std::max(static_cast<double>(end_tsc - start_tsc) / us, 1e-3);
+}
+
+void Exporter::Drain(SpanRing* ring,
+                     std::vector<std::pair<uint64_t, Span>>* spans) {
+  const auto head = ring->head.load(std::memory_order_acquire);
+  uint64_t dropped = 0;
+  if (head - ring->tail > kRingSize) {
+    dropped += head - ring->tail - kRingSize;
+    ring->tail = head - kRingSize;
+  }
+
+  for (; ring->tail < head; ++ring->tail) {
+    const auto& slot = ring->slots[ring->tail % kRingSize];
+    const auto trace_id = slot.trace_id.load(std::memory_order_relaxed);
+    const auto name = slot.name.load(std::memory_order_relaxed);
+    const auto start_tsc = slot.start_tsc.load(std::memory_order_relaxed);
+    const auto end_tsc = slot.end_tsc.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // the thread may have wrapped around to this slot meanwhile
+    if (ring->head.load(std::memory_order_relaxed) >=
+        ring->tail + kRingSize) {
+      ++dropped;
+      continue;
+    }
+
+    const auto duration_us = end_tsc > start_tsc ?
+      static_cast<uint64_t>((end_tsc - start_tsc) / tsc_per_us_) : 0;
+    spans->emplace_back(trace_id, Span{name, start_tsc, duration_us});
+  }
+
+  if (dropped > 0) {
+    common::Stats::get()->Incr(kTraceSpansDropped, dropped);
+  }
+}
+
+void Exporter::ExportNow() {
+  std::vector<std::shared_ptr<SpanRing>> rings;
+  {
+    std::lock_guard<std::mutex> g(rings_lock_);
+    rings = rings_;
+  }
+
+  std::lock_guard<std::mutex> g(export_lock_);
+  if (tsc_per_us_ == 0) {
+    // not calibrated yet, the spans wait in the rings
+    return;
+  }
+
+  std::vector<std::pair<uint64_t, Span>> spans;
+  for (const auto& ring : rings) {
+    // read alive first, so that a ring found dead is drained fully
+    const bool alive = ring->alive.load(std::memory_order_acquire);
+    Drain(ring.get(), &spans);
+    if (!alive) {
+      std::lock_guard<std::mutex> rings_guard(rings_lock_);
+      rings_.erase(std::remove(rings_.begin(), rings_.end(), ring),
+                   rings_.end());
+    }
+  }
+
+  const auto max_traces =
+    static_cast<size_t>(std::max(FLAGS_trace_max_recent_traces, 0));
+  for (const auto& span : spans) {
+    common::Stats::get()->AddMetric(
+      kTraceSpanUsPrefix + std::string(span.second.name),
+      span.second.duration_us);
+
+    if (max_traces == 0) {
+      continue;
+    }
+    auto itor = recent_traces_.find(span.first);
+    if (itor == recent_traces_.end()) {
+      recent_order_.push_back(span.first);
+      itor = recent_traces_.emplace(span.first, std::vector<Span>()).first;
+    }
+    itor->second.push_back(span.second);
+  }
+
+  while (recent_order_.size() > max_traces) {
+    recent_traces_.erase(recent_order_.front());
+    recent_order_.pop_front();
+  }
+}
+
+std::string Exporter::Dump() {
+  std::lock_guard<std::mutex> g(export_lock_);
+  std::string text;
+  // the most recent first
+  for (auto itor = recent_order_.rbegin(); itor != recent_order_.rend();
+       ++itor) {
+    auto spans = recent_traces_[*itor];
+    std::sort(spans.begin(), spans.end(), [] (const Span& a, const Span& b) {
+        return a.start_tsc < b.start_tsc;
+      });
+
+    text += folly::stringPrintf("trace %" PRIu64 "\n", *itor);
+    for (const auto& span : spans) {
+      text += folly::stringPrintf(
+        "  %s start_us=%" PRIu64 " duration_us=%" PRIu64 "\n", span.name,
+        static_cast<uint64_t>(
+          (span.start_tsc - spans[0].start_tsc) / tsc_per_us_),
+        span.duration_us);
+    }
+  }
+
+  return text;
+}
+
+// The ring of the calling thread, registered to the exporter on first use
+struct ThreadRing {
+  ThreadRing() : ring(std::make_shared<SpanRing>()) {
+    Exporter::get()->Register(ring);
+  }
+
+  ~ThreadRing() {
+    ring->alive.store(false, std::memory_order_release);
+  }
+
+  std::shared_ptr<SpanRing> ring;
+};
+
+SpanRing* GetThreadRing() {
+  thread_local ThreadRing thread_ring;
+  return thread_ring.ring.get();
+}
+
+bool ParseTraceId(
+    const apache::thrift::transport::THeader::StringToStringMap& headers,
+    uint64_t* trace_id) {
+  auto itor = headers.find(common::Trace::kTraceHeader);
+  if (itor == headers.end()) {
+    return false;
+  }
+
+  auto ret = folly::tryTo<uint64_t>(itor->second);
+  if (!ret.hasValue() || ret.value() == 0) {
+    return false;
+  }
+  *trace_id = ret.value();
+  return true;
+}
+
+}  // namespace
+
+namespace common {
+
+const char* const Trace::kTraceHeader = "rsp_trace_id";
+
+thread_local uint64_t Trace::current_ = 0;
+
+uint64_t Trace::fromRequest(const apache::thrift::Cpp2RequestContext* ctx) {
+  uint64_t trace_id;
+  if (ctx != nullptr && ctx->getHeader() != nullptr &&
+      ParseTraceId(ctx->getHeader()->getHeaders(), &trace_id)) {
+    return trace_id;
+  }
+
+  return maybeStart();
+}
+
+uint64_t Trace::maybeStart() {
+  const auto rate = FLAGS_trace_sample_rate;
+  if (rate <= 0) {
+    return 0;
+  }
+
+  // start at a random point, so that the threads don't sample in lockstep
+  thread_local uint32_t n = folly::Random::rand32(rate);
+  if (++n % rate != 0) {
+    return 0;
+  }
+
+  // never 0
+  return folly::Random::rand64() | 1;
+}
+
+void Trace::applyTo(const uint64_t trace_id,
+                    apache::thrift::RpcOptions* options) {
+  if (trace_id == 0) {
+    return;
+  }
+
+  options->setWriteHeader(kTraceHeader, folly::to<std::string>(trace_id));
+}
+
+void Trace::record(const uint64_t trace_id, const char* name,
+                   const uint64_t start_tsc, const uint64_t end_tsc) {
+  auto ring = GetThreadRing();
+  const auto head = ring->head.load(std::memory_order_relaxed);
+  // orders the head published by the previous record before the writes
+  // below, so that the exporter notices when they overwrite a slot it reads
+  std::atomic_thread_fence(std::memory_order_release);
+  auto& slot = ring->slots[head % kRingSize];
+  slot.trace_id.store(trace_id, std::memory_order_relaxed);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.start_tsc.store(start_tsc, std::memory_order_relaxed);
+  slot.end_tsc.store(end_tsc, std::memory_order_relaxed);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string Trace::DumpRecentTracesAsText() {
+  return Exporter::get()->Dump();
+}
+
+void Trace::exportNow() {
+  Exporter::get()->ExportNow();
+}
+
+}  // namespace common
@@ -0,0 +1,160 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace apache { namespace thrift {
+
+class Cpp2RequestContext;
+class RpcOptions;
+
+}}  // namespace apache::thrift
+
+namespace common {
+
+/*
+ * Sampled request tracing.
+ *
+ * One request in --trace_sample_rate starts a trace, whose id travels to the
+ * next hops in the kTraceHeader Thrift header. While a thread handles a
+ * traced request, with a ScopedTrace, the TraceSpans it goes through are
+ * recorded into a ring buffer of the thread, with TSC timestamps. A span
+ * costs two rdtsc and a few relaxed stores when traced, and one thread local
+ * load otherwise.
+ *
+ * An exporter thread drains the rings every --trace_export_interval_ms. It
+ * adds the duration of each span to the "trace_span_us span=<name>" metric,
+ * and keeps the last --trace_max_recent_traces traces for
+ * DumpRecentTracesAsText(). The spans of a ring not drained in time are
+ * dropped and counted in trace_spans_dropped.
+ */
+class Trace {
+ public:
+  // The header carrying the trace id
+  static const char* const kTraceHeader;
+
+  // The trace of the request handled by the calling thread, 0 for none
+  static uint64_t current() {
+    return current_;
+  }
+
+  // The trace of the request being handled, from its kTraceHeader, or a new
+  // trace for one in --trace_sample_rate requests without the header. 0 for
+  // no trace.
+  static uint64_t fromRequest(const apache::thrift::Cpp2RequestContext* ctx);
+
+  // A new trace for one in --trace_sample_rate calls, 0 otherwise
+  static uint64_t maybeStart();
+
+  // Forward trace_id to the next hop in kTraceHeader. Does nothing for 0.
+  static void applyTo(const uint64_t trace_id,
+                      apache::thrift::RpcOptions* options);
+
+  // Read the timestamp counter of the CPU
+  static uint64_t readTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // Record a span of trace_id named name, a string literal, in the ring of
+  // the calling thread
+  static void record(const uint64_t trace_id, const char* name,
+                     const uint64_t start_tsc, const uint64_t end_tsc);
+
+  // Dump the recent traces exported as a text string, one span per line
+  static std::string DumpRecentTracesAsText();
+
+  // Export the spans recorded so far now, e.g. for tests
+  static void exportNow();
+
+ private:
+  friend class ScopedTrace;
+
+  static thread_local uint64_t current_;
+};
+
+// Make trace_id the trace of the calling thread in this scope, e.g. while
+// handling the request
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const uint64_t trace_id)
+      : previous_(Trace::current_) {
+    Trace::current_ = trace_id;
+  }
+
+  ~ScopedTrace() {
+    Trace::current_ = previous_;
+  }
+
+  // no copy nor move
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+ private:
+  const uint64_t previous_;
+};
+
+// Record this scope as a span named name, a string literal, of the trace of
+// the calling thread, if any. The span may end on another thread, e.g. when
+// moved into a future callback.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name)
+      : TraceSpan(name, Trace::current()) {}
+
+  TraceSpan(const char* name, const uint64_t trace_id)
+      : name_(name)
+      , trace_id_(trace_id)
+      , start_tsc_(trace_id == 0 ? 0 : Trace::readTsc()) {}
+
+  TraceSpan(TraceSpan&& other)
+      : name_(other.name_)
+      , trace_id_(other.trace_id_)
+      , start_tsc_(other.start_tsc_) {
+    other.trace_id_ = 0;
+  }
+
+  ~TraceSpan() {
+    if (trace_id_ != 0) {
+      Trace::record(trace_id_, name_, start_tsc_, Trace::readTsc());
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* const name_;
+  uint64_t trace_id_;
+  const uint64_t start_tsc_;
+};
+
+}  // namespace common
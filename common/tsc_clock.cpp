@@ -0,0 +1,82 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/tsc_clock.h"
+
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "glog/logging.h"
+
+namespace {
+
+#if defined(__x86_64__)
+const std::chrono::milliseconds kCalibrationTime(20);
+
+// If the TSC ticks at a constant rate, and doesn't stop in deep C-states
+bool HasInvariantTsc() {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 5, "flags") == 0) {
+      return line.find(" constant_tsc") != std::string::npos &&
+        line.find(" nonstop_tsc") != std::string::npos;
+    }
+  }
+
+  return false;
+}
+#endif
+
+// Calibrate at startup rather than on the first hot path reading
+const bool kUsesTsc = common::TscClock::UsesTsc();
+
+}  // namespace
+
+namespace common {
+
+TscClock::Calibration TscClock::Calibrate() {
+  Calibration calibration{false, 1.0};
+#if defined(__x86_64__)
+  if (!HasInvariantTsc()) {
+    LOG(INFO) << "No invariant TSC, TscClock uses steady_clock";
+    return calibration;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto start_ticks = __rdtsc();
+  std::this_thread::sleep_for(kCalibrationTime);
+  const auto end_ticks = __rdtsc();
+  const auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  if (end_ticks <= start_ticks || elapsed_ns <= 0) {
+    LOG(ERROR) << "Failed to calibrate TSC, TscClock uses steady_clock";
+    return calibration;
+  }
+
+  calibration.use_tsc = true;
+  calibration.ns_per_tick =
+    static_cast<double>(elapsed_ns) / (end_ticks - start_ticks);
+  LOG(INFO) << "TscClock calibrated to " << 1 / calibration.ns_per_tick
+            << " ticks per ns";
+#endif
+  return calibration;
+}
+
+}  // namespace common
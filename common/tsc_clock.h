@@ -0,0 +1,87 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include <chrono>
+#include <cstdint>
+
+namespace common {
+
+/*
+ * TscClock reads the time stamp counter of the CPU, which is much cheaper
+ * than a clock_gettime() call, for measuring short durations in ns. The
+ * counter is calibrated against std::chrono::steady_clock once per process.
+ *
+ * Without an invariant TSC (constant_tsc and nonstop_tsc in /proc/cpuinfo),
+ * or off x86_64, ticks are steady_clock ns instead.
+ *
+ * // Example usage
+ * const auto start = TscClock::Now();
+ * ...
+ * const auto elapsed_us = TscClock::ElapsedNs(start) / 1000;
+ */
+class TscClock {
+ public:
+  // The current ticks, only meaningful relative to other readings
+  static uint64_t Now() {
+#if defined(__x86_64__)
+    if (calibration().use_tsc) {
+      return __rdtsc();
+    }
+#endif
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Convert ticks to ns
+  static uint64_t ToNs(const uint64_t ticks) {
+    return static_cast<uint64_t>(ticks * calibration().ns_per_tick);
+  }
+
+  // The ns since start, a reading of Now(). It is 0 if start is later, which
+  // is possible for readings on different CPUs.
+  static uint64_t ElapsedNs(const uint64_t start) {
+    const auto now = Now();
+    return now > start ? ToNs(now - start) : 0;
+  }
+
+  // Whether ticks come from the TSC
+  static bool UsesTsc() {
+    return calibration().use_tsc;
+  }
+
+ private:
+  struct Calibration {
+    bool use_tsc;
+    double ns_per_tick;
+  };
+
+  static Calibration Calibrate();
+
+  static const Calibration& calibration() {
+    static const Calibration calibration = Calibrate();
+    return calibration;
+  }
+};
+
+}  // namespace common
@@ -0,0 +1,236 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "common/work_stealing_executor.h"
+
+#include <glog/logging.h>
+
+#include <utility>
+
+#include "common/identical_name_thread_factory.h"
+#include "common/stats/stats.h"
+#if __GNUC__ >= 8
+#include "folly/executors/task_queue/BlockingQueue.h"
+#else
+#include "wangle/concurrent/BlockingQueue.h"
+#endif
+
+#if __GNUC__ >= 8
+using folly::QueueFullException;
+#else
+using wangle::QueueFullException;
+#endif
+
+namespace {
+
+// The executor and the index of the worker running on this thread
+thread_local const common::WorkStealingExecutor* tl_executor = nullptr;
+thread_local uint32_t tl_worker_idx = 0;
+
+}  // namespace
+
+namespace common {
+
+WorkStealingExecutor::WorkStealingExecutor(const uint16_t n_threads,
+                                           const size_t max_pending_tasks,
+                                           const bool block_when_full,
+                                           const std::string& name,
+                                           std::shared_ptr<ThreadPlacement>
+                                             placement)
+    : workers_()
+    , threads_()
+    , next_worker_(0)
+    , max_pending_tasks_(max_pending_tasks)
+    , block_when_full_(block_when_full)
+    , n_pending_(0)
+    , mutex_()
+    , idle_cv_()
+    , not_full_cv_()
+    , n_idle_(0)
+    , n_blocked_(0)
+    , stop_(false)
+    , queue_wait_metrics_{name + "_queue_wait_us priority=low",
+                          name + "_queue_wait_us priority=high"}
+    , task_run_metric_(name + "_task_run_us")
+    , steals_stat_(name + "_steals") {
+  CHECK_GT(n_threads, 0);
+  for (uint16_t i = 0; i < n_threads; ++i) {
+    workers_.emplace_back(new Worker());
+  }
+
+  IdenticalNameThreadFactory factory(name, std::move(placement));
+  for (uint16_t i = 0; i < n_threads; ++i) {
+    threads_.push_back(factory.newThread([this, i] { run(i); }));
+  }
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    stop_ = true;
+  }
+  idle_cv_.notify_all();
+
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkStealingExecutor::add(folly::Func func) {
+  addWithPriority(std::move(func), folly::Executor::MID_PRI);
+}
+
+void WorkStealingExecutor::addWithPriority(folly::Func func,
+                                           const int8_t priority) {
+  const bool from_worker = (tl_executor == this);
+  reserve(from_worker);
+
+  const uint32_t idx = from_worker ? tl_worker_idx :
+    next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+  Task task{std::move(func), std::chrono::steady_clock::now(),
+            priority >= folly::Executor::MID_PRI ? HIGH : LOW};
+  {
+    auto& worker = *workers_[idx];
+    std::lock_guard<std::mutex> g(worker.mutex);
+    worker.tasks[task.priority].push_back(std::move(task));
+  }
+
+  // Pairs with the check of n_pending_ after incrementing n_idle_ in run()
+  if (n_idle_.load() > 0) {
+    std::lock_guard<std::mutex> g(mutex_);
+    idle_cv_.notify_one();
+  }
+}
+
+void WorkStealingExecutor::reserve(const bool from_worker) {
+  if (max_pending_tasks_ == 0 || from_worker) {
+    n_pending_.fetch_add(1);
+    return;
+  }
+
+  while (n_pending_.fetch_add(1) >= max_pending_tasks_) {
+    n_pending_.fetch_sub(1);
+    if (!block_when_full_) {
+      throw QueueFullException("WorkStealingExecutor queue is full");
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++n_blocked_;
+    not_full_cv_.wait(lock, [this] {
+      return n_pending_.load() < max_pending_tasks_;
+    });
+    --n_blocked_;
+  }
+}
+
+void WorkStealingExecutor::run(const uint32_t idx) {
+  tl_executor = this;
+  tl_worker_idx = idx;
+
+  uint32_t n_run = 0;
+  while (true) {
+    Task task;
+    const bool prefer_low = (++n_run % kLowPriorityInterval == 0);
+    if (popLocal(idx, prefer_low, &task) || steal(idx, &task)) {
+      runTask(&task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stop_ && n_pending_.load() == 0) {
+      return;
+    }
+
+    ++n_idle_;
+    // A task reserved before n_idle_ was incremented is seen here, and the
+    // ones after notify us
+    if (n_pending_.load() == 0 && !stop_) {
+      idle_cv_.wait(lock);
+    }
+    --n_idle_;
+  }
+}
+
+bool WorkStealingExecutor::popLocal(const uint32_t idx, const bool prefer_low,
+                                    Task* task) {
+  auto& worker = *workers_[idx];
+  std::lock_guard<std::mutex> g(worker.mutex);
+  const Priority order[] = {
+    prefer_low ? LOW : HIGH,
+    prefer_low ? HIGH : LOW,
+  };
+  for (const auto priority : order) {
+    auto& tasks = worker.tasks[priority];
+    if (!tasks.empty()) {
+      *task = std::move(tasks.front());
+      tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool WorkStealingExecutor::steal(const uint32_t idx, Task* task) {
+  const uint32_t n_workers = workers_.size();
+  for (int priority = HIGH; priority >= LOW; --priority) {
+    for (uint32_t i = 1; i < n_workers; ++i) {
+      auto& victim = *workers_[(idx + i) % n_workers];
+      std::lock_guard<std::mutex> g(victim.mutex);
+      auto& tasks = victim.tasks[priority];
+      if (!tasks.empty()) {
+        *task = std::move(tasks.back());
+        tasks.pop_back();
+        Stats::get()->Incr(steals_stat_);
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void WorkStealingExecutor::runTask(Task* task) {
+  n_pending_.fetch_sub(1);
+  if (n_blocked_.load() > 0) {
+    std::lock_guard<std::mutex> g(mutex_);
+    not_full_cv_.notify_one();
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  Stats::get()->AddMetric(
+    queue_wait_metrics_[task->priority],
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      start - task->enqueue_time).count());
+
+  try {
+    task->func();
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "WorkStealingExecutor task threw: " << ex.what();
+  } catch (...) {
+    LOG(ERROR) << "WorkStealingExecutor task threw a non std::exception";
+  }
+  task->func = nullptr;
+
+  Stats::get()->AddMetric(
+    task_run_metric_,
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count());
+}
+
+}  // namespace common
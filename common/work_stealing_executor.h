@@ -0,0 +1,123 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/thread_placement.h"
+#include "folly/Executor.h"
+
+namespace common {
+
+/*
+ * WorkStealingExecutor is a CPU executor with a deque of tasks per worker
+ * thread and two priorities.
+ *
+ * Tasks added by a worker go to its own deque, the others are spread round
+ * robin over the workers. A worker runs the oldest task of its deque, high
+ * priority first, and steals the newest task of another worker's deque once
+ * its own is empty. Every kLowPriorityInterval tasks, a worker prefers a low
+ * priority task, so that background work isn't starved.
+ *
+ * add() and priorities >= folly::Executor::MID_PRI are high priority, lower
+ * ones are low priority. At most max_pending_tasks tasks may be pending; add()
+ * then blocks or throws QueueFullException depending on block_when_full,
+ * except for workers adding tasks, which would deadlock.
+ *
+ * It reports:
+ *   <name>_queue_wait_us priority=high|low  how long tasks wait to run
+ *   <name>_task_run_us                      how long tasks run
+ *   <name>_steals                           the number of stolen tasks
+ */
+class WorkStealingExecutor : public folly::Executor {
+ public:
+  WorkStealingExecutor(uint16_t n_threads,
+                       size_t max_pending_tasks,
+                       bool block_when_full,
+                       const std::string& name,
+                       std::shared_ptr<ThreadPlacement> placement = nullptr);
+
+  // Run the pending tasks and stop the workers
+  ~WorkStealingExecutor() override;
+
+  void add(folly::Func func) override;
+
+  void addWithPriority(folly::Func func, int8_t priority) override;
+
+  uint8_t getNumPriorities() const override {
+    return NUM_PRIORITIES;
+  }
+
+  size_t getPendingTaskCount() const {
+    return n_pending_.load();
+  }
+
+ private:
+  enum Priority { LOW = 0, HIGH = 1, NUM_PRIORITIES = 2 };
+
+  static const uint32_t kLowPriorityInterval = 16;
+
+  struct Task {
+    folly::Func func;
+    std::chrono::steady_clock::time_point enqueue_time;
+    Priority priority;
+  };
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks[NUM_PRIORITIES];
+  };
+
+  void run(uint32_t idx);
+  bool popLocal(uint32_t idx, bool prefer_low, Task* task);
+  bool steal(uint32_t idx, Task* task);
+  void runTask(Task* task);
+  void reserve(bool from_worker);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<uint32_t> next_worker_;
+
+  const size_t max_pending_tasks_;
+  const bool block_when_full_;
+  std::atomic<size_t> n_pending_;
+
+  // Idle workers wait on idle_cv_, and blocked add()s on not_full_cv_
+  std::mutex mutex_;
+  std::condition_variable idle_cv_;
+  std::condition_variable not_full_cv_;
+  std::atomic<uint32_t> n_idle_;
+  std::atomic<uint32_t> n_blocked_;
+  bool stop_;
+
+  const std::string queue_wait_metrics_[NUM_PRIORITIES];
+  const std::string task_run_metric_;
+  const std::string steals_stat_;
+};
+
+}  // namespace common
@@ -0,0 +1,193 @@
+#!/bin/bash
+#
+# Drive the benchmark cluster of docker-compose.yml, see README.md.
+#
+#   bench.sh up [followers]         start the cluster and write the shard config
+#   bench.sh setup                  add the DBs, led by the leader
+#   bench.sh scenario <name>        run replication_lag, restore, ingestion
+#                                   or s3_transfer [benchmark flags]
+#   bench.sh down                   stop the cluster and drop its data
+#
+# Settings come from the environment, e.g.
+#   BUILD_DIR=~/rocksplicator/build SHARDS=16 NETEM_DELAY_MS=5 \
+#     ./bench.sh scenario replication_lag
+
+set -e
+
+cd "$(dirname "$0")"
+
+export COMPOSE_PROJECT_NAME=${COMPOSE_PROJECT_NAME:-rocksplicator_bench}
+FOLLOWERS=${FOLLOWERS:-2}
+SHARDS=${SHARDS:-8}
+SEGMENT=${SEGMENT:-default}
+DURATION_SEC=${DURATION_SEC:-60}
+QPS=${QPS:-10000}
+THREADS=${THREADS:-8}
+S3_BUCKET=${S3_BUCKET:-bench}
+KAFKA_TOPIC=${KAFKA_TOPIC:-bench}
+KAFKA_MESSAGES=${KAFKA_MESSAGES:-1000000}
+S3_FILE_MB=${S3_FILE_MB:-256}
+S3_FILES=${S3_FILES:-4}
+
+PROFILES=""
+if [ -n "$WITH_S3" ]; then
+  PROFILES="$PROFILES --profile s3"
+  export S3_ENDPOINT=${S3_ENDPOINT:-http://minio:9000}
+fi
+if [ -n "$WITH_KAFKA" ]; then
+  PROFILES="$PROFILES --profile kafka"
+fi
+
+compose() {
+  docker compose $PROFILES "$@"
+}
+
+# The ip of a service container on the bench network
+ip_of() {
+  docker inspect -f '{{range .NetworkSettings.Networks}}{{.IPAddress}}{{end}}' \
+    "$1"
+}
+
+leader_ip() {
+  ip_of "$(compose ps -q leader)"
+}
+
+follower_ips() {
+  local ips=""
+  for id in $(compose ps -q follower); do
+    ips="$ips${ips:+,}$(ip_of "$id")"
+  done
+  echo "$ips"
+}
+
+tools() {
+  compose exec -T tools "$@"
+}
+
+admin() {
+  tools python /rocksplicator/docker/benchmark/bench_admin.py \
+    --segment "$SEGMENT" --shards "$SHARDS" \
+    --leader "$(leader_ip)" --followers "$(follower_ips)" "$@"
+}
+
+up() {
+  FOLLOWERS=${1:-$FOLLOWERS}
+  compose up -d --scale follower="$FOLLOWERS"
+  tools bash -c "cd /rocksplicator/rocksdb_admin/tool && ./sync.sh > /dev/null"
+  admin shard_config | tools bash -c "cat > /shared/shard_config.json.tmp && \
+    mv /shared/shard_config.json.tmp /shared/shard_config.json"
+
+  if [ -n "$WITH_S3" ]; then
+    compose exec -T minio mkdir -p "/data/$S3_BUCKET"
+  fi
+  if [ -n "$WITH_KAFKA" ]; then
+    tools bash -c "echo kafka:9092 > /shared/kafka_serverset"
+  fi
+}
+
+setup() {
+  admin setup
+}
+
+# Run the load generator against the leader
+load() {
+  tools /build/examples/counter_service/load_generator \
+    --server_ip="$(leader_ip)" --segment="$SEGMENT" --qps="$QPS" \
+    --thread_num="$THREADS" --duration_sec="$1" --set_weight=50 \
+    --bump_weight=50 --get_weight=0 "${@:2}"
+}
+
+# The bytes of a DB dir on a node
+db_bytes() {
+  docker exec "$1" du -sb "/data/$2" | cut -f1
+}
+
+replication_lag() {
+  echo "== replication lag of $(follower_ips) at $QPS qps for $DURATION_SEC s"
+  load "$DURATION_SEC" > /tmp/bench_load.log 2>&1 &
+  local load_pid=$!
+  admin lag --duration_sec "$DURATION_SEC"
+  wait $load_pid || true
+  echo "== load generator summary"
+  tail -n 20 /tmp/bench_load.log
+}
+
+restore() {
+  if [ -z "$WITH_S3" ]; then
+    echo "restore needs WITH_S3=1" >&2
+    exit 1
+  fi
+  echo "== fill the leader for $DURATION_SEC s at $QPS qps"
+  load "$DURATION_SEC" > /dev/null 2>&1
+  local db="${SEGMENT}00000"
+  local follower
+  follower=$(compose ps -q follower | head -n 1)
+  echo "== back $db up to s3://$S3_BUCKET and restore it"
+  admin restore --bucket "$S3_BUCKET" --followers "$(ip_of "$follower")" \
+    | tee /tmp/bench_restore.log
+  local bytes
+  bytes=$(db_bytes "$follower" "$db")
+  local restore_sec
+  restore_sec=$(tail -n 1 /tmp/bench_restore.log | awk '{print $3}')
+  awk -v b="$bytes" -v s="$restore_sec" \
+    'BEGIN { printf "restored %.1f MB at %.1f MB/s\n", b / 1048576, b / 1048576 / s }'
+}
+
+s3_transfer() {
+  if [ -z "$WITH_S3" ]; then
+    echo "s3_transfer needs WITH_S3=1" >&2
+    exit 1
+  fi
+  echo "== transfer $S3_FILES files of $S3_FILE_MB MB to and from s3://$S3_BUCKET"
+  tools /build/common/tests/s3_util_benchmark \
+    --s3_endpoint_override="$S3_ENDPOINT" --bucket="$S3_BUCKET" \
+    --file_mb="$S3_FILE_MB" --n_files="$S3_FILES" "$@"
+}
+
+ingestion() {
+  if [ -z "$WITH_KAFKA" ]; then
+    echo "ingestion needs WITH_KAFKA=1" >&2
+    exit 1
+  fi
+  echo "== produce $KAFKA_MESSAGES messages to $KAFKA_TOPIC"
+  compose exec -T kafka kafka-topics --bootstrap-server kafka:9092 \
+    --create --if-not-exists --topic "$KAFKA_TOPIC" \
+    --partitions "$SHARDS" --replication-factor 1
+  compose exec -T kafka bash -c "seq 1 $KAFKA_MESSAGES | \
+    awk '{ print \"key\" \$1 \":value\" \$1 }' | \
+    kafka-console-producer --broker-list kafka:9092 --topic $KAFKA_TOPIC \
+      --property parse.key=true --property key.separator=: > /dev/null"
+  echo "== ingest $KAFKA_TOPIC to the leader"
+  admin ingest --topic "$KAFKA_TOPIC" --messages "$KAFKA_MESSAGES"
+}
+
+down() {
+  compose --profile s3 --profile kafka down -v
+}
+
+case "$1" in
+  up)
+    up "$2"
+    ;;
+  setup)
+    setup
+    ;;
+  scenario)
+    case "$2" in
+      replication_lag|restore|ingestion|s3_transfer)
+        "$2" "${@:3}"
+        ;;
+      *)
+        echo "unknown scenario: $2" >&2
+        exit 1
+        ;;
+    esac
+    ;;
+  down)
+    down
+    ;;
+  *)
+    sed -n '3,13p' "$0"
+    exit 1
+    ;;
+esac
@@ -0,0 +1,243 @@
+#!/usr/bin/python
+#
+
+# Copyright 2016 Pinterest Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+
+"""
+Admin calls of the benchmark scenarios of bench.sh, run from its tools
+container. Hosts are given as ip, and all serve the admin interface on
+--port. Needs the thrift_libs generated by rocksdb_admin/tool/sync.sh.
+
+-- Print the shard config of a leader serving all shards, and followers
+python bench_admin.py shard_config --leader ip --followers ip,ip
+
+-- Add the DBs of all shards, as Masters on the leader and Slaves of it on
+-- the followers
+python bench_admin.py setup --leader ip --followers ip,ip
+
+-- Sample how far the followers are behind the leader, and print a summary
+python bench_admin.py lag --leader ip --followers ip,ip --duration_sec 60
+
+-- Back a DB of the leader up to S3, and restore it on a follower
+python bench_admin.py restore --leader ip --followers ip --bucket bench
+
+-- Ingest a Kafka topic to the DBs of the leader, and print the rate
+python bench_admin.py ingest --leader ip --topic bench --messages 1000000
+"""
+
+import argparse
+import os
+import simplejson
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                             '../../rocksdb_admin/tool'))
+
+from thrift.protocol import TBinaryProtocol
+from thrift.transport import TSocket
+from thrift.transport import TTransport
+from thrift_libs.Admin import Client
+from thrift_libs.ttypes import AddDBRequest
+from thrift_libs.ttypes import BackupDBToS3Request
+from thrift_libs.ttypes import ChangeDBRoleAndUpstreamRequest
+from thrift_libs.ttypes import CloseDBRequest
+from thrift_libs.ttypes import GetSequenceNumbersRequest
+from thrift_libs.ttypes import RestoreDBFromS3Request
+from thrift_libs.ttypes import StartMessageIngestionRequest
+
+
+def LOG(msg):
+    print('%s %s' % (time.strftime('%H:%M:%S'), msg))
+    sys.stdout.flush()
+
+
+def get_client(ip, port):
+    transport = TSocket.TSocket(ip, int(port))
+    transport = TTransport.TBufferedTransport(transport)
+    protocol = TBinaryProtocol.TBinaryProtocol(transport)
+    client = Client(protocol)
+    transport.open()
+    return client
+
+
+def _followers(args):
+    return [f for f in args.followers.split(',') if f]
+
+
+def _db_names(args):
+    return ['%s%05d' % (args.segment, i) for i in xrange(args.shards)]
+
+
+def _wait_until_alive(ip, port, timeout_sec=120):
+    deadline = time.time() + timeout_sec
+    while True:
+        try:
+            get_client(ip, port).ping()
+            return
+        except Exception:
+            if time.time() > deadline:
+                raise
+            time.sleep(1)
+
+
+def _get_seq_nums(ip, port):
+    res = get_client(ip, port).getSequenceNumbers(GetSequenceNumbersRequest([]))
+    return res.seq_nums
+
+
+def _percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def shard_config(args):
+    shards = xrange(args.shards)
+    segment = {'num_shards': args.shards}
+    segment['%s:%d:bench' % (args.leader, args.port)] = \
+        ['%05d:M' % i for i in shards]
+    for follower in _followers(args):
+        segment['%s:%d:bench' % (follower, args.port)] = \
+            ['%05d:S' % i for i in shards]
+    print(simplejson.dumps({args.segment: segment}, indent=2, sort_keys=True))
+
+
+def setup(args):
+    for host in [args.leader] + _followers(args):
+        _wait_until_alive(host, args.port)
+
+    leader = get_client(args.leader, args.port)
+    for db_name in _db_names(args):
+        leader.addDB(AddDBRequest(db_name, args.leader, True))
+        leader.changeDBRoleAndUpStream(
+            ChangeDBRoleAndUpstreamRequest(db_name, 'MASTER'))
+
+    for follower in _followers(args):
+        client = get_client(follower, args.port)
+        for db_name in _db_names(args):
+            client.addDB(AddDBRequest(db_name, args.leader, True, 'SLAVE'))
+    LOG('Added %d DBs to the leader and %d followers' %
+        (args.shards, len(_followers(args))))
+
+
+def lag(args):
+    # follower -> the total lag over all dbs, per sample
+    samples = {}
+    deadline = time.time() + args.duration_sec
+    while time.time() < deadline:
+        leader_seqs = _get_seq_nums(args.leader, args.port)
+        for follower in _followers(args):
+            follower_seqs = _get_seq_nums(follower, args.port)
+            total = 0
+            for db_name, seq in leader_seqs.iteritems():
+                total += max(seq - follower_seqs.get(db_name, 0), 0)
+            samples.setdefault(follower, []).append(total)
+        time.sleep(args.interval_sec)
+
+    print('%-20s %8s %12s %12s %12s %12s' %
+          ('follower', 'samples', 'avg lag', 'p50 lag', 'p99 lag', 'max lag'))
+    for follower, lags in sorted(samples.iteritems()):
+        print('%-20s %8d %12.1f %12d %12d %12d' %
+              (follower, len(lags), float(sum(lags)) / len(lags),
+               _percentile(lags, 50), _percentile(lags, 99), max(lags)))
+
+
+def restore(args):
+    db_name = _db_names(args)[0]
+    backup_dir = 'bench_backup/%s' % db_name
+    leader = get_client(args.leader, args.port)
+    start = time.time()
+    leader.backupDBToS3(BackupDBToS3Request(db_name, args.bucket, backup_dir,
+                                            args.limit_mbs))
+    backup_sec = time.time() - start
+
+    follower = _followers(args)[0]
+    client = get_client(follower, args.port)
+    client.closeDB(CloseDBRequest(db_name))
+    start = time.time()
+    client.restoreDBFromS3(RestoreDBFromS3Request(
+        db_name, args.bucket, backup_dir, args.leader, args.port,
+        args.limit_mbs))
+    restore_sec = time.time() - start
+
+    print('%-20s %12s %12s' % ('db', 'backup sec', 'restore sec'))
+    print('%-20s %12.2f %12.2f' % (db_name, backup_sec, restore_sec))
+
+
+def ingest(args):
+    before = _get_seq_nums(args.leader, args.port)
+    client = get_client(args.leader, args.port)
+    start = time.time()
+    for db_name in _db_names(args):
+        client.startMessageIngestion(StartMessageIngestionRequest(
+            db_name, args.topic, args.serverset_path, 0, False))
+
+    ingested = 0
+    deadline = start + args.timeout_sec
+    while ingested < args.messages and time.time() < deadline:
+        time.sleep(args.interval_sec)
+        after = _get_seq_nums(args.leader, args.port)
+        ingested = sum(seq - before.get(db_name, 0)
+                       for db_name, seq in after.iteritems())
+        LOG('Ingested %d of %d messages' % (ingested, args.messages))
+    elapsed_sec = time.time() - start
+
+    print('%12s %12s %12s' % ('messages', 'seconds', 'messages/s'))
+    print('%12d %12.2f %12.1f' % (ingested, elapsed_sec,
+                                  ingested / max(elapsed_sec, 0.001)))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--port', type=int, default=9090)
+    parser.add_argument('--segment', default='default')
+    parser.add_argument('--shards', type=int, default=8)
+    parser.add_argument('--leader', required=True)
+    parser.add_argument('--followers', default='')
+    subparsers = parser.add_subparsers()
+
+    shard_config_parser = subparsers.add_parser(
+        'shard_config', help='print the shard config')
+    shard_config_parser.set_defaults(func=shard_config)
+
+    setup_parser = subparsers.add_parser('setup', help='add the DBs')
+    setup_parser.set_defaults(func=setup)
+
+    lag_parser = subparsers.add_parser('lag', help='sample replication lag')
+    lag_parser.add_argument('--duration_sec', type=int, default=60)
+    lag_parser.add_argument('--interval_sec', type=float, default=1)
+    lag_parser.set_defaults(func=lag)
+
+    restore_parser = subparsers.add_parser(
+        'restore', help='back a DB up to S3 and restore it')
+    restore_parser.add_argument('--bucket', default='bench')
+    restore_parser.add_argument('--limit_mbs', type=int, default=0)
+    restore_parser.set_defaults(func=restore)
+
+    ingest_parser = subparsers.add_parser('ingest', help='ingest from Kafka')
+    ingest_parser.add_argument('--topic', default='bench')
+    ingest_parser.add_argument('--serverset_path',
+                               default='/shared/kafka_serverset')
+    ingest_parser.add_argument('--messages', type=int, required=True)
+    ingest_parser.add_argument('--timeout_sec', type=int, default=600)
+    ingest_parser.add_argument('--interval_sec', type=float, default=1)
+    ingest_parser.set_defaults(func=ingest)
+
+    args = parser.parse_args()
+    args.func(args)
@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# Entrypoint of the leader and the followers. Adds the tc netem delay and
+# loss, if any, waits for bench.sh to write the shard config, then runs the
+# counter service with its DBs under /data.
+
+set -e
+
+if [ "${NETEM_DELAY_MS:-0}" != "0" ] || [ "${NETEM_LOSS_PERCENT:-0}" != "0" ]; then
+  tc qdisc replace dev eth0 root netem \
+    delay "${NETEM_DELAY_MS:-0}ms" "${NETEM_JITTER_MS:-0}ms" \
+    loss "${NETEM_LOSS_PERCENT:-0}%"
+fi
+
+while [ ! -f /shared/shard_config.json ]; do
+  sleep 1
+done
+
+S3_FLAGS=""
+if [ -n "$S3_ENDPOINT" ]; then
+  S3_FLAGS="--s3_endpoint_override=$S3_ENDPOINT"
+fi
+
+mkdir -p /data
+exec /build/examples/counter_service/counter \
+  --shard_config_path=/shared/shard_config.json \
+  --rocksdb_dir=/data/ \
+  --port=9090 \
+  --http_status_port=9999 \
+  --rocksdb_block_cache_size_gb=1 \
+  $S3_FLAGS \
+  $NODE_FLAGS
@@ -0,0 +1,192 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "examples/counter_service/bump_coalescer.h"
+
+#include <algorithm>
+
+#include "folly/Hash.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_replicator/write_batch_pool.h"
+
+namespace counter {
+
+BumpCoalescer::BumpCoalescer(DBGetter get_db,
+                             rocksdb::WriteOptions write_options,
+                             std::chrono::milliseconds interval)
+    : get_db_(std::move(get_db))
+    , write_options_(std::move(write_options))
+    , interval_(interval)
+    , shards_()
+    , stop_mutex_()
+    , stop_cv_()
+    , stop_(false)
+    , flush_thread_() {
+  flush_thread_ = std::thread([this] { flushLoop(); });
+}
+
+BumpCoalescer::~BumpCoalescer() {
+  {
+    std::lock_guard<std::mutex> g(stop_mutex_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  flush_thread_.join();
+}
+
+BumpCoalescer::Shard& BumpCoalescer::shardFor(const std::string& db_name,
+                                              const std::string& key) {
+  const auto hash = folly::hash::hash_combine(db_name, key);
+  return shards_[hash % kNumShards];
+}
+
+folly::Future<rocksdb::Status> BumpCoalescer::Add(const std::string& db_name,
+                                                  const std::string& key,
+                                                  int64_t delta) {
+  auto& shard = shardFor(db_name, key);
+  folly::Promise<rocksdb::Status> promise;
+  auto future = promise.getFuture();
+
+  std::lock_guard<std::mutex> g(shard.mutex);
+  shard.deltas[db_name][key] += delta;
+  shard.promises[db_name].push_back(std::move(promise));
+  return future;
+}
+
+std::vector<int64_t> BumpCoalescer::ReadWithPending(
+    const std::string& db_name,
+    const std::vector<std::string>& keys,
+    const std::function<void()>& read) {
+  std::vector<int64_t> pending;
+  readWithPending(db_name, keys, read, true /* wait */, &pending);
+  return pending;
+}
+
+bool BumpCoalescer::TryReadWithPending(
+    const std::string& db_name,
+    const std::vector<std::string>& keys,
+    const std::function<void()>& read,
+    std::vector<int64_t>* pending) {
+  return readWithPending(db_name, keys, read, false /* wait */, pending);
+}
+
+bool BumpCoalescer::readWithPending(
+    const std::string& db_name,
+    const std::vector<std::string>& keys,
+    const std::function<void()>& read,
+    bool wait,
+    std::vector<int64_t>* pending) {
+  std::vector<Shard*> shards;
+  shards.reserve(keys.size());
+  for (const auto& key : keys) {
+    shards.push_back(&shardFor(db_name, key));
+  }
+
+  // Lock in address order, as flushes take one shard at a time anyway
+  std::vector<Shard*> locked(shards);
+  std::sort(locked.begin(), locked.end());
+  locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+  for (size_t i = 0; i < locked.size(); ++i) {
+    if (wait) {
+      locked[i]->flush_lock.lock_shared();
+    } else if (!locked[i]->flush_lock.try_lock_shared()) {
+      for (size_t j = 0; j < i; ++j) {
+        locked[j]->flush_lock.unlock_shared();
+      }
+      return false;
+    }
+  }
+
+  read();
+
+  pending->assign(keys.size(), 0);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    std::lock_guard<std::mutex> g(shards[i]->mutex);
+    auto db_itor = shards[i]->deltas.find(db_name);
+    if (db_itor == shards[i]->deltas.end()) {
+      continue;
+    }
+    auto key_itor = db_itor->second.find(keys[i]);
+    if (key_itor != db_itor->second.end()) {
+      (*pending)[i] = key_itor->second;
+    }
+  }
+
+  for (auto shard : locked) {
+    shard->flush_lock.unlock_shared();
+  }
+
+  return true;
+}
+
+void BumpCoalescer::flushShard(Shard* shard) {
+  folly::SharedMutex::WriteHolder wh(shard->flush_lock);
+
+  std::unordered_map<std::string, std::unordered_map<std::string, int64_t>>
+    deltas;
+  std::unordered_map<std::string,
+                     std::vector<folly::Promise<rocksdb::Status>>> promises;
+  {
+    std::lock_guard<std::mutex> g(shard->mutex);
+    deltas.swap(shard->deltas);
+    promises.swap(shard->promises);
+  }
+
+  if (deltas.empty()) {
+    return;
+  }
+
+  // Each db is written on its own, so the failure of one only fails its
+  // bumps
+  for (const auto& db_deltas : deltas) {
+    rocksdb::Status status;
+    auto db = get_db_(db_deltas.first);
+    if (db == nullptr) {
+      status = rocksdb::Status::NotFound("DB not found: " + db_deltas.first);
+    } else {
+      auto write_batch = replicator::WriteBatchPool::Get();
+      for (const auto& key_delta : db_deltas.second) {
+        write_batch->Merge(
+          key_delta.first,
+          rocksdb::Slice(reinterpret_cast<const char*>(&key_delta.second),
+                         sizeof(key_delta.second)));
+      }
+      status = db->Write(write_options_, write_batch.get());
+    }
+
+    auto itor = promises.find(db_deltas.first);
+    if (itor == promises.end()) {
+      continue;
+    }
+    for (auto& promise : itor->second) {
+      promise.setValue(status);
+    }
+  }
+}
+
+void BumpCoalescer::flushLoop() {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  bool stopping = false;
+  while (!stopping) {
+    stopping = stop_cv_.wait_for(lock, interval_, [this] { return stop_; });
+
+    lock.unlock();
+    for (auto& shard : shards_) {
+      flushShard(&shard);
+    }
+    lock.lock();
+  }
+}
+
+}  // namespace counter
@@ -0,0 +1,126 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "folly/SharedMutex.h"
+#include "folly/futures/Future.h"
+#include "rocksdb/options.h"
+#include "rocksdb/status.h"
+#include "rocksdb_admin/application_db.h"
+
+namespace counter {
+
+/*
+ * Coalesces counter bumps in memory, so that a hot counter gets one merge per
+ * flush interval instead of one per bump.
+ *
+ * Deltas are summed per key in one of kNumShards shards, and flushed every
+ * interval with one WriteBatch of merges per db.
+ *
+ * Durability: the future of a bump is only fulfilled once the flush holding
+ * its delta has been written, with the same write options as an uncoalesced
+ * bump. An acknowledged bump is therefore as durable as before. Bumps not yet
+ * acknowledged when the process dies are lost, and their callers see an
+ * error. Pending deltas are flushed on destruction.
+ *
+ * Reads done through ReadWithPending() see a delta exactly once, whether it
+ * is still pending or already flushed.
+ */
+class BumpCoalescer {
+ public:
+  using DBGetter = std::function<std::shared_ptr<admin::ApplicationDB>(
+    const std::string& db_name)>;
+
+  BumpCoalescer(DBGetter get_db,
+                rocksdb::WriteOptions write_options,
+                std::chrono::milliseconds interval);
+
+  ~BumpCoalescer();
+
+  // Add delta to key of db_name. The future is fulfilled with the status of
+  // the write holding it, which only holds the deltas of db_name.
+  folly::Future<rocksdb::Status> Add(const std::string& db_name,
+                                     const std::string& key,
+                                     int64_t delta);
+
+  // Call read with no flush of keys in progress, and return the deltas
+  // pending for keys once it's done. A flush is either fully visible to read
+  // or its deltas are returned.
+  std::vector<int64_t> ReadWithPending(const std::string& db_name,
+                                       const std::vector<std::string>& keys,
+                                       const std::function<void()>& read);
+
+  // Like ReadWithPending(), but return false without calling read if a flush
+  // of keys is in progress, instead of waiting for it. For the threads which
+  // must not block, e.g., the IO threads.
+  bool TryReadWithPending(const std::string& db_name,
+                          const std::vector<std::string>& keys,
+                          const std::function<void()>& read,
+                          std::vector<int64_t>* pending);
+
+ private:
+  static const size_t kNumShards = 64;
+
+  struct Shard {
+    // Held exclusively while the deltas of this shard are written
+    folly::SharedMutex flush_lock;
+
+    // Protects the members below
+    std::mutex mutex;
+    // db name -> key -> delta
+    std::unordered_map<std::string, std::unordered_map<std::string, int64_t>>
+      deltas;
+    // db name -> the promises of its bumps
+    std::unordered_map<std::string,
+                       std::vector<folly::Promise<rocksdb::Status>>> promises;
+  };
+
+  Shard& shardFor(const std::string& db_name, const std::string& key);
+
+  // Back ReadWithPending() and TryReadWithPending(), waiting for the flushes
+  // of keys in progress if wait
+  bool readWithPending(const std::string& db_name,
+                       const std::vector<std::string>& keys,
+                       const std::function<void()>& read,
+                       bool wait,
+                       std::vector<int64_t>* pending);
+
+  void flushShard(Shard* shard);
+
+  void flushLoop();
+
+  const DBGetter get_db_;
+  const rocksdb::WriteOptions write_options_;
+  const std::chrono::milliseconds interval_;
+  std::array<Shard, kNumShards> shards_;
+
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stop_;
+  std::thread flush_thread_;
+};
+
+}  // namespace counter
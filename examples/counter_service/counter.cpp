@@ -18,6 +18,10 @@
 
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
 #include <string>
 #include <memory>
 #include <vector>
@@ -29,17 +33,34 @@
 
 
 #include "common/availability_zone.h"
+#include "common/graceful_shutdown_handler.h"
+#include "common/network_util.h"
+#include "common/ssl_context_manager.h"
 #include "common/stats/stats.h"
 #include "common/stats/status_server.h"
+#include "common/thread_placement.h"
+#include "common/tracing.h"
 #include "gflags/gflags.h"
 #include "rocksdb_admin/helix_client.h"
 #include "thrift/lib/cpp2/server/ThriftServer.h"
+#if __GNUC__ >= 8
+#include "folly/executors/IOThreadPoolExecutor.h"
+#include "folly/executors/thread_factory/NamedThreadFactory.h"
+#else
+#include "wangle/concurrent/IOThreadPoolExecutor.h"
+#endif
 
 
 DEFINE_int32(num_worker_threads, 256, "Total number of thrift worker threads");
 DEFINE_int32(num_server_io_threads, sysconf(_SC_NPROCESSORS_ONLN),
              "The number of threads for processing server IO");
 
+DEFINE_string(server_io_cpus, "",
+              "The CPUs to pin the server IO threads to, see "
+              "common::ThreadPlacement for the format. With "
+              "--counter_inline_reads, \"core:\" and as many IO threads as "
+              "CPUs serve each inline read on a core of its own.");
+
 DEFINE_string(helix_zk_connect_str, "127.0.0.1:2181",
               "ZK cluster connect string");
 
@@ -49,6 +70,21 @@ DEFINE_bool(read_only_mode, true, "If the cluster does batch uploading only");
 
 DEFINE_string(post_url, "", "The url to post the shard mapping file to");
 
+DEFINE_int32(drain_min_wait_ms, 5000,
+             "On SIGTERM, how long to keep serving after failing the health "
+             "check, so that the clients move away first");
+
+DEFINE_int32(drain_timeout_ms, 30000,
+             "On SIGTERM, how long to wait for the requests in flight at most");
+
+DEFINE_int32(hottest_dbs, 20,
+             "The number of dbs in /hottest_dbs.txt, unless set by its n "
+             "argument");
+
+DEFINE_bool(serve_routed_requests_in_process, true,
+            "Serve the requests needing routing which are routed to this "
+            "host in process, rather than sending them to it over loopback");
+
 DECLARE_string(shard_config_path);
 DECLARE_int32(port);
 
@@ -61,7 +97,11 @@ int main(int argc, char** argv) {
 
   auto router = std::make_unique<counter::CounterRouter>(
     common::getAvailabilityZone(), FLAGS_shard_config_path);
-  auto server = std::make_unique<apache::thrift::ThriftServer>();
+  if (FLAGS_serve_routed_requests_in_process) {
+    router->SetLocalAddress(
+      folly::SocketAddress(common::getLocalIPAddress(), FLAGS_port));
+  }
+  auto server = std::make_shared<apache::thrift::ThriftServer>();
 
   const bool helix_mode = !FLAGS_helix_cluster_name.empty();
   std::unique_ptr<admin::ApplicationDBManager> db_manager;
@@ -73,15 +113,87 @@ int main(int argc, char** argv) {
     std::move(db_manager), counter::GetRocksdbOptions,
     std::move(router), rocksdb::WriteOptions(), rocksdb::ReadOptions());
 
+  auto handler_ptr = handler.get();
   server->setInterface(std::move(handler));
 
   server->setPort(FLAGS_port);
   server->setIdleTimeout(std::chrono::milliseconds(0));
   server->setTaskExpireTime(std::chrono::milliseconds(0));
   server->setNPoolThreads(FLAGS_num_worker_threads);
+  auto io_placement = common::ThreadPlacement::Create(FLAGS_server_io_cpus);
+  if (io_placement) {
+#if __GNUC__ >= 8
+    server->setIOThreadPool(std::make_shared<folly::IOThreadPoolExecutor>(
+      0, std::make_shared<common::PlacedThreadFactory>(
+        std::make_shared<folly::NamedThreadFactory>("svr-io-"),
+        io_placement)));
+#else
+    server->setIOThreadPool(std::make_shared<wangle::IOThreadPoolExecutor>(
+      0, std::make_shared<common::PlacedThreadFactory>(
+        std::make_shared<wangle::NamedThreadFactory>("svr-io-"),
+        io_placement)));
+#endif
+  }
   server->setNWorkerThreads(FLAGS_num_server_io_threads);
-
-  common::StatusServer::StartStatusServer();
+  common::configureServerTLS(server.get());
+
+  // The backlog of the thrift worker threads serving the data calls, next to
+  // admin_pool_pending_tasks of the pools running the admin calls
+  common::Stats::get()->RegisterGauge("thrift_worker_pending_tasks",
+    [server] () -> uint64_t {
+      auto thread_manager = server->getThreadManager();
+      return thread_manager ? thread_manager->pendingTaskCount() : 0;
+    });
+
+  // Fails the health check once draining, so that the host is taken out of
+  // routing before it goes away
+  static std::atomic<bool> draining{false};
+  common::StatusServer::StartStatusServer({
+    {
+      "/hot_keys.txt",
+      [handler_ptr] (const common::StatusServer::Arguments*) {
+        return handler_ptr->DumpHotKeysAsText();
+      }
+    },
+    {
+      "/hottest_dbs.txt",
+      [handler_ptr] (const common::StatusServer::Arguments* args) {
+        uint32_t n = std::max(FLAGS_hottest_dbs, 0);
+        for (const auto& arg : *args) {
+          if (arg.first == "n") {
+            n = std::strtoul(arg.second.c_str(), nullptr, 10);
+          }
+        }
+        return handler_ptr->DumpHottestDBsAsText(n);
+      }
+    },
+    {
+      "/traces.txt",
+      [] (const common::StatusServer::Arguments*) {
+        return common::Trace::DumpRecentTracesAsText();
+      }
+    },
+    {
+      "/startup.txt",
+      [handler_ptr] (const common::StatusServer::Arguments*) {
+        return handler_ptr->DumpStartupReportAsText();
+      }
+    },
+    {
+      "/health.txt",
+      [] (const common::StatusServer::Arguments*) {
+        return std::string(draining.load() ? "DRAINING" : "OK");
+      }
+    }
+  }, {}, {
+    {
+      // appended to /stats.txt, streamed as there is a section per db
+      "/rocksdb_info.txt",
+      [handler_ptr] (const common::StatusServer::Arguments*) {
+        return handler_ptr->DBStatsReader();
+      }
+    }
+  });
 
   if (helix_mode) {
       auto az = common::getAvailabilityZone();
@@ -98,6 +210,16 @@ int main(int argc, char** argv) {
                          FLAGS_post_url);
   }
 
+  common::GracefulShutdownHandler graceful_shutdown(server);
+  graceful_shutdown.EnableDrain(milliseconds(FLAGS_drain_min_wait_ms),
+                                milliseconds(FLAGS_drain_timeout_ms));
+  graceful_shutdown.RegisterDrainHandler([] { draining.store(true); });
+  // flush the memtables, so that the next start has no WAL to replay
+  graceful_shutdown.RegisterPostShutdownHandler([handler_ptr] {
+      handler_ptr->FlushAllDBs();
+    });
+  graceful_shutdown.RegisterShutdownSignal(SIGTERM);
+
   LOG(INFO) << "Starting server at port " << FLAGS_port;
   server->serve();
   
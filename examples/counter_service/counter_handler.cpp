@@ -19,15 +19,172 @@
 
 #include "examples/counter_service/counter_handler.h"
 
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "examples/counter_service/stats_enum.h"
+#include "common/admission_controller.h"
+#include "common/deadline.h"
 #include "common/stats/stats.h"
 #include "common/timer.h"
-
+#include "common/tracing.h"
+#include "common/tsc_clock.h"
+#include "gflags/gflags.h"
+#include "rocksdb_replicator/write_batch_pool.h"
+
+DEFINE_int32(counters_batch_timeout_ms, 1000,
+             "The timeout of the requests a batch counter call is forwarded "
+             "in, if the call has no deadline");
+DEFINE_int32(counter_bump_coalesce_ms, 0,
+             "If positive, bumps are summed in memory per counter and "
+             "written once every this many ms. A bump is acknowledged once "
+             "written, so it adds up to this much latency to bumps.");
+
+DEFINE_bool(counter_inline_reads, false,
+            "Serve getCounter on the thrift IO thread when the counter is "
+            "local and in the memtables or the block cache, saving the trips "
+            "to a worker thread and back. The other calls, e.g., reading "
+            "sst files or routed to other hosts, still go to the workers.");
+
+DEFINE_int32(counter_inline_budget_us, 200,
+             "An inline getCounter taking longer than this sends the next "
+             "ones of its IO thread to the workers for "
+             "--counter_inline_backoff_ms, so that slow reads don't hold up "
+             "the other connections of the IO thread");
+
+DEFINE_int32(counter_inline_backoff_ms, 100,
+             "See --counter_inline_budget_us");
 
 namespace counter {
 
+namespace {
+
+// Fail the request of callback and return true if its deadline expired, so
+// that no work is done for callers which have given up. Checked again right
+// before the RocksDB work, as the budget counts from when the handler starts.
+template <typename CallbackPtr>
+bool dropIfExpired(const common::Deadline& deadline, CallbackPtr* callback) {
+  if (!deadline.expired()) {
+    return false;
+  }
+
+  common::Stats::get()->Incr(kExpiredRequests);
+  CounterException ex;
+  ex.code = ErrorCode::DEADLINE_EXCEEDED;
+  ex.msg = "Deadline expired";
+  callback->release()->exceptionInThread(std::move(ex));
+  return true;
+}
+
+// Admit the request of callback, or fail it and return nullptr if it is shed
+template <typename CallbackPtr>
+std::unique_ptr<common::AdmissionController::Permit> admitOrShed(
+    common::AdmissionController* controller,
+    common::AdmissionController::Priority priority,
+    CallbackPtr* callback) {
+  auto permit = controller->TryAcquire(priority);
+  if (permit == nullptr) {
+    CounterException ex;
+    ex.code = ErrorCode::OVERLOADED;
+    ex.msg = "Server overloaded";
+    callback->release()->exceptionInThread(std::move(ex));
+  }
+
+  return permit;
+}
+
+std::chrono::milliseconds batchTimeout(const common::Deadline& deadline) {
+  return deadline.isSet() ?
+    deadline.remaining() :
+    std::chrono::milliseconds(FLAGS_counters_batch_timeout_ms);
+}
+
+// Fail the request of callback with the error of a shard if some shard of a
+// batch call could not be served
+template <typename Result, typename CallbackPtr>
+bool failIfAnyShardFailed(Result* result, CallbackPtr* callback) {
+  if (result->errors.empty()) {
+    return false;
+  }
+
+  callback->release()->exceptionInThread(
+    std::move(result->errors.begin()->second));
+  return true;
+}
+
+// Reply to the bump request of callback with the status of its write
+template <typename Response, typename CallbackPtr>
+void replyWithStatus(const rocksdb::Status& status, CallbackPtr* callback) {
+  if (status.ok()) {
+    callback->release()->resultInThread(Response());
+    return;
+  }
+
+  CounterException ex;
+  ex.code = ErrorCode::ROCKSDB_ERROR;
+  ex.msg = status.ToString();
+  callback->release()->exceptionInThread(std::move(ex));
+}
+
+// Reply to the getCounter request of callback with the result of its read
+template <typename CallbackPtr>
+void replyWithCounter(const rocksdb::Status& status, const std::string& value,
+                      const int64_t pending, CallbackPtr* callback) {
+  // A counter only bumped so far may not be written yet
+  if (status.IsNotFound() && pending != 0) {
+    GetResponse res;
+    res.counter_value = pending;
+    callback->release()->resultInThread(res);
+    return;
+  }
+
+  CounterException ex;
+  if (!status.ok()) {
+    ex.code = ErrorCode::ROCKSDB_ERROR;
+    ex.msg = status.ToString();
+    callback->release()->exceptionInThread(std::move(ex));
+    return;
+  }
+
+  if (value.size() != sizeof(int64_t)) {
+    ex.code = ErrorCode::CORRUPTED_DATA;
+    ex.msg = "Corrupted data found";
+    callback->release()->exceptionInThread(std::move(ex));
+    return;
+  }
+
+  GetResponse res;
+  memcpy(&res.counter_value, value.c_str(), value.size());
+  res.counter_value += pending;
+  callback->release()->resultInThread(res);
+}
+
+}  // namespace
+
+CounterHandler::CounterHandler(
+    std::unique_ptr<::admin::ApplicationDBManager> db_manager,
+    admin::RocksDBOptionsGeneratorType rocksdb_options,
+    std::unique_ptr<CounterRouter> router,
+    rocksdb::WriteOptions write_options,
+    rocksdb::ReadOptions read_options)
+    : AdminHandler(std::move(db_manager), std::move(rocksdb_options))
+    , router_(std::move(router))
+    , write_options_(std::move(write_options))
+    , read_options_(std::move(read_options))
+    , coalescer_() {
+  if (FLAGS_counter_bump_coalesce_ms > 0) {
+    coalescer_ = std::make_unique<BumpCoalescer>(
+      [this] (const std::string& db_name) {
+        return getDB(db_name, nullptr);
+      },
+      write_options_,
+      std::chrono::milliseconds(FLAGS_counter_bump_coalesce_ms));
+  }
+}
+
 std::shared_ptr<::admin::ApplicationDB> CounterHandler::getDB(
     const std::string& db_name,
     CounterException* ex) {
@@ -41,12 +198,133 @@ std::shared_ptr<::admin::ApplicationDB> CounterHandler::getDB(
   return db;
 }
 
-void CounterHandler::async_tm_getCounter(
+void CounterHandler::async_eb_getCounter(
     std::unique_ptr<apache::thrift::HandlerCallback<
       std::unique_ptr<::counter::GetResponse>>> callback,
     std::unique_ptr<::counter::GetRequest> request) {
+  const auto deadline =
+    common::Deadline::fromRequest(callback->getConnectionContext());
+  if (tryGetCounterInline(&callback, *request, deadline)) {
+    return;
+  }
+
+  // as the generated code does for the calls not run on IO threads
+  callback->getThreadManager()->add(
+    [this, callback = std::move(callback), request = std::move(request),
+     deadline] () mutable {
+      getCounterInWorker(std::move(callback), std::move(request), deadline);
+    });
+}
+
+bool CounterHandler::tryGetCounterInline(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<::counter::GetResponse>>>* callback,
+    const ::counter::GetRequest& request,
+    const common::Deadline& deadline) {
+  // Until then, the calls of this IO thread go to the workers
+  static thread_local std::chrono::steady_clock::time_point backoff_until;
+  if (!FLAGS_counter_inline_reads ||
+      std::chrono::steady_clock::now() < backoff_until) {
+    return false;
+  }
+
+  const auto start = common::TscClock::Now();
+  common::ScopedTrace trace(
+    common::Trace::fromRequest((*callback)->getConnectionContext()));
+  common::TraceSpan span("counter_get_inline");
+
+  // Expired calls are dropped by the workers, and shedding is left to them,
+  // as the calls served inline don't queue
+  if (deadline.expired()) {
+    return false;
+  }
+
+  if (request.need_routing) {
+    std::vector<std::shared_ptr<CounterAsyncClient>> clients;
+    router_->GetClientsFor(request.segment,
+                           request.counter_name,
+                           true /* for_read */,
+                           &clients);
+    if (clients.empty() || !router_->IsLocalClient(clients[0].get())) {
+      return false;
+    }
+  }
+
+  auto db_name = router_->GetDBName(request.segment, request.counter_name);
+  auto db = getDB(db_name, nullptr);
+  // Waking up a hibernated db restores its options with SetOptions(), which
+  // writes the OPTIONS file, so it is left to the workers
+  if (db == nullptr || db->IsHibernated()) {
+    return false;
+  }
+
+  // Incomplete rather than reading sst files on a block cache miss
+  auto read_options = read_options_;
+  read_options.read_tier = rocksdb::kBlockCacheTier;
+  std::string value;
+  rocksdb::Status status;
+  auto read = [&] {
+    status = db->Get(read_options, request.counter_name, &value);
+  };
+  int64_t pending = 0;
+  if (coalescer_) {
+    // A flush of the counter in progress may take a while, which the workers
+    // wait for instead
+    std::vector<int64_t> pendings;
+    if (!coalescer_->TryReadWithPending(db_name, {request.counter_name}, read,
+                                        &pendings)) {
+      common::Stats::get()->Incr(kInlineReadSpills);
+      return false;
+    }
+    pending = pendings[0];
+  } else {
+    read();
+  }
+
+  const auto elapsed_us = common::TscClock::ElapsedNs(start) / 1000;
+  if (elapsed_us > static_cast<uint64_t>(
+        std::max(FLAGS_counter_inline_budget_us, 0))) {
+    backoff_until = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(FLAGS_counter_inline_backoff_ms);
+  }
+
+  if (status.IsIncomplete()) {
+    common::Stats::get()->Incr(kInlineReadSpills);
+    return false;
+  }
+
+  common::Stats::get()->Incr(kApiGetCounter);
+  common::Stats::get()->Incr(kInlineReads);
+  if (request.need_routing) {
+    common::Stats::get()->Incr(kRoutedInProcess);
+  }
+  common::Stats::get()->AddMetric(kApiGetCounterMs, elapsed_us / 1000);
+  replyWithCounter(status, value, pending, callback);
+  return true;
+}
+
+void CounterHandler::getCounterInWorker(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<::counter::GetResponse>>> callback,
+    std::unique_ptr<::counter::GetRequest> request,
+    const common::Deadline& deadline) {
   common::Stats::get()->Incr(kApiGetCounter);
   common::Timer timer(kApiGetCounterMs);
+  common::ScopedTrace trace(
+    common::Trace::fromRequest(callback->getConnectionContext()));
+  common::TraceSpan span("counter_get");
+
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  // Reads are shed before writes
+  auto permit = admitOrShed(&admission_controller_,
+                            common::AdmissionController::Priority::LOW,
+                            &callback);
+  if (permit == nullptr) {
+    return;
+  }
 
   CounterException ex;
   if (request->need_routing) {
@@ -63,17 +341,24 @@ void CounterHandler::async_tm_getCounter(
       return;
     }
 
-    clients[0]->future_getCounter(*request).then(
-      [ callback = std::move(callback) ]
-      (folly::Try<::counter::GetResponse>&& t) mutable {
-        if (t.hasException()) {
-          callback.release()->exceptionInThread(t.exception());
-        } else {
-          callback.release()->resultInThread(std::move(t.value()));
-        }
-      });
+    // The request is served below when this host is the one routed to
+    if (!router_->IsLocalClient(clients[0].get())) {
+      apache::thrift::RpcOptions options;
+      deadline.applyTo(&options);
+      common::Trace::applyTo(common::Trace::current(), &options);
+      clients[0]->future_getCounter(options, *request).then(
+        [ callback = std::move(callback), permit = std::move(permit) ]
+        (folly::Try<::counter::GetResponse>&& t) mutable {
+          if (t.hasException()) {
+            callback.release()->exceptionInThread(t.exception());
+          } else {
+            callback.release()->resultInThread(std::move(t.value()));
+          }
+        });
 
-    return;
+      return;
+    }
+    common::Stats::get()->Incr(kRoutedInProcess);
   }
 
   auto db_name = router_->GetDBName(request->segment, request->counter_name);
@@ -84,26 +369,24 @@ void CounterHandler::async_tm_getCounter(
     return;
   }
 
-  std::string value;
-  auto status = db->Get(read_options_, request->counter_name, &value);
-  if (!status.ok()) {
-    ex.code = ErrorCode::ROCKSDB_ERROR;
-    ex.msg = status.ToString();
-    callback.release()->exceptionInThread(std::move(ex));
+  if (dropIfExpired(deadline, &callback)) {
     return;
   }
 
-  if (value.size() != sizeof(int64_t)) {
-    ex.code = ErrorCode::CORRUPTED_DATA;
-    ex.msg = "Corrupted data found";
-    callback.release()->exceptionInThread(std::move(ex));
-    return;
+  std::string value;
+  rocksdb::Status status;
+  auto read = [&] {
+    status = db->Get(read_options_, request->counter_name, &value);
+  };
+  int64_t pending = 0;
+  if (coalescer_) {
+    pending = coalescer_->ReadWithPending(db_name, {request->counter_name},
+                                          read)[0];
+  } else {
+    read();
   }
 
-
-  GetResponse res;
-  memcpy(&res.counter_value, value.c_str(), value.size());
-  callback.release()->resultInThread(res);
+  replyWithCounter(status, value, pending, &callback);
 }
 
 void CounterHandler::async_tm_setCounter(
@@ -112,6 +395,22 @@ void CounterHandler::async_tm_setCounter(
     std::unique_ptr<::counter::SetRequest> request) {
   common::Stats::get()->Incr(kApiSetCounter);
   common::Timer timer(kApiSetCounterMs);
+  common::ScopedTrace trace(
+    common::Trace::fromRequest(callback->getConnectionContext()));
+  common::TraceSpan span("counter_set");
+
+  const auto deadline =
+    common::Deadline::fromRequest(callback->getConnectionContext());
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  auto permit = admitOrShed(&admission_controller_,
+                            common::AdmissionController::Priority::NORMAL,
+                            &callback);
+  if (permit == nullptr) {
+    return;
+  }
 
   CounterException ex;
   if (request->need_routing) {
@@ -128,17 +427,24 @@ void CounterHandler::async_tm_setCounter(
       return;
     }
 
-    clients[0]->future_setCounter(*request).then(
-      [ callback = std::move(callback) ]
-      (folly::Try<::counter::SetResponse>&& t) mutable {
-        if (t.hasException()) {
-          callback.release()->exceptionInThread(t.exception());
-        } else {
-          callback.release()->resultInThread(std::move(t.value()));
-        }
-      });
+    // The request is served below when this host is the one routed to
+    if (!router_->IsLocalClient(clients[0].get())) {
+      apache::thrift::RpcOptions options;
+      deadline.applyTo(&options);
+      common::Trace::applyTo(common::Trace::current(), &options);
+      clients[0]->future_setCounter(options, *request).then(
+        [ callback = std::move(callback), permit = std::move(permit) ]
+        (folly::Try<::counter::SetResponse>&& t) mutable {
+          if (t.hasException()) {
+            callback.release()->exceptionInThread(t.exception());
+          } else {
+            callback.release()->resultInThread(std::move(t.value()));
+          }
+        });
 
-    return;
+      return;
+    }
+    common::Stats::get()->Incr(kRoutedInProcess);
   }
 
   auto db_name = router_->GetDBName(request->segment, request->counter_name);
@@ -149,13 +455,17 @@ void CounterHandler::async_tm_setCounter(
     return;
   }
 
-  rocksdb::WriteBatch write_batch;
-  write_batch.Put(
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  auto write_batch = replicator::WriteBatchPool::Get();
+  write_batch->Put(
     request->counter_name,
     rocksdb::Slice(reinterpret_cast<const char*>(&request->counter_value),
                    sizeof(request->counter_value)));
 
-  auto status = db->Write(write_options_, &write_batch);
+  auto status = db->Write(write_options_, write_batch.get());
   if (status.ok()) {
     callback.release()->resultInThread(SetResponse());
     return;
@@ -172,6 +482,22 @@ void CounterHandler::async_tm_bumpCounter(
     std::unique_ptr<::counter::BumpRequest> request) {
   common::Stats::get()->Incr(kApiBumpCounter);
   common::Timer timer(kApiBumpCounterMs);
+  common::ScopedTrace trace(
+    common::Trace::fromRequest(callback->getConnectionContext()));
+  common::TraceSpan span("counter_bump");
+
+  const auto deadline =
+    common::Deadline::fromRequest(callback->getConnectionContext());
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  auto permit = admitOrShed(&admission_controller_,
+                            common::AdmissionController::Priority::NORMAL,
+                            &callback);
+  if (permit == nullptr) {
+    return;
+  }
 
   CounterException ex;
   if (request->need_routing) {
@@ -188,17 +514,24 @@ void CounterHandler::async_tm_bumpCounter(
       return;
     }
 
-    clients[0]->future_bumpCounter(*request).then(
-      [ callback = std::move(callback) ]
-      (folly::Try<::counter::BumpResponse>&& t) mutable {
-        if (t.hasException()) {
-          callback.release()->exceptionInThread(t.exception());
-        } else {
-          callback.release()->resultInThread(std::move(t.value()));
-        }
-      });
+    // The request is served below when this host is the one routed to
+    if (!router_->IsLocalClient(clients[0].get())) {
+      apache::thrift::RpcOptions options;
+      deadline.applyTo(&options);
+      common::Trace::applyTo(common::Trace::current(), &options);
+      clients[0]->future_bumpCounter(options, *request).then(
+        [ callback = std::move(callback), permit = std::move(permit) ]
+        (folly::Try<::counter::BumpResponse>&& t) mutable {
+          if (t.hasException()) {
+            callback.release()->exceptionInThread(t.exception());
+          } else {
+            callback.release()->resultInThread(std::move(t.value()));
+          }
+        });
 
-    return;
+      return;
+    }
+    common::Stats::get()->Incr(kRoutedInProcess);
   }
 
   auto db_name = router_->GetDBName(request->segment, request->counter_name);
@@ -209,21 +542,326 @@ void CounterHandler::async_tm_bumpCounter(
     return;
   }
 
-  rocksdb::WriteBatch write_batch;
-  write_batch.Merge(
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  if (coalescer_) {
+    // The permit is not held until the flush, as waiting for it takes no
+    // server resources
+    coalescer_->Add(db_name, request->counter_name, request->counter_delta)
+      .then([ callback = std::move(callback) ]
+            (rocksdb::Status&& status) mutable {
+        replyWithStatus<BumpResponse>(status, &callback);
+      });
+    return;
+  }
+
+  auto write_batch = replicator::WriteBatchPool::Get();
+  write_batch->Merge(
     request->counter_name,
     rocksdb::Slice(reinterpret_cast<const char*>(&request->counter_delta),
                    sizeof(request->counter_delta)));
 
-  auto status = db->Write(write_options_, &write_batch);
-  if (status.ok()) {
-    callback.release()->resultInThread(BumpResponse());
+  auto status = db->Write(write_options_, write_batch.get());
+  replyWithStatus<BumpResponse>(status, &callback);
+}
+
+void CounterHandler::async_tm_getCounters(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<::counter::GetCountersResponse>>> callback,
+    std::unique_ptr<::counter::GetCountersRequest> request) {
+  common::Stats::get()->Incr(kApiGetCounters);
+  common::Stats::get()->AddMetric(kApiCountersBatchSize,
+                                  request->counter_names.size());
+  common::Timer timer(kApiGetCountersMs);
+  common::ScopedTrace trace(
+    common::Trace::fromRequest(callback->getConnectionContext()));
+  common::TraceSpan span("counter_multi_get");
+
+  const auto deadline =
+    common::Deadline::fromRequest(callback->getConnectionContext());
+  if (dropIfExpired(deadline, &callback)) {
     return;
   }
 
-  ex.code = ErrorCode::ROCKSDB_ERROR;
-  ex.msg = status.ToString();
-  callback.release()->exceptionInThread(std::move(ex));
+  // Reads are shed before writes
+  auto permit = admitOrShed(&admission_controller_,
+                            common::AdmissionController::Priority::LOW,
+                            &callback);
+  if (permit == nullptr) {
+    return;
+  }
+
+  CounterException ex;
+  if (request->counter_names.empty()) {
+    callback.release()->resultInThread(GetCountersResponse());
+    return;
+  }
+
+  if (request->need_routing) {
+    if (router_->GetShardNumberFor(request->segment) == 0) {
+      ex.code = ErrorCode::SERVER_NOT_FOUND;
+      ex.msg = "Unknown segment: " + request->segment;
+      callback.release()->exceptionInThread(std::move(ex));
+      return;
+    }
+
+    const auto segment = request->segment;
+    const auto trace_id = common::Trace::current();
+    router_->ScatterGather(
+      segment, request->counter_names, true /* for_read */,
+      [segment, deadline, trace_id]
+      (const std::shared_ptr<CounterAsyncClient>& client,
+       const std::map<uint32_t, std::vector<std::string>>& shard_to_keys) {
+        GetCountersRequest host_request;
+        host_request.segment = segment;
+        host_request.need_routing = false;
+        for (const auto& shard_keys : shard_to_keys) {
+          host_request.counter_names.insert(host_request.counter_names.end(),
+                                            shard_keys.second.begin(),
+                                            shard_keys.second.end());
+        }
+
+        apache::thrift::RpcOptions options;
+        deadline.applyTo(&options);
+        common::Trace::applyTo(trace_id, &options);
+        return client->future_getCounters(options, host_request);
+      },
+      batchTimeout(deadline)).then(
+      [ callback = std::move(callback), permit = std::move(permit) ]
+      (common::ThriftRouter<CounterAsyncClient>::ScatterGatherResult<
+         GetCountersResponse>&& result) mutable {
+        if (failIfAnyShardFailed(&result, &callback)) {
+          return;
+        }
+
+        GetCountersResponse res;
+        for (auto& host_response : result.responses) {
+          auto& values = host_response.second.counter_values;
+          res.counter_values.insert(values.begin(), values.end());
+        }
+        callback.release()->resultInThread(std::move(res));
+      });
+
+    return;
+  }
+
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  // One MultiGet() per db
+  std::map<std::string, std::vector<rocksdb::Slice>> db_to_keys;
+  for (const auto& counter_name : request->counter_names) {
+    db_to_keys[router_->GetDBName(request->segment, counter_name)]
+      .emplace_back(counter_name);
+  }
+
+  GetCountersResponse res;
+  for (const auto& db_keys : db_to_keys) {
+    auto db = getDB(db_keys.first, &ex);
+    if (db == nullptr) {
+      callback.release()->exceptionInThread(std::move(ex));
+      return;
+    }
+
+    const auto& keys = db_keys.second;
+    std::vector<rocksdb::PinnableSlice> values(keys.size());
+    std::vector<rocksdb::Status> statuses(keys.size());
+    auto read = [&] {
+      db->MultiGet(read_options_, keys.size(), keys.data(), values.data(),
+                   statuses.data());
+    };
+    std::vector<int64_t> pending(keys.size(), 0);
+    if (coalescer_) {
+      std::vector<std::string> key_strings;
+      key_strings.reserve(keys.size());
+      for (const auto& key : keys) {
+        key_strings.push_back(key.ToString());
+      }
+      pending = coalescer_->ReadWithPending(db_keys.first, key_strings, read);
+    } else {
+      read();
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (statuses[i].IsNotFound()) {
+        if (pending[i] != 0) {
+          res.counter_values[keys[i].ToString()] = pending[i];
+        }
+        continue;
+      }
+
+      if (!statuses[i].ok()) {
+        ex.code = ErrorCode::ROCKSDB_ERROR;
+        ex.msg = statuses[i].ToString();
+        callback.release()->exceptionInThread(std::move(ex));
+        return;
+      }
+
+      if (values[i].size() != sizeof(int64_t)) {
+        ex.code = ErrorCode::CORRUPTED_DATA;
+        ex.msg = "Corrupted data found";
+        callback.release()->exceptionInThread(std::move(ex));
+        return;
+      }
+
+      int64_t value;
+      memcpy(&value, values[i].data(), values[i].size());
+      res.counter_values[keys[i].ToString()] = value + pending[i];
+    }
+  }
+
+  callback.release()->resultInThread(std::move(res));
+}
+
+void CounterHandler::async_tm_bumpCounters(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<::counter::BumpCountersResponse>>> callback,
+    std::unique_ptr<::counter::BumpCountersRequest> request) {
+  common::Stats::get()->Incr(kApiBumpCounters);
+  common::Stats::get()->AddMetric(kApiCountersBatchSize,
+                                  request->counter_deltas.size());
+  common::Timer timer(kApiBumpCountersMs);
+  common::ScopedTrace trace(
+    common::Trace::fromRequest(callback->getConnectionContext()));
+  common::TraceSpan span("counter_multi_bump");
+
+  const auto deadline =
+    common::Deadline::fromRequest(callback->getConnectionContext());
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  auto permit = admitOrShed(&admission_controller_,
+                            common::AdmissionController::Priority::NORMAL,
+                            &callback);
+  if (permit == nullptr) {
+    return;
+  }
+
+  CounterException ex;
+  if (request->counter_deltas.empty()) {
+    callback.release()->resultInThread(BumpCountersResponse());
+    return;
+  }
+
+  if (request->need_routing) {
+    if (router_->GetShardNumberFor(request->segment) == 0) {
+      ex.code = ErrorCode::SERVER_NOT_FOUND;
+      ex.msg = "Unknown segment: " + request->segment;
+      callback.release()->exceptionInThread(std::move(ex));
+      return;
+    }
+
+    std::vector<std::string> counter_names;
+    counter_names.reserve(request->counter_deltas.size());
+    for (const auto& counter_delta : request->counter_deltas) {
+      counter_names.push_back(counter_delta.first);
+    }
+
+    std::shared_ptr<const BumpCountersRequest> shared_request(
+      std::move(request));
+    const auto trace_id = common::Trace::current();
+    router_->ScatterGather(
+      shared_request->segment, counter_names, false /* for_read */,
+      [shared_request, deadline, trace_id]
+      (const std::shared_ptr<CounterAsyncClient>& client,
+       const std::map<uint32_t, std::vector<std::string>>& shard_to_keys) {
+        BumpCountersRequest host_request;
+        host_request.segment = shared_request->segment;
+        host_request.need_routing = false;
+        for (const auto& shard_keys : shard_to_keys) {
+          for (const auto& counter_name : shard_keys.second) {
+            host_request.counter_deltas[counter_name] =
+              shared_request->counter_deltas.at(counter_name);
+          }
+        }
+
+        apache::thrift::RpcOptions options;
+        deadline.applyTo(&options);
+        common::Trace::applyTo(trace_id, &options);
+        return client->future_bumpCounters(options, host_request);
+      },
+      batchTimeout(deadline)).then(
+      [ callback = std::move(callback), permit = std::move(permit) ]
+      (common::ThriftRouter<CounterAsyncClient>::ScatterGatherResult<
+         BumpCountersResponse>&& result) mutable {
+        if (failIfAnyShardFailed(&result, &callback)) {
+          return;
+        }
+
+        callback.release()->resultInThread(BumpCountersResponse());
+      });
+
+    return;
+  }
+
+  if (dropIfExpired(deadline, &callback)) {
+    return;
+  }
+
+  if (coalescer_) {
+    std::vector<folly::Future<rocksdb::Status>> futures;
+    futures.reserve(request->counter_deltas.size());
+    for (const auto& counter_delta : request->counter_deltas) {
+      auto db_name = router_->GetDBName(request->segment, counter_delta.first);
+      if (getDB(db_name, &ex) == nullptr) {
+        callback.release()->exceptionInThread(std::move(ex));
+        return;
+      }
+
+      futures.push_back(coalescer_->Add(db_name, counter_delta.first,
+                                        counter_delta.second));
+    }
+
+    folly::collectAll(futures).then(
+      [ callback = std::move(callback) ]
+      (std::vector<folly::Try<rocksdb::Status>>&& tries) mutable {
+        for (auto& t : tries) {
+          if (!t.value().ok()) {
+            replyWithStatus<BumpCountersResponse>(t.value(), &callback);
+            return;
+          }
+        }
+
+        callback.release()->resultInThread(BumpCountersResponse());
+      });
+    return;
+  }
+
+  // One WriteBatch of merges per db
+  std::map<std::string, replicator::WriteBatchPool::Handle> db_to_batch;
+  for (const auto& counter_delta : request->counter_deltas) {
+    const auto& delta = counter_delta.second;
+    auto& batch =
+      db_to_batch[router_->GetDBName(request->segment, counter_delta.first)];
+    if (batch == nullptr) {
+      batch = replicator::WriteBatchPool::Get();
+    }
+    batch->Merge(counter_delta.first,
+                 rocksdb::Slice(reinterpret_cast<const char*>(&delta),
+                                sizeof(delta)));
+  }
+
+  for (auto& db_batch : db_to_batch) {
+    auto db = getDB(db_batch.first, &ex);
+    if (db == nullptr) {
+      callback.release()->exceptionInThread(std::move(ex));
+      return;
+    }
+
+    auto status = db->Write(write_options_, db_batch.second.get());
+    if (!status.ok()) {
+      ex.code = ErrorCode::ROCKSDB_ERROR;
+      ex.msg = status.ToString();
+      callback.release()->exceptionInThread(std::move(ex));
+      return;
+    }
+  }
+
+  callback.release()->resultInThread(BumpCountersResponse());
 }
 
 }  // namespace counter
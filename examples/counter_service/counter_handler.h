@@ -21,8 +21,10 @@
 #include <memory>
 #include <string>
 
+#include "examples/counter_service/bump_coalescer.h"
 #include "examples/counter_service/counter_router.h"
 #include "examples/counter_service/thrift/gen-cpp2/Counter.h"
+#include "common/deadline.h"
 #include "rocksdb_admin/admin_handler.h"
 
 namespace counter {
@@ -36,15 +38,12 @@ class CounterHandler
     admin::RocksDBOptionsGeneratorType rocksdb_options,
     std::unique_ptr<CounterRouter> router,
     rocksdb::WriteOptions write_options,
-    rocksdb::ReadOptions read_options)
-      : AdminHandler(std::move(db_manager), std::move(rocksdb_options))
-      , router_(std::move(router))
-      , write_options_(std::move(write_options))
-      , read_options_(std::move(read_options)) {}
+    rocksdb::ReadOptions read_options);
 
   virtual ~CounterHandler() {}
 
-  void async_tm_getCounter(
+  // Called on the IO thread
+  void async_eb_getCounter(
       std::unique_ptr<apache::thrift::HandlerCallback<
         std::unique_ptr<::counter::GetResponse>>> callback,
       std::unique_ptr<::counter::GetRequest> request) override;
@@ -59,12 +58,41 @@ class CounterHandler
         std::unique_ptr<::counter::BumpResponse>>> callback,
       std::unique_ptr<::counter::BumpRequest> request) override;
 
+  void async_tm_getCounters(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<::counter::GetCountersResponse>>> callback,
+      std::unique_ptr<::counter::GetCountersRequest> request) override;
+
+  void async_tm_bumpCounters(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<::counter::BumpCountersResponse>>> callback,
+      std::unique_ptr<::counter::BumpCountersRequest> request) override;
+
  private:
+  // Serve a getCounter call on the IO thread, if it is local and its counter
+  // is in memory. Return false, leaving callback and request alone, if it
+  // has to go to a worker.
+  bool tryGetCounterInline(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<::counter::GetResponse>>>* callback,
+      const ::counter::GetRequest& request,
+      const common::Deadline& deadline);
+
+  // deadline is taken on the IO thread, so that it counts the time queued
+  // for a worker
+  void getCounterInWorker(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<::counter::GetResponse>>> callback,
+      std::unique_ptr<::counter::GetRequest> request,
+      const common::Deadline& deadline);
+
   std::shared_ptr<::admin::ApplicationDB> getDB(const std::string& db_name,
                                                 CounterException* ex);
   std::unique_ptr<CounterRouter> router_;
   const rocksdb::WriteOptions write_options_;
   const rocksdb::ReadOptions read_options_;
+  // nullptr unless --counter_bump_coalesce_ms is set
+  std::unique_ptr<BumpCoalescer> coalescer_;
 };
 
 }  // namespace counter
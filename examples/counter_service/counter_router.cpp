@@ -18,9 +18,10 @@
 
 #include "examples/counter_service/counter_router.h"
 
-namespace {
+namespace counter {
 
-uint32_t ShardId(const std::string& key, const uint32_t num_shards) {
+uint32_t CounterRouter::ShardId(const std::string& key,
+                                const uint32_t num_shards) {
   int hash_code = 0;
   for (size_t i = 0; i < key.size(); i++) {
     hash_code = 31 * hash_code + key[i];
@@ -29,10 +30,6 @@ uint32_t ShardId(const std::string& key, const uint32_t num_shards) {
   return abs(hash_code % num_shards);
 }
 
-}  // anonymous namespace
-
-namespace counter {
-
 std::string CounterRouter::GetDBName(const std::string& segment,
                                      const std::string& key) {
   auto num_shards = router_.getShardNumberFor(segment);
@@ -18,7 +18,11 @@
 
 #pragma once
 
+#include <chrono>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "examples/counter_service/thrift/gen-cpp2/Counter.h"
 #include "common/thrift_router.h"
@@ -38,7 +42,48 @@ class CounterRouter {
                      const bool for_read,
                      std::vector<std::shared_ptr<CounterAsyncClient>>* clients);
 
+  // See common::ThriftRouter::setLocalAddress()
+  void SetLocalAddress(const folly::SocketAddress& addr) {
+    router_.setLocalAddress(addr);
+  }
+
+  // Whether client, from GetClientsFor(), points to this process
+  bool IsLocalClient(const CounterAsyncClient* client) {
+    return router_.isLocalClient(client);
+  }
+
+  // The number of shards of segment, 0 if it isn't in the config
+  uint32_t GetShardNumberFor(const std::string& segment) {
+    return router_.getShardNumberFor(segment);
+  }
+
+  /*
+   * Send keys to the hosts serving them, one request per host for all its
+   * shards, and collect the responses. The segment must have shards.
+   * See common::ThriftRouter::scatterGather() for request and the result.
+   */
+  template <typename RequestFn>
+  auto ScatterGather(const std::string& segment,
+                     const std::vector<std::string>& keys,
+                     const bool for_read,
+                     RequestFn&& request,
+                     const std::chrono::milliseconds timeout) {
+    using RouterType = common::ThriftRouter<CounterAsyncClient>;
+    const auto num_shards = router_.getShardNumberFor(segment);
+    return router_.scatterGather(
+      router_.getSegmentHandle(segment),
+      for_read ? RouterType::Role::ANY : RouterType::Role::MASTER,
+      keys,
+      [num_shards] (const std::string& key) {
+        return ShardId(key, num_shards);
+      },
+      std::forward<RequestFn>(request),
+      timeout);
+  }
+
  private:
+  static uint32_t ShardId(const std::string& key, const uint32_t num_shards);
+
   common::ThriftRouter<CounterAsyncClient> router_;
 };
 
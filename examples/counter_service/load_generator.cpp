@@ -0,0 +1,455 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// Open loop load generator for the counter service.
+//
+// Requests are sent on a fixed schedule at --qps, whether or not earlier
+// ones have completed, so a slow server can't slow down the load it is
+// measured with. Latency is reported twice:
+//   corrected:   from the time the request should have been sent, which
+//                accounts for the requests a stalled server held back
+//                (coordinated omission)
+//   uncorrected: from the time it was actually sent
+//
+// Counters are picked from --key_count keys with a Zipfian distribution of
+// parameter --zipf_theta (0 for uniform). Ranks are scrambled, so that the
+// hottest keys land on different shards.
+//
+// Requests either go to --server_ip and are routed by it, or with --direct
+// straight to the hosts serving their shards according to
+// --shard_config_path.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/availability_zone.h"
+#include "common/thrift_client_pool.h"
+#include "examples/counter_service/counter_router.h"
+#include "examples/counter_service/thrift/gen-cpp2/Counter.h"
+#include "folly/Conv.h"
+#include "folly/Format.h"
+#include "folly/Hash.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+DEFINE_string(server_ip, "127.0.0.1", "The server to send routed requests to");
+DEFINE_int32(server_port, 9090, "The port of the servers");
+DEFINE_bool(direct, false,
+            "Send requests to the hosts serving them according to "
+            "--shard_config_path instead of having --server_ip route them");
+DEFINE_string(segment, "default", "The segment of the counters");
+
+DEFINE_int32(qps, 1000, "The target rate of requests, over all threads");
+DEFINE_bool(poisson_arrivals, false,
+            "Space requests exponentially instead of evenly");
+DEFINE_int32(thread_num, 4, "The number of sending threads");
+DEFINE_int32(duration_sec, 60, "How long to send requests for");
+DEFINE_int32(warmup_sec, 5,
+             "Requests scheduled in the first this many seconds are not "
+             "measured");
+DEFINE_int32(max_in_flight, 100000,
+             "Sending blocks while this many requests are in flight. Time "
+             "spent blocked counts towards corrected latency.");
+DEFINE_int32(report_interval_sec, 10, "How often to print progress");
+DEFINE_int32(timeout_ms, 1000, "The timeout of each request");
+
+DEFINE_int32(get_weight, 50, "Relative weight of getCounter requests");
+DEFINE_int32(set_weight, 10, "Relative weight of setCounter requests");
+DEFINE_int32(bump_weight, 40, "Relative weight of bumpCounter requests");
+
+DEFINE_int64(key_count, 1000000, "The number of distinct counters");
+DEFINE_double(zipf_theta, 0.99,
+              "Zipfian skew of the counters accessed, 0 for uniform. Must be "
+              "below 1.");
+DEFINE_string(key_prefix, "load_", "The prefix of counter names");
+
+DECLARE_string(shard_config_path);
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using ClientType = counter::CounterAsyncClient;
+
+/*
+ * Log linear histogram of latencies in us, with 64 buckets per power of two,
+ * so that percentiles are within 1.6% of the exact value. Can be added to
+ * from any thread.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : buckets_(kNumBuckets) {
+    for (auto& bucket : buckets_) {
+      bucket.store(0);
+    }
+  }
+
+  void add(uint64_t us) {
+    buckets_[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The lower bound of the bucket holding the p-th percentile
+  uint64_t percentile(double p) const {
+    uint64_t total = 0;
+    for (const auto& bucket : buckets_) {
+      total += bucket.load();
+    }
+    if (total == 0) {
+      return 0;
+    }
+
+    const auto rank = static_cast<uint64_t>(std::ceil(p / 100 * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i].load();
+      if (seen >= std::max<uint64_t>(rank, 1)) {
+        return lowerBoundOf(i);
+      }
+    }
+    return lowerBoundOf(buckets_.size() - 1);
+  }
+
+ private:
+  static const int kSubBits = 6;
+  static const uint64_t kSubBuckets = 1 << kSubBits;
+  static const size_t kNumBuckets = kSubBuckets * (64 - kSubBits + 1);
+
+  static size_t bucketOf(uint64_t v) {
+    if (v < kSubBuckets) {
+      return v;
+    }
+    const int exp = 63 - __builtin_clzll(v);
+    const uint64_t sub = (v >> (exp - kSubBits)) & (kSubBuckets - 1);
+    return kSubBuckets * (exp - kSubBits + 1) + sub;
+  }
+
+  static uint64_t lowerBoundOf(size_t bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    const int exp = bucket / kSubBuckets + kSubBits - 1;
+    const uint64_t sub = bucket % kSubBuckets;
+    return (kSubBuckets + sub) << (exp - kSubBits);
+  }
+
+  std::vector<std::atomic<uint64_t>> buckets_;
+};
+
+struct OpStats {
+  explicit OpStats(const char* op_name) : name(op_name), ok(0), errors(0) {}
+
+  const char* const name;
+  std::atomic<uint64_t> ok;
+  std::atomic<uint64_t> errors;
+  LatencyHistogram corrected;
+  LatencyHistogram uncorrected;
+};
+
+/*
+ * Zipfian ranks in [0, n), after Gray et al., "Quickly generating
+ * billion-record synthetic databases", as used by YCSB.
+ */
+class ZipfianGenerator {
+ public:
+  ZipfianGenerator(uint64_t n, double theta)
+      : n_(n)
+      , zetan_(zeta(n, theta))
+      , alpha_(1 / (1 - theta))
+      , eta_((1 - std::pow(2.0 / n, 1 - theta)) /
+             (1 - zeta(2, theta) / zetan_))
+      , half_pow_theta_(1 + std::pow(0.5, theta)) {}
+
+  template <typename Rng>
+  uint64_t next(Rng* rng) {
+    const double u = std::uniform_real_distribution<double>(0, 1)(*rng);
+    const double uz = u * zetan_;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < half_pow_theta_) {
+      return 1;
+    }
+    const auto rank =
+      static_cast<uint64_t>(n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+    return std::min(n_ - 1, rank);
+  }
+
+ private:
+  static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+      sum += 1 / std::pow(i, theta);
+    }
+    return sum;
+  }
+
+  const uint64_t n_;
+  const double zetan_;
+  const double alpha_;
+  const double eta_;
+  const double half_pow_theta_;
+};
+
+enum class Op { GET, SET, BUMP };
+
+class LoadGenerator {
+ public:
+  LoadGenerator()
+      : get_stats_("get")
+      , set_stats_("set")
+      , bump_stats_("bump")
+      , in_flight_(0)
+      , zipf_(FLAGS_zipf_theta > 0 ?
+              std::make_unique<ZipfianGenerator>(FLAGS_key_count,
+                                                 FLAGS_zipf_theta) :
+              nullptr) {
+    if (FLAGS_direct) {
+      router_ = std::make_unique<counter::CounterRouter>(
+        common::getAvailabilityZone(), FLAGS_shard_config_path);
+    }
+  }
+
+  void run() {
+    const auto start = Clock::now();
+    measure_start_ = start + std::chrono::seconds(FLAGS_warmup_sec);
+    const auto end = start + std::chrono::seconds(FLAGS_duration_sec);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+      threads.emplace_back([this, i, start, end] { send(i, start, end); });
+    }
+
+    auto next_report = start + std::chrono::seconds(FLAGS_report_interval_sec);
+    while (Clock::now() < end) {
+      std::this_thread::sleep_until(std::min(next_report, end));
+      if (Clock::now() >= next_report) {
+        printProgress();
+        next_report += std::chrono::seconds(FLAGS_report_interval_sec);
+      }
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    // Requests time out, so in_flight_ drops to 0
+    while (in_flight_.load() > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    const auto measured_sec = std::chrono::duration<double>(
+      end - std::max(start, measure_start_)).count();
+    printSummary(measured_sec);
+  }
+
+ private:
+  void send(int thread_index, Clock::time_point start, Clock::time_point end) {
+    std::mt19937_64 rng(std::random_device{}() + thread_index);
+    const double per_thread_qps =
+      static_cast<double>(FLAGS_qps) / FLAGS_thread_num;
+    std::exponential_distribution<double> exp_gap(per_thread_qps);
+    std::discrete_distribution<int> op_dist(
+      { static_cast<double>(FLAGS_get_weight),
+        static_cast<double>(FLAGS_set_weight),
+        static_cast<double>(FLAGS_bump_weight) });
+    std::uniform_int_distribution<uint64_t> uniform_key(0, FLAGS_key_count - 1);
+
+    // Spread the threads over the first interval
+    double offset_sec = thread_index / static_cast<double>(FLAGS_qps);
+    while (true) {
+      const auto intended = start +
+        std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(offset_sec));
+      if (intended >= end) {
+        return;
+      }
+      offset_sec += FLAGS_poisson_arrivals ? exp_gap(rng) : 1 / per_thread_qps;
+
+      std::this_thread::sleep_until(intended);
+      while (in_flight_.load() >= FLAGS_max_in_flight) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+
+      const uint64_t rank = zipf_ ? zipf_->next(&rng) : uniform_key(rng);
+      const auto key = FLAGS_key_prefix + folly::to<std::string>(
+        folly::hash::twang_mix64(rank) % FLAGS_key_count);
+      const auto op = static_cast<Op>(op_dist(rng));
+      issue(op, key, rng(), intended);
+    }
+  }
+
+  std::shared_ptr<ClientType> clientFor(const std::string& key, bool for_read) {
+    if (!FLAGS_direct) {
+      return client_pool_.getClient(FLAGS_server_ip, FLAGS_server_port);
+    }
+
+    std::vector<std::shared_ptr<ClientType>> clients;
+    router_->GetClientsFor(FLAGS_segment, key, for_read, &clients);
+    return clients.empty() ? nullptr : clients[0];
+  }
+
+  void issue(Op op, const std::string& key, int64_t value,
+             Clock::time_point intended) {
+    auto stats = op == Op::GET ? &get_stats_ :
+      (op == Op::SET ? &set_stats_ : &bump_stats_);
+    const bool measured = intended >= measure_start_;
+
+    auto client = clientFor(key, op == Op::GET);
+    if (client == nullptr) {
+      if (measured) {
+        ++stats->errors;
+      }
+      return;
+    }
+
+    apache::thrift::RpcOptions options;
+    options.setTimeout(std::chrono::milliseconds(FLAGS_timeout_ms));
+    const auto sent = Clock::now();
+    ++in_flight_;
+
+    auto done = [this, stats, measured, intended, sent] (bool ok) {
+      const auto now = Clock::now();
+      if (measured) {
+        if (ok) {
+          ++stats->ok;
+          stats->corrected.add(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+              now - intended).count());
+          stats->uncorrected.add(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+              now - sent).count());
+        } else {
+          ++stats->errors;
+        }
+      }
+      --in_flight_;
+    };
+
+    switch (op) {
+    case Op::GET: {
+      counter::GetRequest request;
+      request.counter_name = key;
+      request.segment = FLAGS_segment;
+      request.need_routing = !FLAGS_direct;
+      client->future_getCounter(options, request).then(
+        [done] (folly::Try<counter::GetResponse>&& t) {
+          // Counters never set are reported as errors by the server
+          done(!t.hasException());
+        });
+      break;
+    }
+    case Op::SET: {
+      counter::SetRequest request;
+      request.counter_name = key;
+      request.counter_value = value;
+      request.segment = FLAGS_segment;
+      request.need_routing = !FLAGS_direct;
+      client->future_setCounter(options, request).then(
+        [done] (folly::Try<counter::SetResponse>&& t) {
+          done(!t.hasException());
+        });
+      break;
+    }
+    case Op::BUMP: {
+      counter::BumpRequest request;
+      request.counter_name = key;
+      request.counter_delta = 1;
+      request.segment = FLAGS_segment;
+      request.need_routing = !FLAGS_direct;
+      client->future_bumpCounter(options, request).then(
+        [done] (folly::Try<counter::BumpResponse>&& t) {
+          done(!t.hasException());
+        });
+      break;
+    }
+    }
+  }
+
+  void printProgress() {
+    uint64_t ok = 0;
+    uint64_t errors = 0;
+    for (const auto stats : { &get_stats_, &set_stats_, &bump_stats_ }) {
+      ok += stats->ok.load();
+      errors += stats->errors.load();
+    }
+    LOG(INFO) << "Completed " << ok << " requests, " << errors
+              << " errors, " << in_flight_.load() << " in flight";
+  }
+
+  void printSummary(double measured_sec) {
+    printf("%-5s %10s %8s %10s  %-11s %8s %8s %8s %8s %8s\n",
+           "op", "ok", "errors", "qps", "latency us",
+           "p50", "p90", "p99", "p99.9", "p99.99");
+    for (const auto stats : { &get_stats_, &set_stats_, &bump_stats_ }) {
+      const auto ok = stats->ok.load();
+      const auto qps = measured_sec > 0 ? ok / measured_sec : 0;
+      const std::pair<const char*, const LatencyHistogram*> histograms[] = {
+        { "corrected", &stats->corrected },
+        { "uncorrected", &stats->uncorrected },
+      };
+      for (const auto& histogram : histograms) {
+        const bool first = histogram.second == &stats->corrected;
+        printf("%-5s %10s %8s %10s  %-11s %8lu %8lu %8lu %8lu %8lu\n",
+               first ? stats->name : "",
+               first ? folly::to<std::string>(ok).c_str() : "",
+               first ?
+                 folly::to<std::string>(stats->errors.load()).c_str() : "",
+               first ? folly::sformat("{:.1f}", qps).c_str() : "",
+               histogram.first,
+               histogram.second->percentile(50),
+               histogram.second->percentile(90),
+               histogram.second->percentile(99),
+               histogram.second->percentile(99.9),
+               histogram.second->percentile(99.99));
+      }
+    }
+  }
+
+  common::ThriftClientPool<ClientType> client_pool_;
+  std::unique_ptr<counter::CounterRouter> router_;
+
+  OpStats get_stats_;
+  OpStats set_stats_;
+  OpStats bump_stats_;
+  std::atomic<int64_t> in_flight_;
+
+  std::unique_ptr<ZipfianGenerator> zipf_;
+  Clock::time_point measure_start_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_GT(FLAGS_qps, 0);
+  CHECK_GT(FLAGS_thread_num, 0);
+  CHECK_GT(FLAGS_key_count, 0);
+  CHECK_LT(FLAGS_zipf_theta, 1.0);
+  CHECK_GT(FLAGS_get_weight + FLAGS_set_weight + FLAGS_bump_weight, 0);
+  CHECK(!FLAGS_direct || !FLAGS_shard_config_path.empty())
+    << "--direct needs --shard_config_path";
+
+  LoadGenerator generator;
+  generator.run();
+}
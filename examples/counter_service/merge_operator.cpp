@@ -18,29 +18,83 @@
 
 #include "examples/counter_service/merge_operator.h"
 
+#include <cstring>
+#include <iterator>
+
 namespace counter {
 
-bool CounterMergeOperator::Merge(const rocksdb::Slice& key,
-                                  const rocksdb::Slice* existing_value,
-                                  const rocksdb::Slice& value,
-                                  std::string* new_value,
-                                  rocksdb::Logger* logger) const {
-  if (existing_value == nullptr) {
-    *new_value = value.ToString();
-    return true;
+namespace {
+
+// Add the counters of slices in [begin, end) to *sum. Returns false if any
+// of them is not a counter.
+template <typename Iterator>
+bool addCounters(Iterator begin, Iterator end, int64_t* sum) {
+  int64_t total = *sum;
+  for (auto itor = begin; itor != end; ++itor) {
+    if (itor->size() != sizeof(int64_t)) {
+      return false;
+    }
+
+    int64_t counter;
+    memcpy(&counter, itor->data(), sizeof(counter));
+    total += counter;
+  }
+
+  *sum = total;
+  return true;
+}
+
+void setCounter(int64_t counter, std::string* value) {
+  value->assign(reinterpret_cast<const char*>(&counter), sizeof(counter));
+}
+
+}  // namespace
+
+bool CounterMergeOperator::FullMergeV2(
+    const MergeOperationInput& merge_in,
+    MergeOperationOutput* merge_out) const {
+  int64_t counter = 0;
+  if (merge_in.existing_value != nullptr &&
+      !addCounters(merge_in.existing_value, merge_in.existing_value + 1,
+                   &counter)) {
+    return false;
+  }
+
+  if (!addCounters(merge_in.operand_list.begin(), merge_in.operand_list.end(),
+                   &counter)) {
+    return false;
+  }
+
+  setCounter(counter, &merge_out->new_value);
+  return true;
+}
+
+bool CounterMergeOperator::PartialMerge(const rocksdb::Slice& key,
+                                        const rocksdb::Slice& left_operand,
+                                        const rocksdb::Slice& right_operand,
+                                        std::string* new_value,
+                                        rocksdb::Logger* logger) const {
+  const rocksdb::Slice operands[] = { left_operand, right_operand };
+  int64_t counter = 0;
+  if (!addCounters(std::begin(operands), std::end(operands), &counter)) {
+    return false;
   }
 
-  if (existing_value->size() != sizeof(int64_t) ||
-      value.size() != sizeof(int64_t)) {
+  setCounter(counter, new_value);
+  return true;
+}
+
+bool CounterMergeOperator::PartialMergeMulti(
+    const rocksdb::Slice& key,
+    const std::deque<rocksdb::Slice>& operand_list,
+    std::string* new_value,
+    rocksdb::Logger* logger) const {
+  int64_t counter = 0;
+  if (!addCounters(operand_list.begin(), operand_list.end(), &counter)) {
     return false;
   }
 
-  int64_t old_counter;
-  int64_t counter;
-  memcpy(&old_counter, existing_value->data(), sizeof(old_counter));
-  memcpy(&counter, value.data(), sizeof(counter));
-  counter += old_counter;
-  new_value->assign(reinterpret_cast<const char*>(&counter), sizeof(counter));
+  setCounter(counter, new_value);
   return true;
 }
 
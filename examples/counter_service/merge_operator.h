@@ -18,32 +18,37 @@
 
 #pragma once
 
+#include <deque>
 #include <string>
 
 #include "rocksdb/merge_operator.h"
 
 namespace counter {
 
-// Gives the client a way to express the read -> modify -> write semantics
-// key:           (IN) The key that's associated with this merge operation.
-// existing_value:(IN) null indicates the key does not exist before this op
-// value:         (IN) the value to update/merge the existing_value with
-// new_value:    (OUT) Client is responsible for filling the merge result
-// here. The string that new_value is pointing to will be empty.
-// logger:        (IN) Client could use this to log errors during merge.
+// Sums int64 counters.
 //
-// Return true on success.
-// All values passed in will be client-specific values. So if this method
-// returns false, it is because client specified bad data or there was
-// internal corruption. The client should assume that this will be treated
-// as an error by the library.
-class CounterMergeOperator : public rocksdb::AssociativeMergeOperator {
+// All the operands of a key are summed in one pass, both when a value is
+// built (FullMergeV2) and when operands are collapsed without the base value
+// (PartialMergeMulti), so reading a counter with a long chain of bumps costs
+// a single loop over them rather than one merge call per operand.
+//
+// Values and operands which are not 8 bytes make the merge fail, which
+// RocksDB reports as corruption.
+class CounterMergeOperator : public rocksdb::MergeOperator {
  public:
-  bool Merge(const rocksdb::Slice& key,
-             const rocksdb::Slice* existing_value,
-             const rocksdb::Slice& value,
-             std::string* new_value,
-             rocksdb::Logger* logger) const override;
+  bool FullMergeV2(const MergeOperationInput& merge_in,
+                   MergeOperationOutput* merge_out) const override;
+
+  bool PartialMerge(const rocksdb::Slice& key,
+                    const rocksdb::Slice& left_operand,
+                    const rocksdb::Slice& right_operand,
+                    std::string* new_value,
+                    rocksdb::Logger* logger) const override;
+
+  bool PartialMergeMulti(const rocksdb::Slice& key,
+                         const std::deque<rocksdb::Slice>& operand_list,
+                         std::string* new_value,
+                         rocksdb::Logger* logger) const override;
 
   const char* Name() const override {
     return "Counter merge operator";
@@ -18,16 +18,24 @@
 
 #include "examples/counter_service/rocksdb_options.h"
 
+#include <algorithm>
+#include <mutex>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
 
-
+#include "common/stats/stats.h"
+#include "common/thrift_router.h"
 #include "examples/counter_service/merge_operator.h"
+#include "folly/FileUtil.h"
 #include "gflags/gflags.h"
+#include "glog/logging.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/env.h"
 #include "rocksdb/filter_policy.h"
 #include "rocksdb/table.h"
+#include "rocksdb/version.h"
+#include "rocksdb_admin/huge_page_allocator.h"
 
 DEFINE_int32(max_compaction_threads,
              std::min(16L, sysconf(_SC_NPROCESSORS_ONLN)),
@@ -40,6 +48,14 @@ DEFINE_uint64(rocksdb_block_cache_size_gb, 20,
               "The size of RocksDB LRU block cache in GB");
 DEFINE_uint64(rocksdb_block_cache_shard_bits, 8,
               "The number of shard bits for RocksDB block cache");
+DEFINE_bool(rocksdb_block_cache_huge_pages, false,
+            "Allocate the blocks of the block cache from huge pages, the "
+            "ones reserved by vm.nr_hugepages first, and transparent huge "
+            "pages otherwise. Ignored before rocksdb 6.0.");
+DEFINE_int32(rocksdb_memtable_huge_page_size_mb, 0,
+             "If positive, allocate the memtables from huge pages of this "
+             "size, which must be reserved by vm.nr_hugepages. RocksDB falls "
+             "back to malloc() without them.");
 DEFINE_uint64(rocksdb_wal_ttl_seconds, 3600, "The WAL ttl for RocksDB");
 DEFINE_int32(rocksdb_block_size_kb, 4,
              "The rocksdb block size in KB.");
@@ -52,12 +68,87 @@ DEFINE_int32(rocksdb_bytes_per_sync_mb, 1,
 DEFINE_int32(rocksdb_wal_bytes_per_sync_mb, 1,
              "The amount of wal per sync.");
 
+DEFINE_string(rocksdb_default_profile, "default",
+              "The RocksDB option profile of segments which don't set "
+              "rocksdb_profile in the shard config. One of default, "
+              "point_lookup, scan and write_heavy.");
+
+DECLARE_string(shard_config_path);
+
 namespace {
 
 const uint64_t KB = 1024;
 const uint64_t MB = 1024 * KB;
 const uint64_t GB = 1024 * MB;
 
+#if ROCKSDB_MAJOR >= 6
+std::shared_ptr<rocksdb::MemoryAllocator> NewBlockCacheAllocator(
+    size_t capacity) {
+  if (!FLAGS_rocksdb_block_cache_huge_pages) {
+    return nullptr;
+  }
+
+  // The free blocks of a size class aren't reused by the others, so don't
+  // map more than the cache may hold
+  auto allocator = std::make_shared<admin::HugePageAllocator>(64 << 20,
+                                                              capacity);
+  std::weak_ptr<admin::HugePageAllocator> weak_allocator = allocator;
+  const auto register_gauge = [&weak_allocator] (
+      const std::string& name,
+      uint64_t (*value)(const admin::HugePageAllocator::Stats&)) {
+    common::Stats::get()->RegisterGauge(name, [weak_allocator, value] {
+        auto allocator = weak_allocator.lock();
+        return allocator ? value(allocator->GetStats()) : 0;
+      });
+  };
+  register_gauge("rocksdb_block_cache_hugetlb_regions",
+                 [] (const admin::HugePageAllocator::Stats& stats) {
+                   return stats.hugetlb_regions;
+                 });
+  register_gauge("rocksdb_block_cache_thp_regions",
+                 [] (const admin::HugePageAllocator::Stats& stats) {
+                   return stats.thp_regions;
+                 });
+  register_gauge("rocksdb_block_cache_allocated_bytes",
+                 [] (const admin::HugePageAllocator::Stats& stats) {
+                   return stats.allocated_bytes;
+                 });
+  register_gauge("rocksdb_block_cache_fallback_allocations",
+                 [] (const admin::HugePageAllocator::Stats& stats) {
+                   return stats.fallback_allocations;
+                 });
+  return allocator;
+}
+#endif
+
+// All profiles share one block cache
+std::shared_ptr<rocksdb::Cache> GetBlockCache() {
+  static const auto cache = [] {
+#if ROCKSDB_MAJOR >= 6
+    rocksdb::LRUCacheOptions options;
+    options.capacity = FLAGS_rocksdb_block_cache_size_gb * GB;
+    options.num_shard_bits = FLAGS_rocksdb_block_cache_shard_bits;
+    options.memory_allocator = NewBlockCacheAllocator(options.capacity);
+    return rocksdb::NewLRUCache(options);
+#else
+    LOG_IF(ERROR, FLAGS_rocksdb_block_cache_huge_pages)
+      << "The block cache can't use huge pages before rocksdb 6.0, ignoring "
+      << "--rocksdb_block_cache_huge_pages";
+    return rocksdb::NewLRUCache(FLAGS_rocksdb_block_cache_size_gb * GB,
+                                FLAGS_rocksdb_block_cache_shard_bits);
+#endif
+  }();
+  return cache;
+}
+
+rocksdb::BlockBasedTableOptions GetTableOptions() {
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_size = FLAGS_rocksdb_block_size_kb * KB;
+  table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10));
+  table_options.block_cache = GetBlockCache();
+  return table_options;
+}
+
 rocksdb::Options __GetRocksdbOptions() {
   rocksdb::Options options;
   options.env = rocksdb::Env::Default();
@@ -70,18 +161,16 @@ rocksdb::Options __GetRocksdbOptions() {
   options.env->SetBackgroundThreads(FLAGS_max_flush_threads,
                                     rocksdb::Env::HIGH);
 
-  rocksdb::BlockBasedTableOptions table_options;
-  table_options.block_size = FLAGS_rocksdb_block_size_kb * KB;
-  table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10));
-  table_options.block_cache = rocksdb::NewLRUCache(
-    FLAGS_rocksdb_block_cache_size_gb * GB,
-    FLAGS_rocksdb_block_cache_shard_bits);
   options.table_factory.reset(
-    rocksdb::NewBlockBasedTableFactory(table_options));
+    rocksdb::NewBlockBasedTableFactory(GetTableOptions()));
 
   options.write_buffer_size = FLAGS_rocksdb_write_buffer_size_mb * MB;
   options.max_write_buffer_number = FLAGS_max_write_buffer_number;
   options.min_write_buffer_number_to_merge = 1;
+  if (FLAGS_rocksdb_memtable_huge_page_size_mb > 0) {
+    options.memtable_huge_page_size =
+      FLAGS_rocksdb_memtable_huge_page_size_mb * MB;
+  }
 
   options.level0_file_num_compaction_trigger = 4;
 
@@ -102,13 +191,122 @@ rocksdb::Options __GetRocksdbOptions() {
   return options;
 }
 
+// Mostly Gets of keys which exist. Index and filters are partitioned, so that
+// only the partitions in use take block cache, and filters are left out of
+// the last level, where Gets of existing keys end anyway.
+rocksdb::Options GetPointLookupOptions() {
+  auto options = __GetRocksdbOptions();
+  auto table_options = GetTableOptions();
+  table_options.index_type =
+    rocksdb::BlockBasedTableOptions::kTwoLevelIndexSearch;
+  table_options.partition_filters = true;
+  table_options.filter_policy.reset(
+    rocksdb::NewBloomFilterPolicy(10, false /* use_block_based_builder */));
+  table_options.cache_index_and_filter_blocks = true;
+  table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+  options.table_factory.reset(
+    rocksdb::NewBlockBasedTableFactory(table_options));
+  options.optimize_filters_for_hits = true;
+  return options;
+}
+
+// Mostly iteration over ranges of keys. Bigger blocks read and compress
+// better, and data below L1 is compressed as it is read sequentially.
+rocksdb::Options GetScanOptions() {
+  auto options = __GetRocksdbOptions();
+  auto table_options = GetTableOptions();
+  table_options.block_size = std::max<uint64_t>(table_options.block_size,
+                                                64 * KB);
+  options.table_factory.reset(
+    rocksdb::NewBlockBasedTableFactory(table_options));
+  options.compression_per_level = {
+    rocksdb::kNoCompression,
+    rocksdb::kNoCompression,
+    rocksdb::kLZ4Compression,
+  };
+  options.compaction_readahead_size = 2 * MB;
+  options.advise_random_on_open = false;
+  return options;
+}
+
+// Mostly writes. Universal compaction rewrites data fewer times than leveled
+// compaction, and bigger memtables absorb more merges of the same counters
+// before they are flushed.
+rocksdb::Options GetWriteHeavyOptions() {
+  auto options = __GetRocksdbOptions();
+  options.compaction_style = rocksdb::kCompactionStyleUniversal;
+  options.write_buffer_size = 4 * FLAGS_rocksdb_write_buffer_size_mb * MB;
+  options.max_write_buffer_number =
+    std::max(FLAGS_max_write_buffer_number, 6);
+  options.min_write_buffer_number_to_merge = 2;
+  options.level0_file_num_compaction_trigger = 8;
+  options.level0_slowdown_writes_trigger = 20;
+  options.level0_stop_writes_trigger = 36;
+  return options;
+}
+
+const std::unordered_map<std::string, rocksdb::Options>& GetProfiles() {
+  static const std::unordered_map<std::string, rocksdb::Options> profiles = {
+    { "default", __GetRocksdbOptions() },
+    { "point_lookup", GetPointLookupOptions() },
+    { "scan", GetScanOptions() },
+    { "write_heavy", GetWriteHeavyOptions() },
+  };
+  return profiles;
+}
+
+// The profile set for segment in the shard config, or the default one. The
+// config is parsed as the router does, so that any of its formats works.
+std::string ReadProfileName(const std::string& segment) {
+  std::string content;
+  if (FLAGS_shard_config_path.empty() ||
+      !folly::readFile(FLAGS_shard_config_path.c_str(), content)) {
+    return FLAGS_rocksdb_default_profile;
+  }
+
+  const auto layout = common::parseConfig(content, "");
+  if (layout == nullptr) {
+    return FLAGS_rocksdb_default_profile;
+  }
+
+  const auto itor = layout->segments.find(segment);
+  if (itor == layout->segments.end() ||
+      itor->second.rocksdb_profile.empty()) {
+    return FLAGS_rocksdb_default_profile;
+  }
+
+  return itor->second.rocksdb_profile;
+}
+
 }  // anonymous namespace
 
 namespace counter {
 
 rocksdb::Options GetRocksdbOptions(const std::string& segment) {
-  static const rocksdb::Options options = __GetRocksdbOptions();
-  return options;
+  static std::mutex mutex;
+  // segment -> profile, resolved once, as the options of an open db can't
+  // change anyway
+  static std::unordered_map<std::string, const rocksdb::Options*> segments;
+
+  std::lock_guard<std::mutex> g(mutex);
+  auto itor = segments.find(segment);
+  if (itor != segments.end()) {
+    return *itor->second;
+  }
+
+  const auto& profiles = GetProfiles();
+  const auto name = ReadProfileName(segment);
+  auto profile = profiles.find(name);
+  if (profile == profiles.end()) {
+    LOG(ERROR) << "Unknown RocksDB profile " << name << " for " << segment
+               << ", using default";
+    profile = profiles.find("default");
+  }
+
+  LOG(INFO) << "Using RocksDB profile " << profile->first << " for "
+            << segment;
+  segments[segment] = &profile->second;
+  return profile->second;
 }
 
 }  // namespace counter
@@ -25,7 +25,15 @@
 namespace counter {
 
 /*
- * Get the rocksdb options used for segment name
+ * Get the rocksdb options used for segment name.
+ *
+ * The options come from the profile named by the rocksdb_profile field of
+ * the segment in the shard config, or --rocksdb_default_profile:
+ *   default:      leveled compaction, uncompressed 4KB blocks, bloom filters
+ *   point_lookup: partitioned index and filters, no last level filters
+ *   scan:         64KB blocks, LZ4 below L1
+ *   write_heavy:  universal compaction, bigger and more memtables
+ * A segment keeps the profile it first got until restart.
  */
 rocksdb::Options GetRocksdbOptions(const std::string& segment);
 
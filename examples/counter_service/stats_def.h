@@ -17,9 +17,18 @@
 NEW_COUNTER_STAT(kApiGetCounter, "api_get_counter")
 NEW_COUNTER_STAT(kApiSetCounter, "api_set_counter")
 NEW_COUNTER_STAT(kApiBumpCounter, "api_bump_counter")
+NEW_COUNTER_STAT(kApiGetCounters, "api_get_counters")
+NEW_COUNTER_STAT(kApiBumpCounters, "api_bump_counters")
+NEW_COUNTER_STAT(kExpiredRequests, "expired_requests")
+NEW_COUNTER_STAT(kRoutedInProcess, "routed_in_process")
+NEW_COUNTER_STAT(kInlineReads, "inline_reads")
+NEW_COUNTER_STAT(kInlineReadSpills, "inline_read_spills")
 
 
 // METRICS
 NEW_METRIC_STAT(kApiGetCounterMs, "api_get_counter_ms")
 NEW_METRIC_STAT(kApiSetCounterMs, "api_set_counter_ms")
 NEW_METRIC_STAT(kApiBumpCounterMs, "api_bump_counter_ms")
+NEW_METRIC_STAT(kApiGetCountersMs, "api_get_counters_ms")
+NEW_METRIC_STAT(kApiBumpCountersMs, "api_bump_counters_ms")
+NEW_METRIC_STAT(kApiCountersBatchSize, "api_counters_batch_size")
@@ -25,6 +25,10 @@ enum ErrorCode {
   ROCKSDB_ERROR = 2,
   CORRUPTED_DATA = 3,
   SERVER_NOT_FOUND = 4,
+  # the caller's deadline expired before the request was handled
+  DEADLINE_EXCEEDED = 5,
+  # the server is overloaded and shed the request
+  OVERLOADED = 6,
 }
 
 exception CounterException {
@@ -64,14 +68,47 @@ struct BumpResponse {
   # for future use
 }
 
+struct GetCountersRequest {
+  1: required list<string> counter_names,
+  2: optional string segment = "default",
+  3: optional bool need_routing = 1,
+}
+
+struct GetCountersResponse {
+  # counters which don't exist are left out
+  1: required map<string, i64> counter_values,
+}
+
+struct BumpCountersRequest {
+  1: required map<string, i64> counter_deltas,
+  2: optional string segment = "default",
+  3: optional bool need_routing = 1,
+}
+
+struct BumpCountersResponse {
+  # for future use
+}
+
 
 service Counter extends rocksdb_admin.Admin {
+  # Called on the IO thread, which serves it when it's cheap, and hands it to
+  # a worker thread otherwise, see --counter_inline_reads
   GetResponse getCounter(1: GetRequest request)
-      throws (1: CounterException e)
+      throws (1: CounterException e) (thread = 'eb')
 
   SetResponse setCounter(1: SetRequest request)
       throws (1: CounterException e)
 
   BumpResponse bumpCounter(1: BumpRequest request)
       throws (1: CounterException e)
+
+  # The batch versions of the above. Counters are grouped by shard, and one
+  # request is sent to each host serving some of them.
+  GetCountersResponse getCounters(1: GetCountersRequest request)
+      throws (1: CounterException e)
+
+  # Not atomic across shards. Each shard applies its deltas in one write, but
+  # deltas of other shards may be applied even if the call fails.
+  BumpCountersResponse bumpCounters(1: BumpCountersRequest request)
+      throws (1: CounterException e)
 }
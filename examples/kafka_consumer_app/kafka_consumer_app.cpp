@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cinttypes>
+#include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -14,6 +18,8 @@
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "librdkafka/rdkafkacpp.h"
+#include "rocksdb/db.h"
+#include "rocksdb/write_batch.h"
 #include "rocksdb_admin/detail/kafka_broker_file_watcher_manager.h"
 
 const uint32_t kKafkaConsumerPoolSize = 1;
@@ -27,8 +33,23 @@ DEFINE_int64(wait_for_seconds_after_catchup, 1, "Wait these many seconds after c
 DEFINE_int64(wait_for_seconds_before_start,
              1,
              "Wait these many seconds before starting consumption");
-DEFINE_int32(sleep_between_message_msec, 1,
-             "Sleeps these many seconds between individual messages consumption");
+DEFINE_int32(sleep_between_message_msec, 0,
+             "Sleeps these many milliseconds between individual messages consumption");
+DEFINE_string(consume_mode, "message",
+              "How messages are consumed: \"message\" hands them over one at a time, "
+              "\"batch\" up to --batch_size at a time");
+DEFINE_int32(batch_size, 100, "Max number of messages per batch in the batch mode");
+DEFINE_int32(parallel_workers, 0,
+             "If not 0, handle the partitions of each consumer on these many threads");
+DEFINE_int32(max_pending_per_partition, 1000,
+             "Max number of messages (or batches) pending per partition with --parallel_workers");
+DEFINE_int32(report_interval_sec, 10,
+             "Report throughput and per partition lag every these many seconds");
+DEFINE_string(rocksdb_dir, "",
+              "If not empty, write the messages into a local RocksDB in this directory, to "
+              "measure the full ingestion path");
+DEFINE_bool(rocksdb_disable_wal, false, "Disable the WAL of writes to --rocksdb_dir");
+DEFINE_bool(print_messages, false, "Print each message consumed");
 DEFINE_string(topic_name,
               "",
               "topic to consume data from");
@@ -42,16 +63,102 @@ using std::endl;
 using std::string;
 using std::unordered_set;
 
+namespace {
+
+int64_t GetCurrentTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Counters shared by all consumers, and read by the reporter thread
+struct BenchmarkStats {
+  explicit BenchmarkStats(const uint32_t num_partitions)
+      : messages(0), bytes(0), last_message_timestamp_ms(num_partitions) {
+    for (auto& ts : last_message_timestamp_ms) {
+      ts.store(-1);
+    }
+  }
+
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> bytes;
+  // The timestamp of the last message of each partition, or -1
+  std::vector<std::atomic<int64_t>> last_message_timestamp_ms;
+};
+
+std::unique_ptr<BenchmarkStats> gStats;
+std::unique_ptr<rocksdb::DB> gDB;
+
+void addToWriteBatch(const RdKafka::Message& message, rocksdb::WriteBatch* batch) {
+  const rocksdb::Slice value(static_cast<const char*>(message.payload()), message.len());
+  if (message.key_pointer() != nullptr) {
+    batch->Put(rocksdb::Slice(static_cast<const char*>(message.key_pointer()), message.key_len()),
+               value);
+  } else {
+    batch->Put(folly::stringPrintf("%d_%" PRId64, message.partition(), message.offset()), value);
+  }
+}
+
+void writeBatch(rocksdb::WriteBatch* batch) {
+  rocksdb::WriteOptions options;
+  options.disableWAL = FLAGS_rocksdb_disable_wal;
+  const auto status = gDB->Write(options, batch);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to write to rocksdb: " << status.ToString();
+  }
+}
+
+void handleMessage(const RdKafka::Message& message, rocksdb::WriteBatch* batch) {
+  if (FLAGS_sleep_between_message_msec != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_sleep_between_message_msec));
+  }
+  gStats->messages.fetch_add(1);
+  gStats->bytes.fetch_add(message.len() + message.key_len());
+  const auto partition = static_cast<size_t>(message.partition());
+  if (partition < gStats->last_message_timestamp_ms.size()) {
+    gStats->last_message_timestamp_ms[partition].store(message.timestamp().timestamp);
+  }
+  if (batch) {
+    addToWriteBatch(message, batch);
+  }
+  if (FLAGS_print_messages) {
+    cout << "Key " << (message.key() ? *message.key() : "") << ", "
+         << "partition: " << message.partition() << ", "
+         << "offset: " << message.offset() << ", "
+         << "payload len: " << message.len() << endl;
+  }
+}
+
+// Print messages/s, MB/s over the last interval, and how far behind in ms each partition is
+void report(const int64_t interval_ms, uint64_t* last_messages, uint64_t* last_bytes) {
+  const auto messages = gStats->messages.load();
+  const auto bytes = gStats->bytes.load();
+  const auto seconds = std::max<int64_t>(interval_ms, 1) / 1000.0;
+  cout << folly::stringPrintf("%.0f messages/s, %.2f MB/s, %" PRIu64 " messages in total",
+                              (messages - *last_messages) / seconds,
+                              (bytes - *last_bytes) / seconds / (1 << 20), messages)
+       << endl;
+  *last_messages = messages;
+  *last_bytes = bytes;
+
+  const auto now_ms = GetCurrentTimeMs();
+  string lags = "lag ms by partition:";
+  for (size_t i = 0; i < gStats->last_message_timestamp_ms.size(); ++i) {
+    const auto ts = gStats->last_message_timestamp_ms[i].load();
+    lags += folly::stringPrintf(" %zu=", i) + (ts < 0 ? "-" : std::to_string(now_ms - ts));
+  }
+  cout << lags << endl;
+}
+
+}  // namespace
+
 void run_partition_set(const unordered_set<uint32_t>& partition_ids_set) {
-  const string db_name = "test_db";
   const string segment = "test_segment";
   const string topic_name = FLAGS_topic_name;
   const string kafka_broker_serverset_path = FLAGS_kafka_broker_serverset_path;
   const string kafka_consumer_group = FLAGS_kafka_consumer_group;
-  const uint64_t replay_timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                           std::chrono::system_clock::now().time_since_epoch())
-                                           .count() -
-                                       (FLAGS_replay_from_minutes_ago * 60 * 1000);
+  const uint64_t replay_timestamp_ms =
+      GetCurrentTimeMs() - (FLAGS_replay_from_minutes_ago * 60 * 1000);
 
   cout << "Sleeping for " << FLAGS_wait_for_seconds_before_start << " seconds before consuming"
        << endl;
@@ -76,29 +183,41 @@ void run_partition_set(const unordered_set<uint32_t>& partition_ids_set) {
       -1,   // kafka_init_blocking_consume_timeout_ms
       1000  // kafka consumer timeout ms
   );
+  if (FLAGS_parallel_workers > 0) {
+    kafka_watcher->EnableParallelHandling(FLAGS_parallel_workers,
+                                          FLAGS_max_pending_per_partition);
+  }
 
-  int64_t message_count = 0;
-  kafka_watcher->StartWith(
-      replay_timestamp_ms,
-      [message_count, db_name, segment = std::move(segment)](
-          std::shared_ptr<const RdKafka::Message> message, const bool is_replay) mutable {
-        if (message == nullptr) {
-          LOG(ERROR) << "Message nullptr";
-          return;
-        }
-        if (FLAGS_sleep_between_message_msec != 0) {
-          std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_sleep_between_message_msec));
-        }
-        message_count++;
-        cout << "DB name: " << db_name << ", Key " << *message->key() << ", "
-             << "partition: " << message->partition() << ", "
-             << "offset: " << message->offset() << ", "
-             << "payload len: " << message->len()
-             << ", "
-             // << "msg_timestamp: " << message->timestamp()
-             << endl;
-      });
-  cout << "Caught up" << endl;
+  const auto start_ms = GetCurrentTimeMs();
+  if (FLAGS_consume_mode == "batch") {
+    kafka_watcher->StartWithBatch(
+        replay_timestamp_ms,
+        [](const std::vector<std::unique_ptr<RdKafka::Message>>& messages, const bool is_replay) {
+          rocksdb::WriteBatch batch;
+          for (const auto& message : messages) {
+            handleMessage(*message, gDB ? &batch : nullptr);
+          }
+          if (gDB) {
+            writeBatch(&batch);
+          }
+        },
+        FLAGS_batch_size);
+  } else {
+    kafka_watcher->StartWith(
+        replay_timestamp_ms,
+        [](std::shared_ptr<const RdKafka::Message> message, const bool is_replay) {
+          if (message == nullptr) {
+            LOG(ERROR) << "Message nullptr";
+            return;
+          }
+          rocksdb::WriteBatch batch;
+          handleMessage(*message, gDB ? &batch : nullptr);
+          if (gDB) {
+            writeBatch(&batch);
+          }
+        });
+  }
+  cout << "Caught up after " << GetCurrentTimeMs() - start_ms << " ms" << endl;
 
   // Now wait for some time before leaving this thread.
   cout << "Sleeping for " << FLAGS_wait_for_seconds_after_catchup << " seconds after catchup"
@@ -115,12 +234,6 @@ void run_partition_set(const unordered_set<uint32_t>& partition_ids_set) {
   cout << "Shutdown kafka consumer" << endl;
 }
 
-void run_partition(const uint32_t partition_id) {
-  const unordered_set<uint32_t> partition_ids_set({partition_id});
-  run_partition_set(partition_ids_set);
-  cout << "Returning from kafka watcher for partition_id" << partition_id << endl;
-}
-
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   google::SetLogDestination(google::FATAL, "kafka_consumer_app.log.FATAL.");
@@ -142,13 +255,47 @@ int main(int argc, char** argv) {
     LOG(ERROR) << "Must provide consumer group to use. Don't use production consumer group" << std::endl;
     exit(-1);
   }
+  if (FLAGS_consume_mode != "message" && FLAGS_consume_mode != "batch") {
+    LOG(ERROR) << "Unknown consume mode " << FLAGS_consume_mode << std::endl;
+    exit(-1);
+  }
 
   uint32_t batchSize = FLAGS_num_partitions_per_consumer;
   uint32_t numBatches = FLAGS_num_consumers;
   uint32_t numPartitions = batchSize * numBatches;
 
-  std::vector<std::thread> threads(numPartitions);
+  gStats = std::make_unique<BenchmarkStats>(numPartitions);
+  if (!FLAGS_rocksdb_dir.empty()) {
+    rocksdb::Options options;
+    options.create_if_missing = true;
+    options.IncreaseParallelism();
+    rocksdb::DB* db;
+    const auto status = rocksdb::DB::Open(options, FLAGS_rocksdb_dir, &db);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to open rocksdb " << FLAGS_rocksdb_dir << ": " << status.ToString();
+      exit(-1);
+    }
+    gDB.reset(db);
+  }
 
+  std::mutex reporter_mutex;
+  std::condition_variable reporter_cv;
+  bool done = false;
+  std::thread reporter([&reporter_mutex, &reporter_cv, &done] {
+    uint64_t last_messages = 0;
+    uint64_t last_bytes = 0;
+    auto last_report_ms = GetCurrentTimeMs();
+    std::unique_lock<std::mutex> lock(reporter_mutex);
+    while (!done) {
+      reporter_cv.wait_for(lock, std::chrono::seconds(FLAGS_report_interval_sec));
+      const auto now_ms = GetCurrentTimeMs();
+      report(now_ms - last_report_ms, &last_messages, &last_bytes);
+      last_report_ms = now_ms;
+    }
+  });
+
+  const auto start_ms = GetCurrentTimeMs();
+  std::vector<std::thread> threads;
   for (uint32_t batchId = 0; batchId < numBatches; ++batchId) {
     unordered_set<uint32_t> partitions = unordered_set<uint32_t>();
     for (uint32_t itemId = 0; itemId < batchSize; ++itemId) {
@@ -156,22 +303,30 @@ int main(int argc, char** argv) {
       partitions.insert(partition_id);
     }
 
-    std::thread thread =
-        std::thread([partitions = std::move(partitions)] { run_partition_set(partitions); });
-    threads.push_back(std::move(thread));
-    cout << "Returning from kafka watcher for batchId" << batchId << endl;
+    threads.emplace_back([partitions = std::move(partitions)] { run_partition_set(partitions); });
+    cout << "Started kafka watcher for batchId " << batchId << endl;
   }
 
-  for (uint32_t i = 1; i <= numBatches; ++i) {
-    while (!threads.at(i - 1).joinable()) {
-      cout << "Waiting for consumer thread to be joinable" << endl;
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-    }
+  for (auto& thread : threads) {
+    thread.join();
   }
 
-  for (uint32_t i = 1; i <= numBatches; ++i) {
-    threads.at(i - 1).join();
+  {
+    std::lock_guard<std::mutex> lock(reporter_mutex);
+    done = true;
   }
+  reporter_cv.notify_one();
+  reporter.join();
+
+  const auto elapsed_ms = std::max<int64_t>(GetCurrentTimeMs() - start_ms, 1);
+  cout << folly::stringPrintf(
+              "Consumed %" PRIu64 " messages, %" PRIu64 " bytes in %" PRId64
+              " ms: %.0f messages/s, %.2f MB/s",
+              gStats->messages.load(), gStats->bytes.load(), elapsed_ms,
+              gStats->messages.load() * 1000.0 / elapsed_ms,
+              gStats->bytes.load() * 1000.0 / elapsed_ms / (1 << 20))
+       << endl;
+  gDB.reset();
 
   return 0;
 }
@@ -19,19 +19,33 @@
 
 #include "rocksdb_admin/admin_handler.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cinttypes>
+#include <fstream>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <sstream>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "boost/filesystem.hpp"
 #include "common/identical_name_thread_factory.h"
 #include "common/kafka/kafka_broker_file_watcher.h"
+#include "common/kafka/kafka_consumer.h"
+#include "common/kafka/kafka_consumer_holder.h"
 #include "common/kafka/kafka_consumer_pool.h"
 #include "common/kafka/kafka_watcher.h"
+#include "common/kafka/shared_kafka_consumer.h"
 #include "common/network_util.h"
 #include "common/rocksdb_env_s3.h"
 #include "common/rocksdb_glogger/rocksdb_glogger.h"
@@ -45,18 +59,28 @@
 #include "folly/ScopeGuard.h"
 #include "folly/String.h"
 #include "librdkafka/rdkafkacpp.h"
+#include "rocksdb/convenience.h"
 #include "rocksdb/env.h"
 #include "rocksdb/options.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/table.h"
 #include "rocksdb/utilities/backupable_db.h"
 #include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb_admin/column_family_db.h"
 #include "rocksdb_admin/detail/kafka_broker_file_watcher_manager.h"
+#include "rocksdb_admin/flush_listener.h"
+#include "rocksdb_admin/job_rate_limiter.h"
+#include "rocksdb_admin/stats_event_listener.h"
 #include "rocksdb_admin/utils.h"
+#include "rocksdb_admin/write_batch_deduper.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
 #include "thrift/lib/cpp2/protocol/Serializer.h"
 #if __GNUC__ >= 8
 #include "folly/executors/CPUThreadPoolExecutor.h"
+#include "folly/hash/Checksum.h"
 #include "folly/system/ThreadName.h"
 #else
+#include "folly/Checksum.h"
 #include "wangle/concurrent/CPUThreadPoolExecutor.h"
 #endif
 
@@ -69,6 +93,14 @@ DEFINE_string(rocksdb_dir, "/tmp/",
 DEFINE_int32(num_hdfs_access_threads, 8,
              "The number of threads for backup or restore to/from HDFS");
 
+DEFINE_int32(backup_host_rate_limit_mb, 0,
+             "If positive, the backups to HDFS or S3 of all dbs share a rate "
+             "limit of this many MB per second, in even shares per db");
+
+DEFINE_int32(restore_host_rate_limit_mb, 0,
+             "If positive, the restores from HDFS or S3 of all dbs share a "
+             "rate limit of this many MB per second, in even shares per db");
+
 DEFINE_int32(port, 9090, "Port of the server");
 
 DEFINE_string(shard_config_path, "",
@@ -84,9 +116,47 @@ DEFINE_bool(rocksdb_allow_overlapping_keys, false,
 DEFINE_string(allow_overlapping_keys_segments, "",
               "comma separated list of segments supporting overlapping keys");
 
+DEFINE_string(read_only_segments, "",
+              "comma separated list of segments only loaded by "
+              "addS3SstFilesToDB, whose dbs are opened read-only without "
+              "replication, and replaced by a new version on each load");
+
+DEFINE_bool(read_only_mmap_reads, false,
+            "Read the sst files of read-only dbs with mmap, for segments "
+            "whose data fits in memory");
+
+DEFINE_string(tiered_storage_segments, "",
+              "comma separated list of segments whose dbs move their cold "
+              "bottommost level sst files to S3, and read them from there. "
+              "These dbs can't be checkpointed, e.g. by backupDBToS3 or "
+              "splitDB");
+
+DEFINE_string(tiered_storage_s3_bucket, "",
+              "The S3 bucket of the sst files moved by tiered storage");
+
+DEFINE_string(tiered_storage_s3_prefix, "tiered_storage/",
+              "The S3 key prefix of the sst files moved by tiered storage, "
+              "followed by <host name>/<db name>/");
+
+DEFINE_int32(tiered_storage_s3_rate_limit_mb, 128,
+             "The rate limit of the uploads and reads of the sst files moved "
+             "by tiered storage, in MB/s");
+
+DEFINE_int32(tiered_storage_file_age_sec, 7 * 24 * 3600,
+             "The bottommost level sst files not modified for this long are "
+             "moved to S3 by tiered storage");
+
+DEFINE_int32(tiered_storage_check_interval_sec, 600,
+             "How often in sec to look for sst files to move to S3");
+
 DEFINE_bool(compact_db_after_load_sst, false,
             "Compact DB after loading SST files");
 
+DEFINE_int32(max_concurrent_compactions_per_disk, 0,
+             "If positive, the max number of manual compactions, including the "
+             "ones after loading sst files, running at a time on each disk. "
+             "The others wait, the dbs with the most L0 files first");
+
 DECLARE_int32(rocksdb_replicator_port);
 
 DEFINE_bool(s3_direct_io, false, "Whether to enable direct I/O for s3 client");
@@ -94,10 +164,137 @@ DEFINE_bool(s3_direct_io, false, "Whether to enable direct I/O for s3 client");
 DEFINE_int32(max_s3_sst_loading_concurrency, 999,
              "Max S3 SST loading concurrency");
 
+DEFINE_int32(s3_transfer_admission_timeout_ms, 10 * 60 * 1000,
+             "How long an S3 backup/restore/loading waits in the queue for "
+             "one of the --max_s3_sst_loading_concurrency slots before it "
+             "fails");
+
 DEFINE_int32(s3_download_limit_mb, 0, "S3 download sst bandwidth");
 
-DEFINE_int32(kafka_ts_update_interval, 1000, "Number of kafka messages consumed"
-                                             " before updating meta_db");
+DEFINE_int32(s3_max_connections, 64,
+             "The max number of connections of the S3 client shared by all "
+             "the S3 transfers of the process");
+
+DEFINE_int32(s3_connect_timeout_ms, 3000, "The connect timeout of S3 requests");
+
+DEFINE_int32(s3_request_timeout_ms, 3000, "The request timeout of S3 requests");
+
+DEFINE_int32(s3_sst_ingest_group_size, 0,
+             "If positive, addS3SstFilesToDB downloads the sst files "
+             "concurrently and ingests them in groups of this many files as "
+             "they land, rather than ingesting all of them after the last one "
+             "is downloaded. Only used for segments without overlapping keys");
+
+DEFINE_int32(s3_sst_ingest_max_pending_files, 32,
+             "Max number of sst files being downloaded or waiting for "
+             "ingestion in the local disk for a pipelined addS3SstFilesToDB");
+
+DEFINE_bool(s3_sst_require_checksum_manifest, false,
+            "If true, addS3SstFilesToDB fails for datasets without an "
+            "SST_CHECKSUMS manifest. The datasets with one are always "
+            "verified against it");
+
+DEFINE_int32(kafka_ts_update_interval, 1000, "Deprecated, the kafka timestamps "
+             "are saved every --kafka_ts_flush_interval_ms");
+
+DEFINE_int32(kafka_ts_flush_interval_ms, 1000,
+             "How often the timestamps of the last kafka messages written to "
+             "the dbs are saved to meta_db, all dbs in one batch");
+
+DEFINE_int32(kafka_ingestion_batch_max_bytes, 0,
+             "If positive, the kafka messages ingested to a db are written as "
+             "one WriteBatch once they add up to this many bytes, or once the "
+             "first of them has waited for --kafka_ingestion_batch_max_ms. "
+             "Otherwise each message is written on its own");
+
+DEFINE_int32(kafka_ingestion_batch_max_ms, 100,
+             "The max time a kafka message waits to be written in a batch");
+
+DEFINE_int32(kafka_ingestion_consume_batch_size, 500,
+             "The max number of kafka messages consumed at a time for "
+             "ingestion");
+
+DEFINE_bool(kafka_ingestion_dedup_batches, false,
+            "If true, only the last update per key of a batch of kafka "
+            "messages is written, with the merge operands after it combined "
+            "by the merge operator of the db. Cuts the memtable inserts and "
+            "WAL bytes of bursts of updates to the same keys");
+
+DEFINE_bool(kafka_ingestion_disable_wal, false,
+            "If true, the kafka messages are written without the WAL, and the "
+            "kafka timestamp of a db is only saved once a memtable flush has "
+            "persisted the messages up to it, so that they are consumed "
+            "again after a crash. Only for the dbs not replicated (NOOP "
+            "role), the others are still written with the WAL, as the "
+            "replication ships it");
+
+DEFINE_bool(kafka_ingestion_pause_on_write_stall, true,
+            "Pause consuming the kafka messages ingested to a db while the db "
+            "stalls writes");
+
+DEFINE_int32(kafka_ingestion_max_handler_latency_ms, 0,
+             "If positive, pause consuming the kafka messages ingested to a db "
+             "for a while when writing those of a consume takes longer");
+
+DEFINE_bool(kafka_ingestion_shared_consumer, false,
+            "If true, all dbs ingesting from the same kafka topic and broker "
+            "serverset share one kafka consumer and thread, rather than "
+            "having one each");
+
+DEFINE_int64(kafka_replay_to_sst_min_lag_ms, 0,
+             "If positive, a db whose kafka replay timestamp is older than "
+             "this catches up by building sst files from the replayed "
+             "messages and ingesting them, rather than writing them one by "
+             "one. Only for dbs without slaves, as the ingested files are "
+             "not replicated");
+
+DEFINE_int64(kafka_replay_sst_file_bytes, 64 * 1024 * 1024,
+             "The approximate size of each sst file built while replaying "
+             "kafka messages");
+
+DEFINE_int64(host_block_cache_bytes, 0,
+             "If positive, all dbs share a block cache of this size instead "
+             "of the ones of their options");
+
+DEFINE_bool(host_block_cache_use_clock, false,
+            "Use a clock cache rather than an LRU one as the shared block "
+            "cache");
+
+DEFINE_string(host_block_cache_segment_shares, "",
+              "Comma separated segment:fraction pairs. The dbs of each listed "
+              "segment get that fraction of --host_block_cache_bytes as "
+              "their own cache, and the other dbs share the rest");
+
+DEFINE_int64(host_write_buffer_bytes, 0,
+             "If positive, the memtables of all dbs are limited to this size "
+             "in total, and charged to the shared block cache if any");
+
+DEFINE_int64(host_rate_limit_bytes_per_sec, 0,
+             "If positive, the flushes and compactions of all dbs share a "
+             "rate limit of this many bytes per second");
+
+DEFINE_string(host_flash_cache_path, "",
+              "Dir on a local flash drive for a cache of compressed blocks "
+              "under the block caches, shared by all dbs");
+
+DEFINE_int64(host_flash_cache_bytes, 0,
+             "If positive, and --host_flash_cache_path is set, the size of "
+             "the flash cache of all dbs");
+
+DEFINE_bool(host_flash_cache_admit_on_second_miss, true,
+            "Only put a block into the flash cache the second time it misses, "
+            "so that the blocks read once, e.g. by scans, don't push out the "
+            "ones read again");
+
+DEFINE_bool(host_block_cache_own_arena, false,
+            "Allocate the blocks of the shared block caches from a jemalloc "
+            "arena of their own, reported by /jemalloc_stats.txt. Needs "
+            "rocksdb 6.0+ built with jemalloc, and an LRU cache");
+
+DEFINE_bool(application_db_hibernation_cache_index_and_filter_blocks, true,
+            "With --application_db_hibernate_idle_min, keep the index and "
+            "filter blocks of the dbs opened with max_open_files = -1 in the "
+            "block cache, as hibernating can't close their table readers");
 
 DEFINE_bool(enable_logging_consumer_log, false,
             "Enable logging consumer messages meta data at given log frequency");
@@ -114,13 +311,52 @@ DEFINE_bool(enable_checkpoint_backup, false, "Enable backup via creating checkpo
 
 DEFINE_int32(checkpoint_backup_batch_num_upload, 1, "how many batches could be uploaded in paralell");
 
-DEFINE_int32(checkpoint_backup_batch_num_download, 1, "how many batches could be downloaded in paralell");
+DEFINE_int32(export_db_num_ranges, 8,
+             "The number of key ranges of a db exported to S3 concurrently "
+             "by exportDBToS3, unless the request sets it");
+
+DEFINE_int64(export_db_sst_file_bytes, 256 * 1024 * 1024,
+             "The approximate size of each sst file exported by exportDBToS3");
+
+DEFINE_int64(export_db_readahead_bytes, 2 * 1024 * 1024,
+             "The readahead size of the iterators of exportDBToS3");
+
+DEFINE_int32(checkpoint_backup_batch_num_download, 1, "how many workers could download checkpoint files in paralell, "
+             "the largest files first");
 
 DEFINE_int32(num_s3_upload_download_threads, 8,
              "The number of threads for upload to/download from s3");
 
 DEFINE_int64(max_s3_upload_download_task_queue_size, 1000, "The queue size in the executor");
 
+DEFINE_int32(num_shutdown_flush_threads, 8,
+             "The number of threads flushing the dbs at shutdown");
+
+DEFINE_int32(db_resource_collect_interval_ms, 10000,
+             "The time between the passes collecting the resource usage of "
+             "the dbs, 0 to disable them");
+
+DEFINE_int32(shutdown_flush_budget_ms, 20000,
+             "No more db is flushed at shutdown after this long, 0 for no "
+             "limit");
+
+DEFINE_bool(admin_offload_long_requests, true,
+            "Run the long S3 and peer transfer calls on their own threads, "
+            "so that they don't hold a thrift worker thread until they are "
+            "done");
+
+DEFINE_int32(num_admin_long_request_threads, 8,
+             "The number of threads for the long admin calls");
+
+DEFINE_bool(admin_offload_control_requests, true,
+            "Run the admin calls opening, closing or reconfiguring dbs, e.g. "
+            "addDB and changeDBRoleAndUpStream, on their own threads, so "
+            "that they don't take thrift worker threads from the data calls");
+
+DEFINE_int32(num_admin_control_request_threads, 4,
+             "The number of threads for the admin calls opening, closing or "
+             "reconfiguring dbs");
+
 DEFINE_bool(enable_async_delete_dbs, false, "Enable delete db files in async way");
 
 DEFINE_int32(async_delete_dbs_frequency_sec,
@@ -129,6 +365,44 @@ DEFINE_int32(async_delete_dbs_frequency_sec,
 DEFINE_int32(async_delete_dbs_wait_sec,
              60,
              "How long in sec to wait between the dbs deletion");
+DEFINE_int64(async_delete_dbs_bytes_per_sec, 0,
+             "If positive, the dbs are deleted in the async way file by file, "
+             "each of them truncated in chunks before being unlinked, at this "
+             "many bytes per second at most");
+
+DEFINE_int32(num_startup_db_openers, 16,
+             "The number of dbs in the shard config opened in parallel at "
+             "startup");
+
+DEFINE_int32(startup_report_top_dbs, 10,
+             "The number of the slowest dbs to open logged at startup");
+
+DEFINE_int32(num_admin_job_threads, 4,
+             "The number of admin calls submitted as jobs run at a time. "
+             "Keep it below --max_s3_sst_loading_concurrency, so that jobs "
+             "are queued rather than failed by the limit");
+
+DEFINE_bool(enable_auto_catch_up_from_checkpoint, false,
+            "If true, a SLAVE db whose upstream has purged the WAL it needs is "
+            "replaced with a checkpoint fetched from the upstream");
+
+DEFINE_int32(db_warm_up_budget_ms, 0,
+             "Max time to spend paging the index, filter and data blocks of a "
+             "db into memory after it is restored, bootstrapped, loaded with "
+             "sst files or first added after a restart, before the call "
+             "returns and the shard is marked online. 0 disables warm-up");
+
+DEFINE_uint64(db_warm_up_scan_bytes, 0,
+              "Max bytes of data blocks to read from the first key of a db "
+              "when warming it up, after its index and filter blocks");
+
+DEFINE_uint64(db_warm_up_max_bytes_per_sec, 64 * 1024 * 1024,
+              "Max rate of reading data blocks when warming up a db, 0 for no "
+              "limit");
+
+DEFINE_bool(rocksdb_event_stats, true,
+            "If true, the flushes, compactions, file ingestions and write "
+            "stalls of the dbs are recorded in stats");
 
 #if __GNUC__ >= 8
 using folly::CPUThreadPoolExecutor;
@@ -143,11 +417,14 @@ using wangle::QueueBehaviorIfFull;
 namespace {
 
 const int kMB = 1024 * 1024;
-const int kS3UtilRecheckSec = 5;
+
+// The max number of key ranges of a db compacted concurrently by compactDB
+const int32_t kMaxCompactionRanges = 64;
 
 const int64_t kMillisPerSec = 1000;
 const char kKafkaConsumerType[] = "rocksplicator_consumer";
 const char kKafkaWatcherName[] = "rocksplicator_watcher";
+const char kKafkaSharedConsumerName[] = "rocksplicator_shared_consumer";
 const uint32_t kKafkaConsumerPoolSize = 1;
 const std::string kKafkaConsumerLatency = "kafka_consumer_latency";
 const std::string kKafkaDbPutMessage = "kafka_put_msg_consumed";
@@ -158,6 +435,7 @@ const std::string kKafkaDbDeleteErrors = "kafka_db_delete_errors";
 const std::string kKafkaDbMergeErrors = "kafka_db_merge_errors";
 const std::string kKafkaDeserFailure = "kafka_deser_failure";
 const std::string kKafkaInvalidOpcode = "kafka_invalid_opcode";
+const std::string kKafkaDedupedUpdates = "kafka_deduped_updates";
 const std::string kHDFSBackupSuccess = "hdfs_backup_success";
 const std::string kS3BackupSuccess = "s3_backup_success";
 const std::string kHDFSBackupFailure = "hdfs_backup_failure";
@@ -170,7 +448,75 @@ const std::string kHDFSBackupMs = "hdfs_backup_ms";
 const std::string kHDFSRestoreMs = "hdfs_restore_ms";
 const std::string kS3BackupMs = "s3_backup_ms";
 const std::string kS3RestoreMs = "s3_restore_ms";
+// per db, bytes per second of the last backup or restore
+const std::string kBackupBytesPerSec = "backup_bytes_per_sec";
+const std::string kRestoreBytesPerSec = "restore_bytes_per_sec";
+const std::string kS3ExportSuccess = "s3_export_success";
+const std::string kS3ExportFailure = "s3_export_failure";
+const std::string kS3ExportMs = "s3_export_ms";
 const std::string kDeleteDBFailure = "delete_db_failure";
+const std::string kPendingDeleteBytes = "pending_delete_db_bytes";
+// The bytes truncated from a file at a time when deleting dbs rate limited
+const uint64_t kDeleteChunkBytes = 64 * 1024 * 1024;
+const std::string kCheckpointCatchUpSuccess = "checkpoint_catch_up_success";
+const std::string kCheckpointCatchUpFailure = "checkpoint_catch_up_failure";
+const std::string kPeerBootstrapSuccess = "peer_bootstrap_success";
+const std::string kPeerBootstrapFailure = "peer_bootstrap_failure";
+const std::string kPeerBootstrapMs = "peer_bootstrap_ms";
+// per db timings when opening the dbs in the shard config at startup
+const std::string kStartupDBOpenMs = "startup_db_open_ms";
+const std::string kStartupWALReplayBytes = "startup_db_wal_replay_bytes";
+const std::string kStartupDBAddMs = "startup_db_add_ms";
+const std::string kStartupTotalMs = "startup_total_ms";
+const std::string kShutdownFlushMs = "shutdown_flush_ms";
+const std::string kShutdownFlushFailures = "shutdown_flush_failures";
+const std::string kShutdownFlushSkippedDBs = "shutdown_flush_skipped_dbs";
+const std::string kShutdownUnflushedBytes = "shutdown_unflushed_bytes";
+const std::string kS3BackupSharedBytes = "s3_backup_shared_bytes";
+// per db, RocksDB reports the ingested files but not how long they took
+const std::string kIngestMs = "rocksdb_ingest_ms";
+const std::string kSstManifestFileName = "SST_MANIFEST";
+const std::string kSharedSstDirName = "shared_checksum";
+const std::string kSstChecksumManifestFileName = "SST_CHECKSUMS";
+const std::string kExportManifestFileName = "EXPORT_MANIFEST";
+const std::string kS3SstChecksumMismatch = "s3_sst_checksum_mismatch";
+const std::string kTieredStorageOffloadedFiles =
+  "tiered_storage_offloaded_files";
+const std::string kTieredStorageOffloadedBytes =
+  "tiered_storage_offloaded_bytes";
+const std::string kTieredStorageOffloadFailures =
+  "tiered_storage_offload_failures";
+const std::string kS3TransferAdmissionWaitMs = "s3_transfer_admission_wait_ms";
+// per admin call pool, tagged with pool=<name>
+const std::string kAdminPoolQueueMs = "admin_pool_queue_ms";
+const std::string kAdminPoolRunMs = "admin_pool_run_ms";
+const std::string kAdminPoolPendingTasks = "admin_pool_pending_tasks";
+const std::string kS3TransferQueueDepth = "s3_transfer_queue_depth";
+const std::string kS3TransferAdmissionTimeout =
+  "s3_transfer_admission_timeout";
+// The dbs dumped per chunk of a streamed /rocksdb_info.txt
+const size_t kDBStatsChunkDBs = 64;
+
+// S3 transfer priorities, restores go first as the shards being restored are
+// not serving
+const uint32_t kS3RestorePriority = 0;
+const uint32_t kS3AddSstFilesPriority = 1;
+const uint32_t kS3BackupPriority = 2;
+
+// Persist the kafka messages written to db without the WAL, so that their
+// timestamp becomes the kafka checkpoint of db
+void FlushUnloggedKafkaMessages(
+    const std::shared_ptr<admin::ApplicationDB>& db) {
+  if (!FLAGS_kafka_ingestion_disable_wal) {
+    return;
+  }
+
+  auto status = db->rocksdb()->Flush(rocksdb::FlushOptions());
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to flush the kafka messages written to "
+               << db->db_name() << ": " << status.ToString();
+  }
+}
 
 int64_t GetMessageTimestampSecs(const RdKafka::Message& message) {
   const auto ts = message.timestamp();
@@ -205,40 +551,340 @@ rocksdb::DB* OpenMetaDB() {
   return db;
 }
 
-std::unique_ptr<rocksdb::DB> GetRocksdb(const std::string& dir,
-                                        const rocksdb::Options& options) {
-  rocksdb::DB* db;
-  auto s = rocksdb::DB::Open(options, dir, &db);
+// Open the db at dir with its column families, see ColumnFamilyDB::Open()
+std::unique_ptr<rocksdb::DB> GetRocksdb(
+    const std::string& dir,
+    const rocksdb::Options& options,
+    const std::vector<rocksdb::ColumnFamilyDescriptor>& column_families = {}) {
+  std::unique_ptr<rocksdb::DB> db;
+  auto s = admin::ColumnFamilyDB::Open(options, dir, column_families, &db);
   if (!s.ok()) {
     LOG(ERROR) << "Failed to create db at " << dir << " with error "
                << s.ToString();
     return nullptr;
   }
 
+  return db;
+}
+
+// The column families of the dbs of segment per column_family_options
+std::vector<rocksdb::ColumnFamilyDescriptor> GetColumnFamilies(
+    const admin::RocksDBColumnFamilyOptionsGeneratorType& column_family_options,
+    const std::string& segment) {
+  if (column_family_options == nullptr) {
+    return {};
+  }
+
+  return column_family_options(segment);
+}
+
+bool IsReadOnlySegment(const std::string& segment) {
+  static const auto segments = [] {
+    std::unordered_set<std::string> result;
+    folly::splitTo<std::string>(",", FLAGS_read_only_segments,
+                                std::inserter(result, result.begin()));
+    return result;
+  }();
+  return segments.count(segment) != 0;
+}
+
+bool IsTieredStorageSegment(const std::string& segment) {
+  static const auto segments = [] {
+    std::unordered_set<std::string> result;
+    folly::splitTo<std::string>(",", FLAGS_tiered_storage_segments,
+                                std::inserter(result, result.begin()));
+    return result;
+  }();
+  return segments.count(segment) != 0;
+}
+
+// The env of the dbs of --tiered_storage_segments. It is never destroyed, as
+// they use it until they are closed.
+rocksdb::TieredS3Env* TieredStorageEnv() {
+  static auto env = [] {
+    char host_name[256] = {0};
+    if (!rocksdb::Env::Default()->GetHostName(host_name,
+                                              sizeof(host_name) - 1).ok()) {
+      LOG(ERROR) << "Failed to get the host name for tiered storage";
+    }
+    return new rocksdb::TieredS3Env(
+      FLAGS_rocksdb_dir,
+      FLAGS_tiered_storage_s3_prefix + host_name + "/",
+      common::S3Util::BuildS3Util(FLAGS_tiered_storage_s3_rate_limit_mb,
+                                  FLAGS_tiered_storage_s3_bucket,
+                                  FLAGS_s3_connect_timeout_ms,
+                                  FLAGS_s3_request_timeout_ms,
+                                  FLAGS_s3_max_connections,
+                                  FLAGS_tiered_storage_s3_rate_limit_mb));
+  }();
+  return env;
+}
+
+// Open the db at dir for reads only, creating an empty one if there is none
+std::unique_ptr<rocksdb::DB> OpenReadOnlyRocksdb(const std::string& dir,
+                                                 rocksdb::Options options) {
+  if (!boost::filesystem::exists(dir + "/CURRENT")) {
+    options.create_if_missing = true;
+    if (GetRocksdb(dir, options) == nullptr) {
+      return nullptr;
+    }
+  }
+
+  // Nothing changes the files, so all of them are opened up front instead of
+  // on the first reads
+  options.max_open_files = -1;
+  options.allow_mmap_reads = FLAGS_read_only_mmap_reads;
+  rocksdb::DB* db;
+  auto s = rocksdb::DB::OpenForReadOnly(options, dir, &db);
+  if (!s.ok()) {
+    LOG(ERROR) << "Failed to open db at " << dir << " for reads only with "
+               << "error " << s.ToString();
+    return nullptr;
+  }
+
   return std::unique_ptr<rocksdb::DB>(db);
 }
 
-folly::Future<std::unique_ptr<rocksdb::DB>> GetRocksdbFuture(
-    const std::string& dir,
-    const rocksdb::Options&options) {
-  folly::Promise<std::unique_ptr<rocksdb::DB>> promise;
-  auto future = promise.getFuture();
-
-  std::thread opener([dir, options,
-                      promise = std::move(promise)] () mutable {
-      LOG(INFO) << "Start opening " << dir;
-      promise.setValue(GetRocksdb(dir, options));
-      LOG(INFO) << "Finished opening " << dir;
-    });
+bool IsSstFileName(const std::string& file_name) {
+  static const std::string suffix = ".sst";
+  return file_name.size() >= suffix.size() + 1 &&
+    file_name.compare(file_name.size() - suffix.size(), suffix.size(),
+                      suffix) == 0;
+}
+
+// Size of the file at path, 0 if unknown
+int64_t GetFileBytes(const std::string& path) {
+  boost::system::error_code ec;
+  auto size = boost::filesystem::file_size(path, ec);
+  return ec ? 0 : static_cast<int64_t>(size);
+}
+
+// The crc32c of the file at path
+bool GetFileCrc32c(const std::string& path, uint32_t* crc32c) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  std::vector<char> buf(1 << 20);
+  uint32_t crc = ~0U;
+  while (file) {
+    file.read(buf.data(), buf.size());
+    crc = folly::crc32c(reinterpret_cast<const uint8_t*>(buf.data()),
+                        file.gcount(), crc);
+  }
+
+  *crc32c = crc;
+  return file.eof();
+}
+
+// Delete the keys of db outside of [begin, end), where nullptr means
+// unbounded, e.g. for a half of a split db. Keys are compared bytewise. The
+// deletions are written in one batch of range deletions, so that dbs with
+// the same keys end up with the same sequence #s. Then the sst files holding
+// only deleted keys are dropped, and the rest of the deleted ranges is
+// compacted away.
+rocksdb::Status KeepKeyRange(rocksdb::DB* db,
+                             const std::string* begin,
+                             const std::string* end) {
+  rocksdb::WriteBatch write_batch;
+  // The last key before begin, as the end of DeleteFilesInRange() is inclusive
+  std::string last_before_begin;
+  bool has_keys_before_begin = false;
+  bool has_keys_from_end = false;
+  {
+    std::unique_ptr<rocksdb::Iterator> iter(
+      db->NewIterator(rocksdb::ReadOptions()));
+    if (begin) {
+      iter->Seek(*begin);
+      if (iter->Valid()) {
+        iter->Prev();
+      } else if (iter->status().ok()) {
+        iter->SeekToLast();
+      }
+      if (iter->Valid()) {
+        has_keys_before_begin = true;
+        last_before_begin = iter->key().ToString();
+        iter->SeekToFirst();
+        write_batch.DeleteRange(iter->key(), *begin);
+      }
+    }
+    if (end) {
+      iter->Seek(*end);
+      if (iter->Valid()) {
+        has_keys_from_end = true;
+        iter->SeekToLast();
+        // The end of a range deletion is exclusive
+        auto last = iter->key().ToString();
+        last.push_back('\0');
+        write_batch.DeleteRange(*end, last);
+      }
+    }
+    if (!iter->status().ok()) {
+      return iter->status();
+    }
+  }
+
+  if (!has_keys_before_begin && !has_keys_from_end) {
+    return rocksdb::Status::OK();
+  }
+
+  auto status = db->Write(rocksdb::WriteOptions(), &write_batch);
+  if (!status.ok()) {
+    return status;
+  }
+  status = db->Flush(rocksdb::FlushOptions());
+  if (!status.ok()) {
+    return status;
+  }
+
+  rocksdb::CompactRangeOptions options;
+  options.bottommost_level_compaction =
+    rocksdb::BottommostLevelCompaction::kForce;
+  if (has_keys_before_begin) {
+    const rocksdb::Slice last_slice(last_before_begin);
+    const rocksdb::Slice begin_slice(*begin);
+    status = rocksdb::DeleteFilesInRange(db, db->DefaultColumnFamily(),
+                                         nullptr, &last_slice);
+    if (status.ok()) {
+      status = db->CompactRange(options, nullptr, &begin_slice);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  if (has_keys_from_end) {
+    const rocksdb::Slice end_slice(*end);
+    status = rocksdb::DeleteFilesInRange(db, db->DefaultColumnFamily(),
+                                         &end_slice, nullptr);
+    if (status.ok()) {
+      status = db->CompactRange(options, &end_slice, nullptr);
+    }
+  }
+
+  return status;
+}
+
+// Check the downloaded sst file at path against its entry in the
+// SST_CHECKSUMS manifest of its dataset
+bool VerifySstFile(const std::string& path,
+                   const ::admin::SstFileChecksum& expected) {
+  const auto size = GetFileBytes(path);
+  if (size != expected.size) {
+    LOG(ERROR) << path << " has " << size << " bytes instead of "
+               << expected.size;
+    return false;
+  }
+
+  // GetFileCrc32c() leaves out the final inversion of the standard CRC-32C
+  uint32_t crc32c;
+  if (!GetFileCrc32c(path, &crc32c)) {
+    LOG(ERROR) << "Failed to checksum " << path;
+    return false;
+  }
+  if (~crc32c != static_cast<uint32_t>(expected.crc32c)) {
+    LOG(ERROR) << path << " has crc32c " << ~crc32c << " instead of "
+               << static_cast<uint32_t>(expected.crc32c);
+    return false;
+  }
+
+  return true;
+}
+
+// The shared sst files of the incremental checkpoint backups under a dir are
+// kept in its parent dir, so that the backups of a db taken at different times
+// share them.
+std::string GetSharedSstS3Dir(const std::string& s3_backup_dir) {
+  auto dir = s3_backup_dir;
+  while (!dir.empty() && dir.back() == '/') {
+    dir.pop_back();
+  }
+  const auto pos = dir.find_last_of('/');
+  return (pos == std::string::npos ? "" : dir.substr(0, pos + 1)) +
+    kSharedSstDirName + "/";
+}
+
+// Like the BackupEngine, the shared sst files are named by their checksums
+// and sizes too, so that different files with the same name don't clash.
+std::string GetSharedSstFileName(const std::string& file_name,
+                                 const uint32_t crc32c,
+                                 const int64_t size) {
+  const auto base_name = file_name.substr(0, file_name.size() - 4);
+  return base_name + "_" + std::to_string(crc32c) + "_" +
+    std::to_string(size) + ".sst";
+}
 
-  opener.detach();
+// Total size of the WAL files in dir, which rocksdb replays when opening it
+uint64_t GetWALBytes(const std::string& dir) {
+  uint64_t bytes = 0;
+  boost::system::error_code ec;
+  boost::filesystem::directory_iterator itr(dir, ec);
+  if (ec) {
+    return 0;
+  }
+
+  for (; itr != boost::filesystem::directory_iterator(); ++itr) {
+    if (itr->path().extension() == ".log") {
+      auto size = boost::filesystem::file_size(itr->path(), ec);
+      bytes += ec ? 0 : size;
+    }
+  }
 
-  return future;
+  return bytes;
 }
 
+// The per db timings of the dbs opened at startup, slowest first
+std::mutex startup_report_mutex;
+std::string startup_report;
+
+// Find the host local_addr replicates shard from. The Master comes first,
+// followed by the Slaves ordered by their addresses, and the i-th host
+// replicates from the ((i - 1) / fanout)-th one. A fanout of 0 means all Slaves
+// replicate from the Master.
+const common::detail::Host* GetUpstreamHost(
+    const std::vector<std::pair<const common::detail::Host*,
+                                common::detail::Role>>& shard,
+    const folly::SocketAddress& local_addr,
+    uint32_t fanout) {
+  std::vector<const common::detail::Host*> hosts;
+  for (const auto& host : shard) {
+    if (host.second == common::detail::Role::MASTER) {
+      hosts.push_back(host.first);
+      break;
+    }
+  }
+
+  if (hosts.empty()) {
+    return nullptr;
+  }
+
+  for (const auto& host : shard) {
+    if (host.second == common::detail::Role::SLAVE) {
+      hosts.push_back(host.first);
+    }
+  }
+  std::sort(hosts.begin() + 1, hosts.end(),
+            [] (const common::detail::Host* a, const common::detail::Host* b) {
+              return a->addr < b->addr;
+            });
+
+  if (fanout == 0) {
+    return hosts.front();
+  }
+
+  for (size_t i = 1; i < hosts.size(); ++i) {
+    if (hosts[i]->addr == local_addr) {
+      return hosts[(i - 1) / fanout];
+    }
+  }
+
+  return nullptr;
+}
 
 std::unique_ptr<::admin::ApplicationDBManager> CreateDBBasedOnConfig(
-    const admin::RocksDBOptionsGeneratorType& rocksdb_options) {
+    const admin::RocksDBOptionsGeneratorType& rocksdb_options,
+    const admin::RocksDBColumnFamilyOptionsGeneratorType&
+      column_family_options) {
   auto db_manager = std::make_unique<::admin::ApplicationDBManager>();
   std::string content;
   CHECK(folly::readFile(FLAGS_shard_config_path.c_str(), content));
@@ -248,7 +894,20 @@ std::unique_ptr<::admin::ApplicationDBManager> CreateDBBasedOnConfig(
 
   folly::SocketAddress local_addr(common::getLocalIPAddress(), FLAGS_port);
 
-  std::vector<std::function<void(void)>> ops;
+  struct StartupDB {
+    std::string db_name;
+    rocksdb::Options options;
+    std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+    common::detail::Role role;
+    std::unique_ptr<folly::SocketAddress> upstream_addr;
+    bool read_only;
+    // set once opened
+    uint64_t wal_bytes;
+    uint64_t open_ms;
+    uint64_t add_ms;
+  };
+
+  std::vector<StartupDB> startup_dbs;
   for (const auto& segment : cluster_layout->segments) {
     int shard_id = -1;
     for (const auto& shard : segment.second.shard_to_hosts) {
@@ -269,48 +928,132 @@ std::unique_ptr<::admin::ApplicationDBManager> CreateDBBasedOnConfig(
       }
 
       auto db_name = admin::SegmentToDbName(segment.first.c_str(), shard_id);
-      auto options = rocksdb_options(segment.first);
-      auto db_future = GetRocksdbFuture(FLAGS_rocksdb_dir + db_name, options);
       std::unique_ptr<folly::SocketAddress> upstream_addr(nullptr);
       if (my_role == common::detail::Role::SLAVE) {
-        for (const auto& host : shard) {
-          if (host.second == common::detail::Role::MASTER) {
-            upstream_addr =
-              std::make_unique<folly::SocketAddress>(host.first->addr);
-            upstream_addr->setPort(FLAGS_rocksdb_replicator_port);
-            break;
-          }
+        // Slaves replicating from other Slaves serve their own applied
+        // updates downstream, offloading the Master's fan-out.
+        auto upstream = GetUpstreamHost(
+          shard, local_addr, segment.second.replication_fanout);
+        if (upstream) {
+          upstream_addr = std::make_unique<folly::SocketAddress>(upstream->addr);
+          upstream_addr->setPort(FLAGS_rocksdb_replicator_port);
         }
       }
 
-      ops.push_back(
-        [db_name = std::move(db_name),
-         db_future = folly::makeMoveWrapper(std::move(db_future)),
-         upstream_addr = folly::makeMoveWrapper(std::move(upstream_addr)),
-         my_role, &db_manager] () mutable {
-          std::string err_msg;
-          auto db = std::move(*db_future).get();
-          CHECK(db);
-          if (my_role == common::detail::Role::MASTER) {
-            LOG(ERROR) << "Hosting master " << db_name;
-            CHECK(db_manager->addDB(db_name, std::move(db),
-                                    replicator::DBRole::MASTER,
-                                    &err_msg)) << err_msg;
-            return;
-          }
+      startup_dbs.push_back(StartupDB{std::move(db_name),
+                                      rocksdb_options(segment.first),
+                                      GetColumnFamilies(column_family_options,
+                                                        segment.first),
+                                      my_role,
+                                      std::move(upstream_addr),
+                                      IsReadOnlySegment(segment.first),
+                                      0, 0, 0});
+    }
+  }
 
-          CHECK(my_role == common::detail::Role::SLAVE);
-          LOG(ERROR) << "Hosting slave " << db_name;
-          CHECK(db_manager->addDB(db_name, std::move(db),
-                                  replicator::DBRole::SLAVE,
-                                  std::move(*upstream_addr),
-                                  &err_msg)) << err_msg;
-        });
+  // Masters first, so that writes are taken as early as possible, and their
+  // Slaves elsewhere have something to pull from.
+  std::stable_sort(startup_dbs.begin(), startup_dbs.end(),
+                   [] (const StartupDB& a, const StartupDB& b) {
+                     return a.role == common::detail::Role::MASTER &&
+                       b.role != common::detail::Role::MASTER;
+                   });
+
+  // Each db is opened and added as soon as one of the openers gets to it, so
+  // that replication for it doesn't wait for the others.
+  const auto start_ms = common::timeutil::GetCurrentTimestamp();
+  std::atomic<size_t> next_db(0);
+  auto opener = [&startup_dbs, &next_db, &db_manager] {
+    size_t i;
+    while ((i = next_db++) < startup_dbs.size()) {
+      auto& startup_db = startup_dbs[i];
+      const auto db_path = FLAGS_rocksdb_dir + startup_db.db_name;
+      startup_db.wal_bytes = GetWALBytes(db_path);
+      common::Stats::get()->AddMetric(kStartupWALReplayBytes,
+                                      startup_db.wal_bytes);
+
+      LOG(INFO) << "Start opening " << db_path;
+      auto open_start_ms = common::timeutil::GetCurrentTimestamp();
+      auto db = startup_db.read_only ?
+        OpenReadOnlyRocksdb(db_path, startup_db.options) :
+        GetRocksdb(db_path, startup_db.options, startup_db.column_families);
+      CHECK(db);
+      auto add_start_ms = common::timeutil::GetCurrentTimestamp();
+      startup_db.open_ms = add_start_ms - open_start_ms;
+      common::Stats::get()->AddMetric(kStartupDBOpenMs, startup_db.open_ms);
+      LOG(INFO) << "Finished opening " << db_path;
+
+      std::string err_msg;
+      if (startup_db.read_only) {
+        // A SLAVE without upstream isn't replicated, nor written to
+        LOG(ERROR) << "Hosting read-only " << startup_db.db_name;
+        CHECK(db_manager->addDB(startup_db.db_name, std::move(db),
+                                replicator::DBRole::SLAVE, nullptr,
+                                &err_msg)) << err_msg;
+      } else if (startup_db.role == common::detail::Role::MASTER) {
+        LOG(ERROR) << "Hosting master " << startup_db.db_name;
+        CHECK(db_manager->addDB(startup_db.db_name, std::move(db),
+                                replicator::DBRole::MASTER,
+                                &err_msg)) << err_msg;
+      } else {
+        CHECK(startup_db.role == common::detail::Role::SLAVE);
+        LOG(ERROR) << "Hosting slave " << startup_db.db_name;
+        // A Slave applying without WAL may have lost updates in a crash. It
+        // is left out until it is rebuilt, instead of failing the others.
+        if (!db_manager->addDB(startup_db.db_name, std::move(db),
+                               replicator::DBRole::SLAVE,
+                               std::move(startup_db.upstream_addr),
+                               &err_msg)) {
+          LOG(ERROR) << "Failed to host slave " << startup_db.db_name << ": "
+                     << err_msg;
+        }
+      }
+      startup_db.add_ms =
+        common::timeutil::GetCurrentTimestamp() - add_start_ms;
+      common::Stats::get()->AddMetric(kStartupDBAddMs, startup_db.add_ms);
     }
+  };
+
+  const auto n_openers = std::min<size_t>(
+    std::max(FLAGS_num_startup_db_openers, 1), startup_dbs.size());
+  std::vector<std::thread> openers;
+  for (size_t i = 0; i < n_openers; ++i) {
+    openers.emplace_back(opener);
+  }
+  for (auto& thread : openers) {
+    thread.join();
   }
 
-  for (auto& op : ops) {
-    op();
+  const auto total_ms = common::timeutil::GetCurrentTimestamp() - start_ms;
+  common::Stats::get()->AddMetric(kStartupTotalMs, total_ms);
+  LOG(INFO) << "Opened " << startup_dbs.size() << " dbs in " << total_ms
+            << " ms";
+
+  // Opening is dominated by the WAL replay, so this tells which dbs to flush
+  // before the next restart
+  std::vector<const StartupDB*> by_open_ms;
+  for (const auto& startup_db : startup_dbs) {
+    by_open_ms.push_back(&startup_db);
+  }
+  std::sort(by_open_ms.begin(), by_open_ms.end(),
+            [] (const StartupDB* a, const StartupDB* b) {
+              return a->open_ms > b->open_ms;
+            });
+  std::string report = folly::stringPrintf(
+    "Opened %zu dbs in %" PRId64 " ms\n", startup_dbs.size(), total_ms);
+  for (size_t i = 0; i < by_open_ms.size(); ++i) {
+    const auto line = folly::stringPrintf(
+      "%s open_ms=%" PRIu64 " add_ms=%" PRIu64 " wal_bytes=%" PRIu64 "\n",
+      by_open_ms[i]->db_name.c_str(), by_open_ms[i]->open_ms,
+      by_open_ms[i]->add_ms, by_open_ms[i]->wal_bytes);
+    if (i < static_cast<size_t>(std::max(FLAGS_startup_report_top_dbs, 0))) {
+      LOG(INFO) << "Slow startup db " << line;
+    }
+    report += line;
+  }
+  {
+    std::lock_guard<std::mutex> g(startup_report_mutex);
+    startup_report = std::move(report);
   }
 
   return db_manager;
@@ -358,38 +1101,85 @@ bool SetAddressOrException(const std::string& ip,
   }
 }
 
-template <typename T>
-bool DecodeThriftStruct(const void* data, const size_t size, T* obj) {
-  try {
-    apache::thrift::BinarySerializer::deserialize(
-        folly::StringPiece(static_cast<const char *>(data), size), *obj);
-  } catch (const std::exception& ex) {
-    LOG(ERROR) << "Error when decoding message : " << ex.what();
-    return false;
-  }
-  return true;
-}
-
+// value points into kafka_payload, so nothing is copied per message
 bool DeserializeKafkaPayload(
     const void* kafka_payload,
     const size_t payload_len,
     admin::KafkaOperationCode* op_code,
-    std::string* value) {
-  admin::KafkaMessagePayload msg_payload;
-
-  if (DecodeThriftStruct<admin::KafkaMessagePayload>(kafka_payload, payload_len,
-      &msg_payload)) {
-    *op_code = msg_payload.op_code;
-    if (msg_payload.__isset.value) {
-      *value = std::move(msg_payload.value);
-    }
-    return true;
-  } else {
+    rocksdb::Slice* value) {
+  int32_t op_code_value;
+  folly::StringPiece value_piece;
+  if (!DecodeKafkaMessagePayload(kafka_payload, payload_len, &op_code_value,
+                                 &value_piece)) {
     common::Stats::get()->Incr(kKafkaDeserFailure);
     return false;
   }
+
+  *op_code = static_cast<admin::KafkaOperationCode>(op_code_value);
+  *value = rocksdb::Slice(value_piece.data(), value_piece.size());
+  return true;
 }
 
+// The per segment stats of kafka ingestion, resolved once rather than for
+// each message
+struct KafkaIngestionStats {
+  explicit KafkaIngestionStats(const std::string& segment)
+    : consumer_latency(SegmentMetric(kKafkaConsumerLatency, segment))
+    , put_messages(SegmentCounter(kKafkaDbPutMessage, segment))
+    , delete_messages(SegmentCounter(kKafkaDbDelMessage, segment))
+    , merge_messages(SegmentCounter(kKafkaDbMergeMessage, segment))
+    , put_errors(SegmentCounter(kKafkaDbPutErrors, segment))
+    , delete_errors(SegmentCounter(kKafkaDbDeleteErrors, segment))
+    , merge_errors(SegmentCounter(kKafkaDbMergeErrors, segment))
+    , invalid_opcode(SegmentCounter(kKafkaInvalidOpcode, segment))
+    , deduped_updates(SegmentCounter(kKafkaDedupedUpdates, segment)) {}
+
+  static common::Stats::CounterHandle SegmentCounter(
+      const std::string& name, const std::string& segment) {
+    return common::Stats::get()->GetCounterHandle(name,
+                                                  {{"segment", segment}});
+  }
+
+  static common::Stats::MetricHandle SegmentMetric(
+      const std::string& name, const std::string& segment) {
+    return common::Stats::get()->GetMetricHandle(name, {{"segment", segment}});
+  }
+
+  const common::Stats::MetricHandle consumer_latency;
+  const common::Stats::CounterHandle put_messages;
+  const common::Stats::CounterHandle delete_messages;
+  const common::Stats::CounterHandle merge_messages;
+  const common::Stats::CounterHandle put_errors;
+  const common::Stats::CounterHandle delete_errors;
+  const common::Stats::CounterHandle merge_errors;
+  const common::Stats::CounterHandle invalid_opcode;
+  const common::Stats::CounterHandle deduped_updates;
+};
+
+// The kafka messages consumed for a db but not written yet
+struct KafkaIngestionBatch {
+  rocksdb::WriteBatch updates;
+  // collects the updates instead of updates with
+  // --kafka_ingestion_dedup_batches
+  std::unique_ptr<WriteBatchDeduper> deduper;
+  uint64_t n_puts = 0;
+  uint64_t n_deletes = 0;
+  uint64_t n_merges = 0;
+  // the number of messages, including the ones not making it to updates
+  uint64_t n_messages = 0;
+  uint64_t first_message_ms = 0;
+  int64_t last_timestamp_ms = -1;
+
+  bool Full() const {
+    return FLAGS_kafka_ingestion_batch_max_bytes <= 0 ||
+      (deduper ? deduper->GetDataSize() : updates.GetDataSize()) >=
+        static_cast<size_t>(FLAGS_kafka_ingestion_batch_max_bytes) ||
+      common::timeutil::GetCurrentTimestamp(
+        common::timeutil::TimeUnit::kMillisecond) >=
+        first_message_ms + FLAGS_kafka_ingestion_batch_max_ms;
+  }
+};
+
 CPUThreadPoolExecutor* S3UploadAndDownloadExecutor() {
   static CPUThreadPoolExecutor executor(
       FLAGS_num_s3_upload_download_threads,
@@ -400,9 +1190,240 @@ CPUThreadPoolExecutor* S3UploadAndDownloadExecutor() {
   return &executor;
 }
 
+// A pool of admin call threads, whose backlog is reported as
+// admin_pool_pending_tasks pool=<name>
+class AdminCallPool {
+ public:
+  AdminCallPool(const std::string& name, const int n_threads)
+      : queue_ms_(kAdminPoolQueueMs + " pool=" + name)
+      , run_ms_(kAdminPoolRunMs + " pool=" + name)
+      , executor_(std::max(n_threads, 1),
+                  std::make_shared<common::IdenticalNameThreadFactory>(name)) {
+    common::Stats::get()->RegisterGauge(
+      kAdminPoolPendingTasks + " pool=" + name, [this] {
+        return executor_.getPoolStats().pendingTaskCount;
+      });
+  }
+
+  // Run call on a thread of the pool, recording how long it waited for one
+  // and how long it ran
+  void add(folly::Func call) {
+    executor_.add(
+      [this, call = std::move(call),
+       queued = std::chrono::steady_clock::now()] () mutable {
+        common::Stats::get()->AddMetric(
+          queue_ms_, std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - queued).count());
+        common::Timer timer(run_ms_);
+        call();
+      });
+  }
+
+ private:
+  const std::string queue_ms_;
+  const std::string run_ms_;
+  CPUThreadPoolExecutor executor_;
+};
+
+// The long admin calls run here instead of on the thrift worker threads. They
+// wait for their transfers on S3UploadAndDownloadExecutor(), so they must not
+// share it.
+AdminCallPool* LongRequestPool() {
+  static AdminCallPool pool("admin-long-call",
+                            FLAGS_num_admin_long_request_threads);
+  return &pool;
+}
+
+// The admin calls opening, closing or reconfiguring dbs, which take seconds
+// at most, run here, so that a burst of them, e.g. when a host takes over
+// shards, leaves the thrift worker threads to the data calls. They are kept
+// off LongRequestPool(), so that they don't queue behind transfers.
+AdminCallPool* ControlRequestPool() {
+  static AdminCallPool pool("admin-call",
+                            FLAGS_num_admin_control_request_threads);
+  return &pool;
+}
+
+// The versions of dbs replaced by reloads are closed and deleted here, once
+// their readers are done with them.
+CPUThreadPoolExecutor* RetiredDBExecutor() {
+  static CPUThreadPoolExecutor executor(
+      1,
+      std::make_shared<common::IdenticalNameThreadFactory>("retired-db"));
+
+  return &executor;
+}
+
+// The rate limiters shared by the backups, and by the restores, of all dbs,
+// nullptr for no limit
+std::shared_ptr<rocksdb::RateLimiter> HostBackupRateLimiter() {
+  static const std::shared_ptr<rocksdb::RateLimiter> limiter(
+    FLAGS_backup_host_rate_limit_mb > 0 ?
+      rocksdb::NewGenericRateLimiter(
+        static_cast<int64_t>(FLAGS_backup_host_rate_limit_mb) * kMB) :
+      nullptr);
+
+  return limiter;
+}
+
+std::shared_ptr<rocksdb::RateLimiter> HostRestoreRateLimiter() {
+  static const std::shared_ptr<rocksdb::RateLimiter> limiter(
+    FLAGS_restore_host_rate_limit_mb > 0 ?
+      rocksdb::NewGenericRateLimiter(
+        static_cast<int64_t>(FLAGS_restore_host_rate_limit_mb) * kMB) :
+      nullptr);
+
+  return limiter;
+}
+
+// Move the old version of a read-only db back to db_path after a failed
+// reload, where it is still served from
+void RestoreRetiredReadOnlyDB(const std::string& retired_path,
+                              const std::string& db_path) {
+  boost::system::error_code rename_err;
+  boost::filesystem::rename(retired_path, db_path, rename_err);
+  if (rename_err) {
+    LOG(ERROR) << "Failed to move " << retired_path << " back to " << db_path
+               << ", it won't reopen after a restart: "
+               << rename_err.message();
+  }
+}
+
+// The table readers of a db opened with max_open_files = -1 are never
+// closed, and with them the index and filter blocks they pin. Keep these
+// blocks in the block cache instead, so that they are given back when the db
+// is idle.
+void CacheIndexAndFilterBlocksIfPinned(rocksdb::Options* options) {
+  if (options->max_open_files != -1 || !options->table_factory ||
+      std::string(options->table_factory->Name()) != "BlockBasedTable") {
+    return;
+  }
+
+  auto table_options = *static_cast<rocksdb::BlockBasedTableOptions*>(
+    options->table_factory->GetOptions());
+  if (table_options.cache_index_and_filter_blocks) {
+    return;
+  }
+  table_options.cache_index_and_filter_blocks = true;
+  options->table_factory.reset(
+    rocksdb::NewBlockBasedTableFactory(table_options));
+}
+
+// Run func on the files with n_workers tasks on the S3 executor. The workers
+// share one queue of the files ordered by size, largest first, and each
+// takes the next file as soon as it is done with the last one, so that the
+// largest files don't pile up on one worker. No file is started after a
+// failure.
+// @return true if func succeeds on all files
+bool RunLargestFirst(std::vector<std::pair<std::string, uint64_t>> files,
+                     const uint32_t n_workers,
+                     const std::function<bool(const std::string&)>& func) {
+  std::stable_sort(files.begin(), files.end(),
+                   [] (const std::pair<std::string, uint64_t>& a,
+                       const std::pair<std::string, uint64_t>& b) {
+                     return a.second > b.second;
+                   });
+
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  std::vector<folly::Future<bool>> futures;
+  for (uint32_t i = 0; i < std::min<size_t>(n_workers, files.size()); ++i) {
+    auto p = folly::Promise<bool>();
+    futures.push_back(p.getFuture());
+
+    S3UploadAndDownloadExecutor()->add(
+        [&, p = std::move(p)]() mutable {
+          for (auto idx = next++; idx < files.size() && !failed; idx = next++) {
+            if (!func(files[idx].first)) {
+              failed = true;
+              break;
+            }
+          }
+          p.setValue(!failed);
+        });
+  }
+
+  // wait for all workers, they refer to the locals here
+  bool ok = true;
+  for (auto& f : futures) {
+    ok = std::move(f).get() && ok;
+  }
+  return ok && !failed;
+}
+
+// The bytes of the files in db_tmp/ left to delete
+std::atomic<uint64_t> pending_delete_bytes{0};
+
+// Tells apart the s3_tmp/ dirs of the concurrent S3 backups of a db
+std::atomic<uint64_t> s3_backup_seq{0};
+
+// Delete the file at path of size bytes by truncating it a chunk at a time
+// before unlinking it, so that the disk discards it gradually. It spends at
+// most --async_delete_dbs_bytes_per_sec. A file left when stopping is
+// deleted the next time.
+// Files hard linked elsewhere, e.g. SSTs shared with a checkpoint or with
+// the db they were split from, are only unlinked, as truncating them would
+// destroy the other copies.
+bool deleteFileRateLimited(const std::string& path, uint64_t size,
+                           const std::atomic<bool>& stop) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0 || st.st_nlink != 1) {
+    pending_delete_bytes -= std::min(pending_delete_bytes.load(), size);
+    size = 0;
+  }
+
+  while (size > 0) {
+    if (stop.load()) {
+      return false;
+    }
+    const auto step = std::min<uint64_t>(size, kDeleteChunkBytes);
+    if (truncate(path.c_str(), size - step) != 0) {
+      pending_delete_bytes -= std::min(pending_delete_bytes.load(), size);
+      break;
+    }
+    size -= step;
+    pending_delete_bytes -= std::min(pending_delete_bytes.load(), step);
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        step * 1000000 / FLAGS_async_delete_dbs_bytes_per_sec));
+  }
+  return unlink(path.c_str()) == 0;
+}
+
+// Delete db_path file by file with the rate limit, and then the empty
+// directories left
+bool deleteDBRateLimited(const boost::filesystem::path& db_path,
+                         const std::atomic<bool>& stop) {
+  std::vector<std::pair<std::string, uint64_t>> files;
+  boost::system::error_code err;
+  boost::filesystem::recursive_directory_iterator itr(db_path, err);
+  for (; !err && itr != boost::filesystem::recursive_directory_iterator();
+       itr.increment(err)) {
+    if (boost::filesystem::is_regular_file(itr->status())) {
+      files.emplace_back(itr->path().string(), std::max<int64_t>(
+          GetFileBytes(itr->path().string()), 0));
+    }
+  }
+  if (err) {
+    LOG(ERROR) << "Can't list files in " << db_path << ": " << err.message();
+    return false;
+  }
+
+  for (const auto& file : files) {
+    if (!deleteFileRateLimited(file.first, file.second, stop)) {
+      if (!stop.load()) {
+        LOG(ERROR) << "Cant delete file: " << file.first;
+      }
+      return false;
+    }
+  }
+
+  boost::filesystem::remove_all(db_path, err);
+  return !err;
+}
+
 // The dbs moved to db_tmp/ shouldnt be re-used or re-opened, so we can
 // delete them via boost filesystem operations rather than rocksdb::DestroyDB()
-void deleteTmpDBs() {
+void deleteTmpDBs(const std::atomic<bool>& stop) {
   static const std::string db_tmp_path = FLAGS_rocksdb_dir + "db_tmp/";
   boost::system::error_code dir_itr_err;
   boost::filesystem::directory_iterator itr(db_tmp_path, dir_itr_err);
@@ -410,13 +1431,37 @@ void deleteTmpDBs() {
     LOG(ERROR) << "Can't list files in db_tmp/:" << dir_itr_err.message();
     return;
   }
-  for (; itr != boost::filesystem::directory_iterator(); ++itr) {
+
+  const bool rate_limited = FLAGS_async_delete_dbs_bytes_per_sec > 0;
+  if (rate_limited) {
+    uint64_t total_bytes = 0;
+    boost::system::error_code err;
+    boost::filesystem::recursive_directory_iterator file_itr(db_tmp_path, err);
+    for (;
+         !err && file_itr != boost::filesystem::recursive_directory_iterator();
+         file_itr.increment(err)) {
+      if (boost::filesystem::is_regular_file(file_itr->status())) {
+        total_bytes += std::max<int64_t>(
+          GetFileBytes(file_itr->path().string()), 0);
+      }
+    }
+    pending_delete_bytes = total_bytes;
+  }
+
+  for (; itr != boost::filesystem::directory_iterator() && !stop.load();
+       ++itr) {
     if (itr->path().filename() == "." || itr->path().filename() == "..") {
       continue;
     }
     boost::system::error_code remove_err;
-    boost::filesystem::remove_all(itr->path(), remove_err);
-    if (remove_err) {
+    bool ok;
+    if (rate_limited) {
+      ok = deleteDBRateLimited(itr->path(), stop);
+    } else {
+      boost::filesystem::remove_all(itr->path(), remove_err);
+      ok = !remove_err;
+    }
+    if (!ok) {
       common::Stats::get()->Incr(kDeleteDBFailure);
       LOG(ERROR) << "Cant delete db: " << itr->path() << remove_err.message();
     } else {
@@ -426,33 +1471,162 @@ void deleteTmpDBs() {
   }
 }
 
+// Fill response with what checkDB() tells about db
+void FillCheckDBResponse(::admin::ApplicationDB* db,
+                         ::admin::CheckDBResponse* response) {
+  response->set_seq_num(db->rocksdb()->GetLatestSequenceNumber());
+  response->set_wal_ttl_seconds(db->rocksdb()->GetOptions().WAL_ttl_seconds);
+  response->set_is_master(!db->IsSlave());
+
+  // If there is at least one update
+  if (response->seq_num != 0) {
+    std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+    auto status = db->rocksdb()->GetUpdatesSince(response->seq_num, &iter);
+
+    if (status.ok() && iter && iter->Valid()) {
+      auto batch = iter->GetBatch();
+      uint64_t ms;
+      if (replicator::LogExtractor::ExtractTimestamp(*batch.writeBatchPtr,
+                                                     &ms)) {
+        response->set_last_update_timestamp_ms(ms);
+      }
+    }
+  }
+}
+
 }  // anonymous namespace
 
 namespace admin {
 
 AdminHandler::AdminHandler(
     std::unique_ptr<ApplicationDBManager> db_manager,
-    RocksDBOptionsGeneratorType rocksdb_options)
+    RocksDBOptionsGeneratorType rocksdb_options,
+    RocksDBColumnFamilyOptionsGeneratorType column_family_options)
   : db_admin_lock_()
+  , admission_controller_("handler")
   , db_manager_(std::move(db_manager))
   , rocksdb_options_(std::move(rocksdb_options))
-  , s3_util_()
-  , s3_util_lock_()
+  , column_family_options_(std::move(column_family_options))
+  , host_resources_(std::make_unique<HostResources>(
+      FLAGS_host_block_cache_bytes,
+      FLAGS_host_block_cache_use_clock,
+      FLAGS_host_block_cache_segment_shares,
+      FLAGS_host_write_buffer_bytes,
+      FLAGS_host_rate_limit_bytes_per_sec,
+      FLAGS_host_flash_cache_path,
+      FLAGS_host_flash_cache_bytes,
+      FLAGS_host_flash_cache_admit_on_second_miss,
+      FLAGS_host_block_cache_own_arena))
+  , compaction_scheduler_(std::make_unique<CompactionScheduler>(
+      std::max(FLAGS_max_concurrent_compactions_per_disk, 0)))
+  , db_resource_collector_(std::make_unique<DBResourceCollector>(
+      db_manager_.get(),
+      std::chrono::milliseconds(
+        std::max(FLAGS_db_resource_collect_interval_ms, 0))))
   , meta_db_(OpenMetaDB())
   , allow_overlapping_keys_segments_()
-  , num_current_s3_sst_downloadings_(0)
-  , stop_db_deletion_thread_(false) {
-  if (db_manager_ == nullptr) {
-    db_manager_ = CreateDBBasedOnConfig(rocksdb_options_);
+  , s3_transfer_admission_()
+  , kafka_checkpoints_()
+  , stop_kafka_checkpoint_thread_(false)
+  , stop_db_deletion_thread_(false)
+  , stop_tiered_storage_thread_(false)
+  , job_manager_(std::make_unique<AdminJobManager>(
+      FLAGS_num_admin_job_threads)) {
+  if (host_resources_->Enabled()) {
+    rocksdb_options_ = [generator = std::move(rocksdb_options_),
+                        resources = host_resources_.get()] (
+        const std::string& segment) {
+      auto options = generator(segment);
+      resources->Apply(segment, &options);
+      return options;
+    };
   }
-  folly::splitTo<std::string>(
-      ",", FLAGS_allow_overlapping_keys_segments,
-      std::inserter(allow_overlapping_keys_segments_,
+  if (FLAGS_rocksdb_event_stats) {
+    rocksdb_options_ = [generator = std::move(rocksdb_options_)] (
+        const std::string& segment) {
+      auto options = generator(segment);
+      StatsEventListener::AddTo(segment, &options);
+      return options;
+    };
+  }
+  if (FLAGS_application_db_hibernate_idle_min > 0 &&
+      FLAGS_application_db_hibernation_cache_index_and_filter_blocks) {
+    rocksdb_options_ = [generator = std::move(rocksdb_options_)] (
+        const std::string& segment) {
+      auto options = generator(segment);
+      CacheIndexAndFilterBlocksIfPinned(&options);
+      return options;
+    };
+  }
+  if (FLAGS_kafka_ingestion_disable_wal) {
+    rocksdb_options_ = [generator = std::move(rocksdb_options_), this] (
+        const std::string& segment) {
+      auto options = generator(segment);
+      FlushListener::AddTo(
+        [this] (const std::string& db_name,
+                const rocksdb::SequenceNumber largest_seqno) {
+          onMemTableFlushed(db_name, largest_seqno);
+        },
+        &options);
+      return options;
+    };
+  }
+  if (!FLAGS_tiered_storage_segments.empty()) {
+    rocksdb_options_ = [generator = std::move(rocksdb_options_)] (
+        const std::string& segment) {
+      auto options = generator(segment);
+      if (IsTieredStorageSegment(segment)) {
+        options.env = TieredStorageEnv();
+      }
+      return options;
+    };
+  }
+  if (db_manager_ == nullptr) {
+    db_manager_ = CreateDBBasedOnConfig(rocksdb_options_,
+                                        column_family_options_);
+  }
+  folly::splitTo<std::string>(
+      ",", FLAGS_allow_overlapping_keys_segments,
+      std::inserter(allow_overlapping_keys_segments_,
                     allow_overlapping_keys_segments_.begin()));
 
   CHECK(FLAGS_max_s3_sst_loading_concurrency > 0)
     << "Invalid FLAGS_max_s3_sst_loading_concurrency: "
     << FLAGS_max_s3_sst_loading_concurrency;
+  s3_transfer_admission_ = std::make_unique<common::AdmissionQueue>(
+    FLAGS_max_s3_sst_loading_concurrency);
+
+  kafka_checkpoint_thread_ = std::make_unique<std::thread>([this] {
+    if (!folly::setThreadName("KafkaCkpt")) {
+      LOG(ERROR) << "Failed to set thread name for kafka checkpoint thread";
+    }
+
+    std::unique_lock<std::mutex> lock(kafka_checkpoints_lock_);
+    while (!stop_kafka_checkpoint_thread_) {
+      kafka_checkpoint_cv_.wait_for(
+        lock, std::chrono::milliseconds(FLAGS_kafka_ts_flush_interval_ms),
+        [this] { return stop_kafka_checkpoint_thread_; });
+      lock.unlock();
+      flushKafkaCheckpoints();
+      lock.lock();
+    }
+  });
+
+  if (!FLAGS_tiered_storage_segments.empty()) {
+    tiered_storage_thread_ = std::make_unique<std::thread>([this] {
+      if (!folly::setThreadName("TieredStorage")) {
+        LOG(ERROR) << "Failed to set thread name for tiered storage thread";
+      }
+
+      while (!stop_tiered_storage_thread_.load()) {
+        offloadColdFiles();
+        for (int i = 0; i < FLAGS_tiered_storage_check_interval_sec &&
+                        !stop_tiered_storage_thread_.load(); ++i) {
+          std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+      }
+    });
+  }
 
   if (FLAGS_enable_async_delete_dbs) {
     static const std::string db_tmp_path = FLAGS_rocksdb_dir + "db_tmp/";
@@ -465,6 +1639,9 @@ AdminHandler::AdminHandler(
       }
     }
 
+    common::Stats::get()->RegisterGauge(kPendingDeleteBytes, [] {
+        return pending_delete_bytes.load();
+      });
     db_deletion_thread_ = std::make_unique<std::thread>([this] {
       if (!folly::setThreadName("DBDeleter")) {
         LOG(ERROR) << "Failed to set thread name for DB deletion thread";
@@ -472,19 +1649,96 @@ AdminHandler::AdminHandler(
 
       LOG(INFO) << "Starting DB deletion thread ...";
       while (!stop_db_deletion_thread_.load()) {
-        deleteTmpDBs();
+        deleteTmpDBs(stop_db_deletion_thread_);
         std::this_thread::sleep_for(std::chrono::seconds(FLAGS_async_delete_dbs_frequency_sec));
       }
       LOG(INFO) << "Stopping DB deletioin thread ...";
     });
   }
+
+  if (FLAGS_enable_auto_catch_up_from_checkpoint) {
+    replicator::RocksDBReplicator::instance()->setWALPurgedHandler(
+      [this] (const std::string& db_name,
+              const folly::SocketAddress& upstream_addr) {
+        S3UploadAndDownloadExecutor()->add([this, db_name, upstream_addr] {
+            catchUpFromUpstreamCheckpoint(db_name, upstream_addr);
+          });
+      });
+  }
 }
 
 AdminHandler::~AdminHandler() {
+  {
+    // Stop the shared kafka consumers while their handlers can still set
+    // kafka checkpoints
+    decltype(kafka_shared_consumers_) shared_consumers;
+    {
+      std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
+      shared_consumers.swap(kafka_shared_consumers_);
+      kafka_shared_consumer_dbs_.clear();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+    stop_kafka_checkpoint_thread_ = true;
+  }
+  kafka_checkpoint_cv_.notify_all();
+  kafka_checkpoint_thread_->join();
+  if (FLAGS_enable_auto_catch_up_from_checkpoint) {
+    replicator::RocksDBReplicator::instance()->setWALPurgedHandler(nullptr);
+  }
   if (FLAGS_enable_async_delete_dbs) {
     stop_db_deletion_thread_ = true;
     db_deletion_thread_->join();
   }
+  if (tiered_storage_thread_) {
+    stop_tiered_storage_thread_ = true;
+    tiered_storage_thread_->join();
+  }
+}
+
+void AdminHandler::offloadColdFiles() {
+  const uint64_t now_sec = common::timeutil::GetCurrentTimestamp(
+    common::timeutil::TimeUnit::kSecond);
+  for (const auto& db_name : getAllDBNames()) {
+    if (stop_tiered_storage_thread_.load()) {
+      return;
+    }
+    if (!IsTieredStorageSegment(DbNameToSegment(db_name))) {
+      continue;
+    }
+    auto db = getDB(db_name, nullptr);
+    if (db == nullptr) {
+      continue;
+    }
+
+    std::vector<rocksdb::LiveFileMetaData> files;
+    db->rocksdb()->GetLiveFilesMetaData(&files);
+    const int bottommost_level = db->rocksdb()->NumberLevels() - 1;
+    for (const auto& file : files) {
+      const auto path = file.db_path + file.name;
+      uint64_t mtime;
+      if (file.level != bottommost_level ||
+          TieredStorageEnv()->IsOffloaded(path) ||
+          !rocksdb::Env::Default()->GetFileModificationTime(path,
+                                                            &mtime).ok()) {
+        continue;
+      }
+      if (mtime + FLAGS_tiered_storage_file_age_sec > now_sec) {
+        continue;
+      }
+
+      auto status = TieredStorageEnv()->Offload(path);
+      if (!status.ok()) {
+        common::Stats::get()->Incr(kTieredStorageOffloadFailures);
+        LOG(ERROR) << "Failed to move " << path << " to S3: "
+                   << status.ToString();
+        continue;
+      }
+      common::Stats::get()->Incr(kTieredStorageOffloadedFiles);
+      common::Stats::get()->Incr(kTieredStorageOffloadedBytes, file.size);
+    }
+  }
 }
 
 std::shared_ptr<ApplicationDB> AdminHandler::getDB(
@@ -500,6 +1754,47 @@ std::shared_ptr<ApplicationDB> AdminHandler::getDB(
   return db;
 }
 
+void AdminHandler::warmUpDB(ApplicationDB* db) {
+  if (db == nullptr || FLAGS_db_warm_up_budget_ms <= 0) {
+    return;
+  }
+
+  db->WarmUp(std::chrono::milliseconds(FLAGS_db_warm_up_budget_ms),
+             FLAGS_db_warm_up_scan_bytes,
+             FLAGS_db_warm_up_max_bytes_per_sec);
+}
+
+std::unique_ptr<common::AdmissionQueue::Admission>
+AdminHandler::admitS3Transfer(const uint32_t priority,
+                              const std::string& db_name,
+                              std::string* err_msg) {
+  // The local db size is what we know about the size of the transfer before
+  // it starts. It is 0 for a new db being restored.
+  uint64_t db_bytes = 0;
+  auto db = getDB(db_name, nullptr);
+  if (db != nullptr) {
+    db->rocksdb()->GetIntProperty("rocksdb.total-sst-files-size", &db_bytes);
+  }
+
+  common::Stats::get()->AddMetric(kS3TransferQueueDepth,
+                                  s3_transfer_admission_->QueueDepth());
+  const auto start_ms = common::timeutil::GetCurrentTimestamp();
+  auto admission = s3_transfer_admission_->Admit(
+    priority, db_bytes,
+    std::chrono::milliseconds(FLAGS_s3_transfer_admission_timeout_ms));
+  const auto wait_ms = common::timeutil::GetCurrentTimestamp() - start_ms;
+  common::Stats::get()->AddMetric(kS3TransferAdmissionWaitMs, wait_ms);
+  if (admission == nullptr) {
+    *err_msg = folly::stringPrintf(
+      "Concurrent uploading/downloading limit hits %d by %s",
+      FLAGS_max_s3_sst_loading_concurrency, db_name.c_str()) +
+      ", timed out after waiting " + std::to_string(wait_ms) + " ms";
+    common::Stats::get()->Incr(kS3TransferAdmissionTimeout);
+  }
+
+  return admission;
+}
+
 std::unique_ptr<rocksdb::DB> AdminHandler::removeDB(
     const std::string& db_name,
     AdminException* ex) {
@@ -513,6 +1808,172 @@ std::unique_ptr<rocksdb::DB> AdminHandler::removeDB(
   return db;
 }
 
+void AdminHandler::catchUpFromUpstreamCheckpoint(
+    const std::string& db_name,
+    const folly::SocketAddress& upstream_addr) {
+  // Fetch the checkpoint before closing the db, so that it keeps serving
+  // (stale) reads in the meantime
+  const auto tmp_path = FLAGS_rocksdb_dir + "catch_up_tmp/" + db_name +
+    std::to_string(common::timeutil::GetCurrentTimestamp());
+  boost::system::error_code create_err;
+  boost::filesystem::create_directories(FLAGS_rocksdb_dir + "catch_up_tmp/",
+                                        create_err);
+  std::string err_msg;
+  if (create_err ||
+      !replicator::RocksDBReplicator::instance()->fetchCheckpoint(
+        db_name, upstream_addr, tmp_path, &err_msg)) {
+    LOG(ERROR) << "Failed to fetch a checkpoint of " << db_name << " from "
+               << upstream_addr.describe() << ": "
+               << (create_err ? create_err.message() : err_msg);
+    boost::filesystem::remove_all(tmp_path, create_err);
+    common::Stats::get()->Incr(kCheckpointCatchUpFailure);
+    return;
+  }
+
+  db_admin_lock_.Lock(db_name);
+  SCOPE_EXIT { db_admin_lock_.Unlock(db_name); };
+  SCOPE_EXIT { boost::filesystem::remove_all(tmp_path, create_err); };
+
+  {
+    // The db may have been closed or promoted while fetching
+    auto db = getDB(db_name, nullptr);
+    if (db == nullptr || !db->IsSlave() || db->upstream_addr() == nullptr ||
+        *db->upstream_addr() != upstream_addr) {
+      LOG(INFO) << db_name << " changed while fetching the checkpoint, "
+                << "dropping it";
+      return;
+    }
+  }
+
+  removeDB(db_name, nullptr);
+
+  const auto segment = admin::DbNameToSegment(db_name);
+  const auto db_path = FLAGS_rocksdb_dir + db_name;
+  auto status = rocksdb::DestroyDB(db_path, rocksdb_options_(segment));
+  boost::system::error_code rename_err;
+  if (status.ok()) {
+    boost::filesystem::rename(tmp_path, db_path, rename_err);
+  }
+
+  // Reopen the db, either from the checkpoint or as it was on failures
+  auto db = GetRocksdb(db_path, rocksdb_options_(segment),
+                       GetColumnFamilies(column_family_options_, segment));
+  if (db == nullptr || !db_manager_->addDB(
+        db_name, std::move(db), replicator::DBRole::SLAVE,
+        std::make_unique<folly::SocketAddress>(upstream_addr), &err_msg)) {
+    LOG(ERROR) << "Failed to reopen " << db_name << " " << err_msg;
+    common::Stats::get()->Incr(kCheckpointCatchUpFailure);
+    return;
+  }
+
+  if (!status.ok() || rename_err) {
+    LOG(ERROR) << "Failed to replace " << db_name << " with the checkpoint: "
+               << (status.ok() ? rename_err.message() : status.ToString());
+    common::Stats::get()->Incr(kCheckpointCatchUpFailure);
+    return;
+  }
+
+  LOG(INFO) << "Replaced " << db_name << " with a checkpoint from "
+            << upstream_addr.describe();
+  common::Stats::get()->Incr(kCheckpointCatchUpSuccess);
+}
+
+void AdminHandler::setKafkaCheckpoint(const std::string& db_name,
+                                      const int64_t timestamp_ms) {
+  std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+  kafka_checkpoints_[db_name] = timestamp_ms;
+}
+
+void AdminHandler::addUnflushedKafkaCheckpoint(
+    const std::string& db_name,
+    const rocksdb::SequenceNumber seq_no,
+    const int64_t timestamp_ms) {
+  std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+  // A flush may have persisted seq_no already, before this was called, and
+  // the next one may be far off. The checkpoints before it were promoted by
+  // that flush.
+  auto flushed_itor = flushed_kafka_seq_nos_.find(db_name);
+  if (flushed_itor != flushed_kafka_seq_nos_.end() &&
+      seq_no <= flushed_itor->second) {
+    kafka_checkpoints_[db_name] = timestamp_ms;
+    return;
+  }
+  unflushed_kafka_checkpoints_[db_name].emplace_back(seq_no, timestamp_ms);
+}
+
+void AdminHandler::onMemTableFlushed(
+    const std::string& db_name,
+    const rocksdb::SequenceNumber largest_seqno) {
+  std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+  if (FLAGS_kafka_ingestion_disable_wal) {
+    auto& flushed = flushed_kafka_seq_nos_[db_name];
+    flushed = std::max(flushed, largest_seqno);
+  }
+  auto itor = unflushed_kafka_checkpoints_.find(db_name);
+  if (itor == unflushed_kafka_checkpoints_.end()) {
+    return;
+  }
+
+  auto& unflushed = itor->second;
+  while (!unflushed.empty() && unflushed.front().first <= largest_seqno) {
+    kafka_checkpoints_[db_name] = unflushed.front().second;
+    unflushed.pop_front();
+  }
+  if (unflushed.empty()) {
+    unflushed_kafka_checkpoints_.erase(itor);
+  }
+}
+
+void AdminHandler::flushKafkaCheckpoints(const std::string& db_name) {
+  // Held from taking the checkpoints until they are written, or a concurrent
+  // flush could take newer ones and write them first, to be overwritten
+  // with these older ones, or a clearMetaData() could come in between.
+  std::lock_guard<std::mutex> meta_db_lock(meta_db_lock_);
+  std::unordered_map<std::string, int64_t> checkpoints;
+  {
+    std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+    if (db_name.empty()) {
+      checkpoints.swap(kafka_checkpoints_);
+    } else {
+      auto itor = kafka_checkpoints_.find(db_name);
+      if (itor != kafka_checkpoints_.end()) {
+        checkpoints.insert(*itor);
+        kafka_checkpoints_.erase(itor);
+      }
+    }
+  }
+
+  if (checkpoints.empty()) {
+    return;
+  }
+
+  rocksdb::WriteBatch updates;
+  for (const auto& checkpoint : checkpoints) {
+    auto meta = getMetaData(checkpoint.first);
+    meta.set_last_kafka_msg_timestamp_ms(checkpoint.second);
+    std::string buffer;
+    apache::thrift::CompactSerializer::serialize(meta, &buffer);
+    updates.Put(checkpoint.first, buffer);
+  }
+
+  rocksdb::WriteOptions options;
+  options.sync = true;
+  auto s = meta_db_->Write(options, &updates);
+  if (!s.ok()) {
+    LOG(ERROR) << "[meta_db] Failed to write kafka timestamps for "
+               << checkpoints.size() << " dbs: " << s.ToString();
+    // Retry with the next flush, unless there are newer ones
+    std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+    for (const auto& checkpoint : checkpoints) {
+      kafka_checkpoints_.insert(checkpoint);
+    }
+    return;
+  }
+
+  VLOG(1) << "[meta_db] Wrote kafka timestamps for " << checkpoints.size()
+          << " dbs";
+}
+
 DBMetaData AdminHandler::getMetaData(const std::string& db_name) {
   DBMetaData meta;
   meta.db_name = db_name;
@@ -528,6 +1989,13 @@ DBMetaData AdminHandler::getMetaData(const std::string& db_name) {
 }
 
 bool AdminHandler::clearMetaData(const std::string& db_name) {
+  std::lock_guard<std::mutex> meta_db_lock(meta_db_lock_);
+  {
+    std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+    kafka_checkpoints_.erase(db_name);
+    unflushed_kafka_checkpoints_.erase(db_name);
+    flushed_kafka_seq_nos_.erase(db_name);
+  }
   rocksdb::WriteOptions options;
   options.sync = true;
   auto s = meta_db_->Delete(options, db_name);
@@ -539,6 +2007,13 @@ bool AdminHandler::writeMetaData(
     const std::string& s3_bucket,
     const std::string& s3_path,
     const int64_t last_kafka_msg_timestamp_ms) {
+  std::lock_guard<std::mutex> meta_db_lock(meta_db_lock_);
+  {
+    std::lock_guard<std::mutex> lock(kafka_checkpoints_lock_);
+    kafka_checkpoints_.erase(db_name);
+    unflushed_kafka_checkpoints_.erase(db_name);
+    flushed_kafka_seq_nos_.erase(db_name);
+  }
   DBMetaData meta;
   meta.db_name = db_name;
   meta.set_s3_bucket(s3_bucket);
@@ -555,6 +2030,20 @@ bool AdminHandler::writeMetaData(
 }
 
 void AdminHandler::async_tm_addDB(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      AddDBResponse>>> callback,
+    std::unique_ptr<AddDBRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    addDB(std::move(control_callback), std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  addDB(std::move(callback), std::move(request));
+}
+
+void AdminHandler::addDB(
       std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
           AddDBResponse>>> callback,
       std::unique_ptr<AddDBRequest> request) {
@@ -564,6 +2053,10 @@ void AdminHandler::async_tm_addDB(
   AdminException e;
   auto db = getDB(request->db_name, &e);
   if (db) {
+    // Opened at startup, warm it up before the shard is marked online
+    if (!db->IsWarmedUp()) {
+      warmUpDB(db.get());
+    }
     e.errorCode = AdminErrorCode::DB_EXIST;
     e.message = "Db already exists";
     callback.release()->exceptionInThread(std::move(e));
@@ -595,9 +2088,28 @@ void AdminHandler::async_tm_addDB(
     }
   }
 
+  if (IsReadOnlySegment(segment)) {
+    std::string err_msg;
+    auto read_only_db = OpenReadOnlyRocksdb(db_path, rocksdb_options_(segment));
+    if (read_only_db == nullptr ||
+        !db_manager_->addDB(request->db_name, std::move(read_only_db),
+                            replicator::DBRole::SLAVE, nullptr, &err_msg)) {
+      e.errorCode = AdminErrorCode::DB_ERROR;
+      e.message = "Failed to open read-only " + request->db_name + " " +
+        err_msg;
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+    warmUpDB(getDB(request->db_name, nullptr).get());
+    callback->result(AddDBResponse());
+    return;
+  }
+
   // Open the actual rocksdb instance
-  rocksdb::DB* rocksdb_db;
-  status = rocksdb::DB::Open(rocksdb_options_(segment), db_path, &rocksdb_db);
+  std::unique_ptr<rocksdb::DB> rocksdb_db;
+  status = ColumnFamilyDB::Open(
+    rocksdb_options_(segment), db_path,
+    GetColumnFamilies(column_family_options_, segment), &rocksdb_db);
   if (!OKOrSetException(status,
                         AdminErrorCode::DB_ERROR,
                         &callback)) {
@@ -621,8 +2133,7 @@ void AdminHandler::async_tm_addDB(
     }
   }
 
-  if (!db_manager_->addDB(request->db_name,
-                          std::unique_ptr<rocksdb::DB>(rocksdb_db),
+  if (!db_manager_->addDB(request->db_name, std::move(rocksdb_db),
                           role, std::move(upstream_addr),
                           &err_msg)) {
     e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
@@ -630,6 +2141,7 @@ void AdminHandler::async_tm_addDB(
     callback.release()->exceptionInThread(std::move(e));
     return;
   }
+  warmUpDB(getDB(request->db_name, nullptr).get());
   callback->result(AddDBResponse());
 }
 
@@ -647,8 +2159,11 @@ bool AdminHandler::backupDBHelper(const std::string& db_name,
                                   bool include_meta,
                                   AdminException* e) {
   CHECK(env_holder != nullptr);
-  db_admin_lock_.Lock(db_name);
-  SCOPE_EXIT { db_admin_lock_.Unlock(db_name); };
+  const auto backup_key = db_name + " " + backup_dir;
+  backup_dir_lock_.Lock(backup_key);
+  SCOPE_EXIT { backup_dir_lock_.Unlock(backup_key); };
+  db_admin_lock_.LockShared(db_name);
+  SCOPE_EXIT { db_admin_lock_.UnlockShared(db_name); };
 
   auto db = getDB(db_name, e);
   if (db == nullptr) {
@@ -663,9 +2178,12 @@ bool AdminHandler::backupDBHelper(const std::string& db_name,
   common::RocksdbGLogger logger;
   options.info_log = &logger;
   options.max_background_operations = FLAGS_num_hdfs_access_threads;
-  if (enable_backup_rate_limit && backup_rate_limit > 0) {
-    options.backup_rate_limit = backup_rate_limit * kMB;
-  }
+  // The rate limit of the request applies on top of the share of the db
+  auto rate_limiter = std::make_shared<JobRateLimiter>(
+    HostBackupRateLimiter(),
+    enable_backup_rate_limit ? static_cast<int64_t>(backup_rate_limit) * kMB
+                             : 0);
+  options.backup_rate_limiter = rate_limiter;
   options.backup_env = env_holder.get();
 
   rocksdb::BackupEngine* backup_engine;
@@ -678,6 +2196,14 @@ bool AdminHandler::backupDBHelper(const std::string& db_name,
     return false;
   }
   std::unique_ptr<rocksdb::BackupEngine> backup_engine_holder(backup_engine);
+  SCOPE_EXIT {
+    const auto bytes_per_sec = rate_limiter->GetThroughput();
+    LOG(INFO) << "Backup of " << db_name << " copied "
+              << rate_limiter->GetTotalBytesThrough() << " bytes at "
+              << bytes_per_sec << " bytes/s";
+    common::Stats::get()->AddMetric(kBackupBytesPerSec + " db=" + db_name,
+                                    bytes_per_sec);
+  };
 
   if (include_meta) {
     std::string db_meta;
@@ -717,9 +2243,12 @@ bool AdminHandler::restoreDBHelper(const std::string& db_name,
   common::RocksdbGLogger logger;
   options.info_log = &logger;
   options.max_background_operations = FLAGS_num_hdfs_access_threads;
-  if (enable_restore_rate_limit && restore_rate_limit > 0) {
-    options.restore_rate_limit = restore_rate_limit * kMB;
-  }
+  // The rate limit of the request applies on top of the share of the db
+  auto rate_limiter = std::make_shared<JobRateLimiter>(
+    HostRestoreRateLimiter(),
+    enable_restore_rate_limit ? static_cast<int64_t>(restore_rate_limit) * kMB
+                              : 0);
+  options.restore_rate_limiter = rate_limiter;
   options.backup_env = env_holder.get();
 
   rocksdb::BackupEngine* backup_engine;
@@ -747,15 +2276,23 @@ bool AdminHandler::restoreDBHelper(const std::string& db_name,
 
   auto db_path = FLAGS_rocksdb_dir + db_name;
   status = backup_engine->RestoreDBFromBackup(latest_backup_id, db_path, db_path);
+  const auto bytes_per_sec = rate_limiter->GetThroughput();
+  LOG(INFO) << "Restore of " << db_name << " copied "
+            << rate_limiter->GetTotalBytesThrough() << " bytes at "
+            << bytes_per_sec << " bytes/s";
+  common::Stats::get()->AddMetric(kRestoreBytesPerSec + " db=" + db_name,
+                                  bytes_per_sec);
   if (!status.ok()) {
     e->errorCode = AdminErrorCode::DB_ADMIN_ERROR;
     e->message = status.ToString();
     return false;
   }
 
-  rocksdb::DB* rocksdb_db;
+  std::unique_ptr<rocksdb::DB> rocksdb_db;
   auto segment = admin::DbNameToSegment(db_name);
-  status = rocksdb::DB::Open(rocksdb_options_(segment), db_path, &rocksdb_db);
+  status = ColumnFamilyDB::Open(
+    rocksdb_options_(segment), db_path,
+    GetColumnFamilies(column_family_options_, segment), &rocksdb_db);
   if (!status.ok()) {
     e->errorCode = AdminErrorCode::DB_ERROR;
     e->message = status.ToString();
@@ -778,14 +2315,14 @@ bool AdminHandler::restoreDBHelper(const std::string& db_name,
   }
 
   std::string err_msg;
-  if (!db_manager_->addDB(db_name,
-                          std::unique_ptr<rocksdb::DB>(rocksdb_db),
+  if (!db_manager_->addDB(db_name, std::move(rocksdb_db),
                           replicator::DBRole::SLAVE,
                           std::move(upstream_addr), &err_msg)) {
     e->errorCode = AdminErrorCode::DB_ADMIN_ERROR;
     e->message = std::move(err_msg);
     return false;
   }
+  warmUpDB(getDB(db_name, nullptr).get());
   return true;
 }
 
@@ -888,26 +2425,44 @@ void AdminHandler::async_tm_backupDBToS3(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       BackupDBToS3Response>>> callback,
     std::unique_ptr<BackupDBToS3Request> request) {
-  AdminException e;
-  const auto n = num_current_s3_sst_uploadings_.fetch_add(1);
-  SCOPE_EXIT {
-    num_current_s3_sst_uploadings_.fetch_sub(1);
+  auto run = [this] (auto job_callback, auto job_request) {
+    backupDBToS3(std::move(job_callback), std::move(job_request));
   };
+  const auto source = request->s3_bucket + "/" + request->s3_backup_dir;
+  if (submitJobIfAsync(&callback, &request, "backupDBToS3", source, run) ||
+      offloadLongRequest(&callback, &request, std::move(run))) {
+    return;
+  }
 
-  if (n >= FLAGS_max_s3_sst_loading_concurrency) {
-    auto err_str =
-        folly::stringPrintf("Concurrent uploading/downloading limit hits %d by %s",
-                            n, request->db_name.c_str());
+  backupDBToS3(std::move(callback), std::move(request));
+}
+
+template <typename CallbackType>
+void AdminHandler::backupDBToS3(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<BackupDBToS3Request> request) {
+  AdminException e;
+  std::string err_str;
+  auto admission =
+    admitS3Transfer(kS3BackupPriority, request->db_name, &err_str);
+  if (admission == nullptr) {
     SetException(err_str, AdminErrorCode::DB_ADMIN_ERROR, &callback);
     LOG(ERROR) << err_str;
     common::Stats::get()->Incr(kS3BackupFailure);
     return;
   }
 
+  // The backups of the db to the same s3 dir would overwrite each other's
+  // files
+  const auto backup_key = request->db_name + " " + request->s3_bucket + "/" +
+    request->s3_backup_dir;
+  backup_dir_lock_.Lock(backup_key);
+  SCOPE_EXIT { backup_dir_lock_.Unlock(backup_key); };
+
   common::Timer timer(kS3BackupMs);
   LOG(INFO) << "S3 Backup " << request->db_name << " to " << request->s3_backup_dir;
   auto ts = common::timeutil::GetCurrentTimestamp();
-  auto local_path = folly::stringPrintf("%ss3_tmp/%s%d/", FLAGS_rocksdb_dir.c_str(), request->db_name.c_str(), ts);
+  auto local_path = folly::stringPrintf("%ss3_tmp/%s%d_%lu/", FLAGS_rocksdb_dir.c_str(), request->db_name.c_str(), ts, s3_backup_seq++);
   boost::system::error_code remove_err;
   boost::system::error_code create_err;
   boost::filesystem::remove_all(local_path, remove_err);
@@ -920,8 +2475,8 @@ void AdminHandler::async_tm_backupDBToS3(
   }
 
   if (FLAGS_enable_checkpoint_backup) {
-    db_admin_lock_.Lock(request->db_name);
-    SCOPE_EXIT { db_admin_lock_.Unlock(request->db_name); };
+    db_admin_lock_.LockShared(request->db_name);
+    SCOPE_EXIT { db_admin_lock_.UnlockShared(request->db_name); };
 
     auto db = getDB(request->db_name, &e);
     if (db == nullptr) {
@@ -959,28 +2514,96 @@ void AdminHandler::async_tm_backupDBToS3(
       return;
     }
 
+    int64_t total_bytes = 0;
+    for (const auto& file : checkpoint_files) {
+      if (file != "." && file != "..") {
+        total_bytes += GetFileBytes(checkpoint_local_path + "/" + file);
+      }
+    }
+    SetJobTotalBytes(callback.get(), total_bytes);
+
     // Upload checkpoint to s3
     auto local_s3_util = createLocalS3Util(request->limit_mbs, request->s3_bucket);
     std::string formatted_s3_dir_path = ensure_ends_with_pathsep(request->s3_backup_dir);
     std::string formatted_checkpoint_local_path = ensure_ends_with_pathsep(checkpoint_local_path);
+    // (s3 key, local file) of the files to upload
+    std::vector<std::pair<std::string, std::string>> uploads;
+    const bool share_files_with_checksum =
+      request->__isset.share_files_with_checksum && request->share_files_with_checksum;
+    CheckpointSstManifest manifest;
+    if (share_files_with_checksum) {
+      // The sst files are immutable, so the ones uploaded by the previous
+      // backups are referred to by the manifest instead of being re-uploaded
+      const auto shared_s3_dir_path = GetSharedSstS3Dir(formatted_s3_dir_path);
+      auto list_resp = local_s3_util->listAllObjects(shared_s3_dir_path);
+      if (!list_resp.Error().empty()) {
+        auto err_msg = "Error happened when listing shared sst files in S3: " + list_resp.Error();
+        LOG(ERROR) << err_msg;
+        SetException(err_msg, AdminErrorCode::DB_ADMIN_ERROR, &callback);
+        common::Stats::get()->Incr(kS3BackupFailure);
+        return;
+      }
+      const std::unordered_set<std::string> shared_s3_keys(
+        list_resp.Body().objects.begin(), list_resp.Body().objects.end());
+
+      int64_t shared_bytes = 0;
+      for (const auto& file : checkpoint_files) {
+        if (file == "." || file == "..") {
+          continue;
+        }
+        const auto source = formatted_checkpoint_local_path + file;
+        if (!IsSstFileName(file)) {
+          uploads.emplace_back(formatted_s3_dir_path + file, source);
+          continue;
+        }
+
+        SharedSstFile shared_file;
+        shared_file.file_name = file;
+        shared_file.size = GetFileBytes(source);
+        uint32_t crc32c;
+        if (!GetFileCrc32c(source, &crc32c)) {
+          SetException("Failed to checksum " + source,
+                       AdminErrorCode::DB_ADMIN_ERROR, &callback);
+          common::Stats::get()->Incr(kS3BackupFailure);
+          return;
+        }
+        shared_file.crc32c = static_cast<int32_t>(crc32c);
+        shared_file.s3_key = shared_s3_dir_path + GetSharedSstFileName(
+          file, crc32c, shared_file.size);
+        if (shared_s3_keys.count(shared_file.s3_key) > 0) {
+          shared_bytes += shared_file.size;
+          AddJobBytes(callback.get(), shared_file.size);
+        } else {
+          uploads.emplace_back(shared_file.s3_key, source);
+        }
+        manifest.sst_files.push_back(std::move(shared_file));
+      }
+      common::Stats::get()->AddMetric(kS3BackupSharedBytes, shared_bytes);
+    } else {
+      for (const auto& file : checkpoint_files) {
+        if (file != "." && file != "..") {
+          uploads.emplace_back(formatted_s3_dir_path + file,
+                               formatted_checkpoint_local_path + file);
+        }
+      }
+    }
+
     auto upload_func = [&](const std::string& dest, const std::string& source) {
       auto copy_resp = local_s3_util->putObject(dest, source);
       if (!copy_resp.Error().empty()) {
         LOG(ERROR) << "Error happened when uploading files from checkpoint to S3: " << copy_resp.Error();
         return false;
       }
+      AddJobBytes(callback.get(), GetFileBytes(source));
       return true;
     };
 
     if (FLAGS_checkpoint_backup_batch_num_upload > 1) {
       // Upload checkpoint files to s3 in parallel
-      std::vector<std::vector<std::string>> file_batches(FLAGS_checkpoint_backup_batch_num_upload);
-      for (size_t i = 0; i < checkpoint_files.size(); ++i) {
-        auto& file = checkpoint_files[i];
-        if (file == "." || file == "..") {
-          continue;
-        }
-        file_batches[i%FLAGS_checkpoint_backup_batch_num_upload].push_back(file);
+      std::vector<std::vector<std::pair<std::string, std::string>>> file_batches(
+        FLAGS_checkpoint_backup_batch_num_upload);
+      for (size_t i = 0; i < uploads.size(); ++i) {
+        file_batches[i%FLAGS_checkpoint_backup_batch_num_upload].push_back(uploads[i]);
       }
 
       std::vector<folly::Future<bool>> futures;
@@ -991,7 +2614,7 @@ void AdminHandler::async_tm_backupDBToS3(
         S3UploadAndDownloadExecutor()->add(
             [&, files = std::move(files), p = std::move(p)]() mutable {
               for (const auto& file : files) {
-                if (!upload_func(formatted_s3_dir_path + file, formatted_checkpoint_local_path + file)) {
+                if (!upload_func(file.first, file.second)) {
                   p.setValue(false);
                   return;
                 }
@@ -1011,11 +2634,8 @@ void AdminHandler::async_tm_backupDBToS3(
         }
       }
     } else {
-      for (const auto& file : checkpoint_files) {
-        if (file == "." || file == "..") {
-          continue;
-        }
-        if (!upload_func(formatted_s3_dir_path + file, formatted_checkpoint_local_path + file)) {
+      for (const auto& file : uploads) {
+        if (!upload_func(file.first, file.second)) {
           // If there is error in one file uploading, then we fail the whole backup process
           SetException("Error happened when uploading files from checkpoint to S3",
                        AdminErrorCode::DB_ADMIN_ERROR,
@@ -1026,6 +2646,22 @@ void AdminHandler::async_tm_backupDBToS3(
       }
     }
 
+    if (share_files_with_checksum) {
+      // The manifest goes last, so that a backup with a manifest is complete
+      std::string manifest_data;
+      const auto manifest_local_path = local_path + kSstManifestFileName;
+      if (!EncodeThriftStruct(manifest, &manifest_data) ||
+          !folly::writeFile(manifest_data, manifest_local_path.c_str()) ||
+          !local_s3_util->putObject(formatted_s3_dir_path + kSstManifestFileName,
+                                    manifest_local_path).Body()) {
+        SetException("Error happened when uploading the sst manifest to S3",
+                     AdminErrorCode::DB_ADMIN_ERROR,
+                     &callback);
+        common::Stats::get()->Incr(kS3BackupFailure);
+        return;
+      }
+    }
+
     // Delete the directory to remove the snapshot.
     boost::filesystem::remove_all(local_path);
   } else {
@@ -1057,16 +2693,27 @@ void AdminHandler::async_tm_restoreDBFromS3(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       RestoreDBFromS3Response>>> callback,
     std::unique_ptr<RestoreDBFromS3Request> request) {
-  AdminException e;
-  auto n = num_current_s3_sst_downloadings_.fetch_add(1);
-  SCOPE_EXIT {
-    num_current_s3_sst_downloadings_.fetch_sub(1);
+  auto run = [this] (auto job_callback, auto job_request) {
+    restoreDBFromS3(std::move(job_callback), std::move(job_request));
   };
+  const auto source = request->s3_bucket + "/" + request->s3_backup_dir;
+  if (submitJobIfAsync(&callback, &request, "restoreDBFromS3", source, run) ||
+      offloadLongRequest(&callback, &request, std::move(run))) {
+    return;
+  }
 
-  if (n >= FLAGS_max_s3_sst_loading_concurrency) {
-    auto err_str =
-        folly::stringPrintf("Concurrent uploading/downloading limit hits %d by %s",
-                            n, request->db_name.c_str());
+  restoreDBFromS3(std::move(callback), std::move(request));
+}
+
+template <typename CallbackType>
+void AdminHandler::restoreDBFromS3(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<RestoreDBFromS3Request> request) {
+  AdminException e;
+  std::string err_str;
+  auto admission =
+    admitS3Transfer(kS3RestorePriority, request->db_name, &err_str);
+  if (admission == nullptr) {
     SetException(err_str, AdminErrorCode::DB_ADMIN_ERROR, &callback);
     LOG(ERROR) << err_str;
     common::Stats::get()->Incr(kS3RestoreFailure);
@@ -1107,8 +2754,9 @@ void AdminHandler::async_tm_restoreDBFromS3(
   if (FLAGS_enable_checkpoint_backup) {
     std::string formatted_s3_dir_path = ensure_ends_with_pathsep(request->s3_backup_dir);
     std::string formatted_local_path = ensure_ends_with_pathsep(local_path);
-    // fetch all files using the given path as the key prefix in S3
-    auto resp = local_s3_util->listAllObjects(formatted_s3_dir_path);
+    // fetch all files along with their sizes using the given path as the key
+    // prefix in S3
+    auto resp = local_s3_util->listAllObjectSizes(formatted_s3_dir_path);
     if (!resp.Error().empty()) {
       auto err_msg = folly::stringPrintf(
           "Error happened when fetching files in checkpoint from S3: %s under path: %s",
@@ -1119,70 +2767,84 @@ void AdminHandler::async_tm_restoreDBFromS3(
       return;
     }
 
+    // The sst files of an incremental backup are downloaded from the shared
+    // dir its manifest refers to
+    std::vector<std::pair<std::string, uint64_t>> s3_files;
+    std::unordered_map<std::string, std::string> local_file_paths;
+    int64_t total_bytes = 0;
+    for (const auto& object : resp.Body()) {
+      const auto& s3_path = object.first;
+      const auto file = s3_path.substr(formatted_s3_dir_path.size());
+      if (file != kSstManifestFileName) {
+        s3_files.emplace_back(s3_path, object.second);
+        local_file_paths[s3_path] = formatted_local_path + file;
+        total_bytes += object.second;
+        continue;
+      }
+
+      std::stringstream manifest_data;
+      CheckpointSstManifest manifest;
+      if (!local_s3_util->getObject(s3_path, &manifest_data).Body() ||
+          !DecodeThriftStruct(manifest_data.str(), &manifest)) {
+        auto err_msg = "Error happened when reading the sst manifest " + s3_path;
+        LOG(ERROR) << err_msg;
+        SetException(err_msg, AdminErrorCode::DB_ADMIN_ERROR, &callback);
+        common::Stats::get()->Incr(kS3RestoreFailure);
+        return;
+      }
+
+      for (const auto& shared_file : manifest.sst_files) {
+        s3_files.emplace_back(shared_file.s3_key, shared_file.size);
+        local_file_paths[shared_file.s3_key] =
+          formatted_local_path + shared_file.file_name;
+        total_bytes += shared_file.size;
+      }
+    }
+    SetJobTotalBytes(callback.get(), total_bytes);
+
     auto download_func = [&](const std::string& s3_path) {
+      const auto& local_file_path = local_file_paths.at(s3_path);
       auto get_resp = local_s3_util->getObject(
-          s3_path,
-          formatted_local_path + s3_path.substr(formatted_s3_dir_path.size()),
-          FLAGS_s3_direct_io);
+          s3_path, local_file_path, FLAGS_s3_direct_io);
       if (!get_resp.Error().empty()) {
         LOG(ERROR) << "Error happened when downloading the file in checkpoint from S3 to local: "
                    << get_resp.Error();
         return false;
       }
+      AddJobBytes(callback.get(), GetFileBytes(local_file_path));
       return true;
     };
 
-    if (FLAGS_checkpoint_backup_batch_num_download> 1) {
-      // Download checkpoint files to s3 in parallel
-      std::vector<std::vector<std::string>> file_batches(FLAGS_checkpoint_backup_batch_num_download);
-      for (size_t i = 0; i < resp.Body().objects.size(); ++i) {
-        file_batches[i%FLAGS_checkpoint_backup_batch_num_download].push_back(resp.Body().objects[i]);
-      }
-
-      std::vector<folly::Future<bool>> futures;
-      for (auto& files : file_batches) {
-        auto p = folly::Promise<bool>();
-        futures.push_back(p.getFuture());
-
-        S3UploadAndDownloadExecutor()->add(
-            [&, files = std::move(files), p = std::move(p)]() mutable {
-              for (const auto& file : files) {
-                if (!download_func(file)) {
-                  p.setValue(false);
-                  return;
-                }
-              }
-              p.setValue(true);
-            });
-      }
-
-      for (auto& f : futures) {
-        auto res = std::move(f).get();
-        if (!res) {
-          SetException("Error happened when downloading the file in checkpoint from S3 to local",
-                       AdminErrorCode::DB_ADMIN_ERROR,
-                       &callback);
-          common::Stats::get()->Incr(kS3RestoreFailure);
-          return;
-        }
-      }
+    bool downloaded = true;
+    if (FLAGS_checkpoint_backup_batch_num_download > 1) {
+      // Download checkpoint files from s3 in parallel, largest first
+      downloaded = RunLargestFirst(std::move(s3_files),
+                                   FLAGS_checkpoint_backup_batch_num_download,
+                                   download_func);
     } else {
-      for (auto& v : resp.Body().objects) {
-        if (!download_func(v)) {
-          // If there is error in one file uploading, then we fail the whole backup process
-          SetException("Error happened when downloading the file in checkpoint from S3 to local",
-                       AdminErrorCode::DB_ADMIN_ERROR,
-                       &callback);
-          common::Stats::get()->Incr(kS3RestoreFailure);
-          return;
+      for (const auto& v : s3_files) {
+        if (!download_func(v.first)) {
+          downloaded = false;
+          break;
         }
       }
     }
 
+    if (!downloaded) {
+      // If there is error in one file downloading, then we fail the whole restore process
+      SetException("Error happened when downloading the file in checkpoint from S3 to local",
+                   AdminErrorCode::DB_ADMIN_ERROR,
+                   &callback);
+      common::Stats::get()->Incr(kS3RestoreFailure);
+      return;
+    }
+
 
-    rocksdb::DB* restore_db;
+    std::unique_ptr<rocksdb::DB> restore_db;
     auto segment = admin::DbNameToSegment(request->db_name);
-    auto status = rocksdb::DB::Open(rocksdb_options_(segment), formatted_local_path, &restore_db);
+    auto status = ColumnFamilyDB::Open(
+      rocksdb_options_(segment), formatted_local_path,
+      GetColumnFamilies(column_family_options_, segment), &restore_db);
     if (!status.ok()) {
       OKOrSetException(status, AdminErrorCode::DB_ERROR, &callback);
       LOG(ERROR) << "Error happened when opening db via checkpoint: " << status.ToString();
@@ -1191,8 +2853,7 @@ void AdminHandler::async_tm_restoreDBFromS3(
     }
 
     std::string err_msg;
-    if (!db_manager_->addDB(request->db_name,
-                            std::unique_ptr<rocksdb::DB>(restore_db),
+    if (!db_manager_->addDB(request->db_name, std::move(restore_db),
                             replicator::DBRole::SLAVE,
                             std::move(upstream_addr), &err_msg)) {
       LOG(ERROR) << "Error happened when adding db after restore by checkpoint: " << err_msg;
@@ -1200,6 +2861,7 @@ void AdminHandler::async_tm_restoreDBFromS3(
       common::Stats::get()->Incr(kS3RestoreFailure);
       return;
     }
+    warmUpDB(getDB(request->db_name, nullptr).get());
   } else {
     std::string formatted_s3_dir_path = rtrim(request->s3_backup_dir, '/');
     rocksdb::Env* s3_env = new rocksdb::S3Env(
@@ -1223,35 +2885,142 @@ void AdminHandler::async_tm_restoreDBFromS3(
   common::Stats::get()->Incr(kS3RestoreSuccess);
 }
 
-void AdminHandler::async_tm_checkDB(
+void AdminHandler::async_tm_bootstrapFromPeer(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
-      CheckDBResponse>>> callback,
-    std::unique_ptr<CheckDBRequest> request) {
-  AdminException e;
-  auto db = getDB(request->db_name, &e);
-  if (db == nullptr) {
-    callback.release()->exceptionInThread(std::move(e));
+      BootstrapFromPeerResponse>>> callback,
+    std::unique_ptr<BootstrapFromPeerRequest> request) {
+  auto run = [this] (auto job_callback, auto job_request) {
+    bootstrapFromPeer(std::move(job_callback), std::move(job_request));
+  };
+  const auto source = request->peer_ip;
+  if (submitJobIfAsync(&callback, &request, "bootstrapFromPeer", source, run) ||
+      offloadLongRequest(&callback, &request, std::move(run))) {
     return;
   }
 
-  CheckDBResponse response;
-  response.set_seq_num(db->rocksdb()->GetLatestSequenceNumber());
-  response.set_wal_ttl_seconds(db->rocksdb()->GetOptions().WAL_ttl_seconds);
-  response.set_is_master(!db->IsSlave());
+  bootstrapFromPeer(std::move(callback), std::move(request));
+}
 
-  // If there is at least one update
-  if (response.seq_num != 0) {
-    std::unique_ptr<rocksdb::TransactionLogIterator> iter;
-    auto status = db->rocksdb()->GetUpdatesSince(response.seq_num, &iter);
+template <typename CallbackType>
+void AdminHandler::bootstrapFromPeer(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<BootstrapFromPeerRequest> request) {
+  auto upstream_addr = std::make_unique<folly::SocketAddress>();
+  if (!SetAddressOrException(request->peer_ip,
+                             FLAGS_rocksdb_replicator_port,
+                             upstream_addr.get(),
+                             &callback)) {
+    common::Stats::get()->Incr(kPeerBootstrapFailure);
+    return;
+  }
 
-    if (status.ok() && iter && iter->Valid()) {
-      auto batch = iter->GetBatch();
-      replicator::LogExtractor extractor;
-      status = batch.writeBatchPtr->Iterate(&extractor);
-      if (status.ok()) {
-        response.set_last_update_timestamp_ms(extractor.ms);
-      }
-    }
+  db_admin_lock_.Lock(request->db_name);
+  SCOPE_EXIT { db_admin_lock_.Unlock(request->db_name); };
+
+  if (getDB(request->db_name, nullptr)) {
+    SetException("Could not bootstrap an opened DB, close it first",
+                 AdminErrorCode::DB_EXIST, &callback);
+    common::Stats::get()->Incr(kPeerBootstrapFailure);
+    return;
+  }
+
+  common::Timer timer(kPeerBootstrapMs);
+  LOG(INFO) << "Bootstrap " << request->db_name << " from "
+            << upstream_addr->describe();
+
+  // Fetch the checkpoint aside, and move it in place only once complete
+  const auto tmp_path = FLAGS_rocksdb_dir + "bootstrap_tmp/" +
+    request->db_name + std::to_string(common::timeutil::GetCurrentTimestamp());
+  boost::system::error_code create_err;
+  boost::filesystem::create_directories(FLAGS_rocksdb_dir + "bootstrap_tmp/",
+                                        create_err);
+  SCOPE_EXIT { boost::filesystem::remove_all(tmp_path, create_err); };
+  const uint64_t limit_bytes_per_sec =
+    request->limit_mbs > 0 ? static_cast<uint64_t>(request->limit_mbs) * kMB : 0;
+  std::string err_msg;
+  if (create_err ||
+      !replicator::RocksDBReplicator::instance()->fetchCheckpoint(
+        request->db_name, *upstream_addr, tmp_path, &err_msg,
+        limit_bytes_per_sec,
+        [&callback] (uint64_t bytes) {
+          AddJobBytes(callback.get(), bytes);
+        })) {
+    err_msg = "Failed to fetch a checkpoint from " +
+      upstream_addr->describe() + ": " +
+      (create_err ? create_err.message() : err_msg);
+    LOG(ERROR) << err_msg;
+    SetException(err_msg, AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kPeerBootstrapFailure);
+    return;
+  }
+
+  // Whatever is left at the db path is stale
+  const auto segment = admin::DbNameToSegment(request->db_name);
+  const auto db_path = FLAGS_rocksdb_dir + request->db_name;
+  auto status = rocksdb::DestroyDB(db_path, rocksdb_options_(segment));
+  boost::system::error_code rename_err;
+  if (status.ok()) {
+    boost::filesystem::remove_all(db_path, rename_err);
+    boost::filesystem::rename(tmp_path, db_path, rename_err);
+  }
+  if (!status.ok() || rename_err) {
+    err_msg = "Failed to move the checkpoint to " + db_path + ": " +
+      (status.ok() ? rename_err.message() : status.ToString());
+    LOG(ERROR) << err_msg;
+    SetException(err_msg, AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kPeerBootstrapFailure);
+    return;
+  }
+
+  auto db = GetRocksdb(db_path, rocksdb_options_(segment),
+                       GetColumnFamilies(column_family_options_, segment));
+  if (db == nullptr) {
+    SetException("Failed to open the checkpoint at " + db_path,
+                 AdminErrorCode::DB_ERROR, &callback);
+    common::Stats::get()->Incr(kPeerBootstrapFailure);
+    return;
+  }
+
+  const auto seq_num = db->GetLatestSequenceNumber();
+  if (!db_manager_->addDB(request->db_name, std::move(db),
+                          replicator::DBRole::SLAVE,
+                          std::move(upstream_addr), &err_msg)) {
+    LOG(ERROR) << "Error happened when adding db after bootstrap: " << err_msg;
+    SetException(err_msg, AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kPeerBootstrapFailure);
+    return;
+  }
+  warmUpDB(getDB(request->db_name, nullptr).get());
+
+  LOG(INFO) << "Bootstrapped " << request->db_name << " at seq num "
+            << seq_num << " from " << request->peer_ip;
+  callback->result(BootstrapFromPeerResponse());
+  common::Stats::get()->Incr(kPeerBootstrapSuccess);
+}
+
+void AdminHandler::async_tm_checkDB(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      CheckDBResponse>>> callback,
+    std::unique_ptr<CheckDBRequest> request) {
+  AdminException e;
+  auto db = getDB(request->db_name, &e);
+  if (db == nullptr) {
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+
+  CheckDBResponse response;
+  FillCheckDBResponse(db.get(), &response);
+  callback->result(response);
+}
+
+void AdminHandler::async_tm_checkDBs(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      CheckDBsResponse>>> callback,
+    std::unique_ptr<CheckDBsRequest> request) {
+  CheckDBsResponse response;
+  for (const auto& db : db_manager_->getDBs(request->db_names)) {
+    FillCheckDBResponse(db.second.get(), &response.dbs[db.first]);
   }
 
   callback->result(response);
@@ -1261,6 +3030,20 @@ void AdminHandler::async_tm_closeDB(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       CloseDBResponse>>> callback,
     std::unique_ptr<CloseDBRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    closeDB(std::move(control_callback), std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  closeDB(std::move(callback), std::move(request));
+}
+
+void AdminHandler::closeDB(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      CloseDBResponse>>> callback,
+    std::unique_ptr<CloseDBRequest> request) {
   db_admin_lock_.Lock(request->db_name);
   SCOPE_EXIT { db_admin_lock_.Unlock(request->db_name); };
 
@@ -1277,6 +3060,20 @@ void AdminHandler::async_tm_changeDBRoleAndUpStream(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       ChangeDBRoleAndUpstreamResponse>>> callback,
     std::unique_ptr<ChangeDBRoleAndUpstreamRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    changeDBRoleAndUpStream(std::move(control_callback), std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  changeDBRoleAndUpStream(std::move(callback), std::move(request));
+}
+
+void AdminHandler::changeDBRoleAndUpStream(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      ChangeDBRoleAndUpstreamResponse>>> callback,
+    std::unique_ptr<ChangeDBRoleAndUpstreamRequest> request) {
   db_admin_lock_.Lock(request->db_name);
   SCOPE_EXIT { db_admin_lock_.Unlock(request->db_name); };
 
@@ -1306,15 +3103,26 @@ void AdminHandler::async_tm_changeDBRoleAndUpStream(
     }
   }
 
-  auto db = removeDB(request->db_name, &e);
+  // Read-only dbs are SLAVEs without upstream, which can't be written to
+  if (IsReadOnlySegment(DbNameToSegment(request->db_name)) &&
+      (new_role != replicator::DBRole::SLAVE || upstream_addr != nullptr)) {
+    e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
+    e.message = "Can't change the role or upstream of read-only " +
+      request->db_name;
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+
+  // Switched in place, so that the readers of the db don't need to let go of
+  // it first, which takes a while on busy dbs
+  auto db = getDB(request->db_name, &e);
   if (db == nullptr) {
     callback.release()->exceptionInThread(std::move(e));
     return;
   }
 
   std::string err_msg;
-  if (!db_manager_->addDB(request->db_name, std::move(db), new_role,
-                          std::move(upstream_addr), &err_msg)) {
+  if (!db->ChangeRole(new_role, std::move(upstream_addr), &err_msg)) {
     e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
     e.message = std::move(err_msg);
     callback.release()->exceptionInThread(std::move(e));
@@ -1340,32 +3148,68 @@ void AdminHandler::async_tm_getSequenceNumber(
   callback->result(response);
 }
 
+void AdminHandler::async_tm_getSequenceNumbers(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      GetSequenceNumbersResponse>>> callback,
+    std::unique_ptr<GetSequenceNumbersRequest> request) {
+  GetSequenceNumbersResponse response;
+  for (const auto& db : db_manager_->getDBs(request->db_names)) {
+    response.seq_nums[db.first] =
+      db.second->rocksdb()->GetLatestSequenceNumber();
+  }
+
+  callback->result(response);
+}
+
 void AdminHandler::async_tm_clearDB(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       ClearDBResponse>>> callback,
     std::unique_ptr<ClearDBRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    clearDB(std::move(control_callback), std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  clearDB(std::move(callback), std::move(request));
+}
+
+void AdminHandler::clearDB(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      ClearDBResponse>>> callback,
+    std::unique_ptr<ClearDBRequest> request) {
   db_admin_lock_.Lock(request->db_name);
   SCOPE_EXIT { db_admin_lock_.Unlock(request->db_name); };
 
-  bool need_to_reopen = false;
-  replicator::DBRole db_role;
-  std::unique_ptr<folly::SocketAddress> upstream_addr;
-  {
+  const auto segment = admin::DbNameToSegment(request->db_name);
+  // Read-only dbs can't delete keys, and are reopened empty below instead
+  const bool read_only = IsReadOnlySegment(segment);
+  if (request->reopen_db && !read_only) {
+    // Cleared while open, so that it keeps serving with its role
     auto db = getDB(request->db_name, nullptr);
     if (db) {
-      need_to_reopen = true;
-      db_role = db->IsSlave() ? replicator::DBRole::SLAVE :
-        replicator::DBRole::MASTER;
-      if (db->upstream_addr()) {
-        upstream_addr =
-          std::make_unique<folly::SocketAddress>(*(db->upstream_addr()));
+      LOG(INFO) << "Clearing DB in place: " << request->db_name;
+      clearMetaData(request->db_name);
+      auto status = db->DeleteAllKeys();
+      if (!OKOrSetException(status,
+                            AdminErrorCode::DB_ADMIN_ERROR,
+                            &callback)) {
+        LOG(ERROR) << "Failed to clear DB " << request->db_name << " "
+                   << status.ToString();
+        return;
       }
+
+      LOG(INFO) << "Done clearing DB: " << request->db_name;
+      callback->result(ClearDBResponse());
+      return;
     }
   }
 
-  removeDB(request->db_name, nullptr);
+  const bool was_open = removeDB(request->db_name, nullptr) != nullptr;
+  const bool reopen_read_only = read_only && was_open && request->reopen_db;
 
-  auto options = rocksdb_options_(admin::DbNameToSegment(request->db_name));
+  auto options = rocksdb_options_(segment);
   auto db_path = FLAGS_rocksdb_dir + request->db_name;
   LOG(INFO) << "Clearing DB: " << request->db_name;
   clearMetaData(request->db_name);
@@ -1401,70 +3245,310 @@ void AdminHandler::async_tm_clearDB(
     LOG(INFO) << "Done clearing DB: " << request->db_name;
   }
 
-  if (request->reopen_db && need_to_reopen) {
-    LOG(INFO) << "Open DB: " << request->db_name;
-    admin::AdminException e;
-    e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
-    auto db = GetRocksdb(db_path, options);
-    if (db == nullptr) {
-      e.message = "Failed to open DB: " + request->db_name;
-      callback.release()->exceptionInThread(std::move(e));
-      return;
-    }
-
+  if (reopen_read_only) {
     std::string err_msg;
-    if (!db_manager_->addDB(request->db_name, std::move(db), db_role,
-                            std::move(upstream_addr), &err_msg)) {
-      e.message = std::move(err_msg);
-      callback.release()->exceptionInThread(std::move(e));
+    auto db = OpenReadOnlyRocksdb(db_path, options);
+    if (db == nullptr ||
+        !db_manager_->addDB(request->db_name, std::move(db),
+                            replicator::DBRole::SLAVE, nullptr, &err_msg)) {
+      SetException("Failed to reopen " + request->db_name + " " + err_msg,
+                   AdminErrorCode::DB_ERROR, &callback);
       return;
     }
-    LOG(INFO) << "Done open DB: " << request->db_name;
   }
 
   callback->result(ClearDBResponse());
 }
 
-inline bool should_new_s3_client(
-    const common::S3Util& s3_util, const uint32_t s3_download_limit_mb, const std::string& s3_bucket) {
-  return s3_util.getBucket() != s3_bucket ||
-         s3_util.getRateLimit() != s3_download_limit_mb;
-}
-
 std::shared_ptr<common::S3Util> AdminHandler::createLocalS3Util(
     const uint32_t read_ratelimit_mb,
     const std::string& bucket) {
-  // Though it is claimed that AWS s3 sdk is a light weight library. However,
-  // we couldn't afford to create a new client for every SST file downloading
-  // request, which is not even on any critical code path. Otherwise, we will
-  // see latency spike when uploading data to production clusters.
-  std::shared_ptr<common::S3Util> local_s3_util;
+  // Creating a client for every request would mean new connections and TLS
+  // handshakes every time. The S3Utils share the pooled client instead, and
+  // only bring their own bucket and rate limit.
+  return common::S3Util::BuildS3Util(read_ratelimit_mb, bucket,
+                                     FLAGS_s3_connect_timeout_ms,
+                                     FLAGS_s3_request_timeout_ms,
+                                     FLAGS_s3_max_connections);
+}
 
-  {
-    std::lock_guard<std::mutex> guard(s3_util_lock_);
-    if (s3_util_ == nullptr || should_new_s3_client(*s3_util_, read_ratelimit_mb, bucket)) {
-      // Request with different ratelimit or bucket has to wait for old
-      // requests to drain.
-      while (s3_util_ != nullptr && s3_util_.use_count() > 1) {
-        LOG(INFO) << "There are other downloads happening, wait "
-                  << kS3UtilRecheckSec << " seconds";
-        std::this_thread::sleep_for(std::chrono::seconds(kS3UtilRecheckSec));
+std::shared_ptr<ApplicationDB> AdminHandler::clearDBInPlace(
+    const std::string& db_name,
+    std::shared_ptr<ApplicationDB> db,
+    rocksdb::ColumnFamilyHandle* column_family,
+    AdminException* e) {
+  e->errorCode = AdminErrorCode::DB_ADMIN_ERROR;
+  LOG(INFO) << "Clearing DB in place: " << db_name;
+  auto status = db->DeleteAllKeys(column_family);
+  if (!status.ok()) {
+    e->message = "Failed to clear DB " + db_name + " " + status.ToString();
+    return nullptr;
+  }
+
+  LOG(INFO) << "Done clearing DB: " << db_name;
+  return db;
+}
+
+template <typename CallbackType>
+bool AdminHandler::downloadAndIngestS3SstFiles(
+    CallbackType* callback,
+    const AddS3SstFilesToDBRequest& request,
+    const std::string& local_path,
+    rocksdb::DB* db,
+    rocksdb::ColumnFamilyHandle* column_family,
+    std::string* err_msg) {
+  auto local_s3_util =
+    createLocalS3Util(request.s3_download_limit_mb, request.s3_bucket);
+  auto list_resp = local_s3_util->listAllObjects(request.s3_path);
+  if (!list_resp.Error().empty()) {
+    *err_msg = "Failed to list any object from " + request.s3_path +
+      " AWS Error: " + list_resp.Error();
+    return false;
+  }
+
+  std::vector<std::string> s3_keys;
+  for (const auto& key : list_resp.Body().objects) {
+    if (IsSstFileName(key.substr(key.find_last_of('/') + 1))) {
+      s3_keys.push_back(key);
+    }
+  }
+
+  if (s3_keys.empty()) {
+    *err_msg = "Failed to list any object from " + request.s3_path;
+    return false;
+  }
+  std::sort(s3_keys.begin(), s3_keys.end());
+
+  // The expected sizes and checksums of the sst files by name, which each
+  // download task verifies its file against as soon as it lands, so that the
+  // files are checked in parallel and before anything is ingested
+  std::shared_ptr<std::unordered_map<std::string, SstFileChecksum>> checksums;
+  for (const auto& key : list_resp.Body().objects) {
+    if (key.substr(key.find_last_of('/') + 1) != kSstChecksumManifestFileName) {
+      continue;
+    }
+
+    std::stringstream manifest_data;
+    SstChecksumManifest manifest;
+    if (!local_s3_util->getObject(key, &manifest_data).Body() ||
+        !DecodeThriftStruct(manifest_data.str(), &manifest)) {
+      *err_msg = "Failed to read the sst checksum manifest " + key;
+      return false;
+    }
+    checksums =
+      std::make_shared<std::unordered_map<std::string, SstFileChecksum>>();
+    for (auto& file : manifest.sst_files) {
+      auto file_name = file.file_name;
+      checksums->emplace(std::move(file_name), std::move(file));
+    }
+  }
+
+  if (checksums == nullptr && FLAGS_s3_sst_require_checksum_manifest) {
+    *err_msg = "No " + kSstChecksumManifestFileName + " under " +
+      request.s3_path;
+    return false;
+  }
+  if (checksums) {
+    for (const auto& key : s3_keys) {
+      if (checksums->count(key.substr(key.find_last_of('/') + 1)) == 0) {
+        *err_msg = key + " is not in " + kSstChecksumManifestFileName;
+        return false;
+      }
+    }
+  }
+
+  const size_t group_size = FLAGS_s3_sst_ingest_group_size > 0 ?
+    static_cast<size_t>(FLAGS_s3_sst_ingest_group_size) : s3_keys.size();
+  const size_t max_pending_files = std::max<size_t>(
+    FLAGS_s3_sst_ingest_max_pending_files, group_size);
+  std::vector<std::string> local_file_paths;
+  std::vector<folly::Future<bool>> downloads;
+  // The downloads refer to the files in local_path, which is removed by our
+  // caller, so we can't return before all of them are done.
+  SCOPE_EXIT {
+    for (auto& download : downloads) {
+      download.wait();
+    }
+  };
+
+  auto start_download = [&] (const std::string& key) {
+    local_file_paths.push_back(
+      local_path + key.substr(key.find_last_of('/') + 1));
+    folly::Promise<bool> p;
+    downloads.push_back(p.getFuture());
+    S3UploadAndDownloadExecutor()->add(
+        [local_s3_util, key, local_file_path = local_file_paths.back(),
+         checksums, callback, p = std::move(p)] () mutable {
+          auto resp = local_s3_util->getObject(key, local_file_path,
+                                               FLAGS_s3_direct_io);
+          if (!resp.Body()) {
+            LOG(ERROR) << resp.Error();
+            p.setValue(false);
+            return;
+          }
+          if (checksums &&
+              !VerifySstFile(local_file_path, checksums->at(
+                  key.substr(key.find_last_of('/') + 1)))) {
+            common::Stats::get()->Incr(kS3SstChecksumMismatch);
+            p.setValue(false);
+            return;
+          }
+          AddJobBytes(callback, GetFileBytes(local_file_path));
+          p.setValue(true);
+        });
+  };
+
+  rocksdb::IngestExternalFileOptions ifo;
+  ifo.move_files = true;
+  ifo.allow_global_seqno = false;
+  ifo.allow_blocking_flush = false;
+  for (size_t group_start = 0; group_start < s3_keys.size();
+       group_start += group_size) {
+    // The files of the ingested groups have been moved into the db, so this
+    // caps the size of local_path.
+    const auto download_end =
+      std::min(group_start + max_pending_files, s3_keys.size());
+    while (downloads.size() < download_end) {
+      start_download(s3_keys[downloads.size()]);
+    }
+
+    const auto group_end = std::min(group_start + group_size, s3_keys.size());
+    std::vector<std::string> group;
+    for (auto i = group_start; i < group_end; ++i) {
+      downloads[i].wait();
+      if (!downloads[i].value()) {
+        *err_msg = "Failed to download or verify " + s3_keys[i];
+        return false;
       }
-      // Invoke destructor explicitly to make sure Aws::InitAPI()
-      // and Aps::ShutdownApi() appear in pairs.
-      s3_util_ = nullptr;
-      s3_util_ = common::S3Util::BuildS3Util(read_ratelimit_mb, bucket);
+      group.push_back(local_file_paths[i]);
+    }
+
+    rocksdb::Status status;
+    {
+      common::Timer timer(kIngestMs + " db=" + request.db_name);
+      status = db->IngestExternalFile(column_family, group, ifo);
+    }
+    if (!status.ok()) {
+      *err_msg = "Failed to ingest " + group.front() + "...: " +
+        status.ToString();
+      return false;
+    }
+    LOG(INFO) << "Ingested " << group_end << " of " << s3_keys.size()
+              << " sst files from " << request.s3_path;
+  }
+
+  return true;
+}
+
+template <typename CallbackType>
+bool AdminHandler::reloadReadOnlyDB(CallbackType* callback,
+                                    const AddS3SstFilesToDBRequest& request,
+                                    const std::string& local_path,
+                                    std::string* err_msg) {
+  const auto segment = admin::DbNameToSegment(request.db_name);
+  const auto options = rocksdb_options_(segment);
+  const auto db_path = FLAGS_rocksdb_dir + request.db_name;
+  const auto staged_dir = FLAGS_rocksdb_dir + "reload_tmp/";
+  const auto staged_path = staged_dir + request.db_name;
+
+  boost::system::error_code create_err;
+  boost::filesystem::create_directories(staged_dir, create_err);
+  auto status = rocksdb::DestroyDB(staged_path, options);
+  if (create_err || !status.ok()) {
+    *err_msg = "Cannot clear " + staged_path;
+    return false;
+  }
+
+  {
+    // Built aside, as a read-only db can't ingest files. It is closed before
+    // being reopened read-only, so that all its data is in its sst files.
+    auto staged_options = options;
+    staged_options.create_if_missing = true;
+    auto staged_db = GetRocksdb(staged_path, staged_options);
+    if (staged_db == nullptr) {
+      *err_msg = "Cannot open " + staged_path;
+      return false;
+    }
+
+    if (!downloadAndIngestS3SstFiles(callback, request, local_path,
+                                     staged_db.get(),
+                                     staged_db->DefaultColumnFamily(),
+                                     err_msg)) {
+      rocksdb::DestroyDB(staged_path, options);
+      return false;
     }
-    local_s3_util = s3_util_;
   }
 
-  return local_s3_util;
+  // Read-only dbs don't write to their dirs and hold all their sst files open
+  // (max_open_files = -1), so the old version can be moved aside while it is
+  // served. The new version is moved to db_path before it is opened, so that
+  // it is only served from where it reopens after restarts.
+  const auto retired_path = staged_dir + request.db_name + ".retired." +
+    folly::to<std::string>(common::timeutil::GetCurrentTimestamp());
+  boost::system::error_code rename_err;
+  boost::filesystem::rename(db_path, retired_path, rename_err);
+  if (rename_err) {
+    *err_msg = "Failed to move " + db_path + " to " + retired_path + ": " +
+      rename_err.message();
+    rocksdb::DestroyDB(staged_path, options);
+    return false;
+  }
+  boost::filesystem::rename(staged_path, db_path, rename_err);
+  if (rename_err) {
+    *err_msg = "Failed to move " + staged_path + " to " + db_path + ": " +
+      rename_err.message();
+    rocksdb::DestroyDB(staged_path, options);
+    RestoreRetiredReadOnlyDB(retired_path, db_path);
+    return false;
+  }
+
+  // Readers go from the old version to the new one at once
+  std::string replace_err;
+  auto new_db = OpenReadOnlyRocksdb(db_path, options);
+  auto old_db = new_db == nullptr ? nullptr :
+    db_manager_->replaceDB(request.db_name, std::move(new_db),
+                           replicator::DBRole::SLAVE, nullptr, &replace_err);
+  if (old_db == nullptr) {
+    *err_msg = "Failed to swap in " + db_path + " " + replace_err;
+    rocksdb::DestroyDB(db_path, options);
+    RestoreRetiredReadOnlyDB(retired_path, db_path);
+    return false;
+  }
+
+  RetiredDBExecutor()->add(
+    [old_db = std::move(old_db), retired_path] () mutable {
+      ApplicationDBManager::releaseDB(std::move(old_db)).reset();
+      boost::system::error_code remove_err;
+      boost::filesystem::remove_all(retired_path, remove_err);
+      if (remove_err) {
+        LOG(ERROR) << "Failed to remove " << retired_path << " "
+                   << remove_err.message();
+      }
+    });
+
+  return true;
 }
 
 void AdminHandler::async_tm_addS3SstFilesToDB(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       AddS3SstFilesToDBResponse>>> callback,
     std::unique_ptr<AddS3SstFilesToDBRequest> request) {
+  auto run = [this] (auto job_callback, auto job_request) {
+    addS3SstFilesToDB(std::move(job_callback), std::move(job_request));
+  };
+  const auto source = request->s3_bucket + "/" + request->s3_path;
+  if (submitJobIfAsync(&callback, &request, "addS3SstFilesToDB", source, run) ||
+      offloadLongRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  addS3SstFilesToDB(std::move(callback), std::move(request));
+}
+
+template <typename CallbackType>
+void AdminHandler::addS3SstFilesToDB(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<AddS3SstFilesToDBRequest> request) {
   admin::AdminException e;
   e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
 
@@ -1480,8 +3564,20 @@ void AdminHandler::async_tm_addS3SstFilesToDB(
     return;
   }
 
+  auto column_family = db->GetColumnFamily(request->column_family);
+  if (column_family == nullptr) {
+    e.message = request->db_name + " doesn't have column family " +
+      request->column_family;
+    LOG(ERROR) << e.message;
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+  // The metadata of the db describes its default column family
+  const bool is_default_column_family = column_family->GetID() == 0;
+
   auto meta = getMetaData(request->db_name);
-  if (meta.__isset.s3_bucket && meta.s3_bucket == request->s3_bucket &&
+  if (is_default_column_family &&
+      meta.__isset.s3_bucket && meta.s3_bucket == request->s3_bucket &&
       meta.__isset.s3_path && meta.s3_path == request->s3_path) {
     LOG(INFO) << "Already hosting " << meta.s3_bucket << "/" << meta.s3_path;
     callback->result(AddS3SstFilesToDBResponse());
@@ -1491,16 +3587,10 @@ void AdminHandler::async_tm_addS3SstFilesToDB(
   // The local data is not the latest, so we need to download the latest data
   // from S3 and load it into the DB. This is to limit the allowed concurrent
   // loadings.
-  auto n = num_current_s3_sst_downloadings_.fetch_add(1);
-  SCOPE_EXIT {
-    num_current_s3_sst_downloadings_.fetch_sub(1);
-  };
-
-  if (n >= FLAGS_max_s3_sst_loading_concurrency) {
-    auto err_str =
-      folly::stringPrintf("Concurrent downloading limit hits %d by %s",
-                          n, request->db_name.c_str());
-
+  std::string err_str;
+  auto admission =
+    admitS3Transfer(kS3AddSstFilesPriority, request->db_name, &err_str);
+  if (admission == nullptr) {
     e.message = err_str;
     callback.release()->exceptionInThread(std::move(e));
     LOG(ERROR) << err_str;
@@ -1523,122 +3613,164 @@ void AdminHandler::async_tm_addS3SstFilesToDB(
   if (FLAGS_s3_download_limit_mb > 0) {
     request->s3_download_limit_mb = FLAGS_s3_download_limit_mb;
   }
-  auto local_s3_util = createLocalS3Util(request->s3_download_limit_mb, request->s3_bucket);
-  auto responses = local_s3_util->getObjects(request->s3_path,
-                                      local_path, "/", FLAGS_s3_direct_io);
-  if (!responses.Error().empty() || responses.Body().size() == 0) {
-    e.message = "Failed to list any object from " + request->s3_path;
-
-    if (!responses.Error().empty()) {
-      e.message += " AWS Error: " + responses.Error();
-    }
-
-    LOG(ERROR) << e.message;
-    callback.release()->exceptionInThread(std::move(e));
-    return;
-  }
-
-  for (auto& response : responses.Body()) {
-    if (!response.Body()) {
-      e.message = response.Error();
+  auto segment = admin::DbNameToSegment(request->db_name);
+  if (IsReadOnlySegment(segment)) {
+    if (!is_default_column_family) {
+      e.message = "Read-only " + request->db_name +
+        " only has the default column family";
+      LOG(ERROR) << e.message;
       callback.release()->exceptionInThread(std::move(e));
       return;
     }
-  }
 
-  const boost::filesystem::directory_iterator end_itor;
-  boost::filesystem::directory_iterator itor(local_path);
-  static const std::string suffix = ".sst";
-  std::vector<std::string> sst_file_paths;
-  for (; itor != end_itor; ++itor) {
-    auto file_name = itor->path().filename().string();
-    if (file_name.size() < suffix.size() + 1 ||
-        file_name.compare(file_name.size() - suffix.size(), suffix.size(),
-                          suffix) != 0) {
-      // skip non "*.sst" files
-      continue;
+    clearMetaData(request->db_name);
+    db.reset();
+    std::string err_msg;
+    if (!reloadReadOnlyDB(callback.get(), *request, local_path, &err_msg)) {
+      LOG(ERROR) << "Failed to reload " << request->db_name << " " << err_msg;
+      e.message = std::move(err_msg);
+      callback.release()->exceptionInThread(std::move(e));
+      return;
     }
 
-    sst_file_paths.push_back(local_path + file_name);
+    writeMetaData(request->db_name, request->s3_bucket, request->s3_path);
+    warmUpDB(getDB(request->db_name, nullptr).get());
+    callback->result(AddS3SstFilesToDBResponse());
+    return;
   }
 
-  clearMetaData(request->db_name);
-
-  auto segment = admin::DbNameToSegment(request->db_name);
   bool allow_overlapping_keys =
       allow_overlapping_keys_segments_.find(segment) !=
       allow_overlapping_keys_segments_.end();
   // OR with the flag to make backwards compatibility
   allow_overlapping_keys =
       allow_overlapping_keys || FLAGS_rocksdb_allow_overlapping_keys;
-  if (!allow_overlapping_keys) {
-    // clear DB if overlapping keys are not allowed
-    auto db_role = db->IsSlave() ?
-      replicator::DBRole::SLAVE : replicator::DBRole::MASTER;
-    std::unique_ptr<folly::SocketAddress> upstream_addr;
-    if (db_role == replicator::DBRole::SLAVE &&
-        db->upstream_addr() != nullptr) {
-      upstream_addr.reset(new folly::SocketAddress(*db->upstream_addr()));
-    }
-    db.reset();
-    removeDB(request->db_name, nullptr);
-    auto options = rocksdb_options_(segment);
-    auto db_path = FLAGS_rocksdb_dir + request->db_name;
-    LOG(INFO) << "Clearing DB: " << request->db_name;
-    auto status = rocksdb::DestroyDB(db_path, options);
-    if (!OKOrSetException(status,
-                          AdminErrorCode::DB_ADMIN_ERROR,
-                          &callback)) {
-      LOG(ERROR) << "Failed to clear DB " << request->db_name << " "
-                 << status.ToString();
-      return;
-    }
 
-    // reopen it
-    LOG(INFO) << "Open DB: " << request->db_name;
-    admin::AdminException e;
-    e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
-    auto rocksdb_db = GetRocksdb(db_path, options);
-    if (rocksdb_db == nullptr) {
-      e.message = "Failed to open DB: " + request->db_name;
+  // Files loaded into a db with overlapping keys can go below all its data,
+  // which takes no memtable flush and so doesn't stall writes. The db has to
+  // reserve its bottommost level for this.
+  const bool ingest_behind = allow_overlapping_keys &&
+    request->__isset.ingest_behind && request->ingest_behind;
+  if (ingest_behind && !db->rocksdb()->GetOptions().allow_ingest_behind) {
+    e.message = request->db_name + " is not opened with allow_ingest_behind, "
+      "so files can't be ingested behind";
+    LOG(ERROR) << e.message;
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+
+  if (!allow_overlapping_keys && FLAGS_s3_sst_ingest_group_size > 0) {
+    // The groups are ingested while the rest are being downloaded, so the DB
+    // has to be cleared before the downloading starts
+    if (is_default_column_family) {
+      clearMetaData(request->db_name);
+    }
+    db = clearDBInPlace(request->db_name, std::move(db), column_family, &e);
+    if (db == nullptr) {
+      LOG(ERROR) << e.message;
       callback.release()->exceptionInThread(std::move(e));
       return;
     }
 
     std::string err_msg;
-    if (!db_manager_->addDB(request->db_name, std::move(rocksdb_db),
-                            db_role, std::move(upstream_addr), &err_msg)) {
+    if (!downloadAndIngestS3SstFiles(callback.get(), *request, local_path,
+                                     db->rocksdb(), column_family,
+                                     &err_msg)) {
+      LOG(ERROR) << "Failed to add files to DB " << request->db_name << " "
+                 << err_msg;
       e.message = std::move(err_msg);
       callback.release()->exceptionInThread(std::move(e));
       return;
     }
-    LOG(INFO) << "Done open DB: " << request->db_name;
-    db = getDB(request->db_name, nullptr);
-  }
+  } else {
+    auto local_s3_util =
+      createLocalS3Util(request->s3_download_limit_mb, request->s3_bucket);
+    auto responses = local_s3_util->getObjects(request->s3_path,
+                                        local_path, "/", FLAGS_s3_direct_io);
+    if (!responses.Error().empty() || responses.Body().size() == 0) {
+      e.message = "Failed to list any object from " + request->s3_path;
+
+      if (!responses.Error().empty()) {
+        e.message += " AWS Error: " + responses.Error();
+      }
 
-  rocksdb::IngestExternalFileOptions ifo;
-  ifo.move_files = true;
-  /* if true, rocksdb will allow for overlapping keys */
-  ifo.allow_global_seqno = allow_overlapping_keys;
-  ifo.allow_blocking_flush = allow_overlapping_keys;
-  auto status = db->rocksdb()->IngestExternalFile(sst_file_paths, ifo);
-  if (!OKOrSetException(status,
-                        AdminErrorCode::DB_ADMIN_ERROR,
-                        &callback)) {
-    LOG(ERROR) << "Failed to add files to DB " << request->db_name
-               << status.ToString();
-    return;
+      LOG(ERROR) << e.message;
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+
+    for (auto& response : responses.Body()) {
+      if (!response.Body()) {
+        e.message = response.Error();
+        callback.release()->exceptionInThread(std::move(e));
+        return;
+      }
+    }
+
+    const boost::filesystem::directory_iterator end_itor;
+    boost::filesystem::directory_iterator itor(local_path);
+    std::vector<std::string> sst_file_paths;
+    for (; itor != end_itor; ++itor) {
+      auto file_name = itor->path().filename().string();
+      if (!IsSstFileName(file_name)) {
+        // skip non "*.sst" files
+        continue;
+      }
+
+      sst_file_paths.push_back(local_path + file_name);
+      AddJobBytes(callback.get(), GetFileBytes(sst_file_paths.back()));
+    }
+
+    if (is_default_column_family) {
+      clearMetaData(request->db_name);
+    }
+
+    if (!allow_overlapping_keys) {
+      // clear DB if overlapping keys are not allowed
+      db = clearDBInPlace(request->db_name, std::move(db), column_family, &e);
+      if (db == nullptr) {
+        LOG(ERROR) << e.message;
+        callback.release()->exceptionInThread(std::move(e));
+        return;
+      }
+    }
+
+    rocksdb::IngestExternalFileOptions ifo;
+    ifo.move_files = true;
+    /* if true, rocksdb will allow for overlapping keys */
+    ifo.allow_global_seqno = allow_overlapping_keys;
+    ifo.allow_blocking_flush = allow_overlapping_keys && !ingest_behind;
+    // placed at the bottommost level, older than anything in the db
+    ifo.ingest_behind = ingest_behind;
+    rocksdb::Status status;
+    {
+      common::Timer timer(kIngestMs + " db=" + request->db_name);
+      status = db->rocksdb()->IngestExternalFile(column_family, sst_file_paths,
+                                                 ifo);
+    }
+    db->ClearReadCache();
+    if (!OKOrSetException(status,
+                          AdminErrorCode::DB_ADMIN_ERROR,
+                          &callback)) {
+      LOG(ERROR) << "Failed to add files to DB " << request->db_name
+                 << status.ToString();
+      return;
+    }
   }
 
-  writeMetaData(request->db_name, request->s3_bucket, request->s3_path);
+  if (is_default_column_family) {
+    writeMetaData(request->db_name, request->s3_bucket, request->s3_path);
+  }
 
   if (FLAGS_compact_db_after_load_sst) {
-    auto status = db->rocksdb()->CompactRange(nullptr, nullptr);
+    auto status = compaction_scheduler_->Compact(
+        db, rocksdb::CompactRangeOptions());
     if (!status.ok()) {
       LOG(ERROR) << "Failed to compact DB: " << status.ToString();
     }
   }
 
+  warmUpDB(db.get());
   callback->result(AddS3SstFilesToDBResponse());
 }
 
@@ -1646,6 +3778,21 @@ void AdminHandler::async_tm_startMessageIngestion(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       StartMessageIngestionResponse>>> callback,
     std::unique_ptr<StartMessageIngestionRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    startMessageIngestion(std::move(control_callback),
+                          std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  startMessageIngestion(std::move(callback), std::move(request));
+}
+
+void AdminHandler::startMessageIngestion(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      StartMessageIngestionResponse>>> callback,
+    std::unique_ptr<StartMessageIngestionRequest> request) {
 
   admin::AdminException e;
   e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
@@ -1672,6 +3819,7 @@ void AdminHandler::async_tm_startMessageIngestion(
 
   // Compare the value in local_meta_db with replay_timestamp_ms and choose
   // the latest.
+  flushKafkaCheckpoints(db_name);
   const auto meta = getMetaData(db_name);
   replay_timestamp_ms = std::max(meta.last_kafka_msg_timestamp_ms,
                                  replay_timestamp_ms);
@@ -1681,7 +3829,9 @@ void AdminHandler::async_tm_startMessageIngestion(
   {
     std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
     // Check if there's already a thread consuming the same partition.
-    if (kafka_watcher_map_.find(db_name) != kafka_watcher_map_.end()) {
+    if (kafka_watcher_map_.find(db_name) != kafka_watcher_map_.end() ||
+        kafka_shared_consumer_dbs_.find(db_name) !=
+          kafka_shared_consumer_dbs_.end()) {
       // This can happen if there are duplicate state transition messages from helix.
       // Since there is aleady a thread consuming kafka messages for this db,
       // just log and return.
@@ -1708,62 +3858,118 @@ void AdminHandler::async_tm_startMessageIngestion(
   auto kafka_broker_file_watcher = detail::KafkaBrokerFileWatcherManager
       ::getInstance().getFileWatcher(kafka_broker_serverset_path);
 
-  const auto kafka_consumer_pool = std::make_shared<::kafka::KafkaConsumerPool>(
-      kKafkaConsumerPoolSize,
-      partition_ids_set,
-      // TODO: fix this to return a string object rather than a reference
-      kafka_broker_file_watcher->GetKafkaBrokerList(),
-      std::unordered_set<std::string>({topic_name}),
-      getConsumerGroupId(db_name),
-      folly::stringPrintf("%s_%s", kKafkaConsumerType, segment.c_str()));
-
-  auto kafka_watcher = std::make_shared<KafkaWatcher>(
-      folly::stringPrintf("%s_%s", kKafkaWatcherName, segment.c_str()),
-      kafka_consumer_pool,
-      -1, // kafka_init_blocking_consume_timeout_ms
-      FLAGS_kafka_consumer_timeout_ms);
+  const auto should_deserialize = request->is_kafka_payload_serialized;
 
-  {
-    std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
-    kafka_watcher_map_[db_name] = kafka_watcher;
+  // Catch up on a long lag by ingesting sst files built from the replayed
+  // messages, and then resume right after the last of them
+  int64_t replayed_offset = -1;
+  const auto lag_ms = common::timeutil::GetCurrentTimestamp(
+      common::timeutil::TimeUnit::kMillisecond) - replay_timestamp_ms;
+  if (FLAGS_kafka_replay_to_sst_min_lag_ms > 0 &&
+      lag_ms > FLAGS_kafka_replay_to_sst_min_lag_ms) {
+    int64_t replayed_timestamp_ms = -1;
+    if (!replayKafkaToSstFiles(db, topic_name, partition_id,
+                               kafka_broker_file_watcher->GetKafkaBrokerList(),
+                               replay_timestamp_ms, should_deserialize,
+                               &replayed_offset, &replayed_timestamp_ms)) {
+      LOG(ERROR) << "Failed to replay all of " << topic_name << " to sst "
+                 << "files for " << db_name << ", consuming the rest";
+    }
+    if (replayed_offset != -1) {
+      setKafkaCheckpoint(db_name, replayed_timestamp_ms);
+      flushKafkaCheckpoints(db_name);
+    }
   }
 
-  int64_t message_count = 0;
-  const auto should_deserialize = request->is_kafka_payload_serialized;
+  auto stats = std::make_shared<const KafkaIngestionStats>(segment);
+  auto batch = std::make_shared<KafkaIngestionBatch>();
+  if (FLAGS_kafka_ingestion_dedup_batches) {
+    batch->deduper = std::make_unique<WriteBatchDeduper>(
+      db->rocksdb()->GetOptions().merge_operator);
+  }
 
-  // With kafka_init_blocking_consume_timeout_ms set to -1, messages from
-  // replay_timestamp_ms to the current are synchronously consumed. The
-  // calling thread then returns after spawning a new thread to consume
-  // live messages.
-  kafka_watcher->StartWith(
-      replay_timestamp_ms,
-      [message_count, db_name, db, should_deserialize,
-       segment = std::move(segment), this](
-          std::shared_ptr<const RdKafka::Message> message,
-          const bool is_replay) mutable {
-    if (message == nullptr) {
-      LOG(ERROR) << "Message nullptr";
+  // Write the messages in batch, and then checkpoint the timestamp of the
+  // last one, so that we never resume after a message not written yet
+  auto commit_batch = [db_name, db, stats, batch, this] {
+    if (batch->n_messages == 0) {
       return;
     }
-    const int64_t msg_timestamp_secs = GetMessageTimestampSecs(*message);
-    message_count++;
+
+    // The replicated dbs keep the WAL, as the replication ships it
+    const bool disable_wal = FLAGS_kafka_ingestion_disable_wal &&
+      db->role() == replicator::DBRole::NOOP;
+    rocksdb::WriteOptions write_options;
+    write_options.disableWAL = disable_wal;
+    auto stats_ptr = common::Stats::get();
+    if (batch->deduper) {
+      batch->deduper->AppendTo(&batch->updates);
+      stats_ptr->Incr(stats->deduped_updates,
+                      batch->deduper->Count() - batch->updates.Count());
+      batch->deduper->Clear();
+    }
+
+    rocksdb::Status status;
+    if (batch->updates.Count() > 0) {
+      // Written through rocksdb(), which doesn't wake it up
+      if (db->IsHibernated()) {
+        db->WakeUp();
+      }
+      status = db->rocksdb()->Write(write_options, &batch->updates);
+      db->InvalidateReadCache(batch->updates);
+    }
+
+    stats_ptr->Incr(stats->put_messages, batch->n_puts);
+    stats_ptr->Incr(stats->delete_messages, batch->n_deletes);
+    stats_ptr->Incr(stats->merge_messages, batch->n_merges);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failure while writing " << batch->updates.Count()
+                 << " kafka messages to " << db_name << ": "
+                 << status.ToString();
+      stats_ptr->Incr(stats->put_errors, batch->n_puts);
+      stats_ptr->Incr(stats->delete_errors, batch->n_deletes);
+      stats_ptr->Incr(stats->merge_errors, batch->n_merges);
+    }
+
+    // The kafka checkpoint thread saves the timestamp to meta_db. Without
+    // the WAL, only once the messages are flushed.
+    if (status.ok() && disable_wal) {
+      addUnflushedKafkaCheckpoint(db_name,
+                                  db->rocksdb()->GetLatestSequenceNumber(),
+                                  batch->last_timestamp_ms);
+    } else if (status.ok()) {
+      setKafkaCheckpoint(db_name, batch->last_timestamp_ms);
+    }
+
+    batch->updates.Clear();
+    batch->n_puts = batch->n_deletes = batch->n_merges = 0;
+    batch->n_messages = 0;
+  };
+
+  auto add_message = [db_name, should_deserialize, stats, batch](
+      const RdKafka::Message& message, const bool is_replay) {
+    const int64_t msg_timestamp_secs = GetMessageTimestampSecs(message);
+    if (batch->n_messages++ == 0) {
+      batch->first_message_ms = common::timeutil::GetCurrentTimestamp(
+          common::timeutil::TimeUnit::kMillisecond);
+    }
+    batch->last_timestamp_ms = message.timestamp().timestamp;
 
     // Logs for debugging, only enabled if flag is specified.
     // In case of sensitive data... we shouldn't be logging message, unless
     // explicitly configured to do so (may be in order to debug)
     if (FLAGS_enable_logging_consumer_log) {
       LOG_EVERY_N(INFO, FLAGS_consumer_log_frequency)
-        << "DB name: " << db_name << ", Key " << folly::hexlify(*message->key())
+        << "DB name: " << db_name << ", Key " << folly::hexlify(*message.key())
         << ", "
         << "value "
         << ((FLAGS_enable_logging_consumer_log_with_payload)
           ? (folly::hexlify(folly::StringPiece(
-            static_cast<const char *>(message->payload()), message->len())))
+            static_cast<const char *>(message.payload()), message.len())))
           : ("***REDACTED***"))
         << ", "
-        << "partition: " << message->partition() << ", "
-        << "offset: " << message->offset() << ", "
-        << "payload len: " << message->len() << ", "
+        << "partition: " << message.partition() << ", "
+        << "offset: " << message.offset() << ", "
+        << "payload len: " << message.len() << ", "
         << "msg_timestamp: " << ToUTC(msg_timestamp_secs) << " or "
         << std::to_string(msg_timestamp_secs) << " secs";
     }
@@ -1771,88 +3977,173 @@ void AdminHandler::async_tm_startMessageIngestion(
     if (!is_replay) {
       auto latency_ms = common::timeutil::GetCurrentTimestamp(
           common::timeutil::TimeUnit::kMillisecond)
-                        - message->timestamp().timestamp;
-      common::Stats::get()->AddMetric(folly::stringPrintf("%s segment=%s",
-          kKafkaConsumerLatency.c_str(), segment.c_str()), latency_ms);
+                        - message.timestamp().timestamp;
+      common::Stats::get()->AddMetric(stats->consumer_latency, latency_ms);
     }
 
-    auto key = rocksdb::Slice(static_cast<const char *>(message->key_pointer()),
-                              message->key_len());
+    auto key = rocksdb::Slice(static_cast<const char *>(message.key_pointer()),
+                              message.key_len());
 
     // Deserialize the kafka payload
     KafkaOperationCode op_code;
-    std::string deser_val;
     rocksdb::Slice value;
     if (should_deserialize) {
-      if (DeserializeKafkaPayload(message->payload(),
-          message->len(), &op_code, &deser_val)) {
-        value = rocksdb::Slice(deser_val);
-      } else {
+      if (!DeserializeKafkaPayload(message.payload(),
+          message.len(), &op_code, &value)) {
         LOG(ERROR) << "Failed to deserialize. Ignoring kafka message";
         return;
       }
     } else {
       // If serialization is not required, just put the value to rocksdb
       op_code = KafkaOperationCode::PUT;
-      value = rocksdb::Slice(static_cast<const char *>(message->payload()),
-          message->len());
+      value = rocksdb::Slice(static_cast<const char *>(message.payload()),
+          message.len());
     }
 
-    // Write the message to rocksdb
-    rocksdb::Status status;
-    static const rocksdb::WriteOptions write_options;
-
+    // Add the message to the batch, which copies key and value
     switch (op_code) {
       case KafkaOperationCode::PUT:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaDbPutMessage.c_str(), segment.c_str()));
-
-        status = db->rocksdb()->Put(write_options, key, value);
-        if (!status.ok()) {
-          LOG(ERROR) << "Failure while writing to " << db_name << ": "
-                     << status.ToString();
-          common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-              kKafkaDbPutErrors.c_str(), segment.c_str()));
+        if (batch->deduper) {
+          batch->deduper->Put(key, value);
+        } else {
+          batch->updates.Put(key, value);
         }
-
+        ++batch->n_puts;
         break;
       case KafkaOperationCode::DELETE:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaDbDelMessage.c_str(), segment.c_str()));
-        status = db->rocksdb()->Delete(write_options, key);
-        if (!status.ok()) {
-          LOG(ERROR) << "Failure while deleting from " << db_name << ": "
-                     << status.ToString();
-          common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-              kKafkaDbDeleteErrors.c_str(), segment.c_str()));
+        if (batch->deduper) {
+          batch->deduper->Delete(key);
+        } else {
+          batch->updates.Delete(key);
         }
+        ++batch->n_deletes;
         break;
       case KafkaOperationCode::MERGE:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaDbMergeMessage.c_str(), segment.c_str()));
-        status = db->rocksdb()->Merge(write_options, key, value);
-        if (!status.ok()) {
-          LOG(ERROR) << "Failure while merging to " << db_name << ": "
-                     << status.ToString();
-          common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-              kKafkaDbMergeErrors.c_str(), segment.c_str()));
+        if (batch->deduper) {
+          batch->deduper->Merge(key, value);
+        } else {
+          batch->updates.Merge(key, value);
         }
+        ++batch->n_merges;
         break;
       default:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaInvalidOpcode.c_str(), segment.c_str()));
+        common::Stats::get()->Incr(stats->invalid_opcode);
         LOG(ERROR) << "Invalid op_code in kafka payload";
     }
+  };
 
-    // Update meta_db with kafka message timestamp periodically.
-    if (message_count % FLAGS_kafka_ts_update_interval == 0) {
-      const auto timestamp_ms = message->timestamp().timestamp;
-      const auto meta = getMetaData(db_name);
-      writeMetaData(db_name, meta.s3_bucket, meta.s3_path, timestamp_ms);
-      LOG(INFO) << "[meta_db] Writing timestamp " << timestamp_ms
-                << " for db: " << db_name;
+  auto handle_messages = [add_message, batch, commit_batch](
+      const std::vector<std::unique_ptr<RdKafka::Message>>& messages,
+      const bool is_replay) {
+    for (const auto& message : messages) {
+      add_message(*message, is_replay);
+      if (batch->Full()) {
+        commit_batch();
+      }
     }
-  });
+  };
+
+  if (FLAGS_kafka_ingestion_shared_consumer) {
+    // Messages from replay_timestamp_ms to the current are consumed before
+    // AddPartition() returns, and live messages then continue to be consumed
+    // by the shared consumer thread.
+    const auto key = std::make_pair(topic_name, kafka_broker_serverset_path);
+    std::shared_ptr<::kafka::SharedKafkaConsumer> shared_consumer;
+    {
+      std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
+      auto& consumer = kafka_shared_consumers_[key];
+      if (consumer == nullptr) {
+        auto rd_kafka_consumer = ::kafka::CreateRdKafkaConsumer(
+            partition_ids_set,
+            kafka_broker_file_watcher->GetKafkaBrokerList(),
+            getConsumerGroupId(topic_name),
+            folly::stringPrintf("%s_%s", kKafkaConsumerType, segment.c_str()));
+        if (rd_kafka_consumer == nullptr) {
+          kafka_shared_consumers_.erase(key);
+          e.message = "Failed to create kafka consumer for " + topic_name;
+          callback.release()->exceptionInThread(std::move(e));
+          return;
+        }
+        consumer = std::make_shared<::kafka::SharedKafkaConsumer>(
+            folly::stringPrintf("%s_%s", kKafkaSharedConsumerName,
+                                topic_name.c_str()),
+            std::move(rd_kafka_consumer),
+            FLAGS_kafka_ingestion_consume_batch_size,
+            FLAGS_kafka_consumer_timeout_ms);
+      }
+      shared_consumer = consumer;
+      kafka_shared_consumer_dbs_[db_name] = key;
+    }
+
+    if (!shared_consumer->AddPartition(topic_name, partition_id,
+                                       replay_timestamp_ms, handle_messages,
+                                       commit_batch,
+                                       replayed_offset == -1 ?
+                                         -1 : replayed_offset + 1)) {
+      removeSharedKafkaConsumerDB(db_name);
+      e.message = "Failed to consume " + topic_name + " for " + db_name;
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+
+    LOG(INFO) << "Now consuming live messages for " << db_name
+              << " with the shared consumer of " << topic_name;
+    callback.release()->result(StartMessageIngestionResponse());
+    return;
+  }
+
+  const auto kafka_consumer_pool = std::make_shared<::kafka::KafkaConsumerPool>(
+      kKafkaConsumerPoolSize,
+      partition_ids_set,
+      // TODO: fix this to return a string object rather than a reference
+      kafka_broker_file_watcher->GetKafkaBrokerList(),
+      std::unordered_set<std::string>({topic_name}),
+      getConsumerGroupId(db_name),
+      folly::stringPrintf("%s_%s", kKafkaConsumerType, segment.c_str()));
+
+  auto kafka_watcher = std::make_shared<KafkaWatcher>(
+      folly::stringPrintf("%s_%s", kKafkaWatcherName, segment.c_str()),
+      kafka_consumer_pool,
+      -1, // kafka_init_blocking_consume_timeout_ms
+      FLAGS_kafka_consumer_timeout_ms);
+
+  if (FLAGS_kafka_ingestion_pause_on_write_stall ||
+      FLAGS_kafka_ingestion_max_handler_latency_ms > 0) {
+    KafkaBackpressureHandler backpressure_handler = nullptr;
+    if (FLAGS_kafka_ingestion_pause_on_write_stall) {
+      backpressure_handler = [db] { return db->IsWriteStalled(); };
+    }
+    kafka_watcher->SetBackpressureHandler(
+        std::move(backpressure_handler),
+        std::max(FLAGS_kafka_ingestion_max_handler_latency_ms, 0));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
+    kafka_watcher_map_[db_name] = kafka_watcher;
+  }
+
+  // With kafka_init_blocking_consume_timeout_ms set to -1, messages from
+  // replay_timestamp_ms to the current are synchronously consumed. The
+  // calling thread then returns after spawning a new thread to consume
+  // live messages.
+  if (replayed_offset != -1) {
+    // Seeks to the message after replayed_offset
+    std::map<std::string, std::map<int32_t, int64_t>> last_offsets;
+    last_offsets[topic_name][partition_id] = replayed_offset;
+    kafka_watcher->StartWithBatch(
+        last_offsets,
+        handle_messages,
+        FLAGS_kafka_ingestion_consume_batch_size,
+        commit_batch);
+  } else {
+    kafka_watcher->StartWithBatch(
+        replay_timestamp_ms,
+        handle_messages,
+        FLAGS_kafka_ingestion_consume_batch_size,
+        // Don't hold messages back while there are no more
+        commit_batch);
+  }
 
   LOG(INFO) << "Now consuming live messages for " << db_name;
 
@@ -1866,6 +4157,21 @@ void AdminHandler::async_tm_stopMessageIngestion(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       StopMessageIngestionResponse>>> callback,
     std::unique_ptr<StopMessageIngestionRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    stopMessageIngestion(std::move(control_callback),
+                         std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  stopMessageIngestion(std::move(callback), std::move(request));
+}
+
+void AdminHandler::stopMessageIngestion(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      StopMessageIngestionResponse>>> callback,
+    std::unique_ptr<StopMessageIngestionRequest> request) {
 
   admin::AdminException e;
   e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
@@ -1883,6 +4189,29 @@ void AdminHandler::async_tm_stopMessageIngestion(
   }
 
   std::shared_ptr<KafkaWatcher> kafka_watcher;
+  std::shared_ptr<::kafka::SharedKafkaConsumer> shared_consumer;
+  std::pair<std::string, int32_t> topic_partition;
+  {
+    std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
+    auto shared_iter = kafka_shared_consumer_dbs_.find(db_name);
+    if (shared_iter != kafka_shared_consumer_dbs_.end()) {
+      shared_consumer = kafka_shared_consumers_[shared_iter->second];
+      topic_partition = std::make_pair(shared_iter->second.first,
+                                       ExtractShardId(db_name));
+    }
+  }
+
+  if (shared_consumer != nullptr) {
+    // No more messages are written to the db once it returns
+    shared_consumer->RemovePartition(topic_partition.first,
+                                     topic_partition.second);
+    removeSharedKafkaConsumerDB(db_name);
+    FlushUnloggedKafkaMessages(db);
+    flushKafkaCheckpoints(db_name);
+    callback.release()->result(StopMessageIngestionResponse());
+    return;
+  }
+
   {
     std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
     auto iter = kafka_watcher_map_.find(db_name);
@@ -1906,14 +4235,240 @@ void AdminHandler::async_tm_stopMessageIngestion(
     kafka_watcher_map_.erase(db_name);
   }
 
+  // Save where to resume from right away
+  FlushUnloggedKafkaMessages(db);
+  flushKafkaCheckpoints(db_name);
+
   callback.release()->result(StopMessageIngestionResponse());
   return;
 }
 
+void AdminHandler::removeSharedKafkaConsumerDB(const std::string& db_name) {
+  std::shared_ptr<::kafka::SharedKafkaConsumer> unused_consumer;
+  {
+    std::lock_guard<std::mutex> lock(kafka_watcher_lock_);
+    auto iter = kafka_shared_consumer_dbs_.find(db_name);
+    if (iter == kafka_shared_consumer_dbs_.end()) {
+      return;
+    }
+    const auto key = iter->second;
+    kafka_shared_consumer_dbs_.erase(iter);
+
+    // Close the consumer once no db ingests from it
+    for (const auto& db : kafka_shared_consumer_dbs_) {
+      if (db.second == key) {
+        return;
+      }
+    }
+    auto consumer_iter = kafka_shared_consumers_.find(key);
+    unused_consumer = std::move(consumer_iter->second);
+    kafka_shared_consumers_.erase(consumer_iter);
+  }
+  LOG(INFO) << "Closing the shared kafka consumer of " << db_name;
+}
+
+bool AdminHandler::replayKafkaToSstFiles(
+    const std::shared_ptr<ApplicationDB>& db,
+    const std::string& topic_name,
+    const int32_t partition_id,
+    const std::string& broker_list,
+    const int64_t replay_timestamp_ms,
+    const bool should_deserialize,
+    int64_t* last_offset,
+    int64_t* last_timestamp_ms) {
+  const auto& db_name = db->db_name();
+  const auto segment = DbNameToSegment(db_name);
+  ::kafka::KafkaConsumer consumer(
+      std::unordered_set<uint32_t>({static_cast<uint32_t>(partition_id)}),
+      broker_list,
+      std::unordered_set<std::string>({topic_name}),
+      getConsumerGroupId(db_name),
+      folly::stringPrintf("%s_%s", kKafkaConsumerType, segment.c_str()));
+  if (!consumer.IsHealthy() || !consumer.Seek(topic_name, replay_timestamp_ms)) {
+    LOG(ERROR) << "Failed to seek " << topic_name << " to "
+               << replay_timestamp_ms << " for " << db_name;
+    return false;
+  }
+
+  const auto tmp_dir = FLAGS_rocksdb_dir + "kafka_replay_tmp/" + db_name + "/";
+  boost::system::error_code fs_err;
+  boost::filesystem::remove_all(tmp_dir, fs_err);
+  boost::filesystem::create_directories(tmp_dir, fs_err);
+  if (fs_err) {
+    LOG(ERROR) << "Failed to create dir: " << tmp_dir << fs_err.message();
+    return false;
+  }
+  SCOPE_EXIT { boost::filesystem::remove_all(tmp_dir, fs_err); };
+
+  // The latest update of each key since the last sst file, in the order of
+  // the db's comparator as required by SstFileWriter. An sst file can hold
+  // one entry per key only, so a merge to a key already there starts a new
+  // file, while a put or delete just replaces the earlier update.
+  const auto options = db->rocksdb()->GetOptions();
+  const rocksdb::Comparator* comparator = options.comparator;
+  auto compare = [comparator] (const std::string& a, const std::string& b) {
+    return comparator->Compare(a, b) < 0;
+  };
+  std::map<std::string, std::pair<KafkaOperationCode, std::string>,
+           decltype(compare)> chunk(compare);
+  size_t chunk_bytes = 0;
+  int64_t chunk_last_offset = -1;
+  int64_t chunk_last_timestamp_ms = -1;
+  uint32_t n_files = 0;
+
+  // Build an sst file from chunk and ingest it
+  auto flush_chunk = [&] () -> bool {
+    if (chunk.empty()) {
+      // Only undecodable messages, nothing to write for them
+      if (chunk_last_offset != -1) {
+        *last_offset = chunk_last_offset;
+        *last_timestamp_ms = chunk_last_timestamp_ms;
+      }
+      return true;
+    }
+
+    const auto file_path = tmp_dir + std::to_string(n_files++) + ".sst";
+    rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), options);
+    auto status = writer.Open(file_path);
+    for (auto iter = chunk.begin(); status.ok() && iter != chunk.end();
+         ++iter) {
+      switch (iter->second.first) {
+        case KafkaOperationCode::PUT:
+          status = writer.Put(iter->first, iter->second.second);
+          break;
+        case KafkaOperationCode::DELETE:
+          status = writer.Delete(iter->first);
+          break;
+        default:
+          status = writer.Merge(iter->first, iter->second.second);
+      }
+    }
+    if (status.ok()) {
+      status = writer.Finish();
+    }
+
+    if (status.ok()) {
+      // The replayed messages are newer than anything in the db already
+      rocksdb::IngestExternalFileOptions ifo;
+      ifo.move_files = true;
+      ifo.allow_global_seqno = true;
+      ifo.allow_blocking_flush = true;
+      common::Timer timer(kIngestMs + " db=" + db_name);
+      status = db->rocksdb()->IngestExternalFile({file_path}, ifo);
+      db->ClearReadCache();
+    }
+
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to ingest " << file_path << " replayed from "
+                 << topic_name << ": " << status.ToString();
+      return false;
+    }
+
+    LOG(INFO) << "Ingested " << chunk.size() << " keys replayed from "
+              << topic_name << " to " << db_name << " up to offset "
+              << chunk_last_offset;
+    *last_offset = chunk_last_offset;
+    *last_timestamp_ms = chunk_last_timestamp_ms;
+    chunk.clear();
+    chunk_bytes = 0;
+    return true;
+  };
+
+  // Messages produced after this are left for the live consumption
+  const auto end_timestamp_ms = common::timeutil::GetCurrentTimestamp(
+      common::timeutil::TimeUnit::kMillisecond);
+  *last_offset = -1;
+  *last_timestamp_ms = -1;
+  while (true) {
+    auto messages = consumer.ConsumeBatch(
+        FLAGS_kafka_ingestion_consume_batch_size,
+        FLAGS_kafka_consumer_timeout_ms);
+    if (messages.empty()) {
+      return false;
+    }
+
+    for (const auto& message : messages) {
+      const auto error_code = message->err();
+      if (error_code == RdKafka::ERR__PARTITION_EOF ||
+          error_code == RdKafka::ERR__TIMED_OUT) {
+        return flush_chunk();
+      }
+      if (error_code != RdKafka::ERR_NO_ERROR) {
+        LOG(ERROR) << "Failed to replay " << topic_name << " for " << db_name
+                   << ": " << message->errstr();
+        return false;
+      }
+      if (message->timestamp().timestamp >= end_timestamp_ms) {
+        return flush_chunk();
+      }
+
+      KafkaOperationCode op_code;
+      rocksdb::Slice value;
+      bool is_valid = true;
+      if (should_deserialize) {
+        is_valid = DeserializeKafkaPayload(message->payload(), message->len(),
+                                           &op_code, &value);
+      } else {
+        op_code = KafkaOperationCode::PUT;
+        value = rocksdb::Slice(static_cast<const char *>(message->payload()),
+                               message->len());
+      }
+      if (is_valid && op_code != KafkaOperationCode::PUT &&
+          op_code != KafkaOperationCode::DELETE &&
+          op_code != KafkaOperationCode::MERGE) {
+        LOG(ERROR) << "Invalid op_code in kafka payload";
+        is_valid = false;
+      }
+
+      if (is_valid) {
+        std::string key(static_cast<const char *>(message->key_pointer()),
+                        message->key_len());
+        auto iter = chunk.find(key);
+        if (iter != chunk.end() && op_code == KafkaOperationCode::MERGE) {
+          if (!flush_chunk()) {
+            return false;
+          }
+          iter = chunk.end();
+        }
+        chunk_bytes += key.size() + value.size();
+        if (iter == chunk.end()) {
+          chunk.emplace(std::move(key),
+                        std::make_pair(op_code, value.ToString()));
+        } else {
+          iter->second = std::make_pair(op_code, value.ToString());
+        }
+      }
+      chunk_last_offset = message->offset();
+      chunk_last_timestamp_ms = message->timestamp().timestamp;
+
+      if (chunk_bytes >=
+            static_cast<size_t>(std::max<int64_t>(
+              FLAGS_kafka_replay_sst_file_bytes, 1)) &&
+          !flush_chunk()) {
+        return false;
+      }
+    }
+  }
+}
+
 void AdminHandler::async_tm_setDBOptions(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       SetDBOptionsResponse>>> callback,
     std::unique_ptr<SetDBOptionsRequest> request) {
+  auto run = [this] (auto control_callback, auto control_request) {
+    setDBOptions(std::move(control_callback), std::move(control_request));
+  };
+  if (offloadControlRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  setDBOptions(std::move(callback), std::move(request));
+}
+
+void AdminHandler::setDBOptions(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      SetDBOptionsResponse>>> callback,
+    std::unique_ptr<SetDBOptionsRequest> request) {
   std::unordered_map<string, string> options;
   for (auto& option_pair : request->options) {
     options.emplace(std::move(option_pair));
@@ -1940,6 +4495,21 @@ void AdminHandler::async_tm_compactDB(
     std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
       CompactDBResponse>>> callback,
     std::unique_ptr<CompactDBRequest> request) {
+  auto run = [this] (auto job_callback, auto job_request) {
+    compactDB(std::move(job_callback), std::move(job_request));
+  };
+  if (submitJobIfAsync(&callback, &request, "compactDB", "", run) ||
+      offloadLongRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  compactDB(std::move(callback), std::move(request));
+}
+
+template <typename CallbackType>
+void AdminHandler::compactDB(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<CompactDBRequest> request) {
   ::admin::AdminException e;
   auto db = getDB(request->db_name, &e);
   if (db == nullptr) {
@@ -1947,23 +4517,624 @@ void AdminHandler::async_tm_compactDB(
     return;
   }
 
-  auto status = db->CompactRange(
-      rocksdb::CompactRangeOptions(), nullptr, nullptr);
+  const auto n_ranges = static_cast<uint32_t>(std::min(
+      std::max(request->max_subcompactions, 1), kMaxCompactionRanges));
+  auto raw_callback = callback.get();
+  auto status = compaction_scheduler_->Compact(
+      db, rocksdb::CompactRangeOptions(), n_ranges,
+      [raw_callback] (const bool is_total, const uint64_t bytes) {
+        if (is_total) {
+          SetJobTotalBytes(raw_callback, bytes);
+        } else {
+          AddJobBytes(raw_callback, bytes);
+        }
+      });
   if (!status.ok()) {
     e.message = status.ToString();
     e.errorCode = AdminErrorCode::DB_ERROR;
     callback.release()->exceptionInThread(std::move(e));
     return;
   }
-  callback.release()->result(CompactDBResponse());
+  callback->result(CompactDBResponse());
+}
+
+void AdminHandler::async_tm_splitDB(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      SplitDBResponse>>> callback,
+    std::unique_ptr<SplitDBRequest> request) {
+  auto run = [this] (auto long_callback, auto long_request) {
+    splitDB(std::move(long_callback), std::move(long_request));
+  };
+  if (offloadLongRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  splitDB(std::move(callback), std::move(request));
+}
+
+void AdminHandler::splitDB(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      SplitDBResponse>>> callback,
+    std::unique_ptr<SplitDBRequest> request) {
+  AdminException e;
+  e.errorCode = AdminErrorCode::DB_ADMIN_ERROR;
+  const auto& left_db_name = request->left_db_name;
+  const auto& right_db_name = request->right_db_name;
+  if (left_db_name == right_db_name || left_db_name == request->db_name ||
+      right_db_name == request->db_name) {
+    e.message = "The halves of " + request->db_name + " need new names";
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+
+  // The db is only read, like by backups
+  db_admin_lock_.LockShared(request->db_name);
+  SCOPE_EXIT { db_admin_lock_.UnlockShared(request->db_name); };
+  db_admin_lock_.Lock(left_db_name);
+  SCOPE_EXIT { db_admin_lock_.Unlock(left_db_name); };
+  db_admin_lock_.Lock(right_db_name);
+  SCOPE_EXIT { db_admin_lock_.Unlock(right_db_name); };
+
+  auto db = getDB(request->db_name, &e);
+  if (db == nullptr) {
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+  if (IsReadOnlySegment(DbNameToSegment(request->db_name))) {
+    e.message = "Can't split read-only " + request->db_name;
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+  if (IsTieredStorageSegment(DbNameToSegment(request->db_name))) {
+    e.message = "Can't checkpoint " + request->db_name + " of tiered storage";
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+
+  const std::vector<std::pair<std::string, bool>> halves = {
+    {left_db_name, true}, {right_db_name, false}};
+  for (const auto& half : halves) {
+    boost::system::error_code exists_err;
+    if (getDB(half.first, nullptr) != nullptr ||
+        boost::filesystem::exists(FLAGS_rocksdb_dir + half.first,
+                                  exists_err)) {
+      e.errorCode = AdminErrorCode::DB_EXIST;
+      e.message = half.first + " already exists";
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+  }
+
+  // The checkpoints are removed on failures, they were created by us
+  std::vector<std::unique_ptr<rocksdb::DB>> half_dbs;
+  bool split = false;
+  SCOPE_EXIT {
+    half_dbs.clear();
+    for (size_t i = 0; !split && i < halves.size(); ++i) {
+      boost::system::error_code remove_err;
+      boost::filesystem::remove_all(FLAGS_rocksdb_dir + halves[i].first,
+                                    remove_err);
+    }
+  };
+
+  // The right half is a checkpoint of the left one, so that both start from
+  // the same sequence # while the db takes writes
+  for (const auto& half : halves) {
+    const auto half_path = FLAGS_rocksdb_dir + half.first;
+    rocksdb::Checkpoint* checkpoint;
+    auto status = rocksdb::Checkpoint::Create(
+      half_dbs.empty() ? db->rocksdb() : half_dbs.back().get(), &checkpoint);
+    if (!OKOrSetException(status, AdminErrorCode::DB_ADMIN_ERROR, &callback)) {
+      return;
+    }
+    // Hard links the sst files, so that the halves take little space until
+    // they are compacted
+    status = checkpoint->CreateCheckpoint(half_path);
+    delete checkpoint;
+    if (!OKOrSetException(status, AdminErrorCode::DB_ADMIN_ERROR, &callback)) {
+      return;
+    }
+
+    const auto half_segment = DbNameToSegment(half.first);
+    auto half_db = GetRocksdb(half_path, rocksdb_options_(half_segment),
+                              GetColumnFamilies(column_family_options_,
+                                                half_segment));
+    if (half_db == nullptr) {
+      e.message = "Failed to open " + half_path;
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+    half_dbs.push_back(std::move(half_db));
+  }
+
+  // The sequence # of the checkpoints, before dropping keys takes more
+  const auto checkpoint_seq_num = half_dbs[0]->GetLatestSequenceNumber();
+
+  for (size_t i = 0; i < halves.size(); ++i) {
+    auto status = halves[i].second ?
+      KeepKeyRange(half_dbs[i].get(), nullptr, &request->split_key) :
+      KeepKeyRange(half_dbs[i].get(), &request->split_key, nullptr);
+    if (!OKOrSetException(status, AdminErrorCode::DB_ERROR, &callback)) {
+      LOG(ERROR) << "Failed to drop the other half from " << halves[i].first
+                 << " " << status.ToString();
+      return;
+    }
+  }
+
+  // The halves would miss the updates written to the db after the
+  // checkpoints, so the db must not take any during the split
+  const auto db_seq_num = db->rocksdb()->GetLatestSequenceNumber();
+  if (db_seq_num != checkpoint_seq_num) {
+    e.message = request->db_name + " took updates while being split, from "
+      "sequence # " + folly::to<std::string>(checkpoint_seq_num) + " to " +
+      folly::to<std::string>(db_seq_num) + ". Stop its writes first";
+    callback.release()->exceptionInThread(std::move(e));
+    return;
+  }
+
+  SplitDBResponse response;
+  response.left_seq_num = half_dbs[0]->GetLatestSequenceNumber();
+  response.right_seq_num = half_dbs[1]->GetLatestSequenceNumber();
+  for (size_t i = 0; i < halves.size(); ++i) {
+    std::unique_ptr<folly::SocketAddress> upstream_addr;
+    if (db->upstream_addr()) {
+      upstream_addr =
+        std::make_unique<folly::SocketAddress>(*db->upstream_addr());
+    }
+    std::string err_msg;
+    if (!db_manager_->addDB(halves[i].first, std::move(half_dbs[i]),
+                            db->role(), std::move(upstream_addr), &err_msg)) {
+      if (i > 0) {
+        db_manager_->removeDB(halves[0].first, nullptr);
+      }
+      e.message = std::move(err_msg);
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+  }
+  split = true;
+
+  LOG(INFO) << "Split " << request->db_name << " into " << left_db_name
+            << " and " << right_db_name;
+  callback->result(response);
+}
+
+void AdminHandler::async_tm_exportDBToS3(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      ExportDBToS3Response>>> callback,
+    std::unique_ptr<ExportDBToS3Request> request) {
+  auto run = [this] (auto job_callback, auto job_request) {
+    exportDBToS3(std::move(job_callback), std::move(job_request));
+  };
+  const auto source = request->s3_bucket + "/" + request->s3_export_dir;
+  if (submitJobIfAsync(&callback, &request, "exportDBToS3", source, run) ||
+      offloadLongRequest(&callback, &request, std::move(run))) {
+    return;
+  }
+
+  exportDBToS3(std::move(callback), std::move(request));
+}
+
+template <typename CallbackType>
+void AdminHandler::exportDBToS3(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<ExportDBToS3Request> request) {
+  AdminException e;
+  std::string err_str;
+  auto admission =
+    admitS3Transfer(kS3BackupPriority, request->db_name, &err_str);
+  if (admission == nullptr) {
+    SetException(err_str, AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kS3ExportFailure);
+    return;
+  }
+
+  // The db is only read, like by backups
+  db_admin_lock_.LockShared(request->db_name);
+  SCOPE_EXIT { db_admin_lock_.UnlockShared(request->db_name); };
+
+  auto db = getDB(request->db_name, &e);
+  if (db == nullptr) {
+    callback.release()->exceptionInThread(std::move(e));
+    common::Stats::get()->Incr(kS3ExportFailure);
+    return;
+  }
+
+  common::Timer timer(kS3ExportMs);
+  LOG(INFO) << "S3 Export " << request->db_name << " to "
+            << request->s3_export_dir;
+  const auto local_path = folly::stringPrintf(
+    "%sexport_tmp/%s%" PRId64 "/", FLAGS_rocksdb_dir.c_str(),
+    request->db_name.c_str(), common::timeutil::GetCurrentTimestamp());
+  boost::system::error_code fs_err;
+  boost::filesystem::remove_all(local_path, fs_err);
+  boost::filesystem::create_directories(local_path, fs_err);
+  SCOPE_EXIT { boost::filesystem::remove_all(local_path, fs_err); };
+  if (fs_err) {
+    SetException("Cannot create dir for export: " + local_path,
+                 AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kS3ExportFailure);
+    return;
+  }
+
+  // All the ranges are read from the same point in time
+  const rocksdb::Snapshot* snapshot = db->rocksdb()->GetSnapshot();
+  SCOPE_EXIT { db->rocksdb()->ReleaseSnapshot(snapshot); };
+
+  const auto n_ranges = request->__isset.num_ranges &&
+    request->num_ranges > 0 ? request->num_ranges : FLAGS_export_db_num_ranges;
+  const auto ranges = CompactionScheduler::SplitKeySpace(
+    db, static_cast<uint32_t>(std::min(std::max(n_ranges, 1),
+                                       kMaxCompactionRanges)));
+  uint64_t total_bytes = 0;
+  for (const auto& range : ranges) {
+    total_bytes += range.bytes;
+  }
+  SetJobTotalBytes(callback.get(), total_bytes);
+
+  auto local_s3_util =
+    createLocalS3Util(request->limit_mbs, request->s3_bucket);
+  const auto s3_dir = ensure_ends_with_pathsep(request->s3_export_dir);
+  const auto options = db->rocksdb()->GetOptions();
+  std::mutex manifest_lock;
+  ExportManifest manifest;
+  SstChecksumManifest checksums;
+
+  // Write the keys of a range to sst files of about
+  // --export_db_sst_file_bytes, and upload each of them once it is done. The
+  // files are named after their range and their order in it, so that the
+  // order of their names is the order of their keys.
+  auto export_range = [&] (const size_t idx) {
+    const auto& range = ranges[idx];
+    rocksdb::ReadOptions read_options;
+    read_options.snapshot = snapshot;
+    read_options.fill_cache = false;
+    read_options.readahead_size = FLAGS_export_db_readahead_bytes;
+    read_options.total_order_seek = true;
+    const rocksdb::Slice end(range.end);
+    if (range.has_end) {
+      read_options.iterate_upper_bound = &end;
+    }
+    std::unique_ptr<rocksdb::Iterator> iter(
+      db->rocksdb()->NewIterator(read_options));
+
+    uint32_t n_files = 0;
+    std::string file_name;
+    std::unique_ptr<rocksdb::SstFileWriter> writer;
+    auto upload_file = [&] () {
+      rocksdb::ExternalSstFileInfo info;
+      auto status = writer->Finish(&info);
+      writer.reset();
+      const auto file_path = local_path + file_name;
+      uint32_t crc32c;
+      if (!status.ok() || !GetFileCrc32c(file_path, &crc32c)) {
+        LOG(ERROR) << "Failed to write " << file_path << ": "
+                   << status.ToString();
+        return false;
+      }
+
+      auto put_resp = local_s3_util->putObject(s3_dir + file_name, file_path);
+      if (!put_resp.Error().empty()) {
+        LOG(ERROR) << "Failed to upload " << file_path << " to S3: "
+                   << put_resp.Error();
+        return false;
+      }
+      boost::system::error_code remove_err;
+      boost::filesystem::remove(file_path, remove_err);
+
+      ExportedSstFile exported;
+      exported.file_name = file_name;
+      exported.smallest_key = info.smallest_key;
+      exported.largest_key = info.largest_key;
+      exported.num_entries = info.num_entries;
+      exported.size = info.file_size;
+      SstFileChecksum checksum;
+      checksum.file_name = file_name;
+      checksum.size = info.file_size;
+      // GetFileCrc32c() leaves out the final inversion of the standard CRC-32C
+      checksum.crc32c = static_cast<int32_t>(~crc32c);
+      std::lock_guard<std::mutex> g(manifest_lock);
+      manifest.sst_files.push_back(std::move(exported));
+      checksums.sst_files.push_back(std::move(checksum));
+      return true;
+    };
+
+    if (range.has_begin) {
+      iter->Seek(range.begin);
+    } else {
+      iter->SeekToFirst();
+    }
+    for (; iter->Valid(); iter->Next()) {
+      if (writer == nullptr) {
+        file_name = folly::stringPrintf("%05zu_%05u.sst", idx, n_files++);
+        writer = std::make_unique<rocksdb::SstFileWriter>(
+          rocksdb::EnvOptions(), options);
+        auto status = writer->Open(local_path + file_name);
+        if (!status.ok()) {
+          LOG(ERROR) << "Failed to open " << local_path << file_name << ": "
+                     << status.ToString();
+          return false;
+        }
+      }
+
+      auto status = writer->Put(iter->key(), iter->value());
+      if (!status.ok()) {
+        LOG(ERROR) << "Failed to write " << local_path << file_name << ": "
+                   << status.ToString();
+        return false;
+      }
+      if (writer->FileSize() >=
+            static_cast<uint64_t>(FLAGS_export_db_sst_file_bytes) &&
+          !upload_file()) {
+        return false;
+      }
+    }
+    if (!iter->status().ok()) {
+      LOG(ERROR) << "Failed to read " << request->db_name << ": "
+                 << iter->status().ToString();
+      return false;
+    }
+    if (writer != nullptr && !upload_file()) {
+      return false;
+    }
+
+    AddJobBytes(callback.get(), range.bytes);
+    return true;
+  };
+
+  // The ranges go to RunLargestFirst() by their index
+  std::vector<std::pair<std::string, uint64_t>> range_ids;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    range_ids.emplace_back(folly::to<std::string>(i), ranges[i].bytes);
+  }
+  if (!RunLargestFirst(std::move(range_ids), ranges.size(),
+                       [&export_range] (const std::string& range_id) {
+                         return export_range(folly::to<size_t>(range_id));
+                       })) {
+    SetException("Error happened when exporting " + request->db_name +
+                 " to S3", AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kS3ExportFailure);
+    return;
+  }
+
+  // The manifests go last, so that an export with a manifest is complete
+  auto by_name = [] (const auto& a, const auto& b) {
+    return a.file_name < b.file_name;
+  };
+  std::sort(manifest.sst_files.begin(), manifest.sst_files.end(), by_name);
+  std::sort(checksums.sst_files.begin(), checksums.sst_files.end(), by_name);
+  manifest.db_name = request->db_name;
+  manifest.seq_num = snapshot->GetSequenceNumber();
+  std::string manifest_data;
+  std::string checksums_data;
+  const auto manifest_local_path = local_path + kExportManifestFileName;
+  const auto checksums_local_path = local_path + kSstChecksumManifestFileName;
+  if (!EncodeThriftStruct(manifest, &manifest_data) ||
+      !EncodeThriftStruct(checksums, &checksums_data) ||
+      !folly::writeFile(manifest_data, manifest_local_path.c_str()) ||
+      !folly::writeFile(checksums_data, checksums_local_path.c_str()) ||
+      !local_s3_util->putObject(s3_dir + kSstChecksumManifestFileName,
+                                checksums_local_path).Body() ||
+      !local_s3_util->putObject(s3_dir + kExportManifestFileName,
+                                manifest_local_path).Body()) {
+    SetException("Error happened when uploading the export manifests to S3",
+                 AdminErrorCode::DB_ADMIN_ERROR, &callback);
+    common::Stats::get()->Incr(kS3ExportFailure);
+    return;
+  }
+
+  LOG(INFO) << "S3 Export of " << request->db_name << " is done with "
+            << manifest.sst_files.size() << " files at seq # "
+            << manifest.seq_num;
+  common::Stats::get()->Incr(kS3ExportSuccess);
+  callback->result(ExportDBToS3Response());
+}
+
+void AdminHandler::async_tm_getJobStatus(
+    std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+      GetJobStatusResponse>>> callback,
+    std::unique_ptr<GetJobStatusRequest> request) {
+  GetJobStatusResponse response;
+  if (!job_manager_->getStatus(request->job_id, &response.status)) {
+    SetException("Unknown job " + request->job_id,
+                 AdminErrorCode::JOB_NOT_FOUND, &callback);
+    return;
+  }
+
+  callback->result(response);
+}
+
+template <typename Response, typename Request, typename Run>
+bool AdminHandler::submitJobIfAsync(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<Response>>>* callback,
+    std::unique_ptr<Request>* request,
+    const std::string& operation,
+    const std::string& source,
+    Run run) {
+  if (!(*request)->__isset.async_job || !(*request)->async_job) {
+    return false;
+  }
+
+  const auto db_name = (*request)->db_name;
+  Response response;
+  response.job_id = job_manager_->submit(
+    operation + " " + db_name + " " + source, db_name, operation,
+    [run = std::move(run),
+     request = folly::makeMoveWrapper(std::move(*request))]
+    (std::shared_ptr<AdminJob> job) mutable {
+      run(std::make_unique<JobCallback<Response>>(std::move(job)),
+          std::move(*request));
+    });
+  response.__isset.job_id = true;
+  (*callback)->result(response);
+  return true;
+}
+
+template <typename Response, typename Request, typename Run>
+bool AdminHandler::offloadLongRequest(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<Response>>>* callback,
+    std::unique_ptr<Request>* request,
+    Run run) {
+  if (!FLAGS_admin_offload_long_requests) {
+    return false;
+  }
+
+  LongRequestPool()->add(
+    [run = std::move(run),
+     callback = folly::makeMoveWrapper(std::move(*callback)),
+     request = folly::makeMoveWrapper(std::move(*request))] () mutable {
+      run(std::move(*callback), std::move(*request));
+    });
+  return true;
+}
+
+template <typename Response, typename Request, typename Run>
+bool AdminHandler::offloadControlRequest(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<Response>>>* callback,
+    std::unique_ptr<Request>* request,
+    Run run) {
+  if (!FLAGS_admin_offload_control_requests) {
+    return false;
+  }
+
+  ControlRequestPool()->add(
+    [run = std::move(run),
+     callback = folly::makeMoveWrapper(std::move(*callback)),
+     request = folly::makeMoveWrapper(std::move(*request))] () mutable {
+      run(std::move(*callback), std::move(*request));
+    });
+  return true;
 }
 
 std::string AdminHandler::DumpDBStatsAsText() const {
-  return db_manager_->DumpDBStatsAsText();
+  return db_manager_->DumpDBStatsAsText() +
+    db_resource_collector_->DumpUsageAsText() +
+    host_resources_->DumpUsageAsText();
+}
+
+std::function<bool(std::string*)> AdminHandler::DBStatsReader() const {
+  struct State {
+    std::vector<std::string> db_names;
+    size_t next_db;
+    bool dumped_usage;
+  };
+
+  auto state = std::make_shared<State>();
+  state->db_names = db_manager_->getAllDBNames();
+  state->next_db = 0;
+  state->dumped_usage = false;
+  return [this, state] (std::string* chunk) {
+    if (state->next_db < state->db_names.size()) {
+      const auto end = std::min(state->next_db + kDBStatsChunkDBs,
+                                state->db_names.size());
+      *chunk += db_manager_->DumpDBStatsAsText(std::vector<std::string>(
+        state->db_names.begin() + state->next_db,
+        state->db_names.begin() + end));
+      state->next_db = end;
+      return true;
+    }
+
+    if (!state->dumped_usage) {
+      state->dumped_usage = true;
+      *chunk += db_resource_collector_->DumpUsageAsText() +
+        host_resources_->DumpUsageAsText();
+      return true;
+    }
+
+    return false;
+  };
+}
+
+std::string AdminHandler::DumpHotKeysAsText() const {
+  return db_manager_->DumpHotKeysAsText();
+}
+
+std::string AdminHandler::DumpHottestDBsAsText(const uint32_t n) const {
+  return db_resource_collector_->DumpHottestDBsAsText(n);
 }
 
 std::vector<std::string> AdminHandler::getAllDBNames() {
     return db_manager_->getAllDBNames();
 }
 
+void AdminHandler::FlushAllDBs() {
+  common::Timer timer(kShutdownFlushMs);
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline = start + std::chrono::milliseconds(
+    FLAGS_shutdown_flush_budget_ms);
+
+  // The dbs with the most unflushed bytes take the longest to replay
+  std::vector<std::pair<std::shared_ptr<ApplicationDB>, uint64_t>> dbs;
+  uint64_t total_bytes = 0;
+  for (const auto& db_name : getAllDBNames()) {
+    auto db = db_manager_->getDB(db_name, nullptr);
+    if (db == nullptr) {
+      continue;
+    }
+
+    uint64_t bytes = 0;
+    db->rocksdb()->GetIntProperty(
+      rocksdb::DB::Properties::kCurSizeAllMemTables, &bytes);
+    total_bytes += bytes;
+    dbs.emplace_back(std::move(db), bytes);
+  }
+  std::stable_sort(dbs.begin(), dbs.end(),
+                   [] (const std::pair<std::shared_ptr<ApplicationDB>,
+                                       uint64_t>& a,
+                       const std::pair<std::shared_ptr<ApplicationDB>,
+                                       uint64_t>& b) {
+                     return a.second > b.second;
+                   });
+  LOG(INFO) << "Flushing " << dbs.size() << " dbs with " << total_bytes
+            << " bytes in their memtables";
+
+  std::atomic<size_t> next{0};
+  std::atomic<uint64_t> unflushed_bytes{0};
+  std::atomic<uint32_t> skipped{0};
+  std::vector<std::thread> threads;
+  const auto n_threads = std::min<size_t>(
+    std::max(FLAGS_num_shutdown_flush_threads, 1), dbs.size());
+  for (size_t i = 0; i < n_threads; ++i) {
+    threads.emplace_back([&] {
+      for (auto idx = next++; idx < dbs.size(); idx = next++) {
+        if (FLAGS_shutdown_flush_budget_ms > 0 &&
+            std::chrono::steady_clock::now() >= deadline) {
+          unflushed_bytes += dbs[idx].second;
+          ++skipped;
+          continue;
+        }
+
+        auto status = dbs[idx].first->rocksdb()->Flush(
+          rocksdb::FlushOptions());
+        if (!status.ok()) {
+          LOG(ERROR) << "Failed to flush " << dbs[idx].first->db_name()
+                     << ": " << status.ToString();
+          common::Stats::get()->Incr(kShutdownFlushFailures);
+          unflushed_bytes += dbs[idx].second;
+        }
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  common::Stats::get()->Incr(kShutdownFlushSkippedDBs, skipped);
+  common::Stats::get()->AddMetric(kShutdownUnflushedBytes, unflushed_bytes);
+  LOG(INFO) << "Flushed " << dbs.size() - skipped << " dbs in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::steady_clock::now() - start).count()
+            << " ms, skipped " << skipped << " over the budget, leaving "
+            << unflushed_bytes << " bytes to replay";
+}
+
+std::string AdminHandler::DumpStartupReportAsText() const {
+  std::lock_guard<std::mutex> g(startup_report_mutex);
+  return startup_report;
+}
+
 }  // namespace admin
@@ -19,17 +19,29 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
+#include "common/admission_controller.h"
+#include "common/admission_queue.h"
 #include "common/object_lock.h"
 #include "common/s3util.h"
+#include "folly/SharedMutex.h"
 #include "folly/SocketAddress.h"
+#include "rocksdb_admin/admin_jobs.h"
 #include "rocksdb_admin/application_db_manager.h"
+#include "rocksdb_admin/compaction_scheduler.h"
+#include "rocksdb_admin/db_resource_collector.h"
+#include "rocksdb_admin/host_resources.h"
 #ifdef PINTEREST_INTERNAL
 // NEVER SET THIS UNLESS PINTEREST INTERNAL USAGE.
 #include "schemas/gen-cpp2/Admin.h"
@@ -40,16 +52,28 @@
 
 class KafkaWatcher;
 
+namespace kafka {
+class SharedKafkaConsumer;
+}  // namespace kafka
+
 namespace admin {
 
 using RocksDBOptionsGeneratorType =
   std::function<rocksdb::Options(const std::string&)>;
 
+// Return the column families other than the default one of the dbs of a
+// segment, with their options, e.g. a column family for small hot metadata
+// with a smaller block size than the default one holding large values.
+using RocksDBColumnFamilyOptionsGeneratorType =
+  std::function<std::vector<rocksdb::ColumnFamilyDescriptor>(
+    const std::string&)>;
+
 class AdminHandler : virtual public AdminSvIf {
  public:
   AdminHandler(
     std::unique_ptr<ApplicationDBManager> db_manager,
-    RocksDBOptionsGeneratorType rocksdb_options);
+    RocksDBOptionsGeneratorType rocksdb_options,
+    RocksDBColumnFamilyOptionsGeneratorType column_family_options = nullptr);
 
   virtual ~AdminHandler();
 
@@ -82,11 +106,21 @@ class AdminHandler : virtual public AdminSvIf {
         RestoreDBFromS3Response>>> callback,
       std::unique_ptr<RestoreDBFromS3Request> request) override;
 
+  void async_tm_bootstrapFromPeer(
+      std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+        BootstrapFromPeerResponse>>> callback,
+      std::unique_ptr<BootstrapFromPeerRequest> request) override;
+
   void async_tm_checkDB(
       std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
           CheckDBResponse>>> callback,
       std::unique_ptr<CheckDBRequest> request) override;
 
+  void async_tm_checkDBs(
+      std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+          CheckDBsResponse>>> callback,
+      std::unique_ptr<CheckDBsRequest> request) override;
+
   void async_tm_closeDB(
       std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
         CloseDBResponse>>> callback,
@@ -103,6 +137,11 @@ class AdminHandler : virtual public AdminSvIf {
         GetSequenceNumberResponse>>> callback,
       std::unique_ptr<GetSequenceNumberRequest> request) override;
 
+  void async_tm_getSequenceNumbers(
+      std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+        GetSequenceNumbersResponse>>> callback,
+      std::unique_ptr<GetSequenceNumbersRequest> request) override;
+
   void async_tm_clearDB(
       std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
         ClearDBResponse>>> callback,
@@ -133,25 +172,241 @@ class AdminHandler : virtual public AdminSvIf {
         CompactDBResponse>>> callback,
       std::unique_ptr<CompactDBRequest> request) override;
 
+  void async_tm_splitDB(
+      std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+        SplitDBResponse>>> callback,
+      std::unique_ptr<SplitDBRequest> request) override;
+
+  void async_tm_exportDBToS3(
+      std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+        ExportDBToS3Response>>> callback,
+      std::unique_ptr<ExportDBToS3Request> request) override;
+
+  void async_tm_getJobStatus(
+      std::unique_ptr<apache::thrift::HandlerCallback<std::unique_ptr<
+        GetJobStatusResponse>>> callback,
+      std::unique_ptr<GetJobStatusRequest> request) override;
+
   std::shared_ptr<ApplicationDB> getDB(const std::string& db_name,
                                        AdminException* ex);
 
   // Dump stats for all DBs as a text string
   std::string DumpDBStatsAsText() const;
 
+  // Stream the stats of DumpDBStatsAsText() a batch of DBs per call, for
+  // common::StatusServer::StreamingEndPointToOPMap. Append the next chunk to
+  // its argument and return true, or return false once all are dumped.
+  std::function<bool(std::string*)> DBStatsReader() const;
+
+  // Dump the hot keys of all DBs as a text string
+  std::string DumpHotKeysAsText() const;
+
+  // Dump the resource usage of the n DBs with the most reads and writes per
+  // second, as of the last pass of the collector, as a text string
+  std::string DumpHottestDBsAsText(const uint32_t n) const;
+
   // Get all the db names held by the AdminHandler
   std::vector<std::string> getAllDBNames();
 
+  // Flush the memtables of all DBs in parallel, so that they have no WAL to
+  // replay when opened next time. Call it once no more writes are coming,
+  // e.g. at shutdown. The DBs with the most unflushed bytes go first, and no
+  // more DB is started after --shutdown_flush_budget_ms.
+  void FlushAllDBs();
+
+  // Dump the per DB open times at startup as a text string, slowest first
+  std::string DumpStartupReportAsText() const;
+
  protected:
   // Lock to synchronize DB admin operations at per DB granularity.
+  // Operations only reading a db, like backups, lock it shared, so that they
+  // run concurrently with each other and only wait for the ones changing it.
   // Put db_admin_lock in protected to provide flexibility
   // of overriding some admin functions
-  common::ObjectLock<std::string> db_admin_lock_;
+  common::ObjectLock<std::string, std::hash<std::string>, folly::SharedMutex>
+    db_admin_lock_;
+
+  // Lock of (db name, backup dir) for the backups locking their db shared,
+  // so that only the ones to different dirs run concurrently
+  common::ObjectLock<std::string> backup_dir_lock_;
+
+  // For the data paths of the services built on top of us to shed load with
+  // at the entry of their handlers
+  common::AdmissionController admission_controller_;
 
  private:
   std::unique_ptr<rocksdb::DB> removeDB(const std::string& db_name,
                                         AdminException* ex);
 
+  // The long running admin calls, run either for a thrift callback or for a
+  // JobCallback when the request asks for a job.
+  template <typename CallbackType>
+  void backupDBToS3(std::unique_ptr<CallbackType> callback,
+                    std::unique_ptr<BackupDBToS3Request> request);
+  template <typename CallbackType>
+  void restoreDBFromS3(std::unique_ptr<CallbackType> callback,
+                       std::unique_ptr<RestoreDBFromS3Request> request);
+  template <typename CallbackType>
+  void bootstrapFromPeer(std::unique_ptr<CallbackType> callback,
+                         std::unique_ptr<BootstrapFromPeerRequest> request);
+  template <typename CallbackType>
+  void addS3SstFilesToDB(std::unique_ptr<CallbackType> callback,
+                         std::unique_ptr<AddS3SstFilesToDBRequest> request);
+  template <typename CallbackType>
+  void compactDB(std::unique_ptr<CallbackType> callback,
+                 std::unique_ptr<CompactDBRequest> request);
+  template <typename CallbackType>
+  void exportDBToS3(std::unique_ptr<CallbackType> callback,
+                    std::unique_ptr<ExportDBToS3Request> request);
+
+  void splitDB(std::unique_ptr<apache::thrift::HandlerCallback<
+                 std::unique_ptr<SplitDBResponse>>> callback,
+               std::unique_ptr<SplitDBRequest> request);
+
+  // The admin calls opening, closing or reconfiguring dbs, run either on the
+  // thrift worker thread or on the control call threads
+  void addDB(std::unique_ptr<apache::thrift::HandlerCallback<
+               std::unique_ptr<AddDBResponse>>> callback,
+             std::unique_ptr<AddDBRequest> request);
+  void closeDB(std::unique_ptr<apache::thrift::HandlerCallback<
+                 std::unique_ptr<CloseDBResponse>>> callback,
+               std::unique_ptr<CloseDBRequest> request);
+  void changeDBRoleAndUpStream(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<ChangeDBRoleAndUpstreamResponse>>> callback,
+      std::unique_ptr<ChangeDBRoleAndUpstreamRequest> request);
+  void clearDB(std::unique_ptr<apache::thrift::HandlerCallback<
+                 std::unique_ptr<ClearDBResponse>>> callback,
+               std::unique_ptr<ClearDBRequest> request);
+  void startMessageIngestion(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<StartMessageIngestionResponse>>> callback,
+      std::unique_ptr<StartMessageIngestionRequest> request);
+  void stopMessageIngestion(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<StopMessageIngestionResponse>>> callback,
+      std::unique_ptr<StopMessageIngestionRequest> request);
+  void setDBOptions(std::unique_ptr<apache::thrift::HandlerCallback<
+                      std::unique_ptr<SetDBOptionsResponse>>> callback,
+                    std::unique_ptr<SetDBOptionsRequest> request);
+
+  // Download the sst files under request.s3_path to local_path concurrently,
+  // and ingest them into db in groups of --s3_sst_ingest_group_size files (all
+  // of them at once if it is 0) in the order of their names, as soon as each
+  // group has landed into column_family. The key ranges of the files must not
+  // overlap.
+  // @return false if anything failed, with err_msg set.
+  template <typename CallbackType>
+  bool downloadAndIngestS3SstFiles(CallbackType* callback,
+                                   const AddS3SstFilesToDBRequest& request,
+                                   const std::string& local_path,
+                                   rocksdb::DB* db,
+                                   rocksdb::ColumnFamilyHandle* column_family,
+                                   std::string* err_msg);
+
+  // Replace the read-only db of request.db_name with a new version holding
+  // the sst files under request.s3_path, built in a staging dir. Reads are
+  // served by the old version until the new one is swapped in, and the old
+  // version is closed and deleted in the background.
+  // @return false if anything failed, with err_msg set.
+  template <typename CallbackType>
+  bool reloadReadOnlyDB(CallbackType* callback,
+                        const AddS3SstFilesToDBRequest& request,
+                        const std::string& local_path,
+                        std::string* err_msg);
+
+  // Warm up db for --db_warm_up_budget_ms, see ApplicationDB::WarmUp().
+  // Nothing is done if the budget is 0 or db is nullptr.
+  void warmUpDB(ApplicationDB* db);
+
+  // Delete all keys of column_family (the default one if nullptr) of db while
+  // it stays open and keeps its role, see ApplicationDB::DeleteAllKeys().
+  // @return db, or nullptr if anything failed, with e set.
+  std::shared_ptr<ApplicationDB> clearDBInPlace(
+    const std::string& db_name,
+    std::shared_ptr<ApplicationDB> db,
+    rocksdb::ColumnFamilyHandle* column_family,
+    AdminException* e);
+
+  // If request->async_job is set, submit run(job callback, request) as a job
+  // for (operation, db, source), reply with the job id and return true.
+  template <typename Response, typename Request, typename Run>
+  bool submitJobIfAsync(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<Response>>>* callback,
+      std::unique_ptr<Request>* request,
+      const std::string& operation,
+      const std::string& source,
+      Run run);
+
+  // Unless --admin_offload_long_requests is off, run run(callback, request)
+  // on the long call threads and return true. The thrift worker thread is
+  // free again right away, and the reply is sent when run is done.
+  template <typename Response, typename Request, typename Run>
+  bool offloadLongRequest(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<Response>>>* callback,
+      std::unique_ptr<Request>* request,
+      Run run);
+
+  // Likewise for the control calls, unless --admin_offload_control_requests
+  // is off, on threads of their own, which the long calls can't exhaust.
+  template <typename Response, typename Request, typename Run>
+  bool offloadControlRequest(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<Response>>>* callback,
+      std::unique_ptr<Request>* request,
+      Run run);
+
+  // Wait for one of the --max_s3_sst_loading_concurrency S3 transfer slots.
+  // Transfers with lower priority values go first, then the ones for smaller
+  // dbs.
+  // @return nullptr if we timed out, with err_msg set.
+  std::unique_ptr<common::AdmissionQueue::Admission> admitS3Transfer(
+      const uint32_t priority,
+      const std::string& db_name,
+      std::string* err_msg);
+
+  // Replace a SLAVE db, which can't catch up via replication anymore, with a
+  // checkpoint from its upstream
+  void catchUpFromUpstreamCheckpoint(const std::string& db_name,
+                                     const folly::SocketAddress& upstream_addr);
+
+  // Remember the timestamp of the last kafka message written to db_name. It
+  // is saved to meta_db by the kafka checkpoint thread.
+  void setKafkaCheckpoint(const std::string& db_name,
+                          const int64_t timestamp_ms);
+  // Save the kafka checkpoints set since the last call to meta_db in one
+  // batch, or just the one of db_name if not empty.
+  void flushKafkaCheckpoints(const std::string& db_name = "");
+  // With --kafka_ingestion_disable_wal, remember the timestamp of the last
+  // kafka message written to db_name, as of seq_no. It becomes the kafka
+  // checkpoint once a memtable flush persists seq_no.
+  void addUnflushedKafkaCheckpoint(const std::string& db_name,
+                                   const rocksdb::SequenceNumber seq_no,
+                                   const int64_t timestamp_ms);
+  // Called by FlushListener once the updates of db_name up to largest_seqno
+  // are persisted
+  void onMemTableFlushed(const std::string& db_name,
+                         const rocksdb::SequenceNumber largest_seqno);
+
+  // Forget the shared kafka consumer of db_name, and close it unless other
+  // dbs still use it
+  void removeSharedKafkaConsumerDB(const std::string& db_name);
+
+  // Replay topic_name/partition_id to db from replay_timestamp_ms up to now
+  // by building sst files of the messages and ingesting them. The offset
+  // and timestamp of the last message ingested, or -1, are returned in
+  // last_offset and last_timestamp_ms, even if it fails later on.
+  bool replayKafkaToSstFiles(const std::shared_ptr<ApplicationDB>& db,
+                             const std::string& topic_name,
+                             const int32_t partition_id,
+                             const std::string& broker_list,
+                             const int64_t replay_timestamp_ms,
+                             const bool should_deserialize,
+                             int64_t* last_offset,
+                             int64_t* last_timestamp_ms);
+
   DBMetaData getMetaData(const std::string& db_name);
   bool clearMetaData(const std::string& db_name);
   bool writeMetaData(const std::string& db_name,
@@ -161,23 +416,55 @@ class AdminHandler : virtual public AdminSvIf {
 
   std::unique_ptr<ApplicationDBManager> db_manager_;
   RocksDBOptionsGeneratorType rocksdb_options_;
-  // S3 util used for download
-  std::shared_ptr<common::S3Util> s3_util_;
-  // Lock for protecting the s3 util
-  mutable std::mutex s3_util_lock_;
+  // nullptr if the dbs have the default column family only
+  RocksDBColumnFamilyOptionsGeneratorType column_family_options_;
+  // The block cache, memtable budget and rate limiter shared by all dbs
+  std::unique_ptr<HostResources> host_resources_;
+  // Queues manual compactions, limiting the concurrent ones on each disk
+  std::unique_ptr<CompactionScheduler> compaction_scheduler_;
+  // The resource usage of the dbs, collected every
+  // --db_resource_collect_interval_ms. After db_manager_ to go before it.
+  std::unique_ptr<DBResourceCollector> db_resource_collector_;
   // db that contains meta data for all local rocksdb instances
   std::unique_ptr<rocksdb::DB> meta_db_;
   // segments which allow for overlapping keys when adding SST files
   std::unordered_set<std::string> allow_overlapping_keys_segments_;
-  // number of the current concurrenty s3 downloadings
-  std::atomic<int> num_current_s3_sst_downloadings_;
-  // number of the current concurrenty s3 uploadings
-  std::atomic<int> num_current_s3_sst_uploadings_;
+  // admission of the concurrent s3 uploadings and downloadings
+  std::unique_ptr<common::AdmissionQueue> s3_transfer_admission_;
   // Map of db_name to kafka watcher
   std::unordered_map<std::string, std::shared_ptr<KafkaWatcher>>
     kafka_watcher_map_;
-  // Lock for synchronizing access to kafka_watcher_map_
+  // (topic, broker serverset path) -> the consumer shared by the dbs
+  // ingesting from it, with --kafka_ingestion_shared_consumer
+  std::map<std::pair<std::string, std::string>,
+           std::shared_ptr<kafka::SharedKafkaConsumer>>
+    kafka_shared_consumers_;
+  // Map of db_name to the key of its shared consumer
+  std::unordered_map<std::string, std::pair<std::string, std::string>>
+    kafka_shared_consumer_dbs_;
+  // Lock for synchronizing access to kafka_watcher_map_ and the shared
+  // consumers
   std::mutex kafka_watcher_lock_;
+  // Lock for the read-modify-writes of meta_db_. Taken before
+  // kafka_checkpoints_lock_ when both are held.
+  std::mutex meta_db_lock_;
+  // db name -> the timestamp of the last kafka message written to it, which
+  // is not saved to meta_db yet
+  std::unordered_map<std::string, int64_t> kafka_checkpoints_;
+  std::mutex kafka_checkpoints_lock_;
+  // db name -> (the seq # after a batch of kafka messages, the timestamp of
+  // the last of them) for the batches written without the WAL and not
+  // flushed yet, oldest first. Guarded by kafka_checkpoints_lock_.
+  std::unordered_map<std::string,
+                     std::deque<std::pair<rocksdb::SequenceNumber, int64_t>>>
+    unflushed_kafka_checkpoints_;
+  // db name -> the largest seq # persisted by its memtable flushes, with
+  // --kafka_ingestion_disable_wal. Guarded by kafka_checkpoints_lock_.
+  std::unordered_map<std::string, rocksdb::SequenceNumber>
+    flushed_kafka_seq_nos_;
+  std::condition_variable kafka_checkpoint_cv_;
+  bool stop_kafka_checkpoint_thread_;
+  std::unique_ptr<std::thread> kafka_checkpoint_thread_;
 
   bool backupDBHelper(const std::string& db_name,
                       const std::string& backup_dir,
@@ -196,11 +483,22 @@ class AdminHandler : virtual public AdminSvIf {
                        const uint32_t restore_rate_limit,
                        AdminException* e);
 
+  // Move the bottommost level sst files of the dbs of
+  // --tiered_storage_segments not modified for --tiered_storage_file_age_sec
+  // to S3, see rocksdb::TieredS3Env
+  void offloadColdFiles();
+
   std::shared_ptr<common::S3Util> createLocalS3Util(const uint32_t read_ratelimit_mb = 50,
                                                     const std::string& bucket = "");
 
   std::unique_ptr<std::thread> db_deletion_thread_;
   std::atomic<bool> stop_db_deletion_thread_;
+  // Moves the cold sst files of --tiered_storage_segments to S3
+  std::unique_ptr<std::thread> tiered_storage_thread_;
+  std::atomic<bool> stop_tiered_storage_thread_;
+  // Runs admin calls submitted as jobs. Declared last so that it is destroyed
+  // first, while running jobs may still use the rest of us.
+  std::unique_ptr<AdminJobManager> job_manager_;
 };
 
 }  // namespace admin
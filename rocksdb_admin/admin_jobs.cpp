@@ -0,0 +1,205 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/admin_jobs.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include "common/identical_name_thread_factory.h"
+#include "common/timeutil.h"
+#include "folly/Conv.h"
+
+DEFINE_int32(admin_job_retention_sec, 3600,
+             "How long finished admin jobs are kept for getJobStatus(), and "
+             "succeeded ones are returned for the same submission again");
+
+namespace admin {
+
+AdminJob::AdminJob(const std::string& job_id,
+                   const std::string& db_name,
+                   const std::string& operation)
+    : job_id_(job_id)
+    , db_name_(db_name)
+    , operation_(operation)
+    , submit_time_ms_(common::timeutil::GetCurrentTimestamp())
+    , bytes_transferred_(0)
+    , total_bytes_(-1)
+    , mutex_()
+    , state_(AdminJobState::PENDING)
+    , start_time_ms_(0)
+    , end_time_ms_(0)
+    , error_message_() {
+}
+
+void AdminJob::setTotalBytes(int64_t total_bytes) {
+  total_bytes_ = total_bytes;
+}
+
+void AdminJob::addBytes(int64_t bytes) {
+  bytes_transferred_ += bytes;
+}
+
+void AdminJob::start() {
+  std::lock_guard<std::mutex> g(mutex_);
+  state_ = AdminJobState::RUNNING;
+  start_time_ms_ = common::timeutil::GetCurrentTimestamp();
+}
+
+void AdminJob::succeed() {
+  std::lock_guard<std::mutex> g(mutex_);
+  state_ = AdminJobState::SUCCEEDED;
+  end_time_ms_ = common::timeutil::GetCurrentTimestamp();
+  LOG(INFO) << "Job " << job_id_ << " succeeded";
+}
+
+void AdminJob::fail(const std::string& error_message) {
+  std::lock_guard<std::mutex> g(mutex_);
+  state_ = AdminJobState::FAILED;
+  end_time_ms_ = common::timeutil::GetCurrentTimestamp();
+  error_message_ = error_message;
+  LOG(ERROR) << "Job " << job_id_ << " failed: " << error_message;
+}
+
+AdminJobStatus AdminJob::getStatus() const {
+  AdminJobStatus status;
+  status.job_id = job_id_;
+  status.db_name = db_name_;
+  status.operation = operation_;
+  status.bytes_transferred = bytes_transferred_.load();
+  status.total_bytes = total_bytes_.load();
+  status.submit_time_ms = submit_time_ms_;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    status.state = state_;
+    status.start_time_ms = start_time_ms_;
+    status.end_time_ms = end_time_ms_;
+    if (state_ == AdminJobState::FAILED) {
+      status.error_message = error_message_;
+      status.__isset.error_message = true;
+    }
+  }
+
+  if (status.start_time_ms > 0) {
+    const auto end_ms = status.end_time_ms > 0 ?
+      status.end_time_ms : common::timeutil::GetCurrentTimestamp();
+    const auto elapsed_ms = end_ms - status.start_time_ms;
+    if (elapsed_ms > 0) {
+      status.bytes_per_sec = status.bytes_transferred * 1000 / elapsed_ms;
+    }
+  }
+
+  if (status.state == AdminJobState::SUCCEEDED) {
+    status.eta_secs = 0;
+  } else if (status.state == AdminJobState::RUNNING &&
+             status.total_bytes >= 0 && status.bytes_per_sec > 0) {
+    status.eta_secs = std::max<int64_t>(
+      status.total_bytes - status.bytes_transferred, 0) / status.bytes_per_sec;
+  }
+
+  return status;
+}
+
+AdminJobManager::AdminJobManager(int n_threads)
+    : jobs_()
+    , key_to_job_id_()
+    , next_job_seq_(0)
+    , mutex_()
+    , executor_(std::max(n_threads, 1),
+                std::make_shared<common::IdenticalNameThreadFactory>(
+                  "admin-job")) {
+}
+
+AdminJobManager::~AdminJobManager() {
+  executor_.stop();
+}
+
+std::string AdminJobManager::submit(
+    const std::string& key,
+    const std::string& db_name,
+    const std::string& operation,
+    std::function<void(std::shared_ptr<AdminJob>)> op) {
+  const auto now_ms = common::timeutil::GetCurrentTimestamp();
+  std::shared_ptr<AdminJob> job;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    removeExpiredJobsLocked(now_ms);
+
+    auto itor = key_to_job_id_.find(key);
+    if (itor != key_to_job_id_.end()) {
+      auto job_itor = jobs_.find(itor->second);
+      if (job_itor != jobs_.end() &&
+          job_itor->second.second->getStatus().state !=
+            AdminJobState::FAILED) {
+        LOG(INFO) << "Reusing job " << itor->second << " for " << key;
+        return itor->second;
+      }
+    }
+
+    auto job_id = folly::to<std::string>(db_name, "-", operation, "-", now_ms,
+                                         "-", next_job_seq_++);
+    job = std::make_shared<AdminJob>(job_id, db_name, operation);
+    jobs_.emplace(job_id, std::make_pair(key, job));
+    key_to_job_id_[key] = job_id;
+  }
+
+  LOG(INFO) << "Submitting job " << job->getStatus().job_id << " for " << key;
+  executor_.add([job, op = std::move(op)] {
+      job->start();
+      op(job);
+    });
+
+  return job->getStatus().job_id;
+}
+
+bool AdminJobManager::getStatus(const std::string& job_id,
+                                AdminJobStatus* status) const {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto itor = jobs_.find(job_id);
+  if (itor == jobs_.end()) {
+    return false;
+  }
+
+  *status = itor->second.second->getStatus();
+  return true;
+}
+
+void AdminJobManager::removeExpiredJobsLocked(int64_t now_ms) {
+  const int64_t retention_ms =
+    static_cast<int64_t>(FLAGS_admin_job_retention_sec) * 1000;
+  auto itor = jobs_.begin();
+  while (itor != jobs_.end()) {
+    const auto end_time_ms = itor->second.second->getStatus().end_time_ms;
+    if (end_time_ms == 0 || now_ms - end_time_ms < retention_ms) {
+      ++itor;
+      continue;
+    }
+
+    auto key_itor = key_to_job_id_.find(itor->second.first);
+    if (key_itor != key_to_job_id_.end() && key_itor->second == itor->first) {
+      key_to_job_id_.erase(key_itor);
+    }
+    itor = jobs_.erase(itor);
+  }
+}
+
+}  // namespace admin
@@ -0,0 +1,187 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#ifdef PINTEREST_INTERNAL
+// NEVER SET THIS UNLESS PINTEREST INTERNAL USAGE.
+#include "schemas/gen-cpp2/rocksdb_admin_types.h"
+#else
+#include "rocksdb_admin/gen-cpp2/rocksdb_admin_types.h"
+#endif
+#if __GNUC__ >= 8
+#include "folly/executors/CPUThreadPoolExecutor.h"
+#else
+#include "wangle/concurrent/CPUThreadPoolExecutor.h"
+#endif
+
+namespace admin {
+
+/*
+ * A long running admin operation run in the background, whose progress can be
+ * polled with getJobStatus(). All public functions are thread safe.
+ */
+class AdminJob {
+ public:
+  AdminJob(const std::string& job_id,
+           const std::string& db_name,
+           const std::string& operation);
+
+  // Progress reported by the operation. Bytes are the ones transferred to or
+  // from S3 for the operations doing so.
+  void setTotalBytes(int64_t total_bytes);
+  void addBytes(int64_t bytes);
+
+  void start();
+  void succeed();
+  void fail(const std::string& error_message);
+
+  AdminJobStatus getStatus() const;
+
+ private:
+  const std::string job_id_;
+  const std::string db_name_;
+  const std::string operation_;
+  const int64_t submit_time_ms_;
+  std::atomic<int64_t> bytes_transferred_;
+  std::atomic<int64_t> total_bytes_;
+  // protects the fields below
+  mutable std::mutex mutex_;
+  AdminJobState state_;
+  int64_t start_time_ms_;
+  int64_t end_time_ms_;
+  std::string error_message_;
+};
+
+/*
+ * Runs AdminJobs on a bounded number of threads. Jobs beyond that are queued
+ * instead of rejected.
+ */
+class AdminJobManager {
+ public:
+  explicit AdminJobManager(int n_threads);
+
+  // Waits for running jobs to finish, and drops pending ones
+  ~AdminJobManager();
+
+  // Run op as a job, and return its id. If a job with the same key is pending,
+  // running or has succeeded in the last --admin_job_retention_sec, return its
+  // id instead, so that retrying a call doesn't start the same work twice.
+  // op reports its outcome through the job passed to it.
+  std::string submit(const std::string& key,
+                     const std::string& db_name,
+                     const std::string& operation,
+                     std::function<void(std::shared_ptr<AdminJob>)> op);
+
+  // Return false if job_id is not known, e.g., it has expired
+  bool getStatus(const std::string& job_id, AdminJobStatus* status) const;
+
+ private:
+  void removeExpiredJobsLocked(int64_t now_ms);
+
+  // job id -> (key, job)
+  std::unordered_map<std::string,
+    std::pair<std::string, std::shared_ptr<AdminJob>>> jobs_;
+  // key -> the latest job id submitted with it
+  std::unordered_map<std::string, std::string> key_to_job_id_;
+  uint64_t next_job_seq_;
+  mutable std::mutex mutex_;
+#if __GNUC__ >= 8
+  folly::CPUThreadPoolExecutor executor_;
+#else
+  wangle::CPUThreadPoolExecutor executor_;
+#endif
+};
+
+/*
+ * Stands in for the thrift callback of an admin call run as a job, so that
+ * the same handler code serves the call either way.
+ */
+template <typename Response>
+class JobCallback {
+ public:
+  explicit JobCallback(std::shared_ptr<AdminJob> job)
+    : job_(std::move(job))
+    , done_(false) {
+  }
+
+  ~JobCallback() {
+    if (!done_) {
+      job_->fail("Finished without a result");
+    }
+  }
+
+  void result(const Response&) {
+    done_ = true;
+    job_->succeed();
+  }
+
+  void exception(const AdminException& e) {
+    done_ = true;
+    job_->fail(e.message);
+  }
+
+  // As with thrift callbacks, these are called on released callbacks, which
+  // delete themselves.
+  void resultInThread(const Response& response) {
+    result(response);
+    delete this;
+  }
+
+  void exceptionInThread(const AdminException& e) {
+    exception(e);
+    delete this;
+  }
+
+  AdminJob* job() const {
+    return job_.get();
+  }
+
+ private:
+  const std::shared_ptr<AdminJob> job_;
+  bool done_;
+};
+
+// Report progress of the job behind callback, if any
+template <typename CallbackType>
+void SetJobTotalBytes(CallbackType*, int64_t) {
+}
+
+template <typename Response>
+void SetJobTotalBytes(JobCallback<Response>* callback, int64_t total_bytes) {
+  callback->job()->setTotalBytes(total_bytes);
+}
+
+template <typename CallbackType>
+void AddJobBytes(CallbackType*, int64_t) {
+}
+
+template <typename Response>
+void AddJobBytes(JobCallback<Response>* callback, int64_t bytes) {
+  callback->job()->addBytes(bytes);
+}
+
+}  // namespace admin
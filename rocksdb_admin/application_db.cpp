@@ -15,14 +15,60 @@
 
 #include "rocksdb_admin/application_db.h"
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "common/stats/stats.h"
 #include "common/timer.h"
+#include "common/tracing.h"
+#include "folly/Conv.h"
+#include "rocksdb/convenience.h"
+#include "rocksdb/version.h"
+#include "rocksdb_admin/column_family_db.h"
+#include "rocksdb_admin/utils.h"
 
 DEFINE_bool(disable_rocksplicator_db_stats, false,
             "Disable the stats for rocksplicator db");
 
+DEFINE_int32(application_db_scan_readahead_bytes, 2 * 1024 * 1024,
+             "The readahead size of the iterators of ApplicationDB::Scan(), "
+             "unless the read options set one");
+
+DEFINE_int32(application_db_hot_key_sample_rate, 0,
+             "Record 1 in this many keys read by Get() or written by Write() "
+             "for detecting hot keys of each ApplicationDB opened after it is "
+             "set. 0 disables hot key detection");
+
+DEFINE_int64(application_db_read_cache_bytes, 0,
+             "The size of the cache of values read by Get() in front of each "
+             "ApplicationDB opened after it is set. 0 disables the cache");
+
+DEFINE_int32(application_db_read_cache_shards, 16,
+             "The number of shards of each ApplicationDB read cache");
+
+DEFINE_bool(application_db_multi_get_async_io, false,
+            "Overlap the reads of the blocks missing from the block cache of "
+            "each batched ApplicationDB::MultiGet(), which takes RocksDB 7.0+ "
+            "built with io_uring");
+
+DEFINE_int32(application_db_hot_key_percents, 10,
+             "A key is hot if it takes more than this percent of the sampled "
+             "load of its db. It may not be smaller than 10");
+
+DEFINE_int64(application_db_hibernated_write_buffer_bytes, 1 << 20,
+             "The write buffer size of hibernated ApplicationDBs, see "
+             "--application_db_hibernate_idle_min. 0 keeps it as is");
+
+DEFINE_int32(application_db_hibernated_max_open_files, 64,
+             "The max open files of hibernated ApplicationDBs, see "
+             "--application_db_hibernate_idle_min. 0 keeps it as is, and so "
+             "do dbs opened with max_open_files = -1");
+
 namespace {
 
 const std::string kRocksdbNewIterator = "rocksdb_new_iterator";
@@ -34,8 +80,64 @@ const std::string kRocksdbMultiGetMs = "rocksdb_multi_get_ms";
 const std::string kRocksdbWrite = "rocksdb_write";
 const std::string kRocksdbWriteBytes = "rocksdb_write_bytes";
 const std::string kRocksdbWriteMs = "rocksdb_write_ms";
+const std::string kRocksdbScan = "rocksdb_scan";
+const std::string kRocksdbScanKeys = "rocksdb_scan_keys";
+const std::string kRocksdbScanMs = "rocksdb_scan_ms";
 const std::string kRocksdbCompaction = "rocksdb_compact_range";
 const std::string kRocksdbCompactionMs = "rocksdb_compact_range_ms";
+const std::string kRocksdbHotKeySamples = "rocksdb_hot_key_samples";
+const std::string kRocksdbWarmUpMs = "rocksdb_warm_up_ms";
+const std::string kRocksdbWarmUpFiles = "rocksdb_warm_up_files";
+const std::string kRocksdbWarmUpBytes = "rocksdb_warm_up_bytes";
+const std::string kRocksdbHibernations = "rocksdb_hibernations";
+const std::string kRocksdbWakeUps = "rocksdb_wake_ups";
+
+// How often WarmUp() checks its time budget and rate limit when scanning
+const uint32_t kWarmUpCheckIntervalKeys = 1024;
+
+std::shared_ptr<admin::ApplicationDB::HotKeyHandler> gHotKeyHandler;
+
+std::unique_ptr<admin::PerfContextSampler> NewPerfContextSampler(
+    const admin::PerfContextSampler::Op op,
+    const std::string& db_name) {
+  if (FLAGS_application_db_perf_context_sample_rate <= 0) {
+    return nullptr;
+  }
+
+  return std::make_unique<admin::PerfContextSampler>(
+    op, admin::DbNameToSegment(db_name),
+    FLAGS_application_db_perf_context_sample_rate);
+}
+
+// Collect the keys updated by a write batch
+class WriteBatchKeys : public rocksdb::WriteBatch::Handler {
+ public:
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+                        const rocksdb::Slice& value) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+                           const rocksdb::Slice& key) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+                                 const rocksdb::Slice& key) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice& key,
+                          const rocksdb::Slice& value) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  std::vector<rocksdb::Slice> keys;
+};
 
 }  // anonymous namespace
 
@@ -50,15 +152,94 @@ ApplicationDB::ApplicationDB(
     , db_(std::move(db))
     , role_(role)
     , upstream_addr_(std::move(upstream_addr))
-    , replicated_db_(nullptr) {
-  if (!IsSlave() || upstream_addr_) {
-    auto ret = replicator::RocksDBReplicator::instance()->addDB(db_name_,
-      db_, role_, upstream_addr_ ? *upstream_addr_ : folly::SocketAddress(),
-      &replicated_db_);
-    if (ret != replicator::ReturnCode::OK) {
-      throw ret;
+    , replicated_db_(nullptr)
+    , hot_key_sample_rate_(
+        std::max(FLAGS_application_db_hot_key_sample_rate, 0))
+    , hot_key_detector_(hot_key_sample_rate_ > 0 ?
+        std::make_unique<common::HotKeyDetector<std::string>>() : nullptr)
+    , read_cache_(FLAGS_application_db_read_cache_bytes > 0 ?
+        std::make_shared<ReadCache>(
+          FLAGS_application_db_read_cache_bytes,
+          std::max(FLAGS_application_db_read_cache_shards, 1)) : nullptr)
+    , get_perf_sampler_(NewPerfContextSampler(
+        PerfContextSampler::Op::GET, db_name))
+    , multi_get_perf_sampler_(NewPerfContextSampler(
+        PerfContextSampler::Op::MULTI_GET, db_name))
+    , write_perf_sampler_(NewPerfContextSampler(
+        PerfContextSampler::Op::WRITE, db_name))
+    , ttl_(std::dynamic_pointer_cast<TtlCompactionFilterFactory>(
+        db_->GetOptions().compaction_filter_factory))
+    , num_reads_(0)
+    , num_writes_(0)
+    , hibernated_(false)
+    , hibernation_lock_()
+    , hibernated_cf_options_()
+    , hibernated_db_options_()
+    , warmed_up_(false) {
+  auto ret = StartReplication();
+  if (ret != replicator::ReturnCode::OK) {
+    throw ret;
+  }
+}
+
+replicator::ReturnCode ApplicationDB::StartReplication() {
+  if (IsSlave() && upstream_addr_ == nullptr) {
+    return replicator::ReturnCode::OK;
+  }
+
+  auto ret = replicator::RocksDBReplicator::instance()->addDB(db_name_,
+    db_, role_.load(),
+    upstream_addr_ ? *upstream_addr_ : folly::SocketAddress(),
+    &replicated_db_);
+  if (ret != replicator::ReturnCode::OK) {
+    replicated_db_ = nullptr;
+    return ret;
+  }
+
+  // Values cached before the handler is set were read from db_ before the
+  // updates applied until then, so they may be stale. This only matters when
+  // switching role, and the cache is cleared then.
+  if (read_cache_) {
+    replicated_db_->setAppliedUpdatesHandler(
+      [read_cache = read_cache_] (const rocksdb::WriteBatch& updates) {
+        read_cache->Erase(updates);
+      });
+  }
+
+  // Or the updates would go to the shrunk write buffers of a hibernated db.
+  // removeDB() waits for the apply in progress, so this outlives it.
+  replicated_db_->setApplyingUpdatesHandler([this] {
+      wakeUpIfHibernated();
+    });
+
+  return replicator::ReturnCode::OK;
+}
+
+bool ApplicationDB::ChangeRole(
+    replicator::DBRole role,
+    std::unique_ptr<folly::SocketAddress> upstream_addr,
+    std::string* error_message) {
+  folly::SharedMutex::WriteHolder wh(replication_lock_);
+  if (replicated_db_) {
+    // Only waits for the replicator to let go of the db, e.g. for the pull
+    // in flight of a SLAVE
+    replicator::RocksDBReplicator::instance()->removeDB(db_name_);
+    replicated_db_ = nullptr;
+  }
+
+  role_.store(role);
+  upstream_addr_ = std::move(upstream_addr);
+  auto ret = StartReplication();
+  ClearReadCache();
+  if (ret != replicator::ReturnCode::OK) {
+    if (error_message) {
+      *error_message = "Failed to replicate " + db_name_ + " in its new role: "
+        + folly::to<std::string>(static_cast<int>(ret));
     }
+    return false;
   }
+
+  return true;
 }
 
 ApplicationDB::~ApplicationDB() {
@@ -69,61 +250,337 @@ ApplicationDB::~ApplicationDB() {
 
 rocksdb::Iterator* ApplicationDB::NewIterator(
     const rocksdb::ReadOptions& options) {
+  wakeUpIfHibernated();
   common::Stats::get()->Incr(kRocksdbNewIterator);
   common::Timer timer(kRocksdbNewIteratorMs);
   return db_->NewIterator(options);
 }
 
+rocksdb::Iterator* ApplicationDB::NewIterator(
+    const rocksdb::ReadOptions& options,
+    rocksdb::ColumnFamilyHandle* column_family) {
+  wakeUpIfHibernated();
+  common::Stats::get()->Incr(kRocksdbNewIterator);
+  common::Timer timer(kRocksdbNewIteratorMs);
+  return db_->NewIterator(options, column_family);
+}
+
 rocksdb::Status ApplicationDB::Get(
     const rocksdb::ReadOptions& options,
     const rocksdb::Slice& slice,
     std::string* value) {
+  common::TraceSpan span("application_db_get");
+  num_reads_.fetch_add(1, std::memory_order_relaxed);
+  wakeUpIfHibernated();
+  if (hot_key_detector_ && shouldSampleHotKeys()) {
+    recordHotKey(slice, false);
+  }
+
+  const bool use_cache = read_cache_ && options.snapshot == nullptr;
+  uint64_t epoch = 0;
+  if (use_cache) {
+    if (read_cache_->Lookup(slice, value)) {
+      return isExpired(*value) ? rocksdb::Status::NotFound()
+                               : rocksdb::Status::OK();
+    }
+    epoch = read_cache_->GetEpoch(slice);
+  }
+
+  PerfContextSampler::Sample perf_sample(get_perf_sampler_.get());
   // TODO(bol) apply it to all other stats or sample the stats.
   // We need to call Get() nearly 10M times per second, which makes it too
   // expensive to tract stats for every call.
+  rocksdb::Status status;
   if (FLAGS_disable_rocksplicator_db_stats) {
-    return db_->Get(options, slice, value);
+    status = db_->Get(options, slice, value);
   } else {
     common::Stats::get()->Incr(kRocksdbGet);
     common::Timer timer(kRocksdbGetMs);
-    return db_->Get(options, slice, value);
+    status = db_->Get(options, slice, value);
   }
+
+  if (status.ok() && isExpired(*value)) {
+    return rocksdb::Status::NotFound();
+  }
+  if (use_cache && status.ok()) {
+    read_cache_->Insert(slice, *value, epoch);
+  }
+  return status;
+}
+
+rocksdb::Status ApplicationDB::Get(
+    const rocksdb::ReadOptions& options,
+    rocksdb::ColumnFamilyHandle* column_family,
+    const rocksdb::Slice& key,
+    std::string* value) {
+  // The read cache is keyed by the keys of the default column family only
+  if (column_family->GetID() == 0) {
+    return Get(options, key, value);
+  }
+
+  common::TraceSpan span("application_db_get");
+  num_reads_.fetch_add(1, std::memory_order_relaxed);
+  wakeUpIfHibernated();
+  if (hot_key_detector_ && shouldSampleHotKeys()) {
+    recordHotKey(key, false);
+  }
+
+  PerfContextSampler::Sample perf_sample(get_perf_sampler_.get());
+  if (FLAGS_disable_rocksplicator_db_stats) {
+    return db_->Get(options, column_family, key, value);
+  }
+
+  common::Stats::get()->Incr(kRocksdbGet);
+  common::Timer timer(kRocksdbGetMs);
+  return db_->Get(options, column_family, key, value);
 }
 
 rocksdb::Status ApplicationDB::Get(const rocksdb::ReadOptions& options,
                                    const rocksdb::Slice& key,
                                    rocksdb::PinnableSlice* value) {
+  common::TraceSpan span("application_db_get");
+  num_reads_.fetch_add(1, std::memory_order_relaxed);
+  wakeUpIfHibernated();
+  if (hot_key_detector_ && shouldSampleHotKeys()) {
+    recordHotKey(key, false);
+  }
+
+  const bool use_cache = read_cache_ && options.snapshot == nullptr;
+  uint64_t epoch = 0;
+  if (use_cache) {
+    // release what value may have pinned before filling it
+    value->Reset();
+    if (read_cache_->Lookup(key, value->GetSelf())) {
+      value->PinSelf();
+      return isExpired(*value) ? rocksdb::Status::NotFound()
+                               : rocksdb::Status::OK();
+    }
+    epoch = read_cache_->GetEpoch(key);
+  }
+
+  PerfContextSampler::Sample perf_sample(get_perf_sampler_.get());
+  rocksdb::Status status;
   if (FLAGS_disable_rocksplicator_db_stats) {
-    return db_->Get(options, db_->DefaultColumnFamily(), key, value);
+    status = db_->Get(options, db_->DefaultColumnFamily(), key, value);
   } else {
     common::Stats::get()->Incr(kRocksdbGet);
     common::Timer timer(kRocksdbGetMs);
-    return db_->Get(options, db_->DefaultColumnFamily(), key, value);
+    status = db_->Get(options, db_->DefaultColumnFamily(), key, value);
+  }
+
+  if (status.ok() && isExpired(*value)) {
+    return rocksdb::Status::NotFound();
   }
+  if (use_cache && status.ok()) {
+    read_cache_->Insert(key, *value, epoch);
+  }
+  return status;
 }
 
 std::vector<rocksdb::Status> ApplicationDB::MultiGet(
     const rocksdb::ReadOptions& options,
     const std::vector<rocksdb::Slice>& slice,
     std::vector<std::string>* value) {
+  common::TraceSpan span("application_db_multi_get");
+  num_reads_.fetch_add(slice.size(), std::memory_order_relaxed);
+  wakeUpIfHibernated();
+  common::Stats::get()->Incr(kRocksdbMultiGet);
+  common::Timer timer(kRocksdbMultiGetMs);
+  std::vector<rocksdb::Status> statuses;
+  {
+    PerfContextSampler::Sample perf_sample(multi_get_perf_sampler_.get());
+    statuses = db_->MultiGet(options, slice, value);
+  }
+  if (ttl_) {
+    for (size_t i = 0; i < statuses.size(); ++i) {
+      if (statuses[i].ok() && isExpired((*value)[i])) {
+        statuses[i] = rocksdb::Status::NotFound();
+      }
+    }
+  }
+  return statuses;
+}
+
+void ApplicationDB::MultiGet(const rocksdb::ReadOptions& options,
+                             const size_t num_keys,
+                             const rocksdb::Slice* keys,
+                             rocksdb::PinnableSlice* values,
+                             rocksdb::Status* statuses,
+                             const bool sorted_input) {
+  common::TraceSpan span("application_db_multi_get");
+  num_reads_.fetch_add(num_keys, std::memory_order_relaxed);
+  wakeUpIfHibernated();
   common::Stats::get()->Incr(kRocksdbMultiGet);
   common::Timer timer(kRocksdbMultiGetMs);
-  return db_->MultiGet(options, slice, value);
+  PerfContextSampler::Sample perf_sample(multi_get_perf_sampler_.get());
+#if ROCKSDB_MAJOR > 6 || (ROCKSDB_MAJOR == 6 && ROCKSDB_MINOR >= 4)
+  rocksdb::ReadOptions read_options(options);
+#if ROCKSDB_MAJOR >= 7
+  read_options.async_io =
+    read_options.async_io || FLAGS_application_db_multi_get_async_io;
+#endif
+  db_->MultiGet(read_options, db_->DefaultColumnFamily(), num_keys, keys,
+                values, statuses, sorted_input);
+#else
+  for (size_t i = 0; i < num_keys; ++i) {
+    statuses[i] = db_->Get(options, db_->DefaultColumnFamily(), keys[i],
+                           &values[i]);
+  }
+#endif
+  if (ttl_) {
+    for (size_t i = 0; i < num_keys; ++i) {
+      if (statuses[i].ok() && isExpired(values[i])) {
+        statuses[i] = rocksdb::Status::NotFound();
+      }
+    }
+  }
+}
+
+void ScanResults::Reset() {
+  entries.clear();
+  next_key.clear();
+  // the iterator goes before the bound and the pinned data it refers to
+  iter_.reset();
+  upper_bound_key_.clear();
+  upper_bound_ = rocksdb::Slice();
+  copies_.clear();
+}
+
+rocksdb::Status ApplicationDB::Scan(const rocksdb::ReadOptions& options,
+                                    const rocksdb::Slice& start,
+                                    const rocksdb::Slice& end,
+                                    const uint32_t limit,
+                                    ScanResults* results) {
+  common::TraceSpan span("application_db_scan");
+  wakeUpIfHibernated();
+  common::Stats::get()->Incr(kRocksdbScan);
+  common::Timer timer(kRocksdbScanMs);
+  // Copied first, as they may point into results, e.g. when paging with
+  // results->next_key
+  const std::string start_key = start.ToString();
+  const std::string end_key = end.ToString();
+  results->Reset();
+
+  auto scan_options = options;
+  // Keep the blocks read in memory, so that the keys and values returned
+  // point into them instead of being copied
+  scan_options.pin_data = true;
+  if (scan_options.readahead_size == 0 &&
+      FLAGS_application_db_scan_readahead_bytes > 0) {
+    scan_options.readahead_size = FLAGS_application_db_scan_readahead_bytes;
+  }
+  if (!end_key.empty()) {
+    results->upper_bound_key_ = end_key;
+    results->upper_bound_ = rocksdb::Slice(results->upper_bound_key_);
+    scan_options.iterate_upper_bound = &results->upper_bound_;
+  }
+
+  results->iter_.reset(db_->NewIterator(scan_options));
+  auto iter = results->iter_.get();
+  std::string pinned;
+  for (iter->Seek(start_key); iter->Valid(); iter->Next()) {
+    if (results->entries.size() >= limit) {
+      results->next_key = iter->key().ToString();
+      break;
+    }
+
+    if (isExpired(iter->value())) {
+      continue;
+    }
+
+    auto key = iter->key();
+    if (!iter->GetProperty("rocksdb.iterator.is-key-pinned", &pinned).ok() ||
+        pinned != "1") {
+      results->copies_.emplace_back(key.data(), key.size());
+      key = rocksdb::Slice(results->copies_.back());
+    }
+    auto value = iter->value();
+    if (!iter->GetProperty("rocksdb.iterator.is-value-pinned", &pinned).ok() ||
+        pinned != "1") {
+      results->copies_.emplace_back(value.data(), value.size());
+      value = rocksdb::Slice(results->copies_.back());
+    }
+    results->entries.emplace_back(key, value);
+  }
+
+  common::Stats::get()->Incr(kRocksdbScanKeys, results->entries.size());
+  num_reads_.fetch_add(results->entries.size(), std::memory_order_relaxed);
+  return iter->status();
+}
+
+folly::Future<std::unique_ptr<ScanResults>> ApplicationDB::ScanAsync(
+    const rocksdb::ReadOptions& options,
+    std::string start,
+    std::string end,
+    const uint32_t limit,
+    folly::Executor* executor) {
+  return folly::via(executor,
+    [this, options, start = std::move(start), end = std::move(end), limit] {
+      auto results = std::make_unique<ScanResults>();
+      auto status = Scan(options, start, end, limit, results.get());
+      if (!status.ok()) {
+        throw std::runtime_error(status.ToString());
+      }
+      return results;
+    });
 }
 
 rocksdb::Status ApplicationDB::Write(const rocksdb::WriteOptions& options,
     rocksdb::WriteBatch* write_batch) {
+  if (hot_key_detector_ && shouldSampleHotKeys()) {
+    recordHotKeys(write_batch);
+  }
+
+  common::TraceSpan span("application_db_write");
+  num_writes_.fetch_add(1, std::memory_order_relaxed);
+  wakeUpIfHibernated();
   common::Stats::get()->Incr(kRocksdbWrite);
   common::Stats::get()->Incr(kRocksdbWriteBytes, write_batch->GetDataSize());
   common::Timer timer(kRocksdbWriteMs);
+  rocksdb::Status status;
+  folly::SharedMutex::ReadHolder rh(replication_lock_);
+  PerfContextSampler::Sample perf_sample(write_perf_sampler_.get());
   if (replicated_db_) {
-    return replicated_db_->Write(options, write_batch);
+    status = replicated_db_->Write(options, write_batch);
   } else {
     // ApplicationDBManager can be use to manage rocksdb instance lifecycle
     // without replication. In this case, ApplicationDB has the replicator::DBRole
     // as SLAVE and no upstream_addr. Thus the replicated_db_ is nullptr, and
     // we'll write to the local db_
-    return db_->Write(options, write_batch);
+    status = db_->Write(options, write_batch);
+  }
+
+  // Even failed writes may have been committed locally, e.g. when timing out
+  // waiting for Slaves
+  InvalidateReadCache(*write_batch);
+  return status;
+}
+
+folly::Future<rocksdb::Status> ApplicationDB::WriteAsync(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* write_batch) {
+  if (hot_key_detector_ && shouldSampleHotKeys()) {
+    recordHotKeys(write_batch);
+  }
+
+  common::TraceSpan span("application_db_write");
+  num_writes_.fetch_add(1, std::memory_order_relaxed);
+  wakeUpIfHibernated();
+  common::Stats::get()->Incr(kRocksdbWrite);
+  common::Stats::get()->Incr(kRocksdbWriteBytes, write_batch->GetDataSize());
+  folly::SharedMutex::ReadHolder rh(replication_lock_);
+  PerfContextSampler::Sample perf_sample(write_perf_sampler_.get());
+  if (replicated_db_) {
+    // The updates are committed locally by the time WriteAsync() returns
+    auto future = replicated_db_->WriteAsync(options, write_batch)
+      .then([] (rocksdb::SequenceNumber) { return rocksdb::Status::OK(); });
+    InvalidateReadCache(*write_batch);
+    return future;
+  } else {
+    common::Timer timer(kRocksdbWriteMs);
+    auto status = db_->Write(options, write_batch);
+    InvalidateReadCache(*write_batch);
+    return folly::makeFuture(std::move(status));
   }
 }
 
@@ -135,6 +592,216 @@ rocksdb::Status ApplicationDB::CompactRange(
   return db_->CompactRange(options, begin, end);
 }
 
+rocksdb::Status ApplicationDB::DeleteAllKeys(
+    rocksdb::ColumnFamilyHandle* column_family) {
+  if (column_family == nullptr) {
+    column_family = db_->DefaultColumnFamily();
+  }
+
+  std::string begin;
+  std::string end;
+  {
+    std::unique_ptr<rocksdb::Iterator> iter(
+      db_->NewIterator(rocksdb::ReadOptions(), column_family));
+    iter->SeekToFirst();
+    if (!iter->Valid()) {
+      return iter->status();
+    }
+    begin = iter->key().ToString();
+    iter->SeekToLast();
+    if (!iter->Valid()) {
+      return iter->status();
+    }
+    // The end of a range deletion is exclusive
+    end = iter->key().ToString();
+    end.push_back('\0');
+  }
+
+  rocksdb::WriteBatch write_batch;
+  write_batch.DeleteRange(column_family, begin, end);
+  auto status = db_->Write(rocksdb::WriteOptions(), &write_batch);
+  ClearReadCache();
+  if (!status.ok()) {
+    return status;
+  }
+
+  status = db_->Flush(rocksdb::FlushOptions(), column_family);
+  if (!status.ok()) {
+    return status;
+  }
+
+  const rocksdb::Slice begin_slice(begin);
+  const rocksdb::Slice end_slice(end);
+  status = rocksdb::DeleteFilesInRange(db_.get(), column_family,
+                                       &begin_slice, &end_slice);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // Drops the L0 files DeleteFilesInRange() leaves, and the tombstone
+  rocksdb::CompactRangeOptions options;
+  options.bottommost_level_compaction =
+    rocksdb::BottommostLevelCompaction::kForce;
+  common::Stats::get()->Incr(kRocksdbCompaction);
+  common::Timer timer(kRocksdbCompactionMs);
+  return db_->CompactRange(options, column_family, nullptr, nullptr);
+}
+
+void ApplicationDB::WarmUp(std::chrono::milliseconds budget,
+                           uint64_t scan_bytes,
+                           uint64_t max_bytes_per_sec) {
+  common::Timer timer(kRocksdbWarmUpMs);
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline = start + budget;
+
+  std::vector<rocksdb::LiveFileMetaData> files;
+  db_->GetLiveFilesMetaData(&files);
+  // Upper levels first, they hold the most recently written keys
+  std::stable_sort(files.begin(), files.end(),
+                   [] (const rocksdb::LiveFileMetaData& a,
+                       const rocksdb::LiveFileMetaData& b) {
+                     return a.level < b.level;
+                   });
+
+  rocksdb::ReadOptions options;
+  options.fill_cache = true;
+  uint32_t n_files = 0;
+  {
+    // Seeking to the first key of a file opens it, which reads its index and
+    // filter blocks, into the block cache if the table options put them there
+    std::unique_ptr<rocksdb::Iterator> iter(db_->NewIterator(options));
+    for (const auto& file : files) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+      iter->Seek(file.smallestkey);
+      ++n_files;
+    }
+  }
+
+  // Then data blocks from the first key, at most max_bytes_per_sec
+  uint64_t read_bytes = 0;
+  if (scan_bytes > 0 && std::chrono::steady_clock::now() < deadline) {
+    options.readahead_size =
+      static_cast<size_t>(std::max(FLAGS_application_db_scan_readahead_bytes,
+                                   0));
+    std::unique_ptr<rocksdb::Iterator> iter(db_->NewIterator(options));
+    const auto scan_start = std::chrono::steady_clock::now();
+    uint32_t n_keys = 0;
+    for (iter->SeekToFirst(); iter->Valid() && read_bytes < scan_bytes;
+         iter->Next()) {
+      read_bytes += iter->key().size() + iter->value().size();
+      if (++n_keys % kWarmUpCheckIntervalKeys != 0) {
+        continue;
+      }
+
+      if (max_bytes_per_sec > 0) {
+        const auto due = scan_start + std::chrono::milliseconds(
+          read_bytes * 1000 / max_bytes_per_sec);
+        std::this_thread::sleep_until(std::min(due, deadline));
+      }
+      if (std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+    }
+  }
+
+  common::Stats::get()->AddMetric(kRocksdbWarmUpFiles, n_files);
+  common::Stats::get()->AddMetric(kRocksdbWarmUpBytes, read_bytes);
+  LOG(INFO) << "Warmed up " << db_name_ << " by opening " << n_files << " of "
+            << files.size() << " sst files and reading " << read_bytes
+            << " bytes in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::steady_clock::now() - start).count() << " ms";
+  warmed_up_ = true;
+}
+
+bool ApplicationDB::Hibernate() {
+  std::lock_guard<std::mutex> lock(hibernation_lock_);
+  if (hibernated_.load()) {
+    return false;
+  }
+
+  auto status = db_->Flush(rocksdb::FlushOptions());
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to flush " << db_name_ << " to hibernate: "
+               << status.ToString();
+  }
+
+  const auto options = db_->GetOptions();
+  std::unordered_map<std::string, std::string> cf_options;
+  const auto write_buffer_size = static_cast<size_t>(
+    std::max<int64_t>(FLAGS_application_db_hibernated_write_buffer_bytes, 0));
+  if (write_buffer_size > 0 && options.write_buffer_size > write_buffer_size) {
+    cf_options["write_buffer_size"] =
+      folly::to<std::string>(write_buffer_size);
+    hibernated_cf_options_["write_buffer_size"] =
+      folly::to<std::string>(options.write_buffer_size);
+  }
+
+  std::unordered_map<std::string, std::string> db_options;
+  // max_open_files can't be changed from -1, under which the table readers
+  // stay pinned. Their index and filter blocks are in the block cache only
+  // with cache_index_and_filter_blocks, see
+  // --application_db_hibernation_cache_index_and_filter_blocks.
+  const auto max_open_files = FLAGS_application_db_hibernated_max_open_files;
+  if (max_open_files > 0 && options.max_open_files > max_open_files) {
+    db_options["max_open_files"] = folly::to<std::string>(max_open_files);
+    hibernated_db_options_["max_open_files"] =
+      folly::to<std::string>(options.max_open_files);
+  }
+
+  if (!cf_options.empty()) {
+    status = db_->SetOptions(cf_options);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to shrink the write buffers of " << db_name_
+                 << " to hibernate: " << status.ToString();
+      hibernated_cf_options_.clear();
+    }
+  }
+  if (!db_options.empty()) {
+    status = db_->SetDBOptions(db_options);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to cap the open files of " << db_name_
+                 << " to hibernate: " << status.ToString();
+      hibernated_db_options_.clear();
+    }
+  }
+
+  ClearReadCache();
+  hibernated_.store(true);
+  common::Stats::get()->Incr(kRocksdbHibernations);
+  return true;
+}
+
+bool ApplicationDB::WakeUp() {
+  std::lock_guard<std::mutex> lock(hibernation_lock_);
+  if (!hibernated_.load()) {
+    return false;
+  }
+
+  hibernated_.store(false);
+  if (!hibernated_cf_options_.empty()) {
+    auto status = db_->SetOptions(hibernated_cf_options_);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to restore the write buffers of " << db_name_
+                 << ": " << status.ToString();
+    }
+    hibernated_cf_options_.clear();
+  }
+  if (!hibernated_db_options_.empty()) {
+    auto status = db_->SetDBOptions(hibernated_db_options_);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to restore the open files of " << db_name_
+                 << ": " << status.ToString();
+    }
+    hibernated_db_options_.clear();
+  }
+
+  common::Stats::get()->Incr(kRocksdbWakeUps);
+  return true;
+}
+
 uint32_t ApplicationDB::getHighestEmptyLevel() {
   rocksdb::ColumnFamilyMetaData cf_metadata;
   db_->GetColumnFamilyMetaData(&cf_metadata);
@@ -148,4 +815,79 @@ uint32_t ApplicationDB::getHighestEmptyLevel() {
   return *empty_levels.rbegin();
 }
 
+rocksdb::ColumnFamilyHandle* ApplicationDB::GetColumnFamily(
+    const std::string& name) const {
+  return ColumnFamilyDB::GetColumnFamily(db_.get(), name);
+}
+
+void ApplicationDB::InvalidateReadCache(
+    const rocksdb::WriteBatch& write_batch) {
+  if (read_cache_) {
+    read_cache_->Erase(write_batch);
+  }
+}
+
+void ApplicationDB::ClearReadCache() {
+  if (read_cache_) {
+    read_cache_->Clear();
+  }
+}
+
+void ApplicationDB::SetHotKeyHandler(HotKeyHandler handler) {
+  std::shared_ptr<HotKeyHandler> new_handler;
+  if (handler) {
+    new_handler = std::make_shared<HotKeyHandler>(std::move(handler));
+  }
+  std::atomic_store(&gHotKeyHandler, std::move(new_handler));
+}
+
+std::vector<std::string> ApplicationDB::GetHotKeys() const {
+  if (!hot_key_detector_) {
+    return {};
+  }
+
+  return hot_key_detector_->getKeysAbove(FLAGS_application_db_hot_key_percents);
+}
+
+bool ApplicationDB::shouldSampleHotKeys() const {
+  // Shared by all dbs, which is fine as we only need a rate
+  static thread_local uint32_t n_calls = 0;
+  return ++n_calls % hot_key_sample_rate_ == 0;
+}
+
+void ApplicationDB::recordHotKey(const rocksdb::Slice& key, bool is_write) {
+  common::Stats::get()->Incr(kRocksdbHotKeySamples);
+  auto key_str = key.ToString();
+  hot_key_detector_->record(key_str);
+
+  auto handler = std::atomic_load(&gHotKeyHandler);
+  if (handler && hot_key_detector_->isAbove(
+        key_str, FLAGS_application_db_hot_key_percents)) {
+    (*handler)(db_name_, key, is_write);
+  }
+}
+
+void ApplicationDB::recordHotKeys(rocksdb::WriteBatch* write_batch) {
+  WriteBatchKeys batch_keys;
+  // Keys before an unsupported record, e.g. a range deletion, are still
+  // collected, which is good enough for sampling
+  write_batch->Iterate(&batch_keys);
+  for (const auto& key : batch_keys.keys) {
+    recordHotKey(key, true);
+  }
+}
+
+bool ApplicationDB::IsWriteStalled() {
+  uint64_t value = 0;
+  if (db_->GetIntProperty(rocksdb::DB::Properties::kIsWriteStopped, &value) &&
+      value > 0) {
+    return true;
+  }
+
+  // The delayed write rate is only set while writes are slowed down
+  value = 0;
+  return db_->GetIntProperty(
+      rocksdb::DB::Properties::kActualDelayedWriteRate, &value) && value > 0;
+}
+
 }  // namespace admin
@@ -15,20 +15,72 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "common/hot_key_detector.h"
+#include "folly/Executor.h"
+#include "folly/SharedMutex.h"
 #include "folly/SocketAddress.h"
+#include "folly/futures/Future.h"
 #include "rocksdb/db.h"
 #include "rocksdb/options.h"
 #include "rocksdb/write_batch.h"
+#include "rocksdb_admin/perf_context_sampler.h"
+#include "rocksdb_admin/read_cache.h"
+#include "rocksdb_admin/ttl_compaction_filter.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
 
 namespace admin {
 
+// A page of key values returned by ApplicationDB::Scan(). Keys and values
+// point into the blocks pinned by the iterator of the scan where possible,
+// and into copies held here otherwise, so they are only valid as long as
+// this object. The data of the blocks stays in memory until then.
+class ScanResults {
+ public:
+  ScanResults() = default;
+
+  // no copy nor move, the iterator refers to upper_bound_
+  ScanResults(const ScanResults&) = delete;
+  ScanResults& operator=(const ScanResults&) = delete;
+
+  // The (key, value) pairs in order
+  std::vector<std::pair<rocksdb::Slice, rocksdb::Slice>> entries;
+
+  // The key to start the next page from, empty if the range is done
+  std::string next_key;
+
+ private:
+  void Reset();
+
+  std::unique_ptr<rocksdb::Iterator> iter_;
+  std::string upper_bound_key_;
+  rocksdb::Slice upper_bound_;
+  // copies of the keys and values not pinned by the iterator
+  std::deque<std::string> copies_;
+
+  friend class ApplicationDB;
+};
+
 // This class is the wrapper of Rocksdb::DB, it adds the replication logic
 // along with basic data operations(read/write)
 class ApplicationDB {
  public:
+  // Called with the db name and a key when a sampled Get() or Write() of the
+  // key finds it hot
+  using HotKeyHandler = std::function<void(const std::string& db_name,
+                                           const rocksdb::Slice& key,
+                                           bool is_write)>;
+
   // Create a ApplicationDB instance
   // db_name:       (IN) name of this db instance
   // db:            (IN) shared pointer of rocksdb instance
@@ -45,7 +97,15 @@ class ApplicationDB {
   // Return non-null pointer on success
   rocksdb::Iterator* NewIterator(const rocksdb::ReadOptions& options);
 
-  // Get rocksdb value for a given key
+  // Similar to the above NewIterator(), but over column_family
+  rocksdb::Iterator* NewIterator(const rocksdb::ReadOptions& options,
+                                 rocksdb::ColumnFamilyHandle* column_family);
+
+  // Get rocksdb value for a given key. Reads without a snapshot are served
+  // from the read cache of this db if it has one, see
+  // --application_db_read_cache_bytes. Values of the default column family
+  // expired per its TtlCompactionFilterFactory are not found by Get(),
+  // MultiGet() or Scan().
   // options: (IN) Read options
   // key: (IN) rocksdb key
   // value: (OUT) the value of the key
@@ -55,6 +115,13 @@ class ApplicationDB {
                       const rocksdb::Slice& key,
                       std::string* value);
 
+  // Similar to the above Get(), but from column_family. Only reads from the
+  // default column family are served from the read cache.
+  rocksdb::Status Get(const rocksdb::ReadOptions& options,
+                      rocksdb::ColumnFamilyHandle* column_family,
+                      const rocksdb::Slice& key,
+                      std::string* value);
+
   // Similar to the above Get(). Output a PinnableSlice instead of a string
   rocksdb::Status Get(const rocksdb::ReadOptions& options,
                       const rocksdb::Slice& key,
@@ -72,7 +139,55 @@ class ApplicationDB {
                                         const std::vector<rocksdb::Slice>& keys,
                                         std::vector<std::string>* values);
 
-  // Batch write with the given options and data.
+  // Batched MultiGet. The keys are looked up together, which shares the
+  // memtable and block lookups of keys in the same blocks, and the values
+  // are pinned instead of copied. With --application_db_multi_get_async_io,
+  // the reads of the blocks missing from the block cache overlap. The read
+  // cache is not used. Falls back to a Get() per key with RocksDB older than
+  // 6.4.
+  // options:      (IN) Read options
+  // num_keys:     (IN) The number of keys, values and statuses
+  // keys:         (IN) rocksdb keys
+  // values:      (OUT) the values of the keys
+  // statuses:    (OUT) the status of each key, NotFound if it doesn't exist
+  // sorted_input: (IN) If keys are sorted, which saves sorting them
+  void MultiGet(const rocksdb::ReadOptions& options,
+                size_t num_keys,
+                const rocksdb::Slice* keys,
+                rocksdb::PinnableSlice* values,
+                rocksdb::Status* statuses,
+                bool sorted_input = false);
+
+  // Scan up to limit keys in [start, end) in order. The readahead size of
+  // options defaults to --application_db_scan_readahead_bytes, and a
+  // snapshot can be set in options to page through a consistent view.
+  // options: (IN) Read options
+  // start:   (IN) The first key to scan
+  // end:     (IN) The key to stop at, or empty to scan to the last key
+  // limit:   (IN) The max number of keys returned
+  // results: (OUT) The keys and values scanned
+  //
+  // Return rocksdb::Status::ok on success
+  rocksdb::Status Scan(const rocksdb::ReadOptions& options,
+                       const rocksdb::Slice& start,
+                       const rocksdb::Slice& end,
+                       const uint32_t limit,
+                       ScanResults* results);
+
+  // Similar to the above Scan(), but runs on executor. The caller must keep
+  // this db and the snapshot in options, if any, until the future is done.
+  // Return a future fulfilled with the results, or failing with the status
+  // as a std::runtime_error
+  folly::Future<std::unique_ptr<ScanResults>> ScanAsync(
+    const rocksdb::ReadOptions& options,
+    std::string start,
+    std::string end,
+    const uint32_t limit,
+    folly::Executor* executor);
+
+  // Batch write with the given options and data, which may update any column
+  // family of GetColumnFamily(). The keys written are evicted from the read
+  // cache.
   // options:     (IN) Write options
   // write_batch: (IN) Batch operations
   //
@@ -80,6 +195,17 @@ class ApplicationDB {
   rocksdb::Status Write(const rocksdb::WriteOptions& options,
                         rocksdb::WriteBatch* write_batch);
 
+  // Similar to the above Write(), but doesn't block the calling thread when
+  // waiting for Slaves in semi-sync replication modes. The returned future
+  // fails with replicator::ReturnCode if the replicated write fails.
+  // options:     (IN) Write options
+  // write_batch: (IN) Batch operations
+  //
+  // Return a future fulfilled with rocksdb::Status::ok on success
+  folly::Future<rocksdb::Status> WriteAsync(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* write_batch);
+
   // Compact the db.
   // options:     (IN) CompactRange options
   // begin:       (IN) Start key of the compaction.
@@ -89,16 +215,70 @@ class ApplicationDB {
   rocksdb::Status CompactRange(const rocksdb::CompactRangeOptions& options,
                                const rocksdb::Slice* begin,
                                const rocksdb::Slice* end);
-  
+
+  // Delete all keys while the db stays open. The keys are deleted with one
+  // range deletion, after which the sst files holding only deleted keys are
+  // dropped and what remains is compacted away, so that the db ends up with
+  // no files nor tombstones, e.g. for ingesting files without global seq #.
+  // Sequence #s keep increasing. The deletion is written to db_ directly, so
+  // it isn't sent to Slaves. Keys written while it runs may be deleted too.
+  //
+  // column_family: (IN) The column family to clear, nullptr for the default
+  //
+  // Return rocksdb::Status::ok on success
+  rocksdb::Status DeleteAllKeys(
+    rocksdb::ColumnFamilyHandle* column_family = nullptr);
+
+  // Page the index and filter blocks of all sst files into memory, then the
+  // data blocks of up to scan_bytes of keys and values from the first key,
+  // e.g. before serving reads after a restore or a restart. Whatever is left
+  // after budget is skipped.
+  // budget:            (IN) Max time to spend
+  // scan_bytes:        (IN) Max bytes of data to read, 0 for none
+  // max_bytes_per_sec: (IN) Max rate of reading data, 0 for no limit
+  void WarmUp(std::chrono::milliseconds budget,
+              uint64_t scan_bytes,
+              uint64_t max_bytes_per_sec);
+
+  // Whether WarmUp() has been done since this db was opened
+  bool IsWarmedUp() const { return warmed_up_.load(); }
+
   // get the highest empty level of default column family
   uint32_t getHighestEmptyLevel();
 
+  // Whether rocksdb is stopping or slowing down writes, e.g. while compaction
+  // falls behind
+  bool IsWriteStalled();
+
   // Whether this db instance is slave
-  bool IsSlave() const { return role_ == replicator::DBRole::SLAVE; }
+  bool IsSlave() const { return role_.load() == replicator::DBRole::SLAVE; }
+
+  // Replication role of this db
+  replicator::DBRole role() const { return role_.load(); }
+
+  // Switch the replication role and upstream of this db in place. The
+  // replicator stops or starts pulling for it, and writes are let through or
+  // refused per the new role. Reads are served all along, and writes only
+  // wait for the switch itself, not for the users of this db to let go of it.
+  // The caller must serialize it with other admin operations of this db,
+  // as upstream_addr() changes.
+  // role:           (IN) The new role
+  // upstream_addr:  (IN) The new upstream, if any
+  // error_message: (OUT) Set if something goes wrong
+  //
+  // Return true on success. On failure, the db is left unreplicated.
+  bool ChangeRole(replicator::DBRole role,
+                  std::unique_ptr<folly::SocketAddress> upstream_addr,
+                  std::string* error_message);
 
   // Name of this db
   const std::string& db_name() const { return db_name_; }
 
+  // Return the handle of the column family name, which is the default one for
+  // an empty name, or nullptr if this db doesn't have it. It is valid as long
+  // as this db.
+  rocksdb::ColumnFamilyHandle* GetColumnFamily(const std::string& name) const;
+
   // Return a raw pointer to the underlying rocksdb object. We don't return a
   // shared_ptr here to indicate that we must hold the outer object while using
   // the returned pointer
@@ -110,16 +290,134 @@ class ApplicationDB {
     return upstream_addr_.get();
   }
 
+  // Set the handler called for hot keys of all dbs, which is the policy of
+  // the service for them, e.g. serving them from a cache or spreading their
+  // reads across replicas. It is only called for the dbs sampling keys, see
+  // --application_db_hot_key_sample_rate. Pass nullptr to remove it.
+  static void SetHotKeyHandler(HotKeyHandler handler);
+
+  // Evict the keys updated by write_batch from the read cache, for writes
+  // made to rocksdb() directly
+  void InvalidateReadCache(const rocksdb::WriteBatch& write_batch);
+
+  // Evict everything from the read cache, e.g. after ingesting sst files to
+  // rocksdb() directly
+  void ClearReadCache();
+
+  // The read cache of this db, nullptr if it doesn't have one
+  const ReadCache* read_cache() const { return read_cache_.get(); }
+
+  // Return the keys taking more than --application_db_hot_key_percents of the
+  // sampled load, or nothing if this db doesn't sample keys
+  std::vector<std::string> GetHotKeys() const;
+
+  // The number of keys read by Get(), MultiGet() and Scan() calls, and the
+  // number of Write() and WriteAsync() calls, since this db was opened
+  uint64_t NumReads() const {
+    return num_reads_.load(std::memory_order_relaxed);
+  }
+  uint64_t NumWrites() const {
+    return num_writes_.load(std::memory_order_relaxed);
+  }
+
+  // Give back the memory of this db while it is idle: flush its memtables,
+  // shrink their budget to --application_db_hibernated_write_buffer_bytes,
+  // cap its open files to --application_db_hibernated_max_open_files, and
+  // clear its read cache. Capping the open files releases the table readers
+  // beyond the cap. It can't be done for dbs opened with max_open_files = -1,
+  // whose index and filter blocks are only released if they are kept in the
+  // block cache. The next read or write, or replicated update, wakes it up.
+  //
+  // Return true if this db was awake
+  bool Hibernate();
+
+  // Restore the options changed by Hibernate(). Reads, writes and
+  // replicated updates call it when needed, so it is only for waking up dbs
+  // ahead of them, e.g. dbs written to directly through rocksdb().
+  //
+  // Return true if this db was hibernated
+  bool WakeUp();
+
+  // Whether this db is hibernated
+  bool IsHibernated() const { return hibernated_.load(); }
+
+  // Replication lag of this db if it is a SLAVE, see
+  // ReplicatedDB::seqNoLag() and ReplicatedDB::msSinceLastApply()
+  uint64_t ReplicationSeqNoLag() const {
+    folly::SharedMutex::ReadHolder rh(replication_lock_);
+    return replicated_db_ ? replicated_db_->seqNoLag() : 0;
+  }
+  uint64_t ReplicationMsSinceLastApply() const {
+    folly::SharedMutex::ReadHolder rh(replication_lock_);
+    return replicated_db_ ? replicated_db_->msSinceLastApply() : 0;
+  }
+
   ~ApplicationDB();
 
  private:
   const std::string db_name_;
   std::shared_ptr<rocksdb::DB> db_;
 
-  const replicator::DBRole role_;
+  // Register this db to the replicator per role_ and upstream_addr_. Must
+  // hold replication_lock_ exclusively, or be constructing.
+  replicator::ReturnCode StartReplication();
+
+  std::atomic<replicator::DBRole> role_;
   std::unique_ptr<folly::SocketAddress> upstream_addr_;
+  // Held shared by writes going through replicated_db_, and exclusively while
+  // ChangeRole() swaps it
+  mutable folly::SharedMutex replication_lock_;
   replicator::RocksDBReplicator::ReplicatedDB* replicated_db_;
 
+  // Record 1 in hot_key_sample_rate_ keys, so that most calls don't take the
+  // lock of the detector
+  bool shouldSampleHotKeys() const;
+  void recordHotKey(const rocksdb::Slice& key, bool is_write);
+  void recordHotKeys(rocksdb::WriteBatch* write_batch);
+
+  const uint32_t hot_key_sample_rate_;
+  // nullptr if we don't sample keys
+  std::unique_ptr<common::HotKeyDetector<std::string>> hot_key_detector_;
+
+  // nullptr if --application_db_read_cache_bytes is 0. Shared with the
+  // handler invalidating it for the updates applied by the replicator.
+  std::shared_ptr<ReadCache> read_cache_;
+
+  // nullptr if --application_db_perf_context_sample_rate is 0
+  std::unique_ptr<PerfContextSampler> get_perf_sampler_;
+  std::unique_ptr<PerfContextSampler> multi_get_perf_sampler_;
+  std::unique_ptr<PerfContextSampler> write_perf_sampler_;
+
+  // The TTL of the values of the default column family, nullptr if they
+  // don't expire
+  std::shared_ptr<TtlCompactionFilterFactory> ttl_;
+
+  // If value has outlived the TTL, but not been compacted away yet
+  bool isExpired(const rocksdb::Slice& value) const {
+    return ttl_ && ttl_->IsExpired(value);
+  }
+
+  // relaxed, only read for the resource usage of the db
+  std::atomic<uint64_t> num_reads_;
+  std::atomic<uint64_t> num_writes_;
+
+  // Called by all reads and writes
+  void wakeUpIfHibernated() {
+    if (hibernated_.load(std::memory_order_relaxed)) {
+      WakeUp();
+    }
+  }
+
+  std::atomic<bool> hibernated_;
+  // serializes Hibernate() and WakeUp()
+  std::mutex hibernation_lock_;
+  // The options changed by Hibernate() -> their values before
+  std::unordered_map<std::string, std::string> hibernated_cf_options_;
+  std::unordered_map<std::string, std::string> hibernated_db_options_;
+
+  // Set by WarmUp()
+  std::atomic<bool> warmed_up_;
+
   friend class ApplicationDBManager;
 };
 
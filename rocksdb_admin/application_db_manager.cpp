@@ -15,20 +15,64 @@
 
 #include "rocksdb_admin/application_db_manager.h"
 
+#include <algorithm>
 #include <chrono>
 #include <string>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
+#include "folly/String.h"
+#include "folly/ThreadName.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_int32(application_db_hibernate_idle_min, 0,
+             "Hibernate the dbs without reads, writes or replicated updates "
+             "for this many minutes, to give back their memory until they are "
+             "used again. 0 disables hibernation");
+
+DEFINE_int32(application_db_hibernation_check_sec, 60,
+             "How often to look for dbs to hibernate or wake up, see "
+             "--application_db_hibernate_idle_min");
+
 namespace admin {
 
 const int kRemoveDBRefWaitMilliSec = 200;
 
 ApplicationDBManager::ApplicationDBManager()
     : dbs_()
-    , dbs_lock_() {}
+    , dbs_write_lock_()
+    , db_activities_()
+    , hibernation_lock_()
+    , stop_hibernation_(false)
+    , hibernation_thread_lock_()
+    , hibernation_cv_()
+    , hibernation_thread_(nullptr) {
+  if (FLAGS_application_db_hibernate_idle_min <= 0) {
+    return;
+  }
+
+  hibernation_thread_ = std::make_unique<std::thread>([this] {
+    if (!folly::setThreadName("DBHibernation")) {
+      LOG(ERROR) << "Failed to set thread name for db hibernation";
+    }
+
+    const std::chrono::seconds interval(
+      std::max(FLAGS_application_db_hibernation_check_sec, 1));
+    std::unique_lock<std::mutex> lock(hibernation_thread_lock_);
+    while (!stop_hibernation_) {
+      hibernation_cv_.wait_for(lock, interval,
+                               [this] { return stop_hibernation_; });
+      if (stop_hibernation_) {
+        break;
+      }
+      lock.unlock();
+      hibernateIdleDBs();
+      lock.lock();
+    }
+  });
+}
 
 bool ApplicationDBManager::addDB(const std::string& db_name,
                                  std::unique_ptr<rocksdb::DB> db,
@@ -42,34 +86,48 @@ bool ApplicationDBManager::addDB(const std::string& db_name,
                                  replicator::DBRole role,
                                  std::unique_ptr<folly::SocketAddress> up_addr,
                                  std::string* error_message) {
-  std::unique_lock<std::shared_mutex> lock(dbs_lock_);
-  if (dbs_.find(db_name) != dbs_.end()) {
+  std::lock_guard<std::mutex> lock(dbs_write_lock_);
+  // Check before creating the ApplicationDB, which registers itself to the
+  // replicator
+  std::shared_ptr<ApplicationDB> existing_db;
+  if (dbs_.get(db_name, &existing_db)) {
     if (error_message) {
       *error_message = db_name + " has already been added";
     }
     return false;
   }
-  auto rocksdb_ptr = std::shared_ptr<rocksdb::DB>(db.release(),
+  auto raw_db = db.release();
+  auto rocksdb_ptr = std::shared_ptr<rocksdb::DB>(raw_db,
     [](rocksdb::DB* db){});
-  auto application_db_ptr = std::make_shared<ApplicationDB>(db_name,
-    std::move(rocksdb_ptr), role, std::move(up_addr));
+  std::shared_ptr<ApplicationDB> application_db_ptr;
+  try {
+    application_db_ptr = std::make_shared<ApplicationDB>(db_name,
+      std::move(rocksdb_ptr), role, std::move(up_addr));
+  } catch (const replicator::ReturnCode& code) {
+    // e.g., a Slave which lost updates in a crash and has to be rebuilt
+    delete raw_db;
+    if (error_message) {
+      *error_message = "Failed to replicate " + db_name + ", code " +
+        std::to_string(static_cast<int>(code));
+    }
+    return false;
+  }
 
-  dbs_.emplace(db_name, std::move(application_db_ptr));
+  dbs_.add(db_name, application_db_ptr);
   return true;
 }
 
 const std::shared_ptr<ApplicationDB> ApplicationDBManager::getDB(
     const std::string& db_name,
     std::string* error_message) {
-  std::shared_lock<std::shared_mutex> lock(dbs_lock_);
-  auto itor = dbs_.find(db_name);
-  if (itor == dbs_.end()) {
+  std::shared_ptr<ApplicationDB> db;
+  if (!dbs_.get(db_name, &db)) {
     if (error_message) {
       *error_message = db_name + " does not exist";
     }
     return nullptr;
   }
-  return itor -> second;
+  return db;
 }
 
 std::unique_ptr<rocksdb::DB> ApplicationDBManager::removeDB(
@@ -78,33 +136,97 @@ std::unique_ptr<rocksdb::DB> ApplicationDBManager::removeDB(
   std::shared_ptr<ApplicationDB> ret;
 
   {
-    std::unique_lock<std::shared_mutex> lock(dbs_lock_);
-    auto itor = dbs_.find(db_name);
-    if (itor == dbs_.end()) {
+    std::lock_guard<std::mutex> lock(dbs_write_lock_);
+    // The readers of the old snapshot are done once it returns
+    if (!dbs_.remove(db_name, &ret)) {
       if (error_message) {
         *error_message = db_name + " does not exist";
       }
       return nullptr;
     }
-  
-    ret = std::move(itor->second);
-    dbs_.erase(itor);
   }
 
   waitOnApplicationDBRef(ret);
   return std::unique_ptr<rocksdb::DB>(ret->db_.get());
 }
 
+std::shared_ptr<ApplicationDB> ApplicationDBManager::replaceDB(
+    const std::string& db_name,
+    std::unique_ptr<rocksdb::DB> db,
+    replicator::DBRole role,
+    std::unique_ptr<folly::SocketAddress> up_addr,
+    std::string* error_message) {
+  std::lock_guard<std::mutex> lock(dbs_write_lock_);
+  std::shared_ptr<ApplicationDB> old_db;
+  if (!dbs_.get(db_name, &old_db)) {
+    if (error_message) {
+      *error_message = db_name + " does not exist";
+    }
+    return nullptr;
+  }
+
+  // The replicator holds one db per name, which has to be the new one
+  if (!old_db->ChangeRole(replicator::DBRole::SLAVE, nullptr, error_message)) {
+    return nullptr;
+  }
+
+  auto rocksdb_ptr = std::shared_ptr<rocksdb::DB>(db.release(),
+    [](rocksdb::DB* db){});
+  auto application_db_ptr = std::make_shared<ApplicationDB>(db_name,
+    std::move(rocksdb_ptr), role, std::move(up_addr));
+
+  // The readers of the old snapshot are done once it returns, so only the
+  // holders of old_db are left to wait for
+  dbs_.replace(db_name, application_db_ptr);
+  return old_db;
+}
+
+std::unique_ptr<rocksdb::DB> ApplicationDBManager::releaseDB(
+    std::shared_ptr<ApplicationDB> db) {
+  waitOnApplicationDBRef(db);
+  return std::unique_ptr<rocksdb::DB>(db->db_.get());
+}
+
+std::map<std::string, std::shared_ptr<ApplicationDB>>
+ApplicationDBManager::getDBs(const std::vector<std::string>& db_names) {
+  std::map<std::string, std::shared_ptr<ApplicationDB>> dbs;
+  const std::unordered_set<std::string> wanted(db_names.begin(),
+                                               db_names.end());
+  dbs_.forEach([&dbs, &wanted] (const std::string& db_name,
+                                const std::shared_ptr<ApplicationDB>& db) {
+      if (wanted.empty() || wanted.count(db_name) != 0) {
+        dbs.emplace(db_name, db);
+      }
+    });
+
+  return dbs;
+}
+
 std::string ApplicationDBManager::DumpDBStatsAsText() const {
   std::vector<std::shared_ptr<ApplicationDB>> dbs;
-  {
-    std::shared_lock<std::shared_mutex> lock(dbs_lock_);
-    dbs.reserve(dbs_.size());
-    for (const auto& db : dbs_) {
-      dbs.push_back(db.second);
+  dbs_.forEach([&dbs] (const std::string& db_name,
+                       const std::shared_ptr<ApplicationDB>& db) {
+      dbs.push_back(db);
+    });
+
+  return DumpStatsOfDBs(dbs);
+}
+
+std::string ApplicationDBManager::DumpDBStatsAsText(
+    const std::vector<std::string>& db_names) const {
+  std::vector<std::shared_ptr<ApplicationDB>> dbs;
+  for (const auto& db_name : db_names) {
+    std::shared_ptr<ApplicationDB> db;
+    if (dbs_.get(db_name, &db)) {
+      dbs.push_back(std::move(db));
     }
   }
 
+  return DumpStatsOfDBs(dbs);
+}
+
+std::string ApplicationDBManager::DumpStatsOfDBs(
+    const std::vector<std::shared_ptr<ApplicationDB>>& dbs) {
   std::string stats;
   // Add stats for DB size
   // total_sst_file_size db=abc00001: 12345
@@ -119,29 +241,129 @@ std::string ApplicationDBManager::DumpDBStatsAsText() const {
 
     stats += folly::stringPrintf("  total_sst_file_size db=%s: %" PRIu64 "\n",
                                  db->db_name().c_str(), sz);
+
+    // The memory of the db, which shared block caches and write buffer
+    // managers are budgeting for
+    if (!db->rocksdb()->GetIntProperty(
+          rocksdb::DB::Properties::kCurSizeAllMemTables, &sz)) {
+      sz = 0;
+    }
+    stats += folly::stringPrintf("  cur_size_all_mem_tables db=%s: %" PRIu64
+                                 "\n", db->db_name().c_str(), sz);
+    if (!db->rocksdb()->GetIntProperty(
+          rocksdb::DB::Properties::kEstimateTableReadersMem, &sz)) {
+      sz = 0;
+    }
+    stats += folly::stringPrintf("  estimate_table_readers_mem db=%s: %" PRIu64
+                                 "\n", db->db_name().c_str(), sz);
+
+    stats += folly::stringPrintf("  hibernated db=%s: %d\n",
+                                 db->db_name().c_str(),
+                                 db->IsHibernated() ? 1 : 0);
+
+    const auto read_cache = db->read_cache();
+    if (read_cache) {
+      const auto hits = read_cache->hits();
+      const auto lookups = hits + read_cache->misses();
+      stats += folly::stringPrintf("  read_cache_hits db=%s: %" PRIu64 "\n",
+                                   db->db_name().c_str(), hits);
+      stats += folly::stringPrintf("  read_cache_lookups db=%s: %" PRIu64
+                                   "\n", db->db_name().c_str(), lookups);
+      stats += folly::stringPrintf("  read_cache_hit_ratio db=%s: %.4f\n",
+                                   db->db_name().c_str(),
+                                   lookups == 0 ? 0.0 :
+                                     static_cast<double>(hits) / lookups);
+    }
   }
 
   return stats;
 }
 
+std::string ApplicationDBManager::DumpHotKeysAsText() const {
+  std::vector<std::shared_ptr<ApplicationDB>> dbs;
+  dbs_.forEach([&dbs] (const std::string& db_name,
+                       const std::shared_ptr<ApplicationDB>& db) {
+      dbs.push_back(db);
+    });
+
+  std::string hot_keys;
+  for (const auto& db : dbs) {
+    for (const auto& key : db->GetHotKeys()) {
+      hot_keys += db->db_name() + " " + folly::hexlify(key) + "\n";
+    }
+  }
+
+  return hot_keys;
+}
+
 std::vector<std::string> ApplicationDBManager::getAllDBNames()  {
     std::vector<std::string> db_names;
-    std::shared_lock<std::shared_mutex> lock(dbs_lock_);
-    db_names.reserve(dbs_.size());
-    for (const auto& db : dbs_) {
-        db_names.push_back(db.first);
-    }
+    dbs_.forEach([&db_names] (const std::string& db_name,
+                              const std::shared_ptr<ApplicationDB>& db) {
+        db_names.push_back(db_name);
+      });
     return db_names;
 }
 
+void ApplicationDBManager::hibernateIdleDBs(
+    const std::chrono::steady_clock::time_point now) {
+  std::lock_guard<std::mutex> lock(hibernation_lock_);
+  const std::chrono::minutes idle_time(
+    std::max(FLAGS_application_db_hibernate_idle_min, 0));
+  std::unordered_map<std::string, DBActivity> activities;
+  for (const auto& db_name_db : getDBs({})) {
+    const auto& db = db_name_db.second;
+    DBActivity activity{db->NumReads(), db->NumWrites(),
+                        db->rocksdb()->GetLatestSequenceNumber(), now};
+    auto itor = db_activities_.find(db_name_db.first);
+    if (itor != db_activities_.end()) {
+      const auto& last = itor->second;
+      const bool replicated = activity.seq_no != last.seq_no;
+      if (activity.num_reads == last.num_reads &&
+          activity.num_writes == last.num_writes && !replicated) {
+        activity.last_active = last.last_active;
+      }
+
+      // Reads and writes wake up dbs by themselves, unlike the replicator
+      if (replicated && db->WakeUp()) {
+        LOG(INFO) << "Woke up " << db_name_db.first
+                  << " for replicated updates";
+      } else if (idle_time.count() > 0 && !db->IsHibernated() &&
+                 now - activity.last_active >= idle_time) {
+        LOG(INFO) << "Hibernating " << db_name_db.first << ", idle for "
+                  << std::chrono::duration_cast<std::chrono::minutes>(
+                       now - activity.last_active).count() << " min";
+        db->Hibernate();
+      }
+    }
+
+    activities.emplace(db_name_db.first, activity);
+  }
+
+  // Forget the dbs removed
+  db_activities_.swap(activities);
+}
+
 ApplicationDBManager::~ApplicationDBManager() {
-  auto itor = dbs_.begin();
-  while (itor != dbs_.end()) {
-    waitOnApplicationDBRef(itor->second);
+  if (hibernation_thread_) {
+    {
+      std::lock_guard<std::mutex> lock(hibernation_thread_lock_);
+      stop_hibernation_ = true;
+    }
+    hibernation_cv_.notify_all();
+    hibernation_thread_->join();
+  }
+
+  for (const auto& db_name : getAllDBNames()) {
+    std::shared_ptr<ApplicationDB> db;
+    if (!dbs_.remove(db_name, &db)) {
+      continue;
+    }
+    waitOnApplicationDBRef(db);
     // we want to first remove the ApplicationDB and then release the RocksDB
     // it contains.
-    auto tmp = std::unique_ptr<rocksdb::DB>(itor->second->db_.get());
-    itor = dbs_.erase(itor);
+    auto tmp = std::unique_ptr<rocksdb::DB>(db->db_.get());
+    db.reset();
   }
 }
 
@@ -15,18 +15,28 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <map>
-#include <shared_mutex>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
+#include "gflags/gflags.h"
 #include "rocksdb/db.h"
 #include "rocksdb_admin/application_db.h"
+#include "rocksdb_replicator/fast_read_map.h"
+
+DECLARE_int32(application_db_hibernate_idle_min);
 
 namespace admin {
 
 // This class manages application rocksdb instances, it offers functionality to
 // add/remove/get application rocksdb instance.
-// Note: this class is thread-safe.
+// Note: this class is thread-safe. Looking up dbs doesn't write any memory
+// shared with other lookups, except for the ref count of the returned db.
 class ApplicationDBManager {
  public:
   ApplicationDBManager();
@@ -66,6 +76,15 @@ class ApplicationDBManager {
   const std::shared_ptr<ApplicationDB> getDB(const std::string& db_name,
                                              std::string* error_message);
 
+  // Get ApplicationDB instances of the given names in one pass, or of all DBs
+  // if db_names is empty. Names not found are left out.
+  // Returned dbs are not supposed to be long held by client
+  // db_names:       (IN) Names of the ApplicationDB instances to be returned
+  //
+  // Return db name -> db
+  std::map<std::string, std::shared_ptr<ApplicationDB>> getDBs(
+    const std::vector<std::string>& db_names);
+
   // Remove ApplicationDB instance of the given name
   // db_name:        (IN) Name of the ApplicationDB instance to be removed
   // error_message: (OUT) This field will be set if something goes wrong
@@ -74,21 +93,87 @@ class ApplicationDBManager {
   std::unique_ptr<rocksdb::DB> removeDB(const std::string& db_name,
                                         std::string* error_message);
 
+  // Replace the ApplicationDB instance of the given name with a new one of db.
+  // Lookups see either the old or the new instance, never none. The old one
+  // is unregistered from the replicator first, so writes to it are refused
+  // from then on, but it is left open for the lookups still holding it.
+  // db_name:        (IN) Name of the ApplicationDB instance to be replaced
+  // db:             (IN) The unique pointer of the new rocksdb instance
+  // role:           (IN) Replicating role of the new rocksdb instance
+  // upstream_addr   (IN) Address of upstream rocksdb instance
+  // error_message: (OUT) This field will be set if something goes wrong
+  //
+  // Return the replaced ApplicationDB instance on success, to be handed to
+  // releaseDB(). Return nullptr on failure, with db closed.
+  std::shared_ptr<ApplicationDB> replaceDB(
+    const std::string& db_name,
+    std::unique_ptr<rocksdb::DB> db,
+    replicator::DBRole role,
+    std::unique_ptr<folly::SocketAddress> upstream_addr,
+    std::string* error_message);
+
+  // Wait for the other holders of an ApplicationDB instance returned by
+  // replaceDB() to let go of it, and return its rocksdb instance. It doesn't
+  // touch the ApplicationDBManager, which may be gone by then.
+  static std::unique_ptr<rocksdb::DB> releaseDB(
+    std::shared_ptr<ApplicationDB> db);
+
   // Dump stats for all DBs as a text string
   std::string DumpDBStatsAsText() const;
 
+  // Dump stats for the DBs of db_names still held as a text string
+  std::string DumpDBStatsAsText(const std::vector<std::string>& db_names) const;
+
+  // Dump the hot keys of all DBs sampling keys as a text string, one
+  // "<db name> <hex encoded key>" per line
+  std::string DumpHotKeysAsText() const;
+
   // Get the names of all DBs currently held by the ApplicationDBManager
   // This can be used if some service wants to perform some action such
   // as compaction across all dbs currently maintained.
   std::vector<std::string> getAllDBNames();
 
+  // Hibernate the dbs without reads, writes or replicated updates for
+  // --application_db_hibernate_idle_min, and wake up the hibernated dbs which
+  // got replicated updates, see ApplicationDB::Hibernate(). It runs every
+  // --application_db_hibernation_check_sec in the background if
+  // --application_db_hibernate_idle_min is positive.
+  // now: (IN) The current time
+  void hibernateIdleDBs(
+    std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now());
+
   ~ApplicationDBManager();
 
  private:
-  std::unordered_map<std::string, std::shared_ptr<ApplicationDB>> dbs_;
-  mutable std::shared_mutex dbs_lock_;
-
-  void waitOnApplicationDBRef(const std::shared_ptr<ApplicationDB>& db);
+  // The activity of a db as of the last hibernateIdleDBs()
+  struct DBActivity {
+    uint64_t num_reads;
+    uint64_t num_writes;
+    rocksdb::SequenceNumber seq_no;
+    std::chrono::steady_clock::time_point last_active;
+  };
+
+  static std::string DumpStatsOfDBs(
+    const std::vector<std::shared_ptr<ApplicationDB>>& dbs);
+
+  mutable replicator::detail::FastReadMap<std::string,
+                                          std::shared_ptr<ApplicationDB>> dbs_;
+  // serializes addDB(), removeDB() and replaceDB()
+  std::mutex dbs_write_lock_;
+
+  // db name -> its activity, only used by hibernateIdleDBs()
+  std::unordered_map<std::string, DBActivity> db_activities_;
+  // serializes hibernateIdleDBs()
+  std::mutex hibernation_lock_;
+
+  bool stop_hibernation_;
+  std::mutex hibernation_thread_lock_;
+  std::condition_variable hibernation_cv_;
+  std::unique_ptr<std::thread> hibernation_thread_;
+
+  static void waitOnApplicationDBRef(
+    const std::shared_ptr<ApplicationDB>& db);
 };
 
 }  // namespace admin
@@ -0,0 +1,128 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/column_family_db.h"
+
+#include <set>
+#include <utility>
+
+#include "glog/logging.h"
+
+namespace admin {
+
+ColumnFamilyDB::ColumnFamilyDB(
+    rocksdb::DB* db,
+    std::vector<rocksdb::ColumnFamilyHandle*> handles)
+    : rocksdb::StackableDB(db)
+    , handles_(std::move(handles)) {}
+
+ColumnFamilyDB::~ColumnFamilyDB() {
+  // The handles must go before the db, which StackableDB deletes
+  for (auto handle : handles_) {
+    auto status = GetBaseDB()->DestroyColumnFamilyHandle(handle);
+    LOG_IF(ERROR, !status.ok()) << "Failed to destroy the handle of "
+                                << GetName() << ": " << status.ToString();
+  }
+}
+
+rocksdb::Status ColumnFamilyDB::Open(
+    const rocksdb::Options& options,
+    const std::string& dir,
+    const std::vector<rocksdb::ColumnFamilyDescriptor>& column_families,
+    std::unique_ptr<rocksdb::DB>* db) {
+  std::vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+  descriptors.emplace_back(rocksdb::kDefaultColumnFamilyName,
+                           rocksdb::ColumnFamilyOptions(options));
+  std::set<std::string> names{rocksdb::kDefaultColumnFamilyName};
+  for (const auto& descriptor : column_families) {
+    if (names.insert(descriptor.name).second) {
+      descriptors.push_back(descriptor);
+    }
+  }
+
+  // All column families of an existing db have to be opened. It is fine if
+  // there is no db yet.
+  std::vector<std::string> existing_names;
+  if (rocksdb::DB::ListColumnFamilies(options, dir, &existing_names).ok()) {
+    for (const auto& name : existing_names) {
+      if (names.insert(name).second) {
+        descriptors.emplace_back(name, rocksdb::ColumnFamilyOptions(options));
+      }
+    }
+  }
+
+  if (descriptors.size() == 1) {
+    rocksdb::DB* raw_db;
+    auto status = rocksdb::DB::Open(options, dir, &raw_db);
+    if (status.ok()) {
+      db->reset(raw_db);
+    }
+    return status;
+  }
+
+  auto db_options = rocksdb::DBOptions(options);
+  db_options.create_missing_column_families = true;
+  rocksdb::DB* raw_db;
+  std::vector<rocksdb::ColumnFamilyHandle*> handles;
+  auto status = rocksdb::DB::Open(db_options, dir, descriptors, &handles,
+                                  &raw_db);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // The db keeps a handle of the default column family of its own
+  raw_db->DestroyColumnFamilyHandle(handles.front());
+  handles.erase(handles.begin());
+  db->reset(new ColumnFamilyDB(raw_db, std::move(handles)));
+  return status;
+}
+
+rocksdb::ColumnFamilyHandle* ColumnFamilyDB::GetColumnFamily(
+    rocksdb::DB* db,
+    const std::string& name) {
+  if (name.empty() || name == rocksdb::kDefaultColumnFamilyName) {
+    return db->DefaultColumnFamily();
+  }
+
+  auto cf_db = dynamic_cast<ColumnFamilyDB*>(db);
+  if (cf_db == nullptr) {
+    return nullptr;
+  }
+
+  for (auto handle : cf_db->handles_) {
+    if (handle->GetName() == name) {
+      return handle;
+    }
+  }
+
+  return nullptr;
+}
+
+std::vector<rocksdb::ColumnFamilyHandle*> ColumnFamilyDB::GetColumnFamilies(
+    rocksdb::DB* db) {
+  std::vector<rocksdb::ColumnFamilyHandle*> handles{db->DefaultColumnFamily()};
+  auto cf_db = dynamic_cast<ColumnFamilyDB*>(db);
+  if (cf_db) {
+    handles.insert(handles.end(), cf_db->handles_.begin(),
+                   cf_db->handles_.end());
+  }
+
+  return handles;
+}
+
+}  // namespace admin
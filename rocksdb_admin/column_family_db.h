@@ -0,0 +1,77 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rocksdb/db.h"
+#include "rocksdb/options.h"
+#include "rocksdb/utilities/stackable_db.h"
+
+namespace admin {
+
+// A rocksdb::DB opened with column families other than the default one. It
+// owns their handles, and destroys them before closing the db, so that it can
+// be passed around and closed as any other rocksdb::DB.
+//
+// The column families of a db are replicated together, as the records of a
+// WriteBatch refer to them by id. Ids are assigned in the order column
+// families are created, so the replicas of a db must be created with the same
+// column families, or from a checkpoint or backup of the db.
+class ColumnFamilyDB : public rocksdb::StackableDB {
+ public:
+  // Open the db at dir, with its default column family configured by
+  // options, and each of column_families, which are created if missing.
+  // Column families the db has but column_families doesn't are opened with
+  // options. If the db ends up with the default column family only, db is a
+  // plain rocksdb::DB.
+  // options:         (IN) Options of the db and its default column family
+  // dir:             (IN) Where the db is
+  // column_families: (IN) Non-default column families and their options
+  // db:             (OUT) The opened db
+  //
+  // Return rocksdb::Status::ok on success
+  static rocksdb::Status Open(
+    const rocksdb::Options& options,
+    const std::string& dir,
+    const std::vector<rocksdb::ColumnFamilyDescriptor>& column_families,
+    std::unique_ptr<rocksdb::DB>* db);
+
+  // Return the handle of the column family name of db, which is the default
+  // one for an empty name, or nullptr if db doesn't have it
+  static rocksdb::ColumnFamilyHandle* GetColumnFamily(rocksdb::DB* db,
+                                                      const std::string& name);
+
+  // Return the handles of all column families of db, the default one first
+  static std::vector<rocksdb::ColumnFamilyHandle*> GetColumnFamilies(
+    rocksdb::DB* db);
+
+  ~ColumnFamilyDB() override;
+
+ private:
+  // handles doesn't include the default column family
+  ColumnFamilyDB(rocksdb::DB* db,
+                 std::vector<rocksdb::ColumnFamilyHandle*> handles);
+
+  std::vector<rocksdb::ColumnFamilyHandle*> handles_;
+};
+
+}  // namespace admin
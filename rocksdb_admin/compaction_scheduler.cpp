@@ -0,0 +1,221 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/compaction_scheduler.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "common/stats/stats.h"
+#include "common/timer.h"
+#include "glog/logging.h"
+
+namespace {
+
+const std::string kCompactionWaitMs = "compaction_wait_ms";
+
+}  // anonymous namespace
+
+namespace admin {
+
+CompactionScheduler::CompactionScheduler(const uint32_t max_per_disk)
+    : max_per_disk_(max_per_disk)
+    , lock_()
+    , cv_()
+    , waiting_()
+    , running_() {}
+
+rocksdb::Status CompactionScheduler::Compact(
+    const std::shared_ptr<ApplicationDB>& db,
+    const rocksdb::CompactRangeOptions& options,
+    const uint32_t n_ranges,
+    const std::function<void(bool is_total, uint64_t bytes)>& progress) {
+  if (max_per_disk_ == 0) {
+    return CompactRanges(db, options, n_ranges, progress);
+  }
+
+  struct stat st;
+  dev_t disk = 0;
+  if (stat(db->rocksdb()->GetName().c_str(), &st) == 0) {
+    disk = st.st_dev;
+  } else {
+    LOG(ERROR) << "Failed to find the disk of " << db->db_name();
+  }
+  const Waiter waiter{db, disk, static_cast<uint64_t>(std::max(
+      db->rocksdb()->GetOptions().level0_slowdown_writes_trigger, 1))};
+
+  {
+    common::Timer timer(kCompactionWaitMs);
+    std::unique_lock<std::mutex> lock(lock_);
+    auto itor = waiting_.insert(waiting_.end(), &waiter);
+    cv_.wait(lock, [this, &waiter] { return IsNextLocked(waiter); });
+    waiting_.erase(itor);
+    ++running_[disk];
+  }
+  // The next waiter may start too if there are slots left
+  cv_.notify_all();
+
+  LOG(INFO) << "Compacting " << db->db_name();
+  auto status = CompactRanges(db, options, n_ranges, progress);
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (--running_[disk] == 0) {
+      running_.erase(disk);
+    }
+  }
+  cv_.notify_all();
+  return status;
+}
+
+size_t CompactionScheduler::NumWaiting() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return waiting_.size();
+}
+
+bool CompactionScheduler::IsNextLocked(const Waiter& waiter) const {
+  auto itor = running_.find(waiter.disk);
+  if (itor != running_.end() && itor->second >= max_per_disk_) {
+    return false;
+  }
+
+  // The most urgent waiter of the disk, the earliest one among equals
+  const auto urgency = Urgency(waiter);
+  bool is_earlier = true;
+  for (const auto other : waiting_) {
+    if (other == &waiter) {
+      is_earlier = false;
+      continue;
+    }
+    if (other->disk != waiter.disk) {
+      continue;
+    }
+    const auto other_urgency = Urgency(*other);
+    if (other_urgency > urgency || (other_urgency == urgency && is_earlier)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+double CompactionScheduler::Urgency(const Waiter& waiter) {
+  std::string value;
+  if (!waiter.db->rocksdb()->GetProperty("rocksdb.num-files-at-level0",
+                                         &value)) {
+    return 0;
+  }
+  return std::strtoull(value.c_str(), nullptr, 10) /
+    static_cast<double>(waiter.l0_slowdown_trigger);
+}
+
+std::vector<CompactionScheduler::KeyRange> CompactionScheduler::SplitKeySpace(
+    const std::shared_ptr<ApplicationDB>& db, const uint32_t n_ranges) {
+  std::vector<rocksdb::LiveFileMetaData> files;
+  db->rocksdb()->GetLiveFilesMetaData(&files);
+  const auto comparator = db->rocksdb()->GetOptions().comparator;
+  std::sort(files.begin(), files.end(),
+            [comparator] (const rocksdb::LiveFileMetaData& a,
+                          const rocksdb::LiveFileMetaData& b) {
+              return comparator->Compare(a.smallestkey, b.smallestkey) < 0;
+            });
+
+  uint64_t total_bytes = 0;
+  for (const auto& file : files) {
+    total_bytes += file.size;
+  }
+
+  // Cut a new range once the current one has its share of the bytes, at the
+  // smallest key of the next file
+  std::vector<KeyRange> ranges(1, KeyRange{false, "", false, "", 0});
+  const auto range_bytes =
+    std::max<uint64_t>(total_bytes / std::max(n_ranges, 1u), 1);
+  for (const auto& file : files) {
+    auto& range = ranges.back();
+    if (range.bytes >= range_bytes && ranges.size() < n_ranges &&
+        (!range.has_begin ||
+         comparator->Compare(range.begin, file.smallestkey) < 0)) {
+      range.has_end = true;
+      range.end = file.smallestkey;
+      ranges.push_back(KeyRange{true, file.smallestkey, false, "", 0});
+    }
+    ranges.back().bytes += file.size;
+  }
+  return ranges;
+}
+
+rocksdb::Status CompactionScheduler::CompactRanges(
+    const std::shared_ptr<ApplicationDB>& db,
+    const rocksdb::CompactRangeOptions& options,
+    const uint32_t n_ranges,
+    const std::function<void(bool is_total, uint64_t bytes)>& progress) {
+  if (n_ranges <= 1 && !progress) {
+    return db->CompactRange(options, nullptr, nullptr);
+  }
+
+  const auto ranges = SplitKeySpace(db, std::max(n_ranges, 1u));
+  if (progress) {
+    uint64_t total_bytes = 0;
+    for (const auto& range : ranges) {
+      total_bytes += range.bytes;
+    }
+    progress(true, total_bytes);
+  }
+
+  // The ranges have to be compacted concurrently with each other
+  auto range_options = options;
+  if (ranges.size() > 1) {
+    range_options.exclusive_manual_compaction = false;
+  }
+
+  std::vector<rocksdb::Status> statuses(ranges.size());
+  auto compact = [&] (const size_t i) {
+    const auto& range = ranges[i];
+    const rocksdb::Slice begin(range.begin);
+    const rocksdb::Slice end(range.end);
+    statuses[i] = db->CompactRange(range_options,
+                                   range.has_begin ? &begin : nullptr,
+                                   range.has_end ? &end : nullptr);
+    if (statuses[i].ok() && progress) {
+      progress(false, range.bytes);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < ranges.size(); ++i) {
+    threads.emplace_back(compact, i);
+  }
+  compact(0);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (const auto& status : statuses) {
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  LOG(INFO) << "Compacted " << db->db_name() << " in " << ranges.size()
+            << " ranges";
+  return rocksdb::Status::OK();
+}
+
+}  // namespace admin
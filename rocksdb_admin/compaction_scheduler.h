@@ -0,0 +1,121 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rocksdb/options.h"
+#include "rocksdb/status.h"
+#include "rocksdb_admin/application_db.h"
+
+namespace admin {
+
+// Runs the manual compactions of the dbs of a host, with at most a given
+// number of them at a time on each disk. Waiting compactions go first for
+// the dbs whose L0 file count is the closest to slowing down writes, and
+// then in the order they were requested, so that loading many shards at
+// once doesn't saturate the disks and stall online writes.
+// Note: this class is thread-safe.
+class CompactionScheduler {
+ public:
+  // max_per_disk: (IN) The max number of concurrent compactions on a disk,
+  //                    0 for no limit
+  explicit CompactionScheduler(const uint32_t max_per_disk);
+
+  // no copy nor move
+  CompactionScheduler(const CompactionScheduler&) = delete;
+  CompactionScheduler& operator=(const CompactionScheduler&) = delete;
+
+  // Compact the whole db once it is its turn, blocking until it is done.
+  // db:       (IN) The db to compact
+  // options:  (IN) CompactRange options
+  // n_ranges: (IN) If more than 1, the key space is split into up to this
+  //                many ranges of about the same file size, which are
+  //                compacted concurrently
+  // progress: (IN) If set, called with the total bytes of the sst files
+  //                before compacting, and then with the bytes of the files
+  //                of each range compacted
+  //
+  // Return rocksdb::Status::ok on success
+  rocksdb::Status Compact(
+    const std::shared_ptr<ApplicationDB>& db,
+    const rocksdb::CompactRangeOptions& options,
+    const uint32_t n_ranges = 1,
+    const std::function<void(bool is_total, uint64_t bytes)>& progress =
+      nullptr);
+
+  // The number of compactions waiting for their turn
+  size_t NumWaiting() const;
+
+  // A key range, unbounded on the sides with no key
+  struct KeyRange {
+    bool has_begin;
+    std::string begin;
+    bool has_end;
+    std::string end;
+    // the size of the sst files starting in the range
+    uint64_t bytes;
+  };
+
+  // Split the key space of db into up to n_ranges ranges, along the
+  // smallest keys of its sst files. The ranges are in key order and cover
+  // the whole key space.
+  static std::vector<KeyRange> SplitKeySpace(
+    const std::shared_ptr<ApplicationDB>& db, const uint32_t n_ranges);
+
+ private:
+  struct Waiter {
+    const std::shared_ptr<ApplicationDB> db;
+    const dev_t disk;
+    // L0 files of the db slowing down its writes
+    const uint64_t l0_slowdown_trigger;
+  };
+
+  // Whether waiter may start now. Must hold lock_.
+  bool IsNextLocked(const Waiter& waiter) const;
+
+  // L0 file count of waiter's db relative to its slowdown trigger
+  static double Urgency(const Waiter& waiter);
+
+  static rocksdb::Status CompactRanges(
+    const std::shared_ptr<ApplicationDB>& db,
+    const rocksdb::CompactRangeOptions& options,
+    const uint32_t n_ranges,
+    const std::function<void(bool is_total, uint64_t bytes)>& progress);
+
+  const uint32_t max_per_disk_;
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  // in the order of requests
+  std::list<const Waiter*> waiting_;
+  // disk -> the number of compactions running on it
+  std::unordered_map<dev_t, uint32_t> running_;
+};
+
+}  // namespace admin
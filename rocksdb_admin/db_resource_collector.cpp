@@ -0,0 +1,222 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/db_resource_collector.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+
+#include "folly/String.h"
+#include "folly/ThreadName.h"
+#include "glog/logging.h"
+
+namespace admin {
+
+namespace {
+
+uint64_t GetIntProperty(rocksdb::DB* db, const std::string& property) {
+  uint64_t value = 0;
+  if (!db->GetIntProperty(property, &value)) {
+    return 0;
+  }
+  return value;
+}
+
+uint64_t GetNumL0Files(rocksdb::DB* db) {
+  std::string value;
+  if (!db->GetProperty("rocksdb.num-files-at-level0", &value)) {
+    return 0;
+  }
+  return std::strtoull(value.c_str(), nullptr, 10);
+}
+
+}  // namespace
+
+DBResourceCollector::DBResourceCollector(
+    ApplicationDBManager* db_manager,
+    const std::chrono::milliseconds interval)
+    : db_manager_(db_manager)
+    , interval_(interval)
+    , lock_()
+    , usage_()
+    , last_passes_()
+    , collect_lock_()
+    , stop_(false)
+    , cv_()
+    , thread_(nullptr) {
+  if (interval_.count() <= 0) {
+    return;
+  }
+
+  thread_ = std::make_unique<std::thread>([this] {
+    if (!folly::setThreadName("DBResources")) {
+      LOG(ERROR) << "Failed to set thread name for db resource collector";
+    }
+
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stop_) {
+      cv_.wait_for(lock, interval_, [this] { return stop_; });
+      if (stop_) {
+        break;
+      }
+      lock.unlock();
+      Collect();
+      lock.lock();
+    }
+  });
+}
+
+DBResourceCollector::~DBResourceCollector() {
+  if (thread_ == nullptr) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> g(lock_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_->join();
+}
+
+void DBResourceCollector::Collect() {
+  std::lock_guard<std::mutex> collect_guard(collect_lock_);
+  auto db_names = db_manager_->getAllDBNames();
+  std::sort(db_names.begin(), db_names.end());
+
+  std::vector<DBUsage> usage;
+  usage.reserve(db_names.size());
+  std::unordered_map<std::string, LastPass> last_passes;
+  std::string error_message;
+  for (const auto& db_name : db_names) {
+    auto db = db_manager_->getDB(db_name, &error_message);
+    if (db == nullptr) {
+      // removed since we listed it
+      continue;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    auto rocksdb = db->rocksdb();
+    DBUsage db_usage;
+    db_usage.db_name = db_name;
+    db_usage.mem_table_bytes = GetIntProperty(
+      rocksdb, rocksdb::DB::Properties::kCurSizeAllMemTables);
+    db_usage.table_readers_bytes = GetIntProperty(
+      rocksdb, rocksdb::DB::Properties::kEstimateTableReadersMem);
+    db_usage.sst_file_bytes = GetIntProperty(
+      rocksdb, rocksdb::DB::Properties::kTotalSstFilesSize);
+    db_usage.pending_compaction_bytes = GetIntProperty(
+      rocksdb, rocksdb::DB::Properties::kEstimatePendingCompactionBytes);
+    db_usage.num_l0_files = GetNumL0Files(rocksdb);
+    db_usage.replication_seq_no_lag = db->ReplicationSeqNoLag();
+    db_usage.replication_ms_since_last_apply =
+      db->ReplicationMsSinceLastApply();
+    db_usage.write_stalled_ms = 0;
+    db_usage.read_qps = 0;
+    db_usage.write_qps = 0;
+
+    LastPass last_pass{db->NumReads(), db->NumWrites(), 0, now};
+    auto it = last_passes_.find(db_name);
+    if (it != last_passes_.end()) {
+      const auto elapsed_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          now - it->second.time).count();
+      last_pass.write_stalled_ms = it->second.write_stalled_ms +
+        (db->IsWriteStalled() ? elapsed_ms : 0);
+      if (elapsed_ms > 0) {
+        db_usage.read_qps =
+          (last_pass.num_reads - it->second.num_reads) * 1000.0 / elapsed_ms;
+        db_usage.write_qps =
+          (last_pass.num_writes - it->second.num_writes) * 1000.0 /
+          elapsed_ms;
+      }
+    }
+    db_usage.write_stalled_ms = last_pass.write_stalled_ms;
+
+    last_passes.emplace(db_name, last_pass);
+    usage.push_back(std::move(db_usage));
+  }
+
+  // the dbs removed are dropped
+  last_passes_.swap(last_passes);
+  std::lock_guard<std::mutex> g(lock_);
+  usage_.swap(usage);
+}
+
+std::vector<DBResourceCollector::DBUsage> DBResourceCollector::GetUsage()
+    const {
+  std::lock_guard<std::mutex> g(lock_);
+  return usage_;
+}
+
+std::string DBResourceCollector::DumpUsageAsText() const {
+  const auto usage = GetUsage();
+  std::string stats;
+  for (const auto& db_usage : usage) {
+    const char* db_name = db_usage.db_name.c_str();
+    stats += folly::stringPrintf(
+      "  pending_compaction_bytes db=%s: %" PRIu64 "\n", db_name,
+      db_usage.pending_compaction_bytes);
+    stats += folly::stringPrintf("  num_l0_files db=%s: %" PRIu64 "\n",
+                                 db_name, db_usage.num_l0_files);
+    stats += folly::stringPrintf("  write_stalled_ms db=%s: %" PRIu64 "\n",
+                                 db_name, db_usage.write_stalled_ms);
+    stats += folly::stringPrintf("  read_qps db=%s: %.1f\n", db_name,
+                                 db_usage.read_qps);
+    stats += folly::stringPrintf("  write_qps db=%s: %.1f\n", db_name,
+                                 db_usage.write_qps);
+    stats += folly::stringPrintf(
+      "  replication_seq_no_lag db=%s: %" PRIu64 "\n", db_name,
+      db_usage.replication_seq_no_lag);
+    stats += folly::stringPrintf(
+      "  replication_ms_since_last_apply db=%s: %" PRIu64 "\n", db_name,
+      db_usage.replication_ms_since_last_apply);
+  }
+
+  return stats;
+}
+
+std::string DBResourceCollector::DumpHottestDBsAsText(const uint32_t n) const {
+  auto usage = GetUsage();
+  const auto num_dbs = std::min<size_t>(n, usage.size());
+  std::partial_sort(usage.begin(), usage.begin() + num_dbs, usage.end(),
+    [] (const DBUsage& a, const DBUsage& b) {
+      return a.read_qps + a.write_qps > b.read_qps + b.write_qps;
+    });
+
+  std::string text =
+    "db read_qps write_qps mem_table_bytes table_readers_bytes "
+    "sst_file_bytes pending_compaction_bytes num_l0_files write_stalled_ms "
+    "replication_seq_no_lag\n";
+  for (size_t i = 0; i < num_dbs; ++i) {
+    const auto& db_usage = usage[i];
+    text += folly::stringPrintf(
+      "%s %.1f %.1f %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+      " %" PRIu64 " %" PRIu64 "\n",
+      db_usage.db_name.c_str(), db_usage.read_qps, db_usage.write_qps,
+      db_usage.mem_table_bytes, db_usage.table_readers_bytes,
+      db_usage.sst_file_bytes, db_usage.pending_compaction_bytes,
+      db_usage.num_l0_files, db_usage.write_stalled_ms,
+      db_usage.replication_seq_no_lag);
+  }
+
+  return text;
+}
+
+}  // namespace admin
@@ -0,0 +1,109 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rocksdb_admin/application_db_manager.h"
+
+namespace admin {
+
+// Collects the resource usage of all dbs of a host in one background pass
+// every interval, so that dumping it for capacity planning is cheap and
+// doesn't query rocksdb on each scrape.
+// Note: this class is thread-safe.
+class DBResourceCollector {
+ public:
+  // The resource usage of a db as of the last pass
+  struct DBUsage {
+    std::string db_name;
+    uint64_t mem_table_bytes;
+    uint64_t table_readers_bytes;
+    uint64_t sst_file_bytes;
+    uint64_t pending_compaction_bytes;
+    uint64_t num_l0_files;
+    // The time writes were found stalled by the passes, estimated as the
+    // whole interval for each pass finding them stalled
+    uint64_t write_stalled_ms;
+    double read_qps;
+    double write_qps;
+    uint64_t replication_seq_no_lag;
+    uint64_t replication_ms_since_last_apply;
+  };
+
+  // db_manager: (IN) The dbs to collect the usage of, which must outlive
+  //                  this object
+  // interval:   (IN) The time between the passes, 0 to collect them only
+  //                  by calling Collect()
+  DBResourceCollector(ApplicationDBManager* db_manager,
+                      const std::chrono::milliseconds interval);
+
+  // no copy nor move
+  DBResourceCollector(const DBResourceCollector&) = delete;
+  DBResourceCollector& operator=(const DBResourceCollector&) = delete;
+
+  // Run a pass now
+  void Collect();
+
+  // The usage of all dbs as of the last pass, in the order of db names
+  std::vector<DBUsage> GetUsage() const;
+
+  // Dump the usage of all dbs as a text string in the stats.txt format, e.g.
+  //   pending_compaction_bytes db=abc00001: 12345
+  std::string DumpUsageAsText() const;
+
+  // Dump the n dbs with the most reads and writes per second as a text
+  // string, one per line
+  std::string DumpHottestDBsAsText(const uint32_t n) const;
+
+  ~DBResourceCollector();
+
+ private:
+  // The counters of a db at the last pass, to get the rates since
+  struct LastPass {
+    uint64_t num_reads;
+    uint64_t num_writes;
+    uint64_t write_stalled_ms;
+    std::chrono::steady_clock::time_point time;
+  };
+
+  ApplicationDBManager* const db_manager_;
+  const std::chrono::milliseconds interval_;
+
+  mutable std::mutex lock_;
+  std::vector<DBUsage> usage_;
+  // db name -> its counters at the last pass, only used by Collect()
+  std::unordered_map<std::string, LastPass> last_passes_;
+  // serializes Collect()
+  std::mutex collect_lock_;
+
+  bool stop_;
+  std::condition_variable cv_;
+  std::unique_ptr<std::thread> thread_;
+};
+
+}  // namespace admin
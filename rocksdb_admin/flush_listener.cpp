@@ -0,0 +1,52 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/flush_listener.h"
+
+#include <memory>
+#include <utility>
+
+#include "rocksdb/db.h"
+
+namespace admin {
+
+FlushListener::FlushListener(Callback callback)
+    : callback_(std::move(callback)) {
+}
+
+void FlushListener::AddTo(Callback callback, rocksdb::Options* options) {
+  options->listeners.push_back(
+    std::make_shared<FlushListener>(std::move(callback)));
+}
+
+void FlushListener::OnFlushCompleted(rocksdb::DB* db,
+                                     const rocksdb::FlushJobInfo& info) {
+  if (info.cf_name != rocksdb::kDefaultColumnFamilyName) {
+    return;
+  }
+
+  auto path = db->GetName();
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+  const auto pos = path.rfind('/');
+  callback_(pos == std::string::npos ? path : path.substr(pos + 1),
+            info.largest_seqno);
+}
+
+}  // namespace admin
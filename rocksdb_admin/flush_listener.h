@@ -0,0 +1,52 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "rocksdb/listener.h"
+#include "rocksdb/options.h"
+#include "rocksdb/types.h"
+
+namespace admin {
+
+// Calls back with the largest seq # of each memtable flush of the default
+// column family. All updates up to it are then persisted, so it tells when
+// the updates written without the WAL are safe from a crash.
+// Note: callback is called on the flush threads of RocksDB.
+class FlushListener : public rocksdb::EventListener {
+ public:
+  // db_name: The last component of the path of the db
+  using Callback = std::function<void(const std::string& db_name,
+                                      rocksdb::SequenceNumber largest_seqno)>;
+
+  explicit FlushListener(Callback callback);
+
+  // Attach a new listener calling callback to options
+  static void AddTo(Callback callback, rocksdb::Options* options);
+
+  void OnFlushCompleted(rocksdb::DB* db,
+                        const rocksdb::FlushJobInfo& info) override;
+
+ private:
+  const Callback callback_;
+};
+
+}  // namespace admin
@@ -21,7 +21,9 @@
 #include "jni.h"
 
 #include <chrono>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <glog/logging.h>
 
 #include "common/network_util.h"
@@ -49,6 +51,11 @@ DEFINE_string(handoff_client_event_history_json_shard_map_path,
   "",
   "[Optional]: path of shard_map generated from spectator in json format");
 
+DEFINE_int32(helix_leader_cache_ttl_ms, 60 * 1000,
+             "How long GetLeaderInstanceId() caches the leaders it has looked "
+             "up. They are dropped earlier when the external view of their "
+             "resource changes. 0 disables the cache");
+
 namespace {
 
 JNIEnv* createVM(const std::string& class_path) {
@@ -202,6 +209,54 @@ std::string JStringToString(JNIEnv* env, jstring jstr) {
   return keyStr;
 }
 
+// The leaders looked up by GetLeaderInstanceId(), per resource
+struct LeaderCache {
+  struct Leader {
+    std::string instance_id;
+    std::chrono::steady_clock::time_point expiry;
+  };
+
+  struct Resource {
+    // bumped whenever the leaders are dropped, so that lookups racing with a
+    // change of the external view don't cache what they found
+    uint64_t generation = 0;
+    std::unordered_map<std::string, Leader> leaders;
+  };
+
+  std::mutex mutex;
+  // keyed by ResourceKey()
+  std::unordered_map<std::string, Resource> resources;
+};
+
+LeaderCache* GetLeaderCache() {
+  // leaked, the JVM may call OnExternalViewChange() during shutdown
+  static auto cache = new LeaderCache();
+  return cache;
+}
+
+// The same key as HelixClient uses for its watches
+std::string ResourceKey(const std::string& zk_connect_str,
+                        const std::string& cluster,
+                        const std::string& resource) {
+  return zk_connect_str + "/" + cluster + "/" + resource;
+}
+
+// HelixClient.onExternalViewChange(), called by the zk watch of the external
+// view of a resource
+void JNICALL OnExternalViewChange(JNIEnv* env, jclass,
+                                  jstring zk_connect_str,
+                                  jstring cluster,
+                                  jstring resource) {
+  const auto key = ResourceKey(JStringToString(env, zk_connect_str),
+                               JStringToString(env, cluster),
+                               JStringToString(env, resource));
+  auto cache = GetLeaderCache();
+  std::lock_guard<std::mutex> g(cache->mutex);
+  auto& cached = cache->resources[key];
+  ++cached.generation;
+  cached.leaders.clear();
+}
+
 } // namespace
 
 namespace admin {
@@ -267,6 +322,20 @@ std::string GetLeaderInstanceId(
   const std::string& cluster,
   const std::string& resource,
   const std::string& partition) {
+    const auto key = ResourceKey(zk_connect_str, cluster, resource);
+    auto cache = GetLeaderCache();
+    uint64_t generation = 0;
+    {
+      std::lock_guard<std::mutex> g(cache->mutex);
+      auto& cached = cache->resources[key];
+      auto itor = cached.leaders.find(partition);
+      if (itor != cached.leaders.end() &&
+          std::chrono::steady_clock::now() < itor->second.expiry) {
+        return itor->second.instance_id;
+      }
+      generation = cached.generation;
+    }
+
     auto env = getRunningVM();
     std::string leaderInstanceId;
 
@@ -282,6 +351,20 @@ std::string GetLeaderInstanceId(
         return leaderInstanceId;
     }
 
+    // The watches installed by the lookups call back into the cache
+    static std::once_flag natives_registered;
+    std::call_once(natives_registered, [env, HelixClientClass] {
+      JNINativeMethod method;
+      method.name = const_cast<char*>("onExternalViewChange");
+      method.signature = const_cast<char*>(
+        "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
+      method.fnPtr = reinterpret_cast<void*>(&OnExternalViewChange);
+      if (env->RegisterNatives(HelixClientClass, &method, 1) != JNI_OK) {
+        env->ExceptionDescribe();
+        LOG(ERROR) << "Failed to register HelixClient.onExternalViewChange()";
+      }
+    });
+
     jmethodID getLeaderInstanceIdMethod = env->GetStaticMethodID(
       HelixClientClass,
       "getleaderInstanceId",
@@ -303,7 +386,21 @@ std::string GetLeaderInstanceId(
     jstring jstr = (jstring)env->CallStaticObjectMethod(HelixClientClass,
       getLeaderInstanceIdMethod, j_zk_str, j_cluster, j_resource, j_partition);
 
-    return JStringToString(env, jstr);
+    leaderInstanceId = JStringToString(env, jstr);
+    // "No leader" is only a moment of a failover, and errors are also empty.
+    // Neither is cached, as the watch clearing them may not have been set up.
+    if (FLAGS_helix_leader_cache_ttl_ms > 0 && !leaderInstanceId.empty()) {
+      std::lock_guard<std::mutex> g(cache->mutex);
+      auto& cached = cache->resources[key];
+      if (cached.generation == generation) {
+        cached.leaders[partition] = LeaderCache::Leader{
+          leaderInstanceId,
+          std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(FLAGS_helix_leader_cache_ttl_ms)};
+      }
+    }
+
+    return leaderInstanceId;
 }
 
 }  // namespace admin
@@ -51,6 +51,12 @@ void JoinCluster(const std::string& zk_connect_str,
  */
 void DisconnectHelixManager();
 
+/*
+ * Return the helix instance id of the leader of partition, empty if there is
+ * none or on errors. The leaders found are cached for
+ * --helix_leader_cache_ttl_ms, or until the external view of their resource
+ * changes. Empty results are never cached.
+ */
 std::string GetLeaderInstanceId(
   const std::string& zk_connect_str,
   const std::string& cluster,
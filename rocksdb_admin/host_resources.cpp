@@ -0,0 +1,322 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/host_resources.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <vector>
+
+#include "common/rocksdb_glogger/rocksdb_glogger.h"
+#include "folly/Conv.h"
+#include "folly/String.h"
+#include "folly/hash/SpookyHashV2.h"
+#include "glog/logging.h"
+#include "rocksdb/env.h"
+#include "rocksdb/table.h"
+
+namespace admin {
+
+// One slot of the admission filter per this many bytes of flash cache, about
+// a block
+const int64_t kFlashCacheBytesPerAdmissionSlot = 16 * 1024;
+
+namespace {
+
+// The number of jemalloc arenas, 0 if unknown
+unsigned NumJemallocArenas() {
+  unsigned n_arenas = 0;
+  size_t size = sizeof(n_arenas);
+  if (mallctl("arenas.narenas", &n_arenas, &size, nullptr, 0) != 0) {
+    return 0;
+  }
+  return n_arenas;
+}
+
+}  // namespace
+
+// Wraps a flash cache to only admit the blocks missed before. The blocks
+// missed once are remembered by the hashes of their keys in a fixed table,
+// where a newer block takes the slot of an older one.
+class AdmittingPersistentCache : public rocksdb::PersistentCache {
+ public:
+  AdmittingPersistentCache(std::shared_ptr<rocksdb::PersistentCache> cache,
+                           const size_t n_slots)
+      : cache_(std::move(cache))
+      , seen_(n_slots)
+      , rejected_(0) {}
+
+  rocksdb::Status Insert(const rocksdb::Slice& key, const char* data,
+                         const size_t size) override {
+    if (!seen_.empty()) {
+      // 0 is an empty slot
+      const uint64_t hash =
+        folly::hash::SpookyHashV2::Hash64(key.data(), key.size(), 0) | 1;
+      if (seen_[hash % seen_.size()].exchange(
+            hash, std::memory_order_relaxed) != hash) {
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return rocksdb::Status::OK();
+      }
+    }
+    return cache_->Insert(key, data, size);
+  }
+
+  rocksdb::Status Lookup(const rocksdb::Slice& key,
+                         std::unique_ptr<char[]>* data,
+                         size_t* size) override {
+    return cache_->Lookup(key, data, size);
+  }
+
+  bool IsCompressed() override {
+    return cache_->IsCompressed();
+  }
+
+  StatsType Stats() override {
+    return cache_->Stats();
+  }
+
+  std::string GetPrintableOptions() const override {
+    return cache_->GetPrintableOptions();
+  }
+
+  // Number of blocks not admitted
+  uint64_t rejected() const {
+    return rejected_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::shared_ptr<rocksdb::PersistentCache> cache_;
+  std::vector<std::atomic<uint64_t>> seen_;
+  std::atomic<uint64_t> rejected_;
+};
+
+HostResources::HostResources(const int64_t block_cache_bytes,
+                             const bool use_clock_cache,
+                             const std::string& segment_shares,
+                             const int64_t write_buffer_bytes,
+                             const int64_t rate_limit_bytes_sec,
+                             const std::string& flash_cache_path,
+                             const int64_t flash_cache_bytes,
+                             const bool flash_cache_admit_on_second_miss,
+                             const bool block_cache_own_arena)
+    : use_clock_cache_(use_clock_cache)
+#if ROCKSDB_MAJOR >= 6
+    , block_cache_allocator_(nullptr)
+#endif
+    , block_cache_arena_(-1)
+    , block_cache_(nullptr)
+    , segment_block_caches_()
+    , write_buffer_manager_(nullptr)
+    , rate_limiter_(nullptr)
+    , flash_cache_(nullptr)
+    , flash_cache_bytes_(flash_cache_bytes)
+    , statistics_(nullptr) {
+  if (block_cache_bytes > 0 && block_cache_own_arena) {
+#if ROCKSDB_MAJOR >= 6
+    // The allocator creates the arena, which is the one added last
+    const auto n_arenas = NumJemallocArenas();
+    rocksdb::JemallocAllocatorOptions allocator_options;
+    auto status = rocksdb::NewJemallocNodumpAllocator(allocator_options,
+                                                      &block_cache_allocator_);
+    if (status.ok()) {
+      if (n_arenas > 0 && NumJemallocArenas() == n_arenas + 1) {
+        block_cache_arena_ = n_arenas;
+      }
+      LOG(INFO) << "Block caches allocate from jemalloc arena "
+                << block_cache_arena_;
+    } else {
+      // e.g., rocksdb is built without jemalloc
+      LOG(ERROR) << "Failed to create a jemalloc arena for the block caches: "
+                 << status.ToString();
+      block_cache_allocator_ = nullptr;
+    }
+#else
+    LOG(ERROR) << "Block caches can't have their own jemalloc arena before "
+               << "rocksdb 6.0, ignoring it";
+#endif
+  }
+
+  if (block_cache_bytes > 0) {
+    std::vector<folly::StringPiece> shares;
+    folly::split(",", segment_shares, shares, true);
+    double shared_fraction = 1;
+    for (const auto& share : shares) {
+      std::string segment;
+      double fraction;
+      CHECK(folly::split(":", share, segment, fraction) &&
+            fraction > 0 && fraction < 1)
+        << "Invalid block cache share: " << share;
+      shared_fraction -= fraction;
+      segment_block_caches_[segment] =
+        NewCache(static_cast<int64_t>(block_cache_bytes * fraction));
+    }
+    CHECK(shared_fraction > 0)
+      << "The block cache shares of segments add up to 1 or more";
+    block_cache_ =
+      NewCache(static_cast<int64_t>(block_cache_bytes * shared_fraction));
+  }
+
+  if (write_buffer_bytes > 0) {
+    // Charge the memtables to the shared block cache, so that they take
+    // cache space rather than come on top of it
+    write_buffer_manager_ = std::make_shared<rocksdb::WriteBufferManager>(
+      write_buffer_bytes, block_cache_);
+  }
+
+  if (rate_limit_bytes_sec > 0) {
+    rate_limiter_.reset(rocksdb::NewGenericRateLimiter(rate_limit_bytes_sec));
+  }
+
+  if (flash_cache_bytes > 0 && !flash_cache_path.empty()) {
+    std::shared_ptr<rocksdb::PersistentCache> cache;
+    // Left over cache files are deleted, as the cache isn't persisted
+    // across restarts
+    auto status = rocksdb::NewPersistentCache(
+      rocksdb::Env::Default(), flash_cache_path, flash_cache_bytes,
+      std::make_shared<common::RocksdbGLogger>(), true /* optimized_for_nvm */,
+      &cache);
+    CHECK(status.ok()) << "Failed to create the flash cache at "
+                       << flash_cache_path << ": " << status.ToString();
+    flash_cache_ = std::make_shared<AdmittingPersistentCache>(
+      std::move(cache),
+      flash_cache_admit_on_second_miss ?
+        std::max<int64_t>(flash_cache_bytes / kFlashCacheBytesPerAdmissionSlot,
+                          1) :
+        0);
+    statistics_ = rocksdb::CreateDBStatistics();
+  }
+}
+
+bool HostResources::Enabled() const {
+  return block_cache_ || write_buffer_manager_ || rate_limiter_ ||
+    flash_cache_;
+}
+
+void HostResources::Apply(const std::string& segment,
+                          rocksdb::Options* options) const {
+  if ((block_cache_ || flash_cache_) && options->table_factory &&
+      std::string(options->table_factory->Name()) == "BlockBasedTable") {
+    auto table_options = *static_cast<rocksdb::BlockBasedTableOptions*>(
+      options->table_factory->GetOptions());
+    if (block_cache_) {
+      auto itor = segment_block_caches_.find(segment);
+      table_options.block_cache =
+        itor == segment_block_caches_.end() ? block_cache_ : itor->second;
+      table_options.no_block_cache = false;
+    }
+    if (flash_cache_) {
+      table_options.persistent_cache = flash_cache_;
+    }
+    options->table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+  }
+
+  if (statistics_) {
+    options->statistics = statistics_;
+  }
+
+  if (write_buffer_manager_) {
+    options->write_buffer_manager = write_buffer_manager_;
+  }
+
+  if (rate_limiter_) {
+    options->rate_limiter = rate_limiter_;
+  }
+}
+
+std::string HostResources::DumpUsageAsText() const {
+  std::string stats;
+  if (block_cache_) {
+    stats += folly::stringPrintf(
+      "  host_block_cache_usage: %zu\n"
+      "  host_block_cache_pinned_usage: %zu\n"
+      "  host_block_cache_capacity: %zu\n",
+      block_cache_->GetUsage(), block_cache_->GetPinnedUsage(),
+      block_cache_->GetCapacity());
+    if (block_cache_arena_ >= 0) {
+      // to look up the jemalloc_arena_* stats of the block caches
+      stats += folly::stringPrintf("  host_block_cache_jemalloc_arena: %" PRId64
+                                   "\n", block_cache_arena_);
+    }
+  }
+  for (const auto& segment_cache : segment_block_caches_) {
+    stats += folly::stringPrintf(
+      "  host_block_cache_usage segment=%s: %zu\n"
+      "  host_block_cache_capacity segment=%s: %zu\n",
+      segment_cache.first.c_str(), segment_cache.second->GetUsage(),
+      segment_cache.first.c_str(), segment_cache.second->GetCapacity());
+  }
+  if (flash_cache_) {
+    // Each tier is looked up for the blocks missing the one above it
+    const auto ratio = [] (uint64_t hits, uint64_t misses) {
+      return hits + misses == 0 ? 0.0 :
+        static_cast<double>(hits) / (hits + misses);
+    };
+    const auto block_hits =
+      statistics_->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+    const auto block_misses =
+      statistics_->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+    const auto flash_hits =
+      statistics_->getTickerCount(rocksdb::PERSISTENT_CACHE_HIT);
+    const auto flash_misses =
+      statistics_->getTickerCount(rocksdb::PERSISTENT_CACHE_MISS);
+    stats += folly::stringPrintf(
+      "  host_block_cache_hits: %" PRIu64 "\n"
+      "  host_block_cache_misses: %" PRIu64 "\n"
+      "  host_block_cache_hit_ratio: %.4f\n"
+      "  host_flash_cache_hits: %" PRIu64 "\n"
+      "  host_flash_cache_misses: %" PRIu64 "\n"
+      "  host_flash_cache_hit_ratio: %.4f\n"
+      "  host_flash_cache_rejected_inserts: %" PRIu64 "\n"
+      "  host_flash_cache_capacity: %" PRId64 "\n",
+      block_hits, block_misses, ratio(block_hits, block_misses),
+      flash_hits, flash_misses, ratio(flash_hits, flash_misses),
+      flash_cache_->rejected(), flash_cache_bytes_);
+  }
+  if (write_buffer_manager_) {
+    stats += folly::stringPrintf(
+      "  host_write_buffer_usage: %zu\n"
+      "  host_write_buffer_size: %zu\n",
+      write_buffer_manager_->memory_usage(),
+      write_buffer_manager_->buffer_size());
+  }
+  return stats;
+}
+
+std::shared_ptr<rocksdb::Cache> HostResources::NewCache(
+    const int64_t capacity) const {
+  if (use_clock_cache_) {
+    // nullptr if rocksdb is built without clock cache support
+    auto cache = rocksdb::NewClockCache(capacity);
+    if (cache) {
+      return cache;
+    }
+    LOG(ERROR) << "Clock cache is not supported, using an LRU cache";
+  }
+#if ROCKSDB_MAJOR >= 6
+  rocksdb::LRUCacheOptions options;
+  options.capacity = capacity;
+  options.memory_allocator = block_cache_allocator_;
+  return rocksdb::NewLRUCache(options);
+#else
+  return rocksdb::NewLRUCache(capacity);
+#endif
+}
+
+}  // namespace admin
@@ -0,0 +1,119 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "rocksdb/cache.h"
+#include "rocksdb/version.h"
+#if ROCKSDB_MAJOR >= 6
+#include "rocksdb/memory_allocator.h"
+#endif
+#include "rocksdb/options.h"
+#include "rocksdb/persistent_cache.h"
+#include "rocksdb/rate_limiter.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/write_buffer_manager.h"
+
+namespace admin {
+
+class AdmittingPersistentCache;
+
+// The rocksdb resources shared by all dbs of a host: a block cache, a flash
+// cache under it, a budget for the memtables charged to the block cache and a
+// rate limiter for flushes and compactions. With the dbs drawing from them,
+// memory stays bounded however many dbs the host opens, and the hot dbs get
+// most of the cache.
+// Note: this class is thread-safe.
+class HostResources {
+ public:
+  // block_cache_bytes:    (IN) Size of the shared block cache, 0 to keep the
+  //                            caches of the options as they are
+  // use_clock_cache:      (IN) Use a clock cache rather than an LRU one
+  // segment_shares:       (IN) Comma separated segment:fraction pairs. Each
+  //                            listed segment gets that fraction of
+  //                            block_cache_bytes for itself, and all other
+  //                            segments share the rest.
+  // write_buffer_bytes:   (IN) Memtable budget of all dbs, 0 for none
+  // rate_limit_bytes_sec: (IN) Flush and compaction writes per second of all
+  //                            dbs, 0 for no limit
+  // flash_cache_path:     (IN) Dir of a flash cache of compressed blocks under
+  //                            the block caches, shared by all dbs
+  // flash_cache_bytes:    (IN) Size of the flash cache, 0 for none
+  // flash_cache_admit_on_second_miss:
+  //                       (IN) Only put a block into the flash cache the
+  //                            second time it misses, so that the blocks read
+  //                            once don't push out the ones read again
+  // block_cache_own_arena:
+  //                       (IN) Allocate the blocks of the block caches from a
+  //                            jemalloc arena of their own, so that their
+  //                            footprint shows apart from the rest of the
+  //                            heap, e.g., Thrift buffers, and the holes left
+  //                            by the other allocations don't hold them.
+  //                            Ignored before rocksdb 6.0.
+  HostResources(const int64_t block_cache_bytes,
+                const bool use_clock_cache,
+                const std::string& segment_shares,
+                const int64_t write_buffer_bytes,
+                const int64_t rate_limit_bytes_sec,
+                const std::string& flash_cache_path = "",
+                const int64_t flash_cache_bytes = 0,
+                const bool flash_cache_admit_on_second_miss = true,
+                const bool block_cache_own_arena = false);
+
+  // no copy nor move
+  HostResources(const HostResources&) = delete;
+  HostResources& operator=(const HostResources&) = delete;
+
+  // Whether any resource is shared
+  bool Enabled() const;
+
+  // Make the options of a db of segment use the shared resources
+  // segment: (IN) Segment of the db
+  // options: (IN/OUT) Options of the db
+  void Apply(const std::string& segment, rocksdb::Options* options) const;
+
+  // Dump the usage of the shared resources as a text string
+  std::string DumpUsageAsText() const;
+
+ private:
+  std::shared_ptr<rocksdb::Cache> NewCache(const int64_t capacity) const;
+
+  const bool use_clock_cache_;
+#if ROCKSDB_MAJOR >= 6
+  // The allocator of the block caches with their own arena, if any
+  std::shared_ptr<rocksdb::MemoryAllocator> block_cache_allocator_;
+#endif
+  // The index of that arena, -1 if unknown
+  int64_t block_cache_arena_;
+  std::shared_ptr<rocksdb::Cache> block_cache_;
+  std::unordered_map<std::string, std::shared_ptr<rocksdb::Cache>>
+    segment_block_caches_;
+  std::shared_ptr<rocksdb::WriteBufferManager> write_buffer_manager_;
+  std::shared_ptr<rocksdb::RateLimiter> rate_limiter_;
+  std::shared_ptr<AdmittingPersistentCache> flash_cache_;
+  int64_t flash_cache_bytes_;
+  // The block cache and flash cache tickers of the dbs, for the hit ratios
+  // of the two tiers. Only set with a flash cache.
+  std::shared_ptr<rocksdb::Statistics> statistics_;
+};
+
+}  // namespace admin
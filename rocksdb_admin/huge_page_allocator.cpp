@@ -0,0 +1,198 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/huge_page_allocator.h"
+
+#if ROCKSDB_MAJOR >= 6
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+namespace {
+
+const size_t kHugePageBytes = 2 << 20;
+const size_t kMinClassBytes = 64;
+const size_t kMaxClassBytes = 1 << 20;
+// Each block is preceded by the index of its class, keeping the 16 bytes
+// alignment of malloc()
+const size_t kHeaderBytes = 16;
+const uint32_t kMallocClass = UINT32_MAX;
+
+uint32_t* Header(void* p) {
+  return reinterpret_cast<uint32_t*>(static_cast<char*>(p) - kHeaderBytes);
+}
+
+}  // namespace
+
+namespace admin {
+
+HugePageAllocator::HugePageAllocator(size_t region_bytes,
+                                     size_t max_mapped_bytes)
+    : region_bytes_(std::max<size_t>(
+        (region_bytes + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes,
+        kHugePageBytes))
+    , max_regions_(max_mapped_bytes == 0 ? SIZE_MAX :
+        std::max<size_t>(max_mapped_bytes / region_bytes_, 1))
+    , class_sizes_()
+    , classes_()
+    , regions_mutex_()
+    , regions_()
+    , next_(nullptr)
+    , remaining_(0)
+    , hugetlb_regions_(0)
+    , thp_regions_(0)
+    , allocated_bytes_(0)
+    , fallback_allocations_(0) {
+  for (size_t base = kMinClassBytes; base < kMaxClassBytes; base *= 2) {
+    for (size_t i = 0; i < 4; ++i) {
+      class_sizes_.push_back(base + i * base / 4);
+    }
+  }
+  class_sizes_.push_back(kMaxClassBytes);
+  classes_.reset(new SizeClass[class_sizes_.size()]);
+}
+
+HugePageAllocator::~HugePageAllocator() {
+  for (auto region : regions_) {
+    munmap(region, region_bytes_);
+  }
+}
+
+void* HugePageAllocator::Allocate(size_t size) {
+  const auto bytes = size + kHeaderBytes;
+  const auto class_index = FindClass(bytes);
+  char* block = nullptr;
+  if (class_index < class_sizes_.size()) {
+    auto& size_class = classes_[class_index];
+    {
+      std::lock_guard<std::mutex> g(size_class.mutex);
+      if (size_class.free_list != nullptr) {
+        block = static_cast<char*>(size_class.free_list);
+        size_class.free_list = *reinterpret_cast<void**>(block);
+      }
+    }
+    if (block == nullptr) {
+      block = Carve(class_sizes_[class_index]);
+    }
+  }
+
+  if (block == nullptr) {
+    block = static_cast<char*>(malloc(bytes));
+    if (block == nullptr) {
+      return nullptr;
+    }
+    *reinterpret_cast<uint32_t*>(block) = kMallocClass;
+    fallback_allocations_.fetch_add(1, std::memory_order_relaxed);
+    return block + kHeaderBytes;
+  }
+
+  *reinterpret_cast<uint32_t*>(block) = static_cast<uint32_t>(class_index);
+  allocated_bytes_.fetch_add(class_sizes_[class_index],
+                             std::memory_order_relaxed);
+  return block + kHeaderBytes;
+}
+
+void HugePageAllocator::Deallocate(void* p) {
+  if (p == nullptr) {
+    return;
+  }
+
+  const auto class_index = *Header(p);
+  char* block = reinterpret_cast<char*>(Header(p));
+  if (class_index == kMallocClass) {
+    free(block);
+    return;
+  }
+
+  allocated_bytes_.fetch_sub(class_sizes_[class_index],
+                             std::memory_order_relaxed);
+  auto& size_class = classes_[class_index];
+  std::lock_guard<std::mutex> g(size_class.mutex);
+  *reinterpret_cast<void**>(block) = size_class.free_list;
+  size_class.free_list = block;
+}
+
+size_t HugePageAllocator::UsableSize(void* p, size_t allocation_size) const {
+  const auto class_index = *Header(p);
+  if (class_index == kMallocClass) {
+    return allocation_size;
+  }
+  return class_sizes_[class_index] - kHeaderBytes;
+}
+
+HugePageAllocator::Stats HugePageAllocator::GetStats() const {
+  return Stats{
+    hugetlb_regions_.load(),
+    thp_regions_.load(),
+    allocated_bytes_.load(),
+    fallback_allocations_.load()};
+}
+
+size_t HugePageAllocator::FindClass(size_t bytes) const {
+  return std::lower_bound(class_sizes_.begin(), class_sizes_.end(), bytes) -
+    class_sizes_.begin();
+}
+
+char* HugePageAllocator::Carve(size_t bytes) {
+  std::lock_guard<std::mutex> g(regions_mutex_);
+  if (remaining_ < bytes) {
+    if (regions_.size() >= max_regions_) {
+      LOG_FIRST_N(WARNING, 1) << "Mapped " << regions_.size() << " block "
+                              << "cache regions, the max. Using malloc()";
+      return nullptr;
+    }
+
+    // The tail of the current region, smaller than a block, is left unused
+    void* region = mmap(nullptr, region_bytes_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+      hugetlb_regions_.fetch_add(1);
+    } else {
+      LOG_FIRST_N(WARNING, 1) << "Not enough huge pages reserved for the "
+                              << "block cache, see vm.nr_hugepages. Using "
+                              << "transparent huge pages";
+      region = mmap(nullptr, region_bytes_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (region == MAP_FAILED) {
+        LOG_FIRST_N(ERROR, 1) << "Failed to map a block cache region of "
+                              << region_bytes_ << " bytes";
+        return nullptr;
+      }
+      // Fails if THP is disabled, leaving the region with 4KB pages
+      madvise(region, region_bytes_, MADV_HUGEPAGE);
+      thp_regions_.fetch_add(1);
+    }
+
+    regions_.push_back(static_cast<char*>(region));
+    next_ = static_cast<char*>(region);
+    remaining_ = region_bytes_;
+  }
+
+  auto block = next_;
+  next_ += bytes;
+  remaining_ -= bytes;
+  return block;
+}
+
+}  // namespace admin
+
+#endif  // ROCKSDB_MAJOR >= 6
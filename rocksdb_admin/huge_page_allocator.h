@@ -0,0 +1,118 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "rocksdb/version.h"
+
+// rocksdb::MemoryAllocator is not there before rocksdb 6.0
+#if ROCKSDB_MAJOR >= 6
+
+#include "rocksdb/memory_allocator.h"
+
+namespace admin {
+
+// A block cache allocator carving the blocks out of big regions backed by
+// huge pages, so that a block cache of many GBs takes few TLB entries.
+//
+// Regions are mapped with MAP_HUGETLB from the pages reserved by
+// vm.nr_hugepages. Without enough of them, they are mapped with 4KB pages
+// and advised to be backed by transparent huge pages instead, and blocks
+// are malloc()ed if regions can't be mapped at all.
+//
+// Blocks are rounded up to size classes, 4 per power of 2, and the freed
+// ones are kept for blocks of the same class. Regions are never unmapped,
+// and the free blocks of a class aren't reused by the others, so the
+// regions are capped at max_mapped_bytes. Beyond it, and for blocks larger
+// than the biggest class, blocks are malloc()ed.
+// Note: this class is thread-safe.
+class HugePageAllocator : public rocksdb::MemoryAllocator {
+ public:
+  struct Stats {
+    // regions backed by reserved huge pages
+    uint64_t hugetlb_regions;
+    // regions backed by transparent huge pages, if the kernel finds them
+    uint64_t thp_regions;
+    // bytes of the blocks in use, rounded up to their size classes
+    uint64_t allocated_bytes;
+    // blocks malloc()ed, as they are too big, the regions are capped or no
+    // region could be mapped
+    uint64_t fallback_allocations;
+  };
+
+  // region_bytes:     (IN) Size of the regions, rounded up to 2MB
+  // max_mapped_bytes: (IN) Max total size of the regions, 0 for no cap. At
+  //                        least one region is mapped.
+  explicit HugePageAllocator(size_t region_bytes = 64 << 20,
+                             size_t max_mapped_bytes = 0);
+  ~HugePageAllocator() override;
+
+  // no copy nor move
+  HugePageAllocator(const HugePageAllocator&) = delete;
+  HugePageAllocator& operator=(const HugePageAllocator&) = delete;
+
+  const char* Name() const override {
+    return "HugePageAllocator";
+  }
+
+  void* Allocate(size_t size) override;
+  void Deallocate(void* p) override;
+  size_t UsableSize(void* p, size_t allocation_size) const override;
+
+  Stats GetStats() const;
+
+ private:
+  struct SizeClass {
+    std::mutex mutex;
+    // linked through the first word of the freed blocks
+    void* free_list = nullptr;
+  };
+
+  // The index of the smallest class holding bytes, or class_sizes_.size()
+  size_t FindClass(size_t bytes) const;
+
+  // Carve bytes out of the current region, mapping a new one if needed.
+  // Return nullptr if no more region can be mapped.
+  char* Carve(size_t bytes);
+
+  const size_t region_bytes_;
+  const size_t max_regions_;
+  std::vector<size_t> class_sizes_;
+  std::unique_ptr<SizeClass[]> classes_;
+
+  std::mutex regions_mutex_;
+  std::vector<char*> regions_;
+  char* next_;
+  size_t remaining_;
+
+  std::atomic<uint64_t> hugetlb_regions_;
+  std::atomic<uint64_t> thp_regions_;
+  std::atomic<uint64_t> allocated_bytes_;
+  std::atomic<uint64_t> fallback_allocations_;
+};
+
+}  // namespace admin
+
+#endif  // ROCKSDB_MAJOR >= 6
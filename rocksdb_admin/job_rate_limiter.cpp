@@ -0,0 +1,107 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/job_rate_limiter.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace admin {
+
+JobRateLimiter::JobRateLimiter(std::shared_ptr<rocksdb::RateLimiter> shared,
+                               const int64_t bytes_per_sec)
+    : shared_(std::move(shared))
+    , own_(bytes_per_sec > 0 ?
+             rocksdb::NewGenericRateLimiter(bytes_per_sec) : nullptr)
+    , shared_lock_()
+    , start_(std::chrono::steady_clock::now())
+    , bytes_through_(0)
+    , requests_(0) {}
+
+void JobRateLimiter::SetBytesPerSecond(int64_t bytes_per_second) {
+  if (own_ && bytes_per_second > 0) {
+    own_->SetBytesPerSecond(bytes_per_second);
+  }
+}
+
+void JobRateLimiter::Request(const int64_t bytes,
+                             const rocksdb::Env::IOPriority pri) {
+  Request(bytes, pri, nullptr);
+}
+
+void JobRateLimiter::Request(const int64_t bytes,
+                             const rocksdb::Env::IOPriority pri,
+                             rocksdb::Statistics* stats) {
+  bytes_through_ += bytes;
+  ++requests_;
+
+  // The limiters take at most a burst per request
+  const auto burst = GetSingleBurstBytes();
+  for (int64_t left = bytes; left > 0; left -= burst) {
+    const auto chunk = std::min(left, burst);
+    // Waiting for its own limit doesn't hold the other jobs back
+    if (own_) {
+      own_->Request(chunk, pri, stats);
+    }
+    if (shared_) {
+      std::lock_guard<std::mutex> g(shared_lock_);
+      shared_->Request(chunk, pri, stats);
+    }
+  }
+}
+
+int64_t JobRateLimiter::GetSingleBurstBytes() const {
+  auto burst = std::numeric_limits<int64_t>::max();
+  if (own_) {
+    burst = std::min(burst, own_->GetSingleBurstBytes());
+  }
+  if (shared_) {
+    burst = std::min(burst, shared_->GetSingleBurstBytes());
+  }
+  return std::max<int64_t>(burst, 1);
+}
+
+int64_t JobRateLimiter::GetTotalBytesThrough(
+    const rocksdb::Env::IOPriority pri) const {
+  return bytes_through_.load();
+}
+
+int64_t JobRateLimiter::GetTotalRequests(
+    const rocksdb::Env::IOPriority pri) const {
+  return requests_.load();
+}
+
+int64_t JobRateLimiter::GetBytesPerSecond() const {
+  auto rate = std::numeric_limits<int64_t>::max();
+  if (own_) {
+    rate = std::min(rate, own_->GetBytesPerSecond());
+  }
+  if (shared_) {
+    rate = std::min(rate, shared_->GetBytesPerSecond());
+  }
+  return rate;
+}
+
+int64_t JobRateLimiter::GetThroughput() const {
+  const auto elapsed_ms = std::chrono::duration_cast<
+    std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_)
+    .count();
+  return bytes_through_.load() * 1000 / std::max<int64_t>(elapsed_ms, 1);
+}
+
+}  // namespace admin
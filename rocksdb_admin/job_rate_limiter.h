@@ -0,0 +1,84 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#include "rocksdb/env.h"
+#include "rocksdb/rate_limiter.h"
+
+namespace admin {
+
+// The rate limiter of one job, e.g. the backup of a db, drawing from a rate
+// limiter shared by all such jobs of the host. A job has at most one request
+// waiting for the shared limiter at a time, so that the waiting jobs are
+// served in turn and get even shares of it, however many threads each of
+// them copies files with. A rate limit of the job's own applies on top.
+// It also counts the bytes through it, for the throughput of the job.
+// Note: this class is thread-safe.
+class JobRateLimiter : public rocksdb::RateLimiter {
+ public:
+  // shared:          (IN) The limiter shared with the other jobs, nullptr for
+  //                       none
+  // bytes_per_sec:   (IN) The rate limit of the job alone, 0 for none
+  JobRateLimiter(std::shared_ptr<rocksdb::RateLimiter> shared,
+                 const int64_t bytes_per_sec);
+
+  // no copy nor move
+  JobRateLimiter(const JobRateLimiter&) = delete;
+  JobRateLimiter& operator=(const JobRateLimiter&) = delete;
+
+  // Only changes the limit of the job's own, if it has one
+  void SetBytesPerSecond(int64_t bytes_per_second) override;
+
+  void Request(const int64_t bytes, const rocksdb::Env::IOPriority pri)
+    override;
+
+  void Request(const int64_t bytes, const rocksdb::Env::IOPriority pri,
+               rocksdb::Statistics* stats) override;
+
+  int64_t GetSingleBurstBytes() const override;
+
+  int64_t GetTotalBytesThrough(
+    const rocksdb::Env::IOPriority pri = rocksdb::Env::IO_TOTAL) const
+    override;
+
+  int64_t GetTotalRequests(
+    const rocksdb::Env::IOPriority pri = rocksdb::Env::IO_TOTAL) const
+    override;
+
+  int64_t GetBytesPerSecond() const override;
+
+  // The bytes through the limiter per second since it was created
+  int64_t GetThroughput() const;
+
+ private:
+  const std::shared_ptr<rocksdb::RateLimiter> shared_;
+  std::unique_ptr<rocksdb::RateLimiter> own_;
+  // held while waiting for shared_
+  std::mutex shared_lock_;
+  const std::chrono::steady_clock::time_point start_;
+  std::atomic<int64_t> bytes_through_;
+  std::atomic<int64_t> requests_;
+};
+
+}  // namespace admin
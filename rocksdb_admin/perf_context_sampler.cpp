@@ -0,0 +1,170 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/perf_context_sampler.h"
+
+#include <algorithm>
+
+#include "folly/Random.h"
+
+DEFINE_int32(application_db_perf_context_sample_rate, 0,
+             "Measure 1 in this many Get(), MultiGet() and Write() calls of "
+             "ApplicationDB with the RocksDB PerfContext, into per segment "
+             "metrics. 0 disables the sampling");
+
+namespace {
+
+using Perf = rocksdb::PerfContext;
+using IOStats = rocksdb::IOStatsContext;
+
+struct MetricDef {
+  const char* name;
+  uint64_t (*value)(const Perf&, const IOStats&);
+};
+
+uint64_t MutexWaitUs(const Perf& perf, const IOStats&) {
+  return (perf.db_mutex_lock_nanos + perf.db_condition_wait_nanos) / 1000;
+}
+
+// The costs of a read, mostly spent in the memtables or in the sst files
+const MetricDef kReadMetrics[] = {
+  {"block_reads", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.block_read_count;
+    }},
+  {"block_read_bytes", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.block_read_byte;
+    }},
+  {"block_read_us", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.block_read_time / 1000;
+    }},
+  {"block_cache_hits", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.block_cache_hit_count;
+    }},
+  // the sst files skipped thanks to their bloom filters
+  {"bloom_filtered", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.bloom_sst_miss_count;
+    }},
+  {"memtable_us", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.get_from_memtable_time / 1000;
+    }},
+  {"merge_us", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.merge_operator_time_nanos / 1000;
+    }},
+  {"mutex_wait_us", MutexWaitUs},
+  {"io_read_bytes", [] (const Perf&, const IOStats& iostats) -> uint64_t {
+      return iostats.bytes_read;
+    }},
+};
+
+const MetricDef kWriteMetrics[] = {
+  {"wal_us", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.write_wal_time / 1000;
+    }},
+  {"memtable_us", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.write_memtable_time / 1000;
+    }},
+  // the time the write was slowed down or stopped by RocksDB
+  {"delay_us", [] (const Perf& perf, const IOStats&) -> uint64_t {
+      return perf.write_delay_time / 1000;
+    }},
+  {"mutex_wait_us", MutexWaitUs},
+  {"io_write_bytes", [] (const Perf&, const IOStats& iostats) -> uint64_t {
+      return iostats.bytes_written;
+    }},
+};
+
+const char* OpName(const admin::PerfContextSampler::Op op) {
+  switch (op) {
+    case admin::PerfContextSampler::Op::GET:
+      return "get";
+    case admin::PerfContextSampler::Op::MULTI_GET:
+      return "multi_get";
+    case admin::PerfContextSampler::Op::WRITE:
+      return "write";
+  }
+  return "unknown";
+}
+
+}  // anonymous namespace
+
+namespace admin {
+
+PerfContextSampler::PerfContextSampler(const Op op,
+                                       const std::string& segment,
+                                       const uint32_t sample_rate)
+    : sample_rate_(sample_rate)
+    , metrics_() {
+  const std::string prefix = std::string("rocksdb_") + OpName(op) + "_";
+  auto add = [this, &prefix, &segment] (const MetricDef& def) {
+    metrics_.push_back(Metric{
+      common::Stats::get()->GetMetricHandle(prefix + def.name,
+                                            {{"segment", segment}}),
+      def.value});
+  };
+
+  if (op == Op::WRITE) {
+    std::for_each(std::begin(kWriteMetrics), std::end(kWriteMetrics), add);
+  } else {
+    std::for_each(std::begin(kReadMetrics), std::end(kReadMetrics), add);
+  }
+}
+
+bool PerfContextSampler::shouldSample() const {
+  if (sample_rate_ == 0) {
+    return false;
+  }
+
+  // At random rather than every sample_rate_ calls of the thread, which
+  // would never sample an op or a segment always called in step with others
+  return folly::Random::oneIn(sample_rate_);
+}
+
+void PerfContextSampler::record(const rocksdb::PerfContext& perf,
+                                const rocksdb::IOStatsContext& iostats) const {
+  auto stats = common::Stats::get();
+  for (const auto& metric : metrics_) {
+    stats->AddMetric(metric.handle, metric.value(perf, iostats));
+  }
+}
+
+PerfContextSampler::Sample::Sample(const PerfContextSampler* sampler)
+    : sampler_(sampler && sampler->shouldSample() ? sampler : nullptr)
+    , prev_level_(rocksdb::PerfLevel::kDisable) {
+  if (sampler_ == nullptr) {
+    return;
+  }
+
+  // Both contexts and the level are thread local, so only this call is
+  // measured. kEnableTime includes the time waiting for the DB mutex.
+  prev_level_ = rocksdb::GetPerfLevel();
+  rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableTime);
+  rocksdb::get_perf_context()->Reset();
+  rocksdb::get_iostats_context()->Reset();
+}
+
+PerfContextSampler::Sample::~Sample() {
+  if (sampler_ == nullptr) {
+    return;
+  }
+
+  rocksdb::SetPerfLevel(prev_level_);
+  sampler_->record(*rocksdb::get_perf_context(),
+                   *rocksdb::get_iostats_context());
+}
+
+}  // namespace admin
@@ -0,0 +1,92 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common/stats/stats.h"
+#include "gflags/gflags.h"
+#include "rocksdb/iostats_context.h"
+#include "rocksdb/perf_context.h"
+#include "rocksdb/perf_level.h"
+
+DECLARE_int32(application_db_perf_context_sample_rate);
+
+namespace admin {
+
+/*
+ * PerfContextSampler breaks down where the time of the RocksDB calls of one
+ * kind goes, for the dbs of a segment. 1 in sample_rate calls are measured
+ * with the rocksdb::PerfContext and IOStatsContext of their thread, which
+ * are added to metrics tagged with the segment, e.g.
+ * "rocksdb_get_block_reads segment=foo" or
+ * "rocksdb_write_wal_us segment=foo".
+ *
+ * // Example usage
+ * PerfContextSampler sampler(PerfContextSampler::Op::GET, "foo", 1000);
+ * {
+ *   PerfContextSampler::Sample sample(&sampler);
+ *   db->Get(options, key, &value);
+ * }
+ */
+class PerfContextSampler {
+ public:
+  enum class Op {
+    GET,
+    MULTI_GET,
+    WRITE,
+  };
+
+  // Measures the RocksDB calls made on this thread in its scope, if it is
+  // sampled. Samples must not be nested.
+  class Sample {
+   public:
+    // sampler may be nullptr, for calls which are never sampled
+    explicit Sample(const PerfContextSampler* sampler);
+    ~Sample();
+
+    Sample(const Sample&) = delete;
+    Sample& operator=(const Sample&) = delete;
+
+   private:
+    // nullptr if this call isn't sampled
+    const PerfContextSampler* sampler_;
+    rocksdb::PerfLevel prev_level_;
+  };
+
+  PerfContextSampler(Op op, const std::string& segment, uint32_t sample_rate);
+
+ private:
+  struct Metric {
+    common::Stats::MetricHandle handle;
+    uint64_t (*value)(const rocksdb::PerfContext&,
+                      const rocksdb::IOStatsContext&);
+  };
+
+  bool shouldSample() const;
+  void record(const rocksdb::PerfContext& perf,
+              const rocksdb::IOStatsContext& iostats) const;
+
+  const uint32_t sample_rate_;
+  std::vector<Metric> metrics_;
+};
+
+}  // namespace admin
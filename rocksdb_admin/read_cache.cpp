@@ -0,0 +1,209 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/read_cache.h"
+
+#include <algorithm>
+#include <string>
+
+#include "folly/Hash.h"
+
+namespace {
+
+// Roughly the memory taken by an Entry, its key and its slot besides the
+// bytes of the key and value
+const uint64_t kEntryOverheadBytes = 96;
+
+uint64_t EntryBytes(const size_t key_size, const size_t value_size) {
+  return key_size + value_size + kEntryOverheadBytes;
+}
+
+// Collect the keys updated by a write batch
+class WriteBatchKeys : public rocksdb::WriteBatch::Handler {
+ public:
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+                        const rocksdb::Slice& value) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+                           const rocksdb::Slice& key) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+                                 const rocksdb::Slice& key) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice& key,
+                          const rocksdb::Slice& value) override {
+    keys.push_back(key);
+    return rocksdb::Status::OK();
+  }
+
+  std::vector<rocksdb::Slice> keys;
+};
+
+}  // anonymous namespace
+
+namespace admin {
+
+ReadCache::ReadCache(const uint64_t capacity_bytes, const uint32_t n_shards)
+    : shard_capacity_bytes_(capacity_bytes / std::max<uint32_t>(n_shards, 1))
+    , shards_()
+    , hits_(0)
+    , misses_(0) {
+  for (uint32_t i = 0; i < std::max<uint32_t>(n_shards, 1); ++i) {
+    shards_.emplace_back(std::make_unique<Shard>());
+  }
+}
+
+ReadCache::Shard* ReadCache::GetShard(const rocksdb::Slice& key) {
+  return shards_[folly::hash::fnv64_buf(key.data(), key.size()) %
+                 shards_.size()].get();
+}
+
+bool ReadCache::Lookup(const rocksdb::Slice& key, std::string* value) {
+  auto shard = GetShard(key);
+  {
+    std::lock_guard<std::mutex> g(shard->mutex);
+    auto itor = shard->entries.find(key.ToString());
+    if (itor != shard->entries.end()) {
+      itor->second.referenced = true;
+      *value = itor->second.value;
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+uint64_t ReadCache::GetEpoch(const rocksdb::Slice& key) {
+  auto shard = GetShard(key);
+  std::lock_guard<std::mutex> g(shard->mutex);
+  return shard->epoch;
+}
+
+void ReadCache::Insert(const rocksdb::Slice& key, const rocksdb::Slice& value,
+                       const uint64_t epoch) {
+  const auto bytes = EntryBytes(key.size(), value.size());
+  if (bytes > shard_capacity_bytes_) {
+    return;
+  }
+
+  auto shard = GetShard(key);
+  std::lock_guard<std::mutex> g(shard->mutex);
+  if (shard->epoch != epoch) {
+    // key may have been updated after value was read
+    return;
+  }
+
+  auto ret = shard->entries.emplace(key.ToString(), Entry());
+  if (!ret.second) {
+    // cached by another reader meanwhile
+    return;
+  }
+
+  auto& entry = ret.first->second;
+  entry.value = value.ToString();
+  entry.referenced = false;
+  if (shard->free_slots.empty()) {
+    entry.slot = shard->clock.size();
+    shard->clock.push_back(&ret.first->first);
+  } else {
+    entry.slot = shard->free_slots.back();
+    shard->free_slots.pop_back();
+    shard->clock[entry.slot] = &ret.first->first;
+  }
+  shard->bytes += bytes;
+
+  EvictLocked(shard);
+}
+
+void ReadCache::Erase(const rocksdb::Slice& key) {
+  auto shard = GetShard(key);
+  std::lock_guard<std::mutex> g(shard->mutex);
+  ++shard->epoch;
+  auto itor = shard->entries.find(key.ToString());
+  if (itor != shard->entries.end()) {
+    EraseLocked(shard, itor);
+  }
+}
+
+void ReadCache::Erase(const rocksdb::WriteBatch& write_batch) {
+  WriteBatchKeys batch_keys;
+  // Iterate() fails on records not handled, e.g. range deletions, after
+  // which we can't tell the keys updated
+  if (!write_batch.Iterate(&batch_keys).ok()) {
+    Clear();
+    return;
+  }
+
+  for (const auto& key : batch_keys.keys) {
+    Erase(key);
+  }
+}
+
+void ReadCache::Clear() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> g(shard->mutex);
+    ++shard->epoch;
+    shard->entries.clear();
+    shard->clock.clear();
+    shard->free_slots.clear();
+    shard->hand = 0;
+    shard->bytes = 0;
+  }
+}
+
+void ReadCache::EraseLocked(
+    Shard* shard, std::unordered_map<std::string, Entry>::iterator itor) {
+  shard->bytes -= EntryBytes(itor->first.size(), itor->second.value.size());
+  shard->clock[itor->second.slot] = nullptr;
+  shard->free_slots.push_back(itor->second.slot);
+  shard->entries.erase(itor);
+}
+
+void ReadCache::EvictLocked(Shard* shard) {
+  while (shard->bytes > shard_capacity_bytes_) {
+    if (shard->hand >= shard->clock.size()) {
+      shard->hand = 0;
+    }
+
+    const auto key = shard->clock[shard->hand++];
+    if (key == nullptr) {
+      continue;
+    }
+
+    auto itor = shard->entries.find(*key);
+    if (itor->second.referenced) {
+      itor->second.referenced = false;
+      continue;
+    }
+
+    EraseLocked(shard, itor);
+  }
+}
+
+}  // namespace admin
@@ -0,0 +1,112 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rocksdb/slice.h"
+#include "rocksdb/write_batch.h"
+
+namespace admin {
+
+// A size bounded cache of the values of keys read from a db, in front of the
+// db for the small set of keys serving most of the reads. It is sharded by
+// key, and each shard evicts with the CLOCK algorithm: an entry read since
+// the hand last passed it gets another round.
+// Writers must Erase() the keys they update after writing them. Readers take
+// an epoch before reading a key from the db and pass it to Insert(), which
+// drops the value if the key may have been updated since.
+// Note: this class is thread-safe.
+class ReadCache {
+ public:
+  // capacity_bytes: (IN) The max size of the keys and values cached
+  // n_shards:       (IN) The # of shards
+  ReadCache(const uint64_t capacity_bytes, const uint32_t n_shards);
+
+  // no copy nor move
+  ReadCache(const ReadCache&) = delete;
+  ReadCache& operator=(const ReadCache&) = delete;
+
+  // Look up key, and fill value if it is cached
+  // Return true on hit
+  bool Lookup(const rocksdb::Slice& key, std::string* value);
+
+  // Return the epoch to pass to Insert() for key. Take it before reading the
+  // value from the db.
+  uint64_t GetEpoch(const rocksdb::Slice& key);
+
+  // Cache the value of key read from the db, unless key may have been updated
+  // since epoch was taken
+  void Insert(const rocksdb::Slice& key, const rocksdb::Slice& value,
+              const uint64_t epoch);
+
+  // Evict key
+  void Erase(const rocksdb::Slice& key);
+
+  // Evict all keys updated by write_batch
+  void Erase(const rocksdb::WriteBatch& write_batch);
+
+  // Evict everything, e.g. after ingesting sst files
+  void Clear();
+
+  uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+  uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Entry {
+    std::string value;
+    // whether it is read since the clock hand passed it
+    bool referenced;
+    // its position in the clock
+    uint32_t slot;
+  };
+
+  struct Shard {
+    Shard() : mutex(), entries(), clock(), free_slots(), hand(0), bytes(0),
+              epoch(0) {}
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    // the keys of entries in their slots, or nullptr for free slots
+    std::vector<const std::string*> clock;
+    std::vector<uint32_t> free_slots;
+    uint32_t hand;
+    uint64_t bytes;
+    // bumped whenever a key of the shard is erased
+    uint64_t epoch;
+  };
+
+  Shard* GetShard(const rocksdb::Slice& key);
+  // Must hold shard->mutex
+  void EraseLocked(Shard* shard,
+                   std::unordered_map<std::string, Entry>::iterator itor);
+  void EvictLocked(Shard* shard);
+
+  const uint64_t shard_capacity_bytes_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+};
+
+}  // namespace admin
@@ -26,6 +26,58 @@ struct DBMetaData {
   4: optional i64 last_kafka_msg_timestamp_ms
 }
 
+# an sst file of an incremental checkpoint backup, which is shared with the
+# other backups
+struct SharedSstFile {
+  # the file name in the checkpoint
+  1: required string file_name,
+  2: required string s3_key,
+  3: required i64 size,
+  4: required i32 crc32c,
+}
+
+# uploaded as SST_MANIFEST for an incremental checkpoint backup
+struct CheckpointSstManifest {
+  1: required list<SharedSstFile> sst_files,
+}
+
+# an sst file of a dataset loaded by addS3SstFilesToDB()
+struct SstFileChecksum {
+  # the file name under the s3 path of the dataset
+  1: required string file_name,
+  2: required i64 size,
+  # the standard CRC-32C (Castagnoli) of the file, as an unsigned 32 bit value
+  # stored in an i32
+  3: required i32 crc32c,
+}
+
+# uploaded as SST_CHECKSUMS along with the sst files of a dataset by the job
+# generating them. addS3SstFilesToDB() verifies the files against it before
+# ingesting them.
+struct SstChecksumManifest {
+  1: required list<SstFileChecksum> sst_files,
+}
+
+# an sst file of a dataset exported by exportDBToS3()
+struct ExportedSstFile {
+  # the file name under the s3 path of the export
+  1: required string file_name,
+  # the first and last keys in the file
+  2: required binary smallest_key,
+  3: required binary largest_key,
+  4: required i64 num_entries,
+  5: required i64 size,
+}
+
+# uploaded as EXPORT_MANIFEST, once all the files of an export are there
+struct ExportManifest {
+  1: required string db_name,
+  # the sequence number of the snapshot exported
+  2: required i64 seq_num,
+  # in key order, their key ranges don't overlap
+  3: required list<ExportedSstFile> sst_files,
+}
+
 enum AdminErrorCode {
   DB_NOT_FOUND = 1,
   DB_EXIST = 2,
@@ -33,6 +85,7 @@ enum AdminErrorCode {
   INVALID_UPSTREAM = 4,
   DB_ADMIN_ERROR = 5,
   DB_ERROR = 6,
+  JOB_NOT_FOUND = 7,
 }
 
 exception AdminException {
@@ -97,13 +150,19 @@ struct BackupDBToS3Request {
   3: required string s3_backup_dir,
   # rate limit in MB/S, a non positive value means no limit
   4: optional i32 limit_mbs = 0,
+  # with --enable_checkpoint_backup, upload the sst files which are not in S3
+  # yet to the shared_checksum dir next to s3_backup_dir, and list the sst
+  # files of the backup in its SST_MANIFEST
   5: optional bool share_files_with_checksum = false,
   # enable backup with metadata
   6: optional bool include_meta = false,
+  # if true, run the backup as a job in the background, see getJobStatus()
+  7: optional bool async_job = false,
 }
 
 struct  BackupDBToS3Response {
-  # for future use
+  # set if the request is run as a job
+  1: optional string job_id,
 }
 
 struct RestoreDBFromS3Request {
@@ -118,10 +177,30 @@ struct RestoreDBFromS3Request {
   5: required i16 upstream_port,
   # rate limit in MB/S, a non positive value means no limit
   6: optional i32 limit_mbs = 0,
+  # if true, run the restore as a job in the background, see getJobStatus()
+  7: optional bool async_job = false,
 }
 
 struct RestoreDBFromS3Response {
-  # for future use
+  # set if the request is run as a job
+  1: optional string job_id,
+}
+
+struct BootstrapFromPeerRequest {
+  # the db to be bootstrapped, which must not be opened
+  1: required string db_name,
+  # the host of a MASTER or SLAVE of the db to copy a checkpoint from, and to
+  # pull updates from thereafter
+  2: required string peer_ip,
+  # rate limit in MB/S, a non positive value means no limit
+  3: optional i32 limit_mbs = 0,
+  # if true, run the bootstrap as a job in the background, see getJobStatus()
+  4: optional bool async_job = false,
+}
+
+struct BootstrapFromPeerResponse {
+  # set if the request is run as a job
+  1: optional string job_id,
 }
 
 struct CloseDBRequest {
@@ -149,6 +228,16 @@ struct CheckDBResponse {
   4: optional bool is_master = false,
 }
 
+struct CheckDBsRequest {
+  # the DBs to check, all DBs on the host if empty
+  1: optional list<string> db_names = [],
+}
+
+struct CheckDBsResponse {
+  # db name -> what checkDB() returns for it, DBs not on the host are left out
+  1: required map<string, CheckDBResponse> dbs,
+}
+
 struct ChangeDBRoleAndUpstreamRequest {
   # the db to change
   1: required string db_name,
@@ -172,6 +261,16 @@ struct GetSequenceNumberResponse {
   1: required i64 seq_num,
 }
 
+struct GetSequenceNumbersRequest {
+  # the dbs to get sequence numbers for, all dbs on the host if empty
+  1: optional list<string> db_names = [],
+}
+
+struct GetSequenceNumbersResponse {
+  # db name -> sequence number, dbs not on the host are left out
+  1: required map<string, i64> seq_nums,
+}
+
 struct ClearDBRequest {
   1: required string db_name,
   2: optional bool reopen_db = true,
@@ -186,12 +285,21 @@ struct AddS3SstFilesToDBRequest {
   2: required string s3_bucket,
   3: required string s3_path,
   4: optional i32 s3_download_limit_mb = 64,
-  # if true, ingest files at the bottom of RocksDB
+  # if true, ingest files at the bottom of RocksDB, behind the existing data,
+  # without flushing the memtables. Only for segments allowing overlapping
+  # keys, and dbs opened with allow_ingest_behind.
   5: optional bool ingest_behind,
+  # if true, add the files as a job in the background, see getJobStatus()
+  6: optional bool async_job = false,
+  # the column family to load the files into, which only is cleared first.
+  # The db must have it, see RocksDBColumnFamilyOptionsGeneratorType. The
+  # s3_bucket and s3_path of the db are only recorded for the default one.
+  7: optional string column_family = "",
 }
 
 struct AddS3SstFilesToDBResponse {
-  # for future use
+  # set if the request is run as a job
+  1: optional string job_id,
 }
 
 struct StartMessageIngestionRequest {
@@ -240,10 +348,91 @@ struct SetDBOptionsResponse {
 struct CompactDBRequest {
   # the db instance name to compact
   1: required string db_name,
+  # if true, run the compaction as a job in the background, see getJobStatus()
+  2: optional bool async_job = false,
+  # if more than 1, split the key space into up to this many ranges along
+  # sst file boundaries and compact them concurrently. The job reports the
+  # bytes of the files of the ranges compacted so far.
+  3: optional i32 max_subcompactions = 0,
 }
 
 struct CompactDBResponse {
-  # for future use
+  # set if the request is run as a job
+  1: optional string job_id,
+}
+
+enum AdminJobState {
+  PENDING = 1,
+  RUNNING = 2,
+  SUCCEEDED = 3,
+  FAILED = 4,
+}
+
+struct AdminJobStatus {
+  1: required string job_id,
+  2: required string db_name,
+  # the admin call run by the job, e.g., backupDBToS3
+  3: required string operation,
+  4: required AdminJobState state,
+  5: optional i64 bytes_transferred = 0,
+  # a negative value means unknown
+  6: optional i64 total_bytes = -1,
+  7: optional i64 bytes_per_sec = 0,
+  # a negative value means unknown
+  8: optional i64 eta_secs = -1,
+  # set if the job has failed
+  9: optional string error_message,
+  10: optional i64 submit_time_ms = 0,
+  11: optional i64 start_time_ms = 0,
+  12: optional i64 end_time_ms = 0,
+}
+
+struct SplitDBRequest {
+  # the db to split, which is left as it is. It must not take updates, from
+  # its clients nor its upstream, until the split is done, or the split
+  # fails. The caller closes it once the halves have taken over.
+  1: required string db_name,
+  # the keys before split_key go to left_db_name, and the others to
+  # right_db_name. Keys are compared bytewise.
+  2: required binary split_key,
+  3: required string left_db_name,
+  4: required string right_db_name,
+}
+
+struct SplitDBResponse {
+  # the latest sequence numbers of the halves. The replicas of db_name split
+  # at the same sequence number end up with the same ones.
+  1: required i64 left_seq_num,
+  2: required i64 right_seq_num,
+}
+
+struct ExportDBToS3Request {
+  # the db to export
+  1: required string db_name,
+  # the s3 bucket to export to
+  2: required string s3_bucket,
+  # the s3 key prefix to export to
+  3: required string s3_export_dir,
+  # the number of key ranges exported concurrently, 0 for
+  # --export_db_num_ranges
+  4: optional i32 num_ranges = 0,
+  # rate limit in MB/S, a non positive value means no limit
+  5: optional i32 limit_mbs = 0,
+  # if true, run the export as a job in the background, see getJobStatus()
+  6: optional bool async_job = false,
+}
+
+struct ExportDBToS3Response {
+  # set if the request is run as a job
+  1: optional string job_id,
+}
+
+struct GetJobStatusRequest {
+  1: required string job_id,
+}
+
+struct GetJobStatusResponse {
+  1: required AdminJobStatus status,
 }
 
 service Admin {
@@ -286,12 +475,27 @@ RestoreDBResponse restoreDB(1:RestoreDBRequest request)
  RestoreDBFromS3Response restoreDBFromS3(1:RestoreDBFromS3Request request)
   throws (1:AdminException e)
 
+/*
+ * Build a local DB from a checkpoint of a live replica on another host,
+ * rather than from a backup. The data is copied from the peer's replicator
+ * directly, and the new DB is a SLAVE of the peer, picking up from where the
+ * checkpoint was created.
+ */
+BootstrapFromPeerResponse bootstrapFromPeer(1:BootstrapFromPeerRequest request)
+  throws (1:AdminException e)
+
 /*
  * Check if a DB exists on a host
  */
 CheckDBResponse checkDB(1: CheckDBRequest request)
   throws (1:AdminException e)
 
+/*
+ * Same as checkDB(), but for many DBs in one call
+ */
+CheckDBsResponse checkDBs(1: CheckDBsRequest request)
+  throws (1:AdminException e)
+
 /*
  * Close a DB
  */
@@ -312,6 +516,15 @@ ChangeDBRoleAndUpstreamResponse changeDBRoleAndUpStream(
 GetSequenceNumberResponse getSequenceNumber(1:GetSequenceNumberRequest request)
   throws (1:AdminException e)
 
+/*
+ * Same as getSequenceNumber(), but for many dbs in one call, so that a new
+ * MASTER can be chosen for all the shards of a host without a round trip per
+ * shard
+ */
+GetSequenceNumbersResponse getSequenceNumbers(
+    1:GetSequenceNumbersRequest request)
+  throws (1:AdminException e)
+
 /*
  * Clear the content of a DB.
  */
@@ -350,4 +563,32 @@ SetDBOptionsResponse setDBOptions(1:SetDBOptionsRequest request)
  */
 CompactDBResponse compactDB(1:CompactDBRequest request)
   throws (1:AdminException e)
+
+/*
+ * Split a DB into two new DBs by key range, in place. Both halves start as
+ * hard linked checkpoints of the DB, which then drop the keys of the other
+ * half. They take the role and upstream of the DB.
+ */
+SplitDBResponse splitDB(1:SplitDBRequest request)
+  throws (1:AdminException e)
+
+/*
+ * Export a point in time snapshot of a DB to S3 as sorted sst files, for the
+ * offline consumers which can't read backups. Key ranges of the DB are
+ * written and uploaded concurrently. The files are listed with their key
+ * ranges in EXPORT_MANIFEST, and with their checksums in SST_CHECKSUMS, so
+ * that the export can also be loaded by addS3SstFilesToDB.
+ */
+ExportDBToS3Response exportDBToS3(1:ExportDBToS3Request request)
+  throws (1:AdminException e)
+
+/*
+ * Get the status of a job started by backupDBToS3, restoreDBFromS3,
+ * bootstrapFromPeer, addS3SstFilesToDB, compactDB or exportDBToS3 with
+ * async_job set.
+ * Submitting the same operation for the same db and source again while its
+ * job is pending, running or has recently succeeded returns the same job.
+ */
+GetJobStatusResponse getJobStatus(1:GetJobStatusRequest request)
+  throws (1:AdminException e)
 } (priority = 'HIGH')
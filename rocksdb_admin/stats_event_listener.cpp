@@ -0,0 +1,170 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/stats_event_listener.h"
+
+#include <memory>
+#include <utility>
+
+#include "common/stats/stats.h"
+#include "rocksdb/db.h"
+#include "rocksdb/table_properties.h"
+
+namespace {
+
+const std::string kFlushes = "rocksdb_flushes";
+const std::string kFlushMs = "rocksdb_flush_ms";
+const std::string kFlushBytes = "rocksdb_flush_bytes";
+const std::string kCompactions = "rocksdb_compactions";
+const std::string kCompactionFailures = "rocksdb_compaction_failures";
+const std::string kCompactionMs = "rocksdb_compaction_ms";
+const std::string kCompactionInputBytes = "rocksdb_compaction_input_bytes";
+const std::string kCompactionOutputBytes = "rocksdb_compaction_output_bytes";
+const std::string kIngestedFiles = "rocksdb_ingested_files";
+const std::string kIngestedBytes = "rocksdb_ingested_bytes";
+const std::string kWriteSlowdowns = "rocksdb_write_slowdowns";
+const std::string kWriteStops = "rocksdb_write_stops";
+const std::string kWriteStallMs = "rocksdb_write_stall_ms";
+
+// The name of db, the last component of its path
+std::string DBName(rocksdb::DB* db) {
+  auto path = db->GetName();
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+
+  const auto pos = path.rfind('/');
+  return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+uint64_t FileBytes(const rocksdb::TableProperties& properties) {
+  return properties.data_size + properties.index_size +
+    properties.filter_size;
+}
+
+}  // anonymous namespace
+
+namespace admin {
+
+StatsEventListener::StatsEventListener(std::string segment)
+    : segment_(std::move(segment))
+    , lock_()
+    , flush_starts_()
+    , stall_starts_() {
+}
+
+void StatsEventListener::AddTo(const std::string& segment,
+                               rocksdb::Options* options) {
+  options->listeners.push_back(std::make_shared<StatsEventListener>(segment));
+}
+
+void StatsEventListener::OnFlushBegin(rocksdb::DB* db,
+                                      const rocksdb::FlushJobInfo& info) {
+  std::lock_guard<std::mutex> g(lock_);
+  flush_starts_[info.job_id] = Clock::now();
+}
+
+void StatsEventListener::OnFlushCompleted(rocksdb::DB* db,
+                                          const rocksdb::FlushJobInfo& info) {
+  Clock::time_point start;
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> g(lock_);
+    auto itor = flush_starts_.find(info.job_id);
+    if (itor != flush_starts_.end()) {
+      start = itor->second;
+      found = true;
+      flush_starts_.erase(itor);
+    }
+  }
+
+  const auto tag = " db=" + DBName(db);
+  auto stats = common::Stats::get();
+  stats->Incr(kFlushes + tag);
+  stats->Incr(kFlushBytes + tag, FileBytes(info.table_properties));
+  if (found) {
+    stats->AddMetric(kFlushMs + tag,
+                     std::chrono::duration_cast<std::chrono::milliseconds>(
+                       Clock::now() - start).count());
+  }
+}
+
+void StatsEventListener::OnCompactionCompleted(
+    rocksdb::DB* db,
+    const rocksdb::CompactionJobInfo& info) {
+  const auto tag = " db=" + DBName(db);
+  auto stats = common::Stats::get();
+  if (!info.status.ok()) {
+    stats->Incr(kCompactionFailures + tag);
+    return;
+  }
+
+  stats->Incr(kCompactions + tag);
+  stats->Incr(kCompactionInputBytes + tag, info.stats.total_input_bytes);
+  stats->Incr(kCompactionOutputBytes + tag, info.stats.total_output_bytes);
+  stats->AddMetric(kCompactionMs + tag, info.stats.elapsed_micros / 1000);
+}
+
+void StatsEventListener::OnExternalFileIngested(
+    rocksdb::DB* db,
+    const rocksdb::ExternalFileIngestionInfo& info) {
+  const auto tag = " db=" + DBName(db);
+  auto stats = common::Stats::get();
+  stats->Incr(kIngestedFiles + tag);
+  stats->Incr(kIngestedBytes + tag, FileBytes(info.table_properties));
+}
+
+void StatsEventListener::OnStallConditionsChanged(
+    const rocksdb::WriteStallInfo& info) {
+  const auto tag = " segment=" + segment_;
+  auto stats = common::Stats::get();
+  if (info.condition.cur == rocksdb::WriteStallCondition::kDelayed) {
+    stats->Incr(kWriteSlowdowns + tag);
+  } else if (info.condition.cur == rocksdb::WriteStallCondition::kStopped) {
+    stats->Incr(kWriteStops + tag);
+  }
+
+  const bool was_stalled =
+    info.condition.prev != rocksdb::WriteStallCondition::kNormal;
+  const bool is_stalled =
+    info.condition.cur != rocksdb::WriteStallCondition::kNormal;
+  if (was_stalled == is_stalled) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> g(lock_);
+  if (is_stalled) {
+    stall_starts_[info.cf_name] = Clock::now();
+    return;
+  }
+
+  auto itor = stall_starts_.find(info.cf_name);
+  if (itor != stall_starts_.end()) {
+    stats->AddMetric(kWriteStallMs + tag,
+                     std::chrono::duration_cast<std::chrono::milliseconds>(
+                       Clock::now() - itor->second).count());
+    stall_starts_.erase(itor);
+  }
+}
+
+bool StatsEventListener::IsStalled() const {
+  std::lock_guard<std::mutex> g(lock_);
+  return !stall_starts_.empty();
+}
+
+}  // namespace admin
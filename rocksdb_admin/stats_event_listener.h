@@ -0,0 +1,76 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "rocksdb/listener.h"
+#include "rocksdb/options.h"
+
+namespace admin {
+
+// Records the flushes, compactions, file ingestions and write stalls of a db
+// into common::Stats, so that how long they take and how many bytes they
+// move is visible per db.
+// The flush, compaction and ingestion stats are tagged with the db name.
+// RocksDB doesn't tell which db a stall is for, so the stall stats are
+// tagged with the segment, and each db needs a listener of its own to time
+// its stalls.
+// Note: this class is thread-safe.
+class StatsEventListener : public rocksdb::EventListener {
+ public:
+  // segment: (IN) Segment of the db the listener is attached to
+  explicit StatsEventListener(std::string segment);
+
+  // Attach a new listener for a db of segment to options
+  static void AddTo(const std::string& segment, rocksdb::Options* options);
+
+  void OnFlushBegin(rocksdb::DB* db,
+                    const rocksdb::FlushJobInfo& info) override;
+
+  void OnFlushCompleted(rocksdb::DB* db,
+                        const rocksdb::FlushJobInfo& info) override;
+
+  void OnCompactionCompleted(rocksdb::DB* db,
+                             const rocksdb::CompactionJobInfo& info) override;
+
+  void OnExternalFileIngested(
+    rocksdb::DB* db,
+    const rocksdb::ExternalFileIngestionInfo& info) override;
+
+  void OnStallConditionsChanged(const rocksdb::WriteStallInfo& info) override;
+
+  // Whether the writes of any column family of the db are delayed or stopped
+  bool IsStalled() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  const std::string segment_;
+  mutable std::mutex lock_;
+  // job id -> start time of the running flushes
+  std::unordered_map<int, Clock::time_point> flush_starts_;
+  // column family -> start time of its stall, for the stalled ones
+  std::unordered_map<std::string, Clock::time_point> stall_starts_;
+};
+
+}  // namespace admin
@@ -30,7 +30,13 @@ using admin::AdminHandler;
 using admin::ApplicationDBManager;
 using admin::CheckDBRequest;
 using admin::CheckDBResponse;
+using admin::CheckDBsRequest;
+using admin::CheckDBsResponse;
 using admin::DBMetaData;
+using admin::GetSequenceNumbersRequest;
+using admin::GetSequenceNumbersResponse;
+using admin::SplitDBRequest;
+using admin::SplitDBResponse;
 using apache::thrift::async::TAsyncSocket;
 using apache::thrift::HeaderClientChannel;
 using apache::thrift::ThriftServer;
@@ -205,6 +211,99 @@ TEST(AdminHandlerTest, CheckDB) {
   thread->join();
 }
 
+TEST(AdminHandlerTest, BatchedChecks) {
+  EXPECT_EQ(std::system("rm -rf /tmp/meta_db"), 0);
+
+  shared_ptr<AdminHandler> handler;
+  shared_ptr<ThriftServer> server;
+  shared_ptr<thread> thread;
+  tie(handler, server, thread) = makeServer(8091);
+  sleep_for(seconds(1));
+
+  ThriftClientPool<AdminAsyncClient> pool(1);
+  auto client = pool.getClient("127.0.0.1", 8091);
+
+  GetSequenceNumbersRequest seq_req;
+  GetSequenceNumbersResponse seq_res;
+  seq_req.db_names = {"imp00001", "imp00002", "unknown_db"};
+  EXPECT_NO_THROW(seq_res = client->future_getSequenceNumbers(seq_req).get());
+  EXPECT_EQ(seq_res.seq_nums.size(), 2);
+  EXPECT_EQ(seq_res.seq_nums["imp00001"], 0);
+  EXPECT_EQ(seq_res.seq_nums["imp00002"], 1);
+
+  // all dbs on the host
+  seq_req.db_names.clear();
+  EXPECT_NO_THROW(seq_res = client->future_getSequenceNumbers(seq_req).get());
+  EXPECT_EQ(seq_res.seq_nums.size(), 2);
+
+  CheckDBsRequest check_req;
+  CheckDBsResponse check_res;
+  check_req.db_names = {"imp00002", "unknown_db"};
+  EXPECT_NO_THROW(check_res = client->future_checkDBs(check_req).get());
+  EXPECT_EQ(check_res.dbs.size(), 1);
+  EXPECT_EQ(check_res.dbs["imp00002"].seq_num, 1);
+  EXPECT_EQ(check_res.dbs["imp00002"].wal_ttl_seconds, 123);
+  EXPECT_TRUE(check_res.dbs["imp00002"].is_master);
+  EXPECT_GT(check_res.dbs["imp00002"].last_update_timestamp_ms, 1521000000);
+
+  server->stop();
+  thread->join();
+}
+
+TEST(AdminHandlerTest, SplitDB) {
+  EXPECT_EQ(std::system("rm -rf /tmp/meta_db /tmp/imp00003 /tmp/imp00004"), 0);
+
+  shared_ptr<AdminHandler> handler;
+  shared_ptr<ThriftServer> server;
+  shared_ptr<thread> thread;
+  tie(handler, server, thread) = makeServer(8092);
+  handler->rocksdb_options_ = [] (const string& segment) {
+    return rocksdb::Options();
+  };
+  sleep_for(seconds(1));
+
+  auto db = handler->getDB("imp00001", nullptr);
+  for (const string key : {"a", "b", "c", "d"}) {
+    EXPECT_TRUE(db->rocksdb()->Put(rocksdb::WriteOptions(), key, key).ok());
+  }
+
+  ThriftClientPool<AdminAsyncClient> pool(1);
+  auto client = pool.getClient("127.0.0.1", 8092);
+
+  SplitDBRequest req;
+  SplitDBResponse res;
+  req.db_name = "imp00001";
+  req.split_key = "c";
+  req.left_db_name = "imp00003";
+  req.right_db_name = "imp00001";
+  EXPECT_THROW(res = client->future_splitDB(req).get(), AdminException);
+
+  req.right_db_name = "imp00004";
+  EXPECT_NO_THROW(res = client->future_splitDB(req).get());
+  EXPECT_EQ(res.left_seq_num, res.right_seq_num);
+
+  auto keys_of = [&handler] (const string& db_name) {
+    std::vector<string> keys;
+    auto half = handler->getDB(db_name, nullptr);
+    EXPECT_NE(half, nullptr);
+    std::unique_ptr<rocksdb::Iterator> iter(
+      half->rocksdb()->NewIterator(rocksdb::ReadOptions()));
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      keys.push_back(iter->key().ToString());
+    }
+    return keys;
+  };
+  EXPECT_EQ(keys_of("imp00003"), (std::vector<string>{"a", "b"}));
+  EXPECT_EQ(keys_of("imp00004"), (std::vector<string>{"c", "d"}));
+  EXPECT_EQ(keys_of("imp00001").size(), 4);
+
+  // the halves exist now
+  EXPECT_THROW(res = client->future_splitDB(req).get(), AdminException);
+
+  server->stop();
+  thread->join();
+}
+
 int main(int argc, char** argv) {
   FLAGS_rocksdb_dir = "/tmp/";
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,173 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "folly/Baton.h"
+#include "gtest/gtest.h"
+#include "rocksdb_admin/admin_jobs.h"
+
+using admin::AdminJob;
+using admin::AdminJobManager;
+using admin::AdminJobState;
+using admin::AdminJobStatus;
+using admin::JobCallback;
+using admin::CompactDBResponse;
+using std::chrono::milliseconds;
+using std::this_thread::sleep_for;
+
+namespace {
+
+AdminJobStatus WaitForJob(const AdminJobManager& manager,
+                          const std::string& job_id) {
+  AdminJobStatus status;
+  while (true) {
+    EXPECT_TRUE(manager.getStatus(job_id, &status));
+    if (status.state == AdminJobState::SUCCEEDED ||
+        status.state == AdminJobState::FAILED) {
+      return status;
+    }
+    sleep_for(milliseconds(10));
+  }
+}
+
+}  // namespace
+
+TEST(AdminJobsTest, Basics) {
+  AdminJobManager manager(2);
+  AdminJobStatus unknown_status;
+  EXPECT_FALSE(manager.getStatus("unknown", &unknown_status));
+
+  auto job_id = manager.submit("compactDB db1", "db1", "compactDB",
+    [] (std::shared_ptr<AdminJob> job) {
+      job->setTotalBytes(100);
+      job->addBytes(100);
+      job->succeed();
+    });
+
+  auto status = WaitForJob(manager, job_id);
+  EXPECT_EQ(status.job_id, job_id);
+  EXPECT_EQ(status.db_name, "db1");
+  EXPECT_EQ(status.operation, "compactDB");
+  EXPECT_EQ(status.state, AdminJobState::SUCCEEDED);
+  EXPECT_EQ(status.bytes_transferred, 100);
+  EXPECT_EQ(status.total_bytes, 100);
+  EXPECT_EQ(status.eta_secs, 0);
+  EXPECT_FALSE(status.__isset.error_message);
+  EXPECT_GT(status.start_time_ms, 0);
+  EXPECT_GE(status.end_time_ms, status.start_time_ms);
+}
+
+TEST(AdminJobsTest, Idempotent) {
+  AdminJobManager manager(2);
+  std::atomic<int> n_runs(0);
+  folly::Baton<> baton;
+  auto op = [&n_runs, &baton] (std::shared_ptr<AdminJob> job) {
+    ++n_runs;
+    baton.wait();
+    job->succeed();
+  };
+
+  // the same work is not started twice, while in progress and after done
+  auto job_id = manager.submit("key", "db1", "backupDBToS3", op);
+  EXPECT_EQ(manager.submit("key", "db1", "backupDBToS3", op), job_id);
+  baton.post();
+  WaitForJob(manager, job_id);
+  EXPECT_EQ(manager.submit("key", "db1", "backupDBToS3", op), job_id);
+  EXPECT_EQ(n_runs.load(), 1);
+
+  // but different work is
+  auto job_id2 = manager.submit("key2", "db1", "backupDBToS3", op);
+  EXPECT_NE(job_id2, job_id);
+  WaitForJob(manager, job_id2);
+  EXPECT_EQ(n_runs.load(), 2);
+}
+
+TEST(AdminJobsTest, RetryFailedJob) {
+  AdminJobManager manager(1);
+  auto job_id = manager.submit("key", "db1", "restoreDBFromS3",
+    [] (std::shared_ptr<AdminJob> job) {
+      job->fail("no luck");
+    });
+
+  auto status = WaitForJob(manager, job_id);
+  EXPECT_EQ(status.state, AdminJobState::FAILED);
+  EXPECT_EQ(status.error_message, "no luck");
+
+  auto job_id2 = manager.submit("key", "db1", "restoreDBFromS3",
+    [] (std::shared_ptr<AdminJob> job) {
+      job->succeed();
+    });
+  EXPECT_NE(job_id2, job_id);
+  EXPECT_EQ(WaitForJob(manager, job_id2).state, AdminJobState::SUCCEEDED);
+}
+
+TEST(AdminJobsTest, Queueing) {
+  // jobs beyond the thread count wait instead of being rejected
+  AdminJobManager manager(1);
+  folly::Baton<> baton;
+  auto job_id1 = manager.submit("key1", "db1", "addS3SstFilesToDB",
+    [&baton] (std::shared_ptr<AdminJob> job) {
+      job->setTotalBytes(1000);
+      job->addBytes(500);
+      baton.wait();
+      job->addBytes(500);
+      job->succeed();
+    });
+  auto job_id2 = manager.submit("key2", "db2", "addS3SstFilesToDB",
+    [] (std::shared_ptr<AdminJob> job) {
+      job->succeed();
+    });
+
+  sleep_for(milliseconds(200));
+  AdminJobStatus status;
+  EXPECT_TRUE(manager.getStatus(job_id1, &status));
+  EXPECT_EQ(status.state, AdminJobState::RUNNING);
+  EXPECT_EQ(status.bytes_transferred, 500);
+  EXPECT_GT(status.bytes_per_sec, 0);
+  EXPECT_GE(status.eta_secs, 0);
+  EXPECT_TRUE(manager.getStatus(job_id2, &status));
+  EXPECT_EQ(status.state, AdminJobState::PENDING);
+
+  baton.post();
+  EXPECT_EQ(WaitForJob(manager, job_id2).state, AdminJobState::SUCCEEDED);
+  EXPECT_EQ(WaitForJob(manager, job_id1).bytes_transferred, 1000);
+}
+
+TEST(AdminJobsTest, JobCallback) {
+  AdminJobManager manager(1);
+  auto job_id = manager.submit("key", "db1", "compactDB",
+    [] (std::shared_ptr<AdminJob> job) {
+      std::unique_ptr<JobCallback<CompactDBResponse>> callback(
+        new JobCallback<CompactDBResponse>(std::move(job)));
+      AddJobBytes(callback.get(), 10);
+      admin::AdminException e;
+      e.message = "compaction failed";
+      callback.release()->exceptionInThread(std::move(e));
+    });
+
+  auto status = WaitForJob(manager, job_id);
+  EXPECT_EQ(status.state, AdminJobState::FAILED);
+  EXPECT_EQ(status.error_message, "compaction failed");
+  EXPECT_EQ(status.bytes_transferred, 10);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,140 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "rocksdb/db.h"
+#include "rocksdb_admin/application_db.h"
+#include "rocksdb_admin/application_db_manager.h"
+
+DEFINE_int32(n_dbs, 64, "The number of dbs to look up");
+DEFINE_int32(n_threads, 48, "The number of concurrent lookup threads");
+
+namespace {
+
+const std::string kDBDir = "/tmp/application_db_manager_benchmark/";
+
+std::string DBName(const int i) {
+  return "db" + std::to_string(i);
+}
+
+std::unique_ptr<rocksdb::DB> OpenDB(const std::string& path) {
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  rocksdb::DB* db;
+  const auto status = rocksdb::DB::Open(options, path, &db);
+  CHECK(status.ok()) << status.ToString();
+  return std::unique_ptr<rocksdb::DB>(db);
+}
+
+// The lookups ApplicationDBManager used to do, to compare with
+class SharedMutexDBMap {
+ public:
+  void add(const std::string& db_name,
+           std::shared_ptr<admin::ApplicationDB> db) {
+    std::unique_lock<std::shared_mutex> lock(dbs_lock_);
+    dbs_.emplace(db_name, std::move(db));
+  }
+
+  const std::shared_ptr<admin::ApplicationDB> getDB(const std::string& db_name,
+                                                    std::string*) {
+    std::shared_lock<std::shared_mutex> lock(dbs_lock_);
+    auto itor = dbs_.find(db_name);
+    return itor == dbs_.end() ? nullptr : itor->second;
+  }
+
+ private:
+  std::unordered_map<std::string, std::shared_ptr<admin::ApplicationDB>> dbs_;
+  std::shared_mutex dbs_lock_;
+};
+
+admin::ApplicationDBManager* Manager() {
+  static auto manager = [] {
+    CHECK_EQ(std::system(("rm -rf " + kDBDir).c_str()), 0);
+    CHECK_EQ(std::system(("mkdir -p " + kDBDir).c_str()), 0);
+    auto manager = new admin::ApplicationDBManager();
+    for (int i = 0; i < FLAGS_n_dbs; ++i) {
+      std::string error_message;
+      CHECK(manager->addDB(DBName(i), OpenDB(kDBDir + DBName(i)),
+                           replicator::DBRole::SLAVE, &error_message))
+        << error_message;
+    }
+    return manager;
+  }();
+  return manager;
+}
+
+SharedMutexDBMap* LockedMap() {
+  static auto map = [] {
+    auto map = new SharedMutexDBMap();
+    for (int i = 0; i < FLAGS_n_dbs; ++i) {
+      map->add(DBName(i), Manager()->getDB(DBName(i), nullptr));
+    }
+    return map;
+  }();
+  return map;
+}
+
+// n lookups spread over FLAGS_n_threads threads, each of them going through
+// all dbs
+template <typename Map>
+void ConcurrentGetDB(Map* map, const size_t n) {
+  std::vector<std::string> db_names;
+  std::vector<std::thread> threads;
+  BENCHMARK_SUSPEND {
+    for (int i = 0; i < FLAGS_n_dbs; ++i) {
+      db_names.push_back(DBName(i));
+    }
+  }
+
+  const size_t n_per_thread = n / FLAGS_n_threads + 1;
+  for (int i = 0; i < FLAGS_n_threads; ++i) {
+    threads.emplace_back([map, &db_names, n_per_thread, i] {
+        for (size_t j = 0; j < n_per_thread; ++j) {
+          auto db = map->getDB(db_names[(i + j) % db_names.size()], nullptr);
+          folly::doNotOptimizeAway(db);
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+}  // namespace
+
+BENCHMARK(SharedMutexGetDB, n) {
+  ConcurrentGetDB(LockedMap(), n);
+}
+
+BENCHMARK_RELATIVE(ApplicationDBManagerGetDB, n) {
+  ConcurrentGetDB(Manager(), n);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  // open the dbs before timing anything
+  LockedMap();
+  folly::runBenchmarks();
+}
@@ -13,6 +13,7 @@
 /// limitations under the License.
 
 
+#include <chrono>
 #include <string>
 
 #include "rocksdb_admin/application_db.h"
@@ -65,6 +66,91 @@ TEST(ApplicationDBManagerTest, Basics) {
   ASSERT_TRUE(ret);
 }
 
+TEST(ApplicationDBManagerTest, ReplaceDB) {
+  admin::ApplicationDBManager db_manager;
+  std::string error_message;
+  auto new_db = GetTestDB("/tmp/application_db_manager_test_new_db");
+  EXPECT_EQ(db_manager.replaceDB("test_db", std::move(new_db),
+                                 replicator::DBRole::SLAVE, nullptr,
+                                 &error_message),
+            nullptr);
+
+  auto old_db = GetTestDB("/tmp/application_db_manager_test_old_db");
+  ASSERT_TRUE(old_db->Put(rocksdb::WriteOptions(), "key", "old").ok());
+  ASSERT_TRUE(db_manager.addDB("test_db", std::move(old_db),
+                               replicator::DBRole::SLAVE, &error_message));
+  auto held_db = db_manager.getDB("test_db", &error_message);
+
+  new_db = GetTestDB("/tmp/application_db_manager_test_new_db");
+  ASSERT_TRUE(new_db->Put(rocksdb::WriteOptions(), "key", "new").ok());
+  auto replaced_db = db_manager.replaceDB("test_db", std::move(new_db),
+                                          replicator::DBRole::SLAVE, nullptr,
+                                          &error_message);
+  ASSERT_EQ(replaced_db, held_db);
+
+  // Lookups get the new version, while the old one stays readable for its
+  // holders
+  std::string value;
+  auto db = db_manager.getDB("test_db", &error_message);
+  ASSERT_NE(db, nullptr);
+  EXPECT_TRUE(db->rocksdb()->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "new");
+  EXPECT_TRUE(
+    held_db->rocksdb()->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "old");
+  db.reset();
+  held_db.reset();
+
+  EXPECT_NE(db_manager.releaseDB(std::move(replaced_db)), nullptr);
+  EXPECT_NE(db_manager.removeDB("test_db", &error_message), nullptr);
+}
+
+TEST(ApplicationDBManagerTest, HibernateIdleDBs) {
+  admin::ApplicationDBManager db_manager;
+  std::string error_message;
+  ASSERT_TRUE(db_manager.addDB(
+    "test_db", GetTestDB("/tmp/application_db_manager_test_hibernate_db"),
+    replicator::DBRole::SLAVE, &error_message));
+  auto db = db_manager.getDB("test_db", &error_message);
+  ASSERT_NE(db, nullptr);
+  const auto write_buffer_size =
+    db->rocksdb()->GetOptions().write_buffer_size;
+
+  FLAGS_application_db_hibernate_idle_min = 10;
+  const auto now = std::chrono::steady_clock::now();
+  const std::chrono::minutes idle_time(10);
+  db_manager.hibernateIdleDBs(now);
+  db_manager.hibernateIdleDBs(now + idle_time - std::chrono::minutes(1));
+  EXPECT_FALSE(db->IsHibernated());
+
+  // Idle for long enough
+  db_manager.hibernateIdleDBs(now + idle_time);
+  EXPECT_TRUE(db->IsHibernated());
+  EXPECT_LT(db->rocksdb()->GetOptions().write_buffer_size, write_buffer_size);
+
+  // Reads wake it up
+  std::string value;
+  EXPECT_TRUE(db->Get(rocksdb::ReadOptions(), "key", &value).IsNotFound());
+  EXPECT_FALSE(db->IsHibernated());
+  EXPECT_EQ(db->rocksdb()->GetOptions().write_buffer_size, write_buffer_size);
+
+  // Which also makes it active
+  db_manager.hibernateIdleDBs(now + idle_time * 2 - std::chrono::minutes(1));
+  EXPECT_FALSE(db->IsHibernated());
+  db_manager.hibernateIdleDBs(now + idle_time * 3);
+  EXPECT_TRUE(db->IsHibernated());
+
+  // Replicated updates wake it up
+  ASSERT_TRUE(db->rocksdb()->Put(rocksdb::WriteOptions(), "key", "v").ok());
+  db_manager.hibernateIdleDBs(now + idle_time * 3 + std::chrono::minutes(1));
+  EXPECT_FALSE(db->IsHibernated());
+  EXPECT_EQ(db->rocksdb()->GetOptions().write_buffer_size, write_buffer_size);
+
+  FLAGS_application_db_hibernate_idle_min = 0;
+  db.reset();
+  EXPECT_NE(db_manager.removeDB("test_db", &error_message), nullptr);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
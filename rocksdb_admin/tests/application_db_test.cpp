@@ -17,17 +17,31 @@
 //
 
 #include <stdlib.h>
+#include <chrono>
 #include <ctime>
 #include <iostream>
 #include <thread>
 #include <vector>
 
 #include "boost/filesystem.hpp"
+#include "common/stats/stats.h"
+#include "gflags/gflags.h"
 #include "gtest/gtest.h"
 #include "rocksdb/db.h"
 #include "rocksdb/sst_file_writer.h"
 #include "rocksdb_admin/application_db.h"
+#include "rocksdb_admin/column_family_db.h"
+#include "rocksdb_admin/utils.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
+#if __GNUC__ >= 8
+#include "folly/executors/InlineExecutor.h"
+#else
+#include "folly/InlineExecutor.h"
+#endif
+
+DECLARE_int32(application_db_hot_key_sample_rate);
+DECLARE_int32(application_db_perf_context_sample_rate);
+DECLARE_int64(application_db_read_cache_bytes);
 
 namespace admin {
 
@@ -40,6 +54,7 @@ using rocksdb::Options;
 using rocksdb::Slice;
 using rocksdb::SstFileWriter;
 using std::list;
+using std::make_pair;
 using std::make_unique;
 using std::pair;
 using std::string;
@@ -166,6 +181,347 @@ TEST_F(ApplicationDBTestBase, GetLSMLevelInfo) {
   EXPECT_EQ(db_->getHighestEmptyLevel(), 6);
 }
 
+TEST_F(ApplicationDBTestBase, IsWriteStalled) {
+  // Nothing stalls the writes of a new db
+  EXPECT_FALSE(db_->IsWriteStalled());
+
+  EXPECT_TRUE(db_->rocksdb()->Put(rocksdb::WriteOptions(), "key", "value").ok());
+  EXPECT_FALSE(db_->IsWriteStalled());
+}
+
+TEST_F(ApplicationDBTestBase, Scan) {
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(db_->rocksdb()->Put(rocksdb::WriteOptions(),
+                                    "key" + to_string(i),
+                                    "value" + to_string(i)).ok());
+  }
+  // Some of them in an sst file, the rest in the memtable
+  EXPECT_TRUE(db_->rocksdb()->Flush(rocksdb::FlushOptions()).ok());
+  EXPECT_TRUE(db_->rocksdb()->Put(rocksdb::WriteOptions(), "key5",
+                                  "new_value5").ok());
+
+  ScanResults results;
+  auto s = db_->Scan(rocksdb::ReadOptions(), "key2", "key7", 3, &results);
+  EXPECT_TRUE(s.ok());
+  ASSERT_EQ(results.entries.size(), 3);
+  EXPECT_EQ(results.entries[0].first.ToString(), "key2");
+  EXPECT_EQ(results.entries[0].second.ToString(), "value2");
+  EXPECT_EQ(results.entries[2].first.ToString(), "key4");
+  EXPECT_EQ(results.next_key, "key5");
+
+  // The next page stops before end
+  s = db_->Scan(rocksdb::ReadOptions(), results.next_key, "key7", 3,
+                &results);
+  EXPECT_TRUE(s.ok());
+  ASSERT_EQ(results.entries.size(), 2);
+  EXPECT_EQ(results.entries[0].first.ToString(), "key5");
+  EXPECT_EQ(results.entries[0].second.ToString(), "new_value5");
+  EXPECT_EQ(results.entries[1].first.ToString(), "key6");
+  EXPECT_TRUE(results.next_key.empty());
+
+  // No end
+  s = db_->Scan(rocksdb::ReadOptions(), "key8", "", 100, &results);
+  EXPECT_TRUE(s.ok());
+  ASSERT_EQ(results.entries.size(), 2);
+  EXPECT_EQ(results.entries[1].first.ToString(), "key9");
+  EXPECT_TRUE(results.next_key.empty());
+
+  // From a key pointing into the blocks pinned by the previous page
+  s = db_->Scan(rocksdb::ReadOptions(), results.entries[1].first, "", 100,
+                &results);
+  EXPECT_TRUE(s.ok());
+  ASSERT_EQ(results.entries.size(), 1);
+  EXPECT_EQ(results.entries[0].first.ToString(), "key9");
+
+  // Scan a snapshot
+  auto snapshot = db_->rocksdb()->GetSnapshot();
+  EXPECT_TRUE(db_->rocksdb()->Delete(rocksdb::WriteOptions(), "key0").ok());
+  rocksdb::ReadOptions options;
+  options.snapshot = snapshot;
+  folly::InlineExecutor executor;
+  auto async_results =
+    db_->ScanAsync(options, "key0", "key1", 10, &executor).get();
+  ASSERT_EQ(async_results->entries.size(), 1);
+  EXPECT_EQ(async_results->entries[0].second.ToString(), "value0");
+  db_->rocksdb()->ReleaseSnapshot(snapshot);
+
+  async_results = db_->ScanAsync(rocksdb::ReadOptions(), "key0", "key1", 10,
+                                 &executor).get();
+  EXPECT_TRUE(async_results->entries.empty());
+}
+
+TEST_F(ApplicationDBTestBase, HotKeys) {
+  // Not sampling keys by default
+  string value;
+  for (int i = 0; i < 100; ++i) {
+    db_->Get(rocksdb::ReadOptions(), "hot_key", &value);
+  }
+  EXPECT_TRUE(db_->GetHotKeys().empty());
+
+  FLAGS_application_db_hot_key_sample_rate = 1;
+  recreateDBWithAllowIngestBehind();
+  FLAGS_application_db_hot_key_sample_rate = 0;
+
+  vector<pair<string, bool>> handled;
+  ApplicationDB::SetHotKeyHandler(
+    [&handled] (const string& db_name, const Slice& key, bool is_write) {
+      handled.emplace_back(key.ToString(), is_write);
+    });
+
+  for (int i = 0; i < 100; ++i) {
+    db_->Get(rocksdb::ReadOptions(), "key" + to_string(i), &value);
+    db_->Get(rocksdb::ReadOptions(), "hot_key", &value);
+  }
+  EXPECT_EQ(db_->GetHotKeys(), vector<string>({"hot_key"}));
+  ASSERT_FALSE(handled.empty());
+  EXPECT_EQ(handled.back(), make_pair(string("hot_key"), false));
+
+  rocksdb::WriteBatch batch;
+  batch.Put("hot_key", "value");
+  batch.Delete("hot_key");
+  handled.clear();
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  ASSERT_EQ(handled.size(), 2);
+  EXPECT_EQ(handled[0], make_pair(string("hot_key"), true));
+
+  ApplicationDB::SetHotKeyHandler(nullptr);
+  handled.clear();
+  db_->Get(rocksdb::ReadOptions(), "hot_key", &value);
+  EXPECT_TRUE(handled.empty());
+}
+
+TEST_F(ApplicationDBTestBase, PerfContextSampling) {
+  FLAGS_application_db_perf_context_sample_rate = 1;
+  recreateDBWithAllowIngestBehind();
+  FLAGS_application_db_perf_context_sample_rate = 0;
+
+  rocksdb::WriteBatch batch;
+  batch.Put("key", "value");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  EXPECT_TRUE(db_->rocksdb()->Flush(rocksdb::FlushOptions()).ok());
+  string value;
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  vector<string> values;
+  EXPECT_EQ(db_->MultiGet(rocksdb::ReadOptions(), {"key"}, &values).size(),
+            1);
+
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  const string tag = " segment=" + DbNameToSegment(db_name());
+  for (const string name : {"rocksdb_get_block_reads",
+                            "rocksdb_multi_get_block_reads",
+                            "rocksdb_write_wal_us"}) {
+    auto metric = common::Stats::get()->GetMetric(name + tag);
+    ASSERT_NE(metric, nullptr) << name;
+    EXPECT_EQ(metric->GetCountTotal(), 1) << name;
+  }
+  // The block of key was read from the sst file
+  EXPECT_GE(common::Stats::get()->GetMetric(
+              "rocksdb_get_block_reads" + tag)->GetSumTotal(), 1);
+}
+
+TEST_F(ApplicationDBTestBase, ReadCache) {
+  EXPECT_EQ(db_->read_cache(), nullptr);
+
+  FLAGS_application_db_read_cache_bytes = 1024 * 1024;
+  recreateDBWithAllowIngestBehind();
+  FLAGS_application_db_read_cache_bytes = 0;
+  ASSERT_NE(db_->read_cache(), nullptr);
+
+  rocksdb::WriteBatch batch;
+  batch.Put("key", "value");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  string value;
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "value");
+
+  // Served from the cache, which doesn't see writes bypassing db_
+  EXPECT_TRUE(db_->rocksdb()->Put(rocksdb::WriteOptions(), "key",
+                                  "new_value").ok());
+  rocksdb::PinnableSlice pinnable;
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &pinnable).ok());
+  EXPECT_EQ(pinnable.ToString(), "value");
+  EXPECT_EQ(db_->read_cache()->hits(), 1);
+
+  // Snapshot reads bypass the cache
+  rocksdb::ReadOptions options;
+  options.snapshot = db_->rocksdb()->GetSnapshot();
+  EXPECT_TRUE(db_->Get(options, "key", &value).ok());
+  EXPECT_EQ(value, "new_value");
+  db_->rocksdb()->ReleaseSnapshot(options.snapshot);
+
+  db_->ClearReadCache();
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "new_value");
+
+  // Writes evict the keys they update
+  batch.Clear();
+  batch.Put("key", "newest_value");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "newest_value");
+}
+
+TEST_F(ApplicationDBTestBase, ChangeRole) {
+  EXPECT_TRUE(db_->IsSlave());
+  rocksdb::WriteBatch batch;
+  batch.Put("key", "value");
+
+  string err_msg;
+  EXPECT_TRUE(db_->ChangeRole(replicator::DBRole::MASTER, nullptr, &err_msg));
+  EXPECT_FALSE(db_->IsSlave());
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+
+  // Writes are refused once it follows an upstream, reads still work
+  EXPECT_TRUE(db_->ChangeRole(
+    replicator::DBRole::SLAVE,
+    make_unique<folly::SocketAddress>("127.0.0.1", 9091), &err_msg));
+  EXPECT_TRUE(db_->IsSlave());
+  ASSERT_NE(db_->upstream_addr(), nullptr);
+  EXPECT_EQ(db_->upstream_addr()->getPort(), 9091);
+  EXPECT_THROW(db_->Write(rocksdb::WriteOptions(), &batch),
+               replicator::ReturnCode);
+  string value;
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "value");
+
+  EXPECT_TRUE(db_->ChangeRole(replicator::DBRole::MASTER, nullptr, &err_msg));
+  EXPECT_FALSE(db_->IsSlave());
+  EXPECT_EQ(db_->upstream_addr(), nullptr);
+  batch.Clear();
+  batch.Put("key", "new_value");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "new_value");
+}
+
+TEST_F(ApplicationDBTestBase, DeleteAllKeys) {
+  // Nothing to do for an empty db
+  EXPECT_TRUE(db_->DeleteAllKeys().ok());
+
+  rocksdb::WriteBatch batch;
+  for (int i = 0; i < 100; ++i) {
+    batch.Put("key" + to_string(i), "value");
+  }
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  EXPECT_TRUE(db_->rocksdb()->Flush(rocksdb::FlushOptions()).ok());
+  batch.Clear();
+  batch.Put("key_in_memtable", "value");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  const auto seq_no = db_->rocksdb()->GetLatestSequenceNumber();
+
+  EXPECT_TRUE(db_->DeleteAllKeys().ok());
+
+  unique_ptr<rocksdb::Iterator> iter(
+    db_->rocksdb()->NewIterator(rocksdb::ReadOptions()));
+  iter->SeekToFirst();
+  EXPECT_FALSE(iter->Valid());
+  iter.reset();
+  rocksdb::ColumnFamilyMetaData meta;
+  db_->rocksdb()->GetColumnFamilyMetaData(&meta);
+  EXPECT_EQ(meta.file_count, 0);
+  EXPECT_GT(db_->rocksdb()->GetLatestSequenceNumber(), seq_no);
+
+  // Still usable
+  batch.Clear();
+  batch.Put("key", "new_value");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  string value;
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key", &value).ok());
+  EXPECT_EQ(value, "new_value");
+}
+
+TEST_F(ApplicationDBTestBase, WarmUp) {
+  rocksdb::WriteBatch batch;
+  for (int i = 0; i < 10000; ++i) {
+    batch.Put("key" + to_string(i), string(100, 'v'));
+  }
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+  EXPECT_TRUE(db_->rocksdb()->Flush(rocksdb::FlushOptions()).ok());
+
+  EXPECT_FALSE(db_->IsWarmedUp());
+  db_->WarmUp(std::chrono::seconds(10), 1024 * 1024, 0);
+  EXPECT_TRUE(db_->IsWarmedUp());
+
+  // A tiny budget gives up early, but still counts as done
+  db_->WarmUp(std::chrono::milliseconds(0), 1024 * 1024, 1);
+  EXPECT_TRUE(db_->IsWarmedUp());
+
+  string value;
+  EXPECT_TRUE(db_->Get(rocksdb::ReadOptions(), "key1", &value).ok());
+  EXPECT_EQ(value, string(100, 'v'));
+}
+
+TEST_F(ApplicationDBTestBase, BatchedMultiGet) {
+  rocksdb::WriteBatch batch;
+  batch.Put("key1", "value1");
+  batch.Put("key3", "value3");
+  EXPECT_TRUE(db_->Write(rocksdb::WriteOptions(), &batch).ok());
+
+  const vector<Slice> keys = {"key1", "key2", "key3"};
+  vector<rocksdb::PinnableSlice> values(keys.size());
+  vector<rocksdb::Status> statuses(keys.size());
+  db_->MultiGet(rocksdb::ReadOptions(), keys.size(), keys.data(),
+                values.data(), statuses.data(), true);
+  EXPECT_TRUE(statuses[0].ok());
+  EXPECT_EQ(values[0].ToString(), "value1");
+  EXPECT_TRUE(statuses[1].IsNotFound());
+  EXPECT_TRUE(statuses[2].ok());
+  EXPECT_EQ(values[2].ToString(), "value3");
+}
+
+TEST(ColumnFamilyDBTest, ReadWriteAndReopen) {
+  const string path = "/tmp/column_family_db_test";
+  EXPECT_NO_THROW(remove_all(path));
+  Options options;
+  options.create_if_missing = true;
+  const vector<rocksdb::ColumnFamilyDescriptor> column_families = {
+    rocksdb::ColumnFamilyDescriptor("cf1", rocksdb::ColumnFamilyOptions())};
+
+  unique_ptr<DB> db;
+  EXPECT_TRUE(ColumnFamilyDB::Open(options, path, column_families, &db).ok());
+  {
+    ApplicationDB app_db("column_family_db", std::move(db),
+                         replicator::DBRole::SLAVE, nullptr);
+    auto cf1 = app_db.GetColumnFamily("cf1");
+    ASSERT_NE(cf1, nullptr);
+    EXPECT_EQ(app_db.GetColumnFamily(""),
+              app_db.rocksdb()->DefaultColumnFamily());
+    EXPECT_EQ(app_db.GetColumnFamily("cf2"), nullptr);
+
+    rocksdb::WriteBatch batch;
+    batch.Put("key", "default_value");
+    batch.Put(cf1, "key", "cf1_value");
+    EXPECT_TRUE(app_db.Write(rocksdb::WriteOptions(), &batch).ok());
+
+    string value;
+    EXPECT_TRUE(app_db.Get(rocksdb::ReadOptions(), "key", &value).ok());
+    EXPECT_EQ(value, "default_value");
+    EXPECT_TRUE(app_db.Get(rocksdb::ReadOptions(), cf1, "key", &value).ok());
+    EXPECT_EQ(value, "cf1_value");
+
+    // Clearing cf1 leaves the default column family alone
+    EXPECT_TRUE(app_db.DeleteAllKeys(cf1).ok());
+    EXPECT_TRUE(
+      app_db.Get(rocksdb::ReadOptions(), cf1, "key", &value).IsNotFound());
+    EXPECT_TRUE(app_db.Get(rocksdb::ReadOptions(), "key", &value).ok());
+
+    batch.Clear();
+    batch.Put(cf1, "key", "cf1_value");
+    EXPECT_TRUE(app_db.Write(rocksdb::WriteOptions(), &batch).ok());
+  }
+
+  // cf1 is opened again without asking for it
+  EXPECT_TRUE(ColumnFamilyDB::Open(options, path, {}, &db).ok());
+  auto cf1 = ColumnFamilyDB::GetColumnFamily(db.get(), "cf1");
+  ASSERT_NE(cf1, nullptr);
+  EXPECT_EQ(ColumnFamilyDB::GetColumnFamilies(db.get()).size(), 2);
+  string value;
+  EXPECT_TRUE(db->Get(rocksdb::ReadOptions(), cf1, "key", &value).ok());
+  EXPECT_EQ(value, "cf1_value");
+  db.reset();
+  EXPECT_NO_THROW(remove_all(path));
+}
+
 }  // namespace admin
 
 int main(int argc, char** argv) {
@@ -0,0 +1,161 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_admin/application_db.h"
+#include "rocksdb_admin/compaction_scheduler.h"
+
+namespace admin {
+
+namespace {
+
+std::shared_ptr<ApplicationDB> OpenDBWithL0Files(const std::string& name,
+                                                 const int n_files) {
+  const auto path = "/tmp/compaction_scheduler_test/" + name;
+  boost::filesystem::remove_all(path);
+  boost::filesystem::create_directories(path);
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  options.disable_auto_compactions = true;
+  rocksdb::DB* db;
+  EXPECT_TRUE(rocksdb::DB::Open(options, path, &db).ok());
+  for (int i = 0; i < n_files; ++i) {
+    EXPECT_TRUE(db->Put(rocksdb::WriteOptions(), "key" + std::to_string(i),
+                        "value").ok());
+    EXPECT_TRUE(db->Flush(rocksdb::FlushOptions()).ok());
+  }
+  return std::make_shared<ApplicationDB>(
+    name, std::shared_ptr<rocksdb::DB>(db), replicator::DBRole::SLAVE,
+    nullptr);
+}
+
+std::string NumL0Files(const std::shared_ptr<ApplicationDB>& db) {
+  std::string value;
+  EXPECT_TRUE(db->rocksdb()->GetProperty("rocksdb.num-files-at-level0",
+                                         &value));
+  return value;
+}
+
+}  // namespace
+
+TEST(CompactionSchedulerTest, NoLimit) {
+  CompactionScheduler scheduler(0);
+  auto db = OpenDBWithL0Files("no_limit", 3);
+  EXPECT_EQ(NumL0Files(db), "3");
+  EXPECT_TRUE(scheduler.Compact(db, rocksdb::CompactRangeOptions()).ok());
+  EXPECT_EQ(NumL0Files(db), "0");
+}
+
+TEST(CompactionSchedulerTest, ConcurrentCompactions) {
+  CompactionScheduler scheduler(1);
+  std::vector<std::shared_ptr<ApplicationDB>> dbs;
+  for (int i = 0; i < 8; ++i) {
+    dbs.push_back(OpenDBWithL0Files("db" + std::to_string(i), i + 1));
+  }
+
+  std::atomic<int> n_ok(0);
+  std::vector<std::thread> threads;
+  for (const auto& db : dbs) {
+    threads.emplace_back([&scheduler, &n_ok, db] {
+        if (scheduler.Compact(db, rocksdb::CompactRangeOptions()).ok()) {
+          ++n_ok;
+        }
+      });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(n_ok, 8);
+  EXPECT_EQ(scheduler.NumWaiting(), 0);
+  for (const auto& db : dbs) {
+    EXPECT_EQ(NumL0Files(db), "0");
+  }
+}
+
+TEST(CompactionSchedulerTest, CompactRanges) {
+  CompactionScheduler scheduler(1);
+  auto db = OpenDBWithL0Files("ranges", 8);
+
+  uint64_t total_bytes = 0;
+  uint64_t compacted_bytes = 0;
+  int n_compacted_ranges = 0;
+  std::mutex mutex;
+  EXPECT_TRUE(scheduler.Compact(
+      db, rocksdb::CompactRangeOptions(), 4,
+      [&] (const bool is_total, const uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (is_total) {
+          total_bytes = bytes;
+        } else {
+          compacted_bytes += bytes;
+          ++n_compacted_ranges;
+        }
+      }).ok());
+
+  EXPECT_GT(total_bytes, 0);
+  EXPECT_EQ(compacted_bytes, total_bytes);
+  EXPECT_EQ(n_compacted_ranges, 4);
+  EXPECT_EQ(NumL0Files(db), "0");
+  for (int i = 0; i < 8; ++i) {
+    std::string value;
+    EXPECT_TRUE(db->rocksdb()->Get(rocksdb::ReadOptions(),
+                                   "key" + std::to_string(i), &value).ok());
+  }
+}
+
+TEST(CompactionSchedulerTest, SplitKeySpace) {
+  auto db = OpenDBWithL0Files("split", 8);
+
+  const auto ranges = CompactionScheduler::SplitKeySpace(db, 4);
+  ASSERT_EQ(ranges.size(), 4);
+  EXPECT_FALSE(ranges.front().has_begin);
+  EXPECT_FALSE(ranges.back().has_end);
+  uint64_t total_bytes = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    EXPECT_GT(ranges[i].bytes, 0);
+    total_bytes += ranges[i].bytes;
+    if (i > 0) {
+      // the ranges are adjacent, in key order
+      EXPECT_TRUE(ranges[i].has_begin);
+      EXPECT_EQ(ranges[i].begin, ranges[i - 1].end);
+      EXPECT_TRUE(ranges[i - 1].has_end);
+    }
+  }
+
+  std::string value;
+  EXPECT_TRUE(db->rocksdb()->GetProperty("rocksdb.total-sst-files-size",
+                                         &value));
+  EXPECT_EQ(std::to_string(total_bytes), value);
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
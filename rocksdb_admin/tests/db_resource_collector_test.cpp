@@ -0,0 +1,129 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_admin/application_db_manager.h"
+#include "rocksdb_admin/db_resource_collector.h"
+
+namespace admin {
+
+namespace {
+
+std::unique_ptr<rocksdb::DB> GetTestDB(const std::string& dir) {
+  EXPECT_EQ(std::system(("rm -rf " + dir).c_str()), 0);
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  rocksdb::DB* db;
+  auto s = rocksdb::DB::Open(options, dir, &db);
+  if (!s.ok()) {
+    LOG(ERROR) << "Failed to create db at " << dir << " with error "
+               << s.ToString();
+    return nullptr;
+  }
+  return std::unique_ptr<rocksdb::DB>(db);
+}
+
+void AddDB(ApplicationDBManager* db_manager, const std::string& db_name) {
+  std::string error_message;
+  ASSERT_TRUE(db_manager->addDB(
+    db_name, GetTestDB("/tmp/db_resource_collector_test_" + db_name),
+    replicator::DBRole::SLAVE, &error_message)) << error_message;
+}
+
+}  // namespace
+
+TEST(DBResourceCollectorTest, Collect) {
+  ApplicationDBManager db_manager;
+  AddDB(&db_manager, "db00000");
+  AddDB(&db_manager, "db00001");
+  DBResourceCollector collector(&db_manager, std::chrono::milliseconds(0));
+  EXPECT_TRUE(collector.GetUsage().empty());
+
+  collector.Collect();
+  auto usage = collector.GetUsage();
+  ASSERT_EQ(usage.size(), 2);
+  EXPECT_EQ(usage[0].db_name, "db00000");
+  EXPECT_EQ(usage[1].db_name, "db00001");
+  EXPECT_EQ(usage[1].read_qps, 0);
+  EXPECT_EQ(usage[1].write_qps, 0);
+
+  std::string error_message;
+  auto db = db_manager.getDB("db00001", &error_message);
+  ASSERT_NE(db, nullptr);
+  for (int i = 0; i < 100; ++i) {
+    rocksdb::WriteBatch batch;
+    batch.Put("key" + std::to_string(i), "value");
+    EXPECT_TRUE(db->Write(rocksdb::WriteOptions(), &batch).ok());
+  }
+  std::string value;
+  EXPECT_TRUE(db->Get(rocksdb::ReadOptions(), "key1", &value).ok());
+  ASSERT_TRUE(db->rocksdb()->Flush(rocksdb::FlushOptions()).ok());
+  EXPECT_EQ(db->NumWrites(), 100);
+  EXPECT_EQ(db->NumReads(), 1);
+  db.reset();
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  collector.Collect();
+  usage = collector.GetUsage();
+  ASSERT_EQ(usage.size(), 2);
+  EXPECT_EQ(usage[0].write_qps, 0);
+  EXPECT_GT(usage[1].write_qps, 0);
+  EXPECT_GT(usage[1].read_qps, 0);
+  EXPECT_EQ(usage[1].num_l0_files, 1);
+  EXPECT_GT(usage[1].sst_file_bytes, 0);
+  EXPECT_EQ(usage[1].replication_seq_no_lag, 0);
+
+  auto text = collector.DumpUsageAsText();
+  EXPECT_NE(text.find("  num_l0_files db=db00001: 1\n"), std::string::npos);
+  EXPECT_NE(text.find("  num_l0_files db=db00000: 0\n"), std::string::npos);
+
+  // the hottest db goes first
+  text = collector.DumpHottestDBsAsText(1);
+  EXPECT_NE(text.find("\ndb00001 "), std::string::npos);
+  EXPECT_EQ(text.find("db00000"), std::string::npos);
+
+  // removed dbs are dropped by the next pass
+  EXPECT_NE(db_manager.removeDB("db00000", &error_message), nullptr);
+  collector.Collect();
+  usage = collector.GetUsage();
+  ASSERT_EQ(usage.size(), 1);
+  EXPECT_EQ(usage[0].db_name, "db00001");
+}
+
+TEST(DBResourceCollectorTest, Periodic) {
+  ApplicationDBManager db_manager;
+  AddDB(&db_manager, "db00002");
+  DBResourceCollector collector(&db_manager, std::chrono::milliseconds(10));
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_EQ(collector.GetUsage().size(), 1);
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,77 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_admin/flush_listener.h"
+
+namespace admin {
+
+TEST(FlushListenerTest, LargestFlushedSeqNo) {
+  const std::string db_name = "flush_listener_test_db";
+  const std::string db_path = "/tmp/" + db_name;
+  boost::filesystem::remove_all(db_path);
+
+  std::vector<std::pair<std::string, rocksdb::SequenceNumber>> flushes;
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  FlushListener::AddTo(
+    [&flushes] (const std::string& name,
+                const rocksdb::SequenceNumber largest_seqno) {
+      flushes.emplace_back(name, largest_seqno);
+    },
+    &options);
+
+  rocksdb::DB* raw_db;
+  ASSERT_TRUE(rocksdb::DB::Open(options, db_path, &raw_db).ok());
+  std::unique_ptr<rocksdb::DB> db(raw_db);
+  rocksdb::WriteOptions write_options;
+  write_options.disableWAL = true;
+  EXPECT_TRUE(db->Put(write_options, "key1", "value").ok());
+  EXPECT_TRUE(db->Put(write_options, "key2", "value").ok());
+  EXPECT_TRUE(db->Flush(rocksdb::FlushOptions()).ok());
+  ASSERT_EQ(flushes.size(), 1);
+  EXPECT_EQ(flushes[0].first, db_name);
+  EXPECT_EQ(flushes[0].second, db->GetLatestSequenceNumber());
+
+  // Not flushed yet
+  EXPECT_TRUE(db->Put(write_options, "key3", "value").ok());
+  EXPECT_EQ(flushes.size(), 1);
+
+  // Updates of other column families don't persist the default one
+  rocksdb::ColumnFamilyHandle* cf;
+  ASSERT_TRUE(db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "cf",
+                                     &cf).ok());
+  EXPECT_TRUE(db->Put(write_options, cf, "key", "value").ok());
+  EXPECT_TRUE(db->Flush(rocksdb::FlushOptions(), cf).ok());
+  EXPECT_EQ(flushes.size(), 1);
+  delete cf;
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
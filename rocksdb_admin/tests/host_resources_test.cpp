@@ -0,0 +1,134 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "rocksdb/options.h"
+#include "rocksdb/table.h"
+#include "rocksdb_admin/host_resources.h"
+
+namespace admin {
+
+namespace {
+
+std::shared_ptr<rocksdb::Cache> BlockCache(const rocksdb::Options& options) {
+  return static_cast<rocksdb::BlockBasedTableOptions*>(
+    options.table_factory->GetOptions())->block_cache;
+}
+
+}  // namespace
+
+TEST(HostResourcesTest, Disabled) {
+  HostResources resources(0, false, "", 0, 0);
+  EXPECT_FALSE(resources.Enabled());
+
+  rocksdb::Options options;
+  const auto cache = BlockCache(options);
+  resources.Apply("segment", &options);
+  EXPECT_EQ(BlockCache(options), cache);
+  EXPECT_EQ(options.write_buffer_manager, nullptr);
+  EXPECT_EQ(options.rate_limiter, nullptr);
+  EXPECT_TRUE(resources.DumpUsageAsText().empty());
+}
+
+TEST(HostResourcesTest, Shared) {
+  const int64_t cache_bytes = 1000 * 1000;
+  HostResources resources(cache_bytes, false, "hot:0.5,warm:0.25", 1000, 1000);
+  EXPECT_TRUE(resources.Enabled());
+
+  rocksdb::Options options1;
+  rocksdb::Options options2;
+  resources.Apply("cold", &options1);
+  resources.Apply("other", &options2);
+  EXPECT_EQ(BlockCache(options1), BlockCache(options2));
+  EXPECT_EQ(BlockCache(options1)->GetCapacity(), cache_bytes / 4);
+  EXPECT_NE(options1.write_buffer_manager, nullptr);
+  EXPECT_EQ(options1.write_buffer_manager, options2.write_buffer_manager);
+  EXPECT_NE(options1.rate_limiter, nullptr);
+  EXPECT_EQ(options1.rate_limiter, options2.rate_limiter);
+
+  rocksdb::Options hot_options;
+  resources.Apply("hot", &hot_options);
+  EXPECT_NE(BlockCache(hot_options), BlockCache(options1));
+  EXPECT_EQ(BlockCache(hot_options)->GetCapacity(), cache_bytes / 2);
+  EXPECT_EQ(hot_options.write_buffer_manager, options1.write_buffer_manager);
+
+  const auto usage = resources.DumpUsageAsText();
+  EXPECT_NE(usage.find("host_block_cache_capacity: 250000"),
+            std::string::npos);
+  EXPECT_NE(usage.find("host_block_cache_capacity segment=hot: 500000"),
+            std::string::npos);
+  EXPECT_NE(usage.find("host_write_buffer_size: 1000"), std::string::npos);
+}
+
+TEST(HostResourcesTest, OwnArena) {
+  // Falls back to the default allocator if rocksdb is built without jemalloc
+  HostResources resources(1000 * 1000, false, "hot:0.5", 0, 0, "", 0, true,
+                          true);
+  EXPECT_TRUE(resources.Enabled());
+
+  rocksdb::Options options;
+  resources.Apply("hot", &options);
+  auto cache = BlockCache(options);
+  EXPECT_EQ(cache->GetCapacity(), 500 * 1000);
+  EXPECT_TRUE(cache->Insert("key", nullptr, 100, nullptr).ok());
+  EXPECT_EQ(cache->GetUsage(), 100);
+}
+
+TEST(HostResourcesTest, FlashCache) {
+  EXPECT_EQ(std::system("rm -rf /tmp/host_resources_test_flash"), 0);
+  HostResources resources(1000 * 1000, false, "", 0, 0,
+                          "/tmp/host_resources_test_flash", 64 << 20, true);
+  EXPECT_TRUE(resources.Enabled());
+
+  rocksdb::Options options1;
+  rocksdb::Options options2;
+  resources.Apply("segment1", &options1);
+  resources.Apply("segment2", &options2);
+  const auto flash_cache = static_cast<rocksdb::BlockBasedTableOptions*>(
+    options1.table_factory->GetOptions())->persistent_cache;
+  EXPECT_NE(flash_cache, nullptr);
+  EXPECT_EQ(flash_cache, static_cast<rocksdb::BlockBasedTableOptions*>(
+    options2.table_factory->GetOptions())->persistent_cache);
+  EXPECT_NE(options1.statistics, nullptr);
+  EXPECT_EQ(options1.statistics, options2.statistics);
+
+  // Admitted the second time only
+  const std::string block = "block";
+  std::unique_ptr<char[]> data;
+  size_t size;
+  EXPECT_TRUE(flash_cache->Insert("key", block.data(), block.size()).ok());
+  EXPECT_FALSE(flash_cache->Lookup("key", &data, &size).ok());
+  EXPECT_TRUE(flash_cache->Insert("key", block.data(), block.size()).ok());
+
+  const auto usage = resources.DumpUsageAsText();
+  EXPECT_NE(usage.find("host_flash_cache_rejected_inserts: 1"),
+            std::string::npos);
+  EXPECT_NE(usage.find("host_flash_cache_capacity: 67108864"),
+            std::string::npos);
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
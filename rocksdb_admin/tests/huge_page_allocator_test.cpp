@@ -0,0 +1,112 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb/cache.h"
+#include "rocksdb_admin/huge_page_allocator.h"
+
+#if ROCKSDB_MAJOR >= 6
+
+namespace admin {
+
+TEST(HugePageAllocatorTest, AllocateAndReuse) {
+  HugePageAllocator allocator(1);
+  auto p = allocator.Allocate(1000);
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % 16, 0);
+  EXPECT_GE(allocator.UsableSize(p, 1000), 1000);
+  memset(p, 'a', allocator.UsableSize(p, 1000));
+
+  // Mapped with either kind of huge pages, even if the kernel has none
+  auto stats = allocator.GetStats();
+  EXPECT_EQ(stats.hugetlb_regions + stats.thp_regions, 1);
+  EXPECT_GE(stats.allocated_bytes, 1000);
+  EXPECT_EQ(stats.fallback_allocations, 0);
+
+  // A freed block is reused by the next one of its class
+  allocator.Deallocate(p);
+  EXPECT_EQ(allocator.GetStats().allocated_bytes, 0);
+  EXPECT_EQ(allocator.Allocate(990), p);
+  allocator.Deallocate(p);
+
+  // Filling up a 2MB region maps another one
+  std::vector<void*> blocks;
+  for (int i = 0; i < 64; ++i) {
+    blocks.push_back(allocator.Allocate(64 * 1024));
+  }
+  stats = allocator.GetStats();
+  EXPECT_EQ(stats.hugetlb_regions + stats.thp_regions, 3);
+  for (auto block : blocks) {
+    allocator.Deallocate(block);
+  }
+  EXPECT_EQ(allocator.GetStats().allocated_bytes, 0);
+}
+
+TEST(HugePageAllocatorTest, Fallback) {
+  HugePageAllocator allocator;
+  const size_t size = 4 << 20;
+  auto p = allocator.Allocate(size);
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(allocator.UsableSize(p, size), size);
+  memset(p, 'a', size);
+  EXPECT_EQ(allocator.GetStats().fallback_allocations, 1);
+  EXPECT_EQ(allocator.GetStats().allocated_bytes, 0);
+  allocator.Deallocate(p);
+}
+
+TEST(HugePageAllocatorTest, MaxMappedBytes) {
+  HugePageAllocator allocator(1, 2 << 20);
+  std::vector<void*> blocks;
+  for (int i = 0; i < 64; ++i) {
+    blocks.push_back(allocator.Allocate(64 * 1024));
+    ASSERT_NE(blocks.back(), nullptr);
+  }
+
+  // The blocks which don't fit in the one region allowed are malloc()ed
+  auto stats = allocator.GetStats();
+  EXPECT_EQ(stats.hugetlb_regions + stats.thp_regions, 1);
+  EXPECT_GT(stats.fallback_allocations, 0);
+  EXPECT_LE(stats.allocated_bytes, 2 << 20);
+  for (auto block : blocks) {
+    allocator.Deallocate(block);
+  }
+  EXPECT_EQ(allocator.GetStats().allocated_bytes, 0);
+}
+
+TEST(HugePageAllocatorTest, BlockCache) {
+  rocksdb::LRUCacheOptions options;
+  options.capacity = 1 << 20;
+  options.memory_allocator = std::make_shared<HugePageAllocator>();
+  auto cache = rocksdb::NewLRUCache(options);
+  EXPECT_EQ(cache->memory_allocator(), options.memory_allocator.get());
+}
+
+}  // namespace admin
+
+#endif  // ROCKSDB_MAJOR >= 6
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
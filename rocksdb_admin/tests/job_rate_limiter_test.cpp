@@ -0,0 +1,94 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_admin/job_rate_limiter.h"
+
+namespace admin {
+
+const int64_t kMB = 1024 * 1024;
+
+TEST(JobRateLimiterTest, NoLimit) {
+  JobRateLimiter limiter(nullptr, 0);
+  for (int i = 0; i < 10; ++i) {
+    limiter.Request(kMB, rocksdb::Env::IO_LOW);
+  }
+
+  EXPECT_EQ(limiter.GetTotalBytesThrough(), 10 * kMB);
+  EXPECT_EQ(limiter.GetTotalRequests(), 10);
+  EXPECT_GT(limiter.GetThroughput(), 0);
+}
+
+TEST(JobRateLimiterTest, OwnLimit) {
+  JobRateLimiter limiter(nullptr, 10 * kMB);
+  EXPECT_EQ(limiter.GetBytesPerSecond(), 10 * kMB);
+
+  // The requests larger than a burst are let through a burst at a time
+  const auto start = std::chrono::steady_clock::now();
+  limiter.Request(5 * kMB, rocksdb::Env::IO_LOW);
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(elapsed, std::chrono::milliseconds(300));
+  EXPECT_EQ(limiter.GetTotalBytesThrough(), 5 * kMB);
+}
+
+TEST(JobRateLimiterTest, EvenShares) {
+  std::shared_ptr<rocksdb::RateLimiter> shared(
+    rocksdb::NewGenericRateLimiter(10 * kMB));
+  JobRateLimiter busy_job(shared, 0);
+  JobRateLimiter quiet_job(shared, 0);
+
+  // The job with more threads doesn't get more of the shared limit
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&stop, &busy_job] {
+        while (!stop) {
+          busy_job.Request(64 * 1024, rocksdb::Env::IO_LOW);
+        }
+      });
+  }
+  threads.emplace_back([&stop, &quiet_job] {
+      while (!stop) {
+        quiet_job.Request(64 * 1024, rocksdb::Env::IO_LOW);
+      }
+    });
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  const auto busy_bytes = busy_job.GetTotalBytesThrough();
+  const auto quiet_bytes = quiet_job.GetTotalBytesThrough();
+  EXPECT_GT(quiet_bytes, 0);
+  EXPECT_LT(busy_bytes, 2 * quiet_bytes);
+  EXPECT_LT(busy_bytes + quiet_bytes, 30 * kMB);
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,79 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <string>
+
+#include "folly/Benchmark.h"
+#include "gflags/gflags.h"
+#include "rocksdb_admin/gen-cpp2/rocksdb_admin_types.h"
+#include "rocksdb_admin/utils.h"
+#include "thrift/lib/cpp2/protocol/Serializer.h"
+
+namespace {
+
+std::string SerializedPayload(const size_t value_size) {
+  admin::KafkaMessagePayload payload;
+  payload.op_code = admin::KafkaOperationCode::PUT;
+  payload.value = std::string(value_size, 'v');
+  payload.__isset.value = true;
+  std::string data;
+  apache::thrift::BinarySerializer::serialize(payload, &data);
+  return data;
+}
+
+// What ingestion did before: decode into a KafkaMessagePayload, and move the
+// value out of it
+void DecodeWithCopy(const size_t n, const size_t value_size) {
+  std::string data;
+  BENCHMARK_SUSPEND {
+    data = SerializedPayload(value_size);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    admin::KafkaMessagePayload payload;
+    apache::thrift::BinarySerializer::deserialize(
+        folly::StringPiece(data), payload);
+    std::string value = std::move(payload.value);
+    folly::doNotOptimizeAway(value);
+  }
+}
+
+void DecodeInPlace(const size_t n, const size_t value_size) {
+  std::string data;
+  BENCHMARK_SUSPEND {
+    data = SerializedPayload(value_size);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    int32_t op_code;
+    folly::StringPiece value;
+    admin::DecodeKafkaMessagePayload(data.data(), data.size(), &op_code,
+                                     &value);
+    folly::doNotOptimizeAway(value);
+  }
+}
+
+}  // namespace
+
+BENCHMARK_PARAM(DecodeWithCopy, 100)
+BENCHMARK_RELATIVE_PARAM(DecodeInPlace, 100)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(DecodeWithCopy, 1024)
+BENCHMARK_RELATIVE_PARAM(DecodeInPlace, 1024)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(DecodeWithCopy, 10240)
+BENCHMARK_RELATIVE_PARAM(DecodeInPlace, 10240)
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
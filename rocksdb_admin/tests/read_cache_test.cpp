@@ -0,0 +1,96 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_admin/read_cache.h"
+
+namespace admin {
+
+TEST(ReadCacheTest, LookupAndErase) {
+  ReadCache cache(1024 * 1024, 4);
+  std::string value;
+  EXPECT_FALSE(cache.Lookup("key", &value));
+
+  cache.Insert("key", "value", cache.GetEpoch("key"));
+  EXPECT_TRUE(cache.Lookup("key", &value));
+  EXPECT_EQ(value, "value");
+  EXPECT_EQ(cache.hits(), 1);
+  EXPECT_EQ(cache.misses(), 1);
+
+  cache.Erase("key");
+  EXPECT_FALSE(cache.Lookup("key", &value));
+
+  rocksdb::WriteBatch batch;
+  batch.Put("key1", "value1");
+  batch.Delete("key2");
+  cache.Insert("key1", "old_value1", cache.GetEpoch("key1"));
+  cache.Insert("key2", "old_value2", cache.GetEpoch("key2"));
+  cache.Insert("key3", "value3", cache.GetEpoch("key3"));
+  cache.Erase(batch);
+  EXPECT_FALSE(cache.Lookup("key1", &value));
+  EXPECT_FALSE(cache.Lookup("key2", &value));
+  EXPECT_TRUE(cache.Lookup("key3", &value));
+
+  cache.Clear();
+  EXPECT_FALSE(cache.Lookup("key3", &value));
+}
+
+TEST(ReadCacheTest, StaleInsert) {
+  ReadCache cache(1024 * 1024, 1);
+  // The key is updated after the reader read it from the db
+  const auto epoch = cache.GetEpoch("key");
+  cache.Erase("key");
+  cache.Insert("key", "old_value", epoch);
+  std::string value;
+  EXPECT_FALSE(cache.Lookup("key", &value));
+
+  cache.Insert("key", "new_value", cache.GetEpoch("key"));
+  EXPECT_TRUE(cache.Lookup("key", &value));
+  EXPECT_EQ(value, "new_value");
+}
+
+TEST(ReadCacheTest, Eviction) {
+  // room for about 10 entries
+  ReadCache cache(10 * 110, 1);
+  std::string value;
+  cache.Insert("hot", "value", cache.GetEpoch("hot"));
+  for (int i = 0; i < 100; ++i) {
+    // the clock keeps the key read since it last passed it
+    EXPECT_TRUE(cache.Lookup("hot", &value));
+    const auto key = "key" + std::to_string(i);
+    cache.Insert(key, "value", cache.GetEpoch(key));
+  }
+
+  EXPECT_TRUE(cache.Lookup("hot", &value));
+  EXPECT_TRUE(cache.Lookup("key99", &value));
+  EXPECT_FALSE(cache.Lookup("key0", &value));
+
+  // too large for the cache
+  cache.Insert("large", std::string(2000, 'a'), cache.GetEpoch("large"));
+  EXPECT_FALSE(cache.Lookup("large", &value));
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,121 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "boost/filesystem.hpp"
+#include "common/stats/stats.h"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb_admin/stats_event_listener.h"
+
+namespace admin {
+
+namespace {
+
+const std::string kDBName = "stats_event_listener_test_db";
+const std::string kDBPath = "/tmp/" + kDBName;
+
+uint64_t CounterTotal(const std::string& name) {
+  auto counter = common::Stats::get()->GetCounter(name);
+  return counter == nullptr ? 0 : counter->GetTotal();
+}
+
+}  // namespace
+
+TEST(StatsEventListenerTest, FlushCompactionAndIngestion) {
+  boost::filesystem::remove_all(kDBPath);
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  options.disable_auto_compactions = true;
+  StatsEventListener::AddTo("test_segment", &options);
+  ASSERT_EQ(options.listeners.size(), 1);
+
+  rocksdb::DB* raw_db;
+  ASSERT_TRUE(rocksdb::DB::Open(options, kDBPath, &raw_db).ok());
+  std::unique_ptr<rocksdb::DB> db(raw_db);
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(db->Put(rocksdb::WriteOptions(), "key" + std::to_string(i),
+                        "value").ok());
+    EXPECT_TRUE(db->Flush(rocksdb::FlushOptions()).ok());
+  }
+  EXPECT_TRUE(db->CompactRange(rocksdb::CompactRangeOptions(),
+                               nullptr, nullptr).ok());
+
+  const std::string sst_path = "/tmp/stats_event_listener_test.sst";
+  rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), options);
+  ASSERT_TRUE(writer.Open(sst_path).ok());
+  EXPECT_TRUE(writer.Put("key9", "value").ok());
+  ASSERT_TRUE(writer.Finish().ok());
+  rocksdb::IngestExternalFileOptions ifo;
+  ifo.move_files = true;
+  EXPECT_TRUE(db->IngestExternalFile({sst_path}, ifo).ok());
+
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  const auto tag = " db=" + kDBName;
+  EXPECT_EQ(CounterTotal("rocksdb_flushes" + tag), 2);
+  EXPECT_GT(CounterTotal("rocksdb_flush_bytes" + tag), 0);
+  EXPECT_EQ(CounterTotal("rocksdb_compactions" + tag), 1);
+  EXPECT_GT(CounterTotal("rocksdb_compaction_input_bytes" + tag), 0);
+  EXPECT_EQ(CounterTotal("rocksdb_ingested_files" + tag), 1);
+  auto flush_ms = common::Stats::get()->GetMetric("rocksdb_flush_ms" + tag);
+  ASSERT_NE(flush_ms, nullptr);
+  EXPECT_EQ(flush_ms->GetCountTotal(), 2);
+}
+
+TEST(StatsEventListenerTest, WriteStalls) {
+  StatsEventListener listener("stall_segment");
+  EXPECT_FALSE(listener.IsStalled());
+
+  rocksdb::WriteStallInfo info;
+  info.cf_name = "default";
+  info.condition.prev = rocksdb::WriteStallCondition::kNormal;
+  info.condition.cur = rocksdb::WriteStallCondition::kDelayed;
+  listener.OnStallConditionsChanged(info);
+  EXPECT_TRUE(listener.IsStalled());
+
+  info.condition.prev = rocksdb::WriteStallCondition::kDelayed;
+  info.condition.cur = rocksdb::WriteStallCondition::kStopped;
+  listener.OnStallConditionsChanged(info);
+  EXPECT_TRUE(listener.IsStalled());
+
+  info.condition.prev = rocksdb::WriteStallCondition::kStopped;
+  info.condition.cur = rocksdb::WriteStallCondition::kNormal;
+  listener.OnStallConditionsChanged(info);
+  EXPECT_FALSE(listener.IsStalled());
+
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  const std::string tag = " segment=stall_segment";
+  EXPECT_EQ(CounterTotal("rocksdb_write_slowdowns" + tag), 1);
+  EXPECT_EQ(CounterTotal("rocksdb_write_stops" + tag), 1);
+  auto stall_ms =
+    common::Stats::get()->GetMetric("rocksdb_write_stall_ms" + tag);
+  ASSERT_NE(stall_ms, nullptr);
+  EXPECT_EQ(stall_ms->GetCountTotal(), 1);
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,110 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_admin/application_db.h"
+#include "rocksdb_admin/ttl_compaction_filter.h"
+
+namespace admin {
+
+std::atomic<uint64_t> now_sec(1000);
+
+uint64_t GetNowSec() {
+  return now_sec.load();
+}
+
+TEST(TtlCompactionFilterTest, Encoding) {
+  const auto value = EncodeTtlValue("value", 123);
+  EXPECT_EQ(value.size(), kTtlTimestampSize + 5);
+  EXPECT_EQ(DecodeTtlTimestamp(value), 123);
+  EXPECT_EQ(StripTtlTimestamp(value).ToString(), "value");
+
+  // Too short to have a timestamp
+  EXPECT_EQ(DecodeTtlTimestamp("short"), 0);
+  EXPECT_EQ(StripTtlTimestamp("short").ToString(), "short");
+
+  TtlCompactionFilterFactory ttl(100, GetNowSec);
+  now_sec.store(1000);
+  EXPECT_FALSE(ttl.IsExpired(EncodeTtlValue("value", 900)));
+  EXPECT_TRUE(ttl.IsExpired(EncodeTtlValue("value", 899)));
+  EXPECT_FALSE(ttl.IsExpired("short"));
+}
+
+TEST(TtlCompactionFilterTest, ExpireInApplicationDB) {
+  const std::string path = "/tmp/ttl_compaction_filter_test";
+  boost::filesystem::remove_all(path);
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  options.compaction_filter_factory =
+    std::make_shared<TtlCompactionFilterFactory>(100, GetNowSec);
+  rocksdb::DB* db;
+  ASSERT_TRUE(rocksdb::DB::Open(options, path, &db).ok());
+  ApplicationDB app_db("ttl_db", std::shared_ptr<rocksdb::DB>(db),
+                       replicator::DBRole::SLAVE, nullptr);
+
+  now_sec.store(1000);
+  rocksdb::WriteBatch batch;
+  batch.Put("old", EncodeTtlValue("old_value", 950));
+  batch.Put("new", EncodeTtlValue("new_value", 1000));
+  ASSERT_TRUE(app_db.Write(rocksdb::WriteOptions(), &batch).ok());
+
+  std::string value;
+  EXPECT_TRUE(app_db.Get(rocksdb::ReadOptions(), "old", &value).ok());
+  EXPECT_EQ(StripTtlTimestamp(value).ToString(), "old_value");
+
+  // Expired, but still in the db until it is compacted
+  now_sec.store(1060);
+  EXPECT_TRUE(app_db.Get(rocksdb::ReadOptions(), "old", &value).IsNotFound());
+  EXPECT_TRUE(app_db.Get(rocksdb::ReadOptions(), "new", &value).ok());
+  std::vector<std::string> values;
+  auto statuses = app_db.MultiGet(rocksdb::ReadOptions(), {"old", "new"},
+                                  &values);
+  EXPECT_TRUE(statuses[0].IsNotFound());
+  EXPECT_TRUE(statuses[1].ok());
+  ScanResults results;
+  EXPECT_TRUE(app_db.Scan(rocksdb::ReadOptions(), "", "", 10, &results).ok());
+  ASSERT_EQ(results.entries.size(), 1);
+  EXPECT_EQ(results.entries[0].first.ToString(), "new");
+  std::string raw_value;
+  EXPECT_TRUE(app_db.rocksdb()->Get(rocksdb::ReadOptions(), "old",
+                                    &raw_value).ok());
+
+  // Compaction drops it without a delete
+  rocksdb::CompactRangeOptions compact_options;
+  compact_options.bottommost_level_compaction =
+    rocksdb::BottommostLevelCompaction::kForce;
+  EXPECT_TRUE(app_db.CompactRange(compact_options, nullptr, nullptr).ok());
+  EXPECT_TRUE(app_db.rocksdb()->Get(rocksdb::ReadOptions(), "old",
+                                    &raw_value).IsNotFound());
+  EXPECT_TRUE(app_db.rocksdb()->Get(rocksdb::ReadOptions(), "new",
+                                    &raw_value).ok());
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
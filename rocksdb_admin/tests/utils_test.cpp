@@ -15,7 +15,11 @@
 
 #include "rocksdb_admin/utils.h"
 
+#include <string>
+
 #include "gtest/gtest.h"
+#include "rocksdb_admin/gen-cpp2/rocksdb_admin_types.h"
+#include "thrift/lib/cpp2/protocol/Serializer.h"
 
 TEST(SegmentToDbNameTest, Basics) {
   EXPECT_EQ(admin::SegmentToDbName("seg", 1), "seg00001");
@@ -41,6 +45,71 @@ TEST(ExtractShardIDTest, Basics) {
   EXPECT_EQ(admin::ExtractShardId(db_name), -1);
 }
 
+TEST(DecodeKafkaMessagePayloadTest, Basics) {
+  admin::KafkaMessagePayload payload;
+  payload.op_code = admin::KafkaOperationCode::MERGE;
+  payload.value = std::string("va\0lue", 6);
+  payload.__isset.value = true;
+  std::string data;
+  apache::thrift::BinarySerializer::serialize(payload, &data);
+
+  int32_t op_code;
+  folly::StringPiece value;
+  ASSERT_TRUE(admin::DecodeKafkaMessagePayload(data.data(), data.size(),
+                                               &op_code, &value));
+  EXPECT_EQ(op_code, static_cast<int32_t>(admin::KafkaOperationCode::MERGE));
+  EXPECT_EQ(value, folly::StringPiece(payload.value));
+  // value points into data
+  EXPECT_GE(value.data(), data.data());
+  EXPECT_LE(value.end(), data.data() + data.size());
+
+  // Without value
+  payload.op_code = admin::KafkaOperationCode::DELETE;
+  payload.value.clear();
+  payload.__isset.value = false;
+  apache::thrift::BinarySerializer::serialize(payload, &data);
+  ASSERT_TRUE(admin::DecodeKafkaMessagePayload(data.data(), data.size(),
+                                               &op_code, &value));
+  EXPECT_EQ(op_code, static_cast<int32_t>(admin::KafkaOperationCode::DELETE));
+  EXPECT_TRUE(value.empty());
+}
+
+TEST(DecodeKafkaMessagePayloadTest, InvalidPayloads) {
+  admin::KafkaMessagePayload payload;
+  payload.op_code = admin::KafkaOperationCode::PUT;
+  payload.value = "value";
+  payload.__isset.value = true;
+  std::string data;
+  apache::thrift::BinarySerializer::serialize(payload, &data);
+
+  int32_t op_code;
+  folly::StringPiece value;
+  // Truncated anywhere
+  for (size_t size = 0; size < data.size(); ++size) {
+    EXPECT_FALSE(admin::DecodeKafkaMessagePayload(data.data(), size,
+                                                  &op_code, &value));
+  }
+
+  // Not a payload at all
+  const std::string garbage = "not a thrift struct";
+  EXPECT_FALSE(admin::DecodeKafkaMessagePayload(garbage.data(), garbage.size(),
+                                                &op_code, &value));
+
+  // Missing the required op_code: a binary field 2 and the stop
+  const std::string no_op_code("\x0b\x00\x02\x00\x00\x00\x01v\x00", 9);
+  EXPECT_FALSE(admin::DecodeKafkaMessagePayload(
+      no_op_code.data(), no_op_code.size(), &op_code, &value));
+
+  // Unknown fields are skipped: an i64 field 7, then op_code and the stop
+  const std::string unknown_field(
+      "\x0a\x00\x07\x00\x00\x00\x00\x00\x00\x00\x01"
+      "\x08\x00\x01\x00\x00\x00\x02\x00", 19);
+  ASSERT_TRUE(admin::DecodeKafkaMessagePayload(
+      unknown_field.data(), unknown_field.size(), &op_code, &value));
+  EXPECT_EQ(op_code, 2);
+  EXPECT_TRUE(value.empty());
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,122 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb/merge_operator.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_admin/write_batch_deduper.h"
+
+namespace admin {
+
+// Appends the operands, which is associative
+class AppendMergeOperator : public rocksdb::AssociativeMergeOperator {
+ public:
+  bool Merge(const rocksdb::Slice& key,
+             const rocksdb::Slice* existing_value,
+             const rocksdb::Slice& value,
+             std::string* new_value,
+             rocksdb::Logger* logger) const override {
+    new_value->clear();
+    if (existing_value != nullptr) {
+      new_value->assign(existing_value->data(), existing_value->size());
+    }
+    new_value->append(value.data(), value.size());
+    return true;
+  }
+
+  const char* Name() const override { return "AppendMergeOperator"; }
+};
+
+// Records the updates of a batch as "<op> <key> <value>"
+class RecordingHandler : public rocksdb::WriteBatch::Handler {
+ public:
+  void Put(const rocksdb::Slice& key, const rocksdb::Slice& value) override {
+    updates.push_back("put " + key.ToString() + " " + value.ToString());
+  }
+
+  void Delete(const rocksdb::Slice& key) override {
+    updates.push_back("delete " + key.ToString());
+  }
+
+  void Merge(const rocksdb::Slice& key, const rocksdb::Slice& value) override {
+    updates.push_back("merge " + key.ToString() + " " + value.ToString());
+  }
+
+  std::vector<std::string> updates;
+};
+
+std::vector<std::string> GetUpdates(const WriteBatchDeduper& deduper) {
+  rocksdb::WriteBatch batch;
+  deduper.AppendTo(&batch);
+  RecordingHandler handler;
+  EXPECT_TRUE(batch.Iterate(&handler).ok());
+  std::sort(handler.updates.begin(), handler.updates.end());
+  return handler.updates;
+}
+
+TEST(WriteBatchDeduperTest, LastWriteWins) {
+  WriteBatchDeduper deduper(nullptr);
+  deduper.Put("a", "1");
+  deduper.Put("a", "2");
+  deduper.Put("b", "1");
+  deduper.Delete("b");
+  deduper.Delete("c");
+  deduper.Put("c", "3");
+  EXPECT_EQ(deduper.Count(), 6u);
+  EXPECT_EQ(deduper.GetDataSize(), 5u);
+  EXPECT_EQ(GetUpdates(deduper),
+            std::vector<std::string>({"delete b", "put a 2", "put c 3"}));
+
+  // Without a merge operator, the operands after the last write are kept
+  deduper.Clear();
+  EXPECT_EQ(deduper.Count(), 0u);
+  EXPECT_TRUE(GetUpdates(deduper).empty());
+  deduper.Merge("a", "x");
+  deduper.Put("a", "1");
+  deduper.Merge("a", "y");
+  deduper.Merge("a", "z");
+  EXPECT_EQ(GetUpdates(deduper),
+            std::vector<std::string>({"merge a y", "merge a z", "put a 1"}));
+}
+
+TEST(WriteBatchDeduperTest, CombineMerges) {
+  WriteBatchDeduper deduper(std::make_shared<AppendMergeOperator>());
+  deduper.Merge("a", "x");
+  deduper.Merge("a", "y");
+  deduper.Put("b", "1");
+  deduper.Merge("b", "x");
+  deduper.Merge("b", "y");
+  deduper.Delete("c");
+  deduper.Merge("c", "x");
+  deduper.Merge("d", "x");
+  EXPECT_EQ(GetUpdates(deduper),
+            std::vector<std::string>(
+              {"merge a xy", "merge d x", "put b 1xy", "put c x"}));
+}
+
+}  // namespace admin
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,119 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/ttl_compaction_filter.h"
+
+#include <chrono>
+#include <cstring>
+#include <utility>
+
+#include "common/stats/stats.h"
+
+namespace {
+
+const std::string kTtlExpiredCompacted = "ttl_expired_compacted";
+
+// If a value written at write_time_sec has outlived ttl_seconds at now_sec
+bool IsExpiredAt(const uint64_t write_time_sec,
+                 const uint64_t ttl_seconds,
+                 const uint64_t now_sec) {
+  return write_time_sec != 0 && write_time_sec + ttl_seconds < now_sec;
+}
+
+// Filters the values of one compaction against the time it started
+class TtlCompactionFilter : public rocksdb::CompactionFilter {
+ public:
+  TtlCompactionFilter(const uint64_t ttl_seconds, const uint64_t now_sec)
+      : ttl_seconds_(ttl_seconds), now_sec_(now_sec) {}
+
+  bool Filter(int /* level */,
+              const rocksdb::Slice& /* key */,
+              const rocksdb::Slice& existing_value,
+              std::string* /* new_value */,
+              bool* /* value_changed */) const override {
+    if (!IsExpiredAt(admin::DecodeTtlTimestamp(existing_value), ttl_seconds_,
+                     now_sec_)) {
+      return false;
+    }
+
+    common::Stats::get()->Incr(kTtlExpiredCompacted);
+    return true;
+  }
+
+  const char* Name() const override { return "TtlCompactionFilter"; }
+
+ private:
+  const uint64_t ttl_seconds_;
+  const uint64_t now_sec_;
+};
+
+}  // namespace
+
+namespace admin {
+
+std::string EncodeTtlValue(const rocksdb::Slice& value,
+                           const uint64_t write_time_sec) {
+  std::string encoded(kTtlTimestampSize + value.size(), '\0');
+  memcpy(&encoded[0], &write_time_sec, kTtlTimestampSize);
+  memcpy(&encoded[kTtlTimestampSize], value.data(), value.size());
+  return encoded;
+}
+
+uint64_t DecodeTtlTimestamp(const rocksdb::Slice& value) {
+  if (value.size() < kTtlTimestampSize) {
+    return 0;
+  }
+
+  uint64_t write_time_sec;
+  memcpy(&write_time_sec, value.data(), kTtlTimestampSize);
+  return write_time_sec;
+}
+
+rocksdb::Slice StripTtlTimestamp(const rocksdb::Slice& value) {
+  if (value.size() < kTtlTimestampSize) {
+    return value;
+  }
+
+  return rocksdb::Slice(value.data() + kTtlTimestampSize,
+                        value.size() - kTtlTimestampSize);
+}
+
+TtlCompactionFilterFactory::TtlCompactionFilterFactory(
+    const uint64_t ttl_seconds,
+    std::function<uint64_t()> clock)
+    : ttl_seconds_(ttl_seconds)
+    , clock_(std::move(clock)) {
+}
+
+std::unique_ptr<rocksdb::CompactionFilter>
+TtlCompactionFilterFactory::CreateCompactionFilter(
+    const rocksdb::CompactionFilter::Context& /* context */) {
+  return std::make_unique<TtlCompactionFilter>(ttl_seconds_, clock_());
+}
+
+bool TtlCompactionFilterFactory::IsExpired(
+    const rocksdb::Slice& value) const {
+  return IsExpiredAt(DecodeTtlTimestamp(value), ttl_seconds_, clock_());
+}
+
+uint64_t TtlCompactionFilterFactory::GetCurrentTimeSec() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace admin
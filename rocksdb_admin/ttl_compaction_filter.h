@@ -0,0 +1,83 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "rocksdb/compaction_filter.h"
+#include "rocksdb/slice.h"
+
+namespace admin {
+
+// The values of a db with a TTL start with the time they were written, in
+// seconds since epoch, as a fixed 8 byte integer. Clients encode it with
+// EncodeTtlValue() when writing, including through Kafka ingestion, and skip
+// it when reading.
+const size_t kTtlTimestampSize = sizeof(uint64_t);
+
+// Return value prefixed with write_time_sec
+std::string EncodeTtlValue(const rocksdb::Slice& value,
+                           uint64_t write_time_sec);
+
+// Return the write time value starts with, or 0 if it is too short to have
+// one, which never expires
+uint64_t DecodeTtlTimestamp(const rocksdb::Slice& value);
+
+// Return value without its write time
+rocksdb::Slice StripTtlTimestamp(const rocksdb::Slice& value);
+
+// Drops the values older than a TTL while compacting, so that expired data
+// is reclaimed without writing deletes for it. Set it in the options of the
+// segments with a TTL, e.g. in the RocksDBOptionsGeneratorType:
+//
+//   options.compaction_filter_factory =
+//     std::make_shared<TtlCompactionFilterFactory>(7 * 24 * 3600);
+//
+// ApplicationDB finds it there, and reads expired values not compacted yet
+// as NotFound.
+// Note: this class is thread-safe.
+class TtlCompactionFilterFactory : public rocksdb::CompactionFilterFactory {
+ public:
+  // ttl_seconds: (IN) How long values live after their write time
+  // clock:       (IN) Return the current time in seconds since epoch
+  explicit TtlCompactionFilterFactory(
+    uint64_t ttl_seconds,
+    std::function<uint64_t()> clock = GetCurrentTimeSec);
+
+  std::unique_ptr<rocksdb::CompactionFilter> CreateCompactionFilter(
+    const rocksdb::CompactionFilter::Context& context) override;
+
+  const char* Name() const override { return "TtlCompactionFilterFactory"; }
+
+  // If value is older than the TTL now
+  bool IsExpired(const rocksdb::Slice& value) const;
+
+  uint64_t ttl_seconds() const { return ttl_seconds_; }
+
+  static uint64_t GetCurrentTimeSec();
+
+ private:
+  const uint64_t ttl_seconds_;
+  const std::function<uint64_t()> clock_;
+};
+
+}  // namespace admin
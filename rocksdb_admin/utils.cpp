@@ -21,6 +21,163 @@
 
 const uint32_t kShardLength = 5;
 
+namespace {
+
+// The thrift binary protocol field types
+enum ThriftType : uint8_t {
+  kStop = 0,
+  kBool = 2,
+  kByte = 3,
+  kDouble = 4,
+  kI16 = 6,
+  kI32 = 8,
+  kI64 = 10,
+  kString = 11,
+  kStruct = 12,
+  kMap = 13,
+  kSet = 14,
+  kList = 15,
+};
+
+const int kMaxThriftDepth = 32;
+
+// Reads the big endian values of the thrift binary protocol from a buffer,
+// failing once it runs out of data
+class BinaryProtocolReader {
+ public:
+  BinaryProtocolReader(const char* data, const size_t size)
+    : pos_(data), end_(data + size) {}
+
+  bool ReadByte(uint8_t* value) {
+    if (end_ - pos_ < 1) {
+      return false;
+    }
+    *value = static_cast<uint8_t>(*pos_++);
+    return true;
+  }
+
+  bool ReadI16(int16_t* value) {
+    uint64_t v;
+    if (!ReadBigEndian(2, &v)) {
+      return false;
+    }
+    *value = static_cast<int16_t>(v);
+    return true;
+  }
+
+  bool ReadI32(int32_t* value) {
+    uint64_t v;
+    if (!ReadBigEndian(4, &v)) {
+      return false;
+    }
+    *value = static_cast<int32_t>(v);
+    return true;
+  }
+
+  bool ReadBinary(folly::StringPiece* value) {
+    int32_t len;
+    if (!ReadI32(&len) || len < 0 || end_ - pos_ < len) {
+      return false;
+    }
+    *value = folly::StringPiece(pos_, len);
+    pos_ += len;
+    return true;
+  }
+
+  // Skip a value of type, which may be a container or a struct
+  bool Skip(const uint8_t type, const int depth = 0) {
+    if (depth > kMaxThriftDepth) {
+      return false;
+    }
+
+    switch (type) {
+      case kBool:
+      case kByte:
+        return SkipBytes(1);
+      case kI16:
+        return SkipBytes(2);
+      case kI32:
+        return SkipBytes(4);
+      case kDouble:
+      case kI64:
+        return SkipBytes(8);
+      case kString: {
+        folly::StringPiece unused;
+        return ReadBinary(&unused);
+      }
+      case kStruct:
+        while (true) {
+          uint8_t field_type;
+          int16_t field_id;
+          if (!ReadByte(&field_type)) {
+            return false;
+          }
+          if (field_type == kStop) {
+            return true;
+          }
+          if (!ReadI16(&field_id) || !Skip(field_type, depth + 1)) {
+            return false;
+          }
+        }
+      case kMap: {
+        uint8_t key_type, value_type;
+        int32_t n;
+        if (!ReadByte(&key_type) || !ReadByte(&value_type) || !ReadI32(&n) ||
+            n < 0) {
+          return false;
+        }
+        for (int32_t i = 0; i < n; ++i) {
+          if (!Skip(key_type, depth + 1) || !Skip(value_type, depth + 1)) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case kSet:
+      case kList: {
+        uint8_t element_type;
+        int32_t n;
+        if (!ReadByte(&element_type) || !ReadI32(&n) || n < 0) {
+          return false;
+        }
+        for (int32_t i = 0; i < n; ++i) {
+          if (!Skip(element_type, depth + 1)) {
+            return false;
+          }
+        }
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+ private:
+  bool ReadBigEndian(const int n_bytes, uint64_t* value) {
+    if (end_ - pos_ < n_bytes) {
+      return false;
+    }
+    *value = 0;
+    for (int i = 0; i < n_bytes; ++i) {
+      *value = (*value << 8) | static_cast<uint8_t>(*pos_++);
+    }
+    return true;
+  }
+
+  bool SkipBytes(const size_t n) {
+    if (static_cast<size_t>(end_ - pos_) < n) {
+      return false;
+    }
+    pos_ += n;
+    return true;
+  }
+
+  const char* pos_;
+  const char* const end_;
+};
+
+}  // namespace
+
 namespace admin {
 
 std::string SegmentToDbName(const std::string& segment,
@@ -35,6 +192,47 @@ std::string DbNameToSegment(const std::string& db_name) {
   return db_name.substr(0, db_name.size() - kShardLength);
 }
 
+bool DecodeKafkaMessagePayload(const void* data,
+                               const size_t size,
+                               int32_t* op_code,
+                               folly::StringPiece* value) {
+  // The field ids of KafkaMessagePayload in rocksdb_admin.thrift
+  const int16_t kOpCodeId = 1;
+  const int16_t kValueId = 2;
+
+  BinaryProtocolReader reader(static_cast<const char*>(data), size);
+  bool has_op_code = false;
+  *value = folly::StringPiece();
+  while (true) {
+    uint8_t field_type;
+    int16_t field_id;
+    if (!reader.ReadByte(&field_type)) {
+      return false;
+    }
+    if (field_type == kStop) {
+      // op_code is required
+      return has_op_code;
+    }
+    if (!reader.ReadI16(&field_id)) {
+      return false;
+    }
+
+    if (field_id == kOpCodeId && field_type == kI32) {
+      if (!reader.ReadI32(op_code)) {
+        return false;
+      }
+      has_op_code = true;
+    } else if (field_id == kValueId && field_type == kString) {
+      if (!reader.ReadBinary(value)) {
+        return false;
+      }
+    } else if (!reader.Skip(field_type)) {
+      // Skipping fields unknown to this version failed
+      return false;
+    }
+  }
+}
+
 int ExtractShardId(const std::string& db_name) {
   if (UNLIKELY(db_name.size() < kShardLength)) {
     return -1;
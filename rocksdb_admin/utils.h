@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 #include "folly/ExceptionWrapper.h"
@@ -36,6 +37,16 @@ std::string DbNameToSegment(const std::string& db_name);
  */
 int ExtractShardId(const std::string& db_name);
 
+/*
+ * Decode a KafkaMessagePayload serialized with the thrift binary protocol
+ * in place. value points into data, and is empty if the payload has none.
+ * Returns false if data is not a valid KafkaMessagePayload.
+ */
+bool DecodeKafkaMessagePayload(const void* data,
+                               const size_t size,
+                               int32_t* op_code,
+                               folly::StringPiece* value);
+
 template <typename T>
 bool DecodeThriftStruct(const std::string& data, T* obj) {
   auto ex = folly::try_and_catch<std::exception>([data, obj]() {
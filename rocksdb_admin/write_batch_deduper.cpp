@@ -0,0 +1,135 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_admin/write_batch_deduper.h"
+
+#include <deque>
+#include <utility>
+
+namespace admin {
+
+WriteBatchDeduper::WriteBatchDeduper(
+    std::shared_ptr<rocksdb::MergeOperator> merge_operator)
+    : merge_operator_(std::move(merge_operator))
+    , updates_()
+    , n_updates_(0)
+    , data_size_(0) {}
+
+WriteBatchDeduper::KeyUpdates* WriteBatchDeduper::ResetKey(
+    const rocksdb::Slice& key, const Base base) {
+  ++n_updates_;
+  auto itor = updates_.find(key.ToString());
+  if (itor == updates_.end()) {
+    data_size_ += key.size();
+    itor = updates_.emplace(key.ToString(), KeyUpdates()).first;
+  }
+
+  auto& updates = itor->second;
+  if (base != Base::kNone) {
+    data_size_ -= updates.value.size();
+    for (const auto& operand : updates.operands) {
+      data_size_ -= operand.size();
+    }
+    updates.base = base;
+    updates.value.clear();
+    updates.operands.clear();
+  }
+  return &updates;
+}
+
+void WriteBatchDeduper::Put(const rocksdb::Slice& key,
+                            const rocksdb::Slice& value) {
+  auto updates = ResetKey(key, Base::kPut);
+  updates->value.assign(value.data(), value.size());
+  data_size_ += value.size();
+}
+
+void WriteBatchDeduper::Delete(const rocksdb::Slice& key) {
+  ResetKey(key, Base::kDelete);
+}
+
+void WriteBatchDeduper::Merge(const rocksdb::Slice& key,
+                              const rocksdb::Slice& value) {
+  auto updates = ResetKey(key, Base::kNone);
+  updates->operands.emplace_back(value.data(), value.size());
+  data_size_ += value.size();
+}
+
+void WriteBatchDeduper::AppendTo(rocksdb::WriteBatch* batch) const {
+  for (const auto& key_updates : updates_) {
+    const rocksdb::Slice key(key_updates.first);
+    const auto& updates = key_updates.second;
+    if (updates.operands.empty()) {
+      if (updates.base == Base::kPut) {
+        batch->Put(key, updates.value);
+      } else {
+        batch->Delete(key);
+      }
+      continue;
+    }
+
+    if (merge_operator_ != nullptr && updates.base != Base::kNone) {
+      // The value is known, so fold the operands into a Put
+      const rocksdb::Slice value(updates.value);
+      std::vector<rocksdb::Slice> operands(updates.operands.begin(),
+                                           updates.operands.end());
+      std::string new_value;
+      rocksdb::Slice existing_operand(nullptr, 0);
+      rocksdb::MergeOperator::MergeOperationOutput merge_out(new_value,
+                                                             existing_operand);
+      if (merge_operator_->FullMergeV2(
+            rocksdb::MergeOperator::MergeOperationInput(
+              key, updates.base == Base::kPut ? &value : nullptr, operands,
+              nullptr),
+            &merge_out)) {
+        batch->Put(key, existing_operand.data() != nullptr ?
+                          existing_operand : rocksdb::Slice(new_value));
+        continue;
+      }
+    }
+
+    if (updates.base == Base::kPut) {
+      batch->Put(key, updates.value);
+    } else if (updates.base == Base::kDelete) {
+      batch->Delete(key);
+    }
+
+    if (merge_operator_ != nullptr && updates.operands.size() > 1) {
+      const std::deque<rocksdb::Slice> operands(updates.operands.begin(),
+                                                updates.operands.end());
+      std::string new_value;
+      if (merge_operator_->PartialMergeMulti(key, operands, &new_value,
+                                             nullptr)) {
+        batch->Merge(key, new_value);
+        continue;
+      }
+    }
+
+    for (const auto& operand : updates.operands) {
+      batch->Merge(key, operand);
+    }
+  }
+}
+
+void WriteBatchDeduper::Clear() {
+  updates_.clear();
+  n_updates_ = 0;
+  data_size_ = 0;
+}
+
+}  // namespace admin
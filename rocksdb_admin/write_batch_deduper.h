@@ -0,0 +1,78 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rocksdb/merge_operator.h"
+#include "rocksdb/slice.h"
+#include "rocksdb/write_batch.h"
+
+namespace admin {
+
+// Collects the updates of a batch of kafka messages, and keeps only the last
+// one per key, last write wins. A Put or Delete supersedes the updates of its
+// key before it, and the Merge operands after them are combined with
+// merge_operator when it can, so a burst of updates to a key costs one
+// memtable insert and WAL record.
+// Note: this class is not thread-safe.
+class WriteBatchDeduper {
+ public:
+  // merge_operator: (IN) The merge operator of the db, nullptr if it has none
+  explicit WriteBatchDeduper(
+    std::shared_ptr<rocksdb::MergeOperator> merge_operator);
+
+  void Put(const rocksdb::Slice& key, const rocksdb::Slice& value);
+  void Delete(const rocksdb::Slice& key);
+  void Merge(const rocksdb::Slice& key, const rocksdb::Slice& value);
+
+  // Append the updates left after dedup to batch
+  void AppendTo(rocksdb::WriteBatch* batch) const;
+
+  void Clear();
+
+  // The number of updates added, before dedup
+  uint64_t Count() const { return n_updates_; }
+
+  // The bytes of the keys and values kept
+  size_t GetDataSize() const { return data_size_; }
+
+ private:
+  enum class Base { kNone, kPut, kDelete };
+
+  struct KeyUpdates {
+    Base base = Base::kNone;
+    std::string value;
+    std::vector<std::string> operands;
+  };
+
+  // Reset the updates of key to base, dropping the ones before
+  KeyUpdates* ResetKey(const rocksdb::Slice& key, Base base);
+
+  const std::shared_ptr<rocksdb::MergeOperator> merge_operator_;
+  std::unordered_map<std::string, KeyUpdates> updates_;
+  uint64_t n_updates_;
+  size_t data_size_;
+};
+
+}  // namespace admin
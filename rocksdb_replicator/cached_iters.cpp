@@ -0,0 +1,165 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/cached_iters.h"
+
+#include <utility>
+
+namespace replicator { namespace detail {
+
+CachedIters::Iter CachedIters::get(const void* db,
+                                   rocksdb::SequenceNumber seq_no,
+                                   uint64_t max_skip,
+                                   rocksdb::SequenceNumber* iter_seq_no) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto db_itor = dbs_.find(db);
+  if (db_itor == dbs_.end()) {
+    return nullptr;
+  }
+
+  // A Slave retrying from a slightly earlier seq #, or two Slaves a few
+  // updates apart, can share an iter by skipping forward.
+  auto& iters = db_itor->second;
+  auto itor = iters.upper_bound(seq_no);
+  if (itor == iters.begin()) {
+    return nullptr;
+  }
+
+  --itor;
+  if (seq_no - itor->first > max_skip) {
+    return nullptr;
+  }
+
+  auto entry = itor->second;
+  *iter_seq_no = entry->seq_no;
+  auto ret = std::move(entry->iter);
+  iters.erase(itor);
+  if (iters.empty()) {
+    dbs_.erase(db_itor);
+  }
+  lru_.erase(entry);
+  return ret;
+}
+
+uint64_t CachedIters::put(const void* db, rocksdb::SequenceNumber seq_no,
+                          Iter iter, uint64_t now_ms) {
+  uint64_t num_dropped = 0;
+  // Destroyed after mutex_ is released, as closing the WAL files they read
+  // may take a while
+  std::list<Iter> dropped;
+  std::lock_guard<std::mutex> g(mutex_);
+  auto& iters = dbs_[db];
+  while (max_per_db_ > 0 && iters.size() >= max_per_db_) {
+    auto oldest = iters.begin();
+    for (auto itor = iters.begin(); itor != iters.end(); ++itor) {
+      if (itor->second->order < oldest->second->order) {
+        oldest = itor;
+      }
+    }
+    auto entry = oldest->second;
+    iters.erase(oldest);
+    dropped.push_back(std::move(entry->iter));
+    lru_.erase(entry);
+    ++num_dropped;
+  }
+
+  while (max_total_ > 0 && lru_.size() >= max_total_) {
+    eraseLocked(lru_.begin(), &dropped);
+    ++num_dropped;
+  }
+
+  auto entry = lru_.insert(lru_.end(),
+                           Entry{db, seq_no, std::move(iter), now_ms,
+                                 next_order_++});
+  dbs_[db].emplace(seq_no, entry);
+  return num_dropped;
+}
+
+void CachedIters::dropIdle(const void* db, uint64_t ms) {
+  std::list<Iter> dropped;
+  std::lock_guard<std::mutex> g(mutex_);
+  auto db_itor = dbs_.find(db);
+  if (db_itor == dbs_.end()) {
+    return;
+  }
+
+  auto& iters = db_itor->second;
+  auto itor = iters.begin();
+  while (itor != iters.end()) {
+    if (itor->second->used_ms < ms) {
+      dropped.push_back(std::move(itor->second->iter));
+      lru_.erase(itor->second);
+      itor = iters.erase(itor);
+      continue;
+    }
+
+    ++itor;
+  }
+
+  if (iters.empty()) {
+    dbs_.erase(db_itor);
+  }
+}
+
+void CachedIters::dropAll(const void* db) {
+  std::list<Iter> dropped;
+  std::lock_guard<std::mutex> g(mutex_);
+  auto db_itor = dbs_.find(db);
+  if (db_itor == dbs_.end()) {
+    return;
+  }
+
+  for (const auto& seq_and_entry : db_itor->second) {
+    dropped.push_back(std::move(seq_and_entry.second->iter));
+    lru_.erase(seq_and_entry.second);
+  }
+  dbs_.erase(db_itor);
+}
+
+size_t CachedIters::size(const void* db) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto db_itor = dbs_.find(db);
+  return db_itor == dbs_.end() ? 0 : db_itor->second.size();
+}
+
+size_t CachedIters::size() {
+  std::lock_guard<std::mutex> g(mutex_);
+  return lru_.size();
+}
+
+void CachedIters::eraseLocked(EntryList::iterator entry,
+                              std::list<Iter>* dropped) {
+  auto db_itor = dbs_.find(entry->db);
+  auto& iters = db_itor->second;
+  auto range = iters.equal_range(entry->seq_no);
+  for (auto itor = range.first; itor != range.second; ++itor) {
+    if (itor->second == entry) {
+      iters.erase(itor);
+      break;
+    }
+  }
+  if (iters.empty()) {
+    dbs_.erase(db_itor);
+  }
+
+  dropped->push_back(std::move(entry->iter));
+  lru_.erase(entry);
+}
+
+}  // namespace detail
+}  // namespace replicator
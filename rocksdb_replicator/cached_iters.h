@@ -0,0 +1,129 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "rocksdb/transaction_log.h"
+#include "rocksdb/types.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * CachedIters keeps the TransactionLogIterators left by the responses to
+ * Slaves, for the next requests of the same dbs to pick up where they
+ * stopped, instead of calling the more expensive GetUpdatesSince().
+ *
+ * Iters are cached per db, identified by an opaque pointer, with at most
+ * max_per_db iters per db and max_total iters for all dbs. Once full, the
+ * least recently cached iter is dropped, of the db for the per db cap, and
+ * of any db for the total cap, so that dbs serving active Slaves take the
+ * room left by idle ones.
+ *
+ * @note All public interface of CachedIters are thread safe.
+ */
+class CachedIters {
+ public:
+  using Iter = std::unique_ptr<rocksdb::TransactionLogIterator>;
+
+  /*
+   * max_per_db and max_total are the caps of iters, 0 means no limit.
+   */
+  CachedIters(size_t max_per_db, size_t max_total)
+    : max_per_db_(max_per_db)
+    , max_total_(max_total)
+    , mutex_()
+    , lru_()
+    , dbs_()
+    , next_order_(0) {}
+
+  // no copy or move
+  CachedIters(const CachedIters&) = delete;
+  CachedIters& operator=(const CachedIters&) = delete;
+
+  /*
+   * Take the iter of db closest to and at or below seq_no, and no more than
+   * max_skip updates behind it, and set iter_seq_no to where it is.
+   *
+   * @return nullptr if there is none
+   */
+  Iter get(const void* db, rocksdb::SequenceNumber seq_no, uint64_t max_skip,
+           rocksdb::SequenceNumber* iter_seq_no);
+
+  /*
+   * Cache iter of db, sitting at seq_no, and last used at now_ms.
+   *
+   * @return the # of iters dropped to make room for it
+   */
+  uint64_t put(const void* db, rocksdb::SequenceNumber seq_no, Iter iter,
+               uint64_t now_ms);
+
+  /*
+   * Drop the iters of db last used before ms.
+   */
+  void dropIdle(const void* db, uint64_t ms);
+
+  /*
+   * Drop all iters of db, e.g., before it is closed.
+   */
+  void dropAll(const void* db);
+
+  /*
+   * The # of iters cached for db
+   */
+  size_t size(const void* db);
+
+  /*
+   * The # of iters cached for all dbs
+   */
+  size_t size();
+
+ private:
+  struct Entry {
+    const void* db;
+    rocksdb::SequenceNumber seq_no;
+    Iter iter;
+    uint64_t used_ms;
+    // when it was cached, for the LRU order within a db
+    uint64_t order;
+  };
+
+  using EntryList = std::list<Entry>;
+  // seq # -> entry in lru_
+  using DBIters = std::multimap<rocksdb::SequenceNumber, EntryList::iterator>;
+
+  // Remove entry from lru_ and dbs_, and move its iter to dropped, which is
+  // destroyed by the caller without mutex_. Requires mutex_.
+  void eraseLocked(EntryList::iterator entry, std::list<Iter>* dropped);
+
+  const size_t max_per_db_;
+  const size_t max_total_;
+  std::mutex mutex_;
+  // least recently cached first
+  EntryList lru_;
+  std::map<const void*, DBIters> dbs_;
+  uint64_t next_order_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -23,7 +23,11 @@
 #include <mutex>
 #include <unordered_map>
 
+#if __GNUC__ >= 8
+#include "folly/synchronization/Rcu.h"
+#else
 #include "folly/RWSpinLock.h"
+#endif
 
 namespace replicator { namespace detail {
 
@@ -31,16 +35,34 @@ namespace replicator { namespace detail {
  * A thread safe concurrent map optimized for reads.
  * It is useful for secnarios where modifications are rare, and high read
  * concurrency is required.
+ *
+ * Readers look up an immutable snapshot of the map, which writers replace
+ * with a modified copy. With folly RCU, readers don't write any memory shared
+ * with other threads, and writers wait for the readers of the old snapshot
+ * before freeing it. Otherwise, the snapshot is a shared_ptr guarded by a
+ * RWSpinLock.
  */
 template <typename K, typename V, typename H = std::hash<K>>
 class FastReadMap {
+  using MapType = std::unordered_map<K, V, H>;
+
  public:
   FastReadMap()
-      : map_(std::make_shared<std::unordered_map<K, V>>())
+#if __GNUC__ >= 8
+      : map_(new MapType())
+#else
+      : map_(std::make_shared<MapType>())
       , map_rwlock_()
+#endif
       , write_lock_() {
   }
 
+  ~FastReadMap() {
+#if __GNUC__ >= 8
+    delete map_.load();
+#endif
+  }
+
   // no copy or move
   FastReadMap(const FastReadMap&) = delete;
   FastReadMap& operator=(const FastReadMap&) = delete;
@@ -51,12 +73,17 @@ class FastReadMap {
    * Otherwise, value is untouched, and false is returned.
    */
   bool get(const K& key, V* value) {
-    std::shared_ptr<std::unordered_map<K, V>> local_map;
+#if __GNUC__ >= 8
+    folly::rcu_reader guard;
+    const auto local_map = map_.load(std::memory_order_acquire);
+#else
+    std::shared_ptr<MapType> local_map;
 
     {
       folly::RWSpinLock::ReadHolder read_guard(map_rwlock_);
       local_map = map_;
     }
+#endif
 
     auto itor = local_map->find(key);
     if (itor == local_map->end()) {
@@ -67,6 +94,29 @@ class FastReadMap {
     return true;
   }
 
+  /*
+   * Call func on each (key, value) pair of the current snapshot.
+   * func must not modify the map, which would wait for func to finish.
+   */
+  template <typename F>
+  void forEach(F&& func) {
+#if __GNUC__ >= 8
+    folly::rcu_reader guard;
+    const auto local_map = map_.load(std::memory_order_acquire);
+#else
+    std::shared_ptr<MapType> local_map;
+
+    {
+      folly::RWSpinLock::ReadHolder read_guard(map_rwlock_);
+      local_map = map_;
+    }
+#endif
+
+    for (const auto& kv : *local_map) {
+      func(kv.first, kv.second);
+    }
+  }
+
   /*
    * Add the (key, value) pair to the map.
    * If key is already in the map, it is a non-op, and false is returned.
@@ -74,17 +124,13 @@ class FastReadMap {
   bool add(const K& key, const V& value) {
     std::lock_guard<std::mutex> g(write_lock_);
 
-    auto new_map = std::make_shared<std::unordered_map<K, V>>(*map_);
+    std::unique_ptr<MapType> new_map(new MapType(*currentMap()));
     if (!(new_map->insert(std::make_pair(key, value)).second)) {
       // the key is already in the map
       return false;
     }
 
-    {
-      folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
-      map_.swap(new_map);
-    }
-
+    publish(std::move(new_map));
     return true;
   }
 
@@ -95,7 +141,7 @@ class FastReadMap {
   bool remove(const K& key, V* value = nullptr) {
     std::lock_guard<std::mutex> g(write_lock_);
 
-    auto new_map = std::make_shared<std::unordered_map<K, V>>(*map_);
+    std::unique_ptr<MapType> new_map(new MapType(*currentMap()));
     auto itor = new_map->find(key);
     if (itor == new_map->end()) {
       // the key is not in the map
@@ -108,11 +154,33 @@ class FastReadMap {
 
     new_map->erase(itor);
 
-    {
-      folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
-      map_.swap(new_map);
+    publish(std::move(new_map));
+    return true;
+  }
+
+  /*
+   * Replace the value associated with key, which readers see switch from the
+   * old value to the new one at once.
+   * If old_value is not nullptr, it is filled with the replaced value.
+   * Return false if key is not found in the map, which is then untouched.
+   */
+  bool replace(const K& key, const V& value, V* old_value = nullptr) {
+    std::lock_guard<std::mutex> g(write_lock_);
+
+    std::unique_ptr<MapType> new_map(new MapType(*currentMap()));
+    auto itor = new_map->find(key);
+    if (itor == new_map->end()) {
+      // the key is not in the map
+      return false;
+    }
+
+    if (old_value) {
+      *old_value = std::move(itor->second);
     }
 
+    itor->second = value;
+
+    publish(std::move(new_map));
     return true;
   }
 
@@ -122,18 +190,43 @@ class FastReadMap {
   void clear() {
     std::lock_guard<std::mutex> g(write_lock_);
 
-    auto new_map = std::make_shared<std::unordered_map<K, V>>();
+    publish(std::unique_ptr<MapType>(new MapType()));
+  }
+
+ private:
+  // Must hold write_lock_
+  const MapType* currentMap() const {
+#if __GNUC__ >= 8
+    return map_.load(std::memory_order_relaxed);
+#else
+    return map_.get();
+#endif
+  }
+
+  // Replace the snapshot. Must hold write_lock_.
+  // With RCU, the old snapshot is destroyed once its readers are done, before
+  // returning. The values removed from the map are then released promptly,
+  // which RocksDBReplicator::removeDB() waits for.
+  void publish(std::unique_ptr<MapType> new_map) {
+#if __GNUC__ >= 8
+    std::unique_ptr<MapType> old_map(
+      map_.exchange(new_map.release(), std::memory_order_acq_rel));
+    folly::synchronize_rcu();
+#else
+    std::shared_ptr<MapType> old_map(std::move(new_map));
     {
       folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
-      map_.swap(new_map);
+      map_.swap(old_map);
     }
+#endif
   }
 
- private:
-  // TODO(bol) use std::atomoc<std::shared_ptr<>> once later version of gcc
-  // supports it
-  std::shared_ptr<std::unordered_map<K, V>> map_;
+#if __GNUC__ >= 8
+  std::atomic<MapType*> map_;
+#else
+  std::shared_ptr<MapType> map_;
   folly::RWSpinLock map_rwlock_;
+#endif
 
   // lock for synchronizing write ops
   std::mutex write_lock_;
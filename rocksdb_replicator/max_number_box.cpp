@@ -19,48 +19,120 @@
 #include "rocksdb_replicator/max_number_box.h"
 
 #include <algorithm>
+#include <chrono>
+#include <iterator>
 
 #include "folly/Likely.h"
 
 namespace replicator { namespace detail {
 
+constexpr uint64_t MaxNumberBox::kNoWaiter;
+
 void MaxNumberBox::post(const uint64_t num) {
-  std::vector<Waiter*> waiters_to_notify;
-  std::vector<Waiter*> waiters_to_wait;
+  auto cur = max_number_.load();
+  do {
+    if (num <= cur) {
+      return;
+    }
+  } while (!max_number_.compare_exchange_weak(cur, num));
+
+  // Fast path: no waiter is waiting for a number <= num. A waiter publishes
+  // min_num_to_wait_ before rechecking max_number_, and we update max_number_
+  // before reading min_num_to_wait_. So at least one of us sees the other's
+  // update, and no waiter is left behind.
+  if (LIKELY(num < min_num_to_wait_.load())) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<AsyncWaiter>> async_waiters_to_notify;
 
   {
     std::unique_lock<std::mutex> lk(mtx_);
-    if (num <= max_number_) {
-      return;
+    // Other posters may have bumped it further in the meantime
+    const auto max_number = max_number_.load();
+    while (!waiters_.empty() && waiters_.front().num_to_wait <= max_number) {
+      std::pop_heap(waiters_.begin(), waiters_.end(), LaterWaiter());
+      auto& entry = waiters_.back();
+      if (entry.waiter) {
+        // Notify under mtx_. Once popped, a waiter seeing max_number_ may
+        // return and destroy its cv as soon as mtx_ is released.
+        entry.waiter->queued = false;
+        entry.waiter->cv.notify_one();
+      } else {
+        async_waiters_to_notify.push_back(std::move(entry.async_waiter));
+      }
+      waiters_.pop_back();
     }
 
-    max_number_ = num;
+    updateMinNumToWaitLocked();
+  }
 
-    if (waiters_.empty()) {
-      return;
+  // Fulfilling a promise may run continuations inline, so do it without mtx_
+  for (auto& w : async_waiters_to_notify) {
+    if (!w->done.exchange(true)) {
+      w->promise.setValue(true);
     }
+  }
+}
 
-    std::partition_copy(waiters_.begin(), waiters_.end(),
-                        std::back_inserter(waiters_to_notify),
-                        std::back_inserter(waiters_to_wait),
-                        [this] (Waiter* w) {
-                          return w->num_to_wait <= this->max_number_;
-                        });
+template <typename Pred>
+size_t MaxNumberBox::removeWaitersLocked(Pred pred) {
+  auto new_end = std::remove_if(waiters_.begin(), waiters_.end(), pred);
+  auto n_removed = std::distance(new_end, waiters_.end());
+  if (n_removed > 0) {
+    waiters_.erase(new_end, waiters_.end());
+    std::make_heap(waiters_.begin(), waiters_.end(), LaterWaiter());
+    updateMinNumToWaitLocked();
+  }
+
+  return n_removed;
+}
+
+bool MaxNumberBox::addWaiterLocked(WaiterEntry entry) {
+  const auto num = entry.num_to_wait;
+  const auto waiter = entry.waiter;
+  const auto async_waiter = entry.async_waiter.get();
+  if (waiter) {
+    waiter->queued = true;
+  }
+  waiters_.push_back(std::move(entry));
+  std::push_heap(waiters_.begin(), waiters_.end(), LaterWaiter());
+  updateMinNumToWaitLocked();
+
+  if (LIKELY(num > max_number_.load())) {
+    return false;
+  }
+
+  // A post() raced with us and may have taken the fast path. Take ourselves
+  // out, as nobody else will.
+  removeWaitersLocked([waiter, async_waiter] (const WaiterEntry& e) {
+      return e.waiter == waiter && e.async_waiter.get() == async_waiter;
+    });
+  if (waiter) {
+    waiter->queued = false;
+  }
+  return true;
+}
 
-    waiters_.swap(waiters_to_wait);
+void MaxNumberBox::dequeueLocked(Waiter* waiter) {
+  // post() publishes max_number_ before it pops the waiters it satisfies, so
+  // we may see our number reached while still queued. Leave nothing behind
+  // for it to pop and notify once we are gone.
+  if (!waiter->queued) {
+    return;
   }
 
-  // We don't want to hold mtx_ when calling notify_one(). Because that could
-  // make pending threads wake up and go to sleep immediately due to we are
-  // still holding mtx_.
-  // This could make a pending thread return true from wait() or wait_for() due
-  // to spurious wakeup or timeout. This is benign. Because we use the pred versions
-  // of wait() and wait_for(). Also concurrent calling notify_one() is safe.
-  std::for_each(waiters_to_notify.begin(), waiters_to_notify.end(),
-                [] (Waiter* w) { w->cv.notify_one(); });
+  removeWaitersLocked([waiter] (const WaiterEntry& e) {
+      return e.waiter == waiter;
+    });
+  waiter->queued = false;
 }
 
 bool MaxNumberBox::wait(const uint64_t num, const uint64_t timeout_ms) {
+  if (num <= max_number_.load()) {
+    return true;
+  }
+
   // We use thread local waiter because 1) avoid constructor and destructor
   // overhead of Waiter::cv; 2) It is possible that the thread calling wait()
   // returns from wait() before the thread calling post() calls notify_one()
@@ -68,39 +140,83 @@ bool MaxNumberBox::wait(const uint64_t num, const uint64_t timeout_ms) {
   thread_local Waiter me;
 
   std::unique_lock<std::mutex> lk(mtx_);
-  if (UNLIKELY(num <= max_number_)) {
+  if (UNLIKELY(addWaiterLocked(WaiterEntry{num, &me, nullptr}))) {
     return true;
   }
 
-  me.num_to_wait = num;
-  waiters_.push_back(&me);
-
   if (timeout_ms == 0) {
-    me.cv.wait(lk, [this, num] { return num <= this->max_number_; });
+    me.cv.wait(lk, [this, num] { return num <= this->max_number_.load(); });
+    dequeueLocked(&me);
     return true;
   }
 
 
   if (me.cv.wait_for(lk,
                      std::chrono::milliseconds(timeout_ms),
-                     [this, num] { return num <= this->max_number_; })) {
+                     [this, num] { return num <= this->max_number_.load(); })) {
+    dequeueLocked(&me);
     return true;
   }
 
   // We are timeouted if we are here.
   // If it is timeout. wait_for() will acquire the lock and recheck pred. So
-  // it is safe to assert that we must still be in waiters_, and that
-  // num > max_number_.
-  // waiters_ usually has a few to at most a few hundreds elements. So we use
-  // std::vector instead of list to make code simpler and achieve better cache
-  // locality. Also timeout shouldn't be on the performance critical path.
-  auto new_end = std::remove(waiters_.begin(), waiters_.end(), &me);
+  // it is safe to assert that num > max_number_. post() only pops waiters
+  // whose num_to_wait it has reached, so we must still be in waiters_.
+  // Removing from the middle of the heap is O(n), but timeout shouldn't be on
+  // the performance critical path.
+  auto n_removed = removeWaitersLocked([] (const WaiterEntry& e) {
+      return e.waiter == &me;
+    });
+  me.queued = false;
   // TODO (bol) change it to DCHECK/assert() once it's stable.
-  CHECK(num > max_number_ && std::distance(new_end, waiters_.end()) == 1);
-  waiters_.erase(new_end, waiters_.end());
+  CHECK(num > max_number_.load() && n_removed == 1);
   return false;
 }
 
+folly::Future<bool> MaxNumberBox::waitAsync(const uint64_t num,
+                                            const uint64_t timeout_ms) {
+  if (num <= max_number_.load()) {
+    return folly::makeFuture(true);
+  }
+
+  auto waiter = std::make_shared<AsyncWaiter>();
+  auto future = waiter->promise.getFuture();
+
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    // Drop timed out waiters once in a while, in case post() doesn't come
+    static const size_t kSweepThreshold = 1024;
+    if (waiters_.size() >= kSweepThreshold) {
+      removeWaitersLocked([] (const WaiterEntry& e) {
+          return e.async_waiter && e.async_waiter->done.load();
+        });
+    }
+
+    if (addWaiterLocked(WaiterEntry{num, nullptr, waiter})) {
+      return folly::makeFuture(true);
+    }
+  }
+
+  if (timeout_ms > 0) {
+    std::weak_ptr<AsyncWaiter> weak_waiter(waiter);
+#if __GNUC__ >= 8
+    auto sleep = folly::futures::sleepUnsafe(
+      std::chrono::milliseconds(timeout_ms));
+#else
+    auto sleep = folly::futures::sleep(std::chrono::milliseconds(timeout_ms));
+#endif
+    std::move(sleep).then(
+      [weak_waiter = std::move(weak_waiter)] (folly::Try<folly::Unit>&& t) {
+        auto waiter = weak_waiter.lock();
+        if (waiter && !waiter->done.exchange(true)) {
+          waiter->promise.setValue(false);
+        }
+      });
+  }
+
+  return future;
+}
+
 }  // namespace detail
 }  // namespace replicator
 
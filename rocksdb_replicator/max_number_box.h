@@ -18,10 +18,14 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <vector>
 
+#include "folly/futures/Future.h"
 #include "glog/logging.h"
 
 namespace replicator { namespace detail {
@@ -31,7 +35,8 @@ namespace replicator { namespace detail {
  * through its post() API.
  *
  * It also provides a wait() API, which will block caller until the max number
- * is no less than the number parameter, or timeout_ms has passed.
+ * is no less than the number parameter, or timeout_ms has passed, and a
+ * waitAsync() API, which does the same without blocking the caller.
  *
  * @note All public interface of MaxNumberBox are thread safe.
  */
@@ -41,14 +46,21 @@ class MaxNumberBox {
    * init_num is the initial number in the box.
    */
   MaxNumberBox(const uint64_t init_num = 0)
-    : mtx_()
-    , max_number_(init_num)
+    : max_number_(init_num)
+    , min_num_to_wait_(kNoWaiter)
+    , mtx_()
     , waiters_() {}
 
   ~MaxNumberBox() {
-    // it's client's responsibility to ensure there is no pending calls when the
-    // destructor is called.
-    CHECK(waiters_.empty());
+    for (auto& entry : waiters_) {
+      // it's client's responsibility to ensure there is no pending calls when
+      // the destructor is called.
+      CHECK(entry.waiter == nullptr);
+      // pending async waiters are treated as timeout
+      if (!entry.async_waiter->done.exchange(true)) {
+        entry.async_waiter->promise.setValue(false);
+      }
+    }
   }
 
   // no copy or move
@@ -57,6 +69,7 @@ class MaxNumberBox {
 
   /*
    * Post a number to the box.
+   * It doesn't touch mtx_ unless num satisfies at least one waiter.
    */
   void post(const uint64_t num);
 
@@ -68,18 +81,73 @@ class MaxNumberBox {
    */
   bool wait(const uint64_t num, const uint64_t timeout_ms);
 
+  /*
+   * Same as wait(), but return a future instead of blocking the caller. The
+   * future is fulfilled by post() or the timeout, and doesn't hold any thread
+   * while pending.
+   */
+  folly::Future<bool> waitAsync(const uint64_t num, const uint64_t timeout_ms);
+
  private:
+  static constexpr uint64_t kNoWaiter = std::numeric_limits<uint64_t>::max();
+
   struct Waiter {
-    uint64_t num_to_wait;
     std::condition_variable cv;
+    // Whether it is in waiters_. Guarded by mtx_.
+    bool queued = false;
   };
 
-  // mtx_ protects max_number_ and waiters_
-  // We didn't investigate using other mutex types. Our gut feeling is that the
-  // mutex type itself won't be the bottleneck.
+  struct AsyncWaiter {
+    AsyncWaiter() : promise(), done(false) {}
+
+    folly::Promise<bool> promise;
+    // whoever flips it first fulfills promise
+    std::atomic<bool> done;
+  };
+
+  // Exactly one of waiter and async_waiter is set
+  struct WaiterEntry {
+    uint64_t num_to_wait;
+    Waiter* waiter;
+    std::shared_ptr<AsyncWaiter> async_waiter;
+  };
+
+  // Makes waiters_ a min-heap on num_to_wait
+  struct LaterWaiter {
+    bool operator()(const WaiterEntry& a, const WaiterEntry& b) const {
+      return a.num_to_wait > b.num_to_wait;
+    }
+  };
+
+  // Add entry to waiters_, and return true if num_to_wait has been reached in
+  // the meantime. Must hold mtx_.
+  bool addWaiterLocked(WaiterEntry entry);
+
+  // Remove all entries matching pred from waiters_, and return the number of
+  // entries removed. Must hold mtx_.
+  template <typename Pred>
+  size_t removeWaitersLocked(Pred pred);
+
+  // Take waiter out of waiters_ if it is still there. Must hold mtx_.
+  void dequeueLocked(Waiter* waiter);
+
+  // Must hold mtx_
+  void updateMinNumToWaitLocked() {
+    min_num_to_wait_.store(
+      waiters_.empty() ? kNoWaiter : waiters_.front().num_to_wait);
+  }
+
+  // max_number_ only grows. It's updated by post() without holding mtx_.
+  std::atomic<uint64_t> max_number_;
+  // Smallest num_to_wait in waiters_, or kNoWaiter. post() only needs mtx_
+  // when the new max number has reached it.
+  std::atomic<uint64_t> min_num_to_wait_;
+
+  // mtx_ protects waiters_
   std::mutex mtx_;
-  uint64_t max_number_;
-  std::vector<Waiter*> waiters_;
+  // Min-heap ordered by LaterWaiter. Timed out async waiters are removed
+  // lazily.
+  std::vector<WaiterEntry> waiters_;
 };
 
 }  // namespace detail
@@ -0,0 +1,183 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "folly/MoveWrapper.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+
+DECLARE_int32(replicator_max_server_wait_time_ms);
+DECLARE_int32(replicator_client_server_timeout_difference_ms);
+
+namespace replicator {
+
+RocksDBReplicator::MultiplexedStream::MultiplexedStream(
+    const folly::SocketAddress& upstream_addr,
+    folly::Executor* executor,
+    common::ThriftClientPool<ReplicatorAsyncClient>* client_pool)
+    : upstream_addr_(upstream_addr)
+    , executor_(executor)
+    , client_pool_(client_pool)
+    , client_(client_pool->getClient(upstream_addr))
+    , pending_pulls_()
+    , flush_scheduled_(false)
+    , mutex_()
+    , rpc_options_() {
+  rpc_options_.setTimeout(
+      std::chrono::milliseconds(
+          FLAGS_replicator_max_server_wait_time_ms
+          + FLAGS_replicator_client_server_timeout_difference_ms));
+}
+
+void RocksDBReplicator::MultiplexedStream::pull(
+    std::shared_ptr<ReplicatedDB> db,
+    ReplicateRequest request,
+    uint64_t generation) {
+  folly::EventBase* eb = nullptr;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    pending_pulls_.emplace_back(
+      PendingPull{std::move(db), std::move(request), generation});
+    if (flush_scheduled_) {
+      return;
+    }
+
+    flush_scheduled_ = true;
+    eb = client_->getChannel()->getEventBase();
+  }
+
+  // Pulls from other dbs arriving before flush() runs are sent along in the
+  // same replicateMulti() call.
+  std::weak_ptr<MultiplexedStream> weak_stream = shared_from_this();
+  eb->runInEventBaseThread([weak_stream = std::move(weak_stream)] {
+      auto stream = weak_stream.lock();
+      if (stream) {
+        stream->flush();
+      }
+    });
+}
+
+void RocksDBReplicator::MultiplexedStream::flush() {
+  std::vector<PendingPull> pulls;
+  std::shared_ptr<ReplicatorAsyncClient> client;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    pulls.swap(pending_pulls_);
+    flush_scheduled_ = false;
+    client = client_;
+  }
+
+  if (pulls.empty()) {
+    return;
+  }
+
+  // The call waits as long as the least idle db asks for, so that it rejoins
+  // the next call soon after it gets updates.
+  ReplicateMultiRequest req;
+  req.max_wait_ms = pulls.front().request.max_wait_ms;
+  req.requests.reserve(pulls.size());
+  for (const auto& pull : pulls) {
+    req.max_wait_ms = std::min(req.max_wait_ms, pull.request.max_wait_ms);
+    req.requests.push_back(pull.request);
+  }
+
+  std::weak_ptr<MultiplexedStream> weak_stream = shared_from_this();
+  auto options = rpc_options_;
+  options.setTimeout(std::chrono::milliseconds(
+    req.max_wait_ms + FLAGS_replicator_client_server_timeout_difference_ms));
+  client->future_replicateMulti(options, req).via(executor_)
+    .then([weak_stream = std::move(weak_stream),
+           pulls = folly::makeMoveWrapper(std::move(pulls))]
+          (folly::Try<ReplicateMultiResponse>&& t) mutable {
+        auto stream = weak_stream.lock();
+        if (stream == nullptr) {
+          return;
+        }
+
+        stream->handleResponse(std::move(*pulls), std::move(t));
+      });
+}
+
+void RocksDBReplicator::MultiplexedStream::handleResponse(
+    std::vector<PendingPull> pulls,
+    folly::Try<ReplicateMultiResponse>&& t) {
+  if (t.hasException()) {
+    LOG(ERROR) << "replicateMulti() to " << upstream_addr_.describe()
+               << " failed: " << t.exception().what();
+    incCounter(kReplicatorConnectionErrors, 1);
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      client_ = client_pool_->getClient(upstream_addr_);
+    }
+
+    for (auto& pull : pulls) {
+      auto db = pull.db.lock();
+      if (db) {
+        db->handlePullError(pull.generation, false);
+      }
+    }
+    return;
+  }
+
+  auto& response = t.value();
+  for (auto& pull : pulls) {
+    auto db = pull.db.lock();
+    if (db == nullptr) {
+      continue;
+    }
+
+    const auto& db_name = pull.request.db_name;
+    auto error = response.errors.find(db_name);
+    if (error != response.errors.end()) {
+      LOG(ERROR) << "ReplicateError: " << static_cast<int>(error->second.code)
+                 << " " << error->second.msg;
+      incCounter(kReplicatorRemoteApplicationExceptions, 1, db_name);
+      if (error->second.code == ErrorCode::SOURCE_WAL_PURGED) {
+        db->onUpstreamWALPurged();
+      }
+      db->handlePullError(pull.generation, false);
+      continue;
+    }
+
+    // A db with no updates in the response gets an empty one, which makes it
+    // join the next replicateMulti() call.
+    ReplicateResponse db_response;
+    auto itor = response.responses.find(db_name);
+    if (itor != response.responses.end()) {
+      db_response = std::move(itor->second);
+    }
+
+    // Apply updates of different dbs in parallel
+    db->executor_->add(
+      [db = std::move(db),
+       db_response = folly::makeMoveWrapper(std::move(db_response)),
+       seq_no = pull.request.seq_no,
+       generation = pull.generation] () mutable {
+        db->handleReplicateResponse(std::move(*db_response), seq_no,
+                                    generation, false);
+      });
+  }
+}
+
+}  // namespace replicator
@@ -0,0 +1,188 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "rocksdb_replicator/non_blocking_condition_variable.h"
+
+#include <folly/io/async/EventBase.h>
+#if __GNUC__ >= 8
+#include "folly/system/ThreadName.h"
+#else
+#include <folly/ThreadName.h>
+#endif
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+
+DEFINE_int32(replicator_max_pooled_cond_var_tasks, 64 * 1024,
+             "The max # of idle NonBlockingConditionVariable tasks kept for "
+             "reuse");
+
+namespace {
+
+// The timer thread shared by every NonBlockingConditionVariable
+class TimeoutWheel {
+ public:
+  TimeoutWheel()
+      : evb_()
+      , timer_(folly::HHWheelTimer::newTimer(&evb_))
+      , thread_() {
+    thread_ = std::thread([this] {
+        if (!folly::setThreadName("CondVarTimer")) {
+          LOG(ERROR) << "Failed to setThreadName() for CondVarTimer thread";
+        }
+
+        this->evb_.loopForever();
+      });
+  }
+
+  folly::EventBase* evb() {
+    return &evb_;
+  }
+
+  folly::HHWheelTimer* timer() {
+    return timer_.get();
+  }
+
+ private:
+  folly::EventBase evb_;
+  folly::HHWheelTimer::UniquePtr timer_;
+  std::thread thread_;
+};
+
+TimeoutWheel* GetTimeoutWheel() {
+  // Leaked on purpose, timeouts may be pending when static objects are
+  // destroyed at exit.
+  static auto wheel = new TimeoutWheel();
+  return wheel;
+}
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+void NonBlockingConditionVariable::Task::timeoutExpired() noexcept {
+  if (should_i_run()) {
+    executor->add(std::move(func));
+  }
+
+  releaseTask(this);
+}
+
+void NonBlockingConditionVariable::Task::callbackCanceled() noexcept {
+  // only happens when the timer is destroyed, which never happens
+}
+
+void NonBlockingConditionVariable::runATaskList(Task* tasks) {
+  // Timeouts to cancel still hold the tasks' list references, which are
+  // released in the timer thread after cancelling.
+  std::vector<Task*> timeouts;
+  while (tasks) {
+    auto next = tasks->next;
+    if (tasks->should_i_run()) {
+      executor_->add(std::move(tasks->func));
+      if (tasks->timeout_ms > 0) {
+        timeouts.push_back(tasks);
+        tasks = next;
+        continue;
+      }
+    }
+
+    releaseTask(tasks);
+    tasks = next;
+  }
+
+  if (timeouts.empty()) {
+    return;
+  }
+
+  GetTimeoutWheel()->evb()->runInEventBaseThread(
+    [timeouts = std::move(timeouts)] {
+      for (auto task : timeouts) {
+        if (task->isScheduled()) {
+          task->cancelTimeout();
+          releaseTask(task);
+        }
+
+        releaseTask(task);
+      }
+    });
+}
+
+NonBlockingConditionVariable::TaskPool*
+NonBlockingConditionVariable::taskPool() {
+  // Leaked for the same reason as the TimeoutWheel
+  static auto pool = new TaskPool();
+  return pool;
+}
+
+NonBlockingConditionVariable::Task* NonBlockingConditionVariable::newTask() {
+  auto pool = taskPool();
+  {
+    std::lock_guard<std::mutex> g(pool->mutex);
+    if (!pool->tasks.empty()) {
+      auto task = pool->tasks.back();
+      pool->tasks.pop_back();
+      return task;
+    }
+  }
+
+  return new Task();
+}
+
+void NonBlockingConditionVariable::releaseTask(Task* task) {
+  if (task->refs.fetch_sub(1) != 1) {
+    return;
+  }
+
+  task->func = nullptr;
+  task->next = nullptr;
+  task->has_done.store(false);
+
+  auto pool = taskPool();
+  {
+    std::lock_guard<std::mutex> g(pool->mutex);
+    if (pool->tasks.size() <
+        static_cast<size_t>(FLAGS_replicator_max_pooled_cond_var_tasks)) {
+      pool->tasks.push_back(task);
+      return;
+    }
+  }
+
+  delete task;
+}
+
+void NonBlockingConditionVariable::scheduleTimeout(Task* task) {
+  auto wheel = GetTimeoutWheel();
+  wheel->evb()->runInEventBaseThread([wheel, task] {
+      // The task may have been notified before we get here, in which case
+      // the cancellation in runATaskList() found nothing to cancel.
+      if (task->has_done.load()) {
+        releaseTask(task);
+        return;
+      }
+
+      wheel->timer()->scheduleTimeout(
+        task, std::chrono::milliseconds(task->timeout_ms));
+    });
+}
+
+}  // namespace detail
+}  // namespace replicator
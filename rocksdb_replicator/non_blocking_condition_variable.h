@@ -19,12 +19,14 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <functional>
-#include <memory>
 #include <mutex>
+#include <utility>
+#include <vector>
 
 #include "folly/Executor.h"
-#include "folly/futures/Future.h"
+#include "folly/io/async/HHWheelTimer.h"
 
 namespace replicator { namespace detail {
 
@@ -36,24 +38,39 @@ namespace replicator { namespace detail {
  * many of threads. NonBlockingConditionVariable allows tasks to be run on
  * a executor passing in through its constructor. So the # of threads can be
  * much smaller than the # of tasks.
+ *
+ * Timeouts of all condition variables share one HHWheelTimer, and are
+ * cancelled as soon as their tasks are notified. Tasks are recycled through a
+ * process wide pool.
  */
 class NonBlockingConditionVariable {
  private:
-  struct Task {
-    template <typename Func>
-    explicit Task(Func&& f)
-        : func(std::move(f))
-        , next()
-        , has_done(false) {
+  struct Task : public folly::HHWheelTimer::Callback {
+    Task()
+        : func()
+        , executor(nullptr)
+        , timeout_ms(0)
+        , next(nullptr)
+        , has_done(false)
+        , refs(0) {
     }
 
     bool should_i_run() {
       return !has_done.exchange(true);
     }
 
+    // called in the timer thread
+    void timeoutExpired() noexcept override;
+    void callbackCanceled() noexcept override;
+
     std::function<void()> func;
-    std::shared_ptr<Task> next;
+    folly::Executor* executor;
+    uint64_t timeout_ms;
+    Task* next;
     std::atomic<bool> has_done;
+    // held by the pending task list, and by the timer when timeout_ms > 0. The
+    // task goes back to the pool when both are released.
+    std::atomic<int> refs;
   };
 
  public:
@@ -62,7 +79,7 @@ class NonBlockingConditionVariable {
   // This shouldn't be that inconvenient, because we expect executor
   // is long living.
   explicit NonBlockingConditionVariable(folly::Executor* executor)
-      : tasks_()
+      : tasks_(nullptr)
       , tasks_mutex_()
       , executor_(executor) {
   }
@@ -88,77 +105,71 @@ class NonBlockingConditionVariable {
       return;
     }
 
-    auto task = std::make_shared<Task>(std::move(f));
+    auto task = newTask();
+    task->func = std::move(f);
+    task->executor = executor_;
+    task->timeout_ms = timeout_ms;
+    // one for the pending task list, and one for the timer
+    task->refs.store(timeout_ms > 0 ? 2 : 1);
 
     // add task to the pending task list
     {
-      // TODO(bol) use CAS operation of std::atomic<std::shared_ptr<>> when
-      // move to gcc 5.1
       std::lock_guard<std::mutex> g(tasks_mutex_);
-      task->next = std::move(tasks_);
+      task->next = tasks_;
       tasks_ = task;
     }
 
-    // we need to recheck the the condition in case missing a notification
+    // we need to recheck the the condition in case missing a notification.
+    // The timeout is still scheduled, and released once the timer sees the
+    // task has run.
     if (p() && task->should_i_run()) {
       executor_->add(std::move(task->func));
-      return;
     }
 
     if (timeout_ms > 0) {
-      // Put a weak_ptr instead of shared_ptr in the timeout lambda. Otherwise,
-      // we may accumulate some unnecessary tasks if they have run before the
-      // timeout.
-      std::weak_ptr<Task> weak_task(task);
-#if __GNUC__ >= 8
-      auto future = folly::futures::sleepUnsafe(std::chrono::milliseconds(timeout_ms));
-#else
-      auto future = folly::futures::sleep(std::chrono::milliseconds(timeout_ms));
-#endif
-      std::move(future).then([weak_task = std::move(weak_task), executor = executor_] (folly::Try<folly::Unit>&& t) {
-          auto task = weak_task.lock();
-          if (task && task->should_i_run()) {
-            executor->add(std::move(task->func));
-          }
-        });
+      scheduleTimeout(task);
     }
   }
 
   // put all pending tasks to be run in the executor.
   //
   void notifyAll() {
-    std::shared_ptr<Task> local_tasks;
+    Task* local_tasks = nullptr;
 
     {
-      // TODO(bol) use atomic_exchange() once we move to gcc 5.1
       std::lock_guard<std::mutex> g(tasks_mutex_);
-      tasks_.swap(local_tasks);
+      std::swap(tasks_, local_tasks);
     }
 
-    runATaskList(std::move(local_tasks));
+    runATaskList(local_tasks);
   }
 
   ~NonBlockingConditionVariable() {
     // no need to do any synchronizations, because we are in the destructor,
     // and thus no others are working on *this. Otherwise, there is a bug in
     // the client side code.
-    runATaskList(std::move(tasks_));
+    runATaskList(tasks_);
+    tasks_ = nullptr;
   }
 
  private:
-  void runATaskList(std::shared_ptr<Task> tasks) {
-    while (tasks) {
-      if (tasks->should_i_run()) {
-        executor_->add(std::move(tasks->func));
-      }
+  // Run the tasks not run yet, cancel their timeouts, and release them from
+  // the list.
+  void runATaskList(Task* tasks);
 
-      tasks = std::move(tasks->next);
-    }
-  }
+  struct TaskPool {
+    std::mutex mutex;
+    std::vector<Task*> tasks;
+  };
+
+  static TaskPool* taskPool();
+  static Task* newTask();
+  static void releaseTask(Task* task);
+  // Schedule the timeout of task in the timer thread, unless the task has run
+  // by then.
+  static void scheduleTimeout(Task* task);
 
-  // TODO(bol) replacing them with std::atomic<std::shared_ptr<>> once we
-  // upgrade to gcc 5.1
-  std::shared_ptr<Task> tasks_;
+  Task* tasks_;
   std::mutex tasks_mutex_;
 
   folly::Executor* const executor_;
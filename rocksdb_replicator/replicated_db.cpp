@@ -18,37 +18,254 @@
 
 #include <gflags/gflags.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "common/s3util.h"
+#include "common/tracing.h"
+#include "common/tsc_clock.h"
+#include "folly/Bits.h"
 #include "folly/MoveWrapper.h"
+#include "folly/Random.h"
+#include "folly/io/IOBuf.h"
+#if __GNUC__ >= 8
+#include "folly/compression/Compression.h"
+#else
+#include "folly/io/Compression.h"
+#endif
+#include "folly/futures/Future.h"
+#include "rocksdb/env.h"
+#include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb_replicator/cached_iters.h"
 #include "rocksdb_replicator/replicator_stats.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
+#include "rocksdb_replicator/write_batch_pool.h"
+#include "thrift/lib/cpp2/protocol/Serializer.h"
 
 DEFINE_int32(replicator_max_server_wait_time_ms, 10 * 1000,
              "Max wait time before an empty response is returned");
 
+DEFINE_int32(replicator_max_idle_server_wait_time_ms, 60 * 1000,
+             "Slaves getting empty responses double the wait time they ask "
+             "for, from --replicator_max_server_wait_time_ms up to this, so "
+             "that idle dbs rarely cost an empty response. Any update brings "
+             "it back. Not larger than --replicator_max_server_wait_time_ms "
+             "means a fixed wait time");
+
 DEFINE_int32(replicator_client_server_timeout_difference_ms, 10 * 1000,
              "The difference between server and client side timeouts");
 
-DEFINE_int32(replicator_max_updates_per_response, 50,
+DEFINE_int32(replicator_max_updates_per_response, 1000,
              "Max number of RocksDB updates a response can contain");
 
+DEFINE_int64(replicator_max_bytes_per_response, 16 * 1024 * 1024,
+             "Server side cap on the total bytes of RocksDB updates a response "
+             "can contain, 0 means no cap");
+
+DEFINE_int64(replicator_client_max_bytes_per_request, 4 * 1024 * 1024,
+             "The largest byte budget a Slave asks for in one pull request");
+
+DEFINE_int64(replicator_client_min_bytes_per_request, 64 * 1024,
+             "The smallest byte budget a Slave asks for in one pull request");
+
+DEFINE_int32(replicator_client_target_apply_ms, 100,
+             "A Slave shrinks the byte budget of its pull requests when "
+             "applying a response takes longer than this, and grows it when "
+             "applying is faster and the response used up most of the budget");
+
 DEFINE_int32(replicator_pull_delay_on_error_ms, 5 * 1000,
              "How long to wait before sending the next pull request on error");
 
+DEFINE_int32(replicator_pull_pipeline_depth, 1,
+             "Max number of pull responses a Slave db may have in flight or "
+             "received but not yet applied. With a value larger than 1, the "
+             "next pull request is sent before the current response is "
+             "applied. Responses are always applied in order.");
+
+DEFINE_bool(replicator_group_apply, false,
+             "If true, a Slave db concatenates all updates of a response into "
+             "one WriteBatch, and commits them with a single write.");
+
+DEFINE_int32(replicator_push_credits, 0,
+             "If larger than 0, a Slave db asks its upstream to push updates to "
+             "it, with this many requests parked at the upstream for the "
+             "upstream to reply to as soon as new updates are committed. It "
+             "falls back to pulling if the upstream doesn't support push.");
+
+DEFINE_bool(replicator_enable_push, true,
+            "Whether to serve push requests from Slaves. If false, they are "
+            "served as pull requests, and Slaves fall back to pulling.");
+
 DEFINE_int32(replicator_replication_mode, 0,
              "Replication mode. "
              "0: ack client once committed to Master; "
              "1: ack client once committed to Master and written to the TCP "
              "stack for the connection to one of the Slave; "
-             "2: ack client once committed to Master and one of the Slaves.");
+             "2: ack client once committed to Master and one of the Slaves; "
+             "3: ack client once committed to Master and "
+             "--replicator_quorum_size of the Slaves.");
+
+DEFINE_int32(replicator_quorum_size, 2,
+             "The # of distinct Slaves that must have committed an update "
+             "before acking the client in replication mode 3. Writes time out "
+             "if fewer Slaves are replicating.");
 
 DEFINE_uint64(replicator_timeout_ms, 5 * 1000,
               "How long to wait for Slave before timeout a client write, 0 means"
               " waiting forever");
 
+DEFINE_uint64(replicator_read_wait_timeout_ms, 1000,
+              "How long a read waits for its min_seq_no to be applied before "
+              "timing out. Must be > 0.");
+
+DEFINE_int32(replicator_write_group_commit_us, 0,
+             "If > 0, concurrent writes to the same MASTER db arriving within "
+             "this many microseconds are committed as one rocksdb write, with "
+             "one wakeup of the Slaves waiting for updates");
+
+DEFINE_int64(replicator_write_group_max_bytes, 1024 * 1024,
+             "Max bytes of updates committed by one write group");
+
+DEFINE_int64(replicator_db_max_out_bytes_per_sec, 0,
+             "Max bytes per second sent by each db to Slaves catching up. 0 "
+             "means no limit.");
+
+DEFINE_int64(replicator_host_max_out_bytes_per_sec, 0,
+             "Max bytes per second sent by all dbs to Slaves catching up. 0 "
+             "means no limit.");
+
+DEFINE_int32(replicator_throttle_exempt_lag_ms, 30 * 1000,
+             "Responses whose first update is at most this old are sent "
+             "regardless of the bandwidth limits, so that Slaves close to the "
+             "tail are never held back by Slaves catching up");
+
+DEFINE_int32(replicator_throttle_retry_ms, 100,
+             "How often a throttled response retries to get bandwidth");
+
+DEFINE_uint64(replicator_max_cached_iter_skip, 10000,
+              "Max # of sequence numbers a cached iter may be moved forward to "
+              "serve a pull request. If no cached iter is close enough, a new "
+              "one is created with GetUpdatesSince(), which is more expensive. "
+              "0 means only reusing exact matches.");
+
+DEFINE_int32(replicator_max_cached_iters_per_db, 64,
+             "Max # of iters a db keeps for serving Slaves. Once full, the "
+             "least recently cached iter of the db is dropped. 0 means no "
+             "limit.");
+
+DEFINE_int32(replicator_max_cached_iters, 2048,
+             "Max # of iters kept for serving Slaves by all dbs on this "
+             "host. Once full, the least recently cached iter of any db is "
+             "dropped. 0 means no limit.");
+
+DEFINE_int32(replicator_cached_iter_estimated_bytes, 64 * 1024,
+             "The estimated memory held by a cached iter, i.e., the readers "
+             "and buffers of its WAL file, for the "
+             "replicator_cached_iter_bytes gauge");
+
+DEFINE_int64(replicator_tail_cache_bytes, 0,
+             "Max # of bytes of recently committed updates kept in memory for "
+             "serving Slaves close to the tail, shared by all MASTER dbs on "
+             "this host. 0 disables the cache.");
+
+DEFINE_string(replicator_compression, "none",
+              "Compression a Slave db asks its upstream to use for updates: "
+              "none, lz4 or zstd.");
+
+DEFINE_bool(replicator_enable_compression, true,
+            "Whether to compress updates for Slaves asking for it.");
+
+DEFINE_int64(replicator_compression_min_bytes, 4 * 1024,
+             "Responses with fewer bytes of updates are sent uncompressed.");
+
+DEFINE_string(replicator_checkpoint_dir, "/tmp/replicator_checkpoints/",
+              "Where to create checkpoints for Slaves to copy. Checkpoints are "
+              "removed once not read for --replicator_idle_iter_timeout_ms.");
+
+DEFINE_int64(replicator_max_checkpoint_chunk_bytes, 4 * 1024 * 1024,
+             "Max # of bytes of a checkpoint file to send in one response");
+
+DEFINE_bool(replicator_wal_retention_by_progress, false,
+            "If true, archived WAL files all known Slaves have committed are "
+            "deleted without waiting for WAL_ttl_seconds, which together with "
+            "WAL_size_limit_MB only caps how long WAL is kept.");
+
+DEFINE_int32(replicator_wal_min_retention_sec, 600,
+             "Archived WAL files younger than this are kept even if all known "
+             "Slaves have committed them, for Slaves added or restored lately");
+
+DEFINE_int32(replicator_wal_follower_timeout_sec, 24 * 3600,
+             "Slaves not heard from for this long stop holding back the "
+             "deletion of archived WAL files");
+
+DEFINE_bool(replicator_slave_disable_wal, false,
+            "If true, SLAVE dbs apply updates without writing their own WAL, "
+            "and flush every --replicator_slave_flush_interval_sec instead. "
+            "Such Slaves can't have Slaves of their own, and one that crashed "
+            "with updates not flushed yet can't be added back, and has to be "
+            "rebuilt from a backup or its upstream.");
+
+DEFINE_int32(replicator_slave_flush_interval_sec, 60,
+             "How often SLAVE dbs without WAL flush their memtables");
+
+DEFINE_bool(replicator_slave_apply_no_slowdown, false,
+            "If true, SLAVE dbs apply updates with no_slowdown. Updates "
+            "rejected by a write stall are retried after "
+            "--replicator_slave_stall_retry_ms, and the stall is reported to "
+            "upstream, which then sends small responses until it is over.");
+
+DEFINE_int32(replicator_slave_stall_retry_ms, 50,
+             "How long a SLAVE db stalled by RocksDB waits before applying "
+             "again");
+
+DEFINE_int64(replicator_stalled_slave_max_bytes, 64 * 1024,
+             "The max bytes of the responses to Slaves reporting a write "
+             "stall, 0 for the usual limits");
+
+DEFINE_int32(replicator_slave_stall_write_delay_ms, 0,
+             "In the replication modes waiting for Slaves, delay each write "
+             "of a Master by this long while one of its Slaves reports a "
+             "write stall, rather than timing out waiting for it. 0 disables "
+             "the delay");
+
+DEFINE_int64(replicator_flow_control_lag_seq_nos, 0,
+             "Delay the writes of a Master once its slowest in sync Slave is "
+             "this many updates behind, up to "
+             "--replicator_flow_control_max_delay_ms at twice as many. Meant "
+             "for replication mode 0, where nothing else bounds the lag. 0 "
+             "disables the flow control");
+
+DEFINE_int32(replicator_flow_control_max_delay_ms, 100,
+             "The max delay of a write throttled by the flow control");
+
+DEFINE_int32(replicator_flow_control_out_of_sync_factor, 10,
+             "Slaves lagging behind by more than this many times "
+             "--replicator_flow_control_lag_seq_nos, e.g., those catching up "
+             "after a restore, are out of sync and ignored by the flow "
+             "control");
+
+DEFINE_int32(replicator_flow_control_slave_timeout_ms, 10 * 1000,
+             "Slaves not heard from for this long are ignored by the flow "
+             "control");
+
+DEFINE_string(replicator_s3_segment_tmp_dir, "/tmp/replicator_s3_segments/",
+              "Where WAL segments are written before they are uploaded to S3");
+
+DEFINE_string(replicator_s3_segment_compression, "zstd",
+              "How WAL segments shipped to S3 are compressed, one of none, "
+              "lz4 and zstd");
+
 DECLARE_int32(replicator_idle_iter_timeout_ms);
 DEFINE_bool(emit_stat_for_leader_behind,
             false,
@@ -57,326 +274,2648 @@ DEFINE_bool(emit_stat_for_leader_behind,
 
 namespace {
 
+// Bytes in the tail caches of all dbs
+std::atomic<int64_t> g_tail_cache_bytes(0);
+
+// Iters cached by all dbs
+replicator::detail::CachedIters* HostCachedIters() {
+  // leaked, dbs may be destroyed during shutdown
+  static auto iters = new replicator::detail::CachedIters(
+    std::max(FLAGS_replicator_max_cached_iters_per_db, 0),
+    std::max(FLAGS_replicator_max_cached_iters, 0));
+  return iters;
+}
+
+void RegisterCachedIterGauges() {
+  static std::once_flag registered;
+  std::call_once(registered, [] {
+      common::Stats::get()->RegisterGauge(kReplicatorCachedIters, [] {
+          return static_cast<uint64_t>(HostCachedIters()->size());
+        });
+      common::Stats::get()->RegisterGauge(kReplicatorCachedIterBytes, [] {
+          return static_cast<uint64_t>(HostCachedIters()->size()) *
+            std::max(FLAGS_replicator_cached_iter_estimated_bytes, 0);
+        });
+    });
+}
+
 uint64_t GetCurrentTimeMs() {
   return std::chrono::duration_cast<std::chrono::milliseconds>(
     std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
-}  // namespace
+void FreeWriteBatch(void* /* buf */, void* write_batch) {
+  delete static_cast<rocksdb::WriteBatch*>(write_batch);
+}
 
-namespace replicator {
-rocksdb::Status RocksDBReplicator::ReplicatedDB::Write(
-    const rocksdb::WriteOptions& options,
-    rocksdb::WriteBatch* updates,
-    rocksdb::SequenceNumber* seq_no) {
-  if (role_ == DBRole::SLAVE) {
-    throw ReturnCode::WRITE_TO_SLAVE;
+// Wrap the rep of write_batch into an IOBuf without copying it. The returned
+// IOBuf owns write_batch, and frees it once the IOBuf is destroyed, i.e., after
+// the response has been serialized.
+folly::IOBuf WrapWriteBatch(std::unique_ptr<rocksdb::WriteBatch> write_batch) {
+  const auto& rep = write_batch->Data();
+  auto data = const_cast<char*>(rep.data());
+  auto size = rep.size();
+  return folly::IOBuf(folly::IOBuf::TAKE_OWNERSHIP, data, size,
+                      FreeWriteBatch, write_batch.release());
+}
+
+// Build the rep of a WriteBatch directly from a (possibly chained) IOBuf.
+// This copies the data exactly once, instead of coalesce() + string copy.
+std::string ToWriteBatchRep(const folly::IOBuf& buf) {
+  std::string rep;
+  rep.reserve(buf.computeChainDataLength());
+  for (const auto range : buf) {
+    rep.append(reinterpret_cast<const char*>(range.data()), range.size());
   }
 
-  incCounter(kReplicatorWriteBytes, updates->GetDataSize(), db_name_);
+  return rep;
+}
 
-  auto ms = GetCurrentTimeMs();
-  updates->PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&ms),
-                                     sizeof(ms)));
-  auto start = GetCurrentTimeMs();
-  auto status = db_->Write(options, updates);
-  auto end = GetCurrentTimeMs();
-  logMetric(kReplicatorWriteMs, start < end ? end - start : 0, db_name_);
-  if (status.ok()) {
-    cond_var_.notifyAll();
+// The rep of a WriteBatch starts with a fixed 12 bytes header, i.e., an 8 bytes
+// sequence # followed by a 4 bytes count, both little endian. Records follow.
+const size_t kWriteBatchHeader = 12;
 
-    // TODO(bol): change it once RocksDB guarantees the sequence number is in
-    // the write batch.
-    auto cur_seq_no = db_->GetLatestSequenceNumber();
-    if (seq_no) {
-      *seq_no = cur_seq_no;
+void EncodeWriteBatchCount(std::string* rep, uint32_t count) {
+  for (size_t i = 0; i < 4; ++i) {
+    (*rep)[8 + i] = static_cast<char>((count >> (8 * i)) & 0xff);
+  }
+}
+
+// Concatenate batches into one WriteBatch, which is equivalent to what
+// WriteBatchInternal::Append() does. The records of each batch (LogData
+// included) are kept in order, and the count is the sum of all counts, so
+// applying it assigns the same sequence #s as the upstream did.
+replicator::WriteBatchPool::Handle GroupWriteBatches(
+    const std::vector<const rocksdb::WriteBatch*>& batches) {
+  size_t total_size = kWriteBatchHeader;
+  uint32_t count = 0;
+  for (const auto batch : batches) {
+    total_size += batch->GetDataSize() - kWriteBatchHeader;
+    count += batch->Count();
+  }
+
+  return replicator::WriteBatchPool::Build([&] (std::string* rep) {
+      rep->reserve(total_size);
+      rep->append(batches.front()->Data().data(), kWriteBatchHeader);
+      for (const auto batch : batches) {
+        const auto& data = batch->Data();
+        rep->append(data.data() + kWriteBatchHeader,
+                    data.size() - kWriteBatchHeader);
+      }
+      EncodeWriteBatchCount(rep, count);
+    });
+}
+
+replicator::WriteBatchPool::Handle GroupWriteBatches(
+    const std::vector<replicator::WriteBatchPool::Handle>& batches) {
+  std::vector<const rocksdb::WriteBatch*> batch_ptrs;
+  batch_ptrs.reserve(batches.size());
+  for (const auto& batch : batches) {
+    batch_ptrs.push_back(batch.get());
+  }
+
+  return GroupWriteBatches(batch_ptrs);
+}
+
+// Rewrite a WriteBatch down to the records of the keys with one of prefixes.
+// Each record dropped is replaced by a Delete of the empty key, which takes a
+// sequence # as well, so that partial replicas assign the same sequence #s as
+// their upstream. Range deletions and LogData records are kept.
+class KeyPrefixFilter : public rocksdb::WriteBatch::Handler {
+ public:
+  explicit KeyPrefixFilter(const std::vector<std::string>& prefixes)
+      : prefixes_(prefixes)
+      , filtered_()
+      , n_dropped_(0) {}
+
+  rocksdb::Status PutCF(uint32_t cf_id, const rocksdb::Slice& key,
+                        const rocksdb::Slice& value) override {
+    return filter(cf_id, key, [&] { filtered_.Put(key, value); });
+  }
+
+  rocksdb::Status DeleteCF(uint32_t cf_id,
+                           const rocksdb::Slice& key) override {
+    return filter(cf_id, key, [&] { filtered_.Delete(key); });
+  }
+
+  rocksdb::Status SingleDeleteCF(uint32_t cf_id,
+                                 const rocksdb::Slice& key) override {
+    return filter(cf_id, key, [&] { filtered_.SingleDelete(key); });
+  }
+
+  rocksdb::Status MergeCF(uint32_t cf_id, const rocksdb::Slice& key,
+                          const rocksdb::Slice& value) override {
+    return filter(cf_id, key, [&] { filtered_.Merge(key, value); });
+  }
+
+  rocksdb::Status DeleteRangeCF(uint32_t cf_id,
+                                const rocksdb::Slice& begin_key,
+                                const rocksdb::Slice& end_key) override {
+    if (cf_id != 0) {
+      return rocksdb::Status::NotSupported("column families");
     }
+    filtered_.DeleteRange(begin_key, end_key);
+    return rocksdb::Status::OK();
+  }
 
-    switch (FLAGS_replicator_replication_mode) {
-    case 1:
-    case 2:
-      // TODO(bol): This potentially could block all worker threads. We may
-      // consider having a dedicated set of worker threads for admin requests,
-      // and/or provide async write API when this turns out to be a problem.
-      if (!max_seq_no_acked_.wait(cur_seq_no, FLAGS_replicator_timeout_ms)) {
-        throw ReturnCode::WAIT_SLAVE_TIMEOUT;
+  void LogData(const rocksdb::Slice& blob) override {
+    filtered_.PutLogData(blob);
+  }
+
+  uint32_t n_dropped() const {
+    return n_dropped_;
+  }
+
+  // The filtered batch, with the header of original, which was iterated
+  std::unique_ptr<rocksdb::WriteBatch> release(
+      const rocksdb::WriteBatch& original) {
+    std::string rep = filtered_.Data();
+    rep.replace(0, kWriteBatchHeader, original.Data().data(),
+                kWriteBatchHeader);
+    return std::make_unique<rocksdb::WriteBatch>(std::move(rep));
+  }
+
+ private:
+  template <typename F>
+  rocksdb::Status filter(uint32_t cf_id, const rocksdb::Slice& key, F add) {
+    if (cf_id != 0) {
+      return rocksdb::Status::NotSupported("column families");
+    }
+
+    for (const auto& prefix : prefixes_) {
+      if (key.starts_with(prefix)) {
+        add();
+        return rocksdb::Status::OK();
       }
-      break;
-    default:
-      CHECK(FLAGS_replicator_replication_mode == 0)
-        << "Invalid replicaton mode " << FLAGS_replicator_replication_mode;
     }
+
+    filtered_.Delete(rocksdb::Slice());
+    ++n_dropped_;
+    return rocksdb::Status::OK();
   }
 
-  return status;
-}
+  const std::vector<std::string>& prefixes_;
+  rocksdb::WriteBatch filtered_;
+  uint32_t n_dropped_;
+};
 
+// Filter the updates of response down to the keys with one of prefixes. An
+// update which can't be filtered, e.g. with column families, is left as is.
+void FilterUpdates(const std::vector<std::string>& prefixes,
+                   replicator::ReplicateResponse* response,
+                   const std::string& db_name) {
+  uint64_t total_bytes = 0;
+  uint64_t filtered_bytes = 0;
+  for (auto& update : response->updates) {
+    rocksdb::WriteBatch batch(ToWriteBatchRep(update.raw_data));
+    total_bytes += batch.GetDataSize();
+    KeyPrefixFilter filter(prefixes);
+    if (!batch.Iterate(&filter).ok() || filter.n_dropped() == 0) {
+      filtered_bytes += batch.GetDataSize();
+      continue;
+    }
 
-RocksDBReplicator::ReplicatedDB::ReplicatedDB(
-    const std::string& db_name,
-    std::shared_ptr<rocksdb::DB> db,
-    folly::Executor* executor,
-    const DBRole role,
-    const folly::SocketAddress& upstream_addr,
-    common::ThriftClientPool<ReplicatorAsyncClient>* client_pool)
-    : db_name_(db_name)
-    , db_(std::move(db))
-    , executor_(executor)
-    , role_(role)
-    , upstream_addr_(upstream_addr)
-    , client_pool_(client_pool)
-    , client_()
-    , cond_var_(executor)
-    , rpc_options_()
-    , write_options_()
-    , cached_iters_()
-    , cached_iters_mutex_() {
-  if (role == DBRole::SLAVE) {
-    client_ = client_pool_->getClient(upstream_addr);
+    auto filtered = filter.release(batch);
+    filtered_bytes += filtered->GetDataSize();
+    update.raw_data = WrapWriteBatch(std::move(filtered));
   }
 
-  rpc_options_.setTimeout(
-      std::chrono::milliseconds(
-          FLAGS_replicator_max_server_wait_time_ms
-          + FLAGS_replicator_client_server_timeout_difference_ms));
+  if (total_bytes > 0) {
+    replicator::logMetric(replicator::kReplicatorKeyFilterRatio,
+                          filtered_bytes * 100 / total_bytes, db_name);
+  }
 }
 
-void RocksDBReplicator::ReplicatedDB::pullFromUpstream() {
-  CHECK(role_ == DBRole::SLAVE);
-  ReplicateRequest req;
-  req.seq_no = db_->GetLatestSequenceNumber();
-  req.db_name = db_name_;
-  req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
-  req.max_updates = FLAGS_replicator_max_updates_per_response;
+// Whether writes with options a and b can be committed together
+bool CanGroupWrites(const rocksdb::WriteOptions& a,
+                    const rocksdb::WriteOptions& b) {
+  return a.sync == b.sync && a.disableWAL == b.disableWAL;
+}
 
-  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
-  auto options = rpc_options_;
-  client_->future_replicate(options, req).via(executor_)
-    .then([weak_db = std::move(weak_db)] (folly::Try<ReplicateResponse>&& t) {
-        auto db = weak_db.lock();
-        if (db == nullptr) {
-          return;
-        }
+// For push stream and checkpoint ids, where 0 means none
+int64_t NewRandomId() {
+  int64_t id;
+  do {
+    id = static_cast<int64_t>(folly::Random::rand64());
+  } while (id == 0);
 
-        bool delay_next_pull = false;
-        if (t.hasException()) {
-          delay_next_pull = true;
-          try {
-#if __GNUC__ >= 8
-            t.exception().throw_exception();
-#else
-            t.exception().throwException();
-#endif
-          } catch (const ReplicateException& ex) {
-            LOG(ERROR) << "ReplicateException: " << static_cast<int>(ex.code)
-                       << " " << ex.msg;
-            incCounter(kReplicatorRemoteApplicationExceptions, 1, db->db_name_);
-          } catch (const std::exception& ex) {
-            LOG(ERROR) << "std::exception: " << ex.what();
-            incCounter(kReplicatorConnectionErrors, 1, db->db_name_);
-            db->client_ = db->client_pool_->getClient(db->upstream_addr_);
-          }
-        } else {
-          auto& response = t.value();
-          uint64_t write_bytes = 0;
-          const auto now = GetCurrentTimeMs();
-          for (auto& update : response.updates) {
-            if (update.timestamp != 0) {
-              uint64_t then = update.timestamp;
-              logMetric(kReplicatorLatency, then < now ? now - then : 0,
-                        db->db_name_);
-            }
+  return id;
+}
 
-            auto byteRange = update.raw_data.coalesce();
-            write_bytes += byteRange.size();
-            rocksdb::WriteBatch write_batch(
-                std::string(reinterpret_cast<const char*>(byteRange.data()),
-                            byteRange.size()));
-            write_batch.PutLogData(
-              rocksdb::Slice(reinterpret_cast<const char*>(&update.timestamp),
-                             sizeof(update.timestamp)));
-
-            auto status = db->db_->Write(db->write_options_, &write_batch);
-            if (!status.ok()) {
-              LOG(ERROR) << "Failed to apply updates to SLAVE " << db->db_name_
-                         << " " << status.ToString();
-              delay_next_pull = true;
-              break;
-            }
-          }
+// Byte budget for a response, combining the client's limit with our server
+// side cap. 0 means no limit.
+int64_t EffectiveMaxBytes(int64_t client_max_bytes) {
+  const int64_t server_max_bytes = FLAGS_replicator_max_bytes_per_response;
+  if (client_max_bytes <= 0) {
+    return std::max<int64_t>(server_max_bytes, 0);
+  }
 
-          if (!response.updates.empty()) {
-            db->cond_var_.notifyAll();
-          }
-          incCounter(kReplicatorInBytes, write_bytes, db->db_name_);
-        }
+  if (server_max_bytes <= 0) {
+    return client_max_bytes;
+  }
 
-        if (delay_next_pull) {
-          auto eb = db->client_->getChannel()->getEventBase();
-          // It is very bad if we fail to rescheudle a pull request, we'd prefer
-          // crashing.
-          eb->runInEventBaseThread([eb, weak_db = std::move(weak_db)] {
-              eb->runAfterDelay([weak_db = std::move(weak_db)] {
-                  auto db = weak_db.lock();
-                  if (db == nullptr) {
-                    return;
-                  }
-                  db->pullFromUpstream();
-                },
-                FLAGS_replicator_pull_delay_on_error_ms);
-            });
-        } else {
-          db->pullFromUpstream();
-        }
-      });
+  return std::min(client_max_bytes, server_max_bytes);
 }
 
-void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
-    std::unique_ptr<CallbackType> callback,
-    std::unique_ptr<ReplicateRequest> request) {
-  CHECK(request->db_name == db_name_);
+// Byte budget for a response to request, which is kept small while the
+// client reports a write stall. 0 means no limit.
+int64_t ResponseMaxBytes(const replicator::ReplicateRequest& request) {
+  const auto max_bytes = EffectiveMaxBytes(request.max_bytes);
+  const auto stalled_max_bytes = FLAGS_replicator_stalled_slave_max_bytes;
+  if (!request.write_stalled || stalled_max_bytes <= 0) {
+    return max_bytes;
+  }
 
-  auto db = shared_from_this();
-  std::weak_ptr<ReplicatedDB> weak_db = db;
-  auto seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
+  return max_bytes <= 0 ? stalled_max_bytes
+                        : std::min(max_bytes, stalled_max_bytes);
+}
 
-  // Inverse of predicate below: if requested sequence number is HIGHER than latest sequence number on leader, emit a stat)
-  auto leaderSeqNum = db->db_->GetLatestSequenceNumber();
-  if (FLAGS_emit_stat_for_leader_behind && leaderSeqNum < seq_no) {
-    logMetric(kReplicatorLeaderSequenceNumbersBehind, seq_no - leaderSeqNum, db ->db_name_);
+replicator::CompressionType ParseCompressionType(const std::string& name) {
+  if (name == "lz4") {
+    return replicator::CompressionType::LZ4;
   }
 
-  if (FLAGS_replicator_replication_mode == 1 ||
-      FLAGS_replicator_replication_mode == 2) {
-    // post the largest sequence number the Slave has committed
-    max_seq_no_acked_.post(seq_no);
+  if (name == "zstd") {
+    return replicator::CompressionType::ZSTD;
   }
-  auto timeout = request->max_wait_ms;
 
-  cond_var_.runIfConditionOrWaitForNotify(
-      // Operation
-      [weak_db = std::move(weak_db),
-       // TODO(bol) remove folly::makeMoveWrapper() when move to gcc 5.1
-       request = folly::makeMoveWrapper(std::move(request)),
-       callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
-        auto db = weak_db.lock();
-        if (db == nullptr) {
-          ReplicateException e;
-          e.msg = (*request)->db_name + " has been removed";
-          e.code = ErrorCode::SOURCE_NOT_FOUND;
-          (*callback).release()->exceptionInThread(std::move(e));
-          return;
-        }
+  LOG_IF(ERROR, name != "none") << "Unknown compression type " << name;
+  return replicator::CompressionType::NONE;
+}
 
-        const auto expected_seq_no = (*request)->seq_no + 1;
-        rocksdb::SequenceNumber next_seq_no = expected_seq_no;
-        auto iter = db->getCachedIter(expected_seq_no);
-        if (iter && !iter->Valid()) {
-          iter->Next();
-          if (!iter->Valid()) {
-            // this can only happen when cond_var_ timeout, or a new log file
-            // got created. Either way, it is ok (required) to create a new
-            // iterator.
-            iter.reset(nullptr);
-          }
-        }
+std::unique_ptr<folly::io::Codec> GetCodec(replicator::CompressionType type) {
+  switch (type) {
+  case replicator::CompressionType::LZ4:
+    // Encode the uncompressed size, so that we don't need to send it
+    return folly::io::getCodec(folly::io::CodecType::LZ4_VARINT_SIZE);
+  case replicator::CompressionType::ZSTD:
+    return folly::io::getCodec(folly::io::CodecType::ZSTD);
+  default:
+    return nullptr;
+  }
+}
 
-        rocksdb::Status status;
-        bool use_cached_iter = (iter != nullptr);
-        if (!use_cached_iter) {
-          auto start = GetCurrentTimeMs();
-          status = db->db_->GetUpdatesSince(expected_seq_no, &iter);
-          auto end = GetCurrentTimeMs();
-          logMetric(kReplicatorGetUpdatesSinceMs, start < end ? end - start : 0,
-                    db->db_name_);
-        }
+const double kBytesPerRateLimiterToken = 1024;
 
-        if (use_cached_iter || status.ok() || status.IsNotFound()) {
-          ReplicateResponse response;
-          uint64_t read_bytes = 0;
-          for (int32_t i = 0;
-               i < (*request)->max_updates && iter && iter->Valid();
-               ++i, iter->Next()) {
-            auto result = iter->GetBatch();
-            Update update;
-            next_seq_no += result.writeBatchPtr->Count();
-            const auto& str = result.writeBatchPtr->Data();
-            read_bytes += str.size();
-            update.raw_data = std::move(*folly::IOBuf::copyBuffer(str.data(),
-                                                                  str.size()));
-            LogExtractor extractor;
-            auto ret = result.writeBatchPtr->Iterate(&extractor);
-            if (ret.ok()) {
-              update.timestamp = extractor.ms;
-            } else {
-              update.timestamp = 0;
-              LOG(ERROR) << "Failed to extract timestamp for " << db->db_name_;
-            }
-            response.updates.emplace_back(std::move(update));
-          }
+std::unique_ptr<common::ConcurrentRateLimiter> NewOutRateLimiter(
+    const int64_t bytes_per_sec) {
+  if (bytes_per_sec <= 0) {
+    return nullptr;
+  }
 
-          (*callback).release()->resultInThread(std::move(response));
-          if (FLAGS_replicator_replication_mode == 1) {
-            // post the largest sequence number we have written to the Slave.
-            db->max_seq_no_acked_.post(next_seq_no - 1);
-          }
-          incCounter(kReplicatorOutBytes, read_bytes, db->db_name_);
-        } else {
-          LOG(ERROR) << "Failed to pull updates from " << db->db_name_
-                     << " with error: " << status.ToString();
-          incCounter(kReplicatorGetUpdatesSinceErrors, 1, db->db_name_);
-          ReplicateException e;
-          e.msg = status.ToString();
-          e.code = ErrorCode::SOURCE_READ_ERROR;
-          (*callback).release()->exceptionInThread(std::move(e));
-        }
+  return std::make_unique<common::ConcurrentRateLimiter>(
+    std::max(bytes_per_sec / kBytesPerRateLimiterToken, 1.0));
+}
 
-        if (iter) {
-          db->putCachedIter(next_seq_no, std::move(iter));
-        }
-      },
-      // Predicate
-      [db = std::move(db), seq_no] {
-        return db->db_->GetLatestSequenceNumber() > seq_no;
-      },
-      // timeout
-      timeout);
+common::ConcurrentRateLimiter* HostOutRateLimiter() {
+  static auto limiter =
+    NewOutRateLimiter(FLAGS_replicator_host_max_out_bytes_per_sec);
+  return limiter.get();
 }
 
-std::unique_ptr<rocksdb::TransactionLogIterator>
-RocksDBReplicator::ReplicatedDB::getCachedIter(
-    rocksdb::SequenceNumber seq_no) {
-  std::lock_guard<std::mutex> g(cached_iters_mutex_);
-  auto iter = cached_iters_.find(seq_no);
-  if (iter == cached_iters_.end()) {
-    return nullptr;
+// The tokens for bytes from a limiter which holds at most bytes_per_sec
+// worth of tokens, so we never ask for more than that.
+uint32_t OutTokens(const int64_t bytes_per_sec, const uint64_t bytes) {
+  const auto max_tokens = std::max<uint64_t>(
+    bytes_per_sec / kBytesPerRateLimiterToken, 1);
+  return static_cast<uint32_t>(std::min<uint64_t>(
+    std::max<uint64_t>(bytes / kBytesPerRateLimiterToken, 1), max_tokens));
+}
+
+// Take the tokens for bytes from limiter
+bool GetOutTokens(common::ConcurrentRateLimiter* limiter,
+                  const int64_t bytes_per_sec, const uint64_t bytes) {
+  if (limiter == nullptr) {
+    return true;
   }
 
-  auto ret = std::move(iter->second.first);
-  cached_iters_.erase(iter);
-  return ret;
+  return limiter->GetTokens(OutTokens(bytes_per_sec, bytes));
 }
 
-void RocksDBReplicator::ReplicatedDB::putCachedIter(
-    rocksdb::SequenceNumber seq_no,
-    std::unique_ptr<rocksdb::TransactionLogIterator> iter) {
-  std::lock_guard<std::mutex> g(cached_iters_mutex_);
-  cached_iters_.emplace(seq_no,
-                        std::make_pair(std::move(iter), GetCurrentTimeMs()));
+// Give back to limiter the tokens GetOutTokens() took for bytes
+void ReturnOutTokens(common::ConcurrentRateLimiter* limiter,
+                     const int64_t bytes_per_sec, const uint64_t bytes) {
+  if (limiter != nullptr) {
+    limiter->ReturnTokens(OutTokens(bytes_per_sec, bytes));
+  }
 }
 
-void RocksDBReplicator::ReplicatedDB::cleanIdleCachedIters() {
-  auto now = GetCurrentTimeMs();
-  std::lock_guard<std::mutex> g(cached_iters_mutex_);
-  auto itor = cached_iters_.begin();
-  while (itor != cached_iters_.end()) {
-    if (itor->second.second + FLAGS_replicator_idle_iter_timeout_ms < now) {
-      itor = cached_iters_.erase(itor);
-      continue;
+// Compress the raw_data of all updates in response with type, unless it's too
+// small or doesn't get smaller.
+void CompressUpdates(replicator::CompressionType type,
+                     replicator::ReplicateResponse* response,
+                     const std::string& db_name) {
+  uint64_t total_bytes = 0;
+  for (const auto& update : response->updates) {
+    total_bytes += update.raw_data.computeChainDataLength();
+  }
+
+  if (total_bytes == 0 ||
+      total_bytes < static_cast<uint64_t>(
+        FLAGS_replicator_compression_min_bytes)) {
+    return;
+  }
+
+  const auto start = common::TscClock::Now();
+  std::vector<folly::IOBuf> compressed;
+  compressed.reserve(response->updates.size());
+  uint64_t compressed_bytes = 0;
+  try {
+    auto codec = GetCodec(type);
+    if (codec == nullptr) {
+      return;
     }
 
-    ++itor;
+    for (const auto& update : response->updates) {
+      auto buf = codec->compress(&update.raw_data);
+      compressed_bytes += buf->computeChainDataLength();
+      compressed.emplace_back(std::move(*buf));
+    }
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "Failed to compress updates for " << db_name << ": "
+               << ex.what();
+    replicator::incCounter(replicator::kReplicatorCompressionErrors, 1,
+                           db_name);
+    return;
+  }
+
+  replicator::logMetric(replicator::kReplicatorCompressUs,
+                        common::TscClock::ElapsedNs(start) / 1000, db_name);
+  replicator::logMetric(replicator::kReplicatorCompressionRatio,
+                        compressed_bytes * 100 / total_bytes, db_name);
+  if (compressed_bytes >= total_bytes) {
+    return;
+  }
+
+  for (size_t i = 0; i < compressed.size(); ++i) {
+    response->updates[i].raw_data = std::move(compressed[i]);
+  }
+  response->compression = type;
+}
+
+// Return false if the updates in response can't be uncompressed
+bool UncompressUpdates(replicator::ReplicateResponse* response,
+                       const std::string& db_name) {
+  const auto start = common::TscClock::Now();
+  try {
+    auto codec = GetCodec(response->compression);
+    if (codec == nullptr) {
+      throw std::runtime_error("Unknown compression type");
+    }
+
+    for (auto& update : response->updates) {
+      auto buf = codec->uncompress(&update.raw_data);
+      update.raw_data = std::move(*buf);
+    }
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "Failed to uncompress updates for " << db_name << ": "
+               << ex.what();
+    replicator::incCounter(replicator::kReplicatorCompressionErrors, 1,
+                           db_name);
+    return false;
   }
+
+  replicator::logMetric(replicator::kReplicatorUncompressUs,
+                        common::TscClock::ElapsedNs(start) / 1000, db_name);
+  response->compression = replicator::CompressionType::NONE;
+  return true;
+}
+
+// Remove dir and the files in it. dir must not have sub dirs.
+void RemoveFlatDir(const std::string& dir) {
+  auto env = rocksdb::Env::Default();
+  std::vector<std::string> children;
+  if (env->GetChildren(dir, &children).ok()) {
+    for (const auto& child : children) {
+      if (child != "." && child != "..") {
+        env->DeleteFile(dir + "/" + child);
+      }
+    }
+  }
+
+  auto status = env->DeleteDir(dir);
+  LOG_IF(ERROR, !status.ok()) << "Failed to remove " << dir << ": "
+                              << status.ToString();
+}
+
+// Move iter forward to the batch starting from seq_no, and take that batch
+// into batch. Return false if iter doesn't have such a batch. If iter runs out
+// of batches right before seq_no, return true and leave batch empty.
+bool SkipToBatch(rocksdb::TransactionLogIterator* iter,
+                 rocksdb::SequenceNumber seq_no,
+                 rocksdb::BatchResult* batch) {
+  rocksdb::SequenceNumber next_seq_no = 0;
+  for (; iter->Valid(); iter->Next()) {
+    // GetBatch() moves the batch out of iter, so we have to keep the one we
+    // are looking for
+    auto result = iter->GetBatch();
+    if (result.sequence >= seq_no) {
+      if (result.sequence != seq_no) {
+        return false;
+      }
+
+      *batch = std::move(result);
+      return true;
+    }
+
+    next_seq_no = result.sequence + result.writeBatchPtr->Count();
+  }
+
+  return next_seq_no == seq_no;
+}
+
+// A SLAVE db applying without WAL records here the latest seq # it had when
+// it was last flushed on removal
+const char kFlushedSeqNoFile[] = "REPLICATOR_FLUSHED_SEQ_NO";
+
+std::string FlushedSeqNoPath(rocksdb::DB* db) {
+  return db->GetName() + "/" + kFlushedSeqNoFile;
+}
+
+// Flush db and record its latest seq # as flushed. Nothing may write to db
+// meanwhile.
+rocksdb::Status FlushAndRecordSeqNo(rocksdb::DB* db) {
+  const auto seq_no = db->GetLatestSequenceNumber();
+  auto status = db->Flush(rocksdb::FlushOptions());
+  if (!status.ok()) {
+    return status;
+  }
+
+  auto env = rocksdb::Env::Default();
+  const auto path = FlushedSeqNoPath(db);
+  status = rocksdb::WriteStringToFile(env, std::to_string(seq_no),
+                                      path + ".tmp", true /* should_sync */);
+  if (!status.ok()) {
+    return status;
+  }
+  return env->RenameFile(path + ".tmp", path);
+}
+
+// The seq # of the first update in a WriteBatch read from the WAL
+rocksdb::SequenceNumber DecodeWriteBatchSequence(const std::string& rep) {
+  uint64_t seq_no;
+  memcpy(&seq_no, rep.data(), sizeof(seq_no));
+  return folly::Endian::little(seq_no);
+}
+
+}  // namespace
+
+namespace replicator {
+rocksdb::Status RocksDBReplicator::ReplicatedDB::Write(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    rocksdb::SequenceNumber* seq_no) {
+  rocksdb::SequenceNumber cur_seq_no;
+  rocksdb::Status status;
+  throttleWriteIfSlaveStalled();
+  throttleWriteIfSlaveLagging();
+  {
+    common::TraceSpan span("replicator_write_locally");
+    status = writeLocally(options, updates, &cur_seq_no);
+  }
+  if (status.ok()) {
+    if (seq_no) {
+      *seq_no = cur_seq_no;
+    }
+
+    // Use WriteAsync() to avoid blocking the calling thread here
+    if (waitForSlaves()) {
+      common::TraceSpan span("replicator_wait_slaves");
+      if (!max_seq_no_acked_.wait(cur_seq_no, FLAGS_replicator_timeout_ms)) {
+        if (isSlaveStalled()) {
+          incCounter(kReplicatorStalledSlaveTimeouts, 1, db_name_);
+        }
+        throw ReturnCode::WAIT_SLAVE_TIMEOUT;
+      }
+    }
+  }
+
+  return status;
+}
+
+template <typename T, typename F>
+folly::Future<T> RocksDBReplicator::ReplicatedDB::readAfter(
+    rocksdb::SequenceNumber min_seq_no, F read) {
+  if (min_seq_no == 0 || db_->GetLatestSequenceNumber() >= min_seq_no) {
+    return folly::makeFuture<T>(read());
+  }
+
+  incCounter(kReplicatorReadWaits, 1, db_name_);
+  // Don't hold db in the pending wait, so that removeDB() isn't blocked by
+  // it. The wait fails when db is destroyed.
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  return applied_seq_no_.waitAsync(min_seq_no,
+                                   FLAGS_replicator_read_wait_timeout_ms)
+    .then([weak_db = std::move(weak_db), read = std::move(read)] (
+              bool applied) mutable {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          throw ReturnCode::DB_NOT_FOUND;
+        }
+
+        if (!applied) {
+          incCounter(kReplicatorReadWaitTimeouts, 1, db->db_name_);
+          throw ReturnCode::WAIT_SEQ_NO_TIMEOUT;
+        }
+
+        return read();
+      });
+}
+
+folly::Future<RocksDBReplicator::ReplicatedDB::GetResult>
+RocksDBReplicator::ReplicatedDB::Get(const rocksdb::ReadOptions& options,
+                                     const std::string& key,
+                                     rocksdb::SequenceNumber min_seq_no) {
+  return readAfter<GetResult>(min_seq_no, [db = db_, options, key] {
+      GetResult result;
+      result.first = db->Get(options, key, &result.second);
+      return result;
+    });
+}
+
+folly::Future<RocksDBReplicator::ReplicatedDB::MultiGetResult>
+RocksDBReplicator::ReplicatedDB::MultiGet(
+    const rocksdb::ReadOptions& options,
+    const std::vector<std::string>& keys,
+    rocksdb::SequenceNumber min_seq_no) {
+  return readAfter<MultiGetResult>(min_seq_no, [db = db_, options, keys] {
+      std::vector<rocksdb::Slice> key_slices(keys.begin(), keys.end());
+      MultiGetResult result;
+      result.first = db->MultiGet(options, key_slices, &result.second);
+      return result;
+    });
+}
+
+folly::Future<std::unique_ptr<rocksdb::Iterator>>
+RocksDBReplicator::ReplicatedDB::NewIterator(
+    const rocksdb::ReadOptions& options,
+    rocksdb::SequenceNumber min_seq_no) {
+  return readAfter<std::unique_ptr<rocksdb::Iterator>>(
+    min_seq_no, [db = db_, options] {
+      return std::unique_ptr<rocksdb::Iterator>(db->NewIterator(options));
+    });
+}
+
+folly::Future<rocksdb::SequenceNumber>
+RocksDBReplicator::ReplicatedDB::WriteAsync(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates) {
+  rocksdb::SequenceNumber cur_seq_no;
+  rocksdb::Status status;
+  throttleWriteIfSlaveStalled();
+  throttleWriteIfSlaveLagging();
+  try {
+    common::TraceSpan span("replicator_write_locally");
+    status = writeLocally(options, updates, &cur_seq_no);
+  } catch (const ReturnCode code) {
+    return folly::makeFuture<rocksdb::SequenceNumber>(
+      folly::make_exception_wrapper<ReturnCode>(code));
+  }
+
+  if (!status.ok()) {
+    return folly::makeFuture<rocksdb::SequenceNumber>(
+      folly::make_exception_wrapper<ReturnCode>(ReturnCode::WRITE_ERROR));
+  }
+
+  if (!waitForSlaves()) {
+    return folly::makeFuture(cur_seq_no);
+  }
+
+  return max_seq_no_acked_.waitAsync(cur_seq_no, FLAGS_replicator_timeout_ms)
+    .then([db = shared_from_this(), cur_seq_no,
+           span = common::TraceSpan("replicator_wait_slaves")]
+          (bool acked) {
+        if (!acked) {
+          if (db->isSlaveStalled()) {
+            incCounter(kReplicatorStalledSlaveTimeouts, 1, db->db_name_);
+          }
+          throw ReturnCode::WAIT_SLAVE_TIMEOUT;
+        }
+
+        return cur_seq_no;
+      });
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::writeLocally(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    rocksdb::SequenceNumber* seq_no) {
+  if (role_ == DBRole::SLAVE) {
+    throw ReturnCode::WRITE_TO_SLAVE;
+  }
+
+  write_bytes_counter_.Incr(updates->GetDataSize());
+
+  PendingWrite write{&options, updates, rocksdb::Status(), 0, false};
+  if (FLAGS_replicator_write_group_commit_us <= 0) {
+    commitWriteGroup({&write});
+    *seq_no = write.seq_no;
+    return write.status;
+  }
+
+  std::unique_lock<std::mutex> g(write_group_mutex_);
+  pending_writes_.push_back(&write);
+  while (true) {
+    write_group_cv_.wait(g, [this, &write] {
+        return write.done || !write_group_leader_;
+      });
+    if (write.done) {
+      break;
+    }
+
+    // Lead the next group. Give concurrent writes a chance to join it.
+    write_group_leader_ = true;
+    g.unlock();
+    std::this_thread::sleep_for(
+      std::chrono::microseconds(FLAGS_replicator_write_group_commit_us));
+    g.lock();
+
+    // Take the pending writes which can go with the oldest one, in order
+    std::vector<PendingWrite*> group;
+    const auto& group_options = *pending_writes_.front()->options;
+    int64_t group_bytes = 0;
+    auto itor = pending_writes_.begin();
+    while (itor != pending_writes_.end() &&
+           (group.empty() ||
+            group_bytes < FLAGS_replicator_write_group_max_bytes)) {
+      if (!CanGroupWrites(group_options, *(*itor)->options)) {
+        ++itor;
+        continue;
+      }
+
+      group_bytes += (*itor)->updates->GetDataSize();
+      group.push_back(*itor);
+      itor = pending_writes_.erase(itor);
+    }
+
+    g.unlock();
+    commitWriteGroup(group);
+    g.lock();
+
+    for (auto pending_write : group) {
+      pending_write->done = true;
+    }
+    write_group_leader_ = false;
+    write_group_cv_.notify_all();
+  }
+
+  *seq_no = write.seq_no;
+  return write.status;
+}
+
+void RocksDBReplicator::ReplicatedDB::commitWriteGroup(
+    const std::vector<PendingWrite*>& group) {
+  logMetric(kReplicatorWriteGroupSize, group.size(), db_name_);
+
+  // A single write is committed as is, with the timestamp appended to the
+  // caller's batch as before.
+  WriteBatchPool::Handle grouped;
+  rocksdb::WriteBatch* updates = group.front()->updates;
+  if (group.size() > 1) {
+    std::vector<const rocksdb::WriteBatch*> batches;
+    batches.reserve(group.size());
+    for (auto pending_write : group) {
+      batches.push_back(pending_write->updates);
+    }
+
+    grouped = GroupWriteBatches(batches);
+    updates = grouped.get();
+  }
+
+  const auto& options = *group.front()->options;
+  auto ms = GetCurrentTimeMs();
+  updates->PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&ms),
+                                     sizeof(ms)));
+  const auto start = common::TscClock::Now();
+  auto status = db_->Write(options, updates);
+  logMetric(kReplicatorWriteUs, common::TscClock::ElapsedNs(start) / 1000,
+            db_name_);
+  if (status.ok()) {
+    if (FLAGS_replicator_tail_cache_bytes > 0) {
+      addToTailCache(options, *updates, ms);
+    }
+
+    cond_var_.notifyAll();
+
+    // RocksDB stores the first seq # assigned to updates in the header of its
+    // rep, from which we derive the seq # of each write in the group. Fall
+    // back to the latest seq # if it doesn't make sense.
+    const auto latest_seq_no = db_->GetLatestSequenceNumber();
+    rocksdb::SequenceNumber next_seq_no = folly::Endian::little(
+      folly::loadUnaligned<uint64_t>(updates->Data().data()));
+    if (next_seq_no == 0 ||
+        next_seq_no + updates->Count() - 1 > latest_seq_no) {
+      next_seq_no = 0;
+    }
+
+    for (auto pending_write : group) {
+      if (next_seq_no == 0) {
+        pending_write->seq_no = latest_seq_no;
+        continue;
+      }
+
+      next_seq_no += pending_write->updates->Count();
+      pending_write->seq_no = next_seq_no - 1;
+    }
+
+    applied_seq_no_.post(latest_seq_no);
+  }
+
+  for (auto pending_write : group) {
+    pending_write->status = status;
+  }
+}
+
+bool RocksDBReplicator::ReplicatedDB::waitForSlaves() {
+  switch (FLAGS_replicator_replication_mode) {
+  case 1:
+  case 2:
+  case 3:
+    return true;
+  default:
+    CHECK(FLAGS_replicator_replication_mode == 0)
+      << "Invalid replicaton mode " << FLAGS_replicator_replication_mode;
+    return false;
+  }
+}
+
+bool RocksDBReplicator::ReplicatedDB::isSlaveStalled() const {
+  const uint64_t last_stall_ms = last_slave_stall_ms_.load();
+  return last_stall_ms != 0 &&
+    GetCurrentTimeMs() < last_stall_ms +
+      static_cast<uint64_t>(std::max(FLAGS_replicator_timeout_ms, 0));
+}
+
+void RocksDBReplicator::ReplicatedDB::throttleWriteIfSlaveStalled() {
+  if (FLAGS_replicator_slave_stall_write_delay_ms <= 0 || !waitForSlaves() ||
+      !isSlaveStalled()) {
+    return;
+  }
+
+  incCounter(kReplicatorStallThrottledWrites, 1, db_name_);
+  std::this_thread::sleep_for(
+    std::chrono::milliseconds(FLAGS_replicator_slave_stall_write_delay_ms));
+}
+
+void RocksDBReplicator::ReplicatedDB::throttleWriteIfSlaveLagging() {
+  const auto lag_threshold = FLAGS_replicator_flow_control_lag_seq_nos;
+  if (lag_threshold <= 0 || role_ != DBRole::MASTER) {
+    return;
+  }
+
+  // Nothing to go by once all Slaves are gone or out of sync
+  const auto now = GetCurrentTimeMs();
+  if (in_sync_min_ack_ms_.load() +
+      std::max(FLAGS_replicator_flow_control_slave_timeout_ms, 0) < now) {
+    return;
+  }
+
+  const auto min_seq_no = in_sync_min_ack_seq_no_.load();
+  const auto latest_seq_no = db_->GetLatestSequenceNumber();
+  if (latest_seq_no <= min_seq_no + lag_threshold) {
+    return;
+  }
+
+  // Ramp up linearly like the delayed write rate of RocksDB, from no delay
+  // at the threshold to the max one at twice the threshold
+  const auto over = std::min<uint64_t>(
+    latest_seq_no - min_seq_no - lag_threshold, lag_threshold);
+  const auto delay_ms =
+    std::max(FLAGS_replicator_flow_control_max_delay_ms, 0) * over /
+    lag_threshold;
+  if (delay_ms == 0) {
+    return;
+  }
+
+  incCounter(kReplicatorFlowControlDelayedWrites, 1, db_name_);
+  logMetric(kReplicatorFlowControlDelayMs, delay_ms, db_name_);
+  std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+}
+
+RocksDBReplicator::ReplicatedDB::ReplicatedDB(
+    const std::string& db_name,
+    std::shared_ptr<rocksdb::DB> db,
+    folly::Executor* executor,
+    const DBRole role,
+    const folly::SocketAddress& upstream_addr,
+    common::ThriftClientPool<ReplicatorAsyncClient>* client_pool,
+    std::shared_ptr<MultiplexedStream> stream,
+    const std::string& replica_id,
+    folly::Executor* read_executor)
+    : db_name_(db_name)
+    , db_(std::move(db))
+    , executor_(executor)
+    , role_(role)
+    , upstream_addr_(upstream_addr)
+    , client_pool_(client_pool)
+    , client_()
+    , stream_(std::move(stream))
+    , replica_id_(replica_id)
+    , compression_(ParseCompressionType(FLAGS_replicator_compression))
+    , cond_var_(read_executor ? read_executor : executor)
+    , rpc_options_()
+    , write_options_()
+    , last_flush_ms_(GetCurrentTimeMs())
+    , max_seq_no_acked_()
+    , applied_seq_no_(db_->GetLatestSequenceNumber())
+    , upstream_latest_seq_no_(db_->GetLatestSequenceNumber())
+    , last_apply_ms_(GetCurrentTimeMs())
+    , max_bytes_per_request_(FLAGS_replicator_client_max_bytes_per_request)
+    , write_stalled_(false)
+    , apply_bytes_per_sec_(-1)
+    , apply_window_start_ms_(GetCurrentTimeMs())
+    , apply_window_bytes_(0)
+    , last_slave_stall_ms_(0)
+    , server_wait_ms_(FLAGS_replicator_max_server_wait_time_ms)
+    , write_group_mutex_()
+    , write_group_cv_()
+    , pending_writes_()
+    , write_group_leader_(false)
+    , out_rate_limiter_(
+        NewOutRateLimiter(FLAGS_replicator_db_max_out_bytes_per_sec))
+    , pipeline_mutex_()
+    , pending_batches_()
+    , reordered_batches_()
+    , unapplied_responses_(0)
+    , in_flight_pulls_(0)
+    , deferred_pulls_(0)
+    , next_pull_seq_no_(0)
+    , pipeline_generation_(0)
+    , applying_(false)
+    , push_stream_id_(0)
+    , pipeline_depth_(std::max(FLAGS_replicator_pull_pipeline_depth, 1))
+    // push doesn't work with replicateMulti()
+    , push_credits_(stream_ ? 0 : std::max(FLAGS_replicator_push_credits, 0))
+    , push_cursors_()
+    , push_cursors_mutex_()
+    , slave_progress_()
+    , slave_progress_mutex_()
+    , wal_acks_()
+    , wal_acks_mutex_()
+    , last_anonymous_slave_ms_(0)
+    , in_sync_min_ack_seq_no_(0)
+    , in_sync_min_ack_ms_(0)
+    , retained_wal_bytes_(0)
+    , tail_cache_()
+    , tail_cache_bytes_(0)
+    , tail_cache_mutex_()
+    , checkpoints_()
+    , checkpoints_mutex_()
+    , wal_purged_handler_()
+    , wal_purged_reported_(false)
+    , applied_updates_handler_()
+    , applying_updates_handler_()
+    , key_prefixes_()
+    , s3_shipped_seq_no_(0)
+    , s3_shipped_seq_no_known_(false)
+    , s3_last_applied_key_()
+    , write_bytes_counter_(kReplicatorWriteBytes, db_name)
+    , in_bytes_counter_(kReplicatorInBytes, db_name)
+    , out_bytes_counter_(kReplicatorOutBytes, db_name)
+    , cached_iter_hits_counter_(kReplicatorCachedIterHits, db_name)
+    , cached_iter_misses_counter_(kReplicatorCachedIterMisses, db_name)
+    , cached_iter_skips_counter_(kReplicatorCachedIterSkips, db_name)
+    , tail_cache_hits_counter_(kReplicatorTailCacheHits, db_name)
+    , tail_cache_misses_counter_(kReplicatorTailCacheMisses, db_name) {
+  if (role == DBRole::SLAVE) {
+    // S3 replicas have no upstream host
+    if (client_pool_) {
+      client_ = client_pool_->getClient(upstream_addr);
+    }
+    // The upstream is the source of truth, and the updates lost in a crash
+    // are pulled again from it
+    write_options_.disableWAL = FLAGS_replicator_slave_disable_wal;
+  }
+
+  rpc_options_.setTimeout(
+      std::chrono::milliseconds(
+          FLAGS_replicator_max_server_wait_time_ms
+          + FLAGS_replicator_client_server_timeout_difference_ms));
+}
+
+uint64_t RocksDBReplicator::ReplicatedDB::seqNoLag() const {
+  if (role_ != DBRole::SLAVE) {
+    return 0;
+  }
+
+  const auto upstream_seq_no = upstream_latest_seq_no_.load();
+  const auto local_seq_no = db_->GetLatestSequenceNumber();
+  return upstream_seq_no > local_seq_no ? upstream_seq_no - local_seq_no : 0;
+}
+
+uint64_t RocksDBReplicator::ReplicatedDB::msSinceLastApply() const {
+  if (role_ != DBRole::SLAVE) {
+    return 0;
+  }
+
+  const auto now = GetCurrentTimeMs();
+  const auto last_ms = last_apply_ms_.load();
+  return now > last_ms ? now - last_ms : 0;
+}
+
+uint64_t RocksDBReplicator::ReplicatedDB::retainedWALBytes() const {
+  return retained_wal_bytes_.load();
+}
+
+uint64_t RocksDBReplicator::ReplicatedDB::numCachedIters() {
+  return HostCachedIters()->size(this);
+}
+
+void RocksDBReplicator::ReplicatedDB::setAppliedUpdatesHandler(
+    AppliedUpdatesHandler handler) {
+  std::shared_ptr<AppliedUpdatesHandler> new_handler;
+  if (handler) {
+    new_handler = std::make_shared<AppliedUpdatesHandler>(std::move(handler));
+  }
+  std::atomic_store(&applied_updates_handler_, std::move(new_handler));
+}
+
+void RocksDBReplicator::ReplicatedDB::setApplyingUpdatesHandler(
+    ApplyingUpdatesHandler handler) {
+  std::shared_ptr<ApplyingUpdatesHandler> new_handler;
+  if (handler) {
+    new_handler = std::make_shared<ApplyingUpdatesHandler>(std::move(handler));
+  }
+  std::atomic_store(&applying_updates_handler_, std::move(new_handler));
+}
+
+void RocksDBReplicator::ReplicatedDB::setReplicationKeyPrefixes(
+    std::vector<std::string> key_prefixes) {
+  std::shared_ptr<const std::vector<std::string>> new_prefixes;
+  if (!key_prefixes.empty()) {
+    new_prefixes = std::make_shared<const std::vector<std::string>>(
+      std::move(key_prefixes));
+  }
+  std::atomic_store(&key_prefixes_, std::move(new_prefixes));
+}
+
+RocksDBReplicator::ReplicatedDB::~ReplicatedDB() {
+  if (write_options_.disableWAL) {
+    // The db may stay open in another role, e.g., as a MASTER, so persist
+    // what has only been in memtables
+    auto status = FlushAndRecordSeqNo(db_.get());
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to flush " << db_name_ << ": "
+                 << status.ToString();
+    }
+  }
+
+  g_tail_cache_bytes -= tail_cache_bytes_;
+  // The iters read the WAL of db_
+  HostCachedIters()->dropAll(this);
+  for (const auto& checkpoint : checkpoints_) {
+    RemoveFlatDir(checkpoint.second.first);
+  }
+}
+
+bool RocksDBReplicator::ReplicatedDB::hasLostUpdates(rocksdb::DB* db) {
+  // Updates recovered from the WAL, if the db has been written with it, are
+  // only in memtables
+  auto status = db->Flush(rocksdb::FlushOptions());
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to flush " << db->GetName() << ": "
+               << status.ToString();
+    return true;
+  }
+
+  // Flushes and compactions persist the latest seq # at the time they
+  // finish, which may be past the updates they persist. Those still in
+  // memtables when we crashed are gone, but their seq #s are taken, so the
+  // updates pulled again from upstream would get other seq #s here.
+  const auto latest_seq_no = db->GetLatestSequenceNumber();
+  std::string recorded;
+  if (rocksdb::ReadFileToString(rocksdb::Env::Default(),
+                                FlushedSeqNoPath(db), &recorded).ok() &&
+      recorded == std::to_string(latest_seq_no)) {
+    // Nothing has been persisted since the last removal
+    return false;
+  }
+
+  // The db wasn't removed cleanly, or has been written with WAL since. It is
+  // intact if the live SSTs have the latest update.
+  std::vector<rocksdb::LiveFileMetaData> files;
+  db->GetLiveFilesMetaData(&files);
+  rocksdb::SequenceNumber flushed_seq_no = 0;
+  for (const auto& file : files) {
+    flushed_seq_no = std::max(flushed_seq_no, file.largest_seqno);
+  }
+  return flushed_seq_no < latest_seq_no;
+}
+
+void RocksDBReplicator::ReplicatedDB::startPulling() {
+  CHECK(role_ == DBRole::SLAVE);
+  int n_pulls;
+  {
+    std::lock_guard<std::mutex> g(pipeline_mutex_);
+    if (push_credits_ > 0) {
+      push_stream_id_ = NewRandomId();
+      n_pulls = push_credits_;
+    } else {
+      n_pulls = 1;
+    }
+    in_flight_pulls_ += n_pulls;
+  }
+
+  for (int i = 0; i < n_pulls; ++i) {
+    pullFromUpstream();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::pullFromUpstream() {
+  CHECK(role_ == DBRole::SLAVE);
+  ReplicateRequest req;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> g(pipeline_mutex_);
+    // Updates we have received but not applied yet must not be requested
+    // again.
+    req.seq_no = next_pull_seq_no_ != 0 ? next_pull_seq_no_
+                                        : db_->GetLatestSequenceNumber();
+    req.stream_id = push_stream_id_;
+    generation = pipeline_generation_;
+  }
+  req.db_name = db_name_;
+  req.max_wait_ms = server_wait_ms_.load();
+  req.max_updates = FLAGS_replicator_max_updates_per_response;
+  req.max_bytes = max_bytes_per_request_.load();
+  req.committed_seq_no = db_->GetLatestSequenceNumber();
+  req.replica_id = replica_id_;
+  req.compression = compression_;
+  req.write_stalled = write_stalled_.load();
+  req.apply_bytes_per_sec = apply_bytes_per_sec_.load();
+  const auto key_prefixes = std::atomic_load(&key_prefixes_);
+  if (key_prefixes) {
+    req.key_prefixes = *key_prefixes;
+  }
+  if (FLAGS_replicator_replication_mode == 3) {
+    // Forward the progress of the replicas pulling from us, so that the quorum
+    // counts them even if they don't pull from the Master directly.
+    std::lock_guard<std::mutex> g(slave_progress_mutex_);
+    for (const auto& p : slave_progress_) {
+      req.downstream_committed_seq_nos[p.first] = p.second.first;
+    }
+  }
+
+  if (stream_) {
+    stream_->pull(shared_from_this(), std::move(req), generation);
+    return;
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto options = rpc_options_;
+  options.setTimeout(std::chrono::milliseconds(
+    req.max_wait_ms + FLAGS_replicator_client_server_timeout_difference_ms));
+  client_->future_replicate(options, req).via(executor_)
+    .then([weak_db = std::move(weak_db), seq_no = req.seq_no, generation,
+           pushed = req.stream_id != 0]
+          (folly::Try<ReplicateResponse>&& t) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        if (t.hasException()) {
+          try {
+#if __GNUC__ >= 8
+            t.exception().throw_exception();
+#else
+            t.exception().throwException();
+#endif
+          } catch (const ReplicateException& ex) {
+            LOG(ERROR) << "ReplicateException: " << static_cast<int>(ex.code)
+                       << " " << ex.msg;
+            incCounter(kReplicatorRemoteApplicationExceptions, 1, db->db_name_);
+            if (ex.code == ErrorCode::SOURCE_WAL_PURGED) {
+              db->onUpstreamWALPurged();
+            }
+          } catch (const std::exception& ex) {
+            LOG(ERROR) << "std::exception: " << ex.what();
+            incCounter(kReplicatorConnectionErrors, 1, db->db_name_);
+            db->client_ = db->client_pool_->getClient(db->upstream_addr_);
+          }
+
+          db->handlePullError(generation, pushed);
+          return;
+        }
+
+        db->handleReplicateResponse(std::move(t.value()), seq_no, generation,
+                                    pushed);
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::pullFromUpstreamAfterDelay(int n_pulls) {
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto eb = client_->getChannel()->getEventBase();
+  // It is very bad if we fail to rescheudle a pull request, we'd prefer
+  // crashing.
+  eb->runInEventBaseThread([eb, weak_db = std::move(weak_db), n_pulls] {
+      eb->runAfterDelay([weak_db = std::move(weak_db), n_pulls] {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+          for (int i = 0; i < n_pulls; ++i) {
+            db->pullFromUpstream();
+          }
+        },
+        FLAGS_replicator_pull_delay_on_error_ms);
+    });
+}
+
+int RocksDBReplicator::ReplicatedDB::takeDeferredPullsLocked() {
+  const auto budget = push_stream_id_ != 0 ?
+    std::max(pipeline_depth_, push_credits_) : pipeline_depth_;
+  int n_pulls = 0;
+  while (deferred_pulls_ > 0 &&
+         in_flight_pulls_ + unapplied_responses_ < budget) {
+    --deferred_pulls_;
+    ++in_flight_pulls_;
+    ++n_pulls;
+  }
+
+  return n_pulls;
+}
+
+int RocksDBReplicator::ReplicatedDB::resetPushStreamLocked(bool fall_back) {
+  // Updates received out of order can't be trusted any more. Those already
+  // queued in order are kept.
+  unapplied_responses_ -= reordered_batches_.size();
+  reordered_batches_.clear();
+  deferred_pulls_ = 0;
+  ++pipeline_generation_;
+
+  int n_pulls;
+  if (fall_back) {
+    push_stream_id_ = 0;
+    n_pulls = 1;
+  } else {
+    push_stream_id_ = NewRandomId();
+    n_pulls = push_credits_;
+  }
+  in_flight_pulls_ += n_pulls;
+  return n_pulls;
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePullError(uint64_t generation,
+                                                      bool pushed) {
+  int n_pulls = 0;
+  {
+    std::lock_guard<std::mutex> g(pipeline_mutex_);
+    if (!pushed) {
+      // Keep pulling, the pull stays in flight while we are waiting
+      n_pulls = 1;
+    } else {
+      --in_flight_pulls_;
+      if (generation == pipeline_generation_ && push_stream_id_ != 0) {
+        n_pulls = resetPushStreamLocked(false);
+      } else {
+        // The stream has been reset already, and this credit is gone with it
+        n_pulls = takeDeferredPullsLocked();
+      }
+    }
+  }
+
+  pullFromUpstreamAfterDelay(n_pulls);
+}
+
+void RocksDBReplicator::ReplicatedDB::handleReplicateResponse(
+    ReplicateResponse response,
+    rocksdb::SequenceNumber requested_seq_no,
+    uint64_t generation,
+    bool pushed) {
+  if (response.compression != CompressionType::NONE &&
+      !UncompressUpdates(&response, db_name_)) {
+    handlePullError(generation, pushed);
+    return;
+  }
+
+  adjustServerWait(!response.updates.empty());
+  if (response.latest_seq_no >= 0) {
+    const auto upstream_seq_no =
+      static_cast<rocksdb::SequenceNumber>(response.latest_seq_no);
+    upstream_latest_seq_no_ = upstream_seq_no;
+    if (response.updates.empty() &&
+        upstream_seq_no <= db_->GetLatestSequenceNumber()) {
+      // Nothing to apply, we are up to date
+      last_apply_ms_ = GetCurrentTimeMs();
+    }
+  }
+
+  std::vector<WriteBatchPool::Handle> batches;
+  batches.reserve(response.updates.size());
+  // Pushed updates continue from where the upstream stopped for our stream,
+  // which may be ahead of what we asked for.
+  const rocksdb::SequenceNumber start_seq_no =
+    response.pushed ? response.start_seq_no : requested_seq_no;
+  auto next_seq_no = start_seq_no;
+  const auto now = GetCurrentTimeMs();
+  for (auto& update : response.updates) {
+    if (update.timestamp != 0) {
+      uint64_t then = update.timestamp;
+      logMetric(kReplicatorLatency, then < now ? now - then : 0, db_name_);
+    }
+
+    auto write_batch = WriteBatchPool::Get(update.raw_data);
+    next_seq_no += write_batch->Count();
+    write_batch->PutLogData(
+      rocksdb::Slice(reinterpret_cast<const char*>(&update.timestamp),
+                     sizeof(update.timestamp)));
+    batches.emplace_back(std::move(write_batch));
+  }
+
+  int n_pulls = 0;
+  bool delay_pulls = false;
+  bool apply_now = false;
+  {
+    std::lock_guard<std::mutex> g(pipeline_mutex_);
+    --in_flight_pulls_;
+    if (generation != pipeline_generation_) {
+      // We dropped updates received before this response, so it doesn't
+      // continue from what we have.
+      if (pushed) {
+        n_pulls = takeDeferredPullsLocked();
+      } else {
+        // Keep the pull loop going
+        ++in_flight_pulls_;
+        n_pulls = 1;
+        delay_pulls = true;
+      }
+    } else if (pushed && !response.pushed) {
+      LOG(ERROR) << "Upstream of " << db_name_ << " doesn't support push, "
+                 << "falling back to pull";
+      n_pulls = resetPushStreamLocked(true);
+    } else if (batches.empty()) {
+      ++in_flight_pulls_;
+      n_pulls = 1;
+    } else {
+      ++unapplied_responses_;
+      if (pushed) {
+        reordered_batches_.emplace(
+          start_seq_no, std::make_pair(next_seq_no, std::move(batches)));
+        if (next_pull_seq_no_ == 0) {
+          next_pull_seq_no_ = db_->GetLatestSequenceNumber();
+        }
+        // Move responses which continue what we have queued to the queue.
+        auto itor = reordered_batches_.begin();
+        while (itor != reordered_batches_.end() &&
+               itor->first == next_pull_seq_no_) {
+          next_pull_seq_no_ = itor->second.first;
+          pending_batches_.emplace_back(std::move(itor->second.second));
+          itor = reordered_batches_.erase(itor);
+        }
+      } else {
+        next_pull_seq_no_ = next_seq_no;
+        pending_batches_.emplace_back(std::move(batches));
+      }
+
+      // The next request goes out before this response is applied, as long as
+      // the pipeline is not full. Otherwise, the applier sends it once it has
+      // made room.
+      ++deferred_pulls_;
+      n_pulls = takeDeferredPullsLocked();
+      apply_now = !applying_ && !pending_batches_.empty();
+      applying_ = applying_ || apply_now;
+    }
+  }
+
+  if (delay_pulls) {
+    pullFromUpstreamAfterDelay(n_pulls);
+  } else {
+    for (int i = 0; i < n_pulls; ++i) {
+      pullFromUpstream();
+    }
+  }
+
+  if (apply_now) {
+    applyPendingBatches();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::applyPendingBatches() {
+  while (true) {
+    std::vector<WriteBatchPool::Handle> batches;
+    {
+      std::lock_guard<std::mutex> g(pipeline_mutex_);
+      if (pending_batches_.empty()) {
+        applying_ = false;
+        return;
+      }
+
+      batches = std::move(pending_batches_.front());
+      pending_batches_.pop_front();
+    }
+
+    uint64_t write_bytes = 0;
+    bool failed = false;
+    const auto apply_start = GetCurrentTimeMs();
+    if (FLAGS_replicator_group_apply && batches.size() > 1) {
+      auto grouped = GroupWriteBatches(batches);
+      batches.clear();
+      batches.emplace_back(std::move(grouped));
+    }
+
+    // A write stalled by RocksDB fails at once with no_slowdown, rather than
+    // blocking this thread until the compactions catch up.
+    auto apply_options = write_options_;
+    apply_options.no_slowdown = FLAGS_replicator_slave_apply_no_slowdown;
+    const auto applied_updates_handler =
+      std::atomic_load(&applied_updates_handler_);
+    const auto applying_updates_handler =
+      std::atomic_load(&applying_updates_handler_);
+    if (applying_updates_handler) {
+      (*applying_updates_handler)();
+    }
+    size_t n_applied = 0;
+    bool stalled = false;
+    for (auto& write_batch : batches) {
+      auto status = db_->Write(apply_options, write_batch.get());
+      if (status.IsIncomplete() && apply_options.no_slowdown) {
+        stalled = true;
+        break;
+      }
+      if (!status.ok()) {
+        LOG(ERROR) << "Failed to apply updates to SLAVE " << db_name_
+                   << " " << status.ToString();
+        failed = true;
+        break;
+      }
+
+      write_bytes += write_batch->GetDataSize();
+      ++n_applied;
+      if (applied_updates_handler) {
+        (*applied_updates_handler)(*write_batch);
+      }
+    }
+
+    if (stalled) {
+      // Keep what is left for later, at the head of the queue. applying_
+      // stays set, so that nobody else applies in between.
+      write_stalled_ = true;
+      incCounter(kReplicatorSlaveApplyStalls, 1, db_name_);
+      batches.erase(batches.begin(), batches.begin() + n_applied);
+      {
+        std::lock_guard<std::mutex> g(pipeline_mutex_);
+        pending_batches_.emplace_front(std::move(batches));
+      }
+      if (n_applied > 0) {
+        cond_var_.notifyAll();
+        applied_seq_no_.post(db_->GetLatestSequenceNumber());
+        in_bytes_counter_.Incr(write_bytes);
+      }
+      applyPendingBatchesAfterDelay();
+      return;
+    }
+
+    cond_var_.notifyAll();
+    applied_seq_no_.post(db_->GetLatestSequenceNumber());
+    const auto apply_end = GetCurrentTimeMs();
+    if (!failed) {
+      last_apply_ms_ = apply_end;
+    }
+    if (write_options_.disableWAL &&
+        last_flush_ms_ +
+          static_cast<uint64_t>(FLAGS_replicator_slave_flush_interval_sec) *
+          1000 <= apply_end) {
+      flushMemtables(apply_end);
+    }
+    adjustMaxBytesPerRequest(
+      apply_start < apply_end ? apply_end - apply_start : 0, write_bytes);
+    in_bytes_counter_.Incr(write_bytes);
+    if (!failed) {
+      write_stalled_ = false;
+    }
+    // The apply rate reported to upstream, over windows of at least 1 second
+    apply_window_bytes_ += write_bytes;
+    if (apply_window_start_ms_ + 1000 <= apply_end) {
+      apply_bytes_per_sec_ = static_cast<int64_t>(
+        apply_window_bytes_ * 1000 / (apply_end - apply_window_start_ms_));
+      apply_window_start_ms_ = apply_end;
+      apply_window_bytes_ = 0;
+    }
+
+    int n_pulls = 0;
+    {
+      std::lock_guard<std::mutex> g(pipeline_mutex_);
+      --unapplied_responses_;
+      if (failed) {
+        // Drop everything received after the failed update. Responses to
+        // requests still in flight are ignored, and pulling restarts from
+        // the local DB.
+        unapplied_responses_ -= pending_batches_.size();
+        pending_batches_.clear();
+        next_pull_seq_no_ = 0;
+        if (push_stream_id_ != 0) {
+          n_pulls = resetPushStreamLocked(false);
+        } else {
+          ++pipeline_generation_;
+          n_pulls = takeDeferredPullsLocked();
+        }
+      } else {
+        n_pulls = takeDeferredPullsLocked();
+      }
+    }
+
+    if (failed) {
+      pullFromUpstreamAfterDelay(n_pulls);
+    } else {
+      for (int i = 0; i < n_pulls; ++i) {
+        pullFromUpstream();
+      }
+    }
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::applyPendingBatchesAfterDelay() {
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto eb = client_->getChannel()->getEventBase();
+  eb->runInEventBaseThread([eb, weak_db = std::move(weak_db)] {
+      eb->runAfterDelay([weak_db = std::move(weak_db)] {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+          // Not on the event base, which must keep serving responses
+          db->executor_->add([db] { db->applyPendingBatches(); });
+        },
+        FLAGS_replicator_slave_stall_retry_ms);
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::flushMemtables(uint64_t now_ms) {
+  last_flush_ms_ = now_ms;
+  // Don't hold up applying, the memtables are flushed in the background
+  rocksdb::FlushOptions options;
+  options.wait = false;
+  auto status = db_->Flush(options);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to flush SLAVE " << db_name_ << ": "
+               << status.ToString();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<ReplicateRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  recordSlaveProgress(*request);
+  if (request->stream_id != 0 && FLAGS_replicator_enable_push) {
+    auto deadline_ms = GetCurrentTimeMs() + request->max_wait_ms;
+    handlePushRequest(std::move(callback), std::move(request), deadline_ms);
+    return;
+  }
+
+  auto db = shared_from_this();
+  std::weak_ptr<ReplicatedDB> weak_db = db;
+  auto seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
+  auto timeout = request->max_wait_ms;
+  const auto deadline_ms = GetCurrentTimeMs() + request->max_wait_ms;
+
+  cond_var_.runIfConditionOrWaitForNotify(
+      // Operation
+      [weak_db = std::move(weak_db),
+       // TODO(bol) remove folly::makeMoveWrapper() when move to gcc 5.1
+       request = folly::makeMoveWrapper(std::move(request)),
+       callback = folly::makeMoveWrapper(std::move(callback)),
+       deadline_ms] () mutable {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          ReplicateException e;
+          e.msg = (*request)->db_name + " has been removed";
+          e.code = ErrorCode::SOURCE_NOT_FOUND;
+          (*callback).release()->exceptionInThread(std::move(e));
+          return;
+        }
+
+        ReplicateResponse response;
+        rocksdb::SequenceNumber last_seq_no;
+        auto status = db->readUpdates(**request, &response, &last_seq_no);
+        if (status.ok()) {
+          db->sendThrottledResponse(std::move(*callback), std::move(response),
+                                    last_seq_no, deadline_ms);
+        } else {
+          ReplicateException e;
+          e.msg = status.ToString();
+          e.code = readErrorCode(status);
+          (*callback).release()->exceptionInThread(std::move(e));
+        }
+      },
+      // Predicate
+      [db = std::move(db), seq_no] {
+        return db->db_->GetLatestSequenceNumber() > seq_no;
+      },
+      // timeout
+      timeout);
+}
+
+void RocksDBReplicator::ReplicatedDB::sendThrottledResponse(
+    std::unique_ptr<CallbackType> callback,
+    ReplicateResponse response,
+    rocksdb::SequenceNumber last_seq_no,
+    uint64_t deadline_ms) {
+  const auto now = GetCurrentTimeMs();
+  if (admitResponse(response)) {
+    callback.release()->resultInThread(std::move(response));
+    recordSentSeqNo(last_seq_no);
+    return;
+  }
+
+  if (now >= deadline_ms) {
+    // The Slave will ask again for the same updates
+    ReplicateResponse empty_response;
+    empty_response.latest_seq_no = response.latest_seq_no;
+    callback.release()->resultInThread(std::move(empty_response));
+    return;
+  }
+
+  incCounter(kReplicatorThrottledResponses, 1, db_name_);
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  const auto delay_ms = std::min<uint64_t>(
+    std::max(FLAGS_replicator_throttle_retry_ms, 1), deadline_ms - now);
+#if __GNUC__ >= 8
+  auto future = folly::futures::sleepUnsafe(std::chrono::milliseconds(delay_ms));
+#else
+  auto future = folly::futures::sleep(std::chrono::milliseconds(delay_ms));
+#endif
+  std::move(future).via(executor_).then(
+    [weak_db = std::move(weak_db),
+     callback = folly::makeMoveWrapper(std::move(callback)),
+     response = folly::makeMoveWrapper(std::move(response)),
+     last_seq_no, deadline_ms] (folly::Try<folly::Unit>&& t) mutable {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        ReplicateException e;
+        e.msg = "db has been removed";
+        e.code = ErrorCode::SOURCE_NOT_FOUND;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      db->sendThrottledResponse(std::move(*callback), std::move(*response),
+                                last_seq_no, deadline_ms);
+    });
+}
+
+bool RocksDBReplicator::ReplicatedDB::admitResponse(
+    const ReplicateResponse& response) {
+  auto host_limiter = HostOutRateLimiter();
+  if (response.updates.empty() ||
+      (out_rate_limiter_ == nullptr && host_limiter == nullptr)) {
+    return true;
+  }
+
+  const uint64_t first_ms = response.updates.front().timestamp;
+  const auto now = GetCurrentTimeMs();
+  if (first_ms == 0 || now <= first_ms ||
+      now - first_ms <= static_cast<uint64_t>(
+        std::max(FLAGS_replicator_throttle_exempt_lag_ms, 0))) {
+    return true;
+  }
+
+  uint64_t bytes = 0;
+  for (const auto& update : response.updates) {
+    bytes += update.raw_data.computeChainDataLength();
+  }
+
+  if (!GetOutTokens(out_rate_limiter_.get(),
+                    FLAGS_replicator_db_max_out_bytes_per_sec, bytes)) {
+    return false;
+  }
+
+  if (!GetOutTokens(host_limiter, FLAGS_replicator_host_max_out_bytes_per_sec,
+                    bytes)) {
+    // Or the db would pay for the bytes it didn't send
+    ReturnOutTokens(out_rate_limiter_.get(),
+                    FLAGS_replicator_db_max_out_bytes_per_sec, bytes);
+    return false;
+  }
+  return true;
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePushRequest(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<ReplicateRequest> request,
+    uint64_t deadline_ms) {
+  auto db = shared_from_this();
+  std::weak_ptr<ReplicatedDB> weak_db = db;
+  const auto stream_id = request->stream_id;
+  const auto seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
+  const auto now = GetCurrentTimeMs();
+  // a timeout of 0 means waiting forever for cond_var_
+  const uint64_t timeout = deadline_ms > now ? deadline_ms - now : 1;
+
+  cond_var_.runIfConditionOrWaitForNotify(
+      // Operation
+      [weak_db = std::move(weak_db),
+       request = folly::makeMoveWrapper(std::move(request)),
+       callback = folly::makeMoveWrapper(std::move(callback)),
+       deadline_ms] () mutable {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          ReplicateException e;
+          e.msg = (*request)->db_name + " has been removed";
+          e.code = ErrorCode::SOURCE_NOT_FOUND;
+          (*callback).release()->exceptionInThread(std::move(e));
+          return;
+        }
+
+        ReplicateResponse response;
+        rocksdb::SequenceNumber last_seq_no;
+        auto status = db->readPushedUpdates(**request, &response,
+                                            &last_seq_no);
+        if (status.ok() && response.updates.empty() &&
+            GetCurrentTimeMs() < deadline_ms) {
+          // Other requests of the same stream have taken the new updates, wait
+          // for more.
+          db->handlePushRequest(std::move(*callback), std::move(*request),
+                                deadline_ms);
+          return;
+        }
+
+        if (status.ok()) {
+          (*callback).release()->resultInThread(std::move(response));
+          db->recordSentSeqNo(last_seq_no);
+        } else {
+          ReplicateException e;
+          e.msg = status.ToString();
+          e.code = readErrorCode(status);
+          (*callback).release()->exceptionInThread(std::move(e));
+        }
+      },
+      // Predicate
+      [db = std::move(db), stream_id, seq_no] {
+        return db->db_->GetLatestSequenceNumber() >
+          db->getPushCursor(stream_id, seq_no);
+      },
+      // timeout
+      timeout);
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::readPushedUpdates(
+    const ReplicateRequest& request,
+    ReplicateResponse* response,
+    rocksdb::SequenceNumber* last_seq_no) {
+  // Requests of the same stream are served one by one, each continuing from
+  // where the previous one stopped.
+  std::lock_guard<std::mutex> g(push_cursors_mutex_);
+  auto itor = push_cursors_.emplace(
+    request.stream_id,
+    std::make_pair(static_cast<rocksdb::SequenceNumber>(request.seq_no),
+                   GetCurrentTimeMs())).first;
+
+  ReplicateRequest cursor_request(request);
+  cursor_request.seq_no = itor->second.first;
+  auto status = readUpdates(cursor_request, response, last_seq_no);
+  response->start_seq_no = cursor_request.seq_no;
+  response->pushed = true;
+  if (status.ok() && !response->updates.empty()) {
+    itor->second.first = *last_seq_no;
+  }
+  itor->second.second = GetCurrentTimeMs();
+
+  return status;
+}
+
+rocksdb::SequenceNumber RocksDBReplicator::ReplicatedDB::getPushCursor(
+    int64_t stream_id, rocksdb::SequenceNumber default_seq_no) {
+  std::lock_guard<std::mutex> g(push_cursors_mutex_);
+  auto itor = push_cursors_.find(stream_id);
+  return itor == push_cursors_.end() ? default_seq_no : itor->second.first;
+}
+
+void RocksDBReplicator::ReplicatedDB::recordSlaveProgress(
+    const ReplicateRequest& request) {
+  // Pipelining and pushing Slaves ask for updates they have received but not
+  // committed yet. Only committed ones count as acked.
+  auto seq_no = static_cast<rocksdb::SequenceNumber>(
+    request.committed_seq_no >= 0 ? request.committed_seq_no : request.seq_no);
+
+  // Inverse of predicate below: if requested sequence number is HIGHER than latest sequence number on leader, emit a stat)
+  auto leaderSeqNum = db_->GetLatestSequenceNumber();
+  if (FLAGS_emit_stat_for_leader_behind && leaderSeqNum < seq_no) {
+    logMetric(kReplicatorLeaderSequenceNumbersBehind, seq_no - leaderSeqNum, db_name_);
+  }
+
+  if (request.write_stalled) {
+    last_slave_stall_ms_ = GetCurrentTimeMs();
+    incCounter(kReplicatorStalledSlaveReports, 1, db_name_);
+  }
+
+  if (!request.replica_id.empty()) {
+    logMetric(kReplicatorSlaveAckLag,
+              leaderSeqNum > seq_no ? leaderSeqNum - seq_no : 0,
+              db_name_ + " slave=" + request.replica_id);
+
+    if (request.apply_bytes_per_sec >= 0) {
+      logMetric(kReplicatorSlaveApplyBytesPerSec, request.apply_bytes_per_sec,
+                db_name_ + " slave=" + request.replica_id);
+    }
+
+    const auto now = GetCurrentTimeMs();
+    std::lock_guard<std::mutex> g(wal_acks_mutex_);
+    auto& ack = wal_acks_[request.replica_id];
+    ack.first = std::max(ack.first, seq_no);
+    ack.second = now;
+    if (FLAGS_replicator_flow_control_lag_seq_nos > 0) {
+      updateInSyncMinAckLocked(leaderSeqNum, now);
+    }
+  } else {
+    last_anonymous_slave_ms_ = GetCurrentTimeMs();
+  }
+
+  if (FLAGS_replicator_replication_mode == 1 ||
+      FLAGS_replicator_replication_mode == 2) {
+    // post the largest sequence number the Slave has committed
+    max_seq_no_acked_.post(seq_no);
+  } else if (FLAGS_replicator_replication_mode == 3 &&
+             !request.replica_id.empty()) {
+    // Slaves not telling who they are can't be counted towards the quorum
+    recordQuorumProgress(request.replica_id, seq_no);
+    for (const auto& p : request.downstream_committed_seq_nos) {
+      if (p.first != replica_id_ && p.first != request.replica_id) {
+        recordQuorumProgress(p.first,
+                             static_cast<rocksdb::SequenceNumber>(p.second));
+      }
+    }
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::updateInSyncMinAckLocked(
+    rocksdb::SequenceNumber latest_seq_no, uint64_t now_ms) {
+  const auto timeout_ms = static_cast<uint64_t>(
+    std::max(FLAGS_replicator_flow_control_slave_timeout_ms, 0));
+  const auto max_lag =
+    static_cast<uint64_t>(FLAGS_replicator_flow_control_lag_seq_nos) *
+    std::max(FLAGS_replicator_flow_control_out_of_sync_factor, 1);
+  bool found = false;
+  rocksdb::SequenceNumber min_seq_no = latest_seq_no;
+  for (const auto& p : wal_acks_) {
+    if (p.second.second + timeout_ms < now_ms ||
+        p.second.first + max_lag < latest_seq_no) {
+      continue;
+    }
+
+    found = true;
+    min_seq_no = std::min(min_seq_no, p.second.first);
+  }
+
+  if (found) {
+    in_sync_min_ack_seq_no_ = min_seq_no;
+    in_sync_min_ack_ms_ = now_ms;
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::recordQuorumProgress(
+    const std::string& replica_id,
+    rocksdb::SequenceNumber seq_no) {
+  const auto quorum_size =
+    static_cast<size_t>(std::max(FLAGS_replicator_quorum_size, 1));
+  std::vector<rocksdb::SequenceNumber> committed_seq_nos;
+  {
+    std::lock_guard<std::mutex> g(slave_progress_mutex_);
+    auto& progress = slave_progress_[replica_id];
+    progress.first = std::max(progress.first, seq_no);
+    progress.second = GetCurrentTimeMs();
+    if (slave_progress_.size() < quorum_size) {
+      return;
+    }
+
+    committed_seq_nos.reserve(slave_progress_.size());
+    for (const auto& p : slave_progress_) {
+      committed_seq_nos.push_back(p.second.first);
+    }
+  }
+
+  // The quorum_size-th largest one has been committed by quorum_size Slaves
+  std::nth_element(committed_seq_nos.begin(),
+                   committed_seq_nos.begin() + quorum_size - 1,
+                   committed_seq_nos.end(),
+                   std::greater<rocksdb::SequenceNumber>());
+  max_seq_no_acked_.post(committed_seq_nos[quorum_size - 1]);
+}
+
+bool RocksDBReplicator::ReplicatedDB::isWALPurged(
+    rocksdb::SequenceNumber seq_no) {
+  rocksdb::VectorLogPtr wal_files;
+  if (!db_->GetSortedWalFiles(wal_files).ok()) {
+    return false;
+  }
+
+  if (wal_files.empty()) {
+    return seq_no <= db_->GetLatestSequenceNumber();
+  }
+
+  return wal_files.front()->StartSequence() > seq_no;
+}
+
+bool RocksDBReplicator::ReplicatedDB::minWALAck(
+    rocksdb::SequenceNumber* seq_no) {
+  const auto now = GetCurrentTimeMs();
+  const auto timeout_ms =
+    static_cast<uint64_t>(FLAGS_replicator_wal_follower_timeout_sec) * 1000;
+
+  // We don't know how far Slaves not telling who they are have got
+  const auto anonymous_ms = last_anonymous_slave_ms_.load();
+  if (anonymous_ms != 0 && anonymous_ms + timeout_ms >= now) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> g(wal_acks_mutex_);
+  auto itor = wal_acks_.begin();
+  while (itor != wal_acks_.end()) {
+    if (itor->second.second + timeout_ms < now) {
+      LOG(WARNING) << db_name_ << " stops keeping WAL for Slave "
+                   << itor->first << ", which has been gone for "
+                   << (now - itor->second.second) / 1000 << " seconds";
+      itor = wal_acks_.erase(itor);
+      continue;
+    }
+
+    ++itor;
+  }
+
+  if (wal_acks_.empty()) {
+    return false;
+  }
+
+  *seq_no = wal_acks_.begin()->second.first;
+  for (const auto& p : wal_acks_) {
+    *seq_no = std::min(*seq_no, p.second.first);
+  }
+
+  return true;
+}
+
+void RocksDBReplicator::ReplicatedDB::purgeAckedWAL() {
+  rocksdb::VectorLogPtr wal_files;
+  auto status = db_->GetSortedWalFiles(wal_files);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to list WAL files of " << db_name_ << ": "
+               << status.ToString();
+    return;
+  }
+
+  rocksdb::SequenceNumber acked_seq_no = 0;
+  bool purge = FLAGS_replicator_wal_retention_by_progress &&
+    minWALAck(&acked_seq_no);
+  auto env = db_->GetEnv();
+  auto wal_dir = db_->GetOptions().wal_dir;
+  if (wal_dir.empty()) {
+    wal_dir = db_->GetName();
+  }
+  const auto now_sec = GetCurrentTimeMs() / 1000;
+  const auto min_retention_sec =
+    static_cast<uint64_t>(std::max(FLAGS_replicator_wal_min_retention_sec, 0));
+
+  uint64_t retained_bytes = 0;
+  for (size_t i = 0; i < wal_files.size(); ++i) {
+    const auto& file = wal_files[i];
+    // The updates in a file end right before the next file starts. Files are
+    // deleted from the oldest one, so that the remaining WAL has no gaps.
+    if (purge && file->Type() == rocksdb::kArchivedLogFile &&
+        i + 1 < wal_files.size() &&
+        wal_files[i + 1]->StartSequence() <= acked_seq_no + 1) {
+      uint64_t mtime_sec = 0;
+      status = env->GetFileModificationTime(wal_dir + file->PathName(),
+                                            &mtime_sec);
+      if (status.ok() && mtime_sec + min_retention_sec <= now_sec) {
+        status = db_->DeleteFile(file->PathName());
+        if (status.ok()) {
+          incCounter(kReplicatorPurgedWALFiles, 1, db_name_);
+          continue;
+        }
+
+        LOG(ERROR) << "Failed to delete " << file->PathName() << " of "
+                   << db_name_ << ": " << status.ToString();
+      }
+    }
+
+    purge = false;
+    retained_bytes += file->SizeFileBytes();
+  }
+
+  retained_wal_bytes_ = retained_bytes;
+}
+
+ErrorCode RocksDBReplicator::ReplicatedDB::readErrorCode(
+    const rocksdb::Status& status) {
+  // see readUpdates()
+  return status.IsIncomplete() ? ErrorCode::SOURCE_WAL_PURGED
+                               : ErrorCode::SOURCE_READ_ERROR;
+}
+
+void RocksDBReplicator::ReplicatedDB::onUpstreamWALPurged() {
+  if (wal_purged_handler_ == nullptr || wal_purged_reported_.exchange(true)) {
+    return;
+  }
+
+  LOG(ERROR) << db_name_ << " can't catch up from "
+             << upstream_addr_.describe() << ", whose WAL has been purged";
+  executor_->add(
+    [handler = wal_purged_handler_, db_name = db_name_,
+     upstream_addr = upstream_addr_] {
+      handler(db_name, upstream_addr);
+    });
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::createCheckpoint(
+    CheckpointResponse* response) {
+  auto env = rocksdb::Env::Default();
+  auto status = env->CreateDirIfMissing(FLAGS_replicator_checkpoint_dir);
+  if (!status.ok()) {
+    return status;
+  }
+
+  const int64_t checkpoint_id = NewRandomId();
+  const auto dir = FLAGS_replicator_checkpoint_dir + "/" + db_name_ + "_" +
+    std::to_string(checkpoint_id);
+  rocksdb::Checkpoint* checkpoint;
+  status = rocksdb::Checkpoint::Create(db_.get(), &checkpoint);
+  if (!status.ok()) {
+    return status;
+  }
+  std::unique_ptr<rocksdb::Checkpoint> checkpoint_holder(checkpoint);
+
+  status = checkpoint->CreateCheckpoint(dir);
+  std::vector<std::string> children;
+  if (status.ok()) {
+    status = env->GetChildren(dir, &children);
+  }
+
+  for (const auto& child : children) {
+    if (!status.ok()) {
+      break;
+    }
+
+    if (child == "." || child == "..") {
+      continue;
+    }
+
+    CheckpointFile file;
+    file.name = child;
+    uint64_t size;
+    status = env->GetFileSize(dir + "/" + child, &size);
+    file.size = size;
+    response->files.push_back(std::move(file));
+  }
+
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to create checkpoint for " << db_name_ << ": "
+               << status.ToString();
+    RemoveFlatDir(dir);
+    return status;
+  }
+
+  response->checkpoint_id = checkpoint_id;
+  std::lock_guard<std::mutex> g(checkpoints_mutex_);
+  checkpoints_.emplace(checkpoint_id, std::make_pair(dir, GetCurrentTimeMs()));
+  return status;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::readCheckpointFile(
+    const ReadCheckpointFileRequest& request,
+    ReadCheckpointFileResponse* response) {
+  std::string dir;
+  {
+    std::lock_guard<std::mutex> g(checkpoints_mutex_);
+    auto itor = checkpoints_.find(request.checkpoint_id);
+    if (itor == checkpoints_.end()) {
+      return rocksdb::Status::NotFound("Unknown checkpoint");
+    }
+
+    itor->second.second = GetCurrentTimeMs();
+    dir = itor->second.first;
+  }
+
+  // Only serve files in the checkpoint
+  if (request.file_name.empty() || request.file_name == "." ||
+      request.file_name == ".." ||
+      request.file_name.find('/') != std::string::npos) {
+    return rocksdb::Status::InvalidArgument("Invalid file name");
+  }
+
+  const auto path = dir + "/" + request.file_name;
+  auto env = rocksdb::Env::Default();
+  uint64_t file_size;
+  auto status = env->GetFileSize(path, &file_size);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (request.offset < 0 ||
+      static_cast<uint64_t>(request.offset) > file_size) {
+    return rocksdb::Status::InvalidArgument("Invalid offset");
+  }
+
+  const uint64_t offset = request.offset;
+  int64_t max_bytes = FLAGS_replicator_max_checkpoint_chunk_bytes;
+  if (request.max_bytes > 0 && request.max_bytes < max_bytes) {
+    max_bytes = request.max_bytes;
+  }
+  const auto n = std::min<uint64_t>(std::max<int64_t>(max_bytes, 1),
+                                    file_size - offset);
+
+  std::unique_ptr<rocksdb::RandomAccessFile> file;
+  status = env->NewRandomAccessFile(path, &file, rocksdb::EnvOptions());
+  if (!status.ok()) {
+    return status;
+  }
+
+  folly::IOBuf buf(folly::IOBuf::CREATE, n);
+  auto scratch = reinterpret_cast<char*>(buf.writableData());
+  rocksdb::Slice result;
+  status = file->Read(offset, n, &result, scratch);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (result.data() != scratch) {
+    memcpy(scratch, result.data(), result.size());
+  }
+  buf.append(result.size());
+
+  out_bytes_counter_.Incr(result.size());
+  response->data = std::move(buf);
+  response->eof = offset + result.size() >= file_size;
+  return status;
+}
+
+void RocksDBReplicator::ReplicatedDB::recordSentSeqNo(
+    rocksdb::SequenceNumber seq_no) {
+  if (FLAGS_replicator_replication_mode == 1) {
+    // post the largest sequence number we have written to the Slave.
+    max_seq_no_acked_.post(seq_no);
+  }
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::readUpdates(
+    const ReplicateRequest& request,
+    ReplicateResponse* response,
+    rocksdb::SequenceNumber* last_seq_no) {
+  if (write_options_.disableWAL) {
+    return rocksdb::Status::NotSupported(db_name_ + " has no WAL to read");
+  }
+
+  response->latest_seq_no = db_->GetLatestSequenceNumber();
+  if (FLAGS_replicator_tail_cache_bytes > 0 &&
+      readTailCache(request, response, last_seq_no)) {
+    // The cached updates are shared, and replaced rather than modified
+    if (!request.key_prefixes.empty()) {
+      FilterUpdates(request.key_prefixes, response, db_name_);
+    }
+    if (request.compression != CompressionType::NONE &&
+        FLAGS_replicator_enable_compression) {
+      CompressUpdates(request.compression, response, db_name_);
+    }
+
+    return rocksdb::Status::OK();
+  }
+
+  const auto expected_seq_no = request.seq_no + 1;
+  rocksdb::SequenceNumber next_seq_no = expected_seq_no;
+  rocksdb::SequenceNumber iter_seq_no = 0;
+  auto iter = getCachedIter(expected_seq_no, &iter_seq_no);
+  if (iter && !iter->Valid()) {
+    iter->Next();
+    if (!iter->Valid()) {
+      // this can only happen when cond_var_ timeout, or a new log file
+      // got created. Either way, it is ok (required) to create a new
+      // iterator.
+      iter.reset(nullptr);
+    }
+  }
+
+  // The batch starting from expected_seq_no, if we had to take it out of iter
+  // while skipping to it
+  rocksdb::BatchResult first_batch;
+  if (iter && iter_seq_no < expected_seq_no) {
+    if (SkipToBatch(iter.get(), expected_seq_no, &first_batch)) {
+      cached_iter_skips_counter_.Incr(1);
+      logMetric(kReplicatorCachedIterSkipDistance,
+                expected_seq_no - iter_seq_no, db_name_);
+    } else {
+      iter.reset(nullptr);
+    }
+  } else if (iter) {
+    cached_iter_hits_counter_.Incr(1);
+  }
+
+  rocksdb::Status status;
+  bool use_cached_iter = (iter != nullptr);
+  if (!use_cached_iter) {
+    cached_iter_misses_counter_.Incr(1);
+    const auto start = common::TscClock::Now();
+    status = db_->GetUpdatesSince(expected_seq_no, &iter);
+    logMetric(kReplicatorGetUpdatesSinceUs,
+              common::TscClock::ElapsedNs(start) / 1000, db_name_);
+  }
+
+  if (use_cached_iter || status.ok() || status.IsNotFound()) {
+    status = rocksdb::Status::OK();
+    uint64_t read_bytes = 0;
+    const auto max_updates = request.max_updates;
+    const auto max_bytes = ResponseMaxBytes(request);
+    for (int32_t i = 0;
+         (max_updates <= 0 || i < max_updates) &&
+         (max_bytes <= 0 || read_bytes < static_cast<uint64_t>(max_bytes))
+         && iter && iter->Valid();
+         ++i, iter->Next()) {
+      auto result = first_batch.writeBatchPtr ? std::move(first_batch)
+                                              : iter->GetBatch();
+      Update update;
+      next_seq_no += result.writeBatchPtr->Count();
+      read_bytes += result.writeBatchPtr->GetDataSize();
+      uint64_t ms;
+      if (LogExtractor::ExtractTimestamp(*result.writeBatchPtr, &ms)) {
+        update.timestamp = ms;
+      } else {
+        update.timestamp = 0;
+        LOG(ERROR) << "Failed to extract timestamp for " << db_name_;
+      }
+      update.raw_data = WrapWriteBatch(std::move(result.writeBatchPtr));
+      response->updates.emplace_back(std::move(update));
+    }
+
+    *last_seq_no = next_seq_no - 1;
+    out_bytes_counter_.Incr(read_bytes);
+  } else {
+    LOG(ERROR) << "Failed to pull updates from " << db_name_
+               << " with error: " << status.ToString();
+    incCounter(kReplicatorGetUpdatesSinceErrors, 1, db_name_);
+    if (isWALPurged(expected_seq_no)) {
+      // Retrying won't help, the Slave has to be rebuilt
+      status = rocksdb::Status::Incomplete("WAL purged", status.ToString());
+    }
+  }
+
+  // iter is broken if we didn't give back the batch we took out of it
+  if (iter && first_batch.writeBatchPtr == nullptr) {
+    putCachedIter(next_seq_no, std::move(iter));
+  }
+
+  if (status.ok() && !request.key_prefixes.empty()) {
+    FilterUpdates(request.key_prefixes, response, db_name_);
+  }
+
+  if (status.ok() && request.compression != CompressionType::NONE &&
+      FLAGS_replicator_enable_compression) {
+    CompressUpdates(request.compression, response, db_name_);
+  }
+
+  return status;
+}
+
+void RocksDBReplicator::ReplicatedDB::addToTailCache(
+    const rocksdb::WriteOptions& options,
+    const rocksdb::WriteBatch& updates,
+    uint64_t ms) {
+  // Slaves can't get updates skipping the WAL from GetUpdatesSince(), so they
+  // must not get them from tail_cache_ either.
+  if (options.disableWAL || updates.Count() == 0) {
+    return;
+  }
+
+  // RocksDB stores the first seq # assigned to updates in the header of its
+  // rep. Don't trust it if it doesn't make sense.
+  const auto& rep = updates.Data();
+  const rocksdb::SequenceNumber seq_no = folly::Endian::little(
+    folly::loadUnaligned<uint64_t>(rep.data()));
+  if (seq_no == 0 ||
+      seq_no + updates.Count() - 1 > db_->GetLatestSequenceNumber()) {
+    return;
+  }
+
+  const int64_t size = rep.size();
+  const auto max_bytes = FLAGS_replicator_tail_cache_bytes;
+  std::lock_guard<std::mutex> g(tail_cache_mutex_);
+  // Make room by dropping our own oldest batches. Idle dbs give their bytes
+  // back in cleanIdleCachedIters().
+  while (g_tail_cache_bytes.load() + size > max_bytes && !tail_cache_.empty()) {
+    auto oldest = tail_cache_.begin();
+    const int64_t oldest_size = oldest->second.raw_data.length();
+    tail_cache_bytes_ -= oldest_size;
+    g_tail_cache_bytes -= oldest_size;
+    tail_cache_.erase(oldest);
+  }
+
+  if (g_tail_cache_bytes.load() + size > max_bytes) {
+    return;
+  }
+
+  tail_cache_bytes_ += size;
+  g_tail_cache_bytes += size;
+  tail_cache_.emplace(seq_no, TailCacheEntry{
+      folly::IOBuf(folly::IOBuf::COPY_BUFFER, rep.data(), rep.size()),
+      ms,
+      static_cast<uint32_t>(updates.Count())});
+}
+
+bool RocksDBReplicator::ReplicatedDB::readTailCache(
+    const ReplicateRequest& request,
+    ReplicateResponse* response,
+    rocksdb::SequenceNumber* last_seq_no) {
+  rocksdb::SequenceNumber next_seq_no = request.seq_no + 1;
+  uint64_t read_bytes = 0;
+  const auto max_updates = request.max_updates;
+  const auto max_bytes = ResponseMaxBytes(request);
+  {
+    std::lock_guard<std::mutex> g(tail_cache_mutex_);
+    // Concurrent writes may be added out of order, or not at all, so we only
+    // serve consecutive batches, and stop at the first gap.
+    auto itor = tail_cache_.find(next_seq_no);
+    if (itor == tail_cache_.end()) {
+      tail_cache_misses_counter_.Incr(1);
+      return false;
+    }
+
+    for (int32_t i = 0;
+         (max_updates <= 0 || i < max_updates) &&
+         (max_bytes <= 0 || read_bytes < static_cast<uint64_t>(max_bytes)) &&
+         itor != tail_cache_.end() && itor->first == next_seq_no;
+         ++i, ++itor) {
+      Update update;
+      // shares the buffer with tail_cache_
+      update.raw_data = itor->second.raw_data;
+      update.timestamp = itor->second.timestamp;
+      next_seq_no += itor->second.count;
+      read_bytes += itor->second.raw_data.length();
+      response->updates.emplace_back(std::move(update));
+    }
+  }
+
+  *last_seq_no = next_seq_no - 1;
+  tail_cache_hits_counter_.Incr(1);
+  out_bytes_counter_.Incr(read_bytes);
+  return true;
+}
+
+std::unique_ptr<rocksdb::TransactionLogIterator>
+RocksDBReplicator::ReplicatedDB::getCachedIter(
+    rocksdb::SequenceNumber seq_no,
+    rocksdb::SequenceNumber* iter_seq_no) {
+  return HostCachedIters()->get(this, seq_no,
+                                FLAGS_replicator_max_cached_iter_skip,
+                                iter_seq_no);
+}
+
+void RocksDBReplicator::ReplicatedDB::putCachedIter(
+    rocksdb::SequenceNumber seq_no,
+    std::unique_ptr<rocksdb::TransactionLogIterator> iter) {
+  RegisterCachedIterGauges();
+  // Iters dropped for the host wide cap may be of other dbs, but are counted
+  // for the db needing the room
+  const auto num_dropped = HostCachedIters()->put(this, seq_no, std::move(iter),
+                                                  GetCurrentTimeMs());
+  if (num_dropped > 0) {
+    incCounter(kReplicatorCachedIterEvictions, num_dropped, db_name_);
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::adjustMaxBytesPerRequest(
+    uint64_t apply_ms, uint64_t applied_bytes) {
+  const auto max_bytes = FLAGS_replicator_client_max_bytes_per_request;
+  const auto min_bytes = std::min(FLAGS_replicator_client_min_bytes_per_request,
+                                  max_bytes);
+  const auto target_ms =
+    static_cast<uint64_t>(FLAGS_replicator_client_target_apply_ms);
+
+  const int64_t cur_bytes = max_bytes_per_request_.load();
+  if (apply_ms > target_ms) {
+    max_bytes_per_request_ = std::max<int64_t>(cur_bytes / 2, min_bytes);
+  } else if (applied_bytes * 2 >= static_cast<uint64_t>(cur_bytes)) {
+    max_bytes_per_request_ = std::min<int64_t>(cur_bytes * 2, max_bytes);
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::adjustServerWait(bool got_updates) {
+  const auto min_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
+  const auto max_wait_ms =
+    std::max(FLAGS_replicator_max_idle_server_wait_time_ms, min_wait_ms);
+  if (got_updates) {
+    server_wait_ms_ = min_wait_ms;
+    return;
+  }
+
+  const int64_t wait_ms = static_cast<int64_t>(server_wait_ms_.load()) * 2;
+  server_wait_ms_ = static_cast<int32_t>(
+    std::min<int64_t>(std::max<int64_t>(wait_ms, min_wait_ms), max_wait_ms));
+}
+
+void RocksDBReplicator::ReplicatedDB::cleanIdleCachedIters() {
+  auto now = GetCurrentTimeMs();
+  std::vector<std::string> idle_checkpoints;
+  {
+    std::lock_guard<std::mutex> g(checkpoints_mutex_);
+    auto itor = checkpoints_.begin();
+    while (itor != checkpoints_.end()) {
+      if (itor->second.second + FLAGS_replicator_idle_iter_timeout_ms < now) {
+        idle_checkpoints.push_back(std::move(itor->second.first));
+        itor = checkpoints_.erase(itor);
+        continue;
+      }
+
+      ++itor;
+    }
+  }
+
+  // Removing files may take a while, so do it without the lock
+  for (const auto& dir : idle_checkpoints) {
+    RemoveFlatDir(dir);
+  }
+
+  {
+    // Give back bytes of dbs not written to for a while
+    std::lock_guard<std::mutex> g(tail_cache_mutex_);
+    if (!tail_cache_.empty() &&
+        tail_cache_.rbegin()->second.timestamp +
+          FLAGS_replicator_idle_iter_timeout_ms < now) {
+      g_tail_cache_bytes -= tail_cache_bytes_;
+      tail_cache_bytes_ = 0;
+      tail_cache_.clear();
+    }
+  }
+
+  {
+    // Slaves we haven't heard from for a while are probably gone
+    std::lock_guard<std::mutex> g(slave_progress_mutex_);
+    auto itor = slave_progress_.begin();
+    while (itor != slave_progress_.end()) {
+      if (itor->second.second + FLAGS_replicator_idle_iter_timeout_ms < now) {
+        itor = slave_progress_.erase(itor);
+        continue;
+      }
+
+      ++itor;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> g(push_cursors_mutex_);
+    auto itor = push_cursors_.begin();
+    while (itor != push_cursors_.end()) {
+      if (itor->second.second + FLAGS_replicator_idle_iter_timeout_ms < now) {
+        itor = push_cursors_.erase(itor);
+        continue;
+      }
+
+      ++itor;
+    }
+  }
+
+  if (now > static_cast<uint64_t>(FLAGS_replicator_idle_iter_timeout_ms)) {
+    HostCachedIters()->dropIdle(
+      this, now - FLAGS_replicator_idle_iter_timeout_ms);
+  }
+
+  purgeAckedWAL();
+}
+
+std::string RocksDBReplicator::ReplicatedDB::WALSegmentDir(
+    const std::string& s3_prefix,
+    const std::string& db_name) {
+  auto dir = s3_prefix;
+  if (!dir.empty() && dir.back() != '/') {
+    dir.push_back('/');
+  }
+
+  return dir + db_name + "/";
+}
+
+std::string RocksDBReplicator::ReplicatedDB::WALSegmentKey(
+    const std::string& dir,
+    rocksdb::SequenceNumber first_seq_no,
+    rocksdb::SequenceNumber last_seq_no) {
+  char name[64];
+  snprintf(name, sizeof(name), "%020" PRIu64 "-%020" PRIu64,
+           static_cast<uint64_t>(first_seq_no),
+           static_cast<uint64_t>(last_seq_no));
+  return dir + name;
+}
+
+bool RocksDBReplicator::ReplicatedDB::ParseWALSegmentKey(
+    const std::string& key,
+    rocksdb::SequenceNumber* first_seq_no,
+    rocksdb::SequenceNumber* last_seq_no) {
+  const auto pos = key.rfind('/');
+  const auto name = pos == std::string::npos ? key : key.substr(pos + 1);
+  uint64_t first = 0;
+  uint64_t last = 0;
+  char extra;
+  if (sscanf(name.c_str(), "%" SCNu64 "-%" SCNu64 "%c",
+             &first, &last, &extra) != 2 || first > last) {
+    return false;
+  }
+
+  *first_seq_no = first;
+  *last_seq_no = last;
+  return true;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::shipWALToS3(
+    common::S3Util* s3_util,
+    const std::string& s3_prefix) {
+  const auto dir = WALSegmentDir(s3_prefix, db_name_);
+  if (!s3_shipped_seq_no_known_) {
+    // Continue from the last segment shipped, e.g., before a restart
+    auto resp = s3_util->listAllObjects(dir);
+    if (!resp.Error().empty()) {
+      return rocksdb::Status::IOError("Failed to list " + dir, resp.Error());
+    }
+
+    s3_shipped_seq_no_ = 0;
+    bool found = false;
+    for (const auto& key : resp.Body().objects) {
+      rocksdb::SequenceNumber first_seq_no;
+      rocksdb::SequenceNumber last_seq_no;
+      if (ParseWALSegmentKey(key, &first_seq_no, &last_seq_no)) {
+        s3_shipped_seq_no_ = std::max(s3_shipped_seq_no_, last_seq_no);
+        found = true;
+      }
+    }
+
+    if (!found) {
+      s3_shipped_seq_no_ = db_->GetLatestSequenceNumber();
+    }
+    s3_shipped_seq_no_known_ = true;
+    LOG(INFO) << "Shipping the WAL of " << db_name_ << " to " << dir
+              << " after seq # " << s3_shipped_seq_no_;
+  }
+
+  auto env = rocksdb::Env::Default();
+  auto status = env->CreateDirIfMissing(FLAGS_replicator_s3_segment_tmp_dir);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // A segment holds the updates of one response, as a Slave would get them
+  while (true) {
+    ReplicateRequest request;
+    request.seq_no = s3_shipped_seq_no_;
+    request.db_name = db_name_;
+    request.max_wait_ms = 0;
+    request.max_updates = 0;
+    request.compression =
+      ParseCompressionType(FLAGS_replicator_s3_segment_compression);
+    ReplicateResponse response;
+    rocksdb::SequenceNumber last_seq_no = 0;
+    status = readUpdates(request, &response, &last_seq_no);
+    if (!status.ok() || response.updates.empty()) {
+      break;
+    }
+
+    std::string data;
+    apache::thrift::CompactSerializer::serialize(response, &data);
+    const auto key = WALSegmentKey(dir, s3_shipped_seq_no_ + 1, last_seq_no);
+    const auto local_path = FLAGS_replicator_s3_segment_tmp_dir + "/" +
+      db_name_ + "-" + key.substr(dir.size());
+    status = rocksdb::WriteStringToFile(env, data, local_path);
+    if (!status.ok()) {
+      break;
+    }
+
+    auto resp = s3_util->putObject(key, local_path);
+    env->DeleteFile(local_path);
+    if (!resp.Error().empty()) {
+      status = rocksdb::Status::IOError("Failed to upload " + key,
+                                        resp.Error());
+      break;
+    }
+
+    s3_shipped_seq_no_ = last_seq_no;
+    incCounter(kReplicatorS3SegmentsShipped, 1, db_name_);
+  }
+
+  // Hold back purging the WAL not shipped yet. The ack is refreshed even if
+  // nothing was shipped, so that an idle db doesn't time out.
+  {
+    std::lock_guard<std::mutex> g(wal_acks_mutex_);
+    auto& ack = wal_acks_["s3:" + dir];
+    ack.first = std::max(ack.first, s3_shipped_seq_no_);
+    ack.second = GetCurrentTimeMs();
+  }
+
+  return status;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::applyWALFromS3(
+    common::S3Util* s3_util,
+    const std::string& s3_prefix) {
+  const auto dir = WALSegmentDir(s3_prefix, db_name_);
+  auto latest_seq_no = db_->GetLatestSequenceNumber();
+  auto marker = s3_last_applied_key_;
+  while (true) {
+    auto list_resp = s3_util->listObjectsV2(dir, "", marker);
+    if (!list_resp.Error().empty()) {
+      return rocksdb::Status::IOError("Failed to list " + dir,
+                                      list_resp.Error());
+    }
+
+    for (const auto& key : list_resp.Body().objects) {
+      rocksdb::SequenceNumber first_seq_no;
+      rocksdb::SequenceNumber last_seq_no;
+      if (!ParseWALSegmentKey(key, &first_seq_no, &last_seq_no)) {
+        continue;
+      }
+
+      upstream_latest_seq_no_ = std::max<uint64_t>(upstream_latest_seq_no_,
+                                                   last_seq_no);
+      if (last_seq_no <= latest_seq_no) {
+        s3_last_applied_key_ = key;
+        continue;
+      }
+
+      if (first_seq_no > latest_seq_no + 1) {
+        onUpstreamWALPurged();
+        return rocksdb::Status::Incomplete(
+          "WAL purged", key + " doesn't continue from seq # " +
+          std::to_string(latest_seq_no));
+      }
+
+      std::stringstream stream;
+      auto get_resp = s3_util->getObject(key, &stream);
+      if (!get_resp.Error().empty()) {
+        return rocksdb::Status::IOError("Failed to download " + key,
+                                        get_resp.Error());
+      }
+
+      ReplicateResponse response;
+      try {
+        apache::thrift::CompactSerializer::deserialize(stream.str(), response);
+      } catch (const std::exception& ex) {
+        return rocksdb::Status::Corruption("Failed to parse " + key,
+                                           ex.what());
+      }
+
+      if (response.compression != CompressionType::NONE &&
+          !UncompressUpdates(&response, db_name_)) {
+        return rocksdb::Status::Corruption("Failed to uncompress " + key);
+      }
+
+      const auto applied_updates_handler =
+        std::atomic_load(&applied_updates_handler_);
+      const auto now = GetCurrentTimeMs();
+      uint64_t write_bytes = 0;
+      for (auto& update : response.updates) {
+        auto write_batch = WriteBatchPool::Get(update.raw_data);
+        if (write_batch->GetDataSize() < kWriteBatchHeader) {
+          return rocksdb::Status::Corruption("Bad update in " + key);
+        }
+
+        const auto seq_no = DecodeWriteBatchSequence(write_batch->Data());
+        if (seq_no + write_batch->Count() <= latest_seq_no + 1) {
+          // applied already
+          continue;
+        }
+
+        if (seq_no != latest_seq_no + 1) {
+          return rocksdb::Status::Corruption(
+            key + " doesn't continue from seq # " +
+            std::to_string(latest_seq_no));
+        }
+
+        if (update.timestamp != 0) {
+          uint64_t then = update.timestamp;
+          logMetric(kReplicatorLatency, then < now ? now - then : 0, db_name_);
+        }
+
+        write_batch->PutLogData(
+          rocksdb::Slice(reinterpret_cast<const char*>(&update.timestamp),
+                         sizeof(update.timestamp)));
+        write_bytes += write_batch->GetDataSize();
+        auto status = db_->Write(write_options_, write_batch.get());
+        if (!status.ok()) {
+          return status;
+        }
+
+        if (applied_updates_handler) {
+          (*applied_updates_handler)(*write_batch);
+        }
+        latest_seq_no = db_->GetLatestSequenceNumber();
+      }
+
+      cond_var_.notifyAll();
+      applied_seq_no_.post(latest_seq_no);
+      in_bytes_counter_.Incr(write_bytes);
+      incCounter(kReplicatorS3SegmentsApplied, 1, db_name_);
+      s3_last_applied_key_ = key;
+    }
+
+    marker = list_resp.Body().next_marker;
+    if (marker.empty()) {
+      break;
+    }
+  }
+
+  // We have applied everything shipped so far
+  last_apply_ms_ = GetCurrentTimeMs();
+  if (write_options_.disableWAL &&
+      last_flush_ms_ +
+        static_cast<uint64_t>(FLAGS_replicator_slave_flush_interval_sec) *
+        1000 <= last_apply_ms_) {
+    flushMemtables(last_apply_ms_);
+  }
+
+  return rocksdb::Status::OK();
 }
 
 }  // namespace replicator
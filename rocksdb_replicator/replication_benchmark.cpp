@@ -0,0 +1,588 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+//
+// A benchmark of replication lag and cost. In the default "all" role, it
+// forks a leader process, which writes to --num_shards MASTER dbs, and
+// --num_followers follower processes, which replicate all of them through a
+// proxy adding --network_delay_ms each way. Every process prints one JSON
+// line of results to stdout when done, e.g.,
+//
+//   replication_benchmark --replication_mode=1 --value_size=uniform:100:4096
+//     --batch_size=exp:8 --network_delay_ms=2
+//
+// The leader and followers can also run on different hosts with --role.
+// Their clocks need to be in sync for lag to be meaningful then.
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "folly/Conv.h"
+#include "folly/String.h"
+#include "rocksdb/db.h"
+#include "rocksdb/options.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+
+using folly::SocketAddress;
+using replicator::DBRole;
+using replicator::LogExtractor;
+using replicator::ReturnCode;
+using replicator::RocksDBReplicator;
+using rocksdb::DB;
+using rocksdb::Options;
+using rocksdb::SequenceNumber;
+using rocksdb::WriteBatch;
+using std::chrono::milliseconds;
+using std::shared_ptr;
+using std::string;
+using std::this_thread::sleep_for;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+DEFINE_string(role, "all",
+              "all: fork a leader and the followers, and wait for them. "
+              "leader or follower: run only one of them.");
+DEFINE_int32(num_followers, 1, "Number of follower processes in role all");
+DEFINE_int32(follower_id, 0, "Id of this follower in role follower");
+DEFINE_int32(num_shards, 16, "Number of shards");
+DEFINE_int32(num_write_threads, 2, "Number of threads issuing writes");
+DEFINE_int32(num_batches_per_shard_thread, 10 * 1024,
+             "Number of write batches per shard per write thread");
+DEFINE_string(value_size, "fixed:1024",
+              "Distribution of value sizes, one of fixed:<n>, "
+              "uniform:<min>:<max> or exp:<mean>");
+DEFINE_string(batch_size, "fixed:1",
+              "Distribution of the # of keys per write batch, in the same "
+              "format as --value_size");
+DEFINE_int32(replication_mode, 0,
+             "--replicator_replication_mode of the leader");
+DEFINE_int32(network_delay_ms, 0,
+             "Delay added each way between the leader and a follower");
+DEFINE_int32(leader_port, 9300,
+             "Replicator port of the leader. Follower i listens on "
+             "leader_port + 1 + i, and its proxy on leader_port + 101 + i.");
+DEFINE_string(leader_ip, "127.0.0.1", "Leader ip in role follower");
+DEFINE_int32(leader_linger_sec, 60,
+             "How long the leader keeps serving after writing in role leader");
+DEFINE_int32(lag_sample_interval_ms, 1,
+             "How often followers sample their latest sequence #s");
+DEFINE_string(db_path, "/tmp/replication_benchmark/", "The path to dbs");
+
+DECLARE_int32(rocksdb_replicator_port);
+DECLARE_int32(replicator_replication_mode);
+
+namespace {
+
+const char kDoneKey[] = "__replication_benchmark_done__";
+
+class Distribution {
+ public:
+  explicit Distribution(const string& spec) : type_(), a_(0), b_(0) {
+    vector<string> parts;
+    folly::split(':', spec, parts);
+    CHECK(!parts.empty()) << "Invalid distribution " << spec;
+    type_ = parts[0];
+    if (type_ == "fixed" || type_ == "exp") {
+      CHECK_EQ(parts.size(), 2) << "Invalid distribution " << spec;
+      a_ = folly::to<double>(parts[1]);
+    } else if (type_ == "uniform") {
+      CHECK_EQ(parts.size(), 3) << "Invalid distribution " << spec;
+      a_ = folly::to<double>(parts[1]);
+      b_ = folly::to<double>(parts[2]);
+      CHECK_LE(a_, b_) << "Invalid distribution " << spec;
+    } else {
+      LOG(FATAL) << "Invalid distribution " << spec;
+    }
+  }
+
+  // Always >= 1
+  uint32_t next(std::mt19937_64* rng) const {
+    double v = a_;
+    if (type_ == "uniform") {
+      v = std::uniform_real_distribution<double>(a_, b_)(*rng);
+    } else if (type_ == "exp") {
+      v = std::exponential_distribution<double>(1.0 / a_)(*rng);
+    }
+
+    return std::max<uint32_t>(static_cast<uint32_t>(v), 1);
+  }
+
+ private:
+  string type_;
+  double a_;
+  double b_;
+};
+
+uint64_t GetCurrentTimeMs() {
+  return std::chrono::duration_cast<milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+double GetCpuSeconds() {
+  rusage usage;
+  CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+string ShardName(int i) {
+  return "shard" + to_string(i);
+}
+
+shared_ptr<DB> cleanAndOpenDB(const string& path) {
+  CHECK_EQ(system(("rm -rf " + path + " && mkdir -p " + path).c_str()), 0);
+  Options options;
+  options.create_if_missing = true;
+  // followers read back their WAL to compute lag
+  options.WAL_ttl_seconds = 3600;
+  options.IncreaseParallelism(4);
+
+  DB* db;
+  auto status = DB::Open(options, path, &db);
+  CHECK(status.ok()) << status.ToString();
+  return shared_ptr<DB>(db);
+}
+
+// Forward the connections to listen_port to upstream, delaying everything
+// by delay_ms each way. It is only meant for the few connections between
+// two replicators, so every connection gets its own threads.
+class DelayProxy {
+ public:
+  DelayProxy(int listen_port, const SocketAddress& upstream, int delay_ms)
+      : upstream_(upstream), delay_ms_(delay_ms), listen_fd_(-1) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_GE(listen_fd_, 0);
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(listen_port);
+    CHECK_EQ(bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                  sizeof(addr)), 0) << "Failed to bind " << listen_port;
+    CHECK_EQ(listen(listen_fd_, 64), 0);
+    thread([this] { acceptLoop(); }).detach();
+  }
+
+ private:
+  struct Chunk {
+    uint64_t ready_ms;
+    string data;
+  };
+
+  struct Pipe {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Chunk> chunks;
+    bool eof = false;
+  };
+
+  void acceptLoop() {
+    while (true) {
+      int client_fd = accept(listen_fd_, nullptr, nullptr);
+      if (client_fd < 0) {
+        continue;
+      }
+
+      int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+      sockaddr_storage addr;
+      auto len = upstream_.getAddress(&addr);
+      if (server_fd < 0 ||
+          connect(server_fd, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        LOG(ERROR) << "Failed to connect to " << upstream_.describe();
+        close(client_fd);
+        if (server_fd >= 0) {
+          close(server_fd);
+        }
+        continue;
+      }
+
+      int one = 1;
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      forward(client_fd, server_fd);
+      forward(server_fd, client_fd);
+    }
+  }
+
+  void forward(int from_fd, int to_fd) {
+    auto pipe = std::make_shared<Pipe>();
+    const uint64_t delay_ms = delay_ms_;
+    thread([pipe, from_fd, delay_ms] {
+        char buf[64 * 1024];
+        while (true) {
+          auto n = read(from_fd, buf, sizeof(buf));
+          std::lock_guard<std::mutex> g(pipe->mutex);
+          if (n <= 0) {
+            pipe->eof = true;
+            pipe->cv.notify_one();
+            return;
+          }
+
+          pipe->chunks.push_back(
+            Chunk{GetCurrentTimeMs() + delay_ms, string(buf, n)});
+          pipe->cv.notify_one();
+        }
+      }).detach();
+
+    thread([pipe, to_fd] {
+        while (true) {
+          Chunk chunk;
+          {
+            std::unique_lock<std::mutex> g(pipe->mutex);
+            pipe->cv.wait(g, [&pipe] {
+                return pipe->eof || !pipe->chunks.empty();
+              });
+            if (pipe->chunks.empty()) {
+              shutdown(to_fd, SHUT_WR);
+              return;
+            }
+
+            chunk = std::move(pipe->chunks.front());
+            pipe->chunks.pop_front();
+          }
+
+          const auto now = GetCurrentTimeMs();
+          if (chunk.ready_ms > now) {
+            sleep_for(milliseconds(chunk.ready_ms - now));
+          }
+
+          size_t written = 0;
+          while (written < chunk.data.size()) {
+            auto n = write(to_fd, chunk.data.data() + written,
+                           chunk.data.size() - written);
+            if (n <= 0) {
+              return;
+            }
+            written += n;
+          }
+        }
+      }).detach();
+  }
+
+  const SocketAddress upstream_;
+  const int delay_ms_;
+  int listen_fd_;
+};
+
+// Return the p-th percentile of sorted values
+uint64_t Percentile(const vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  auto idx = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+string LagJson(vector<uint64_t>* lags) {
+  std::sort(lags->begin(), lags->end());
+  std::ostringstream os;
+  os << "{\"count\":" << lags->size()
+     << ",\"p50\":" << Percentile(*lags, 50)
+     << ",\"p90\":" << Percentile(*lags, 90)
+     << ",\"p99\":" << Percentile(*lags, 99)
+     << ",\"p999\":" << Percentile(*lags, 99.9)
+     << ",\"max\":" << (lags->empty() ? 0 : lags->back()) << "}";
+  return os.str();
+}
+
+// Return after reading EOF from fd, or after --leader_linger_sec if fd < 0
+void waitForFollowers(int fd) {
+  if (fd < 0) {
+    sleep_for(std::chrono::seconds(FLAGS_leader_linger_sec));
+    return;
+  }
+
+  char c;
+  while (read(fd, &c, 1) > 0) {
+  }
+}
+
+void runLeader(int done_fd) {
+  FLAGS_rocksdb_replicator_port = FLAGS_leader_port;
+  FLAGS_replicator_replication_mode = FLAGS_replication_mode;
+  auto replicator = RocksDBReplicator::instance();
+
+  vector<RocksDBReplicator::ReplicatedDB*> dbs;
+  for (int i = 0; i < FLAGS_num_shards; ++i) {
+    RocksDBReplicator::ReplicatedDB* db;
+    CHECK(replicator->addDB(ShardName(i),
+                            cleanAndOpenDB(FLAGS_db_path + "leader/" +
+                                           ShardName(i)),
+                            DBRole::MASTER, SocketAddress(), &db) ==
+          ReturnCode::OK);
+    dbs.push_back(db);
+  }
+
+  // give followers time to start pulling
+  sleep_for(std::chrono::seconds(3));
+
+  const Distribution value_size(FLAGS_value_size);
+  const Distribution batch_size(FLAGS_batch_size);
+  std::atomic<uint64_t> bytes(0);
+  std::atomic<uint64_t> timeouts(0);
+  const auto cpu_start = GetCpuSeconds();
+  const auto start_ms = GetCurrentTimeMs();
+  vector<thread> threads(FLAGS_num_write_threads);
+  for (int i = 0; i < FLAGS_num_write_threads; ++i) {
+    threads[i] = thread([&, thread_id = i] {
+        std::mt19937_64 rng(thread_id);
+        const rocksdb::WriteOptions options;
+        uint64_t key = 0;
+        for (int n = 0; n < FLAGS_num_batches_per_shard_thread; ++n) {
+          for (auto db : dbs) {
+            WriteBatch updates;
+            const auto n_keys = batch_size.next(&rng);
+            for (uint32_t k = 0; k < n_keys; ++k) {
+              updates.Put("thread_" + to_string(thread_id) + "_key_" +
+                          to_string(key++), string(value_size.next(&rng), 'v'));
+            }
+
+            bytes += updates.GetDataSize();
+            try {
+              CHECK(db->Write(options, &updates).ok());
+            } catch (const ReturnCode code) {
+              CHECK(code == ReturnCode::WAIT_SLAVE_TIMEOUT);
+              ++timeouts;
+            }
+          }
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  const auto write_ms = std::max<uint64_t>(GetCurrentTimeMs() - start_ms, 1);
+
+  for (auto db : dbs) {
+    WriteBatch updates;
+    updates.Put(kDoneKey, "");
+    try {
+      db->Write(rocksdb::WriteOptions(), &updates);
+    } catch (const ReturnCode code) {
+      ++timeouts;
+    }
+  }
+
+  // keep serving until followers are done, so that their cost is counted
+  waitForFollowers(done_fd);
+
+  const auto cpu_sec = GetCpuSeconds() - cpu_start;
+  const double mb = bytes.load() / (1024.0 * 1024.0);
+  std::ostringstream os;
+  os << "{\"role\":\"leader\""
+     << ",\"replication_mode\":" << FLAGS_replication_mode
+     << ",\"num_shards\":" << FLAGS_num_shards
+     << ",\"network_delay_ms\":" << FLAGS_network_delay_ms
+     << ",\"value_size\":\"" << FLAGS_value_size << "\""
+     << ",\"batch_size\":\"" << FLAGS_batch_size << "\""
+     << ",\"mb_written\":" << mb
+     << ",\"write_ms\":" << write_ms
+     << ",\"mb_per_sec\":" << mb * 1000 / write_ms
+     << ",\"write_timeouts\":" << timeouts.load()
+     << ",\"cpu_sec\":" << cpu_sec
+     << ",\"cpu_sec_per_mb\":" << (mb > 0 ? cpu_sec / mb : 0) << "}";
+  std::cout << os.str() << std::endl;
+}
+
+void runFollower(int follower_id) {
+  FLAGS_rocksdb_replicator_port = FLAGS_leader_port + 1 + follower_id;
+  const SocketAddress leader_addr(FLAGS_leader_ip, FLAGS_leader_port);
+  SocketAddress upstream_addr = leader_addr;
+  std::unique_ptr<DelayProxy> proxy;
+  if (FLAGS_network_delay_ms > 0) {
+    const int proxy_port = FLAGS_leader_port + 101 + follower_id;
+    proxy = std::make_unique<DelayProxy>(proxy_port, leader_addr,
+                                         FLAGS_network_delay_ms);
+    upstream_addr = SocketAddress("127.0.0.1", proxy_port);
+  }
+
+  auto replicator = RocksDBReplicator::instance();
+  const auto path =
+    FLAGS_db_path + "follower" + to_string(follower_id) + "/";
+  vector<shared_ptr<DB>> dbs;
+  for (int i = 0; i < FLAGS_num_shards; ++i) {
+    dbs.push_back(cleanAndOpenDB(path + ShardName(i)));
+  }
+
+  const auto cpu_start = GetCpuSeconds();
+  for (int i = 0; i < FLAGS_num_shards; ++i) {
+    CHECK(replicator->addDB(ShardName(i), dbs[i], DBRole::SLAVE,
+                            upstream_addr) == ReturnCode::OK);
+  }
+
+  // shard -> (latest seq #, first time it was seen)
+  vector<vector<std::pair<SequenceNumber, uint64_t>>> samples(dbs.size());
+  const rocksdb::ReadOptions read_options;
+  size_t n_done = 0;
+  vector<bool> done(dbs.size(), false);
+  while (n_done < dbs.size()) {
+    const auto now = GetCurrentTimeMs();
+    for (size_t i = 0; i < dbs.size(); ++i) {
+      const auto seq_no = dbs[i]->GetLatestSequenceNumber();
+      if (samples[i].empty() || samples[i].back().first < seq_no) {
+        samples[i].emplace_back(seq_no, now);
+      }
+
+      string value;
+      if (!done[i] && seq_no > 0 &&
+          dbs[i]->Get(read_options, kDoneKey, &value).ok()) {
+        done[i] = true;
+        ++n_done;
+      }
+    }
+
+    sleep_for(milliseconds(FLAGS_lag_sample_interval_ms));
+  }
+
+  const auto cpu_sec = GetCpuSeconds() - cpu_start;
+
+  // The lag of a batch is from the time the leader wrote it, as appended by
+  // ReplicatedDB::Write(), to when we first saw it applied
+  vector<uint64_t> all_lags;
+  uint64_t bytes = 0;
+  std::ostringstream shards_os;
+  for (size_t i = 0; i < dbs.size(); ++i) {
+    std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+    auto status = dbs[i]->GetUpdatesSince(1, &iter);
+    CHECK(status.ok()) << status.ToString();
+    vector<uint64_t> lags;
+    auto sample = samples[i].begin();
+    for (; iter->Valid(); iter->Next()) {
+      auto result = iter->GetBatch();
+      const auto last_seq_no =
+        result.sequence + result.writeBatchPtr->Count() - 1;
+      while (sample != samples[i].end() && sample->first < last_seq_no) {
+        ++sample;
+      }
+
+      uint64_t write_ms;
+      if (sample == samples[i].end() ||
+          !LogExtractor::ExtractTimestamp(*result.writeBatchPtr, &write_ms)) {
+        continue;
+      }
+
+      bytes += result.writeBatchPtr->GetDataSize();
+      lags.push_back(sample->second > write_ms ? sample->second - write_ms : 0);
+    }
+
+    all_lags.insert(all_lags.end(), lags.begin(), lags.end());
+    shards_os << (i == 0 ? "" : ",") << "\"" << ShardName(i) << "\":"
+              << LagJson(&lags);
+  }
+
+  for (int i = 0; i < FLAGS_num_shards; ++i) {
+    replicator->removeDB(ShardName(i));
+  }
+
+  const double mb = bytes / (1024.0 * 1024.0);
+  std::ostringstream os;
+  os << "{\"role\":\"follower\""
+     << ",\"follower_id\":" << follower_id
+     << ",\"mb_replicated\":" << mb
+     << ",\"cpu_sec\":" << cpu_sec
+     << ",\"cpu_sec_per_mb\":" << (mb > 0 ? cpu_sec / mb : 0)
+     << ",\"lag_ms\":" << LagJson(&all_lags)
+     << ",\"shard_lag_ms\":{" << shards_os.str() << "}}";
+  std::cout << os.str() << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_role == "leader") {
+    runLeader(-1);
+    return 0;
+  }
+
+  if (FLAGS_role == "follower") {
+    runFollower(FLAGS_follower_id);
+    return 0;
+  }
+
+  CHECK_EQ(FLAGS_role, "all");
+  // Fork before anything starts threads. The leader waits for EOF on
+  // done_fds[0], which happens once all followers exit.
+  int done_fds[2];
+  CHECK_EQ(pipe(done_fds), 0);
+  std::cout.flush();
+  const pid_t leader = fork();
+  CHECK_GE(leader, 0);
+  if (leader == 0) {
+    close(done_fds[1]);
+    runLeader(done_fds[0]);
+    return 0;
+  }
+  close(done_fds[0]);
+
+  vector<pid_t> followers;
+  for (int i = 0; i < FLAGS_num_followers; ++i) {
+    const pid_t follower = fork();
+    CHECK_GE(follower, 0);
+    if (follower == 0) {
+      close(done_fds[1]);
+      runFollower(i);
+      return 0;
+    }
+    followers.push_back(follower);
+  }
+
+  int ret = 0;
+  for (auto pid : followers) {
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      ret = 1;
+    }
+  }
+
+  close(done_fds[1]);
+  int status;
+  waitpid(leader, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    ret = 1;
+  }
+
+  return ret;
+}
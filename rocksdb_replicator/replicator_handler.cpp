@@ -18,6 +18,123 @@
 
 #include "rocksdb_replicator/replicator_handler.h"
 
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "folly/futures/Future.h"
+#include "rocksdb_replicator/replicator_stats.h"
+
+DECLARE_int32(replicator_throttle_retry_ms);
+
+namespace {
+
+using replicator::ErrorCode;
+using replicator::ReplicateError;
+using replicator::ReplicateMultiRequest;
+using replicator::ReplicateMultiResponse;
+using replicator::ReplicateResponse;
+using ReplicatedDB = replicator::RocksDBReplicator::ReplicatedDB;
+
+// The state shared by all the dbs a replicateMulti request is waiting on.
+// Whichever of them first gets new updates (or times out) replies for all.
+struct MultiRequestState {
+  using CallbackType = apache::thrift::HandlerCallback<
+    std::unique_ptr<ReplicateMultiResponse>>;
+
+  MultiRequestState(std::unique_ptr<CallbackType> cb,
+                    std::unique_ptr<ReplicateMultiRequest> req)
+      : callback(std::move(cb)), request(std::move(req)), dbs()
+      , deadline_ms(GetCurrentTimeMs() +
+                    std::max<int64_t>(request->max_wait_ms, 0))
+      , response(), throttled(), sent(), replied(false) {}
+
+  std::unique_ptr<CallbackType> callback;
+  std::unique_ptr<ReplicateMultiRequest> request;
+  // Parallel to request->requests, nullptr for dbs not found
+  std::vector<std::weak_ptr<ReplicatedDB>> dbs;
+  const uint64_t deadline_ms;
+  ReplicateMultiResponse response;
+  // index in request->requests -> the response held back by the bandwidth
+  // limits, and the seq # of its last update
+  std::map<size_t, std::pair<ReplicateResponse, rocksdb::SequenceNumber>>
+    throttled;
+  // The dbs in response, and the seq # of their last update sent
+  std::vector<std::pair<std::shared_ptr<ReplicatedDB>,
+                        rocksdb::SequenceNumber>> sent;
+  std::atomic<bool> replied;
+
+  static uint64_t GetCurrentTimeMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+};
+
+// Move the throttled responses of state which the bandwidth limits allow now
+// to its response, and send it once it has any or the deadline is reached.
+// Until then, retry every --replicator_throttle_retry_ms. Replying with
+// nothing would make the Slave ask again right away, reading the same
+// updates again.
+void SendMultiResponse(std::shared_ptr<MultiRequestState> state) {
+  for (auto itor = state->throttled.begin();
+       itor != state->throttled.end();) {
+    auto db = state->dbs[itor->first].lock();
+    if (db != nullptr && !db->admitResponse(itor->second.first)) {
+      ++itor;
+      continue;
+    }
+
+    const auto& db_name = state->request->requests[itor->first].db_name;
+    if (db == nullptr) {
+      ReplicateError e;
+      e.code = ErrorCode::SOURCE_NOT_FOUND;
+      e.msg = db_name + " has been removed";
+      state->response.errors[db_name] = std::move(e);
+    } else {
+      state->response.responses[db_name] = std::move(itor->second.first);
+      state->sent.emplace_back(std::move(db), itor->second.second);
+    }
+    itor = state->throttled.erase(itor);
+  }
+
+  const auto now = MultiRequestState::GetCurrentTimeMs();
+  if (!state->throttled.empty() && state->sent.empty() &&
+      now < state->deadline_ms) {
+    const auto delay_ms = std::min<uint64_t>(
+      std::max(FLAGS_replicator_throttle_retry_ms, 1),
+      state->deadline_ms - now);
+#if __GNUC__ >= 8
+    auto future =
+      folly::futures::sleepUnsafe(std::chrono::milliseconds(delay_ms));
+#else
+    auto future = folly::futures::sleep(std::chrono::milliseconds(delay_ms));
+#endif
+    std::move(future).then([state = std::move(state)] (
+        folly::Try<folly::Unit>&& t) mutable {
+      SendMultiResponse(std::move(state));
+    });
+    return;
+  }
+
+  // The Slave asks again for the updates still throttled
+  for (const auto& entry : state->throttled) {
+    replicator::incCounter(replicator::kReplicatorThrottledResponses, 1,
+                           state->request->requests[entry.first].db_name);
+  }
+  state->callback.release()->resultInThread(std::move(state->response));
+  for (auto& db_and_seq_no : state->sent) {
+    db_and_seq_no.first->recordSentSeqNo(db_and_seq_no.second);
+  }
+}
+
+}  // namespace
+
 namespace replicator {
 
 #if __GNUC__ >= 8
@@ -40,4 +157,151 @@ void ReplicatorHandler::async_eb_replicate(
   db->handleReplicateRequest(std::move(callback), std::move(request));
 }
 
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_replicateMulti(
+#else
+void ReplicatorHandler::async_eb_replicateMulti(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<ReplicateMultiResponse>>> callback,
+    std::unique_ptr<ReplicateMultiRequest> request) {
+  auto state = std::make_shared<MultiRequestState>(std::move(callback),
+                                                   std::move(request));
+  std::vector<std::shared_ptr<ReplicatedDB>> dbs;
+  bool has_updates = false;
+  bool has_dbs = false;
+  for (const auto& req : state->request->requests) {
+    std::shared_ptr<ReplicatedDB> db;
+    if (!db_map_->get(req.db_name, &db)) {
+      ReplicateError e;
+      e.code = ErrorCode::SOURCE_NOT_FOUND;
+      e.msg = "could not find " + req.db_name;
+      state->response.errors[req.db_name] = std::move(e);
+    } else {
+      auto seq_no = static_cast<rocksdb::SequenceNumber>(req.seq_no);
+      has_dbs = true;
+      db->recordSlaveProgress(req);
+      has_updates |= db->db_->GetLatestSequenceNumber() > seq_no;
+    }
+    state->dbs.emplace_back(db);
+    dbs.emplace_back(std::move(db));
+  }
+
+  auto reply = [state] {
+    if (state->replied.exchange(true)) {
+      return;
+    }
+
+    for (size_t i = 0; i < state->dbs.size(); ++i) {
+      auto db = state->dbs[i].lock();
+      const auto& req = state->request->requests[i];
+      if (db == nullptr) {
+        if (state->response.errors.count(req.db_name) == 0) {
+          ReplicateError e;
+          e.code = ErrorCode::SOURCE_NOT_FOUND;
+          e.msg = req.db_name + " has been removed";
+          state->response.errors[req.db_name] = std::move(e);
+        }
+        continue;
+      }
+
+      if (db->db_->GetLatestSequenceNumber() <=
+          static_cast<rocksdb::SequenceNumber>(req.seq_no)) {
+        continue;
+      }
+
+      ReplicateResponse response;
+      rocksdb::SequenceNumber last_seq_no;
+      auto status = db->readUpdates(req, &response, &last_seq_no);
+      if (status.ok()) {
+        // Admitted by SendMultiResponse() below
+        state->throttled.emplace(
+          i, std::make_pair(std::move(response), last_seq_no));
+      } else {
+        ReplicateError e;
+        e.code = ReplicatedDB::readErrorCode(status);
+        e.msg = status.ToString();
+        state->response.errors[req.db_name] = std::move(e);
+      }
+    }
+
+    SendMultiResponse(state);
+  };
+
+  const auto timeout = state->request->max_wait_ms;
+  if (has_updates || timeout <= 0 || !has_dbs) {
+    reply();
+    return;
+  }
+
+  // Wait on the condition variables of all the dbs. The first task runs
+  // reply(), and the others become no-ops.
+  for (size_t i = 0; i < dbs.size(); ++i) {
+    auto& db = dbs[i];
+    if (db == nullptr) {
+      continue;
+    }
+
+    auto seq_no =
+      static_cast<rocksdb::SequenceNumber>(state->request->requests[i].seq_no);
+    db->cond_var_.runIfConditionOrWaitForNotify(
+      reply,
+      [db, seq_no] { return db->db_->GetLatestSequenceNumber() > seq_no; },
+      timeout);
+  }
+}
+
+void ReplicatorHandler::async_tm_createCheckpoint(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<CheckpointResponse>>> callback,
+    std::unique_ptr<CheckpointRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  CheckpointResponse response;
+  auto status = db->createCheckpoint(&response);
+  if (!status.ok()) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_READ_ERROR;
+    e.msg = status.ToString();
+    callback->exception(e);
+    return;
+  }
+
+  callback->result(std::move(response));
+}
+
+void ReplicatorHandler::async_tm_readCheckpointFile(
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<ReadCheckpointFileResponse>>> callback,
+    std::unique_ptr<ReadCheckpointFileRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  ReadCheckpointFileResponse response;
+  auto status = db->readCheckpointFile(*request, &response);
+  if (!status.ok()) {
+    ReplicateException e;
+    e.code = status.IsNotFound() ? ErrorCode::SOURCE_NOT_FOUND
+                                 : ErrorCode::SOURCE_READ_ERROR;
+    e.msg = status.ToString();
+    callback->exception(e);
+    return;
+  }
+
+  callback->result(std::move(response));
+}
+
 }  // namespace replicator
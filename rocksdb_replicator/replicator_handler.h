@@ -42,6 +42,26 @@ class ReplicatorHandler : public ReplicatorSvIf {
         std::unique_ptr<ReplicateResponse>>> callback,
       std::unique_ptr<ReplicateRequest> request) override;
 
+#if __GNUC__ >= 8
+  void async_tm_replicateMulti(
+#else
+  void async_eb_replicateMulti(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<ReplicateMultiResponse>>> callback,
+      std::unique_ptr<ReplicateMultiRequest> request) override;
+
+  // These block on disk IO, so they are run by thrift worker threads
+  void async_tm_createCheckpoint(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<CheckpointResponse>>> callback,
+      std::unique_ptr<CheckpointRequest> request) override;
+
+  void async_tm_readCheckpointFile(
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<ReadCheckpointFileResponse>>> callback,
+      std::unique_ptr<ReadCheckpointFileRequest> request) override;
+
  private:
   DBMapType* db_map_;
 };
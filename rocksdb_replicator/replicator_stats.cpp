@@ -18,7 +18,9 @@
 
 #include "rocksdb_replicator/replicator_stats.h"
 
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #include "common/stats/stats.h"
 
@@ -36,10 +38,68 @@ const std::string kReplicatorRemoteApplicationExceptions =
   "replicator_remote_app_exceptions";
 const std::string kReplicatorGetUpdatesSinceErrors =
   "replicator_get_update_since_errors";
-const std::string kReplicatorGetUpdatesSinceMs =
-  "replicator_get_update_since_ms";
-const std::string kReplicatorWriteMs = "replicator_write_ms";
+const std::string kReplicatorGetUpdatesSinceUs =
+  "replicator_get_update_since_us";
+const std::string kReplicatorWriteUs = "replicator_write_us";
 const std::string kReplicatorLeaderSequenceNumbersBehind = "replicator_leader_sequence_numbers_behind";
+// tagged with " db=<db name> slave=<replica id>"
+const std::string kReplicatorSlaveAckLag = "replicator_slave_ack_lag";
+const std::string kReplicatorCachedIterHits = "replicator_cached_iter_hits";
+const std::string kReplicatorCachedIterMisses = "replicator_cached_iter_misses";
+const std::string kReplicatorCachedIterSkips = "replicator_cached_iter_skips";
+const std::string kReplicatorCachedIterSkipDistance =
+  "replicator_cached_iter_skip_distance";
+const std::string kReplicatorCachedIterEvictions =
+  "replicator_cached_iter_evictions";
+const std::string kReplicatorCachedIters = "replicator_cached_iters";
+const std::string kReplicatorCachedIterBytes = "replicator_cached_iter_bytes";
+const std::string kReplicatorTailCacheHits = "replicator_tail_cache_hits";
+const std::string kReplicatorTailCacheMisses = "replicator_tail_cache_misses";
+// compressed bytes * 100 / uncompressed bytes
+const std::string kReplicatorCompressionRatio =
+  "replicator_compression_ratio_percent";
+// filtered bytes * 100 / unfiltered bytes, for partial replicas
+const std::string kReplicatorKeyFilterRatio =
+  "replicator_key_filter_ratio_percent";
+const std::string kReplicatorCompressUs = "replicator_compress_us";
+const std::string kReplicatorUncompressUs = "replicator_uncompress_us";
+const std::string kReplicatorCompressionErrors =
+  "replicator_compression_errors";
+// tagged with " lane=<apply|read>", and with " lane=<apply|read> shard=<id>"
+const std::string kReplicatorExecutorQueueDepth =
+  "replicator_executor_queue_depth";
+const std::string kReplicatorExecutorWaitUs = "replicator_executor_wait_us";
+const std::string kReplicatorReadWaits = "replicator_read_waits";
+const std::string kReplicatorReadWaitTimeouts =
+  "replicator_read_wait_timeouts";
+const std::string kReplicatorThrottledResponses =
+  "replicator_throttled_responses";
+const std::string kReplicatorWriteGroupSize = "replicator_write_group_size";
+// gauges of SLAVE dbs
+const std::string kReplicatorSeqNoLag = "replicator_seq_no_lag";
+const std::string kReplicatorMsSinceLastApply =
+  "replicator_ms_since_last_apply";
+const std::string kReplicatorRetainedWALBytes = "replicator_retained_wal_bytes";
+const std::string kReplicatorPurgedWALFiles = "replicator_purged_wal_files";
+const std::string kReplicatorS3SegmentsShipped =
+  "replicator_s3_segments_shipped";
+const std::string kReplicatorS3SegmentsApplied =
+  "replicator_s3_segments_applied";
+const std::string kReplicatorS3SyncErrors = "replicator_s3_sync_errors";
+// flow control between Slaves stalled by RocksDB and their Master
+const std::string kReplicatorSlaveApplyStalls = "replicator_slave_apply_stalls";
+const std::string kReplicatorSlaveApplyBytesPerSec =
+  "replicator_slave_apply_bytes_per_sec";
+const std::string kReplicatorStalledSlaveReports =
+  "replicator_stalled_slave_reports";
+const std::string kReplicatorStallThrottledWrites =
+  "replicator_stall_throttled_writes";
+const std::string kReplicatorStalledSlaveTimeouts =
+  "replicator_stalled_slave_timeouts";
+const std::string kReplicatorFlowControlDelayedWrites =
+  "replicator_flow_control_delayed_writes";
+const std::string kReplicatorFlowControlDelayMs =
+  "replicator_flow_control_delay_ms";
 
 
 void logMetric(const std::string& metric_name, int64_t value,
@@ -58,4 +118,49 @@ void incCounter(const std::string& counter_name, uint64_t value,
   }
 }
 
+DBCounter::DBCounter(const std::string& counter_name,
+                     const std::string& db_name)
+    : counter_(common::Stats::get()->GetCounterHandle(counter_name))
+    , db_counter_(common::Stats::get()->GetCounterHandle(counter_name,
+                                                         {{"db", db_name}}))
+    , per_db_(FLAGS_replicator_enable_per_db_stats && !db_name.empty()) {}
+
+void DBCounter::Incr(uint64_t value) const {
+  common::Stats::get()->Incr(counter_, value);
+  if (per_db_) {
+    common::Stats::get()->Incr(db_counter_, value);
+  }
+}
+
+void registerGauge(const std::string& gauge_name, const std::string& db_name,
+                   std::function<uint64_t()> getter) {
+  if (!FLAGS_replicator_enable_per_db_stats) {
+    return;
+  }
+
+  static std::mutex getters_mutex;
+  // Stats doesn't support unregistering gauges, so we register one getter per
+  // gauge with it, dispatching to the latest getter registered here.
+  static auto getters =
+    new std::unordered_map<std::string, std::function<uint64_t()>>();
+
+  const auto name = gauge_name + " db=" + db_name;
+  bool is_new;
+  {
+    std::lock_guard<std::mutex> g(getters_mutex);
+    auto& stored_getter = (*getters)[name];
+    is_new = !stored_getter;
+    stored_getter = std::move(getter);
+  }
+
+  // Stats calls the getters with its own lock held, so don't register while
+  // holding getters_mutex.
+  if (is_new) {
+    common::Stats::get()->RegisterGauge(name, [name] {
+        std::lock_guard<std::mutex> g(getters_mutex);
+        return (*getters)[name]();
+      });
+  }
+}
+
 }  // namespace replicator
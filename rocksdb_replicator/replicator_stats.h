@@ -18,8 +18,11 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 
+#include "common/stats/stats.h"
+
 namespace replicator {
 
 extern const std::string kReplicatorLatency;
@@ -29,9 +32,45 @@ extern const std::string kReplicatorWriteBytes;
 extern const std::string kReplicatorConnectionErrors;
 extern const std::string kReplicatorRemoteApplicationExceptions;
 extern const std::string kReplicatorGetUpdatesSinceErrors;
-extern const std::string kReplicatorGetUpdatesSinceMs;
-extern const std::string kReplicatorWriteMs;
+extern const std::string kReplicatorGetUpdatesSinceUs;
+extern const std::string kReplicatorWriteUs;
 extern const std::string kReplicatorLeaderSequenceNumbersBehind;
+extern const std::string kReplicatorSlaveAckLag;
+extern const std::string kReplicatorCachedIterHits;
+extern const std::string kReplicatorCachedIterMisses;
+extern const std::string kReplicatorCachedIterSkips;
+extern const std::string kReplicatorCachedIterSkipDistance;
+extern const std::string kReplicatorCachedIterEvictions;
+// gauges of the cached iters of a db, and of all dbs without the db tag
+extern const std::string kReplicatorCachedIters;
+extern const std::string kReplicatorCachedIterBytes;
+extern const std::string kReplicatorTailCacheHits;
+extern const std::string kReplicatorTailCacheMisses;
+extern const std::string kReplicatorCompressionRatio;
+extern const std::string kReplicatorKeyFilterRatio;
+extern const std::string kReplicatorCompressUs;
+extern const std::string kReplicatorUncompressUs;
+extern const std::string kReplicatorCompressionErrors;
+extern const std::string kReplicatorExecutorQueueDepth;
+extern const std::string kReplicatorExecutorWaitUs;
+extern const std::string kReplicatorReadWaits;
+extern const std::string kReplicatorReadWaitTimeouts;
+extern const std::string kReplicatorThrottledResponses;
+extern const std::string kReplicatorWriteGroupSize;
+extern const std::string kReplicatorSeqNoLag;
+extern const std::string kReplicatorMsSinceLastApply;
+extern const std::string kReplicatorRetainedWALBytes;
+extern const std::string kReplicatorPurgedWALFiles;
+extern const std::string kReplicatorS3SegmentsShipped;
+extern const std::string kReplicatorS3SegmentsApplied;
+extern const std::string kReplicatorS3SyncErrors;
+extern const std::string kReplicatorSlaveApplyStalls;
+extern const std::string kReplicatorSlaveApplyBytesPerSec;
+extern const std::string kReplicatorStalledSlaveReports;
+extern const std::string kReplicatorStallThrottledWrites;
+extern const std::string kReplicatorStalledSlaveTimeouts;
+extern const std::string kReplicatorFlowControlDelayedWrites;
+extern const std::string kReplicatorFlowControlDelayMs;
 
 
 // add value to metric_name. If db_name is not empty, add value to the per db
@@ -44,4 +83,24 @@ void logMetric(const std::string& metric_name, int64_t value,
 void incCounter(const std::string& counter_name, uint64_t value,
                 const std::string& db_name = std::string());
 
+// counter_name and its per db version for db_name, resolved once for the hot
+// paths. incCounter(counter_name, value, db_name) without building the name.
+class DBCounter {
+ public:
+  DBCounter(const std::string& counter_name, const std::string& db_name);
+
+  void Incr(uint64_t value) const;
+
+ private:
+  const common::Stats::CounterHandle counter_;
+  const common::Stats::CounterHandle db_counter_;
+  const bool per_db_;
+};
+
+// export what getter returns as gauge_name tagged with " db=<db_name>". A
+// later call for the same gauge and db replaces getter, e.g., when the db is
+// added again.
+void registerGauge(const std::string& gauge_name, const std::string& db_name,
+                   std::function<uint64_t()> getter);
+
 }  // namespace replicator
@@ -19,10 +19,16 @@
 #include "rocksdb_replicator/rocksdb_replicator.h"
 
 #include <gflags/gflags.h>
+#include <unistd.h>
 
+#include <chrono>
 #include <string>
+#include <thread>
 
+#include "common/thread_placement.h"
 #include "rocksdb_replicator/replicator_handler.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#include "rocksdb/env.h"
 #if __GNUC__ >= 8
 #include "folly/executors/CPUThreadPoolExecutor.h"
 #include "folly/executors/IOThreadPoolExecutor.h"
@@ -40,11 +46,63 @@ DEFINE_int32(num_replicator_io_threads, 8,
 DEFINE_int32(rocksdb_replicator_executor_threads, 32,
              "The number of rocksplicator executor threads.");
 
+DEFINE_int32(replicator_executor_shards, 0,
+             "If > 0, pin each db to one of this many executors, so that a "
+             "busy db can't starve the others. They run pull responses and "
+             "replicate() calls, with replicate() calls first.");
+
+DEFINE_int32(replicator_threads_per_executor_shard, 2,
+             "The number of threads of each executor shard.");
+
+DEFINE_string(rocksdb_replicator_cpus, "",
+              "The CPUs to pin the replicator executor and server IO threads "
+              "to, see common::ThreadPlacement for the format");
+
+DEFINE_bool(replicator_multiplex_pulls, false,
+            "If true, SLAVE dbs replicating from the same upstream host share "
+            "replicateMulti() calls instead of each running its own "
+            "replicate() long-poll. The upstream must support replicateMulti.");
+
+DEFINE_string(replicator_replica_id, "",
+              "How SLAVE dbs identify this host to their upstreams, e.g., in "
+              "per Slave stats. Defaults to <hostname>:<replicator port>. "
+              "Must be unique among the Slaves of a Master.");
+
+DEFINE_int32(replicator_checkpoint_rpc_timeout_ms, 60 * 1000,
+             "The timeout for each rpc made by fetchCheckpoint().");
+
+DECLARE_bool(replicator_slave_disable_wal);
+
+namespace {
+
+std::string GetReplicaId() {
+  if (!FLAGS_replicator_replica_id.empty()) {
+    return FLAGS_replicator_replica_id;
+  }
+
+  char hostname[256];
+  if (gethostname(hostname, sizeof(hostname)) != 0) {
+    hostname[0] = '\0';
+  }
+  hostname[sizeof(hostname) - 1] = '\0';
+
+  return std::string(hostname) + ":" +
+    std::to_string(FLAGS_rocksdb_replicator_port);
+}
+
+}  // namespace
+
 namespace replicator {
 
 RocksDBReplicator::RocksDBReplicator()
-    : executor_()
+    : replica_id_(GetReplicaId())
+    , executor_()
+    , sharded_executor_()
     , client_pool_(FLAGS_num_replicator_io_threads)
+    , streams_()
+    , streams_mutex_()
+    , wal_purged_handler_()
+    , wal_purged_handler_mutex_()
     , db_map_()
 #if __GNUC__ >= 8
     , server_()
@@ -52,27 +110,43 @@ RocksDBReplicator::RocksDBReplicator()
     , server_("disabled", false)
 #endif
     , thread_()
-    , cleaner_() {
+    , cleaner_()
+    , s3_syncer_() {
+  auto placement = common::ThreadPlacement::Create(
+    FLAGS_rocksdb_replicator_cpus);
 #if __GNUC__ >= 8
   executor_ = std::make_unique<folly::CPUThreadPoolExecutor>(
 #else
   executor_ = std::make_unique<wangle::CPUThreadPoolExecutor>(
 #endif
     std::max(FLAGS_rocksdb_replicator_executor_threads, 16),
+    std::make_shared<common::PlacedThreadFactory>(
 #if __GNUC__ >= 8
-    std::make_shared<folly::NamedThreadFactory>("rptor-worker-"));
+      std::make_shared<folly::NamedThreadFactory>("rptor-worker-"),
 #else
-    std::make_shared<wangle::NamedThreadFactory>("rptor-worker-"));
+      std::make_shared<wangle::NamedThreadFactory>("rptor-worker-"),
 #endif
+      placement));
+
+  if (FLAGS_replicator_executor_shards > 0) {
+    sharded_executor_ = std::make_unique<detail::ShardedExecutor>(
+      FLAGS_replicator_executor_shards,
+      FLAGS_replicator_threads_per_executor_shard,
+      placement);
+  }
 
   server_.setInterface(std::make_unique<ReplicatorHandler>(&db_map_));
   server_.setPort(FLAGS_rocksdb_replicator_port);
 #if __GNUC__ >= 8
   auto io_thread_pool = std::make_shared<folly::IOThreadPoolExecutor>(
-    0, std::make_shared<folly::NamedThreadFactory>("rptor-svr-io-"));
+    0, std::make_shared<common::PlacedThreadFactory>(
+      std::make_shared<folly::NamedThreadFactory>("rptor-svr-io-"),
+      placement));
 #else
   auto io_thread_pool = std::make_shared<wangle::IOThreadPoolExecutor>(
-    0, std::make_shared<wangle::NamedThreadFactory>("rptor-svr-io-"));
+    0, std::make_shared<common::PlacedThreadFactory>(
+      std::make_shared<wangle::NamedThreadFactory>("rptor-svr-io-"),
+      placement));
 #endif
   server_.setIOThreadPool(std::move(io_thread_pool));
   // TODO(bol) share io threads between server_ and client_pool_
@@ -88,6 +162,7 @@ RocksDBReplicator::RocksDBReplicator()
 RocksDBReplicator::~RocksDBReplicator() {
   db_map_.clear();
   cleaner_.stopAndWait();
+  s3_syncer_.stopAndWait();
   server_.stop();
   thread_.join();
 }
@@ -97,9 +172,31 @@ ReturnCode RocksDBReplicator::addDB(const std::string& db_name,
                                     const DBRole role,
                                     const folly::SocketAddress& upstream_addr,
                                     ReplicatedDB** replicated_db) {
+  if (role == DBRole::SLAVE && FLAGS_replicator_slave_disable_wal &&
+      ReplicatedDB::hasLostUpdates(db.get())) {
+    LOG(ERROR) << db_name << " crashed with updates not flushed, it has to "
+               << "be rebuilt";
+    return ReturnCode::UPDATES_LOST;
+  }
+
+  std::shared_ptr<MultiplexedStream> stream;
+  if (role == DBRole::SLAVE && FLAGS_replicator_multiplex_pulls) {
+    stream = getStream(upstream_addr);
+  }
+
+  folly::Executor* executor = executor_.get();
+  folly::Executor* read_executor = executor_.get();
+  if (sharded_executor_) {
+    executor = sharded_executor_->getExecutor(db_name,
+                                              detail::ExecutorLane::APPLY);
+    read_executor = sharded_executor_->getExecutor(db_name,
+                                                   detail::ExecutorLane::READ);
+  }
+
   std::shared_ptr<ReplicatedDB> new_db(
-    new ReplicatedDB(db_name, std::move(db), executor_.get(),
-                     role, upstream_addr, &client_pool_));
+    new ReplicatedDB(db_name, std::move(db), executor,
+                     role, upstream_addr, &client_pool_, std::move(stream),
+                     replica_id_, read_executor));
 
   if (!db_map_.add(db_name, new_db)) {
     return ReturnCode::DB_PRE_EXIST;
@@ -110,14 +207,104 @@ ReturnCode RocksDBReplicator::addDB(const std::string& db_name,
   }
 
   if (role == DBRole::SLAVE) {
-    new_db->pullFromUpstream();
+    {
+      std::lock_guard<std::mutex> g(wal_purged_handler_mutex_);
+      new_db->wal_purged_handler_ = wal_purged_handler_;
+    }
+    new_db->startPulling();
+  }
+
+  registerGauges(db_name, new_db);
+  cleaner_.addDB(new_db);
+
+  return ReturnCode::OK;
+}
+
+ReturnCode RocksDBReplicator::addS3ReplicaDB(
+    const std::string& db_name,
+    std::shared_ptr<rocksdb::DB> db,
+    std::shared_ptr<common::S3Util> s3_util,
+    const std::string& s3_prefix,
+    ReplicatedDB** replicated_db) {
+  folly::Executor* executor = executor_.get();
+  folly::Executor* read_executor = executor_.get();
+  if (sharded_executor_) {
+    executor = sharded_executor_->getExecutor(db_name,
+                                              detail::ExecutorLane::APPLY);
+    read_executor = sharded_executor_->getExecutor(db_name,
+                                                   detail::ExecutorLane::READ);
+  }
+
+  // No upstream host to pull from
+  std::shared_ptr<ReplicatedDB> new_db(
+    new ReplicatedDB(db_name, std::move(db), executor, DBRole::SLAVE,
+                     folly::SocketAddress(), nullptr, nullptr, replica_id_,
+                     read_executor));
+
+  if (!db_map_.add(db_name, new_db)) {
+    return ReturnCode::DB_PRE_EXIST;
+  }
+
+  if (replicated_db) {
+    *replicated_db = new_db.get();
   }
 
+  {
+    std::lock_guard<std::mutex> g(wal_purged_handler_mutex_);
+    new_db->wal_purged_handler_ = wal_purged_handler_;
+  }
+
+  registerGauges(db_name, new_db);
   cleaner_.addDB(new_db);
+  // db_name was not in db_map_, so it can't be in s3_syncer_ either
+  s3_syncer_.addDB(db_name, new_db, std::move(s3_util), s3_prefix,
+                   false /* ship */);
+
+  return ReturnCode::OK;
+}
+
+ReturnCode RocksDBReplicator::shipWALToS3(
+    const std::string& db_name,
+    std::shared_ptr<common::S3Util> s3_util,
+    const std::string& s3_prefix) {
+  std::shared_ptr<ReplicatedDB> db;
+  if (!db_map_.get(db_name, &db)) {
+    return ReturnCode::DB_NOT_FOUND;
+  }
+
+  if (!s3_syncer_.addDB(db_name, db, std::move(s3_util), s3_prefix,
+                        true /* ship */)) {
+    return ReturnCode::DB_PRE_EXIST;
+  }
 
   return ReturnCode::OK;
 }
 
+void RocksDBReplicator::registerGauges(
+    const std::string& db_name,
+    const std::shared_ptr<ReplicatedDB>& db) {
+  std::weak_ptr<ReplicatedDB> weak_db = db;
+  if (db->role_ == DBRole::SLAVE) {
+    registerGauge(kReplicatorSeqNoLag, db_name, [weak_db] {
+        auto db = weak_db.lock();
+        return db ? db->seqNoLag() : 0;
+      });
+    registerGauge(kReplicatorMsSinceLastApply, db_name, [weak_db] {
+        auto db = weak_db.lock();
+        return db ? db->msSinceLastApply() : 0;
+      });
+  }
+
+  registerGauge(kReplicatorRetainedWALBytes, db_name, [weak_db] {
+      auto db = weak_db.lock();
+      return db ? db->retainedWALBytes() : 0;
+    });
+  registerGauge(kReplicatorCachedIters, db_name, [weak_db] {
+      auto db = weak_db.lock();
+      return db ? db->numCachedIters() : 0;
+    });
+}
+
 ReturnCode RocksDBReplicator::removeDB(const std::string& db_name) {
   std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
   auto exist = db_map_.remove(db_name, &db);
@@ -156,6 +343,126 @@ ReturnCode RocksDBReplicator::write(const std::string& db_name,
   }
 }
 
+void RocksDBReplicator::setWALPurgedHandler(WALPurgedHandler handler) {
+  std::lock_guard<std::mutex> g(wal_purged_handler_mutex_);
+  wal_purged_handler_ = std::move(handler);
+}
+
+bool RocksDBReplicator::fetchCheckpoint(
+    const std::string& db_name,
+    const folly::SocketAddress& upstream_addr,
+    const std::string& local_dir,
+    std::string* err_msg,
+    const uint64_t limit_bytes_per_sec,
+    const std::function<void(uint64_t)>& on_bytes) {
+  auto env = rocksdb::Env::Default();
+  if (env->FileExists(local_dir).ok()) {
+    *err_msg = local_dir + " already exists";
+    return false;
+  }
+
+  apache::thrift::RpcOptions options;
+  options.setTimeout(
+    std::chrono::milliseconds(FLAGS_replicator_checkpoint_rpc_timeout_ms));
+
+  try {
+    auto client = client_pool_.getClient(upstream_addr);
+    CheckpointRequest checkpoint_req;
+    checkpoint_req.db_name = db_name;
+    auto checkpoint =
+      client->future_createCheckpoint(options, checkpoint_req).get();
+
+    auto status = env->CreateDir(local_dir);
+    if (!status.ok()) {
+      *err_msg = status.ToString();
+      return false;
+    }
+
+    const rocksdb::EnvOptions env_options;
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t fetched_bytes = 0;
+    for (const auto& file : checkpoint.files) {
+      std::unique_ptr<rocksdb::WritableFile> local_file;
+      status = env->NewWritableFile(local_dir + "/" + file.name, &local_file,
+                                    env_options);
+      if (!status.ok()) {
+        *err_msg = status.ToString();
+        return false;
+      }
+
+      ReadCheckpointFileRequest read_req;
+      read_req.db_name = db_name;
+      read_req.checkpoint_id = checkpoint.checkpoint_id;
+      read_req.file_name = file.name;
+      read_req.offset = 0;
+      while (true) {
+        auto chunk = client->future_readCheckpointFile(options, read_req).get();
+        for (auto range : chunk.data) {
+          status = local_file->Append(rocksdb::Slice(
+            reinterpret_cast<const char*>(range.data()), range.size()));
+          if (!status.ok()) {
+            *err_msg = status.ToString();
+            return false;
+          }
+          read_req.offset += range.size();
+          fetched_bytes += range.size();
+          if (on_bytes) {
+            on_bytes(range.size());
+          }
+        }
+
+        if (chunk.eof) {
+          break;
+        }
+
+        if (limit_bytes_per_sec > 0) {
+          // Wait until the bytes so far are within the limit
+          std::this_thread::sleep_until(
+            start + std::chrono::microseconds(static_cast<int64_t>(
+              fetched_bytes * 1e6 / limit_bytes_per_sec)));
+        }
+      }
+
+      status = local_file->Sync();
+      if (status.ok()) {
+        status = local_file->Close();
+      }
+      if (!status.ok()) {
+        *err_msg = status.ToString();
+        return false;
+      }
+
+      if (read_req.offset != file.size) {
+        *err_msg = "Got " + std::to_string(read_req.offset) + " bytes of " +
+          file.name + ", expecting " + std::to_string(file.size);
+        return false;
+      }
+    }
+  } catch (const ReplicateException& ex) {
+    *err_msg = ex.msg;
+    return false;
+  } catch (const std::exception& ex) {
+    *err_msg = ex.what();
+    return false;
+  }
+
+  LOG(INFO) << "Fetched a checkpoint of " << db_name << " from "
+            << upstream_addr.describe() << " to " << local_dir;
+  return true;
+}
+
+std::shared_ptr<RocksDBReplicator::MultiplexedStream>
+RocksDBReplicator::getStream(const folly::SocketAddress& upstream_addr) {
+  std::lock_guard<std::mutex> g(streams_mutex_);
+  auto& stream = streams_[upstream_addr.describe()];
+  if (stream == nullptr) {
+    stream = std::make_shared<MultiplexedStream>(upstream_addr, executor_.get(),
+                                                 &client_pool_);
+  }
+
+  return stream;
+}
+
 std::string RocksDBReplicator::getTextStats() {
   // TODO(bol) add stats
   return "TBD";
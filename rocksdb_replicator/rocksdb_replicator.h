@@ -20,23 +20,38 @@
 
 #include <folly/io/async/EventBase.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "common/concurrent_rate_limiter.h"
 #include "common/thrift_client_pool.h"
 #include "rocksdb_replicator/fast_read_map.h"
 #include "rocksdb_replicator/max_number_box.h"
 #include "rocksdb_replicator/non_blocking_condition_variable.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#include "rocksdb_replicator/sharded_executor.h"
+#include "rocksdb_replicator/write_batch_pool.h"
 #include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
 #include "folly/SocketAddress.h"
+#include "folly/io/IOBuf.h"
 #include "rocksdb/db.h"
 #include "thrift/lib/cpp2/server/ThriftServer.h"
 
+namespace common {
+  class S3Util;
+}
+
 namespace folly {
   class Executor;
 }
@@ -61,6 +76,37 @@ struct LogExtractor : public rocksdb::WriteBatch::Handler {
     memcpy(&ms, blob.data(), sizeof(ms));
   }
 
+  /*
+   * Extract the update time appended by ReplicatedDB::Write() to batch. It is
+   * the last record of batch, so we read it in place if the tail of the rep
+   * looks like a LogData record of the right size, and only walk all records
+   * with Iterate() otherwise. Return false if it can't be extracted.
+   */
+  static bool ExtractTimestamp(const rocksdb::WriteBatch& batch,
+                               uint64_t* ms) {
+    // tag (kTypeLogData) + varint32 length + data
+    static const char kLogDataTag = 0x3;
+    static const size_t kLogDataRecordSize = 2 + sizeof(uint64_t);
+    static const size_t kHeaderSize = 12;
+    const auto& rep = batch.Data();
+    if (rep.size() >= kHeaderSize + kLogDataRecordSize) {
+      const char* record = rep.data() + rep.size() - kLogDataRecordSize;
+      if (record[0] == kLogDataTag && record[1] == sizeof(uint64_t)) {
+        memcpy(ms, record + 2, sizeof(uint64_t));
+        return true;
+      }
+    }
+
+    LogExtractor extractor;
+    extractor.ms = 0;
+    if (!batch.Iterate(&extractor).ok()) {
+      return false;
+    }
+
+    *ms = extractor.ms;
+    return true;
+  }
+
   uint64_t ms;
 };
 
@@ -77,13 +123,25 @@ enum class ReturnCode {
   WRITE_TO_SLAVE = 3,
   WRITE_ERROR = 4,
   WAIT_SLAVE_TIMEOUT = 5,
+  WAIT_SEQ_NO_TIMEOUT = 6,
+  UPDATES_LOST = 7,
 };
 
 /*
  * All public interfaces of RocksDBReplicator are thread safe.
  */
 class RocksDBReplicator {
+ private:
+  class MultiplexedStream;
+
  public:
+  /*
+   * Called with the name and upstream of a SLAVE db, once the upstream has
+   * purged the WAL the db needs to catch up.
+   */
+  using WALPurgedHandler = std::function<
+    void(const std::string& db_name, const folly::SocketAddress& upstream_addr)>;
+
   class ReplicatedDB : public std::enable_shared_from_this<ReplicatedDB> {
    public:
     // Similar to rocksdb::DB::Write(). Only two differences:
@@ -91,7 +149,7 @@ class RocksDBReplicator {
     // updates. This is useful to implement read-after-write consistency at
     // higher level.
     // 2) WRITE_TO_SLAVE will be thrown if this is a SLAVE db.
-    // 3) WAIT_SLAVE_TIMEOUT will be thrown if replication mode 1 and 2 is
+    // 3) WAIT_SLAVE_TIMEOUT will be thrown if replication mode 1, 2 and 3 is
     // enabled, and no slave gets back to us in time. In this case, the update
     // is guaranteed to be committed to Master. Slaves may or may not have got
     // the update.
@@ -99,8 +157,78 @@ class RocksDBReplicator {
                           rocksdb::WriteBatch* updates,
                           rocksdb::SequenceNumber* seq_no = nullptr);
 
-    // read APIs may be added later on demand. They can be simply implmented by
-    // delegating to the internal rocksdb::DB object.
+    // Same as Write(), except that it doesn't block the calling thread while
+    // waiting for Slaves in replication mode 1, 2 and 3. The returned future is
+    // fulfilled with the sequence # after applying the updates, or fails with
+    // WRITE_TO_SLAVE, WRITE_ERROR or WAIT_SLAVE_TIMEOUT.
+    // The future may be fulfilled from a replicator thread or a timer thread,
+    // so callers should add their continuations via() their own executors if
+    // they are not lightweight.
+    folly::Future<rocksdb::SequenceNumber> WriteAsync(
+      const rocksdb::WriteOptions& options,
+      rocksdb::WriteBatch* updates);
+
+    // Read APIs served by the local rocksdb::DB. They are similar to their
+    // rocksdb::DB counterparts, except for min_seq_no. If it is > 0, the read
+    // waits until this db has applied the update with sequence # min_seq_no,
+    // e.g., as returned by Write() on the Master, so that clients can read
+    // their writes from Slaves. The wait doesn't block the calling thread, and
+    // fails the future with WAIT_SEQ_NO_TIMEOUT after
+    // --replicator_read_wait_timeout_ms, or DB_NOT_FOUND if the db is removed.
+    // As with WriteAsync(), the future may be fulfilled from a replicator
+    // thread.
+    using GetResult = std::pair<rocksdb::Status, std::string>;
+    folly::Future<GetResult> Get(const rocksdb::ReadOptions& options,
+                                 const std::string& key,
+                                 rocksdb::SequenceNumber min_seq_no = 0);
+
+    using MultiGetResult =
+      std::pair<std::vector<rocksdb::Status>, std::vector<std::string>>;
+    folly::Future<MultiGetResult> MultiGet(
+      const rocksdb::ReadOptions& options,
+      const std::vector<std::string>& keys,
+      rocksdb::SequenceNumber min_seq_no = 0);
+
+    // The iterator must be destroyed before *this
+    folly::Future<std::unique_ptr<rocksdb::Iterator>> NewIterator(
+      const rocksdb::ReadOptions& options,
+      rocksdb::SequenceNumber min_seq_no = 0);
+
+    // Replication lag of a SLAVE db. seqNoLag() is how many updates it is
+    // behind its upstream, as of the last response from the upstream.
+    // msSinceLastApply() is the time since it last applied updates or found
+    // itself caught up, which keeps growing for a stuck Slave even when no
+    // updates arrive. For an idle Slave, it stays below
+    // --replicator_max_idle_server_wait_time_ms. Both are 0 for other roles.
+    uint64_t seqNoLag() const;
+    uint64_t msSinceLastApply() const;
+
+    // Bytes of WAL files kept for Slaves to catch up from, as of the last
+    // time purgeAckedWAL() ran.
+    uint64_t retainedWALBytes() const;
+
+    // # of iters cached for serving Slaves
+    uint64_t numCachedIters();
+
+    // Called with each batch of updates a SLAVE db applies from its upstream,
+    // after writing it, e.g. to invalidate caches in front of the db. It is
+    // called from a replicator thread, so it should return quickly.
+    using AppliedUpdatesHandler =
+      std::function<void(const rocksdb::WriteBatch& updates)>;
+    void setAppliedUpdatesHandler(AppliedUpdatesHandler handler);
+
+    // Called before a SLAVE db applies a batch of updates from its upstream,
+    // e.g. to get the db ready for writes. Same threading as above.
+    using ApplyingUpdatesHandler = std::function<void()>;
+    void setApplyingUpdatesHandler(ApplyingUpdatesHandler handler);
+
+    // Make a SLAVE db a partial replica, which only pulls the keys with one of
+    // key_prefixes from its upstream (all keys if empty), from its next pull
+    // on. The other updates still take sequence #s on it, as Deletes of the
+    // empty key.
+    void setReplicationKeyPrefixes(std::vector<std::string> key_prefixes);
+
+    ~ReplicatedDB();
 
    private:
     ReplicatedDB(const std::string& db_name,
@@ -110,38 +238,324 @@ class RocksDBReplicator {
                  const folly::SocketAddress& upstream_addr
                  = folly::SocketAddress(),
                  common::ThriftClientPool<ReplicatorAsyncClient>* client_pool
-                 = nullptr);
-
+                 = nullptr,
+                 std::shared_ptr<MultiplexedStream> stream = nullptr,
+                 const std::string& replica_id = std::string(),
+                 folly::Executor* read_executor = nullptr);
+
+    // Send the initial pull request(s) of a SLAVE db
+    void startPulling();
+    // Send the next pull request, either on its own, or through stream_ if
+    // set.
     void pullFromUpstream();
+    void pullFromUpstreamAfterDelay(int n_pulls = 1);
+    // Apply updates to db_ and notify Slaves waiting for them
+    rocksdb::Status writeLocally(const rocksdb::WriteOptions& options,
+                                 rocksdb::WriteBatch* updates,
+                                 rocksdb::SequenceNumber* seq_no);
+    // A write queued for group commit by writeLocally()
+    struct PendingWrite {
+      const rocksdb::WriteOptions* options;
+      rocksdb::WriteBatch* updates;
+      rocksdb::Status status;
+      // the seq # of the last update in updates
+      rocksdb::SequenceNumber seq_no;
+      bool done;
+    };
+    // Write the updates of group to db_ as one batch, and fill the status and
+    // seq_no of each of them.
+    void commitWriteGroup(const std::vector<PendingWrite*>& group);
+    // Whether writes need to wait for Slaves per the replication mode
+    bool waitForSlaves();
+    // Whether a Slave has reported a write stall within the last
+    // --replicator_timeout_ms
+    bool isSlaveStalled() const;
+    // Delay a write of a Master waiting for its Slaves while one of them is
+    // stalled, per --replicator_slave_stall_write_delay_ms
+    void throttleWriteIfSlaveStalled();
+    // Delay a write of a Master while its slowest in sync Slave lags behind
+    // by more than --replicator_flow_control_lag_seq_nos
+    void throttleWriteIfSlaveLagging();
+    // Run read() once this db has applied min_seq_no
+    template <typename T, typename F>
+    folly::Future<T> readAfter(rocksdb::SequenceNumber min_seq_no, F read);
+    void handlePullError(uint64_t generation, bool pushed);
+    // Queue the updates in response for applying, and send the next pull
+    // request if the pipeline has room for it.
+    void handleReplicateResponse(ReplicateResponse response,
+                                 rocksdb::SequenceNumber requested_seq_no,
+                                 uint64_t generation,
+                                 bool pushed);
+    // Apply queued updates in order until the queue is empty. At most one
+    // thread runs this at any time.
+    void applyPendingBatches();
+    // Retry applying after a write stall, once
+    // --replicator_slave_stall_retry_ms has passed
+    void applyPendingBatchesAfterDelay();
+    // Start flushing the memtables of a SLAVE db applying without WAL
+    void flushMemtables(uint64_t now_ms);
+    // Whether a SLAVE db to apply without WAL may have lost updates in a
+    // crash, so that its seq #s no longer match its upstream's
+    static bool hasLostUpdates(rocksdb::DB* db);
+    // Move as many deferred pulls as the pipeline has room for to in flight,
+    // and return how many of them to send.
+    int takeDeferredPullsLocked();
+    // Drop the current push stream, and start a new one, or fall back to
+    // pull. Return the # of pull requests to send.
+    int resetPushStreamLocked(bool fall_back);
     using CallbackType =
       apache::thrift::HandlerCallback<std::unique_ptr<ReplicateResponse>>;
     void handleReplicateRequest(std::unique_ptr<CallbackType> callback,
                                 std::unique_ptr<ReplicateRequest> request);
+    // Park request until there are updates after the stream's cursor, or
+    // deadline_ms is reached.
+    void handlePushRequest(std::unique_ptr<CallbackType> callback,
+                           std::unique_ptr<ReplicateRequest> request,
+                           uint64_t deadline_ms);
+    // Send response once admitResponse() allows it, or an empty response at
+    // deadline_ms.
+    void sendThrottledResponse(std::unique_ptr<CallbackType> callback,
+                               ReplicateResponse response,
+                               rocksdb::SequenceNumber last_seq_no,
+                               uint64_t deadline_ms);
+    // Whether response can be sent now under the per db and per host
+    // bandwidth limits. Responses to Slaves close to the tail are always
+    // allowed, and don't take any bandwidth from the Slaves catching up.
+    bool admitResponse(const ReplicateResponse& response);
+    // Same as readUpdates(), but starting from and advancing the cursor of
+    // request.stream_id.
+    rocksdb::Status readPushedUpdates(const ReplicateRequest& request,
+                                      ReplicateResponse* response,
+                                      rocksdb::SequenceNumber* last_seq_no);
+    rocksdb::SequenceNumber getPushCursor(
+      int64_t stream_id, rocksdb::SequenceNumber default_seq_no);
+    // Take the cached iter closest to and at or below seq_no, and set
+    // iter_seq_no to where it is.
     std::unique_ptr<rocksdb::TransactionLogIterator> getCachedIter(
-        rocksdb::SequenceNumber seq_no);
+        rocksdb::SequenceNumber seq_no,
+        rocksdb::SequenceNumber* iter_seq_no);
+    // Cache iter, sitting at seq_no, in the host wide LRU of iters, see
+    // detail::CachedIters.
     void putCachedIter(rocksdb::SequenceNumber seq_no,
                        std::unique_ptr<rocksdb::TransactionLogIterator>);
+    // Read updates after request.seq_no into response, and set last_seq_no
+    // to the seq # of the last update read.
+    rocksdb::Status readUpdates(const ReplicateRequest& request,
+                                ReplicateResponse* response,
+                                rocksdb::SequenceNumber* last_seq_no);
+    // Keep a copy of updates, which has just been committed with timestamp ms,
+    // in tail_cache_.
+    void addToTailCache(const rocksdb::WriteOptions& options,
+                        const rocksdb::WriteBatch& updates,
+                        uint64_t ms);
+    // Same as readUpdates(), but from tail_cache_. Return false if the updates
+    // after request.seq_no are not in tail_cache_.
+    bool readTailCache(const ReplicateRequest& request,
+                       ReplicateResponse* response,
+                       rocksdb::SequenceNumber* last_seq_no);
+    // Called when a Slave asks for updates, which tells how far it has
+    // committed.
+    void recordSlaveProgress(const ReplicateRequest& request);
+    // Recompute in_sync_min_ack_seq_no_ from wal_acks_. Requires
+    // wal_acks_mutex_.
+    void updateInSyncMinAckLocked(rocksdb::SequenceNumber latest_seq_no,
+                                  uint64_t now_ms);
+    // Called once updates up to seq_no have been sent to a Slave.
+    void recordSentSeqNo(rocksdb::SequenceNumber seq_no);
+    // Whether the WAL starting from seq_no is no longer available
+    bool isWALPurged(rocksdb::SequenceNumber seq_no);
+    // The error code to reply to Slaves for a failed readUpdates()
+    static ErrorCode readErrorCode(const rocksdb::Status& status);
+    // Called when upstream tells us it has purged the WAL we need
+    void onUpstreamWALPurged();
+    // Create a checkpoint for a Slave to copy with readCheckpointFile()
+    rocksdb::Status createCheckpoint(CheckpointResponse* response);
+    rocksdb::Status readCheckpointFile(const ReadCheckpointFileRequest& request,
+                                       ReadCheckpointFileResponse* response);
+    // Record that Slave replica_id has committed up to seq_no, and post the
+    // largest seq # committed by at least --replicator_quorum_size Slaves.
+    void recordQuorumProgress(const std::string& replica_id,
+                              rocksdb::SequenceNumber seq_no);
     void cleanIdleCachedIters();
+    // WAL segments in S3 are named <prefix>/<db name>/<first seq #>-<last
+    // seq #>, with the seq #s zero padded so that segments are listed in
+    // order. WALSegmentDir() returns <prefix>/<db name>/.
+    static std::string WALSegmentDir(const std::string& s3_prefix,
+                                     const std::string& db_name);
+    static std::string WALSegmentKey(const std::string& dir,
+                                     rocksdb::SequenceNumber first_seq_no,
+                                     rocksdb::SequenceNumber last_seq_no);
+    // Return false if key is not the key of a segment
+    static bool ParseWALSegmentKey(const std::string& key,
+                                   rocksdb::SequenceNumber* first_seq_no,
+                                   rocksdb::SequenceNumber* last_seq_no);
+    // Upload the updates after the last segment under s3_prefix as new WAL
+    // segments, and keep the WAL until they are uploaded.
+    rocksdb::Status shipWALToS3(common::S3Util* s3_util,
+                                const std::string& s3_prefix);
+    // Apply the WAL segments under s3_prefix after the latest seq # of db_
+    rocksdb::Status applyWALFromS3(common::S3Util* s3_util,
+                                   const std::string& s3_prefix);
+    // Set seq_no to the smallest seq # committed by the Slaves we know, and
+    // return false if there is none, or a Slave not telling who it is.
+    bool minWALAck(rocksdb::SequenceNumber* seq_no);
+    // Delete the archived WAL files all Slaves have committed, if
+    // --replicator_wal_retention_by_progress, and update retained_wal_bytes_.
+    void purgeAckedWAL();
+    // Adapt the byte budget of the next pull request to how long it took to
+    // apply the last response.
+    void adjustMaxBytesPerRequest(uint64_t apply_ms, uint64_t applied_bytes);
+    // Adapt how long the next pull request asks the upstream to wait for
+    // updates to whether the last response had any.
+    void adjustServerWait(bool got_updates);
 
     const std::string db_name_;
     std::shared_ptr<rocksdb::DB> db_;
+    // runs pull responses
     folly::Executor* const executor_;
     const DBRole role_;
     const folly::SocketAddress upstream_addr_;
     common::ThriftClientPool<ReplicatorAsyncClient>* const client_pool_;
     std::shared_ptr<ReplicatorAsyncClient> client_;
+    const std::shared_ptr<MultiplexedStream> stream_;
+    // Sent to upstream to identify ourselves
+    const std::string replica_id_;
+    // Compression we ask upstream to use
+    const CompressionType compression_;
     detail::NonBlockingConditionVariable cond_var_;
     apache::thrift::RpcOptions rpc_options_;
     rocksdb::WriteOptions write_options_;
-    std::unordered_multimap<rocksdb::SequenceNumber,
-      std::pair<std::unique_ptr<rocksdb::TransactionLogIterator>,
-                uint64_t>> cached_iters_;
-    std::mutex cached_iters_mutex_;
+    // When a SLAVE db without WAL last flushed, only accessed by the thread
+    // applying updates
+    uint64_t last_flush_ms_;
     detail::MaxNumberBox max_seq_no_acked_;
+    // the latest seq # written to db_, for reads waiting for their min_seq_no
+    detail::MaxNumberBox applied_seq_no_;
+    // The upstream's latest seq # and when we last applied updates or were
+    // caught up with it, for the lag gauges of a SLAVE db
+    std::atomic<uint64_t> upstream_latest_seq_no_;
+    std::atomic<uint64_t> last_apply_ms_;
+    std::atomic<int64_t> max_bytes_per_request_;
+    // Sent to upstream with each pull request of a SLAVE db. The apply rate is
+    // measured over windows of the bytes applied since apply_window_start_ms_,
+    // which are only accessed by the thread applying updates.
+    std::atomic<bool> write_stalled_;
+    std::atomic<int64_t> apply_bytes_per_sec_;
+    uint64_t apply_window_start_ms_;
+    uint64_t apply_window_bytes_;
+    // When one of our Slaves last reported a write stall
+    std::atomic<uint64_t> last_slave_stall_ms_;
+    // max_wait_ms of the next pull request
+    std::atomic<int32_t> server_wait_ms_;
+    // Group commit state. At most one writer at a time is the leader, which
+    // commits a group of pending_writes_ on behalf of the others.
+    std::mutex write_group_mutex_;
+    std::condition_variable write_group_cv_;
+    std::deque<PendingWrite*> pending_writes_;
+    bool write_group_leader_;
+    // in KB, only set if --replicator_db_max_out_bytes_per_sec > 0
+    std::unique_ptr<common::ConcurrentRateLimiter> out_rate_limiter_;
+
+    // State of the pull pipeline of a SLAVE db, protected by pipeline_mutex_.
+    // Each element of pending_batches_ holds the updates of one response.
+    std::mutex pipeline_mutex_;
+    std::deque<std::vector<WriteBatchPool::Handle>> pending_batches_;
+    // Pushed responses received ahead of the ones they follow.
+    // start seq # -> (end seq #, updates)
+    std::map<rocksdb::SequenceNumber,
+      std::pair<rocksdb::SequenceNumber,
+                std::vector<WriteBatchPool::Handle>>> reordered_batches_;
+    // # of responses received but not applied yet
+    int32_t unapplied_responses_;
+    // # of pull requests sent and not replied yet
+    int32_t in_flight_pulls_;
+    // # of pull requests waiting for room in the pipeline
+    int32_t deferred_pulls_;
+    // Where the next pull starts from, 0 means the latest seq # in db_
+    rocksdb::SequenceNumber next_pull_seq_no_;
+    // Bumped whenever received updates are dropped, so responses to requests
+    // sent before that are ignored
+    uint64_t pipeline_generation_;
+    bool applying_;
+    // Non-zero if we ask upstream to push updates to us
+    int64_t push_stream_id_;
+    const int32_t pipeline_depth_;
+    const int32_t push_credits_;
+
+    // stream id -> (last seq # pushed, last used time in ms), for the push
+    // streams of our Slaves
+    std::unordered_map<int64_t,
+      std::pair<rocksdb::SequenceNumber, uint64_t>> push_cursors_;
+    std::mutex push_cursors_mutex_;
+
+    // replica id -> (largest seq # committed, last seen time in ms), for our
+    // Slaves and the replicas downstream of them in replication mode 3
+    std::unordered_map<std::string,
+      std::pair<rocksdb::SequenceNumber, uint64_t>> slave_progress_;
+    std::mutex slave_progress_mutex_;
+
+    // replica id -> (largest seq # committed, last seen time in ms), for the
+    // Slaves pulling from us, which decide how much WAL we keep
+    std::unordered_map<std::string,
+      std::pair<rocksdb::SequenceNumber, uint64_t>> wal_acks_;
+    std::mutex wal_acks_mutex_;
+    // When a Slave without replica id last pulled from us
+    std::atomic<uint64_t> last_anonymous_slave_ms_;
+    // The smallest seq # committed by the Slaves in sync with us, and when it
+    // was last updated, for write flow control
+    std::atomic<uint64_t> in_sync_min_ack_seq_no_;
+    std::atomic<uint64_t> in_sync_min_ack_ms_;
+    std::atomic<uint64_t> retained_wal_bytes_;
+
+    // Recently committed batches, so that Slaves close to the tail don't have
+    // to read them from the WAL.
+    struct TailCacheEntry {
+      folly::IOBuf raw_data;
+      uint64_t timestamp;
+      uint32_t count;
+    };
+    // seq # of the first update in the batch -> batch
+    std::map<rocksdb::SequenceNumber, TailCacheEntry> tail_cache_;
+    int64_t tail_cache_bytes_;
+    std::mutex tail_cache_mutex_;
+
+    // checkpoint id -> (dir, last used time in ms), for Slaves copying them
+    std::unordered_map<int64_t, std::pair<std::string, uint64_t>> checkpoints_;
+    std::mutex checkpoints_mutex_;
+
+    // Set before we start pulling
+    WALPurgedHandler wal_purged_handler_;
+    // Handlers are only called once per db
+    std::atomic<bool> wal_purged_reported_;
+    // Accessed with std::atomic_load() and std::atomic_store()
+    std::shared_ptr<AppliedUpdatesHandler> applied_updates_handler_;
+    // Accessed with std::atomic_load() and std::atomic_store()
+    std::shared_ptr<ApplyingUpdatesHandler> applying_updates_handler_;
+    // Accessed with std::atomic_load() and std::atomic_store(), nullptr for
+    // all keys
+    std::shared_ptr<const std::vector<std::string>> key_prefixes_;
+
+    // Only accessed by the S3WALSyncer thread. The last seq # shipped to S3,
+    // once found, and the key of the last WAL segment applied from S3.
+    rocksdb::SequenceNumber s3_shipped_seq_no_;
+    bool s3_shipped_seq_no_known_;
+    std::string s3_last_applied_key_;
+
+    // The per db counters of the hot paths
+    const DBCounter write_bytes_counter_;
+    const DBCounter in_bytes_counter_;
+    const DBCounter out_bytes_counter_;
+    const DBCounter cached_iter_hits_counter_;
+    const DBCounter cached_iter_misses_counter_;
+    const DBCounter cached_iter_skips_counter_;
+    const DBCounter tail_cache_hits_counter_;
+    const DBCounter tail_cache_misses_counter_;
 
     friend class ReplicatorHandler;
     friend class RocksDBReplicator;
     friend class CachedIterCleaner;
+    friend class S3WALSyncer;
+    friend class MultiplexedStream;
   };
 
   static RocksDBReplicator* instance() {
@@ -158,6 +572,10 @@ class RocksDBReplicator {
    * valid until the subsequent call of removeDB with db_name.
    * If role is SLAVE, upstream_addr is where the library should pull updates
    * from for this db.
+   * With --replicator_slave_disable_wal, a SLAVE db which crashed with updates
+   * not flushed yet is refused with UPDATES_LOST. It has to be rebuilt.
+   * Such a db is flushed by removeDB(), so it has to be removed before it is
+   * added in another role, e.g., promoted to MASTER.
    */
   ReturnCode addDB(const std::string& db_name,
                    std::shared_ptr<rocksdb::DB> db,
@@ -189,6 +607,65 @@ class RocksDBReplicator {
                    rocksdb::WriteBatch* updates,
                    rocksdb::SequenceNumber* seq_no = nullptr);
 
+  /*
+   * Set the handler to call for SLAVE dbs which can't catch up from their
+   * upstreams anymore, e.g., to rebuild them with fetchCheckpoint(). Such dbs
+   * keep retrying to pull until removed. The handler is called from a
+   * replicator thread, so it should return quickly.
+   * It only applies to dbs added afterwards.
+   */
+  void setWALPurgedHandler(WALPurgedHandler handler);
+
+  /*
+   * Copy a checkpoint of db_name from its MASTER or SLAVE at upstream_addr to
+   * local_dir, which must not exist yet. local_dir can then be opened as a
+   * rocksdb::DB, and replicated as a SLAVE, picking up from where the
+   * checkpoint was created.
+   * It blocks the caller until done, so don't call it from replicator threads.
+   * If limit_bytes_per_sec > 0, the copy is throttled to that rate. on_bytes,
+   * if set, is called with the size of each chunk as it is written.
+   * Return false and set err_msg on failure.
+   */
+  bool fetchCheckpoint(const std::string& db_name,
+                       const folly::SocketAddress& upstream_addr,
+                       const std::string& local_dir,
+                       std::string* err_msg,
+                       const uint64_t limit_bytes_per_sec = 0,
+                       const std::function<void(uint64_t)>& on_bytes = nullptr);
+
+  /*
+   * Ship the WAL of db_name to S3 for disaster-recovery replicas far away,
+   * which tail it with addS3ReplicaDB() instead of pulling from this host.
+   * Every --replicator_s3_sync_interval_sec, the updates committed since the
+   * last segment are uploaded as compressed segments named
+   * <s3_prefix>/<db_name>/<first seq #>-<last seq #>. Shipping resumes after
+   * the last segment under s3_prefix, or from the latest seq # of the db if
+   * there is none, so replicas must be seeded from checkpoints created after
+   * shipping started.
+   * With --replicator_wal_retention_by_progress, the WAL is kept until it
+   * is shipped, like for a Slave. Old segments are not deleted, leave it to
+   * S3 lifecycle rules.
+   * Return DB_NOT_FOUND if the library is not managing this db, or
+   * DB_PRE_EXIST if it is already shipped or tailed.
+   */
+  ReturnCode shipWALToS3(const std::string& db_name,
+                         std::shared_ptr<common::S3Util> s3_util,
+                         const std::string& s3_prefix);
+
+  /*
+   * Add a SLAVE db replicated from the WAL segments shipped to s3_prefix by
+   * shipWALToS3(), instead of from an upstream host. They are applied every
+   * --replicator_s3_sync_interval_sec, from the latest seq # of db on. If the
+   * segments to continue from are missing, the WAL purged handler is called
+   * with an empty upstream address.
+   * Otherwise the same as addDB().
+   */
+  ReturnCode addS3ReplicaDB(const std::string& db_name,
+                            std::shared_ptr<rocksdb::DB> db,
+                            std::shared_ptr<common::S3Util> s3_util,
+                            const std::string& s3_prefix,
+                            ReplicatedDB** replicated_db = nullptr);
+
   /*
    * Get stats of the library in the same text format as the java ostrich
    * library.
@@ -214,17 +691,109 @@ class RocksDBReplicator {
     folly::EventBase evb_;
   };
 
+  /*
+   * Ships the WAL of dbs to S3, and applies the shipped WAL to S3 replicas,
+   * from a thread of its own.
+   */
+  class S3WALSyncer {
+   public:
+    S3WALSyncer();
+    // Return false if db_name is already added
+    bool addDB(const std::string& db_name,
+               std::weak_ptr<ReplicatedDB> db,
+               std::shared_ptr<common::S3Util> s3_util,
+               const std::string& s3_prefix,
+               bool ship);
+    void stopAndWait();
+
+   private:
+    struct Entry {
+      std::weak_ptr<ReplicatedDB> db;
+      std::shared_ptr<common::S3Util> s3_util;
+      std::string s3_prefix;
+      // ship the WAL of db, or apply the shipped WAL to it
+      bool ship;
+    };
+
+    void scheduleSync();
+    // db name -> entry
+    std::map<std::string, Entry> dbs_;
+    std::mutex dbs_mutex_;
+    std::thread thread_;
+    folly::EventBase evb_;
+  };
+
+  /*
+   * Coalesces pull requests of the SLAVE dbs replicating from the same
+   * upstream host into replicateMulti() calls, so that a host pair shares one
+   * long-poll instead of one per db.
+   */
+  class MultiplexedStream
+      : public std::enable_shared_from_this<MultiplexedStream> {
+   public:
+    MultiplexedStream(
+      const folly::SocketAddress& upstream_addr,
+      folly::Executor* executor,
+      common::ThriftClientPool<ReplicatorAsyncClient>* client_pool);
+
+    // Send request for db with the next replicateMulti() call.
+    void pull(std::shared_ptr<ReplicatedDB> db,
+              ReplicateRequest request,
+              uint64_t generation);
+
+   private:
+    struct PendingPull {
+      std::weak_ptr<ReplicatedDB> db;
+      ReplicateRequest request;
+      uint64_t generation;
+    };
+
+    void flush();
+    void handleResponse(std::vector<PendingPull> pulls,
+                        folly::Try<ReplicateMultiResponse>&& t);
+
+    const folly::SocketAddress upstream_addr_;
+    folly::Executor* const executor_;
+    common::ThriftClientPool<ReplicatorAsyncClient>* const client_pool_;
+    std::shared_ptr<ReplicatorAsyncClient> client_;
+    std::vector<PendingPull> pending_pulls_;
+    bool flush_scheduled_;
+    // protects client_, pending_pulls_ and flush_scheduled_
+    std::mutex mutex_;
+    apache::thrift::RpcOptions rpc_options_;
+  };
+
   RocksDBReplicator();
   ~RocksDBReplicator();
 
+  // How our SLAVE dbs identify themselves to their upstreams
+  const std::string replica_id_;
+
+  // Get or create the stream for upstream_addr
+  std::shared_ptr<MultiplexedStream> getStream(
+    const folly::SocketAddress& upstream_addr);
+
+  // Register the per db gauges of db
+  void registerGauges(const std::string& db_name,
+                      const std::shared_ptr<ReplicatedDB>& db);
+
 #if __GNUC__ >= 8
   std::unique_ptr<folly::CPUThreadPoolExecutor> executor_;
 #else
   std::unique_ptr<wangle::CPUThreadPoolExecutor> executor_;
 #endif
+  // Per db executors, only used if --replicator_executor_shards > 0
+  std::unique_ptr<detail::ShardedExecutor> sharded_executor_;
 
   common::ThriftClientPool<ReplicatorAsyncClient> client_pool_;
 
+  // upstream address -> stream, only used if --replicator_multiplex_pulls
+  std::unordered_map<std::string, std::shared_ptr<MultiplexedStream>> streams_;
+  std::mutex streams_mutex_;
+
+  WALPurgedHandler wal_purged_handler_;
+  std::mutex wal_purged_handler_mutex_;
+
   detail::FastReadMap<std::string,
     std::shared_ptr<RocksDBReplicator::ReplicatedDB>> db_map_;
 
@@ -233,6 +802,8 @@ class RocksDBReplicator {
   std::thread thread_;
 
   CachedIterCleaner cleaner_;
+
+  S3WALSyncer s3_syncer_;
 };
 
 }  // namespace replicator
@@ -0,0 +1,115 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <folly/io/async/EventBase.h>
+#if __GNUC__ >= 8
+#include "folly/system/ThreadName.h"
+#else
+#include <folly/ThreadName.h>
+#endif
+#include <gflags/gflags.h>
+
+#include <vector>
+
+#include "common/s3util.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+
+DEFINE_int32(replicator_s3_sync_interval_sec, 10,
+             "How often the WAL of dbs is shipped to S3, and S3 replicas "
+             "apply the shipped WAL");
+
+namespace replicator {
+
+RocksDBReplicator::S3WALSyncer::S3WALSyncer()
+    : dbs_(), dbs_mutex_(), thread_(), evb_() {
+  scheduleSync();
+  thread_ = std::thread([this] {
+      if (!folly::setThreadName("S3WALSyncer")) {
+        LOG(ERROR) << "Failed to setThreadName() for S3WALSyncer thread";
+      }
+
+      LOG(INFO) << "Starting S3 WAL sync thread ...";
+      this->evb_.loopForever();
+      LOG(INFO) << "Stopping S3 WAL sync thread ...";
+    });
+}
+
+void RocksDBReplicator::S3WALSyncer::scheduleSync() {
+  evb_.runAfterDelay([this] {
+        // Don't hold dbs_mutex_ while talking to S3
+        std::vector<std::pair<std::string, Entry>> entries;
+        {
+          std::lock_guard<std::mutex> g(dbs_mutex_);
+          auto itor = dbs_.begin();
+          while (itor != dbs_.end()) {
+            if (itor->second.db.expired()) {
+              itor = dbs_.erase(itor);
+              continue;
+            }
+
+            entries.emplace_back(*itor);
+            ++itor;
+          }
+        }
+
+        for (const auto& entry : entries) {
+          auto db = entry.second.db.lock();
+          if (db == nullptr) {
+            continue;
+          }
+
+          auto status = entry.second.ship ?
+            db->shipWALToS3(entry.second.s3_util.get(),
+                            entry.second.s3_prefix) :
+            db->applyWALFromS3(entry.second.s3_util.get(),
+                               entry.second.s3_prefix);
+          if (!status.ok()) {
+            LOG(ERROR) << "Failed to " << (entry.second.ship ? "ship" : "apply")
+                       << " the WAL of " << entry.first << " in S3 "
+                       << entry.second.s3_prefix << ": " << status.ToString();
+            incCounter(kReplicatorS3SyncErrors, 1, entry.first);
+          }
+        }
+        this->scheduleSync();
+  },
+  FLAGS_replicator_s3_sync_interval_sec * 1000);
+}
+
+bool RocksDBReplicator::S3WALSyncer::addDB(
+    const std::string& db_name,
+    std::weak_ptr<ReplicatedDB> db,
+    std::shared_ptr<common::S3Util> s3_util,
+    const std::string& s3_prefix,
+    bool ship) {
+  std::lock_guard<std::mutex> g(dbs_mutex_);
+  auto itor = dbs_.find(db_name);
+  if (itor != dbs_.end() && !itor->second.db.expired()) {
+    return false;
+  }
+
+  dbs_[db_name] = Entry{std::move(db), std::move(s3_util), s3_prefix, ship};
+  return true;
+}
+
+void RocksDBReplicator::S3WALSyncer::stopAndWait() {
+  evb_.terminateLoopSoon();
+  thread_.join();
+}
+
+}  // namespace replicator
@@ -0,0 +1,121 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "rocksdb_replicator/sharded_executor.h"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <utility>
+
+#include "common/tsc_clock.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#if __GNUC__ >= 8
+#include "folly/executors/thread_factory/NamedThreadFactory.h"
+#else
+#include "wangle/concurrent/NamedThreadFactory.h"
+#endif
+
+namespace {
+
+const char* LaneName(const replicator::detail::ExecutorLane lane) {
+  return lane == replicator::detail::ExecutorLane::READ ? "read" : "apply";
+}
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+ShardedExecutor::LaneExecutor::LaneExecutor(
+#if __GNUC__ >= 8
+    folly::CPUThreadPoolExecutor* pool,
+#else
+    wangle::CPUThreadPoolExecutor* pool,
+#endif
+    const ExecutorLane lane,
+    const uint32_t shard_id)
+    : pool_(pool)
+    , priority_(lane == ExecutorLane::READ ? folly::Executor::HI_PRI
+                                           : folly::Executor::LO_PRI)
+    , lane_depth_metric_(kReplicatorExecutorQueueDepth + " lane=" +
+                         LaneName(lane))
+    , shard_depth_metric_(lane_depth_metric_ + " shard=" +
+                          std::to_string(shard_id))
+    , lane_wait_metric_(kReplicatorExecutorWaitUs + " lane=" + LaneName(lane))
+    , shard_wait_metric_(lane_wait_metric_ + " shard=" +
+                         std::to_string(shard_id))
+    , queue_depth_(0) {
+}
+
+void ShardedExecutor::LaneExecutor::add(folly::Func func) {
+  const auto depth = ++queue_depth_;
+  logMetric(lane_depth_metric_, depth);
+  logMetric(shard_depth_metric_, depth);
+
+  const auto enqueue_time = common::TscClock::Now();
+  pool_->addWithPriority(
+    [this, func = std::move(func), enqueue_time] () mutable {
+      --queue_depth_;
+      const auto wait_us = common::TscClock::ElapsedNs(enqueue_time) / 1000;
+      logMetric(lane_wait_metric_, wait_us);
+      logMetric(shard_wait_metric_, wait_us);
+
+      func();
+    },
+    priority_);
+}
+
+ShardedExecutor::ShardedExecutor(
+    const uint32_t n_shards,
+    const uint32_t n_threads_per_shard,
+    std::shared_ptr<common::ThreadPlacement> placement)
+    : shards_(std::max<uint32_t>(n_shards, 1)) {
+  for (uint32_t i = 0; i < shards_.size(); ++i) {
+    auto& shard = shards_[i];
+    const auto thread_name_prefix = "rptor-shard" + std::to_string(i) + "-";
+#if __GNUC__ >= 8
+    shard.pool = std::make_unique<folly::CPUThreadPoolExecutor>(
+      std::max<uint32_t>(n_threads_per_shard, 1), 2 /* numPriorities */,
+      std::make_shared<common::PlacedThreadFactory>(
+        std::make_shared<folly::NamedThreadFactory>(thread_name_prefix),
+        placement));
+#else
+    shard.pool = std::make_unique<wangle::CPUThreadPoolExecutor>(
+      std::max<uint32_t>(n_threads_per_shard, 1), 2 /* numPriorities */,
+      std::make_shared<common::PlacedThreadFactory>(
+        std::make_shared<wangle::NamedThreadFactory>(thread_name_prefix),
+        placement));
+#endif
+    shard.apply_lane = std::make_unique<LaneExecutor>(
+      shard.pool.get(), ExecutorLane::APPLY, i);
+    shard.read_lane = std::make_unique<LaneExecutor>(
+      shard.pool.get(), ExecutorLane::READ, i);
+  }
+}
+
+folly::Executor* ShardedExecutor::getExecutor(const std::string& db_name,
+                                              const ExecutorLane lane) {
+  auto& shard = shards_[std::hash<std::string>()(db_name) % shards_.size()];
+  if (lane == ExecutorLane::READ) {
+    return shard.read_lane.get();
+  }
+
+  return shard.apply_lane.get();
+}
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,110 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/thread_placement.h"
+#include "folly/Executor.h"
+#if __GNUC__ >= 8
+#include "folly/executors/CPUThreadPoolExecutor.h"
+#else
+#include "wangle/concurrent/CPUThreadPoolExecutor.h"
+#endif
+
+namespace replicator { namespace detail {
+
+enum class ExecutorLane {
+  // Applying updates pulled by SLAVE dbs
+  APPLY = 0,
+  // Serving replicate() calls from downstream hosts. These are short, and a
+  // whole chain of downstream hosts waits for them, so they run before
+  // queued APPLY tasks.
+  READ = 1,
+};
+
+/*
+ * A set of executors, each with its own threads, to which dbs are pinned by
+ * name. A hot db can only keep busy the threads of its own shard, and the
+ * tasks of a db stay on the same few cores.
+ * Each shard has an APPLY and a READ lane, whose queue depths and wait times
+ * are exported as stats.
+ */
+class ShardedExecutor {
+ public:
+  // placement, if not nullptr, is applied to the threads of all shards
+  ShardedExecutor(const uint32_t n_shards, const uint32_t n_threads_per_shard,
+                  std::shared_ptr<common::ThreadPlacement> placement = nullptr);
+
+  // no copy or move
+  ShardedExecutor(const ShardedExecutor&) = delete;
+  ShardedExecutor& operator=(const ShardedExecutor&) = delete;
+
+  // The returned executor lives as long as *this
+  folly::Executor* getExecutor(const std::string& db_name,
+                               const ExecutorLane lane);
+
+ private:
+  class LaneExecutor : public folly::Executor {
+   public:
+#if __GNUC__ >= 8
+    LaneExecutor(folly::CPUThreadPoolExecutor* pool,
+#else
+    LaneExecutor(wangle::CPUThreadPoolExecutor* pool,
+#endif
+                 const ExecutorLane lane,
+                 const uint32_t shard_id);
+
+    void add(folly::Func func) override;
+
+   private:
+#if __GNUC__ >= 8
+    folly::CPUThreadPoolExecutor* const pool_;
+#else
+    wangle::CPUThreadPoolExecutor* const pool_;
+#endif
+    const int8_t priority_;
+    // tagged with the lane, and with the lane and the shard
+    const std::string lane_depth_metric_;
+    const std::string shard_depth_metric_;
+    const std::string lane_wait_metric_;
+    const std::string shard_wait_metric_;
+    std::atomic<int64_t> queue_depth_;
+  };
+
+  struct Shard {
+    std::unique_ptr<LaneExecutor> apply_lane;
+    std::unique_ptr<LaneExecutor> read_lane;
+    // declared last to be destroyed first, which joins the threads still
+    // running tasks of the lanes
+#if __GNUC__ >= 8
+    std::unique_ptr<folly::CPUThreadPoolExecutor> pool;
+#else
+    std::unique_ptr<wangle::CPUThreadPoolExecutor> pool;
+#endif
+  };
+
+  std::vector<Shard> shards_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,170 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <memory>
+
+#include "gtest/gtest.h"
+#include "rocksdb/transaction_log.h"
+#include "rocksdb_replicator/cached_iters.h"
+
+using replicator::detail::CachedIters;
+
+namespace {
+
+// An iter which counts how many of its kind are alive
+class FakeIter : public rocksdb::TransactionLogIterator {
+ public:
+  static int alive;
+
+  FakeIter() {
+    ++alive;
+  }
+
+  ~FakeIter() override {
+    --alive;
+  }
+
+  bool Valid() override {
+    return false;
+  }
+
+  void Next() override {}
+
+  rocksdb::Status status() override {
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::BatchResult GetBatch() override {
+    return rocksdb::BatchResult();
+  }
+};
+
+int FakeIter::alive = 0;
+
+CachedIters::Iter NewIter() {
+  return CachedIters::Iter(new FakeIter());
+}
+
+// Whether db has an iter at exactly seq_no, which is taken out
+bool Take(CachedIters* iters, const void* db, rocksdb::SequenceNumber seq_no) {
+  rocksdb::SequenceNumber iter_seq_no = 0;
+  return iters->get(db, seq_no, 0, &iter_seq_no) != nullptr &&
+    iter_seq_no == seq_no;
+}
+
+}  // namespace
+
+TEST(CachedItersTest, GetClosest) {
+  CachedIters iters(0, 0);
+  int db;
+  rocksdb::SequenceNumber iter_seq_no = 0;
+  EXPECT_EQ(iters.get(&db, 10, 100, &iter_seq_no), nullptr);
+
+  iters.put(&db, 10, NewIter(), 1);
+  iters.put(&db, 20, NewIter(), 1);
+  EXPECT_EQ(iters.size(&db), 2u);
+
+  // before all iters, and too far ahead of them
+  EXPECT_EQ(iters.get(&db, 5, 100, &iter_seq_no), nullptr);
+  EXPECT_EQ(iters.get(&db, 30, 5, &iter_seq_no), nullptr);
+
+  // the closest iter at or below it, taken out
+  EXPECT_NE(iters.get(&db, 25, 5, &iter_seq_no), nullptr);
+  EXPECT_EQ(iter_seq_no, 20u);
+  EXPECT_EQ(iters.size(&db), 1u);
+  EXPECT_NE(iters.get(&db, 25, 100, &iter_seq_no), nullptr);
+  EXPECT_EQ(iter_seq_no, 10u);
+  EXPECT_EQ(iters.size(), 0u);
+  EXPECT_EQ(FakeIter::alive, 0);
+}
+
+TEST(CachedItersTest, PerDBCap) {
+  CachedIters iters(2, 0);
+  int db1;
+  int db2;
+  EXPECT_EQ(iters.put(&db1, 30, NewIter(), 1), 0u);
+  EXPECT_EQ(iters.put(&db1, 10, NewIter(), 2), 0u);
+  EXPECT_EQ(iters.put(&db2, 20, NewIter(), 3), 0u);
+
+  // The least recently cached iter of db1 goes, not the one of the lowest
+  // seq #, nor the one of db2
+  EXPECT_EQ(iters.put(&db1, 40, NewIter(), 4), 1u);
+  EXPECT_EQ(iters.size(&db1), 2u);
+  EXPECT_EQ(iters.size(&db2), 1u);
+  EXPECT_EQ(FakeIter::alive, 3);
+  EXPECT_FALSE(Take(&iters, &db1, 30));
+  EXPECT_TRUE(Take(&iters, &db1, 10));
+  EXPECT_TRUE(Take(&iters, &db1, 40));
+  EXPECT_TRUE(Take(&iters, &db2, 20));
+  EXPECT_EQ(FakeIter::alive, 0);
+}
+
+TEST(CachedItersTest, HostCap) {
+  CachedIters iters(0, 3);
+  int db1;
+  int db2;
+  int db3;
+  EXPECT_EQ(iters.put(&db1, 10, NewIter(), 1), 0u);
+  EXPECT_EQ(iters.put(&db2, 10, NewIter(), 2), 0u);
+  EXPECT_EQ(iters.put(&db1, 20, NewIter(), 3), 0u);
+
+  // A db with no iter takes the room of the least recently cached iter of
+  // the host
+  EXPECT_EQ(iters.put(&db3, 10, NewIter(), 4), 1u);
+  EXPECT_EQ(iters.size(), 3u);
+  EXPECT_FALSE(Take(&iters, &db1, 10));
+
+  // Then of db2, even if db1 has more iters
+  EXPECT_EQ(iters.put(&db1, 30, NewIter(), 5), 1u);
+  EXPECT_EQ(iters.size(&db2), 0u);
+  EXPECT_EQ(iters.size(&db1), 2u);
+
+  // Taking an iter out and putting it back makes it the most recent
+  EXPECT_TRUE(Take(&iters, &db1, 20));
+  EXPECT_EQ(iters.put(&db1, 20, NewIter(), 6), 0u);
+  EXPECT_EQ(iters.put(&db2, 10, NewIter(), 7), 1u);
+  EXPECT_EQ(iters.size(&db3), 0u);
+  EXPECT_TRUE(Take(&iters, &db1, 20));
+  EXPECT_TRUE(Take(&iters, &db1, 30));
+  EXPECT_TRUE(Take(&iters, &db2, 10));
+  EXPECT_EQ(FakeIter::alive, 0);
+}
+
+TEST(CachedItersTest, Drop) {
+  CachedIters iters(0, 0);
+  int db1;
+  int db2;
+  iters.put(&db1, 10, NewIter(), 100);
+  iters.put(&db1, 20, NewIter(), 200);
+  iters.put(&db2, 10, NewIter(), 100);
+
+  // Only the idle iters of db1
+  iters.dropIdle(&db1, 150);
+  EXPECT_EQ(iters.size(&db1), 1u);
+  EXPECT_EQ(iters.size(&db2), 1u);
+  EXPECT_TRUE(Take(&iters, &db1, 20));
+
+  iters.put(&db1, 30, NewIter(), 300);
+  iters.dropAll(&db2);
+  EXPECT_EQ(iters.size(&db2), 0u);
+  EXPECT_EQ(iters.size(), 1u);
+  iters.dropAll(&db1);
+  EXPECT_EQ(iters.size(), 0u);
+  EXPECT_EQ(FakeIter::alive, 0);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
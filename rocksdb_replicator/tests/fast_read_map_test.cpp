@@ -16,14 +16,25 @@
 // @author bol (bol@pinterest.com)
 //
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "folly/RWSpinLock.h"
 #include "gtest/gtest.h"
 #include "rocksdb_replicator/fast_read_map.h"
 
 using replicator::detail::FastReadMap;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::to_string;
@@ -98,6 +109,118 @@ TEST(FastReadMapTest, Basics) {
   EXPECT_FALSE(map.get("3", &value));
 }
 
+TEST(FastReadMapTest, Replace) {
+  FastReadMap<string, int> map;
+  EXPECT_TRUE(map.add("1", 1));
+
+  int old_value = 0;
+  EXPECT_TRUE(map.replace("1", 10, &old_value));
+  EXPECT_EQ(old_value, 1);
+  EXPECT_FALSE(map.replace("2", 2));
+
+  int value;
+  EXPECT_TRUE(map.get("1", &value));
+  EXPECT_EQ(value, 10);
+  EXPECT_FALSE(map.get("2", &value));
+}
+
+TEST(FastReadMapTest, ForEach) {
+  FastReadMap<string, int> map;
+  EXPECT_TRUE(map.add("1", 1));
+  EXPECT_TRUE(map.add("2", 2));
+  EXPECT_TRUE(map.add("3", 3));
+  EXPECT_TRUE(map.remove("2"));
+
+  std::unordered_map<string, int> visited;
+  map.forEach([&visited] (const string& key, int value) {
+      visited.emplace(key, value);
+    });
+  EXPECT_EQ(visited, (std::unordered_map<string, int>{{"1", 1}, {"3", 3}}));
+}
+
+// The read path FastReadMap used to have, to compare with
+class LockedSnapshotMap {
+ public:
+  LockedSnapshotMap()
+      : map_(std::make_shared<std::unordered_map<string, int>>())
+      , map_rwlock_() {
+  }
+
+  void add(const string& key, int value) {
+    (*map_)[key] = value;
+  }
+
+  bool get(const string& key, int* value) {
+    shared_ptr<std::unordered_map<string, int>> local_map;
+    {
+      folly::RWSpinLock::ReadHolder read_guard(map_rwlock_);
+      local_map = map_;
+    }
+
+    auto itor = local_map->find(key);
+    if (itor == local_map->end()) {
+      return false;
+    }
+
+    *value = itor->second;
+    return true;
+  }
+
+ private:
+  shared_ptr<std::unordered_map<string, int>> map_;
+  folly::RWSpinLock map_rwlock_;
+};
+
+// Return # of reads per second of n_threads threads
+template <typename Map>
+double readThroughput(Map* map, int n_threads, int n_keys,
+                      int n_reads_per_thread) {
+  vector<string> keys;
+  for (int key = 0; key < n_keys; ++key) {
+    keys.push_back(to_string(key));
+  }
+
+  vector<thread> threads(n_threads);
+  const auto start = steady_clock::now();
+  for (int i = 0; i < n_threads; ++i) {
+    threads[i] = thread([map, &keys, n_reads_per_thread, i] {
+        int value;
+        for (int j = 0; j < n_reads_per_thread; ++j) {
+          EXPECT_TRUE(map->get(keys[(i + j) % keys.size()], &value));
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  const auto us =
+    duration_cast<microseconds>(steady_clock::now() - start).count();
+  return n_threads * n_reads_per_thread * 1000000.0 / std::max<int64_t>(us, 1);
+}
+
+TEST(FastReadMapTest, ReadThroughput) {
+  const int n_keys = 100;
+  const int n_reads_per_thread = 1000000;
+  FastReadMap<string, int> map;
+  LockedSnapshotMap locked_map;
+  for (int key = 0; key < n_keys; ++key) {
+    map.add(to_string(key), key);
+    locked_map.add(to_string(key), key);
+  }
+
+  const int max_threads = std::max(1u, thread::hardware_concurrency());
+  for (int n_threads = 1; n_threads <= max_threads; n_threads *= 4) {
+    std::cout << n_threads << " threads: FastReadMap "
+              << readThroughput(&map, n_threads, n_keys, n_reads_per_thread)
+              << " reads/s, RWSpinLock + shared_ptr "
+              << readThroughput(&locked_map, n_threads, n_keys,
+                                n_reads_per_thread)
+              << " reads/s" << std::endl;
+  }
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
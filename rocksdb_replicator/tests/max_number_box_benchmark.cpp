@@ -0,0 +1,93 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "gflags/gflags.h"
+#include "rocksdb_replicator/max_number_box.h"
+
+DEFINE_int32(n_waiters, 256, "The number of concurrent waiter threads");
+
+using replicator::detail::MaxNumberBox;
+
+// post() with nobody to wake up, i.e. acks for writes that are not waited on
+BENCHMARK(PostNoWaiters, n) {
+  MaxNumberBox box;
+  for (uint64_t i = 1; i <= n; ++i) {
+    box.post(i);
+  }
+}
+
+// post() while many waiters are parked on numbers that are not reached yet
+BENCHMARK(PostParkedWaiters, n) {
+  MaxNumberBox box;
+  std::vector<std::thread> waiters;
+  const uint64_t far_away = std::numeric_limits<uint64_t>::max() / 2;
+
+  BENCHMARK_SUSPEND {
+    for (int i = 0; i < FLAGS_n_waiters; ++i) {
+      waiters.emplace_back([&box, far_away, i] () {
+          box.wait(far_away + i, 0);
+        });
+    }
+    // give them a chance to park
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  for (uint64_t i = 1; i <= n; ++i) {
+    box.post(i);
+  }
+
+  BENCHMARK_SUSPEND {
+    box.post(far_away + FLAGS_n_waiters);
+    for (auto& t : waiters) {
+      t.join();
+    }
+  }
+}
+
+// Semi-sync writers waiting for acks which are posted by a single thread
+BENCHMARK(ConcurrentWaitAndPost, n) {
+  MaxNumberBox box;
+  std::atomic<uint64_t> next_num(0);
+  std::atomic<uint64_t> n_done(0);
+  std::vector<std::thread> waiters;
+
+  for (int i = 0; i < FLAGS_n_waiters; ++i) {
+    waiters.emplace_back([&box, &next_num, &n_done, n] () {
+        uint64_t num;
+        while ((num = next_num.fetch_add(1) + 1) <= n) {
+          box.wait(num, 0);
+          n_done.fetch_add(1);
+        }
+      });
+  }
+
+  while (n_done.load() < n) {
+    box.post(next_num.load());
+  }
+
+  for (auto& t : waiters) {
+    t.join();
+  }
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
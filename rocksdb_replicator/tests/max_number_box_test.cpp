@@ -64,6 +64,76 @@ TEST(MaxNumberBoxTest, Basics) {
   poster.join();
 }
 
+TEST(MaxNumberBoxTest, WaitAsync) {
+  MaxNumberBox box;
+  EXPECT_TRUE(box.waitAsync(0, 10).get());
+  EXPECT_FALSE(box.waitAsync(1, 10).get());
+
+  auto f1 = box.waitAsync(5, 0);
+  auto f2 = box.waitAsync(10, 0);
+  auto f3 = box.waitAsync(20, 100);
+  EXPECT_FALSE(f1.isReady());
+  EXPECT_FALSE(f2.isReady());
+  box.post(5);
+  EXPECT_TRUE(f1.isReady());
+  EXPECT_TRUE(f1.get());
+  EXPECT_FALSE(f2.isReady());
+  box.post(15);
+  EXPECT_TRUE(f2.isReady());
+  EXPECT_TRUE(f2.get());
+  EXPECT_FALSE(f3.get());
+  EXPECT_TRUE(box.waitAsync(15, 10).get());
+
+  // pending waiters are fulfilled with false when the box goes away
+  folly::Future<bool> f4 = folly::makeFuture(true);
+  {
+    MaxNumberBox box2;
+    f4 = box2.waitAsync(1, 0);
+  }
+  EXPECT_FALSE(f4.get());
+}
+
+TEST(MaxNumberBoxTest, OnlySatisfiedWaitersWakeUp) {
+  MaxNumberBox box;
+  const int n_waiters = 10;
+  std::atomic<int> n_woken(0);
+  std::vector<std::thread> waiters;
+  // wait on 10, 20, ..., 100 in reverse order
+  for (int i = n_waiters; i > 0; --i) {
+    waiters.emplace_back([&box, &n_woken, i] () {
+        EXPECT_TRUE(box.wait(i * 10, 0));
+        n_woken.fetch_add(1);
+      });
+  }
+  // mixed with async waiters and timed out ones
+  auto f1 = box.waitAsync(35, 0);
+  auto f2 = box.waitAsync(25, 1);
+  EXPECT_FALSE(box.wait(45, 1));
+  EXPECT_FALSE(f2.get());
+
+  std::this_thread::sleep_for(milliseconds(100));
+  box.post(9);
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_EQ(n_woken.load(), 0);
+
+  box.post(30);
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_EQ(n_woken.load(), 3);
+  EXPECT_FALSE(f1.isReady());
+
+  box.post(55);
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_EQ(n_woken.load(), 5);
+  EXPECT_TRUE(f1.isReady());
+  EXPECT_TRUE(f1.get());
+
+  box.post(1000);
+  for (auto& t : waiters) {
+    t.join();
+  }
+  EXPECT_EQ(n_woken.load(), n_waiters);
+}
+
 TEST(MaxNumberBoxTest, Stress) {
   // reduce the number of threads to make travis happy.
   // we may need to restore the numbers if we need to stress test it.
@@ -93,6 +93,36 @@ TEST(NonBlockingConditionVariableTest, Basics) {
   EXPECT_EQ(counter, 7);
 }
 
+TEST(NonBlockingConditionVariableTest, NotifyCancelsTimeouts) {
+  NonBlockingConditionVariable variable(&g_executor);
+  atomic<int> counter(0);
+  auto predicate = [] {
+    return false;
+  };
+  auto func = [&counter] {
+    ++counter;
+  };
+
+  const int n_tasks = 1000;
+  for (int i = 0; i < n_tasks; ++i) {
+    variable.runIfConditionOrWaitForNotify(func, predicate, kPauseTimeMs);
+  }
+  variable.notifyAll();
+  sleep_for(milliseconds(kPauseTimeMs * 2));
+  EXPECT_EQ(counter, n_tasks);
+
+  // the recycled tasks time out as usual
+  for (int i = 0; i < n_tasks; ++i) {
+    variable.runIfConditionOrWaitForNotify(func, predicate, kPauseTimeMs / 2);
+  }
+  EXPECT_EQ(counter, n_tasks);
+  sleep_for(milliseconds(kPauseTimeMs * 2));
+  EXPECT_EQ(counter, n_tasks * 2);
+  variable.notifyAll();
+  sleep_for(milliseconds(kPauseTimeMs));
+  EXPECT_EQ(counter, n_tasks * 2);
+}
+
 void stress(int n_notify_threads, int n_add_threads,
             int notify_interval_ms, int n_tasks_per_thread) {
   NonBlockingConditionVariable cond_var(&g_executor);
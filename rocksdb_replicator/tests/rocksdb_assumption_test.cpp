@@ -17,6 +17,7 @@
 //
 
 #include <algorithm>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <string>
@@ -431,6 +432,101 @@ TEST(RocksDBAssumptionTest, GetUpdatesSince) {
   }
 }
 
+TEST(RocksDBAssumptionTest, WriteBatchRepLayout) {
+  // The Slave side group apply relies on the rep of a WriteBatch being a 12
+  // bytes header (8 bytes seq #, 4 bytes little endian count) followed by
+  // records. LogData records are not counted.
+  WriteBatch batch1;
+  batch1.Put("key1", "value1");
+  batch1.Delete("key2");
+  batch1.PutLogData("blob1");
+  WriteBatch batch2;
+  batch2.Merge("key3", "value3");
+  batch2.PutLogData("blob2");
+  EXPECT_EQ(batch1.Count(), 2);
+  EXPECT_EQ(batch2.Count(), 1);
+
+  string rep = batch1.Data() + batch2.Data().substr(12);
+  rep[8] = 3;
+  WriteBatch grouped(rep);
+  EXPECT_EQ(grouped.Count(), 3);
+  EXPECT_EQ(grouped.GetDataSize(),
+            batch1.GetDataSize() + batch2.GetDataSize() - 12);
+
+  const string path = "/tmp/test_write_batch_rep_layout_db";
+  auto db = CleanAndOpenDB(path);
+  EXPECT_TRUE(db->Write(rocksdb::WriteOptions(), &grouped).ok());
+  EXPECT_EQ(db->GetLatestSequenceNumber(), 3);
+  string value;
+  EXPECT_TRUE(db->Get(ReadOptions(), "key1", &value).ok());
+  EXPECT_EQ(value, "value1");
+  EXPECT_TRUE(db->Get(ReadOptions(), "key3", &value).ok());
+  EXPECT_EQ(value, "value3");
+}
+
+TEST(RocksDBAssumptionTest, SkipTransactionLogIterator) {
+  // Reusing a cached iter for a later seq # relies on GetBatch() moving the
+  // batch out of the iter, and Next() moving to the batch right after it.
+  const string path = "/tmp/test_skip_transaction_log_iterator_db";
+  auto db = CleanAndOpenDB(path);
+  for (int i = 0; i < 5; ++i) {
+    WriteBatch batch;
+    batch.Put("key" + std::to_string(i), "value");
+    batch.Put("key2" + std::to_string(i), "value");
+    EXPECT_TRUE(db->Write(rocksdb::WriteOptions(), &batch).ok());
+  }
+
+  std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+  EXPECT_TRUE(db->GetUpdatesSince(1, &iter).ok());
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(iter->Valid());
+    auto result = iter->GetBatch();
+    EXPECT_EQ(result.sequence, i * 2 + 1);
+    EXPECT_EQ(result.writeBatchPtr->Count(), 2);
+    EXPECT_TRUE(iter->GetBatch().writeBatchPtr == nullptr);
+    iter->Next();
+  }
+
+  EXPECT_FALSE(iter->Valid());
+}
+
+TEST(RocksDBAssumptionTest, SequenceNumberInWriteBatchRep) {
+  // The tail cache relies on DB::Write() storing the first seq # assigned to
+  // a batch in the header of its rep.
+  const string path = "/tmp/test_sequence_number_in_write_batch_rep_db";
+  auto db = CleanAndOpenDB(path);
+  for (int i = 0; i < 5; ++i) {
+    WriteBatch batch;
+    batch.Put("key" + std::to_string(i), "value");
+    batch.Delete("key2" + std::to_string(i));
+    batch.PutLogData("blob");
+    EXPECT_TRUE(db->Write(rocksdb::WriteOptions(), &batch).ok());
+    uint64_t seq_no;
+    memcpy(&seq_no, batch.Data().data(), sizeof(seq_no));
+    EXPECT_EQ(seq_no, i * 2 + 1);
+    EXPECT_EQ(db->GetLatestSequenceNumber(), seq_no + 1);
+  }
+}
+
+TEST(RocksDBAssumptionTest, LogDataRecordLayout) {
+  // Timestamp extraction relies on a batch ending with a 8 bytes LogData
+  // record being laid out as tag 0x3, varint32 length 8, then the data.
+  WriteBatch batch;
+  batch.Put("key", "value");
+  batch.Delete("key2");
+  uint64_t ms = 0x0102030405060708;
+  batch.PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&ms),
+                                  sizeof(ms)));
+  const auto& rep = batch.Data();
+  ASSERT_GE(rep.size(), 12 + 10);
+  const char* record = rep.data() + rep.size() - 10;
+  EXPECT_EQ(record[0], 0x3);
+  EXPECT_EQ(record[1], 8);
+  uint64_t extracted;
+  memcpy(&extracted, record + 2, sizeof(extracted));
+  EXPECT_EQ(extracted, ms);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
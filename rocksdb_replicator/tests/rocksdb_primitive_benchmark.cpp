@@ -0,0 +1,235 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// The cost of the RocksDB primitives the replicator is built on, whose
+// behavior rocksdb_assumption_test.cpp checks. Rerun it when upgrading or
+// tuning RocksDB.
+//
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "folly/io/IOBuf.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "rocksdb/db.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/write_batch.h"
+
+DEFINE_int32(value_size, 100, "The bytes of each value");
+DEFINE_int32(updates_per_batch, 10, "The updates of each WAL batch");
+DEFINE_int32(keys_per_sst, 1000, "The keys of each ingested sst file");
+
+namespace {
+
+const std::string kDBDir = "/tmp/rocksdb_primitive_benchmark/";
+
+std::string Key(const uint64_t i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "key%016" PRIu64, i);
+  return buf;
+}
+
+std::unique_ptr<rocksdb::DB> CleanAndOpenDB(const std::string& name) {
+  const auto path = kDBDir + name;
+  rocksdb::Options options;
+  CHECK(rocksdb::DestroyDB(path, options).ok());
+  options.create_if_missing = true;
+  // keep all WAL files around, like the masters do for their slaves
+  options.WAL_ttl_seconds = 24 * 3600;
+  options.WAL_size_limit_MB = 100 * 1024;
+  rocksdb::DB* db;
+  const auto status = rocksdb::DB::Open(options, path, &db);
+  CHECK(status.ok()) << status.ToString();
+  return std::unique_ptr<rocksdb::DB>(db);
+}
+
+rocksdb::WriteBatch MakeBatch(const uint64_t first_key, const int n_updates) {
+  rocksdb::WriteBatch batch;
+  const std::string value(FLAGS_value_size, 'v');
+  for (int i = 0; i < n_updates; ++i) {
+    batch.Put(Key(first_key + i), value);
+  }
+  return batch;
+}
+
+// A DB with n_updates in its WAL, which is created on the first call for
+// each n_updates and kept for the following ones
+rocksdb::DB* DBWithWAL(const uint64_t n_updates) {
+  static std::map<uint64_t, std::unique_ptr<rocksdb::DB>> dbs;
+  auto& db = dbs[n_updates];
+  if (db == nullptr) {
+    db = CleanAndOpenDB("wal" + std::to_string(n_updates));
+    for (uint64_t i = 0; i < n_updates; i += FLAGS_updates_per_batch) {
+      auto batch = MakeBatch(i, FLAGS_updates_per_batch);
+      CHECK(db->Write(rocksdb::WriteOptions(), &batch).ok());
+    }
+    // move most of the WAL into archived files, as it is on a busy master
+    CHECK(db->Flush(rocksdb::FlushOptions()).ok());
+    CHECK_GE(db->GetLatestSequenceNumber(), n_updates);
+  }
+  return db.get();
+}
+
+}  // namespace
+
+// GetUpdatesSince() for a seq # at position_percent of the WAL, plus reading
+// the first batch, which is what each pull of a slave starts with
+void GetUpdatesSince(const size_t n,
+                     const uint64_t n_updates,
+                     const int position_percent) {
+  rocksdb::DB* db;
+  rocksdb::SequenceNumber seq_no;
+  BENCHMARK_SUSPEND {
+    db = DBWithWAL(n_updates);
+    seq_no = std::max<rocksdb::SequenceNumber>(
+      db->GetLatestSequenceNumber() * position_percent / 100, 1);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+    CHECK(db->GetUpdatesSince(seq_no, &iter).ok());
+    CHECK(iter->Valid());
+    auto result = iter->GetBatch();
+    folly::doNotOptimizeAway(result.sequence);
+  }
+}
+
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 10K_head, 10000, 0)
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 10K_middle, 10000, 50)
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 10K_tail, 10000, 100)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 1M_head, 1000000, 0)
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 1M_middle, 1000000, 50)
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 1M_tail, 1000000, 100)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 10M_head, 10000000, 0)
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 10M_middle, 10000000, 50)
+BENCHMARK_NAMED_PARAM(GetUpdatesSince, 10M_tail, 10000000, 100)
+BENCHMARK_DRAW_LINE();
+
+// n batches read by Next() and GetBatch(), i.e. the throughput of a slave
+// catching up
+BENCHMARK(TransactionLogIteratorNext, n) {
+  rocksdb::DB* db;
+  std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+  BENCHMARK_SUSPEND {
+    db = DBWithWAL(1000000);
+    CHECK(db->GetUpdatesSince(1, &iter).ok());
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (!iter->Valid()) {
+      BENCHMARK_SUSPEND {
+        CHECK(db->GetUpdatesSince(1, &iter).ok());
+      }
+    }
+    auto result = iter->GetBatch();
+    folly::doNotOptimizeAway(result.writeBatchPtr->Count());
+    iter->Next();
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+// A WriteBatch from the raw bytes of an update, as a slave does for each
+// update it pulls, copying the (chained) IOBuf once into the rep
+void WriteBatchFromRawBytes(const size_t n, const int n_updates) {
+  std::unique_ptr<folly::IOBuf> raw_data;
+  BENCHMARK_SUSPEND {
+    const auto rep = MakeBatch(0, n_updates).Data();
+    // as received, in a chain of 4KB buffers
+    const size_t kBufSize = 4096;
+    for (size_t offset = 0; offset < rep.size(); offset += kBufSize) {
+      auto buf = folly::IOBuf::copyBuffer(
+        rep.data() + offset, std::min(kBufSize, rep.size() - offset));
+      if (raw_data) {
+        raw_data->prependChain(std::move(buf));
+      } else {
+        raw_data = std::move(buf);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    std::string rep;
+    rep.reserve(raw_data->computeChainDataLength());
+    for (const auto range : *raw_data) {
+      rep.append(reinterpret_cast<const char*>(range.data()), range.size());
+    }
+    rocksdb::WriteBatch batch(std::move(rep));
+    folly::doNotOptimizeAway(batch.Count());
+  }
+}
+
+BENCHMARK_PARAM(WriteBatchFromRawBytes, 1)
+BENCHMARK_PARAM(WriteBatchFromRawBytes, 10)
+BENCHMARK_PARAM(WriteBatchFromRawBytes, 100)
+BENCHMARK_PARAM(WriteBatchFromRawBytes, 1000)
+BENCHMARK_DRAW_LINE();
+
+// Ingest n sst files of FLAGS_keys_per_sst keys each. With global_seqno, all
+// files overlap the DB, so each of them is assigned a global seq #, which is
+// written into the file. Otherwise the key ranges are disjoint, and the files
+// keep seq # 0.
+void IngestExternalFile(const size_t n, const bool global_seqno) {
+  std::unique_ptr<rocksdb::DB> db;
+  rocksdb::Options options;
+  rocksdb::IngestExternalFileOptions ifo;
+  const std::string value(FLAGS_value_size, 'v');
+  BENCHMARK_SUSPEND {
+    db = CleanAndOpenDB(global_seqno ? "ingest_global_seqno" : "ingest");
+    ifo.move_files = true;
+    ifo.allow_global_seqno = global_seqno;
+    ifo.allow_blocking_flush = global_seqno;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    const auto sst_file = kDBDir + "ingest.sst";
+    BENCHMARK_SUSPEND {
+      rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), options,
+                                    options.comparator);
+      CHECK(writer.Open(sst_file).ok());
+      const uint64_t first_key = global_seqno ? 0 : i * FLAGS_keys_per_sst;
+      for (int j = 0; j < FLAGS_keys_per_sst; ++j) {
+        CHECK(writer.Add(Key(first_key + j), value).ok());
+      }
+      CHECK(writer.Finish().ok());
+    }
+
+    const auto status = db->IngestExternalFile({sst_file}, ifo);
+    CHECK(status.ok()) << status.ToString();
+  }
+
+  BENCHMARK_SUSPEND {
+    db.reset();
+  }
+}
+
+BENCHMARK_NAMED_PARAM(IngestExternalFile, without_global_seqno, false)
+BENCHMARK_RELATIVE_NAMED_PARAM(IngestExternalFile, with_global_seqno, true)
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK_EQ(std::system(("mkdir -p " + kDBDir).c_str()), 0);
+  folly::runBenchmarks();
+}
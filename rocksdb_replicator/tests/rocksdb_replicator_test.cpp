@@ -16,10 +16,17 @@
 // @author bol (bol@pinterest.com)
 //
 
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "common/s3util.h"
 #include "gtest/gtest.h"
+#include "rocksdb/env.h"
 
 // we need this hack to use RocksDBReplicator::RocksDBReplicator(), which is
 // private
@@ -31,9 +38,11 @@ using replicator::DBRole;
 using replicator::ReturnCode;
 using replicator::RocksDBReplicator;
 using rocksdb::DB;
+using rocksdb::Env;
 using rocksdb::Options;
 using rocksdb::ReadOptions;
 using rocksdb::Status;
+using rocksdb::VectorLogPtr;
 using rocksdb::WriteBatch;
 using rocksdb::WriteOptions;
 using std::chrono::milliseconds;
@@ -44,8 +53,27 @@ using std::to_string;
 using std::unique_ptr;
 using std::vector;
 
+DECLARE_int64(replicator_max_bytes_per_response);
 DECLARE_int32(replicator_pull_delay_on_error_ms);
+DECLARE_int32(replicator_pull_pipeline_depth);
+DECLARE_int32(replicator_max_updates_per_response);
+DECLARE_bool(replicator_multiplex_pulls);
+DECLARE_int32(replicator_push_credits);
+DECLARE_bool(replicator_enable_push);
+DECLARE_bool(replicator_group_apply);
+DECLARE_int32(replicator_replication_mode);
+DECLARE_int32(replicator_quorum_size);
+DECLARE_uint64(replicator_timeout_ms);
+DECLARE_int64(replicator_tail_cache_bytes);
+DECLARE_string(replicator_compression);
+DECLARE_int64(replicator_compression_min_bytes);
+DECLARE_int32(replicator_executor_shards);
+DECLARE_int32(replicator_write_group_commit_us);
+DECLARE_int32(replicator_max_server_wait_time_ms);
+DECLARE_int32(replicator_max_idle_server_wait_time_ms);
 DECLARE_int32(rocksdb_replicator_port);
+DECLARE_bool(replicator_slave_disable_wal);
+DECLARE_int64(replicator_stalled_slave_max_bytes);
 
 shared_ptr<DB> cleanAndOpenDB(const string& path) {
   EXPECT_EQ(system(("rm -rf " + path).c_str()), 0);
@@ -333,6 +361,1189 @@ TEST(RocksDBReplicatorTest, 1_master_2_slaves_chain) {
   EXPECT_EQ(db_slave_2->GetLatestSequenceNumber(), 2 * n_keys);
 }
 
+TEST(RocksDBReplicatorTest, ByteBudgetedResponses) {
+  // Every response can hold only one update due to the tiny byte cap
+  auto old_max_bytes = FLAGS_replicator_max_bytes_per_response;
+  FLAGS_replicator_max_bytes_per_response = 1;
+  int16_t master_port = 9100;
+  int16_t slave_port = 9101;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  string big_value(64 * 1024, 'v');
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    updates.Put(to_string(i) + "key", big_value);
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    string value;
+    auto status = db_slave->Get(read_options, to_string(i) + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, big_value);
+  }
+
+  FLAGS_replicator_max_bytes_per_response = old_max_bytes;
+}
+
+TEST(RocksDBReplicatorTest, StalledSlaveResponses) {
+  auto old_stalled_max_bytes = FLAGS_replicator_stalled_slave_max_bytes;
+  FLAGS_replicator_stalled_slave_max_bytes = 64 * 1024;
+  Host master(9102);
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  RocksDBReplicator::ReplicatedDB* replicated_db;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      folly::SocketAddress(), &replicated_db),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  string big_value(16 * 1024, 'v');
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    updates.Put(to_string(i) + "key", big_value);
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  const auto response_bytes = [] (const replicator::ReplicateResponse& res) {
+    uint64_t bytes = 0;
+    for (const auto& update : res.updates) {
+      bytes += update.raw_data.computeChainDataLength();
+    }
+    return bytes;
+  };
+
+  replicator::ReplicateRequest request;
+  request.seq_no = 0;
+  request.db_name = "shard1";
+  request.max_wait_ms = 0;
+  request.max_updates = 0;
+  rocksdb::SequenceNumber last_seq_no;
+  replicator::ReplicateResponse response;
+  EXPECT_TRUE(replicated_db->readUpdates(request, &response,
+                                         &last_seq_no).ok());
+  EXPECT_EQ(response.updates.size(), n_keys);
+
+  // Stops at the first update reaching the cap
+  request.write_stalled = true;
+  replicator::ReplicateResponse stalled_response;
+  EXPECT_TRUE(replicated_db->readUpdates(request, &stalled_response,
+                                         &last_seq_no).ok());
+  EXPECT_GT(stalled_response.updates.size(), 0);
+  EXPECT_LT(stalled_response.updates.size(), n_keys);
+  EXPECT_LT(response_bytes(stalled_response),
+            FLAGS_replicator_stalled_slave_max_bytes + big_value.size() +
+            1024);
+  EXPECT_EQ(last_seq_no, stalled_response.updates.size());
+
+  EXPECT_EQ(master.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_stalled_slave_max_bytes = old_stalled_max_bytes;
+}
+
+TEST(RocksDBReplicatorTest, PipelinedPulls) {
+  // Small responses, so that the slave has to keep several of them in the
+  // pipeline to catch up
+  auto old_depth = FLAGS_replicator_pull_pipeline_depth;
+  auto old_max_updates = FLAGS_replicator_max_updates_per_response;
+  FLAGS_replicator_pull_pipeline_depth = 4;
+  FLAGS_replicator_max_updates_per_response = 3;
+  int16_t master_port = 9102;
+  int16_t slave_port = 9103;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 1000;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    updates.Put(str + "key2", str + "value2");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 2) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+
+    status = db_slave->Get(read_options, str + "key2", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value2");
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_pull_pipeline_depth = old_depth;
+  FLAGS_replicator_max_updates_per_response = old_max_updates;
+}
+
+TEST(RocksDBReplicatorTest, MultiplexedPulls) {
+  FLAGS_replicator_multiplex_pulls = true;
+  int16_t master_port = 9104;
+  int16_t slave_port = 9105;
+  Host master(master_port);
+  Host slave(slave_port);
+  int n_shards = 10;
+  uint32_t n_keys = 100;
+
+  vector<shared_ptr<DB>> db_masters;
+  vector<shared_ptr<DB>> db_slaves;
+  SocketAddress addr_master("127.0.0.1", master_port);
+  for (int i = 0; i < n_shards; ++i) {
+    auto str = to_string(i);
+    auto shard = "shard" + str;
+    db_masters.emplace_back(cleanAndOpenDB("/tmp/db_master" + str));
+    db_slaves.emplace_back(cleanAndOpenDB("/tmp/db_slave" + str));
+    EXPECT_EQ(master.replicator_->addDB(shard, db_masters[i], DBRole::MASTER),
+              ReturnCode::OK);
+    EXPECT_EQ(slave.replicator_->addDB(shard, db_slaves[i], DBRole::SLAVE,
+                                       addr_master),
+              ReturnCode::OK);
+  }
+
+  // only write to some of the shards, the others should keep waiting
+  WriteOptions options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    for (int j = 0; j < n_shards; j += 2) {
+      auto str = to_string(i);
+      WriteBatch updates;
+      updates.Put(str + "key", str + "value");
+      EXPECT_EQ(master.replicator_->write("shard" + to_string(j), options,
+                                          &updates),
+                ReturnCode::OK);
+    }
+  }
+
+  ReadOptions read_options;
+  for (int i = 0; i < n_shards; i += 2) {
+    while (db_slaves[i]->GetLatestSequenceNumber() < n_keys) {
+      sleep_for(milliseconds(100));
+    }
+    EXPECT_EQ(db_slaves[i]->GetLatestSequenceNumber(), n_keys);
+    EXPECT_EQ(db_slaves[i + 1]->GetLatestSequenceNumber(), 0);
+
+    for (uint32_t j = 0; j < n_keys; ++j) {
+      string value;
+      auto str = to_string(j);
+      auto status = db_slaves[i]->Get(read_options, str + "key", &value);
+      EXPECT_TRUE(status.ok());
+      EXPECT_EQ(value, str + "value");
+    }
+  }
+
+  FLAGS_replicator_multiplex_pulls = false;
+}
+
+void testPush(int16_t master_port, int16_t slave_port) {
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 500;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+}
+
+TEST(RocksDBReplicatorTest, Push) {
+  FLAGS_replicator_push_credits = 4;
+  testPush(9106, 9107);
+  FLAGS_replicator_push_credits = 0;
+}
+
+TEST(RocksDBReplicatorTest, PushFallBackToPull) {
+  FLAGS_replicator_push_credits = 4;
+  FLAGS_replicator_enable_push = false;
+  testPush(9108, 9109);
+  FLAGS_replicator_enable_push = true;
+  FLAGS_replicator_push_credits = 0;
+}
+
+TEST(RocksDBReplicatorTest, GroupApply) {
+  FLAGS_replicator_group_apply = true;
+  int16_t master_port = 9110;
+  int16_t slave_port = 9111;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+
+  // write before the slave is added, so that it gets many updates in one
+  // response
+  WriteOptions options;
+  uint32_t n_keys = 500;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    updates.Delete(str + "key2");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 2) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_group_apply = false;
+}
+
+TEST(RocksDBReplicatorTest, QuorumAcks) {
+  FLAGS_replicator_replication_mode = 3;
+  FLAGS_replicator_quorum_size = 2;
+  FLAGS_replicator_timeout_ms = 1000;
+  int16_t master_port = 9112;
+  vector<int16_t> slave_ports = { 9113, 9114, 9115 };
+  Host master(master_port);
+  vector<unique_ptr<Host>> slaves;
+  for (auto port : slave_ports) {
+    slaves.emplace_back(new Host(port));
+  }
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  vector<shared_ptr<DB>> db_slaves;
+  for (size_t i = 0; i < slaves.size(); ++i) {
+    db_slaves.push_back(cleanAndOpenDB("/tmp/db_slave" + to_string(i)));
+    EXPECT_EQ(slaves[i]->replicator_->addDB("shard1", db_slaves[i],
+                                            DBRole::SLAVE, addr_master),
+              ReturnCode::OK);
+  }
+
+  WriteOptions options;
+  auto write = [&master, &options] (uint32_t i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    return master.replicator_->write("shard1", options, &updates);
+  };
+
+  for (uint32_t i = 0; i < 10; ++i) {
+    EXPECT_EQ(write(i), ReturnCode::OK);
+  }
+
+  // 2 out of 3 is still a quorum
+  EXPECT_EQ(slaves[0]->replicator_->removeDB("shard1"), ReturnCode::OK);
+  for (uint32_t i = 10; i < 20; ++i) {
+    EXPECT_EQ(write(i), ReturnCode::OK);
+  }
+
+  // but 1 is not
+  EXPECT_EQ(slaves[1]->replicator_->removeDB("shard1"), ReturnCode::OK);
+  EXPECT_EQ(write(20), ReturnCode::WAIT_SLAVE_TIMEOUT);
+  while (db_slaves[2]->GetLatestSequenceNumber() < 21) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(slaves[2]->replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_replication_mode = 0;
+  FLAGS_replicator_timeout_ms = 5 * 1000;
+}
+
+TEST(RocksDBReplicatorTest, TailCache) {
+  // small enough to force evicting
+  FLAGS_replicator_tail_cache_bytes = 8 * 1024;
+  int16_t master_port = 9116;
+  int16_t slave_port = 9117;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  auto write = [&master, &options] (uint32_t i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    updates.Put(str + "key2", str + "value2");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  };
+
+  // the first ones have been evicted when the slave joins
+  uint32_t n_keys = 500;
+  for (uint32_t i = 0; i < n_keys / 2; ++i) {
+    write(i);
+  }
+
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  for (uint32_t i = n_keys / 2; i < n_keys; ++i) {
+    write(i);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 2) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    EXPECT_TRUE(db_slave->Get(read_options, str + "key", &value).ok());
+    EXPECT_EQ(value, str + "value");
+    EXPECT_TRUE(db_slave->Get(read_options, str + "key2", &value).ok());
+    EXPECT_EQ(value, str + "value2");
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_tail_cache_bytes = 0;
+}
+
+void testCompression(const string& compression, int16_t master_port,
+                     int16_t slave_port) {
+  FLAGS_replicator_compression = compression;
+  FLAGS_replicator_compression_min_bytes = 0;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 500;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", string(100, 'v') + str);
+    updates.Delete(str + "key2");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 2) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    EXPECT_TRUE(db_slave->Get(read_options, str + "key", &value).ok());
+    EXPECT_EQ(value, string(100, 'v') + str);
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_compression = "none";
+  FLAGS_replicator_compression_min_bytes = 4 * 1024;
+}
+
+TEST(RocksDBReplicatorTest, LZ4Compression) {
+  testCompression("lz4", 9118, 9119);
+}
+
+TEST(RocksDBReplicatorTest, ZSTDCompression) {
+  testCompression("zstd", 9120, 9121);
+}
+
+TEST(RocksDBReplicatorTest, FetchCheckpoint) {
+  int16_t master_port = 9122;
+  int16_t slave_port = 9123;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  auto write = [&master, &options] (uint32_t i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  };
+
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys / 2; ++i) {
+    write(i);
+  }
+
+  SocketAddress addr_master("127.0.0.1", master_port);
+  string err_msg;
+  EXPECT_FALSE(slave.replicator_->fetchCheckpoint(
+    "non_exist_db", addr_master, "/tmp/db_checkpoint", &err_msg));
+  EXPECT_FALSE(err_msg.empty());
+
+  EXPECT_EQ(system("rm -rf /tmp/db_checkpoint"), 0);
+  uint64_t fetched_bytes = 0;
+  EXPECT_TRUE(slave.replicator_->fetchCheckpoint(
+    "shard1", addr_master, "/tmp/db_checkpoint", &err_msg, 100 * 1024 * 1024,
+    [&fetched_bytes] (uint64_t bytes) { fetched_bytes += bytes; }))
+    << err_msg;
+
+  vector<string> files;
+  EXPECT_TRUE(Env::Default()->GetChildren("/tmp/db_checkpoint", &files).ok());
+  uint64_t total_bytes = 0;
+  for (const auto& file : files) {
+    uint64_t size = 0;
+    if (file != "." && file != ".." &&
+        Env::Default()->GetFileSize("/tmp/db_checkpoint/" + file, &size).ok()) {
+      total_bytes += size;
+    }
+  }
+  EXPECT_EQ(fetched_bytes, total_bytes);
+
+  DB* db;
+  EXPECT_TRUE(DB::Open(Options(), "/tmp/db_checkpoint", &db).ok());
+  shared_ptr<DB> db_slave(db);
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys / 2);
+
+  // replicating picks up from the checkpoint
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+  for (uint32_t i = n_keys / 2; i < n_keys; ++i) {
+    write(i);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    EXPECT_TRUE(db_slave->Get(read_options, str + "key", &value).ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+}
+
+TEST(RocksDBReplicatorTest, ShardedExecutors) {
+  FLAGS_replicator_executor_shards = 3;
+  int16_t master_port = 9124;
+  int16_t slave_port = 9125;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  const uint32_t n_dbs = 4;
+  vector<shared_ptr<DB>> db_masters;
+  vector<shared_ptr<DB>> db_slaves;
+  SocketAddress addr_master("127.0.0.1", master_port);
+  for (uint32_t i = 0; i < n_dbs; ++i) {
+    auto db_name = "shard" + to_string(i);
+    db_masters.push_back(cleanAndOpenDB("/tmp/db_master" + to_string(i)));
+    db_slaves.push_back(cleanAndOpenDB("/tmp/db_slave" + to_string(i)));
+    EXPECT_EQ(master.replicator_->addDB(db_name, db_masters.back(),
+                                        DBRole::MASTER),
+              ReturnCode::OK);
+    EXPECT_EQ(slave.replicator_->addDB(db_name, db_slaves.back(),
+                                       DBRole::SLAVE, addr_master),
+              ReturnCode::OK);
+  }
+
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    for (uint32_t j = 0; j < n_dbs; ++j) {
+      WriteBatch updates;
+      auto str = to_string(i);
+      updates.Put(str + "key", str + "value");
+      EXPECT_EQ(master.replicator_->write("shard" + to_string(j), options,
+                                          &updates),
+                ReturnCode::OK);
+    }
+  }
+
+  ReadOptions read_options;
+  for (uint32_t j = 0; j < n_dbs; ++j) {
+    while (db_slaves[j]->GetLatestSequenceNumber() < n_keys) {
+      sleep_for(milliseconds(100));
+    }
+
+    EXPECT_EQ(db_slaves[j]->GetLatestSequenceNumber(), n_keys);
+    for (uint32_t i = 0; i < n_keys; ++i) {
+      auto str = to_string(i);
+      string value;
+      EXPECT_TRUE(db_slaves[j]->Get(read_options, str + "key", &value).ok());
+      EXPECT_EQ(value, str + "value");
+    }
+
+    EXPECT_EQ(slave.replicator_->removeDB("shard" + to_string(j)),
+              ReturnCode::OK);
+  }
+
+  FLAGS_replicator_executor_shards = 0;
+}
+
+TEST(RocksDBReplicatorTest, ReadYourWrites) {
+  int16_t master_port = 9126;
+  int16_t slave_port = 9127;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  RocksDBReplicator::ReplicatedDB* replicated_db_master;
+  RocksDBReplicator::ReplicatedDB* replicated_db_slave;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), &replicated_db_master),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master, &replicated_db_slave),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < 100; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    rocksdb::SequenceNumber seq_no;
+    EXPECT_TRUE(replicated_db_master->Write(options, &updates, &seq_no).ok());
+
+    auto result =
+      replicated_db_slave->Get(read_options, str + "key", seq_no).get();
+    EXPECT_TRUE(result.first.ok());
+    EXPECT_EQ(result.second, str + "value");
+
+    auto results = replicated_db_slave->MultiGet(
+      read_options, {str + "key", "non_exist_key"}, seq_no).get();
+    EXPECT_TRUE(results.first[0].ok());
+    EXPECT_EQ(results.second[0], str + "value");
+    EXPECT_TRUE(results.first[1].IsNotFound());
+
+    auto iter = replicated_db_slave->NewIterator(read_options, seq_no).get();
+    iter->Seek(str + "key");
+    EXPECT_TRUE(iter->Valid());
+    EXPECT_EQ(iter->value().ToString(), str + "value");
+  }
+
+  // never applied
+  auto seq_no = db_master->GetLatestSequenceNumber() + 1;
+  EXPECT_THROW(replicated_db_slave->Get(read_options, "0key", seq_no).get(),
+               ReturnCode);
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+}
+
+TEST(RocksDBReplicatorTest, WriteGroupCommit) {
+  FLAGS_replicator_write_group_commit_us = 500;
+  int16_t master_port = 9128;
+  int16_t slave_port = 9129;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  RocksDBReplicator::ReplicatedDB* replicated_db_master;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), &replicated_db_master),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  const uint32_t n_threads = 8;
+  const uint32_t n_writes = 100;
+  vector<vector<rocksdb::SequenceNumber>> seq_nos(n_threads);
+  vector<std::thread> threads;
+  for (uint32_t i = 0; i < n_threads; ++i) {
+    threads.emplace_back([i, &seq_nos, replicated_db_master] {
+        WriteOptions options;
+        for (uint32_t j = 0; j < n_writes; ++j) {
+          WriteBatch updates;
+          auto str = to_string(i) + "_" + to_string(j);
+          // two updates per write
+          updates.Put(str + "key", str + "value");
+          updates.Put(str + "key2", str + "value2");
+          rocksdb::SequenceNumber seq_no;
+          EXPECT_TRUE(
+            replicated_db_master->Write(options, &updates, &seq_no).ok());
+          seq_nos[i].push_back(seq_no);
+        }
+      });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // each write is handed the seq # of its own last update
+  const uint64_t n_updates = n_threads * n_writes * 2;
+  EXPECT_EQ(db_master->GetLatestSequenceNumber(), n_updates);
+  vector<rocksdb::SequenceNumber> all_seq_nos;
+  for (const auto& thread_seq_nos : seq_nos) {
+    EXPECT_TRUE(std::is_sorted(thread_seq_nos.begin(), thread_seq_nos.end()));
+    all_seq_nos.insert(all_seq_nos.end(), thread_seq_nos.begin(),
+                       thread_seq_nos.end());
+  }
+  std::sort(all_seq_nos.begin(), all_seq_nos.end());
+  for (uint32_t i = 0; i < all_seq_nos.size(); ++i) {
+    EXPECT_EQ(all_seq_nos[i], 2 * (i + 1));
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_updates) {
+    sleep_for(milliseconds(100));
+  }
+
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_threads; ++i) {
+    for (uint32_t j = 0; j < n_writes; ++j) {
+      auto str = to_string(i) + "_" + to_string(j);
+      string value;
+      EXPECT_TRUE(db_slave->Get(read_options, str + "key", &value).ok());
+      EXPECT_EQ(value, str + "value");
+      EXPECT_TRUE(db_slave->Get(read_options, str + "key2", &value).ok());
+      EXPECT_EQ(value, str + "value2");
+    }
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_write_group_commit_us = 0;
+}
+
+TEST(RocksDBReplicatorTest, ChainReplication) {
+  FLAGS_replicator_replication_mode = 3;
+  FLAGS_replicator_quorum_size = 2;
+  FLAGS_replicator_timeout_ms = 1000;
+  int16_t master_port = 9130;
+  int16_t slave1_port = 9131;
+  int16_t slave2_port = 9132;
+  Host master(master_port);
+  Host slave1(slave1_port);
+  Host slave2(slave2_port);
+
+  // master -> slave1 -> slave2
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave1 = cleanAndOpenDB("/tmp/db_slave1");
+  auto db_slave2 = cleanAndOpenDB("/tmp/db_slave2");
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  EXPECT_EQ(slave1.replicator_->addDB("shard1", db_slave1, DBRole::SLAVE,
+                                      SocketAddress("127.0.0.1", master_port)),
+            ReturnCode::OK);
+  EXPECT_EQ(slave2.replicator_->addDB("shard1", db_slave2, DBRole::SLAVE,
+                                      SocketAddress("127.0.0.1", slave1_port)),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  auto write = [&master, &options] (uint32_t i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    return master.replicator_->write("shard1", options, &updates);
+  };
+
+  // slave2 is counted towards the quorum through slave1
+  for (uint32_t i = 0; i < 10; ++i) {
+    EXPECT_EQ(write(i), ReturnCode::OK);
+  }
+
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < 10; ++i) {
+    auto str = to_string(i);
+    string value;
+    EXPECT_TRUE(db_slave2->Get(read_options, str + "key", &value).ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  EXPECT_EQ(slave2.replicator_->removeDB("shard1"), ReturnCode::OK);
+  EXPECT_EQ(write(10), ReturnCode::WAIT_SLAVE_TIMEOUT);
+
+  EXPECT_EQ(slave1.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_replication_mode = 0;
+  FLAGS_replicator_timeout_ms = 5 * 1000;
+}
+
+TEST(RocksDBReplicatorTest, LagGauges) {
+  // idle Slaves hear from the Master every 200ms
+  FLAGS_replicator_max_server_wait_time_ms = 200;
+  FLAGS_replicator_max_idle_server_wait_time_ms = 200;
+  int16_t master_port = 9133;
+  int16_t slave_port = 9134;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  RocksDBReplicator::ReplicatedDB* replicated_db_master;
+  RocksDBReplicator::ReplicatedDB* replicated_db_slave;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), &replicated_db_master),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master, &replicated_db_slave),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  for (uint32_t i = 0; i < 100; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < 100) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(replicated_db_slave->seqNoLag(), 0);
+  EXPECT_LT(replicated_db_slave->msSinceLastApply(), 1000);
+  EXPECT_EQ(replicated_db_master->seqNoLag(), 0);
+  EXPECT_EQ(replicated_db_master->msSinceLastApply(), 0);
+
+  // An idle Slave stays healthy as long as it hears from its upstream
+  sleep_for(milliseconds(1500));
+  EXPECT_LT(replicated_db_slave->msSinceLastApply(), 1000);
+
+  // but a stuck one doesn't
+  EXPECT_EQ(master.replicator_->removeDB("shard1"), ReturnCode::OK);
+  sleep_for(milliseconds(1500));
+  EXPECT_GE(replicated_db_slave->msSinceLastApply(), 1000);
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_max_server_wait_time_ms = 10 * 1000;
+  FLAGS_replicator_max_idle_server_wait_time_ms = 60 * 1000;
+}
+
+TEST(RocksDBReplicatorTest, AdaptiveServerWait) {
+  FLAGS_replicator_max_server_wait_time_ms = 100;
+  FLAGS_replicator_max_idle_server_wait_time_ms = 5 * 1000;
+  for (bool multiplex : { false, true }) {
+    FLAGS_replicator_multiplex_pulls = multiplex;
+    int16_t master_port = 9135;
+    int16_t slave_port = 9136;
+    Host master(master_port);
+    Host slave(slave_port);
+
+    auto db_master = cleanAndOpenDB("/tmp/db_master");
+    auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+    EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+              ReturnCode::OK);
+    SocketAddress addr_master("127.0.0.1", master_port);
+    EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                       addr_master),
+              ReturnCode::OK);
+
+    WriteOptions options;
+    for (uint32_t i = 0; i < 5; ++i) {
+      // idle long enough for the Slave to wait the longest
+      sleep_for(milliseconds(2000));
+      WriteBatch updates;
+      auto str = to_string(i);
+      updates.Put(str + "key", str + "value");
+      EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+                ReturnCode::OK);
+
+      // Long waits don't delay updates
+      sleep_for(milliseconds(500));
+      EXPECT_EQ(db_slave->GetLatestSequenceNumber(), i + 1);
+    }
+
+    EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  }
+
+  FLAGS_replicator_multiplex_pulls = false;
+  FLAGS_replicator_max_server_wait_time_ms = 10 * 1000;
+  FLAGS_replicator_max_idle_server_wait_time_ms = 60 * 1000;
+}
+
+TEST(RocksDBReplicatorTest, WALLessSlave) {
+  FLAGS_replicator_slave_disable_wal = true;
+  int16_t master_port = 9137;
+  int16_t slave_port = 9138;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  // Nothing has been written to the WAL of the Slave
+  VectorLogPtr wal_files;
+  EXPECT_TRUE(db_slave->GetSortedWalFiles(wal_files).ok());
+  for (const auto& file : wal_files) {
+    EXPECT_EQ(file->SizeFileBytes(), 0);
+  }
+
+  // Removing the Slave flushes it, so it restarts from where it was
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  db_slave.reset();
+  DB* db;
+  EXPECT_TRUE(DB::Open(Options(), "/tmp/db_slave", &db).ok());
+  db_slave.reset(db);
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys);
+  string value;
+  EXPECT_TRUE(db_slave->Get(ReadOptions(), "99key", &value).ok());
+  EXPECT_EQ(value, "99value");
+
+  // Nothing was lost, so it can be added back
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+
+  EXPECT_EQ(master.replicator_->removeDB("shard1"), ReturnCode::OK);
+  FLAGS_replicator_slave_disable_wal = false;
+}
+
+// An S3 bucket in memory, for the calls shipping and applying WAL segments
+class FakeS3Util : public common::S3Util {
+ public:
+  FakeS3Util() : common::S3Util("bucket"), objects() {}
+
+  common::GetObjectResponse getObject(const string& key,
+                                      std::iostream* out) override {
+    auto itor = objects.find(key);
+    if (itor == objects.end()) {
+      return common::GetObjectResponse(false, "NoSuchKey");
+    }
+    *out << itor->second;
+    return common::GetObjectResponse(true, "");
+  }
+
+  // One key per page, to go through the continuations
+  common::ListObjectsResponseV2 listObjectsV2(
+      const string& prefix, const string& delimiter,
+      const string& marker) override {
+    auto itor = objects.upper_bound(marker);
+    for (; itor != objects.end(); ++itor) {
+      if (itor->first.compare(0, prefix.size(), prefix) == 0) {
+        return common::ListObjectsResponseV2(
+          common::ListObjectsResponseV2Body({itor->first}, itor->first), "");
+      }
+    }
+    return common::ListObjectsResponseV2(
+      common::ListObjectsResponseV2Body({}, ""), "");
+  }
+
+  common::ListObjectsResponseV2 listAllObjects(
+      const string& prefix, const string& delimiter) override {
+    vector<string> keys;
+    for (const auto& object : objects) {
+      if (object.first.compare(0, prefix.size(), prefix) == 0) {
+        keys.push_back(object.first);
+      }
+    }
+    return common::ListObjectsResponseV2(
+      common::ListObjectsResponseV2Body(keys, ""), "");
+  }
+
+  common::PutObjectResponse putObject(const string& key,
+                                      const string& local_path,
+                                      const string& tags) override {
+    std::ifstream file(local_path, std::ios::binary);
+    std::stringstream data;
+    data << file.rdbuf();
+    objects[key] = data.str();
+    return common::PutObjectResponse(true, "");
+  }
+
+  std::map<string, string> objects;
+};
+
+TEST(RocksDBReplicatorTest, WALSegmentKeys) {
+  using ReplicatedDB = RocksDBReplicator::ReplicatedDB;
+  const auto dir = ReplicatedDB::WALSegmentDir("prefix", "shard1");
+  EXPECT_EQ(dir, "prefix/shard1/");
+  EXPECT_EQ(ReplicatedDB::WALSegmentDir("prefix/", "shard1"), dir);
+
+  // Zero padded, so that they are listed in order
+  const auto key = ReplicatedDB::WALSegmentKey(dir, 1, 100);
+  EXPECT_EQ(key, dir + "00000000000000000001-00000000000000000100");
+  EXPECT_LT(key, ReplicatedDB::WALSegmentKey(dir, 11, 20));
+
+  rocksdb::SequenceNumber first_seq_no = 0;
+  rocksdb::SequenceNumber last_seq_no = 0;
+  EXPECT_TRUE(ReplicatedDB::ParseWALSegmentKey(key, &first_seq_no,
+                                               &last_seq_no));
+  EXPECT_EQ(first_seq_no, 1);
+  EXPECT_EQ(last_seq_no, 100);
+  EXPECT_TRUE(ReplicatedDB::ParseWALSegmentKey("5-5", &first_seq_no,
+                                               &last_seq_no));
+  EXPECT_EQ(first_seq_no, 5);
+  EXPECT_EQ(last_seq_no, 5);
+
+  for (const string bad_key : {"", "prefix/shard1/", "prefix/shard1/5",
+                               "prefix/shard1/5-", "prefix/shard1/6-5",
+                               "prefix/shard1/5-6.tmp", "prefix/shard1/a-b"}) {
+    EXPECT_FALSE(ReplicatedDB::ParseWALSegmentKey(bad_key, &first_seq_no,
+                                                  &last_seq_no)) << bad_key;
+  }
+}
+
+TEST(RocksDBReplicatorTest, S3WALRoundTrip) {
+  int16_t master_port = 9143;
+  int16_t replica_port = 9144;
+  Host master(master_port);
+  Host replica(replica_port);
+  auto s3_util = std::make_shared<FakeS3Util>();
+  const string s3_prefix = "wal";
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_replica = cleanAndOpenDB("/tmp/db_slave");
+  RocksDBReplicator::ReplicatedDB* replicated_db_master;
+  RocksDBReplicator::ReplicatedDB* replicated_db_replica;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), &replicated_db_master),
+            ReturnCode::OK);
+  EXPECT_EQ(replica.replicator_->addS3ReplicaDB("shard1", db_replica, s3_util,
+                                                s3_prefix,
+                                                &replicated_db_replica),
+            ReturnCode::OK);
+
+  // Shipping starts from the latest seq # of the master
+  EXPECT_TRUE(replicated_db_master->shipWALToS3(s3_util.get(),
+                                                s3_prefix).ok());
+  EXPECT_TRUE(s3_util->objects.empty());
+
+  WriteOptions options;
+  auto write_keys = [&] (uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; ++i) {
+      WriteBatch updates;
+      auto str = to_string(i);
+      updates.Put(str + "key", str + "value");
+      EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+                ReturnCode::OK);
+    }
+  };
+  auto expect_replicated = [&] (uint32_t n_keys) {
+    EXPECT_EQ(db_replica->GetLatestSequenceNumber(), n_keys);
+    for (uint32_t i = 0; i < n_keys; ++i) {
+      string value;
+      auto str = to_string(i);
+      EXPECT_TRUE(db_replica->Get(ReadOptions(), str + "key", &value).ok());
+      EXPECT_EQ(value, str + "value");
+    }
+  };
+
+  write_keys(0, 50);
+  EXPECT_TRUE(replicated_db_master->shipWALToS3(s3_util.get(),
+                                                s3_prefix).ok());
+  EXPECT_FALSE(s3_util->objects.empty());
+  for (const auto& object : s3_util->objects) {
+    rocksdb::SequenceNumber first_seq_no;
+    rocksdb::SequenceNumber last_seq_no;
+    EXPECT_EQ(object.first.find("wal/shard1/"), 0);
+    EXPECT_TRUE(RocksDBReplicator::ReplicatedDB::ParseWALSegmentKey(
+      object.first, &first_seq_no, &last_seq_no));
+  }
+  EXPECT_TRUE(replicated_db_replica->applyWALFromS3(s3_util.get(),
+                                                    s3_prefix).ok());
+  expect_replicated(50);
+
+  // The next segments continue from the last ones, and are applied after
+  // the last one applied
+  write_keys(50, 100);
+  EXPECT_TRUE(replicated_db_master->shipWALToS3(s3_util.get(),
+                                                s3_prefix).ok());
+  EXPECT_TRUE(replicated_db_replica->applyWALFromS3(s3_util.get(),
+                                                    s3_prefix).ok());
+  expect_replicated(100);
+
+  // Applying again is a no-op
+  EXPECT_TRUE(replicated_db_replica->applyWALFromS3(s3_util.get(),
+                                                    s3_prefix).ok());
+  expect_replicated(100);
+  EXPECT_EQ(replica.replicator_->removeDB("shard1"), ReturnCode::OK);
+  db_replica.reset();
+
+  // A new replica can't continue if the first segments are gone
+  s3_util->objects.erase(s3_util->objects.begin());
+  auto db_new_replica = cleanAndOpenDB("/tmp/db_slave");
+  EXPECT_EQ(replica.replicator_->addS3ReplicaDB("shard1", db_new_replica,
+                                                s3_util, s3_prefix,
+                                                &replicated_db_replica),
+            ReturnCode::OK);
+  EXPECT_TRUE(replicated_db_replica->applyWALFromS3(
+    s3_util.get(), s3_prefix).IsIncomplete());
+  EXPECT_EQ(db_new_replica->GetLatestSequenceNumber(), 0);
+
+  EXPECT_EQ(replica.replicator_->removeDB("shard1"), ReturnCode::OK);
+  EXPECT_EQ(master.replicator_->removeDB("shard1"), ReturnCode::OK);
+}
+
+TEST(RocksDBReplicatorTest, PartialReplica) {
+  int16_t master_port = 9139;
+  int16_t slave_port = 9140;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  RocksDBReplicator::ReplicatedDB* replicated_db_slave;
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master, &replicated_db_slave),
+            ReturnCode::OK);
+  replicated_db_slave->setReplicationKeyPrefixes({"summary_", "meta_"});
+
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put("summary_" + str, str + "summary");
+    updates.Put("detail_" + str, str + "detail");
+    updates.Delete("meta_" + str);
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  // The Slave takes as many sequence #s as the Master
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 3) {
+    sleep_for(milliseconds(100));
+  }
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 3);
+
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    EXPECT_TRUE(db_slave->Get(read_options, "summary_" + str, &value).ok());
+    EXPECT_EQ(value, str + "summary");
+    EXPECT_TRUE(
+      db_slave->Get(read_options, "detail_" + str, &value).IsNotFound());
+  }
+
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  EXPECT_EQ(master.replicator_->removeDB("shard1"), ReturnCode::OK);
+}
+
 TEST(RocksDBReplicatorTest, Stress) {
   int16_t port_1 = 8081;
   int16_t port_2 = 8082;
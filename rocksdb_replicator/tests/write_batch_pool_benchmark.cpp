@@ -0,0 +1,171 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "folly/Benchmark.h"
+#include "folly/io/IOBuf.h"
+#include "gflags/gflags.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_replicator/write_batch_pool.h"
+
+DEFINE_int32(allocation_count_requests, 10000,
+             "The requests to count the allocations of, after the benchmarks");
+
+using replicator::WriteBatchPool;
+
+namespace {
+
+std::atomic<uint64_t> n_allocations(0);
+
+}  // namespace
+
+// Count all allocations of the process
+void* operator new(size_t size) {
+  n_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+const std::string kKey = "counter_name_0123456789";
+const uint64_t kValue = 42;
+
+// A setCounter() request
+void PutNew() {
+  rocksdb::WriteBatch batch;
+  batch.Put(kKey, rocksdb::Slice(reinterpret_cast<const char*>(&kValue),
+                                 sizeof(kValue)));
+  folly::doNotOptimizeAway(batch.GetDataSize());
+}
+
+void PutPooled() {
+  auto batch = WriteBatchPool::Get();
+  batch->Put(kKey, rocksdb::Slice(reinterpret_cast<const char*>(&kValue),
+                                  sizeof(kValue)));
+  folly::doNotOptimizeAway(batch->GetDataSize());
+}
+
+// An update received by a slave, in a chain of 4KB buffers
+const folly::IOBuf& RawData() {
+  static auto raw_data = [] {
+    rocksdb::WriteBatch batch;
+    const std::string value(100, 'v');
+    for (int i = 0; i < 100; ++i) {
+      batch.Put(kKey + std::to_string(i), value);
+    }
+
+    const auto& rep = batch.Data();
+    std::unique_ptr<folly::IOBuf> chain;
+    const size_t kBufSize = 4096;
+    for (size_t offset = 0; offset < rep.size(); offset += kBufSize) {
+      auto buf = folly::IOBuf::copyBuffer(
+        rep.data() + offset, std::min(kBufSize, rep.size() - offset));
+      if (chain) {
+        chain->prependChain(std::move(buf));
+      } else {
+        chain = std::move(buf);
+      }
+    }
+    return chain;
+  }();
+  return *raw_data;
+}
+
+void ApplyNew() {
+  const auto& raw_data = RawData();
+  std::string rep;
+  rep.reserve(raw_data.computeChainDataLength());
+  for (const auto range : raw_data) {
+    rep.append(reinterpret_cast<const char*>(range.data()), range.size());
+  }
+  rocksdb::WriteBatch batch(std::move(rep));
+  batch.PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&kValue),
+                                  sizeof(kValue)));
+  folly::doNotOptimizeAway(batch.Count());
+}
+
+void ApplyPooled() {
+  auto batch = WriteBatchPool::Get(RawData());
+  batch->PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&kValue),
+                                   sizeof(kValue)));
+  folly::doNotOptimizeAway(batch->Count());
+}
+
+void Run(const std::function<void()>& request, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    request();
+  }
+}
+
+double AllocationsPerRequest(const std::function<void()>& request) {
+  // warm up the pool
+  request();
+  const auto start = n_allocations.load();
+  Run(request, FLAGS_allocation_count_requests);
+  return static_cast<double>(n_allocations.load() - start) /
+    FLAGS_allocation_count_requests;
+}
+
+}  // namespace
+
+BENCHMARK(SetCounterNewBatch, n) {
+  Run(PutNew, n);
+}
+
+BENCHMARK_RELATIVE(SetCounterPooledBatch, n) {
+  Run(PutPooled, n);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(ApplyUpdateNewBatch, n) {
+  Run(ApplyNew, n);
+}
+
+BENCHMARK_RELATIVE(ApplyUpdatePooledBatch, n) {
+  Run(ApplyPooled, n);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+
+  printf("\n%-30s %20s\n", "request", "allocations/request");
+  printf("%-30s %20.2f\n", "SetCounterNewBatch", AllocationsPerRequest(PutNew));
+  printf("%-30s %20.2f\n", "SetCounterPooledBatch",
+         AllocationsPerRequest(PutPooled));
+  printf("%-30s %20.2f\n", "ApplyUpdateNewBatch",
+         AllocationsPerRequest(ApplyNew));
+  printf("%-30s %20.2f\n", "ApplyUpdatePooledBatch",
+         AllocationsPerRequest(ApplyPooled));
+}
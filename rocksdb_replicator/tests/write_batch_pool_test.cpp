@@ -0,0 +1,98 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <string>
+#include <thread>
+
+#include "folly/io/IOBuf.h"
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_replicator/write_batch_pool.h"
+
+DECLARE_int32(write_batch_pool_max_bytes);
+
+using replicator::WriteBatchPool;
+
+TEST(WriteBatchPoolTest, Reuse) {
+  rocksdb::WriteBatch* reused;
+  {
+    auto batch = WriteBatchPool::Get();
+    batch->Put("key", std::string(10000, 'v'));
+    reused = batch.get();
+  }
+
+  auto batch = WriteBatchPool::Get();
+  EXPECT_EQ(batch.get(), reused);
+  // cleared, with the rep grown before
+  EXPECT_EQ(batch->Count(), 0u);
+  EXPECT_GE(batch->Data().capacity(), 10000u);
+  batch->Put("key", "value");
+  EXPECT_EQ(batch->Count(), 1u);
+}
+
+TEST(WriteBatchPoolTest, FromRawData) {
+  rocksdb::WriteBatch original;
+  original.Put("key1", "value1");
+  original.Delete("key2");
+  original.Merge("key3", "value3");
+
+  // a chain of 2 buffers
+  const auto& rep = original.Data();
+  auto raw_data = folly::IOBuf::copyBuffer(rep.data(), 10);
+  raw_data->prependChain(
+    folly::IOBuf::copyBuffer(rep.data() + 10, rep.size() - 10));
+
+  auto batch = WriteBatchPool::Get(*raw_data);
+  EXPECT_EQ(batch->Data(), rep);
+  EXPECT_EQ(batch->Count(), 3u);
+  batch->PutLogData("log");
+  EXPECT_EQ(batch->Count(), 3u);
+}
+
+TEST(WriteBatchPoolTest, LargeBatchesAreFreed) {
+  {
+    auto batch = WriteBatchPool::Get();
+    batch->Put("key", std::string(FLAGS_write_batch_pool_max_bytes, 'v'));
+  }
+
+  auto batch = WriteBatchPool::Get();
+  EXPECT_LE(batch->Data().capacity(),
+            static_cast<size_t>(FLAGS_write_batch_pool_max_bytes));
+}
+
+TEST(WriteBatchPoolTest, SharedByThreads) {
+  FLAGS_write_batch_pool_size = 1;
+  rocksdb::WriteBatch* shared = nullptr;
+  std::thread producer([&shared] {
+      auto cached = WriteBatchPool::Get();
+      auto overflow = WriteBatchPool::Get();
+      shared = overflow.get();
+      cached.reset();
+      // the cache of this thread is full
+      overflow.reset();
+    });
+  producer.join();
+
+  std::thread consumer([shared] {
+      // from the shared pool, as this thread has no cache
+      EXPECT_EQ(WriteBatchPool::Get().get(), shared);
+    });
+  consumer.join();
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
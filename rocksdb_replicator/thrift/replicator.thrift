@@ -18,6 +18,12 @@
 
 namespace cpp2 replicator
 
+enum CompressionType {
+  NONE = 0,
+  LZ4 = 1,
+  ZSTD = 2,
+}
+
 struct ReplicateRequest {
   # The largest sequence number currently in the local DB. Request for updates
   # of sequence (seq_no + 1) and larger
@@ -36,6 +42,51 @@ struct ReplicateRequest {
   # uppper limit set by client side.
   # A value of 0 means no limit
   4: required i32 max_updates,
+
+  # The upper limit of the total size in bytes of the updates a response may
+  # contain. A response always contains at least one update if any is
+  # available, even when the first update alone exceeds this limit.
+  # A value of 0 means no limit
+  5: i64 max_bytes = 0,
+
+  # If not 0, the client asks the server to push updates to it through a
+  # number of requests with the same stream_id parked on the server. Each of
+  # them is replied once new updates are available, continuing from where the
+  # last reply for this stream stopped. seq_no is only used for the first
+  # request of a stream.
+  6: i64 stream_id = 0,
+
+  # The largest sequence number the client has committed, which may be
+  # smaller than seq_no if the client asks for more updates before applying
+  # the ones it has received. A negative value means seq_no.
+  7: i64 committed_seq_no = -1,
+
+  # Identifies the client, so that the server can tell how far each of its
+  # clients has committed. Empty means unknown.
+  8: binary replica_id = "",
+
+  # The client accepts Update.raw_data compressed with this type. The server
+  # may still reply uncompressed, e.g., for small responses.
+  9: CompressionType compression = CompressionType.NONE,
+
+  # replica_id -> the largest sequence number committed, for the replicas
+  # replicating from the client (and from their own downstream replicas) when
+  # the client is a Slave serving a replication chain or tree. The server
+  # counts them towards the quorum in replication mode 3.
+  10: map<binary, i64> downstream_committed_seq_nos = {},
+
+  # If not empty, the client is a partial replica which only wants the keys
+  # with one of these prefixes. The server rewrites each update down to the
+  # records of these keys, replacing every other record with a Delete of the
+  # empty key, so that the update still takes as many sequence numbers.
+  11: list<binary> key_prefixes = [],
+  # The client applies updates with no_slowdown, and the last one it applied
+  # was rejected by a write stall of its DB. The server then keeps its
+  # responses small until the stall is over.
+  12: bool write_stalled = false,
+  # The bytes per second the client has applied lately. A negative value means
+  # unknown.
+  13: i64 apply_bytes_per_sec = -1,
 }
 
 typedef binary (cpp.type = "folly::IOBuf") IOBuf
@@ -54,12 +105,40 @@ struct ReplicateResponse {
   # updates is an ordered continuous range of updates starting from the seq_no
   # specified in ReplicateRequest.
   1: required list<Update> updates,
+
+  # Whether updates are pushed for ReplicateRequest.stream_id. If true, updates
+  # start from start_seq_no + 1 instead of ReplicateRequest.seq_no + 1.
+  2: bool pushed = false,
+  3: i64 start_seq_no = 0,
+
+  # How the raw_data of all updates is compressed
+  4: CompressionType compression = CompressionType.NONE,
+
+  # The largest sequence number in the server's DB when the response was
+  # built, so that clients can tell how far behind they are. A negative value
+  # means unknown.
+  5: i64 latest_seq_no = -1,
+}
+
+struct ReplicateMultiRequest {
+  # Requests for a set of dbs replicating from the same upstream host. The
+  # max_wait_ms of each individual request is ignored.
+  1: required list<ReplicateRequest> requests,
+
+  # If updates are available for any of the requested dbs, the server will
+  # reply immediately. Otherwise, it will wait for this amount of time or until
+  # updates show up for one of them.
+  # A value of 0 means no wait at all.
+  2: required i32 max_wait_ms,
 }
 
 enum ErrorCode {
   OTHER = 0,
   SOURCE_NOT_FOUND = 1, # could not find the upstream db
   SOURCE_READ_ERROR = 2,
+  # the WAL needed has been purged from the upstream db, so the client has to
+  # be rebuilt from a checkpoint
+  SOURCE_WAL_PURGED = 3,
 }
 
 exception ReplicateException {
@@ -67,7 +146,64 @@ exception ReplicateException {
   2: required ErrorCode code,
 }
 
+struct ReplicateError {
+  1: required string msg,
+  2: required ErrorCode code,
+}
+
+struct ReplicateMultiResponse {
+  # db_name -> updates, for the dbs with updates available. Dbs missing from
+  # both maps have no new updates.
+  1: required map<binary, ReplicateResponse> responses,
+
+  # db_name -> error, for the dbs failed to be served.
+  2: required map<binary, ReplicateError> errors,
+}
+
+struct CheckpointRequest {
+  1: required binary db_name,
+}
+
+struct CheckpointFile {
+  1: required string name,
+  2: required i64 size,
+}
+
+struct CheckpointResponse {
+  # Identifies the checkpoint in ReadCheckpointFileRequest. The server removes
+  # checkpoints not read for a while.
+  1: required i64 checkpoint_id,
+  2: required list<CheckpointFile> files,
+}
+
+struct ReadCheckpointFileRequest {
+  1: required binary db_name,
+  2: required i64 checkpoint_id,
+  3: required string file_name,
+  4: required i64 offset,
+  # The server may return fewer bytes
+  5: required i64 max_bytes,
+}
+
+struct ReadCheckpointFileResponse {
+  1: required IOBuf data,
+  # Whether data reaches the end of the file
+  2: required bool eof,
+}
+
 service Replicator {
   ReplicateResponse replicate(1:ReplicateRequest request)
       throws (1:ReplicateException e)
+
+  # Pull updates for multiple dbs with a single long-poll.
+  ReplicateMultiResponse replicateMulti(1:ReplicateMultiRequest request)
+
+  # Create a checkpoint of a db, for clients too far behind to catch up from
+  # its WAL to copy with readCheckpointFile().
+  CheckpointResponse createCheckpoint(1:CheckpointRequest request)
+      throws (1:ReplicateException e)
+
+  ReadCheckpointFileResponse readCheckpointFile(
+      1:ReadCheckpointFileRequest request)
+      throws (1:ReplicateException e)
 }
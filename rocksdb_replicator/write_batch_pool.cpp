@@ -0,0 +1,115 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/write_batch_pool.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "folly/MPMCQueue.h"
+
+DEFINE_int32(write_batch_pool_size, 16,
+             "The WriteBatches each thread keeps for reuse, 0 to disable "
+             "pooling");
+DEFINE_int32(write_batch_pool_shared_size, 1024,
+             "The WriteBatches kept for reuse by all threads, once the cache "
+             "of the thread releasing them is full");
+DEFINE_int32(write_batch_pool_reserved_bytes, 4096,
+             "The bytes reserved for the rep of each new pooled WriteBatch");
+DEFINE_int32(write_batch_pool_max_bytes, 1 << 20,
+             "Pooled WriteBatches whose rep has grown over this many bytes "
+             "are freed rather than reused");
+
+namespace {
+
+// Set once the cache of this thread is gone, for batches released by the
+// destructors of other thread locals
+thread_local bool local_pool_destroyed = false;
+
+// The cache of this thread, freed with it
+struct LocalPool {
+  ~LocalPool() {
+    local_pool_destroyed = true;
+    for (auto batch : batches) {
+      delete batch;
+    }
+  }
+
+  std::vector<rocksdb::WriteBatch*> batches;
+};
+
+thread_local LocalPool local_pool;
+
+folly::MPMCQueue<rocksdb::WriteBatch*>* SharedPool() {
+  // leaked, threads may release batches during shutdown
+  static auto pool = new folly::MPMCQueue<rocksdb::WriteBatch*>(
+    std::max(FLAGS_write_batch_pool_shared_size, 1));
+  return pool;
+}
+
+}  // namespace
+
+namespace replicator {
+
+WriteBatchPool::Handle WriteBatchPool::Get() {
+  rocksdb::WriteBatch* batch = nullptr;
+  if (!local_pool_destroyed && !local_pool.batches.empty()) {
+    batch = local_pool.batches.back();
+    local_pool.batches.pop_back();
+  } else if (FLAGS_write_batch_pool_size <= 0 ||
+             !SharedPool()->read(batch)) {
+    batch = new rocksdb::WriteBatch(
+      std::max(FLAGS_write_batch_pool_reserved_bytes, 0));
+  }
+
+  return Handle(batch);
+}
+
+void WriteBatchPool::Recycler::operator()(rocksdb::WriteBatch* batch) const {
+  if (batch == nullptr) {
+    return;
+  }
+
+  if (FLAGS_write_batch_pool_size <= 0 ||
+      batch->Data().capacity() >
+        static_cast<size_t>(FLAGS_write_batch_pool_max_bytes)) {
+    delete batch;
+    return;
+  }
+
+  // Clear() keeps the capacity of the rep
+  batch->Clear();
+  if (!local_pool_destroyed &&
+      local_pool.batches.size() <
+        static_cast<size_t>(FLAGS_write_batch_pool_size)) {
+    local_pool.batches.push_back(batch);
+  } else if (!SharedPool()->write(batch)) {
+    delete batch;
+  }
+}
+
+std::string WriteBatchPool::TakeRep(rocksdb::WriteBatch* batch) {
+  // WriteBatch has no API to give up its rep, and Data() is the rep itself.
+  // Like WrapWriteBatch() in replicated_db.cpp, we take it over in place.
+  std::string rep;
+  rep.swap(const_cast<std::string&>(batch->Data()));
+  rep.clear();
+  return rep;
+}
+
+}  // namespace replicator
@@ -0,0 +1,88 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "folly/io/IOBuf.h"
+#include "gflags/gflags.h"
+#include "rocksdb/write_batch.h"
+
+DECLARE_int32(write_batch_pool_size);
+
+namespace replicator {
+
+/*
+ * WriteBatchPool recycles rocksdb::WriteBatch objects, and the reps they have
+ * grown, so writes in steady state allocate nothing for their batches.
+ *
+ * Each thread has a cache of up to --write_batch_pool_size batches. Batches
+ * released to a full cache go to a bounded pool shared by all threads, so
+ * batches built on one thread and released on another, e.g. the IO and the
+ * apply threads of a slave, still come back. Batches with reps grown over
+ * --write_batch_pool_max_bytes are freed instead.
+ *
+ * // Example usage
+ * auto batch = WriteBatchPool::Get();
+ * batch->Put(key, value);
+ * db->Write(options, batch.get());
+ * // batch goes back to the pool once it is out of scope
+ */
+class WriteBatchPool {
+ public:
+  struct Recycler {
+    void operator()(rocksdb::WriteBatch* batch) const;
+  };
+
+  using Handle = std::unique_ptr<rocksdb::WriteBatch, Recycler>;
+
+  // An empty batch
+  static Handle Get();
+
+  // A batch of the rep appended by fill(std::string* rep) to an empty string
+  // holding the buffer of a pooled batch
+  template <typename Fill>
+  static Handle Build(Fill&& fill) {
+    auto batch = Get();
+    auto rep = TakeRep(batch.get());
+    fill(&rep);
+    *batch = rocksdb::WriteBatch(std::move(rep));
+    return batch;
+  }
+
+  // A batch of the raw bytes of an update, copied exactly once
+  static Handle Get(const folly::IOBuf& raw_data) {
+    return Build([&raw_data] (std::string* rep) {
+        rep->reserve(raw_data.computeChainDataLength());
+        for (const auto range : raw_data) {
+          rep->append(reinterpret_cast<const char*>(range.data()),
+                      range.size());
+        }
+      });
+  }
+
+ private:
+  // Move the rep out of batch, which is left unusable until it is assigned.
+  // The returned string is empty, with the capacity of the rep.
+  static std::string TakeRep(rocksdb::WriteBatch* batch);
+};
+
+}  // namespace replicator
@@ -0,0 +1,240 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "tgrep/af_packet_capture.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <pcap.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace {
+
+// Frames never span blocks with TPACKET_V3, so this only needs to satisfy the
+// kernel's sanity checks on the ring layout
+const uint32_t kFrameSize = 2048;
+const uint32_t kBlockTimeoutMs = 10;
+const int kPollTimeoutMs = 100;
+const useconds_t kInFlightWaitUs = 1000;
+
+bool attachFilter(int fd, const std::string& filter) {
+  auto dead = pcap_open_dead(DLT_EN10MB, 65535);
+  if (dead == nullptr) {
+    LOG(ERROR) << "Failed to create pcap handle for filter compilation";
+    return false;
+  }
+
+  struct bpf_program fp;
+  if (pcap_compile(dead, &fp, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN)) {
+    LOG(ERROR) << "Could not compile filter string: " << filter << " "
+               << pcap_geterr(dead);
+    pcap_close(dead);
+    return false;
+  }
+
+  // struct bpf_insn has the same layout as struct sock_filter
+  struct sock_fprog prog;
+  prog.len = fp.bf_len;
+  prog.filter = reinterpret_cast<struct sock_filter*>(fp.bf_insns);
+  const auto ret =
+    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+  pcap_freecode(&fp);
+  pcap_close(dead);
+
+  if (ret) {
+    LOG(ERROR) << "Failed to attach filter: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+namespace tgrep {
+
+std::unique_ptr<AfPacketCapture> AfPacketCapture::create(
+    const std::string& dev,
+    uint32_t block_size,
+    uint32_t block_count,
+    const std::string& filter) {
+  if (block_size == 0 || block_size % getpagesize() != 0 ||
+      block_size % kFrameSize != 0 || block_count == 0) {
+    LOG(ERROR) << "Invalid ring layout: " << block_count << " blocks of "
+               << block_size << " bytes";
+    return nullptr;
+  }
+
+  const auto ifindex = if_nametoindex(dev.c_str());
+  if (ifindex == 0) {
+    LOG(ERROR) << "Unknown device " << dev;
+    return nullptr;
+  }
+
+  int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to create AF_PACKET socket: " << strerror(errno);
+    return nullptr;
+  }
+
+  // Attach the filter before binding, so no unfiltered frame gets in
+  if (!attachFilter(fd, filter)) {
+    close(fd);
+    return nullptr;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+    LOG(ERROR) << "Failed to set TPACKET_V3: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = block_size;
+  req.tp_block_nr = block_count;
+  req.tp_frame_size = kFrameSize;
+  req.tp_frame_nr = block_size / kFrameSize * block_count;
+  req.tp_retire_blk_tov = kBlockTimeoutMs;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+    LOG(ERROR) << "Failed to set up the rx ring: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+
+  const size_t ring_size = static_cast<size_t>(block_size) * block_count;
+  auto ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_LOCKED, fd, 0);
+  if (ring == MAP_FAILED) {
+    LOG(ERROR) << "Failed to mmap the rx ring: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) {
+    LOG(ERROR) << "Failed to bind to " << dev << ": " << strerror(errno);
+    munmap(ring, ring_size);
+    close(fd);
+    return nullptr;
+  }
+
+  return std::unique_ptr<AfPacketCapture>(new AfPacketCapture(
+    fd, static_cast<uint8_t*>(ring), block_size, block_count));
+}
+
+AfPacketCapture::AfPacketCapture(int fd, uint8_t* ring, uint32_t block_size,
+                                 uint32_t block_count)
+    : fd_(fd)
+    , ring_(ring)
+    , block_size_(block_size)
+    , block_count_(block_count)
+    , in_flight_(new std::atomic<bool>[block_count])
+    , stop_(false) {
+  for (uint32_t i = 0; i < block_count_; ++i) {
+    in_flight_[i].store(false);
+  }
+}
+
+AfPacketCapture::~AfPacketCapture() {
+  munmap(ring_, static_cast<size_t>(block_size_) * block_count_);
+  close(fd_);
+}
+
+bool AfPacketCapture::loop(const FrameCallback& callback) {
+  uint32_t current = 0;
+  uint64_t in_flight_waits = 0;
+
+  while (!stop_.load()) {
+    auto desc = reinterpret_cast<struct tpacket_block_desc*>(
+      ring_ + static_cast<size_t>(current) * block_size_);
+
+    // The block is still held since we last handed it out, and its status
+    // is still TP_STATUS_USER. Wait for it rather than handing it out again.
+    if (in_flight_[current].load(std::memory_order_acquire)) {
+      ++in_flight_waits;
+      usleep(kInFlightWaitUs);
+      continue;
+    }
+
+    if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      struct pollfd pfd;
+      pfd.fd = fd_;
+      pfd.events = POLLIN | POLLERR;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, kPollTimeoutMs) < 0 && errno != EINTR) {
+        LOG(ERROR) << "poll failed: " << strerror(errno);
+        return false;
+      }
+      continue;
+    }
+
+    // Packets handed out keep the block. The last one gone gives it back.
+    // It is in flight until then, so that the status is given back first.
+    auto in_flight = &in_flight_[current];
+    in_flight->store(true, std::memory_order_relaxed);
+    std::shared_ptr<void> block(desc, [in_flight](void* p) {
+      auto d = static_cast<struct tpacket_block_desc*>(p);
+      __atomic_store_n(&d->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      in_flight->store(false, std::memory_order_release);
+    });
+
+    auto hdr = reinterpret_cast<const struct tpacket3_hdr*>(
+      reinterpret_cast<const uint8_t*>(desc) +
+      desc->hdr.bh1.offset_to_first_pkt);
+    for (uint32_t i = 0; i < desc->hdr.bh1.num_pkts; ++i) {
+      struct timeval ts;
+      ts.tv_sec = hdr->tp_sec;
+      ts.tv_usec = hdr->tp_nsec / 1000;
+      callback(ts,
+               reinterpret_cast<const u_char*>(hdr) + hdr->tp_mac,
+               hdr->tp_snaplen,
+               block);
+
+      hdr = reinterpret_cast<const struct tpacket3_hdr*>(
+        reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_next_offset);
+    }
+
+    current = (current + 1) % block_count_;
+  }
+
+  struct tpacket_stats_v3 stats;
+  socklen_t len = sizeof(stats);
+  if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0) {
+    LOG(INFO) << "AF_PACKET ring received " << stats.tp_packets
+              << " packets, dropped " << stats.tp_drops
+              << ", froze " << stats.tp_freeze_q_cnt << " times, waited "
+              << in_flight_waits << " times for blocks in flight";
+  }
+
+  return true;
+}
+
+}  // namespace tgrep
@@ -0,0 +1,75 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <sys/time.h>
+#include <sys/types.h>
+
+namespace tgrep {
+
+/*
+ * Captures frames from a TPACKET_V3 AF_PACKET mmap ring.
+ *
+ * Frames are handed out in place, together with a reference to the ring
+ * block holding them. A block is given back to the kernel once the last
+ * reference to it is dropped, so frame data may be used without copying for
+ * as long as the block reference is kept. The capture waits for a block
+ * still referenced when the ring wraps around to it.
+ */
+class AfPacketCapture {
+ public:
+  using FrameCallback =
+    std::function<void(const struct timeval& ts,
+                       const u_char* frame,
+                       uint32_t len,
+                       const std::shared_ptr<void>& block)>;
+
+  // Open a ring of block_count blocks of block_size bytes on dev, only
+  // capturing frames matching the pcap filter. Returns nullptr on failure.
+  static std::unique_ptr<AfPacketCapture> create(const std::string& dev,
+                                                 uint32_t block_size,
+                                                 uint32_t block_count,
+                                                 const std::string& filter);
+
+  ~AfPacketCapture();
+
+  // Call callback for every captured frame until stop() is called.
+  // Returns false on error.
+  bool loop(const FrameCallback& callback);
+
+  // Make loop() return. Safe to call from a signal handler.
+  void stop() {
+    stop_.store(true);
+  }
+
+ private:
+  AfPacketCapture(int fd, uint8_t* ring, uint32_t block_size,
+                  uint32_t block_count);
+
+  const int fd_;
+  uint8_t* const ring_;
+  const uint32_t block_size_;
+  const uint32_t block_count_;
+  // Whether each block is still referenced since it was last handed out
+  std::unique_ptr<std::atomic<bool>[]> in_flight_;
+  std::atomic<bool> stop_;
+};
+
+}  // namespace tgrep
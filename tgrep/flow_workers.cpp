@@ -0,0 +1,314 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "tgrep/flow_workers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <tuple>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(stats_interval_sec, 10,
+             "With --stats, how often to print per method stats. 0 to only "
+             "print them at exit");
+
+DEFINE_int32(flow_idle_timeout_sec, 300,
+             "Flows and connections without packets for this long, in capture "
+             "time, are dropped. 0 to keep them forever");
+
+DECLARE_bool(stats);
+DECLARE_bool(replicator_stats);
+
+namespace {
+
+const int64_t kDoneUs = std::numeric_limits<int64_t>::max();
+
+// How often, in capture time, workers look for idle flows
+const int64_t kExpiryIntervalUs = 1000 * 1000;
+
+int64_t toUs(const struct timeval& ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_usec;
+}
+
+void idle() {
+  std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+}  // namespace
+
+namespace tgrep {
+
+FlowWorkers::FlowWorkers(uint32_t n_workers, uint32_t queue_size)
+    : workers_()
+    , latest_us_(0)
+    , dispatched_us_(0)
+    , printer_()
+    , reporter_mutex_()
+    , reporter_cv_()
+    , stopping_(false)
+    , last_report_(std::chrono::steady_clock::now())
+    , reporter_() {
+  CHECK_GT(n_workers, 0);
+  // ProducerConsumerQueue holds one element less than its size
+  CHECK_GT(queue_size, 1);
+
+  for (uint32_t i = 0; i < n_workers; ++i) {
+    workers_.emplace_back(new Worker(queue_size));
+  }
+
+  for (auto& worker : workers_) {
+    auto w = worker.get();
+    worker->thread = std::thread([this, w] { runWorker(w); });
+  }
+  printer_ = std::thread([this] { runPrinter(); });
+
+  if (FLAGS_stats && FLAGS_stats_interval_sec > 0) {
+    reporter_ = std::thread([this] { runReporter(); });
+  }
+}
+
+void FlowWorkers::dispatch(std::unique_ptr<Packet> packet) {
+  latest_us_ = std::max(latest_us_, toUs(packet->ts));
+  auto& worker = *workers_[packet->tcp_identifier.getConnectionHash() %
+                           workers_.size()];
+
+  while (!worker.packets.write(std::move(packet))) {
+    std::this_thread::yield();
+  }
+
+  // Published after the write, so a worker seeing this timestamp and an empty
+  // queue has processed everything dispatched to it up to the timestamp
+  dispatched_us_.store(latest_us_, std::memory_order_release);
+}
+
+void FlowWorkers::finish() {
+  for (auto& worker : workers_) {
+    while (!worker->packets.write(nullptr)) {
+      std::this_thread::yield();
+    }
+  }
+
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+  printer_.join();
+
+  if (reporter_.joinable()) {
+    {
+      std::lock_guard<std::mutex> g(reporter_mutex_);
+      stopping_ = true;
+    }
+    reporter_cv_.notify_all();
+    reporter_.join();
+  }
+
+  if (FLAGS_stats) {
+    reportMethodStats();
+  }
+
+  for (const auto& worker : workers_) {
+    for (const auto& it : worker->connections) {
+      it.second.dump_stats(std::cout);
+    }
+  }
+
+  std::cout << "Done, bye!" << std::endl;
+}
+
+void FlowWorkers::runWorker(Worker* worker) {
+  std::unique_ptr<Packet> packet;
+  std::ostringstream os;
+
+  while (true) {
+    const auto dispatched_us =
+      dispatched_us_.load(std::memory_order_acquire);
+    if (!worker->packets.read(packet)) {
+      if (dispatched_us >
+          worker->watermark_us.load(std::memory_order_relaxed)) {
+        worker->watermark_us.store(dispatched_us, std::memory_order_release);
+      }
+      idle();
+      continue;
+    }
+
+    if (!packet) {
+      worker->watermark_us.store(kDoneUs, std::memory_order_release);
+      return;
+    }
+
+    // Keep the output of each worker in timestamp order, even if libpcap
+    // hands out packets slightly out of order
+    const auto ts_us = std::max(
+      toUs(packet->ts), worker->watermark_us.load(std::memory_order_relaxed));
+
+    if (FLAGS_stats) {
+      const auto& id = packet->tcp_identifier.getConnectionIdentifier();
+      auto res = worker->connections.emplace(
+        std::piecewise_construct,
+        std::forward_as_tuple(id),
+        std::forward_as_tuple(id, &worker->method_stats, nullptr,
+                              FLAGS_replicator_stats ?
+                                &worker->replicator_stats : nullptr));
+      auto& tcp_connection = res.first->second;
+
+      tcp_connection.push_back(std::move(packet), os);
+    } else {
+      auto res = worker->flows.emplace(packet->tcp_identifier,
+                                       packet->tcp_identifier);
+      auto& tcp_flow = res.first->second;
+      if (!tcp_flow.push_back(std::move(packet), os) || tcp_flow.empty()) {
+        worker->flows.erase(res.first);
+      }
+    }
+
+    if (FLAGS_flow_idle_timeout_sec > 0 && ts_us >= worker->next_expiry_us) {
+      expireIdle(worker, ts_us, os);
+      worker->next_expiry_us = ts_us + kExpiryIntervalUs;
+    }
+
+    auto text = os.str();
+    if (!text.empty()) {
+      os.str("");
+      Output output{ts_us, std::move(text)};
+      while (!worker->outputs.write(std::move(output))) {
+        idle();
+      }
+    }
+
+    worker->watermark_us.store(ts_us, std::memory_order_release);
+  }
+}
+
+void FlowWorkers::expireIdle(Worker* worker,
+                             int64_t now_us,
+                             std::ostream& os) {
+  const auto deadline_us =
+    now_us - static_cast<int64_t>(FLAGS_flow_idle_timeout_sec) * 1000000;
+
+  for (auto itor = worker->flows.begin(); itor != worker->flows.end(); ) {
+    if (itor->second.last_seen_us() < deadline_us) {
+      itor = worker->flows.erase(itor);
+    } else {
+      ++itor;
+    }
+  }
+
+  for (auto itor = worker->connections.begin();
+       itor != worker->connections.end(); ) {
+    if (itor->second.last_seen_us() < deadline_us) {
+      itor->second.dump_stats(os);
+      itor = worker->connections.erase(itor);
+    } else {
+      ++itor;
+    }
+  }
+}
+
+void FlowWorkers::runPrinter() {
+  const auto n_workers = workers_.size();
+  std::vector<int64_t> watermarks(n_workers);
+  std::vector<Output*> heads(n_workers);
+
+  while (true) {
+    // Watermarks must be loaded before peeking the queues. Output pushed
+    // before a watermark was published is then visible below.
+    for (size_t i = 0; i < n_workers; ++i) {
+      watermarks[i] =
+        workers_[i]->watermark_us.load(std::memory_order_acquire);
+    }
+
+    Output* next = nullptr;
+    size_t next_worker = 0;
+    bool done = true;
+    for (size_t i = 0; i < n_workers; ++i) {
+      heads[i] = workers_[i]->outputs.frontPtr();
+      if (heads[i] == nullptr) {
+        done = done && watermarks[i] == kDoneUs;
+        continue;
+      }
+
+      done = false;
+      if (next == nullptr || heads[i]->ts_us < next->ts_us) {
+        next = heads[i];
+        next_worker = i;
+      }
+    }
+
+    if (done) {
+      std::cout << std::flush;
+      return;
+    }
+
+    // next can only be printed once no other worker may still produce
+    // something earlier
+    bool ready = next != nullptr;
+    for (size_t i = 0; ready && i < n_workers; ++i) {
+      ready = heads[i] != nullptr || watermarks[i] >= next->ts_us;
+    }
+
+    if (!ready) {
+      idle();
+      continue;
+    }
+
+    std::cout << next->text;
+    workers_[next_worker]->outputs.popFront();
+  }
+}
+
+void FlowWorkers::runReporter() {
+  const std::chrono::seconds interval(FLAGS_stats_interval_sec);
+  std::unique_lock<std::mutex> lock(reporter_mutex_);
+
+  while (!reporter_cv_.wait_for(lock, interval,
+                                [this] { return stopping_; })) {
+    reportMethodStats();
+  }
+}
+
+void FlowWorkers::reportMethodStats() {
+  MethodStatsMap stats;
+  ReplicatorStatsMap replicator_stats;
+  for (auto& worker : workers_) {
+    worker->method_stats.drainInto(&stats);
+    worker->replicator_stats.drainInto(&replicator_stats);
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  const auto interval_sec =
+    std::chrono::duration<double>(now - last_report_).count();
+  last_report_ = now;
+
+  if (stats.empty()) {
+    return;
+  }
+
+  // Built up front, as the printer thread writes to std::cout as well
+  std::ostringstream os;
+  os << "==== Per method stats since the last report ====" << std::endl;
+  MethodStats::print(os, stats);
+  if (!replicator_stats.dbs.empty()) {
+    os << "==== Replication per db and per peer over the last " <<
+      interval_sec << "s ====" << std::endl;
+    ReplicatorStats::print(os, replicator_stats, interval_sec);
+  }
+  std::cout << os.str() << std::flush;
+}
+
+}  // namespace tgrep
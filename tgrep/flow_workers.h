@@ -0,0 +1,130 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <folly/ProducerConsumerQueue.h>
+
+#include "tgrep/method_stats.h"
+#include "tgrep/packet.h"
+#include "tgrep/replicator_stats.h"
+#include "tgrep/tcp_connection.h"
+#include "tgrep/tcp_flow.h"
+#include "tgrep/tcp_identifier.h"
+
+namespace tgrep {
+
+/*
+ * Processes captured packets on a set of worker threads.
+ *
+ * Packets are sharded by connection hash, so both directions of a connection
+ * go to the same worker, which owns their TcpFlow and TcpConnection objects.
+ * Each worker is fed by the capture thread through its own SPSC queue.
+ *
+ * Workers don't print. What they would print for a packet is handed to a
+ * printer thread, which merges the output of all workers in packet timestamp
+ * order.
+ *
+ * Flows and connections idle for --flow_idle_timeout_sec of capture time are
+ * dropped, so that memory stays bounded on long captures.
+ *
+ * With --stats, per method latency and size stats of all workers are printed
+ * every --stats_interval_sec by a reporter thread, followed by the replication
+ * rates per db and per peer with --replicator_stats.
+ */
+class FlowWorkers {
+ public:
+  // queue_size is the size of the packet and output queues of each worker
+  FlowWorkers(uint32_t n_workers, uint32_t queue_size);
+
+  // Must only be called from the capture thread. Blocks while the queue of the
+  // worker owning packet is full.
+  void dispatch(std::unique_ptr<Packet> packet);
+
+  // Wait for all dispatched packets to be processed and their output to be
+  // printed, then print connection stats. Must be called once, from the
+  // capture thread, before destruction.
+  void finish();
+
+ private:
+  struct Output {
+    int64_t ts_us;
+    std::string text;
+  };
+
+  struct Worker {
+    explicit Worker(uint32_t queue_size)
+        : packets(queue_size)
+        , outputs(queue_size)
+        , watermark_us(0)
+        , next_expiry_us(0) {}
+
+    folly::ProducerConsumerQueue<std::unique_ptr<Packet>> packets;
+    folly::ProducerConsumerQueue<Output> outputs;
+
+    // All output with a timestamp up to this has been pushed to outputs.
+    // Timestamps in outputs never go below it.
+    std::atomic<int64_t> watermark_us;
+
+    std::unordered_map<TcpIdentifier, TcpFlow, TcpIdentifierHash> flows;
+    std::unordered_map<TcpIdentifier, TcpConnection, TcpIdentifierHash>
+      connections;
+    // Capture time of the next idle flow expiry
+    int64_t next_expiry_us;
+    MethodStats method_stats;
+    ReplicatorStats replicator_stats;
+    std::thread thread;
+  };
+
+  void runWorker(Worker* worker);
+
+  // Drop the flows and connections of worker idle since before now_us minus
+  // the idle timeout. Stats of dropped connections are printed to os.
+  static void expireIdle(Worker* worker, int64_t now_us, std::ostream& os);
+
+  void runPrinter();
+
+  void runReporter();
+
+  // Print the method and replicator stats gathered since the last report
+  void reportMethodStats();
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // The latest timestamp dispatched, only written by the capture thread
+  int64_t latest_us_;
+  std::atomic<int64_t> dispatched_us_;
+
+  std::thread printer_;
+
+  std::mutex reporter_mutex_;
+  std::condition_variable reporter_cv_;
+  bool stopping_;
+  // Only used by the thread reporting stats
+  std::chrono::steady_clock::time_point last_report_;
+  std::thread reporter_;
+};
+
+}  // namespace tgrep
@@ -0,0 +1,100 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "tgrep/frame.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+
+#include <folly/Memory.h>
+#include <glog/logging.h>
+
+namespace tgrep {
+
+TcpIdentifier TcpSegment::identifier() const {
+  return TcpIdentifier(ntohs(tcp->th_sport),
+                       ntohs(tcp->th_dport),
+                       ip->ip_src,
+                       ip->ip_dst);
+}
+
+bool parse_tcp_segment(const u_char* packet, uint32_t len,
+                       TcpSegment* segment) {
+  // TODO(bol): verify IP and TCP checksum for incoming packets
+  int size_ip;
+  int size_tcp;
+  const struct sniff_ip* ip;
+  const struct sniff_tcp* tcp;
+
+  if (len < SIZE_ETHERNET + 20) {
+    LOG(ERROR) << "less than ip header length";
+    return false;
+  }
+
+  ip = (const struct sniff_ip*)(packet + SIZE_ETHERNET);
+  size_ip = IP_HL(ip)*4;
+  if (size_ip < 20) {
+    LOG(ERROR) << "Invalid IP header length: " << size_ip;
+    return false;
+  }
+
+  if (len < SIZE_ETHERNET + size_ip + 20) {
+    LOG(ERROR) << "less than tcp header length";
+    return false;
+  }
+
+  tcp = (const struct sniff_tcp*)(packet + SIZE_ETHERNET + size_ip);
+  size_tcp = TH_OFF(tcp) * 4;
+  if (size_tcp < 20) {
+    LOG(ERROR) << "Invalid TCP header length: " << size_tcp;
+    return false;
+  }
+  uint32_t total_header_size = SIZE_ETHERNET + size_ip + size_tcp;
+  if (len < total_header_size) {
+    LOG(ERROR) << "Invalid packet lenth: " << len <<
+      " while total header length: " << total_header_size;
+    return false;
+  } else if (len == total_header_size) {
+    return false;
+  }
+
+  int ip_payload_size = ntohs(ip->ip_len) - (size_ip + size_tcp);
+  if (ip_payload_size <= 0) {
+    return false;
+  }
+
+  segment->ip = ip;
+  segment->tcp = tcp;
+  segment->payload = packet + total_header_size;
+  // Never read past the captured bytes, even if the IP header claims more
+  segment->payload_size =
+    std::min<size_t>(ip_payload_size, len - total_header_size);
+  return true;
+}
+
+std::unique_ptr<Packet> make_packet(const struct timeval& ts,
+                                    const TcpSegment& segment,
+                                    std::unique_ptr<folly::IOBuf> buf,
+                                    std::shared_ptr<void> ring_block) {
+  return folly::make_unique<Packet>(ts,
+                                    std::move(buf),
+                                    ntohs(segment.tcp->th_sport),
+                                    ntohs(segment.tcp->th_dport),
+                                    segment.ip->ip_src,
+                                    segment.ip->ip_dst,
+                                    ntohl(segment.tcp->th_seq),
+                                    std::move(ring_block));
+}
+
+} // namespace tgrep
@@ -0,0 +1,50 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <folly/io/IOBuf.h>
+
+#include "tgrep/header.h"
+#include "tgrep/packet.h"
+#include "tgrep/tcp_identifier.h"
+
+namespace tgrep {
+
+// The TCP segment carried by an Ethernet frame
+struct TcpSegment {
+  TcpIdentifier identifier() const;
+
+  const struct sniff_ip* ip;
+  const struct sniff_tcp* tcp;
+  const u_char* payload;
+  size_t payload_size;
+};
+
+// Find the TCP segment in a frame of len captured bytes. Returns false if
+// there is none, or if it carries no payload.
+bool parse_tcp_segment(const u_char* frame, uint32_t len, TcpSegment* segment);
+
+// buf holds the payload of segment, either copied or in place
+std::unique_ptr<Packet> make_packet(const struct timeval& ts,
+                                    const TcpSegment& segment,
+                                    std::unique_ptr<folly::IOBuf> buf,
+                                    std::shared_ptr<void> ring_block = nullptr);
+
+} // namespace tgrep
@@ -0,0 +1,101 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "tgrep/method_stats.h"
+
+namespace {
+
+// Latencies are kept up to 1s in 100us buckets, sizes up to 1MB in 1KB
+// buckets. Values above go to the last bucket.
+const int64_t kLatencyBucketUs = 100;
+const int64_t kMaxLatencyUs = 1000 * 1000;
+const int64_t kSizeBucketBytes = 1024;
+const int64_t kMaxSizeBytes = 1024 * 1024;
+
+template <typename T>
+void printPercentiles(std::ostream& os,
+                      const char* name,
+                      const folly::Histogram<T>& histogram) {
+  os << " " << name <<
+    " P50 " << histogram.getPercentileEstimate(0.5) <<
+    " P90 " << histogram.getPercentileEstimate(0.9) <<
+    " P99 " << histogram.getPercentileEstimate(0.99) <<
+    " P999 " << histogram.getPercentileEstimate(0.999);
+}
+
+}  // namespace
+
+namespace tgrep {
+
+MethodHistograms::MethodHistograms()
+    : calls(0)
+    , errors(0)
+    , latency_us(kLatencyBucketUs, 0, kMaxLatencyUs)
+    , request_bytes(kSizeBucketBytes, 0, kMaxSizeBytes)
+    , response_bytes(kSizeBucketBytes, 0, kMaxSizeBytes) {
+}
+
+void MethodHistograms::merge(const MethodHistograms& other) {
+  calls += other.calls;
+  errors += other.errors;
+  latency_us.merge(other.latency_us);
+  request_bytes.merge(other.request_bytes);
+  response_bytes.merge(other.response_bytes);
+}
+
+void MethodStats::add(const std::string& method,
+                      int64_t latency_us,
+                      int64_t request_bytes,
+                      int64_t response_bytes,
+                      bool error) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto& histograms = stats_[method];
+  ++histograms.calls;
+  if (error) {
+    ++histograms.errors;
+  }
+  histograms.latency_us.addValue(latency_us);
+  histograms.request_bytes.addValue(request_bytes);
+  histograms.response_bytes.addValue(response_bytes);
+}
+
+void MethodStats::drainInto(MethodStatsMap* stats) {
+  MethodStatsMap drained;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    drained.swap(stats_);
+  }
+
+  for (const auto& method : drained) {
+    auto res = stats->emplace(method.first, method.second);
+    if (!res.second) {
+      res.first->second.merge(method.second);
+    }
+  }
+}
+
+void MethodStats::print(std::ostream& os, const MethodStatsMap& stats) {
+  for (const auto& method : stats) {
+    const auto& histograms = method.second;
+    os << method.first << ": calls " << histograms.calls <<
+      " errors " << histograms.errors << " (" <<
+      100.0 * histograms.errors / histograms.calls << "%)";
+    printPercentiles(os, "latency_us", histograms.latency_us);
+    printPercentiles(os, "request_bytes", histograms.request_bytes);
+    printPercentiles(os, "response_bytes", histograms.response_bytes);
+    os << std::endl;
+  }
+}
+
+}  // namespace tgrep
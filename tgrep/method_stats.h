@@ -0,0 +1,64 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include "folly/stats/Histogram.h"
+
+namespace tgrep {
+
+// Stats of the calls to one Thrift method
+struct MethodHistograms {
+  MethodHistograms();
+
+  void merge(const MethodHistograms& other);
+
+  int64_t calls;
+  int64_t errors;
+  folly::Histogram<int64_t> latency_us;
+  folly::Histogram<int64_t> request_bytes;
+  folly::Histogram<int64_t> response_bytes;
+};
+
+using MethodStatsMap = std::map<std::string, MethodHistograms>;
+
+/*
+ * Per method stats of the calls seen by one worker thread. They are added by
+ * the worker, and periodically taken away by the thread reporting them.
+ */
+class MethodStats {
+ public:
+  void add(const std::string& method,
+           int64_t latency_us,
+           int64_t request_bytes,
+           int64_t response_bytes,
+           bool error);
+
+  // Merge the stats added since the last call into *stats
+  void drainInto(MethodStatsMap* stats);
+
+  static void print(std::ostream& os, const MethodStatsMap& stats);
+
+ private:
+  std::mutex mutex_;
+  MethodStatsMap stats_;
+};
+
+}  // namespace tgrep
@@ -0,0 +1,292 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "tgrep/offline_analyzer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <iterator>
+#include <pcap.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include <folly/String.h>
+#include <glog/logging.h>
+
+#include "tgrep/frame.h"
+#include "tgrep/tcp_connection.h"
+
+namespace {
+
+const uint32_t kMagicUs = 0xa1b2c3d4;
+const uint32_t kMagicNs = 0xa1b23c4d;
+const size_t kFileHeaderSize = 24;
+const size_t kRecordHeaderSize = 16;
+
+struct Call {
+  int64_t ts_us;
+  std::string line;
+
+  bool operator < (const Call& other) const {
+    return ts_us < other.ts_us;
+  }
+};
+
+}  // namespace
+
+namespace tgrep {
+
+std::unique_ptr<OfflineAnalyzer> OfflineAnalyzer::open(
+    const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << path << ": " << strerror(errno);
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || static_cast<size_t>(st.st_size) < kFileHeaderSize) {
+    LOG(ERROR) << path << " is not a pcap file";
+    close(fd);
+    return nullptr;
+  }
+
+  const size_t size = st.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "Failed to mmap " << path << ": " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+
+  std::unique_ptr<OfflineAnalyzer> analyzer(
+    new OfflineAnalyzer(fd, static_cast<const uint8_t*>(data), size));
+
+  uint32_t magic;
+  memcpy(&magic, data, sizeof(magic));
+  if (magic == kMagicUs || magic == kMagicNs) {
+    analyzer->swapped_ = false;
+  } else if (__builtin_bswap32(magic) == kMagicUs ||
+             __builtin_bswap32(magic) == kMagicNs) {
+    analyzer->swapped_ = true;
+    magic = __builtin_bswap32(magic);
+  } else {
+    LOG(ERROR) << path << " is not a pcap file";
+    return nullptr;
+  }
+
+  analyzer->nanosecond_ = magic == kMagicNs;
+  analyzer->snaplen_ = analyzer->read32(analyzer->data_ + 16);
+  analyzer->linktype_ = analyzer->read32(analyzer->data_ + 20);
+  if (analyzer->linktype_ != DLT_EN10MB) {
+    LOG(ERROR) << "Only Ethernet captures are supported, " << path
+               << " has link type " << analyzer->linktype_;
+    return nullptr;
+  }
+
+  return analyzer;
+}
+
+OfflineAnalyzer::OfflineAnalyzer(int fd, const uint8_t* data, size_t size)
+    : fd_(fd)
+    , data_(data)
+    , size_(size)
+    , swapped_(false)
+    , nanosecond_(false)
+    , snaplen_(0)
+    , linktype_(0)
+    , connections_() {
+}
+
+OfflineAnalyzer::~OfflineAnalyzer() {
+  munmap(const_cast<uint8_t*>(data_), size_);
+  close(fd_);
+}
+
+uint32_t OfflineAnalyzer::read32(const uint8_t* p) const {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return swapped_ ? __builtin_bswap32(v) : v;
+}
+
+bool OfflineAnalyzer::readRecord(size_t offset,
+                                 struct timeval* ts,
+                                 const uint8_t** frame,
+                                 uint32_t* caplen,
+                                 uint32_t* len,
+                                 size_t* next_offset) const {
+  if (offset + kRecordHeaderSize > size_) {
+    return false;
+  }
+
+  const auto header = data_ + offset;
+  *caplen = read32(header + 8);
+  *len = read32(header + 12);
+  if (offset + kRecordHeaderSize + *caplen > size_) {
+    LOG(ERROR) << "Truncated record at offset " << offset;
+    return false;
+  }
+
+  ts->tv_sec = read32(header);
+  ts->tv_usec = nanosecond_ ? read32(header + 4) / 1000 : read32(header + 4);
+  *frame = header + kRecordHeaderSize;
+  *next_offset = offset + kRecordHeaderSize + *caplen;
+  return true;
+}
+
+bool OfflineAnalyzer::index(const std::string& filter) {
+  auto dead = pcap_open_dead(linktype_, snaplen_);
+  if (dead == nullptr) {
+    LOG(ERROR) << "Failed to create pcap handle for filter compilation";
+    return false;
+  }
+
+  struct bpf_program fp;
+  if (pcap_compile(dead, &fp, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN)) {
+    LOG(ERROR) << "Could not compile filter string: " << filter << " "
+               << pcap_geterr(dead);
+    pcap_close(dead);
+    return false;
+  }
+  pcap_close(dead);
+
+  madvise(const_cast<uint8_t*>(data_), size_, MADV_SEQUENTIAL);
+
+  std::unordered_map<TcpIdentifier, std::vector<size_t>, TcpIdentifierHash>
+    index;
+  size_t offset = kFileHeaderSize;
+  size_t next_offset;
+  size_t n_records = 0;
+  struct pcap_pkthdr header;
+  const uint8_t* frame;
+  while (readRecord(offset, &header.ts, &frame, &header.caplen, &header.len,
+                    &next_offset)) {
+    ++n_records;
+    TcpSegment segment;
+    if (pcap_offline_filter(&fp, &header, frame) &&
+        parse_tcp_segment(frame, header.caplen, &segment)) {
+      index[segment.identifier().getConnectionIdentifier()].push_back(offset);
+    }
+    offset = next_offset;
+  }
+  pcap_freecode(&fp);
+
+  madvise(const_cast<uint8_t*>(data_), size_, MADV_NORMAL);
+
+  // Start with the busiest connections, so that no thread is left with a
+  // big one at the end. TcpIdentifier is not assignable, so the index entries
+  // are sorted before being moved to connections_.
+  std::vector<decltype(index)::iterator> by_size;
+  by_size.reserve(index.size());
+  for (auto itor = index.begin(); itor != index.end(); ++itor) {
+    by_size.push_back(itor);
+  }
+  std::sort(by_size.begin(), by_size.end(),
+            [] (decltype(index)::iterator a, decltype(index)::iterator b) {
+              return a->second.size() > b->second.size();
+            });
+
+  connections_.clear();
+  connections_.reserve(index.size());
+  for (auto itor : by_size) {
+    connections_.emplace_back(itor->first, std::move(itor->second));
+  }
+
+  LOG(INFO) << "Indexed " << connections_.size() << " connections in "
+            << n_records << " records";
+  return true;
+}
+
+void OfflineAnalyzer::analyze(uint32_t n_threads,
+                              const std::string& method,
+                              std::ostream& os) {
+  std::atomic<size_t> next_connection(0);
+  std::vector<std::vector<Call>> calls(n_threads);
+  std::vector<std::thread> threads;
+
+  for (uint32_t i = 0; i < n_threads; ++i) {
+    auto thread_calls = &calls[i];
+    threads.emplace_back([this, &next_connection, &method, thread_calls] {
+      // Only stats are collected, so nothing TcpFlow prints is needed
+      std::ostream null_os(nullptr);
+      auto on_call = [&method, thread_calls] (const CallRecord& call) {
+        if (!method.empty() && *call.fname != method) {
+          return;
+        }
+
+        thread_calls->push_back(Call{
+          static_cast<int64_t>(call.call_ts.tv_sec) * 1000000 +
+            call.call_ts.tv_usec,
+          folly::stringPrintf("%ld.%06ld\t%s\t%s\t%d\t%zu\t%zu\t%ld\t%d\n",
+                              static_cast<long>(call.call_ts.tv_sec),
+                              static_cast<long>(call.call_ts.tv_usec),
+                              call.flow->c_str(),
+                              call.fname->c_str(),
+                              call.seqid,
+                              call.request_size,
+                              call.response_size,
+                              static_cast<long>(call.latency_us),
+                              call.error ? 1 : 0)});
+      };
+
+      size_t c;
+      while ((c = next_connection++) < connections_.size()) {
+        const auto& connection = connections_[c];
+        TcpConnection tcp_connection(connection.first, nullptr, on_call);
+
+        for (auto offset : connection.second) {
+          struct timeval ts;
+          const uint8_t* frame;
+          uint32_t caplen;
+          uint32_t len;
+          size_t next_offset;
+          TcpSegment segment;
+          readRecord(offset, &ts, &frame, &caplen, &len, &next_offset);
+          parse_tcp_segment(frame, caplen, &segment);
+
+          // The mapping outlives the connection, so payloads stay in place
+          tcp_connection.push_back(
+            make_packet(ts, segment, folly::IOBuf::wrapBuffer(
+                                       segment.payload, segment.payload_size)),
+            null_os);
+        }
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<Call> all_calls;
+  for (auto& thread_calls : calls) {
+    std::move(thread_calls.begin(), thread_calls.end(),
+              std::back_inserter(all_calls));
+    thread_calls.clear();
+  }
+  std::stable_sort(all_calls.begin(), all_calls.end());
+
+  for (const auto& call : all_calls) {
+    os << call.line;
+  }
+  os << std::flush;
+}
+
+}  // namespace tgrep
@@ -0,0 +1,82 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tgrep/tcp_identifier.h"
+
+namespace tgrep {
+
+/*
+ * Analyzes a pcap file in two passes.
+ *
+ * The file is memory mapped. The first pass indexes the records of each
+ * connection. The second one decodes connections in parallel, each on one
+ * thread, with payloads read in place from the mapping.
+ *
+ * Every call matched with its reply is written as one tab separated line:
+ *   call time (sec.usec), "client => server", method, seqId,
+ *   request bytes, response bytes, latency in us, 1 if an error else 0
+ * Lines are sorted by call time.
+ */
+class OfflineAnalyzer {
+ public:
+  // Returns nullptr on failure
+  static std::unique_ptr<OfflineAnalyzer> open(const std::string& path);
+
+  ~OfflineAnalyzer();
+
+  // First pass. Index the records matching the pcap filter by connection.
+  // Returns false on failure.
+  bool index(const std::string& filter);
+
+  // Second pass. Decode the indexed connections on n_threads threads and
+  // write the calls to method, or all calls if method is empty, to os.
+  void analyze(uint32_t n_threads, const std::string& method,
+               std::ostream& os);
+
+ private:
+  OfflineAnalyzer(int fd, const uint8_t* data, size_t size);
+
+  // Read the record at offset. Returns false past the last complete record.
+  bool readRecord(size_t offset,
+                  struct timeval* ts,
+                  const uint8_t** frame,
+                  uint32_t* caplen,
+                  uint32_t* len,
+                  size_t* next_offset) const;
+
+  uint32_t read32(const uint8_t* p) const;
+
+  const int fd_;
+  const uint8_t* const data_;
+  const size_t size_;
+
+  bool swapped_;
+  bool nanosecond_;
+  uint32_t snaplen_;
+  uint32_t linktype_;
+
+  // Record offsets of each connection, in capture order
+  std::vector<std::pair<TcpIdentifier, std::vector<size_t>>> connections_;
+};
+
+}  // namespace tgrep
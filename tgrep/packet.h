@@ -37,20 +37,35 @@ struct Packet {
          uint16_t port_dest_arg,
          struct in_addr ip_src_arg,
          struct in_addr ip_dest_arg,
-         tcp_seq seq_arg) :
+         tcp_seq seq_arg,
+         std::shared_ptr<void> ring_block_arg = nullptr) :
     ts(ts_arg),
     buf(std::move(buf_arg)),
     tcp_identifier(port_src_arg,
                    port_dest_arg,
                    ip_src_arg,
                    ip_dest_arg),
-    seq(seq_arg) {
+    seq(seq_arg),
+    ring_block(std::move(ring_block_arg)) {
+  }
+
+  // Copy the payload out of the capture ring block, if it points into one, so
+  // that the block can be handed back to the kernel
+  void own_buffer() {
+    if (ring_block) {
+      buf->makeManaged();
+      ring_block.reset();
+    }
   }
 
   const struct timeval ts;
   std::unique_ptr<folly::IOBuf> buf;
   const TcpIdentifier tcp_identifier;
   const tcp_seq seq;
+
+  // Set if buf is a view into an AF_PACKET ring block. The block is returned
+  // to the kernel once no packet holds it anymore.
+  std::shared_ptr<void> ring_block;
 };
 
 
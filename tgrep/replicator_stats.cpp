@@ -0,0 +1,102 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "tgrep/replicator_stats.h"
+
+#include <algorithm>
+
+DEFINE_bool(replicator_stats, false,
+            "With --stats, also decode the Replicator calls, and print the "
+            "replication traffic per db and per peer");
+
+namespace {
+
+void printCounters(std::ostream& os,
+                   const std::string& name,
+                   const tgrep::ReplicationCounters& counters,
+                   double interval_sec) {
+  os << name <<
+    ": requests/s " << counters.requests / interval_sec <<
+    " batches/s " << counters.batches / interval_sec <<
+    " updates/s " << counters.updates / interval_sec <<
+    " bytes/s " << counters.update_bytes / interval_sec <<
+    " avg_hold_ms " <<
+    (counters.requests > 0 ?
+       counters.total_hold_us / 1000.0 / counters.requests : 0) <<
+    " max_hold_ms " << counters.max_hold_us / 1000.0 << std::endl;
+}
+
+}  // namespace
+
+namespace tgrep {
+
+void ReplicationCounters::merge(const ReplicationCounters& other) {
+  requests += other.requests;
+  batches += other.batches;
+  updates += other.updates;
+  update_bytes += other.update_bytes;
+  total_hold_us += other.total_hold_us;
+  max_hold_us = std::max(max_hold_us, other.max_hold_us);
+}
+
+void ReplicatorStats::add(const std::string& db_name,
+                          const std::string& peer,
+                          const ReplicateDbInfo& reply,
+                          int64_t hold_us) {
+  ReplicationCounters counters;
+  counters.requests = 1;
+  counters.batches = reply.n_updates > 0 ? 1 : 0;
+  counters.updates = reply.n_updates;
+  counters.update_bytes = reply.update_bytes;
+  counters.total_hold_us = hold_us;
+  counters.max_hold_us = hold_us;
+
+  std::lock_guard<std::mutex> g(mutex_);
+  stats_.dbs[db_name].merge(counters);
+  stats_.peers[peer].merge(counters);
+}
+
+void ReplicatorStats::drainInto(ReplicatorStatsMap* stats) {
+  ReplicatorStatsMap drained;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    drained.dbs.swap(stats_.dbs);
+    drained.peers.swap(stats_.peers);
+  }
+
+  for (const auto& db : drained.dbs) {
+    stats->dbs[db.first].merge(db.second);
+  }
+  for (const auto& peer : drained.peers) {
+    stats->peers[peer.first].merge(peer.second);
+  }
+}
+
+void ReplicatorStats::print(std::ostream& os,
+                            const ReplicatorStatsMap& stats,
+                            double interval_sec) {
+  interval_sec = std::max(interval_sec, 0.001);
+  for (const auto& db : stats.dbs) {
+    printCounters(os, "db " + db.first, db.second, interval_sec);
+  }
+  for (const auto& peer : stats.peers) {
+    printCounters(os, "peer " + peer.first, peer.second, interval_sec);
+  }
+}
+
+bool isReplicatorMethod(const std::string& fname) {
+  return fname == "replicate" || fname == "replicateMulti";
+}
+
+}  // namespace tgrep
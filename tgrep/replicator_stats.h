@@ -0,0 +1,218 @@
+/// Copyright 2017 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <thrift/lib/cpp/protocol/TProtocol.h>
+
+DECLARE_bool(replicator_stats);
+
+namespace tgrep {
+
+// One db of a Replicator call or reply
+struct ReplicateDbInfo {
+  // Empty in the reply of replicate(), which only has the one of its call
+  std::string db_name;
+  int64_t seq_no = -1;
+  int64_t n_updates = 0;
+  // The raw_data bytes of the updates
+  int64_t update_bytes = 0;
+};
+
+// Replication traffic of a db, or of a peer
+struct ReplicationCounters {
+  void merge(const ReplicationCounters& other);
+
+  // Requests for the db, counting each db of a replicateMulti()
+  int64_t requests = 0;
+  // Replies carrying updates
+  int64_t batches = 0;
+  int64_t updates = 0;
+  int64_t update_bytes = 0;
+  // How long requests were held by the server, which long-polls while there
+  // are no updates
+  int64_t total_hold_us = 0;
+  int64_t max_hold_us = 0;
+};
+
+struct ReplicatorStatsMap {
+  std::map<std::string, ReplicationCounters> dbs;
+  // By client address
+  std::map<std::string, ReplicationCounters> peers;
+};
+
+/*
+ * Per db and per peer stats of the Replicator calls seen by one worker
+ * thread, decoded with --replicator_stats. Like MethodStats, they are added by
+ * the worker, and periodically taken away by the thread reporting them.
+ */
+class ReplicatorStats {
+ public:
+  void add(const std::string& db_name,
+           const std::string& peer,
+           const ReplicateDbInfo& reply,
+           int64_t hold_us);
+
+  // Merge the stats added since the last call into *stats
+  void drainInto(ReplicatorStatsMap* stats);
+
+  // Print the stats gathered over interval_sec as rates
+  static void print(std::ostream& os,
+                    const ReplicatorStatsMap& stats,
+                    double interval_sec);
+
+ private:
+  std::mutex mutex_;
+  ReplicatorStatsMap stats_;
+};
+
+// If fname is a method of the Replicator service decoded by
+// readReplicatorArgument()
+bool isReplicatorMethod(const std::string& fname);
+
+template <class Protocol_>
+void readReplicateRequest(Protocol_& prot, ReplicateDbInfo* info) {
+  std::string name;
+  apache::thrift::protocol::TType ftype;
+  int16_t fid;
+  prot.readStructBegin(name);
+  while (true) {
+    prot.readFieldBegin(name, ftype, fid);
+    if (ftype == apache::thrift::protocol::T_STOP) {
+      break;
+    }
+    if (fid == 1 && ftype == apache::thrift::protocol::T_I64) {
+      prot.readI64(info->seq_no);
+    } else if (fid == 2 && ftype == apache::thrift::protocol::T_STRING) {
+      prot.readBinary(info->db_name);
+    } else {
+      prot.skip(ftype);
+    }
+    prot.readFieldEnd();
+  }
+  prot.readStructEnd();
+}
+
+template <class Protocol_>
+void readReplicateResponse(Protocol_& prot, ReplicateDbInfo* info) {
+  std::string name;
+  apache::thrift::protocol::TType ftype;
+  int16_t fid;
+  prot.readStructBegin(name);
+  while (true) {
+    prot.readFieldBegin(name, ftype, fid);
+    if (ftype == apache::thrift::protocol::T_STOP) {
+      break;
+    }
+    if (fid != 1 || ftype != apache::thrift::protocol::T_LIST) {
+      prot.skip(ftype);
+      prot.readFieldEnd();
+      continue;
+    }
+
+    // list<Update>, of which only the size of raw_data matters
+    apache::thrift::protocol::TType elem_type;
+    uint32_t size;
+    prot.readListBegin(elem_type, size);
+    for (uint32_t i = 0; i < size; ++i) {
+      ++info->n_updates;
+      prot.readStructBegin(name);
+      while (true) {
+        prot.readFieldBegin(name, ftype, fid);
+        if (ftype == apache::thrift::protocol::T_STOP) {
+          break;
+        }
+        if (fid == 1 && ftype == apache::thrift::protocol::T_STRING) {
+          std::string raw_data;
+          prot.readBinary(raw_data);
+          info->update_bytes += raw_data.size();
+        } else {
+          prot.skip(ftype);
+        }
+        prot.readFieldEnd();
+      }
+      prot.readStructEnd();
+    }
+    prot.readListEnd();
+    prot.readFieldEnd();
+  }
+  prot.readStructEnd();
+}
+
+// Decode the ReplicateRequest(s) of a call, or the ReplicateResponse(s) of a
+// reply, of which prot has just read the field header of the argument or of
+// the return value.
+template <class Protocol_>
+void readReplicatorArgument(Protocol_& prot,
+                            const std::string& fname,
+                            bool is_call,
+                            std::vector<ReplicateDbInfo>* dbs) {
+  if (fname == "replicate") {
+    dbs->emplace_back();
+    if (is_call) {
+      readReplicateRequest(prot, &dbs->back());
+    } else {
+      readReplicateResponse(prot, &dbs->back());
+    }
+    return;
+  }
+
+  // ReplicateMultiRequest.requests, or ReplicateMultiResponse.responses
+  std::string name;
+  apache::thrift::protocol::TType ftype;
+  int16_t fid;
+  prot.readStructBegin(name);
+  while (true) {
+    prot.readFieldBegin(name, ftype, fid);
+    if (ftype == apache::thrift::protocol::T_STOP) {
+      break;
+    }
+    if (fid == 1 && is_call && ftype == apache::thrift::protocol::T_LIST) {
+      apache::thrift::protocol::TType elem_type;
+      uint32_t size;
+      prot.readListBegin(elem_type, size);
+      for (uint32_t i = 0; i < size; ++i) {
+        dbs->emplace_back();
+        readReplicateRequest(prot, &dbs->back());
+      }
+      prot.readListEnd();
+    } else if (fid == 1 && !is_call &&
+               ftype == apache::thrift::protocol::T_MAP) {
+      apache::thrift::protocol::TType key_type;
+      apache::thrift::protocol::TType val_type;
+      uint32_t size;
+      prot.readMapBegin(key_type, val_type, size);
+      for (uint32_t i = 0; i < size; ++i) {
+        dbs->emplace_back();
+        prot.readBinary(dbs->back().db_name);
+        readReplicateResponse(prot, &dbs->back());
+      }
+      prot.readMapEnd();
+    } else {
+      prot.skip(ftype);
+    }
+    prot.readFieldEnd();
+  }
+  prot.readStructEnd();
+}
+
+}  // namespace tgrep
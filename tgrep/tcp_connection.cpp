@@ -19,12 +19,15 @@
 #include "tgrep/tcp_connection.h"
 
 #include <arpa/inet.h>
+#include <atomic>
 #include <iostream>
+#include <mutex>
 
+std::mutex g_histogram_mutex;
 folly::Histogram<int64_t> g_histogram(1, 0, 1000);
-int64_t mismatched_call = 0;
-int64_t mismatched_reply = 0;
-int64_t total_pairs = 0;
+std::atomic<int64_t> mismatched_call(0);
+std::atomic<int64_t> mismatched_reply(0);
+std::atomic<int64_t> total_pairs(0);
 
 SCOPE_EXIT {
   std::cout << "mismatched call " << mismatched_call << std::endl;
@@ -40,59 +43,125 @@ SCOPE_EXIT {
 
 namespace tgrep {
 
-TcpConnection::TcpConnection(const TcpIdentifier& id)
-    : histogram_(1, 0, 1000) {
+namespace {
+
+// Calls without a reply, e.g. because of dropped packets, are forgotten
+// beyond this
+const size_t kMaxPendingCalls = 1024;
+
+int64_t to_us(const struct timeval& ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_usec;
+}
+
+}  // namespace
+
+TcpConnection::TcpConnection(const TcpIdentifier& id,
+                             MethodStats* method_stats,
+                             CallCallback on_call,
+                             ReplicatorStats* replicator_stats)
+    : pending_calls_()
+    , histogram_(1, 0, 1000)
+    , method_stats_(method_stats)
+    , on_call_(std::move(on_call))
+    , replicator_stats_(replicator_stats)
+    , last_seen_us_(0) {
   identifier_ = folly::stringPrintf("%s:%d <=> ",
                                     inet_ntoa(id.ip_src), id.port_src);
   folly::stringAppendf(&identifier_, "%s:%d",
                        inet_ntoa(id.ip_dest), id.port_dest);
 }
 
-void TcpConnection::push_back(std::unique_ptr<Packet> packet) {
+void TcpConnection::push_back(std::unique_ptr<Packet> packet,
+                              std::ostream& os) {
+  last_seen_us_ = to_us(packet->ts);
   auto res = flows_.emplace(packet->tcp_identifier, packet->tcp_identifier);
   auto& tcp_flow = res.first->second;
 
+  MessageInfo info;
+  info.mtype = (apache::thrift::MessageType)0;
 
-  struct timeval ts;
-  apache::thrift::MessageType mtype = (apache::thrift::MessageType)0;
-
-  if (!tcp_flow.push_back(std::move(packet), &mtype, &ts)) {
+  if (!tcp_flow.push_back(std::move(packet), os, &info)) {
     // dropped some packets
     flows_.clear();
-    last_seen_call_time_.tv_sec = 0;
+    mismatched_call += pending_calls_.size();
+    pending_calls_.clear();
     return;
   }
 
-  if (mtype != 0) {
-    if (mtype == apache::thrift::MessageType::T_CALL) {
-      if (last_seen_call_time_.tv_sec != 0) {
-        ++ mismatched_call;
-      }
+  if (info.mtype == apache::thrift::MessageType::T_CALL) {
+    if (pending_calls_.size() >= kMaxPendingCalls) {
+      mismatched_call += pending_calls_.size();
+      pending_calls_.clear();
+    }
 
-      last_seen_call_time_ = ts;
-    } else if(mtype == apache::thrift::MessageType::T_REPLY) {
-      if (last_seen_call_time_.tv_sec != 0) {
-        int64_t start_ms = last_seen_call_time_.tv_sec * 1000 +
-          last_seen_call_time_.tv_usec / 1000;
-        int64_t end_ms = ts.tv_sec * 1000 + ts.tv_usec / 1000;
-        histogram_.addValue(end_ms - start_ms);
-        g_histogram.addValue(end_ms - start_ms);
-        ++ total_pairs;
-        last_seen_call_time_.tv_sec = 0;
-      } else {
-        ++ mismatched_reply;
+    auto& call = pending_calls_[info.seqid];
+    if (!call.fname.empty()) {
+      // a call with the same seqId never got its reply
+      ++ mismatched_call;
+    }
+    call.flow = &tcp_flow.identifier();
+    call.fname = std::move(info.fname);
+    call.ts = info.ts;
+    call.size = info.size;
+    call.replicate = std::move(info.replicate);
+  } else if (info.mtype == apache::thrift::MessageType::T_REPLY ||
+             info.mtype == apache::thrift::MessageType::T_EXCEPTION) {
+    auto itor = pending_calls_.find(info.seqid);
+    if (itor == pending_calls_.end()) {
+      ++ mismatched_reply;
+      return;
+    }
+
+    const auto& call = itor->second;
+    const auto latency_us = to_us(info.ts) - to_us(call.ts);
+    histogram_.addValue(latency_us / 1000);
+    ++ total_pairs;
+    if (method_stats_) {
+      method_stats_->add(call.fname, latency_us, call.size, info.size,
+                         info.exception);
+    }
+    if (replicator_stats_ && !call.replicate.empty()) {
+      addReplicatorStats(call, info.replicate, latency_us);
+    }
+    if (on_call_) {
+      on_call_(CallRecord{call.flow, &call.fname, info.seqid, call.ts,
+                          latency_us, call.size, info.size, info.exception});
+    }
+    pending_calls_.erase(itor);
+  }
+}
+
+void TcpConnection::addReplicatorStats(
+    const PendingCall& call,
+    const std::vector<ReplicateDbInfo>& reply,
+    int64_t latency_us) {
+  // The client is the source of the call, "ip:port => ip:port"
+  const auto peer = call.flow->substr(0, call.flow->find(':'));
+  const ReplicateDbInfo no_updates;
+  for (const auto& request : call.replicate) {
+    // The reply of replicate() has the one response without a db name, and
+    // replicateMulti() leaves the dbs without updates out
+    const ReplicateDbInfo* response = &no_updates;
+    for (const auto& db : reply) {
+      if (db.db_name.empty() || db.db_name == request.db_name) {
+        response = &db;
+        break;
       }
     }
+    replicator_stats_->add(request.db_name, peer, *response, latency_us);
   }
 }
 
-void TcpConnection::dump_stats() const {
-  std::cout << identifier_ <<
+void TcpConnection::dump_stats(std::ostream& os) const {
+  os << identifier_ <<
     ": P50 " << histogram_.getPercentileEstimate(0.5) <<
     ": P90 " << histogram_.getPercentileEstimate(0.9) <<
     ": P99 " << histogram_.getPercentileEstimate(0.99) <<
     ": P999 " << histogram_.getPercentileEstimate(0.999) <<
     ": P9999 " << histogram_.getPercentileEstimate(0.9999) << std::endl;
+
+  std::lock_guard<std::mutex> g(g_histogram_mutex);
+  g_histogram.merge(histogram_);
 }
 
 }
@@ -18,28 +18,82 @@
 
 #pragma once
 
+#include <functional>
 #include <map>
+#include <ostream>
+#include <string>
+#include <vector>
 
 #include "folly/stats/Histogram.h"
+#include "tgrep/method_stats.h"
 #include "tgrep/packet.h"
+#include "tgrep/replicator_stats.h"
 #include "tgrep/tcp_flow.h"
 #include "tgrep/tcp_identifier.h"
 
 namespace tgrep {
 
+// A call matched with its reply
+struct CallRecord {
+  // "client => server", valid during the CallCallback only
+  const std::string* flow;
+  const std::string* fname;
+  int32_t seqid;
+  struct timeval call_ts;
+  int64_t latency_us;
+  size_t request_size;
+  size_t response_size;
+  bool error;
+};
+
+using CallCallback = std::function<void(const CallRecord&)>;
+
 class TcpConnection {
 public:
-  TcpConnection(const TcpIdentifier& id);
+  // Latencies of the calls on this connection are also added to
+  // method_stats, if set, and passed to on_call, if set. The Replicator calls
+  // decoded with --replicator_stats are added to replicator_stats, if set.
+  explicit TcpConnection(const TcpIdentifier& id,
+                         MethodStats* method_stats = nullptr,
+                         CallCallback on_call = nullptr,
+                         ReplicatorStats* replicator_stats = nullptr);
 
-  void push_back(std::unique_ptr<Packet> packet);
+  void push_back(std::unique_ptr<Packet> packet, std::ostream& os);
 
-  void dump_stats() const;
+  // Print the latency stats of this connection, and add them to the global
+  // stats printed at exit. Connections live on different worker threads, so
+  // their latencies are only added to the global histogram here.
+  void dump_stats(std::ostream& os) const;
+
+  // Capture time of the latest packet of this connection
+  int64_t last_seen_us() const {
+    return last_seen_us_;
+  }
 
 private:
+  struct PendingCall {
+    // Points into flows_
+    const std::string* flow;
+    std::string fname;
+    struct timeval ts;
+    size_t size;
+    std::vector<ReplicateDbInfo> replicate;
+  };
+
+  // Add the dbs of a Replicator call and of its reply to replicator_stats_
+  void addReplicatorStats(const PendingCall& call,
+                          const std::vector<ReplicateDbInfo>& reply,
+                          int64_t latency_us);
+
   std::string identifier_;
   std::map<TcpIdentifier, TcpFlow> flows_;
-  struct timeval last_seen_call_time_;
+  // Calls waiting for their reply, by seqId
+  std::map<int32_t, PendingCall> pending_calls_;
   folly::Histogram<int64_t> histogram_;
+  MethodStats* const method_stats_;
+  const CallCallback on_call_;
+  ReplicatorStats* const replicator_stats_;
+  int64_t last_seen_us_;
 };
 
 }
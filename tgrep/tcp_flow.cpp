@@ -18,7 +18,10 @@
 
 #include "tgrep/tcp_flow.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <ctime>
+#include <folly/ScopeGuard.h>
 #include <thrift/lib/cpp2/protocol/BinaryProtocol.h>
 #include <thrift/lib/cpp2/protocol/CompactProtocol.h>
 
@@ -26,8 +29,6 @@
 DEFINE_string(target, "", "The string to grep");
 DEFINE_bool(finagle, false, "Grep finagle traffic");
 
-DECLARE_bool(stats);
-
 using namespace apache::thrift::transport;
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -42,8 +43,10 @@ TcpFlow::TcpFlow(const TcpIdentifier& tcp_identifier) :
   queue_(),
   needed_(0),
   identifier_(),
-  next_seq_(),
-  seq_to_packet_() {
+  has_next_seq_(false),
+  next_seq_(0),
+  out_of_order_(),
+  last_seen_us_(0) {
   identifier_ = folly::stringPrintf("%s:%d => ",
                                     inet_ntoa(tcp_identifier.ip_src),
                                     tcp_identifier.port_src);
@@ -54,19 +57,31 @@ TcpFlow::TcpFlow(const TcpIdentifier& tcp_identifier) :
 
 
 bool TcpFlow::push_back(std::unique_ptr<Packet> packet,
-                        apache::thrift::MessageType* mtype,
-                        struct timeval* ts) {
-  if (!next_seq_) {
-    next_seq_ = folly::make_unique<tcp_seq>(packet->seq);
+                        std::ostream& os,
+                        MessageInfo* info) {
+  last_seen_us_ = static_cast<int64_t>(packet->ts.tv_sec) * 1000000 +
+    packet->ts.tv_usec;
+
+  if (!has_next_seq_) {
+    next_seq_ = packet->seq;
+    has_next_seq_ = true;
   }
 
-  if (packet->seq < *next_seq_) {
+  if (packet->seq < next_seq_) {
     return true;
-  } else if (packet->seq > *next_seq_) {
+  } else if (packet->seq > next_seq_) {
     auto seq = packet->seq;
-    seq_to_packet_.emplace(seq, std::move(packet));
+    auto pos = std::lower_bound(
+      out_of_order_.begin(), out_of_order_.end(), seq,
+      [] (const std::unique_ptr<Packet>& p, tcp_seq s) {
+        return p->seq < s;
+      });
+    if (pos == out_of_order_.end() || (*pos)->seq != seq) {
+      packet->own_buffer();
+      out_of_order_.insert(pos, std::move(packet));
+    }
 
-    if (seq_to_packet_.size() > kMaxAllowedOutOfOrderTcpSegments) {
+    if (out_of_order_.size() > kMaxAllowedOutOfOrderTcpSegments) {
       clear();
     }
 
@@ -76,22 +91,29 @@ bool TcpFlow::push_back(std::unique_ptr<Packet> packet,
   }
 
   auto len = packet->buf->computeChainDataLength();
-  *next_seq_ += len;
+  next_seq_ += len;
   queue_.append(std::move(packet->buf));
 
-  for (auto itor = seq_to_packet_.begin();
-       itor != seq_to_packet_.end(); ) {
-    if (itor->first < *next_seq_) {
-      seq_to_packet_.erase(itor++);
-    } else if (itor->first > *next_seq_) {
+  // Whatever this packet leaves queued must not outlive its ring block
+  const bool from_ring = packet->ring_block != nullptr;
+  SCOPE_EXIT {
+    if (from_ring) {
+      own_queued_data();
+    }
+  };
+
+  auto itor = out_of_order_.begin();
+  for (; itor != out_of_order_.end(); ++itor) {
+    if ((*itor)->seq > next_seq_) {
       break;
-    } else {
-      len += itor->second->buf->computeChainDataLength();
-      *next_seq_ += itor->second->buf->computeChainDataLength();
-      queue_.append(std::move(itor->second->buf));
-      seq_to_packet_.erase(itor++);
+    } else if ((*itor)->seq == next_seq_) {
+      auto segment_len = (*itor)->buf->computeChainDataLength();
+      len += segment_len;
+      next_seq_ += segment_len;
+      queue_.append(std::move((*itor)->buf));
     }
   }
+  out_of_order_.erase(out_of_order_.begin(), itor);
 
   if (len < needed_) {
     needed_ -= len;
@@ -117,13 +139,16 @@ bool TcpFlow::push_back(std::unique_ptr<Packet> packet,
       }
     }
 
-    if (!FLAGS_stats) {
-      std::cout << "**********************************************" << std::endl
-                << ctime((const time_t *) &packet->ts.tv_sec)
+    if (info == nullptr) {
+      // ctime() isn't safe with the flows handled on several worker threads
+      const time_t sec = packet->ts.tv_sec;
+      char time_str[26];
+      os << "**********************************************" << std::endl
+                << ctime_r(&sec, time_str)
                 << packet->ts.tv_sec << "." << packet->ts.tv_usec << std::endl
                 << identifier_ << std::endl;
     } else {
-      *ts = packet->ts;
+      info->ts = packet->ts;
     }
 
     switch (header.getProtocolId()) {
@@ -131,10 +156,10 @@ bool TcpFlow::push_back(std::unique_ptr<Packet> packet,
       {
         apache::thrift::BinaryProtocolReader iprot;
 
-        if (FLAGS_stats) {
-          *mtype = get_mtype(std::move(msg), iprot);
+        if (info != nullptr) {
+          get_message_info(std::move(msg), iprot, info);
         } else {
-          print_message(std::cout, std::move(msg), iprot);
+          print_message(os, std::move(msg), iprot);
         }
         break;
       }
@@ -142,27 +167,37 @@ bool TcpFlow::push_back(std::unique_ptr<Packet> packet,
       {
         apache::thrift::CompactProtocolReader iprot;
 
-        if (FLAGS_stats) {
-          *mtype = get_mtype(std::move(msg), iprot);
+        if (info != nullptr) {
+          get_message_info(std::move(msg), iprot, info);
         } else {
-          print_message(std::cout, std::move(msg), iprot);
+          print_message(os, std::move(msg), iprot);
         }
         break;
       }
     default:
-      std::cout << "Unsupported protocol: " <<
+      os << "Unsupported protocol: " <<
         header.getProtocolId() <<
         std::endl;
       return true;
     }
   } catch (const std::exception& e) {
     clear();
-    std::cout << "Exception: " << e.what() << std::endl;
+    os << "Exception: " << e.what() << std::endl;
   }
 
   return true;
 }
 
+void TcpFlow::own_queued_data() {
+  if (queue_.empty()) {
+    return;
+  }
+
+  auto buf = queue_.move();
+  buf->makeManaged();
+  queue_.append(std::move(buf));
+}
+
 std::unique_ptr<folly::IOBuf> TcpFlow::extract_msg_thrift(THeader& header) {
   std::map<std::string, std::string> read_headers;
   return header.removeHeader(&queue_, needed_, read_headers);
@@ -187,7 +222,7 @@ std::unique_ptr<folly::IOBuf> TcpFlow::extract_msg_finagle(THeader& header) {
     if (byteRange.size() > 16 * 1024 * 1024) {
       // if the msg size is over 16M and we didn't find any finagle magics,
       // it's most likely not finagle traffic
-      std::cout << "Did you mean to grep thrift traffic? " << std::endl;
+      LOG(ERROR) << "Did you mean to grep thrift traffic?";
       clear();
       return nullptr;
     }
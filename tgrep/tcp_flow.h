@@ -23,12 +23,14 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <folly/io/IOBufQueue.h>
 #include <folly/String.h>
 #include <thrift/lib/cpp/transport/THeader.h>
 
 #include "tgrep/packet.h"
+#include "tgrep/replicator_stats.h"
 #include "tgrep/tcp_identifier.h"
 #include "tgrep/thrift_utils.h"
 
@@ -36,40 +38,90 @@
 namespace tgrep {
 
 
+// What --stats needs to know about a message
+struct MessageInfo {
+  apache::thrift::MessageType mtype;
+  std::string fname;
+  int32_t seqid;
+  // Without headers
+  size_t size;
+  // Whether it's an exception, or a reply carrying a declared exception
+  bool exception;
+  struct timeval ts;
+  // The dbs of a Replicator call or reply, with --replicator_stats
+  std::vector<ReplicateDbInfo> replicate;
+};
+
 class TcpFlow {
 public:
   // implicit
   TcpFlow(const TcpIdentifier& tcp_identifier);
 
+  // Messages completed by packet are printed to os. With info set, they are
+  // described in info instead.
   bool push_back(std::unique_ptr<Packet> packet,
-                 apache::thrift::MessageType* mtype = nullptr,
-                 struct timeval* ts = nullptr);
+                 std::ostream& os,
+                 MessageInfo* info = nullptr);
 
   bool empty() {
-    return queue_.empty() && seq_to_packet_.empty();
+    return queue_.empty() && out_of_order_.empty();
+  }
+
+  // "src => dest"
+  const std::string& identifier() const {
+    return identifier_;
+  }
+
+  // Capture time of the latest packet of this flow
+  int64_t last_seen_us() const {
+    return last_seen_us_;
   }
 
 private:
   void clear(){
     needed_ = 0;
     auto tmp = queue_.move();
-    seq_to_packet_.clear();
-    next_seq_.reset(nullptr);
+    out_of_order_.clear();
+    has_next_seq_ = false;
   }
 
+  // Copy queued data that still points into capture ring blocks
+  void own_queued_data();
+
   std::unique_ptr<folly::IOBuf> extract_msg_thrift(apache::thrift::transport::THeader& header);
 
   std::unique_ptr<folly::IOBuf> extract_msg_finagle(apache::thrift::transport::THeader& header);
 
   template <typename Protocol_>
-  static apache::thrift::MessageType get_mtype(std::unique_ptr<folly::IOBuf> msg, Protocol_& iprot) {
+  static void get_message_info(std::unique_ptr<folly::IOBuf> msg,
+                               Protocol_& iprot,
+                               MessageInfo* info) {
     std::string fname;
-    apache::thrift::MessageType mtype;
-    int32_t protoSeqId = 0;
+    apache::thrift::protocol::TType ftype;
+    int16_t fid;
 
+    info->size = msg->computeChainDataLength();
     iprot.setInput(msg.get());
-    iprot.readMessageBegin(fname, mtype, protoSeqId);
-    return mtype;
+    iprot.readMessageBegin(info->fname, info->mtype, info->seqid);
+
+    // Field 0 of a result struct is the return value, and the others are
+    // declared exceptions
+    info->exception = info->mtype == apache::thrift::MessageType::T_EXCEPTION;
+    const bool is_call = info->mtype == apache::thrift::MessageType::T_CALL;
+    const bool decode_replicator =
+      FLAGS_replicator_stats && isReplicatorMethod(info->fname);
+    if (info->mtype == apache::thrift::MessageType::T_REPLY ||
+        (is_call && decode_replicator)) {
+      iprot.readFieldBegin(fname, ftype, fid);
+      if (!is_call) {
+        info->exception = ftype != TType::T_STOP && fid != 0;
+      }
+      // The request is argument 1, and the response the return value
+      if (decode_replicator && ftype == TType::T_STRUCT &&
+          fid == (is_call ? 1 : 0)) {
+        readReplicatorArgument(iprot, info->fname, is_call, &info->replicate);
+      }
+    }
   }
 
   template <typename Protocol_>
@@ -91,7 +143,7 @@ private:
         break;
       }
       os << fid << ": " << dataTypeName(ftype) << std::endl;
-      print(std::cout, iprot, ftype);
+      print(os, iprot, ftype);
     }
 
     iprot.readMessageEnd();
@@ -100,8 +152,11 @@ private:
   folly::IOBufQueue queue_;
   size_t needed_;
   std::string identifier_;
-  std::unique_ptr<tcp_seq> next_seq_;
-  std::map<tcp_seq, std::unique_ptr<Packet>> seq_to_packet_;
+  bool has_next_seq_;
+  tcp_seq next_seq_;
+  // Segments received ahead of next_seq_, sorted by seq
+  std::vector<std::unique_ptr<Packet>> out_of_order_;
+  int64_t last_seen_us_;
 };
 
 
@@ -18,6 +18,8 @@
 
 #include "tgrep/tcp_identifier.h"
 
+#include "folly/Hash.h"
+
 namespace tgrep {
 
 TcpIdentifier TcpIdentifier::getConnectionIdentifier() const {
@@ -25,6 +27,17 @@ TcpIdentifier TcpIdentifier::getConnectionIdentifier() const {
   return opposite < *this ? opposite : *this;
 }
 
+uint64_t TcpIdentifier::getHash() const {
+  const uint64_t ips = (static_cast<uint64_t>(ip_src.s_addr) << 32) |
+    ip_dest.s_addr;
+  const uint64_t ports = (static_cast<uint64_t>(port_src) << 16) | port_dest;
+  return folly::hash::hash_128_to_64(ips, ports);
+}
+
+uint64_t TcpIdentifier::getConnectionHash() const {
+  return getConnectionIdentifier().getHash();
+}
+
 bool TcpIdentifier::operator < (const TcpIdentifier& tcp) const {
   if (port_src < tcp.port_src) {
     return true;
@@ -53,4 +66,11 @@ bool TcpIdentifier::operator < (const TcpIdentifier& tcp) const {
   return false;
 }
 
+bool TcpIdentifier::operator == (const TcpIdentifier& tcp) const {
+  return port_src == tcp.port_src &&
+    port_dest == tcp.port_dest &&
+    ip_src.s_addr == tcp.ip_src.s_addr &&
+    ip_dest.s_addr == tcp.ip_dest.s_addr;
+}
+
 } // namespace tgrep
@@ -37,12 +37,25 @@ struct TcpIdentifier {
 
   TcpIdentifier getConnectionIdentifier() const;
 
+  uint64_t getHash() const;
+
+  // The same for both directions of a connection
+  uint64_t getConnectionHash() const;
+
   bool operator < (const TcpIdentifier& tcp) const;
 
+  bool operator == (const TcpIdentifier& tcp) const;
+
   const uint16_t port_src;
   const uint16_t port_dest;
   const struct in_addr ip_src;
   const struct in_addr ip_dest;
 };
 
+struct TcpIdentifierHash {
+  size_t operator()(const TcpIdentifier& tcp) const {
+    return tcp.getHash();
+  }
+};
+
 } // namespace tgrep
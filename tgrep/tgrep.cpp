@@ -16,33 +16,56 @@
 // @author bol (bol@pinterest.com)
 //
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <thread>
 
 #include <folly/io/IOBuf.h>
 #include <folly/Memory.h>
-#include <folly/MPMCQueue.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <pcap.h>
 #include <signal.h>
 
 
+#include "tgrep/af_packet_capture.h"
+#include "tgrep/flow_workers.h"
+#include "tgrep/frame.h"
 #include "tgrep/header.h"
-#include "tgrep/tcp_connection.h"
-#include "tgrep/tcp_flow.h"
-#include "tgrep/thrift_utils.h"
+#include "tgrep/offline_analyzer.h"
 
 DEFINE_string(dev, "eth0", "The device to sniff");
 DEFINE_string(file, "", "The file to load data");
 DEFINE_int32(snaplen, 512 * 1024, "snaplen for pcap");
 DEFINE_int32(pcap_buffer_size, 128 * 1024 * 1024, "Ring buffer size in bytes");
 DEFINE_bool(stats, false, "Show stats only");
+DEFINE_int32(worker_threads, 4,
+             "The number of threads processing packets, each owning the "
+             "connections hashed to it");
+DEFINE_int32(worker_queue_size, 5 * 1024,
+             "The size of the packet queue of each worker thread");
+DEFINE_bool(af_packet, false,
+            "Capture from a TPACKET_V3 AF_PACKET ring instead of libpcap. "
+            "Payloads are then not copied unless a flow has to buffer them. "
+            "Ignored with --file");
+DEFINE_int32(af_packet_block_size, 4 * 1024 * 1024,
+             "The size of each AF_PACKET ring block in bytes");
+DEFINE_int32(af_packet_block_count, 64,
+             "The number of blocks in the AF_PACKET ring");
+DEFINE_bool(offline, false,
+            "With --file, index the capture by connection, then decode "
+            "connections in parallel and write one line per call");
+DEFINE_int32(offline_threads, 0,
+             "The number of threads decoding connections with --offline. "
+             "0 to use all cores");
+DEFINE_string(offline_output, "",
+              "Where --offline writes calls, stdout if empty");
+DEFINE_string(method, "",
+              "With --offline, only write calls to this method");
 
 using namespace tgrep;
 
-folly::MPMCQueue<std::unique_ptr<Packet>> packet_queue(5 * 1024);
-
 auto deleter = [] (pcap_t * handle) {
   if (handle) {
     pcap_close(handle);
@@ -50,108 +73,115 @@ auto deleter = [] (pcap_t * handle) {
 };
 
 std::unique_ptr<pcap_t, decltype(deleter)> handle(nullptr, std::move(deleter));
+std::unique_ptr<AfPacketCapture> af_packet_capture;
 
 void sig_handler(int) {
   std::cout << "will exit..." << std::endl;
   if (handle.get()) {
     pcap_breakloop(handle.get());
   }
+  if (af_packet_capture) {
+    af_packet_capture->stop();
+  }
 }
 
-void process_packets() {
-  std::unique_ptr<Packet> packet;
-  std::map<TcpIdentifier, TcpFlow> flows;
-  std::map<TcpIdentifier, TcpConnection> connections;
-
-  SCOPE_EXIT {
-    for (const auto& it : connections) {
-      it.second.dump_stats();
-    }
-  };
+// If ring_block is set, frame points into it and the payload is not copied
+void handle_frame(FlowWorkers* workers,
+                  const struct timeval& ts,
+                  const u_char* frame,
+                  uint32_t len,
+                  const std::shared_ptr<void>& ring_block) {
+  TcpSegment segment;
+  if (!parse_tcp_segment(frame, len, &segment)) {
+    return;
+  }
 
-  while (true) {
-    packet_queue.blockingRead(packet);
-    if (!packet) {
-      std::cout << "Done, bye!" << std::endl;
-      break;
-    }
+  auto buf = ring_block ?
+    folly::IOBuf::wrapBuffer(segment.payload, segment.payload_size) :
+    folly::IOBuf::copyBuffer(segment.payload, segment.payload_size);
+  workers->dispatch(make_packet(ts, segment, std::move(buf), ring_block));
+}
 
-    if (FLAGS_stats) {
-      const auto& id = packet->tcp_identifier.getConnectionIdentifier();
-      auto res = connections.emplace(id, id);
-      auto& tcp_connection = res.first->second;
-
-      tcp_connection.push_back(std::move(packet));
-    } else {
-      auto res = flows.emplace(packet->tcp_identifier, packet->tcp_identifier);
-      auto& tcp_flow = res.first->second;
-      if (!tcp_flow.push_back(std::move(packet)) || tcp_flow.empty()) {
-        flows.erase(res.first);
-      }
-    }
-  }
+void packet_callback(u_char* user, const struct pcap_pkthdr* header, const u_char* packet) {
+  handle_frame(reinterpret_cast<FlowWorkers*>(user),
+               header->ts,
+               packet,
+               header->caplen,
+               nullptr);
 }
 
-void packet_callback(u_char*, const struct pcap_pkthdr* header, const u_char* packet) {
-  // TODO(bol): verify IP and TCP checksum for incoming packets
-  int size_ip;
-  int size_tcp;
-  const struct sniff_ip* ip;
-  const struct sniff_tcp* tcp;
-  const void* payload;
+int main(int argc, char* argv[]) {
+  ::google::ParseCommandLineFlags(&argc, &argv, true);
+  ::google::InitGoogleLogging(argv[0]);
 
-  if (header->len < SIZE_ETHERNET + 20) {
-    LOG(ERROR) << "less than ip header length";
-    return;
-  }
+  char errbuf[PCAP_ERRBUF_SIZE];
 
-  ip = (const struct sniff_ip*)(packet + SIZE_ETHERNET);
-  size_ip = IP_HL(ip)*4;
-  if (size_ip < 20) {
-    LOG(ERROR) << "Invalid IP header length: " << size_ip;
-    return;
+  if (FLAGS_stats) {
+    signal(SIGINT, &sig_handler);
   }
 
-  if (header->len < SIZE_ETHERNET + size_ip + 20) {
-    LOG(ERROR) << "less than tcp header length";
-    return;
+  if (FLAGS_worker_threads <= 0 || FLAGS_worker_queue_size <= 1) {
+    LOG(ERROR) << "Invalid --worker_threads or --worker_queue_size";
+    return -1;
   }
 
-  tcp = (const struct sniff_tcp*)(packet + SIZE_ETHERNET + size_ip);
-  size_tcp = TH_OFF(tcp) * 4;
-  if (size_tcp < 20) {
-    LOG(ERROR) << "Invalid TCP header length: " << size_tcp;
-    return;
-  }
-  uint32_t total_header_size = SIZE_ETHERNET + size_ip + size_tcp;
-  if (header->len < total_header_size) {
-    LOG(ERROR) << "Invalid packet lenth: " << header->len <<
-      " while total header length: " << total_header_size;
-    return;
-  } else if (header->len == total_header_size) {
-    return;
+  std::string filter_str = "tcp ";
+
+  for (int i = 1; i < argc; ++i) {
+    filter_str += argv[i];
+    filter_str.push_back(' ');
   }
 
-  payload = static_cast<const void*>(packet + total_header_size);
-  auto sz = ntohs(ip->ip_len) - (size_ip + size_tcp);
+  if (FLAGS_offline) {
+    if (FLAGS_file.empty()) {
+      LOG(ERROR) << "--offline requires --file";
+      return -1;
+    }
 
-  packet_queue.blockingWrite(folly::make_unique<Packet>(header->ts,
-                                                        folly::IOBuf::copyBuffer(payload, sz),
-                                                        ntohs(tcp->th_sport),
-                                                        ntohs(tcp->th_dport),
-                                                        ip->ip_src,
-                                                        ip->ip_dst,
-                                                        ntohl(tcp->th_seq)));
-}
+    auto analyzer = OfflineAnalyzer::open(FLAGS_file);
+    if (!analyzer || !analyzer->index(filter_str)) {
+      return -1;
+    }
 
-int main(int argc, char* argv[]) {
-  ::google::ParseCommandLineFlags(&argc, &argv, true);
-  ::google::InitGoogleLogging(argv[0]);
+    uint32_t n_threads = FLAGS_offline_threads > 0 ?
+      FLAGS_offline_threads :
+      std::max(std::thread::hardware_concurrency(), 1u);
 
-  char errbuf[PCAP_ERRBUF_SIZE];
+    if (FLAGS_offline_output.empty()) {
+      analyzer->analyze(n_threads, FLAGS_method, std::cout);
+      return 0;
+    }
 
-  if (FLAGS_stats) {
-    signal(SIGINT, &sig_handler);
+    std::ofstream output(FLAGS_offline_output);
+    if (!output) {
+      LOG(ERROR) << "Could not open " << FLAGS_offline_output;
+      return -1;
+    }
+    analyzer->analyze(n_threads, FLAGS_method, output);
+    return output ? 0 : -1;
+  }
+
+  if (FLAGS_af_packet && FLAGS_file.empty()) {
+    af_packet_capture = AfPacketCapture::create(FLAGS_dev,
+                                                FLAGS_af_packet_block_size,
+                                                FLAGS_af_packet_block_count,
+                                                filter_str);
+    if (!af_packet_capture) {
+      return -1;
+    }
+
+    FlowWorkers workers(FLAGS_worker_threads, FLAGS_worker_queue_size);
+    auto ok = af_packet_capture->loop(
+      [&workers] (const struct timeval& ts,
+                  const u_char* frame,
+                  uint32_t len,
+                  const std::shared_ptr<void>& block) {
+        handle_frame(&workers, ts, frame, len, block);
+      });
+
+    // Workers still hold ring blocks until they are done
+    workers.finish();
+    return ok ? 0 : -1;
   }
 
   if (FLAGS_file.empty()) {
@@ -178,13 +208,6 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  std::string filter_str = "tcp ";
-
-  for (int i = 1; i < argc; ++i) {
-    filter_str += argv[i];
-    filter_str.push_back(' ');
-  }
-
   struct bpf_program fp;
   if (pcap_compile(handle.get(), &fp, filter_str.c_str(), 1, PCAP_NETMASK_UNKNOWN)) {
     LOG(ERROR) << "Could not compile filter string: " << filter_str;
@@ -196,13 +219,15 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
-  std::thread t(process_packets);
+  FlowWorkers workers(FLAGS_worker_threads, FLAGS_worker_queue_size);
 
-  if (pcap_loop(handle.get(), 0, packet_callback, nullptr) == -1) {
+  int ret = 0;
+  if (pcap_loop(handle.get(), 0, packet_callback,
+                reinterpret_cast<u_char*>(&workers)) == -1) {
     LOG(ERROR) << "pcap_loop failed " << errno;
-    return -1;
+    ret = -1;
   }
 
-  packet_queue.blockingWrite(nullptr);
-  t.join();
+  workers.finish();
+  return ret;
 }